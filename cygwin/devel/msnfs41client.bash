@@ -253,6 +253,8 @@ function nfsclient_install
 		'sbin/nfs_globalmount'
 		'usr/share/msnfs41client/tests/misc/qsortonmmapedfile1'
 		'usr/share/msnfs41client/tests/misc/lockincfile1'
+		'usr/share/msnfs41client/tests/misc/nfsbench'
+		'usr/share/msnfs41client/tests/misc/upcallreplay'
 	)
 
 	if [[ "${kernel_platform}" != 'i686' ]] ; then
@@ -24,6 +24,7 @@
 #include "sid.h"
 #include "daemon_debug.h"
 #include "nfs41_daemon.h"
+#include "util.h"
 
 #ifndef _NFS41_DRIVER_BUILDFEATURES_
 #error NFS41 build config not included
@@ -42,6 +43,170 @@
  */
 #define GETTOKINFO_EXTRA_BUFFER (8192)
 
+#ifdef NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE
+/*
+ * Token id cache
+ *
+ * Caches the ids mapped from a token (uid/gid for the upcall and the
+ * AUTH_SYS supplementary gids), so the token user/groups and the
+ * idmapper only have to be queried once per logon session instead of
+ * for every upcall.
+ * The cache is direct-mapped by AuthenticationId; an entry is only
+ * used if the token's ModifiedId still matches and it is younger than
+ * |TOKENIDCACHE_TTL| seconds, so changes of the idmapper configuration
+ * are picked up eventually
+ */
+#define TOKENIDCACHE_SIZE 64 /* must be a power of two */
+#define TOKENIDCACHE_TTL 60
+
+typedef struct _tokenidcache_entry {
+    token_cache_key key;
+    util_reltimestamp timestamp;
+    bool ids_valid;
+    uid_t uid;
+    gid_t gid;
+    bool gids_valid;
+    bool gids_truncated;
+    int num_gids;
+    gid_t gids[RPC_AUTHUNIX_AUP_MAX_NUM_GIDS];
+} tokenidcache_entry;
+
+static struct {
+    SRWLOCK lock;
+    tokenidcache_entry entries[TOKENIDCACHE_SIZE];
+} tokenidcache = { .lock = SRWLOCK_INIT };
+
+bool get_token_cache_key(HANDLE tok, token_cache_key *key)
+{
+    TOKEN_STATISTICS tstats;
+    DWORD tokdatalen;
+
+    if (!GetTokenInformation(tok, TokenStatistics, &tstats,
+        sizeof(tstats), &tokdatalen)) {
+        DPRINTF(1, ("get_token_cache_key: "
+            "GetTokenInformation(tok=0x%p, TokenStatistics) failed, "
+            "status=%d\n",
+            (void *)tok, (int)GetLastError()));
+        return false;
+    }
+
+    key->authenticationid = tstats.AuthenticationId;
+    key->modifiedid = tstats.ModifiedId;
+    return true;
+}
+
+static __inline bool token_cache_key_equal(
+    const token_cache_key *k1, const token_cache_key *k2)
+{
+    return (k1->authenticationid.LowPart == k2->authenticationid.LowPart) &&
+        (k1->authenticationid.HighPart == k2->authenticationid.HighPart) &&
+        (k1->modifiedid.LowPart == k2->modifiedid.LowPart) &&
+        (k1->modifiedid.HighPart == k2->modifiedid.HighPart);
+}
+
+static __inline tokenidcache_entry *tokenidcache_slot(
+    const token_cache_key *key)
+{
+    return &tokenidcache.entries[
+        (key->authenticationid.LowPart ^
+            (DWORD)key->authenticationid.HighPart) &
+        (TOKENIDCACHE_SIZE - 1)];
+}
+
+/* returns the entry for |key| if it is valid, expects the lock held */
+static tokenidcache_entry *tokenidcache_find(
+    const token_cache_key *key)
+{
+    tokenidcache_entry *e = tokenidcache_slot(key);
+
+    if (token_cache_key_equal(&e->key, key) &&
+        ((UTIL_GETRELTIME() - e->timestamp) < TOKENIDCACHE_TTL))
+        return e;
+    return NULL;
+}
+
+/*
+ * returns the entry for |key|, replacing the old contents of the slot
+ * if it belongs to another token; expects the exclusive lock held
+ */
+static tokenidcache_entry *tokenidcache_claim(
+    const token_cache_key *key)
+{
+    tokenidcache_entry *e = tokenidcache_find(key);
+
+    if (e == NULL) {
+        e = tokenidcache_slot(key);
+        e->key = *key;
+        e->timestamp = UTIL_GETRELTIME();
+        e->ids_valid = false;
+        e->gids_valid = false;
+    }
+    return e;
+}
+
+bool tokenidcache_get_ids(const token_cache_key *key,
+    uid_t *puid, gid_t *pgid)
+{
+    tokenidcache_entry *e;
+    bool found = false;
+
+    AcquireSRWLockShared(&tokenidcache.lock);
+    e = tokenidcache_find(key);
+    if (e && e->ids_valid) {
+        *puid = e->uid;
+        *pgid = e->gid;
+        found = true;
+    }
+    ReleaseSRWLockShared(&tokenidcache.lock);
+    return found;
+}
+
+void tokenidcache_set_ids(const token_cache_key *key,
+    uid_t uid, gid_t gid)
+{
+    tokenidcache_entry *e;
+
+    AcquireSRWLockExclusive(&tokenidcache.lock);
+    e = tokenidcache_claim(key);
+    e->uid = uid;
+    e->gid = gid;
+    e->ids_valid = true;
+    ReleaseSRWLockExclusive(&tokenidcache.lock);
+}
+
+static bool tokenidcache_get_gids(const token_cache_key *key,
+    gid_t *aup_gids, int *num_aup_gids, bool *truncated)
+{
+    tokenidcache_entry *e;
+    bool found = false;
+
+    AcquireSRWLockShared(&tokenidcache.lock);
+    e = tokenidcache_find(key);
+    if (e && e->gids_valid) {
+        (void)memcpy(aup_gids, e->gids, e->num_gids * sizeof(gid_t));
+        *num_aup_gids = e->num_gids;
+        *truncated = e->gids_truncated;
+        found = true;
+    }
+    ReleaseSRWLockShared(&tokenidcache.lock);
+    return found;
+}
+
+static void tokenidcache_set_gids(const token_cache_key *key,
+    const gid_t *aup_gids, int num_aup_gids, bool truncated)
+{
+    tokenidcache_entry *e;
+
+    AcquireSRWLockExclusive(&tokenidcache.lock);
+    e = tokenidcache_claim(key);
+    (void)memcpy(e->gids, aup_gids, num_aup_gids * sizeof(gid_t));
+    e->num_gids = num_aup_gids;
+    e->gids_truncated = truncated;
+    e->gids_valid = true;
+    ReleaseSRWLockExclusive(&tokenidcache.lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE */
+
 bool get_token_user_name(HANDLE tok, char *out_buffer)
 {
     DWORD tokdatalen;
@@ -130,29 +295,46 @@ bool get_token_primarygroup_name(HANDLE tok, char *out_buffer)
     return true;
 }
 
+/*
+ * Fills |aup_gids| with up to |RPC_AUTHUNIX_AUP_MAX_NUM_GIDS| gids of
+ * the groups of |tok|; |*truncated| is set if the token has more
+ * groups which map to a gid
+ */
 bool fill_auth_unix_aup_gids(HANDLE tok,
-    gid_t *aup_gids, int *num_aup_gids)
+    gid_t *aup_gids, int *num_aup_gids, bool *truncated)
 {
-    char group_names_buff[RPC_AUTHUNIX_AUP_MAX_NUM_GIDS*(UTF8_GNLEN+1)];
-    char *group_names[RPC_AUTHUNIX_AUP_MAX_NUM_GIDS];
+    /* one extra group name to find out whether the list is truncated */
+    char group_names_buff[(RPC_AUTHUNIX_AUP_MAX_NUM_GIDS+1)*(UTF8_GNLEN+1)];
+    char *group_names[RPC_AUTHUNIX_AUP_MAX_NUM_GIDS+1];
     char *s;
     int i;
     int num_groups;
+#ifdef NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE
+    token_cache_key tokkey;
+    bool have_tokkey;
+#endif /* NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE */
 
     /* fixme: This should be a function argument */
     extern nfs41_daemon_globals nfs41_dg;
 
+#ifdef NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE
+    have_tokkey = get_token_cache_key(tok, &tokkey);
+    if (have_tokkey &&
+        tokenidcache_get_gids(&tokkey, aup_gids, num_aup_gids, truncated))
+        return true;
+#endif /* NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE */
+
     /*
      * VS2019 |_alloca()| cannot be used in a loop, so we use multiple
      * pointers into one buffer instead
      */
-    for (s=group_names_buff,i=0 ; i < RPC_AUTHUNIX_AUP_MAX_NUM_GIDS ; i++) {
+    for (s=group_names_buff,i=0 ; i < (RPC_AUTHUNIX_AUP_MAX_NUM_GIDS+1) ; i++) {
         group_names[i] = s;
         s += UTF8_GNLEN+1;
     }
 
     if (!get_token_groups_names(tok,
-        RPC_AUTHUNIX_AUP_MAX_NUM_GIDS, group_names, &num_groups)) {
+        RPC_AUTHUNIX_AUP_MAX_NUM_GIDS+1, group_names, &num_groups)) {
         eprintf("fill_auth_unix_aup_gids: "
             "get_token_groups_names() failed\n");
         *num_aup_gids = 0;
@@ -161,12 +343,17 @@ bool fill_auth_unix_aup_gids(HANDLE tok,
 
     gid_t map_gid;
     *num_aup_gids = 0;
+    *truncated = false;
 
     for (i=0 ; i < num_groups ; i++) {
         if (nfs41_idmap_group_to_gid(
             nfs41_dg.idmapper,
             group_names[i],
             &map_gid) == 0) {
+            if (*num_aup_gids == RPC_AUTHUNIX_AUP_MAX_NUM_GIDS) {
+                *truncated = true;
+                break;
+            }
             aup_gids[(*num_aup_gids)++] = map_gid;
         }
         else {
@@ -176,6 +363,12 @@ bool fill_auth_unix_aup_gids(HANDLE tok,
         }
     }
 
+#ifdef NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE
+    if (have_tokkey)
+        tokenidcache_set_gids(&tokkey, aup_gids, *num_aup_gids,
+            *truncated);
+#endif /* NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE */
+
     return true;
 }
 
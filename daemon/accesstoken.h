@@ -24,6 +24,7 @@
 
 #include <Windows.h>
 #include <stdbool.h>
+#include "nfs41_build_features.h"
 #include "nfs41_types.h" /* for |gid_t| */
 
 bool get_token_user_name(HANDLE tok, char *out_buffer);
@@ -31,9 +32,27 @@ bool get_token_primarygroup_name(HANDLE tok, char *out_buffer);
 bool get_token_authenticationid(HANDLE tok, LUID *out_authenticationid);
 bool set_token_privilege(HANDLE tok, const char *seprivname, bool enable_priv);
 bool fill_auth_unix_aup_gids(HANDLE tok,
-    gid_t *, int *num_aup_gids);
+    gid_t *, int *num_aup_gids, bool *truncated);
 bool get_token_groups_names(HANDLE tok,
     int num_out_buffers, char *out_buffers[],
     int *out_buffers_count);
 
+#ifdef NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE
+/*
+ * |token_cache_key| - identifies a token and its current state;
+ * |ModifiedId| changes whenever the token's groups or privileges
+ * are changed
+ */
+typedef struct _token_cache_key {
+    LUID authenticationid;
+    LUID modifiedid;
+} token_cache_key;
+
+bool get_token_cache_key(HANDLE tok, token_cache_key *key);
+bool tokenidcache_get_ids(const token_cache_key *key,
+    uid_t *puid, gid_t *pgid);
+void tokenidcache_set_ids(const token_cache_key *key,
+    uid_t uid, gid_t gid);
+#endif /* NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE */
+
 #endif /* !__NFS41_DAEMON_ACCESSTOKEN_H__ */
@@ -145,8 +145,7 @@ static int convert_nfs4acl_2_dacl(nfs41_daemon_globals *nfs41dg,
     bool named_attr_support)
 {
     int status = ERROR_NOT_SUPPORTED, size = 0;
-    uint32_t nfs_i = 0, win_i = 0;
-    DWORD sid_len;
+    uint32_t nfs_i = 0, win_i = 0, sid_i;
     PSID *sids;
     PACL dacl;
     LPSTR domain = NULL;
@@ -158,6 +157,12 @@ static int convert_nfs4acl_2_dacl(nfs41_daemon_globals *nfs41dg,
         (int)named_attr_support));
 
     bool *skip_aces = _alloca(acl->count * sizeof(bool));
+    DWORD *sid_lens = _alloca(acl->count * sizeof(DWORD));
+    /* ACEs which need an idmapper/LSA lookup, and their |win_i| */
+    nfs4servername_sid_req *reqs =
+        _alloca(acl->count * sizeof(nfs4servername_sid_req));
+    uint32_t *req_win_i = _alloca(acl->count * sizeof(uint32_t));
+    int num_reqs = 0, req_i;
 
     /*
      * We use |calloc()| here to get |NULL| pointer for unallocated
@@ -198,7 +203,7 @@ static int convert_nfs4acl_2_dacl(nfs41_daemon_globals *nfs41dg,
 #endif /* NFS41_DRIVER_ACLS_SETACL_SKIP_WINNULLSID_ACES */
 
         status = check_4_special_identifiers(curr_nfsace->who, &sids[win_i],
-                                             &sid_len, &flag);
+                                             &sid_lens[win_i], &flag);
         if (status) {
             free_sids(sids, win_i);
             goto out;
@@ -226,18 +231,29 @@ static int convert_nfs4acl_2_dacl(nfs41_daemon_globals *nfs41dg,
                     nfs_i, curr_nfsace->who));
             }
 
-            status = map_nfs4servername_2_sid(nfs41dg,
-                (isgroupacl?GROUP_SECURITY_INFORMATION:OWNER_SECURITY_INFORMATION),
-                &sid_len, &sids[win_i], curr_nfsace->who);
-            if (status) {
-                free_sids(sids, win_i);
-                goto out;
-            }
+            /* mapped below by |map_nfs4servernames_2_sids()| */
+            reqs[num_reqs].query =
+                isgroupacl?GROUP_SECURITY_INFORMATION:OWNER_SECURITY_INFORMATION;
+            reqs[num_reqs].nfsname = curr_nfsace->who;
+            req_win_i[num_reqs] = win_i;
+            num_reqs++;
         }
-        size += sid_len - sizeof(DWORD);
 
         win_i++;
     }
+
+    status = map_nfs4servernames_2_sids(nfs41dg, num_reqs, reqs);
+    for (req_i = 0; req_i < num_reqs; req_i++) {
+        sids[req_win_i[req_i]] = reqs[req_i].sid;
+        sid_lens[req_win_i[req_i]] = reqs[req_i].sid_len;
+    }
+    if (status) {
+        free_sids(sids, win_i);
+        goto out;
+    }
+
+    for (sid_i = 0; sid_i < win_i; sid_i++)
+        size += sid_lens[sid_i] - sizeof(DWORD);
     size += sizeof(ACL) + (sizeof(ACCESS_ALLOWED_ACE)*win_i);
     size = align8(size); // align size on |DWORD| boundry
     dacl = malloc(size);
@@ -334,6 +350,128 @@ out_free_sids:
     goto out;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_ACL_CACHE
+/*
+ * Security descriptor cache
+ *
+ * Building a security descriptor maps the owner, the group and the
+ * |who| of every ACE through the idmapper and SID lookups, and tools
+ * like "icacls /T" or Explorer's security tab query the same files
+ * again and again.
+ * The cache keeps the finished self-relative security descriptor per
+ * superblock, fileid and |SECURITY_INFORMATION|, shared by all handles
+ * and users of the file. An entry is used as long as the (cached)
+ * change attribute of the file is the same as when it was filled,
+ * and for at most |ACL_CACHE_TTL| seconds, so changes of the idmapping
+ * show up eventually. Changes of the owner, group or ACL also change
+ * the change attribute, |handle_setacl()| drops the entry directly.
+ */
+#define ACL_CACHE_SIZE 256 /* must be a power of 2 */
+#define ACL_CACHE_TTL 60
+
+typedef struct __acl_cache_entry {
+    const nfs41_superblock  *superblock;
+    uint64_t                fileid;
+    uint64_t                change;
+    SECURITY_INFORMATION    query;
+    util_reltimestamp       timestamp;
+    DWORD                   sec_desc_len;
+    PSECURITY_DESCRIPTOR    sec_desc; /* NULL if unused */
+} acl_cache_entry;
+
+static struct {
+    SRWLOCK                 lock;
+    acl_cache_entry         entries[ACL_CACHE_SIZE];
+} acl_cache = { .lock = SRWLOCK_INIT };
+
+static __inline acl_cache_entry *acl_cache_slot(
+    IN const nfs41_fh *fh)
+{
+    return &acl_cache.entries[
+        (uint32_t)(fh->fileid ^ (fh->fileid >> 32)) &
+        (ACL_CACHE_SIZE - 1)];
+}
+
+/* returns a copy of the cached security descriptor in |*sec_desc| */
+static bool acl_cache_lookup(
+    IN const nfs41_fh *fh,
+    IN uint64_t change,
+    IN SECURITY_INFORMATION query,
+    OUT PSECURITY_DESCRIPTOR *sec_desc,
+    OUT DWORD *sec_desc_len)
+{
+    acl_cache_entry *e;
+    bool hit = false;
+
+    AcquireSRWLockShared(&acl_cache.lock);
+    e = acl_cache_slot(fh);
+    if ((e->sec_desc != NULL) &&
+        (e->superblock == fh->superblock) &&
+        (e->fileid == fh->fileid) &&
+        (e->change == change) &&
+        (e->query == query) &&
+        ((UTIL_GETRELTIME() - e->timestamp) < ACL_CACHE_TTL)) {
+        *sec_desc = malloc(e->sec_desc_len);
+        if (*sec_desc) {
+            (void)memcpy(*sec_desc, e->sec_desc, e->sec_desc_len);
+            *sec_desc_len = e->sec_desc_len;
+            hit = true;
+        }
+    }
+    ReleaseSRWLockShared(&acl_cache.lock);
+    return hit;
+}
+
+static void acl_cache_store(
+    IN const nfs41_fh *fh,
+    IN uint64_t change,
+    IN SECURITY_INFORMATION query,
+    IN const PSECURITY_DESCRIPTOR sec_desc,
+    IN DWORD sec_desc_len)
+{
+    acl_cache_entry *e;
+    PSECURITY_DESCRIPTOR copy, old_sec_desc;
+
+    copy = malloc(sec_desc_len);
+    if (copy == NULL)
+        return;
+    (void)memcpy(copy, sec_desc, sec_desc_len);
+
+    AcquireSRWLockExclusive(&acl_cache.lock);
+    e = acl_cache_slot(fh);
+    old_sec_desc = e->sec_desc;
+    e->superblock = fh->superblock;
+    e->fileid = fh->fileid;
+    e->change = change;
+    e->query = query;
+    e->timestamp = UTIL_GETRELTIME();
+    e->sec_desc_len = sec_desc_len;
+    e->sec_desc = copy;
+    ReleaseSRWLockExclusive(&acl_cache.lock);
+
+    free(old_sec_desc);
+}
+
+static void acl_cache_invalidate(
+    IN const nfs41_fh *fh)
+{
+    acl_cache_entry *e;
+    PSECURITY_DESCRIPTOR old_sec_desc = NULL;
+
+    AcquireSRWLockExclusive(&acl_cache.lock);
+    e = acl_cache_slot(fh);
+    if ((e->superblock == fh->superblock) &&
+        (e->fileid == fh->fileid)) {
+        old_sec_desc = e->sec_desc;
+        e->sec_desc = NULL;
+        e->sec_desc_len = 0;
+    }
+    ReleaseSRWLockExclusive(&acl_cache.lock);
+
+    free(old_sec_desc);
+}
+#endif /* NFS41_DRIVER_DAEMON_ACL_CACHE */
+
 static int handle_getacl(void *daemon_context, nfs41_upcall *upcall)
 {
     int status = ERROR_NOT_SUPPORTED;
@@ -354,10 +492,32 @@ static int handle_getacl(void *daemon_context, nfs41_upcall *upcall)
         .arr[1] = FATTR4_WORD1_OWNER|FATTR4_WORD1_OWNER_GROUP
     };
     nfsacl41 acl = { 0 };
+#ifdef NFS41_DRIVER_DAEMON_ACL_CACHE
+    nfs41_file_info change_info;
+    bool have_change = false;
+#endif /* NFS41_DRIVER_DAEMON_ACL_CACHE */
 
     DPRINTF(ACLLVL1, ("--> handle_getacl(state->path.path='%s')\n",
         state->path.path));
 
+    args->sec_desc = NULL;
+#ifdef NFS41_DRIVER_DAEMON_ACL_CACHE
+    (void)memset(&change_info, 0, sizeof(nfs41_file_info));
+    if (state->file.fh.fileid &&
+        (nfs41_cached_getattr(state->session,
+            &state->file, NULL, &change_info) == 0) &&
+        bitmap_isset(&change_info.attrmask, 0, FATTR4_WORD0_CHANGE)) {
+        have_change = true;
+        if (acl_cache_lookup(&state->file.fh, change_info.change,
+            args->query, &args->sec_desc, &args->sec_desc_len)) {
+            DPRINTF(ACLLVL2, ("handle_getacl: using cached security "
+                "descriptor\n"));
+            status = ERROR_SUCCESS;
+            goto out_cached;
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_ACL_CACHE */
+
     if (args->query & DACL_SECURITY_INFORMATION) {
         owner_group_acl_bitmap.arr[0] |= FATTR4_WORD0_ACL;
     }
@@ -482,6 +642,12 @@ static int handle_getacl(void *daemon_context, nfs41_upcall *upcall)
         goto out;
     } else status = ERROR_SUCCESS;
 
+#ifdef NFS41_DRIVER_DAEMON_ACL_CACHE
+    if (have_change)
+        acl_cache_store(&state->file.fh, change_info.change,
+            args->query, args->sec_desc, args->sec_desc_len);
+#endif /* NFS41_DRIVER_DAEMON_ACL_CACHE */
+
 out:
     if (args->query & OWNER_SECURITY_INFORMATION) {
         if (osid) free(osid);
@@ -495,6 +661,9 @@ out:
         nfsacl41_free(info.acl);
     }
 
+#ifdef NFS41_DRIVER_DAEMON_ACL_CACHE
+out_cached:
+#endif /* NFS41_DRIVER_DAEMON_ACL_CACHE */
     DPRINTF(ACLLVL1, ("<-- handle_getacl(state->path.path='%s') "
         "returning %d\n",
         state->path.path, status));
@@ -519,10 +688,17 @@ out:
     return status;
 }
 
+static uint32_t downcall_size_getacl(
+    const nfs41_upcall *upcall)
+{
+    return sizeof(DWORD) + upcall->args.getacl.sec_desc_len;
+}
+
 const nfs41_upcall_op nfs41_op_getacl = {
     .parse = parse_getacl,
     .handle = handle_getacl,
     .marshall = marshall_getacl,
+    .downcall_size = downcall_size_getacl,
     .arg_size = sizeof(getacl_upcall_args)
 };
 
@@ -1541,6 +1717,10 @@ static int handle_setacl(void *daemon_context, nfs41_upcall *upcall)
         print_nfs41_file_info("handle_setacl: nfs41_setattr() info IN:", &info);
     }
     status = nfs41_setattr(state->session, &state->file, &stateid, &info);
+#ifdef NFS41_DRIVER_DAEMON_ACL_CACHE
+    /* even a failed SETATTR might have changed some of the attributes */
+    acl_cache_invalidate(&state->file.fh);
+#endif /* NFS41_DRIVER_DAEMON_ACL_CACHE */
     if (status) {
         DPRINTF(ACLLVL1, ("handle_setacl: nfs41_setattr() failed with error '%s'.\n",
                 nfs_error_string(status)));
@@ -0,0 +1,213 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+/*
+ * autotune.c - mount-time and periodic I/O parameter tuning
+ *
+ * With the "autotune" mount option the daemon measures the link to the
+ * server and chooses the READ/WRITE pipeline depth, the readahead
+ * window and the number of connections from it, instead of using the
+ * fixed defaults (which fit a LAN, but not a 60ms WAN link, or the
+ * other way around).
+ *
+ * - RTT: |nfs41_autotune_mount()| sends |AUTOTUNE_RTT_PROBES|
+ *   SEQUENCE-only compounds after the session has been created, later
+ *   the lease renewal SEQUENCEs keep the estimate current
+ * - Bandwidth: measured passively from the READ/WRITE compounds with
+ *   at least |AUTOTUNE_BW_MIN_BYTES| of payload, as payload divided by
+ *   the time the compound took beyond one RTT. Until there are such
+ *   compounds |AUTOTUNE_DEFAULT_BANDWIDTH| is assumed. There is no
+ *   active READ probe, the root of a mount is a directory and there is
+ *   no file we could read without side effects on the server
+ *
+ * Both are smoothed with an EWMA of 1/8. From the bandwidth-delay
+ * product (BDP) follow:
+ * - pipeline depth: enough READs/WRITEs of the negotiated size in
+ *   flight to cover the BDP, plus one
+ * - readahead window: two BDPs, at least one READ
+ * - connections: one per |AUTOTUNE_BDP_PER_CONN| of BDP (the TCP
+ *   window one connection typically reaches), never fewer than the
+ *   "nconnect" mount option. Connections are only added, and only for
+ *   AUTH_SYS/AUTH_NONE, see |nfs41_rpc_clnt_add_trunk_conns()|
+ *
+ * The READ/WRITE size stays the one negotiated with CREATE_SESSION
+ * from "rsize"/"wsize", it is only reported; larger requests are never
+ * worse for throughput here, and smaller ones only add overhead.
+ * The tuning runs again every |AUTOTUNE_INTERVAL_MS|, triggered by the
+ * next compound. The chosen values are part of the mount statistics
+ * ("nfsclientdctl mountstats").
+ */
+
+#include <Windows.h>
+
+#include "nfs41_build_features.h"
+#include "nfs41_ops.h"
+#include "autotune.h"
+#include "daemon_debug.h"
+
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+
+#define AUTOTUNE_RTT_PROBES         4
+#define AUTOTUNE_INTERVAL_MS        30000
+#define AUTOTUNE_BW_MIN_BYTES       (64*1024)
+#define AUTOTUNE_DEFAULT_BANDWIDTH  (125LL*1024*1024) /* 1Gbit/s */
+#define AUTOTUNE_BDP_PER_CONN       (16LL*1024*1024)
+#define AUTOTUNE_MAX_DEPTH          16
+#define AUTOTUNE_MAX_READAHEAD      (8*1024*1024)
+
+#define ATLVL 1 /* dprintf level for autotune logging */
+
+void nfs41_autotune_init(
+    OUT nfs41_autotune *at,
+    IN bool enabled)
+{
+    (void)memset(at, 0, sizeof(*at));
+    at->enabled = enabled;
+}
+
+/* EWMA with a weight of 1/8 for the new sample */
+static LONG64 autotune_ewma(
+    IN LONG64 old,
+    IN LONG64 sample)
+{
+    return (old == 0)?sample:(old + ((sample - old) / 8));
+}
+
+static void autotune_retune(
+    IN nfs41_root *root,
+    IN nfs41_client *client)
+{
+    nfs41_autotune *at = &root->autotune;
+    nfs41_session *session = client->session;
+    nfs41_rpc_clnt *rpc = client->rpc;
+    LONG64 rtt, bandwidth, bdp;
+    uint32_t io_size, depth, readahead, connections, current;
+
+    if (InterlockedCompareExchange(&at->tuning, 1, 0) != 0)
+        return;
+    (void)InterlockedExchange64(&at->last_tune, (LONG64)GetTickCount64());
+
+    rtt = max(at->rtt_usecs, 1);
+    bandwidth = InterlockedAdd64(&at->bandwidth, 0);
+    if (bandwidth == 0)
+        bandwidth = AUTOTUNE_DEFAULT_BANDWIDTH;
+    bdp = (bandwidth * rtt) / 1000000LL;
+
+    io_size = min(session->fore_chan_attrs.ca_maxresponsesize - READ_OVERHEAD,
+        session->fore_chan_attrs.ca_maxrequestsize - WRITE_OVERHEAD);
+    io_size = max(io_size, 1);
+
+    depth = (uint32_t)min((bdp / io_size) + 2, AUTOTUNE_MAX_DEPTH);
+    readahead = (uint32_t)min(max(2 * bdp, (LONG64)io_size),
+        AUTOTUNE_MAX_READAHEAD);
+    connections = (uint32_t)min((bdp / AUTOTUNE_BDP_PER_CONN) + 1,
+        NFS41_MAX_NCONNECT);
+    connections = max(connections, root->nconnect);
+
+    AcquireSRWLockShared(&rpc->lock);
+    current = rpc->trunk_count + 1;
+    ReleaseSRWLockShared(&rpc->lock);
+    if (connections > current) {
+        DPRINTF(ATLVL, ("autotune_retune: adding %u connection(s)\n",
+            connections - current));
+        (void)nfs41_rpc_clnt_add_trunk_conns(rpc, session->session_id,
+            connections - current);
+        AcquireSRWLockShared(&rpc->lock);
+        current = rpc->trunk_count + 1;
+        ReleaseSRWLockShared(&rpc->lock);
+    }
+
+    (void)InterlockedExchange(&at->io_size, (LONG)io_size);
+    (void)InterlockedExchange(&at->depth, (LONG)depth);
+    (void)InterlockedExchange(&at->readahead, (LONG)readahead);
+    (void)InterlockedExchange(&at->connections, (LONG)current);
+
+    DPRINTF(ATLVL, ("autotune_retune(root=0x%p): rtt=%lldus "
+        "bandwidth=%lldKB/s bdp=%lld io_size=%u depth=%u readahead=%u "
+        "connections=%u\n",
+        root, rtt, bandwidth / 1024, bdp, io_size, depth, readahead,
+        current));
+
+    (void)InterlockedExchange(&at->tuning, 0);
+}
+
+void nfs41_autotune_mount(
+    IN nfs41_root *root,
+    IN nfs41_client *client)
+{
+    int i, status;
+
+    for (i = 0; i < AUTOTUNE_RTT_PROBES; i++) {
+        /* |nfs41_autotune_rpc_done()| takes the sample */
+        status = nfs41_send_sequence(client->session);
+        if (status) {
+            eprintf("nfs41_autotune_mount: "
+                "nfs41_send_sequence() failed with '%s'\n",
+                nfs_error_string(status));
+            break;
+        }
+    }
+
+    autotune_retune(root, client);
+}
+
+void nfs41_autotune_rpc_done(
+    IN nfs41_session *session,
+    IN uint32_t argarray_count,
+    IN uint32_t op1,
+    IN int status,
+    IN uint32_t read_bytes,
+    IN uint32_t write_bytes,
+    IN LONGLONG start)
+{
+    nfs41_client *client = session->client;
+    nfs41_root *root = client->root;
+    nfs41_autotune *at;
+    const uint32_t bytes = read_bytes + write_bytes;
+    LONG64 usecs, rtt;
+
+    if ((root == NULL) || !root->autotune.enabled || status)
+        return;
+    at = &root->autotune;
+
+    if ((argarray_count == 1) && (op1 == OP_SEQUENCE)) {
+        usecs = (LONG64)nfsd_op_stats_usecs(start);
+        (void)InterlockedExchange(&at->rtt_usecs,
+            (LONG)min(autotune_ewma(at->rtt_usecs, usecs), LONG_MAX));
+    } else if (bytes >= AUTOTUNE_BW_MIN_BYTES) {
+        usecs = (LONG64)nfsd_op_stats_usecs(start);
+        rtt = at->rtt_usecs;
+        if (usecs > rtt) {
+            LONG64 old = InterlockedAdd64(&at->bandwidth, 0);
+            /* a lost race only loses one sample */
+            (void)InterlockedExchange64(&at->bandwidth, autotune_ewma(old,
+                ((LONG64)bytes * 1000000LL) / (usecs - rtt)));
+        }
+    }
+
+    /* only the metadata server's client can add connections */
+    if (!client->is_data && (at->last_tune != 0) &&
+        ((GetTickCount64() - (ULONGLONG)at->last_tune) >
+            AUTOTUNE_INTERVAL_MS))
+        autotune_retune(root, client);
+}
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
@@ -0,0 +1,91 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+#ifndef __NFS41_DAEMON_AUTOTUNE_H__
+#define __NFS41_DAEMON_AUTOTUNE_H__ 1
+
+#include <Windows.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "nfs41_build_features.h"
+
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+/*
+ * Per-mount link measurements and the I/O parameters chosen from them
+ * ("autotune" mount option), see autotune.c.
+ * The chosen values are zero until the first tuning, and stay zero
+ * without "autotune", so the callers use their fixed defaults then
+ */
+typedef struct __nfs41_autotune {
+    bool enabled;
+    /* smoothed RTT of SEQUENCE-only compounds, in microseconds */
+    volatile LONG rtt_usecs;
+    /* smoothed READ/WRITE throughput, in bytes per second */
+    volatile LONG64 bandwidth;
+    /* |GetTickCount64()| of the last tuning */
+    volatile LONG64 last_tune;
+    volatile LONG tuning; /* a thread is in |autotune_retune()| */
+    /* chosen values */
+    volatile LONG io_size; /* READ/WRITE size, in bytes */
+    volatile LONG depth; /* READ/WRITE pipeline depth */
+    volatile LONG connections;
+    volatile LONG readahead; /* readahead window, in bytes */
+} nfs41_autotune;
+
+typedef struct __nfs41_root nfs41_root;
+typedef struct __nfs41_client nfs41_client;
+typedef struct __nfs41_session nfs41_session;
+
+void nfs41_autotune_init(
+    OUT nfs41_autotune *at,
+    IN bool enabled);
+void nfs41_autotune_mount(
+    IN nfs41_root *root,
+    IN nfs41_client *client);
+void nfs41_autotune_rpc_done(
+    IN nfs41_session *session,
+    IN uint32_t argarray_count,
+    IN uint32_t op1,
+    IN int status,
+    IN uint32_t read_bytes,
+    IN uint32_t write_bytes,
+    IN LONGLONG start);
+
+/* |default_depth| without "autotune" or before the first tuning */
+static __inline uint32_t nfs41_autotune_depth(
+    IN const nfs41_autotune *at,
+    IN uint32_t default_depth)
+{
+    const LONG depth = at->depth;
+    return (depth > 0)?(uint32_t)depth:default_depth;
+}
+
+static __inline uint32_t nfs41_autotune_readahead(
+    IN const nfs41_autotune *at,
+    IN uint32_t default_window)
+{
+    const LONG window = at->readahead;
+    return (window > 0)?(uint32_t)window:default_window;
+}
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
+
+#endif /* !__NFS41_DAEMON_AUTOTUNE_H__ */
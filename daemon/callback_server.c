@@ -35,8 +35,21 @@ static const char g_server_tag[] = "ms-nfs41-callback";
 
 
 /* callback session */
+/* OP_CB_OFFLOAD */
+static enum_t handle_cb_offload(
+    IN nfs41_rpc_clnt *rpc_clnt,
+    IN struct cb_offload_args *args,
+    OUT struct cb_offload_res *res)
+{
+    /* hand the result to the waiting FSCTL upcall */
+    nfs42_copy_offload_done(rpc_clnt->client, &args->stateid,
+        args->status, args->count, args->committed, args->writeverf);
+    res->status = NFS4_OK;
+    return res->status;
+}
+
 static void replay_cache_write(
-    IN nfs41_cb_session *session,
+    IN nfs41_cb_slot *slot,
     IN struct cb_compound_args *args,
     IN struct cb_compound_res *res,
     IN bool_t cachethis);
@@ -44,15 +57,41 @@ static void replay_cache_write(
 void nfs41_callback_session_init(
     IN nfs41_session *session)
 {
-    /* initialize the replay cache with status NFS4ERR_SEQ_MISORDERED */
+    /* initialize the replay caches with status NFS4ERR_SEQ_MISORDERED */
     struct cb_compound_res res = { 0 };
+    uint32_t i;
+
     StringCchCopyA(res.tag.str, CB_COMPOUND_MAX_TAG, g_server_tag);
     res.tag.len = sizeof(g_server_tag);
     res.status = NFS4ERR_SEQ_MISORDERED;
 
+    InitializeSRWLock(&session->cb_session.lock);
     session->cb_session.cb_sessionid = session->session_id;
 
-    replay_cache_write(&session->cb_session, NULL, &res, FALSE);
+    for (i = 0; i < NFS41_MAX_CB_REQS; i++)
+        replay_cache_write(&session->cb_session.slots[i], NULL, &res, FALSE);
+}
+
+void nfs41_callback_session_reset(
+    IN nfs41_session *session)
+{
+    uint32_t i;
+
+    /* the new session starts over with seqid 1 on every slot */
+    AcquireSRWLockExclusive(&session->cb_session.lock);
+    for (i = 0; i < NFS41_MAX_CB_REQS; i++)
+        session->cb_session.slots[i].seqnum = 0;
+    ReleaseSRWLockExclusive(&session->cb_session.lock);
+}
+
+/* release a slot acquired by |handle_cb_sequence()| */
+static void cb_slot_release(
+    IN nfs41_cb_session *session,
+    IN nfs41_cb_slot *slot)
+{
+    AcquireSRWLockExclusive(&session->lock);
+    slot->busy = FALSE;
+    ReleaseSRWLockExclusive(&session->lock);
 }
 
 
@@ -103,13 +142,18 @@ static enum_t handle_cb_sequence(
     IN struct cb_sequence_args *args,
     OUT struct cb_sequence_res *res,
     OUT nfs41_cb_session **session_out,
+    OUT nfs41_cb_slot **slot_out,
     OUT bool_t *cachethis)
 {
-    nfs41_cb_session *cb_session = &rpc_clnt->client->session->cb_session;
+    nfs41_session *session = rpc_clnt->client->session;
+    nfs41_cb_session *cb_session = &session->cb_session;
+    nfs41_cb_slot *slot;
+    uint32_t max_slots;
     uint32_t status = NFS4_OK;
     res->status = NFS4_OK;
 
     *session_out = cb_session;
+    *slot_out = NULL;
 
     /* validate the sessionid */
     if (memcmp(cb_session->cb_sessionid, args->sessionid,
@@ -119,22 +163,38 @@ static enum_t handle_cb_sequence(
         goto out;
     }
 
-    /* we only support 1 slot for the back channel so slotid MUST be 0 */
-    if (args->slotid != 0) {
+    /* the server may use the slots it got in CREATE_SESSION */
+    max_slots = session->back_chan_attrs.ca_maxrequests;
+    if (max_slots > NFS41_MAX_CB_REQS)
+        max_slots = NFS41_MAX_CB_REQS;
+    if (max_slots == 0)
+        max_slots = 1;
+
+    if (args->slotid >= max_slots) {
         eprintf("[cb] received unexpected slotid=%d\n", args->slotid);
         res->status = NFS4ERR_BADSLOT;
         goto out;
     }
-    if (args->highest_slotid != 0) {
-        eprintf("[cb] received unexpected highest_slotid=%d\n", 
+    if (args->highest_slotid >= max_slots) {
+        eprintf("[cb] received unexpected highest_slotid=%d\n",
             args->highest_slotid);
         res->status = NFS4ERR_BAD_HIGH_SLOT;
         goto out;
     }
 
+    slot = &cb_session->slots[args->slotid];
+
+    AcquireSRWLockExclusive(&cb_session->lock);
+    if (slot->busy) {
+        /* a retry of a request which we are still working on */
+        ReleaseSRWLockExclusive(&cb_session->lock);
+        res->status = NFS4ERR_DELAY;
+        goto out;
+    }
+
     /* check for a retry with the same seqid */
-    if (args->sequenceid == cb_session->cb_seqnum) {
-        if (!cb_session->replay.res.length) {
+    if (args->sequenceid == slot->seqnum) {
+        if (!slot->replay.res.length) {
             /* return success for sequence, but fail the next operation */
             res->status = NFS4_OK;
             status = NFS4ERR_RETRY_UNCACHED_REP;
@@ -142,26 +202,35 @@ static enum_t handle_cb_sequence(
             /* return NFS4ERR_SEQ_FALSE_RETRY for all replays; if the retry
              * turns out to be valid, this response will be replaced anyway */
             status = res->status = NFS4ERR_SEQ_FALSE_RETRY;
+            /* keep the replay cache stable while we read it */
+            slot->busy = TRUE;
+            *slot_out = slot;
         }
+        ReleaseSRWLockExclusive(&cb_session->lock);
         goto out;
     }
 
     /* error on any unexpected seqids */
-    if (args->sequenceid != cb_session->cb_seqnum+1) {
-        eprintf("[cb] bad received seq#=%d, expected=%d\n", 
-            args->sequenceid, cb_session->cb_seqnum+1);
+    if (args->sequenceid != slot->seqnum+1) {
+        eprintf("[cb] bad received seq#=%d on slot %d, expected=%d\n",
+            args->sequenceid, args->slotid, slot->seqnum+1);
+        ReleaseSRWLockExclusive(&cb_session->lock);
         res->status = NFS4ERR_SEQ_MISORDERED;
         goto out;
     }
 
-    cb_session->cb_seqnum = args->sequenceid;
+    slot->seqnum = args->sequenceid;
+    slot->busy = TRUE;
+    ReleaseSRWLockExclusive(&cb_session->lock);
+
+    *slot_out = slot;
     *cachethis = args->cachethis;
 
     memcpy(res->ok.sessionid, args->sessionid, NFS4_SESSIONID_SIZE);
     res->ok.sequenceid = args->sequenceid;
     res->ok.slotid = args->slotid;
-    res->ok.highest_slotid = args->highest_slotid;
-    res->ok.target_highest_slotid = args->highest_slotid;
+    res->ok.highest_slotid = max_slots - 1;
+    res->ok.target_highest_slotid = max_slots - 1;
 
 out:
     DPRINTF(CBSLVL, ("  OP_CB_SEQUENCE { seqid %u, slot %u, cachethis %d } "
@@ -194,6 +263,32 @@ static enum_t handle_cb_recall(
     return res->status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+/* OP_CB_NOTIFY */
+static enum_t handle_cb_notify(
+    IN nfs41_rpc_clnt *rpc_clnt,
+    IN struct cb_notify_args *args,
+    OUT struct cb_notify_res *res)
+{
+    /* forget the changed entries of the delegated directory */
+    res->status = nfs41_dir_delegation_notify(rpc_clnt->client,
+        &args->stateid, args->entries, args->entry_count);
+    return res->status;
+}
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+
+/* OP_CB_NOTIFY_LOCK */
+static enum_t handle_cb_notify_lock(
+    IN nfs41_rpc_clnt *rpc_clnt,
+    IN struct cb_notify_lock_args *args,
+    OUT struct cb_notify_lock_res *res)
+{
+    /* wake up blocking lock requests waiting for this lock */
+    nfs41_lock_notify(rpc_clnt->client, &args->fh, &args->lock_owner);
+    res->status = NFS4_OK;
+    return res->status;
+}
+
 /* OP_CB_NOTIFY_DEVICEID */
 static enum_t handle_cb_notify_deviceid(
     IN nfs41_rpc_clnt *rpc_clnt,
@@ -210,7 +305,7 @@ static enum_t handle_cb_notify_deviceid(
 }
 
 static void replay_cache_write(
-    IN nfs41_cb_session *session,
+    IN nfs41_cb_slot *slot,
     IN OPTIONAL struct cb_compound_args *args,
     IN struct cb_compound_res *res,
     IN bool_t cachethis)
@@ -218,24 +313,24 @@ static void replay_cache_write(
     XDR xdr;
     uint32_t i;
 
-    session->replay.arg.length = 0;
-    session->replay.res.length = 0;
+    slot->replay.arg.length = 0;
+    slot->replay.res.length = 0;
 
     /* encode the reply directly into the replay cache */
-    xdrmem_create(&xdr, (char*)session->replay.res.buffer,
+    xdrmem_create(&xdr, (char*)slot->replay.res.buffer,
         NFS41_MAX_SERVER_CACHE, XDR_ENCODE);
 
     /* always try to cache the result */
     if (proc_cb_compound_res(&xdr, res)) {
-        session->replay.res.length = XDR_GETPOS(&xdr);
+        slot->replay.res.length = XDR_GETPOS(&xdr);
 
         if (args) {
             /* encode the arguments into the request cache */
-            xdrmem_create(&xdr, (char*)session->replay.arg.buffer,
+            xdrmem_create(&xdr, (char*)slot->replay.arg.buffer,
                 NFS41_MAX_SERVER_CACHE, XDR_ENCODE);
 
             if (proc_cb_compound_args(&xdr, args))
-                session->replay.arg.length = XDR_GETPOS(&xdr);
+                slot->replay.arg.length = XDR_GETPOS(&xdr);
         }
     } else if (cachethis) {
         /* on failure, only return errors if caching was requested */
@@ -294,7 +389,7 @@ static bool_t replay_validate_ops(
 }
 
 static int replay_cache_read(
-    IN nfs41_cb_session *session,
+    IN nfs41_cb_slot *slot,
     IN struct cb_compound_args *args,
     OUT struct cb_compound_res **res_out)
 {
@@ -311,7 +406,7 @@ static int replay_cache_read(
     }
 
     /* decode the response from the replay cache */
-    xdrmem_create(&xdr, (char*)session->replay.res.buffer,
+    xdrmem_create(&xdr, (char*)slot->replay.res.buffer,
         NFS41_MAX_SERVER_CACHE, XDR_DECODE);
     if (!proc_cb_compound_res(&xdr, replay)) {
         eprintf("[cb] failed to decode replay buffer\n");
@@ -320,8 +415,8 @@ static int replay_cache_read(
     }
 
     /* if we cached the arguments, use them to validate the retry */
-    if (session->replay.arg.length) {
-        if (!replay_validate_args(args, &session->replay.arg)) {
+    if (slot->replay.arg.length) {
+        if (!replay_validate_args(args, &slot->replay.arg)) {
             eprintf("[cb] retry attempt with different arguments\n");
             status = NFS4ERR_SEQ_FALSE_RETRY;
             goto out_free_replay;
@@ -359,6 +454,7 @@ static void handle_cb_compound(nfs41_rpc_clnt *rpc_clnt, cb_req *req, struct cb_
     struct cb_resop *resop;
     XDR *xdr = (XDR*)req->xdr;
     nfs41_cb_session *session = NULL;
+    nfs41_cb_slot *slot = NULL;
     bool_t cachethis = FALSE;
     uint32_t i, status = NFS4_OK;
 
@@ -434,12 +530,13 @@ static void handle_cb_compound(nfs41_rpc_clnt *rpc_clnt, cb_req *req, struct cb_
         case OP_CB_SEQUENCE:
             DPRINTF(1, ("OP_CB_SEQUENCE\n"));
             status = handle_cb_sequence(rpc_clnt, &argop->args.sequence,
-                &resop->res.sequence, &session, &cachethis);
+                &resop->res.sequence, &session, &slot, &cachethis);
 
             if (status == NFS4ERR_SEQ_FALSE_RETRY) {
                 /* replace the current results with the cached response */
-                status = replay_cache_read(session, &args, &res);
+                status = replay_cache_read(slot, &args, &res);
                 if (status) res->status = status;
+                cb_slot_release(session, slot);
                 goto out;
             }
 
@@ -458,7 +555,12 @@ static void handle_cb_compound(nfs41_rpc_clnt *rpc_clnt, cb_req *req, struct cb_
             break;
         case OP_CB_NOTIFY:
             DPRINTF(1, ("OP_CB_NOTIFY\n"));
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+            res->status = handle_cb_notify(rpc_clnt,
+                &argop->args.notify, &resop->res.notify);
+#else
             res->status = NFS4ERR_NOTSUPP;
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
             break;
         case OP_CB_PUSH_DELEG:
             DPRINTF(1, ("OP_CB_PUSH_DELEG\n"));
@@ -478,12 +580,18 @@ static void handle_cb_compound(nfs41_rpc_clnt *rpc_clnt, cb_req *req, struct cb_
             break;
         case OP_CB_NOTIFY_LOCK:
             DPRINTF(1, ("OP_CB_NOTIFY_LOCK\n"));
-            res->status = NFS4ERR_NOTSUPP;
+            res->status = handle_cb_notify_lock(rpc_clnt,
+                &argop->args.notify_lock, &resop->res.notify_lock);
             break;
         case OP_CB_NOTIFY_DEVICEID:
             DPRINTF(1, ("OP_CB_NOTIFY_DEVICEID\n"));
             res->status = NFS4_OK;
             break;
+        case OP_CB_OFFLOAD:
+            DPRINTF(1, ("OP_CB_OFFLOAD\n"));
+            res->status = handle_cb_offload(rpc_clnt,
+                &argop->args.offload, &resop->res.offload);
+            break;
         case OP_CB_ILLEGAL:
             DPRINTF(1, ("OP_CB_ILLEGAL\n"));
             res->status = NFS4ERR_NOTSUPP;
@@ -496,8 +604,10 @@ static void handle_cb_compound(nfs41_rpc_clnt *rpc_clnt, cb_req *req, struct cb_
     }
 
     /* always attempt to cache the reply */
-    if (session)
-        replay_cache_write(session, &args, res, cachethis);
+    if (slot) {
+        replay_cache_write(slot, &args, res, cachethis);
+        cb_slot_release(session, slot);
+    }
 out:
     /* free the arguments */
     xdr->x_op = XDR_FREE;
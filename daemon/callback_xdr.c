@@ -280,6 +280,21 @@ static bool_t info_to_fattr4(nfs41_file_info *info, fattr4 *fattr)
         if (!result) { CBX_ERR("getattr.info.size"); goto out; }
         bitmap_set(&fattr->attrmask, 0, FATTR4_WORD0_SIZE);
     }
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+    /* delegated timestamps (RFC 9754), see |nfs41_delegation_getattr()| */
+    if (bitmap_isset(&info->attrmask, 2, FATTR4_WORD2_TIME_DELEG_ACCESS)) {
+        result = xdr_int64_t(&fattr_xdr, &info->time_access.seconds) &&
+            xdr_uint32_t(&fattr_xdr, &info->time_access.nseconds);
+        if (!result) { CBX_ERR("getattr.info.time_deleg_access"); goto out; }
+        bitmap_set(&fattr->attrmask, 2, FATTR4_WORD2_TIME_DELEG_ACCESS);
+    }
+    if (bitmap_isset(&info->attrmask, 2, FATTR4_WORD2_TIME_DELEG_MODIFY)) {
+        result = xdr_int64_t(&fattr_xdr, &info->time_modify.seconds) &&
+            xdr_uint32_t(&fattr_xdr, &info->time_modify.nseconds);
+        if (!result) { CBX_ERR("getattr.info.time_deleg_modify"); goto out; }
+        bitmap_set(&fattr->attrmask, 2, FATTR4_WORD2_TIME_DELEG_MODIFY);
+    }
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
     fattr->attr_vals_len = xdr_getpos(&fattr_xdr);
 out:
     return result;
@@ -333,12 +348,198 @@ out:
 }
 
 /* OP_CB_NOTIFY */
-static bool_t op_cb_notify_args(XDR *xdr, struct cb_notify_args *res)
+
+/* at most three names per notification (|notify_rename4|) */
+#define NOTIFY_MAX_ENTRIES_PER_TYPE 3
+
+static bool_t notify_entry_name(XDR *xdr, struct notify_dir_entry *entry)
+{
+    uint32_t len;
+
+    if (!xdr_uint32_t(xdr, &len) || (len > NFS41_MAX_COMPONENT_LEN))
+        return FALSE;
+    if (!xdr_opaque(xdr, entry->name, len))
+        return FALSE;
+    entry->name[len] = '\0';
+    entry->len = (unsigned short)len;
+    return TRUE;
+}
+
+/* notify_entry4: the name and attributes of an entry */
+static bool_t notify_entry4(XDR *xdr, struct notify_dir_entry *entry)
+{
+    bitmap4 attrmask;
+    uint32_t attr_len;
+
+    if (!notify_entry_name(xdr, entry))
+        return FALSE;
+
+    /* we request no attributes with the notifications, skip them */
+    if (!xdr_bitmap4(xdr, &attrmask) || !xdr_uint32_t(xdr, &attr_len))
+        return FALSE;
+    return xdr_setpos(xdr, xdr_getpos(xdr) + ((attr_len + 3) & ~3U));
+}
+
+/* notify_remove4: notify_entry4 and its cookie */
+static bool_t notify_remove4(XDR *xdr, struct notify_dir_entry *entry)
+{
+    uint64_t cookie;
+
+    return notify_entry4(xdr, entry) && xdr_uint64_t(xdr, &cookie);
+}
+
+/* notify_add4, returns the new entry and the one it replaced (if any) */
+static bool_t notify_add4(
+    XDR *xdr,
+    struct notify_dir_entry *entries,
+    uint32_t *count)
+{
+    struct notify_dir_entry prev;
+    uint32_t present;
+    uint64_t cookie;
+    bool_t last;
+
+    /* nad_old_entry<1> */
+    if (!xdr_uint32_t(xdr, &present) || (present > 1))
+        return FALSE;
+    if (present) {
+        if (!notify_remove4(xdr, &entries[*count]))
+            return FALSE;
+        entries[(*count)++].type = NOTIFY4_REMOVE_ENTRY;
+    }
+    /* nad_new_entry */
+    if (!notify_entry4(xdr, &entries[*count]))
+        return FALSE;
+    entries[(*count)++].type = NOTIFY4_ADD_ENTRY;
+    /* nad_new_entry_cookie<1> */
+    if (!xdr_uint32_t(xdr, &present) || (present > 1))
+        return FALSE;
+    if (present && !xdr_uint64_t(xdr, &cookie))
+        return FALSE;
+    /* nad_prev_entry<1>, only a position hint for the readdir cookie */
+    if (!xdr_uint32_t(xdr, &present) || (present > 1))
+        return FALSE;
+    if (present && !notify_remove4(xdr, &prev))
+        return FALSE;
+    return xdr_bool(xdr, &last);
+}
+
+static bool_t cb_notify_decode_changes(struct cb_notify_args *args)
+{
+    struct notify4 *notify;
+    XDR notify_xdr;
+    unsigned char verf[NFS4_VERIFIER_SIZE * 2];
+    uint32_t i, w, b, type, max_entries = 0;
+    bool_t result = TRUE;
+
+    for (i = 0; i < args->notify_count; i++) {
+        notify = &args->notify_list[i];
+        for (w = 0; w < notify->mask.count; w++) {
+            for (b = 0; b < 32; b++) {
+                if (notify->mask.arr[w] & (1UL << b))
+                    max_entries += NOTIFY_MAX_ENTRIES_PER_TYPE;
+            }
+        }
+    }
+
+    args->entry_count = 0;
+    if (max_entries == 0)
+        goto out;
+    args->entries = calloc(max_entries, sizeof(struct notify_dir_entry));
+    if (args->entries == NULL)
+        return FALSE;
+
+    for (i = 0; i < args->notify_count; i++) {
+        notify = &args->notify_list[i];
+
+        /* the values for each bit of the mask, in the order of the bits */
+        xdrmem_create(&notify_xdr, notify->list, notify->len, XDR_DECODE);
+
+        for (w = 0; w < notify->mask.count; w++) {
+            for (b = 0; b < 32; b++) {
+                struct notify_dir_entry *entry;
+
+                if ((notify->mask.arr[w] & (1UL << b)) == 0)
+                    continue;
+                type = w * 32 + b;
+                entry = &args->entries[args->entry_count];
+
+                switch (type) {
+                case NOTIFY4_CHANGE_CHILD_ATTRS:
+                case NOTIFY4_CHANGE_DIR_ATTRS:
+                    /* notify_attr4 */
+                    result = notify_entry4(&notify_xdr, entry);
+                    if (!result) { CBX_ERR("notify.attr"); goto out; }
+                    if (type == NOTIFY4_CHANGE_DIR_ATTRS)
+                        entry->len = 0;
+                    entry->type = type;
+                    args->entry_count++;
+                    break;
+                case NOTIFY4_REMOVE_ENTRY:
+                    result = notify_remove4(&notify_xdr, entry);
+                    if (!result) { CBX_ERR("notify.remove"); goto out; }
+                    entry->type = type;
+                    args->entry_count++;
+                    break;
+                case NOTIFY4_ADD_ENTRY:
+                    result = notify_add4(&notify_xdr, args->entries,
+                        &args->entry_count);
+                    if (!result) { CBX_ERR("notify.add"); goto out; }
+                    break;
+                case NOTIFY4_RENAME_ENTRY:
+                    result = notify_remove4(&notify_xdr, entry);
+                    if (!result) { CBX_ERR("notify.rename.old"); goto out; }
+                    entry->type = NOTIFY4_REMOVE_ENTRY;
+                    args->entry_count++;
+                    result = notify_add4(&notify_xdr, args->entries,
+                        &args->entry_count);
+                    if (!result) { CBX_ERR("notify.rename.new"); goto out; }
+                    break;
+                case NOTIFY4_CHANGE_COOKIE_VERIFIER:
+                    result = xdr_opaque(&notify_xdr, (char *)verf,
+                        sizeof(verf));
+                    if (!result) { CBX_ERR("notify.verifier"); goto out; }
+                    entry->type = type;
+                    entry->len = 0;
+                    args->entry_count++;
+                    break;
+                default:
+                    /* cannot skip values of unknown types */
+                    CBX_ERR("notify.type");
+                    result = FALSE;
+                    goto out;
+                }
+            }
+        }
+    }
+out:
+    return result;
+}
+
+static bool_t op_cb_notify_args(XDR *xdr, struct cb_notify_args *args)
 {
     bool_t result;
 
-    result = xdr_uint32_t(xdr, &res->target_highest_slotid);
-    if (!result) { CBX_ERR("notify.target_highest_slotid"); goto out; }
+    result = common_stateid(xdr, &args->stateid);
+    if (!result) { CBX_ERR("notify.stateid"); goto out; }
+
+    result = common_fh(xdr, &args->fh);
+    if (!result) { CBX_ERR("notify.fh"); goto out; }
+
+    result = xdr_array(xdr, (char**)&args->notify_list,
+        &args->notify_count, CB_COMPOUND_MAX_OPERATIONS,
+        sizeof(struct notify4), (xdrproc_t)common_notify4);
+    if (!result) { CBX_ERR("notify.changes"); goto out; }
+
+    switch (xdr->x_op) {
+    case XDR_FREE:
+        free(args->entries);
+        args->entries = NULL;
+    case XDR_ENCODE:
+        return TRUE;
+    }
+
+    result = cb_notify_decode_changes(args);
 out:
     return result;
 }
@@ -438,12 +639,26 @@ out:
 }
 
 /* OP_CB_NOTIFY_LOCK */
-static bool_t op_cb_notify_lock_args(XDR *xdr, struct cb_notify_lock_args *res)
+static bool_t op_cb_notify_lock_args(XDR *xdr, struct cb_notify_lock_args *args)
 {
+    uint64_t clientid = 0;
+    unsigned char *owner = args->lock_owner.owner;
     bool_t result;
 
-    result = xdr_uint32_t(xdr, &res->target_highest_slotid);
-    if (!result) { CBX_ERR("notify_lock.target_highest_slotid"); goto out; }
+    /* nothing to free, the owner is stored inline */
+    if (xdr->x_op == XDR_FREE)
+        return TRUE;
+
+    result = common_fh(xdr, &args->fh);
+    if (!result) { CBX_ERR("notify_lock.fh"); goto out; }
+
+    /* the client id of the lock owner is the one of our session */
+    result = xdr_uint64_t(xdr, &clientid);
+    if (!result) { CBX_ERR("notify_lock.lock_owner.clientid"); goto out; }
+
+    result = xdr_bytes(xdr, (char**)&owner, &args->lock_owner.owner_len,
+        NFS4_OPAQUE_LIMIT);
+    if (!result) { CBX_ERR("notify_lock.lock_owner.owner"); goto out; }
 out:
     return result;
 }
@@ -557,6 +772,68 @@ out:
     return result;
 }
 
+/* OP_CB_OFFLOAD */
+static bool_t op_cb_offload_args(XDR *xdr, struct cb_offload_args *args)
+{
+    uint32_t callback_id_count = 0;
+    stateid4 callback_id;
+    bool_t result;
+
+    /* nothing to free, everything is stored inline */
+    if (xdr->x_op == XDR_FREE)
+        return TRUE;
+
+    result = common_fh(xdr, &args->fh);
+    if (!result) { CBX_ERR("offload.fh"); goto out; }
+
+    result = common_stateid(xdr, &args->stateid);
+    if (!result) { CBX_ERR("offload.stateid"); goto out; }
+
+    result = xdr_enum(xdr, &args->status);
+    if (!result) { CBX_ERR("offload.status"); goto out; }
+
+    if (args->status != NFS4_OK) {
+        /* length4 coa_bytes_copied */
+        result = xdr_uint64_t(xdr, &args->count);
+        if (!result) { CBX_ERR("offload.bytes_copied"); goto out; }
+        goto out;
+    }
+
+    /* write_response4 coa_resok4, the callback id is not used */
+    result = xdr_uint32_t(xdr, &callback_id_count);
+    if (!result) { CBX_ERR("offload.resok.callback_id_count"); goto out; }
+    if (callback_id_count > 1) {
+        result = FALSE;
+        CBX_ERR("offload.resok.callback_id_count");
+        goto out;
+    }
+    if (callback_id_count == 1) {
+        result = common_stateid(xdr, &callback_id);
+        if (!result) { CBX_ERR("offload.resok.callback_id"); goto out; }
+    }
+
+    result = xdr_uint64_t(xdr, &args->count);
+    if (!result) { CBX_ERR("offload.resok.count"); goto out; }
+
+    result = xdr_uint32_t(xdr, &args->committed);
+    if (!result) { CBX_ERR("offload.resok.committed"); goto out; }
+
+    result = xdr_opaque(xdr, (char*)args->writeverf, NFS4_VERIFIER_SIZE);
+    if (!result) { CBX_ERR("offload.resok.writeverf"); goto out; }
+out:
+    return result;
+}
+
+static bool_t op_cb_offload_res(XDR *xdr, struct cb_offload_res *res)
+{
+    bool_t result;
+
+    result = xdr_enum(xdr, &res->status);
+    if (!result) { CBX_ERR("offload.status"); goto out; }
+out:
+    return result;
+}
+
 /* CB_COMPOUND */
 static bool_t cb_compound_tag(XDR *xdr, struct cb_compound_tag *args)
 {
@@ -578,7 +855,7 @@ static const struct xdr_discrim cb_argop_discrim[] = {
     { OP_CB_WANTS_CANCELLED, (xdrproc_t)op_cb_wants_cancelled_args },
     { OP_CB_NOTIFY_LOCK,     (xdrproc_t)op_cb_notify_lock_args },
     { OP_CB_NOTIFY_DEVICEID, (xdrproc_t)op_cb_notify_deviceid_args },
-    { OP_CB_OFFLOAD,         NULL_xdrproc_t },
+    { OP_CB_OFFLOAD,         (xdrproc_t)op_cb_offload_args },
     { OP_CB_ILLEGAL,         NULL_xdrproc_t },
 };
 
@@ -628,7 +905,7 @@ static const struct xdr_discrim cb_resop_discrim[] = {
     { OP_CB_WANTS_CANCELLED, (xdrproc_t)op_cb_wants_cancelled_res },
     { OP_CB_NOTIFY_LOCK,     (xdrproc_t)op_cb_notify_lock_res },
     { OP_CB_NOTIFY_DEVICEID, (xdrproc_t)op_cb_notify_deviceid_res },
-    { OP_CB_OFFLOAD,         NULL_xdrproc_t },
+    { OP_CB_OFFLOAD,         (xdrproc_t)op_cb_offload_res },
     { OP_CB_ILLEGAL,         NULL_xdrproc_t },
 };
 
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <sddl.h>
 #include <direct.h> /* for |_getcwd()| */
+#include <process.h> /* for |_beginthreadex()| */
 
 #include "daemon_debug.h"
 #include "from_kernel.h"
@@ -40,9 +41,264 @@ int g_debug_level = DEFAULT_DEBUG_LEVEL;
 
 void set_debug_level(int level) { g_debug_level = level; }
 
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+/* {a0ada6a6-08da-41cf-8dde-5367c5b1eee3} */
+TRACELOGGING_DEFINE_PROVIDER(nfsd_trace_provider,
+    "NFS41-Client-Daemon",
+    (0xa0ada6a6, 0x08da, 0x41cf,
+        0x8d, 0xde, 0x53, 0x67, 0xc5, 0xb1, 0xee, 0xe3));
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
+
+void nfsd_trace_register(void)
+{
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+    HRESULT hr = TraceLoggingRegister(nfsd_trace_provider);
+    if (FAILED(hr))
+        eprintf("nfsd_trace_register: "
+            "TraceLoggingRegister() failed, hr=0x%lx\n", (long)hr);
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
+}
+
+void nfsd_trace_unregister(void)
+{
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+    TraceLoggingUnregister(nfsd_trace_provider);
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
+}
+
 static FILE *dlog_file;
 static FILE *elog_file;
 
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_LOGGING
+/*
+ * Asynchronous log backend
+ *
+ * Log lines are formatted into a per-thread buffer and handed to one
+ * writer thread through a bounded lock-free multi-producer queue
+ * (each slot has a sequence number which tells producers and the
+ * consumer whether it is free or filled), so logging threads never
+ * wait for stdio or for each other.
+ * If the queue is full the message is dropped and counted in
+ * |logq.dropped|; the writer thread reports new drops in the debug
+ * log.
+ * Lines longer than |LOGQ_MSG_MAX| are truncated. The |print_*()|
+ * helpers still write directly to |dlog_file|, so their output can
+ * be shifted against queued lines.
+ */
+#define LOGQ_SIZE 1024 /* must be a power of two */
+#define LOGQ_MSG_MAX 1024
+#define LOGQ_WRITER_IDLE_TIMEOUT 1000 /* ms */
+
+typedef struct _logq_slot {
+    volatile LONG seq;
+    FILE *file;
+    uint32_t len;
+    char text[LOGQ_MSG_MAX];
+} logq_slot;
+
+static struct {
+    logq_slot slots[LOGQ_SIZE];
+    volatile LONG head; /* next slot to fill */
+    LONG tail; /* next slot to write, only used by the writer thread */
+    volatile LONG64 dropped;
+    LONG64 dropped_reported;
+    volatile LONG writer_idle;
+    volatile LONG running;
+    HANDLE event;
+    HANDLE thread;
+} logq;
+
+__declspec(thread) static char logq_tlsbuf[LOGQ_MSG_MAX];
+
+static bool logq_enqueue(
+    IN FILE *file,
+    IN const char *text,
+    IN uint32_t len)
+{
+    logq_slot *slot;
+    LONG pos, seq, diff;
+
+    pos = logq.head;
+    for (;;) {
+        slot = &logq.slots[pos & (LOGQ_SIZE-1)];
+        seq = InterlockedCompareExchange(&slot->seq, 0, 0);
+        diff = (LONG)((ULONG)seq - (ULONG)pos);
+        if (diff == 0) {
+            /* slot is free, try to claim it */
+            if (InterlockedCompareExchange(&logq.head,
+                (LONG)((ULONG)pos + 1), pos) == pos)
+                break;
+            pos = logq.head;
+        }
+        else if (diff < 0) {
+            /* queue is full */
+            (void)InterlockedIncrement64(&logq.dropped);
+            return false;
+        }
+        else {
+            pos = logq.head;
+        }
+    }
+
+    slot->file = file;
+    slot->len = len;
+    (void)memcpy(slot->text, text, len);
+    /* publish the slot to the writer thread */
+    (void)InterlockedExchange(&slot->seq, (LONG)((ULONG)pos + 1));
+
+    if (InterlockedCompareExchange(&logq.writer_idle, 0, 1) == 1)
+        (void)SetEvent(logq.event);
+    return true;
+}
+
+/* Write all queued lines, returns the number of lines written */
+static unsigned int logq_drain(void)
+{
+    logq_slot *slot;
+    unsigned int count = 0;
+    LONG64 dropped;
+
+    for (;;) {
+        slot = &logq.slots[logq.tail & (LOGQ_SIZE-1)];
+        if (InterlockedCompareExchange(&slot->seq, 0, 0) !=
+            (LONG)((ULONG)logq.tail + 1))
+            break;
+
+        (void)fwrite(slot->text, 1, slot->len, slot->file);
+        /* return the slot to the producers */
+        (void)InterlockedExchange(&slot->seq,
+            (LONG)((ULONG)logq.tail + LOGQ_SIZE));
+        logq.tail = (LONG)((ULONG)logq.tail + 1);
+        count++;
+    }
+
+    dropped = InterlockedCompareExchange64(&logq.dropped, 0, 0);
+    if (dropped != logq.dropped_reported) {
+        (void)fprintf(dlog_file, "# LOG: %lld log messages dropped "
+            "(%lld total)\n",
+            (long long)(dropped - logq.dropped_reported),
+            (long long)dropped);
+        logq.dropped_reported = dropped;
+        count++;
+    }
+
+    if (count) {
+        (void)fflush(dlog_file);
+        (void)fflush(elog_file);
+    }
+    return count;
+}
+
+static unsigned int WINAPI logq_writer_thread(void *args)
+{
+    (void)args;
+
+    while (logq.running) {
+        if (logq_drain())
+            continue;
+
+        /* tell producers to wake us, then check again for a race */
+        (void)InterlockedExchange(&logq.writer_idle, 1);
+        if (logq_drain()) {
+            (void)InterlockedExchange(&logq.writer_idle, 0);
+            continue;
+        }
+        (void)WaitForSingleObject(logq.event, LOGQ_WRITER_IDLE_TIMEOUT);
+        (void)InterlockedExchange(&logq.writer_idle, 0);
+    }
+
+    (void)logq_drain();
+    return 0;
+}
+
+static void logq_stop(void)
+{
+    if (InterlockedExchange(&logq.running, 0) == 0)
+        return;
+
+    (void)SetEvent(logq.event);
+    (void)WaitForSingleObject(logq.thread, INFINITE);
+    (void)CloseHandle(logq.thread);
+    logq.thread = NULL;
+}
+
+static void logq_start(void)
+{
+    LONG i;
+
+    for (i = 0 ; i < LOGQ_SIZE ; i++)
+        logq.slots[i].seq = i;
+    logq.head = logq.tail = 0;
+
+    logq.event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (logq.event == NULL) {
+        (void)fprintf(stderr, "logq_start: CreateEventA() failed, "
+            "lasterr=%d, logging synchronously\n", (int)GetLastError());
+        return;
+    }
+
+    logq.running = 1;
+    logq.thread = (HANDLE)_beginthreadex(NULL, 0,
+        logq_writer_thread, NULL, 0, NULL);
+    if (logq.thread == NULL) {
+        logq.running = 0;
+        (void)fprintf(stderr, "logq_start: _beginthreadex() failed, "
+            "lasterr=%d, logging synchronously\n", (int)GetLastError());
+        return;
+    }
+    /* write the remaining lines if the daemon calls |exit()| */
+    (void)atexit(logq_stop);
+}
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_LOGGING */
+
+/*
+ * Write one formatted log line to |file|: The |prefix|, which can be
+ * |NULL|, followed by |format|
+ */
+static void log_vwrite(
+    IN FILE *file,
+    IN OPTIONAL const char *prefix,
+    IN const char *restrict format,
+    IN va_list args)
+{
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_LOGGING
+    char *buf = logq_tlsbuf;
+    size_t len = 0;
+    int n;
+
+    if (!logq.running) {
+        if (prefix)
+            (void)fputs(prefix, file);
+        (void)vfprintf(file, format, args);
+        (void)fflush(file);
+        return;
+    }
+
+    if (prefix) {
+        len = strlen(prefix);
+        if (len > (LOGQ_MSG_MAX-1))
+            len = LOGQ_MSG_MAX-1;
+        (void)memcpy(buf, prefix, len);
+    }
+    n = vsnprintf(buf + len, LOGQ_MSG_MAX - len, format, args);
+    if (n < 0)
+        n = 0;
+    if ((len + n) > (LOGQ_MSG_MAX-1)) {
+        /* truncated, keep the line terminated */
+        len = LOGQ_MSG_MAX-1;
+        buf[len-1] = '\n';
+    }
+    else
+        len += n;
+    (void)logq_enqueue(file, buf, (uint32_t)len);
+#else
+    if (prefix)
+        (void)fputs(prefix, file);
+    (void)vfprintf(file, format, args);
+    (void)fflush(file);
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_LOGGING */
+}
+
 #ifndef STANDALONE_NFSD
 void open_log_files()
 {
@@ -81,10 +337,16 @@ void open_log_files()
         free(cwd);
         exit(1);
     }
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_LOGGING
+    logq_start();
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_LOGGING */
 }
 
 void close_log_files()
 {
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_LOGGING
+    logq_stop();
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_LOGGING */
     if (dlog_file) fclose(dlog_file);
     if (elog_file) fclose(elog_file);
 }
@@ -93,6 +355,9 @@ void open_log_files()
 {
     dlog_file = stdout;
     elog_file = stderr;
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_LOGGING
+    logq_start();
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_LOGGING */
 }
 #endif
 
@@ -109,6 +374,7 @@ void dprintf_out(const char *restrict format, ...)
 #ifdef DPRINTF_PRINT_IMPERSONATION_USER
     char username[UTF8_UNLEN+1];
     char groupname[UTF8_GNLEN+1];
+    char prefix[UTF8_UNLEN+UTF8_GNLEN+64];
     HANDLE tok;
     const char *tok_src;
     bool free_tok = false;
@@ -148,7 +414,7 @@ void dprintf_out(const char *restrict format, ...)
         in_dprintf_out = false;
     }
 
-    (void)fprintf(dlog_file, "%04x/%s='%s'/'%s' ",
+    (void)snprintf(prefix, sizeof(prefix), "%04x/%s='%s'/'%s' ",
         (int)GetCurrentThreadId(),
         tok_src, username, groupname);
 
@@ -156,10 +422,12 @@ void dprintf_out(const char *restrict format, ...)
         (void)CloseHandle(tok);
     }
 #else
-    (void)fprintf(dlog_file, "%04x: ", (int)GetCurrentThreadId());
+    char prefix[16];
+
+    (void)snprintf(prefix, sizeof(prefix), "%04x: ",
+        (int)GetCurrentThreadId());
 #endif /* DPRINTF_PRINT_IMPERSONATION_USER */
-    (void)vfprintf(dlog_file, format, args);
-    (void)fflush(dlog_file);
+    log_vwrite(dlog_file, prefix, format, args);
     va_end(args);
 }
 
@@ -173,6 +441,7 @@ void logprintf(const char *restrict format, ...)
     SYSTEMTIME stime;
     char username[UTF8_UNLEN+1];
     char groupname[UTF8_GNLEN+1];
+    char prefix[UTF8_UNLEN+UTF8_GNLEN+128];
     HANDLE tok;
     const char *tok_src;
     bool free_tok = false;
@@ -204,7 +473,7 @@ void logprintf(const char *restrict format, ...)
 
     va_list args;
     va_start(args, format);
-    (void)fprintf(dlog_file,
+    (void)snprintf(prefix, sizeof(prefix),
         "# LOG: ts=%04d-%02d-%02d_%02d:%02d:%02d:%04d"
         " thr=%04x %s='%s'/'%s' msg=",
         (int)stime.wYear, (int)stime.wMonth, (int)stime.wDay,
@@ -213,8 +482,7 @@ void logprintf(const char *restrict format, ...)
         (int)GetCurrentThreadId(),
         tok_src,
         username, groupname);
-    (void)vfprintf(dlog_file, format, args);
-    (void)fflush(dlog_file);
+    log_vwrite(dlog_file, prefix, format, args);
     va_end(args);
 
     if (free_tok) {
@@ -230,8 +498,7 @@ void eprintf_out(const char *restrict format, ...)
 {
     va_list args;
     va_start(args, format);
-    (void)vfprintf(elog_file, format, args);
-    (void)fflush(elog_file);
+    log_vwrite(elog_file, NULL, format, args);
     va_end(args);
 }
 
@@ -242,10 +509,12 @@ void eprintf(const char *restrict format, ...)
 #endif /* _MSC_VER */
 {
     va_list args;
+    char prefix[16];
+
     va_start(args, format);
-    (void)fprintf(elog_file, "%04x: ", (int)GetCurrentThreadId());
-    (void)vfprintf(elog_file, format, args);
-    (void)fflush(elog_file);
+    (void)snprintf(prefix, sizeof(prefix), "%04x: ",
+        (int)GetCurrentThreadId());
+    log_vwrite(elog_file, prefix, format, args);
     va_end(args);
 }
 
@@ -473,6 +742,7 @@ const char* opcode2string(nfs41_opcodes opcode)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_DIR_QUERY)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_FILE_QUERY)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_FILE_QUERY_TIME_BASED_COHERENCY)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_FILE_SET)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_EA_SET)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_EA_GET)
@@ -487,6 +757,14 @@ const char* opcode2string(nfs41_opcodes opcode)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_SET_DAEMON_DEBUGLEVEL)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_SHUTDOWN)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_GET_DAEMON_STATS)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_GET_FLIGHT_RECORDER)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_GET_MOUNT_STATS)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_DIR_NOTIFY)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_QUERY_OPEN)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_FSCTL_CACHE_CONTROL)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_GET_TOP_STATS)
+        NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_FLUSH)
         NFSOPCODE_TO_STRLITERAL(NFS41_SYSOP_INVALID_OPCODE1)
         default: break;
     }
@@ -1537,3 +1815,625 @@ const nfs41_upcall_op nfs41_op_setdaemondebuglevel = {
     .marshall = NULL,
     .arg_size = 0
 };
+
+/*
+ * Per-operation latency statistics, returned by
+ * |NFS41_SYSOP_GET_DAEMON_STATS|
+ *
+ * Each thread picks one of |NFSD_OP_STATS_SLOTS| slots on first use,
+ * so worker threads do not share the cache lines they update.
+ * Updates are still interlocked, because short-lived threads (e.g.
+ * for delegation recalls) share slots with the worker threads.
+ */
+#define NFSD_OP_STATS_SLOTS 32
+
+static NFS41_DAEMON_OP_STATS *volatile nfsd_op_stats[NFSD_OP_STATS_SLOTS];
+static volatile LONG nfsd_op_stats_next_slot = 0;
+__declspec(thread) static NFS41_DAEMON_OP_STATS *nfsd_thread_op_stats = NULL;
+
+static NFS41_DAEMON_OP_STATS *nfsd_op_stats_get(void)
+{
+    NFS41_DAEMON_OP_STATS *stats, *new_stats;
+    ULONG slot;
+
+    if (nfsd_thread_op_stats)
+        return nfsd_thread_op_stats;
+
+    slot = (ULONG)InterlockedIncrement(&nfsd_op_stats_next_slot) %
+        NFSD_OP_STATS_SLOTS;
+    stats = nfsd_op_stats[slot];
+    if (stats == NULL) {
+        new_stats = calloc(1, sizeof(NFS41_DAEMON_OP_STATS));
+        if (new_stats == NULL)
+            return NULL;
+        stats = InterlockedCompareExchangePointer(
+            (PVOID volatile *)&nfsd_op_stats[slot], new_stats, NULL);
+        if (stats)
+            free(new_stats); /* another thread was faster */
+        else
+            stats = new_stats;
+    }
+    nfsd_thread_op_stats = stats;
+    return stats;
+}
+
+LONGLONG nfsd_op_stats_start(void)
+{
+    LARGE_INTEGER now;
+
+    (void)QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+/* Microseconds since |start| (from |nfsd_op_stats_start()|) */
+ULONGLONG nfsd_op_stats_usecs(
+    LONGLONG start)
+{
+    static LONGLONG ticks_per_sec = 0;
+    LARGE_INTEGER now, freq;
+
+    if (ticks_per_sec == 0) {
+        (void)QueryPerformanceFrequency(&freq);
+        ticks_per_sec = (freq.QuadPart > 0)?freq.QuadPart:1;
+    }
+
+    (void)QueryPerformanceCounter(&now);
+    return (now.QuadPart > start)?
+        (((ULONGLONG)(now.QuadPart - start) * 1000000ULL) /
+            (ULONGLONG)ticks_per_sec):0ULL;
+}
+
+static void nfsd_latency_histogram_add(
+    NFS41_LATENCY_HISTOGRAM *hist,
+    LONGLONG start)
+{
+    ULONGLONG usecs = nfsd_op_stats_usecs(start);
+    uint32_t bucket = 0;
+
+    /* bucket |i| counts [2^(i-1), 2^i) microseconds */
+    for (ULONGLONG u = usecs ;
+        u && (bucket < (NFS41_OP_STATS_NUM_BUCKETS-1)) ; u >>= 1)
+        bucket++;
+
+    (void)InterlockedAdd64((volatile LONG64 *)&hist->total_usecs,
+        (LONG64)usecs);
+    (void)InterlockedIncrement((volatile LONG *)&hist->buckets[bucket]);
+}
+
+void nfsd_op_stats_upcall_done(
+    uint32_t opcode,
+    LONGLONG start)
+{
+    NFS41_DAEMON_OP_STATS *stats;
+
+    if (opcode >= NFS41_SYSOP_INVALID_OPCODE1)
+        return;
+    stats = nfsd_op_stats_get();
+    if (stats)
+        nfsd_latency_histogram_add(&stats->upcall[opcode], start);
+}
+
+void nfsd_op_stats_rpc_done(
+    uint32_t nfs_op,
+    LONGLONG start)
+{
+    NFS41_DAEMON_OP_STATS *stats;
+
+    if (nfs_op >= NFS41_OP_STATS_NUM_NFS_OPS)
+        return;
+    stats = nfsd_op_stats_get();
+    if (stats)
+        nfsd_latency_histogram_add(&stats->rpc[nfs_op], start);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+/*
+ * CPU cycle accounting
+ *
+ * |upcall_parse()| sets the opcode of the upcall the thread works on,
+ * |upcall_cleanup()| resets it to 0, so that the XDR and RPC phases of
+ * |nfs41_send_compound()| are counted for the right upcall
+ */
+__declspec(thread) static uint32_t nfsd_thread_cpu_opcode = 0;
+/* XDR cycles of this thread so far, see |nfsd_cpu_stats_rpc_done()| */
+__declspec(thread) static ULONG64 nfsd_thread_xdr_cycles = 0;
+
+ULONG64 nfsd_cpu_cycles(void)
+{
+    ULONG64 cycles = 0;
+
+    (void)QueryThreadCycleTime(GetCurrentThread(), &cycles);
+    return cycles;
+}
+
+void nfsd_cpu_stats_set_opcode(
+    uint32_t opcode)
+{
+    nfsd_thread_cpu_opcode =
+        (opcode < NFS41_SYSOP_INVALID_OPCODE1)?opcode:0;
+}
+
+static void nfsd_cpu_stats_count(
+    uint32_t phase,
+    ULONG64 cycles)
+{
+    NFS41_DAEMON_OP_STATS *stats = nfsd_op_stats_get();
+
+    if (stats)
+        (void)InterlockedAdd64((volatile LONG64 *)
+            &stats->cpu_cycles[nfsd_thread_cpu_opcode][phase],
+            (LONG64)cycles);
+}
+
+/*
+ * Count the cycles since |start| (from |nfsd_cpu_cycles()|) for
+ * |phase| of the current upcall
+ */
+void nfsd_cpu_stats_add(
+    uint32_t phase,
+    ULONG64 start)
+{
+    const ULONG64 now = nfsd_cpu_cycles();
+    const ULONG64 cycles = (now > start)?(now - start):0;
+
+    if ((phase == NFS41_CPU_PHASE_XDR_ENCODE) ||
+        (phase == NFS41_CPU_PHASE_XDR_DECODE))
+        nfsd_thread_xdr_cycles += cycles;
+    nfsd_cpu_stats_count(phase, cycles);
+}
+
+ULONG64 nfsd_cpu_stats_xdr_cycles(void)
+{
+    return nfsd_thread_xdr_cycles;
+}
+
+/*
+ * Count the cycles of one RPC since |start|, minus the XDR cycles
+ * counted since |xdr_start| (from |nfsd_cpu_stats_xdr_cycles()|)
+ */
+void nfsd_cpu_stats_rpc_done(
+    ULONG64 start,
+    ULONG64 xdr_start)
+{
+    const ULONG64 now = nfsd_cpu_cycles();
+    const ULONG64 xdr = nfsd_thread_xdr_cycles - xdr_start;
+    ULONG64 cycles = (now > start)?(now - start):0;
+
+    cycles = (cycles > xdr)?(cycles - xdr):0;
+    nfsd_cpu_stats_count(NFS41_CPU_PHASE_RPC, cycles);
+}
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
+
+static void nfsd_latency_histogram_sum(
+    NFS41_LATENCY_HISTOGRAM *sum,
+    const NFS41_LATENCY_HISTOGRAM *hist)
+{
+    uint32_t i;
+
+    sum->total_usecs += hist->total_usecs;
+    for (i = 0 ; i < NFS41_OP_STATS_NUM_BUCKETS ; i++)
+        sum->buckets[i] += hist->buckets[i];
+}
+
+/*
+ * Handle |NFS41_SYSOP_GET_DAEMON_STATS|
+ */
+static
+int handle_getdaemonstats(void *daemon_context,
+    nfs41_upcall *upcall)
+{
+    return ERROR_SUCCESS;
+}
+
+static int marshall_getdaemonstats(
+    unsigned char *restrict buffer,
+    uint32_t *restrict length,
+    nfs41_upcall *restrict upcall)
+{
+    NFS41_DAEMON_OP_STATS sum;
+    const NFS41_DAEMON_OP_STATS *stats;
+    uint32_t slot, i, phase;
+
+    (void)memset(&sum, 0, sizeof(sum));
+
+    for (slot = 0 ; slot < NFSD_OP_STATS_SLOTS ; slot++) {
+        stats = nfsd_op_stats[slot];
+        if (stats == NULL)
+            continue;
+        for (i = 0 ; i < NFS41_SYSOP_INVALID_OPCODE1 ; i++)
+            nfsd_latency_histogram_sum(&sum.upcall[i], &stats->upcall[i]);
+        for (i = 0 ; i < NFS41_OP_STATS_NUM_NFS_OPS ; i++)
+            nfsd_latency_histogram_sum(&sum.rpc[i], &stats->rpc[i]);
+        for (i = 0 ; i < NFS41_SYSOP_INVALID_OPCODE1 ; i++) {
+            for (phase = 0 ; phase < NFS41_OP_STATS_NUM_CPU_PHASES ;
+                phase++)
+                sum.cpu_cycles[i][phase] += stats->cpu_cycles[i][phase];
+        }
+    }
+
+    return safe_write(&buffer, length, &sum, sizeof(sum));
+}
+
+const nfs41_upcall_op nfs41_op_getdaemonstats = {
+    .parse = NULL,
+    .handle = handle_getdaemonstats,
+    .marshall = marshall_getdaemonstats,
+    .arg_size = 0
+};
+
+/*
+ * RPC flight recorder
+ *
+ * |compound_encode_send_decode()| adds one record per compound sent to
+ * a ring buffer of the last |NFS41_FLIGHT_RECORDER_NUM_RECORDS|
+ * compounds, without taking a lock: a writer claims a slot by
+ * incrementing |nfsd_flight_recorder_seq|, clears the slot's |seq|,
+ * fills the slot and then sets |seq| again. Readers skip slots whose
+ * |seq| is not the expected one or changed while they copied the slot.
+ *
+ * The records are returned by |NFS41_SYSOP_GET_FLIGHT_RECORDER|, and
+ * written to the log if a compound took longer than
+ * |NFSD_FLIGHT_RECORDER_DUMP_USECS| (at most once per
+ * |NFSD_FLIGHT_RECORDER_DUMP_INTERVAL_MS|)
+ */
+#define NFSD_FLIGHT_RECORDER_DUMP_USECS (2ULL*1000000ULL)
+#define NFSD_FLIGHT_RECORDER_DUMP_INTERVAL_MS (60LL*1000LL)
+
+static NFS41_FLIGHT_RECORD
+    nfsd_flight_recorder[NFS41_FLIGHT_RECORDER_NUM_RECORDS];
+static volatile LONG64 nfsd_flight_recorder_seq = 0;
+
+/* Copy the valid records, oldest first, into |records| */
+static ULONG nfsd_flight_recorder_snapshot(
+    OUT NFS41_FLIGHT_RECORD *restrict records)
+{
+    NFS41_FLIGHT_RECORD *slot;
+    LONG64 seq, end;
+    ULONG count = 0;
+
+    end = InterlockedAdd64(&nfsd_flight_recorder_seq, 0);
+    seq = (end > NFS41_FLIGHT_RECORDER_NUM_RECORDS)?
+        (end - NFS41_FLIGHT_RECORDER_NUM_RECORDS + 1):1;
+    for ( ; seq <= end ; seq++) {
+        slot = &nfsd_flight_recorder[
+            (ULONG64)(seq - 1) % NFS41_FLIGHT_RECORDER_NUM_RECORDS];
+        if (InterlockedAdd64((volatile LONG64 *)&slot->seq, 0) != seq)
+            continue;
+        (void)memcpy(&records[count], slot, sizeof(NFS41_FLIGHT_RECORD));
+        if (InterlockedAdd64((volatile LONG64 *)&slot->seq, 0) != seq)
+            continue;
+        count++;
+    }
+    return count;
+}
+
+static void nfsd_flight_recorder_print(
+    IN const NFS41_FLIGHT_RECORD *restrict rec)
+{
+    char ops[NFS41_FLIGHT_RECORDER_MAX_OPS*24] = "";
+    FILETIME ft;
+    SYSTEMTIME st;
+    size_t len = 0;
+    uint32_t i;
+
+    for (i = 0 ; i < min(rec->num_ops, NFS41_FLIGHT_RECORDER_MAX_OPS) ; i++) {
+        (void)_snprintf_s(ops + len, sizeof(ops) - len, _TRUNCATE,
+            "%s%s", (i > 0)?",":"", nfs_opnum_to_string(rec->ops[i]));
+        len = strlen(ops);
+    }
+    if (rec->num_ops > NFS41_FLIGHT_RECORDER_MAX_OPS)
+        (void)strcat_s(ops, sizeof(ops), ",...");
+
+    ft.dwLowDateTime = (DWORD)rec->send_time;
+    ft.dwHighDateTime = (DWORD)(rec->send_time >> 32);
+    (void)FileTimeToSystemTime(&ft, &st);
+
+    eprintf("flightrecorder: seq=%llu "
+        "send_time=%02d:%02d:%02d.%03dZ latency_usecs=%lu xid=0x%08lx "
+        "slotid=%ld sequenceid=%lu retry=%u ops=%u/%u '%s' "
+        "io_bytes=%lu rpc_status=%ld nfs_status='%s'\n",
+        rec->seq,
+        (int)st.wHour, (int)st.wMinute, (int)st.wSecond,
+        (int)st.wMilliseconds,
+        (unsigned long)rec->latency_usecs,
+        (unsigned long)rec->xid,
+        (long)rec->slotid,
+        (unsigned long)rec->sequenceid,
+        (unsigned int)rec->retry,
+        (unsigned int)rec->num_results,
+        (unsigned int)rec->num_ops,
+        ops,
+        (unsigned long)rec->io_bytes,
+        (long)rec->rpc_status,
+        nfs_error_string(rec->nfs_status));
+}
+
+static void nfsd_flight_recorder_dump(
+    IN const NFS41_FLIGHT_RECORD *restrict trigger)
+{
+    static volatile LONG64 last_dump = 0;
+    NFS41_FLIGHT_RECORD *records;
+    LONG64 now, last;
+    ULONG i, count;
+
+    now = (LONG64)GetTickCount64();
+    last = last_dump;
+    if ((last != 0) &&
+        ((now - last) < NFSD_FLIGHT_RECORDER_DUMP_INTERVAL_MS))
+        return;
+    if (InterlockedCompareExchange64(&last_dump, now, last) != last)
+        return;
+
+    records = malloc(sizeof(NFS41_FLIGHT_RECORD) *
+        NFS41_FLIGHT_RECORDER_NUM_RECORDS);
+    if (records == NULL)
+        return;
+
+    eprintf("flightrecorder: compound seq=%llu took %lu usecs, "
+        "dumping the last compounds:\n",
+        trigger->seq, (unsigned long)trigger->latency_usecs);
+    count = nfsd_flight_recorder_snapshot(records);
+    for (i = 0 ; i < count ; i++)
+        nfsd_flight_recorder_print(&records[i]);
+    eprintf("flightrecorder: end of dump\n");
+
+    free(records);
+}
+
+void nfsd_flight_recorder_add(
+    IN OUT NFS41_FLIGHT_RECORD *restrict rec,
+    IN LONGLONG start)
+{
+    NFS41_FLIGHT_RECORD *slot;
+    ULONGLONG usecs;
+    LONG64 seq;
+
+    usecs = nfsd_op_stats_usecs(start);
+    rec->latency_usecs = (ULONG)min(usecs, ULONG_MAX);
+
+    seq = InterlockedIncrement64(&nfsd_flight_recorder_seq);
+    slot = &nfsd_flight_recorder[
+        (ULONG64)(seq - 1) % NFS41_FLIGHT_RECORDER_NUM_RECORDS];
+    (void)InterlockedExchange64((volatile LONG64 *)&slot->seq, 0);
+    rec->seq = 0;
+    (void)memcpy(slot, rec, sizeof(NFS41_FLIGHT_RECORD));
+    rec->seq = (ULONGLONG)seq;
+    (void)InterlockedExchange64((volatile LONG64 *)&slot->seq, seq);
+
+    if (usecs >= NFSD_FLIGHT_RECORDER_DUMP_USECS)
+        nfsd_flight_recorder_dump(rec);
+}
+
+/*
+ * Handle |NFS41_SYSOP_GET_FLIGHT_RECORDER|
+ */
+static
+int handle_getflightrecorder(void *daemon_context,
+    nfs41_upcall *upcall)
+{
+    return ERROR_SUCCESS;
+}
+
+static int marshall_getflightrecorder(
+    unsigned char *restrict buffer,
+    uint32_t *restrict length,
+    nfs41_upcall *restrict upcall)
+{
+    NFS41_FLIGHT_RECORD *records;
+    ULONG count;
+    int status;
+
+    records = malloc(sizeof(NFS41_FLIGHT_RECORD) *
+        NFS41_FLIGHT_RECORDER_NUM_RECORDS);
+    if (records == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    count = nfsd_flight_recorder_snapshot(records);
+    status = safe_write(&buffer, length, &count, sizeof(count));
+    if (status) goto out;
+    status = safe_write(&buffer, length, records,
+        count * sizeof(NFS41_FLIGHT_RECORD));
+out:
+    free(records);
+    return status;
+}
+
+const nfs41_upcall_op nfs41_op_getflightrecorder = {
+    .parse = NULL,
+    .handle = handle_getflightrecorder,
+    .marshall = marshall_getflightrecorder,
+    .arg_size = 0
+};
+
+/*
+ * Per-mount statistics
+ *
+ * |handle_mount()| adds each new |nfs41_root| to |nfsd_mount_stats_list|,
+ * |nfs41_root_free()| removes it again. The counters in
+ * |nfs41_root.stats| are updated with interlocked operations without
+ * taking |nfsd_mount_stats_lock|, the lock only protects the list.
+ * They are returned by |NFS41_SYSOP_GET_MOUNT_STATS|.
+ */
+static struct list_entry nfsd_mount_stats_list =
+    { &nfsd_mount_stats_list, &nfsd_mount_stats_list };
+static SRWLOCK nfsd_mount_stats_lock = SRWLOCK_INIT;
+
+void nfsd_mount_stats_add(
+    IN OUT nfs41_root *root,
+    IN const char *hostport,
+    IN const char *path)
+{
+    (void)_snprintf_s(root->stats.name, sizeof(root->stats.name),
+        _TRUNCATE, "%s:%s", hostport, path);
+
+    AcquireSRWLockExclusive(&nfsd_mount_stats_lock);
+    if (list_empty(&root->stats.entry))
+        list_add_tail(&nfsd_mount_stats_list, &root->stats.entry);
+    ReleaseSRWLockExclusive(&nfsd_mount_stats_lock);
+}
+
+void nfsd_mount_stats_remove(
+    IN OUT nfs41_root *root)
+{
+    AcquireSRWLockExclusive(&nfsd_mount_stats_lock);
+    list_remove(&root->stats.entry);
+    ReleaseSRWLockExclusive(&nfsd_mount_stats_lock);
+}
+
+/*
+ * Return up to |max_roots| mounted roots with a reference held, which
+ * the caller must release with |nfs41_root_deref()|. Roots which are
+ * already being freed are skipped; |nfsd_mount_stats_remove()| waits
+ * for |nfsd_mount_stats_lock|, so they cannot go away while we hold it
+ */
+uint32_t nfsd_mount_stats_ref_roots(
+    OUT nfs41_root **roots,
+    IN uint32_t max_roots)
+{
+    struct list_entry *entry;
+    nfs41_root *root;
+    uint32_t count = 0;
+    LONG refs;
+
+    AcquireSRWLockShared(&nfsd_mount_stats_lock);
+    list_for_each(entry, &nfsd_mount_stats_list) {
+        if (count >= max_roots)
+            break;
+        root = list_container(entry, nfs41_root, stats.entry);
+        refs = root->ref_count;
+        while (refs > 0) {
+            const LONG prev = InterlockedCompareExchange(&root->ref_count,
+                refs + 1, refs);
+            if (prev == refs) {
+                roots[count++] = root;
+                break;
+            }
+            refs = prev;
+        }
+    }
+    ReleaseSRWLockShared(&nfsd_mount_stats_lock);
+    return count;
+}
+
+void nfsd_mount_stats_rpc_done(
+    IN OUT nfs41_root_stats *stats,
+    IN uint32_t read_bytes,
+    IN uint32_t write_bytes,
+    IN LONGLONG start)
+{
+    (void)InterlockedIncrement64(&stats->compounds);
+    if (read_bytes)
+        (void)InterlockedAdd64(&stats->read_bytes, read_bytes);
+    if (write_bytes)
+        (void)InterlockedAdd64(&stats->write_bytes, write_bytes);
+    nfsd_latency_histogram_add(&stats->rpc, start);
+}
+
+/*
+ * Count a wait for a session slot which started at |start|, returns
+ * the time waited in microseconds
+ */
+ULONGLONG nfsd_mount_stats_slot_wait_done(
+    IN OUT nfs41_root_stats *stats,
+    IN LONGLONG start)
+{
+    ULONGLONG usecs = nfsd_op_stats_usecs(start);
+    LONG64 max, prev;
+
+    (void)InterlockedIncrement64(&stats->slot_waits);
+    (void)InterlockedAdd64(&stats->slot_wait_usecs, (LONG64)usecs);
+    if (usecs >= NFS41_SLOT_STARVATION_USECS)
+        (void)InterlockedIncrement64(&stats->slot_starvations);
+
+    max = InterlockedAdd64(&stats->slot_wait_max_usecs, 0);
+    while ((LONG64)usecs > max) {
+        prev = InterlockedCompareExchange64(&stats->slot_wait_max_usecs,
+            (LONG64)usecs, max);
+        if (prev == max)
+            break;
+        max = prev;
+    }
+    return usecs;
+}
+
+/*
+ * Handle |NFS41_SYSOP_GET_MOUNT_STATS|
+ */
+static
+int handle_getmountstats(void *daemon_context,
+    nfs41_upcall *upcall)
+{
+    return ERROR_SUCCESS;
+}
+
+static int marshall_getmountstats(
+    unsigned char *restrict buffer,
+    uint32_t *restrict length,
+    nfs41_upcall *restrict upcall)
+{
+    NFS41_ROOT_STATS *roots, *rs;
+    struct list_entry *entry;
+    nfs41_root *root;
+    ULONG count = 0;
+    int status;
+
+    roots = calloc(NFS41_MOUNT_STATS_MAX_MOUNTS, sizeof(NFS41_ROOT_STATS));
+    if (roots == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    AcquireSRWLockShared(&nfsd_mount_stats_lock);
+    list_for_each(entry, &nfsd_mount_stats_list) {
+        if (count >= NFS41_MOUNT_STATS_MAX_MOUNTS)
+            break;
+        root = list_container(entry, nfs41_root, stats.entry);
+        rs = &roots[count++];
+
+        (void)memcpy(rs->name, root->stats.name, sizeof(rs->name));
+        rs->root = (ULONGLONG)(ULONG_PTR)root;
+        rs->sec_flavor = root->sec_flavor;
+        rs->uid = root->uid;
+        rs->gid = root->gid;
+        rs->max_slots = (ULONG)root->stats.max_slots;
+        rs->highest_slot = (ULONG)root->stats.highest_slot;
+        rs->compounds = InterlockedAdd64(&root->stats.compounds, 0);
+        rs->read_bytes = InterlockedAdd64(&root->stats.read_bytes, 0);
+        rs->write_bytes = InterlockedAdd64(&root->stats.write_bytes, 0);
+        rs->retransmits = InterlockedAdd64(&root->stats.retransmits, 0);
+        rs->delays = InterlockedAdd64(&root->stats.delays, 0);
+        rs->slot_waits = InterlockedAdd64(&root->stats.slot_waits, 0);
+        rs->slot_wait_usecs =
+            InterlockedAdd64(&root->stats.slot_wait_usecs, 0);
+        rs->slot_wait_max_usecs =
+            InterlockedAdd64(&root->stats.slot_wait_max_usecs, 0);
+        rs->slot_starvations =
+            InterlockedAdd64(&root->stats.slot_starvations, 0);
+        rs->slot_resizes = InterlockedAdd64(&root->stats.slot_resizes, 0);
+        rs->slot_recalls = InterlockedAdd64(&root->stats.slot_recalls, 0);
+        nfsd_latency_histogram_sum(&rs->rpc, &root->stats.rpc);
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+        rs->autotune_rtt_usecs = (ULONG)root->autotune.rtt_usecs;
+        rs->autotune_bandwidth = (ULONG)min(
+            InterlockedAdd64(&root->autotune.bandwidth, 0) / 1024, ULONG_MAX);
+        rs->autotune_io_size = (ULONG)root->autotune.io_size;
+        rs->autotune_depth = (ULONG)root->autotune.depth;
+        rs->autotune_connections = (ULONG)root->autotune.connections;
+        rs->autotune_readahead = (ULONG)root->autotune.readahead;
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
+    }
+    ReleaseSRWLockShared(&nfsd_mount_stats_lock);
+
+    status = safe_write(&buffer, length, &count, sizeof(count));
+    if (status) goto out;
+    status = safe_write(&buffer, length, roots,
+        count * sizeof(NFS41_ROOT_STATS));
+out:
+    free(roots);
+    return status;
+}
+
+const nfs41_upcall_op nfs41_op_getmountstats = {
+    .parse = NULL,
+    .handle = handle_getmountstats,
+    .marshall = marshall_getmountstats,
+    .arg_size = 0
+};
@@ -35,6 +35,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "nfs41_build_features.h"
+
 #define DEFAULT_DEBUG_LEVEL 1
 
 
@@ -119,6 +121,33 @@
 
 extern int g_debug_level;
 
+/*
+ * ETW TraceLogging events, see |NFS41_DRIVER_ETW_TRACELOGGING|
+ *
+ * Usage: NFSD_TRACE_EVENT("RpcSend", NFSD_TRACE_KEYWORD_RPC,
+ *     TraceLoggingUInt32(slotid, "SlotId"));
+ */
+#define NFSD_TRACE_KEYWORD_RPC          0x1ULL
+#define NFSD_TRACE_KEYWORD_CACHE        0x2ULL
+#define NFSD_TRACE_KEYWORD_DELEGATION   0x4ULL
+#define NFSD_TRACE_KEYWORD_SESSION      0x8ULL
+
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(nfsd_trace_provider);
+
+#define NFSD_TRACE_EVENT(name, keyword, ...) \
+    TraceLoggingWrite(nfsd_trace_provider, name, \
+        TraceLoggingKeyword(keyword), __VA_ARGS__)
+#else
+#define NFSD_TRACE_EVENT(name, keyword, ...) ((void)0)
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
+
+void nfsd_trace_register(void);
+void nfsd_trace_unregister(void);
+
 #define DPRINTF_LEVEL_ENABLED(level) ((level) <= g_debug_level)
 #define DPRINTF(level, args) \
     { \
@@ -177,6 +206,30 @@ void print_nfs41_file_info(const char *label, const void *vinfo);
 typedef struct __nfs41_open_state nfs41_open_state;
 void debug_list_sparsefile_holes(nfs41_open_state *state);
 void debug_list_sparsefile_datasections(nfs41_open_state *state);
+LONGLONG nfsd_op_stats_start(void);
+ULONGLONG nfsd_op_stats_usecs(LONGLONG start);
+void nfsd_op_stats_upcall_done(uint32_t opcode, LONGLONG start);
+void nfsd_op_stats_rpc_done(uint32_t nfs_op, LONGLONG start);
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+ULONG64 nfsd_cpu_cycles(void);
+void nfsd_cpu_stats_set_opcode(uint32_t opcode);
+void nfsd_cpu_stats_add(uint32_t phase, ULONG64 start);
+ULONG64 nfsd_cpu_stats_xdr_cycles(void);
+void nfsd_cpu_stats_rpc_done(ULONG64 start, ULONG64 xdr_start);
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
+struct _NFS41_FLIGHT_RECORD;
+void nfsd_flight_recorder_add(struct _NFS41_FLIGHT_RECORD *restrict rec,
+    LONGLONG start);
+typedef struct __nfs41_root nfs41_root;
+typedef struct __nfs41_root_stats nfs41_root_stats;
+void nfsd_mount_stats_add(nfs41_root *root, const char *hostport,
+    const char *path);
+void nfsd_mount_stats_remove(nfs41_root *root);
+uint32_t nfsd_mount_stats_ref_roots(nfs41_root **roots, uint32_t max_roots);
+void nfsd_mount_stats_rpc_done(nfs41_root_stats *stats,
+    uint32_t read_bytes, uint32_t write_bytes, LONGLONG start);
+ULONGLONG nfsd_mount_stats_slot_wait_done(nfs41_root_stats *stats,
+    LONGLONG start);
 
 
 /* pnfs_debug.c */
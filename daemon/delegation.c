@@ -24,9 +24,13 @@
 #include "delegation.h"
 #include "nfs41_ops.h"
 #include "name_cache.h"
+#include "nfs41_callback.h"
 #include "fileinfoutil.h"
 #include "util.h"
 #include "daemon_debug.h"
+#include "nfs41_daemon.h"
+#include "mempressure.h"
+#include "dirnotify.h"
 
 #include <devioctl.h>
 #include "nfs41_driver.h" /* for making downcall to invalidate cache */
@@ -34,6 +38,50 @@
 
 #define DGLVL 2 /* dprintf level for delegation logging */
 
+/* delegation retention policy
+ *
+ *   each delegation keeps a count of the opens it served, which is
+ * halved for every DELEGATION_HEAT_HALFLIFE seconds it is not used, so
+ * delegation_heat() approximates the recent open rate.  when a
+ * delegation has to be returned to make room (name cache feedback, or
+ * the "--maxdelegations" limit), the coldest one which is not in use
+ * is returned, with ties going to the least recently used one.
+ *   clients never hold more than "--maxdelegations" delegations; new
+ * delegations beyond that are returned right away.  once a client
+ * holds more than 7/8 of the maximum, a background thread returns the
+ * coldest delegations until it is down to 3/4 of the maximum, so OPENs
+ * rarely have to wait for a DELEGRETURN.
+ *   with NFS41_DRIVER_DAEMON_MEMORY_PRESSURE the maximum is scaled
+ * with the system memory state, see mempressure.c. */
+#define DELEGATION_HEAT_HALFLIFE 30 /* in seconds */
+/* lower bound for |delegation_limit()| */
+#define DELEGATION_LIMIT_MIN 64
+#define DELEGATION_OPEN_COUNT_MAX 65536
+
+static uint32_t delegation_heat(
+    IN const nfs41_delegation_state *deleg,
+    IN util_reltimestamp now)
+{
+    util_reltimestamp halflifes;
+
+    halflifes = (now - deleg->last_used) / DELEGATION_HEAT_HALFLIFE;
+    if (halflifes >= 32)
+        return 0;
+    return deleg->open_count >> halflifes;
+}
+
+/* record an open served by |deleg|; expects client.state.lock held */
+static void delegation_touch(
+    IN nfs41_delegation_state *deleg)
+{
+    const util_reltimestamp now = UTIL_GETRELTIME();
+
+    deleg->open_count = delegation_heat(deleg, now);
+    if (deleg->open_count < DELEGATION_OPEN_COUNT_MAX)
+        deleg->open_count++;
+    deleg->last_used = now;
+}
+
 
 /* allocation and reference counting */
 static int delegation_create(
@@ -62,6 +110,13 @@ static int delegation_create(
     fh_copy(&state->parent.fh, &parent->fh);
 
     list_init(&state->client_entry);
+    list_init(&state->fileid_entry);
+    list_init(&state->fh_entry);
+    list_init(&state->stateid_entry);
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    list_init(&state->write_behind.entry);
+    list_init(&state->write_behind.retained);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
     state->status = DELEGATION_GRANTED;
     InitializeSRWLock(&state->lock);
     InitializeConditionVariable(&state->cond);
@@ -89,7 +144,54 @@ void nfs41_delegation_deref(
         free(state);
 }
 
-#define open_entry(pos) list_container(pos, nfs41_open_state, client_entry)
+#define open_entry(pos) list_container(pos, nfs41_open_state, fileid_entry)
+
+/* bucket of |client->state.opens| with the opens of |deleg->file| */
+#define deleg_opens_bucket(state, deleg) \
+    client_state_bucket((state)->open_fileid_hash, \
+        client_state_fileid_hash((deleg)->file.fh.fileid))
+
+/* link into the client's list and indexes, with |client->state.lock| */
+static void delegation_link(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg)
+{
+    list_add_tail(&client->state.delegations, &deleg->client_entry);
+    list_add_tail(client_state_bucket(client->state.deleg_fileid_hash,
+        client_state_fileid_hash(deleg->file.fh.fileid)),
+        &deleg->fileid_entry);
+    list_add_tail(client_state_bucket(client->state.deleg_fh_hash,
+        client_state_fh_hash(&deleg->file.fh)),
+        &deleg->fh_entry);
+    list_add_tail(client_state_bucket(client->state.deleg_stateid_hash,
+        client_state_stateid_hash(&deleg->state.stateid)),
+        &deleg->stateid_entry);
+}
+
+static void delegation_unlink(
+    IN nfs41_delegation_state *deleg)
+{
+    list_remove(&deleg->client_entry);
+    list_remove(&deleg->fileid_entry);
+    list_remove(&deleg->fh_entry);
+    list_remove(&deleg->stateid_entry);
+}
+
+void nfs41_delegation_rehash_stateid(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg)
+{
+    EnterCriticalSection(&client->state.lock);
+    if (!list_empty(&deleg->stateid_entry)) {
+        list_remove(&deleg->stateid_entry);
+        AcquireSRWLockShared(&deleg->lock);
+        list_add_tail(client_state_bucket(client->state.deleg_stateid_hash,
+            client_state_stateid_hash(&deleg->state.stateid)),
+            &deleg->stateid_entry);
+        ReleaseSRWLockShared(&deleg->lock);
+    }
+    LeaveCriticalSection(&client->state.lock);
+}
 
 static void delegation_remove(
     IN nfs41_client *client,
@@ -99,10 +201,13 @@ static void delegation_remove(
 
     /* remove from the client's list */
     EnterCriticalSection(&client->state.lock);
-    list_remove(&deleg->client_entry);
+    if (!list_empty(&deleg->client_entry)) {
+        delegation_unlink(deleg);
+        client->state.delegation_count--;
+    }
 
     /* remove from each associated open */
-    list_for_each(entry, &client->state.opens) {
+    list_for_each(entry, deleg_opens_bucket(&client->state, deleg)) {
         nfs41_open_state *open = open_entry(entry);
         AcquireSRWLockExclusive(&open->lock);
         if (open->delegation.state == deleg) {
@@ -163,7 +268,8 @@ static nfs41_open_state* deleg_open_find(
     nfs41_open_state *open = NULL;
 
     EnterCriticalSection(&state->lock);
-    entry = list_search(&state->opens, deleg, open_deleg_cmp);
+    entry = list_search(deleg_opens_bucket(state, deleg),
+        deleg, open_deleg_cmp);
     if (entry) {
         open = open_entry(entry);
         nfs41_open_state_ref(open); /* return a reference */
@@ -262,6 +368,804 @@ static int delegation_flush_locks(
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+/*
+ * write-behind
+ *
+ * While a write delegation is held no other client can look at the
+ * file, so |write_to_mds()| sends WRITEs as UNSTABLE4 and records the
+ * written range here instead of sending a COMMIT per write.
+ * The range is committed with one COMMIT when the delegation is
+ * returned, on unmount, or |WRITE_BEHIND_DELAY| milliseconds after the
+ * first uncommitted write, whatever comes first.
+ * Each delegation on |write_behind.list| holds a reference on itself
+ * and on the client's root.
+ *
+ * A copy of the data of every deferred write is retained until the
+ * COMMIT has succeeded. All retained writes of a delegation have been
+ * answered with the same write verifier, |write_behind.verf|. If
+ * the verifier changes (the server restarted and lost its UNSTABLE4
+ * data), |write_behind_resend()| writes the retained data again with
+ * FILE_SYNC4, in the order of the original writes, instead of
+ * failing with NFS4ERR_IO. Writes which do not fit into
+ * |WRITE_RETAIN_FILE_MAX| bytes per file or |WRITE_RETAIN_MAX| bytes
+ * in total are not deferred, their caller sends the COMMIT itself.
+ */
+#define WRITE_BEHIND_DELAY (5*1000)
+
+#define WRITE_RETAIN_FILE_MAX   (16*1024*1024)
+#define WRITE_RETAIN_MAX        (64*1024*1024)
+
+static struct {
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+    struct list_entry list; /* oldest first */
+    bool thread_running;
+} write_behind = {
+    .lock = SRWLOCK_INIT,
+    .cond = CONDITION_VARIABLE_INIT,
+    .list = { &write_behind.list, &write_behind.list },
+};
+
+typedef struct __write_retained {
+    struct list_entry entry;
+    uint64_t offset;
+    uint32_t length;
+    unsigned char data[1];
+} write_retained;
+
+/* bytes in all |write_retained| buffers */
+static volatile LONG64 write_retain_bytes = 0;
+
+static write_retained *write_retain_alloc(
+    IN const unsigned char *data,
+    IN uint64_t offset,
+    IN uint32_t length)
+{
+    write_retained *r;
+
+    r = malloc(FIELD_OFFSET(write_retained, data) + length);
+    if (r == NULL)
+        return NULL;
+    r->offset = offset;
+    r->length = length;
+    (void)memcpy(r->data, data, length);
+    (void)InterlockedAdd64(&write_retain_bytes, (LONG64)length);
+    return r;
+}
+
+static void write_retain_free(
+    IN struct list_entry *retained)
+{
+    write_retained *r;
+
+    while (!list_empty(retained)) {
+        r = list_container(retained->next, write_retained, entry);
+        list_remove(&r->entry);
+        (void)InterlockedAdd64(&write_retain_bytes, -(LONG64)r->length);
+        free(r);
+    }
+}
+
+/* move all entries of |src| to the empty list |dst| */
+static void write_retain_move(
+    OUT struct list_entry *dst,
+    IN OUT struct list_entry *src)
+{
+    list_init(dst);
+    if (list_empty(src))
+        return;
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    list_init(src);
+}
+
+/*
+ * add |r| to the writes retained for |deleg|, and drop older ones
+ * which |r| overwrites completely; expects the caller to hold
+ * |write_behind.lock| exclusively
+ */
+static void write_retain_add(
+    IN nfs41_delegation_state *deleg,
+    IN write_retained *r)
+{
+    struct list_entry *entry, *tmp;
+    write_retained *old;
+
+    list_for_each_tmp(entry, tmp, &deleg->write_behind.retained) {
+        old = list_container(entry, write_retained, entry);
+        if ((old->offset >= r->offset) &&
+            ((old->offset + old->length) <= (r->offset + r->length))) {
+            list_remove(&old->entry);
+            deleg->write_behind.retained_bytes -= old->length;
+            (void)InterlockedAdd64(&write_retain_bytes,
+                -(LONG64)old->length);
+            free(old);
+        }
+    }
+    list_add_tail(&deleg->write_behind.retained, &r->entry);
+    deleg->write_behind.retained_bytes += r->length;
+}
+
+/* write the retained data again after the server lost it */
+static int write_behind_resend(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN struct list_entry *retained)
+{
+    const uint32_t maxwritesize =
+        max_write_size(client->session, &deleg->file.fh);
+    stateid_arg stateid;
+    struct list_entry *entry;
+    write_retained *r;
+    nfs41_write_verf verf;
+    nfs41_file_info info;
+    uint32_t done, bytes_written;
+    int status = NFS4_OK;
+
+    stateid.type = STATEID_DELEG_FILE;
+    stateid.open = NULL;
+    stateid.delegation = deleg;
+    AcquireSRWLockShared(&deleg->lock);
+    stateid4_cpy(&stateid.stateid, &deleg->state.stateid);
+    ReleaseSRWLockShared(&deleg->lock);
+
+    list_for_each(entry, retained) {
+        r = list_container(entry, write_retained, entry);
+        DPRINTF(DGLVL, ("write_behind_resend('%s'): offset=%llu "
+            "length=%lu\n", deleg->path.path,
+            (unsigned long long)r->offset, (unsigned long)r->length));
+
+        for (done = 0 ; done < r->length ; done += bytes_written) {
+            bytes_written = 0;
+            (void)memset(&info, 0, sizeof(info));
+            status = nfs41_write(client->session, &deleg->file, &stateid,
+                r->data + done, min(r->length - done, maxwritesize),
+                r->offset + done, FILE_SYNC4, &bytes_written, &verf,
+                &info);
+            if (status)
+                goto out;
+            if ((bytes_written == 0) || (verf.committed == UNSTABLE4)) {
+                status = NFS4ERR_IO;
+                goto out;
+            }
+        }
+    }
+out:
+    return status;
+}
+
+/* remember a failed COMMIT or resend for the next flush or CLOSE */
+static void write_behind_set_error(
+    IN nfs41_delegation_state *deleg,
+    IN int status)
+{
+    AcquireSRWLockExclusive(&write_behind.lock);
+    if (deleg->write_behind.error == NFS4_OK)
+        deleg->write_behind.error = status;
+    ReleaseSRWLockExclusive(&write_behind.lock);
+}
+
+/* commit the range removed from |write_behind.list| */
+static int write_behind_commit(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN uint64_t offset,
+    IN uint64_t end,
+    IN const unsigned char *verf,
+    IN struct list_entry *retained)
+{
+    nfs41_write_verf commit_verf;
+    nfs41_file_info info;
+    uint32_t count;
+    int status;
+
+    /* a count of zero commits everything from |offset| on */
+    count = ((end - offset) > UINT32_MAX)?0:(uint32_t)(end - offset);
+
+    DPRINTF(DGLVL, ("write_behind_commit('%s'): offset=%llu count=%lu\n",
+        deleg->path.path, (unsigned long long)offset,
+        (unsigned long)count));
+
+    (void)memset(&info, 0, sizeof(info));
+    (void)memcpy(commit_verf.expected, verf, NFS4_VERIFIER_SIZE);
+    status = nfs41_commit(client->session, &deleg->file, offset, count,
+        0, &commit_verf, &info);
+    if (status) {
+        eprintf("write_behind_commit('%s'): COMMIT failed with '%s'\n",
+            deleg->path.path, nfs_error_string(status));
+    } else if (!verify_commit(&commit_verf)) {
+        DPRINTF(0, ("write_behind_commit('%s'): verifier changed, "
+            "writing the uncommitted data again\n", deleg->path.path));
+        status = write_behind_resend(client, deleg, retained);
+        if (status) {
+            eprintf("write_behind_commit('%s'): uncommitted writes have "
+                "been lost, resend failed with '%s'\n", deleg->path.path,
+                nfs_error_string(status));
+            status = NFS4ERR_IO;
+        }
+    }
+    write_retain_free(retained);
+    if (status)
+        write_behind_set_error(deleg, status);
+
+    /* release the references from |nfs41_delegation_write_behind()| */
+    nfs41_delegation_deref(deleg);
+    nfs41_root_deref(client->root);
+    return status;
+}
+
+/* expects the caller to hold |write_behind.lock| exclusively */
+static void write_behind_unlink(
+    IN nfs41_delegation_state *deleg,
+    OUT nfs41_client **client,
+    OUT uint64_t *offset,
+    OUT uint64_t *end,
+    OUT unsigned char *verf,
+    OUT struct list_entry *retained)
+{
+    list_remove(&deleg->write_behind.entry);
+    write_retain_move(retained, &deleg->write_behind.retained);
+    deleg->write_behind.retained_bytes = 0;
+    deleg->write_behind.dirty = FALSE;
+    *client = deleg->write_behind.client;
+    *offset = deleg->write_behind.offset;
+    *end = deleg->write_behind.end;
+    (void)memcpy(verf, deleg->write_behind.verf, NFS4_VERIFIER_SIZE);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+/*
+ * Ranges of several delegations of the same client, which are
+ * committed together with |nfs41_commit_batch()|
+ */
+#define WRITE_BEHIND_BATCH 16
+
+typedef struct __write_behind_range {
+    nfs41_delegation_state *deleg;
+    nfs41_client *client;
+    uint64_t offset;
+    uint64_t end;
+    unsigned char verf[NFS4_VERIFIER_SIZE];
+    struct list_entry retained;
+} write_behind_range;
+
+/* commit the ranges removed from |write_behind.list| */
+static void write_behind_commit_batch(
+    IN write_behind_range *ranges,
+    IN uint32_t count)
+{
+    nfs41_client *client = ranges[0].client;
+    nfs41_path_fh *files[WRITE_BEHIND_BATCH];
+    uint64_t offsets[WRITE_BEHIND_BATCH];
+    uint32_t counts[WRITE_BEHIND_BATCH];
+    nfs41_write_verf verfs[WRITE_BEHIND_BATCH];
+    nfs41_write_verf *pverfs[WRITE_BEHIND_BATCH];
+    int statuses[WRITE_BEHIND_BATCH];
+    uint32_t i;
+
+    if (count == 1) {
+        (void)write_behind_commit(client, ranges[0].deleg,
+            ranges[0].offset, ranges[0].end, ranges[0].verf,
+            &ranges[0].retained);
+        return;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        EASSERT(ranges[i].client == client);
+        files[i] = &ranges[i].deleg->file;
+        offsets[i] = ranges[i].offset;
+        /* a count of zero commits everything from |offset| on */
+        counts[i] = ((ranges[i].end - ranges[i].offset) > UINT32_MAX)?
+            0:(uint32_t)(ranges[i].end - ranges[i].offset);
+        (void)memset(&verfs[i], 0, sizeof(verfs[i]));
+        (void)memcpy(verfs[i].expected, ranges[i].verf,
+            NFS4_VERIFIER_SIZE);
+        pverfs[i] = &verfs[i];
+    }
+
+    DPRINTF(DGLVL, ("write_behind_commit_batch: committing %u files\n",
+        (unsigned int)count));
+    (void)nfs41_commit_batch(client->session, count, files, offsets,
+        counts, FALSE, pverfs, NULL, statuses);
+
+    for (i = 0 ; i < count ; i++) {
+        if (statuses[i]) {
+            eprintf("write_behind_commit_batch('%s'): COMMIT failed "
+                "with '%s'\n", ranges[i].deleg->path.path,
+                nfs_error_string(statuses[i]));
+        } else if (!verify_commit(&verfs[i])) {
+            DPRINTF(0, ("write_behind_commit_batch('%s'): verifier "
+                "changed, writing the uncommitted data again\n",
+                ranges[i].deleg->path.path));
+            statuses[i] = write_behind_resend(client, ranges[i].deleg,
+                &ranges[i].retained);
+            if (statuses[i])
+                eprintf("write_behind_commit_batch('%s'): uncommitted "
+                    "writes have been lost, resend failed with '%s'\n",
+                    ranges[i].deleg->path.path,
+                    nfs_error_string(statuses[i]));
+        }
+        write_retain_free(&ranges[i].retained);
+        if (statuses[i])
+            write_behind_set_error(ranges[i].deleg, statuses[i]);
+
+        /* release the references from |nfs41_delegation_write_behind()| */
+        nfs41_delegation_deref(ranges[i].deleg);
+        nfs41_root_deref(ranges[i].client->root);
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+
+static unsigned int WINAPI write_behind_thread(void *args)
+{
+    nfs41_delegation_state *deleg;
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+    write_behind_range ranges[WRITE_BEHIND_BATCH];
+    uint32_t n;
+#else
+    nfs41_client *client;
+    uint64_t offset, end;
+    unsigned char verf[NFS4_VERIFIER_SIZE];
+    struct list_entry retained;
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+    ULONGLONG now;
+
+    AcquireSRWLockExclusive(&write_behind.lock);
+    for (;;) {
+        if (list_empty(&write_behind.list)) {
+            (void)SleepConditionVariableSRW(&write_behind.cond,
+                &write_behind.lock, INFINITE, 0);
+            continue;
+        }
+
+        deleg = list_container(write_behind.list.next,
+            nfs41_delegation_state, write_behind.entry);
+        now = GetTickCount64();
+        if (deleg->write_behind.expiration > now) {
+            (void)SleepConditionVariableSRW(&write_behind.cond,
+                &write_behind.lock,
+                (DWORD)(deleg->write_behind.expiration - now), 0);
+            continue;
+        }
+
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+        /* commit all expired ranges of the same client together */
+        n = 0;
+        for (;;) {
+            ranges[n].deleg = deleg;
+            write_behind_unlink(deleg, &ranges[n].client,
+                &ranges[n].offset, &ranges[n].end, ranges[n].verf,
+                &ranges[n].retained);
+            n++;
+
+            if ((n == WRITE_BEHIND_BATCH) || list_empty(&write_behind.list))
+                break;
+            deleg = list_container(write_behind.list.next,
+                nfs41_delegation_state, write_behind.entry);
+            if ((deleg->write_behind.expiration > now) ||
+                (deleg->write_behind.client != ranges[0].client))
+                break;
+        }
+        ReleaseSRWLockExclusive(&write_behind.lock);
+        write_behind_commit_batch(ranges, n);
+        AcquireSRWLockExclusive(&write_behind.lock);
+#else
+        write_behind_unlink(deleg, &client, &offset, &end, verf,
+            &retained);
+        ReleaseSRWLockExclusive(&write_behind.lock);
+        (void)write_behind_commit(client, deleg, offset, end, verf,
+            &retained);
+        AcquireSRWLockExclusive(&write_behind.lock);
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+    }
+    /* NOTREACHED */
+    return 0;
+}
+
+nfs41_delegation_state *nfs41_delegation_write_behind_get(
+    IN nfs41_open_state *state)
+{
+    nfs41_delegation_state *deleg = NULL;
+
+    AcquireSRWLockShared(&state->lock);
+    if (state->delegation.state &&
+        (state->delegation.state->state.type == OPEN_DELEGATE_WRITE)) {
+        deleg = state->delegation.state;
+        nfs41_delegation_ref(deleg);
+    }
+    ReleaseSRWLockShared(&state->lock);
+    return deleg;
+}
+
+int nfs41_delegation_write_behind(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN const unsigned char *data,
+    IN uint64_t offset,
+    IN uint32_t length,
+    IN const nfs41_write_verf *verf)
+{
+    write_retained *r = NULL;
+    nfs41_client *old_client;
+    uint64_t old_offset, old_end;
+    unsigned char old_verf[NFS4_VERIFIER_SIZE];
+    struct list_entry retained;
+    bool_t defer;
+    int status = NFS4_OK;
+
+    /* without a copy of the data a lost write could not be repeated */
+    if (length <= WRITE_RETAIN_FILE_MAX)
+        r = write_retain_alloc(data, offset, length);
+    defer = (r != NULL);
+
+    AcquireSRWLockExclusive(&write_behind.lock);
+
+    /* a delegation on its way back must be committed right away */
+    AcquireSRWLockShared(&deleg->lock);
+    if (deleg->status != DELEGATION_GRANTED)
+        defer = FALSE;
+    ReleaseSRWLockShared(&deleg->lock);
+
+    if (defer && !write_behind.thread_running) {
+        HANDLE thread;
+
+        thread = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
+            write_behind_thread, NULL, 0, NULL);
+        if (thread == NULL) {
+            eprintf("nfs41_delegation_write_behind: "
+                "_beginthreadex() failed with %d\n", (int)GetLastError());
+            defer = FALSE;
+        } else {
+            (void)CloseHandle(thread);
+            write_behind.thread_running = true;
+        }
+    }
+
+    if (deleg->write_behind.dirty) {
+        if (!defer ||
+            memcmp(deleg->write_behind.verf, verf->expected,
+                NFS4_VERIFIER_SIZE) ||
+            (write_retain_bytes > WRITE_RETAIN_MAX) ||
+            ((deleg->write_behind.retained_bytes + length) >
+                WRITE_RETAIN_FILE_MAX)) {
+            /*
+             * the server restarted since the earlier writes, or this
+             * one cannot be deferred, so commit the earlier writes
+             * now, before the caller commits this one. If the server
+             * lost them, |write_behind_commit()| writes them again,
+             * with this one last so it wins where they overlap.
+             */
+            write_behind_unlink(deleg, &old_client, &old_offset,
+                &old_end, old_verf, &retained);
+            if (r) {
+                list_add_tail(&retained, &r->entry);
+                old_offset = min(old_offset, offset);
+                old_end = max(old_end, offset + length);
+            }
+            ReleaseSRWLockExclusive(&write_behind.lock);
+
+            status = write_behind_commit(old_client, deleg, old_offset,
+                old_end, old_verf, &retained);
+            if ((r == NULL) && (status != NFS4ERR_IO))
+                status = NFS4ERR_DELAY;
+            return status;
+        }
+        write_retain_add(deleg, r);
+        r = NULL;
+        deleg->write_behind.offset =
+            min(deleg->write_behind.offset, offset);
+        deleg->write_behind.end =
+            max(deleg->write_behind.end, offset + length);
+    } else {
+        if (!defer || (write_retain_bytes > WRITE_RETAIN_MAX)) {
+            status = NFS4ERR_DELAY;
+            goto out_unlock;
+        }
+        /* released in |write_behind_commit()| */
+        nfs41_delegation_ref(deleg);
+        nfs41_root_ref(client->root);
+        deleg->write_behind.client = client;
+        deleg->write_behind.offset = offset;
+        deleg->write_behind.end = offset + length;
+        (void)memcpy(deleg->write_behind.verf, verf->expected,
+            NFS4_VERIFIER_SIZE);
+        deleg->write_behind.expiration =
+            GetTickCount64() + WRITE_BEHIND_DELAY;
+        write_retain_add(deleg, r);
+        r = NULL;
+        deleg->write_behind.dirty = TRUE;
+        list_add_tail(&write_behind.list, &deleg->write_behind.entry);
+        WakeConditionVariable(&write_behind.cond);
+    }
+out_unlock:
+    ReleaseSRWLockExclusive(&write_behind.lock);
+    if (r) {
+        (void)InterlockedAdd64(&write_retain_bytes, -(LONG64)r->length);
+        free(r);
+    }
+    return status;
+}
+
+/* commit the uncommitted writes of |deleg|, if any */
+static int write_behind_flush(
+    IN nfs41_delegation_state *deleg)
+{
+    nfs41_client *client;
+    uint64_t offset, end;
+    unsigned char verf[NFS4_VERIFIER_SIZE];
+    struct list_entry retained;
+
+    AcquireSRWLockExclusive(&write_behind.lock);
+    if (!deleg->write_behind.dirty) {
+        ReleaseSRWLockExclusive(&write_behind.lock);
+        return NFS4_OK;
+    }
+    write_behind_unlink(deleg, &client, &offset, &end, verf, &retained);
+    ReleaseSRWLockExclusive(&write_behind.lock);
+
+    return write_behind_commit(client, deleg, offset, end, verf,
+        &retained);
+}
+
+int nfs41_delegation_write_behind_flush_open(
+    IN nfs41_open_state *state)
+{
+    nfs41_delegation_state *deleg;
+    int status;
+
+    deleg = nfs41_delegation_write_behind_get(state);
+    if (deleg == NULL)
+        return NFS4_OK;
+
+    status = write_behind_flush(deleg);
+
+    /* report earlier failures of the write-behind thread only once */
+    AcquireSRWLockExclusive(&write_behind.lock);
+    if (status == NFS4_OK)
+        status = deleg->write_behind.error;
+    deleg->write_behind.error = NFS4_OK;
+    ReleaseSRWLockExclusive(&write_behind.lock);
+
+    nfs41_delegation_deref(deleg);
+    return status;
+}
+
+void nfs41_delegation_write_behind_flush_root(
+    IN nfs41_root *root)
+{
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+    nfs41_delegation_state *deleg;
+    write_behind_range ranges[WRITE_BEHIND_BATCH];
+    struct list_entry *entry, *next;
+    uint32_t n;
+
+    AcquireSRWLockExclusive(&write_behind.lock);
+    do {
+        /* collect up to |WRITE_BEHIND_BATCH| ranges of one client */
+        n = 0;
+        for (entry = write_behind.list.next ;
+            (entry != &write_behind.list) && (n < WRITE_BEHIND_BATCH) ;
+            entry = next) {
+            next = entry->next;
+            deleg = list_container(entry,
+                nfs41_delegation_state, write_behind.entry);
+            if ((deleg->write_behind.client->root != root) ||
+                (n && (deleg->write_behind.client != ranges[0].client)))
+                continue;
+
+            ranges[n].deleg = deleg;
+            write_behind_unlink(deleg, &ranges[n].client,
+                &ranges[n].offset, &ranges[n].end, ranges[n].verf,
+                &ranges[n].retained);
+            n++;
+        }
+        if (n) {
+            ReleaseSRWLockExclusive(&write_behind.lock);
+            write_behind_commit_batch(ranges, n);
+            AcquireSRWLockExclusive(&write_behind.lock);
+        }
+    } while (n);
+    ReleaseSRWLockExclusive(&write_behind.lock);
+#else
+    nfs41_delegation_state *deleg;
+    nfs41_client *client;
+    struct list_entry *entry;
+    uint64_t offset, end;
+    unsigned char verf[NFS4_VERIFIER_SIZE];
+    struct list_entry retained;
+
+    AcquireSRWLockExclusive(&write_behind.lock);
+restart:
+    list_for_each(entry, &write_behind.list) {
+        deleg = list_container(entry,
+            nfs41_delegation_state, write_behind.entry);
+        if (deleg->write_behind.client->root != root)
+            continue;
+
+        write_behind_unlink(deleg, &client, &offset, &end, verf,
+            &retained);
+        ReleaseSRWLockExclusive(&write_behind.lock);
+        (void)write_behind_commit(client, deleg, offset, end, verf,
+            &retained);
+        AcquireSRWLockExclusive(&write_behind.lock);
+        goto restart;
+    }
+    ReleaseSRWLockExclusive(&write_behind.lock);
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+}
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+/*
+ * Delegated timestamps (RFC 9754)
+ *
+ * With an |OPEN_DELEGATE_WRITE_ATTRS_DELEG| delegation the client
+ * owns time_access and time_modify of the file. SETATTRs which only
+ * change the timestamps, and the time_modify updates of WRITEs, are
+ * kept in |deleg->times| and in the attribute cache, and are sent as
+ * time_deleg_access/time_deleg_modify in one SETATTR before the
+ * DELEGRETURN. CB_GETATTR reports them to the server in between.
+ */
+#define DELEG_TIME_ACCESS   0x1
+#define DELEG_TIME_MODIFY   0x2
+
+/* returns a referenced write delegation with delegated timestamps */
+static nfs41_delegation_state *deleg_times_get(
+    IN nfs41_open_state *state)
+{
+    nfs41_delegation_state *deleg = NULL;
+
+    AcquireSRWLockShared(&state->lock);
+    if (state->delegation.state &&
+        (state->delegation.state->state.type == OPEN_DELEGATE_WRITE) &&
+        state->delegation.state->state.attrs_deleg) {
+        deleg = state->delegation.state;
+        nfs41_delegation_ref(deleg);
+    }
+    ReleaseSRWLockShared(&state->lock);
+    return deleg;
+}
+
+/* record the times in |deleg| and in the attribute cache */
+static bool_t deleg_times_set(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN uint32_t which,
+    IN OPTIONAL const nfstime4 *access,
+    IN OPTIONAL const nfstime4 *modify,
+    OUT nfs41_file_info *info)
+{
+    bool_t granted;
+
+    AcquireSRWLockExclusive(&deleg->lock);
+    granted = (deleg->status == DELEGATION_GRANTED);
+    if (granted) {
+        if (which & DELEG_TIME_ACCESS)
+            deleg->times.access = *access;
+        if (which & DELEG_TIME_MODIFY)
+            deleg->times.modify = *modify;
+        deleg->times.dirty |= which;
+    }
+    ReleaseSRWLockExclusive(&deleg->lock);
+    if (!granted)
+        return FALSE;
+
+    (void)memset(info, 0, sizeof(*info));
+    if (which & DELEG_TIME_ACCESS) {
+        info->time_access = *access;
+        bitmap_set(&info->attrmask, 1, FATTR4_WORD1_TIME_ACCESS);
+    }
+    if (which & DELEG_TIME_MODIFY) {
+        info->time_modify = *modify;
+        bitmap_set(&info->attrmask, 1, FATTR4_WORD1_TIME_MODIFY);
+    }
+    (void)nfs41_attr_cache_update(client_name_cache(client),
+        deleg->file.fh.fileid, info);
+    return TRUE;
+}
+
+bool_t nfs41_delegation_set_times(
+    IN nfs41_open_state *state,
+    IN OUT nfs41_file_info *info)
+{
+    nfs41_client *client = state->session->client;
+    nfs41_delegation_state *deleg;
+    nfs41_file_info cinfo;
+    uint32_t i, which = 0;
+    bool_t done = FALSE;
+
+    /* only SETATTRs which change nothing but the timestamps */
+    for (i = 0 ; i < info->attrmask.count ; i++) {
+        if (info->attrmask.arr[i] & ~((i == 1)?
+            (FATTR4_WORD1_TIME_ACCESS_SET|FATTR4_WORD1_TIME_MODIFY_SET) : 0))
+            return FALSE;
+    }
+    if (bitmap_isset(&info->attrmask, 1, FATTR4_WORD1_TIME_ACCESS_SET))
+        which |= DELEG_TIME_ACCESS;
+    if (bitmap_isset(&info->attrmask, 1, FATTR4_WORD1_TIME_MODIFY_SET))
+        which |= DELEG_TIME_MODIFY;
+    if (which == 0)
+        return FALSE;
+
+    deleg = deleg_times_get(state);
+    if (deleg == NULL)
+        return FALSE;
+
+    if (!deleg_times_set(client, deleg, which, &info->time_access,
+        &info->time_modify, &cinfo))
+        goto out;
+
+    /* the caller expects the change attribute of a SETATTR */
+    if (nfs41_attr_cache_lookup(client_name_cache(client),
+        deleg->file.fh.fileid, &cinfo))
+        goto out;
+    info->change = cinfo.change;
+    bitmap_set(&info->attrmask, 0, FATTR4_WORD0_CHANGE);
+    done = TRUE;
+
+    DPRINTF(1, ("nfs41_delegation_set_times(fileid=%llu): "
+        "kept times 0x%x local\n",
+        (unsigned long long)deleg->file.fh.fileid, (unsigned int)which));
+out:
+    nfs41_delegation_deref(deleg);
+    return done;
+}
+
+void nfs41_delegation_modified(
+    IN nfs41_open_state *state)
+{
+    nfs41_delegation_state *deleg;
+    nfs41_file_info info;
+    nfstime4 now;
+
+    deleg = deleg_times_get(state);
+    if (deleg == NULL)
+        return;
+
+    get_nfs_time(&now);
+    (void)deleg_times_set(state->session->client, deleg,
+        DELEG_TIME_MODIFY, NULL, &now, &info);
+    nfs41_delegation_deref(deleg);
+}
+
+/* send the delegated timestamps before the delegation goes back */
+static void deleg_times_flush(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN stateid_arg *stateid)
+{
+    nfs41_file_info info;
+    uint32_t dirty;
+    int status;
+
+    (void)memset(&info, 0, sizeof(info));
+    AcquireSRWLockExclusive(&deleg->lock);
+    dirty = deleg->times.dirty;
+    deleg->times.dirty = 0;
+    info.time_access = deleg->times.access;
+    info.time_modify = deleg->times.modify;
+    ReleaseSRWLockExclusive(&deleg->lock);
+    if (dirty == 0)
+        return;
+
+    if (dirty & DELEG_TIME_ACCESS)
+        bitmap_set(&info.attrmask, 2, FATTR4_WORD2_TIME_DELEG_ACCESS);
+    if (dirty & DELEG_TIME_MODIFY)
+        bitmap_set(&info.attrmask, 2, FATTR4_WORD2_TIME_DELEG_MODIFY);
+
+    status = nfs41_setattr(client->session, &deleg->file, stateid, &info);
+    if (status) {
+        eprintf("deleg_times_flush(fileid=%llu): nfs41_setattr() "
+            "failed with '%s'\n",
+            (unsigned long long)deleg->file.fh.fileid,
+            nfs_error_string(status));
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
+
 #pragma warning (disable : 4706) /* assignment within conditional expression */
 
 static int delegation_return(
@@ -301,6 +1205,11 @@ static int delegation_return(
     }
 out_downcall:
 
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+    /* don't let our own parked opens get in the way of other clients */
+    nfs41_deferred_close_flush_file(client, &deleg->file.fh);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+
     /* recover opens and locks associated with the delegation */
     while ((open = deleg_open_find(&client->state, deleg)) != NULL) {
         status = nfs41_delegation_to_open(open, try_recovery);
@@ -312,6 +1221,11 @@ out_downcall:
             break;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    /* the server must have the data before the delegation goes back */
+    (void)write_behind_flush(deleg);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+
     /* return the delegation */
     stateid.type = STATEID_DELEG_FILE;
     stateid.open = NULL;
@@ -320,6 +1234,9 @@ out_downcall:
     stateid4_cpy(&stateid.stateid, &deleg->state.stateid);
     ReleaseSRWLockShared(&deleg->lock);
 
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+    deleg_times_flush(client, deleg, &stateid);
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
     status = nfs41_delegreturn(client->session,
         &deleg->file, &stateid, try_recovery);
     if (status == NFS4ERR_BADSESSION)
@@ -330,6 +1247,28 @@ out:
     return status;
 }
 
+static void delegation_trim_start(
+    IN nfs41_client *client);
+
+/*
+ * Max. number of delegations per client, 0 means no limit. While
+ * system memory is low there is always a limit
+ */
+static uint32_t delegation_limit(void)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    uint32_t limit = (uint32_t)nfs41_dg.max_delegations;
+
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+    if ((limit == 0) && nfs41_mempressure_low())
+        limit = MAX_DELEGATIONS_DEFAULT;
+    if (limit)
+        limit = (uint32_t)nfs41_mempressure_limit(limit,
+            DELEGATION_LIMIT_MIN);
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+    return limit;
+}
+
 /* open delegation */
 int nfs41_delegation_granted(
     IN nfs41_session *session,
@@ -342,7 +1281,9 @@ int nfs41_delegation_granted(
     stateid_arg stateid;
     nfs41_client *client = session->client;
     nfs41_delegation_state *state;
+    bool_t start_trim = FALSE;
     int status = NO_ERROR;
+    const uint32_t max_delegations = delegation_limit();
 
     if (delegation->type != OPEN_DELEGATE_READ &&
         delegation->type != OPEN_DELEGATE_WRITE)
@@ -360,10 +1301,35 @@ int nfs41_delegation_granted(
 
     /* register the delegation with the client */
     EnterCriticalSection(&client->state.lock);
+    if (max_delegations &&
+        (client->state.delegation_count >= max_delegations)) {
+        LeaveCriticalSection(&client->state.lock);
+        DPRINTF(DGLVL, ("nfs41_delegation_granted: "
+            "%u delegations, returning the new one\n",
+            (unsigned int)max_delegations));
+        nfs41_delegation_deref(state);
+        goto out_return;
+    }
     /* XXX: check for duplicates by fh and stateid? */
-    list_add_tail(&client->state.delegations, &state->client_entry);
+    delegation_link(client, state);
+    client->state.delegation_count++;
+    delegation_touch(state);
+    if (max_delegations &&
+        (client->state.delegation_count >
+            (max_delegations - max_delegations / 8)) &&
+        (!client->state.delegation_trim_running)) {
+        client->state.delegation_trim_running = TRUE;
+        start_trim = TRUE;
+    }
     LeaveCriticalSection(&client->state.lock);
 
+    if (start_trim)
+        delegation_trim_start(client);
+
+    NFSD_TRACE_EVENT("DelegationGranted", NFSD_TRACE_KEYWORD_DELEGATION,
+        TraceLoggingUInt64(file->fh.fileid, "FileId"),
+        TraceLoggingUInt32(delegation->type, "Type"));
+
     nfs41_delegation_ref(state); /* return a reference */
     *deleg_out = state;
 out:
@@ -382,13 +1348,38 @@ out_return: /* return the delegation on failure */
 
 static int deleg_file_cmp(const struct list_entry *entry, const void *value)
 {
-    const nfs41_fh *lhs = &deleg_entry(entry)->file.fh;
+    const nfs41_fh *lhs = &list_container(entry,
+        nfs41_delegation_state, fileid_entry)->file.fh;
     const nfs41_fh *rhs = (const nfs41_fh*)value;
     if (lhs->superblock != rhs->superblock) return -1;
     if (lhs->fileid != rhs->fileid) return -1;
     return 0;
 }
 
+static int deleg_fh_cmp(const struct list_entry *entry, const void *value)
+{
+    const nfs41_fh *lhs = &list_container(entry,
+        nfs41_delegation_state, fh_entry)->file.fh;
+    const nfs41_fh *rhs = (const nfs41_fh*)value;
+    if (lhs->len != rhs->len) return -1;
+    return memcmp(lhs->fh, rhs->fh, lhs->len);
+}
+
+static int deleg_stateid_cmp(const struct list_entry *entry, const void *value)
+{
+    const stateid4 *lhs = &list_container(entry,
+        nfs41_delegation_state, stateid_entry)->state.stateid;
+    const stateid4 *rhs = (const stateid4*)value;
+    return memcmp(lhs->other, rhs->other, NFS4_STATEID_OTHER);
+}
+
+/* index of |client_state| used by |delegation_find()| */
+enum deleg_index {
+    DELEG_BY_FILEID,    /* |nfs41_fh| with superblock and fileid */
+    DELEG_BY_FH,        /* |nfs41_fh| with filehandle */
+    DELEG_BY_STATEID    /* |stateid4| */
+};
+
 static bool_t delegation_compatible(
     IN enum open_delegation_type4 type,
     IN uint32_t create,
@@ -418,23 +1409,50 @@ static bool_t delegation_compatible(
 
 static int delegation_find(
     IN nfs41_client *client,
+    IN enum deleg_index index,
     IN const void *value,
-    IN list_compare_fn cmp,
     OUT nfs41_delegation_state **deleg_out)
 {
-    struct list_entry *entry;
+    struct list_entry *bucket, *entry;
+    nfs41_delegation_state *deleg;
     int status = NFS4ERR_BADHANDLE;
 
     EnterCriticalSection(&client->state.lock);
-    entry = list_search(&client->state.delegations, value, cmp);
-    if (entry) {
+    switch (index) {
+    case DELEG_BY_FILEID:
+        bucket = client_state_bucket(client->state.deleg_fileid_hash,
+            client_state_fileid_hash(((const nfs41_fh*)value)->fileid));
+        entry = list_search(bucket, value, deleg_file_cmp);
+        deleg = entry ? list_container(entry,
+            nfs41_delegation_state, fileid_entry) : NULL;
+        break;
+    case DELEG_BY_FH:
+        bucket = client_state_bucket(client->state.deleg_fh_hash,
+            client_state_fh_hash((const nfs41_fh*)value));
+        entry = list_search(bucket, value, deleg_fh_cmp);
+        deleg = entry ? list_container(entry,
+            nfs41_delegation_state, fh_entry) : NULL;
+        break;
+    case DELEG_BY_STATEID:
+        bucket = client_state_bucket(client->state.deleg_stateid_hash,
+            client_state_stateid_hash((const stateid4*)value));
+        entry = list_search(bucket, value, deleg_stateid_cmp);
+        deleg = entry ? list_container(entry,
+            nfs41_delegation_state, stateid_entry) : NULL;
+        break;
+    default:
+        EASSERT(0);
+        deleg = NULL;
+        break;
+    }
+    if (deleg) {
         /* return a reference to the delegation */
-        *deleg_out = deleg_entry(entry);
-        nfs41_delegation_ref(*deleg_out);
+        *deleg_out = deleg;
+        nfs41_delegation_ref(deleg);
 
         /* move to the 'most recently used' end of the list */
-        list_remove(entry);
-        list_add_tail(&client->state.delegations, entry);
+        list_remove(&deleg->client_entry);
+        list_add_tail(&client->state.delegations, &deleg->client_entry);
         status = NFS4_OK;
     }
     LeaveCriticalSection(&client->state.lock);
@@ -478,7 +1496,7 @@ int nfs41_delegate_open(
     int status;
 
     /* search for a delegation with this filehandle */
-    status = delegation_find(client, &file->fh, deleg_file_cmp, &deleg);
+    status = delegation_find(client, DELEG_BY_FILEID, &file->fh, &deleg);
     if (status)
         goto out;
 
@@ -512,6 +1530,12 @@ int nfs41_delegate_open(
         deleg->srv_open = state->srv_open;
     }
     ReleaseSRWLockExclusive(&deleg->lock);
+
+    if (!status) {
+        EnterCriticalSection(&client->state.lock);
+        delegation_touch(deleg);
+        LeaveCriticalSection(&client->state.lock);
+    }
 
     if (status == NFS4ERR_DELEG_REVOKED)
         goto out_return;
@@ -588,7 +1612,8 @@ int nfs41_delegation_to_open(
 
     status = nfs41_open(open->session, &open->parent, &open->file,
         &open->owner, &claim, open->share_access, open->share_deny,
-        OPEN4_NOCREATE, 0, NULL, try_recovery, &open_stateid, &ignore, NULL);
+        OPEN4_NOCREATE, 0, NULL, NULL, try_recovery, &open_stateid, &ignore,
+        NULL, NULL, NULL);
 
     AcquireSRWLockExclusive(&open->lock);
     if (status == NFS4_OK) {
@@ -620,7 +1645,8 @@ void nfs41_delegation_remove_srvopen(
     nfs41_delegation_state *deleg = NULL;
 
     /* find a delegation for this file */
-    if (delegation_find(session->client, &file->fh, deleg_file_cmp, &deleg))
+    if (delegation_find(session->client, DELEG_BY_FILEID, &file->fh,
+        &deleg))
         return;
     DPRINTF(1, ("nfs41_delegation_remove_srvopen: removing reference to "
         "srv_open=0x%p\n", deleg->srv_open));
@@ -643,7 +1669,7 @@ int nfs41_delegation_return(
     int status;
 
     /* find a delegation for this file */
-    status = delegation_find(client, &file->fh, deleg_file_cmp, &deleg);
+    status = delegation_find(client, DELEG_BY_FILEID, &file->fh, &deleg);
     if (status)
         goto out;
 
@@ -675,32 +1701,535 @@ out:
 #endif
 
 
-/* asynchronous delegation recall */
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+/* directory delegations
+ *
+ *   while the client holds a directory delegation, the server tells it
+ * about every entry added, removed or renamed in that directory with a
+ * CB_NOTIFY instead of letting the cached directory go stale.  the
+ * directory's name cache entry is inserted as delegated, so neither
+ * its attributes nor the attributes of its children time out, and the
+ * READDIR listing cache ignores its "acdirmax" timeout.  CB_NOTIFY
+ * forgets each named entry and invalidates the directory attributes and
+ * the listing; CB_RECALL (or a failed request) falls back to the normal
+ * timeout based revalidation.
+ *   directories are requested when they are listed, or after
+ * DIR_DELEGATION_HOT_LOOKUPS lookups had to go to the server for names
+ * in them.  a client holds at most DIR_DELEGATIONS_MAX directory
+ * delegations, and stops asking once the server refuses with
+ * NFS4ERR_NOTSUPP. */
+#define DIR_DELEGATIONS_MAX 64
+#define DIR_DELEGATION_HOT_LOOKUPS 8
+#define DIR_DELEGATION_HOT_SLOTS 64
+
+struct dir_delegation {
+    struct list_entry       client_entry; /* in client.state.dir_delegations */
+    nfs41_abs_path          path;
+    nfs41_path_fh           file;
+    stateid4                stateid;
+    bool_t                  granted; /* FALSE while the request is sent */
+    bool_t                  recalled;
+};
+
+#define dir_deleg_entry(pos) \
+    list_container(pos, struct dir_delegation, client_entry)
+
+/* server lookups per directory, see dir_delegation_hot() */
+static struct {
+    SRWLOCK                 lock;
+    struct {
+        const nfs41_superblock *superblock;
+        uint64_t            fileid;
+        uint32_t            lookups;
+    } slots[DIR_DELEGATION_HOT_SLOTS];
+} dir_heat = { SRWLOCK_INIT };
+
+static bool_t dir_delegation_hot(
+    IN const nfs41_fh *fh)
+{
+    const uint32_t i = (uint32_t)(fh->fileid % DIR_DELEGATION_HOT_SLOTS);
+    bool_t hot = FALSE;
+
+    AcquireSRWLockExclusive(&dir_heat.lock);
+    if ((dir_heat.slots[i].superblock != fh->superblock) ||
+        (dir_heat.slots[i].fileid != fh->fileid)) {
+        /* take over the slot */
+        dir_heat.slots[i].superblock = fh->superblock;
+        dir_heat.slots[i].fileid = fh->fileid;
+        dir_heat.slots[i].lookups = 0;
+    }
+    if (++dir_heat.slots[i].lookups >= DIR_DELEGATION_HOT_LOOKUPS) {
+        dir_heat.slots[i].lookups = 0;
+        hot = TRUE;
+    }
+    ReleaseSRWLockExclusive(&dir_heat.lock);
+    return hot;
+}
+
+/* expects client.state.lock held */
+static struct dir_delegation *dir_delegation_find_fh(
+    IN nfs41_client *client,
+    IN const nfs41_fh *fh)
+{
+    struct list_entry *entry;
+    struct dir_delegation *dir;
+
+    list_for_each(entry, &client->state.dir_delegations) {
+        dir = dir_deleg_entry(entry);
+        if ((dir->file.fh.len == fh->len) &&
+            (memcmp(dir->file.fh.fh, fh->fh, fh->len) == 0))
+            return dir;
+    }
+    return NULL;
+}
+
+/* expects client.state.lock held */
+static struct dir_delegation *dir_delegation_find_stateid(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid)
+{
+    struct list_entry *entry;
+    struct dir_delegation *dir;
+
+    list_for_each(entry, &client->state.dir_delegations) {
+        dir = dir_deleg_entry(entry);
+        if (dir->granted && (memcmp(dir->stateid.other, stateid->other,
+            NFS4_STATEID_OTHER) == 0))
+            return dir;
+    }
+    return NULL;
+}
+
+static void dir_delegation_unlink(
+    IN nfs41_client *client,
+    IN struct dir_delegation *dir)
+{
+    EnterCriticalSection(&client->state.lock);
+    list_remove(&dir->client_entry);
+    client->state.dir_delegation_count--;
+    LeaveCriticalSection(&client->state.lock);
+}
+
+void nfs41_dir_delegation_hint(
+    IN nfs41_session *session,
+    IN const nfs41_path_fh *file,
+    IN bool_t listing)
+{
+    nfs41_client *client = session->client;
+    struct dir_delegation *dir;
+    nfs41_file_info info;
+    bitmap4 types = { 0 }, notification;
+    stateid_arg stateid;
+    size_t path_len;
+    int status;
+
+    if (client->state.dir_delegation_unsupported ||
+        (file->fh.superblock == NULL))
+        return;
+    if (!listing && !dir_delegation_hot(&file->fh))
+        return;
+
+    dir = calloc(1, sizeof(struct dir_delegation));
+    if (dir == NULL)
+        return;
+
+    /* copy the path up to and including the directory's name */
+    AcquireSRWLockShared(&file->path->lock);
+    path_len = (size_t)(file->name.name + file->name.len - file->path->path);
+    (void)memcpy(dir->path.path, file->path->path, path_len);
+    dir->path.path[path_len] = '\0';
+    dir->path.len = (unsigned short)path_len;
+    ReleaseSRWLockShared(&file->path->lock);
+    InitializeSRWLock(&dir->path.lock);
+    path_fh_init(&dir->file, &dir->path);
+    last_component(dir->path.path, dir->path.path + dir->path.len,
+        &dir->file.name);
+    fh_copy(&dir->file.fh, &file->fh);
+
+    /* register it first, so concurrent hints don't ask twice */
+    EnterCriticalSection(&client->state.lock);
+    if ((client->state.dir_delegation_count >= DIR_DELEGATIONS_MAX) ||
+        dir_delegation_find_fh(client, &file->fh)) {
+        LeaveCriticalSection(&client->state.lock);
+        free(dir);
+        return;
+    }
+    list_add_tail(&client->state.dir_delegations, &dir->client_entry);
+    client->state.dir_delegation_count++;
+    LeaveCriticalSection(&client->state.lock);
+
+    bitmap_set(&types, 0, (1UL << NOTIFY4_REMOVE_ENTRY) |
+        (1UL << NOTIFY4_ADD_ENTRY) | (1UL << NOTIFY4_RENAME_ENTRY) |
+        (1UL << NOTIFY4_CHANGE_DIR_ATTRS) |
+        (1UL << NOTIFY4_CHANGE_COOKIE_VERIFIER));
+
+    ZeroMemory(&info, sizeof(info));
+    status = nfs41_get_dir_delegation(session, &dir->file, &types,
+        &stateid.stateid, &notification, &info);
+    if (status) {
+        DPRINTF(DGLVL, ("nfs41_dir_delegation_hint('%s'): "
+            "nfs41_get_dir_delegation() failed with '%s'\n",
+            dir->path.path, nfs_error_string(status)));
+        if (status == NFS4ERR_NOTSUPP)
+            client->state.dir_delegation_unsupported = TRUE;
+        dir_delegation_unlink(client, dir);
+        free(dir);
+        return;
+    }
+
+    /* without entry notifications the grant is of no use to us */
+    if (!bitmap_isset(&notification, 0, (1UL << NOTIFY4_REMOVE_ENTRY)) ||
+        !bitmap_isset(&notification, 0, (1UL << NOTIFY4_ADD_ENTRY)) ||
+        !bitmap_isset(&notification, 0, (1UL << NOTIFY4_RENAME_ENTRY))) {
+        DPRINTF(DGLVL, ("nfs41_dir_delegation_hint('%s'): server "
+            "declined entry notifications, returning\n", dir->path.path));
+        stateid.type = STATEID_DELEG_DIR;
+        stateid.open = NULL;
+        stateid.delegation = NULL;
+        (void)nfs41_delegreturn(session, &dir->file, &stateid, TRUE);
+        dir_delegation_unlink(client, dir);
+        free(dir);
+        return;
+    }
+
+    DPRINTF(DGLVL, ("nfs41_dir_delegation_hint('%s'): granted (%s)\n",
+        dir->path.path, listing ? "listing" : "lookups"));
+
+    /*
+     * Publish the stateid before the directory is marked delegated, so
+     * CB_NOTIFY and CB_RECALL find it from then on; the name cache is
+     * updated under the lock too, so a recall can't return (and free)
+     * it before the directory is marked
+     */
+    EnterCriticalSection(&client->state.lock);
+    stateid4_cpy(&dir->stateid, &stateid.stateid);
+    dir->granted = TRUE;
+    /* keep the directory cached without timeout */
+    nfs41_name_cache_insert(session_name_cache(session),
+        BIT2BOOL(dir->file.fh.superblock->case_insensitive),
+        dir->path.path, &dir->file.name, &dir->file.fh,
+        &info, NULL, OPEN_DELEGATE_READ);
+    LeaveCriticalSection(&client->state.lock);
+}
+
+bool_t nfs41_dir_delegation_held(
+    IN nfs41_client *client,
+    IN const nfs41_fh *fh)
+{
+    struct dir_delegation *dir;
+    bool_t held;
+
+    EnterCriticalSection(&client->state.lock);
+    dir = dir_delegation_find_fh(client, fh);
+    held = dir && dir->granted && !dir->recalled;
+    LeaveCriticalSection(&client->state.lock);
+    return held;
+}
+
+int nfs41_dir_delegation_notify(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid,
+    IN const struct notify_dir_entry *entries,
+    IN uint32_t entry_count)
+{
+    struct nfs41_name_cache *cache = client_name_cache(client);
+    struct dir_delegation *dir;
+    nfs41_abs_path path;
+    nfs41_component name, child;
+    nfs41_fh fh;
+    bool case_insensitive;
+    uint32_t i;
+    int status = NFS4_OK;
+
+    EnterCriticalSection(&client->state.lock);
+    dir = dir_delegation_find_stateid(client, stateid);
+    if (dir == NULL) {
+        LeaveCriticalSection(&client->state.lock);
+        status = NFS4ERR_BAD_STATEID;
+        goto out;
+    }
+    /* the recall workers may free |dir| once we drop the lock */
+    abs_path_copy(&path, &dir->path);
+    fh_copy(&fh, &dir->file.fh);
+    LeaveCriticalSection(&client->state.lock);
+    last_component(path.path, path.path + path.len, &name);
+
+    case_insensitive = BIT2BOOL(fh.superblock->case_insensitive);
+
+    for (i = 0; i < entry_count; i++) {
+        DPRINTF(DGLVL, ("nfs41_dir_delegation_notify('%s'): "
+            "type %u '%s'\n", path.path,
+            (unsigned int)entries[i].type, entries[i].name));
+        if (entries[i].len) {
+            child.name = entries[i].name;
+            child.len = entries[i].len;
+            (void)nfs41_name_cache_dir_notify(cache, case_insensitive,
+                path.path, &name, &child);
+        }
+    }
+    /* any change to the contents also changes the directory */
+    (void)nfs41_name_cache_dir_notify(cache, case_insensitive,
+        path.path, &name, NULL);
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+    nfs41_readdir_cache_invalidate(&fh);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+    nfs41_dirnotify_changed(&fh);
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
+out:
+    return status;
+}
+
+/* return a directory delegation; called by the recall workers */
+static void dir_delegation_return(
+    IN nfs41_client *client,
+    IN struct dir_delegation *dir)
+{
+    stateid_arg stateid;
+    int status;
+
+    stateid.type = STATEID_DELEG_DIR;
+    stateid.open = NULL;
+    stateid.delegation = NULL;
+    stateid4_cpy(&stateid.stateid, &dir->stateid);
+
+    /* also puts the directory back on the name cache timeouts */
+    status = nfs41_delegreturn(client->session, &dir->file, &stateid, TRUE);
+    if (status)
+        DPRINTF(DGLVL, ("dir_delegation_return('%s'): "
+            "nfs41_delegreturn() failed with '%s'\n",
+            dir->path.path, nfs_error_string(status)));
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+    nfs41_readdir_cache_invalidate(&dir->file.fh);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+
+    dir_delegation_unlink(client, dir);
+    free(dir);
+}
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+
+
+/*
+ * asynchronous delegation recall
+ *
+ * The callback thread can't make rpc calls, so recalls are queued and
+ * handed to a small pool of worker threads. Workers are started on
+ * demand (up to |RECALL_WORKERS_MAX|) and exit after being idle for
+ * |RECALL_WORKER_IDLE_TIMEOUT| milliseconds, so a mass recall no longer
+ * creates one thread per CB_RECALL.
+ */
+#define RECALL_WORKERS_MAX 8
+#define RECALL_WORKER_IDLE_TIMEOUT (30*1000)
+
 struct recall_thread_args {
+    struct list_entry       entry;
     nfs41_client            *client;
     nfs41_delegation_state  *delegation;
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+    struct dir_delegation   *dir; /* if |delegation| is NULL */
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
     bool_t                  truncate;
 };
 
+static struct recall_queue {
+    SRWLOCK                 lock;
+    CONDITION_VARIABLE      cond;
+    struct list_entry       head;
+    bool_t                  initialized;
+    unsigned int            num_workers;
+    unsigned int            num_idle;
+} recall_queue = { SRWLOCK_INIT, CONDITION_VARIABLE_INIT };
+
+#define recall_entry(pos) list_container(pos, struct recall_thread_args, entry)
+
+/* caller must hold |recall_queue.lock| exclusive */
+static struct recall_thread_args *recall_queue_pop(
+    IN const nfs41_client *last_client)
+{
+    struct list_entry *entry;
+    struct recall_thread_args *recall = NULL;
+
+    if (list_empty(&recall_queue.head))
+        goto out;
+
+    /*
+     * Prefer recalls against the server we just talked to, so the
+     * flushes for one server are done back-to-back by one worker
+     */
+    if (last_client) {
+        list_for_each(entry, &recall_queue.head) {
+            if (recall_entry(entry)->client == last_client) {
+                recall = recall_entry(entry);
+                break;
+            }
+        }
+    }
+    if (recall == NULL)
+        recall = recall_entry(recall_queue.head.next);
+    list_remove(&recall->entry);
+out:
+    return recall;
+}
+
 static unsigned int WINAPI delegation_recall_thread(void *args)
 {
-    struct recall_thread_args *recall = (struct recall_thread_args*)args;
+    struct recall_thread_args *recall;
+    nfs41_client *last_client = NULL;
+
+    (void)args;
+
+    AcquireSRWLockExclusive(&recall_queue.lock);
+    for (;;) {
+        recall = recall_queue_pop(last_client);
+        if (recall == NULL) {
+            recall_queue.num_idle++;
+            if (!SleepConditionVariableSRW(&recall_queue.cond,
+                &recall_queue.lock, RECALL_WORKER_IDLE_TIMEOUT, 0)) {
+                recall_queue.num_idle--;
+                if (list_empty(&recall_queue.head))
+                    break;
+            } else {
+                recall_queue.num_idle--;
+            }
+            continue;
+        }
+        ReleaseSRWLockExclusive(&recall_queue.lock);
 
-    delegation_return(recall->client, recall->delegation, recall->truncate, TRUE);
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+        if (recall->delegation == NULL) {
+            dir_delegation_return(recall->client, recall->dir);
+            goto out_recall;
+        }
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+        delegation_return(recall->client, recall->delegation,
+            recall->truncate, TRUE);
+
+        /* clean up recall arguments */
+        nfs41_delegation_deref(recall->delegation);
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+out_recall:
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+        last_client = recall->client;
+        nfs41_root_deref(recall->client->root);
+        free(recall);
+
+        AcquireSRWLockExclusive(&recall_queue.lock);
+    }
+    recall_queue.num_workers--;
+    ReleaseSRWLockExclusive(&recall_queue.lock);
 
-    /* clean up thread arguments */
-    nfs41_delegation_deref(recall->delegation);
-    nfs41_root_deref(recall->client->root);
-    free(recall);
+    DPRINTF(DGLVL, ("delegation_recall_thread: idle worker exiting\n"));
     return 0;
 }
 
-static int deleg_stateid_cmp(const struct list_entry *entry, const void *value)
+static int recall_queue_add(
+    IN struct recall_thread_args *args)
 {
-    const stateid4 *lhs = &deleg_entry(entry)->state.stateid;
-    const stateid4 *rhs = (const stateid4*)value;
-    return memcmp(lhs->other, rhs->other, NFS4_STATEID_OTHER);
+    struct list_entry *entry;
+    HANDLE thread;
+    int status = NFS4_OK;
+
+    AcquireSRWLockExclusive(&recall_queue.lock);
+    if (!recall_queue.initialized) {
+        list_init(&recall_queue.head);
+        recall_queue.initialized = TRUE;
+    }
+
+    /* one queued recall per file is enough */
+    list_for_each(entry, &recall_queue.head) {
+        if ((recall_entry(entry)->delegation == args->delegation)
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+            && (recall_entry(entry)->dir == args->dir)
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+            ) {
+            status = ERROR_ALREADY_EXISTS;
+            goto out_unlock;
+        }
+    }
+
+    list_add_tail(&recall_queue.head, &args->entry);
+
+    if ((recall_queue.num_idle == 0) &&
+        (recall_queue.num_workers < RECALL_WORKERS_MAX)) {
+        thread = (HANDLE)_beginthreadex(NULL,
+            NFSD_THREAD_STACK_SIZE,
+            delegation_recall_thread,
+            NULL,
+            0,
+            NULL);
+        if (thread) {
+            recall_queue.num_workers++;
+            (void)CloseHandle(thread);
+        } else {
+            eprintf("recall_queue_add: _beginthreadex() failed with %d\n",
+                (int)GetLastError());
+            if (recall_queue.num_workers == 0) {
+                /* nobody would ever pick this up */
+                list_remove(&args->entry);
+                status = NFS4ERR_SERVERFAULT;
+                goto out_unlock;
+            }
+        }
+    }
+    WakeConditionVariable(&recall_queue.cond);
+out_unlock:
+    ReleaseSRWLockExclusive(&recall_queue.lock);
+    return status;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+/* CB_RECALL of a directory delegation */
+static int dir_delegation_recall(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid)
+{
+    struct dir_delegation *dir;
+    struct recall_thread_args *args;
+    int status = NFS4_OK;
+
+    EnterCriticalSection(&client->state.lock);
+    dir = dir_delegation_find_stateid(client, stateid);
+    if (dir == NULL) {
+        status = NFS4ERR_BADHANDLE;
+    } else if (dir->recalled) {
+        /* return BADHANDLE if we've already responded to CB_RECALL */
+        status = NFS4ERR_BADHANDLE;
+    } else {
+        dir->recalled = TRUE;
+    }
+    LeaveCriticalSection(&client->state.lock);
+    if (status)
+        goto out;
+
+    args = calloc(1, sizeof(struct recall_thread_args));
+    if (args == NULL) {
+        status = NFS4ERR_SERVERFAULT;
+        eprintf("dir_delegation_recall() failed to allocate arguments\n");
+        goto out;
+    }
+
+    /* hold a reference on the root */
+    nfs41_root_ref(client->root);
+    args->client = client;
+    args->dir = dir;
+
+    status = recall_queue_add(args);
+    if (status == ERROR_ALREADY_EXISTS) {
+        status = NFS4_OK;
+        goto out_args;
+    } else if (status) {
+        eprintf("dir_delegation_recall() failed to queue recall\n");
+        goto out_args;
+    }
+out:
+    return status;
+
+out_args:
+    free(args);
+    nfs41_root_deref(client->root);
+    goto out;
 }
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
 
 int nfs41_delegation_recall(
     IN nfs41_client *client,
@@ -717,9 +2246,16 @@ int nfs41_delegation_recall(
     /* search for the delegation by stateid instead of filehandle;
      * deleg_file_cmp() relies on a proper superblock and fileid,
      * which we don't get with CB_RECALL */
-    status = delegation_find(client, stateid, deleg_stateid_cmp, &deleg);
+    status = delegation_find(client, DELEG_BY_STATEID, stateid, &deleg);
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+    if (status) {
+        status = dir_delegation_recall(client, stateid);
+        goto out;
+    }
+#else
     if (status)
         goto out;
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
 
     AcquireSRWLockExclusive(&deleg->lock);
     if (deleg->state.recalled) {
@@ -739,7 +2275,7 @@ int nfs41_delegation_recall(
     if (status != NFS4ERR_DELEG_REVOKED)
         goto out_deleg;
 
-    /* allocate thread arguments */
+    /* allocate recall arguments */
     args = calloc(1, sizeof(struct recall_thread_args));
     if (args == NULL) {
         status = NFS4ERR_SERVERFAULT;
@@ -753,19 +2289,22 @@ int nfs41_delegation_recall(
     args->delegation = deleg;
     args->truncate = truncate;
 
-    /* the callback thread can't make rpc calls, so spawn a separate thread */
-    if (_beginthreadex(NULL,
-        NFSD_THREAD_STACK_SIZE,
-        delegation_recall_thread,
-        args,
-        0,
-        NULL) == 0) {
-        status = NFS4ERR_SERVERFAULT;
-        eprintf("nfs41_delegation_recall() failed to start thread\n");
+    /* hand the recall to the worker pool */
+    status = recall_queue_add(args);
+    if (status == ERROR_ALREADY_EXISTS) {
+        /* a worker already has this recall queued */
+        status = NFS4_OK;
+        goto out_args;
+    } else if (status) {
+        eprintf("nfs41_delegation_recall() failed to queue recall\n");
         goto out_args;
     }
     status = NFS4_OK;
 out:
+    NFSD_TRACE_EVENT("DelegationRecall", NFSD_TRACE_KEYWORD_DELEGATION,
+        TraceLoggingUInt32(stateid->seqid, "Seqid"),
+        TraceLoggingBool(truncate, "Truncate"),
+        TraceLoggingUInt32(status, "NfsStatus"));
     DPRINTF(DGLVL, ("<-- nfs41_delegation_recall() returning '%s'\n",
         nfs_error_string(status)));
     return status;
@@ -779,14 +2318,6 @@ out_deleg:
 }
 
 
-static int deleg_fh_cmp(const struct list_entry *entry, const void *value)
-{
-    const nfs41_fh *lhs = &deleg_entry(entry)->file.fh;
-    const nfs41_fh *rhs = (const nfs41_fh*)value;
-    if (lhs->len != rhs->len) return -1;
-    return memcmp(lhs->fh, rhs->fh, lhs->len);
-}
-
 int nfs41_delegation_getattr(
     IN nfs41_client *client,
     IN const nfs41_fh *fh,
@@ -800,7 +2331,7 @@ int nfs41_delegation_getattr(
     DPRINTF(2, ("--> nfs41_delegation_getattr()\n"));
 
     /* search for a delegation on this file handle */
-    status = delegation_find(client, fh, deleg_fh_cmp, &deleg);
+    status = delegation_find(client, DELEG_BY_FH, fh, &deleg);
     if (status)
         goto out;
 
@@ -823,6 +2354,16 @@ int nfs41_delegation_getattr(
         status = NFS4ERR_BADHANDLE;
         goto out_deleg;
     }
+
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+    /* the attribute cache has the timestamps we own */
+    if (deleg->state.attrs_deleg) {
+        if (bitmap_isset(attr_request, 2, FATTR4_WORD2_TIME_DELEG_ACCESS))
+            bitmap_set(&info->attrmask, 2, FATTR4_WORD2_TIME_DELEG_ACCESS);
+        if (bitmap_isset(attr_request, 2, FATTR4_WORD2_TIME_DELEG_MODIFY))
+            bitmap_set(&info->attrmask, 2, FATTR4_WORD2_TIME_DELEG_MODIFY);
+    }
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
 out_deleg:
     nfs41_delegation_deref(deleg);
 out:
@@ -839,9 +2380,18 @@ void nfs41_client_delegation_free(
 
     EnterCriticalSection(&client->state.lock);
     list_for_each_tmp (entry, tmp, &client->state.delegations) {
+        nfs41_delegation_state *deleg = deleg_entry(entry);
+        delegation_unlink(deleg);
+        nfs41_delegation_deref(deleg);
+    }
+    client->state.delegation_count = 0;
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+    list_for_each_tmp (entry, tmp, &client->state.dir_delegations) {
         list_remove(entry);
-        nfs41_delegation_deref(deleg_entry(entry));
+        free(dir_deleg_entry(entry));
     }
+    client->state.dir_delegation_count = 0;
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
     LeaveCriticalSection(&client->state.lock);
 }
 
@@ -910,16 +2460,16 @@ int nfs41_client_delegation_return_lru(
     IN nfs41_client *client)
 {
     struct list_entry *entry;
-    nfs41_delegation_state *state = NULL;
+    nfs41_delegation_state *state, *coldest = NULL;
+    const util_reltimestamp now = UTIL_GETRELTIME();
+    uint32_t heat, coldest_heat = 0;
+    bool_t granted;
     int status = NFS4ERR_BADHANDLE;
 
-    /* starting from the least recently opened, find and return
-     * the first delegation that's not 'in use' (currently open) */
-
-    /* TODO: use a more robust algorithm, taking into account:
-     *  -number of total opens
-     *  -time since last operation on an associated open, or
-     *  -number of operations/second over last n seconds */
+    /* find and return the coldest delegation that's not 'in use'
+     * (currently open), see delegation_heat().  the list is ordered
+     * from least to most recently used, so the first of several equally
+     * cold delegations is the least recently used one */
     EnterCriticalSection(&client->state.lock);
     list_for_each(entry, &client->state.delegations) {
         state = deleg_entry(entry);
@@ -929,20 +2479,113 @@ int nfs41_client_delegation_return_lru(
         if (state->ref_count > 1)
             continue;
 
-        AcquireSRWLockExclusive(&state->lock);
-        if (state->status == DELEGATION_GRANTED) {
+        heat = delegation_heat(state, now);
+        if (coldest && heat >= coldest_heat)
+            continue;
+
+        AcquireSRWLockShared(&state->lock);
+        granted = state->status == DELEGATION_GRANTED;
+        ReleaseSRWLockShared(&state->lock);
+        if (!granted)
+            continue;
+
+        coldest = state;
+        coldest_heat = heat;
+        if (heat == 0)
+            break; /* can't get any colder */
+    }
+
+    if (coldest) {
+        AcquireSRWLockExclusive(&coldest->lock);
+        if (coldest->status == DELEGATION_GRANTED) {
             /* start returning the delegation */
-            state->status = DELEGATION_RETURNING;
+            coldest->status = DELEGATION_RETURNING;
             status = NFS4ERR_DELEG_REVOKED;
         }
-        ReleaseSRWLockExclusive(&state->lock);
-
-        if (status == NFS4ERR_DELEG_REVOKED)
-            break;
+        ReleaseSRWLockExclusive(&coldest->lock);
     }
     LeaveCriticalSection(&client->state.lock);
 
-    if (status == NFS4ERR_DELEG_REVOKED)
-        status = delegation_return(client, state, FALSE, TRUE);
+    if (status == NFS4ERR_DELEG_REVOKED) {
+        DPRINTF(DGLVL, ("nfs41_client_delegation_return_lru: "
+            "returning '%s' (heat %u)\n",
+            coldest->path.path, (unsigned int)coldest_heat));
+        status = delegation_return(client, coldest, FALSE, TRUE);
+    }
     return status;
 }
+
+/* background return of cold delegations, see delegation_heat() */
+static unsigned int WINAPI delegation_trim_thread(void *args)
+{
+    nfs41_client *client = (nfs41_client *)args;
+    bool_t done;
+
+    do {
+        /* re-read the limit, it changes with the memory state */
+        const uint32_t limit = delegation_limit();
+
+        EnterCriticalSection(&client->state.lock);
+        done = (limit == 0) ||
+            (client->state.delegation_count <= ((limit / 4) * 3));
+        LeaveCriticalSection(&client->state.lock);
+
+        /* stop if there is nothing left we can return */
+        if (!done && nfs41_client_delegation_return_lru(client))
+            done = TRUE;
+    } while (!done);
+
+    EnterCriticalSection(&client->state.lock);
+    client->state.delegation_trim_running = FALSE;
+    LeaveCriticalSection(&client->state.lock);
+
+    nfs41_root_deref(client->root);
+    return 0;
+}
+
+/*
+ * start delegation_trim_thread(); expects the caller to have set
+ * client.state.delegation_trim_running
+ */
+static void delegation_trim_start(
+    IN nfs41_client *client)
+{
+    HANDLE thread;
+
+    /* hold a reference on the root */
+    nfs41_root_ref(client->root);
+
+    thread = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
+        delegation_trim_thread, client, 0, NULL);
+    if (thread == NULL) {
+        eprintf("delegation_trim_start: _beginthreadex() failed with %d\n",
+            (int)GetLastError());
+        EnterCriticalSection(&client->state.lock);
+        client->state.delegation_trim_running = FALSE;
+        LeaveCriticalSection(&client->state.lock);
+        nfs41_root_deref(client->root);
+        return;
+    }
+    (void)CloseHandle(thread);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+void nfs41_client_delegation_trim(
+    IN nfs41_client *client)
+{
+    const uint32_t max_delegations = delegation_limit();
+    bool_t start_trim = FALSE;
+
+    EnterCriticalSection(&client->state.lock);
+    if (max_delegations &&
+        (client->state.delegation_count > ((max_delegations / 4) * 3)) &&
+        (!client->state.delegation_trim_running)) {
+        client->state.delegation_trim_running = TRUE;
+        start_trim = TRUE;
+    }
+    LeaveCriticalSection(&client->state.lock);
+
+    if (start_trim)
+        delegation_trim_start(client);
+}
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
@@ -39,6 +39,12 @@ void nfs41_delegation_deref(
 void nfs41_client_delegation_free(
     IN nfs41_client *client);
 
+/* call after changing the stateid of a delegation, without holding
+ * |deleg->lock| */
+void nfs41_delegation_rehash_stateid(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg);
+
 
 /* open delegation */
 int nfs41_delegation_granted(
@@ -89,6 +95,74 @@ int nfs41_delegation_recall(
     IN const stateid4 *stateid,
     IN bool_t truncate);
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+/* write-behind of UNSTABLE4 writes under a write delegation;
+ * returns a referenced delegation, or NULL if |state| has none */
+nfs41_delegation_state *nfs41_delegation_write_behind_get(
+    IN nfs41_open_state *state);
+
+/* record an uncommitted write and keep a copy of |data|; fails with
+ * NFS4ERR_DELAY if the caller must send the COMMIT itself, and with
+ * NFS4ERR_IO if uncommitted writes were lost and could not be
+ * written again */
+int nfs41_delegation_write_behind(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN const unsigned char *data,
+    IN uint64_t offset,
+    IN uint32_t length,
+    IN const nfs41_write_verf *verf);
+
+/* commit the uncommitted writes under the delegation of |state|;
+ * also returns a COMMIT or resend failure of the write-behind thread
+ * since the last call */
+int nfs41_delegation_write_behind_flush_open(
+    IN nfs41_open_state *state);
+
+void nfs41_delegation_write_behind_flush_root(
+    IN nfs41_root *root);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+struct notify_dir_entry;
+
+/* directory delegations; |listing| requests one right away, lookups
+ * only once the directory turns out to be hot */
+void nfs41_dir_delegation_hint(
+    IN nfs41_session *session,
+    IN const nfs41_path_fh *file,
+    IN bool_t listing);
+
+bool_t nfs41_dir_delegation_held(
+    IN nfs41_client *client,
+    IN const nfs41_fh *fh);
+
+/* CB_NOTIFY; must not make any rpc calls */
+int nfs41_dir_delegation_notify(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid,
+    IN const struct notify_dir_entry *entries,
+    IN uint32_t entry_count);
+
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+/* drop the cached READDIR listing of a directory (readdir.c) */
+void nfs41_readdir_cache_invalidate(
+    IN const nfs41_fh *fh);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+/* delegated timestamps (RFC 9754); returns TRUE if a SETATTR of only
+ * the times of |info| was kept local, and sets |info->change| */
+bool_t nfs41_delegation_set_times(
+    IN nfs41_open_state *state,
+    IN OUT nfs41_file_info *info);
+
+/* time_modify update after a WRITE */
+void nfs41_delegation_modified(
+    IN nfs41_open_state *state);
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
+
 int nfs41_delegation_getattr(
     IN nfs41_client *client,
     IN const nfs41_fh *fh,
@@ -106,4 +180,15 @@ int nfs41_client_delegation_recovery(
 int nfs41_client_delegation_return_lru(
     IN nfs41_client *client);
 
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+/* start returning cold delegations above the current limit */
+void nfs41_client_delegation_trim(
+    IN nfs41_client *client);
+
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+/* drop all cached READDIR listings (readdir.c) */
+void nfs41_readdir_cache_trim(void);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+
 #endif /* !DELEGATION_H */
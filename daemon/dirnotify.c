@@ -0,0 +1,441 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+/*
+ * dirnotify.c - directory change notification
+ *
+ * The kernel sends a |NFS41_SYSOP_DIR_NOTIFY| upcall for each
+ * |IRP_MN_NOTIFY_CHANGE_DIRECTORY| and keeps the IRP pending until
+ * the daemon makes a |IOCTL_NFS41_DIR_NOTIFY| downcall for the
+ * |srv_open| of the directory.
+ * The upcall arms a watch for the open directory; a watch stays on
+ * |dirnotify.list| until the directory is closed, and changes seen
+ * while no IRP is pending fire when the next one arms the watch.
+ *
+ * Directories with a directory delegation are woken up by CB_NOTIFY
+ * through |nfs41_dirnotify_changed()|. All other watched directories
+ * are polled by a single thread every |DIRNOTIFY_POLL_INTERVAL_MS|,
+ * which fetches the change attributes of all directories of one
+ * session with |nfs41_getattr_batch()|.
+ * Only the directory's own change attribute is compared, so file
+ * renames, creates and deletes are reported, but changes to the
+ * attributes of the files in the directory are not.
+ */
+
+#include <Windows.h>
+#include <stdlib.h>
+#include <process.h>
+#include <devioctl.h>
+
+#include "nfs41_build_features.h"
+#include "dirnotify.h"
+#include "nfs41_ops.h"
+#include "delegation.h"
+#include "upcall.h"
+#include "daemon_debug.h"
+#include "util.h"
+#include "list.h"
+#include "nfs41_driver.h" /* for |IOCTL_NFS41_DIR_NOTIFY| */
+
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+
+#define DNLVL 2 /* dprintf level for dir notify logging */
+
+#define DIRNOTIFY_POLL_INTERVAL_MS 2000
+
+typedef struct _dirnotify_watch {
+    struct list_entry entry; /* in |dirnotify.list| */
+    nfs41_open_state *state; /* holds a reference */
+    uint64_t change; /* last change attribute reported */
+    ULONG filter; /* |FILE_NOTIFY_CHANGE_*| */
+    bool armed; /* the kernel has a pending IRP */
+    bool notified; /* CB_NOTIFY arrived */
+} dirnotify_watch;
+
+static struct {
+    SRWLOCK lock;
+    struct list_entry list;
+    uint32_t count;
+    HANDLE event; /* wakes up the poll thread */
+    bool thread_started;
+} dirnotify = { .lock = SRWLOCK_INIT, .list = { &dirnotify.list, &dirnotify.list } };
+
+/* snapshot of a watch for one poll cycle */
+typedef struct _dirnotify_poll_entry {
+    nfs41_open_state *state; /* holds a reference */
+    bool fire;
+} dirnotify_poll_entry;
+
+/* Must be called with |dirnotify.lock| held */
+static dirnotify_watch *dirnotify_find(
+    IN const nfs41_open_state *state)
+{
+    struct list_entry *entry;
+
+    list_for_each(entry, &dirnotify.list) {
+        dirnotify_watch *w = list_container(entry, dirnotify_watch, entry);
+        if (w->state == state)
+            return w;
+    }
+    return NULL;
+}
+
+static void dirnotify_downcall(
+    IN HANDLE srv_open)
+{
+    HANDLE pipe;
+    DWORD outbuf_len;
+
+    DPRINTF(DNLVL, ("dirnotify_downcall: srv_open=0x%p\n", srv_open));
+
+    pipe = create_nfs41sys_device_pipe();
+    if (pipe == INVALID_HANDLE_VALUE) {
+        eprintf("dirnotify_downcall: "
+            "Unable to open downcall pipe, lasterr=%d\n",
+            (int)GetLastError());
+        return;
+    }
+    if (!DeviceIoControl(pipe, IOCTL_NFS41_DIR_NOTIFY,
+        &srv_open, sizeof(HANDLE), NULL, 0, &outbuf_len, NULL))
+        eprintf("IOCTL_NFS41_DIR_NOTIFY failed %d\n", (int)GetLastError());
+    close_nfs41sys_device_pipe(pipe);
+}
+
+static int dirnotify_session_cmp(
+    const void *a,
+    const void *b)
+{
+    const nfs41_session *sa = ((const dirnotify_poll_entry *)a)->state->session;
+    const nfs41_session *sb = ((const dirnotify_poll_entry *)b)->state->session;
+
+    if (sa == sb)
+        return 0;
+    return (sa < sb)?-1:1;
+}
+
+/* GETATTR(change) for |count| directories of the same session */
+static void dirnotify_poll_session(
+    IN dirnotify_poll_entry *entries,
+    IN uint32_t count)
+{
+    nfs41_path_fh **files;
+    nfs41_file_info *infos;
+    int *statuses;
+    bitmap4 attr_request;
+    dirnotify_watch *w;
+    uint32_t i;
+
+    files = malloc(count * sizeof(nfs41_path_fh *));
+    infos = calloc(count, sizeof(nfs41_file_info));
+    statuses = malloc(count * sizeof(int));
+    if ((files == NULL) || (infos == NULL) || (statuses == NULL))
+        goto out;
+
+    for (i = 0; i < count; i++)
+        files[i] = &entries[i].state->file;
+
+    nfs41_superblock_getattr_profile(files[0]->fh.superblock,
+        NFS41_GETATTR_PROFILE_CHANGE, &attr_request);
+
+    (void)nfs41_getattr_batch(entries[0].state->session, count, files,
+        &attr_request, infos, statuses);
+
+    AcquireSRWLockExclusive(&dirnotify.lock);
+    for (i = 0; i < count; i++) {
+        if (statuses[i] != NFS4_OK) {
+            DPRINTF(DNLVL, ("dirnotify_poll_session('%s'): "
+                "getattr failed with '%s'\n",
+                entries[i].state->path.path,
+                nfs_error_string(statuses[i])));
+            continue;
+        }
+        w = dirnotify_find(entries[i].state);
+        if (w && w->armed && (w->change != infos[i].change)) {
+            DPRINTF(DNLVL, ("dirnotify_poll_session('%s'): "
+                "change %llu -> %llu\n",
+                entries[i].state->path.path,
+                (unsigned long long)w->change,
+                (unsigned long long)infos[i].change));
+            w->change = infos[i].change;
+            w->armed = false;
+            entries[i].fire = true;
+        }
+    }
+    ReleaseSRWLockExclusive(&dirnotify.lock);
+out:
+    free(statuses);
+    free(infos);
+    free(files);
+}
+
+static void dirnotify_poll(void)
+{
+    dirnotify_poll_entry *entries = NULL;
+    struct list_entry *entry;
+    uint32_t count = 0, npoll, i, j;
+
+    /*
+     * Fire the watches with a CB_NOTIFY, and take a snapshot of the
+     * armed ones which must be polled to the front of |entries|
+     */
+    AcquireSRWLockExclusive(&dirnotify.lock);
+    if (dirnotify.count)
+        entries = malloc(dirnotify.count * sizeof(dirnotify_poll_entry));
+    if (entries == NULL) {
+        ReleaseSRWLockExclusive(&dirnotify.lock);
+        return;
+    }
+    list_for_each(entry, &dirnotify.list) {
+        dirnotify_watch *w = list_container(entry, dirnotify_watch, entry);
+
+        if (!w->armed)
+            continue;
+        if (w->notified) {
+            w->notified = false;
+            w->armed = false;
+        }
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+        /* CB_NOTIFY will tell us */
+        else if (nfs41_dir_delegation_held(w->state->session->client,
+            &w->state->file.fh))
+            continue;
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+        nfs41_open_state_ref(w->state);
+        entries[count].state = w->state;
+        entries[count].fire = !w->armed;
+        count++;
+    }
+    ReleaseSRWLockExclusive(&dirnotify.lock);
+
+    /* the ones to poll, grouped by session */
+    npoll = 0;
+    for (i = 0; i < count; i++) {
+        if (!entries[i].fire) {
+            dirnotify_poll_entry tmp = entries[npoll];
+            entries[npoll++] = entries[i];
+            entries[i] = tmp;
+        }
+    }
+    qsort(entries, npoll, sizeof(dirnotify_poll_entry),
+        dirnotify_session_cmp);
+    for (i = 0; i < npoll; i = j) {
+        for (j = i + 1; (j < npoll) &&
+            (entries[j].state->session == entries[i].state->session); j++)
+            ;
+        dirnotify_poll_session(&entries[i], j - i);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (entries[i].fire)
+            dirnotify_downcall(entries[i].state->srv_open);
+        nfs41_open_state_deref(entries[i].state);
+    }
+    free(entries);
+}
+
+static unsigned int WINAPI dirnotify_thread(void *args)
+{
+    (void)args;
+
+    for (;;) {
+        (void)WaitForSingleObject(dirnotify.event,
+            DIRNOTIFY_POLL_INTERVAL_MS);
+        dirnotify_poll();
+    }
+    return 0;
+}
+
+/* Must be called with |dirnotify.lock| held exclusively */
+static void dirnotify_thread_start(void)
+{
+    HANDLE thread;
+
+    if (dirnotify.thread_started)
+        return;
+
+    dirnotify.event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (dirnotify.event == NULL) {
+        eprintf("dirnotify_thread_start: CreateEventA() failed "
+            "with %d\n", (int)GetLastError());
+        return;
+    }
+    thread = (HANDLE)_beginthreadex(NULL,
+        NFSD_THREAD_STACK_SIZE, dirnotify_thread, NULL, 0, NULL);
+    if (thread == NULL) {
+        eprintf("dirnotify_thread_start: _beginthreadex() failed "
+            "with %d\n", (int)GetLastError());
+        (void)CloseHandle(dirnotify.event);
+        dirnotify.event = NULL;
+        return;
+    }
+    (void)CloseHandle(thread);
+    dirnotify.thread_started = true;
+}
+
+void nfs41_dirnotify_remove(
+    IN nfs41_open_state *state)
+{
+    dirnotify_watch *w;
+
+    AcquireSRWLockExclusive(&dirnotify.lock);
+    w = dirnotify_find(state);
+    if (w) {
+        list_remove(&w->entry);
+        dirnotify.count--;
+    }
+    ReleaseSRWLockExclusive(&dirnotify.lock);
+
+    if (w) {
+        DPRINTF(DNLVL, ("nfs41_dirnotify_remove('%s')\n",
+            state->path.path));
+        nfs41_open_state_deref(w->state);
+        free(w);
+    }
+}
+
+void nfs41_dirnotify_changed(
+    IN const nfs41_fh *fh)
+{
+    struct list_entry *entry;
+    bool wakeup = false;
+
+    AcquireSRWLockExclusive(&dirnotify.lock);
+    list_for_each(entry, &dirnotify.list) {
+        dirnotify_watch *w = list_container(entry, dirnotify_watch, entry);
+        const nfs41_fh *wfh = &w->state->file.fh;
+
+        if ((wfh->len == fh->len) && (!memcmp(wfh->fh, fh->fh, fh->len))) {
+            w->notified = true;
+            wakeup = true;
+        }
+    }
+    if (wakeup && dirnotify.event)
+        (void)SetEvent(dirnotify.event);
+    ReleaseSRWLockExclusive(&dirnotify.lock);
+}
+
+
+/* NFS41_SYSOP_DIR_NOTIFY */
+static int parse_dirnotify(
+    const unsigned char *restrict buffer,
+    uint32_t length,
+    nfs41_upcall *upcall)
+{
+    int status;
+    dirnotify_upcall_args *args = &upcall->args.dirnotify;
+
+    status = safe_read(&buffer, &length, &args->watch_tree,
+        sizeof(args->watch_tree));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->filter,
+        sizeof(args->filter));
+    if (status) goto out;
+
+    EASSERT(length == 0);
+
+    DPRINTF(DNLVL, ("parsing NFS41_SYSOP_DIR_NOTIFY: "
+        "watch_tree=%d filter=0x%lx\n",
+        (int)args->watch_tree, (long)args->filter));
+out:
+    return status;
+}
+
+static int handle_dirnotify(
+    void *daemon_context,
+    nfs41_upcall *upcall)
+{
+    dirnotify_upcall_args *args = &upcall->args.dirnotify;
+    nfs41_open_state *state = upcall->state_ref;
+    dirnotify_watch *w, *new_w = NULL;
+    nfs41_file_info info;
+    bitmap4 attr_request;
+    int status;
+
+    if (state->type != NF4DIR) {
+        status = ERROR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    AcquireSRWLockShared(&dirnotify.lock);
+    w = dirnotify_find(state);
+    ReleaseSRWLockShared(&dirnotify.lock);
+
+    if (w == NULL) {
+        /* first IRP for this handle, changes count from now on */
+        (void)memset(&info, 0, sizeof(info));
+        nfs41_superblock_getattr_profile(state->file.fh.superblock,
+            NFS41_GETATTR_PROFILE_CHANGE, &attr_request);
+        status = nfs41_getattr(state->session, &state->file,
+            &attr_request, &info);
+        if (status) {
+            eprintf("handle_dirnotify('%s'): nfs41_getattr() failed "
+                "with '%s'\n", state->path.path, nfs_error_string(status));
+            status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
+            goto out;
+        }
+
+        new_w = calloc(1, sizeof(dirnotify_watch));
+        if (new_w == NULL) {
+            status = GetLastError();
+            goto out;
+        }
+        new_w->state = state;
+        new_w->change = info.change;
+    }
+
+    AcquireSRWLockExclusive(&dirnotify.lock);
+    w = dirnotify_find(state);
+    if (w == NULL) {
+        if (new_w == NULL) {
+            /* the directory was closed in the meantime */
+            ReleaseSRWLockExclusive(&dirnotify.lock);
+            status = ERROR_INVALID_HANDLE;
+            goto out;
+        }
+        nfs41_open_state_ref(state);
+        list_add_tail(&dirnotify.list, &new_w->entry);
+        dirnotify.count++;
+        w = new_w;
+        new_w = NULL;
+    }
+    w->filter = args->filter;
+    w->armed = true;
+    dirnotify_thread_start();
+    /* a change seen while no IRP was pending fires right away */
+    if (w->notified && dirnotify.event)
+        (void)SetEvent(dirnotify.event);
+    ReleaseSRWLockExclusive(&dirnotify.lock);
+
+    DPRINTF(DNLVL, ("handle_dirnotify('%s'): armed, watch_tree=%d\n",
+        state->path.path, (int)args->watch_tree));
+    status = NO_ERROR;
+out:
+    free(new_w);
+    return status;
+}
+
+const nfs41_upcall_op nfs41_op_dirnotify = {
+    .parse = parse_dirnotify,
+    .handle = handle_dirnotify,
+    .arg_size = sizeof(dirnotify_upcall_args)
+};
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
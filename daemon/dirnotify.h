@@ -0,0 +1,40 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+
+#ifndef __NFS41_DAEMON_DIRNOTIFY_H__
+#define __NFS41_DAEMON_DIRNOTIFY_H__ 1
+
+#include "nfs41_build_features.h"
+#include "nfs41.h"
+
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+/* Remove the watch of |state|; called when the directory is closed */
+void nfs41_dirnotify_remove(
+    IN nfs41_open_state *state);
+
+/* CB_NOTIFY for directory |fh|; must not make any rpc calls */
+void nfs41_dirnotify_changed(
+    IN const nfs41_fh *fh);
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
+
+#endif /* !__NFS41_DAEMON_DIRNOTIFY_H__ */
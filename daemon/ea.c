@@ -31,6 +31,8 @@
 #include "upcall.h"
 #include "daemon_debug.h"
 #include "nfs_ea.h"
+#include "nfs41_build_features.h"
+#include "util.h"
 
 /*
  * Compile safeguard to see whether |NFS4_EASIZE+header| will still fit into
@@ -58,6 +60,7 @@
 #define EALVL 2 /* dprintf level for extended attribute logging */
 
 
+#ifndef NFS41_DRIVER_DAEMON_EA_SET_BATCH
 static int set_ea_value(
     IN nfs41_session *session,
     IN nfs41_path_fh *parent,
@@ -118,7 +121,8 @@ static int set_ea_value(
     status = nfs41_open(session, parent, &file, owner, &claim,
         OPEN4_SHARE_ACCESS_WRITE | OPEN4_SHARE_ACCESS_WANT_NO_DELEG,
         OPEN4_SHARE_DENY_BOTH, OPEN4_CREATE, UNCHECKED4,
-        &createattrs, TRUE, &stateid.stateid, &delegation, NULL);
+        &createattrs, NULL, TRUE, &stateid.stateid, &delegation, NULL, NULL,
+        NULL);
     if (status) {
         eprintf("set_ea_value: "
             "nfs41_open(ea_name='%s') failed with '%s'\n",
@@ -144,6 +148,7 @@ out_close:
 out:
     return status;
 }
+#endif /* !NFS41_DRIVER_DAEMON_EA_SET_BATCH */
 
 /* Is this a NFS extended attribute (commonly used by Cygwin) ? */
 static bool is_nfs_ea(
@@ -158,12 +163,479 @@ static bool is_nfs_ea(
 }
 
 
+#ifdef NFS41_DRIVER_DAEMON_EA_CACHE
+/*
+ * EA cache
+ *
+ * Cygwin queries EAs on most opens, and each query needs an OPENATTR,
+ * READDIRs of the named attribute directory for the list of names,
+ * and OPEN/READ/CLOSE for each value.
+ * The cache keeps the list of EA names and up to |EA_CACHE_MAX_VALUES|
+ * small values per superblock and fileid. An entry is used as long as
+ * the (cached) change attribute of the file is the same as when it
+ * was filled, and for at most |EA_CACHE_TTL| seconds.
+ * |nfs41_ea_set()| drops the entry of the file.
+ */
+#define EA_CACHE_SIZE 256 /* must be a power of 2 */
+#define EA_CACHE_TTL 60
+#define EA_CACHE_MAX_VALUES 8
+#define EA_CACHE_MAX_VALUE_LEN 512
+
+typedef struct __ea_cache_value {
+    USHORT                  value_len;
+    UCHAR                   name_len;
+    CHAR                    name_value[1]; /* name, '\0', value */
+} ea_cache_value;
+
+typedef struct __ea_cache_entry {
+    const nfs41_superblock  *superblock;
+    uint64_t                fileid;
+    uint64_t                change;
+    util_reltimestamp       timestamp;
+    bool                    valid;
+    bool                    has_list;
+    PFILE_GET_EA_INFORMATION list; /* NULL if the file has no EAs */
+    uint32_t                list_size;
+    ea_cache_value          *values[EA_CACHE_MAX_VALUES];
+    uint32_t                next_value;
+} ea_cache_entry;
+
+static struct {
+    SRWLOCK                 lock;
+    ea_cache_entry          entries[EA_CACHE_SIZE];
+} ea_cache = { .lock = SRWLOCK_INIT };
+
+static __inline ea_cache_entry *ea_cache_slot(
+    IN const nfs41_fh *fh)
+{
+    return &ea_cache.entries[
+        (uint32_t)(fh->fileid ^ (fh->fileid >> 32)) &
+        (EA_CACHE_SIZE - 1)];
+}
+
+static __inline bool ea_cache_entry_matches(
+    IN const ea_cache_entry *e,
+    IN const nfs41_fh *fh,
+    IN uint64_t change)
+{
+    return (e->valid &&
+        (e->superblock == fh->superblock) &&
+        (e->fileid == fh->fileid) &&
+        (e->change == change) &&
+        ((UTIL_GETRELTIME() - e->timestamp) < EA_CACHE_TTL));
+}
+
+/* must be called with |ea_cache.lock| held exclusive */
+static void ea_cache_entry_clear(
+    IN OUT ea_cache_entry *e)
+{
+    uint32_t i;
+
+    free(e->list);
+    for (i = 0; i < EA_CACHE_MAX_VALUES; i++) {
+        free(e->values[i]);
+        e->values[i] = NULL;
+    }
+    e->list = NULL;
+    e->list_size = 0;
+    e->has_list = false;
+    e->next_value = 0;
+    e->valid = false;
+}
+
+/*
+ * Get the slot for |fh|+|change| for storing new data, the old
+ * content of the slot is dropped if it belongs to another file or
+ * change. Must be called with |ea_cache.lock| held exclusive.
+ */
+static ea_cache_entry *ea_cache_slot_for_store(
+    IN const nfs41_fh *fh,
+    IN uint64_t change)
+{
+    ea_cache_entry *e = ea_cache_slot(fh);
+
+    if (!ea_cache_entry_matches(e, fh, change)) {
+        ea_cache_entry_clear(e);
+        e->superblock = fh->superblock;
+        e->fileid = fh->fileid;
+        e->change = change;
+        e->timestamp = UTIL_GETRELTIME();
+        e->valid = true;
+    }
+    return e;
+}
+
+/*
+ * returns a copy of the cached list of EA names in |*list_out|,
+ * |*list_out| is |NULL| if the file has no EAs
+ */
+static bool ea_cache_lookup_list(
+    IN const nfs41_fh *fh,
+    IN uint64_t change,
+    OUT PFILE_GET_EA_INFORMATION *list_out)
+{
+    ea_cache_entry *e;
+    bool hit = false;
+
+    AcquireSRWLockShared(&ea_cache.lock);
+    e = ea_cache_slot(fh);
+    if (ea_cache_entry_matches(e, fh, change) && e->has_list) {
+        if (e->list == NULL) {
+            *list_out = NULL;
+            hit = true;
+        }
+        else {
+            *list_out = malloc(e->list_size);
+            if (*list_out) {
+                (void)memcpy(*list_out, e->list, e->list_size);
+                hit = true;
+            }
+        }
+    }
+    ReleaseSRWLockShared(&ea_cache.lock);
+    return hit;
+}
+
+static void ea_cache_store_list(
+    IN const nfs41_fh *fh,
+    IN uint64_t change,
+    IN const PFILE_GET_EA_INFORMATION list,
+    IN uint32_t list_size)
+{
+    ea_cache_entry *e;
+    PFILE_GET_EA_INFORMATION copy = NULL;
+
+    if (list) {
+        copy = malloc(list_size);
+        if (copy == NULL)
+            return;
+        (void)memcpy(copy, list, list_size);
+    }
+
+    AcquireSRWLockExclusive(&ea_cache.lock);
+    e = ea_cache_slot_for_store(fh, change);
+    free(e->list);
+    e->list = copy;
+    e->list_size = list_size;
+    e->has_list = true;
+    ReleaseSRWLockExclusive(&ea_cache.lock);
+}
+
+/*
+ * Fill in the value of |ea| (|ea->EaName| must be set) from the cache,
+ * if the value fits into |length| bytes
+ */
+static bool ea_cache_lookup_value(
+    IN const nfs41_fh *fh,
+    IN uint64_t change,
+    IN OUT PFILE_FULL_EA_INFORMATION ea,
+    IN uint32_t length)
+{
+    ea_cache_entry *e;
+    ea_cache_value *v;
+    uint32_t i, diff;
+    bool hit = false;
+
+    diff = (uint32_t)FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) +
+        ea->EaNameLength + 1;
+
+    AcquireSRWLockShared(&ea_cache.lock);
+    e = ea_cache_slot(fh);
+    if (!ea_cache_entry_matches(e, fh, change))
+        goto out;
+
+    for (i = 0; i < EA_CACHE_MAX_VALUES; i++) {
+        v = e->values[i];
+        if ((v == NULL) ||
+            (v->name_len != ea->EaNameLength) ||
+            memcmp(v->name_value, ea->EaName, ea->EaNameLength))
+            continue;
+
+        if (length >= (diff + v->value_len)) {
+            (void)memcpy((unsigned char*)ea->EaName + ea->EaNameLength + 1,
+                v->name_value + v->name_len + 1, v->value_len);
+            ea->EaValueLength = v->value_len;
+            hit = true;
+        }
+        break;
+    }
+out:
+    ReleaseSRWLockShared(&ea_cache.lock);
+    return hit;
+}
+
+static void ea_cache_store_value(
+    IN const nfs41_fh *fh,
+    IN uint64_t change,
+    IN const PFILE_FULL_EA_INFORMATION ea)
+{
+    ea_cache_entry *e;
+    ea_cache_value *v, *old_v = NULL;
+    uint32_t i;
+
+    if (ea->EaValueLength > EA_CACHE_MAX_VALUE_LEN)
+        return;
+
+    v = malloc(FIELD_OFFSET(ea_cache_value, name_value) +
+        ea->EaNameLength + 1 + ea->EaValueLength);
+    if (v == NULL)
+        return;
+    v->name_len = ea->EaNameLength;
+    v->value_len = ea->EaValueLength;
+    (void)memcpy(v->name_value, ea->EaName, ea->EaNameLength);
+    v->name_value[v->name_len] = '\0';
+    (void)memcpy(v->name_value + v->name_len + 1,
+        ea->EaName + ea->EaNameLength + 1, ea->EaValueLength);
+
+    AcquireSRWLockExclusive(&ea_cache.lock);
+    e = ea_cache_slot_for_store(fh, change);
+    /* replace an old value of the same EA, or the oldest value */
+    for (i = 0; i < EA_CACHE_MAX_VALUES; i++) {
+        if (e->values[i] &&
+            (e->values[i]->name_len == v->name_len) &&
+            (!memcmp(e->values[i]->name_value, v->name_value, v->name_len)))
+            break;
+    }
+    if (i == EA_CACHE_MAX_VALUES) {
+        i = e->next_value;
+        e->next_value = (e->next_value + 1) % EA_CACHE_MAX_VALUES;
+    }
+    old_v = e->values[i];
+    e->values[i] = v;
+    ReleaseSRWLockExclusive(&ea_cache.lock);
+
+    free(old_v);
+}
+
+static void ea_cache_invalidate(
+    IN const nfs41_fh *fh)
+{
+    ea_cache_entry *e;
+
+    AcquireSRWLockExclusive(&ea_cache.lock);
+    e = ea_cache_slot(fh);
+    if ((e->superblock == fh->superblock) &&
+        (e->fileid == fh->fileid)) {
+        ea_cache_entry_clear(e);
+    }
+    ReleaseSRWLockExclusive(&ea_cache.lock);
+}
+
+/* get the (cached) change attribute of the file for the EA cache */
+static bool ea_cache_get_change(
+    IN nfs41_open_state *state,
+    OUT uint64_t *change)
+{
+    nfs41_file_info change_info;
+
+    if (state->file.fh.fileid == 0)
+        return false;
+
+    (void)memset(&change_info, 0, sizeof(nfs41_file_info));
+    if ((nfs41_cached_getattr(state->session,
+            &state->file, NULL, &change_info) == 0) &&
+        bitmap_isset(&change_info.attrmask, 0, FATTR4_WORD0_CHANGE)) {
+        *change = change_info.change;
+        return true;
+    }
+    return false;
+}
+#endif /* NFS41_DRIVER_DAEMON_EA_CACHE */
+
+#ifdef NFS41_DRIVER_DAEMON_EA_SET_BATCH
+/*
+ * The file handle of the named attribute directory of an open file is
+ * cached in |state->ea.attrdir|, with a |len| of zero if it is not
+ * known yet
+ */
+static void ea_attrdir_get(
+    IN nfs41_open_state *state,
+    OUT nfs41_path_fh *attrdir)
+{
+    EnterCriticalSection(&state->ea.lock);
+    fh_copy(&attrdir->fh, &state->ea.attrdir);
+    LeaveCriticalSection(&state->ea.lock);
+}
+
+static void ea_attrdir_set(
+    IN nfs41_open_state *state,
+    IN const nfs41_fh *fh)
+{
+    EnterCriticalSection(&state->ea.lock);
+    fh_copy(&state->ea.attrdir, fh);
+    LeaveCriticalSection(&state->ea.lock);
+}
+
+/* write the |*count| EAs in |writes|, and reset |*count| */
+static int ea_set_flush(
+    IN nfs41_open_state *state,
+    IN OUT nfs41_path_fh *attrdir,
+    IN const nfs41_named_attr_write *writes,
+    IN OUT uint32_t *count)
+{
+    uint32_t pos = 0, done;
+    bool_t cached;
+    int status = NFS4_OK;
+
+    while (pos < *count) {
+        cached = (attrdir->fh.len != 0);
+        status = nfs41_named_attrs_write(state->session, &state->file,
+            attrdir, &state->owner, *count - pos, &writes[pos], &done);
+        if (cached && (done == 0) &&
+            ((status == NFS4ERR_STALE) || (status == NFS4ERR_FHEXPIRED))) {
+            /* the named attribute directory is gone, create it again */
+            DPRINTF(EALVL, ("ea_set_flush: cached named attribute "
+                "directory of '%s' is stale\n", state->path.path));
+            attrdir->fh.len = 0;
+            ea_attrdir_set(state, &attrdir->fh);
+            continue;
+        }
+        if (!cached && attrdir->fh.len)
+            ea_attrdir_set(state, &attrdir->fh);
+
+        pos += done;
+        if (status) {
+            eprintf("ea_set_flush: "
+                "nfs41_named_attrs_write(ea_name='%.*s') failed with '%s'\n",
+                (int)writes[pos].name.len, writes[pos].name.name,
+                nfs_error_string(status));
+            break;
+        }
+    }
+    *count = 0;
+    return status;
+}
+
+static int ea_remove_value(
+    IN nfs41_open_state *state,
+    IN OUT nfs41_path_fh *attrdir,
+    IN PFILE_FULL_EA_INFORMATION ea)
+{
+    nfs41_component name;
+    char prefixed_name[256];
+    int status;
+
+    if (attrdir->fh.len == 0) {
+        status = nfs41_rpc_openattr(state->session, &state->file, FALSE,
+            &attrdir->fh);
+        if (status == NFS4ERR_NOENT) /* no EAs to remove */
+            return NFS4_OK;
+        if (status) {
+            eprintf("ea_remove_value: "
+                "nfs41_rpc_openattr() failed with error '%s'\n",
+                nfs_error_string(status));
+            return status;
+        }
+        ea_attrdir_set(state, &attrdir->fh);
+    }
+
+    (void)snprintf(prefixed_name, sizeof(prefixed_name), "%s%.*s",
+        WIN_NFS4_EA_NAME_PREFIX,
+        (int)ea->EaNameLength,
+        ea->EaName);
+    name.name = prefixed_name;
+    name.len = (USHORT)strlen(prefixed_name);
+    (void)nfs41_remove(state->session, attrdir, &name, 0);
+    return NFS4_OK;
+}
+
+/*
+ * All EAs of the chain with a value are written with as few compounds
+ * as possible (see |nfs41_named_attrs_write()|), EAs with an empty
+ * value are removed in between, so the order of the chain is kept.
+ * NFSv4.2 xattrs (RFC 8276) are not used, see |OP_GETXATTR|
+ */
+int nfs41_ea_set(
+    IN nfs41_open_state *state,
+    IN PFILE_FULL_EA_INFORMATION ea)
+{
+    nfs41_path_fh attrdir = { 0 };
+    nfs41_named_attr_write writes[NFS41_NAMED_ATTRS_WRITE_MAX];
+    char names[NFS41_NAMED_ATTRS_WRITE_MAX][256];
+    uint32_t count = 0;
+    int status = NFS4_OK;
+
+    ea_attrdir_get(state, &attrdir);
+
+    for (;;) {
+        /*
+         * NFS pseudo EAs (e.g. "NfsV3Attributes") are not stored as
+         * named attributes
+         */
+        if (!is_nfs_ea(ea)) {
+            /* don't allow values larger than NFS4_EASIZE */
+            if (ea->EaValueLength > NFS4_EASIZE) {
+                eprintf("nfs41_ea_set: "
+                    "trying to write extended attribute value of size %d, "
+                    "max allowed %d\n", ea->EaValueLength, NFS4_EASIZE);
+                status = NFS4ERR_FBIG;
+                break;
+            }
+
+            if ((ea->EaValueLength == 0) ||
+                (count == NFS41_NAMED_ATTRS_WRITE_MAX)) {
+                status = ea_set_flush(state, &attrdir, writes, &count);
+                if (status)
+                    break;
+            }
+
+            if (ea->EaValueLength == 0) {
+                /* remove the file on empty value */
+                status = ea_remove_value(state, &attrdir, ea);
+                if (status)
+                    break;
+            } else {
+                DPRINTF(EALVL, ("nfs41_ea_set: "
+                    "ea->(EaName='%.*s' EaNameLength=%d)\n",
+                    (int)ea->EaNameLength, ea->EaName,
+                    (int)ea->EaNameLength));
+                (void)snprintf(names[count], sizeof(names[count]), "%s%.*s",
+                    WIN_NFS4_EA_NAME_PREFIX,
+                    (int)ea->EaNameLength,
+                    ea->EaName);
+                writes[count].name.name = names[count];
+                writes[count].name.len = (USHORT)strlen(names[count]);
+                writes[count].value = (unsigned char *)EA_VALUE(ea);
+                writes[count].value_len = ea->EaValueLength;
+                count++;
+            }
+        }
+
+        if (ea->NextEntryOffset == 0)
+            break;
+        ea = (PFILE_FULL_EA_INFORMATION)EA_NEXT_ENTRY(ea);
+    }
+
+    if (status == NFS4_OK)
+        status = ea_set_flush(state, &attrdir, writes, &count);
+#ifdef NFS41_DRIVER_DAEMON_EA_CACHE
+    /* also after errors, some EAs might have been written */
+    ea_cache_invalidate(&state->file.fh);
+#endif /* NFS41_DRIVER_DAEMON_EA_CACHE */
+    return status;
+}
+#else
 int nfs41_ea_set(
     IN nfs41_open_state *state,
     IN PFILE_FULL_EA_INFORMATION ea)
 {
     nfs41_path_fh attrdir = { 0 };
+    PFILE_FULL_EA_INFORMATION first = ea;
     int status;
+
+    /*
+     * NFS pseudo EAs (e.g. "NfsV3Attributes") are not stored as named
+     * attributes, so do not create the attribute directory (one round
+     * trip per new file) if there are only such EAs
+     */
+    while (is_nfs_ea(ea)) {
+        if (ea->NextEntryOffset == 0) {
+            status = NFS4_OK;
+            goto out;
+        }
+        ea = (PFILE_FULL_EA_INFORMATION)EA_NEXT_ENTRY(ea);
+    }
+    ea = first;
 
     status = nfs41_rpc_openattr(state->session, &state->file, TRUE, &attrdir.fh);
     if (status) {
@@ -181,9 +653,14 @@ int nfs41_ea_set(
             break;
         ea = (PFILE_FULL_EA_INFORMATION)EA_NEXT_ENTRY(ea);
     }
+#ifdef NFS41_DRIVER_DAEMON_EA_CACHE
+    /* also after errors, some EAs might have been written */
+    ea_cache_invalidate(&state->file.fh);
+#endif /* NFS41_DRIVER_DAEMON_EA_CACHE */
 out:
     return status;
 }
+#endif /* NFS41_DRIVER_DAEMON_EA_SET_BATCH */
 
 
 /* NFS41_SYSOP_EA_SET */
@@ -471,9 +948,56 @@ static void populate_ea_list(
     }
 }
 
+/*
+ * Open the named attribute directory of the file on first use, a file
+ * without named attribute directory gets a |parent->fh.len| of zero
+ */
+static int open_attrdir(
+    IN nfs41_open_state *state,
+    OUT nfs41_path_fh *parent,
+    IN OUT bool *opened)
+{
+    int status;
+
+    if (*opened)
+        return NFS4_OK;
+
+#ifdef NFS41_DRIVER_DAEMON_EA_SET_BATCH
+    ea_attrdir_get(state, parent);
+    if (parent->fh.len) {
+        *opened = true;
+        return NFS4_OK;
+    }
+#endif /* NFS41_DRIVER_DAEMON_EA_SET_BATCH */
+
+    status = nfs41_rpc_openattr(state->session, &state->file, FALSE,
+        &parent->fh);
+    if (status == NFS4ERR_NOENT) { /* no named attribute directory */
+        DPRINTF(EALVL, ("no named attribute directory for '%s'\n",
+            state->path.path));
+        parent->fh.len = 0;
+        status = NFS4_OK;
+    } else if (status) {
+        eprintf("open_attrdir: "
+            "nfs41_rpc_openattr() failed with '%s'\n",
+            nfs_error_string(status));
+        goto out;
+    }
+#ifdef NFS41_DRIVER_DAEMON_EA_SET_BATCH
+    else {
+        ea_attrdir_set(state, &parent->fh);
+    }
+#endif /* NFS41_DRIVER_DAEMON_EA_SET_BATCH */
+    *opened = true;
+out:
+    return status;
+}
+
 static int get_ea_list(
     IN OUT nfs41_open_state *state,
-    IN nfs41_path_fh *eadir,
+    IN OUT nfs41_path_fh *eadir,
+    IN OUT bool *eadir_opened,
+    IN const uint64_t *change,
     OUT PFILE_GET_EA_INFORMATION *ealist_out,
     OUT uint32_t *eaindex_out)
 {
@@ -491,6 +1015,26 @@ static int get_ea_list(
         goto out;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_EA_CACHE
+    if (change && ea_cache_lookup_list(&state->file.fh, *change, &ea_list)) {
+        DPRINTF(EALVL, ("get_ea_list: using cached ea names\n"));
+        *ealist_out = state->ea.list = ea_list;
+        *eaindex_out = state->ea.index;
+        goto out;
+    }
+#endif /* NFS41_DRIVER_DAEMON_EA_CACHE */
+
+    status = open_attrdir(state, eadir, eadir_opened);
+    if (status) {
+        status = nfs_to_windows_error(status, ERROR_EAS_NOT_SUPPORTED);
+        goto out;
+    }
+    if (eadir->fh.len == 0) {
+        ea_size = 0;
+        *ealist_out = state->ea.list = NULL;
+        goto out_store;
+    }
+
     /* read the entire directory into a nfs41_readdir_entry buffer */
     status = read_entire_dir(state->session, eadir, &entry_list, &entry_len);
     if (status)
@@ -513,6 +1057,13 @@ static int get_ea_list(
     *eaindex_out = state->ea.index;
 out_free:
     free(entry_list); /* allocated by read_entire_dir() */
+out_store:
+#ifdef NFS41_DRIVER_DAEMON_EA_CACHE
+    if ((status == NO_ERROR) && change) {
+        ea_cache_store_list(&state->file.fh, *change,
+            state->ea.list, ea_size);
+    }
+#endif /* NFS41_DRIVER_DAEMON_EA_CACHE */
 out:
     LeaveCriticalSection(&state->ea.lock);
     return status;
@@ -559,8 +1110,8 @@ static int get_ea_value(
 
     status = nfs41_open(session, parent, &file, owner, &claim,
         OPEN4_SHARE_ACCESS_READ | OPEN4_SHARE_ACCESS_WANT_NO_DELEG,
-        OPEN4_SHARE_DENY_WRITE, OPEN4_NOCREATE, UNCHECKED4, NULL, TRUE,
-        &stateid.stateid, &delegation, &info);
+        OPEN4_SHARE_DENY_WRITE, OPEN4_NOCREATE, UNCHECKED4, NULL, NULL,
+        TRUE, &stateid.stateid, &delegation, &info, NULL, NULL);
     if (status) {
         eprintf("get_ea_value: "
             "nfs41_open(ea_name='%s') failed with '%s'\n",
@@ -661,28 +1212,22 @@ static int handle_getexattr(void *daemon_context, nfs41_upcall *upcall)
     PFILE_FULL_EA_INFORMATION ea, prev = NULL;
     nfs41_open_state *state = upcall->state_ref;
     nfs41_path_fh parent = { 0 };
+    bool parent_opened = false;
+    const uint64_t *change = NULL;
     uint32_t remaining, needed, index = 0;
     int status;
+#ifdef NFS41_DRIVER_DAEMON_EA_CACHE
+    uint64_t change_value;
 
-    status = nfs41_rpc_openattr(state->session, &state->file, FALSE, &parent.fh);
-    if (status == NFS4ERR_NOENT) { /* no named attribute directory */
-        DPRINTF(EALVL, ("no named attribute directory for '%s'\n", args->path));
-        if (query == NULL) {
-            status = empty_ea_error(args->eaindex, args->restart);
-            goto out;
-        }
-    } else if (status) {
-        eprintf("handle_getexattr: "
-            "nfs41_rpc_openattr() failed with '%s'\n",
-            nfs_error_string(status));
-        status = nfs_to_windows_error(status, ERROR_EAS_NOT_SUPPORTED);
-        goto out;
-    }
+    if (ea_cache_get_change(state, &change_value))
+        change = &change_value;
+#endif /* NFS41_DRIVER_DAEMON_EA_CACHE */
 
     if (query == NULL) {
         /* if no names are queried, use READDIR to list them all */
         uint32_t i;
-        status = get_ea_list(state, &parent, &query, &index);
+        status = get_ea_list(state, &parent, &parent_opened, change,
+            &query, &index);
         if (status)
             goto out;
 
@@ -712,8 +1257,14 @@ static int handle_getexattr(void *daemon_context, nfs41_upcall *upcall)
     }
 
     /* returned ea information can't exceed the downcall buffer size */
+#ifdef NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS
+    /* the downcall header, |overflow| and |buf_len| take < 64 bytes */
+    if (args->buf_len > UPCALL_LARGE_BUF_SIZE - 64)
+        args->buf_len = UPCALL_LARGE_BUF_SIZE - 64;
+#else
     if (args->buf_len > UPCALL_BUF_SIZE - 2 * sizeof(uint32_t))
         args->buf_len = UPCALL_BUF_SIZE - 2 * sizeof(uint32_t);
+#endif /* NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS */
 
     args->buf = malloc(args->buf_len);
     if (args->buf == NULL) {
@@ -736,6 +1287,18 @@ static int handle_getexattr(void *daemon_context, nfs41_upcall *upcall)
         (void)memcpy(ea->EaName, query->EaName, ea->EaNameLength);
         ea->Flags = 0;
 
+#ifdef NFS41_DRIVER_DAEMON_EA_CACHE
+        if (change &&
+            ea_cache_lookup_value(&state->file.fh, *change, ea, remaining))
+            goto value_done;
+#endif /* NFS41_DRIVER_DAEMON_EA_CACHE */
+
+        status = open_attrdir(state, &parent, &parent_opened);
+        if (status) {
+            status = nfs_to_windows_error(status, ERROR_EAS_NOT_SUPPORTED);
+            goto out_free;
+        }
+
         /* read the value from file */
         status = get_ea_value(state->session, &parent,
             &state->owner, ea, remaining, &needed);
@@ -747,6 +1310,11 @@ static int handle_getexattr(void *daemon_context, nfs41_upcall *upcall)
             status = nfs_to_windows_error(status, ERROR_EA_FILE_CORRUPT);
             goto out_free;
         }
+#ifdef NFS41_DRIVER_DAEMON_EA_CACHE
+        if (change)
+            ea_cache_store_value(&state->file.fh, *change, ea);
+value_done:
+#endif /* NFS41_DRIVER_DAEMON_EA_CACHE */
 
         needed = align4(FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) +
             ea->EaNameLength + 1 + ea->EaValueLength);
@@ -818,9 +1386,19 @@ const nfs41_upcall_op nfs41_op_setexattr = {
     .arg_size = sizeof(setexattr_upcall_args)
 };
 
+static uint32_t downcall_size_getexattr(
+    const nfs41_upcall *upcall)
+{
+    const getexattr_upcall_args *args = &upcall->args.getexattr;
+
+    return sizeof(args->overflow) + sizeof(args->buf_len) +
+        ((args->overflow == ERROR_INSUFFICIENT_BUFFER)? 0 : args->buf_len);
+}
+
 const nfs41_upcall_op nfs41_op_getexattr = {
     .parse = parse_getexattr,
     .handle = handle_getexattr,
     .marshall = marshall_getexattr,
+    .downcall_size = downcall_size_getexattr,
     .arg_size = sizeof(getexattr_upcall_args)
 };
@@ -416,12 +416,15 @@ void nfs_to_stat_lx_info(
     }
 
     EASSERT(bitmap_isset(&info->attrmask, 1, FATTR4_WORD1_MODE));
-    if (info->mode & MODE4_RUSR)
-        stat_lx_out->LxMode |= LX_MODE_S_IREAD;
-    if (info->mode & MODE4_WUSR)
-        stat_lx_out->LxMode |= LX_MODE_S_IWRITE;
-    if (info->mode & MODE4_XUSR)
-        stat_lx_out->LxMode |= LX_MODE_S_IEXEC;
+    /*
+     * The |MODE4_*| permission, setuid/setgid and sticky bits have
+     * the same values as the Linux ones in |LxMode|
+     */
+    stat_lx_out->LxMode |= info->mode &
+        (MODE4_SUID|MODE4_SGID|MODE4_SVTX|
+        MODE4_RUSR|MODE4_WUSR|MODE4_XUSR|
+        MODE4_RGRP|MODE4_WGRP|MODE4_XGRP|
+        MODE4_ROTH|MODE4_WOTH|MODE4_XOTH);
 
     char owner[NFS4_FATTR4_OWNER_LIMIT+1];
     char owner_group[NFS4_FATTR4_OWNER_LIMIT+1];
@@ -489,7 +492,7 @@ void nfs_to_stat_lx_info(
          * name, but just no name2gid mapping
          */
         stat_lx_out->LxFlags |= LX_FILE_METADATA_HAS_GID;
-        stat_lx_out->LxUid = NFS_GROUP_NOGROUP_GID;
+        stat_lx_out->LxGid = NFS_GROUP_NOGROUP_GID;
     }
 
     /* FIXME: |LX_FILE_METADATA_HAS_DEVICE_ID| not implemented yet */
@@ -0,0 +1,588 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * fscache.c - local persistent file data cache
+ *
+ * Enabled with "nfsd --fscache <dir>" and the "fsc" mount option.
+ * Regular files read through an "fsc" mount are copied by a
+ * background thread into one cache file per NFS file in <dir>, and
+ * READ upcalls are served from the copy as long as the change
+ * attribute and size of the file are those the copy was made from.
+ * The change attribute comes from |nfs41_cached_getattr()|, i.e. the
+ * attribute cache, which is kept valid while a delegation is held.
+ * Cache files are named after fsid and fileid and start with a
+ * |fscache_header|. They persist across nfsd restarts, so a rebooted
+ * machine reads from the local disk again after the first GETATTR.
+ *
+ * The total size is limited by "--fscachesize <MB>"; the least
+ * recently used cache files are deleted to make room for new ones.
+ * Files larger than a quarter of the cache size are not cached.
+ * The cache directory is trusted, it must only be writable by
+ * administrators and SYSTEM.
+ */
+
+#include <Windows.h>
+#include <stdlib.h>
+#include <strsafe.h>
+#include <process.h>
+
+#include "nfs41_build_features.h"
+#include "fscache.h"
+#include "nfs41_ops.h"
+#include "daemon_debug.h"
+#include "util.h"
+#include "list.h"
+
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+
+#define FSCACHE_MAGIC           0x43534653 /* "SFSC" */
+#define FSCACHE_VERSION         1
+/* file data starts here, sector aligned */
+#define FSCACHE_DATA_OFFSET     4096
+#define FSCACHE_NUM_BUCKETS     1024 /* must be a power of two */
+/* max. number of files copied at the same time */
+#define FSCACHE_MAX_POPULATE    2
+/* files larger than |max_bytes/FSCACHE_MAX_FILE_FRACTION| are not cached */
+#define FSCACHE_MAX_FILE_FRACTION 4
+
+typedef struct _fscache_key {
+    uint64_t fsid_major;
+    uint64_t fsid_minor;
+    uint64_t fileid;
+} fscache_key;
+
+typedef struct _fscache_header {
+    uint32_t magic;
+    uint32_t version;
+    fscache_key key;
+    uint64_t change;
+    uint64_t size;
+} fscache_header;
+
+typedef struct _fscache_entry {
+    struct list_entry entry; /* in |fscache.buckets[]| */
+    fscache_key key;
+    uint64_t change;
+    uint64_t size;
+    volatile LONG64 last_used;
+    HANDLE volatile file; /* opened on first use */
+} fscache_entry;
+
+static struct {
+    SRWLOCK lock;
+    bool open;
+    wchar_t dir[MAX_PATH];
+    uint64_t max_bytes;
+    uint64_t bytes; /* used, including files being copied */
+    volatile LONG64 clock;
+    /* files being copied */
+    fscache_key populating[FSCACHE_MAX_POPULATE];
+    bool populating_used[FSCACHE_MAX_POPULATE];
+    struct list_entry buckets[FSCACHE_NUM_BUCKETS];
+} fscache = { .lock = SRWLOCK_INIT };
+
+#define FSCACHE_FILE_BYTES(size) ((size) + FSCACHE_DATA_OFFSET)
+
+static uint32_t fscache_hash(
+    IN const fscache_key *key)
+{
+    const unsigned char *s = (const unsigned char *)key;
+    uint32_t hash = 2166136261U; /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < sizeof(fscache_key); i++) {
+        hash ^= s[i];
+        hash *= 16777619U;
+    }
+    return hash & (FSCACHE_NUM_BUCKETS-1);
+}
+
+static int fscache_path(
+    IN const fscache_key *key,
+    IN const wchar_t *suffix,
+    OUT wchar_t *path)
+{
+    if (FAILED(StringCchPrintfW(path, MAX_PATH, L"%s\\%016llx%016llx%016llx%s",
+        fscache.dir,
+        (unsigned long long)key->fsid_major,
+        (unsigned long long)key->fsid_minor,
+        (unsigned long long)key->fileid, suffix)))
+        return ERROR_FILENAME_EXCED_RANGE;
+    return NO_ERROR;
+}
+
+/* Must be called with |fscache.lock| held */
+static fscache_entry *fscache_find(
+    IN const fscache_key *key)
+{
+    struct list_entry *pos;
+    fscache_entry *e;
+
+    list_for_each(pos, &fscache.buckets[fscache_hash(key)]) {
+        e = list_container(pos, fscache_entry, entry);
+        if (!memcmp(&e->key, key, sizeof(fscache_key)))
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * Remove |e| from the index, must be called with |fscache.lock| held
+ * exclusively
+ */
+static void fscache_remove(
+    IN fscache_entry *e,
+    IN bool delete_file)
+{
+    wchar_t path[MAX_PATH];
+
+    list_remove(&e->entry);
+    fscache.bytes -= FSCACHE_FILE_BYTES(e->size);
+    if (e->file != INVALID_HANDLE_VALUE)
+        (void)CloseHandle(e->file);
+    if (delete_file && (fscache_path(&e->key, L".fsc", path) == NO_ERROR))
+        (void)DeleteFileW(path);
+    free(e);
+}
+
+/*
+ * Reserve |need| bytes, deleting least recently used cache files.
+ * Must be called with |fscache.lock| held exclusively
+ */
+static bool fscache_reserve(
+    IN uint64_t need)
+{
+    struct list_entry *pos;
+    fscache_entry *e, *lru;
+    uint32_t i;
+
+    while ((fscache.bytes + need) > fscache.max_bytes) {
+        lru = NULL;
+        for (i = 0; i < FSCACHE_NUM_BUCKETS; i++) {
+            list_for_each(pos, &fscache.buckets[i]) {
+                e = list_container(pos, fscache_entry, entry);
+                if ((lru == NULL) || (e->last_used < lru->last_used))
+                    lru = e;
+            }
+        }
+        if (lru == NULL)
+            return false;
+        DPRINTF(1, ("fscache_reserve: evicting fileid=%llu size=%llu\n",
+            (unsigned long long)lru->key.fileid,
+            (unsigned long long)lru->size));
+        fscache_remove(lru, true);
+    }
+    fscache.bytes += need;
+    return true;
+}
+
+static void fscache_insert(
+    IN const fscache_header *hdr,
+    IN LONG64 last_used)
+{
+    fscache_entry *e;
+
+    e = calloc(1, sizeof(fscache_entry));
+    if (e == NULL)
+        return;
+    e->key = hdr->key;
+    e->change = hdr->change;
+    e->size = hdr->size;
+    e->last_used = last_used;
+    e->file = INVALID_HANDLE_VALUE;
+    list_add_tail(&fscache.buckets[fscache_hash(&e->key)], &e->entry);
+}
+
+/* Load the index from the cache files in |fscache.dir| */
+static void fscache_scan(void)
+{
+    WIN32_FIND_DATAW fd;
+    wchar_t pattern[MAX_PATH], path[MAX_PATH];
+    fscache_header hdr;
+    HANDLE find, file;
+    DWORD got;
+    size_t len;
+    unsigned int count = 0;
+
+    if (FAILED(StringCchPrintfW(pattern, MAX_PATH, L"%s\\*", fscache.dir)))
+        return;
+    find = FindFirstFileW(pattern, &fd);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+    do {
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+        if (FAILED(StringCchPrintfW(path, MAX_PATH, L"%s\\%s",
+            fscache.dir, fd.cFileName)))
+            continue;
+        len = wcslen(fd.cFileName);
+        /* copies which were interrupted by a crash or shutdown */
+        if ((len > 4) && !_wcsicmp(fd.cFileName + len - 4, L".tmp")) {
+            (void)DeleteFileW(path);
+            continue;
+        }
+        if ((len <= 4) || _wcsicmp(fd.cFileName + len - 4, L".fsc"))
+            continue;
+
+        file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            continue;
+        if (!ReadFile(file, &hdr, sizeof(hdr), &got, NULL) ||
+            (got != sizeof(hdr)) ||
+            (hdr.magic != FSCACHE_MAGIC) ||
+            (hdr.version != FSCACHE_VERSION) ||
+            ((((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow) !=
+                FSCACHE_FILE_BYTES(hdr.size))) {
+            (void)CloseHandle(file);
+            (void)DeleteFileW(path);
+            continue;
+        }
+        (void)CloseHandle(file);
+
+        fscache_insert(&hdr, 0);
+        fscache.bytes += FSCACHE_FILE_BYTES(hdr.size);
+        count++;
+    } while (FindNextFileW(find, &fd));
+    (void)FindClose(find);
+
+    /* "--fscachesize" might have been lowered */
+    if (fscache_reserve(0) == false)
+        eprintf("fscache_scan: cannot shrink cache to %llu bytes\n",
+            (unsigned long long)fscache.max_bytes);
+
+    DPRINTF(0, ("fscache_scan: %u cache files, %llu bytes\n",
+        count, (unsigned long long)fscache.bytes));
+}
+
+int nfs41_fscache_open(
+    IN const wchar_t *dir,
+    IN uint64_t max_bytes)
+{
+    uint32_t i;
+    int status = NO_ERROR;
+
+    if (FAILED(StringCchCopyW(fscache.dir, MAX_PATH, dir))) {
+        status = ERROR_FILENAME_EXCED_RANGE;
+        goto out;
+    }
+    if (!CreateDirectoryW(fscache.dir, NULL) &&
+        (GetLastError() != ERROR_ALREADY_EXISTS)) {
+        status = GetLastError();
+        eprintf("nfs41_fscache_open: CreateDirectoryW('%S') failed, "
+            "lasterr=%d\n", fscache.dir, status);
+        goto out;
+    }
+
+    AcquireSRWLockExclusive(&fscache.lock);
+    for (i = 0; i < FSCACHE_NUM_BUCKETS; i++)
+        list_init(&fscache.buckets[i]);
+    fscache.max_bytes = max_bytes;
+    fscache.bytes = 0;
+    fscache_scan();
+    fscache.open = true;
+    ReleaseSRWLockExclusive(&fscache.lock);
+out:
+    return status;
+}
+
+void nfs41_fscache_close(void)
+{
+    struct list_entry *pos, *tmp;
+    uint32_t i;
+
+    AcquireSRWLockExclusive(&fscache.lock);
+    if (fscache.open) {
+        fscache.open = false;
+        for (i = 0; i < FSCACHE_NUM_BUCKETS; i++) {
+            list_for_each_tmp(pos, tmp, &fscache.buckets[i])
+                fscache_remove(list_container(pos, fscache_entry, entry),
+                    false);
+        }
+    }
+    ReleaseSRWLockExclusive(&fscache.lock);
+}
+
+typedef struct _fscache_job {
+    nfs41_open_state *state;
+    fscache_header hdr;
+    uint32_t slot; /* in |fscache.populating[]| */
+} fscache_job;
+
+/* Copy the data of |job->state| into a new cache file */
+static unsigned int WINAPI fscache_populate_thread(void *args)
+{
+    fscache_job *job = (fscache_job *)args;
+    nfs41_open_state *state = job->state;
+    const uint32_t chunk = max_read_size(state->session, &state->file.fh);
+    wchar_t tmp_path[MAX_PATH], path[MAX_PATH];
+    unsigned char *buffer = NULL;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    stateid_arg stateid;
+    nfs41_file_info info;
+    OVERLAPPED ov;
+    uint64_t offset = 0;
+    uint32_t got;
+    DWORD written;
+    bool_t eof = FALSE;
+    bool reserved = false, done = false;
+    fscache_entry *old;
+    int status;
+
+    if (fscache_path(&job->hdr.key, L".tmp", tmp_path) ||
+        fscache_path(&job->hdr.key, L".fsc", path))
+        goto out;
+
+    AcquireSRWLockExclusive(&fscache.lock);
+    reserved = fscache_reserve(FSCACHE_FILE_BYTES(job->hdr.size));
+    ReleaseSRWLockExclusive(&fscache.lock);
+    if (!reserved)
+        goto out;
+
+    buffer = malloc(chunk);
+    if (buffer == NULL)
+        goto out;
+    file = CreateFileW(tmp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL|FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        eprintf("fscache_populate_thread: CreateFileW('%S') failed, "
+            "lasterr=%d\n", tmp_path, (int)GetLastError());
+        goto out;
+    }
+
+    nfs41_open_stateid_arg(state, &stateid);
+    while (offset < job->hdr.size) {
+        status = nfs41_read(state->session, &state->file, &stateid,
+            offset, chunk, buffer, &got, &eof);
+        if (status) {
+            DPRINTF(1, ("fscache_populate_thread('%s'): nfs41_read() "
+                "failed with '%s'\n",
+                state->path.path, nfs_error_string(status)));
+            goto out;
+        }
+        if (got == 0)
+            break;
+
+        ZeroMemory(&ov, sizeof(ov));
+        ov.Offset = (DWORD)(FSCACHE_DATA_OFFSET + offset);
+        ov.OffsetHigh = (DWORD)((FSCACHE_DATA_OFFSET + offset) >> 32);
+        if (!WriteFile(file, buffer, got, &written, &ov) ||
+            (written != got))
+            goto out;
+        offset += got;
+        if (eof)
+            break;
+    }
+    if (offset != job->hdr.size)
+        goto out;
+
+    /* the file must not have changed while we copied it */
+    ZeroMemory(&info, sizeof(info));
+    if (nfs41_cached_getattr(state->session, &state->file, NULL, &info) ||
+        (info.change != job->hdr.change) || (info.size != job->hdr.size))
+        goto out;
+
+    ZeroMemory(&ov, sizeof(ov));
+    if (!WriteFile(file, &job->hdr, sizeof(job->hdr), &written, &ov) ||
+        (written != sizeof(job->hdr)))
+        goto out;
+    (void)CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+
+    AcquireSRWLockExclusive(&fscache.lock);
+    if (fscache.open) {
+        /* an outdated copy of the same file */
+        old = fscache_find(&job->hdr.key);
+        if (old)
+            fscache_remove(old, false);
+        if (MoveFileExW(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+            fscache_insert(&job->hdr, InterlockedIncrement64(&fscache.clock));
+            done = true;
+        }
+    }
+    ReleaseSRWLockExclusive(&fscache.lock);
+
+    DPRINTF(1, ("fscache_populate_thread('%s'): cached %llu bytes\n",
+        state->path.path, (unsigned long long)job->hdr.size));
+out:
+    if (file != INVALID_HANDLE_VALUE)
+        (void)CloseHandle(file);
+    if (!done)
+        (void)DeleteFileW(tmp_path);
+    free(buffer);
+
+    AcquireSRWLockExclusive(&fscache.lock);
+    if (reserved && !done)
+        fscache.bytes -= FSCACHE_FILE_BYTES(job->hdr.size);
+    fscache.populating_used[job->slot] = false;
+    ReleaseSRWLockExclusive(&fscache.lock);
+
+    /* release the reference from |fscache_populate_start()| */
+    nfs41_open_state_deref(state);
+    free(job);
+    return 0;
+}
+
+/* Must be called with |fscache.lock| held exclusively */
+static void fscache_populate_start(
+    IN nfs41_open_state *state,
+    IN const fscache_header *hdr)
+{
+    fscache_job *job;
+    HANDLE thread;
+    uint32_t i, slot = FSCACHE_MAX_POPULATE;
+
+    for (i = 0; i < FSCACHE_MAX_POPULATE; i++) {
+        if (!fscache.populating_used[i])
+            slot = i;
+        else if (!memcmp(&fscache.populating[i], &hdr->key,
+            sizeof(fscache_key)))
+            return; /* already being copied */
+    }
+    if (slot == FSCACHE_MAX_POPULATE)
+        return;
+
+    job = malloc(sizeof(fscache_job));
+    if (job == NULL)
+        return;
+    job->state = state;
+    job->hdr = *hdr;
+    job->slot = slot;
+
+    fscache.populating[slot] = hdr->key;
+    fscache.populating_used[slot] = true;
+    /* the thread holds a reference on |state| until it is done */
+    nfs41_open_state_ref(state);
+    thread = (HANDLE)_beginthreadex(NULL,
+        NFSD_THREAD_STACK_SIZE, fscache_populate_thread, job, 0, NULL);
+    if (thread == NULL) {
+        eprintf("fscache_populate_start: _beginthreadex() failed "
+            "with %d\n", (int)GetLastError());
+        fscache.populating_used[slot] = false;
+        nfs41_open_state_deref(state);
+        free(job);
+        return;
+    }
+    (void)CloseHandle(thread);
+}
+
+/*
+ * Serve a READ from the cache file of |state|. Returns |false| if
+ * the data must be read from the server; a copy of the file is then
+ * started in the background
+ */
+bool nfs41_fscache_read(
+    IN nfs41_open_state *state,
+    IN uint64_t offset,
+    IN uint32_t len,
+    OUT unsigned char *buffer,
+    OUT uint32_t *len_out,
+    OUT bool *eof_out)
+{
+    nfs41_file_info info;
+    fscache_header hdr;
+    fscache_entry *e;
+    HANDLE file;
+    OVERLAPPED ov;
+    DWORD got;
+    uint32_t to_read;
+    bool served = false;
+
+    if (!fscache.open || (state->type != NF4REG))
+        return false;
+
+    ZeroMemory(&info, sizeof(info));
+    if (nfs41_cached_getattr(state->session, &state->file, NULL, &info) ||
+        !bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_CHANGE) ||
+        !bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_SIZE))
+        return false;
+
+    ZeroMemory(&hdr, sizeof(hdr));
+    hdr.magic = FSCACHE_MAGIC;
+    hdr.version = FSCACHE_VERSION;
+    hdr.key.fsid_major = state->file.fh.superblock->fsid.major;
+    hdr.key.fsid_minor = state->file.fh.superblock->fsid.minor;
+    hdr.key.fileid = state->file.fh.fileid;
+    hdr.change = info.change;
+    hdr.size = info.size;
+
+    AcquireSRWLockShared(&fscache.lock);
+    e = fscache_find(&hdr.key);
+    if (e && (e->change == hdr.change) && (e->size == hdr.size)) {
+        file = e->file;
+        if (file == INVALID_HANDLE_VALUE) {
+            wchar_t path[MAX_PATH];
+            HANDLE prev;
+
+            if (fscache_path(&e->key, L".fsc", path) == NO_ERROR)
+                file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ,
+                    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file != INVALID_HANDLE_VALUE) {
+                prev = InterlockedCompareExchangePointer(&e->file, file,
+                    INVALID_HANDLE_VALUE);
+                if (prev != INVALID_HANDLE_VALUE) {
+                    (void)CloseHandle(file);
+                    file = prev;
+                }
+            }
+        }
+
+        to_read = (offset < e->size) ?
+            (uint32_t)min((uint64_t)len, e->size - offset) : 0;
+        if (to_read == 0) {
+            *len_out = 0;
+            *eof_out = true;
+            served = true;
+        } else if (file != INVALID_HANDLE_VALUE) {
+            ZeroMemory(&ov, sizeof(ov));
+            ov.Offset = (DWORD)(FSCACHE_DATA_OFFSET + offset);
+            ov.OffsetHigh = (DWORD)((FSCACHE_DATA_OFFSET + offset) >> 32);
+            if (ReadFile(file, buffer, to_read, &got, &ov) &&
+                (got == to_read)) {
+                *len_out = got;
+                *eof_out = (offset + got) >= e->size;
+                served = true;
+            }
+        }
+        if (served)
+            e->last_used = InterlockedIncrement64(&fscache.clock);
+    }
+    ReleaseSRWLockShared(&fscache.lock);
+
+    if (served) {
+        DPRINTF(2, ("nfs41_fscache_read('%s'): offset=%llu len=%lu "
+            "from the cache\n",
+            state->path.path, (unsigned long long)offset,
+            (unsigned long)*len_out));
+        return true;
+    }
+
+    if ((hdr.size > 0) &&
+        (hdr.size <= (fscache.max_bytes / FSCACHE_MAX_FILE_FRACTION))) {
+        AcquireSRWLockExclusive(&fscache.lock);
+        if (fscache.open)
+            fscache_populate_start(state, &hdr);
+        ReleaseSRWLockExclusive(&fscache.lock);
+    }
+    return false;
+}
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
@@ -0,0 +1,46 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+#ifndef __NFS41_DAEMON_FSCACHE_H__
+#define __NFS41_DAEMON_FSCACHE_H__ 1
+
+#include <Windows.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "nfs41_build_features.h"
+
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+/*
+ * Local persistent file data cache for "fsc" mounts, see fscache.c
+ */
+#define FSCACHE_SIZE_DEFAULT_MB 10240
+#define FSCACHE_SIZE_MAX_MB (16*1024*1024)
+
+struct __nfs41_open_state;
+
+int nfs41_fscache_open(const wchar_t *dir, uint64_t max_bytes);
+void nfs41_fscache_close(void);
+bool nfs41_fscache_read(struct __nfs41_open_state *state,
+    uint64_t offset, uint32_t len, unsigned char *buffer,
+    uint32_t *len_out, bool *eof_out);
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+
+#endif /* !__NFS41_DAEMON_FSCACHE_H__ */
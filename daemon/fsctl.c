@@ -19,10 +19,12 @@
  */
 
 #include <Windows.h>
+#include <process.h>
 #include <stdio.h>
 
 #include "nfs41_ops.h"
 #include "name_cache.h"
+#include "delegation.h"
 #include "upcall.h"
 #include "daemon_debug.h"
 #include "util.h"
@@ -30,6 +32,7 @@
 #define QARLVL 2 /* dprintf level for "query allocated ranges" logging */
 #define SZDLVL 2 /* dprintf level for "set zero data" logging */
 #define DDLVL  2 /* dprintf level for "duplicate data" logging */
+#define CCLVL  1 /* dprintf level for "cache control" logging */
 
 static int parse_queryallocatedranges(
     const unsigned char *restrict buffer,
@@ -60,46 +63,53 @@ out:
     return status;
 }
 
-static
-int query_sparsefile_datasections(nfs41_open_state *state,
-    uint64_t start_offset,
-    uint64_t end_offset,
-    FILE_ALLOCATED_RANGE_BUFFER *outbuffer,
-    size_t out_maxrecords,
-    size_t *restrict res_num_records)
+/*
+ * |EXTENT_MAP_MAX_EXTENTS| - number of data extents collected by one
+ * |query_sparsefile_datasections()| call before it stops SEEKing,
+ * unless the caller-supplied record array is larger
+ */
+#define EXTENT_MAP_MAX_EXTENTS 4096
+
+typedef struct __nfs41_data_extent {
+    uint64_t offset;
+    uint64_t length;
+} nfs41_data_extent;
+
+/*
+ * collect the data extents from |start_offset| up to the first hole at
+ * or after |end_offset|, |*covered_end| receives the offset up to which
+ * the extents are known (|NFS4_UINT64_MAX| if EOF was reached)
+ */
+static int seek_data_extents(
+    IN nfs41_open_state *state,
+    IN uint64_t start_offset,
+    IN uint64_t end_offset,
+    IN uint32_t max_extents,
+    OUT nfs41_data_extent **extents_out,
+    OUT uint32_t *count_out,
+    OUT uint64_t *covered_end)
 {
-    int status = NO_ERROR;
     nfs41_session *session = state->session;
-    uint64_t next_offset;
-    uint64_t data_size;
-    int data_seek_status;
-    bool_t data_seek_sr_eof;
-    uint64_t data_seek_sr_offset;
-    int hole_seek_status;
-    bool_t hole_seek_sr_eof;
-    uint64_t hole_seek_sr_offset;
-    size_t i;
-    bool error_more_data = false;
-
+    nfs41_data_extent *extents = NULL, *new_extents;
+    uint32_t count = 0, max_count = 0;
+    uint64_t next_offset = start_offset;
+    uint64_t data_seek_sr_offset, hole_seek_sr_offset;
+    bool_t data_seek_sr_eof, hole_seek_sr_eof;
     stateid_arg stateid;
-
-    DPRINTF(QARLVL,
-        ("--> query_sparsefile_datasections(state->path.path='%s')\n",
-        state->path.path));
-
-    /* NFS SEEK supported ? */
-    if (session->client->root->supports_nfs42_seek == false) {
-        status = ERROR_NOT_SUPPORTED;
-        goto out;
-    }
+    int status = NO_ERROR;
+    int seek_status;
 
     nfs41_open_stateid_arg(state, &stateid);
 
-    next_offset = start_offset;
-    *res_num_records = 0;
+    for (;;) {
+        if (count >= max_extents) {
+            DPRINTF(QARLVL, ("extent limit %u reached at offset %llu\n",
+                (unsigned int)max_extents, next_offset));
+            *covered_end = next_offset;
+            break;
+        }
 
-    for (i=0 ; ; i++) {
-        data_seek_status = nfs42_seek(session,
+        seek_status = nfs42_seek(session,
             &state->file,
             &stateid,
             next_offset,
@@ -129,67 +139,128 @@ int query_sparsefile_datasections(nfs41_open_state *state,
 #define LINUX_NFSD_SEEK_NXIO_BUG_WORKAROUND 1
 
 #ifdef LINUX_NFSD_SEEK_NXIO_BUG_WORKAROUND
-        if (data_seek_status == NFS4ERR_NXIO) {
+        if (seek_status == NFS4ERR_NXIO) {
             DPRINTF(QARLVL, ("SEEK_DATA failed with NFS4ERR_NXIO\n"));
-            goto out;
+            *covered_end = NFS4_UINT64_MAX;
+            break;
         }
 #endif
-        if (data_seek_status) {
-            status = nfs_to_windows_error(data_seek_status,
+        if (seek_status) {
+            status = nfs_to_windows_error(seek_status,
                 ERROR_INVALID_PARAMETER);
             DPRINTF(QARLVL, ("SEEK_DATA failed "
                 "OP_SEEK(sa_offset=%llu,sa_what=SEEK_DATA) "
                 "failed with %d(='%s')\n",
                 next_offset,
-                data_seek_status,
-                nfs_error_string(data_seek_status)));
-            goto out;
+                seek_status,
+                nfs_error_string(seek_status)));
+            goto out_free;
         }
 
-        next_offset = data_seek_sr_offset;
-
-        hole_seek_status = nfs42_seek(session,
+        seek_status = nfs42_seek(session,
             &state->file,
             &stateid,
-            next_offset,
+            data_seek_sr_offset,
             NFS4_CONTENT_HOLE,
             &hole_seek_sr_eof,
             &hole_seek_sr_offset);
-        if (hole_seek_status) {
-            status = nfs_to_windows_error(hole_seek_status,
+        if (seek_status) {
+            status = nfs_to_windows_error(seek_status,
                 ERROR_INVALID_PARAMETER);
             DPRINTF(QARLVL, ("SEEK_HOLE failed "
                 "OP_SEEK(sa_offset=%llu,sa_what=SEEK_HOLE) "
                 "failed with %d(='%s')\n",
-                next_offset,
-                hole_seek_status,
-                nfs_error_string(hole_seek_status)));
-            goto out;
+                data_seek_sr_offset,
+                seek_status,
+                nfs_error_string(seek_status)));
+            goto out_free;
         }
 
         next_offset = hole_seek_sr_offset;
 
-        data_size = hole_seek_sr_offset - data_seek_sr_offset;
-
         DPRINTF(QARLVL, ("data_section: from "
             "%llu to %llu, size=%llu (data_eof=%d, hole_eof=%d)\n",
             data_seek_sr_offset,
             hole_seek_sr_offset,
-            data_size,
+            hole_seek_sr_offset - data_seek_sr_offset,
             (int)data_seek_sr_eof,
             (int)hole_seek_sr_eof));
 
-        if (i < out_maxrecords) {
-            outbuffer[i].FileOffset.QuadPart = data_seek_sr_offset;
-            outbuffer[i].Length.QuadPart = data_size;
+        if (data_seek_sr_offset < hole_seek_sr_offset) {
+            if (count == max_count) {
+                max_count = max_count ? (max_count * 2) : 64;
+                new_extents = realloc(extents,
+                    max_count * sizeof(nfs41_data_extent));
+                if (new_extents == NULL) {
+                    status = ERROR_NOT_ENOUGH_MEMORY;
+                    goto out_free;
+                }
+                extents = new_extents;
+            }
+            extents[count].offset = data_seek_sr_offset;
+            extents[count].length =
+                hole_seek_sr_offset - data_seek_sr_offset;
+            count++;
         }
-        else {
+
+        if (data_seek_sr_eof || hole_seek_sr_eof) {
+            DPRINTF(QARLVL,
+                ("EOF reached (data_seek_sr_eof=%d, hole_seek_sr_eof=%d)\n",
+                (int)data_seek_sr_eof,
+                (int)hole_seek_sr_eof));
+            *covered_end = NFS4_UINT64_MAX;
+            break;
+        }
+
+        if (hole_seek_sr_offset >= end_offset) {
+            DPRINTF(QARLVL,
+                ("end offset reached, "
+                "hole_seek_sr_offset(=%lld) >= end_offset(=%lld)\n",
+                (long long)hole_seek_sr_offset,
+                (long long)end_offset));
+            *covered_end = hole_seek_sr_offset;
+            break;
+        }
+    }
+
+    *extents_out = extents;
+    *count_out = count;
+    return NO_ERROR;
+
+out_free:
+    free(extents);
+    return status;
+}
+
+/*
+ * copy the extents overlapping |start_offset| to |end_offset| into the
+ * caller-supplied record array, returns |ERROR_MORE_DATA| if the array
+ * is too small or the extents end before |end_offset|
+ */
+static int fill_allocated_ranges(
+    IN const nfs41_data_extent *extents,
+    IN uint32_t count,
+    IN uint64_t covered_end,
+    IN uint64_t start_offset,
+    IN uint64_t end_offset,
+    OUT FILE_ALLOCATED_RANGE_BUFFER *outbuffer,
+    IN size_t out_maxrecords,
+    OUT size_t *restrict res_num_records)
+{
+    uint64_t extent_end;
+    uint32_t i;
+
+    *res_num_records = 0;
+
+    for (i=0 ; i < count ; i++) {
+        extent_end = extents[i].offset + extents[i].length;
+        if (extent_end <= start_offset)
+            continue;
+        if (extents[i].offset >= end_offset)
+            return NO_ERROR;
+
+        if (*res_num_records >= out_maxrecords) {
             /*
-             * Return |ERROR_MORE_DATA| if we reach end of the
-             * caller-supplied record array and still have more
-             * data sections (i.e. no EOF from
-             + |NFS4_CONTENT_HOLE|/|NFS4_CONTENT_DATA| yet).
-             *
              * FIXME: We should also implement |out_maxrecords==0|,
              * and then return the size for an array to store
              * all records.
@@ -199,36 +270,274 @@ int query_sparsefile_datasections(nfs41_open_state *state,
              * |FILE_ALLOCATED_RANGE_BUFFER| someone adds more
              * data sections.
              */
-            error_more_data = true;
-            break;
+            return ERROR_MORE_DATA;
         }
 
+        outbuffer[*res_num_records].FileOffset.QuadPart =
+            max(extents[i].offset, start_offset);
+        outbuffer[*res_num_records].Length.QuadPart = extent_end -
+            outbuffer[*res_num_records].FileOffset.QuadPart;
         (*res_num_records)++;
+    }
 
-        if (data_seek_sr_offset > end_offset) {
-            DPRINTF(QARLVL,
-                ("end offset reached, "
-                "i=%d, data_seek_sr_offset(=%lld) > end_offset(=%lld)\n",
-                (int)i,
-                (long long)data_seek_sr_offset,
-                (long long)end_offset));
-            break;
-        }
+    return (covered_end < end_offset)?ERROR_MORE_DATA:NO_ERROR;
+}
 
-        if (data_seek_sr_eof || hole_seek_sr_eof) {
-            DPRINTF(QARLVL,
-                ("EOF reached (data_seek_sr_eof=%d, hole_seek_sr_eof=%d)\n",
-                (int)data_seek_sr_eof,
-                (int)hole_seek_sr_eof));
-            break;
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+/*
+ * Mark |start| to |end| as data or hole in the extent map of |state|,
+ * the caller must hold |state->extent_map.lock| exclusively. Returns
+ * |ERROR_NOT_ENOUGH_MEMORY| if the new extent array cannot be allocated
+ */
+static int extent_map_set(
+    IN nfs41_open_state *state,
+    IN uint64_t start,
+    IN uint64_t end,
+    IN bool_t data)
+{
+    const nfs41_data_extent *extents = state->extent_map.extents;
+    nfs41_data_extent *new_extents;
+    uint64_t extent_start, extent_end;
+    uint32_t i, n = 0;
+    bool_t inserted = FALSE;
+
+    /* a write can merge extents, a hole can split one extent */
+    new_extents = malloc((state->extent_map.count + 1) *
+        sizeof(nfs41_data_extent));
+    if (new_extents == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    for (i=0 ; i < state->extent_map.count ; i++) {
+        extent_start = extents[i].offset;
+        extent_end = extent_start + extents[i].length;
+
+        if (data) {
+            if ((extent_end < start) || (extent_start > end)) {
+                if ((extent_start > end) && !inserted) {
+                    new_extents[n].offset = start;
+                    new_extents[n].length = end - start;
+                    n++;
+                    inserted = TRUE;
+                }
+                new_extents[n++] = extents[i];
+            }
+            else {
+                /* overlapping or adjacent, merge */
+                start = min(start, extent_start);
+                end = max(end, extent_end);
+            }
         }
+        else {
+            if ((extent_end <= start) || (extent_start >= end)) {
+                new_extents[n++] = extents[i];
+                continue;
+            }
+            if (extent_start < start) {
+                new_extents[n].offset = extent_start;
+                new_extents[n].length = start - extent_start;
+                n++;
+            }
+            if (extent_end > end) {
+                new_extents[n].offset = end;
+                new_extents[n].length = extent_end - end;
+                n++;
+            }
+        }
+    }
+
+    if (data && !inserted) {
+        new_extents[n].offset = start;
+        new_extents[n].length = end - start;
+        n++;
+    }
+
+    free(state->extent_map.extents);
+    state->extent_map.extents = new_extents;
+    state->extent_map.count = n;
+    return NO_ERROR;
+}
+
+/* caller must hold |state->extent_map.lock| exclusively */
+static void extent_map_discard(
+    IN nfs41_open_state *state)
+{
+    free(state->extent_map.extents);
+    state->extent_map.extents = NULL;
+    state->extent_map.count = 0;
+    state->extent_map.valid = FALSE;
+}
+
+/*
+ * Called after our own WRITE (|data| is |TRUE|) or DEALLOCATE (|data|
+ * is |FALSE|) of |offset| to |offset+length| through |state|, |change|
+ * is the change attribute returned by the operation
+ */
+void nfs41_extent_map_update(
+    IN nfs41_open_state *state,
+    IN uint64_t offset,
+    IN uint64_t length,
+    IN bool_t data,
+    IN uint64_t change)
+{
+    uint64_t start, end;
+
+    AcquireSRWLockExclusive(&state->extent_map.lock);
+    if (!state->extent_map.valid)
+        goto out;
+
+    end = ((NFS4_UINT64_MAX - offset) < length)?
+        NFS4_UINT64_MAX : (offset + length);
+    start = max(offset, state->extent_map.start);
+    end = min(end, state->extent_map.end);
+
+    if ((start < end) &&
+        extent_map_set(state, start, end, data)) {
+        DPRINTF(QARLVL, ("nfs41_extent_map_update(state->path.path='%s'): "
+            "out of memory, discarding extent map\n",
+            state->path.path));
+        extent_map_discard(state);
+        goto out;
+    }
+    state->extent_map.change = change;
+out:
+    ReleaseSRWLockExclusive(&state->extent_map.lock);
+}
+
+void nfs41_extent_map_invalidate(
+    IN nfs41_open_state *state)
+{
+    AcquireSRWLockExclusive(&state->extent_map.lock);
+    extent_map_discard(state);
+    ReleaseSRWLockExclusive(&state->extent_map.lock);
+}
+
+/*
+ * Answer the query from the extent map if it was made for the current
+ * change attribute and covers |start_offset| to |end_offset|, returns
+ * |ERROR_FILE_NOT_FOUND| if the map cannot be used
+ */
+static int extent_map_query(
+    IN nfs41_open_state *state,
+    IN uint64_t change,
+    IN uint64_t start_offset,
+    IN uint64_t end_offset,
+    OUT FILE_ALLOCATED_RANGE_BUFFER *outbuffer,
+    IN size_t out_maxrecords,
+    OUT size_t *restrict res_num_records)
+{
+    int status = ERROR_FILE_NOT_FOUND;
+
+    AcquireSRWLockShared(&state->extent_map.lock);
+    if (state->extent_map.valid &&
+        (state->extent_map.change == change) &&
+        (state->extent_map.start <= start_offset) &&
+        (state->extent_map.end >= end_offset)) {
+        status = fill_allocated_ranges(state->extent_map.extents,
+            state->extent_map.count,
+            state->extent_map.end,
+            start_offset, end_offset,
+            outbuffer, out_maxrecords, res_num_records);
+        DPRINTF(QARLVL, ("extent_map_query(state->path.path='%s'): "
+            "answered from extent map, status=%d\n",
+            state->path.path, status));
+    }
+    ReleaseSRWLockShared(&state->extent_map.lock);
+    return status;
+}
+
+/* hand |extents| over to the extent map of |state| */
+static void extent_map_install(
+    IN nfs41_open_state *state,
+    IN uint64_t change,
+    IN uint64_t start_offset,
+    IN uint64_t covered_end,
+    IN nfs41_data_extent *extents,
+    IN uint32_t count)
+{
+    AcquireSRWLockExclusive(&state->extent_map.lock);
+    extent_map_discard(state);
+    state->extent_map.extents = extents;
+    state->extent_map.count = count;
+    state->extent_map.change = change;
+    state->extent_map.start = start_offset;
+    state->extent_map.end = covered_end;
+    state->extent_map.valid = TRUE;
+    ReleaseSRWLockExclusive(&state->extent_map.lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
+static
+int query_sparsefile_datasections(nfs41_open_state *state,
+    uint64_t start_offset,
+    uint64_t end_offset,
+    FILE_ALLOCATED_RANGE_BUFFER *outbuffer,
+    size_t out_maxrecords,
+    size_t *restrict res_num_records)
+{
+    int status = NO_ERROR;
+    nfs41_session *session = state->session;
+    nfs41_data_extent *extents = NULL;
+    uint32_t count = 0;
+    uint64_t covered_end = 0;
+    uint32_t max_extents;
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    nfs41_file_info info;
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
+    DPRINTF(QARLVL,
+        ("--> query_sparsefile_datasections(state->path.path='%s')\n",
+        state->path.path));
+
+    *res_num_records = 0;
+
+    /* NFS SEEK supported ? */
+    if (session->client->root->supports_nfs42_seek == false) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out;
+    }
+
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    (void)memset(&info, 0, sizeof(info));
+    status = nfs41_cached_getattr(session, &state->file, NULL, &info);
+    if (status) {
+        status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
+        goto out;
     }
 
+    status = extent_map_query(state, info.change,
+        start_offset, end_offset,
+        outbuffer, out_maxrecords, res_num_records);
+    if (status != ERROR_FILE_NOT_FOUND)
+        goto out;
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
+    max_extents = (uint32_t)min(max(out_maxrecords + 1,
+        EXTENT_MAP_MAX_EXTENTS), UINT32_MAX);
+
+    status = seek_data_extents(state, start_offset, end_offset,
+        max_extents, &extents, &count, &covered_end);
+    if (status)
+        goto out;
+
+    status = fill_allocated_ranges(extents, count, covered_end,
+        start_offset, end_offset,
+        outbuffer, out_maxrecords, res_num_records);
+
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    /*
+     * Keep the map for follow-up queries, a concurrent WRITE changes
+     * the change attribute, so the next query will rebuild it
+     */
+    extent_map_install(state, info.change,
+        start_offset, covered_end, extents, count);
+#else
+    free(extents);
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
 out:
-    if (error_more_data) {
+    if (status == ERROR_MORE_DATA) {
         DPRINTF(QARLVL, ("returning ERROR_MORE_DATA, *res_num_records=%ld\n",
             (long)*res_num_records));
-        status = ERROR_MORE_DATA;
     }
 
     DPRINTF(QARLVL, ("<-- query_sparsefile_datasections(), status=0x%x\n",
@@ -236,7 +545,6 @@ out:
     return status;
 }
 
-
 static
 int handle_queryallocatedranges(void *daemon_context,
     nfs41_upcall *upcall)
@@ -348,6 +656,16 @@ out:
 }
 
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+static int zero_fill_range(
+    IN LONGLONG xid,
+    IN nfs41_open_state *state,
+    IN stateid_arg *stateid,
+    IN uint64_t offset,
+    IN uint64_t length,
+    OUT nfs41_file_info *info);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
+
 static
 int handle_setzerodata(void *daemon_context,
     nfs41_upcall *upcall)
@@ -362,6 +680,7 @@ int handle_setzerodata(void *daemon_context,
     int64_t offset_end; /* signed! */
     int64_t len; /* signed! */
     stateid_arg stateid;
+    bool_t zero_fill = FALSE;
 
     (void)memset(&info, 0, sizeof(info));
 
@@ -380,11 +699,20 @@ int handle_setzerodata(void *daemon_context,
             offset_end,
             len));
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+    /*
+     * DEALLOCATE leaves a hole, which is only fine for sparse files.
+     * Otherwise write zeros, which keeps the range allocated
+     */
+    zero_fill = (file->fh.superblock->sparse_file_support == 0) ||
+        (session->client->root->supports_nfs42_deallocate == false);
+#else
     /* NFS DEALLOCATE supported ? */
     if (session->client->root->supports_nfs42_deallocate == false) {
         status = ERROR_NOT_SUPPORTED;
         goto out;
     }
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
 
     if (len < 0) {
         status = ERROR_INVALID_PARAMETER;
@@ -401,12 +729,19 @@ int handle_setzerodata(void *daemon_context,
 
     nfs41_open_stateid_arg(state, &stateid);
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+    if (zero_fill)
+        status = zero_fill_range((LONGLONG)upcall->xid, state, &stateid,
+            offset_start, len, &info);
+    else
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
     status = nfs42_deallocate(session, file, &stateid,
          offset_start, len, &info);
      if (status) {
         DPRINTF(SZDLVL, ("handle_setzerodata(state->path.path='%s'): "
-            "DEALLOCATE failed with '%s'\n",
+            "%s failed with '%s'\n",
             state->path.path,
+            (zero_fill?"zero fill":"DEALLOCATE"),
             nfs_error_string(status)));
         status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
         goto out;
@@ -416,6 +751,11 @@ int handle_setzerodata(void *daemon_context,
     EASSERT(bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_CHANGE));
     args->ctime = info.change;
 
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    nfs41_extent_map_update(state, offset_start, len, zero_fill,
+        info.change);
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
     DPRINTF(SZDLVL,
         ("handle_setzerodata(state->path.path='%s'): args->ctime=%llu\n",
         state->path.path,
@@ -483,179 +823,934 @@ out:
     return status;
 }
 
-static
-int duplicate_sparsefile(nfs41_opcodes opcode,
-    nfs41_open_state *src_state,
-    nfs41_open_state *dst_state,
-    uint64_t srcfileoffset,
-    uint64_t destfileoffset,
-    uint64_t bytecount,
-    nfs41_file_info *info)
+/*
+ * Asynchronous COPY
+ *
+ * |duplicate_sparsefile()| asks the server for asynchronous COPYs. If
+ * the server runs a copy in the background, it returns a callback id
+ * and sends the result with CB_OFFLOAD later. The upcall waits for
+ * that, checks with OFFLOAD_STATUS every |COPY_OFFLOAD_POLL_MS|
+ * milliseconds in case the callback got lost, and uses |delayxid()|
+ * so the kernel keeps waiting for the upcall.
+ * A CB_OFFLOAD which arrives before we processed the COPY reply is
+ * kept on |copy_offloads.unclaimed|, with at most
+ * |COPY_OFFLOAD_UNCLAIMED_MAX| entries.
+ */
+#define COPY_OFFLOAD_POLL_MS        (5000UL)
+#define COPY_OFFLOAD_UNCLAIMED_MAX  16
+/* number of times to repeat a COPY on write verifier mismatch */
+#define COPY_VERIFIER_RETRIES       3
+
+struct copy_offload {
+    struct list_entry entry;
+    const nfs41_client *client;
+    stateid4 stateid;
+    HANDLE event; /* NULL for |copy_offloads.unclaimed| */
+    bool_t done;
+    uint32_t status;
+    uint64_t count;
+    uint32_t committed;
+    bool_t verf_valid; /* OFFLOAD_STATUS doesn't return a verifier */
+    unsigned char writeverf[NFS4_VERIFIER_SIZE];
+};
+
+static struct {
+    SRWLOCK lock;
+    struct list_entry waiters;
+    struct list_entry unclaimed; /* oldest first */
+    uint32_t unclaimed_count;
+} copy_offloads = {
+    .lock = SRWLOCK_INIT,
+    .waiters = { &copy_offloads.waiters, &copy_offloads.waiters },
+    .unclaimed = { &copy_offloads.unclaimed, &copy_offloads.unclaimed },
+};
+
+/* |nfs42_copy()| returns a zero callback id if the copy is done */
+static bool_t copy_is_async(
+    IN const stateid4 *callback_id)
 {
-    int status = NO_ERROR;
-    nfs41_session *session = src_state->session;
-    uint64_t next_offset;
-    uint64_t end_offset;
-    uint64_t data_size;
-    int data_seek_status;
-    bool_t data_seek_sr_eof;
-    uint64_t data_seek_sr_offset;
-    int hole_seek_status;
-    bool_t hole_seek_sr_eof;
-    uint64_t hole_seek_sr_offset;
-    size_t i;
+    static const unsigned char zero_other[NFS4_STATEID_OTHER] = { 0 };
 
-    nfs41_path_fh *src_file = &src_state->file;
-    nfs41_path_fh *dst_file = &dst_state->file;
-    stateid_arg src_stateid;
-    stateid_arg dst_stateid;
+    return memcmp(callback_id->other, zero_other, NFS4_STATEID_OTHER) != 0;
+}
 
-    (void)memset(info, 0, sizeof(*info));
+/* expects the caller to hold |copy_offloads.lock| */
+static struct copy_offload *copy_offload_find(
+    IN struct list_entry *list,
+    IN const nfs41_client *client,
+    IN const stateid4 *stateid)
+{
+    struct list_entry *entry;
+    struct copy_offload *offload;
+
+    list_for_each(entry, list) {
+        offload = list_container(entry, struct copy_offload, entry);
+        if ((offload->client == client) &&
+            (!memcmp(offload->stateid.other, stateid->other,
+                NFS4_STATEID_OTHER)))
+            return offload;
+    }
+    return NULL;
+}
 
-    DPRINTF(DDLVL,
-        ("--> duplicate_sparsefile(opcode='%s',src_state->path.path='%s')\n",
-        opcode2string(opcode),
-        src_state->path.path));
+void nfs42_copy_offload_done(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid,
+    IN uint32_t status,
+    IN uint64_t count,
+    IN uint32_t committed,
+    IN const unsigned char *writeverf)
+{
+    struct copy_offload *offload;
+
+    DPRINTF(DDLVL, ("nfs42_copy_offload_done: status='%s' count=%llu\n",
+        nfs_error_string(status), (unsigned long long)count));
+
+    AcquireSRWLockExclusive(&copy_offloads.lock);
+    offload = copy_offload_find(&copy_offloads.waiters, client, stateid);
+    if (offload == NULL) {
+        /* the COPY reply is still on its way */
+        offload = calloc(1, sizeof(struct copy_offload));
+        if (offload == NULL) {
+            eprintf("nfs42_copy_offload_done: out of memory\n");
+            goto out_unlock;
+        }
+        offload->client = client;
+        (void)memcpy(&offload->stateid, stateid, sizeof(stateid4));
+        list_add_tail(&copy_offloads.unclaimed, &offload->entry);
+        copy_offloads.unclaimed_count++;
 
-    nfs41_open_stateid_arg(src_state, &src_stateid);
-    nfs41_open_stateid_arg(dst_state, &dst_stateid);
+        while (copy_offloads.unclaimed_count > COPY_OFFLOAD_UNCLAIMED_MAX) {
+            struct list_entry *oldest = copy_offloads.unclaimed.next;
 
-    /*
-     * First punch a hole into the destination to make sure that any
-     * data ranges in the destination from |destfileoffset| to
-     * |destfileoffset+bytecount| are gone
-     */
-    status = nfs42_deallocate(session,
-        dst_file,
-        &dst_stateid,
-        destfileoffset,
-        bytecount,
-        info);
-    if (status) {
-        DPRINTF(0/*DDLVL*/,
-            ("duplicate_sparsefile("
-            "opcode='%s',"
-            "src_state->path.path='%s' "
-            "dst_state->path.path='%s'): "
-            "DEALLOCATE failed with '%s'\n",
-            opcode2string(opcode),
-            src_state->path.path,
-            dst_state->path.path,
-            nfs_error_string(status)));
-        status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
-        goto out;
+            list_remove(oldest);
+            copy_offloads.unclaimed_count--;
+            free(list_container(oldest, struct copy_offload, entry));
+        }
     }
 
-    next_offset = srcfileoffset;
-    end_offset = srcfileoffset + bytecount;
+    offload->status = status;
+    offload->count = count;
+    offload->committed = committed;
+    offload->verf_valid = TRUE;
+    (void)memcpy(offload->writeverf, writeverf, NFS4_VERIFIER_SIZE);
+    offload->done = TRUE;
+    if (offload->event)
+        (void)SetEvent(offload->event);
+out_unlock:
+    ReleaseSRWLockExclusive(&copy_offloads.lock);
+}
 
-    for (i=0 ; ; i++) {
-        data_seek_status = nfs42_seek(session,
-            &src_state->file,
-            &src_stateid,
-            next_offset,
-            NFS4_CONTENT_DATA,
-            &data_seek_sr_eof,
-            &data_seek_sr_offset);
+/* wait for the result of an asynchronous COPY */
+static int copy_offload_wait(
+    IN LONGLONG xid,
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dst_file,
+    IN stateid4 *callback_id,
+    OUT uint64_t *bytes_written,
+    OUT nfs41_write_verf *writeverf,
+    OUT bool_t *verf_valid)
+{
+    struct copy_offload waiter, *early;
+    uint64_t count;
+    bool_t complete, done, poll_failed = FALSE;
+    uint32_t complete_status;
+    int status;
 
-#ifdef LINUX_NFSD_SEEK_NXIO_BUG_WORKAROUND
-        if (data_seek_status == NFS4ERR_NXIO) {
-            DPRINTF(DDLVL, ("SEEK_DATA failed with NFS4ERR_NXIO\n"));
-            goto out;
-        }
-#endif /* LINUX_NFSD_SEEK_NXIO_BUG_WORKAROUND */
-        if (data_seek_status) {
-            status = nfs_to_windows_error(data_seek_status,
-                ERROR_INVALID_PARAMETER);
-            DPRINTF(DDLVL,
-                ("SEEK_DATA failed "
-                "OP_SEEK(sa_offset=%llu,sa_what=SEEK_DATA) "
-                "failed with %d(='%s')\n",
-                next_offset,
-                data_seek_status,
-                nfs_error_string(data_seek_status)));
-            goto out;
-        }
+    (void)memset(&waiter, 0, sizeof(waiter));
+    list_init(&waiter.entry);
+    waiter.client = session->client;
+    (void)memcpy(&waiter.stateid, callback_id, sizeof(stateid4));
+    waiter.event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (waiter.event == NULL) {
+        /* not fatal, we still poll with OFFLOAD_STATUS */
+        eprintf("copy_offload_wait: CreateEventA() failed with %d\n",
+            (int)GetLastError());
+    }
 
-        next_offset = data_seek_sr_offset;
+    AcquireSRWLockExclusive(&copy_offloads.lock);
+    early = copy_offload_find(&copy_offloads.unclaimed,
+        waiter.client, callback_id);
+    if (early) {
+        list_remove(&early->entry);
+        copy_offloads.unclaimed_count--;
+        waiter.done = TRUE;
+        waiter.status = early->status;
+        waiter.count = early->count;
+        waiter.committed = early->committed;
+        waiter.verf_valid = early->verf_valid;
+        (void)memcpy(waiter.writeverf, early->writeverf,
+            NFS4_VERIFIER_SIZE);
+        free(early);
+    } else {
+        list_add_tail(&copy_offloads.waiters, &waiter.entry);
+    }
+    ReleaseSRWLockExclusive(&copy_offloads.lock);
 
-        hole_seek_status = nfs42_seek(session,
-            &src_state->file,
-            &src_stateid,
-            next_offset,
-            NFS4_CONTENT_HOLE,
-            &hole_seek_sr_eof,
-            &hole_seek_sr_offset);
-        if (hole_seek_status) {
-            status = nfs_to_windows_error(hole_seek_status,
-                ERROR_INVALID_PARAMETER);
-            DPRINTF(DDLVL,
-                ("SEEK_HOLE failed "
-                "OP_SEEK(sa_offset=%llu,sa_what=SEEK_HOLE) "
-                "failed with %d(='%s')\n",
-                next_offset,
-                hole_seek_status,
-                nfs_error_string(hole_seek_status)));
-            goto out;
-        }
+    for (;;) {
+        AcquireSRWLockShared(&copy_offloads.lock);
+        done = waiter.done;
+        ReleaseSRWLockShared(&copy_offloads.lock);
+        if (done)
+            break;
 
-        next_offset = hole_seek_sr_offset;
+        /* make sure the kernel waits for us */
+        (void)delayxid(xid, 30+(COPY_OFFLOAD_POLL_MS/1000));
+        if (waiter.event)
+            (void)WaitForSingleObject(waiter.event, COPY_OFFLOAD_POLL_MS);
+        else
+            Sleep(COPY_OFFLOAD_POLL_MS);
+
+        AcquireSRWLockShared(&copy_offloads.lock);
+        done = waiter.done;
+        ReleaseSRWLockShared(&copy_offloads.lock);
+        if (done)
+            break;
 
-        data_size = hole_seek_sr_offset - data_seek_sr_offset;
+        status = nfs42_offload_status(session, dst_file, callback_id,
+            &count, &complete, &complete_status);
+        DPRINTF(DDLVL, ("copy_offload_wait: OFFLOAD_STATUS returned '%s', "
+            "count=%llu complete=%d\n", nfs_error_string(status),
+            (unsigned long long)count, (int)complete));
+
+        AcquireSRWLockExclusive(&copy_offloads.lock);
+        if (!waiter.done) {
+            if (status == NFS4_OK) {
+                if (complete) {
+                    waiter.done = TRUE;
+                    waiter.status = complete_status;
+                    waiter.count = count;
+                    waiter.committed = UNSTABLE4;
+                    waiter.verf_valid = FALSE;
+                }
+            } else if (status == NFS4ERR_NOTSUPP) {
+                /* wait for CB_OFFLOAD only */
+            } else if (poll_failed) {
+                /* the copy is gone, and so is its CB_OFFLOAD */
+                waiter.done = TRUE;
+                waiter.status = status;
+                waiter.count = 0;
+            } else {
+                /* the copy may have just finished, give its
+                 * CB_OFFLOAD one more round */
+                poll_failed = TRUE;
+            }
+        }
+        ReleaseSRWLockExclusive(&copy_offloads.lock);
+    }
 
-        DPRINTF(DDLVL,
+    AcquireSRWLockExclusive(&copy_offloads.lock);
+    list_remove(&waiter.entry);
+    ReleaseSRWLockExclusive(&copy_offloads.lock);
+    if (waiter.event)
+        (void)CloseHandle(waiter.event);
+
+    *bytes_written = waiter.count;
+    writeverf->committed = waiter.committed;
+    (void)memcpy(writeverf->verf, waiter.writeverf, NFS4_VERIFIER_SIZE);
+    *verf_valid = waiter.verf_valid;
+    return waiter.status;
+}
+
+/*
+ * COMMIT the data of a COPY which the server did not write to stable
+ * storage, |*verf_changed| tells the caller to repeat the COPY
+ */
+static int copy_commit(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dst_file,
+    IN uint64_t offset,
+    IN uint64_t length,
+    IN const nfs41_write_verf *writeverf,
+    IN bool_t verf_valid,
+    OUT bool_t *verf_changed,
+    OUT nfs41_file_info *info)
+{
+    nfs41_write_verf commit_verf;
+    uint32_t count;
+    int status;
+
+    *verf_changed = FALSE;
+
+    /* a count of zero commits everything from |offset| on */
+    count = (length > UINT32_MAX)?0:(uint32_t)length;
+
+    (void)memcpy(commit_verf.expected, writeverf->verf, NFS4_VERIFIER_SIZE);
+    status = nfs41_commit(session, dst_file, offset, count, 1,
+        &commit_verf, info);
+    if (status)
+        goto out;
+
+    if (verf_valid && !verify_commit(&commit_verf))
+        *verf_changed = TRUE;
+out:
+    return status;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+/*
+ * Allocated zero ranges
+ *
+ * |zero_fill_range()| writes zeros into ranges which must stay
+ * allocated, where a DEALLOCATE would leave a hole. The
+ * |ZERO_FILL_BLOCK_SIZE| aligned part of the range is sent as WRITE_SAME
+ * with a zero block as pattern, the unaligned head and tail (and
+ * everything if the server does not support WRITE_SAME) are written
+ * from the shared |zero_fill_buffer|. All of it is written UNSTABLE4
+ * and committed once at the end.
+ */
+#define ZERO_FILL_BLOCK_SIZE    4096
+#define ZERO_FILL_BUFFER_SIZE   (1024*1024)
+/* smaller aligned parts are not worth a WRITE_SAME */
+#define ZERO_FILL_MIN_BLOCKS    16
+
+static const unsigned char zero_fill_buffer[ZERO_FILL_BUFFER_SIZE];
+
+typedef struct __zero_fill_state {
+    LONGLONG xid;
+    nfs41_session *session;
+    nfs41_path_fh *file;
+    stateid_arg *stateid;
+    nfs41_file_info *info;
+    nfs41_write_verf verf; /* of the first UNSTABLE4 reply */
+    bool_t unstable;
+    bool_t verf_valid; /* FALSE if OFFLOAD_STATUS had no verifier */
+    bool_t verf_changed;
+} zero_fill_state;
+
+static void zero_fill_note_verf(
+    IN OUT zero_fill_state *zf,
+    IN const nfs41_write_verf *verf,
+    IN bool_t verf_valid)
+{
+    if (verf->committed == FILE_SYNC4)
+        return;
+
+    if (!verf_valid) {
+        zf->unstable = TRUE;
+        zf->verf_valid = FALSE;
+    }
+    else if (!zf->unstable) {
+        (void)memcpy(zf->verf.verf, verf->verf, NFS4_VERIFIER_SIZE);
+        zf->unstable = TRUE;
+    }
+    else if (memcmp(zf->verf.verf, verf->verf, NFS4_VERIFIER_SIZE)) {
+        /* the server restarted between two of our writes */
+        zf->verf_changed = TRUE;
+    }
+}
+
+static int zero_fill_writes(
+    IN OUT zero_fill_state *zf,
+    IN uint64_t offset,
+    IN uint64_t length)
+{
+    const uint32_t maxwritesize = min(max_write_size(zf->session,
+        &zf->file->fh), ZERO_FILL_BUFFER_SIZE);
+    nfs41_write_verf verf;
+    uint32_t chunk, bytes_written;
+    int status = NFS4_OK;
+
+    while (length > 0ULL) {
+        chunk = (uint32_t)min(length, maxwritesize);
+        status = nfs41_write(zf->session, zf->file, zf->stateid,
+            (unsigned char *)zero_fill_buffer, chunk, offset, UNSTABLE4,
+            &bytes_written, &verf, zf->info);
+        if (status)
+            break;
+        if (bytes_written == 0) {
+            status = NFS4ERR_IO;
+            break;
+        }
+        zero_fill_note_verf(zf, &verf, TRUE);
+        offset += bytes_written;
+        length -= bytes_written;
+    }
+    return status;
+}
+
+static int zero_fill_write_same(
+    IN OUT zero_fill_state *zf,
+    IN uint64_t offset,
+    IN uint64_t block_count,
+    OUT uint64_t *bytes_written)
+{
+    nfs41_write_verf verf;
+    stateid4 callback_id;
+    bool_t verf_valid = TRUE;
+    int status;
+
+    *bytes_written = 0ULL;
+    status = nfs42_write_same(zf->session, zf->file, zf->stateid,
+        offset, ZERO_FILL_BLOCK_SIZE, block_count,
+        zero_fill_buffer, ZERO_FILL_BLOCK_SIZE, UNSTABLE4,
+        bytes_written, &verf, &callback_id, zf->info);
+    if (status)
+        goto out;
+
+    if (copy_is_async(&callback_id)) {
+        DPRINTF(SZDLVL, ("zero_fill_write_same: "
+            "waiting for asynchronous WRITE_SAME\n"));
+        status = copy_offload_wait(zf->xid, zf->session, zf->file,
+            &callback_id, bytes_written, &verf, &verf_valid);
+        if (status)
+            goto out;
+        nfs41_superblock_space_changed(zf->file->fh.superblock);
+    }
+    zero_fill_note_verf(zf, &verf, verf_valid);
+out:
+    return status;
+}
+
+static int zero_fill_range(
+    IN LONGLONG xid,
+    IN nfs41_open_state *state,
+    IN stateid_arg *stateid,
+    IN uint64_t offset,
+    IN uint64_t length,
+    OUT nfs41_file_info *info)
+{
+    nfs41_root *root = state->session->client->root;
+    const uint64_t end = offset + length;
+    zero_fill_state zf;
+    uint64_t pos, head, blocks, bytes_written;
+    uint32_t retries = COPY_VERIFIER_RETRIES;
+    bool_t verf_changed;
+    bitmap4 attr_request;
+    int status;
+
+    DPRINTF(SZDLVL, ("--> zero_fill_range(state->path.path='%s', "
+        "offset=%llu, length=%llu)\n",
+        state->path.path,
+        (unsigned long long)offset,
+        (unsigned long long)length));
+
+    for (;;) {
+        (void)memset(&zf, 0, sizeof(zf));
+        zf.xid = xid;
+        zf.session = state->session;
+        zf.file = &state->file;
+        zf.stateid = stateid;
+        zf.info = info;
+        zf.verf_valid = TRUE;
+
+        head = (ZERO_FILL_BLOCK_SIZE -
+            (offset % ZERO_FILL_BLOCK_SIZE)) % ZERO_FILL_BLOCK_SIZE;
+        head = min(head, length);
+        status = zero_fill_writes(&zf, offset, head);
+        if (status)
+            goto out;
+        pos = offset + head;
+
+        while (root->supports_nfs42_write_same &&
+            ((blocks = (end - pos) / ZERO_FILL_BLOCK_SIZE) >=
+                ZERO_FILL_MIN_BLOCKS)) {
+            status = zero_fill_write_same(&zf, pos, blocks,
+                &bytes_written);
+            if (status == NFS4ERR_NOTSUPP) {
+                DPRINTF(1, ("zero_fill_range: "
+                    "server does not support WRITE_SAME, "
+                    "falling back to WRITE\n"));
+                root->supports_nfs42_write_same = false;
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+                client_server_set_notsupp(zf.session->client,
+                    NFS41_SERVER_NOTSUPP_WRITE_SAME);
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+                status = NFS4_OK;
+                break;
+            }
+            if (status)
+                goto out;
+            if (bytes_written == 0ULL)
+                break;
+            pos += bytes_written;
+        }
+
+        status = zero_fill_writes(&zf, pos, end - pos);
+        if (status)
+            goto out;
+
+        verf_changed = zf.verf_changed;
+        if (zf.unstable && !verf_changed) {
+            status = copy_commit(zf.session, zf.file, offset, length,
+                &zf.verf, zf.verf_valid, &verf_changed, info);
+            if (status)
+                goto out;
+        }
+        if (!verf_changed)
+            break;
+
+        /* the server restarted, write the range again */
+        if (retries-- == 0) {
+            status = NFS4ERR_IO;
+            goto out;
+        }
+        DPRINTF(SZDLVL, ("zero_fill_range: "
+            "write verifier changed, repeating writes\n"));
+    }
+
+    /* UNSTABLE4 WRITEs do no GETATTR, and there was no COMMIT */
+    if (!zf.unstable) {
+        nfs41_superblock_getattr_mask(zf.file->fh.superblock,
+            &attr_request);
+        status = nfs41_getattr(zf.session, zf.file, &attr_request, info);
+    }
+out:
+    DPRINTF(SZDLVL, ("<-- zero_fill_range(), status='%s'\n",
+        nfs_error_string(status)));
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
+
+/*
+ * Parallel COPY/CLONE of sparse files
+ *
+ * |duplicate_sparsefile()| first collects the data extents of the
+ * source range with SEEK_DATA/SEEK_HOLE, and then copies or clones
+ * them with up to |MAX_DUPLICATE_PIPELINE_DEPTH| compounds in flight,
+ * each on its own session slot. The calling thread is one of the
+ * workers. CLONEs for several extents are sent in one compound, as far
+ * as |NFS42_MAX_CLONES_PER_COMPOUND| and the session's
+ * |ca_maxoperations| allow. Set the depth to |1| to send the compounds
+ * one after another.
+ */
+#define MAX_DUPLICATE_PIPELINE_DEPTH 4
+
+typedef struct __dup_extent {
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t length;
+} dup_extent;
+
+typedef struct __dup_batch {
+    /* per-batch copies, updated by recovery */
+    stateid_arg src_stateid;
+    stateid_arg dst_stateid;
+    uint32_t first;
+    uint32_t count;
+    int status;
+} dup_batch;
+
+typedef struct __dup_pipeline {
+    nfs41_opcodes opcode;
+    LONGLONG xid;
+    nfs41_session *session;
+    nfs41_path_fh *src_file;
+    nfs41_path_fh *dst_file;
+    /* non-NULL for an inter-server COPY */
+    const nfs42_netloc_list *source_servers;
+    dup_extent *extents;
+    uint32_t extent_count;
+    dup_batch *batches;
+    uint32_t batch_count;
+    volatile LONG next;
+} dup_pipeline;
+
+/* collect the data extents from |srcfileoffset| to |end_offset| */
+static int dup_collect_extents(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *src_file,
+    IN stateid_arg *src_stateid,
+    IN uint64_t srcfileoffset,
+    IN uint64_t destfileoffset,
+    IN uint64_t end_offset,
+    OUT dup_extent **extents_out,
+    OUT uint32_t *count_out)
+{
+    dup_extent *extents = NULL, *new_extents;
+    uint32_t count = 0, max_count = 0;
+    uint64_t next_offset = srcfileoffset;
+    uint64_t data_seek_sr_offset, hole_seek_sr_offset, data_end;
+    bool_t data_seek_sr_eof, hole_seek_sr_eof;
+    int status = NO_ERROR;
+    int seek_status;
+
+    for (;;) {
+        seek_status = nfs42_seek(session,
+            src_file,
+            src_stateid,
+            next_offset,
+            NFS4_CONTENT_DATA,
+            &data_seek_sr_eof,
+            &data_seek_sr_offset);
+
+#ifdef LINUX_NFSD_SEEK_NXIO_BUG_WORKAROUND
+        if (seek_status == NFS4ERR_NXIO) {
+            DPRINTF(DDLVL, ("SEEK_DATA failed with NFS4ERR_NXIO\n"));
+            break;
+        }
+#endif /* LINUX_NFSD_SEEK_NXIO_BUG_WORKAROUND */
+        if (seek_status) {
+            status = nfs_to_windows_error(seek_status,
+                ERROR_INVALID_PARAMETER);
+            DPRINTF(DDLVL,
+                ("SEEK_DATA failed "
+                "OP_SEEK(sa_offset=%llu,sa_what=SEEK_DATA) "
+                "failed with %d(='%s')\n",
+                next_offset,
+                seek_status,
+                nfs_error_string(seek_status)));
+            goto out_free;
+        }
+
+        seek_status = nfs42_seek(session,
+            src_file,
+            src_stateid,
+            data_seek_sr_offset,
+            NFS4_CONTENT_HOLE,
+            &hole_seek_sr_eof,
+            &hole_seek_sr_offset);
+        if (seek_status) {
+            status = nfs_to_windows_error(seek_status,
+                ERROR_INVALID_PARAMETER);
+            DPRINTF(DDLVL,
+                ("SEEK_HOLE failed "
+                "OP_SEEK(sa_offset=%llu,sa_what=SEEK_HOLE) "
+                "failed with %d(='%s')\n",
+                data_seek_sr_offset,
+                seek_status,
+                nfs_error_string(seek_status)));
+            goto out_free;
+        }
+
+        next_offset = hole_seek_sr_offset;
+
+        DPRINTF(DDLVL,
             ("data_section: from "
             "%llu to %llu, size=%llu (data_eof=%d, hole_eof=%d)\n",
             data_seek_sr_offset,
             hole_seek_sr_offset,
-            data_size,
+            hole_seek_sr_offset - data_seek_sr_offset,
             (int)data_seek_sr_eof,
             (int)hole_seek_sr_eof));
 
-        if (opcode == NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY) {
-            uint64_t bytes_written;
-            uint64_t bytestowrite = data_size;
-            uint64_t writeoffset = 0ULL;
-
-            do
-            {
-                nfs41_write_verf verf;
-                bytes_written = 0ULL;
-
-                status = nfs42_copy(session,
-                    src_file,
-                    dst_file,
-                    &src_stateid,
-                    &dst_stateid,
-                    (data_seek_sr_offset + writeoffset),
-                    (destfileoffset + (data_seek_sr_offset-srcfileoffset) + writeoffset),
-                    bytestowrite,
-                    &bytes_written,
-                    &verf,
-                    info);
-                if (status)
+        data_end = min(hole_seek_sr_offset, end_offset);
+        if (data_seek_sr_offset < data_end) {
+            if (count == max_count) {
+                max_count = max_count ? (max_count * 2) : 64;
+                new_extents = realloc(extents,
+                    max_count * sizeof(dup_extent));
+                if (new_extents == NULL) {
+                    status = ERROR_NOT_ENOUGH_MEMORY;
+                    goto out_free;
+                }
+                extents = new_extents;
+            }
+            extents[count].src_offset = data_seek_sr_offset;
+            extents[count].dst_offset = destfileoffset +
+                (data_seek_sr_offset - srcfileoffset);
+            extents[count].length = data_end - data_seek_sr_offset;
+            count++;
+        }
+
+        if (hole_seek_sr_offset >= end_offset) {
+            DPRINTF(DDLVL,
+                ("end offset reached, "
+                "hole_seek_sr_offset(=%lld) >= end_offset(=%lld)\n",
+                (long long)hole_seek_sr_offset,
+                (long long)end_offset));
+            break;
+        }
+
+        if (data_seek_sr_eof || hole_seek_sr_eof) {
+            DPRINTF(DDLVL,
+                ("EOF reached (data_seek_sr_eof=%d, hole_seek_sr_eof=%d)\n",
+                (int)data_seek_sr_eof,
+                (int)hole_seek_sr_eof));
+            break;
+        }
+    }
+
+    *extents_out = extents;
+    *count_out = count;
+out:
+    return status;
+
+out_free:
+    free(extents);
+    goto out;
+}
+
+static int dup_copy_extent(
+    IN dup_pipeline *pipeline,
+    IN dup_batch *batch,
+    IN const dup_extent *extent)
+{
+    nfs41_session *session = pipeline->session;
+    nfs41_path_fh *dst_file = pipeline->dst_file;
+    nfs41_file_info info;
+    uint64_t bytes_written;
+    uint64_t bytestowrite = extent->length;
+    uint64_t writeoffset = 0ULL;
+    uint32_t retries = COPY_VERIFIER_RETRIES;
+    int status = NFS4_OK;
+
+    do
+    {
+        nfs41_write_verf verf;
+        stateid4 callback_id;
+        bool_t verf_valid = TRUE;
+        bool_t verf_changed = FALSE;
+        const uint64_t dstoffset = extent->dst_offset + writeoffset;
+        bytes_written = 0ULL;
+
+        (void)memset(&info, 0, sizeof(info));
+        status = nfs42_copy(session,
+            pipeline->src_file,
+            dst_file,
+            &batch->src_stateid,
+            &batch->dst_stateid,
+            pipeline->source_servers,
+            (extent->src_offset + writeoffset),
+            dstoffset,
+            bytestowrite,
+            FALSE,
+            &bytes_written,
+            &verf,
+            &callback_id,
+            &info);
+        if (status)
+            break;
+
+        if (copy_is_async(&callback_id)) {
+            DPRINTF(DDLVL, ("dup_copy_extent: "
+                "waiting for asynchronous COPY\n"));
+            status = copy_offload_wait(pipeline->xid, session, dst_file,
+                &callback_id, &bytes_written, &verf, &verf_valid);
+            if (status)
+                break;
+            nfs41_superblock_space_changed(dst_file->fh.superblock);
+        }
+
+        if ((verf.committed != FILE_SYNC4) && (bytes_written > 0)) {
+            status = copy_commit(session, dst_file, dstoffset,
+                bytes_written, &verf, verf_valid, &verf_changed,
+                &info);
+            if (status)
+                break;
+            if (verf_changed) {
+                /* the server restarted, copy this part again */
+                if (retries-- == 0) {
+                    status = NFS4ERR_IO;
                     break;
+                }
+                DPRINTF(DDLVL, ("dup_copy_extent: "
+                    "write verifier changed, repeating COPY\n"));
+                continue;
+            }
+        }
 
-                bytestowrite -= bytes_written;
-                writeoffset += bytes_written;
-                /* FIXME: What should we do with |verf| ? Should we COMMIT this ? */
-            } while (bytestowrite > 0ULL);
-        }
-        else if (opcode == NFS41_SYSOP_FSCTL_DUPLICATE_DATA) {
-            status = nfs42_clone(session,
-                src_file,
-                dst_file,
-                &src_stateid,
-                &dst_stateid,
-                data_seek_sr_offset,
-                destfileoffset + (data_seek_sr_offset-srcfileoffset),
-                data_size,
-                info);
+        bytestowrite -= bytes_written;
+        writeoffset += bytes_written;
+    } while (bytestowrite > 0ULL);
+
+    return status;
+}
+
+static int dup_run_batch(
+    IN dup_pipeline *pipeline,
+    IN dup_batch *batch)
+{
+    nfs42_clone_range ranges[NFS42_MAX_CLONES_PER_COMPOUND];
+    nfs41_file_info info;
+    uint32_t i;
+    int status = NFS4_OK;
+
+    if (pipeline->opcode == NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY) {
+        for (i = 0; i < batch->count; i++) {
+            status = dup_copy_extent(pipeline, batch,
+                &pipeline->extents[batch->first + i]);
+            if (status)
+                break;
         }
-        else {
-            EASSERT(0);
+    }
+    else if (pipeline->opcode == NFS41_SYSOP_FSCTL_DUPLICATE_DATA) {
+        EASSERT(batch->count <= NFS42_MAX_CLONES_PER_COMPOUND);
+        for (i = 0; i < batch->count; i++) {
+            const dup_extent *extent = &pipeline->extents[batch->first + i];
+
+            ranges[i].src_offset = extent->src_offset;
+            ranges[i].dst_offset = extent->dst_offset;
+            ranges[i].count = extent->length;
+        }
+        (void)memset(&info, 0, sizeof(info));
+        status = nfs42_clone_ranges(pipeline->session,
+            pipeline->src_file,
+            pipeline->dst_file,
+            &batch->src_stateid,
+            &batch->dst_stateid,
+            ranges,
+            batch->count,
+            &info);
+    }
+    else {
+        EASSERT(0);
+        status = NFS4ERR_INVAL;
+    }
+    return status;
+}
+
+static unsigned int WINAPI dup_pipeline_thread(void *args)
+{
+    dup_pipeline *pipeline = (dup_pipeline *)args;
+    LONG i;
+
+    /* grab the next batch until all are done */
+    while ((i = InterlockedIncrement(&pipeline->next) - 1) <
+        (LONG)pipeline->batch_count) {
+        dup_batch *batch = &pipeline->batches[i];
+        batch->status = dup_run_batch(pipeline, batch);
+    }
+    return 0;
+}
+
+/* Run all batches of |pipeline| with up to |depth| compounds in flight */
+static void dup_pipeline_run(
+    IN dup_pipeline *pipeline,
+    IN uint32_t depth)
+{
+    HANDLE threads[MAX_DUPLICATE_PIPELINE_DEPTH-1];
+    uint32_t i, num_threads = 0;
+
+    /* don't use more requests than the server gave us slots */
+    depth = min(depth, pipeline->batch_count);
+    depth = min(depth, MAX_DUPLICATE_PIPELINE_DEPTH);
+    depth = min(depth, pipeline->session->table.max_slots);
+
+    for (i = 0; (i + 1) < depth; i++) {
+        threads[num_threads] = (HANDLE)_beginthreadex(NULL,
+            NFSD_THREAD_STACK_SIZE, dup_pipeline_thread, pipeline,
+            0, NULL);
+        if (threads[num_threads] == NULL) {
+            eprintf("dup_pipeline_run: "
+                "_beginthreadex() failed with %d\n", (int)GetLastError());
+            break;
         }
+        num_threads++;
+    }
+
+    (void)dup_pipeline_thread(pipeline);
 
+    if (num_threads) {
+        (void)WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+        for (i = 0; i < num_threads; i++)
+            (void)CloseHandle(threads[i]);
+    }
+}
+
+static
+int duplicate_sparsefile(nfs41_opcodes opcode,
+    LONGLONG xid,
+    nfs41_open_state *src_state,
+    nfs41_open_state *dst_state,
+    uint64_t srcfileoffset,
+    uint64_t destfileoffset,
+    uint64_t bytecount,
+    nfs41_file_info *info)
+{
+    int status = NO_ERROR;
+    nfs41_session *session = src_state->session;
+    nfs41_path_fh *src_file = &src_state->file;
+    nfs41_path_fh *dst_file = &dst_state->file;
+    stateid_arg src_stateid;
+    stateid_arg dst_stateid;
+    dup_pipeline pipeline;
+    uint32_t i, per_batch;
+    bitmap4 attr_request;
+
+    (void)memset(info, 0, sizeof(*info));
+    (void)memset(&pipeline, 0, sizeof(pipeline));
+
+    DPRINTF(DDLVL,
+        ("--> duplicate_sparsefile(opcode='%s',src_state->path.path='%s')\n",
+        opcode2string(opcode),
+        src_state->path.path));
+
+    nfs41_open_stateid_arg(src_state, &src_stateid);
+
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    /* CLONE may share or reallocate blocks, just rebuild the map */
+    nfs41_extent_map_invalidate(dst_state);
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
+    nfs41_open_stateid_arg(dst_state, &dst_stateid);
+
+    /*
+     * First punch a hole into the destination to make sure that any
+     * data ranges in the destination from |destfileoffset| to
+     * |destfileoffset+bytecount| are gone
+     */
+    status = nfs42_deallocate(session,
+        dst_file,
+        &dst_stateid,
+        destfileoffset,
+        bytecount,
+        info);
+    if (status) {
+        DPRINTF(0/*DDLVL*/,
+            ("duplicate_sparsefile("
+            "opcode='%s',"
+            "src_state->path.path='%s' "
+            "dst_state->path.path='%s'): "
+            "DEALLOCATE failed with '%s'\n",
+            opcode2string(opcode),
+            src_state->path.path,
+            dst_state->path.path,
+            nfs_error_string(status)));
+        status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
+        goto out;
+    }
+
+    status = dup_collect_extents(session, src_file, &src_stateid,
+        srcfileoffset, destfileoffset, srcfileoffset + bytecount,
+        &pipeline.extents, &pipeline.extent_count);
+    if (status)
+        goto out;
+
+    DPRINTF(DDLVL, ("duplicate_sparsefile: %lu data extents\n",
+        (unsigned long)pipeline.extent_count));
+
+    /* nothing but holes, the DEALLOCATE was all we had to do */
+    if (pipeline.extent_count == 0)
+        goto out;
+
+    /* SEQUENCE, PUTFH, SAVEFH, PUTFH, CLONE..., GETATTR */
+    per_batch = 1;
+    if (opcode == NFS41_SYSOP_FSCTL_DUPLICATE_DATA) {
+        per_batch = NFS42_MAX_CLONES_PER_COMPOUND;
+        if (session->fore_chan_attrs.ca_maxoperations < (per_batch + 5))
+            per_batch = session->fore_chan_attrs.ca_maxoperations - 5;
+        if ((session->fore_chan_attrs.ca_maxoperations < 6) ||
+            (per_batch == 0))
+            per_batch = 1;
+    }
+
+    pipeline.opcode = opcode;
+    pipeline.xid = xid;
+    pipeline.session = session;
+    pipeline.src_file = src_file;
+    pipeline.dst_file = dst_file;
+    pipeline.batch_count =
+        (pipeline.extent_count + per_batch - 1) / per_batch;
+    pipeline.batches = calloc(pipeline.batch_count, sizeof(dup_batch));
+    if (pipeline.batches == NULL) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto out_free;
+    }
+    for (i = 0; i < pipeline.batch_count; i++) {
+        dup_batch *batch = &pipeline.batches[i];
+
+        batch->src_stateid = src_stateid;
+        batch->dst_stateid = dst_stateid;
+        batch->first = i * per_batch;
+        batch->count = min(pipeline.extent_count - batch->first, per_batch);
+    }
+
+    dup_pipeline_run(&pipeline, MAX_DUPLICATE_PIPELINE_DEPTH);
+
+    /* report the first failure in file order */
+    for (i = 0; i < pipeline.batch_count; i++) {
+        status = pipeline.batches[i].status;
         if (status) {
             DPRINTF(0/*DDLVL*/,
                 ("duplicate_sparsefile("
@@ -668,34 +1763,165 @@ int duplicate_sparsefile(nfs41_opcodes opcode,
                 dst_state->path.path,
                 nfs_error_string(status)));
             status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
-            goto out;
-        }
-
-        if (data_seek_sr_offset > end_offset) {
-            DPRINTF(DDLVL,
-                ("end offset reached, "
-                "i=%d, data_seek_sr_offset(=%lld) > end_offset(=%lld)\n",
-                (int)i,
-                (long long)data_seek_sr_offset,
-                (long long)end_offset));
-            break;
+            goto out_free;
         }
+    }
 
-        if (data_seek_sr_eof || hole_seek_sr_eof) {
-            DPRINTF(DDLVL,
-                ("EOF reached (data_seek_sr_eof=%d, hole_seek_sr_eof=%d)\n",
-                (int)data_seek_sr_eof,
-                (int)hole_seek_sr_eof));
-            break;
-        }
+    /* the batches finished in any order, get the final attributes */
+    nfs41_superblock_getattr_mask(dst_file->fh.superblock, &attr_request);
+    status = nfs41_getattr(session, dst_file, &attr_request, info);
+    if (status) {
+        status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
+        goto out_free;
     }
 
+out_free:
+    free(pipeline.batches);
+    free(pipeline.extents);
 out:
     DPRINTF(DDLVL, ("<-- duplicate_sparsefile(), status=0x%x\n",
         status));
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+/*
+ * Inter-server COPY
+ *
+ * Source and destination are on different servers: COPY_NOTIFY on
+ * the source server allows the destination server to read the source
+ * file with the returned copy stateid, then the COPY is sent to the
+ * destination server with the source server's addresses. The copy
+ * runs as one extent through |dup_run_batch()|, so asynchronous
+ * copies and the COMMIT are handled like intra-server copies. There
+ * is no SEEK_DATA/SEEK_HOLE pass, holes in the source are copied as
+ * zeros.
+ * Returns |ERROR_NOT_SAME_DEVICE| if the servers cannot copy between
+ * each other, callers will then fall back to a buffered copy.
+ */
+static int copy_interserver(
+    IN LONGLONG xid,
+    IN nfs41_open_state *src_state,
+    IN nfs41_open_state *dst_state,
+    IN uint64_t srcfileoffset,
+    IN uint64_t destfileoffset,
+    IN uint64_t bytecount,
+    OUT nfs41_file_info *info)
+{
+    nfs41_session *src_session = src_state->session;
+    nfs41_session *dst_session = dst_state->session;
+    nfs41_path_fh *dst_file = &dst_state->file;
+    stateid_arg src_stateid;
+    stateid_arg dst_stateid;
+    stateid_arg copy_stateid;
+    nfs42_netloc destination;
+    nfs42_netloc_list source_servers;
+    dup_pipeline pipeline;
+    dup_extent extent;
+    dup_batch batch;
+    bitmap4 attr_request;
+    int status;
+
+    (void)memset(info, 0, sizeof(*info));
+
+    DPRINTF(DDLVL,
+        ("--> copy_interserver(src_state->path.path='%s',"
+        "dst_state->path.path='%s')\n",
+        src_state->path.path,
+        dst_state->path.path));
+
+    nfs41_open_stateid_arg(src_state, &src_stateid);
+    nfs41_open_stateid_arg(dst_state, &dst_stateid);
+
+    /* tell the source server who is going to read the file */
+    (void)memset(&destination, 0, sizeof(destination));
+    destination.type = NL4_NETADDR;
+    (void)memcpy(&destination.u.addr,
+        nfs41_rpc_netaddr(dst_session->client->rpc), sizeof(netaddr4));
+
+    (void)memset(&source_servers, 0, sizeof(source_servers));
+    (void)memset(&copy_stateid, 0, sizeof(copy_stateid));
+    status = nfs42_copy_notify(src_session, &src_state->file,
+        &src_stateid, &destination, &copy_stateid.stateid,
+        &source_servers);
+    if (status) {
+        DPRINTF(DDLVL, ("copy_interserver: "
+            "COPY_NOTIFY failed with '%s'\n",
+            nfs_error_string(status)));
+        goto out_status;
+    }
+    copy_stateid.type = STATEID_SPECIAL;
+
+    /* no addresses from the source server: use the one we talk to */
+    if (source_servers.count == 0) {
+        source_servers.count = 1;
+        source_servers.arr[0].type = NL4_NETADDR;
+        (void)memcpy(&source_servers.arr[0].u.addr,
+            nfs41_rpc_netaddr(src_session->client->rpc),
+            sizeof(netaddr4));
+    }
+
+    (void)memset(&pipeline, 0, sizeof(pipeline));
+    extent.src_offset = srcfileoffset;
+    extent.dst_offset = destfileoffset;
+    extent.length = bytecount;
+    batch.src_stateid = copy_stateid;
+    batch.dst_stateid = dst_stateid;
+    batch.first = 0;
+    batch.count = 1;
+    batch.status = NFS4_OK;
+
+    pipeline.opcode = NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY;
+    pipeline.xid = xid;
+    pipeline.session = dst_session;
+    pipeline.src_file = &src_state->file;
+    pipeline.dst_file = dst_file;
+    pipeline.source_servers = &source_servers;
+    pipeline.extents = &extent;
+    pipeline.extent_count = 1;
+    pipeline.batches = &batch;
+    pipeline.batch_count = 1;
+
+    status = dup_run_batch(&pipeline, &batch);
+
+    /* the copy stateid is no longer needed */
+    (void)nfs42_offload_cancel(src_session, &src_state->file,
+        &copy_stateid.stateid);
+
+    if (status) {
+        DPRINTF(DDLVL, ("copy_interserver: "
+            "COPY failed with '%s'\n",
+            nfs_error_string(status)));
+        goto out_status;
+    }
+
+    nfs41_superblock_getattr_mask(dst_file->fh.superblock, &attr_request);
+    status = nfs41_getattr(dst_session, dst_file, &attr_request, info);
+    if (status)
+        goto out_status;
+
+out:
+    DPRINTF(DDLVL, ("<-- copy_interserver(), status=0x%x\n",
+        status));
+    return status;
+
+out_status:
+    switch (status) {
+    case NFS4ERR_NOTSUPP:
+    case NFS4ERR_OFFLOAD_DENIED:
+    case NFS4ERR_PARTNER_NOTSUPP:
+    case NFS4ERR_PARTNER_NO_AUTH:
+    case NFS4ERR_WRONG_LFS:
+        status = ERROR_NOT_SAME_DEVICE;
+        break;
+    default:
+        status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
+        break;
+    }
+    goto out;
+}
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
+
 static
 int handle_duplicatedata(void *daemon_context,
     nfs41_upcall *upcall)
@@ -712,6 +1938,7 @@ int handle_duplicatedata(void *daemon_context,
     stateid_arg src_stateid;
     stateid_arg dst_stateid;
     int64_t bytecount;
+    bool_t interserver = FALSE;
 
     DPRINTF(DDLVL,
         ("--> handle_duplicatedata("
@@ -723,7 +1950,20 @@ int handle_duplicatedata(void *daemon_context,
     /*
      * Check whether we support the required NFS operations...
      */
-    if (upcall->opcode == NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY) {
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+    interserver =
+        (upcall->opcode == NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY) &&
+        (src_session->client->server != dst_session->client->server);
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
+
+    if (interserver) {
+        /* the destination server does the COPY */
+        if (dst_session->client->root->supports_nfs42_copy == false) {
+            status = ERROR_NOT_SAME_DEVICE;
+            goto out;
+        }
+    }
+    else if (upcall->opcode == NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY) {
         if ((src_session->client->root->supports_nfs42_seek == false) ||
             (src_session->client->root->supports_nfs42_copy == false) ||
             (src_session->client->root->supports_nfs42_deallocate == false)) {
@@ -815,9 +2055,10 @@ int handle_duplicatedata(void *daemon_context,
 
     /*
      * Check whether source and destination files are on the same
-     * filesystem
+     * filesystem (inter-server copies are between filesystems anyway)
      */
-    if (nfs41_fsid_cmp(&src_file_fsid, &info.fsid) != 0) {
+    if ((!interserver) &&
+        (nfs41_fsid_cmp(&src_file_fsid, &info.fsid) != 0)) {
         DPRINTF(DDLVL,
             ("handle_duplicatedata: "
             "src_file_fsid(major=%llu,minor=%llu) != "
@@ -879,7 +2120,23 @@ int handle_duplicatedata(void *daemon_context,
 
     (void)memset(&info, 0, sizeof(info));
 
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+    if (interserver) {
+        status = copy_interserver((LONGLONG)upcall->xid,
+            src_state,
+            dst_state,
+            args->srcfileoffset,
+            args->destfileoffset,
+            bytecount,
+            &info);
+        if (status)
+            goto out;
+        goto out_ctime;
+    }
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
+
     status = duplicate_sparsefile(upcall->opcode,
+        (LONGLONG)upcall->xid,
         src_state,
         dst_state,
         args->srcfileoffset,
@@ -889,6 +2146,9 @@ int handle_duplicatedata(void *daemon_context,
     if (status)
         goto out;
 
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+out_ctime:
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
     /* Update ctime on success */
     EASSERT(bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_CHANGE));
     args->ctime = info.change;
@@ -931,3 +2191,72 @@ const nfs41_upcall_op nfs41_op_offload_datacopy = {
     .marshall = marshall_duplicatedata,
     .arg_size = sizeof(duplicatedata_upcall_args)
 };
+
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+static int parse_cachecontrol(
+    const unsigned char *restrict buffer,
+    uint32_t length,
+    nfs41_upcall *upcall)
+{
+    int status;
+    cachecontrol_upcall_args *args = &upcall->args.cachecontrol;
+
+    status = safe_read(&buffer, &length, &args->op, sizeof(args->op));
+    if (status) goto out;
+
+    EASSERT(length == 0);
+
+    DPRINTF(CCLVL, ("parse_cachecontrol: parsing '%s' op=%lu\n",
+        opcode2string(upcall->opcode), (unsigned long)args->op));
+out:
+    return status;
+}
+
+static
+int handle_cachecontrol(void *daemon_context,
+    nfs41_upcall *upcall)
+{
+    int status;
+    cachecontrol_upcall_args *args = &upcall->args.cachecontrol;
+    nfs41_open_state *state = upcall->state_ref;
+    struct nfs41_name_cache *cache = session_name_cache(state->session);
+    bool ci = BIT2BOOL(state->file.fh.superblock->case_insensitive);
+
+    DPRINTF(CCLVL,
+        ("--> handle_cachecontrol(state->path.path='%s', op=%lu)\n",
+        state->path.path, (unsigned long)args->op));
+
+    switch (args->op) {
+    case NFS41_CACHE_CONTROL_PIN:
+        status = nfs41_name_cache_pin(cache, ci, state->path.path, true);
+        break;
+    case NFS41_CACHE_CONTROL_UNPIN:
+        status = nfs41_name_cache_pin(cache, ci, state->path.path, false);
+        break;
+    case NFS41_CACHE_CONTROL_FLUSH:
+        status = nfs41_name_cache_flush(cache, ci, state->path.path);
+#if defined(NFS41_DRIVER_DAEMON_DIR_DELEGATIONS) && \
+    defined(NFS41_DRIVER_DAEMON_READDIR_CACHE)
+        nfs41_readdir_cache_invalidate(&state->file.fh);
+#endif
+        break;
+    default:
+        status = ERROR_INVALID_PARAMETER;
+        break;
+    }
+
+    /* Nothing cached for this path is not an error */
+    if (status == ERROR_FILE_NOT_FOUND)
+        status = NO_ERROR;
+
+    DPRINTF(CCLVL, ("<-- handle_cachecontrol(), status=0x%lx\n",
+        (long)status));
+    return status;
+}
+
+const nfs41_upcall_op nfs41_op_cachecontrol = {
+    .parse = parse_cachecontrol,
+    .handle = handle_cachecontrol,
+    .arg_size = sizeof(cachecontrol_upcall_args)
+};
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
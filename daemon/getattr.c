@@ -40,8 +40,13 @@ int nfs41_cached_getattr(
     IN OPTIONAL bitmap4 *extra_attr_request,
     OUT nfs41_file_info *info)
 {
+    nfsd_inflight inflight;
     int status;
-    bool bits_missing = false;
+    bool bits_missing, inflight_checked = false;
+    bool inflight_owner = false;
+
+retry_cache:
+    bits_missing = false;
 
     /* first look for cached attributes */
     status = nfs41_attr_cache_lookup(session_name_cache(session),
@@ -62,6 +67,18 @@ int nfs41_cached_getattr(
         }
     }
 
+    if ((status || bits_missing) && (!inflight_checked)) {
+        /*
+         * Wait for a GETATTR of the same file by another thread, which
+         * puts its result into the attribute cache
+         */
+        inflight_checked = true;
+        if (nfsd_inflight_begin(NFSD_INFLIGHT_GETATTR, session,
+            file->fh.fh, file->fh.len, &inflight))
+            goto retry_cache;
+        inflight_owner = true;
+    }
+
     if (status || bits_missing) {
         /* fetch attributes from the server */
         bitmap4 attr_request;
@@ -71,7 +88,11 @@ int nfs41_cached_getattr(
             bitmap_or(&attr_request, extra_attr_request);
         }
 
+#ifdef NFS41_DRIVER_DAEMON_GETATTR_COALESCING
+        status = nfs41_getattr_coalesced(session, file, &attr_request, info);
+#else
         status = nfs41_getattr(session, file, &attr_request, info);
+#endif /* NFS41_DRIVER_DAEMON_GETATTR_COALESCING */
         if (status) {
             eprintf("nfs41_cached_getattr: "
                 "nfs41_getattr() failed with '%s'\n",
@@ -79,6 +100,9 @@ int nfs41_cached_getattr(
             status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
         }
     }
+
+    if (inflight_owner)
+        nfsd_inflight_end(&inflight);
     return status;
 }
 
@@ -114,6 +138,12 @@ static int handle_getattr(void *daemon_context, nfs41_upcall *upcall)
     nfs41_open_state *state = upcall->state_ref;
     nfs41_file_info info = { 0 };
 
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+    /* a GETATTR from the server must see the size of our pNFS writes */
+    if (state->type == NF4REG)
+        (void)pnfs_layout_commit_open_state(state);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
+
     status = nfs41_cached_getattr(state->session, &state->file, NULL, &info);
     if (status) {
         eprintf("handle_getattr(state->path.path='%s'): "
@@ -312,3 +342,244 @@ const nfs41_upcall_op nfs41_op_getattr = {
     .marshall = marshall_getattr,
     .arg_size = sizeof(getattr_upcall_args)
 };
+
+
+/* NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH */
+static int parse_coherency_batch(
+    const unsigned char *restrict buffer,
+    uint32_t length,
+    nfs41_upcall *upcall)
+{
+    int status;
+    coherency_batch_upcall_args *args = &upcall->args.coherency_batch;
+    uint32_t count;
+    HANDLE state;
+    uint32_t i;
+
+    status = safe_read(&buffer, &length, &count, sizeof(count));
+    if (status) goto out;
+
+    if ((count == 0) || (count > NFS41_COHERENCY_BATCH_MAX)) {
+        eprintf("parse_coherency_batch: invalid count=%u\n",
+            (unsigned int)count);
+        status = ERROR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        status = safe_read(&buffer, &length, &state, sizeof(state));
+        if (status) goto out;
+        if ((state == NULL) || (state == INVALID_HANDLE_VALUE)) {
+            status = ERROR_INVALID_PARAMETER;
+            goto out;
+        }
+        /* |cleanup_coherency_batch()| releases these references */
+        nfs41_open_state_ref((nfs41_open_state *)state);
+        args->states[i] = (nfs41_open_state *)state;
+        args->count = i + 1;
+    }
+
+    EASSERT(length == 0);
+
+    DPRINTF(1, ("parsing '%s': count=%u\n",
+        opcode2string(upcall->opcode), (unsigned int)args->count));
+out:
+    return status;
+}
+
+static int handle_coherency_batch(void *daemon_context, nfs41_upcall *upcall)
+{
+    int status = NO_ERROR;
+    coherency_batch_upcall_args *args = &upcall->args.coherency_batch;
+    nfs41_session *session = args->states[0]->session;
+    nfs41_path_fh *files[NFS41_COHERENCY_BATCH_MAX];
+    int statuses[NFS41_COHERENCY_BATCH_MAX];
+    nfs41_file_info *infos = NULL;
+    bitmap4 attr_request;
+    uint32_t i;
+
+    infos = calloc(args->count, sizeof(nfs41_file_info));
+    if (infos == NULL) {
+        status = GetLastError();
+        goto out;
+    }
+
+    for (i = 0 ; i < args->count ; i++) {
+        files[i] = &args->states[i]->file;
+        /* The kernel only batches open states of the same session */
+        if (args->states[i]->session != session) {
+            eprintf("handle_coherency_batch: "
+                "states[%u] belongs to a different session\n",
+                (unsigned int)i);
+            status = ERROR_INVALID_PARAMETER;
+            goto out;
+        }
+    }
+
+    /* the kernel only compares the change attribute */
+    nfs41_superblock_getattr_profile(files[0]->fh.superblock,
+        NFS41_GETATTR_PROFILE_CHANGE, &attr_request);
+
+    (void)nfs41_getattr_batch(session, args->count, files,
+        &attr_request, infos, statuses);
+
+    for (i = 0 ; i < args->count ; i++) {
+        if (statuses[i] == NFS4_OK) {
+            EASSERT(bitmap_isset(&infos[i].attrmask, 0, FATTR4_WORD0_CHANGE));
+            args->status[i] = NO_ERROR;
+            args->changeattr[i] = infos[i].change;
+        }
+        else {
+            DPRINTF(1, ("handle_coherency_batch(path='%s'): "
+                "getattr failed with %d\n",
+                args->states[i]->path.path, statuses[i]));
+            args->status[i] = nfs_to_windows_error(statuses[i],
+                ERROR_FILE_NOT_FOUND);
+            args->changeattr[i] = 0ULL;
+        }
+    }
+out:
+    free(infos);
+    return status;
+}
+
+static int marshall_coherency_batch(
+    unsigned char *restrict buffer,
+    uint32_t *restrict length,
+    nfs41_upcall *restrict upcall)
+{
+    int status = NO_ERROR;
+    const coherency_batch_upcall_args *args = &upcall->args.coherency_batch;
+    DWORD st;
+    uint32_t i;
+
+    for (i = 0 ; i < args->count ; i++) {
+        st = args->status[i];
+        status = safe_write(&buffer, length, &st, sizeof(st));
+        if (status) goto out;
+        status = safe_write(&buffer, length,
+            &args->changeattr[i], sizeof(args->changeattr[i]));
+        if (status) goto out;
+    }
+out:
+    return status;
+}
+
+static void cleanup_coherency_batch(nfs41_upcall *upcall)
+{
+    coherency_batch_upcall_args *args = &upcall->args.coherency_batch;
+    uint32_t i;
+
+    for (i = 0 ; i < args->count ; i++) {
+        nfs41_open_state_deref(args->states[i]);
+        args->states[i] = NULL;
+    }
+    args->count = 0;
+}
+
+const nfs41_upcall_op nfs41_op_coherency_batch = {
+    .parse = parse_coherency_batch,
+    .handle = handle_coherency_batch,
+    .marshall = marshall_coherency_batch,
+    .cleanup = cleanup_coherency_batch,
+    .arg_size = sizeof(coherency_batch_upcall_args)
+};
+
+
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+/* NFS41_SYSOP_QUERY_OPEN */
+static int parse_queryopen(
+    const unsigned char *restrict buffer,
+    uint32_t length,
+    nfs41_upcall *upcall)
+{
+    int status;
+    queryopen_upcall_args *args = &upcall->args.queryopen;
+
+    status = get_name(&buffer, &length, &args->path);
+    if (status) goto out;
+
+    EASSERT(length == 0);
+
+    DPRINTF(1, ("parsing '%s': path='%s'\n",
+        opcode2string(upcall->opcode), args->path));
+out:
+    return status;
+}
+
+/*
+ * Attributes by path, without an OPEN: |nfs41_lookup()| answers from
+ * the name/attribute cache or sends one LOOKUP+GETATTR compound.
+ * Any error makes the kernel fall back to a full open, so symlinks
+ * (which need a reparse) and files open for writing (whose size might
+ * lag behind cached writes) are refused here. A case-insensitive
+ * match is answered like an exact one, |FileNetworkOpenInformation|
+ * carries no name.
+ */
+static int handle_queryopen(void *daemon_context, nfs41_upcall *upcall)
+{
+    queryopen_upcall_args *args = &upcall->args.queryopen;
+    nfs41_abs_path path;
+    nfs41_path_fh file = { 0 };
+    nfs41_file_info info = { 0 };
+    nfs41_session *session;
+    size_t path_len;
+    int status;
+
+    path_len = strlen(args->path);
+    if (path_len >= NFS41_MAX_PATH_LEN) {
+        status = ERROR_FILENAME_EXCED_RANGE;
+        goto out;
+    }
+    InitializeSRWLock(&path.lock);
+    (void)memcpy(path.path, args->path, path_len + 1);
+    path.len = (unsigned short)path_len;
+
+    file.path = &path;
+    status = nfs41_lookup(upcall->root_ref,
+        nfs41_root_session(upcall->root_ref), false,
+        &path, NULL, &file, &info, &session);
+    if (status) {
+        DPRINTF(1, ("handle_queryopen(path='%s'): "
+            "nfs41_lookup() failed with %d\n", args->path, status));
+        goto out;
+    }
+    last_component(path.path, path.path + path.len, &file.name);
+
+    if (info.type == NF4LNK) {
+        status = ERROR_REPARSE;
+        goto out;
+    }
+    if (nfs41_client_file_open_for_write(session->client, info.fileid)) {
+        DPRINTF(1, ("handle_queryopen(path='%s'): "
+            "file is open for writing\n", args->path));
+        status = ERROR_SHARING_VIOLATION;
+        goto out;
+    }
+
+    nfs_to_network_openinfo(file.name.name,
+        file.fh.superblock,
+        &info,
+        &args->network_info);
+out:
+    return status;
+}
+
+static int marshall_queryopen(
+    unsigned char *restrict buffer,
+    uint32_t *restrict length,
+    nfs41_upcall *restrict upcall)
+{
+    const queryopen_upcall_args *args = &upcall->args.queryopen;
+
+    return safe_write(&buffer, length, &args->network_info,
+        sizeof(args->network_info));
+}
+
+const nfs41_upcall_op nfs41_op_queryopen = {
+    .parse = parse_queryopen,
+    .handle = handle_queryopen,
+    .marshall = marshall_queryopen,
+    .arg_size = sizeof(queryopen_upcall_args)
+};
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
@@ -0,0 +1,330 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * idcachefile.c - persistent idmap/SID cache file
+ *
+ * Enabled with "nfsd --idcachefile <file>". The file is a fixed size
+ * table of |IDCACHEFILE_NUM_RECORDS| records, mapped into memory.
+ * Every positive entry added to the idmap user/group caches
+ * (idmap.c) and to |user_sidcache|/|group_sidcache| (sid.c) is also
+ * written to the record for its name, so the file is updated
+ * incrementally and the OS writes the dirty pages back. At startup
+ * these caches are filled from all records which have not expired
+ * yet, so known principals are resolved without waiting for LDAP,
+ * Cygwin or LSA.
+ *
+ * Records carry their absolute expiry time (wall clock) and TTL,
+ * and are only used if the checksum matches, the expiry time is in
+ * the future and not more than the TTL away (e.g. after the clock
+ * was set back), so a torn write after a crash or an old file
+ * loses some entries, but never produces a wrong mapping older than
+ * the cache TTL.
+ * The records are trusted, the file must be in a directory which is
+ * only writable by administrators and SYSTEM.
+ */
+
+#include <Windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "idcachefile.h"
+#include "daemon_debug.h"
+
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+
+#define IDCACHEFILE_MAGIC       0x43444949 /* "IIDC" */
+#define IDCACHEFILE_VERSION     1
+/* number of records, must be a power of two */
+#define IDCACHEFILE_NUM_RECORDS 8192
+/* number of records probed for a name */
+#define IDCACHEFILE_PROBES      4
+
+typedef struct _idcachefile_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size; /* sizeof(idcachefile_record) */
+    uint32_t num_records;
+} idcachefile_header;
+
+typedef struct _idcachefile_record {
+    uint32_t checksum; /* FNV-1a of the rest of the record */
+    uint32_t ttl;
+    int64_t expires; /* seconds since 1970-01-01 UTC */
+    idcachefile_entry entry;
+} idcachefile_record;
+
+typedef struct _idcachefile {
+    HANDLE file;
+    HANDLE mapping;
+    idcachefile_header *header;
+    idcachefile_record *records;
+    SRWLOCK lock;
+} idcachefile;
+
+static idcachefile cachefile = {
+    .file = INVALID_HANDLE_VALUE,
+    .mapping = NULL,
+    .header = NULL,
+    .records = NULL,
+    .lock = SRWLOCK_INIT
+};
+
+#define IDCACHEFILE_SIZE \
+    (sizeof(idcachefile_header) + \
+    (IDCACHEFILE_NUM_RECORDS * sizeof(idcachefile_record)))
+
+static uint32_t idcachefile_checksum(
+    const idcachefile_record *rec)
+{
+    const unsigned char *s = (const unsigned char *)&rec->ttl;
+    size_t len = sizeof(idcachefile_record) -
+        FIELD_OFFSET(idcachefile_record, ttl);
+    uint32_t hash = 2166136261UL; /* FNV-1a */
+
+    while (len--)
+        hash = (hash ^ *s++) * 16777619UL;
+    return hash;
+}
+
+static uint32_t idcachefile_hash(
+    const idcachefile_entry *entry)
+{
+    const unsigned char *s = (const unsigned char *)entry->name;
+    uint32_t hash = 2166136261UL ^ entry->type; /* FNV-1a */
+
+    while (*s)
+        hash = (hash ^ *s++) * 16777619UL;
+    return hash;
+}
+
+static bool idcachefile_record_valid(
+    const idcachefile_record *rec,
+    int64_t now)
+{
+    const idcachefile_entry *e = &rec->entry;
+
+    if ((e->type < IDCACHEFILE_IDMAP_USER) ||
+        (e->type > IDCACHEFILE_SID_GROUP))
+        return false;
+    if ((rec->expires <= now) || ((rec->expires - now) > rec->ttl))
+        return false;
+    if (rec->checksum != idcachefile_checksum(rec))
+        return false;
+    if ((e->name[0] == '\0') ||
+        (memchr(e->name, '\0', IDCACHEFILE_NAME_LEN) == NULL) ||
+        (memchr(e->name2, '\0', IDCACHEFILE_NAME_LEN) == NULL))
+        return false;
+    if ((e->type == IDCACHEFILE_SID_USER) ||
+        (e->type == IDCACHEFILE_SID_GROUP)) {
+        if ((e->sid_len == 0) || (e->sid_len > SECURITY_MAX_SID_SIZE) ||
+            (!IsValidSid((PSID)e->sid)) ||
+            (GetLengthSid((PSID)e->sid) != e->sid_len))
+            return false;
+    }
+    return true;
+}
+
+int idcachefile_open(
+    const wchar_t *filename)
+{
+    LARGE_INTEGER size;
+    bool init = false;
+    void *view;
+    int status;
+
+    cachefile.file = CreateFileW(filename, GENERIC_READ|GENERIC_WRITE,
+        0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (cachefile.file == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        eprintf("idcachefile_open: cannot open '%S', lasterr=%d\n",
+            filename, status);
+        return status;
+    }
+
+    if (!GetFileSizeEx(cachefile.file, &size) ||
+        (size.QuadPart != (LONGLONG)IDCACHEFILE_SIZE)) {
+        /* new file, or a file with a different layout */
+        size.QuadPart = (LONGLONG)IDCACHEFILE_SIZE;
+        if (!SetFilePointerEx(cachefile.file, size, NULL, FILE_BEGIN) ||
+            !SetEndOfFile(cachefile.file)) {
+            status = GetLastError();
+            eprintf("idcachefile_open: cannot resize '%S', lasterr=%d\n",
+                filename, status);
+            goto out_close;
+        }
+        init = true;
+    }
+
+    cachefile.mapping = CreateFileMappingW(cachefile.file, NULL,
+        PAGE_READWRITE, 0, 0, NULL);
+    if (cachefile.mapping == NULL) {
+        status = GetLastError();
+        eprintf("idcachefile_open: CreateFileMappingW() failed, "
+            "lasterr=%d\n", status);
+        goto out_close;
+    }
+
+    view = MapViewOfFile(cachefile.mapping, FILE_MAP_WRITE, 0, 0, 0);
+    if (view == NULL) {
+        status = GetLastError();
+        eprintf("idcachefile_open: MapViewOfFile() failed, "
+            "lasterr=%d\n", status);
+        goto out_close;
+    }
+    cachefile.header = (idcachefile_header *)view;
+    cachefile.records = (idcachefile_record *)(cachefile.header + 1);
+
+    if (init ||
+        (cachefile.header->magic != IDCACHEFILE_MAGIC) ||
+        (cachefile.header->version != IDCACHEFILE_VERSION) ||
+        (cachefile.header->record_size != sizeof(idcachefile_record)) ||
+        (cachefile.header->num_records != IDCACHEFILE_NUM_RECORDS)) {
+        DPRINTF(0, ("idcachefile_open: initializing '%S'\n", filename));
+        (void)memset(view, 0, IDCACHEFILE_SIZE);
+        cachefile.header->magic = IDCACHEFILE_MAGIC;
+        cachefile.header->version = IDCACHEFILE_VERSION;
+        cachefile.header->record_size = sizeof(idcachefile_record);
+        cachefile.header->num_records = IDCACHEFILE_NUM_RECORDS;
+    }
+
+    DPRINTF(1, ("idcachefile_open: using '%S'\n", filename));
+    return NO_ERROR;
+
+out_close:
+    idcachefile_close();
+    return status;
+}
+
+void idcachefile_close(void)
+{
+    AcquireSRWLockExclusive(&cachefile.lock);
+    if (cachefile.header) {
+        (void)FlushViewOfFile(cachefile.header, 0);
+        (void)UnmapViewOfFile(cachefile.header);
+        cachefile.header = NULL;
+        cachefile.records = NULL;
+    }
+    if (cachefile.mapping) {
+        (void)CloseHandle(cachefile.mapping);
+        cachefile.mapping = NULL;
+    }
+    if (cachefile.file != INVALID_HANDLE_VALUE) {
+        (void)CloseHandle(cachefile.file);
+        cachefile.file = INVALID_HANDLE_VALUE;
+    }
+    ReleaseSRWLockExclusive(&cachefile.lock);
+}
+
+bool idcachefile_is_open(void)
+{
+    return cachefile.records != NULL;
+}
+
+/*
+ * Write |entry| to the record with the same name, to an unused or
+ * expired record, or else to the record which expires first, of the
+ * |IDCACHEFILE_PROBES| records for the name
+ */
+void idcachefile_store(
+    const idcachefile_entry *entry,
+    uint32_t ttl)
+{
+    idcachefile_record *rec, *victim = NULL;
+    const int64_t now = (int64_t)_time64(NULL);
+    uint32_t hash, i;
+
+    if ((!idcachefile_is_open()) || (ttl == 0) ||
+        (entry->name[0] == '\0'))
+        return;
+
+    hash = idcachefile_hash(entry);
+
+    AcquireSRWLockExclusive(&cachefile.lock);
+    if (cachefile.records == NULL)
+        goto out;
+
+    for (i = 0; i < IDCACHEFILE_PROBES; i++) {
+        rec = &cachefile.records[
+            (hash + i) & (IDCACHEFILE_NUM_RECORDS - 1)];
+
+        if ((rec->entry.type == entry->type) &&
+            (!strcmp(rec->entry.name, entry->name))) {
+            victim = rec;
+            break;
+        }
+        if ((rec->entry.type == 0) || (rec->expires <= now)) {
+            if ((victim == NULL) || (victim->expires > now))
+                victim = rec;
+            continue;
+        }
+        if ((victim == NULL) || (rec->expires < victim->expires))
+            victim = rec;
+    }
+
+    /*
+     * Invalidate the checksum first, so a torn write is never
+     * accepted by |idcachefile_load()|
+     */
+    victim->checksum = ~idcachefile_checksum(victim);
+    victim->ttl = ttl;
+    victim->expires = now + ttl;
+    (void)memcpy(&victim->entry, entry, sizeof(idcachefile_entry));
+    victim->checksum = idcachefile_checksum(victim);
+out:
+    ReleaseSRWLockExclusive(&cachefile.lock);
+}
+
+/*
+ * Call |load_fn| for each valid record of type |type|, returns the
+ * number of records found
+ */
+unsigned int idcachefile_load(
+    enum idcachefile_type type,
+    idcachefile_load_fn load_fn,
+    void *context)
+{
+    idcachefile_record *rec;
+    const int64_t now = (int64_t)_time64(NULL);
+    unsigned int i, count = 0;
+
+    if (!idcachefile_is_open())
+        return 0;
+
+    AcquireSRWLockShared(&cachefile.lock);
+    for (i = 0; (cachefile.records != NULL) &&
+        (i < IDCACHEFILE_NUM_RECORDS); i++) {
+        rec = &cachefile.records[i];
+        if ((rec->entry.type != (uint32_t)type) ||
+            (!idcachefile_record_valid(rec, now)))
+            continue;
+        load_fn(context, &rec->entry, (uint32_t)(rec->expires - now));
+        count++;
+    }
+    ReleaseSRWLockShared(&cachefile.lock);
+
+    DPRINTF(1, ("idcachefile_load(type=%d): loaded %u entries\n",
+        (int)type, count));
+    return count;
+}
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
@@ -0,0 +1,65 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+#ifndef __NFS41_DAEMON_IDCACHEFILE_H__
+#define __NFS41_DAEMON_IDCACHEFILE_H__ 1
+
+#include <Windows.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "nfs41_build_features.h"
+
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+/*
+ * Persistent idmap/SID cache file, see idcachefile.c
+ */
+#define IDCACHEFILE_NAME_LEN 257
+
+enum idcachefile_type {
+    IDCACHEFILE_IDMAP_USER = 1,     /* |name|=username, |name2|=principal */
+    IDCACHEFILE_IDMAP_GROUP = 2,    /* |name|=group name */
+    IDCACHEFILE_SID_USER = 3,       /* |user_sidcache| */
+    IDCACHEFILE_SID_GROUP = 4       /* |group_sidcache| */
+};
+
+typedef struct _idcachefile_entry {
+    uint32_t type; /* |enum idcachefile_type| */
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t sid_len; /* zero for the idmap types */
+    unsigned char sid[SECURITY_MAX_SID_SIZE];
+    char name[IDCACHEFILE_NAME_LEN]; /* win32name for the SID types */
+    char name2[IDCACHEFILE_NAME_LEN]; /* aliasname for the SID types */
+} idcachefile_entry;
+
+/* called for each valid entry, |remaining| is the remaining TTL */
+typedef void (*idcachefile_load_fn)(void *context,
+    const idcachefile_entry *entry, uint32_t remaining);
+
+int idcachefile_open(const wchar_t *filename);
+void idcachefile_close(void);
+bool idcachefile_is_open(void);
+void idcachefile_store(const idcachefile_entry *entry, uint32_t ttl);
+unsigned int idcachefile_load(enum idcachefile_type type,
+    idcachefile_load_fn load_fn, void *context);
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+
+#endif /* !__NFS41_DAEMON_IDCACHEFILE_H__ */
@@ -33,6 +33,8 @@
 #include "list.h"
 #include "daemon_debug.h"
 #include "util.h"
+#include "idcachefile.h"
+#include "mempressure.h"
 
 #define PTR2UID_T(p) ((uid_t)PTR2PTRDIFF_T(p))
 #define PTR2GID_T(p) ((gid_t)PTR2PTRDIFF_T(p))
@@ -84,11 +86,12 @@ static const char CONFIG_FILENAME[] = "C:\\etc\\ms-nfs41-idmap.conf";
 
 struct idmap_config {
     /* ldap server information */
-    char hostname[NFS41_HOSTNAME_LEN+1];
+    char hostname[VAL_LEN]; /* list of servers */
     char localdomain_name[NFS41_HOSTNAME_LEN+1];
     UINT port;
     UINT version;
     UINT timeout;
+    UINT pool_size;
 
     /* ldap schema information */
     char classes[NUM_CLASSES][NAME_LEN];
@@ -97,6 +100,7 @@ struct idmap_config {
 
     /* caching configuration */
     INT cache_ttl;
+    INT negative_cache_ttl;
 };
 
 
@@ -126,10 +130,11 @@ struct config_option {
 /* table of recognized config options, including type and default value */
 static const struct config_option g_options[] = {
     /* server information */
-    OPT_STR("ldap_hostname", "localhost", hostname, NFS41_HOSTNAME_LEN+1),
+    OPT_STR("ldap_hostname", "localhost", hostname, VAL_LEN),
     OPT_INT("ldap_port", "389", port),
     OPT_INT("ldap_version", "3", version),
     OPT_INT("ldap_timeout", "0", timeout),
+    OPT_INT("ldap_pool_size", "4", pool_size),
 
     /* schema information */
     OPT_STR("ldap_base", "cn=localhost", base, VAL_LEN),
@@ -143,6 +148,7 @@ static const struct config_option g_options[] = {
 
     /* caching configuration */
     OPT_INT("cache_ttl", "6000", cache_ttl),
+    OPT_INT("negative_cache_ttl", "60", negative_cache_ttl),
 };
 
 
@@ -386,98 +392,331 @@ out:
 }
 
 
-/* generic cache */
+/*
+ * generic cache
+ *
+ * All entries are on |head|, newest first. Each entry is also linked
+ * into one hash chain per key attribute (users: name, principal and
+ * uid; groups: name and gid), so lookups only walk a single chain
+ * instead of the whole list.
+ * Failed lookups are cached as negative entries with the status of
+ * the lookup. These are only indexed by the attribute which was
+ * looked up, and expire after "negative_cache_ttl" seconds instead of
+ * "cache_ttl" seconds.
+ */
+#define IDMAP_CACHE_MAX_KEYS 3
+#define IDMAP_CACHE_BUCKETS 256
+/* the oldest entries are dropped beyond this */
+#define IDMAP_CACHE_MAX_ENTRIES 16384
+/* lower bound for |cache_max_entries()| */
+#define IDMAP_CACHE_MIN_ENTRIES 256
+
+struct idmap_cache_links {
+    struct list_entry chain[IDMAP_CACHE_MAX_KEYS];
+    unsigned key_mask; /* keys this entry is indexed by */
+    int status; /* non-zero for negative entries */
+};
+
+struct cache_key {
+    enum ldap_attr attr;
+    enum config_type type;
+};
+
 typedef struct list_entry* (*entry_alloc_fn)();
 typedef void (*entry_free_fn)(struct list_entry*);
 typedef void (*entry_copy_fn)(struct list_entry*, const struct list_entry*);
+/* returns the value of key |attr|, or |NULL| for an empty string */
+typedef const void* (*entry_key_fn)(const struct list_entry*, enum ldap_attr);
 
 struct cache_ops {
     entry_alloc_fn entry_alloc;
     entry_free_fn entry_free;
     entry_copy_fn entry_copy;
+    entry_key_fn entry_key;
+    /* offset of the |struct idmap_cache_links| from the list entry */
+    size_t links_offset;
+    unsigned num_keys;
+    struct cache_key keys[IDMAP_CACHE_MAX_KEYS];
 };
 
 struct idmap_cache {
     struct list_entry head;
+    struct list_entry buckets[IDMAP_CACHE_MAX_KEYS][IDMAP_CACHE_BUCKETS];
+    unsigned count;
     const struct cache_ops *ops;
     SRWLOCK lock;
 };
 
 
+static __inline struct idmap_cache_links* cache_links(
+    const struct idmap_cache *cache,
+    const struct list_entry *entry)
+{
+    return (struct idmap_cache_links*)
+        ((unsigned char*)entry + cache->ops->links_offset);
+}
+
+/* list entry for the hash chain link |link| of key |key| */
+static __inline struct list_entry* cache_chain_entry(
+    const struct idmap_cache *cache,
+    const struct list_entry *link,
+    unsigned key)
+{
+    return (struct list_entry*)((unsigned char*)(link - key) -
+        FIELD_OFFSET(struct idmap_cache_links, chain) -
+        cache->ops->links_offset);
+}
+
+static uint32_t cache_hash(
+    enum config_type type,
+    const void *value)
+{
+    const unsigned char *s;
+    uint32_t hash;
+
+    if (type == TYPE_INT)
+        return (uint32_t)(PTR2UINT(value) * 0x9E3779B1UL);
+
+    /* FNV-1a */
+    hash = 2166136261UL;
+    for (s = (const unsigned char*)value; *s; s++)
+        hash = (hash ^ *s) * 16777619UL;
+    return hash;
+}
+
+static bool cache_key_equal(
+    enum config_type type,
+    const void *lhs,
+    const void *rhs)
+{
+    if (type == TYPE_INT)
+        return PTR2UINT(lhs) == PTR2UINT(rhs);
+    return strcmp((const char*)lhs, (const char*)rhs) == 0;
+}
+
+static int cache_key_index(
+    const struct idmap_cache *cache,
+    enum ldap_attr attr)
+{
+    unsigned i;
+    for (i = 0; i < cache->ops->num_keys; i++)
+        if (cache->ops->keys[i].attr == attr)
+            return (int)i;
+    return -1;
+}
+
+static struct list_entry* cache_bucket(
+    struct idmap_cache *cache,
+    unsigned key,
+    const void *value)
+{
+    return &cache->buckets[key][
+        cache_hash(cache->ops->keys[key].type, value) % IDMAP_CACHE_BUCKETS];
+}
+
 static void cache_init(
     struct idmap_cache *cache,
     const struct cache_ops *ops)
 {
+    unsigned i, j;
+
     list_init(&cache->head);
+    for (i = 0; i < IDMAP_CACHE_MAX_KEYS; i++)
+        for (j = 0; j < IDMAP_CACHE_BUCKETS; j++)
+            list_init(&cache->buckets[i][j]);
+    cache->count = 0;
     cache->ops = ops;
     InitializeSRWLock(&cache->lock);
 }
 
+/* expects the caller to hold the exclusive lock */
+static void cache_unlink(
+    struct idmap_cache *cache,
+    struct list_entry *entry)
+{
+    struct idmap_cache_links *links = cache_links(cache, entry);
+    unsigned i;
+
+    for (i = 0; i < cache->ops->num_keys; i++)
+        if (links->key_mask & (1U << i))
+            list_remove(&links->chain[i]);
+    links->key_mask = 0;
+    list_remove(entry);
+    cache->count--;
+}
+
+/* limit of entries, scaled with the system memory state */
+static __inline unsigned cache_max_entries(void)
+{
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+    return (unsigned)nfs41_mempressure_limit(IDMAP_CACHE_MAX_ENTRIES,
+        IDMAP_CACHE_MIN_ENTRIES);
+#else
+    return IDMAP_CACHE_MAX_ENTRIES;
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+}
+
+/* drop the oldest entries, expects the caller to hold the exclusive lock */
+static void cache_drop_oldest(
+    struct idmap_cache *cache,
+    unsigned max_entries)
+{
+    while (cache->count > max_entries) {
+        struct list_entry *oldest = cache->head.prev;
+        cache_unlink(cache, oldest);
+        cache->ops->entry_free(oldest);
+    }
+}
+
+/* expects the caller to hold the exclusive lock */
+static void cache_link(
+    struct idmap_cache *cache,
+    struct list_entry *entry,
+    unsigned key_mask)
+{
+    struct idmap_cache_links *links = cache_links(cache, entry);
+    const void *value;
+    unsigned i;
+
+    links->key_mask = 0;
+    for (i = 0; i < cache->ops->num_keys; i++) {
+        if ((key_mask & (1U << i)) == 0)
+            continue;
+        value = cache->ops->entry_key(entry, cache->ops->keys[i].attr);
+        if (value == NULL)
+            continue;
+        list_add_head(cache_bucket(cache, i, value), &links->chain[i]);
+        links->key_mask |= 1U << i;
+    }
+    list_add_head(&cache->head, entry);
+    cache->count++;
+
+    cache_drop_oldest(cache, cache_max_entries());
+}
+
+/* remove all entries which share a key value with |src| */
+static void cache_remove_matching(
+    struct idmap_cache *cache,
+    const struct list_entry *src,
+    unsigned key_mask)
+{
+    struct list_entry *link, *tmp, *entry;
+    const void *value;
+    unsigned i;
+
+    for (i = 0; i < cache->ops->num_keys; i++) {
+        if ((key_mask & (1U << i)) == 0)
+            continue;
+        value = cache->ops->entry_key(src, cache->ops->keys[i].attr);
+        if (value == NULL)
+            continue;
+        list_for_each_tmp(link, tmp, cache_bucket(cache, i, value)) {
+            entry = cache_chain_entry(cache, link, i);
+            if (cache_key_equal(cache->ops->keys[i].type, value,
+                cache->ops->entry_key(entry, cache->ops->keys[i].attr))) {
+                cache_unlink(cache, entry);
+                cache->ops->entry_free(entry);
+            }
+        }
+    }
+}
+
 static void cache_cleanup(
     struct idmap_cache *cache)
 {
     struct list_entry *entry, *tmp;
-    list_for_each_tmp(entry, tmp, &cache->head)
+    list_for_each_tmp(entry, tmp, &cache->head) {
+        cache_unlink(cache, entry);
         cache->ops->entry_free(entry);
+    }
     list_init(&cache->head);
 }
 
+/*
+ * Insert a copy of |src|. A |status| other than zero inserts a
+ * negative entry, which is only indexed by the |lookup| attribute
+ */
 static int cache_insert(
     struct idmap_cache *cache,
     const struct idmap_lookup *lookup,
-    const struct list_entry *src)
+    const struct list_entry *src,
+    int status)
 {
     struct list_entry *entry;
-    int status = NO_ERROR;
+    unsigned key_mask;
+    int key;
+    int res = NO_ERROR;
+
+    key = cache_key_index(cache, lookup->attr);
+    if (key < 0)
+        return ERROR_INVALID_PARAMETER;
+    key_mask = status ? (1U << key) : ((1U << cache->ops->num_keys) - 1);
 
     AcquireSRWLockExclusive(&cache->lock);
 
-    /* search for an existing match */
-    entry = list_search(&cache->head, lookup->value, lookup->compare);
-    if (entry) {
-        /* overwrite the existing entry with the new results */
-        cache->ops->entry_copy(entry, src);
-        goto out;
-    }
+    /* replace any existing entries for the same user/group */
+    cache_remove_matching(cache, src, key_mask);
 
-    /* initialize a new entry and add it to the list */
     entry = cache->ops->entry_alloc();
     if (entry == NULL) {
-        status = GetLastError();
+        res = GetLastError();
         goto out;
     }
     cache->ops->entry_copy(entry, src);
-    list_add_head(&cache->head, entry);
+    cache_links(cache, entry)->status = status;
+    cache_link(cache, entry, key_mask);
 out:
     ReleaseSRWLockExclusive(&cache->lock);
-    return status;
+    return res;
 }
 
+/*
+ * Returns |NO_ERROR| and a copy of the entry in |entry_out| if one was
+ * found; |*status_out| is the status of negative entries and zero else
+ */
 static int cache_lookup(
     struct idmap_cache *cache,
     const struct idmap_lookup *lookup,
-    struct list_entry *entry_out)
+    struct list_entry *entry_out,
+    int *status_out)
 {
-    struct list_entry *entry;
-    int status = ERROR_NOT_FOUND;
+    struct list_entry *link, *entry;
+    int key, status = ERROR_NOT_FOUND;
+
+    key = cache_key_index(cache, lookup->attr);
+    if (key < 0)
+        return status;
 
     AcquireSRWLockShared(&cache->lock);
 
-    entry = list_search(&cache->head, lookup->value, lookup->compare);
-    if (entry) {
-        /* make a copy for use outside of the lock */
-        cache->ops->entry_copy(entry_out, entry);
-        status = NO_ERROR;
+    list_for_each(link, cache_bucket(cache, (unsigned)key, lookup->value)) {
+        entry = cache_chain_entry(cache, link, (unsigned)key);
+        if (lookup->compare(entry, lookup->value) == 0) {
+            /* make a copy for use outside of the lock */
+            cache->ops->entry_copy(entry_out, entry);
+            *status_out = cache_links(cache, entry)->status;
+            status = NO_ERROR;
+            break;
+        }
     }
 
     ReleaseSRWLockShared(&cache->lock);
     return status;
 }
 
+/* lookups which did not find the user or group are cached */
+static __inline bool is_negative_result(
+    int status)
+{
+    return (status == ERROR_NOT_FOUND) ||
+        (status == ERROR_DS_NO_RESULTS_RETURNED);
+}
+
 
 /* user cache */
 struct idmap_user {
     struct list_entry entry;
+    struct idmap_cache_links links;
     char username[VAL_LEN];
     char principal[VAL_LEN];
     uid_t uid;
@@ -506,16 +745,43 @@ static void user_cache_copy(
     dst->gid = src->gid;
     dst->last_updated = src->last_updated;
 }
+static const void* user_cache_key(
+    const struct list_entry *entry,
+    enum ldap_attr attr)
+{
+    const struct idmap_user *user = list_container(entry,
+        const struct idmap_user, entry);
+    switch (attr) {
+    case ATTR_USER_NAME:
+        return user->username[0] ? user->username : NULL;
+    case ATTR_PRINCIPAL:
+        return user->principal[0] ? user->principal : NULL;
+    case ATTR_UID:
+        return UID_T2PTR(user->uid);
+    default:
+        return NULL;
+    }
+}
 static const struct cache_ops user_cache_ops = {
     user_cache_alloc,
     user_cache_free,
-    user_cache_copy
+    user_cache_copy,
+    user_cache_key,
+    FIELD_OFFSET(struct idmap_user, links) -
+        FIELD_OFFSET(struct idmap_user, entry),
+    3,
+    {
+        { ATTR_USER_NAME, TYPE_STR },
+        { ATTR_PRINCIPAL, TYPE_STR },
+        { ATTR_UID, TYPE_INT }
+    }
 };
 
 
 /* group cache */
 struct idmap_group {
     struct list_entry entry;
+    struct idmap_cache_links links;
     char name[VAL_LEN];
     gid_t gid;
     util_reltimestamp last_updated;
@@ -540,19 +806,61 @@ static void group_cache_copy(
     dst->gid = src->gid;
     dst->last_updated = src->last_updated;
 }
+static const void* group_cache_key(
+    const struct list_entry *entry,
+    enum ldap_attr attr)
+{
+    const struct idmap_group *group = list_container(entry,
+        const struct idmap_group, entry);
+    switch (attr) {
+    case ATTR_GROUP_NAME:
+        return group->name[0] ? group->name : NULL;
+    case ATTR_GID:
+        return GID_T2PTR(group->gid);
+    default:
+        return NULL;
+    }
+}
 static const struct cache_ops group_cache_ops = {
     group_cache_alloc,
     group_cache_free,
-    group_cache_copy
+    group_cache_copy,
+    group_cache_key,
+    FIELD_OFFSET(struct idmap_group, links) -
+        FIELD_OFFSET(struct idmap_group, entry),
+    2,
+    {
+        { ATTR_GROUP_NAME, TYPE_STR },
+        { ATTR_GID, TYPE_INT }
+    }
 };
 
 
 /* ldap context */
+#define IDMAP_LDAP_MAX_SERVERS 8
+#define IDMAP_LDAP_MAX_CONNS 16
+
+struct idmap_ldap_conn {
+    LDAP *ldap;
+    UINT server; /* index in |idmap_context.servers| */
+    bool busy;
+};
+
 struct idmap_context {
     struct idmap_config config;
     struct idmap_cache users;
     struct idmap_cache groups;
-    LDAP *ldap;
+
+    /* ldap servers from "ldap_hostname" */
+    char servers[IDMAP_LDAP_MAX_SERVERS][NFS41_HOSTNAME_LEN+1];
+    UINT num_servers;
+    volatile LONG current_server;
+
+    /* ldap connection pool */
+    SRWLOCK pool_lock;
+    HANDLE pool_sem;
+    struct idmap_ldap_conn conns[IDMAP_LDAP_MAX_CONNS];
+    UINT num_conns;
 };
 
 
@@ -596,6 +904,224 @@ static int idmap_filter(
     return status;
 }
 
+/*
+ * ldap connection pool
+ *
+ * Each pool connection runs one query at a time, |pool_sem| caps the
+ * number of outstanding queries to the number of connections.
+ * Connections are opened on first use, to the current server from
+ * "ldap_hostname". A connection which fails with a server/connect
+ * error or a timeout is closed, and the next server in the list
+ * becomes the current server (failover).
+ */
+static bool ldap_is_server_error(
+    ULONG ldap_status)
+{
+    switch (ldap_status) {
+    case LDAP_SERVER_DOWN:
+    case LDAP_UNAVAILABLE:
+    case LDAP_BUSY:
+    case LDAP_TIMEOUT:
+    case LDAP_CONNECT_ERROR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int ldap_conn_open(
+    struct idmap_context *context,
+    struct idmap_ldap_conn *conn)
+{
+    struct idmap_config *config = &context->config;
+    struct l_timeval timeout = { (LONG)config->timeout, 0 };
+    UINT i, server;
+    ULONG status = LDAP_SERVER_DOWN;
+
+    for (i = 0; i < context->num_servers; i++) {
+        server = ((UINT)context->current_server + i) %
+            context->num_servers;
+
+        conn->ldap = ldap_init(context->servers[server], config->port);
+        if (conn->ldap == NULL) {
+            status = LdapGetLastError();
+            eprintf("ldap_init(%s) failed with %d: '%s'\n",
+                context->servers[server], (int)status,
+                ldap_err2stringA(status));
+            continue;
+        }
+
+        status = ldap_set_option(conn->ldap, LDAP_OPT_PROTOCOL_VERSION,
+            (void *)&config->version);
+        if (status != LDAP_SUCCESS) {
+            eprintf("ldap_set_option(version=%d) failed with %d\n",
+                config->version, (int)status);
+            goto next_server;
+        }
+
+        if (config->timeout) {
+            status = ldap_set_option(conn->ldap, LDAP_OPT_TIMELIMIT,
+                (void *)&config->timeout);
+            if (status != LDAP_SUCCESS) {
+                eprintf("ldap_set_option(timeout=%d) failed with %d\n",
+                    config->timeout, (int)status);
+                goto next_server;
+            }
+        }
+
+        status = ldap_connect(conn->ldap,
+            config->timeout?&timeout:NULL);
+        if (status != LDAP_SUCCESS) {
+            eprintf("ldap_connect(%s) failed with %d: '%s'\n",
+                context->servers[server], (int)status,
+                ldap_err2stringA(status));
+            goto next_server;
+        }
+
+        conn->server = server;
+        (void)InterlockedExchange(&context->current_server, (LONG)server);
+        DPRINTF(IDLVL, ("ldap_conn_open: connected to '%s'\n",
+            context->servers[server]));
+        return NO_ERROR;
+
+next_server:
+        ldap_unbind(conn->ldap);
+        conn->ldap = NULL;
+    }
+    return LdapMapErrorToWin32(status);
+}
+
+static int ldap_conn_acquire(
+    struct idmap_context *context,
+    struct idmap_ldap_conn **conn_out)
+{
+    struct idmap_ldap_conn *conn = NULL;
+    DWORD wait_msecs;
+    UINT i;
+    int status;
+
+    /* wait for the whole query timeout at most */
+    wait_msecs = context->config.timeout?
+        (context->config.timeout*1000):INFINITE;
+    if (WaitForSingleObject(context->pool_sem, wait_msecs) != WAIT_OBJECT_0) {
+        eprintf("ldap_conn_acquire: no free ldap connection "
+            "after %u msecs\n", (unsigned)wait_msecs);
+        return ERROR_TIMEOUT;
+    }
+
+    AcquireSRWLockExclusive(&context->pool_lock);
+    for (i = 0; i < context->num_conns; i++) {
+        if (!context->conns[i].busy) {
+            conn = &context->conns[i];
+            conn->busy = true;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&context->pool_lock);
+    /* |pool_sem| guarantees a free connection */
+    EASSERT(conn != NULL);
+
+    if (conn->ldap == NULL) {
+        status = ldap_conn_open(context, conn);
+        if (status) {
+            AcquireSRWLockExclusive(&context->pool_lock);
+            conn->busy = false;
+            ReleaseSRWLockExclusive(&context->pool_lock);
+            (void)ReleaseSemaphore(context->pool_sem, 1, NULL);
+            return status;
+        }
+    }
+
+    *conn_out = conn;
+    return NO_ERROR;
+}
+
+static void ldap_conn_release(
+    struct idmap_context *context,
+    struct idmap_ldap_conn *conn,
+    bool failed)
+{
+    if (failed) {
+        UINT next_server = (conn->server + 1) % context->num_servers;
+
+        eprintf("ldap_conn_release: closing connection to '%s', "
+            "failing over to '%s'\n",
+            context->servers[conn->server],
+            context->servers[next_server]);
+        ldap_unbind(conn->ldap);
+        conn->ldap = NULL;
+        /* only fail over once if several connections fail */
+        (void)InterlockedCompareExchange(&context->current_server,
+            (LONG)next_server, (LONG)conn->server);
+    }
+
+    AcquireSRWLockExclusive(&context->pool_lock);
+    conn->busy = false;
+    ReleaseSRWLockExclusive(&context->pool_lock);
+    (void)ReleaseSemaphore(context->pool_sem, 1, NULL);
+}
+
+static int ldap_pool_init(
+    struct idmap_context *context)
+{
+    struct idmap_config *config = &context->config;
+    char *s, *next_token = NULL;
+    int status = NO_ERROR;
+
+    /* "ldap_hostname" is a list of servers, separated by ',' or ' ' */
+    for (s = strtok_s(config->hostname, ", \t", &next_token);
+        (s != NULL) && (context->num_servers < IDMAP_LDAP_MAX_SERVERS);
+        s = strtok_s(NULL, ", \t", &next_token)) {
+        if (FAILED(StringCchCopyA(context->servers[context->num_servers],
+                NFS41_HOSTNAME_LEN+1, s))) {
+            eprintf("ldap_pool_init: ldap server name '%s' longer than "
+                "%u characters\n", s, (unsigned)NFS41_HOSTNAME_LEN);
+            status = ERROR_BUFFER_OVERFLOW;
+            goto out;
+        }
+        context->num_servers++;
+    }
+    if (context->num_servers == 0) {
+        eprintf("ldap_pool_init: no ldap server in 'ldap_hostname'\n");
+        status = ERROR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    context->num_conns = config->pool_size;
+    if (context->num_conns < 1)
+        context->num_conns = 1;
+    else if (context->num_conns > IDMAP_LDAP_MAX_CONNS)
+        context->num_conns = IDMAP_LDAP_MAX_CONNS;
+
+    InitializeSRWLock(&context->pool_lock);
+    context->pool_sem = CreateSemaphoreA(NULL,
+        (LONG)context->num_conns, (LONG)context->num_conns, NULL);
+    if (context->pool_sem == NULL) {
+        status = GetLastError();
+        eprintf("ldap_pool_init: CreateSemaphoreA() failed with %d\n",
+            status);
+        goto out;
+    }
+
+    DPRINTF(IDLVL, ("ldap_pool_init: %u connections, %u servers\n",
+        context->num_conns, context->num_servers));
+out:
+    return status;
+}
+
+static void ldap_pool_cleanup(
+    struct idmap_context *context)
+{
+    UINT i;
+
+    for (i = 0; i < context->num_conns; i++) {
+        if (context->conns[i].ldap)
+            ldap_unbind(context->conns[i].ldap);
+    }
+    if (context->pool_sem)
+        (void)CloseHandle(context->pool_sem);
+}
+
 static int idmap_query_attrs(
     struct idmap_context *context,
     const struct idmap_lookup *lookup,
@@ -606,7 +1132,12 @@ static int idmap_query_attrs(
 {
     char filter[FILTER_LEN];
     struct idmap_config *config = &context->config;
+    struct idmap_ldap_conn *conn = NULL;
+    struct l_timeval timeout = { (LONG)config->timeout, 0 };
     LDAPMessage *res = NULL, *entry;
+    ULONG msgid, rc;
+    bool conn_failed = false;
+    UINT attempt;
     int i, status;
 
     /* format the ldap filter */
@@ -614,17 +1145,50 @@ static int idmap_query_attrs(
     if (status)
         goto out;
 
-    /* send the ldap query */
-    status = ldap_search_stA(context->ldap, config->base,
-        LDAP_SCOPE_SUBTREE, filter, NULL, 0, NULL, &res);
+    /* try each server once if the query fails with a server error */
+    for (attempt = 0; attempt < context->num_servers; attempt++) {
+        status = ldap_conn_acquire(context, &conn);
+        if (status)
+            goto out;
+
+        /* send the ldap query */
+        status = ldap_search_extA(conn->ldap, config->base,
+            LDAP_SCOPE_SUBTREE, filter, NULL, 0, NULL, NULL,
+            config->timeout, 0, &msgid);
+        if (status == LDAP_SUCCESS) {
+            rc = ldap_result(conn->ldap, msgid, LDAP_MSG_ALL,
+                config->timeout?&timeout:NULL, &res);
+            if (rc == 0) {
+                (void)ldap_abandon(conn->ldap, msgid);
+                status = LDAP_TIMEOUT;
+            }
+            else if (rc == (ULONG)-1)
+                status = LdapGetLastError();
+            else
+                status = ldap_result2error(conn->ldap, res, 0);
+        }
+        if (status == LDAP_SUCCESS)
+            break;
+
+        eprintf("ldap search for '%s' on '%s' failed with %d: '%s'\n",
+            filter, context->servers[conn->server],
+            status, ldap_err2stringA(status));
+        if (res) {
+            ldap_msgfree(res);
+            res = NULL;
+        }
+        conn_failed = ldap_is_server_error(status);
+        ldap_conn_release(context, conn, conn_failed);
+        conn = NULL;
+        if (!conn_failed)
+            break;
+    }
     if (status) {
-        eprintf("ldap search for '%s' failed with %d: '%s'\n",
-            filter, status, ldap_err2stringA(status));
         status = LdapMapErrorToWin32(status);
         goto out;
     }
 
-    entry = ldap_first_entry(context->ldap, res);
+    entry = ldap_first_entry(conn->ldap, res);
     if (entry == NULL) {
         status = LDAP_NO_RESULTS_RETURNED;
         eprintf("ldap search for '%s' failed with %d: '%s'\n",
@@ -636,7 +1200,7 @@ static int idmap_query_attrs(
     /* fetch the attributes */
     for (i = 0; i < len; i++) {
         if (ATTR_ISSET(attributes, i)) {
-            values[i] = ldap_get_valuesA(context->ldap,
+            values[i] = ldap_get_valuesA(conn->ldap,
                 entry, config->attributes[i]);
 
             /* fail if required attributes are missing */
@@ -653,9 +1217,136 @@ static int idmap_query_attrs(
     }
 out:
     if (res) ldap_msgfree(res);
+    if (conn)
+        ldap_conn_release(context, conn, false);
     return status;
 }
 
+/* cache a failed lookup, keyed by the attribute which was looked up */
+static void user_cache_negative(
+    struct idmap_context *context,
+    const struct idmap_lookup *lookup,
+    int status)
+{
+    struct idmap_user user = { 0 };
+
+    switch (lookup->attr) {
+    case ATTR_USER_NAME:
+        if (FAILED(StringCchCopyA(user.username, VAL_LEN,
+            (const char*)lookup->value)))
+            return;
+        break;
+    case ATTR_PRINCIPAL:
+        if (FAILED(StringCchCopyA(user.principal, VAL_LEN,
+            (const char*)lookup->value)))
+            return;
+        break;
+    case ATTR_UID:
+        user.uid = (uid_t)PTR2UINT(lookup->value);
+        break;
+    default:
+        return;
+    }
+    user.last_updated = UTIL_GETRELTIME();
+    cache_insert(&context->users, lookup, &user.entry, status);
+}
+
+static void group_cache_negative(
+    struct idmap_context *context,
+    const struct idmap_lookup *lookup,
+    int status)
+{
+    struct idmap_group group = { 0 };
+
+    switch (lookup->attr) {
+    case ATTR_GROUP_NAME:
+        if (FAILED(StringCchCopyA(group.name, VAL_LEN,
+            (const char*)lookup->value)))
+            return;
+        break;
+    case ATTR_GID:
+        group.gid = (gid_t)PTR2UINT(lookup->value);
+        break;
+    default:
+        return;
+    }
+    group.last_updated = UTIL_GETRELTIME();
+    cache_insert(&context->groups, lookup, &group.entry, status);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+/* persistent copies of the positive cache entries, see idcachefile.c */
+static void user_cache_persist(
+    struct idmap_context *context,
+    const struct idmap_user *user)
+{
+    idcachefile_entry entry = { 0 };
+
+    entry.type = IDCACHEFILE_IDMAP_USER;
+    entry.uid = user->uid;
+    entry.gid = user->gid;
+    (void)StringCchCopyA(entry.name, IDCACHEFILE_NAME_LEN, user->username);
+    (void)StringCchCopyA(entry.name2, IDCACHEFILE_NAME_LEN, user->principal);
+    idcachefile_store(&entry, (uint32_t)context->config.cache_ttl);
+}
+
+static void group_cache_persist(
+    struct idmap_context *context,
+    const struct idmap_group *group)
+{
+    idcachefile_entry entry = { 0 };
+
+    entry.type = IDCACHEFILE_IDMAP_GROUP;
+    entry.gid = group->gid;
+    (void)StringCchCopyA(entry.name, IDCACHEFILE_NAME_LEN, group->name);
+    idcachefile_store(&entry, (uint32_t)context->config.cache_ttl);
+}
+
+/* age of a loaded entry, so it expires at the time it was stored for */
+static __inline util_reltimestamp idcachefile_entry_age(
+    struct idmap_context *context,
+    uint32_t remaining)
+{
+    const uint32_t ttl = (uint32_t)context->config.cache_ttl;
+    return (remaining < ttl)?(ttl - remaining):0;
+}
+
+static void user_cache_load_entry(
+    void *ctx,
+    const idcachefile_entry *entry,
+    uint32_t remaining)
+{
+    struct idmap_context *context = (struct idmap_context *)ctx;
+    struct idmap_user user = { 0 };
+    const struct idmap_lookup lookup = { .attr = ATTR_USER_NAME };
+
+    (void)StringCchCopyA(user.username, VAL_LEN, entry->name);
+    (void)StringCchCopyA(user.principal, VAL_LEN, entry->name2);
+    user.uid = entry->uid;
+    user.gid = entry->gid;
+    /* wraps around for ages > uptime, |UTIL_DIFFRELTIME()| handles that */
+    user.last_updated = UTIL_GETRELTIME() -
+        idcachefile_entry_age(context, remaining);
+    cache_insert(&context->users, &lookup, &user.entry, 0);
+}
+
+static void group_cache_load_entry(
+    void *ctx,
+    const idcachefile_entry *entry,
+    uint32_t remaining)
+{
+    struct idmap_context *context = (struct idmap_context *)ctx;
+    struct idmap_group group = { 0 };
+    const struct idmap_lookup lookup = { .attr = ATTR_GROUP_NAME };
+
+    (void)StringCchCopyA(group.name, VAL_LEN, entry->name);
+    group.gid = entry->gid;
+    group.last_updated = UTIL_GETRELTIME() -
+        idcachefile_entry_age(context, remaining);
+    cache_insert(&context->groups, &lookup, &group.entry, 0);
+}
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+
 static int idmap_lookup_user(
     struct idmap_context *context,
     const struct idmap_lookup *lookup,
@@ -671,14 +1362,22 @@ static int idmap_lookup_user(
     const unsigned optional = ATTR_FLAG(ATTR_PRINCIPAL);
     int i;
 #endif /* !NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN */
-    int status;
+    int status, cached_status;
 
     /* check the user cache for an existing entry */
-    status = cache_lookup(&context->users, lookup, &user->entry);
+    status = cache_lookup(&context->users, lookup, &user->entry,
+        &cached_status);
     if (status == NO_ERROR) {
         /* don't return expired entries; query new attributes
          * and overwrite the entry with cache_insert() */
-        if (UTIL_DIFFRELTIME(UTIL_GETRELTIME(), user->last_updated) < context->config.cache_ttl)
+        if (cached_status) {
+            if (UTIL_DIFFRELTIME(UTIL_GETRELTIME(), user->last_updated) <
+                context->config.negative_cache_ttl) {
+                status = cached_status;
+                goto out;
+            }
+        }
+        else if (UTIL_DIFFRELTIME(UTIL_GETRELTIME(), user->last_updated) < context->config.cache_ttl)
             goto out;
     }
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
@@ -826,13 +1525,20 @@ static int idmap_lookup_user(
 #endif /* !NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN */
     if ((status == 0) && context->config.cache_ttl) {
         /* insert the entry into the cache */
-        cache_insert(&context->users, lookup, &user->entry);
+        cache_insert(&context->users, lookup, &user->entry, 0);
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+        user_cache_persist(context, user);
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
     }
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
 out_free_values:
     for (i = 0; i < NUM_ATTRIBUTES; i++)
         ldap_value_freeA(values[i]);
 #endif
+    if (is_negative_result(status) && context->config.negative_cache_ttl) {
+        /* remember that this user does not exist */
+        user_cache_negative(context, lookup, status);
+    }
 out:
     return status;
 }
@@ -848,14 +1554,22 @@ static int idmap_lookup_group(
         | ATTR_FLAG(ATTR_GID);
     int i;
 #endif
-    int status;
+    int status, cached_status;
 
     /* check the group cache for an existing entry */
-    status = cache_lookup(&context->groups, lookup, &group->entry);
+    status = cache_lookup(&context->groups, lookup, &group->entry,
+        &cached_status);
     if (status == NO_ERROR) {
         /* don't return expired entries; query new attributes
          * and overwrite the entry with cache_insert() */
-        if (UTIL_DIFFRELTIME(UTIL_GETRELTIME(), group->last_updated) < context->config.cache_ttl)
+        if (cached_status) {
+            if (UTIL_DIFFRELTIME(UTIL_GETRELTIME(), group->last_updated) <
+                context->config.negative_cache_ttl) {
+                status = cached_status;
+                goto out;
+            }
+        }
+        else if (UTIL_DIFFRELTIME(UTIL_GETRELTIME(), group->last_updated) < context->config.cache_ttl)
             goto out;
     }
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
@@ -933,13 +1647,20 @@ static int idmap_lookup_group(
 #endif /* !NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN */
     if ((status == 0) && context->config.cache_ttl) {
         /* insert the entry into the cache */
-        cache_insert(&context->groups, lookup, &group->entry);
+        cache_insert(&context->groups, lookup, &group->entry, 0);
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+        group_cache_persist(context, group);
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
     }
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
 out_free_values:
     for (i = 0; i < NUM_ATTRIBUTES; i++)
         ldap_value_freeA(values[i]);
 #endif
+    if (is_negative_result(status) && context->config.negative_cache_ttl) {
+        /* remember that this group does not exist */
+        group_cache_negative(context, lookup, status);
+    }
 out:
     return status;
 }
@@ -976,35 +1697,25 @@ int nfs41_idmap_create(
         goto out_err_free;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+    /* known users and groups from the last run */
+    if (context->config.cache_ttl > 0) {
+        (void)idcachefile_load(IDCACHEFILE_IDMAP_USER,
+            user_cache_load_entry, context);
+        (void)idcachefile_load(IDCACHEFILE_IDMAP_GROUP,
+            group_cache_load_entry, context);
+    }
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
-    /* initialize ldap and configure options */
-    context->ldap = ldap_init(context->config.hostname, context->config.port);
-    if (context->ldap == NULL) {
-        status = LdapGetLastError();
-        eprintf("ldap_init(%s) failed with %d: '%s'\n",
-            context->config.hostname, status, ldap_err2stringA(status));
-        status = LdapMapErrorToWin32(status);
+    /*
+     * initialize the ldap connection pool, connections are opened
+     * on first use
+     */
+    status = ldap_pool_init(context);
+    if (status) {
+        eprintf("ldap_pool_init() failed with %d\n", status);
         goto out_err_free;
-    }
-
-    status = ldap_set_option(context->ldap, LDAP_OPT_PROTOCOL_VERSION,
-        (void *)&context->config.version);
-    if (status != LDAP_SUCCESS) {
-        eprintf("ldap_set_option(version=%d) failed with %d\n",
-            context->config.version, status);
-        status = LdapMapErrorToWin32(status);
-        goto out_err_free;
-    }
-
-    if (context->config.timeout) {
-        status = ldap_set_option(context->ldap, LDAP_OPT_TIMELIMIT,
-            (void *)&context->config.timeout);
-        if (status != LDAP_SUCCESS) {
-            eprintf("ldap_set_option(timeout=%d) failed with %d\n",
-                context->config.timeout, status);
-            status = LdapMapErrorToWin32(status);
-            goto out_err_free;
-        }
     }
 #else
     DPRINTF(CYGWINIDLVL, ("nfs41_idmap_create: Force context->config.timeout = 6000;\n"));
@@ -1024,15 +1735,29 @@ out_err_free:
 void nfs41_idmap_free(
     struct idmap_context *context)
 {
-    /* clean up the connection */
-    if (context->ldap)
-        ldap_unbind(context->ldap);
+    /* clean up the connections */
+    ldap_pool_cleanup(context);
 
     cache_cleanup(&context->users);
     cache_cleanup(&context->groups);
     free(context);
 }
 
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+/* Shrink the user and group caches to |cache_max_entries()| */
+void nfs41_idmap_trim(
+    struct idmap_context *context)
+{
+    AcquireSRWLockExclusive(&context->users.lock);
+    cache_drop_oldest(&context->users, cache_max_entries());
+    ReleaseSRWLockExclusive(&context->users.lock);
+
+    AcquireSRWLockExclusive(&context->groups.lock);
+    cache_drop_oldest(&context->groups, cache_max_entries());
+    ReleaseSRWLockExclusive(&context->groups.lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+
 
 /* username -> uid, gid */
 static int username_cmp(const struct list_entry *list, const void *value)
@@ -35,6 +35,11 @@ int nfs41_idmap_create(
 void nfs41_idmap_free(
     nfs41_idmapper *context);
 
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+void nfs41_idmap_trim(
+    nfs41_idmapper *context);
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+
 
 int nfs41_idmap_name_to_uid(
     struct idmap_context *context,
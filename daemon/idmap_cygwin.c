@@ -48,13 +48,216 @@
     "/cygdrive/c/cygwin/lib/msnfs41client/cygwin_idmapper.ksh")
 #endif /* _WIN64 */
 
+#ifdef _WIN64
+#define CYGWIN_IDMAPPER_SERVER \
+    ("C:\\cygwin64\\bin\\ksh93.exe " \
+    "/cygdrive/c/cygwin64/lib/msnfs41client/cygwin_idmapper.ksh server")
+#else
+#define CYGWIN_IDMAPPER_SERVER \
+    ("C:\\cygwin\\bin\\ksh93.exe " \
+    "/cygdrive/c/cygwin/lib/msnfs41client/cygwin_idmapper.ksh server")
+#endif /* _WIN64 */
+
 #ifdef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
-int cygwin_getent_passwd(const char *name, char *res_loginname, uid_t *res_uid, gid_t *res_gid)
+/*
+ * Persistent idmapper helpers
+ *
+ * Starting ksh93+cygwin_idmapper.ksh for each lookup costs tens of
+ * milliseconds, so we keep a few "cygwin_idmapper.ksh server"
+ * processes running and send them one request per line. Each
+ * reply ends with a line "#end <exit code>".
+ * A helper which dies or sends garbage is killed and restarted on
+ * the next request. If a helper cannot be started at all we fall
+ * back to one cygwin_idmapper.ksh process per lookup.
+ */
+#define CYGWIN_IDMAPPER_NUM_HELPERS 4
+
+typedef struct _cygwin_idmapper_helper {
+    SRWLOCK lock;
+    subcmd_popen_context *pipe;
+} cygwin_idmapper_helper;
+
+static cygwin_idmapper_helper
+    cygwin_idmapper_helpers[CYGWIN_IDMAPPER_NUM_HELPERS] = {
+    { SRWLOCK_INIT, NULL },
+    { SRWLOCK_INIT, NULL },
+    { SRWLOCK_INIT, NULL },
+    { SRWLOCK_INIT, NULL }
+};
+static volatile LONG cygwin_idmapper_next_helper = 0;
+
+static void cygwin_idmapper_helper_kill(
+    cygwin_idmapper_helper *helper)
+{
+    (void)TerminateProcess(helper->pipe->pi.hProcess, 1);
+    (void)subcmd_pclose(helper->pipe);
+    helper->pipe = NULL;
+}
+
+/*
+ * Returns |true| if a helper answered the request, the exit code
+ * of the lookup is returned in |*exitcode_ptr|
+ */
+static bool cygwin_idmapper_helper_query(
+    const char *mode,
+    const char *name,
+    char *buff,
+    size_t buff_size,
+    DWORD *num_buff_read_ptr,
+    int *exitcode_ptr)
+{
+    cygwin_idmapper_helper *helper;
+    char reqbuff[1024];
+    int reqlen;
+    DWORD num_buff_read, num_read;
+    char *end;
+    int attempt;
+    LONG i, start;
+    bool res = false;
+
+    /* The line protocol cannot pass names with newlines */
+    if (strpbrk(name, "\r\n"))
+        return false;
+
+    reqlen = snprintf(reqbuff, sizeof(reqbuff), "%s %s\n", mode, name);
+    if ((reqlen < 0) || (reqlen >= (int)sizeof(reqbuff)))
+        return false;
+
+    /* Use the first idle helper, or wait for one */
+    start = InterlockedIncrement(&cygwin_idmapper_next_helper);
+    helper = NULL;
+    for (i = 0; i < CYGWIN_IDMAPPER_NUM_HELPERS; i++) {
+        cygwin_idmapper_helper *h = &cygwin_idmapper_helpers[
+            (start + i) % CYGWIN_IDMAPPER_NUM_HELPERS];
+        if (TryAcquireSRWLockExclusive(&h->lock)) {
+            helper = h;
+            break;
+        }
+    }
+    if (helper == NULL) {
+        helper = &cygwin_idmapper_helpers[
+            start % CYGWIN_IDMAPPER_NUM_HELPERS];
+        AcquireSRWLockExclusive(&helper->lock);
+    }
+
+    /* Retry once with a new helper if the old one died */
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (helper->pipe == NULL) {
+            helper->pipe = subcmd_popen_rw(CYGWIN_IDMAPPER_SERVER);
+            if (helper->pipe == NULL) {
+                DPRINTF(0,
+                    ("cygwin_idmapper_helper_query: "
+                    "Cannot start '%s', GetLastError()='%d'\n",
+                    CYGWIN_IDMAPPER_SERVER, (int)GetLastError()));
+                goto out;
+            }
+        }
+
+        if (!subcmd_writecmdinput(helper->pipe, reqbuff, reqlen)) {
+            DPRINTF(0,
+                ("cygwin_idmapper_helper_query(mode='%s',name='%s'): "
+                "write failed, restarting helper\n", mode, name));
+            cygwin_idmapper_helper_kill(helper);
+            continue;
+        }
+
+        /* Read until we have the "#end" line */
+        num_buff_read = 0;
+        end = NULL;
+        for (;;) {
+            buff[num_buff_read] = '\0';
+            end = strstr(buff, "\n#end ");
+            if (end && strchr(end+1, '\n'))
+                break;
+            end = NULL;
+
+            if ((num_buff_read+1) >= buff_size)
+                break;
+            if (!subcmd_readcmdoutput(helper->pipe,
+                buff+num_buff_read, buff_size-1-num_buff_read,
+                &num_read) || (num_read == 0))
+                break;
+            num_buff_read += num_read;
+        }
+
+        if (end == NULL) {
+            DPRINTF(0,
+                ("cygwin_idmapper_helper_query(mode='%s',name='%s'): "
+                "no valid reply, restarting helper\n", mode, name));
+            cygwin_idmapper_helper_kill(helper);
+            /* Do not send a request twice if we got a partial reply */
+            if (num_buff_read > 0)
+                goto out;
+            continue;
+        }
+
+        *exitcode_ptr = atoi(end+6);
+        *end = '\0';
+        *num_buff_read_ptr = (DWORD)(end - buff);
+        res = true;
+        break;
+    }
+
+out:
+    ReleaseSRWLockExclusive(&helper->lock);
+    return res;
+}
+
+/*
+ * Run an idmapper lookup, returns |true| and the output in |buff|
+ * on success
+ */
+static bool cygwin_idmapper_run(
+    const char *mode,
+    const char *name,
+    char *buff,
+    size_t buff_size,
+    DWORD *num_buff_read_ptr)
 {
     char cmdbuff[1024];
+    subcmd_popen_context *script_pipe;
+    int exitcode;
+    BOOL ok;
+
+    if (cygwin_idmapper_helper_query(mode, name,
+        buff, buff_size, num_buff_read_ptr, &exitcode)) {
+        return (exitcode == 0)?true:false;
+    }
+
+    /* fixme: better quoting for |name| needed */
+    (void)snprintf(cmdbuff, sizeof(cmdbuff),
+        "%s %s \"%s\"",
+        CYGWIN_IDMAPPER_SCRIPT,
+        mode,
+        name);
+    if ((script_pipe = subcmd_popen(cmdbuff)) == NULL) {
+        int last_error = GetLastError();
+        DPRINTF(0,
+            ("cygwin_idmapper_run(mode='%s',name='%s'): "
+            "'%s' failed, GetLastError()='%d'\n",
+            mode,
+            name,
+            cmdbuff,
+            last_error));
+        return false;
+    }
+
+    ok = subcmd_readcmdoutput(script_pipe,
+        buff, buff_size-1, num_buff_read_ptr);
+    if (!ok) {
+        DPRINTF(0,
+            ("cygwin_idmapper_run(mode='%s',name='%s'): "
+            "subcmd_readcmdoutput() failed\n",
+            mode, name));
+    }
+    (void)subcmd_pclose(script_pipe);
+    return ok?true:false;
+}
+
+int cygwin_getent_passwd(const char *name, char *res_loginname, uid_t *res_uid, gid_t *res_gid)
+{
     char buff[2048];
     DWORD num_buff_read;
-    subcmd_popen_context *script_pipe = NULL;
     int res = 1;
     unsigned long uid = ~0UL;
     unsigned long gid = ~0UL;
@@ -69,27 +272,11 @@ int cygwin_getent_passwd(const char *name, char *res_loginname, uid_t *res_uid,
         ("--> cygwin_getent_passwd(name='%s')\n",
         name));
 
-    /* fixme: better quoting for |name| needed */
-    (void)snprintf(cmdbuff, sizeof(cmdbuff),
-        "%s nfsserver_owner2localaccount \"%s\"",
-        CYGWIN_IDMAPPER_SCRIPT,
-        name);
-    if ((script_pipe = subcmd_popen(cmdbuff)) == NULL) {
-        int last_error = GetLastError();
-        DPRINTF(0,
-            ("cygwin_getent_passwd(name='%s'): "
-            "'%s' failed, GetLastError()='%d'\n",
-            name,
-            cmdbuff,
-            last_error));
-        goto fail;
-    }
-
-    if (!subcmd_readcmdoutput(script_pipe,
+    if (!cygwin_idmapper_run("nfsserver_owner2localaccount", name,
         buff, sizeof(buff), &num_buff_read)) {
-        DPRINTF(0,
+        DPRINTF(CYGWINIDLVL,
             ("cygwin_getent_passwd(name='%s'): "
-            "subcmd_readcmdoutput() failed\n",
+            "idmapper lookup failed\n",
             name));
         goto fail;
     }
@@ -168,9 +355,6 @@ int cygwin_getent_passwd(const char *name, char *res_loginname, uid_t *res_uid,
     res = 0;
 
 fail:
-    if (script_pipe)
-        (void)subcmd_pclose(script_pipe);
-
     for (i=0 ; i < numcnv ; i++) {
         cpv_free_name_val_data(&cnv[i]);
     }
@@ -197,10 +381,8 @@ fail:
 
 int cygwin_getent_group(const char* name, char* res_group_name, gid_t* res_gid)
 {
-    char cmdbuff[1024];
     char buff[2048];
     DWORD num_buff_read;
-    subcmd_popen_context *script_pipe = NULL;
     int res = 1;
     unsigned long gid = ~0UL;
     void *cpvp = NULL;
@@ -215,27 +397,11 @@ int cygwin_getent_group(const char* name, char* res_group_name, gid_t* res_gid)
         ("--> cygwin_getent_group(name='%s')\n",
         name));
 
-    /* fixme: better quoting for |name| needed */
-    (void)snprintf(cmdbuff, sizeof(cmdbuff),
-        "%s nfsserver_owner_group2localgroup \"%s\"",
-        CYGWIN_IDMAPPER_SCRIPT,
-        name);
-    if ((script_pipe = subcmd_popen(cmdbuff)) == NULL) {
-        int last_error = GetLastError();
-        DPRINTF(0,
-            ("cygwin_getent_group(name='%s'): "
-            "'%s' failed, GetLastError()='%d'\n",
-            name,
-            cmdbuff,
-            last_error));
-        goto fail;
-    }
-
-    if (!subcmd_readcmdoutput(script_pipe,
+    if (!cygwin_idmapper_run("nfsserver_owner_group2localgroup", name,
         buff, sizeof(buff), &num_buff_read)) {
-        DPRINTF(0,
+        DPRINTF(CYGWINIDLVL,
             ("cygwin_getent_group(name='%s'): "
-            "subcmd_readcmdoutput() failed\n",
+            "idmapper lookup failed\n",
             name));
         goto fail;
     }
@@ -307,9 +473,6 @@ int cygwin_getent_group(const char* name, char* res_group_name, gid_t* res_gid)
     res = 0;
 
 fail:
-    if (script_pipe)
-        (void)subcmd_pclose(script_pipe);
-
     for (i=0 ; i < numcnv ; i++) {
         cpv_free_name_val_data(&cnv[i]);
     }
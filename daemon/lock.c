@@ -270,15 +270,95 @@ out_free:
     goto out;
 }
 
+/*
+ * Blocking locks which were denied by the server wait on an event in
+ * |lock_waiters| between retries. A matching CB_NOTIFY_LOCK signals
+ * the event, so the waiter retries right away instead of sleeping for
+ * the rest of its poll delay. Servers which never send CB_NOTIFY_LOCK
+ * just see the exponential backoff polling.
+ */
 #define LOCK_POLL_MIN_WAIT_MS   (100UL)     /* 100ms */
 #define LOCK_POLL_MAX_WAIT_MS   (15000UL)   /* 15s */
 
+struct lock_waiter {
+    struct list_entry entry;
+    const nfs41_client *client;
+    const nfs41_fh *fh;
+    const state_owner4 *owner;
+    HANDLE event;
+};
+
+static struct {
+    SRWLOCK lock;
+    struct list_entry list;
+} lock_waiters = {
+    .lock = SRWLOCK_INIT,
+    .list = { &lock_waiters.list, &lock_waiters.list },
+};
+
+static bool_t lock_waiter_add(
+    IN struct lock_waiter *waiter,
+    IN const nfs41_open_state *state)
+{
+    waiter->event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (waiter->event == NULL) {
+        eprintf("lock_waiter_add: CreateEventA() failed with %d\n",
+            (int)GetLastError());
+        return FALSE;
+    }
+    waiter->client = state->session->client;
+    waiter->fh = &state->file.fh;
+    waiter->owner = &state->owner;
+
+    AcquireSRWLockExclusive(&lock_waiters.lock);
+    list_add_tail(&lock_waiters.list, &waiter->entry);
+    ReleaseSRWLockExclusive(&lock_waiters.lock);
+    return TRUE;
+}
+
+static void lock_waiter_remove(
+    IN struct lock_waiter *waiter)
+{
+    AcquireSRWLockExclusive(&lock_waiters.lock);
+    list_remove(&waiter->entry);
+    ReleaseSRWLockExclusive(&lock_waiters.lock);
+
+    (void)CloseHandle(waiter->event);
+    waiter->event = NULL;
+}
+
+void nfs41_lock_notify(
+    IN nfs41_client *client,
+    IN const nfs41_fh *fh,
+    IN const state_owner4 *owner)
+{
+    struct list_entry *entry;
+    struct lock_waiter *waiter;
+
+    AcquireSRWLockShared(&lock_waiters.lock);
+    list_for_each(entry, &lock_waiters.list) {
+        waiter = list_container(entry, struct lock_waiter, entry);
+        if ((waiter->client == client) &&
+            (waiter->fh->len == fh->len) &&
+            (!memcmp(waiter->fh->fh, fh->fh, fh->len)) &&
+            (waiter->owner->owner_len == owner->owner_len) &&
+            (!memcmp(waiter->owner->owner, owner->owner, owner->owner_len))) {
+            DPRINTF(LKLVL, ("nfs41_lock_notify: waking up waiter\n"));
+            (void)SetEvent(waiter->event);
+        }
+    }
+    ReleaseSRWLockShared(&lock_waiters.lock);
+}
+
 static int handle_lock(void *deamon_context, nfs41_upcall *upcall)
 {
     int status;
     lock_upcall_args *args = &upcall->args.lock;
     nfs41_open_state *state = upcall->state_ref;
     DWORD poll_delay = 0UL;
+    struct lock_waiter waiter;
+
+    waiter.event = NULL;
 
 retry_lock:
     status = handle_lock_retry(deamon_context, upcall);
@@ -294,23 +374,31 @@ retry_lock:
         if (poll_delay > LOCK_POLL_MAX_WAIT_MS)
             poll_delay = LOCK_POLL_MAX_WAIT_MS;
 
-        /*
-         * Make sure the kernel waits for us, and then go to sleep
-         *
-         * ToDO:
-         * - Turn this into an Win32 event, wait via
-         * |WaitForSingleObject(..., poll_delay)|, and signal the event if
-         * a matching |CB_NOTIFY_LOCK| is received
-         */
+        /* listen for CB_NOTIFY_LOCK after the first denial */
+        if (waiter.event == NULL)
+            (void)lock_waiter_add(&waiter, state);
+
+        /* Make sure the kernel waits for us, and then go to sleep */
         DPRINTF(1,
             ("handle_lock(state->path.path='%s'): retry in %ldms\n",
             state->path.path, (long)poll_delay));
         (void)delayxid(upcall->xid, 30+(poll_delay/1000));
-        Sleep(poll_delay);
+        if (waiter.event) {
+            if (WaitForSingleObject(waiter.event, poll_delay) ==
+                WAIT_OBJECT_0) {
+                DPRINTF(1,
+                    ("handle_lock(state->path.path='%s'): "
+                    "got CB_NOTIFY_LOCK\n", state->path.path));
+            }
+        } else {
+            Sleep(poll_delay);
+        }
 
         goto retry_lock;
     }
 
+    if (waiter.event)
+        lock_waiter_remove(&waiter);
     return status;
 }
 
@@ -376,6 +464,80 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_BATCHED_LOCKU
+/*
+ * Unlock the ranges of a multi-range unlock (RDBSS unlocks all
+ * locks of a file with one |LOWIO_OP_UNLOCK_MULTIPLE| on close)
+ * with |nfs41_unlock_batch()|, instead of one LOCKU compound per
+ * range
+ */
+static int handle_unlock_batch(
+    IN nfs41_open_state *state,
+    IN const unlock_upcall_args *args)
+{
+    nfs41_unlock_range *ranges;
+    nfs41_lock_state input;
+    stateid_arg stateid;
+    const unsigned char *buf = args->buf;
+    uint32_t buf_len = args->buf_len;
+    uint32_t i, n = 0, per_batch, done;
+    int status = NO_ERROR, nfsstatus;
+
+    ranges = malloc(args->count * sizeof(nfs41_unlock_range));
+    if (ranges == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    for (i = 0; i < args->count; i++) {
+        if (safe_read(&buf, &buf_len, &input.offset, sizeof(LONGLONG))) break;
+        if (safe_read(&buf, &buf_len, &input.length, sizeof(LONGLONG))) break;
+
+        /* do the same translation as LOCK, or the ranges won't match */
+        if (input.length >= NFS4_UINT64_MAX - input.offset)
+            input.length = NFS4_UINT64_MAX;
+
+        /* search for the range to unlock, and remove if delegated */
+        status = open_unlock_delegate(state, &input);
+        if (status != ERROR_LOCKED)
+            continue;
+
+        ranges[n].offset = input.offset;
+        ranges[n].length = input.length;
+        n++;
+    }
+    if (n == 0)
+        goto out;
+
+    per_batch = NFS41_UNLOCK_BATCH_MAX;
+    if (state->session->fore_chan_attrs.ca_maxoperations < (per_batch + 2))
+        per_batch = state->session->fore_chan_attrs.ca_maxoperations - 2;
+
+    EnterCriticalSection(&state->locks.lock);
+    lock_stateid_arg(state, &stateid);
+
+    /* return the first error, but release the remaining ranges too */
+    status = NO_ERROR;
+    for (done = 0; done < n; done += per_batch) {
+        DPRINTF(LKLVL, ("handle_unlock_batch: unlocking %u of %u ranges\n",
+            (unsigned int)min(per_batch, n - done), (unsigned int)n));
+        nfsstatus = nfs41_unlock_batch(state->session, &state->file,
+            &ranges[done], min(per_batch, n - done), &stateid);
+        if (nfsstatus && (status == NO_ERROR))
+            status = nfs_to_windows_error(nfsstatus, ERROR_BAD_NET_RESP);
+    }
+
+    /* like |handle_unlock()|, the ranges are removed even on failure */
+    for (i = 0; i < n; i++) {
+        input.offset = ranges[i].offset;
+        input.length = ranges[i].length;
+        open_unlock_remove(state, &stateid, &input);
+    }
+    LeaveCriticalSection(&state->locks.lock);
+out:
+    free(ranges);
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_BATCHED_LOCKU */
+
 static int handle_unlock(void *daemon_context, nfs41_upcall *upcall)
 {
     nfs41_lock_state input;
@@ -387,6 +549,12 @@ static int handle_unlock(void *daemon_context, nfs41_upcall *upcall)
     uint32_t i;
     int status = NO_ERROR;
 
+#ifdef NFS41_DRIVER_DAEMON_BATCHED_LOCKU
+    if ((args->count > 1) &&
+        (state->session->fore_chan_attrs.ca_maxoperations > 3))
+        return handle_unlock_batch(state, args);
+#endif /* NFS41_DRIVER_DAEMON_BATCHED_LOCKU */
+
     for (i = 0; i < args->count; i++) {
         if (safe_read(&buf, &buf_len, &input.offset, sizeof(LONGLONG))) break;
         if (safe_read(&buf, &buf_len, &input.length, sizeof(LONGLONG))) break;
@@ -28,7 +28,9 @@
 #include "nfs41_compound.h"
 #include "nfs41_ops.h"
 #include "name_cache.h"
+#include "delegation.h"
 #include "fileinfoutil.h"
+#include "ncsnap.h"
 #include "util.h"
 #include "daemon_debug.h"
 
@@ -70,6 +72,12 @@ typedef struct __nfs41_lookup_component_args {
     nfs41_getattr_args      getrootattr;
     nfs41_getattr_args      getattr[MAX_LOOKUP_COMPONENTS];
     bitmap4                 attr_request;
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+    bitmap4                 boot_attr_request;
+    nfs41_openattr_args     openattr;
+    uint32_t                boot_last;
+    bool_t                  bootstrap;
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
 } nfs41_lookup_component_args;
 
 typedef struct __nfs41_lookup_component_res {
@@ -85,6 +93,13 @@ typedef struct __nfs41_lookup_component_res {
     nfs41_file_info         rootinfo;
     nfs41_file_info         info[MAX_LOOKUP_COMPONENTS];
     struct lookup_referral  *referral;
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+    nfs41_openattr_res      openattr;
+    /* superblock attributes of the root [0] and the last component [1] */
+    bitmap4                 boot_supported_attrs[2];
+    bitmap4                 boot_suppattr_exclcreat[2];
+    nfstime4                boot_time_delta[2];
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
 } nfs41_lookup_component_res;
 
 
@@ -109,6 +124,14 @@ static void init_component_args(
         | FATTR4_WORD1_OWNER | FATTR4_WORD1_OWNER_GROUP;
     args->attr_request.arr[2] = FATTR4_WORD2_OFFLINE;
 
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+    nfs41_superblock_attr_request(&args->boot_attr_request);
+    bitmap_or(&args->boot_attr_request, &args->attr_request);
+    res->rootinfo.supported_attrs = &res->boot_supported_attrs[0];
+    res->rootinfo.suppattr_exclcreat = &res->boot_suppattr_exclcreat[0];
+    res->rootinfo.time_delta = &res->boot_time_delta[0];
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+
     args->getrootattr.attr_request = &args->attr_request;
     res->root.path = path;
     res->getrootfh.fh = &res->root.fh;
@@ -126,6 +149,109 @@ static void init_component_args(
     }
 }
 
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+/*
+ * Mount bootstrap
+ *
+ * The first lookup from the root of a server whose superblocks are
+ * not known yet (which is the lookup of the mount path in
+ * |handle_mount()|) adds the superblock attributes to the GETATTRs of
+ * the root and the last component, and ends with an OPENATTR to probe
+ * named attribute support of the last file handle.
+ * That way SEQUENCE+PUTROOTFH+...+LOOKUP+GETFH+GETATTR+OPENATTR is the
+ * only compound after CREATE_SESSION, instead of one more
+ * |nfs41_superblock_getattr()| compound for each fsid on the path.
+ */
+static void lookup_bootstrap_prepare(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN uint32_t count,
+    IN nfs41_lookup_component_args *args,
+    IN nfs41_lookup_component_res *res)
+{
+    /* undo the previous call */
+    args->getrootattr.attr_request = &args->attr_request;
+    args->getattr[args->boot_last].attr_request = &args->attr_request;
+    args->boot_last = 0;
+
+    /* the extra OPENATTR must fit into |ca_maxoperations| */
+    args->bootstrap = (dir == &res->root) &&
+        ((5 + count * 3) <= session->fore_chan_attrs.ca_maxoperations) &&
+        nfs41_superblock_list_empty(session);
+    if (!args->bootstrap)
+        return;
+
+    /* not decoded if an earlier operation fails */
+    res->openattr.status = NFS4ERR_NOTSUPP;
+
+    args->getrootattr.attr_request = &args->boot_attr_request;
+    if (count) {
+        res->getattr[count-1].status = NFS4ERR_SERVERFAULT;
+        args->boot_last = count - 1;
+        args->getattr[count-1].attr_request = &args->boot_attr_request;
+        res->info[count-1].supported_attrs = &res->boot_supported_attrs[1];
+        res->info[count-1].suppattr_exclcreat =
+            &res->boot_suppattr_exclcreat[1];
+        res->info[count-1].time_delta = &res->boot_time_delta[1];
+    }
+    DPRINTF(LULVL, ("lookup_bootstrap_prepare: fetching superblock "
+        "attributes with the lookup of %u components\n", count));
+}
+
+/* same mapping of the OPENATTR result as |nfs41_superblock_getattr()| */
+static bool_t lookup_bootstrap_named_attrs(
+    IN const nfs41_lookup_component_res *res)
+{
+    switch (res->openattr.status) {
+    case NFS4ERR_NOENT:
+    case NFS4_OK:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* |TRUE| if the compound got through the GETATTR of the last component */
+static bool_t lookup_bootstrap_complete(
+    IN uint32_t count,
+    IN const nfs41_lookup_component_res *res)
+{
+    /* |lookup_bootstrap_prepare()| reset the status */
+    return res->getattr[count-1].status == NFS4_OK;
+}
+
+static int lookup_bootstrap_root(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN uint32_t count,
+    IN const nfs41_lookup_component_res *res)
+{
+    const nfs41_fsid *fsid = &res->rootinfo.fsid;
+    bool_t named_attrs;
+
+    if (count == 0) {
+        named_attrs = lookup_bootstrap_named_attrs(res);
+    } else if (lookup_bootstrap_complete(count, res)) {
+        /*
+         * The OPENATTR was sent for the last component. If that is on
+         * another fsid, the root is usually the server's pseudo file
+         * system, which has no named attributes
+         */
+        if ((res->info[count-1].fsid.major == fsid->major) &&
+            (res->info[count-1].fsid.minor == fsid->minor))
+            named_attrs = lookup_bootstrap_named_attrs(res);
+        else
+            named_attrs = FALSE;
+    } else {
+        /* the lookup failed, fetch the attributes the usual way */
+        return nfs41_superblock_for_fh(session, fsid, NULL, dir);
+    }
+
+    return nfs41_superblock_for_fh_prefetched(session, fsid, NULL,
+        &res->rootinfo, named_attrs, dir);
+}
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+
 static int lookup_rpc(
     IN nfs41_session *session,
     IN nfs41_path_fh *dir,
@@ -136,8 +262,8 @@ static int lookup_rpc(
     int status;
     uint32_t i;
     nfs41_compound compound;
-    nfs_argop4 argops[4+MAX_LOOKUP_COMPONENTS*3];
-    nfs_resop4 resops[4+MAX_LOOKUP_COMPONENTS*3];
+    nfs_argop4 argops[5+MAX_LOOKUP_COMPONENTS*3];
+    nfs_resop4 resops[5+MAX_LOOKUP_COMPONENTS*3];
 
     compound_init(&compound, session->client->root->nfsminorvers,
         argops, resops, "lookup");
@@ -168,6 +294,15 @@ static int lookup_rpc(
             &res->getattr[i]);
     }
 
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+    if (args->bootstrap) {
+        /* must be last, it changes the current file handle */
+        compound_add_op(&compound, OP_OPENATTR,
+            &args->openattr, &res->openattr);
+        args->openattr.createdir = 0;
+    }
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+
     status = compound_encode_send_decode(session, &compound, TRUE);
     if (status)
         goto out;
@@ -208,6 +343,9 @@ static int server_lookup(
     if (parent_out) *parent_out = NULL;
     if (target_out) *target_out = NULL;
 
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+    lookup_bootstrap_prepare(session, dir, count, args, res);
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
     lookup_rpc(session, dir, count, args, res);
 
     status = res->sequence.sr_status;       if (status) goto out;
@@ -220,6 +358,11 @@ static int server_lookup(
 
         /* fill in the file handle's fileid and superblock */
         dir->fh.fileid = res->getrootattr.info->fileid;
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+        if (args->bootstrap)
+            status = lookup_bootstrap_root(session, dir, count, res);
+        else
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
         status = nfs41_superblock_for_fh(session,
             &res->getrootattr.info->fsid, NULL, dir);
         if (status)
@@ -231,6 +374,11 @@ static int server_lookup(
         /* add the file handle and attributes to the name cache */
         bitmap4_cpy(&res->getrootattr.info->attrmask,
             &res->getrootattr.obj_attributes.attrmask);
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+        /* the superblock attributes point into |res| */
+        bitmap_intersect(&res->getrootattr.info->attrmask,
+            &args->attr_request);
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
         nfs41_name_cache_insert(session_name_cache(session),
             BIT2BOOL(dir->fh.superblock->case_insensitive),
             path, &name,
@@ -277,6 +425,14 @@ static int server_lookup(
 
         /* fill in the file handle's fileid and superblock */
         file->fh.fileid = res->getattr[i].info->fileid;
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+        if (args->bootstrap && (i == count-1))
+            status = nfs41_superblock_for_fh_prefetched(session,
+                &res->getattr[i].info->fsid, &parent->fh,
+                res->getattr[i].info, lookup_bootstrap_named_attrs(res),
+                file);
+        else
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
         status = nfs41_superblock_for_fh(session,
             &res->getattr[i].info->fsid, &parent->fh, file);
         if (status)
@@ -285,6 +441,10 @@ static int server_lookup(
         /* add the file handle and attributes to the name cache */
         bitmap4_cpy(&res->getattr[i].info->attrmask,
             &res->getattr[i].obj_attributes.attrmask);
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+        bitmap_intersect(&res->getattr[i].info->attrmask,
+            &args->attr_request);
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
         nfs41_name_cache_insert(session_name_cache(session),
             BIT2BOOL(parent->fh.superblock->case_insensitive),
             path, args->lookup[i].name, &res->file[i].fh,
@@ -349,26 +509,34 @@ static int server_lookup_loop(
     OUT OPTIONAL nfs41_path_fh *target_out,
     OUT OPTIONAL nfs41_file_info *info_out)
 {
-    nfs41_lookup_component_args args = { 0 };
-    nfs41_lookup_component_res res = { 0 };
+    nfs41_lookup_component_args *args;
+    nfs41_lookup_component_res *res;
     nfs41_path_fh *dir, *parent, *target;
     const char *path_end;
     const uint32_t max_components = max_lookup_components(session);
     uint32_t count;
     int status = NO_ERROR;
 
-    init_component_args(&args, &res, path, referral);
+    /* Far too big for the stack (>1MB), see |NFSD_THREAD_STACK_SIZE| */
+    args = nfsd_arena_calloc(sizeof(nfs41_lookup_component_args));
+    res = nfsd_arena_calloc(sizeof(nfs41_lookup_component_res));
+    if ((args == NULL) || (res == NULL)) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto out;
+    }
+
+    init_component_args(args, res, path, referral);
     parent = NULL;
     target = NULL;
 
     path_end = path->path + path->len;
-    dir = parent_in ? parent_in : &res.root;
+    dir = parent_in ? parent_in : &res->root;
 
     while (get_component_array(&path_pos, path_end,
-        max_components, res.file, &count)) {
+        max_components, res->file, &count)) {
 
         status = server_lookup(session, dir, path->path, path_end, count,
-            &args, &res, &parent, &target, info_out);
+            args, res, &parent, &target, info_out);
 
         if (status == ERROR_REPARSE) {
             /* copy the component name of the symlink */
@@ -387,10 +555,10 @@ static int server_lookup_loop(
         dir = target;
     }
 
-    if (dir == &res.root && (target_out || info_out)) {
+    if (dir == &res->root && (target_out || info_out)) {
         /* didn't get any components, so we just need the root */
         status = server_lookup(session, dir, path->path, path_end,
-            0, &args, &res, &parent, &target, info_out);
+            0, args, res, &parent, &target, info_out);
         if (status)
             goto out;
     }
@@ -399,6 +567,9 @@ static int server_lookup_loop(
 out_parent:
     if (parent_out && parent) fh_copy(&parent_out->fh, &parent->fh);
 out:
+    /* in reverse order, so both go back to the arena */
+    nfsd_arena_free(res);
+    nfsd_arena_free(args);
     return status;
 }
 
@@ -426,6 +597,13 @@ static int referral_resolve(
     const fs_location4 *location;
     nfs41_client *client;
     int status;
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+    uint32_t preferred = REFERRAL_LOCATION_NONE;
+
+    if (nfs41_root_referral_cache_get(root, &referral->parent.fh,
+        &referral->name, &locations, &preferred))
+        goto mount;
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
 
     /* get fs_locations */
     status = nfs41_fs_locations(session_in, &referral->parent,
@@ -437,6 +615,19 @@ static int referral_resolve(
         goto out;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+mount:
+    /* mount the closest location available */
+    status = nfs41_root_mount_referral(root, &locations, &preferred,
+        &location, &client);
+    if (status) {
+        eprintf("nfs41_root_mount_referral() failed with %d\n",
+            status);
+        goto out;
+    }
+    nfs41_root_referral_cache_put(root, &referral->parent.fh,
+        &referral->name, &locations, preferred);
+#else
     /* mount the first location available */
     status = nfs41_root_mount_referral(root, &locations, &location, &client);
     if (status) {
@@ -444,6 +635,7 @@ static int referral_resolve(
             status);
         goto out;
     }
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
 
     /* format a new path from that location's root */
     if (FAILED(StringCchCopyA(rest_of_path, NFS41_MAX_PATH_LEN,
@@ -480,7 +672,13 @@ int nfs41_lookup(
     nfs41_path_fh parent = { 0 }, target = { 0 }, *server_start;
     const char *path_pos, *path_end;
     struct lookup_referral referral = { 0 };
-    bool negative = false;
+    nfsd_inflight inflight;
+    nfs41_component name, missing;
+    bool negative = false, inflight_checked = false;
+    bool inflight_owner = false;
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    bool snapshot_checked = false;
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
     int status;
 
     if (session_out) *session_out = session;
@@ -500,6 +698,8 @@ int nfs41_lookup(
 
     if (parent_out == NULL) parent_out = &parent;
     if (target_out == NULL) target_out = &target;
+retry_cache:
+    path_pos = path.path;
     parent_out->fh.len = target_out->fh.len = 0;
 
     status = nfs41_name_cache_lookup(cache, casesensitive, path_pos, path_end, &path_pos,
@@ -507,6 +707,38 @@ int nfs41_lookup(
     if (status == NO_ERROR || negative)
         goto out;
 
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    /* "immutable" mounts may find the missing entries in their snapshot */
+    if (!snapshot_checked) {
+        snapshot_checked = true;
+        if (nfs41_ncsnap_lookup(root, cache, casesensitive,
+            path.path, path_end, path_pos))
+            goto retry_cache;
+    }
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
+
+    /*
+     * If the parent directory is not in the name cache either, share
+     * the server lookup of the parent with concurrent lookups of its
+     * other entries (e.g. a build opening files in a deep source tree
+     * with a cold name cache). Waiters retry the name cache, which
+     * leaves only the last component for the server.
+     */
+    if (!inflight_checked) {
+        inflight_checked = true;
+        last_component(path.path, path_end, &name);
+        if (next_component(path_pos, name.name, &missing) == FALSE) {
+            /* only the last component is missing */
+        } else if (nfsd_inflight_begin(NFSD_INFLIGHT_LOOKUP, session,
+            path.path, (size_t)(name.name - path.path), &inflight)) {
+            DPRINTF(LULVL, ("nfs41_lookup('%s'): waited for lookup of "
+                "parent, retrying name cache\n", path.path));
+            goto retry_cache;
+        } else {
+            inflight_owner = true;
+        }
+    }
+
     if (parent_out->fh.len) {
         /* start where the name cache left off */
         if (&parent != parent_out) {
@@ -523,6 +755,24 @@ int nfs41_lookup(
     status = server_lookup_loop(session, server_start,
         &path, path_pos, &referral, parent_out, target_out, info_out);
 
+    if (inflight_owner)
+        nfsd_inflight_end(&inflight);
+
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+    /* directories with many name cache misses are worth a delegation */
+    if (((status == NO_ERROR) || (status == ERROR_FILE_NOT_FOUND)) &&
+        parent_out->fh.len && parent_out->fh.superblock) {
+        nfs41_path_fh dir;
+
+        last_component(path.path, path_end, &name);
+        path_fh_init(&dir, &path);
+        last_component(path.path, name.name, &dir.name);
+        fh_copy(&dir.fh, &parent_out->fh);
+        if (dir.name.len)
+            nfs41_dir_delegation_hint(session, &dir, FALSE);
+    }
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+
     if (status == ERROR_FILESYSTEM_ABSENT) {
         nfs41_session *new_session;
 
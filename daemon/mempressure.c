@@ -0,0 +1,215 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+/*
+ * mempressure.c - adapt the daemon caches to the system memory state
+ *
+ * A monitor thread polls the |LowMemoryResourceNotification| and
+ * |HighMemoryResourceNotification| objects of the memory manager and
+ * publishes the result in |nfs41_mempressure|. The caches with a
+ * heap-allocated bound (SID cache, idmap cache, readahead pool,
+ * delegations) scale their limits with |nfs41_mempressure_limit()|,
+ * so they shrink on a busy VDI host and grow past their defaults on
+ * a machine with plenty of free memory.
+ *
+ * While memory is low |mempressure_trim()| runs once per
+ * |MEMPRESSURE_POLL_INTERVAL| and drops the least recently used
+ * entries above the reduced limits, and starts returning the coldest
+ * delegations of all mounts with
+ * |nfs41_client_delegation_return_lru()|. Releasing a delegation also
+ * releases the name and attribute cache entries pinned by it.
+ */
+
+#include <Windows.h>
+#include <process.h>
+
+#include "nfs41_build_features.h"
+#include "mempressure.h"
+#include "nfs41_daemon.h"
+#include "delegation.h"
+#include "idmap.h"
+#include "sid.h"
+#include "daemon_debug.h"
+#include "util.h"
+
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+
+#define MEMPRESSURE_POLL_INTERVAL   5000 /* in milliseconds */
+/* max. number of mounts trimmed per pass */
+#define MEMPRESSURE_MAX_ROOTS       64
+
+volatile LONG nfs41_mempressure = NFS41_MEMPRESSURE_NORMAL;
+
+static struct {
+    HANDLE low;
+    HANDLE high;
+    HANDLE stop_event;
+    HANDLE thread;
+} mempressure = {
+    .low = NULL,
+    .high = NULL,
+    .stop_event = NULL,
+    .thread = NULL
+};
+
+static const char *mempressure_state_string(
+    IN LONG state)
+{
+    switch (state) {
+        case NFS41_MEMPRESSURE_LOW:     return "low";
+        case NFS41_MEMPRESSURE_PLENTY:  return "plenty";
+        default:                        return "normal";
+    }
+}
+
+static LONG mempressure_query(void)
+{
+    BOOL low = FALSE, high = FALSE;
+
+    if (QueryMemoryResourceNotification(mempressure.low, &low) && low)
+        return NFS41_MEMPRESSURE_LOW;
+    if (QueryMemoryResourceNotification(mempressure.high, &high) && high)
+        return NFS41_MEMPRESSURE_PLENTY;
+    return NFS41_MEMPRESSURE_NORMAL;
+}
+
+/* Shrink all caches to the limits for |NFS41_MEMPRESSURE_LOW| */
+static void mempressure_trim(void)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    nfs41_root *roots[MEMPRESSURE_MAX_ROOTS];
+    struct list_entry *entry;
+    uint32_t i, num_roots;
+
+#ifdef NFS41_DRIVER_SID_CACHE
+    sidcache_trim();
+#endif /* NFS41_DRIVER_SID_CACHE */
+    if (nfs41_dg.idmapper)
+        nfs41_idmap_trim(nfs41_dg.idmapper);
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+    nfs41_readdir_cache_trim();
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+
+    num_roots = nfsd_mount_stats_ref_roots(roots, MEMPRESSURE_MAX_ROOTS);
+    for (i = 0; i < num_roots; i++) {
+        EnterCriticalSection(&roots[i]->lock);
+        list_for_each(entry, &roots[i]->clients) {
+            nfs41_client_delegation_trim(
+                list_container(entry, nfs41_client, root_entry));
+        }
+        LeaveCriticalSection(&roots[i]->lock);
+        nfs41_root_deref(roots[i]);
+    }
+}
+
+static unsigned int WINAPI mempressure_thread(void *args)
+{
+    HANDLE handles[2] = { mempressure.stop_event, mempressure.low };
+    LONG state, prev;
+    DWORD wait;
+
+    (void)args;
+    for (;;) {
+        /*
+         * The notification objects stay signalled as long as the
+         * condition holds, so only wait for |low| while it is not
+         */
+        wait = WaitForMultipleObjects(
+            nfs41_mempressure_low()? 1 : 2, handles, FALSE,
+            MEMPRESSURE_POLL_INTERVAL);
+        if (wait == WAIT_OBJECT_0)
+            break;
+
+        state = mempressure_query();
+        prev = InterlockedExchange(&nfs41_mempressure, state);
+        if (prev != state) {
+            DPRINTF(0, ("mempressure_thread: memory state '%s' -> '%s'\n",
+                mempressure_state_string(prev),
+                mempressure_state_string(state)));
+        }
+        if (state == NFS41_MEMPRESSURE_LOW)
+            mempressure_trim();
+    }
+    return 0;
+}
+
+int nfs41_mempressure_start(void)
+{
+    int status = NO_ERROR;
+
+    mempressure.low =
+        CreateMemoryResourceNotification(LowMemoryResourceNotification);
+    mempressure.high =
+        CreateMemoryResourceNotification(HighMemoryResourceNotification);
+    mempressure.stop_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if ((mempressure.low == NULL) || (mempressure.high == NULL) ||
+        (mempressure.stop_event == NULL)) {
+        status = GetLastError();
+        eprintf("nfs41_mempressure_start: "
+            "CreateMemoryResourceNotification() failed, lasterr=%d\n",
+            status);
+        goto out_close;
+    }
+
+    (void)InterlockedExchange(&nfs41_mempressure, mempressure_query());
+
+    mempressure.thread = (HANDLE)_beginthreadex(NULL,
+        NFSD_THREAD_STACK_SIZE, mempressure_thread, NULL, 0, NULL);
+    if (mempressure.thread == NULL) {
+        status = GetLastError();
+        eprintf("nfs41_mempressure_start: _beginthreadex() failed "
+            "with %d\n", status);
+        goto out_close;
+    }
+
+    DPRINTF(1, ("nfs41_mempressure_start: memory state '%s'\n",
+        mempressure_state_string(nfs41_mempressure)));
+out:
+    return status;
+out_close:
+    nfs41_mempressure_stop();
+    goto out;
+}
+
+void nfs41_mempressure_stop(void)
+{
+    if (mempressure.thread) {
+        (void)SetEvent(mempressure.stop_event);
+        (void)WaitForSingleObject(mempressure.thread, INFINITE);
+        (void)CloseHandle(mempressure.thread);
+        mempressure.thread = NULL;
+    }
+    if (mempressure.stop_event) {
+        (void)CloseHandle(mempressure.stop_event);
+        mempressure.stop_event = NULL;
+    }
+    if (mempressure.high) {
+        (void)CloseHandle(mempressure.high);
+        mempressure.high = NULL;
+    }
+    if (mempressure.low) {
+        (void)CloseHandle(mempressure.low);
+        mempressure.low = NULL;
+    }
+    (void)InterlockedExchange(&nfs41_mempressure, NFS41_MEMPRESSURE_NORMAL);
+}
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
@@ -0,0 +1,78 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+#ifndef __NFS41_DAEMON_MEMPRESSURE_H__
+#define __NFS41_DAEMON_MEMPRESSURE_H__ 1
+
+#include <Windows.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "nfs41_build_features.h"
+
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+/*
+ * System memory state, see mempressure.c
+ */
+enum nfs41_mempressure_state {
+    NFS41_MEMPRESSURE_NORMAL = 0,
+    NFS41_MEMPRESSURE_LOW, /* |LowMemoryResourceNotification| */
+    NFS41_MEMPRESSURE_PLENTY /* |HighMemoryResourceNotification| */
+};
+
+/* cache limits are divided by this while memory is low ... */
+#define NFS41_MEMPRESSURE_SHRINK_FACTOR 4
+/* ... and multiplied with this while memory is plentiful */
+#define NFS41_MEMPRESSURE_GROW_FACTOR 4
+
+extern volatile LONG nfs41_mempressure;
+
+static __inline bool nfs41_mempressure_low(void)
+{
+    return nfs41_mempressure == NFS41_MEMPRESSURE_LOW;
+}
+
+/*
+ * Scale the cache limit |limit| by the current memory state, but
+ * never below |min_limit|
+ */
+static __inline uint64_t nfs41_mempressure_limit(
+    uint64_t limit,
+    uint64_t min_limit)
+{
+    switch (nfs41_mempressure) {
+        case NFS41_MEMPRESSURE_LOW:
+            limit /= NFS41_MEMPRESSURE_SHRINK_FACTOR;
+            break;
+        case NFS41_MEMPRESSURE_PLENTY:
+            limit *= NFS41_MEMPRESSURE_GROW_FACTOR;
+            break;
+        default:
+            break;
+    }
+    return (limit < min_limit)? min_limit : limit;
+}
+
+int nfs41_mempressure_start(void);
+void nfs41_mempressure_stop(void);
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+
+#endif /* !__NFS41_DAEMON_MEMPRESSURE_H__ */
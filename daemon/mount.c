@@ -28,6 +28,9 @@
 #include "nfs41_build_features.h"
 #include "daemon_debug.h"
 #include "nfs41_ops.h"
+#include "name_cache.h"
+#include "delegation.h"
+#include "ncsnap.h"
 #include "upcall.h"
 #include "util.h"
 #ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
@@ -58,6 +61,38 @@ static int parse_mount(
     if (status) goto out;
     status = safe_read(&buffer, &length, &args->nfsvers, sizeof(DWORD));
     if (status) goto out;
+    status = safe_read(&buffer, &length, &args->nconnect, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->acregmin, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->acregmax, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->acdirmin, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->acdirmax, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->namecachesize, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->closetimeo, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->sparsewrite, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->sockbuf, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->keepalive, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->sockflags, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->fsc, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->maxbw, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->maxiops, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->autotune, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->immutable, sizeof(DWORD));
+    if (status) goto out;
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
     status = safe_read(&buffer, &length, &args->force_case_preserving,
         sizeof(tristate_bool));
@@ -72,19 +107,38 @@ static int parse_mount(
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
     DPRINTF(1, ("parsing NFS41_SYSOP_MOUNT: hostport='%s' root='%s' "
         "sec_flavor='%s' rsize=%d wsize=%d use_nfspubfh=%d "
-        "nfsvers=%d force_case_preserving=%d force_case_insensitive=%d\n",
+        "nfsvers=%d nconnect=%d "
+        "acregmin=%d acregmax=%d acdirmin=%d acdirmax=%d "
+        "namecachesize=%d closetimeo=%d sparsewrite=%d "
+        "sockbuf=%d keepalive=%d sockflags=0x%x fsc=%d "
+        "maxbw=%d maxiops=%d autotune=%d immutable=%d "
+        "force_case_preserving=%d force_case_insensitive=%d\n",
         args->hostport, args->path, secflavorop2name(args->sec_flavor),
         args->rsize, args->wsize, args->use_nfspubfh,
-        args->nfsvers,
+        args->nfsvers, args->nconnect,
+        args->acregmin, args->acregmax, args->acdirmin, args->acdirmax,
+        args->namecachesize, args->closetimeo, args->sparsewrite,
+        (int)args->sockbuf, (int)args->keepalive, (int)args->sockflags,
+        (int)args->fsc, (int)args->maxbw, (int)args->maxiops,
+        (int)args->autotune, (int)args->immutable,
         (int)args->force_case_preserving,
         (int)args->force_case_insensitive));
 #else
     DPRINTF(1, ("parsing NFS41_SYSOP_MOUNT: hostport='%s' root='%s' "
         "sec_flavor='%s' rsize=%d wsize=%d use_nfspubfh=%d "
-        "nfsvers=%d\n",
+        "nfsvers=%d nconnect=%d "
+        "acregmin=%d acregmax=%d acdirmin=%d acdirmax=%d "
+        "namecachesize=%d closetimeo=%d sparsewrite=%d "
+        "sockbuf=%d keepalive=%d sockflags=0x%x fsc=%d "
+        "maxbw=%d maxiops=%d autotune=%d immutable=%d\n",
         args->hostport, args->path, secflavorop2name(args->sec_flavor),
         args->rsize, args->wsize, args->use_nfspubfh,
-        args->nfsvers));
+        args->nfsvers, args->nconnect,
+        args->acregmin, args->acregmax, args->acdirmin, args->acdirmax,
+        args->namecachesize, args->closetimeo, args->sparsewrite,
+        (int)args->sockbuf, (int)args->keepalive, (int)args->sockflags,
+        (int)args->fsc, (int)args->maxbw, (int)args->maxiops,
+        (int)args->autotune, (int)args->immutable));
 #endif /* NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS */
 
     return status;
@@ -233,6 +287,35 @@ static int handle_mount(void *daemon_context, nfs41_upcall *upcall)
         }
         root->uid = upcall->uid;
         root->gid = upcall->gid;
+        root->nconnect = min(max(args->nconnect, 1), NFS41_MAX_NCONNECT);
+        if (args->immutable) {
+            /* entries stay until "nfsclientdctl flush" drops them */
+            nfs41_name_cache_config_init(&root->name_cache_config,
+                NAME_CACHE_IMMUTABLE_TTL, NAME_CACHE_IMMUTABLE_TTL,
+                NAME_CACHE_IMMUTABLE_TTL, NAME_CACHE_IMMUTABLE_TTL,
+                args->namecachesize);
+        } else {
+            nfs41_name_cache_config_init(&root->name_cache_config,
+                args->acregmin, args->acregmax,
+                args->acdirmin, args->acdirmax,
+                args->namecachesize);
+        }
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+        root->close_timeout = args->closetimeo;
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+        root->sparse_write = (args->sparsewrite != 0);
+        root->sockopts.sockbuf = args->sockbuf;
+        root->sockopts.keepalive = args->keepalive;
+        root->sockopts.flags = args->sockflags;
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+        root->fsc = (args->fsc != 0);
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+#ifdef NFS41_DRIVER_DAEMON_QOS
+        nfs41_qos_init(&root->qos, args->maxbw, args->maxiops);
+#endif /* NFS41_DRIVER_DAEMON_QOS */
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+        nfs41_autotune_init(&root->autotune, (args->autotune != 0));
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
     }
 
     // find or create the client/session
@@ -242,6 +325,12 @@ static int handle_mount(void *daemon_context, nfs41_upcall *upcall)
         goto out_err;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+    /* probe the link, not fatal */
+    if (root->autotune.enabled)
+        nfs41_autotune_mount(root, client);
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
+
     // make a copy of the path for nfs41_lookup()
     InitializeSRWLock(&path.lock);
     if (FAILED(StringCchCopyA(path.path, NFS41_MAX_PATH_LEN, args->path))) {
@@ -266,8 +355,17 @@ static int handle_mount(void *daemon_context, nfs41_upcall *upcall)
 
     nfs41_superblock_fs_attributes(file.fh.superblock, &args->FsAttrs);
 
-    if (upcall->root_ref == INVALID_HANDLE_VALUE)
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    /* only "immutable" promises that the export did not change */
+    if (args->immutable)
+        nfs41_ncsnap_mount(root, client->session, args->hostport,
+            &path, &file);
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
+
+    if (upcall->root_ref == INVALID_HANDLE_VALUE) {
         nfs41_root_ref(root);
+        nfsd_mount_stats_add(root, args->hostport, args->path);
+    }
     upcall->root_ref = root;
     args->lease_time = client->session->lease_time;
 out:
@@ -376,6 +474,18 @@ static int parse_unmount(const unsigned char *restrict buffer,
 
 static int handle_unmount(void *daemon_context, nfs41_upcall *upcall)
 {
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+    /* parked opens reference the root's sessions */
+    nfs41_deferred_close_flush_root(upcall->root_ref);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    nfs41_delegation_write_behind_flush_root(upcall->root_ref);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    /* save what this mount has looked up for the next one */
+    nfs41_ncsnap_unmount(upcall->root_ref);
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
+
     /* release the original reference from nfs41_root_create() */
     nfs41_root_deref(upcall->root_ref);
 
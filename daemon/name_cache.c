@@ -41,10 +41,17 @@ enum {
 };
 
 
-#define NAME_CACHE_EXPIRATION 30 /* TODO: get from configuration */
-
-/* allow up to 32M of memory for name and attribute cache entries */
-#define NAME_CACHE_MAX_SIZE (32*1024*1024L)
+/*
+ * Attribute cache timeouts
+ *
+ * Each attribute entry has its own timeout, between the |acregmin| and
+ * |acregmax| (|acdirmin| and |acdirmax| for directories) mount options.
+ * The timeout starts at the minimum and is doubled every time the entry
+ * is revalidated after it expired with an unchanged change attribute,
+ * so files which never change are revalidated less often. A different
+ * change attribute resets the timeout to the minimum.
+ * Name entries expire after |acdirmin| seconds.
+ */
 
 /* negative lookup caching
  *
@@ -52,13 +59,23 @@ enum {
  * lookups over the wire.  a name cache entry is negative when its attributes
  * pointer is NULL.  negative entries are created by three functions:
  * nfs41_name_cache_remove(), _insert() when called with NULL for the fh and
- * attributes, and _rename() for the source entry */
+ * attributes, and _rename() for the source entry
+ *
+ * with |NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE|, a negative entry also
+ * records the change attribute of its parent directory when it is
+ * created. as long as the cached attributes of the directory are valid
+ * (which they are for as long as we hold a directory delegation), the
+ * negative entry stays valid while the change attribute is the same,
+ * even after the entry's own timer expired. a different change attribute
+ * makes it invisible right away. compilers probing include paths benefit
+ * most from this, since every include directory sees the same misses
+ * over and over again */
 
 /* delegations and cache feedback
  *
  *   delegations provide a guarantee that no links or attributes will change
  * without notice.  the name cache takes advantage of this by preventing
- * delegated entries from being removed on NAME_CACHE_EXPIRATION, though
+ * delegated entries from being removed on expiration, though
  * they're still removed when a parent is invalidated.  the attribute cache
  * holds an extra reference on delegated entries to prevent their removal
  * entirely, until the delegation is returned.
@@ -95,6 +112,117 @@ static __inline bool is_delegation(
 #define NC_ATTR_TIME_MODIFY     (1 << 15)
 #define NC_ATTR_CLONE_BLKSIZE   (1 << 16)
 
+/*
+ * Interned owner strings
+ *
+ * Almost all files of a server share a handful of owner and
+ * owner_group strings, so instead of storing them inline in each
+ * |attr_cache_entry| (2*|NFS4_FATTR4_OWNER_LIMIT| bytes) the entries
+ * reference a refcounted copy in |attr_owners|. References are taken
+ * and dropped with the shard lock of the entry held, |attr_owners.lock|
+ * is always taken last.
+ */
+#define ATTR_OWNER_BUCKETS 64 /* must be a power of 2 */
+
+struct attr_owner {
+    struct attr_owner       *next;
+    uint32_t                hash;
+    uint32_t                ref_count;
+    unsigned short          len;
+    char                    name[1];
+};
+
+static struct {
+    SRWLOCK                 lock;
+    struct attr_owner       *buckets[ATTR_OWNER_BUCKETS];
+} attr_owners = { .lock = SRWLOCK_INIT };
+
+static uint32_t attr_owner_hash(
+    IN const char *name,
+    IN size_t len)
+{
+    uint32_t hash = 2166136261U; /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* returns a new reference to the interned copy of |name| */
+static struct attr_owner *attr_owner_get(
+    IN const char *name)
+{
+    const size_t len = strlen(name);
+    const uint32_t hash = attr_owner_hash(name, len);
+    struct attr_owner **bucket, *owner;
+
+    AcquireSRWLockExclusive(&attr_owners.lock);
+    bucket = &attr_owners.buckets[hash & (ATTR_OWNER_BUCKETS - 1)];
+    for (owner = *bucket; owner; owner = owner->next) {
+        if ((owner->hash == hash) && (owner->len == len) &&
+            (memcmp(owner->name, name, len) == 0)) {
+            owner->ref_count++;
+            goto out;
+        }
+    }
+
+    owner = malloc(sizeof(struct attr_owner) + len);
+    if (owner == NULL)
+        goto out;
+    owner->hash = hash;
+    owner->ref_count = 1;
+    owner->len = (unsigned short)len;
+    (void)memcpy(owner->name, name, len + 1);
+    owner->next = *bucket;
+    *bucket = owner;
+out:
+    ReleaseSRWLockExclusive(&attr_owners.lock);
+    return owner;
+}
+
+static void attr_owner_put(
+    IN struct attr_owner *owner)
+{
+    struct attr_owner **pos;
+
+    if (owner == NULL)
+        return;
+
+    AcquireSRWLockExclusive(&attr_owners.lock);
+    if (--owner->ref_count == 0) {
+        for (pos = &attr_owners.buckets[
+            owner->hash & (ATTR_OWNER_BUCKETS - 1)];
+            *pos; pos = &(*pos)->next) {
+            if (*pos == owner) {
+                *pos = owner->next;
+                break;
+            }
+        }
+        free(owner);
+    }
+    ReleaseSRWLockExclusive(&attr_owners.lock);
+}
+
+/* replace the owner reference in |*slot| with |name| */
+static bool attr_owner_set(
+    IN OUT struct attr_owner **slot,
+    IN const char *name)
+{
+    struct attr_owner *owner;
+
+    /* files rarely change their owner, avoid the table lock */
+    if (*slot && (strcmp((*slot)->name, name) == 0))
+        return true;
+
+    owner = attr_owner_get(name);
+    attr_owner_put(*slot);
+    *slot = owner;
+    return owner != NULL;
+}
+
 /* attribute cache */
 struct attr_cache_entry {
     RB_ENTRY(attr_cache_entry) rbnode;
@@ -123,20 +251,61 @@ struct attr_cache_entry {
     unsigned                invalidated : 1;
     unsigned                delegated : 1;
     uint32_t                clone_blksize;
+    uint32_t                ttl; /* current timeout, in seconds */
     util_reltimestamp       expiration;
-    char                    owner[NFS4_FATTR4_OWNER_LIMIT+1];
-    char                    owner_group[NFS4_FATTR4_OWNER_LIMIT+1];
+    struct attr_owner       *owner;
+    struct attr_owner       *owner_group;
+    /* name entry which last updated this entry, see "Fileid index" */
+    struct name_cache_entry *name_entry;
 };
 #define ATTR_ENTRY_SIZE sizeof(struct attr_cache_entry)
 
 RB_HEAD(attr_tree, attr_cache_entry);
 
-struct attr_cache {
+/*
+ * The attribute cache is split into |ATTR_CACHE_SHARDS| shards by
+ * fileid, each with its own tree, free entries and lock, so that
+ * |nfs41_attr_cache_lookup()| and |nfs41_attr_cache_update()| from
+ * different worker threads do not contend on a single lock.
+ * Code holding the name cache lock must still take the shard lock to
+ * access an attribute entry (lock order: name cache |lock|, directory
+ * shard lock, attribute shard lock, |lru_lock|).
+ */
+#define ATTR_CACHE_SHARDS 16
+
+struct attr_cache_shard {
     struct attr_tree        head;
+    struct list_entry       free_entries;
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING
+    volatile LONG           in_use; /* entries in |head| */
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING */
+    SRWLOCK                 lock;
+    volatile LONG64         hits;
+    volatile LONG64         misses;
+};
+
+struct attr_cache {
     struct attr_cache_entry *pool;
-    struct list_entry       free_entries;
+    uint32_t                pool_size;
+    struct attr_cache_shard shards[ATTR_CACHE_SHARDS];
+    /* timeout bounds in seconds, see "Attribute cache timeouts" */
+    uint32_t                regmin;
+    uint32_t                regmax;
+    uint32_t                dirmin;
+    uint32_t                dirmax;
 };
 
+/* fileids are often sequential, so mix the bits before picking a shard */
+#define NC_SHARD_HASH(key) \
+    ((uint32_t)(((uint64_t)(key) * 0x9E3779B97F4A7C15ULL) >> 32))
+
+static __inline struct attr_cache_shard *attr_cache_shard(
+    IN struct attr_cache *cache,
+    IN uint64_t fileid)
+{
+    return &cache->shards[NC_SHARD_HASH(fileid) % ATTR_CACHE_SHARDS];
+}
+
 static int attr_cmp(struct attr_cache_entry *lhs, struct attr_cache_entry *rhs)
 {
     return lhs->fileid < rhs->fileid ? -1 : lhs->fileid > rhs->fileid;
@@ -147,8 +316,9 @@ RB_GENERATE(attr_tree, attr_cache_entry, rbnode, attr_cmp)
 /* attr_cache_entry */
 #define attr_entry(pos) list_container(pos, struct attr_cache_entry, free_entry)
 
+/* these functions expect the caller to hold the shard lock */
 static int attr_cache_entry_create(
-    IN struct attr_cache *cache,
+    IN struct attr_cache_shard *shard,
     IN uint64_t fileid,
     OUT struct attr_cache_entry **entry_out)
 {
@@ -156,12 +326,15 @@ static int attr_cache_entry_create(
     int status = NO_ERROR;
 
     /* get the next entry from free_entries and remove it */
-    if (list_empty(&cache->free_entries)) {
+    if (list_empty(&shard->free_entries)) {
         status = ERROR_OUTOFMEMORY;
         goto out;
     }
-    entry = attr_entry(cache->free_entries.next);
+    entry = attr_entry(shard->free_entries.next);
     list_remove(&entry->free_entry);
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING
+    shard->in_use++;
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING */
 
     entry->nc_attrs = 0;
     entry->change = 0ULL;
@@ -172,23 +345,31 @@ static int attr_cache_entry_create(
     entry->fsid_minor = 0ULL;
     entry->invalidated = FALSE;
     entry->delegated = FALSE;
+    entry->ttl = 0;
+    entry->name_entry = NULL;
     *entry_out = entry;
 out:
     return status;
 }
 
 static __inline void attr_cache_entry_free(
-    IN struct attr_cache *cache,
+    IN struct attr_cache_shard *shard,
     IN struct attr_cache_entry *entry)
 {
     DPRINTF(NCLVL1, ("attr_cache_entry_free(%llu)\n", entry->fileid));
-    RB_REMOVE(attr_tree, &cache->head, entry);
+    RB_REMOVE(attr_tree, &shard->head, entry);
+    attr_owner_put(entry->owner);
+    attr_owner_put(entry->owner_group);
+    entry->owner = entry->owner_group = NULL;
     /* add it back to free_entries */
-    list_add_tail(&cache->free_entries, &entry->free_entry);
+    list_add_tail(&shard->free_entries, &entry->free_entry);
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING
+    shard->in_use--;
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING */
 }
 
 static __inline void attr_cache_entry_ref(
-    IN struct attr_cache *cache,
+    IN struct attr_cache_shard *shard,
     IN struct attr_cache_entry *entry)
 {
     const uint32_t previous = entry->ref_count++;
@@ -197,7 +378,7 @@ static __inline void attr_cache_entry_ref(
 }
 
 static __inline void attr_cache_entry_deref(
-    IN struct attr_cache *cache,
+    IN struct attr_cache_shard *shard,
     IN struct attr_cache_entry *entry)
 {
     const uint32_t previous = entry->ref_count--;
@@ -205,7 +386,7 @@ static __inline void attr_cache_entry_deref(
         entry->fileid, previous, entry->ref_count));
 
     if (entry->ref_count == 0)
-        attr_cache_entry_free(cache, entry);
+        attr_cache_entry_free(shard, entry);
 }
 
 static __inline int attr_cache_entry_expired(
@@ -215,11 +396,20 @@ static __inline int attr_cache_entry_expired(
         ((!entry->delegated) && (UTIL_GETRELTIME() > entry->expiration));
 }
 
+/* shard of an entry which is already in the cache */
+static __inline struct attr_cache_shard *attr_entry_shard(
+    IN struct attr_cache *cache,
+    IN const struct attr_cache_entry *entry)
+{
+    return attr_cache_shard(cache, entry->fileid);
+}
+
 /* attr_cache */
 static int attr_cache_init(
     IN struct attr_cache *cache,
     IN uint32_t max_entries)
 {
+    struct attr_cache_shard *shard;
     uint32_t i;
     int status = NO_ERROR;
 
@@ -229,12 +419,24 @@ static int attr_cache_init(
         status = GetLastError();
         goto out;
     }
+    cache->pool_size = max_entries;
+
+    for (i = 0; i < ATTR_CACHE_SHARDS; i++) {
+        shard = &cache->shards[i];
+        RB_INIT(&shard->head);
+        list_init(&shard->free_entries);
+        InitializeSRWLock(&shard->lock);
+        shard->hits = shard->misses = 0;
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING
+        shard->in_use = 0;
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING */
+    }
 
-    /* initialize the list of free entries */
-    list_init(&cache->free_entries);
+    /* spread the free entries over all shards */
     for (i = 0; i < max_entries; i++) {
+        shard = &cache->shards[i % ATTR_CACHE_SHARDS];
         list_init(&cache->pool[i].free_entry);
-        list_add_tail(&cache->free_entries, &cache->pool[i].free_entry);
+        list_add_tail(&shard->free_entries, &cache->pool[i].free_entry);
     }
 out:
     return status;
@@ -243,80 +445,151 @@ out:
 static void attr_cache_free(
     IN struct attr_cache *cache)
 {
+    uint32_t i;
+
+    /* drop the owner references of the entries still in use */
+    for (i = 0; i < cache->pool_size; i++) {
+        attr_owner_put(cache->pool[i].owner);
+        attr_owner_put(cache->pool[i].owner_group);
+    }
+
     /* free the pool */
     free(cache->pool);
     cache->pool = NULL;
-    list_init(&cache->free_entries);
+    cache->pool_size = 0;
+    for (i = 0; i < ATTR_CACHE_SHARDS; i++)
+        list_init(&cache->shards[i].free_entries);
 }
 
 static struct attr_cache_entry* attr_cache_search(
-    IN struct attr_cache *cache,
+    IN struct attr_cache_shard *shard,
     IN uint64_t fileid)
 {
     /* find an entry that matches fileid */
     struct attr_cache_entry tmp;
     tmp.fileid = fileid;
-    return RB_FIND(attr_tree, &cache->head, &tmp);
+    return RB_FIND(attr_tree, &shard->head, &tmp);
 }
 
 static int attr_cache_insert(
-    IN struct attr_cache *cache,
+    IN struct attr_cache_shard *shard,
     IN struct attr_cache_entry *entry)
 {
     int status = NO_ERROR;
 
     DPRINTF(NCLVL2, ("--> attr_cache_insert(%llu)\n", entry->fileid));
 
-    if (RB_INSERT(attr_tree, &cache->head, entry))
+    if (RB_INSERT(attr_tree, &shard->head, entry))
         status = ERROR_FILE_EXISTS;
 
     DPRINTF(NCLVL2, ("<-- attr_cache_insert() returning %d\n", status));
     return status;
 }
 
+/* takes the shard lock */
 static int attr_cache_find_or_create(
     IN struct attr_cache *cache,
     IN uint64_t fileid,
     OUT struct attr_cache_entry **entry_out)
 {
+    struct attr_cache_shard *shard = attr_cache_shard(cache, fileid);
     struct attr_cache_entry *entry;
     int status = NO_ERROR;
 
     DPRINTF(NCLVL1, ("--> attr_cache_find_or_create(%llu)\n", fileid));
 
+    AcquireSRWLockExclusive(&shard->lock);
+
     /* look for an existing entry */
-    entry = attr_cache_search(cache, fileid);
+    entry = attr_cache_search(shard, fileid);
     if (entry == NULL) {
         /* create and insert */
-        status = attr_cache_entry_create(cache, fileid, &entry);
+        status = attr_cache_entry_create(shard, fileid, &entry);
         if (status)
             goto out;
 
-        status = attr_cache_insert(cache, entry);
+        status = attr_cache_insert(shard, entry);
         if (status)
             goto out_err_free;
     }
 
     /* take a reference on success */
-    attr_cache_entry_ref(cache, entry);
+    attr_cache_entry_ref(shard, entry);
 
 out:
+    ReleaseSRWLockExclusive(&shard->lock);
     *entry_out = entry;
     DPRINTF(NCLVL1, ("<-- attr_cache_find_or_create() returning %d\n",
         status));
     return status;
 
 out_err_free:
-    attr_cache_entry_free(cache, entry);
+    attr_cache_entry_free(shard, entry);
     entry = NULL;
     goto out;
 }
 
+/* takes the shard lock */
+static void attr_cache_entry_release(
+    IN struct attr_cache *cache,
+    IN struct attr_cache_entry *entry)
+{
+    struct attr_cache_shard *shard = attr_entry_shard(cache, entry);
+
+    AcquireSRWLockExclusive(&shard->lock);
+    attr_cache_entry_deref(shard, entry);
+    ReleaseSRWLockExclusive(&shard->lock);
+}
+
+/* expects the caller to hold the shard lock */
+static void attr_cache_update_expiration(
+    IN const struct attr_cache *cache,
+    IN struct attr_cache_entry *entry,
+    IN uint64_t change)
+{
+    const util_reltimestamp now = UTIL_GETRELTIME();
+    uint32_t ttl_min, ttl_max;
+
+    if ((entry->nc_attrs & NC_ATTR_TYPE) && (entry->type == NF4DIR)) {
+        ttl_min = cache->dirmin;
+        ttl_max = cache->dirmax;
+    } else {
+        ttl_min = cache->regmin;
+        ttl_max = cache->regmax;
+    }
+
+    if ((entry->nc_attrs & NC_ATTR_CHANGE) && (entry->change == change)) {
+        /* unchanged since the entry expired, back off */
+        if (now >= entry->expiration)
+            entry->ttl = max(entry->ttl * 2, 1);
+    } else {
+        entry->ttl = ttl_min;
+    }
+    entry->ttl = min(max(entry->ttl, ttl_min), ttl_max);
+    entry->expiration = now + entry->ttl;
+}
+
+/* expects the caller to hold the shard lock */
 static void attr_cache_update(
+    IN const struct attr_cache *cache,
     IN struct attr_cache_entry *entry,
     IN const nfs41_file_info *info,
     IN enum open_delegation_type4 delegation)
 {
+    /*
+     * A reply for one of the smaller |nfs41_superblock_getattr_profile()|
+     * masks with a new change attribute but without size and mtime:
+     * The attributes which are not in the reply may be stale, so the
+     * next lookup has to fetch them again
+     */
+    const bool partial = (info->attrmask.count > 0) &&
+        (info->attrmask.arr[0] & FATTR4_WORD0_CHANGE) &&
+        (entry->nc_attrs & NC_ATTR_CHANGE) &&
+        (entry->change != info->change) &&
+        (((info->attrmask.arr[0] & FATTR4_WORD0_SIZE) == 0) ||
+            (info->attrmask.count < 2) ||
+            ((info->attrmask.arr[1] & FATTR4_WORD1_TIME_MODIFY) == 0));
+
     /* update the attributes present in mask */
     if (info->attrmask.count > 0) {
         if (info->attrmask.arr[0] & FATTR4_WORD0_TYPE) {
@@ -324,11 +597,11 @@ static void attr_cache_update(
             entry->type = (unsigned char)(info->type & NFS_FTYPE_MASK);
         }
         if (info->attrmask.arr[0] & FATTR4_WORD0_CHANGE) {
+            /* revalidate whenever we get a change attribute */
+            attr_cache_update_expiration(cache, entry, info->change);
             entry->nc_attrs |= NC_ATTR_CHANGE;
             entry->change = info->change;
-            /* revalidate whenever we get a change attribute */
             entry->invalidated = 0;
-            entry->expiration = UTIL_GETRELTIME() + NAME_CACHE_EXPIRATION;
         }
         if (info->attrmask.arr[0] & FATTR4_WORD0_FSID) {
             entry->nc_attrs |= NC_ATTR_FSID;
@@ -354,14 +627,18 @@ static void attr_cache_update(
             entry->mode = info->mode;
         }
         if (info->attrmask.arr[1] & FATTR4_WORD1_OWNER) {
-            entry->nc_attrs |= NC_ATTR_OWNER;
             EASSERT(info->owner != NULL);
-            (void)strcpy(entry->owner, info->owner);
+            if (attr_owner_set(&entry->owner, info->owner))
+                entry->nc_attrs |= NC_ATTR_OWNER;
+            else
+                entry->nc_attrs &= ~NC_ATTR_OWNER;
         }
         if (info->attrmask.arr[1] & FATTR4_WORD1_OWNER_GROUP) {
-            entry->nc_attrs |= NC_ATTR_OWNER_GROUP;
             EASSERT(info->owner_group != NULL);
-            (void)strcpy(entry->owner_group, info->owner_group);
+            if (attr_owner_set(&entry->owner_group, info->owner_group))
+                entry->nc_attrs |= NC_ATTR_OWNER_GROUP;
+            else
+                entry->nc_attrs &= ~NC_ATTR_OWNER_GROUP;
         }
         if (info->attrmask.arr[1] & FATTR4_WORD1_NUMLINKS) {
             entry->nc_attrs |= NC_ATTR_NUMLINKS;
@@ -402,6 +679,9 @@ static void attr_cache_update(
         }
     }
 
+    if (partial)
+        entry->invalidated = 1;
+
     if (is_delegation(delegation))
         entry->delegated = TRUE;
 }
@@ -455,7 +735,7 @@ static void copy_attrs(
     if (src->nc_attrs & NC_ATTR_OWNER) {
         dst->attrmask.arr[1] |= FATTR4_WORD1_OWNER;
         dst->owner = dst->owner_buf;
-        (void)strcpy(dst->owner, src->owner);
+        (void)memcpy(dst->owner, src->owner->name, src->owner->len + 1);
     }
     else {
         /* this should only happen for newly created files/dirs */
@@ -464,7 +744,8 @@ static void copy_attrs(
     if (src->nc_attrs & NC_ATTR_OWNER_GROUP) {
         dst->attrmask.arr[1] |= FATTR4_WORD1_OWNER_GROUP;
         dst->owner_group = dst->owner_group_buf;
-        (void)strcpy(dst->owner_group, src->owner_group);
+        (void)memcpy(dst->owner_group, src->owner_group->name,
+            src->owner_group->len + 1);
     }
     else {
         /* this should only happen for newly created files/dirs */
@@ -515,9 +796,123 @@ static void copy_attrs(
 /* name cache */
 struct nfs41_name_cache;
 
+/* change attribute of a directory, to validate its negative entries */
+struct name_cache_dir_change {
+    uint64_t                change;
+    bool                    valid;
+};
+
+/*
+ * Component storage
+ *
+ * Most file names are short, so the (NUL-terminated) component of a
+ * |name_cache_entry| is not stored inline with room for
+ * |NFS41_MAX_COMPONENT_LEN| bytes, but allocated from slabs of
+ * |NC_COMPONENT_SLAB_SIZE| bytes in size classes of 16 to 512 bytes
+ * (the larger classes are used for the sort keys of case-insensitive
+ * entries, see "Name comparison").
+ * Freed components go to the free list of their class. Slabs are only
+ * returned by |nfs41_name_cache_free()|.
+ * |NC_COMPONENT_AVG_SIZE| is the size per entry which we reserve in
+ * the cache size budget, see |SIZE_PER_ENTRY|.
+ */
+#define NC_COMPONENT_MIN_SHIFT  4 /* 16 bytes */
+#define NC_COMPONENT_CLASSES    6 /* 16, 32, 64, 128, 256, 512 bytes */
+#define NC_COMPONENT_SLAB_SIZE  (64*1024)
+#define NC_COMPONENT_AVG_SIZE   32
+
+struct name_component_free {
+    struct name_component_free *next;
+};
+
+struct name_component_slab {
+    struct name_component_slab *next;
+};
+
+struct name_component_arena {
+    SRWLOCK                 lock;
+    struct name_component_free *free_lists[NC_COMPONENT_CLASSES];
+    struct name_component_slab *slabs;
+    char                    *slab_pos; /* unused space in the newest slab */
+    char                    *slab_end;
+};
+
+/* size class for |size| bytes */
+static __inline uint32_t name_component_class(
+    IN size_t size)
+{
+    uint32_t c = 0;
+
+    while ((c < (NC_COMPONENT_CLASSES-1)) &&
+        (size > ((size_t)1 << (NC_COMPONENT_MIN_SHIFT + c))))
+        c++;
+    return c;
+}
+
+static char *name_component_alloc(
+    IN struct name_component_arena *arena,
+    IN uint32_t c)
+{
+    const size_t size = (size_t)1 << (NC_COMPONENT_MIN_SHIFT + c);
+    struct name_component_slab *slab;
+    char *component = NULL;
+
+    AcquireSRWLockExclusive(&arena->lock);
+    if (arena->free_lists[c]) {
+        component = (char *)arena->free_lists[c];
+        arena->free_lists[c] = arena->free_lists[c]->next;
+        goto out;
+    }
+
+    if ((size_t)(arena->slab_end - arena->slab_pos) < size) {
+        slab = malloc(NC_COMPONENT_SLAB_SIZE);
+        if (slab == NULL)
+            goto out;
+        slab->next = arena->slabs;
+        arena->slabs = slab;
+        /* keep the components pointer aligned */
+        arena->slab_pos = (char *)slab + sizeof(void *) * 2;
+        arena->slab_end = (char *)slab + NC_COMPONENT_SLAB_SIZE;
+    }
+    component = arena->slab_pos;
+    arena->slab_pos += size;
+out:
+    ReleaseSRWLockExclusive(&arena->lock);
+    return component;
+}
+
+static void name_component_release(
+    IN struct name_component_arena *arena,
+    IN char *component,
+    IN uint32_t c)
+{
+    struct name_component_free *f = (struct name_component_free *)component;
+
+    AcquireSRWLockExclusive(&arena->lock);
+    f->next = arena->free_lists[c];
+    arena->free_lists[c] = f;
+    ReleaseSRWLockExclusive(&arena->lock);
+}
+
+static void name_component_arena_free(
+    IN struct name_component_arena *arena)
+{
+    struct name_component_slab *slab;
+
+    while (arena->slabs) {
+        slab = arena->slabs;
+        arena->slabs = slab->next;
+        free(slab);
+    }
+    (void)memset(arena->free_lists, 0, sizeof(arena->free_lists));
+    arena->slab_pos = arena->slab_end = NULL;
+}
+
+struct name_child_index;
+
 RB_HEAD(name_tree, name_cache_entry);
 struct name_cache_entry {
-    char                    component[NFS41_MAX_COMPONENT_LEN+1];
+    char                    *component; /* see "Component storage" */
     nfs41_fh                fh;
     RB_ENTRY(name_cache_entry) rbnode;
     struct name_tree        rbchildren;
@@ -526,34 +921,143 @@ struct name_cache_entry {
     struct list_entry       exp_entry;
     util_reltimestamp         expiration;
     struct nfs41_name_cache *name_cache;
+    /* parent's change attribute when this negative entry was created */
+    struct name_cache_dir_change dir_change;
     unsigned short          component_len;
+    /* comparison key, see "Name comparison" */
+    unsigned short          key_len;
+    bool                    key_truncated;
+    char                    *key;
+    uint32_t                key_hash;
+    /* see "Child index" */
+    uint32_t                num_children;
+    struct name_child_index *child_index;
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+    /* see |nfs41_name_cache_pin()| */
+    bool                    pinned;
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
 };
 #define NAME_ENTRY_SIZE sizeof(struct name_cache_entry)
 
 /*
- * FIXME: We use a thread-local variable |name_cmp| here because we do not know
- * an (easy) way to do a |RB_GENERATE()| with two diffrent name comparisation
- * functions (|name_cmp_case_sensitive()| and |name_cmp_case_insensitive()|)
+ * Name comparison
+ *
+ * Each entry carries a key for its component, which |name_cmp()|
+ * compares with |memcmp()| after the component lengths:
+ * On case-sensitive filesystems the key is the component itself, on
+ * case-insensitive filesystems it is the ICU sort key of the
+ * component (see |name_cache_make_key()|), which compares like
+ * |ucol_strcollUTF8()| and is the same for names which only differ in
+ * case. That way lookups do not collate the name once per tree level.
+ * Sort keys longer than |NC_KEY_MAX_LEN| bytes are truncated
+ * (|key_truncated|), and the full collation decides if the truncated
+ * keys are equal.
+ *
+ * Whether a filesystem is case-insensitive is a property of the
+ * superblock, not of the (per-server) name cache, so the thread-local
+ * |name_cmp_caseinsensitive| set by |NC_SET_NAMECMP()| selects which
+ * kind of key is built for new entries and lookups.
  */
-__declspec(thread) static
-int (*name_cmp)(struct name_cache_entry *, struct name_cache_entry *) = NULL;
+#define NC_KEY_MAX_LEN 512
+
+__declspec(thread) static bool name_cmp_caseinsensitive = false;
+
+static int icu_strcmpcoll(UCollator *coll, const char *str1,
+    const char *str2, int32_t len);
+
+static int name_cmp(
+    struct name_cache_entry *lhs,
+    struct name_cache_entry *rhs)
+{
+    const int diff = rhs->component_len - lhs->component_len;
+    int res;
+
+    if (diff != 0)
+        return diff;
+
+    res = memcmp(lhs->key, rhs->key, min(lhs->key_len, rhs->key_len));
+    if (res != 0)
+        return res;
+
+    if (lhs->key_truncated || rhs->key_truncated)
+        return icu_strcmpcoll(lhs->name_cache->icu_coll,
+            lhs->component, rhs->component, (int32_t)lhs->component_len);
+
+    return (int)lhs->key_len - (int)rhs->key_len;
+}
 
 RB_GENERATE(name_tree, name_cache_entry, rbnode, name_cmp)
 
+/*
+ * Name cache locking
+ *
+ * |lock| protects the structure of the name tree (|root|, the
+ * |parent| and |rbchildren| of all entries, the pool and
+ * |delegations|). It is held shared for lookups and exclusive for
+ * anything which adds, removes or moves entries.
+ *
+ * The |fh|, |attributes| and |expiration| of an entry and whether it
+ * is on |exp_entries| are protected by the directory shard of its
+ * parent directory (see |name_entry_dir_shard()|), so
+ * |nfs41_name_cache_insert()| can refresh an existing entry while
+ * only holding |lock| shared. Lookups walking the tree take the
+ * directory shard lock shared for each component.
+ * Threads holding |lock| exclusive do not need the directory shard
+ * locks, because all other users of the name tree hold |lock|
+ * shared.
+ *
+ * |lru_lock| serialises changes of |exp_entries| by threads which
+ * only hold |lock| shared.
+ */
+#define NAME_CACHE_DIR_SHARDS 16
+
+struct name_cache_dir_shard {
+    SRWLOCK                 lock;
+    volatile LONG64         hits;
+    volatile LONG64         misses;
+};
+
 struct nfs41_name_cache {
     struct name_cache_entry *root;
     struct name_cache_entry *pool;
     struct attr_cache       attributes;
     struct list_entry       exp_entries; /* list of entries by expiry */
-    uint32_t                expiration;
+    uint32_t                expiration; /* name entry timeout, in seconds */
+    bool                    enabled;
     uint32_t                entries;
     uint32_t                max_entries;
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING
+    size_t                  max_size; /* see "Cache size budget" */
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING */
     uint32_t                delegations;
     uint32_t                max_delegations;
     SRWLOCK                 lock;
+    SRWLOCK                 lru_lock;
+    struct name_cache_dir_shard dirs[NAME_CACHE_DIR_SHARDS];
+    /* negative entries used/found stale by lookups */
+    volatile LONG64         negative_hits;
+    volatile LONG64         negative_misses;
     UCollator               *icu_coll;
+    struct name_component_arena components;
 };
 
+/* directory shard protecting the children of |dir| (|NULL| for root) */
+static __inline struct name_cache_dir_shard *name_cache_dir_shard(
+    IN struct nfs41_name_cache *cache,
+    IN const struct name_cache_entry *dir)
+{
+    return &cache->dirs[
+        NC_SHARD_HASH((uintptr_t)dir) % NAME_CACHE_DIR_SHARDS];
+}
+
+/* directory shard protecting |entry| */
+static __inline struct name_cache_dir_shard *name_entry_dir_shard(
+    IN struct nfs41_name_cache *cache,
+    IN const struct name_cache_entry *entry)
+{
+    return name_cache_dir_shard(cache, entry->parent);
+}
+
 static
 int icu_strcmpcoll(UCollator *coll, const char *str1, const char *str2, int32_t len)
 {
@@ -583,74 +1087,52 @@ int icu_strcmpcoll(UCollator *coll, const char *str1, const char *str2, int32_t
     return -1;
 }
 
-static
-int name_cmp_case_sensitive(
-    struct name_cache_entry *lhs, struct name_cache_entry *rhs)
-{
-    const int diff = rhs->component_len - lhs->component_len;
-    int res;
-
-    if (diff != 0)
-        return diff;
-
-    unsigned short clen = lhs->component_len;
-
-    /* FIXME: Can we use |memcmp()| here ? */
-    res = strncmp(lhs->component, rhs->component, clen);
-
-    return res;
-}
-
-static
-int name_cmp_case_insensitive(
-    struct name_cache_entry *lhs, struct name_cache_entry *rhs)
+/*
+ * Build the comparison key for |component| in |buf|, see "Name
+ * comparison". Returns the key, which is |component->name| for
+ * case-sensitive lookups
+ */
+static const char *name_cache_make_key(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_component *component,
+    OUT char buf[NC_KEY_MAX_LEN],
+    OUT unsigned short *key_len,
+    OUT bool *key_truncated)
 {
-    const int diff = rhs->component_len - lhs->component_len;
-    int res;
+    UCharIterator iter;
+    uint32_t state[2] = { 0, 0 };
+    UErrorCode status = U_ZERO_ERROR;
+    int32_t len;
 
-    if (diff != 0)
-        return diff;
+    if (!name_cmp_caseinsensitive) {
+        *key_len = component->len;
+        *key_truncated = false;
+        return component->name;
+    }
 
-    unsigned short clen = lhs->component_len;
-
-    res = icu_strcmpcoll(lhs->name_cache->icu_coll,
-        lhs->component, rhs->component, (int32_t)clen);
-
-//#define DEBUG_CASEINSENSITIVE_NAMECMP 1
-#ifdef DEBUG_CASEINSENSITIVE_NAMECMP
-    int casesensitive_res;
-
-    /* FIXME: Can we use |memcmp()| here ? */
-    casesensitive_res = strncmp(lhs->component, rhs->component,
-        clen);
-
-    if (res != casesensitive_res) {
-        /*
-         * Explicitly call |clen| "byte_clen" in the output to make sure
-         * people do not get confused, e.g. if |<Ae><ae>| has the same
-         * terminal character width as "dir1
-         */
-        DPRINTF(0,
-            ("name_cmp: "
-                "(lhs='%.*s',rhs='%.*s',byte_clen=%d), "
-                "res(=%d) != casesensitive_res(=%d)\n",
-                (int)clen, lhs->component,
-                (int)clen, rhs->component,
-                (int)clen,
-                res, casesensitive_res));
-    }
-#endif /* DEBUG_CASEINSENSITIVE_NAMECMP */
-
-    return res;
+    uiter_setUTF8(&iter, component->name, component->len);
+    len = ucol_nextSortKeyPart(cache->icu_coll, &iter, state,
+        (uint8_t *)buf, NC_KEY_MAX_LEN, &status);
+    if (U_FAILURE(status)) {
+        eprintf("name_cache_make_key: "
+            "ucol_nextSortKeyPart('%.*s') failed with icu_error='%s'\n",
+            (int)component->len, component->name, u_errorName(status));
+        /* an empty truncated key always uses the full collation */
+        len = 0;
+        *key_truncated = true;
+    }
+    else {
+        /* a full buffer means there might be more */
+        *key_truncated = (len == NC_KEY_MAX_LEN);
+    }
+    *key_len = (unsigned short)len;
+    return buf;
 }
 
 #define NC_SET_NAMECMP(ciss) \
-    { name_cmp = (ciss)?name_cmp_case_insensitive:name_cmp_case_sensitive; }
+    { name_cmp_caseinsensitive = (ciss); }
 #define NC_CLEAR_NAMECMP() \
-    { \
-        name_cmp = \
-            (int (*)(struct name_cache_entry *, struct name_cache_entry *))NULL; \
-    }
+    { name_cmp_caseinsensitive = false; }
 
 
 
@@ -662,16 +1144,176 @@ int name_cmp_case_insensitive(
 static __inline bool name_cache_enabled(
     IN struct nfs41_name_cache *cache)
 {
-    return cache->expiration > 0;
+    return cache->enabled;
 }
 
-static __inline void name_cache_entry_rename(
+static int name_cache_entry_rename(
+    IN struct nfs41_name_cache *cache,
     OUT struct name_cache_entry *entry,
     IN const nfs41_component *component)
 {
-    StringCchCopyNA(entry->component, NFS41_MAX_COMPONENT_LEN+1,
-        component->name, component->len);
+    const uint32_t c = name_component_class((size_t)component->len + 1);
+    char *storage = entry->component;
+    char keybuf[NC_KEY_MAX_LEN];
+    char *key_storage = NULL;
+    const char *key;
+    unsigned short key_len;
+    bool key_truncated;
+
+    key = name_cache_make_key(cache, component, keybuf,
+        &key_len, &key_truncated);
+    if (key == keybuf) {
+        key_storage = name_component_alloc(&cache->components,
+            name_component_class(key_len));
+        if (key_storage == NULL)
+            return ERROR_OUTOFMEMORY;
+        (void)memcpy(key_storage, keybuf, key_len);
+    }
+
+    /* reuse the old storage if it has the same size class */
+    if ((storage == NULL) ||
+        (name_component_class((size_t)entry->component_len + 1) != c)) {
+        storage = name_component_alloc(&cache->components, c);
+        if (storage == NULL) {
+            if (key_storage)
+                name_component_release(&cache->components, key_storage,
+                    name_component_class(key_len));
+            return ERROR_OUTOFMEMORY;
+        }
+        if (entry->component)
+            name_component_release(&cache->components, entry->component,
+                name_component_class((size_t)entry->component_len + 1));
+    }
+
+    /* release the old sort key */
+    if (entry->key && (entry->key != entry->component))
+        name_component_release(&cache->components, entry->key,
+            name_component_class(entry->key_len));
+
+    (void)memcpy(storage, component->name, component->len);
+    storage[component->len] = '\0';
+    entry->component = storage;
     entry->component_len = component->len;
+    entry->key = key_storage ? key_storage : storage;
+    entry->key_len = key_len;
+    entry->key_truncated = key_truncated;
+    entry->key_hash = name_key_hash(entry->key, key_len);
+    return NO_ERROR;
+}
+
+/*
+ * Child index
+ *
+ * Lookups in directories with many children (mail spools, object
+ * stores, build output dirs) walk |rbchildren| with ~17 key
+ * comparisons for 100k children. Directories with at least
+ * |NC_CHILD_INDEX_MIN| children additionally get a hash table of
+ * their children, with open addressing (linear probing, backward
+ * shift deletion) by |key_hash|. |rbchildren| stays the authoritative
+ * structure for iteration. The index is protected by the name cache
+ * |lock| like the tree.
+ */
+#define NC_CHILD_INDEX_MIN 64
+
+struct name_child_index {
+    uint32_t                size; /* power of 2 */
+    uint32_t                used;
+    struct name_cache_entry *slots[1];
+};
+
+static __inline uint32_t name_key_hash(
+    IN const char *key,
+    IN unsigned short key_len)
+{
+    uint32_t hash = 2166136261U; /* FNV-1a */
+    unsigned short i;
+
+    for (i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void name_child_index_add(
+    IN struct name_child_index *index,
+    IN struct name_cache_entry *entry)
+{
+    const uint32_t mask = index->size - 1;
+    uint32_t i = entry->key_hash & mask;
+
+    while (index->slots[i])
+        i = (i + 1) & mask;
+    index->slots[i] = entry;
+    index->used++;
+}
+
+static void name_child_index_del(
+    IN struct name_child_index *index,
+    IN struct name_cache_entry *entry)
+{
+    const uint32_t mask = index->size - 1;
+    uint32_t i = entry->key_hash & mask, j, home;
+
+    while (index->slots[i] != entry) {
+        if (index->slots[i] == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+    index->slots[i] = NULL;
+    index->used--;
+
+    /* move the following entries of the cluster back into the gap */
+    for (j = (i + 1) & mask; index->slots[j]; j = (j + 1) & mask) {
+        home = index->slots[j]->key_hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            index->slots[i] = index->slots[j];
+            index->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/* (re)build the index of |parent| for |num_children| children */
+static void name_child_index_build(
+    IN struct name_cache_entry *parent)
+{
+    struct name_child_index *index;
+    struct name_cache_entry *child;
+    uint32_t size = NC_CHILD_INDEX_MIN * 4;
+
+    /* keep the load factor below 50% */
+    while (size < (parent->num_children * 2))
+        size *= 2;
+
+    index = calloc(1, sizeof(struct name_child_index) +
+        (size - 1) * sizeof(struct name_cache_entry *));
+    if (index == NULL)
+        return; /* lookups fall back to |rbchildren| */
+    index->size = size;
+
+    RB_FOREACH(child, name_tree, &parent->rbchildren)
+        name_child_index_add(index, child);
+
+    free(parent->child_index);
+    parent->child_index = index;
+}
+
+static struct name_cache_entry *name_child_index_find(
+    IN const struct name_child_index *index,
+    IN struct name_cache_entry *key)
+{
+    const uint32_t mask = index->size - 1;
+    struct name_cache_entry *child;
+    uint32_t i;
+
+    for (i = key->key_hash & mask; (child = index->slots[i]) != NULL;
+        i = (i + 1) & mask) {
+        if ((child->key_hash == key->key_hash) &&
+            (name_cmp(child, key) == 0))
+            return child;
+    }
+    return NULL;
 }
 
 static __inline void name_cache_remove(
@@ -679,6 +1321,16 @@ static __inline void name_cache_remove(
     IN struct name_cache_entry *parent)
 {
     RB_REMOVE(name_tree, &parent->rbchildren, entry);
+    parent->num_children--;
+    if (parent->child_index) {
+        if (parent->num_children < (NC_CHILD_INDEX_MIN / 2)) {
+            free(parent->child_index);
+            parent->child_index = NULL;
+        }
+        else {
+            name_child_index_del(parent->child_index, entry);
+        }
+    }
     entry->parent = NULL;
 }
 
@@ -700,12 +1352,15 @@ static __inline void name_cache_unlink(
     name_cache_unlink_children_recursive(cache, entry);
     /* release the cached attributes */
     if (entry->attributes) {
-        attr_cache_entry_deref(&cache->attributes, entry->attributes);
+        attr_cache_entry_release(&cache->attributes, entry->attributes);
         entry->attributes = NULL;
     }
     /* move it to the end of exp_entries for scavenging */
     list_remove(&entry->exp_entry);
     list_add_tail(&cache->exp_entries, &entry->exp_entry);
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+    entry->pinned = false;
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
 }
 
 static void name_cache_unlink_children_recursive(
@@ -717,6 +1372,72 @@ static void name_cache_unlink_children_recursive(
         name_cache_unlink(cache, entry);
 }
 
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+/* max number of entries |name_cache_entry_create()| skips over to
+ * find one which is not pinned */
+#define NAME_CACHE_SCAVENGE_MAX_SKIP 64
+
+/* an entry is pinned if it or one of its parents is pinned */
+static bool name_cache_entry_pinned(
+    IN const struct name_cache_entry *entry)
+{
+    while (entry) {
+        if (entry->pinned)
+            return true;
+        if (entry == entry->parent)
+            break;
+        entry = entry->parent;
+    }
+    return false;
+}
+
+static struct name_cache_entry *name_cache_scavenge_candidate(
+    IN struct nfs41_name_cache *cache)
+{
+    struct list_entry *pos = cache->exp_entries.prev;
+    uint32_t skipped = 0;
+
+    while ((pos != &cache->exp_entries) &&
+        (skipped < NAME_CACHE_SCAVENGE_MAX_SKIP)) {
+        if (!name_cache_entry_pinned(name_entry(pos)))
+            return name_entry(pos);
+        pos = pos->prev;
+        skipped++;
+    }
+    /* everything near the tail is pinned, evict the oldest anyway */
+    return name_entry(cache->exp_entries.prev);
+}
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
+
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING
+/*
+ * Cache size budget
+ *
+ * All names of a file share its attribute entry (which is keyed by
+ * fileid), so a tree with many hard links needs fewer attribute
+ * entries than names. Instead of a fixed number of names the cache
+ * is bounded by the size of the entries actually in use: The name
+ * pool has room for |max_size| worth of names without attributes,
+ * and a new name only comes from the pool while the names plus the
+ * attribute entries in use fit into |max_size|.
+ */
+#define NAME_SIZE_PER_ENTRY (NAME_ENTRY_SIZE + NC_COMPONENT_AVG_SIZE)
+
+static bool name_cache_over_budget(
+    IN const struct nfs41_name_cache *cache)
+{
+    size_t attr_in_use = 0;
+    uint32_t i;
+
+    /* no shard locks, an estimate is good enough */
+    for (i = 0; i < ATTR_CACHE_SHARDS; i++)
+        attr_in_use += (size_t)cache->attributes.shards[i].in_use;
+
+    return (((size_t)cache->entries + 1) * NAME_SIZE_PER_ENTRY +
+        attr_in_use * ATTR_ENTRY_SIZE) > cache->max_size;
+}
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING */
+
 static int name_cache_entry_create(
     IN struct nfs41_name_cache *cache,
     IN const nfs41_component *component,
@@ -725,13 +1446,23 @@ static int name_cache_entry_create(
     int status = NO_ERROR;
     struct name_cache_entry *entry;
 
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING
+    if ((cache->entries >= cache->max_entries) ||
+        (!list_empty(&cache->exp_entries) &&
+            name_cache_over_budget(cache))) {
+#else
     if (cache->entries >= cache->max_entries) {
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING */
         /* scavenge the oldest entry */
         if (list_empty(&cache->exp_entries)) {
             status = ERROR_OUTOFMEMORY;
             goto out;
         }
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+        entry = name_cache_scavenge_candidate(cache);
+#else
         entry = name_entry(cache->exp_entries.prev);
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
         name_cache_unlink(cache, entry);
 
         DPRINTF(NCLVL2, ("name_cache_entry_create('%s') scavenged 0x%p\n",
@@ -745,30 +1476,46 @@ static int name_cache_entry_create(
 
     /* Add back pointer to entry */
     entry->name_cache = cache;
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+    entry->pinned = false;
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
 
-    name_cache_entry_rename(entry, component);
+    status = name_cache_entry_rename(cache, entry, component);
+    if (status)
+        goto out;
 
     *entry_out = entry;
 out:
     return status;
 }
 
+static __inline void exp_entries_move_head(
+    IN struct list_entry *head,
+    IN struct list_entry *entry)
+{
+    /* unlike list_remove(), this never makes |entry| look unlinked to
+     * a |list_empty()| in |entry_invis()| running concurrently */
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    list_add(entry, head, head->next);
+}
+
 static void name_cache_entry_accessed(
     IN struct nfs41_name_cache *cache,
     IN struct name_cache_entry *entry)
 {
+    AcquireSRWLockExclusive(&cache->lru_lock);
     /* move the entry to the front of cache->exp_entries, then do
      * the same for its parents, which are more costly to evict */
     while (entry) {
         /* if entry is delegated, it won't be in the list */
-        if (!list_empty(&entry->exp_entry)) {
-            list_remove(&entry->exp_entry);
-            list_add_head(&cache->exp_entries, &entry->exp_entry);
-        }
+        if (!list_empty(&entry->exp_entry))
+            exp_entries_move_head(&cache->exp_entries, &entry->exp_entry);
         if (entry == entry->parent)
             break;
         entry = entry->parent;
     }
+    ReleaseSRWLockExclusive(&cache->lru_lock);
 }
 
 static void name_cache_entry_updated(
@@ -787,6 +1534,8 @@ static int name_cache_entry_update(
     IN OPTIONAL const nfs41_file_info *info,
     IN enum open_delegation_type4 delegation)
 {
+    struct attr_cache_shard *shard;
+    bool delegated;
     int status = NO_ERROR;
 
     if (fh)
@@ -795,6 +1544,18 @@ static int name_cache_entry_update(
         entry->fh.len = 0;
 
     if (info) {
+        if (entry->attributes &&
+            (info->attrmask.count > 0) &&
+            (info->attrmask.arr[0] & FATTR4_WORD0_FILEID) &&
+            (entry->attributes->fileid != info->fileid)) {
+            /*
+             * The name now refers to a different file: Drop the old
+             * file's attributes instead of overwriting them, they
+             * are shared with the other hard links of that file
+             */
+            attr_cache_entry_release(&cache->attributes, entry->attributes);
+            entry->attributes = NULL;
+        }
         if (entry->attributes == NULL) {
             /* negative -> positive entry, create the attributes */
             status = attr_cache_find_or_create(&cache->attributes,
@@ -803,22 +1564,33 @@ static int name_cache_entry_update(
                 goto out;
         }
 
-        attr_cache_update(entry->attributes, info, delegation);
+        shard = attr_entry_shard(&cache->attributes, entry->attributes);
+        AcquireSRWLockExclusive(&shard->lock);
+        attr_cache_update(&cache->attributes, entry->attributes,
+            info, delegation);
+        entry->attributes->name_entry = entry;
 
         /* hold a reference as long as we have the delegation */
         if (is_delegation(delegation)) {
-            attr_cache_entry_ref(&cache->attributes, entry->attributes);
+            attr_cache_entry_ref(shard, entry->attributes);
             cache->delegations++;
         }
+        delegated = entry->attributes->delegated;
+        ReleaseSRWLockExclusive(&shard->lock);
 
         /* keep the entry from expiring */
-        if (entry->attributes->delegated)
+        if (delegated) {
+            AcquireSRWLockExclusive(&cache->lru_lock);
             list_remove(&entry->exp_entry);
+            ReleaseSRWLockExclusive(&cache->lru_lock);
+        }
     } else if (entry->attributes) {
         /* positive -> negative entry, deref the attributes */
-        attr_cache_entry_deref(&cache->attributes, entry->attributes);
+        attr_cache_entry_release(&cache->attributes, entry->attributes);
         entry->attributes = NULL;
     }
+    /* see |name_cache_entry_set_negative()| */
+    entry->dir_change.valid = false;
     name_cache_entry_updated(cache, entry);
 out:
     return status;
@@ -829,35 +1601,49 @@ static int name_cache_entry_changed(
     IN struct name_cache_entry *entry,
     IN const change_info4 *cinfo)
 {
+    struct attr_cache_shard *shard;
+    int changed;
+
     if (entry->attributes == NULL)
         return FALSE;
 
+    shard = attr_entry_shard(&cache->attributes, entry->attributes);
+    AcquireSRWLockExclusive(&shard->lock);
     if (cinfo->after == entry->attributes->change ||
             (cinfo->atomic && cinfo->before == entry->attributes->change)) {
         entry->attributes->change = cinfo->after;
-        name_cache_entry_updated(cache, entry);
         DPRINTF(NCLVL1, ("name_cache_entry_changed('%s') has not changed. "
             "updated change=%llu\n", entry->component,
             entry->attributes->change));
-        return FALSE;
+        changed = FALSE;
     } else {
         DPRINTF(NCLVL1, ("name_cache_entry_changed('%s') has changed: was %llu, "
             "got before=%llu\n", entry->component,
             entry->attributes->change, cinfo->before));
-        return TRUE;
+        changed = TRUE;
     }
+    ReleaseSRWLockExclusive(&shard->lock);
+
+    if (!changed)
+        name_cache_entry_updated(cache, entry);
+    return changed;
 }
 
 static void name_cache_entry_invalidate(
     IN struct nfs41_name_cache *cache,
     IN struct name_cache_entry *entry)
 {
+    struct attr_cache_shard *shard;
+
     DPRINTF(NCLVL1, ("name_cache_entry_invalidate('%s')\n", entry->component));
 
     if (entry->attributes) {
         /* flag attributes so that entry_invis() will return true
          * if another entry attempts to use them */
+        shard = attr_entry_shard(&cache->attributes, entry->attributes);
+        AcquireSRWLockExclusive(&shard->lock);
         entry->attributes->invalidated = 1;
+        ReleaseSRWLockExclusive(&shard->lock);
     }
     name_cache_unlink(cache, entry);
 }
@@ -868,16 +1654,25 @@ static struct name_cache_entry* name_cache_search(
     IN const nfs41_component *component)
 {
     struct name_cache_entry tmp, *entry;
+    char keybuf[NC_KEY_MAX_LEN];
 
     DPRINTF(NCLVL2, ("--> name_cache_search('%.*s' under '%s')\n",
         component->len, component->name, parent->component));
 
-    StringCchCopyNA(tmp.component, NFS41_MAX_COMPONENT_LEN+1,
-        component->name, component->len);
+    /* |name_cmp()| only looks at |component_len| bytes */
+    tmp.component = (char *)component->name;
     tmp.component_len = component->len;
+    tmp.key = (char *)name_cache_make_key(cache, component, keybuf,
+        &tmp.key_len, &tmp.key_truncated);
     tmp.name_cache = cache;
 
-    entry = RB_FIND(name_tree, &parent->rbchildren, &tmp);
+    if (parent->child_index) {
+        tmp.key_hash = name_key_hash(tmp.key, tmp.key_len);
+        entry = name_child_index_find(parent->child_index, &tmp);
+    }
+    else {
+        entry = RB_FIND(name_tree, &parent->rbchildren, &tmp);
+    }
     if (entry) {
         DPRINTF(NCLVL2, ("<-- name_cache_search() "
             "found existing entry 0x%p\n", entry));
@@ -888,28 +1683,111 @@ static struct name_cache_entry* name_cache_search(
     return entry;
 }
 
+/*
+ * expects the caller to hold the directory shard lock of |entry|
+ *
+ * |dir| is the change attribute of the parent directory, if the
+ * caller knows it. If |entry| is visible, |change_out| returns its own
+ * change attribute for the lookup of the next component.
+ */
 static int entry_invis(
     IN struct name_cache_entry *entry,
+    IN OPTIONAL const struct name_cache_dir_change *dir,
+    OUT OPTIONAL struct name_cache_dir_change *change_out,
     OUT OPTIONAL bool *is_negative)
 {
-    /* name entry timer expired? */
-    if (!list_empty(&entry->exp_entry) && (UTIL_GETRELTIME() > entry->expiration)) {
-        DPRINTF(NCLVL2, ("name_entry_expired('%s')\n", entry->component));
-        return 1;
-    }
+    struct attr_cache_shard *shard;
+    int expired;
+
+    if (change_out) change_out->valid = false;
+
     /* negative lookup entry? */
     if (entry->attributes == NULL) {
+#ifdef NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE
+        if (entry->dir_change.valid && dir && dir->valid) {
+            if (dir->change != entry->dir_change.change) {
+                DPRINTF(NCLVL2, ("name_entry_negative('%s'): directory "
+                    "changed\n", entry->component));
+                InterlockedIncrement64(&entry->name_cache->negative_misses);
+                return 1;
+            }
+            /* unchanged directory, ignore the name entry timer */
+            if (is_negative) *is_negative = true;
+            DPRINTF(NCLVL2, ("name_entry_negative('%s'): directory "
+                "unchanged\n", entry->component));
+            InterlockedIncrement64(&entry->name_cache->negative_hits);
+            return 1;
+        }
+#endif /* NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE */
+        if (!list_empty(&entry->exp_entry) && (UTIL_GETRELTIME() > entry->expiration)) {
+            DPRINTF(NCLVL2, ("name_entry_expired('%s')\n", entry->component));
+            InterlockedIncrement64(&entry->name_cache->negative_misses);
+            return 1;
+        }
         if (is_negative) *is_negative = true;
         DPRINTF(NCLVL2, ("name_entry_negative('%s')\n", entry->component));
+        InterlockedIncrement64(&entry->name_cache->negative_hits);
+        return 1;
+    }
+    /* name entry timer expired? */
+    if (!list_empty(&entry->exp_entry) && (UTIL_GETRELTIME() > entry->expiration)) {
+        DPRINTF(NCLVL2, ("name_entry_expired('%s')\n", entry->component));
         return 1;
     }
     /* attribute entry expired? */
-    if (attr_cache_entry_expired(entry->attributes)) {
+    shard = attr_entry_shard(&entry->name_cache->attributes,
+        entry->attributes);
+    AcquireSRWLockShared(&shard->lock);
+    expired = attr_cache_entry_expired(entry->attributes);
+    if ((!expired) && change_out &&
+        (entry->attributes->nc_attrs & NC_ATTR_CHANGE)) {
+        change_out->change = entry->attributes->change;
+        change_out->valid = true;
+    }
+    ReleaseSRWLockShared(&shard->lock);
+    if (expired) {
         DPRINTF(NCLVL2, ("attr_entry_expired(%llu)\n",
             entry->attributes->fileid));
         return 1;
     }
     return 0;
+}
+
+/*
+ * Record the change attribute of the parent of the negative entry
+ * |entry|, see |entry_invis()|. Expects the caller to hold |lock|
+ * exclusive, or shared with the directory shard of |entry| held
+ * exclusive.
+ */
+static void name_cache_entry_set_negative(
+    IN struct name_cache_entry *entry,
+    IN const struct name_cache_dir_change *dir)
+{
+#ifdef NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE
+    if (entry->attributes == NULL)
+        entry->dir_change = *dir;
+#endif /* NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE */
+}
+
+/*
+ * Get the change attribute of the directory |dir|, if its cached
+ * attributes are still valid. Must not be called with a directory
+ * shard lock held.
+ */
+static void name_cache_dir_change_get(
+    IN struct nfs41_name_cache *cache,
+    IN struct name_cache_entry *dir,
+    OUT struct name_cache_dir_change *change_out)
+{
+    change_out->valid = false;
+#ifdef NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE
+    struct name_cache_dir_shard *shard = name_entry_dir_shard(cache, dir);
+
+    AcquireSRWLockShared(&shard->lock);
+    if (dir->attributes)
+        (void)entry_invis(dir, NULL, change_out, NULL);
+    ReleaseSRWLockShared(&shard->lock);
+#endif /* NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE */
 }
 
 static int name_cache_lookup(
@@ -923,8 +1801,11 @@ static int name_cache_lookup(
     OUT OPTIONAL bool *is_negative)
 {
     struct name_cache_entry *parent, *target;
+    struct name_cache_dir_shard *dir;
+    struct name_cache_dir_change dir_change = { 0 }, target_change = { 0 };
     nfs41_component component;
     const char *path_pos;
+    int invis;
     int status = NO_ERROR;
 
     DPRINTF(NCLVL1, ("--> name_cache_lookup('%s')\n", path));
@@ -933,7 +1814,12 @@ static int name_cache_lookup(
     target = cache->root;
     component.name = path_pos = path;
 
-    if (target == NULL || (skip_invis && entry_invis(target, is_negative))) {
+    dir = name_cache_dir_shard(cache, NULL);
+    AcquireSRWLockShared(&dir->lock);
+    invis = target == NULL ||
+        (skip_invis && entry_invis(target, NULL, &dir_change, is_negative));
+    ReleaseSRWLockShared(&dir->lock);
+    if (invis) {
         target = NULL;
         status = ERROR_PATH_NOT_FOUND;
         goto out;
@@ -941,9 +1827,16 @@ static int name_cache_lookup(
 
     while (next_component(path_pos, path_end, &component)) {
         parent = target;
+        dir = name_cache_dir_shard(cache, parent);
+        AcquireSRWLockShared(&dir->lock);
         target = name_cache_search(cache, parent, &component);
+        invis = target == NULL ||
+            (skip_invis &&
+                entry_invis(target, &dir_change, &target_change, is_negative));
+        ReleaseSRWLockShared(&dir->lock);
+        dir_change = target_change;
         path_pos = component.name + component.len;
-        if (target == NULL || (skip_invis && entry_invis(target, is_negative))) {
+        if (invis) {
             target = NULL;
             if (is_last_component(component.name, path_end))
                 status = ERROR_FILE_NOT_FOUND;
@@ -968,8 +1861,18 @@ static int name_cache_insert(
 
     DPRINTF(NCLVL2, ("--> name_cache_insert('%s')\n", entry->component));
 
-    if (RB_INSERT(name_tree, &parent->rbchildren, entry))
+    if (RB_INSERT(name_tree, &parent->rbchildren, entry)) {
         status = ERROR_FILE_EXISTS;
+    }
+    else {
+        parent->num_children++;
+        if (parent->child_index &&
+            ((parent->child_index->used + 1) * 2 <=
+                parent->child_index->size))
+            name_child_index_add(parent->child_index, entry);
+        else if (parent->num_children >= NC_CHILD_INDEX_MIN)
+            name_child_index_build(parent);
+    }
     entry->parent = parent;
 
     DPRINTF(NCLVL2, ("<-- name_cache_insert() returning %u\n", status));
@@ -1012,18 +1915,40 @@ out_err:
 
 /* public name cache interface, declared in name_cache.h */
 
-/* assuming no hard links, calculate how many entries will fit in the cache */
-#define SIZE_PER_ENTRY (ATTR_ENTRY_SIZE + NAME_ENTRY_SIZE)
-#define NAME_CACHE_MAX_ENTRIES (NAME_CACHE_MAX_SIZE / SIZE_PER_ENTRY)
+/* assuming no hard links, calculate how many files will fit in the cache */
+#define SIZE_PER_ENTRY \
+    (ATTR_ENTRY_SIZE + NAME_ENTRY_SIZE + NC_COMPONENT_AVG_SIZE)
+
+void nfs41_name_cache_config_init(
+    OUT nfs41_name_cache_config *config,
+    IN uint32_t acregmin,
+    IN uint32_t acregmax,
+    IN uint32_t acdirmin,
+    IN uint32_t acdirmax,
+    IN uint32_t size_mb)
+{
+    config->acregmax = acregmax;
+    config->acregmin = min(acregmin, acregmax);
+    config->acdirmax = acdirmax;
+    config->acdirmin = min(acdirmin, acdirmax);
+    /* keep at least 1MB, so the entry pools are never empty */
+    config->max_size = max(size_mb, 1) * 1024UL * 1024UL;
+}
 
 int nfs41_name_cache_create(
+    IN const nfs41_name_cache_config *config,
     OUT struct nfs41_name_cache **cache_out)
 {
     struct nfs41_name_cache *cache;
+    uint32_t attr_entries;
+    uint32_t i;
     int status = NO_ERROR;
 
-    DPRINTF(NCLVL1, ("nfs41_name_cache_create() with %ld entries\n",
-        (long)NAME_CACHE_MAX_ENTRIES));
+    DPRINTF(NCLVL1, ("nfs41_name_cache_create() with %ld entries, "
+        "acregmin=%u acregmax=%u acdirmin=%u acdirmax=%u\n",
+        (long)(config->max_size / SIZE_PER_ENTRY),
+        (unsigned)config->acregmin, (unsigned)config->acregmax,
+        (unsigned)config->acdirmin, (unsigned)config->acdirmax));
 
     /* allocate the cache */
     cache = calloc(1, sizeof(struct nfs41_name_cache));
@@ -1053,10 +1978,28 @@ int nfs41_name_cache_create(
     ucol_setStrength(cache->icu_coll, UCOL_SECONDARY);
 
     list_init(&cache->exp_entries);
-    cache->expiration = NAME_CACHE_EXPIRATION;
-    cache->max_entries = NAME_CACHE_MAX_ENTRIES;
-    cache->max_delegations = NAME_CACHE_MAX_ENTRIES / 2;
+    /* "actimeo=0" disables the cache */
+    cache->enabled = (config->acregmax > 0) || (config->acdirmax > 0);
+    cache->expiration = config->acdirmin;
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING
+    /* names are bounded by |name_cache_over_budget()| */
+    cache->max_size = config->max_size;
+    cache->max_entries = (uint32_t)(config->max_size / NAME_SIZE_PER_ENTRY);
+    attr_entries = (uint32_t)(config->max_size / SIZE_PER_ENTRY);
+#else
+    cache->max_entries = config->max_size / SIZE_PER_ENTRY;
+    attr_entries = cache->max_entries;
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING */
+    cache->max_delegations = attr_entries / 2;
+    cache->attributes.regmin = config->acregmin;
+    cache->attributes.regmax = config->acregmax;
+    cache->attributes.dirmin = config->acdirmin;
+    cache->attributes.dirmax = config->acdirmax;
     InitializeSRWLock(&cache->lock);
+    InitializeSRWLock(&cache->lru_lock);
+    InitializeSRWLock(&cache->components.lock);
+    for (i = 0; i < NAME_CACHE_DIR_SHARDS; i++)
+        InitializeSRWLock(&cache->dirs[i].lock);
 
     /* allocate a pool of entries */
     cache->pool = calloc(cache->max_entries, NAME_ENTRY_SIZE);
@@ -1065,8 +2008,13 @@ int nfs41_name_cache_create(
         goto out_err_cache;
     }
 
-    /* initialize the attribute cache */
-    status = attr_cache_init(&cache->attributes, cache->max_entries);
+    /*
+     * initialize the attribute cache, with some slack because the
+     * entries are split over |ATTR_CACHE_SHARDS| shards by fileid,
+     * which will never be perfectly balanced
+     */
+    status = attr_cache_init(&cache->attributes,
+        attr_entries + attr_entries / 4);
     if (status)
         goto out_err_pool;
 
@@ -1084,14 +2032,40 @@ out_err_cache:
     goto out;
 }
 
+static void name_cache_print_stats(
+    IN struct nfs41_name_cache *cache)
+{
+    uint32_t i;
+
+    DPRINTF(NCLVL1, ("name cache negative entries: hits=%lld misses=%lld\n",
+        (long long)cache->negative_hits,
+        (long long)cache->negative_misses));
+    for (i = 0; i < NAME_CACHE_DIR_SHARDS; i++) {
+        DPRINTF(NCLVL1, ("name cache dir shard %u: hits=%lld misses=%lld\n",
+            (unsigned int)i,
+            (long long)cache->dirs[i].hits,
+            (long long)cache->dirs[i].misses));
+    }
+    for (i = 0; i < ATTR_CACHE_SHARDS; i++) {
+        DPRINTF(NCLVL1, ("attr cache shard %u: hits=%lld misses=%lld\n",
+            (unsigned int)i,
+            (long long)cache->attributes.shards[i].hits,
+            (long long)cache->attributes.shards[i].misses));
+    }
+}
+
 int nfs41_name_cache_free(
     IN struct nfs41_name_cache **cache_out)
 {
     struct nfs41_name_cache *cache = *cache_out;
+    uint32_t i;
     int status = NO_ERROR;
 
     DPRINTF(NCLVL1, ("nfs41_name_cache_free()\n"));
 
+    if (DPRINTF_LEVEL_ENABLED(NCLVL1))
+        name_cache_print_stats(cache);
+
     /* free the attribute cache */
     attr_cache_free(&cache->attributes);
 
@@ -1100,19 +2074,29 @@ int nfs41_name_cache_free(
         ucol_close(cache->icu_coll);
     }
 
-    /* free the name entry pool */
+    /* free the child indexes, name entry pool and component storage */
+    for (i = 0; i < cache->entries; i++)
+        free(cache->pool[i].child_index);
     free(cache->pool);
+    name_component_arena_free(&cache->components);
     free(cache);
     *cache_out = NULL;
     return status;
 }
 
 static __inline void copy_fh(
+    IN struct nfs41_name_cache *cache,
     OUT nfs41_fh *dst,
     IN OPTIONAL const struct name_cache_entry *src)
 {
-    if (src)
+    struct name_cache_dir_shard *dir;
+
+    if (src) {
+        dir = name_entry_dir_shard(cache, src);
+        AcquireSRWLockShared(&dir->lock);
         fh_copy(dst, &src->fh);
+        ReleaseSRWLockShared(&dir->lock);
+    }
     else
         dst->len = 0;
 }
@@ -1129,6 +2113,8 @@ int nfs41_name_cache_lookup(
     OUT OPTIONAL bool *is_negative)
 {
     struct name_cache_entry *parent, *target;
+    struct name_cache_dir_shard *dir;
+    struct attr_cache_shard *shard;
     const char *path_pos = path;
     int status;
 
@@ -1144,10 +2130,27 @@ int nfs41_name_cache_lookup(
     status = name_cache_lookup(cache, 1, path, path_end,
         &path_pos, &parent, &target, is_negative);
 
-    if (parent_out) copy_fh(parent_out, parent);
-    if (target_out) copy_fh(target_out, target);
-    if (info_out && target && target->attributes)
-        copy_attrs(info_out, target->attributes);
+    dir = name_cache_dir_shard(cache, parent);
+    if (status == NO_ERROR)
+        InterlockedIncrement64(&dir->hits);
+    else
+        InterlockedIncrement64(&dir->misses);
+    NFSD_TRACE_EVENT("NameCacheLookup", NFSD_TRACE_KEYWORD_CACHE,
+        TraceLoggingBool(status == NO_ERROR, "Hit"),
+        TraceLoggingBool(is_negative && *is_negative, "Negative"));
+
+    if (parent_out) copy_fh(cache, parent_out, parent);
+    if (target_out) copy_fh(cache, target_out, target);
+    if (info_out && target) {
+        AcquireSRWLockShared(&dir->lock);
+        if (target->attributes) {
+            shard = attr_entry_shard(&cache->attributes, target->attributes);
+            AcquireSRWLockShared(&shard->lock);
+            copy_attrs(info_out, target->attributes);
+            ReleaseSRWLockShared(&shard->lock);
+        }
+        ReleaseSRWLockShared(&dir->lock);
+    }
 
 out_unlock:
     ReleaseSRWLockShared(&cache->lock);
@@ -1156,11 +2159,100 @@ out_unlock:
     return status;
 }
 
+/*
+ * Fileid index
+ *
+ * Each attribute entry points back to the name entry which last
+ * updated it (from LOOKUP, READDIR, OPEN etc.), so that a cached file
+ * can be found by its fileid for |FILE_OPEN_BY_FILE_ID|. The pointer
+ * is not cleared when the name entry is unlinked or reused; name
+ * entries come from |nfs41_name_cache.pool|, so the lookup only has
+ * to check (with the cache lock held exclusive) that the name entry
+ * still uses these attributes and is still linked to |root|.
+ */
+int nfs41_name_cache_fileid_lookup(
+    IN struct nfs41_name_cache *cache,
+    IN uint64_t fileid,
+    OUT nfs41_abs_path *path_out,
+    OUT nfs41_fh *parent_out,
+    OUT nfs41_fh *target_out,
+    OUT OPTIONAL nfs41_file_info *info_out)
+{
+    struct attr_cache_shard *shard =
+        attr_cache_shard(&cache->attributes, fileid);
+    struct attr_cache_entry *attributes;
+    struct name_cache_entry *target = NULL, *entry;
+    size_t len = 0;
+    char *pos;
+    int status = ERROR_FILE_NOT_FOUND;
+
+    DPRINTF(NCLVL1, ("--> nfs41_name_cache_fileid_lookup(%llu)\n",
+        fileid));
+
+    AcquireSRWLockExclusive(&cache->lock);
+
+    if (!name_cache_enabled(cache)) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out_unlock;
+    }
+    if (cache->root == NULL)
+        goto out_unlock;
+
+    AcquireSRWLockShared(&shard->lock);
+    attributes = attr_cache_search(shard, fileid);
+    if (attributes && !attributes->invalidated &&
+        attributes->name_entry &&
+        (attributes->name_entry->attributes == attributes)) {
+        target = attributes->name_entry;
+        if (info_out)
+            copy_attrs(info_out, attributes);
+    }
+    ReleaseSRWLockShared(&shard->lock);
+
+    if ((target == NULL) || (target == cache->root) ||
+        (target->fh.len == 0))
+        goto out_unlock;
+
+    /* measure the path, and fail if an entry is no longer linked */
+    for (entry = target; entry != cache->root; entry = entry->parent) {
+        if (entry == NULL)
+            goto out_unlock;
+        len += 1 + entry->component_len;
+        if (len >= NFS41_MAX_PATH_LEN) {
+            status = ERROR_FILENAME_EXCED_RANGE;
+            goto out_unlock;
+        }
+    }
+
+    /* build "\dir\...\name" backwards from its end */
+    AcquireSRWLockExclusive(&path_out->lock);
+    pos = path_out->path + len;
+    *pos = '\0';
+    for (entry = target; entry != cache->root; entry = entry->parent) {
+        pos -= entry->component_len;
+        (void)memcpy(pos, entry->component, entry->component_len);
+        *--pos = '\\';
+    }
+    path_out->len = (unsigned short)len;
+    ReleaseSRWLockExclusive(&path_out->lock);
+
+    fh_copy(target_out, &target->fh);
+    fh_copy(parent_out, &target->parent->fh);
+    status = NO_ERROR;
+
+out_unlock:
+    ReleaseSRWLockExclusive(&cache->lock);
+    DPRINTF(NCLVL1, ("<-- nfs41_name_cache_fileid_lookup('%s') "
+        "returning %d\n", status ? "" : path_out->path, status));
+    return status;
+}
+
 int nfs41_attr_cache_lookup(
     IN struct nfs41_name_cache *cache,
     IN uint64_t fileid,
     OUT nfs41_file_info *info_out)
 {
+    struct attr_cache_shard *shard;
     struct attr_cache_entry *entry;
     int status = NO_ERROR;
 
@@ -1169,23 +2261,31 @@ int nfs41_attr_cache_lookup(
     /* No name argument, so no lookups by name */
     NC_CLEAR_NAMECMP();
 
-    AcquireSRWLockShared(&cache->lock);
-
     if (!name_cache_enabled(cache)) {
         status = ERROR_NOT_SUPPORTED;
-        goto out_unlock;
+        goto out;
     }
 
-    entry = attr_cache_search(&cache->attributes, fileid);
+    /* only the shard lock, the name tree is not involved */
+    shard = attr_cache_shard(&cache->attributes, fileid);
+    AcquireSRWLockShared(&shard->lock);
+
+    entry = attr_cache_search(shard, fileid);
     if (entry == NULL || attr_cache_entry_expired(entry)) {
+        InterlockedIncrement64(&shard->misses);
         status = ERROR_FILE_NOT_FOUND;
         goto out_unlock;
     }
 
     copy_attrs(info_out, entry);
+    InterlockedIncrement64(&shard->hits);
 
 out_unlock:
-    ReleaseSRWLockShared(&cache->lock);
+    ReleaseSRWLockShared(&shard->lock);
+    NFSD_TRACE_EVENT("AttrCacheLookup", NFSD_TRACE_KEYWORD_CACHE,
+        TraceLoggingUInt64(fileid, "FileId"),
+        TraceLoggingBool(status == NO_ERROR, "Hit"));
+out:
 
     DPRINTF(NCLVL1, ("<-- nfs41_attr_cache_lookup() returning %d\n", status));
     return status;
@@ -1196,6 +2296,7 @@ int nfs41_attr_cache_update(
     IN uint64_t fileid,
     IN const nfs41_file_info *info)
 {
+    struct attr_cache_shard *shard;
     struct attr_cache_entry *entry;
     int status = NO_ERROR;
 
@@ -1204,28 +2305,77 @@ int nfs41_attr_cache_update(
     /* No name argument, so no lookups by name */
     NC_CLEAR_NAMECMP();
 
-    AcquireSRWLockExclusive(&cache->lock);
-
     if (!name_cache_enabled(cache)) {
         status = ERROR_NOT_SUPPORTED;
-        goto out_unlock;
+        goto out;
     }
 
-    entry = attr_cache_search(&cache->attributes, fileid);
+    shard = attr_cache_shard(&cache->attributes, fileid);
+    AcquireSRWLockExclusive(&shard->lock);
+
+    entry = attr_cache_search(shard, fileid);
     if (entry == NULL) {
         status = ERROR_FILE_NOT_FOUND;
         goto out_unlock;
     }
 
-    attr_cache_update(entry, info, OPEN_DELEGATE_NONE);
+    attr_cache_update(&cache->attributes, entry, info, OPEN_DELEGATE_NONE);
 
 out_unlock:
-    ReleaseSRWLockExclusive(&cache->lock);
+    ReleaseSRWLockExclusive(&shard->lock);
+out:
 
     DPRINTF(NCLVL1, ("<-- nfs41_attr_cache_update() returning %d\n", status));
     return status;
 }
 
+/*
+ * Fast path for |nfs41_name_cache_insert()|: refresh an existing entry
+ * with |lock| held shared and the directory shard of its parent held
+ * exclusive. Returns |false| if the insert has to change the structure
+ * of the name tree, or needs a new attribute entry (which may fail).
+ */
+static bool name_cache_insert_shared(
+    IN struct nfs41_name_cache *cache,
+    IN const char *path,
+    IN const nfs41_component *name,
+    IN OPTIONAL const nfs41_fh *fh,
+    IN OPTIONAL const nfs41_file_info *info)
+{
+    struct name_cache_entry *parent, *target;
+    struct name_cache_dir_shard *dir;
+    struct name_cache_dir_change dir_change = { 0 };
+    bool done = false;
+
+    AcquireSRWLockShared(&cache->lock);
+
+    if (!name_cache_enabled(cache))
+        goto out_unlock;
+
+    if (name_cache_lookup(cache, 0, path,
+        name->name, NULL, NULL, &parent, NULL))
+        goto out_unlock;
+
+    if (info == NULL)
+        name_cache_dir_change_get(cache, parent, &dir_change);
+
+    dir = name_cache_dir_shard(cache, parent);
+    AcquireSRWLockExclusive(&dir->lock);
+    target = name_cache_search(cache, parent, name);
+    if (target && (info == NULL || target->attributes)) {
+        (void)name_cache_entry_update(cache, target, fh, info,
+            OPEN_DELEGATE_NONE);
+        if (info == NULL)
+            name_cache_entry_set_negative(target, &dir_change);
+        done = true;
+    }
+    ReleaseSRWLockExclusive(&dir->lock);
+
+out_unlock:
+    ReleaseSRWLockShared(&cache->lock);
+    return done;
+}
+
 int nfs41_name_cache_insert(
     IN struct nfs41_name_cache *cache,
     IN bool caseinsensitivesearch,
@@ -1244,6 +2394,14 @@ int nfs41_name_cache_insert(
 
     NC_SET_NAMECMP(caseinsensitivesearch);
 
+    /* most inserts just refresh an existing entry */
+    if ((cinfo == NULL) && (!is_delegation(delegation)) &&
+        (path != NULL) && (name != NULL) && (name->len != 0) &&
+        name_cache_insert_shared(cache, path, name, fh, info)) {
+        status = NO_ERROR;
+        goto out;
+    }
+
     AcquireSRWLockExclusive(&cache->lock);
 
     if (!name_cache_enabled(cache)) {
@@ -1290,8 +2448,15 @@ int nfs41_name_cache_insert(
     if (status)
         goto out_err_update;
 
+    if ((info == NULL) && (target != cache->root)) {
+        struct name_cache_dir_change dir_change;
+        name_cache_dir_change_get(cache, parent, &dir_change);
+        name_cache_entry_set_negative(target, &dir_change);
+    }
+
 out_unlock:
     ReleaseSRWLockExclusive(&cache->lock);
+out:
     NC_CLEAR_NAMECMP();
 
     DPRINTF(NCLVL1, ("<-- nfs41_name_cache_insert() returning %d\n",
@@ -1307,10 +2472,15 @@ out_err_deleg:
     if (is_delegation(delegation)) {
         /* we still need a reference to the attributes for the delegation */
         struct attr_cache_entry *attributes;
+        struct attr_cache_shard *shard;
         status = attr_cache_find_or_create(&cache->attributes,
             info->fileid, &attributes);
         if (status == NO_ERROR) {
-            attr_cache_update(attributes, info, delegation);
+            shard = attr_entry_shard(&cache->attributes, attributes);
+            AcquireSRWLockExclusive(&shard->lock);
+            attr_cache_update(&cache->attributes, attributes,
+                info, delegation);
+            ReleaseSRWLockExclusive(&shard->lock);
             cache->delegations++;
         }
         else
@@ -1328,6 +2498,7 @@ int nfs41_name_cache_delegreturn(
 {
     struct name_cache_entry *parent, *target;
     struct attr_cache_entry *attributes;
+    struct attr_cache_shard *shard;
     int status;
 
     DPRINTF(NCLVL1, ("--> nfs41_name_cache_delegreturn(%llu, '%s')\n",
@@ -1351,24 +2522,33 @@ int nfs41_name_cache_delegreturn(
 
         attributes = target->attributes;
     } else {
-        /* should still have an attr cache entry */
-        attributes = attr_cache_search(&cache->attributes, fileid);
+        attributes = NULL;
     }
 
+    shard = attr_cache_shard(&cache->attributes,
+        attributes ? attributes->fileid : fileid);
+    AcquireSRWLockExclusive(&shard->lock);
+
+    /* should still have an attr cache entry */
+    if (attributes == NULL)
+        attributes = attr_cache_search(shard, fileid);
+
     if (attributes == NULL) {
         status = ERROR_FILE_NOT_FOUND;
-        goto out_unlock;
+        goto out_unlock_shard;
     }
 
     /* release the reference from name_cache_entry_update() */
     if (attributes->delegated) {
         attributes->delegated = FALSE;
-        attr_cache_entry_deref(&cache->attributes, attributes);
+        attr_cache_entry_deref(shard, attributes);
         EASSERT(cache->delegations > 0);
         cache->delegations--;
     }
     status = NO_ERROR;
 
+out_unlock_shard:
+    ReleaseSRWLockExclusive(&shard->lock);
 out_unlock:
     ReleaseSRWLockExclusive(&cache->lock);
     NC_CLEAR_NAMECMP();
@@ -1387,6 +2567,7 @@ int nfs41_name_cache_remove(
 {
     struct name_cache_entry *parent, *target;
     struct attr_cache_entry *attributes = NULL;
+    struct attr_cache_shard *shard;
     int status;
 
     DPRINTF(NCLVL1, ("--> nfs41_name_cache_remove('%s')\n", path));
@@ -1413,12 +2594,21 @@ int nfs41_name_cache_remove(
     if (status == ERROR_FILE_NOT_FOUND)
         goto out_attributes;
 
-    if (target->attributes)
+    if (target->attributes) {
+        shard = attr_entry_shard(&cache->attributes, target->attributes);
+        AcquireSRWLockExclusive(&shard->lock);
         target->attributes->numlinks--;
+        ReleaseSRWLockExclusive(&shard->lock);
+    }
 
     /* make this a negative entry and unlink children */
     name_cache_entry_update(cache, target, NULL, NULL, OPEN_DELEGATE_NONE);
     name_cache_unlink_children_recursive(cache, target);
+    if (cinfo) {
+        struct name_cache_dir_change dir_change;
+        name_cache_dir_change_get(cache, parent, &dir_change);
+        name_cache_entry_set_negative(target, &dir_change);
+    }
 
 out_unlock:
     ReleaseSRWLockExclusive(&cache->lock);
@@ -1431,9 +2621,12 @@ out_attributes:
     /* in the presence of other links, we need to update numlinks
      * regardless of a failure to find the target entry */
     DPRINTF(NCLVL1, ("nfs41_name_cache_remove: need to find attributes for '%s'\n", path));
-    attributes = attr_cache_search(&cache->attributes, fileid);
+    shard = attr_cache_shard(&cache->attributes, fileid);
+    AcquireSRWLockExclusive(&shard->lock);
+    attributes = attr_cache_search(shard, fileid);
     if (attributes)
         attributes->numlinks--;
+    ReleaseSRWLockExclusive(&shard->lock);
     goto out_unlock;
 }
 
@@ -1514,13 +2707,24 @@ int nfs41_name_cache_rename(
 
         /* move the src entry under dst_parent */
         name_cache_remove(src, src_parent);
-        name_cache_entry_rename(src, dst_name);
+        if (name_cache_entry_rename(cache, src, dst_name)) {
+            /* out of component storage, forget both entries */
+            name_cache_unlink(cache, src);
+            if (existing)
+                name_cache_unlink(cache, existing);
+            goto out_unlock;
+        }
         name_cache_insert(src, dst_parent);
 
         if (existing) {
             /* recycle 'existing' as the negative entry 'src' */
-            name_cache_entry_rename(existing, src_name);
-            name_cache_insert(existing, src_parent);
+            if (name_cache_entry_rename(cache, existing, src_name)) {
+                name_cache_unlink(cache, existing);
+                existing = NULL;
+            }
+            else {
+                name_cache_insert(existing, src_parent);
+            }
         }
         src = existing;
     }
@@ -1539,6 +2743,11 @@ int nfs41_name_cache_rename(
     }
     name_cache_entry_update(cache, src, NULL, NULL, OPEN_DELEGATE_NONE);
     name_cache_unlink_children_recursive(cache, src);
+    {
+        struct name_cache_dir_change dir_change;
+        name_cache_dir_change_get(cache, src_parent, &dir_change);
+        name_cache_entry_set_negative(src, &dir_change);
+    }
 
 out_unlock:
     ReleaseSRWLockExclusive(&cache->lock);
@@ -1548,6 +2757,259 @@ out_unlock:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+int nfs41_name_cache_dir_notify(
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path,
+    IN const nfs41_component *name,
+    IN OPTIONAL const nfs41_component *child)
+{
+    struct name_cache_entry *target, *entry;
+    struct attr_cache_shard *shard;
+    int status;
+
+    DPRINTF(NCLVL1, ("--> nfs41_name_cache_dir_notify('%s', '%.*s')\n",
+        path, child ? (int)child->len : 0, child ? child->name : ""));
+
+    NC_SET_NAMECMP(caseinsensitivesearch);
+
+    AcquireSRWLockExclusive(&cache->lock);
+
+    if (!name_cache_enabled(cache)) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out_unlock;
+    }
+
+    status = name_cache_lookup(cache, 0, path,
+        name->name + name->len, NULL, NULL, &target, NULL);
+    if (status)
+        goto out_unlock;
+
+    if (child) {
+        /* forget the entry, the next lookup goes to the server */
+        entry = name_cache_search(cache, target, child);
+        if (entry)
+            name_cache_unlink(cache, entry);
+    } else if (target->attributes) {
+        /* the directory's own attributes changed, but its children
+         * stay valid; entry_invis() refetches the attributes */
+        shard = attr_entry_shard(&cache->attributes, target->attributes);
+        AcquireSRWLockExclusive(&shard->lock);
+        target->attributes->invalidated = 1;
+        ReleaseSRWLockExclusive(&shard->lock);
+    }
+
+out_unlock:
+    ReleaseSRWLockExclusive(&cache->lock);
+    NC_CLEAR_NAMECMP();
+
+    DPRINTF(NCLVL1, ("<-- nfs41_name_cache_dir_notify() returning %d\n",
+        status));
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+int nfs41_name_cache_pin(
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path,
+    IN bool pin)
+{
+    struct name_cache_entry *target;
+    int status;
+
+    DPRINTF(NCLVL1, ("--> nfs41_name_cache_pin('%s', pin=%d)\n",
+        path, (int)pin));
+
+    NC_SET_NAMECMP(caseinsensitivesearch);
+
+    AcquireSRWLockExclusive(&cache->lock);
+
+    if (!name_cache_enabled(cache)) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out_unlock;
+    }
+
+    status = name_cache_lookup(cache, 0, path,
+        path + strlen(path), NULL, NULL, &target, NULL);
+    if (status)
+        goto out_unlock;
+
+    target->pinned = pin;
+
+out_unlock:
+    ReleaseSRWLockExclusive(&cache->lock);
+    NC_CLEAR_NAMECMP();
+
+    DPRINTF(NCLVL1, ("<-- nfs41_name_cache_pin() returning %d\n",
+        status));
+    return status;
+}
+
+int nfs41_name_cache_flush(
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path)
+{
+    struct name_cache_entry *target, *entry, *tmp;
+    struct attr_cache_shard *shard;
+    int status;
+
+    DPRINTF(NCLVL1, ("--> nfs41_name_cache_flush('%s')\n", path));
+
+    NC_SET_NAMECMP(caseinsensitivesearch);
+
+    AcquireSRWLockExclusive(&cache->lock);
+
+    if (!name_cache_enabled(cache)) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out_unlock;
+    }
+
+    status = name_cache_lookup(cache, 0, path,
+        path + strlen(path), NULL, NULL, &target, NULL);
+    if (status)
+        goto out_unlock;
+
+    /* forget everything below |target|, but keep |target| itself
+     * linked so the tree above it (and the root) stay intact */
+    RB_FOREACH_SAFE(entry, name_tree, &target->rbchildren, tmp)
+        name_cache_entry_invalidate(cache, entry);
+
+    if (target->attributes) {
+        shard = attr_entry_shard(&cache->attributes, target->attributes);
+        AcquireSRWLockExclusive(&shard->lock);
+        target->attributes->invalidated = 1;
+        ReleaseSRWLockExclusive(&shard->lock);
+    }
+
+out_unlock:
+    ReleaseSRWLockExclusive(&cache->lock);
+    NC_CLEAR_NAMECMP();
+
+    DPRINTF(NCLVL1, ("<-- nfs41_name_cache_flush() returning %d\n",
+        status));
+    return status;
+}
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
+
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+/* copy the fh and attributes of a positive entry, must be called
+ * with |cache->lock| held */
+static bool name_cache_entry_get(
+    IN struct nfs41_name_cache *cache,
+    IN struct name_cache_entry *entry,
+    OUT nfs41_fh *fh,
+    OUT nfs41_file_info *info)
+{
+    struct name_cache_dir_shard *dir = name_entry_dir_shard(cache, entry);
+    struct attr_cache_shard *shard;
+    bool found = false;
+
+    AcquireSRWLockShared(&dir->lock);
+    if (entry->attributes && entry->fh.len) {
+        shard = attr_entry_shard(&cache->attributes, entry->attributes);
+        AcquireSRWLockShared(&shard->lock);
+        if (!entry->attributes->invalidated) {
+            fh_copy(fh, &entry->fh);
+            copy_attrs(info, entry->attributes);
+            found = true;
+        }
+        ReleaseSRWLockShared(&shard->lock);
+    }
+    ReleaseSRWLockShared(&dir->lock);
+    return found;
+}
+
+int nfs41_name_cache_walk(
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path,
+    IN nfs41_name_cache_walk_fn fn,
+    IN void *context)
+{
+    struct name_cache_entry *target, *child, **queue = NULL, **tmp;
+    nfs41_component name;
+    nfs41_fh fh;
+    nfs41_file_info *info;
+    uint32_t head = 0, tail = 0, size = 0;
+    int status;
+
+    DPRINTF(NCLVL1, ("--> nfs41_name_cache_walk('%s')\n", path));
+
+    info = malloc(sizeof(nfs41_file_info));
+    if (info == NULL) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto out;
+    }
+
+    NC_SET_NAMECMP(caseinsensitivesearch);
+
+    /* shared, so lookups go on while the tree is walked */
+    AcquireSRWLockShared(&cache->lock);
+
+    if (!name_cache_enabled(cache)) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out_unlock;
+    }
+
+    status = name_cache_lookup(cache, 0, path,
+        path + strlen(path), NULL, NULL, &target, NULL);
+    if (status)
+        goto out_unlock;
+
+    (void)last_component(path, path + strlen(path), &name);
+    (void)memset(info, 0, sizeof(nfs41_file_info));
+    if (!name_cache_entry_get(cache, target, &fh, info) ||
+        !fn(context, UINT32_MAX, &name, &fh, info)) {
+        status = ERROR_PATH_NOT_FOUND;
+        goto out_unlock;
+    }
+
+    /* |queue[i]| is the entry which got index |i| */
+    size = 1024;
+    queue = malloc(size * sizeof(*queue));
+    if (queue == NULL) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto out_unlock;
+    }
+    queue[tail++] = target;
+
+    for (head = 0; head < tail; head++) {
+        RB_FOREACH(child, name_tree, &queue[head]->rbchildren) {
+            (void)memset(info, 0, sizeof(nfs41_file_info));
+            if (!name_cache_entry_get(cache, child, &fh, info))
+                continue;
+            name.name = child->component;
+            name.len = child->component_len;
+            if (!fn(context, head, &name, &fh, info))
+                continue;
+            if (tail == size) {
+                tmp = realloc(queue, 2 * size * sizeof(*queue));
+                if (tmp == NULL) {
+                    status = ERROR_NOT_ENOUGH_MEMORY;
+                    goto out_unlock;
+                }
+                queue = tmp;
+                size *= 2;
+            }
+            queue[tail++] = child;
+        }
+    }
+out_unlock:
+    ReleaseSRWLockShared(&cache->lock);
+    NC_CLEAR_NAMECMP();
+out:
+    free(queue);
+    free(info);
+    DPRINTF(NCLVL1, ("<-- nfs41_name_cache_walk() returning %d\n",
+        status));
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
+
 /* nfs41_name_cache_resolve_fh() */
 
 /*
@@ -1576,9 +3038,11 @@ static bool get_path_fhs(
     OUT uint32_t *count)
 {
     struct name_cache_entry *target;
+    struct name_cache_dir_shard *dir;
     const char *path_end = path->path + path->len;
     nfs41_component *name;
     uint32_t i;
+    int invis;
     int status;
 
     *count = 0;
@@ -1599,16 +3063,21 @@ static bool get_path_fhs(
             break;
         *path_pos = name->name + name->len;
 
+        dir = name_cache_dir_shard(cache, target);
+        AcquireSRWLockShared(&dir->lock);
         target = name_cache_search(cache, target, name);
-        if (target == NULL || entry_invis(target, NULL)) {
+        invis = target == NULL || entry_invis(target, NULL, NULL, NULL);
+        /* make copies for use outside of cache->lock */
+        if (!invis)
+            fh_copy(&files[i].fh, &target->fh);
+        ReleaseSRWLockShared(&dir->lock);
+        if (invis) {
             if (is_last_component(name->name, path_end))
                 status = ERROR_FILE_NOT_FOUND;
             else
                 status = ERROR_PATH_NOT_FOUND;
             goto out_unlock;
         }
-        /* make copies for use outside of cache->lock */
-        fh_copy(&files[i].fh, &target->fh);
         (*count)++;
     }
 
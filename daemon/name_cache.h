@@ -53,7 +53,20 @@ int nfs41_attr_cache_update(
 
 
 /* name cache */
+
+/* attribute and name timeout of "immutable" mounts, in seconds */
+#define NAME_CACHE_IMMUTABLE_TTL (UINT32_MAX/2)
+
+void nfs41_name_cache_config_init(
+    OUT nfs41_name_cache_config *config,
+    IN uint32_t acregmin,
+    IN uint32_t acregmax,
+    IN uint32_t acdirmin,
+    IN uint32_t acdirmax,
+    IN uint32_t size_mb);
+
 int nfs41_name_cache_create(
+    IN const nfs41_name_cache_config *config,
     OUT struct nfs41_name_cache **cache_out);
 
 int nfs41_name_cache_free(
@@ -70,6 +83,14 @@ int nfs41_name_cache_lookup(
     OUT OPTIONAL nfs41_file_info *info_out,
     OUT OPTIONAL bool *is_negative);
 
+int nfs41_name_cache_fileid_lookup(
+    IN struct nfs41_name_cache *cache,
+    IN uint64_t fileid,
+    OUT nfs41_abs_path *path_out,
+    OUT nfs41_fh *parent_out,
+    OUT nfs41_fh *target_out,
+    OUT OPTIONAL nfs41_file_info *info_out);
+
 int nfs41_name_cache_insert(
     IN struct nfs41_name_cache *cache,
     IN bool caseinsensitivesearch,
@@ -105,6 +126,56 @@ int nfs41_name_cache_rename(
     IN const nfs41_component *dst_name,
     IN const change_info4 *dst_cinfo);
 
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+/* CB_NOTIFY for the directory |path|: forget the entry |child|, or
+ * invalidate the directory's attributes if |child| is NULL */
+int nfs41_name_cache_dir_notify(
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path,
+    IN const nfs41_component *name,
+    IN OPTIONAL const nfs41_component *child);
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+/* exempt the entry of |path| and everything below it from eviction;
+ * pinned entries still expire and get revalidated */
+int nfs41_name_cache_pin(
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path,
+    IN bool pin);
+
+/* drop all entries below |path| and invalidate its attributes */
+int nfs41_name_cache_flush(
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path);
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
+
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+/* called by |nfs41_name_cache_walk()| with the cache locked, so it must
+ * not call back into the name cache; |parent| is the index of the
+ * parent entry, counting the calls which returned true from zero, and
+ * |UINT32_MAX| for the start entry. Return false to leave out the
+ * entry and everything below it */
+typedef bool (*nfs41_name_cache_walk_fn)(
+    IN void *context,
+    IN uint32_t parent,
+    IN const nfs41_component *name,
+    IN const nfs41_fh *fh,
+    IN const nfs41_file_info *info);
+
+/* pass the positive entries of the tree below |path| to |fn| in
+ * breadth-first order, so the children of a directory are contiguous */
+int nfs41_name_cache_walk(
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path,
+    IN nfs41_name_cache_walk_fn fn,
+    IN void *context);
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
+
 int nfs41_name_cache_remove_stale(
     IN struct nfs41_name_cache *cache,
     IN bool caseinsensitivesearch,
@@ -24,11 +24,15 @@
 #include <Windows.h>
 #include <strsafe.h>
 
+#include "wintirpc.h"
+#include "rpc/rpc.h"
+
 #include "nfs41_ops.h"
 #include "util.h"
 #include "daemon_debug.h"
 /* for |ERROR_NFS_VERSION_MISMATCH|+|NFS_VERSION_AUTONEGOTIATION| */
 #include "nfs41_driver.h"
+#include "ncsnap.h"
 
 
 
@@ -81,6 +85,7 @@ int nfs41_root_create(
     }
 
     list_init(&root->clients);
+    list_init(&root->stats.entry);
     root->use_nfspubfh = use_nfspubfh;
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
     root->force_case_preserving = force_case_preserving;
@@ -97,6 +102,7 @@ int nfs41_root_create(
     root->supports_nfs42_copy       = false;
     root->supports_nfs42_deallocate = false;
     root->supports_nfs42_clone      = false;
+    root->supports_nfs42_write_same = false;
     if (nfsvers == NFS_VERSION_AUTONEGOTIATION) {
         /*
          * Use auto negotiation, |nfs41_root_mount_addrs()| will
@@ -115,6 +121,13 @@ int nfs41_root_create(
      * protect list searches, which takes a long time
      */
     (void)InitializeCriticalSectionAndSpinCount(&root->lock, 0);
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+    InitializeSRWLock(&root->treewalk.lock);
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+    InitializeSRWLock(&root->referral_cache.lock);
+    list_init(&root->referral_cache.list);
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
     root->ref_count = 1;
     root->sec_flavor = sec_flavor;
 
@@ -137,6 +150,11 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+static void referral_cache_free(
+    IN nfs41_root *root);
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
+
 static void root_free(
     IN nfs41_root *root)
 {
@@ -146,9 +164,22 @@ static void root_free(
 
     EASSERT(waitcriticalsection(&root->lock) == TRUE);
 
+    nfsd_mount_stats_remove(root);
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+    /* data servers of other mounts may still use our clients */
+    pnfs_data_server_pool_purge(root);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
+
     /* free clients */
     list_for_each_tmp(entry, tmp, &root->clients)
         nfs41_client_free(client_entry(entry));
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+    referral_cache_free(root);
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    nfs41_ncsnap_free(root);
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
     DeleteCriticalSection(&root->lock);
     free(root);
 
@@ -358,7 +389,7 @@ static int root_client_create(
 
     /* create client (transfers ownership of rpc to client) */
     status = nfs41_client_create(rpc, &root->client_owner,
-        is_data, exchangeid, &client);
+        is_data, exchangeid, &root->name_cache_config, &client);
     if (status) {
         eprintf("nfs41_client_create() failed with %d\n", status);
         goto out;
@@ -389,6 +420,21 @@ static int root_client_create(
     if (status)
         goto out_err;
 
+    /*
+     * Bind extra connections for "nconnect" (and with
+     * |NFS41_DRIVER_DAEMON_SESSION_TRUNKING| for the other trunkable
+     * server addresses) to the new session. Not fatal, we just
+     * continue with fewer connections if this fails
+     */
+#ifdef NFS41_DRIVER_DAEMON_SESSION_TRUNKING
+    if (!is_data && ((root->nconnect > 1) || (rpc->addrs.count > 1))) {
+#else
+    if (!is_data && (root->nconnect > 1)) {
+#endif /* NFS41_DRIVER_DAEMON_SESSION_TRUNKING */
+        (void)nfs41_rpc_clnt_add_trunk_conns(rpc, session->session_id,
+            root->nconnect - 1);
+    }
+
     *client_out = client;
 out:
     return status;
@@ -422,7 +468,7 @@ int nfs41_root_mount_addrs(
 
     /* create an rpc client */
     status = nfs41_rpc_clnt_create(addrs, root->wsize, root->rsize,
-        root->uid, root->gid, root->sec_flavor, &rpc);
+        root->uid, root->gid, root->sec_flavor, &root->sockopts, &rpc);
     if (status) {
         eprintf("nfs41_rpc_clnt_create() failed %d\n", status);
         goto out;
@@ -487,6 +533,7 @@ retry_nfs41_exchange_id:
         root->supports_nfs42_copy       = true;
         root->supports_nfs42_deallocate = true;
         root->supports_nfs42_clone      = true;
+        root->supports_nfs42_write_same = true;
     }
 
     /* attempt to match existing clients by the exchangeid response */
@@ -531,8 +578,18 @@ retry_nfs41_exchange_id:
     LeaveCriticalSection(&root->lock);
 
 out:
-    if (status == NO_ERROR)
+    if (status == NO_ERROR) {
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+        /* inherit what earlier mounts learned about this server */
+        const LONG notsupp = client_server(client)->nfs42_notsupp;
+
+        if (notsupp & NFS41_SERVER_NOTSUPP_READ_PLUS)
+            root->supports_nfs42_read_plus = false;
+        if (notsupp & NFS41_SERVER_NOTSUPP_WRITE_SAME)
+            root->supports_nfs42_write_same = false;
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
         *client_out = client;
+    }
     DPRINTF(NSLVL, ("<-- nfs41_root_mount_addrs() returning %d\n", status));
     return status;
 
@@ -590,15 +647,177 @@ static int referral_mount_location(
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+/*
+ * Referral location selection
+ *
+ * The locations of a referral are often replicas at different sites,
+ * and the first one in the list is not necessarily the closest one.
+ * Before mounting, |referral_probe_order()| starts a non-blocking TCP
+ * connect to the first resolvable server of each location (at most
+ * |REFERRAL_PROBE_MAX|), and orders the locations by the time it takes
+ * to complete. Locations which do not answer within
+ * |REFERRAL_PROBE_TIMEOUT| milliseconds follow in their original
+ * order.
+ */
+#define REFERRAL_PROBE_MAX 16
+#define REFERRAL_PROBE_TIMEOUT 2000
+
+/* start a connect to the first resolvable server of |loc| */
+static SOCKET referral_probe_connect(
+    IN const fs_location4 *loc)
+{
+    multi_addr4 addrs = { 0 };
+    SOCKET s = INVALID_SOCKET;
+    uint32_t i;
+
+    for (i = 0; (i < loc->server_count) && (s == INVALID_SOCKET); i++) {
+        char addr[NFS41_HOSTNAME_LEN+1];
+        unsigned short port;
+        struct netconfig *nconf;
+        struct netbuf *nb;
+        u_long nonblocking = 1;
+
+        if (parse_fs_location_server_address(loc->servers[i].address,
+            addr, &port))
+            continue;
+        if (nfs41_server_resolve(addr, port, &addrs))
+            continue;
+
+        nconf = getnetconfigent(addrs.arr[0].netid);
+        if (nconf == NULL)
+            continue;
+        nb = uaddr2taddr(nconf, addrs.arr[0].uaddr);
+        freenetconfigent(nconf);
+        if (nb == NULL)
+            continue;
+
+        s = socket(((struct sockaddr *)nb->buf)->sa_family,
+            SOCK_STREAM, IPPROTO_TCP);
+        if (s != INVALID_SOCKET) {
+            if ((ioctlsocket(s, FIONBIO, &nonblocking) != 0) ||
+                ((connect(s, (struct sockaddr *)nb->buf, (int)nb->len) != 0) &&
+                    (WSAGetLastError() != WSAEWOULDBLOCK))) {
+                (void)closesocket(s);
+                s = INVALID_SOCKET;
+            }
+        }
+        freenetbuf(nb);
+    }
+    return s;
+}
+
+/* fill |order| with the location indexes, closest location first */
+static void referral_probe_order(
+    IN const fs_locations4 *locations,
+    OUT uint32_t *order)
+{
+    SOCKET socks[REFERRAL_PROBE_MAX];
+    bool ranked[REFERRAL_PROBE_MAX] = { 0 };
+    const uint32_t count = min(locations->location_count, REFERRAL_PROBE_MAX);
+    const ULONGLONG start = GetTickCount64();
+    uint32_t i, n = 0;
+
+    for (i = 0; i < count; i++)
+        socks[i] = referral_probe_connect(&locations->locations[i]);
+
+    for (;;) {
+        fd_set wfds, efds;
+        struct timeval tv;
+        ULONGLONG elapsed = GetTickCount64() - start;
+        uint32_t pending = 0;
+
+        FD_ZERO(&wfds);
+        FD_ZERO(&efds);
+        for (i = 0; i < count; i++) {
+            if (socks[i] == INVALID_SOCKET)
+                continue;
+            FD_SET(socks[i], &wfds);
+            FD_SET(socks[i], &efds);
+            pending++;
+        }
+        if ((pending == 0) || (elapsed >= REFERRAL_PROBE_TIMEOUT))
+            break;
+
+        tv.tv_sec = (long)((REFERRAL_PROBE_TIMEOUT - elapsed) / 1000);
+        tv.tv_usec = (long)(((REFERRAL_PROBE_TIMEOUT - elapsed) % 1000) * 1000);
+        if (select(0, NULL, &wfds, &efds, &tv) <= 0)
+            break;
+
+        elapsed = GetTickCount64() - start;
+        for (i = 0; i < count; i++) {
+            if (socks[i] == INVALID_SOCKET)
+                continue;
+            if (FD_ISSET(socks[i], &wfds)) {
+                DPRINTF(NSLVL, ("referral_probe_order: location %u "
+                    "('%s') connected after %llums\n",
+                    (unsigned int)i, locations->locations[i].path.path,
+                    (unsigned long long)elapsed));
+                order[n++] = i;
+                ranked[i] = true;
+            }
+            else if (!FD_ISSET(socks[i], &efds))
+                continue;
+            (void)closesocket(socks[i]);
+            socks[i] = INVALID_SOCKET;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (socks[i] != INVALID_SOCKET)
+            (void)closesocket(socks[i]);
+    }
+
+    /* unreachable or slow locations keep their order */
+    for (i = 0; i < locations->location_count; i++) {
+        if ((i >= count) || (!ranked[i]))
+            order[n++] = i;
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
+
 int nfs41_root_mount_referral(
     IN nfs41_root *root,
     IN const fs_locations4 *locations,
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+    IN OUT uint32_t *preferred,
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
     OUT const fs_location4 **loc_out,
     OUT nfs41_client **client_out)
 {
     int status = ERROR_BAD_NET_NAME;
     uint32_t i;
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+    uint32_t *order;
+
+    /* the location we mounted last time is tried first, without probing */
+    if (*preferred < locations->location_count) {
+        status = referral_mount_location(root,
+            &locations->locations[*preferred], client_out);
+        if (status == NO_ERROR) {
+            *loc_out = &locations->locations[*preferred];
+            return status;
+        }
+    }
+    *preferred = REFERRAL_LOCATION_NONE;
 
+    order = malloc(locations->location_count * sizeof(uint32_t));
+    if (order == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    referral_probe_order(locations, order);
+
+    /* establish a mount to the closest available location */
+    for (i = 0; i < locations->location_count; i++) {
+        status = referral_mount_location(root,
+            &locations->locations[order[i]], client_out);
+        if (status == NO_ERROR) {
+            *loc_out = &locations->locations[order[i]];
+            *preferred = order[i];
+            break;
+        }
+    }
+    free(order);
+#else
     /* establish a mount to the first available location */
     for (i = 0; i < locations->location_count; i++) {
         status = referral_mount_location(root,
@@ -608,5 +827,202 @@ int nfs41_root_mount_referral(
             break;
         }
     }
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
     return status;
 }
+
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+/*
+ * Referral cache
+ *
+ * Crossing a referral needs a GETATTR(fs_locations) and the location
+ * probe above. The result is cached per mount, keyed by the parent
+ * directory's filehandle and the name of the referral, for
+ * |REFERRAL_CACHE_TIMEOUT| seconds. At most |REFERRAL_CACHE_MAX|
+ * referrals are cached, the least recently used is dropped first.
+ */
+#define REFERRAL_CACHE_TIMEOUT 300
+#define REFERRAL_CACHE_MAX 64
+
+typedef struct __referral_cache_entry {
+    struct list_entry entry;
+    nfs41_fh parent;
+    char name[NFS41_MAX_COMPONENT_LEN+1];
+    unsigned short name_len;
+    ULONGLONG expiration; /* |GetTickCount64()| value */
+    fs_locations4 locations;
+    uint32_t preferred; /* location mounted last time */
+} referral_cache_entry;
+
+#define referral_entry(pos) list_container(pos, referral_cache_entry, entry)
+
+static void fs_locations_free(
+    IN fs_locations4 *locations)
+{
+    uint32_t i;
+
+    if (locations->locations) {
+        for (i = 0; i < locations->location_count; i++)
+            free(locations->locations[i].servers);
+        free(locations->locations);
+    }
+    locations->locations = NULL;
+    locations->location_count = 0;
+}
+
+static int fs_locations_copy(
+    OUT fs_locations4 *dst,
+    IN const fs_locations4 *src)
+{
+    uint32_t i;
+
+    (void)memset(dst, 0, sizeof(*dst));
+    abs_path_copy(&dst->path, &src->path);
+    if (src->location_count == 0)
+        return NO_ERROR;
+
+    dst->locations = calloc(src->location_count, sizeof(fs_location4));
+    if (dst->locations == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    dst->location_count = src->location_count;
+
+    for (i = 0; i < src->location_count; i++) {
+        const fs_location4 *sl = &src->locations[i];
+        fs_location4 *dl = &dst->locations[i];
+
+        abs_path_copy(&dl->path, &sl->path);
+        if (sl->server_count == 0)
+            continue;
+        dl->servers = malloc(sl->server_count * sizeof(fs_location_server));
+        if (dl->servers == NULL) {
+            fs_locations_free(dst);
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        (void)memcpy(dl->servers, sl->servers,
+            sl->server_count * sizeof(fs_location_server));
+        dl->server_count = sl->server_count;
+    }
+    return NO_ERROR;
+}
+
+/* expects the caller to hold |root->referral_cache.lock| */
+static referral_cache_entry *referral_cache_find(
+    IN nfs41_root *root,
+    IN const nfs41_fh *parent,
+    IN const nfs41_component *name)
+{
+    struct list_entry *entry;
+
+    list_for_each(entry, &root->referral_cache.list) {
+        referral_cache_entry *rce = referral_entry(entry);
+
+        if ((rce->parent.len == parent->len) &&
+            (!memcmp(rce->parent.fh, parent->fh, parent->len)) &&
+            (rce->name_len == name->len) &&
+            (!memcmp(rce->name, name->name, name->len)))
+            return rce;
+    }
+    return NULL;
+}
+
+/* expects the caller to hold |root->referral_cache.lock| exclusively */
+static void referral_cache_remove(
+    IN nfs41_root *root,
+    IN referral_cache_entry *rce)
+{
+    list_remove(&rce->entry);
+    root->referral_cache.count--;
+    fs_locations_free(&rce->locations);
+    free(rce);
+}
+
+static void referral_cache_free(
+    IN nfs41_root *root)
+{
+    struct list_entry *entry, *tmp;
+
+    list_for_each_tmp(entry, tmp, &root->referral_cache.list)
+        referral_cache_remove(root, referral_entry(entry));
+}
+
+/*
+ * Returns a copy of the cached locations for |name| in |parent|,
+ * which the caller must free, or |false| if there is no valid entry
+ */
+bool nfs41_root_referral_cache_get(
+    IN nfs41_root *root,
+    IN const nfs41_fh *parent,
+    IN const nfs41_component *name,
+    OUT fs_locations4 *locations,
+    OUT uint32_t *preferred)
+{
+    referral_cache_entry *rce;
+    bool found = false;
+
+    AcquireSRWLockExclusive(&root->referral_cache.lock);
+    rce = referral_cache_find(root, parent, name);
+    if (rce == NULL)
+        goto out;
+
+    if (rce->expiration <= GetTickCount64()) {
+        referral_cache_remove(root, rce);
+        goto out;
+    }
+    if (fs_locations_copy(locations, &rce->locations))
+        goto out;
+    *preferred = rce->preferred;
+    found = true;
+
+    /* most recently used first */
+    list_remove(&rce->entry);
+    list_add_head(&root->referral_cache.list, &rce->entry);
+out:
+    ReleaseSRWLockExclusive(&root->referral_cache.lock);
+    DPRINTF(NSLVL, ("nfs41_root_referral_cache_get('%.*s'): found=%d\n",
+        (int)name->len, name->name, (int)found));
+    return found;
+}
+
+/* add or update the cache entry for |name| in |parent| */
+void nfs41_root_referral_cache_put(
+    IN nfs41_root *root,
+    IN const nfs41_fh *parent,
+    IN const nfs41_component *name,
+    IN const fs_locations4 *locations,
+    IN uint32_t preferred)
+{
+    referral_cache_entry *rce;
+
+    if (name->len > NFS41_MAX_COMPONENT_LEN)
+        return;
+
+    AcquireSRWLockExclusive(&root->referral_cache.lock);
+    rce = referral_cache_find(root, parent, name);
+    if (rce) {
+        /* the locations did not change, only the preferred one */
+        rce->preferred = preferred;
+        goto out;
+    }
+
+    rce = calloc(1, sizeof(referral_cache_entry));
+    if (rce == NULL)
+        goto out;
+    if (fs_locations_copy(&rce->locations, locations)) {
+        free(rce);
+        goto out;
+    }
+    fh_copy(&rce->parent, parent);
+    (void)memcpy(rce->name, name->name, name->len);
+    rce->name_len = name->len;
+    rce->expiration = GetTickCount64() + REFERRAL_CACHE_TIMEOUT * 1000ULL;
+    rce->preferred = preferred;
+    list_add_head(&root->referral_cache.list, &rce->entry);
+    root->referral_cache.count++;
+
+    while (root->referral_cache.count > REFERRAL_CACHE_MAX)
+        referral_cache_remove(root,
+            referral_entry(root->referral_cache.list.prev));
+out:
+    ReleaseSRWLockExclusive(&root->referral_cache.lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
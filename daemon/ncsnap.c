@@ -0,0 +1,1075 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * ncsnap.c - persistent name cache snapshots
+ *
+ * Enabled with "nfsd --namecachesnapshot <dir>", for "immutable"
+ * mounts only: A snapshot is only of use if the export does not change
+ * while the client is down, which "ro" does not promise, it only keeps
+ * this client from writing.
+ * The name cache entries below the mount path are written to
+ * <dir>\<hash of server and path>.<slot>.ncs on unmount, on nfsd
+ * shutdown and every |NCSNAP_SAVE_INTERVAL| while mounted, if the name
+ * cache has grown past the previous snapshot. On the next mount the
+ * newest valid snapshot is mapped read-only, and name cache misses in
+ * |nfs41_lookup()| are looked up there before going to the server.
+ * Only the header is read at mount time, other pages of the file are
+ * read by the memory manager when a lookup first touches them.
+ *
+ * The format has no pointers: A |ncsnap_header| is followed by the
+ * |ncsnap_entry| array, and by a blob with the names, filehandles and
+ * owner strings which the entries refer to by offset. Entries are in
+ * breadth-first order, so the children of a directory are contiguous,
+ * and they are sorted by |ncsnap_name_hash()| for a binary search.
+ * All values are in host byte order.
+ *
+ * A snapshot is used if the filehandle and fsid of the export root are
+ * those it was made with, and the change attribute of
+ * |NCSNAP_VERSION_FILE| in the export root (or of the export root
+ * itself if there is no such file) has not changed. The change
+ * attribute of a directory only covers its own entries, so exports
+ * which change deeper down should have a version file which the
+ * publisher rewrites with each update.
+ * New snapshots go to a temporary file which is then renamed to the
+ * slot which is not mapped, so a crash leaves the previous one intact.
+ * The snapshot directory is trusted, it must only be writable by
+ * administrators and SYSTEM.
+ */
+
+#include <Windows.h>
+#include <stdlib.h>
+#include <strsafe.h>
+#include <process.h>
+
+#include "nfs41_build_features.h"
+#include "ncsnap.h"
+#include "nfs41_ops.h"
+#include "name_cache.h"
+#include "daemon_debug.h"
+#include "util.h"
+#include "list.h"
+
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+
+#define NCSNAP_MAGIC            0x5053434e /* "NCSP" */
+#define NCSNAP_VERSION          1
+#define NCSNAP_VERSION_FILE     ".nfs41_version"
+#define NCSNAP_NUM_SLOTS        2
+/* milliseconds between two saves of a mounted snapshot */
+#define NCSNAP_SAVE_INTERVAL    (15*60*1000)
+#define NCSNAP_NONE             UINT32_MAX
+#define NCSNAP_OWNER_SLOTS      64 /* must be a power of two */
+#define NCSNAP_WRITE_CHUNK      1024 /* entries per |WriteFile()| */
+
+#define NCSNAP_FLAG_CASEINSENSITIVE 0x0001
+#define NCSNAP_FLAG_VERSION_FILE    0x0002
+
+#define NCSNAP_ENTRY_HIDDEN     0x0001
+#define NCSNAP_ENTRY_ARCHIVE    0x0002
+#define NCSNAP_ENTRY_SYSTEM     0x0004
+#define NCSNAP_ENTRY_OFFLINE    0x0008
+
+typedef struct _ncsnap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size; /* sizeof(ncsnap_entry) */
+    uint32_t flags; /* |NCSNAP_FLAG_*| */
+    uint64_t generation; /* the valid slot with the highest one is used */
+    uint64_t validator; /* change attribute, see above */
+    uint64_t fsid_major;
+    uint64_t fsid_minor;
+    uint64_t file_size;
+    uint64_t blob_offset;
+    uint32_t blob_size;
+    uint32_t num_entries; /* entry zero is the export root */
+    uint32_t rootfh_len;
+    unsigned char rootfh[NFS4_FHSIZE];
+} ncsnap_header;
+
+typedef struct _ncsnap_entry {
+    uint64_t fileid;
+    uint64_t change;
+    uint64_t size;
+    uint64_t space_used;
+    int64_t time_access_s;
+    int64_t time_create_s;
+    int64_t time_modify_s;
+    uint32_t time_access_ns;
+    uint32_t time_create_ns;
+    uint32_t time_modify_ns;
+    uint32_t attrmask[3];
+    uint32_t type;
+    uint32_t mode;
+    uint32_t numlinks;
+    uint32_t clone_blksize;
+    uint32_t flags; /* |NCSNAP_ENTRY_*| */
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t num_children;
+    uint32_t name_hash;
+    /* offsets into the blob */
+    uint32_t name_offset;
+    uint32_t fh_offset;
+    uint32_t owner_offset; /* |NCSNAP_NONE| if not set */
+    uint32_t owner_group_offset;
+    uint16_t name_len;
+    uint16_t fh_len;
+} ncsnap_entry;
+
+typedef struct __nfs41_ncsnap {
+    struct list_entry entry; /* in |ncsnap.mounts| */
+    nfs41_root *root;
+    struct nfs41_name_cache *cache;
+    nfs41_superblock *superblock;
+    nfs41_abs_path path; /* mount path on the server */
+    uint64_t key; /* |ncsnap_key_hash()|, names the files */
+    ncsnap_header hdr; /* for the next save */
+    uint32_t saved_entries;
+    /* the mapped snapshot, |view == NULL| if there is none */
+    int mapped_slot;
+    const unsigned char *view;
+    volatile LONG64 hits;
+} nfs41_ncsnap;
+
+static struct {
+    SRWLOCK lock; /* protects |mounts|, serialises saves */
+    bool open;
+    wchar_t dir[MAX_PATH];
+    struct list_entry mounts;
+    HANDLE stop_event;
+    HANDLE thread;
+} ncsnap = { .lock = SRWLOCK_INIT };
+
+/* ASCII case is folded, so case-insensitive lookups find the name */
+static uint32_t ncsnap_name_hash(
+    IN const char *name,
+    IN uint32_t len)
+{
+    uint32_t hash = 2166136261U; /* FNV-1a */
+    uint32_t i;
+    unsigned char c;
+
+    for (i = 0; i < len; i++) {
+        c = (unsigned char)name[i];
+        if ((c >= 'A') && (c <= 'Z'))
+            c += 'a' - 'A';
+        hash ^= c;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static uint64_t ncsnap_key_hash(
+    IN const char *hostport,
+    IN const char *path)
+{
+    const unsigned char *s;
+    uint64_t hash = 14695981039346656037ULL; /* FNV-1a, 64bit */
+
+    for (s = (const unsigned char *)hostport; *s; s++) {
+        hash ^= *s;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= ':';
+    hash *= 1099511628211ULL;
+    for (s = (const unsigned char *)path; *s; s++) {
+        hash ^= *s;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int ncsnap_path(
+    IN const nfs41_ncsnap *snap,
+    IN int slot,
+    IN const wchar_t *suffix,
+    OUT wchar_t *path)
+{
+    if (FAILED(StringCchPrintfW(path, MAX_PATH, L"%s\\%016llx.%d.ncs%s",
+        ncsnap.dir, (unsigned long long)snap->key, slot, suffix)))
+        return ERROR_FILENAME_EXCED_RANGE;
+    return NO_ERROR;
+}
+
+static __inline int ncsnap_namecmp(
+    IN bool caseinsensitive,
+    IN const char *s1,
+    IN const char *s2,
+    IN size_t len)
+{
+    return caseinsensitive? _strnicmp(s1, s2, len) : strncmp(s1, s2, len);
+}
+
+
+/* snapshot lookup */
+static __inline const ncsnap_header *ncsnap_hdr(
+    IN const nfs41_ncsnap *snap)
+{
+    return (const ncsnap_header *)snap->view;
+}
+
+static const ncsnap_entry *ncsnap_entry_get(
+    IN const nfs41_ncsnap *snap,
+    IN uint32_t index)
+{
+    if (index >= ncsnap_hdr(snap)->num_entries)
+        return NULL;
+    return (const ncsnap_entry *)(snap->view + sizeof(ncsnap_header)) +
+        index;
+}
+
+static const char *ncsnap_blob(
+    IN const nfs41_ncsnap *snap,
+    IN uint32_t offset,
+    IN uint32_t len)
+{
+    const ncsnap_header *hdr = ncsnap_hdr(snap);
+
+    if (((uint64_t)offset + len) > hdr->blob_size)
+        return NULL;
+    return (const char *)(snap->view + hdr->blob_offset + offset);
+}
+
+static uint32_t ncsnap_find_child(
+    IN const nfs41_ncsnap *snap,
+    IN const ncsnap_entry *dir,
+    IN const nfs41_component *name)
+{
+    const bool ci = (snap->hdr.flags & NCSNAP_FLAG_CASEINSENSITIVE) != 0;
+    const uint32_t hash = ncsnap_name_hash(name->name, name->len);
+    const uint32_t end = dir->first_child + dir->num_children;
+    const ncsnap_entry *e;
+    const char *s;
+    uint32_t lo = dir->first_child, hi = end, mid;
+
+    if ((end < lo) || (end > ncsnap_hdr(snap)->num_entries))
+        return NCSNAP_NONE;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ncsnap_entry_get(snap, mid)->name_hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < end; lo++) {
+        e = ncsnap_entry_get(snap, lo);
+        if (e->name_hash != hash)
+            break;
+        if (e->name_len != name->len)
+            continue;
+        s = ncsnap_blob(snap, e->name_offset, e->name_len);
+        if (s && !ncsnap_namecmp(ci, s, name->name, name->len))
+            return lo;
+    }
+    return NCSNAP_NONE;
+}
+
+static bool ncsnap_owner(
+    IN const nfs41_ncsnap *snap,
+    IN uint32_t offset,
+    OUT char *buf)
+{
+    const char *s;
+    size_t max_len, len;
+
+    if (offset == NCSNAP_NONE)
+        return false;
+    s = ncsnap_blob(snap, offset, 1);
+    if (s == NULL)
+        return false;
+    max_len = min(ncsnap_hdr(snap)->blob_size - offset,
+        NFS4_FATTR4_OWNER_LIMIT+1);
+    len = strnlen(s, max_len);
+    if (len == max_len)
+        return false;
+    (void)memcpy(buf, s, len + 1);
+    return true;
+}
+
+static bool ncsnap_entry_info(
+    IN const nfs41_ncsnap *snap,
+    IN const ncsnap_entry *e,
+    OUT nfs41_fh *fh,
+    OUT nfs41_file_info *info)
+{
+    const char *fhdata;
+
+    if ((e->fh_len == 0) || (e->fh_len > NFS4_FHSIZE))
+        return false;
+    fhdata = ncsnap_blob(snap, e->fh_offset, e->fh_len);
+    if (fhdata == NULL)
+        return false;
+    (void)memset(fh, 0, sizeof(nfs41_fh));
+    (void)memcpy(fh->fh, fhdata, e->fh_len);
+    fh->len = e->fh_len;
+    fh->fileid = e->fileid;
+    fh->superblock = snap->superblock;
+
+    (void)memset(info, 0, sizeof(nfs41_file_info));
+    info->attrmask.arr[0] = e->attrmask[0];
+    info->attrmask.arr[1] = e->attrmask[1];
+    info->attrmask.arr[2] = e->attrmask[2];
+    info->fileid = e->fileid;
+    info->fsid.major = snap->hdr.fsid_major;
+    info->fsid.minor = snap->hdr.fsid_minor;
+    info->change = e->change;
+    info->size = e->size;
+    info->space_used = e->space_used;
+    info->time_access.seconds = e->time_access_s;
+    info->time_access.nseconds = e->time_access_ns;
+    info->time_create.seconds = e->time_create_s;
+    info->time_create.nseconds = e->time_create_ns;
+    info->time_modify.seconds = e->time_modify_s;
+    info->time_modify.nseconds = e->time_modify_ns;
+    info->type = e->type;
+    info->mode = e->mode;
+    info->numlinks = e->numlinks;
+    info->clone_blksize = e->clone_blksize;
+    info->hidden = (e->flags & NCSNAP_ENTRY_HIDDEN)? TRUE : FALSE;
+    info->archive = (e->flags & NCSNAP_ENTRY_ARCHIVE)? TRUE : FALSE;
+    info->system = (e->flags & NCSNAP_ENTRY_SYSTEM)? TRUE : FALSE;
+    info->offline = (e->flags & NCSNAP_ENTRY_OFFLINE)? TRUE : FALSE;
+    if (ncsnap_owner(snap, e->owner_offset, info->owner_buf))
+        info->owner = info->owner_buf;
+    else
+        info->attrmask.arr[1] &= ~FATTR4_WORD1_OWNER;
+    if (ncsnap_owner(snap, e->owner_group_offset, info->owner_group_buf))
+        info->owner_group = info->owner_group_buf;
+    else
+        info->attrmask.arr[1] &= ~FATTR4_WORD1_OWNER_GROUP;
+
+    if (info->attrmask.arr[2] != 0)
+        info->attrmask.count = 3;
+    else if (info->attrmask.arr[1] != 0)
+        info->attrmask.count = 2;
+    else
+        info->attrmask.count = 1;
+    return true;
+}
+
+bool nfs41_ncsnap_lookup(
+    IN nfs41_root *root,
+    IN struct nfs41_name_cache *cache,
+    IN bool caseinsensitivesearch,
+    IN const char *path,
+    IN const char *path_end,
+    IN const char *missing)
+{
+    nfs41_ncsnap *snap = root ? root->ncsnap : NULL;
+    const bool ci = snap &&
+        ((snap->hdr.flags & NCSNAP_FLAG_CASEINSENSITIVE) != 0);
+    nfs41_component name, mount;
+    const char *pos = path, *mount_pos;
+    const ncsnap_entry *e;
+    nfs41_file_info *info;
+    nfs41_fh fh;
+    uint32_t index = 0, found = 0;
+
+    /* referrals look up paths on other servers */
+    if ((snap == NULL) || (snap->view == NULL) || (snap->cache != cache))
+        return false;
+
+    /* skip the components of the mount path */
+    mount_pos = snap->path.path;
+    while (next_component(mount_pos, snap->path.path + snap->path.len,
+        &mount)) {
+        if (!next_component(pos, path_end, &name) ||
+            (name.len != mount.len) ||
+            ncsnap_namecmp(ci, name.name, mount.name, name.len))
+            return false;
+        mount_pos = mount.name + mount.len;
+        pos = name.name + name.len;
+    }
+
+    info = malloc(sizeof(nfs41_file_info));
+    if (info == NULL)
+        return false;
+
+    while (next_component(pos, path_end, &name)) {
+        index = ncsnap_find_child(snap, ncsnap_entry_get(snap, index),
+            &name);
+        if (index == NCSNAP_NONE)
+            break;
+        pos = name.name + name.len;
+
+        /* the components before |missing| are in the name cache */
+        if (name.name < missing)
+            continue;
+        e = ncsnap_entry_get(snap, index);
+        if (!ncsnap_entry_info(snap, e, &fh, info))
+            break;
+        if (nfs41_name_cache_insert(cache, caseinsensitivesearch, path,
+            &name, &fh, info, NULL, OPEN_DELEGATE_NONE))
+            break;
+        found++;
+    }
+    free(info);
+
+    if (found) {
+        (void)InterlockedAdd64(&snap->hits, found);
+        DPRINTF(2, ("nfs41_ncsnap_lookup('%.*s'): %u entries from the "
+            "snapshot\n", (int)(path_end - path), path, found));
+    }
+    return found != 0;
+}
+
+
+/* snapshot save */
+typedef struct _ncsnap_writer {
+    const nfs41_ncsnap *snap;
+    ncsnap_entry *entries;
+    uint32_t num_entries;
+    uint32_t max_entries;
+    char *blob;
+    uint32_t blob_size;
+    uint32_t max_blob_size;
+    /* recently added owner strings, most files share a few owners */
+    struct {
+        uint32_t hash;
+        uint32_t offset;
+    } owners[NCSNAP_OWNER_SLOTS];
+    int status;
+} ncsnap_writer;
+
+static uint32_t ncsnap_blob_add(
+    IN ncsnap_writer *w,
+    IN const void *data,
+    IN uint32_t len)
+{
+    uint64_t new_size;
+    uint32_t offset;
+    char *tmp;
+
+    if (((uint64_t)w->blob_size + len) > w->max_blob_size) {
+        new_size = max((uint64_t)w->max_blob_size * 2, 64*1024);
+        while (new_size < ((uint64_t)w->blob_size + len))
+            new_size *= 2;
+        if (new_size >= NCSNAP_NONE) {
+            w->status = ERROR_FILE_TOO_LARGE;
+            return NCSNAP_NONE;
+        }
+        tmp = realloc(w->blob, (size_t)new_size);
+        if (tmp == NULL) {
+            w->status = ERROR_NOT_ENOUGH_MEMORY;
+            return NCSNAP_NONE;
+        }
+        w->blob = tmp;
+        w->max_blob_size = (uint32_t)new_size;
+    }
+    offset = w->blob_size;
+    (void)memcpy(w->blob + offset, data, len);
+    w->blob_size += len;
+    return offset;
+}
+
+static uint32_t ncsnap_owner_add(
+    IN ncsnap_writer *w,
+    IN const char *owner)
+{
+    const uint32_t len = (uint32_t)strlen(owner);
+    const uint32_t hash = ncsnap_name_hash(owner, len);
+    const uint32_t slot = hash & (NCSNAP_OWNER_SLOTS-1);
+    uint32_t offset = w->owners[slot].offset;
+
+    if ((offset != NCSNAP_NONE) && (w->owners[slot].hash == hash) &&
+        !strcmp(w->blob + offset, owner))
+        return offset;
+
+    offset = ncsnap_blob_add(w, owner, len + 1);
+    if (offset != NCSNAP_NONE) {
+        w->owners[slot].hash = hash;
+        w->owners[slot].offset = offset;
+    }
+    return offset;
+}
+
+/* |nfs41_name_cache_walk()| callback */
+static bool ncsnap_walk_entry(
+    IN void *context,
+    IN uint32_t parent,
+    IN const nfs41_component *name,
+    IN const nfs41_fh *fh,
+    IN const nfs41_file_info *info)
+{
+    ncsnap_writer *w = (ncsnap_writer *)context;
+    const ncsnap_header *hdr = &w->snap->hdr;
+    ncsnap_entry *e, *tmp;
+    uint32_t i;
+
+    if (w->status)
+        return false;
+
+    /* filesystems mounted below the export have their own superblock */
+    if ((info->attrmask.arr[0] & FATTR4_WORD0_FSID) &&
+        ((info->fsid.major != hdr->fsid_major) ||
+            (info->fsid.minor != hdr->fsid_minor)))
+        return false;
+
+    if (parent == UINT32_MAX) {
+        if ((fh->len != hdr->rootfh_len) ||
+            memcmp(fh->fh, hdr->rootfh, fh->len)) {
+            w->status = ERROR_FILE_INVALID;
+            return false;
+        }
+        parent = NCSNAP_NONE;
+    }
+
+    if (w->num_entries == w->max_entries) {
+        if (w->max_entries >= (NCSNAP_NONE / 2)) {
+            w->status = ERROR_FILE_TOO_LARGE;
+            return false;
+        }
+        w->max_entries = w->max_entries ? w->max_entries * 2 : 4096;
+        tmp = realloc(w->entries, w->max_entries * sizeof(ncsnap_entry));
+        if (tmp == NULL) {
+            w->status = ERROR_NOT_ENOUGH_MEMORY;
+            return false;
+        }
+        w->entries = tmp;
+    }
+    e = &w->entries[w->num_entries];
+    (void)memset(e, 0, sizeof(ncsnap_entry));
+
+    e->parent = parent;
+    e->name_hash = ncsnap_name_hash(name->name, name->len);
+    e->name_len = name->len;
+    e->name_offset = ncsnap_blob_add(w, name->name, name->len);
+    e->fh_len = (uint16_t)fh->len;
+    e->fh_offset = ncsnap_blob_add(w, fh->fh, fh->len);
+
+    for (i = 0; (i < info->attrmask.count) && (i < 3); i++)
+        e->attrmask[i] = info->attrmask.arr[i];
+    e->fileid = info->fileid;
+    e->change = info->change;
+    e->size = info->size;
+    e->space_used = info->space_used;
+    e->time_access_s = info->time_access.seconds;
+    e->time_access_ns = info->time_access.nseconds;
+    e->time_create_s = info->time_create.seconds;
+    e->time_create_ns = info->time_create.nseconds;
+    e->time_modify_s = info->time_modify.seconds;
+    e->time_modify_ns = info->time_modify.nseconds;
+    e->type = info->type;
+    e->mode = info->mode;
+    e->numlinks = info->numlinks;
+    e->clone_blksize = info->clone_blksize;
+    if (info->hidden) e->flags |= NCSNAP_ENTRY_HIDDEN;
+    if (info->archive) e->flags |= NCSNAP_ENTRY_ARCHIVE;
+    if (info->system) e->flags |= NCSNAP_ENTRY_SYSTEM;
+    if (info->offline) e->flags |= NCSNAP_ENTRY_OFFLINE;
+    e->owner_offset = e->owner_group_offset = NCSNAP_NONE;
+    if ((e->attrmask[1] & FATTR4_WORD1_OWNER) && info->owner)
+        e->owner_offset = ncsnap_owner_add(w, info->owner);
+    if ((e->attrmask[1] & FATTR4_WORD1_OWNER_GROUP) && info->owner_group)
+        e->owner_group_offset = ncsnap_owner_add(w, info->owner_group);
+    if (e->owner_offset == NCSNAP_NONE)
+        e->attrmask[1] &= ~FATTR4_WORD1_OWNER;
+    if (e->owner_group_offset == NCSNAP_NONE)
+        e->attrmask[1] &= ~FATTR4_WORD1_OWNER_GROUP;
+
+    if (w->status)
+        return false;
+    w->num_entries++;
+    return true;
+}
+
+static int __cdecl ncsnap_perm_cmp(
+    void *context,
+    const void *a,
+    const void *b)
+{
+    const ncsnap_entry *entries = (const ncsnap_entry *)context;
+    const uint32_t ha = entries[*(const uint32_t *)a].name_hash;
+    const uint32_t hb = entries[*(const uint32_t *)b].name_hash;
+
+    return (ha < hb)? -1 : ((ha > hb)? 1 : 0);
+}
+
+static int ncsnap_write_all(
+    IN HANDLE file,
+    IN const void *data,
+    IN size_t len)
+{
+    DWORD written;
+
+    if (!WriteFile(file, data, (DWORD)len, &written, NULL))
+        return GetLastError();
+    return (written == len)? NO_ERROR : ERROR_WRITE_FAULT;
+}
+
+/* write the entries of |w| to |slot|, sorting the children of each
+ * directory by name hash */
+static int ncsnap_write(
+    IN const nfs41_ncsnap *snap,
+    IN ncsnap_writer *w,
+    IN int slot,
+    IN uint64_t generation)
+{
+    const uint32_t n = w->num_entries;
+    wchar_t tmp_path[MAX_PATH], path[MAX_PATH];
+    HANDLE file = INVALID_HANDLE_VALUE;
+    uint32_t *perm = NULL, *inv = NULL, i, j, count;
+    ncsnap_entry *chunk = NULL, *p;
+    ncsnap_header hdr;
+    int status;
+
+    status = ncsnap_path(snap, slot, L".tmp", tmp_path);
+    if (status == NO_ERROR)
+        status = ncsnap_path(snap, slot, L"", path);
+    if (status)
+        goto out;
+
+    /* the walk passes the children of a directory one after another */
+    for (i = 1; i < n; i++) {
+        p = &w->entries[w->entries[i].parent];
+        if (p->num_children++ == 0)
+            p->first_child = i;
+    }
+
+    /* |perm[new index]| is the old index, |inv| the reverse */
+    perm = malloc(n * sizeof(uint32_t));
+    inv = malloc(n * sizeof(uint32_t));
+    chunk = malloc(NCSNAP_WRITE_CHUNK * sizeof(ncsnap_entry));
+    if ((perm == NULL) || (inv == NULL) || (chunk == NULL)) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+        perm[i] = i;
+    for (i = 0; i < n; i++) {
+        p = &w->entries[i];
+        if (p->num_children > 1)
+            qsort_s(perm + p->first_child, p->num_children,
+                sizeof(uint32_t), ncsnap_perm_cmp, w->entries);
+    }
+    for (i = 0; i < n; i++)
+        inv[perm[i]] = i;
+
+    file = CreateFileW(tmp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        eprintf("ncsnap_write: CreateFileW('%S') failed, lasterr=%d\n",
+            tmp_path, status);
+        goto out;
+    }
+
+    /* the magic is written last, so an incomplete file is not used */
+    hdr = snap->hdr;
+    hdr.magic = 0;
+    hdr.version = NCSNAP_VERSION;
+    hdr.entry_size = sizeof(ncsnap_entry);
+    hdr.generation = generation;
+    hdr.num_entries = n;
+    hdr.blob_offset = sizeof(ncsnap_header) +
+        (uint64_t)n * sizeof(ncsnap_entry);
+    hdr.blob_size = w->blob_size;
+    hdr.file_size = hdr.blob_offset + w->blob_size;
+    status = ncsnap_write_all(file, &hdr, sizeof(hdr));
+    for (i = 0; (status == NO_ERROR) && (i < n); i += count) {
+        count = min(n - i, NCSNAP_WRITE_CHUNK);
+        for (j = 0; j < count; j++) {
+            chunk[j] = w->entries[perm[i + j]];
+            if (chunk[j].parent != NCSNAP_NONE)
+                chunk[j].parent = inv[chunk[j].parent];
+        }
+        status = ncsnap_write_all(file, chunk, count * sizeof(ncsnap_entry));
+    }
+    if (status == NO_ERROR)
+        status = ncsnap_write_all(file, w->blob, w->blob_size);
+    if (status == NO_ERROR) {
+        hdr.magic = NCSNAP_MAGIC;
+        if (SetFilePointer(file, 0, NULL, FILE_BEGIN) ==
+            INVALID_SET_FILE_POINTER)
+            status = GetLastError();
+        else
+            status = ncsnap_write_all(file, &hdr, sizeof(hdr));
+    }
+    if ((status == NO_ERROR) && !FlushFileBuffers(file))
+        status = GetLastError();
+    (void)CloseHandle(file);
+
+    if ((status == NO_ERROR) && !MoveFileExW(tmp_path, path,
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        status = GetLastError();
+    if (status) {
+        eprintf("ncsnap_write('%S') failed with %d\n", path, status);
+        (void)DeleteFileW(tmp_path);
+    }
+out:
+    free(chunk);
+    free(inv);
+    free(perm);
+    return status;
+}
+
+/* save |snap| if the name cache has more entries than the last
+ * snapshot, must be called with |ncsnap.lock| held exclusively */
+static void ncsnap_save(
+    IN nfs41_ncsnap *snap)
+{
+    ncsnap_writer w;
+    int slot, status;
+
+    (void)memset(&w, 0, sizeof(w));
+    (void)memset(w.owners, 0xff, sizeof(w.owners));
+    w.snap = snap;
+
+    status = nfs41_name_cache_walk(snap->cache,
+        (snap->hdr.flags & NCSNAP_FLAG_CASEINSENSITIVE) != 0,
+        snap->path.path, ncsnap_walk_entry, &w);
+    if (status == NO_ERROR)
+        status = w.status;
+    if (status) {
+        DPRINTF(1, ("ncsnap_save('%s'): nfs41_name_cache_walk() failed "
+            "with %d\n", snap->path.path, status));
+        goto out;
+    }
+
+    /*
+     * The name cache only has the entries which were looked up since
+     * the mount, so do not replace a snapshot with a smaller one
+     */
+    if (w.num_entries <= snap->saved_entries)
+        goto out;
+
+    /* the mapped file cannot be replaced */
+    slot = (snap->view && (snap->mapped_slot == 0))? 1 : 0;
+    status = ncsnap_write(snap, &w, slot, snap->hdr.generation + 1);
+    if (status == NO_ERROR) {
+        snap->hdr.generation++;
+        snap->saved_entries = w.num_entries;
+        DPRINTF(1, ("ncsnap_save('%s'): %u entries in slot %d\n",
+            snap->path.path, w.num_entries, slot));
+    }
+out:
+    free(w.entries);
+    free(w.blob);
+}
+
+static unsigned int WINAPI ncsnap_thread(void *args)
+{
+    struct list_entry *pos;
+
+    (void)args;
+    while (WaitForSingleObject(ncsnap.stop_event,
+        NCSNAP_SAVE_INTERVAL) == WAIT_TIMEOUT) {
+        AcquireSRWLockExclusive(&ncsnap.lock);
+        list_for_each(pos, &ncsnap.mounts)
+            ncsnap_save(list_container(pos, nfs41_ncsnap, entry));
+        ReleaseSRWLockExclusive(&ncsnap.lock);
+    }
+    return 0;
+}
+
+
+/* snapshot load */
+static const unsigned char *ncsnap_map(
+    IN const nfs41_ncsnap *snap,
+    IN int slot)
+{
+    const ncsnap_header *hdr;
+    wchar_t path[MAX_PATH];
+    const unsigned char *view = NULL;
+    LARGE_INTEGER size;
+    HANDLE file, mapping;
+    bool valid;
+
+    if (ncsnap_path(snap, slot, L"", path))
+        goto out;
+    file = CreateFileW(path, GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        goto out;
+    if (!GetFileSizeEx(file, &size) ||
+        (size.QuadPart < (LONGLONG)sizeof(ncsnap_header)) ||
+        ((uint64_t)size.QuadPart > (uint64_t)SIZE_MAX))
+        goto out_close;
+
+    /* the view keeps the mapping and the file open */
+    mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+        goto out_close;
+    view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    (void)CloseHandle(mapping);
+    if (view == NULL)
+        goto out_close;
+
+    hdr = (const ncsnap_header *)view;
+    valid = (hdr->magic == NCSNAP_MAGIC) &&
+        (hdr->version == NCSNAP_VERSION) &&
+        (hdr->entry_size == sizeof(ncsnap_entry)) &&
+        (hdr->file_size == (uint64_t)size.QuadPart) &&
+        (hdr->flags == snap->hdr.flags) &&
+        (hdr->validator == snap->hdr.validator) &&
+        (hdr->fsid_major == snap->hdr.fsid_major) &&
+        (hdr->fsid_minor == snap->hdr.fsid_minor) &&
+        (hdr->rootfh_len == snap->hdr.rootfh_len) &&
+        !memcmp(hdr->rootfh, snap->hdr.rootfh, hdr->rootfh_len) &&
+        (hdr->num_entries > 0) &&
+        (hdr->blob_offset >= (sizeof(ncsnap_header) +
+            (uint64_t)hdr->num_entries * sizeof(ncsnap_entry))) &&
+        ((hdr->blob_offset + hdr->blob_size) <= hdr->file_size);
+    if (!valid) {
+        DPRINTF(1, ("ncsnap_map: '%S' is stale, not using it\n", path));
+        (void)UnmapViewOfFile(view);
+        view = NULL;
+    }
+out_close:
+    (void)CloseHandle(file);
+out:
+    return view;
+}
+
+/* change attribute of the version file, or of the export root */
+static int ncsnap_validator(
+    IN nfs41_root *root,
+    IN nfs41_session *session,
+    IN OUT nfs41_ncsnap *snap,
+    IN nfs41_path_fh *file)
+{
+    nfs41_abs_path vpath;
+    nfs41_path_fh vfile = { 0 }, *target = file;
+    nfs41_file_info info;
+    bitmap4 attr_request;
+    int status;
+
+    InitializeSRWLock(&vpath.lock);
+    if (SUCCEEDED(StringCchPrintfA(vpath.path, NFS41_MAX_PATH_LEN,
+        "%s\\%s", snap->path.path, NCSNAP_VERSION_FILE))) {
+        vpath.len = (unsigned short)strlen(vpath.path);
+        if (nfs41_lookup(root, session,
+            BIT2BOOL(snap->superblock->case_insensitive),
+            &vpath, NULL, &vfile, NULL, NULL) == NO_ERROR) {
+            target = &vfile;
+            snap->hdr.flags |= NCSNAP_FLAG_VERSION_FILE;
+        }
+    }
+
+    (void)memset(&info, 0, sizeof(info));
+    nfs41_superblock_getattr_profile(target->fh.superblock,
+        NFS41_GETATTR_PROFILE_CHANGE, &attr_request);
+    status = nfs41_getattr(session, target, &attr_request, &info);
+    if (status) {
+        eprintf("ncsnap_validator('%s'): nfs41_getattr() failed with "
+            "'%s'\n", snap->path.path, nfs_error_string(status));
+        goto out;
+    }
+    if ((info.attrmask.arr[0] & FATTR4_WORD0_CHANGE) == 0) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out;
+    }
+    snap->hdr.validator = info.change;
+out:
+    return status;
+}
+
+void nfs41_ncsnap_mount(
+    IN nfs41_root *root,
+    IN nfs41_session *session,
+    IN const char *hostport,
+    IN const nfs41_abs_path *path,
+    IN nfs41_path_fh *file)
+{
+    nfs41_ncsnap *snap;
+    const unsigned char *view;
+    bool open;
+    int slot;
+
+    AcquireSRWLockShared(&ncsnap.lock);
+    open = ncsnap.open;
+    ReleaseSRWLockShared(&ncsnap.lock);
+    if (!open || root->ncsnap)
+        return;
+
+    snap = calloc(1, sizeof(nfs41_ncsnap));
+    if (snap == NULL)
+        return;
+    snap->root = root;
+    snap->cache = session_name_cache(session);
+    snap->superblock = file->fh.superblock;
+    InitializeSRWLock(&snap->path.lock);
+    abs_path_copy(&snap->path, path);
+    snap->key = ncsnap_key_hash(hostport, path->path);
+    snap->mapped_slot = -1;
+    snap->hdr.flags = snap->superblock->case_insensitive?
+        NCSNAP_FLAG_CASEINSENSITIVE : 0;
+    snap->hdr.fsid_major = snap->superblock->fsid.major;
+    snap->hdr.fsid_minor = snap->superblock->fsid.minor;
+    snap->hdr.rootfh_len = file->fh.len;
+    (void)memcpy(snap->hdr.rootfh, file->fh.fh, file->fh.len);
+
+    /* without a validator the snapshot could not be trusted later */
+    if (ncsnap_validator(root, session, snap, file)) {
+        free(snap);
+        return;
+    }
+
+    for (slot = 0; slot < NCSNAP_NUM_SLOTS; slot++) {
+        view = ncsnap_map(snap, slot);
+        if (view == NULL)
+            continue;
+        if (snap->view && (((const ncsnap_header *)view)->generation <=
+            ncsnap_hdr(snap)->generation)) {
+            (void)UnmapViewOfFile(view);
+            continue;
+        }
+        if (snap->view)
+            (void)UnmapViewOfFile(snap->view);
+        snap->view = view;
+        snap->mapped_slot = slot;
+    }
+    if (snap->view) {
+        snap->hdr.generation = ncsnap_hdr(snap)->generation;
+        snap->saved_entries = ncsnap_hdr(snap)->num_entries;
+    }
+
+    AcquireSRWLockExclusive(&ncsnap.lock);
+    /* the list holds a reference until |nfs41_ncsnap_unmount()| */
+    nfs41_root_ref(root);
+    root->ncsnap = snap;
+    list_add_tail(&ncsnap.mounts, &snap->entry);
+    ReleaseSRWLockExclusive(&ncsnap.lock);
+
+    DPRINTF(1, ("nfs41_ncsnap_mount('%s'): %u entries from slot %d\n",
+        snap->path.path, snap->saved_entries, snap->mapped_slot));
+}
+
+void nfs41_ncsnap_unmount(
+    IN nfs41_root *root)
+{
+    nfs41_ncsnap *snap = root->ncsnap;
+    bool registered = false;
+    struct list_entry *pos;
+
+    if (snap == NULL)
+        return;
+
+    AcquireSRWLockExclusive(&ncsnap.lock);
+    list_for_each(pos, &ncsnap.mounts) {
+        if (pos == &snap->entry) {
+            registered = true;
+            break;
+        }
+    }
+    if (registered) {
+        ncsnap_save(snap);
+        list_remove(&snap->entry);
+    }
+    ReleaseSRWLockExclusive(&ncsnap.lock);
+
+    if (registered) {
+        DPRINTF(1, ("nfs41_ncsnap_unmount('%s'): %lld snapshot hits\n",
+            snap->path.path, (long long)snap->hits));
+        nfs41_root_deref(root);
+    }
+}
+
+/* called when |root| is freed, other upcalls may use the view until
+ * then */
+void nfs41_ncsnap_free(
+    IN nfs41_root *root)
+{
+    nfs41_ncsnap *snap = root->ncsnap;
+
+    if (snap == NULL)
+        return;
+    if (snap->view)
+        (void)UnmapViewOfFile(snap->view);
+    free(snap);
+    root->ncsnap = NULL;
+}
+
+int nfs41_ncsnap_open(
+    IN const wchar_t *dir)
+{
+    int status = NO_ERROR;
+
+    if (FAILED(StringCchCopyW(ncsnap.dir, MAX_PATH, dir))) {
+        status = ERROR_FILENAME_EXCED_RANGE;
+        goto out;
+    }
+    if (!CreateDirectoryW(ncsnap.dir, NULL) &&
+        (GetLastError() != ERROR_ALREADY_EXISTS)) {
+        status = GetLastError();
+        eprintf("nfs41_ncsnap_open: CreateDirectoryW('%S') failed, "
+            "lasterr=%d\n", ncsnap.dir, status);
+        goto out;
+    }
+
+    list_init(&ncsnap.mounts);
+    ncsnap.stop_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (ncsnap.stop_event == NULL) {
+        status = GetLastError();
+        goto out;
+    }
+    ncsnap.thread = (HANDLE)_beginthreadex(NULL,
+        NFSD_THREAD_STACK_SIZE, ncsnap_thread, NULL, 0, NULL);
+    if (ncsnap.thread == NULL) {
+        status = GetLastError();
+        eprintf("nfs41_ncsnap_open: _beginthreadex() failed "
+            "with %d\n", status);
+        (void)CloseHandle(ncsnap.stop_event);
+        ncsnap.stop_event = NULL;
+        goto out;
+    }
+
+    AcquireSRWLockExclusive(&ncsnap.lock);
+    ncsnap.open = true;
+    ReleaseSRWLockExclusive(&ncsnap.lock);
+out:
+    return status;
+}
+
+void nfs41_ncsnap_close(void)
+{
+    struct list_entry *pos, *tmp;
+
+    if (ncsnap.thread) {
+        (void)SetEvent(ncsnap.stop_event);
+        (void)WaitForSingleObject(ncsnap.thread, INFINITE);
+        (void)CloseHandle(ncsnap.thread);
+        ncsnap.thread = NULL;
+    }
+    if (ncsnap.stop_event) {
+        (void)CloseHandle(ncsnap.stop_event);
+        ncsnap.stop_event = NULL;
+    }
+
+    AcquireSRWLockExclusive(&ncsnap.lock);
+    if (ncsnap.open) {
+        ncsnap.open = false;
+        /*
+         * nfsd is exiting without unmounts, save what the mounts have
+         * looked up. The references on the roots are kept, the roots
+         * are not freed on exit
+         */
+        list_for_each_tmp(pos, tmp, &ncsnap.mounts) {
+            ncsnap_save(list_container(pos, nfs41_ncsnap, entry));
+            list_remove(pos);
+        }
+    }
+    ReleaseSRWLockExclusive(&ncsnap.lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
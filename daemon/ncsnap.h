@@ -0,0 +1,52 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+#ifndef __NFS41_DAEMON_NCSNAP_H__
+#define __NFS41_DAEMON_NCSNAP_H__ 1
+
+#include <Windows.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "nfs41_build_features.h"
+#include "nfs41_types.h"
+
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+/*
+ * Persistent name cache snapshots of "immutable" mounts, see ncsnap.c
+ */
+struct __nfs41_root;
+struct __nfs41_session;
+struct nfs41_name_cache;
+
+int nfs41_ncsnap_open(const wchar_t *dir);
+void nfs41_ncsnap_close(void);
+void nfs41_ncsnap_mount(struct __nfs41_root *root,
+    struct __nfs41_session *session, const char *hostport,
+    const nfs41_abs_path *path, nfs41_path_fh *file);
+void nfs41_ncsnap_unmount(struct __nfs41_root *root);
+void nfs41_ncsnap_free(struct __nfs41_root *root);
+bool nfs41_ncsnap_lookup(struct __nfs41_root *root,
+    struct nfs41_name_cache *cache, bool caseinsensitivesearch,
+    const char *path, const char *path_end, const char *missing);
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
+
+#endif /* !__NFS41_DAEMON_NCSNAP_H__ */
@@ -29,23 +29,37 @@
 #include "util.h"
 #include "list.h"
 #include "nfs41_driver.h" /* needed for |tristate_bool| */
+#include "qos.h"
+#include "autotune.h"
+#include "topstats.h"
 
 
 struct __nfs41_session;
 struct __nfs41_client;
 struct __rpc_client;
+struct __auth;
 struct __nfs41_root;
 
 struct _FILE_GET_EA_INFORMATION;
 struct _FILE_FULL_EA_INFORMATION;
 
+/* number of |enum nfs41_getattr_profile| values */
+#define NFS41_GETATTR_PROFILE_COUNT 3
+
 typedef struct __nfs41_superblock {
     nfs41_fsid fsid;
     struct list_entry entry; /* position in nfs41_server.superblocks */
+    /* position in |nfs41_superblock_list.hash| */
+    struct list_entry hash_entry;
 
     bitmap4 supported_attrs;
     bitmap4 suppattr_exclcreat;
     bitmap4 default_getattr;
+    /*
+     * |nfs41_superblock_getattr_profile()| masks, already intersected
+     * with |supported_attrs|
+     */
+    bitmap4 profile_getattr[NFS41_GETATTR_PROFILE_COUNT];
 
     nfstime4 time_delta;
     uint64_t maxread;
@@ -53,7 +67,7 @@ typedef struct __nfs41_superblock {
 
     /* constant filesystem attributes */
     uint32_t aclsupport; /* |ACL4_SUPPORT_*| */
-    unsigned int layout_types : 3;
+    unsigned int layout_types : 4;
     unsigned int cansettime : 1;
     unsigned int link_support : 1;
     unsigned int symlink_support : 1;
@@ -62,6 +76,14 @@ typedef struct __nfs41_superblock {
     unsigned int case_insensitive : 1;
     unsigned int sparse_file_support : 1;
     unsigned int block_clone_support : 1;
+    /*
+     * Set once an OPEN returned |OPEN4_RESULT_PRESERVE_UNLINKED|,
+     * i.e. the server keeps removed files alive until the last
+     * open is closed, and we can REMOVE instead of a silly rename.
+     * Not a bitfield because it is set after the superblock was
+     * created
+     */
+    bool preserve_unlinked;
 
     /* variable filesystem attributes */
     uint64_t space_avail;
@@ -72,8 +94,16 @@ typedef struct __nfs41_superblock {
     SRWLOCK lock;
 } nfs41_superblock;
 
+/*
+ * Hash index of the superblocks by fsid, so that exports with many
+ * filesystems (e.g. one ZFS dataset per user) do not scan all of them
+ * for each new filehandle. Must be a power of two
+ */
+#define SUPERBLOCK_HASH_SIZE 256
+
 typedef struct __nfs41_superblock_list {
     struct list_entry head;
+    struct list_entry hash[SUPERBLOCK_HASH_SIZE];
     SRWLOCK lock;
 } nfs41_superblock_list;
 
@@ -90,6 +120,14 @@ typedef struct __nfs41_server {
     nfs41_superblock_list superblocks;
     struct nfs41_name_cache *name_cache;
     struct list_entry entry; /* position in global server list */
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+    /*
+     * |NFS41_SERVER_NOTSUPP_*| bits for NFSv4.2 operations a root on
+     * this server found to be unsupported, so later mounts of the
+     * same server owner do not have to probe them again
+     */
+    volatile LONG nfs42_notsupp;
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
 #pragma warning( push )
 /* Ignore "C4324: structure was padded due to alignment specifier" */
 #pragma warning (disable : 4324)
@@ -97,6 +135,11 @@ typedef struct __nfs41_server {
 #pragma warning( pop )
 } nfs41_server;
 
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+#define NFS41_SERVER_NOTSUPP_READ_PLUS  0x0001
+#define NFS41_SERVER_NOTSUPP_WRITE_SAME 0x0002
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+
 enum delegation_status {
     DELEGATION_GRANTED,
     DELEGATION_RETURNING,
@@ -109,6 +152,10 @@ typedef struct __nfs41_delegation_state {
     nfs41_path_fh parent;
     nfs41_path_fh file;
     struct list_entry client_entry; /* entry in nfs41_client.delegations */
+    /* entries in the |client_state| hash indexes, see there */
+    struct list_entry fileid_entry;
+    struct list_entry fh_entry;
+    struct list_entry stateid_entry;
     __declspec(align(8)) volatile LONG ref_count;
 
     enum delegation_status status;
@@ -117,6 +164,45 @@ typedef struct __nfs41_delegation_state {
 
     bool_t revoked; /* for recovery, accessed under client.state.lock */
 
+    /* retention policy, accessed under client.state.lock */
+    uint32_t open_count; /* decayed, see |delegation_heat()| */
+    util_reltimestamp last_used;
+
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    /*
+     * UNSTABLE4 writes under a write delegation which have not been
+     * committed yet, accessed under the write-behind list lock in
+     * delegation.c
+     */
+    struct {
+        struct list_entry entry;
+        struct __nfs41_client *client;
+        uint64_t offset;
+        uint64_t end;
+        unsigned char verf[NFS4_VERIFIER_SIZE];
+        ULONGLONG expiration; /* |GetTickCount64()| */
+        /* copies of the uncommitted writes, oldest first */
+        struct list_entry retained;
+        uint64_t retained_bytes;
+        bool_t dirty;
+        /* first COMMIT or resend failure not yet reported, see
+         * |nfs41_delegation_write_behind_flush_open()| */
+        int error;
+    } write_behind;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+    /*
+     * Timestamps owned by the client with |state.attrs_deleg|, not
+     * sent to the server yet, accessed under |lock|
+     */
+    struct {
+        nfstime4 access;
+        nfstime4 modify;
+        uint32_t dirty; /* |DELEG_TIME_*| in delegation.c */
+    } times;
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
+
     HANDLE srv_open; /* for rdbss cache invalidation */
 } nfs41_delegation_state;
 
@@ -147,11 +233,15 @@ typedef struct __nfs41_open_state {
     state_owner4 owner;
     struct __pnfs_layout_state *layout;
     struct list_entry client_entry; /* entry in nfs41_client.opens */
+    /* entries in the |client_state| hash indexes, see there */
+    struct list_entry path_entry;
+    struct list_entry fileid_entry;
     SRWLOCK lock;
     __declspec(align(8)) volatile LONG ref_count;
     uint32_t share_access;
     uint32_t share_deny;
     uint64_t pnfs_last_offset; /* for layoutcommit */
+    bool_t open_by_fh; /* OPEN with |CLAIM_FH|, see |FILE_OPEN_BY_FILE_ID| */
 
     struct {
         nfs41_delegation_state *state;
@@ -170,13 +260,124 @@ typedef struct __nfs41_open_state {
         struct _FILE_GET_EA_INFORMATION *list;
         uint32_t index;
         CRITICAL_SECTION lock;
+#ifdef NFS41_DRIVER_DAEMON_EA_SET_BATCH
+        nfs41_fh attrdir; /* named attribute directory, |len| 0 if unknown */
+#endif /* NFS41_DRIVER_DAEMON_EA_SET_BATCH */
     } ea;
 
     HANDLE srv_open; /* for data cache invalidation */
+
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+    struct { /* daemon-side readahead, see readwrite.c */
+        SRWLOCK lock;
+        CONDITION_VARIABLE cond;
+        uint64_t next_offset; /* end of the last read */
+        uint32_t seq_count; /* number of sequential reads */
+        uint32_t generation; /* incremented to discard prefetches */
+        bool_t busy; /* prefetch in flight */
+        struct __nfs41_readahead_buf *buf;
+    } readahead;
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
+
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+    struct { /* READDIR readahead, see readdir.c */
+        SRWLOCK lock;
+        CONDITION_VARIABLE cond;
+        uint32_t generation; /* incremented to discard prefetches */
+        uint32_t batch_size; /* size of the next prefetch */
+        bool_t busy; /* prefetch in flight */
+        struct __readdir_ahead_buf *cur; /* partially returned batch */
+        struct __readdir_ahead_buf *next; /* prefetched batch */
+    } readdir_ahead;
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
+
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+    struct { /* parked after the last close, see open.c */
+        struct list_entry entry;
+        ULONGLONG expiration; /* |GetTickCount64()| value */
+        uint32_t uid;
+        uint32_t gid;
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+        bool async; /* on |deferred_close.async_list| */
+        bool sending; /* CLOSE in flight */
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+    } deferred_close;
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+
+#ifdef NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS
+    struct { /* READ vs. READ_PLUS selection, see readwrite.c */
+        volatile LONG64 bytes; /* read with READ_PLUS in this sample */
+        volatile LONG64 hole_bytes; /* ... of which were holes */
+        volatile LONG reads_left; /* READs before trying READ_PLUS again */
+    } read_plus;
+#endif /* NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS */
+
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    struct { /* data extents for FSCTL_QUERY_ALLOCATED_RANGES, see fsctl.c */
+        SRWLOCK lock;
+        bool_t valid;
+        uint64_t change; /* change attribute the map belongs to */
+        uint64_t start; /* the map covers |start| to |end| */
+        uint64_t end; /* |NFS4_UINT64_MAX| if the map reaches EOF */
+        struct __nfs41_data_extent *extents; /* sorted by offset */
+        uint32_t count;
+    } extent_map;
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
+#ifdef NFS41_DRIVER_DAEMON_WRITE_GATHERING
+    struct { /* small FILE_SYNC4 WRITEs, see |write_gathered()| */
+        SRWLOCK lock;
+        CONDITION_VARIABLE cond;
+        struct list_entry pending;
+        bool_t busy; /* a thread is sending a WRITE */
+#ifdef NFS41_DRIVER_PAGING_WRITE_CLUSTERING
+        /* paging WRITEs, see |write_clustered()| */
+        struct list_entry clustered;
+        bool_t cluster_busy;
+        uint32_t cluster_last; /* requests in the last batch */
+#endif /* NFS41_DRIVER_PAGING_WRITE_CLUSTERING */
+    } write_gather;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_GATHERING */
 } nfs41_open_state;
 
+/*
+ * Maximum number of connections per |nfs41_rpc_clnt| for the
+ * "nconnect" mount option, must match |MOUNT_CONFIG_NCONNECT_MAX|
+ * in the kernel driver
+ */
+#define NFS41_MAX_NCONNECT 16
+
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+/* Max number of per-user RPCSEC_GSS contexts per |nfs41_rpc_clnt| */
+#define NFS41_GSS_CTX_POOL_SIZE 64
+
+struct __nfs41_gss_ctx;
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
+
+/*
+ * Socket options of the "sockbuf", "keepalive", "nodelay",
+ * "loopbackfastpath" and "rssaffinity" mount options
+ */
+typedef struct __nfs41_sockopts {
+    uint32_t sockbuf; /* in kilobytes, or |NFS41_MOUNT_SOCKBUF_DEFAULT| */
+    uint32_t keepalive; /* in seconds, 0 = disabled */
+    uint32_t flags; /* |NFS41_MOUNT_SOCKOPT_*| */
+} nfs41_sockopts;
+
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+/* metadata, READ, WRITE */
+#define NFS41_RPC_TIMER_CLASSES 3
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
+
 typedef struct __nfs41_rpc_clnt {
     struct __rpc_client *rpc;
+    /*
+     * Extra connections bound to the session (nconnect), which only
+     * carry the fore channel. Protected by |lock|
+     */
+    struct __rpc_client *trunk[NFS41_MAX_NCONNECT-1];
+    uint32_t trunk_count;
+    volatile LONG trunk_next;
     SRWLOCK lock;
     HANDLE cond;
     struct __nfs41_client *client;
@@ -188,15 +389,72 @@ typedef struct __nfs41_rpc_clnt {
     uint32_t sec_flavor;
     uint32_t uid;
     uint32_t gid;
+    nfs41_sockopts sockopts;
     char server_name[NI_MAXHOST];
     bool_t is_valid_session;
     bool_t in_recovery;
     bool_t needcb;
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+    /*
+     * Per logon session RPCSEC_GSS contexts, see |gss_ctx_get()|.
+     * Protected by |gss_pool_lock|
+     */
+    SRWLOCK gss_pool_lock;
+    struct __nfs41_gss_ctx *gss_pool[NFS41_GSS_CTX_POOL_SIZE];
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+    /*
+     * Established connection to another address of |addrs|, which
+     * |rpc_reconnect()| switches to. Protected by |lock|
+     */
+    struct __rpc_client *standby;
+    uint32_t standby_index;
+    uint32_t health_failures; /* failed probes of |rpc| in a row */
+    struct list_entry health_entry; /* see |rpc_health_thread()| */
+    bool_t health_registered;
+    volatile LONG connect_races; /* running |rpc_connect_race|s */
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+    /*
+     * RTT estimates per |rpc_timer_class|, see |rpc_rtt_timeout()|.
+     * Protected by |rtt_lock|
+     */
+    SRWLOCK rtt_lock;
+    struct __nfs41_rpc_rtt {
+        uint32_t srtt; /* smoothed RTT in msecs, scaled by 8 */
+        uint32_t rttvar; /* RTT variance in msecs, scaled by 4 */
+        uint32_t samples;
+    } rtt[NFS41_RPC_TIMER_CLASSES];
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
 } nfs41_rpc_clnt;
 
+/*
+ * Hash indexes of |client_state.opens| and |client_state.delegations|,
+ * so that the lookups by path (rename), fileid (open with delegation,
+ * delegation return), filehandle (CB_GETATTR) and stateid (CB_RECALL)
+ * do not scan all of a client's state under |client_state.lock|.
+ * Must be a power of two
+ */
+#define CLIENT_STATE_HASH_SIZE 1024
+#define client_state_bucket(table, hash) \
+    (&(table)[(hash) & (CLIENT_STATE_HASH_SIZE-1)])
+
 struct client_state {
     struct list_entry opens; /* list of associated nfs41_open_state */
     struct list_entry delegations; /* list of associated delegations */
+    /* indexes, protected by |lock| like the lists above */
+    struct list_entry open_path_hash[CLIENT_STATE_HASH_SIZE];
+    struct list_entry open_fileid_hash[CLIENT_STATE_HASH_SIZE];
+    struct list_entry deleg_fileid_hash[CLIENT_STATE_HASH_SIZE];
+    struct list_entry deleg_fh_hash[CLIENT_STATE_HASH_SIZE];
+    struct list_entry deleg_stateid_hash[CLIENT_STATE_HASH_SIZE];
+    uint32_t delegation_count; /* number of entries in |delegations| */
+    bool_t delegation_trim_running;
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+    struct list_entry dir_delegations; /* see daemon/delegation.c */
+    uint32_t dir_delegation_count;
+    bool_t dir_delegation_unsupported;
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
     CRITICAL_SECTION lock;
 };
 
@@ -205,6 +463,7 @@ typedef struct __nfs41_client {
     client_owner4 owner;
     uint64_t clnt_id;
     uint32_t seq_id;
+    uint64_t server_minor_id; /* server_owner.minor_id from exchangeid */
     uint32_t roles;
     SRWLOCK exid_lock;
     struct __nfs41_session *session;
@@ -227,15 +486,59 @@ typedef struct __nfs41_client {
 } nfs41_client;
 
 #define NFS41_MAX_NUM_SLOTS NFS41_MAX_RPC_REQS
+/* slots per |nfs41_slot_chunk|, must be a multiple of 32 */
+#define NFS41_SLOT_CHUNK_SLOTS 128
+#define NFS41_SLOT_CHUNK_WORDS (NFS41_SLOT_CHUNK_SLOTS/32)
+#define NFS41_SLOT_MAX_CHUNKS \
+    ((NFS41_MAX_NUM_SLOTS+NFS41_SLOT_CHUNK_SLOTS-1)/NFS41_SLOT_CHUNK_SLOTS)
+
+typedef struct __nfs41_slot_chunk {
+    volatile LONG used_bitmap[NFS41_SLOT_CHUNK_WORDS];
+    volatile LONG seq_nums[NFS41_SLOT_CHUNK_SLOTS];
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+    /* index+1 in |nfs41_slot_table.users| of the user holding the slot */
+    volatile LONG owners[NFS41_SLOT_CHUNK_SLOTS];
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+} nfs41_slot_chunk;
+
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+/* users per slot table which get their own fair share */
+#define NFS41_SLOT_FAIR_USERS 64
+#define NFS41_SLOT_USER_NONE ((LONG)-1)
+
+typedef struct __nfs41_slot_user {
+    volatile LONG uid; /* |NFS41_SLOT_USER_NONE| if unused */
+    volatile LONG in_flight;
+    volatile LONG waiting;
+} nfs41_slot_user;
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+
 typedef struct __nfs41_slot_table {
-    uint32_t seq_nums[NFS41_MAX_NUM_SLOTS];
-    uint32_t used_slots[NFS41_MAX_NUM_SLOTS];
-    uint32_t max_slots;
-    uint32_t highest_used;
-    uint32_t num_used;
-    ULONGLONG target_delay;
+    /*
+     * The table starts with the slots the server granted in
+     * CREATE_SESSION and grows (up to |NFS41_MAX_NUM_SLOTS|) when the
+     * server raises |target_highest_slotid|. Chunks are only added
+     * (under |lock|) and freed with the session, so their addresses
+     * stay valid for the lock-free users; shrinking only lowers
+     * |max_slots|.
+     * |chunks|, |num_chunks|, |max_slots|, |num_used| and
+     * |target_delay| are only accessed with interlocked ops, |lock|
+     * and |cond| are used by threads waiting for a free slot and for
+     * adding chunks
+     */
+    nfs41_slot_chunk *volatile chunks[NFS41_SLOT_MAX_CHUNKS];
+    volatile LONG num_chunks;
+    volatile uint32_t max_slots;
+    volatile LONG num_used;
+    volatile LONG num_waiters;
+    volatile LONG64 target_delay;
     CRITICAL_SECTION lock;
     CONDITION_VARIABLE cond;
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+    /* slots held and waited for per user, entries are never removed */
+    nfs41_slot_user users[NFS41_SLOT_FAIR_USERS];
+    volatile LONG user_waiters; /* sum of |users[].waiting| */
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
 } nfs41_slot_table;
 
 /*
@@ -269,14 +572,19 @@ struct replay_cache {
     uint32_t length;
 };
 
-typedef struct __nfs41_cb_session {
+typedef struct __nfs41_cb_slot {
     struct {
         struct replay_cache arg;
         struct replay_cache res;
     } replay;
+    uint32_t seqnum;
+    bool_t busy; /* a CB_COMPOUND on this slot is being processed */
+} nfs41_cb_slot;
+
+typedef struct __nfs41_cb_session {
+    SRWLOCK lock; /* protects |slots[].seqnum| and |slots[].busy| */
+    nfs41_cb_slot slots[NFS41_MAX_CB_REQS];
     const unsigned char *cb_sessionid; /* -> nfs41_session.session_id */
-    uint32_t cb_seqnum;
-    uint32_t cb_slotid;
 } nfs41_cb_session;
 
 typedef struct __nfs41_session {
@@ -287,14 +595,77 @@ typedef struct __nfs41_session {
     uint32_t lease_time;
     nfs41_slot_table table; /* array of slots */
     struct {
-        HANDLE thread_handle;
-        HANDLE cancel_event;
+        struct list_entry entry; /* in the renewal scheduler */
+        bool_t registered;
+        /* |GetTickCount64()| of the last successful SEQUENCE */
+        volatile LONGLONG last_sequence;
+        ULONGLONG last_attempt;
+        HANDLE thread_handle; /* renewal in progress */
     } renew;
     bool_t isValidState;
     uint32_t flags;
     nfs41_cb_session cb_session;
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+    /* COMMITs waiting for |nfs41_commit_coalesced()| */
+    struct {
+        SRWLOCK lock;
+        CONDITION_VARIABLE cond;
+        struct list_entry pending;
+        bool_t busy; /* a thread is sending the pending COMMITs */
+    } commit_batch;
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+#ifdef NFS41_DRIVER_DAEMON_GETATTR_COALESCING
+    /* GETATTRs waiting for |nfs41_getattr_coalesced()| */
+    struct {
+        SRWLOCK lock;
+        CONDITION_VARIABLE cond;
+        struct list_entry pending;
+        uint32_t senders; /* GETATTR compounds in flight */
+    } getattr_batch;
+#endif /* NFS41_DRIVER_DAEMON_GETATTR_COALESCING */
 } nfs41_session;
 
+/*
+ * Name/attribute cache configuration, from the "acregmin", "acregmax",
+ * "acdirmin", "acdirmax" and "namecachesize" mount options.
+ * The cache is per |nfs41_server|, so the first mount of a server
+ * decides the settings for all mounts of that server.
+ */
+typedef struct __nfs41_name_cache_config {
+    uint32_t acregmin; /* in seconds */
+    uint32_t acregmax;
+    uint32_t acdirmin;
+    uint32_t acdirmax;
+    uint32_t max_size; /* in bytes */
+} nfs41_name_cache_config;
+
+/*
+ * Per-mount statistics, returned by |NFS41_SYSOP_GET_MOUNT_STATS|.
+ * The counters are only updated with interlocked operations, see
+ * |nfsd_mount_stats_add()| in daemon_debug.c
+ */
+typedef struct __nfs41_root_stats {
+    struct list_entry entry; /* in the daemon's list of mounts */
+    char name[NFS41_MOUNT_STATS_NAME_LEN]; /* "server@port:/export" */
+    volatile LONG64 compounds;
+    volatile LONG64 read_bytes;
+    volatile LONG64 write_bytes;
+    volatile LONG64 retransmits;
+    volatile LONG64 delays;
+    volatile LONG64 slot_waits;
+    volatile LONG64 slot_wait_usecs;
+    volatile LONG64 slot_wait_max_usecs;
+    volatile LONG64 slot_starvations;
+    volatile LONG64 slot_resizes;
+    volatile LONG64 slot_recalls;
+    /* |GetTickCount64()| of the last slot starvation warning */
+    volatile LONG64 slot_warn_time;
+    /* Last |max_slots| and highest slotid of its sessions */
+    volatile LONG max_slots;
+    volatile LONG highest_slot;
+    NFS41_LATENCY_HISTOGRAM rpc;
+} nfs41_root_stats;
+
 /* nfs41_root reference counting:
  * similar to nfs41_open_state, the driver holds an implicit reference
  * between MOUNT and UNMOUNT. all other upcalls use upcall_root_ref() on
@@ -311,9 +682,49 @@ typedef struct __nfs41_root {
     bool supports_nfs42_copy;
     bool supports_nfs42_deallocate;
     bool supports_nfs42_clone;
+    bool supports_nfs42_write_same; /* cleared on NFS4ERR_NOTSUPP */
     DWORD nfsminorvers;
     uint32_t wsize;
     uint32_t rsize;
+    uint32_t nconnect;
+    nfs41_name_cache_config name_cache_config;
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+    uint32_t close_timeout; /* "closetimeo", in seconds */
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+    bool sparse_write; /* "sparsewrite" */
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+    bool fsc; /* "fsc" */
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+#ifdef NFS41_DRIVER_DAEMON_QOS
+    nfs41_qos qos; /* "maxbw", "maxiops" */
+#endif /* NFS41_DRIVER_DAEMON_QOS */
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+    nfs41_autotune autotune; /* "autotune" */
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
+#ifdef NFS41_DRIVER_DAEMON_TOP_STATS
+    nfs41_topstats topstats; /* "nfsclientdctl top" */
+#endif /* NFS41_DRIVER_DAEMON_TOP_STATS */
+    nfs41_sockopts sockopts;
+    nfs41_root_stats stats;
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+    struct { /* tree walk detector, see readdir.c */
+        SRWLOCK lock;
+        uint32_t last_hash; /* path of the last enumerated directory */
+        uint32_t last_parent_hash; /* ... and of its parent */
+        uint32_t score;
+    } treewalk;
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+    struct { /* fs_locations of referrals, see namespace.c */
+        SRWLOCK lock;
+        struct list_entry list; /* most recently used first */
+        uint32_t count;
+    } referral_cache;
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    /* name cache snapshot of "immutable" mounts, see ncsnap.c */
+    struct __nfs41_ncsnap *ncsnap;
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
 #pragma warning( push )
 /* Ignore "C4324: structure was padded due to alignment specifier" */
 #pragma warning (disable : 4324)
@@ -368,9 +779,31 @@ int nfs41_root_mount_server(
 int nfs41_root_mount_referral(
     IN nfs41_root *root,
     IN const fs_locations4 *locations,
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+    IN OUT uint32_t *preferred,
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
     OUT const fs_location4 **loc_out,
     OUT nfs41_client **client_out);
 
+#ifdef NFS41_DRIVER_DAEMON_REFERRAL_CACHE
+/* no location mounted yet, |nfs41_root_mount_referral()| probes them */
+#define REFERRAL_LOCATION_NONE UINT32_MAX
+
+bool nfs41_root_referral_cache_get(
+    IN nfs41_root *root,
+    IN const nfs41_fh *parent,
+    IN const nfs41_component *name,
+    OUT fs_locations4 *locations,
+    OUT uint32_t *preferred);
+
+void nfs41_root_referral_cache_put(
+    IN nfs41_root *root,
+    IN const nfs41_fh *parent,
+    IN const nfs41_component *name,
+    IN const fs_locations4 *locations,
+    IN uint32_t preferred);
+#endif /* NFS41_DRIVER_DAEMON_REFERRAL_CACHE */
+
 static __inline nfs41_session* nfs41_root_session(
     IN nfs41_root *root)
 {
@@ -414,10 +847,21 @@ void nfs41_session_get_slot(
     OUT uint32_t *seq, 
     OUT uint32_t *highest);
 
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+/* user on whose behalf the current thread gets slots */
+void nfs41_session_thread_user_set(
+    IN uint32_t uid);
+void nfs41_session_thread_user_clear(void);
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+
 int nfs41_session_recall_slot(
     IN nfs41_session *session,
     IN OUT uint32_t target_highest_slotid);
 
+void nfs41_session_set_max_slots(
+    IN nfs41_session *session,
+    IN uint32_t max_requests);
+
 struct __nfs41_sequence_args;
 void nfs41_session_sequence(
     struct __nfs41_sequence_args *args,
@@ -441,6 +885,7 @@ int nfs41_server_find_or_create(
     IN const char *server_owner_major_id,
     IN const char *server_scope,
     IN const netaddr4 *addr,
+    IN const nfs41_name_cache_config *nc_config,
     OUT nfs41_server **server_out);
 
 void nfs41_server_ref(
@@ -477,6 +922,7 @@ int nfs41_client_create(
     IN const client_owner4 *owner,
     IN bool_t is_data,
     IN const struct __nfs41_exchange_id_res *exchangeid,
+    IN const nfs41_name_cache_config *nc_config,
     OUT nfs41_client **client_out);
 
 int nfs41_client_renew(
@@ -485,6 +931,20 @@ int nfs41_client_renew(
 void nfs41_client_free(
     IN nfs41_client *client);
 
+/* hash functions for the |client_state| indexes */
+uint32_t client_state_path_hash(
+    IN const char *path,
+    IN unsigned short len);
+
+uint32_t client_state_fileid_hash(
+    IN uint64_t fileid);
+
+uint32_t client_state_fh_hash(
+    IN const nfs41_fh *fh);
+
+uint32_t client_state_stateid_hash(
+    IN const stateid4 *stateid);
+
 static __inline nfs41_server* client_server(
     IN nfs41_client *client)
 {
@@ -497,6 +957,16 @@ static __inline nfs41_server* client_server(
     return server;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+/* remember that the client's server does not support |notsupp_op| */
+static __inline void client_server_set_notsupp(
+    IN nfs41_client *client,
+    IN LONG notsupp_op)
+{
+    (void)InterlockedOr(&client_server(client)->nfs42_notsupp, notsupp_op);
+}
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+
 
 /* nfs41_superblock.c */
 int nfs41_superblock_for_fh(
@@ -505,12 +975,84 @@ int nfs41_superblock_for_fh(
     IN const nfs41_fh *parent OPTIONAL,
     OUT nfs41_path_fh *file);
 
+/* the attributes |nfs41_superblock_for_fh()| fetches for a new superblock */
+void nfs41_superblock_attr_request(
+    OUT bitmap4 *attr_request);
+
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+/*
+ * Like |nfs41_superblock_for_fh()|, but fills in a new superblock from
+ * |fsinfo| (requested with |nfs41_superblock_attr_request()| by the
+ * caller) and |supports_named_attrs| instead of sending a compound
+ */
+int nfs41_superblock_for_fh_prefetched(
+    IN nfs41_session *session,
+    IN const nfs41_fsid *fsid,
+    IN const nfs41_fh *parent OPTIONAL,
+    IN const nfs41_file_info *fsinfo,
+    IN bool_t supports_named_attrs,
+    OUT nfs41_path_fh *file);
+
+/* |TRUE| if the session's server has no superblocks yet */
+bool_t nfs41_superblock_list_empty(
+    IN nfs41_session *session);
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+
 static __inline void nfs41_superblock_getattr_mask(
     IN const nfs41_superblock *superblock,
     OUT bitmap4 *attrs)
 {
     bitmap4_cpy(attrs, &superblock->default_getattr);
 }
+
+/*
+ * GETATTR attribute profiles for callers which only need a few
+ * attributes: Smaller masks mean smaller replies and less decoding
+ * than with |nfs41_superblock_getattr_mask()|
+ */
+enum nfs41_getattr_profile {
+    /* after WRITE/COMMIT/LAYOUTCOMMIT: what a write can change */
+    NFS41_GETATTR_PROFILE_WRITE,
+    /* coherency checks, which only compare the change attribute */
+    NFS41_GETATTR_PROFILE_CHANGE,
+    /* directory listings which only return the names */
+    NFS41_GETATTR_PROFILE_NAMES
+};
+
+/* used by |get_superblock_attrs()| to fill |superblock->profile_getattr| */
+static __inline void nfs41_getattr_profile_mask(
+    IN enum nfs41_getattr_profile profile,
+    OUT bitmap4 *attrs)
+{
+    attrs->count = 2;
+    attrs->arr[2] = 0;
+    switch (profile) {
+    case NFS41_GETATTR_PROFILE_WRITE:
+        /* |FATTR4_WORD0_TYPE| for the |NF4NAMEDATTR| checks */
+        attrs->arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE
+            | FATTR4_WORD0_SIZE;
+        attrs->arr[1] = FATTR4_WORD1_SPACE_USED
+            | FATTR4_WORD1_TIME_MODIFY;
+        break;
+    case NFS41_GETATTR_PROFILE_CHANGE:
+        attrs->arr[0] = FATTR4_WORD0_CHANGE;
+        attrs->arr[1] = 0;
+        break;
+    case NFS41_GETATTR_PROFILE_NAMES:
+    default:
+        attrs->arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_FILEID;
+        attrs->arr[1] = 0;
+        break;
+    }
+}
+
+static __inline void nfs41_superblock_getattr_profile(
+    IN const nfs41_superblock *superblock,
+    IN enum nfs41_getattr_profile profile,
+    OUT bitmap4 *attrs)
+{
+    bitmap4_cpy(attrs, &superblock->profile_getattr[profile]);
+}
 static __inline void nfs41_superblock_supported_attrs(
     IN const nfs41_superblock *superblock,
     IN OUT bitmap4 *attrs)
@@ -547,11 +1089,25 @@ int nfs41_rpc_clnt_create(
     IN uint32_t uid,
     IN uint32_t gid,
     IN uint32_t sec_flavor,
+    IN const nfs41_sockopts *sockopts,
     OUT nfs41_rpc_clnt **rpc_out);
 
 void nfs41_rpc_clnt_free(
     IN nfs41_rpc_clnt *rpc);
 
+int nfs41_rpc_clnt_add_trunk_conns(
+    IN nfs41_rpc_clnt *rpc,
+    IN const unsigned char *sessionid,
+    IN uint32_t count);
+
+void nfs41_rpc_clnt_rebind_trunk_conns(
+    IN nfs41_rpc_clnt *rpc,
+    IN const unsigned char *sessionid);
+
+struct __auth *nfs41_authsys_create(
+    IN uint32_t uid,
+    IN uint32_t gid);
+
 int nfs41_send_compound(
     IN nfs41_rpc_clnt *rpc,
     IN char *inbuf,
@@ -582,6 +1138,80 @@ void nfs41_open_stateid_arg(
     IN nfs41_open_state *state,
     OUT struct __stateid_arg *arg);
 
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+bool_t nfs41_client_file_open_for_write(
+    IN nfs41_client *client,
+    IN uint64_t fileid);
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+void nfs41_deferred_close_flush_file(
+    IN nfs41_client *client,
+    IN const nfs41_fh *fh);
+
+void nfs41_deferred_close_flush_root(
+    IN nfs41_root *root);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+
+/* setattr.c */
+struct _FILE_BASIC_INFORMATION;
+int nfs41_basicinfo_to_setattr(
+    IN nfs41_open_state *state,
+    IN const struct _FILE_BASIC_INFORMATION *basic_info,
+    OUT nfs41_file_info *info);
+
+
+/* lock.c */
+void nfs41_lock_notify(
+    IN nfs41_client *client,
+    IN const nfs41_fh *fh,
+    IN const state_owner4 *owner);
+
+/* fsctl.c */
+void nfs42_copy_offload_done(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid,
+    IN uint32_t status,
+    IN uint64_t count,
+    IN uint32_t committed,
+    IN const unsigned char *writeverf);
+
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+void nfs41_extent_map_update(
+    IN nfs41_open_state *state,
+    IN uint64_t offset,
+    IN uint64_t length,
+    IN bool_t data,
+    IN uint64_t change);
+
+void nfs41_extent_map_invalidate(
+    IN nfs41_open_state *state);
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
+
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+/* readwrite.c */
+void nfs41_readahead_invalidate(
+    IN nfs41_open_state *state);
+
+void nfs41_readahead_shutdown(
+    IN nfs41_open_state *state);
+
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+void nfs41_readahead_prefetched(
+    IN nfs41_open_state *state,
+    IN const unsigned char *data,
+    IN uint32_t len,
+    IN bool_t eof);
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
+
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+/* readdir.c */
+void nfs41_readdir_ahead_free(
+    IN nfs41_open_state *state);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
+
 
 /* ea.c */
 int nfs41_ea_set(
@@ -144,8 +144,27 @@ struct cb_recall_res {
 };
 
 /* OP_CB_NOTIFY */
+struct notify4;
+
+/*
+ * One directory entry changed by a CB_NOTIFY, decoded from the
+ * |notify4| list by |op_cb_notify_args()|. |len| is zero for
+ * changes of the directory itself
+ * (|NOTIFY4_CHANGE_DIR_ATTRS|, |NOTIFY4_CHANGE_COOKIE_VERIFIER|)
+ */
+struct notify_dir_entry {
+    uint32_t                type; /* |enum notify_type4| */
+    unsigned short          len;
+    char                    name[NFS41_MAX_COMPONENT_LEN+1];
+};
+
 struct cb_notify_args {
-    uint32_t                target_highest_slotid;
+    stateid4                stateid;
+    nfs41_fh                fh;
+    struct notify4          *notify_list;
+    uint32_t                notify_count;
+    struct notify_dir_entry *entries;
+    uint32_t                entry_count;
 };
 
 struct cb_notify_res {
@@ -190,7 +209,8 @@ struct cb_wants_cancelled_res {
 
 /* OP_CB_NOTIFY_LOCK */
 struct cb_notify_lock_args {
-    uint32_t                target_highest_slotid;
+    nfs41_fh                fh;
+    state_owner4            lock_owner;
 };
 
 struct cb_notify_lock_res {
@@ -224,6 +244,21 @@ struct cb_notify_deviceid_res {
     enum_t                  status;
 };
 
+/* OP_CB_OFFLOAD */
+struct cb_offload_args {
+    nfs41_fh                fh;
+    stateid4                stateid;
+    enum_t                  status;
+    /* case NFS4_OK: write_response4, otherwise bytes copied so far */
+    uint64_t                count;
+    uint32_t                committed; /* stable_how4 */
+    unsigned char           writeverf[NFS4_VERIFIER_SIZE];
+};
+
+struct cb_offload_res {
+    enum_t                  status;
+};
+
 /* CB_COMPOUND */
 #define CB_COMPOUND_MAX_TAG         64
 #define CB_COMPOUND_MAX_OPERATIONS  16
@@ -234,7 +269,10 @@ union cb_op_args {
     struct cb_sequence_args sequence;
     struct cb_getattr_args  getattr;
     struct cb_recall_args   recall;
+    struct cb_notify_args   notify;
+    struct cb_notify_lock_args notify_lock;
     struct cb_notify_deviceid_args notify_deviceid;
+    struct cb_offload_args  offload;
 };
 struct cb_argop {
     enum_t                  opnum;
@@ -259,7 +297,10 @@ union cb_op_res {
     struct cb_sequence_res  sequence;
     struct cb_getattr_res   getattr;
     struct cb_recall_res    recall;
+    struct cb_notify_res    notify;
+    struct cb_notify_lock_res notify_lock;
     struct cb_notify_deviceid_res notify_deviceid;
+    struct cb_offload_res   offload;
 };
 struct cb_resop {
     enum_t                  opnum;
@@ -282,5 +323,7 @@ bool_t proc_cb_compound_res(XDR *xdr, struct cb_compound_res *res);
 struct __nfs41_session;
 void nfs41_callback_session_init(
     IN struct __nfs41_session *session);
+void nfs41_callback_session_reset(
+    IN struct __nfs41_session *session);
 
 #endif /* !__NFS41_CALLBACK_H__ */
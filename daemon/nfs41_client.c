@@ -61,7 +61,8 @@ static int pnfs_client_init(
         status = ERROR_NOT_ENOUGH_MEMORY;
         goto out;
     }
-    pnfsstat = pnfs_file_device_list_create(&client->devices);
+    pnfsstat = pnfs_file_device_list_create(client->server->owner,
+        client->clnt_id, &client->devices);
     if (pnfsstat) {
         status = ERROR_NOT_ENOUGH_MEMORY;
         goto out_err_layouts;
@@ -78,14 +79,15 @@ out_err_layouts:
 static int update_server(
     IN nfs41_client *client,
     IN const char *server_scope,
-    IN const server_owner4 *owner)
+    IN const server_owner4 *owner,
+    IN const nfs41_name_cache_config *nc_config)
 {
     nfs41_server *server;
     int status;
 
     /* find a server matching the owner.major_id and scope */
     status = nfs41_server_find_or_create(owner->so_major_id,
-        server_scope, nfs41_rpc_netaddr(client->rpc), &server);
+        server_scope, nfs41_rpc_netaddr(client->rpc), nc_config, &server);
     if (status)
         goto out;
 
@@ -101,13 +103,15 @@ out:
 
 static int update_exchangeid_res(
     IN nfs41_client *client,
-    IN const nfs41_exchange_id_res *exchangeid)
+    IN const nfs41_exchange_id_res *exchangeid,
+    IN const nfs41_name_cache_config *nc_config)
 {
     client->clnt_id = exchangeid->clientid;
     client->seq_id = exchangeid->sequenceid;
+    client->server_minor_id = exchangeid->server_owner.so_minor_id;
     client->roles = exchangeid->flags & EXCHGID4_FLAG_MASK_PNFS;
     return update_server(client, exchangeid->server_scope,
-        &exchangeid->server_owner);
+        &exchangeid->server_owner, nc_config);
 }
 
 int nfs41_client_create(
@@ -115,10 +119,12 @@ int nfs41_client_create(
     IN const client_owner4 *owner,
     IN bool_t is_data,
     IN const nfs41_exchange_id_res *exchangeid,
+    IN const nfs41_name_cache_config *nc_config,
     OUT nfs41_client **client_out)
 {
     int status;
     nfs41_client *client;
+    uint32_t i;
 
     client = calloc(1, sizeof(nfs41_client));
     if (client == NULL) {
@@ -130,12 +136,22 @@ int nfs41_client_create(
     client->rpc = rpc;
     client->is_data = is_data;
 
-    status = update_exchangeid_res(client, exchangeid);
+    status = update_exchangeid_res(client, exchangeid, nc_config);
     if (status)
         goto out_err_client;
 
     list_init(&client->state.opens);
     list_init(&client->state.delegations);
+    for (i = 0; i < CLIENT_STATE_HASH_SIZE; i++) {
+        list_init(&client->state.open_path_hash[i]);
+        list_init(&client->state.open_fileid_hash[i]);
+        list_init(&client->state.deleg_fileid_hash[i]);
+        list_init(&client->state.deleg_fh_hash[i]);
+        list_init(&client->state.deleg_stateid_hash[i]);
+    }
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+    list_init(&client->state.dir_delegations);
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
     /*
      * Disable spin count as |client->state.lock| is typically used to
      * protect list searches, which takes a long time
@@ -207,7 +223,8 @@ int nfs41_client_renew(
     dprint_roles(2, exchangeid.flags);
 
     AcquireSRWLockExclusive(&client->exid_lock);
-    status = update_exchangeid_res(client, &exchangeid);
+    status = update_exchangeid_res(client, &exchangeid,
+        &client->root->name_cache_config);
     ReleaseSRWLockExclusive(&client->exid_lock);
 out:
     return status;
@@ -235,6 +252,45 @@ void nfs41_client_free(
 }
 
 
+/* client_state hash indexes */
+static uint32_t client_state_hash_bytes(
+    IN const void *buf,
+    IN size_t len)
+{
+    const unsigned char *s = (const unsigned char *)buf;
+    uint32_t hash = 2166136261UL; /* FNV-1a */
+
+    while (len--)
+        hash = (hash ^ *s++) * 16777619UL;
+    return hash;
+}
+
+uint32_t client_state_path_hash(
+    IN const char *path,
+    IN unsigned short len)
+{
+    return client_state_hash_bytes(path, len);
+}
+
+uint32_t client_state_fileid_hash(
+    IN uint64_t fileid)
+{
+    return client_state_hash_bytes(&fileid, sizeof(fileid));
+}
+
+uint32_t client_state_fh_hash(
+    IN const nfs41_fh *fh)
+{
+    return client_state_hash_bytes(fh->fh, fh->len);
+}
+
+uint32_t client_state_stateid_hash(
+    IN const stateid4 *stateid)
+{
+    return client_state_hash_bytes(stateid->other, NFS4_STATEID_OTHER);
+}
+
+
 /* client_owner generation
  * we choose to use MAC addresses to generate a client_owner value that
  * is unique to a machine and persists over restarts.  because the client
@@ -31,6 +31,8 @@
 #include "recovery.h"
 #include "name_cache.h"
 #include "daemon_debug.h"
+#include "nfs41_driver.h"
+#include "nfs41_daemon.h"
 #include "rpc/rpc.h"
 #include "rpc/auth_sspi.h"
 
@@ -125,29 +127,11 @@ static int create_new_rpc_auth(nfs41_session *session, uint32_t op,
             sec_flavor = AUTH_NONE;
         }
         else if (secinfo[i].sec_flavor == AUTH_SYS) {
-            char machname[MAXHOSTNAMELEN + 1];
-            gid_t aup_gids[RPC_AUTHUNIX_AUP_MAX_NUM_GIDS];
-            int num_aup_gids = 0;
-
-            if (!fill_auth_unix_aup_gids(GetCurrentThreadToken(),
-                aup_gids, &num_aup_gids)) {
-                eprintf("create_new_rpc_auth: "
-                    "fill_auth_unix_aup_gids() failed\n");
-                continue;
-            }
-
-            if (gethostname(machname, sizeof(machname)) == -1) {
-                eprintf("create_new_rpc_auth: gethostname failed\n");
-                continue;
-            }
-            machname[sizeof(machname) - 1] = '\0';
-            auth = authsys_create(machname,
-                session->client->rpc->uid,
-                session->client->rpc->gid,
-                num_aup_gids, aup_gids);
+            auth = nfs41_authsys_create(session->client->rpc->uid,
+                session->client->rpc->gid);
             if (auth == NULL) {
                 eprintf("create_new_rpc_auth: "
-                    "authsys_create failed\n");
+                    "nfs41_authsys_create failed\n");
                 continue;
             }
             sec_flavor = AUTH_SYS;
@@ -171,17 +155,141 @@ out:
     return status;
 }
 
+/* the operation a compound's RPC round trip is counted for */
+static uint32_t compound_stats_op(
+    const nfs41_compound *compound)
+{
+    uint32_t i, op = OP_SEQUENCE;
+
+    for (i = 0; i < compound->args.argarray_count; i++) {
+        op = compound->args.argarray[i].op;
+        if ((op != OP_SEQUENCE) && (op != OP_PUTFH) &&
+            (op != OP_PUTROOTFH) && (op != OP_PUTPUBFH))
+            break;
+    }
+    return op;
+}
+
+/* READ/WRITE payload bytes of a compound */
+static void compound_io_bytes(
+    IN const nfs41_compound *compound,
+    IN int rpc_status,
+    OUT uint32_t *read_bytes,
+    OUT uint32_t *write_bytes)
+{
+    uint32_t i, op;
+
+    *read_bytes = *write_bytes = 0;
+    for (i = 0; i < compound->args.argarray_count; i++) {
+        op = compound->args.argarray[i].op;
+        if (op == OP_WRITE) {
+            *write_bytes += ((const nfs41_write_args *)
+                compound->args.argarray[i].arg)->data_len;
+        }
+        else if ((op == OP_READ) && (rpc_status == 0) &&
+            (i < compound->res.resarray_count)) {
+            const nfs41_read_res *read_res = (const nfs41_read_res *)
+                compound->res.resarray[i].res;
+            if (read_res->status == NFS4_OK)
+                *read_bytes += read_res->resok4.data_len;
+        }
+    }
+}
+
+/* Add a |compound_encode_send_decode()| round trip to the flight recorder */
+static void compound_flight_record(
+    IN const nfs41_compound *compound,
+    IN int rpc_status,
+    IN int retry_count,
+    IN const FILETIME *send_time,
+    IN uint32_t read_bytes,
+    IN uint32_t write_bytes,
+    IN LONGLONG rpc_start)
+{
+    const nfs41_sequence_args *seq_args;
+    NFS41_FLIGHT_RECORD rec;
+    uint32_t i;
+
+    (void)memset(&rec, 0, sizeof(rec));
+    rec.send_time = ((ULONGLONG)send_time->dwHighDateTime << 32) |
+        send_time->dwLowDateTime;
+    rec.xid = clnt_get_last_xid();
+    rec.slotid = ULONG_MAX;
+    if (compound->args.argarray[0].op == OP_SEQUENCE) {
+        seq_args = (const nfs41_sequence_args *)
+            compound->args.argarray[0].arg;
+        rec.slotid = seq_args->sa_slotid;
+        rec.sequenceid = seq_args->sa_sequenceid;
+    }
+    rec.rpc_status = rpc_status;
+    rec.nfs_status = compound->res.status;
+    rec.retry = (USHORT)min(retry_count, USHRT_MAX);
+    rec.num_ops = (UCHAR)min(compound->args.argarray_count, UCHAR_MAX);
+    rec.num_results = (UCHAR)min(compound->res.resarray_count, UCHAR_MAX);
+    rec.io_bytes = read_bytes + write_bytes;
+
+    for (i = 0; (i < compound->args.argarray_count) &&
+        (i < NFS41_FLIGHT_RECORDER_MAX_OPS); i++)
+        rec.ops[i] = (UCHAR)compound->args.argarray[i].op;
+
+    nfsd_flight_recorder_add(&rec, rpc_start);
+}
+
+/*
+ * NFS4ERR_DELAY/NFS4ERR_GRACE backoff
+ *
+ * The delay doubles with each retry, starting at
+ * |COMPOUND_DELAY_MIN_MS| (|COMPOUND_GRACE_MIN_MS| for
+ * NFS4ERR_GRACE, grace periods usually last a minute or more), up to
+ * |COMPOUND_DELAY_MAX_MS|. The second half of each delay is random,
+ * so the retries of many threads which got NFS4ERR_DELAY at the same
+ * time do not hit the server at the same time again.
+ */
+#define COMPOUND_DELAY_MIN_MS   100
+#define COMPOUND_GRACE_MIN_MS   1000
+#define COMPOUND_DELAY_MAX_MS   5000
+
+static DWORD compound_delay_backoff(
+    IN unsigned int delay_count,
+    IN bool_t grace)
+{
+    static __declspec(thread) uint32_t seed = 0;
+    const DWORD base = grace?COMPOUND_GRACE_MIN_MS:COMPOUND_DELAY_MIN_MS;
+    DWORD delay;
+
+    if (delay_count > 16)
+        delay = COMPOUND_DELAY_MAX_MS;
+    else
+        delay = min(base << (delay_count - 1), COMPOUND_DELAY_MAX_MS);
+
+    /* xorshift32 */
+    if (seed == 0)
+        seed = ((uint32_t)GetTickCount64() ^ GetCurrentThreadId()) | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return (delay / 2) + (seed % ((delay / 2) + 1));
+}
+
 int compound_encode_send_decode(
     nfs41_session *session,
     nfs41_compound *compound,
     bool_t try_recovery)
 {
     int status, retry_count = 0, delayby = 0, secinfo_status;
+    unsigned int delay_count = 0;
     nfs41_sequence_args *args = (nfs41_sequence_args *)
         compound->args.argarray[0].arg;
     uint32_t saved_sec_flavor;
     AUTH *saved_auth;
     int op1 = compound->args.argarray[0].op;
+    LONGLONG rpc_start;
+    FILETIME send_time;
+    uint32_t read_bytes, write_bytes;
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    ULONG64 rpc_cycles, xdr_cycles;
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
 
 retry:
     /* send compound */
@@ -192,8 +300,42 @@ retry:
             (int)retry_count);
     }
     set_expected_res(compound);
+    NFSD_TRACE_EVENT("RpcSend", NFSD_TRACE_KEYWORD_RPC,
+        TraceLoggingUInt32(compound_stats_op(compound), "Op"),
+        TraceLoggingUInt32((op1 == OP_SEQUENCE)?
+            args->sa_slotid:UINT32_MAX, "SlotId"),
+        TraceLoggingUInt32((op1 == OP_SEQUENCE)?
+            args->sa_sequenceid:0, "SequenceId"),
+        TraceLoggingInt32(retry_count, "Retry"));
+    rpc_start = nfsd_op_stats_start();
+    GetSystemTimeAsFileTime(&send_time);
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    rpc_cycles = nfsd_cpu_cycles();
+    xdr_cycles = nfsd_cpu_stats_xdr_cycles();
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
     status = nfs41_send_compound(session->client->rpc,
         (char *)&compound->args, (char *)&compound->res);
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    nfsd_cpu_stats_rpc_done(rpc_cycles, xdr_cycles);
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
+    nfsd_op_stats_rpc_done(compound_stats_op(compound), rpc_start);
+    compound_io_bytes(compound, status, &read_bytes, &write_bytes);
+    if (session->client->root) {
+        nfsd_mount_stats_rpc_done(&session->client->root->stats,
+            read_bytes, write_bytes, rpc_start);
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+        nfs41_autotune_rpc_done(session, compound->args.argarray_count,
+            op1, status, read_bytes, write_bytes, rpc_start);
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
+    }
+    compound_flight_record(compound, status, retry_count, &send_time,
+        read_bytes, write_bytes, rpc_start);
+    NFSD_TRACE_EVENT("RpcReceive", NFSD_TRACE_KEYWORD_RPC,
+        TraceLoggingUInt32(compound_stats_op(compound), "Op"),
+        TraceLoggingUInt32((op1 == OP_SEQUENCE)?
+            args->sa_slotid:UINT32_MAX, "SlotId"),
+        TraceLoggingInt32(status, "RpcStatus"),
+        TraceLoggingUInt32(compound->res.status, "NfsStatus"));
     // bump sequence number if sequence op succeeded.
     if (compound->res.resarray_count > 0 && 
             compound->res.resarray[0].op == OP_SEQUENCE) {
@@ -326,10 +468,12 @@ retry:
 #endif
             if (op1 == OP_SEQUENCE)
                 nfs41_session_free_slot(session, args->sa_slotid);
-            if (compound->res.status == NFS4ERR_GRACE)
-                delayby = 5000;
-            else
-                delayby = 500*retry_count;
+            if (session->client->root) {
+                (void)InterlockedIncrement64(
+                    &session->client->root->stats.delays);
+            }
+            delayby = (int)compound_delay_backoff(++delay_count,
+                (compound->res.status == NFS4ERR_GRACE));
             DPRINTF(1,
                 ("compound_encode_send_decode: "
                 "Compound returned '%s': "
@@ -349,7 +493,14 @@ retry:
                 }
             }
 #endif /* NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP */
+            /* the slot is free, only this thread waits */
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+            nfsd_worker_thread_delay_begin();
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
             Sleep(delayby);
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+            nfsd_worker_thread_delay_end();
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
             DPRINTF(1, ("Attempting to resend compound.\n"));
             goto do_retry;
 #ifndef RETRY_INDEFINITELY
@@ -45,7 +45,11 @@
 #define NFS4_EASIZE             8192
 #define NFS4_EANAME_SIZE        128
 
-#define NFSD_THREAD_STACK_SIZE (4*1024*1024)
+/*
+ * The big compound structures (e.g. |nfs41_lookup()|'s) come from the
+ * per-thread arena (see |nfsd_arena_alloc()|), not from the stack
+ */
+#define NFSD_THREAD_STACK_SIZE (2*1024*1024)
 
 /* Maximum number of AUP GIDs for |AUTH_UNIX| */
 #define RPC_AUTHUNIX_AUP_MAX_NUM_GIDS 16
@@ -62,13 +66,26 @@
 /*
  * |NFS41_ACL_MAX_ACE_ENTRIES| - Maximum number of ACLs per file/dir
  *
- * This value is limited by |UPCALL_BUF_SIZE| and |NFS4_OPAQUE_LIMIT_ATTR|,
- * a bigger value requirs adjustments of both variables
+ * This value is limited by |UPCALL_BUF_SIZE| (or |UPCALL_LARGE_BUF_SIZE|
+ * with |NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS|) and
+ * |NFS4_OPAQUE_LIMIT_ATTR|, a bigger value requirs adjustments of both
+ * variables
  */
 #define NFS41_ACL_MAX_ACE_ENTRIES (128)
 
 #define NFS41_MAX_SERVER_CACHE  1024
-#define NFS41_MAX_RPC_REQS      128
+/*
+ * |NFS41_MAX_RPC_REQS| - number of forechannel slots requested in
+ * CREATE_SESSION, and upper limit for the slot table (which grows in
+ * |NFS41_SLOT_CHUNK_SLOTS| steps, see |nfs41_slot_table|)
+ */
+#define NFS41_MAX_RPC_REQS      4096
+/*
+ * |NFS41_MAX_CB_REQS| - number of backchannel slots requested in
+ * CREATE_SESSION, each slot has its own replay cache
+ * (2*|NFS41_MAX_SERVER_CACHE|) in |nfs41_cb_session|
+ */
+#define NFS41_MAX_CB_REQS       16
 
 /*
  * UPCALL_BUF_SIZE - buffer size for |DeviceIoControl()|
@@ -80,6 +97,13 @@
  */
 #define UPCALL_BUF_SIZE     (16384)
 
+/*
+ * UPCALL_LARGE_BUF_SIZE - size of the shared downcall buffers used
+ * for results which do not fit into |UPCALL_BUF_SIZE|, see
+ * |NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS|
+ */
+#define UPCALL_LARGE_BUF_SIZE (256*1024)
+
 /*
  * NFS41_MAX_COMPONENT_LEN - MaximumComponentNameLength
  * reported for FileFsAttributeInformation
@@ -44,6 +44,10 @@
 #include "upcall.h"
 #include "sid.h"
 #include "accesstoken.h"
+#include "idcachefile.h"
+#include "fscache.h"
+#include "ncsnap.h"
+#include "mempressure.h"
 #include "util.h"
 /*
  * "git_version.h" is generated by
@@ -63,6 +67,14 @@ nfs41_daemon_globals nfs41_dg = {
     .default_uid = NFS_USER_NOBODY_UID,
     .default_gid = NFS_GROUP_NOGROUP_GID,
     .num_worker_threads = DEFAULT_NUM_THREADS,
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PREFETCH
+    .readdir_prefetch_max = READDIR_PREFETCH_MAX_DEFAULT,
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+    .treewalk_prefetch_max = TREEWALK_PREFETCH_MAX_DEFAULT,
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+    .max_delegations = MAX_DELEGATIONS_DEFAULT,
+    .authsys_gids_mode = AUTHSYS_GIDS_TOKEN,
     .crtdbgmem_flags = NFS41D_GLOBALS_CRTDBGMEM_FLAGS_NOT_SET,
 };
 
@@ -82,6 +94,19 @@ static int map_current_user_to_ids(nfs41_idmapper *idmapper,
     char username[UTF8_UNLEN+1];
     char pgroupname[UTF8_GNLEN+1];
     int status = NO_ERROR;
+#ifdef NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE
+    token_cache_key tokkey;
+    bool have_tokkey, gid_defaulted = false;
+
+    have_tokkey = get_token_cache_key(impersonation_tok, &tokkey);
+    if (have_tokkey && tokenidcache_get_ids(&tokkey, puid, pgid)) {
+        DPRINTF(1,
+            ("map_current_user_to_ids: "
+                "using cached mapping uid=%d/gid=%d\n",
+                (int)*puid, (int)*pgid));
+        return NO_ERROR;
+    }
+#endif /* NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE */
 
     if (!get_token_user_name(impersonation_tok, username)) {
         status = GetLastError();
@@ -118,8 +143,20 @@ static int map_current_user_to_ids(nfs41_idmapper *idmapper,
                 "returning nogroup\n",
                 pgroupname));
         *pgid = nfs41_dg.default_gid;
+#ifdef NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE
+        gid_defaulted = true;
+#endif /* NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE */
     }
 
+#ifdef NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE
+    /*
+     * Only successful mappings are cached, users or groups which fall
+     * back to the nobody/nogroup defaults are looked up again next time
+     */
+    if (have_tokkey && !gid_defaulted)
+        tokenidcache_set_ids(&tokkey, *puid, *pgid);
+#endif /* NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE */
+
 out:
     DPRINTF(1,
         ("map_current_user_to_ids: "
@@ -146,9 +183,618 @@ out_map_default_ids:
 __declspec(thread) LONGLONG curr_upcall_xid = -1;
 #endif /* NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP */
 
+typedef struct _nfsd_worker_thread_args {
+    nfs41_daemon_globals *nfs41dg;
+    bool_t dynamic; /* thread may exit again when idle */
+} nfsd_worker_thread_args;
+
+static nfsd_worker_thread_args static_worker_args = {
+    .nfs41dg = &nfs41_dg,
+    .dynamic = FALSE
+};
+
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+/*
+ * Dynamic worker threads
+ *
+ * An upcall is bound to the thread which fetched it with
+ * |IOCTL_NFS41_READ| (nfs41_driver.sys impersonates the caller on that
+ * thread until the |IOCTL_NFS41_WRITE| downcall), so each upcall in
+ * progress needs its own thread.
+ * Instead of starting |nfs41_dg.num_worker_threads| threads upfront we
+ * start |NFSD_MIN_WORKER_THREADS|, spawn another thread whenever no
+ * thread is left waiting in |IOCTL_NFS41_READ|, and let spawned threads
+ * exit again if too many threads are idle.
+ * |nfs41_dg.num_worker_threads| is the upper limit.
+ */
+#define NFSD_MIN_WORKER_THREADS 16
+
+static nfsd_worker_thread_args dynamic_worker_args = {
+    .nfs41dg = &nfs41_dg,
+    .dynamic = TRUE
+};
+
+static volatile LONG num_worker_threads_running = 0;
+static volatile LONG num_worker_threads_idle = 0;
+/* threads sleeping in a NFS4ERR_DELAY backoff */
+static volatile LONG num_worker_threads_delayed = 0;
+static LONG max_idle_worker_threads = NFSD_MIN_WORKER_THREADS;
+
+static unsigned int WINAPI nfsd_thread_main(void *args);
+
+/*
+ * Max. number of worker threads. Threads in a NFS4ERR_DELAY backoff
+ * do not count against the limit, so upcalls for servers which are
+ * not in a grace period or overloaded can still be processed
+ */
+static __inline LONG nfsd_worker_thread_limit(void)
+{
+    return (LONG)min((ssize_t)nfs41_dg.num_worker_threads +
+        num_worker_threads_delayed, MAX_NUM_THREADS-1);
+}
+
+static void nfsd_worker_thread_spawn(void)
+{
+    HANDLE thread;
+
+    if (InterlockedIncrement(&num_worker_threads_running) >
+        nfsd_worker_thread_limit()) {
+        (void)InterlockedDecrement(&num_worker_threads_running);
+        return;
+    }
+
+    /*
+     * Only reserve the stack, idle threads should not hold on to
+     * |NFSD_THREAD_STACK_SIZE| bytes of commit charge each
+     */
+    thread = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
+        nfsd_thread_main, &dynamic_worker_args,
+        STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+    if (thread == NULL) {
+        (void)InterlockedDecrement(&num_worker_threads_running);
+        eprintf("nfsd_worker_thread_spawn: "
+            "_beginthreadex() failed, lasterr=%d\n",
+            (int)GetLastError());
+        return;
+    }
+    (void)CloseHandle(thread);
+
+    DPRINTF(1, ("nfsd_worker_thread_spawn: %ld worker threads running\n",
+        (long)num_worker_threads_running));
+}
+
+/* Called before a worker thread waits for the next upcall */
+static void nfsd_worker_thread_idle(void)
+{
+    (void)InterlockedIncrement(&num_worker_threads_idle);
+}
+
+/*
+ * Called when a worker thread got an upcall, makes sure another thread
+ * is waiting for the next upcall while this one is busy
+ */
+static void nfsd_worker_thread_busy(void)
+{
+    if (InterlockedDecrement(&num_worker_threads_idle) == 0)
+        nfsd_worker_thread_spawn();
+}
+
+/*
+ * Called with the number of upcalls the kernel still had queued after
+ * filling a batch. If more upcalls wait than threads wait for them
+ * start another thread, and tell the admin once in a while if we
+ * already hit |nfs41_dg.num_worker_threads|
+ */
+static void nfsd_worker_thread_backlog(
+    IN ULONG queued)
+{
+    static volatile LONG64 last_capped_warning = 0;
+    LONG64 now, last;
+
+    if ((LONG)queued <= num_worker_threads_idle)
+        return;
+
+    if (num_worker_threads_running < nfsd_worker_thread_limit()) {
+        nfsd_worker_thread_spawn();
+        return;
+    }
+
+    now = (LONG64)GetTickCount64();
+    last = last_capped_warning;
+    if (((now - last) > 60000LL) &&
+        (InterlockedCompareExchange64(&last_capped_warning,
+            now, last) == last)) {
+        eprintf("nfsd_worker_thread_backlog: %lu upcalls queued, "
+            "all %ld worker threads busy, consider raising "
+            "-numworkerthreads\n",
+            (unsigned long)queued, (long)num_worker_threads_running);
+    }
+}
+
+/*
+ * Called before the current thread sleeps in a NFS4ERR_DELAY or
+ * NFS4ERR_GRACE backoff (see |compound_encode_send_decode()|). The
+ * upcall stays bound to this thread, so make sure another thread
+ * waits for the next upcall meanwhile
+ */
+void nfsd_worker_thread_delay_begin(void)
+{
+    (void)InterlockedIncrement(&num_worker_threads_delayed);
+    if (num_worker_threads_idle <= 0)
+        nfsd_worker_thread_spawn();
+}
+
+void nfsd_worker_thread_delay_end(void)
+{
+    (void)InterlockedDecrement(&num_worker_threads_delayed);
+}
+
+/* Spawned threads exit if enough other threads wait for upcalls */
+static bool_t nfsd_worker_thread_may_exit(
+    IN const nfsd_worker_thread_args *wargs)
+{
+    return wargs->dynamic &&
+        (num_worker_threads_idle > max_idle_worker_threads);
+}
+
+/*
+ * Called with the number of session slots a server granted. Each
+ * upcall in progress needs a thread, so slots beyond
+ * |nfs41_dg.num_worker_threads| can never be used by upcalls. Raise
+ * the limit to match (up to |MAX_NUM_THREADS|), unless the admin set
+ * it with "--numworkerthreads"
+ */
+void nfsd_worker_threads_fit_slots(
+    IN uint32_t max_slots)
+{
+    static SRWLOCK lock = SRWLOCK_INIT;
+    ssize_t num_threads = (ssize_t)min(max_slots, MAX_NUM_THREADS-1);
+
+    if (nfs41_dg.num_worker_threads_set ||
+        (num_threads <= nfs41_dg.num_worker_threads))
+        return;
+
+    AcquireSRWLockExclusive(&lock);
+    if (num_threads > nfs41_dg.num_worker_threads) {
+        DPRINTF(1, ("nfsd_worker_threads_fit_slots: raising worker "
+            "thread limit from %ld to %ld for %u slots\n",
+            (long)nfs41_dg.num_worker_threads, (long)num_threads,
+            (unsigned int)max_slots));
+        nfs41_dg.num_worker_threads = num_threads;
+    }
+    ReleaseSRWLockExclusive(&lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+
+#ifdef NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS
+/*
+ * Shared pool of |UPCALL_LARGE_BUF_SIZE| downcall buffers for the
+ * rare results which do not fit into a worker's |UPCALL_BUF_SIZE|
+ * buffer. Up to |NFSD_LARGE_DOWNCALL_POOL_MAX| unused buffers are
+ * kept for reuse.
+ */
+#define NFSD_LARGE_DOWNCALL_POOL_MAX 4
+
+static struct {
+    SRWLOCK lock;
+    unsigned char *free[NFSD_LARGE_DOWNCALL_POOL_MAX];
+    unsigned int count;
+} nfsd_large_downcall_pool = { .lock = SRWLOCK_INIT };
+
+static unsigned char *nfsd_large_downcall_buf_get(void)
+{
+    unsigned char *buf = NULL;
+
+    AcquireSRWLockExclusive(&nfsd_large_downcall_pool.lock);
+    if (nfsd_large_downcall_pool.count > 0) {
+        buf = nfsd_large_downcall_pool.free[
+            --nfsd_large_downcall_pool.count];
+    }
+    ReleaseSRWLockExclusive(&nfsd_large_downcall_pool.lock);
+
+    if (buf == NULL)
+        buf = malloc(UPCALL_LARGE_BUF_SIZE);
+    return buf;
+}
+
+static void nfsd_large_downcall_buf_put(
+    IN unsigned char *buf)
+{
+    AcquireSRWLockExclusive(&nfsd_large_downcall_pool.lock);
+    if (nfsd_large_downcall_pool.count < NFSD_LARGE_DOWNCALL_POOL_MAX) {
+        nfsd_large_downcall_pool.free[
+            nfsd_large_downcall_pool.count++] = buf;
+        buf = NULL;
+    }
+    ReleaseSRWLockExclusive(&nfsd_large_downcall_pool.lock);
+
+    free(buf);
+}
+#endif /* NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS */
+
+/*
+ * Process one upcall from |upbuf| and marshal the downcall for it
+ * into |downbuf|.
+ * If the results are larger than |downbuf_size| the downcall is
+ * marshalled into a buffer from the large downcall pool instead,
+ * which is returned in |*large_downbuf| and must be released with
+ * |nfsd_large_downcall_buf_put()|. Otherwise |*large_downbuf| is
+ * |NULL|.
+ */
+#ifdef NFS41_DRIVER_DAEMON_LAZY_INIT
+static void nfsd_lazy_init_wait(void);
+#endif /* NFS41_DRIVER_DAEMON_LAZY_INIT */
+
+static void nfsd_process_upcall(
+    IN nfs41_daemon_globals *nfs41dg,
+    IN const unsigned char *upbuf,
+    IN uint32_t upbuf_len,
+    OUT nfs41_upcall *upcall,
+    OUT unsigned char *downbuf,
+    IN uint32_t downbuf_size,
+    OUT uint32_t *downbuf_len,
+    OUT unsigned char **large_downbuf)
+{
+    DWORD status;
+    LONGLONG op_start;
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    ULONG64 idmap_cycles;
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
+
+    upcall->currentthread_token = INVALID_HANDLE_VALUE;
+    *large_downbuf = NULL;
+
+    status = upcall_parse(upbuf, upbuf_len, upcall);
+    if (status) {
+        upcall->status = status;
+        goto write_downcall;
+    }
+
+#ifdef NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP
+    curr_upcall_xid = upcall->xid;
+#endif /* NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP */
+
+    if (!OpenThreadToken(GetCurrentThread(),
+        TOKEN_QUERY/*|TOKEN_IMPERSONATE*/, FALSE,
+        &upcall->currentthread_token)) {
+        upcall->currentthread_token = INVALID_HANDLE_VALUE;
+        DPRINTF(0, ("nfsd_worker_thread_main: "
+            "OpenThreadToken() failed, lasterr=%d.\n",
+            (int)GetLastError()));
+    }
+
+#ifdef NFS41_DRIVER_DAEMON_LAZY_INIT
+    /* the idmapper is needed below and by the upcall handlers */
+    if (upcall->opcode != NFS41_SYSOP_SHUTDOWN)
+        nfsd_lazy_init_wait();
+#endif /* NFS41_DRIVER_DAEMON_LAZY_INIT */
+
+    /*
+     * Map current { user, primary_group } to { uid, gid }
+     * Each thread can handle a different user
+     */
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    idmap_cycles = nfsd_cpu_cycles();
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
+    status = map_current_user_to_ids(nfs41dg->idmapper,
+        upcall->currentthread_token,
+        &upcall->uid, &upcall->gid);
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    nfsd_cpu_stats_add(NFS41_CPU_PHASE_IDMAP, idmap_cycles);
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
+    if (status) {
+        upcall->status = status;
+        goto write_downcall;
+    }
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+    /* session slots are shared fairly between users */
+    nfs41_session_thread_user_set((uint32_t)upcall->uid);
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+
+    if (upcall->opcode == NFS41_SYSOP_SHUTDOWN) {
+        printf("Shutting down...\n");
+        exit(0);
+    }
+
+    op_start = nfsd_op_stats_start();
+    status = upcall_handle(&nfs41_dg, upcall);
+    nfsd_op_stats_upcall_done(upcall->opcode, op_start);
+#ifdef NFS41_DRIVER_DAEMON_TOP_STATS
+    nfs41_topstats_upcall_done(upcall, op_start);
+#endif /* NFS41_DRIVER_DAEMON_TOP_STATS */
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+    nfs41_session_thread_user_clear();
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+
+write_downcall:
+    DPRINTF(1, ("writing downcall: xid=%lld opcode='%s' status=%d "
+        "get_last_error=%d\n", upcall->xid, opcode2string(upcall->opcode),
+        upcall->status, upcall->last_error));
+
+#ifdef NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS
+    if (upcall_downcall_size(upcall) > downbuf_size) {
+        *large_downbuf = nfsd_large_downcall_buf_get();
+        if (*large_downbuf) {
+            DPRINTF(1, ("nfsd_process_upcall: xid=%lld using large "
+                "downcall buffer for %lu bytes\n", upcall->xid,
+                (unsigned long)upcall_downcall_size(upcall)));
+            downbuf = *large_downbuf;
+            downbuf_size = UPCALL_LARGE_BUF_SIZE;
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS */
+    upcall_marshall(upcall, downbuf, downbuf_size, downbuf_len);
+
+    /*
+     * Note: Caller impersonation ends with |IOCTL_NFS41_WRITE| -
+     * nfs41_driver.sys |IOCTL_NFS41_WRITE| calls
+     * |SeStopImpersonatingClient()|
+     */
+    (void)CloseHandle(upcall->currentthread_token);
+    upcall->currentthread_token = INVALID_HANDLE_VALUE;
+
+    /* The downcall has been marshalled, release all upcall memory */
+    nfsd_arena_reset();
+
+#ifdef NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP
+    curr_upcall_xid = -1LL;
+#endif /* NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP */
+}
+
+/*
+ * Write the downcall for |upcall| with |IOCTL_NFS41_WRITE| and
+ * complete |upcall|. |large_downbuf| (from |nfsd_process_upcall()|)
+ * is released.
+ */
+static void nfsd_write_downcall(
+    IN HANDLE pipe,
+    IN nfs41_upcall *upcall,
+    IN unsigned char *downbuf,
+    IN uint32_t downbuf_len,
+    IN unsigned char *large_downbuf)
+{
+    DWORD status, outbuf_len;
+
+    DPRINTF(2,
+        ("making a downcall: "
+        "xid=%lld inbuf_len=%ld opcode='%s' status=%d\n",
+        upcall->xid,
+        (long)downbuf_len,
+        opcode2string(upcall->opcode),
+        upcall->status));
+    status = DeviceIoControl(pipe, IOCTL_NFS41_WRITE,
+        downbuf, downbuf_len, NULL, 0, &outbuf_len, NULL);
+    if (!status) {
+        eprintf("IOCTL_NFS41_WRITE failed with %d xid=%lld opcode='%s'\n",
+            GetLastError(), upcall->xid, opcode2string(upcall->opcode));
+        upcall_cancel(upcall);
+    }
+    if (upcall->status != NFSD_VERSION_MISMATCH)
+        upcall_cleanup(upcall);
+
+#ifdef NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS
+    if (large_downbuf)
+        nfsd_large_downcall_buf_put(large_downbuf);
+#else
+    (void)large_downbuf;
+#endif /* NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS */
+}
+
+#ifdef NFS41_DRIVER_BATCHED_UPCALLS
+/*
+ * The kernel only adds another upcall to a batch if at least
+ * |NFS41_UPDOWNCALL_BATCH_RECORD_SIZE| bytes are left, and each
+ * downcall gets |UPCALL_BUF_SIZE| bytes like in the single-request
+ * protocol. Larger downcalls are written on their own with
+ * |IOCTL_NFS41_WRITE| (see |nfsd_process_upcall_batch()|)
+ */
+#define NFSD_UPCALL_BATCH_BUF_SIZE (4*UPCALL_BUF_SIZE)
+#define NFSD_DOWNCALL_BATCH_BUF_SIZE \
+    (sizeof(NFS41_UPDOWNCALL_BATCH_HEADER) + \
+    (NFS41_UPDOWNCALL_BATCH_MAX * (sizeof(ULONG) + UPCALL_BUF_SIZE)))
+
+typedef struct _nfsd_upcall_batch {
+    /*
+     * Output of |IOCTL_NFS41_WRITE_READ_BATCH|: the downcall statuses
+     * directly followed by the next upcall batch
+     */
+    struct {
+        LONG downcall_status[NFS41_UPDOWNCALL_BATCH_MAX]; /* |NTSTATUS| */
+        unsigned char upbuf[NFSD_UPCALL_BATCH_BUF_SIZE];
+    } io;
+    /* Length of the upcall batch in |io.upbuf| not yet processed */
+    DWORD upbuf_len;
+    unsigned char downbuf[NFSD_DOWNCALL_BATCH_BUF_SIZE];
+    nfs41_upcall upcalls[NFS41_UPDOWNCALL_BATCH_MAX];
+    /* Downcalls which did not fit into |downbuf| */
+    unsigned char *large_downbuf[NFS41_UPDOWNCALL_BATCH_MAX];
+    uint32_t large_downbuf_len[NFS41_UPDOWNCALL_BATCH_MAX];
+} nfsd_upcall_batch;
+
+/* Cleared if nfs41_driver.sys has no |IOCTL_NFS41_READ_BATCH| */
+static volatile bool_t nfsd_batched_upcalls_supported = TRUE;
+/* Cleared if nfs41_driver.sys has no |IOCTL_NFS41_WRITE_READ_BATCH| */
+static volatile bool_t nfsd_write_read_batch_supported = TRUE;
+
+/*
+ * Process a batch of upcalls one after another and return all
+ * downcalls with one ioctl.
+ * The batch is fetched with |IOCTL_NFS41_READ_BATCH| unless the
+ * previous call already got one. If |fetch_next| is set the downcalls
+ * are returned with |IOCTL_NFS41_WRITE_READ_BATCH|, which picks up
+ * the next batch too if upcalls are queued (|batch->upbuf_len| is
+ * non-zero then).
+ * Returns |FALSE| if the kernel does not support batched upcalls.
+ */
+static bool_t nfsd_process_upcall_batch(
+    IN nfs41_daemon_globals *nfs41dg,
+    IN HANDLE pipe,
+    IN nfsd_upcall_batch *batch,
+    IN bool_t fetch_next)
+{
+    NFS41_UPDOWNCALL_BATCH_HEADER hdr;
+    const unsigned char *up;
+    unsigned char *down;
+    uint32_t i, rec, count, up_left, rec_len, down_len;
+    DWORD outbuf_len, status;
+    nfs41_upcall *upcall;
+
+    if (batch->upbuf_len == 0) {
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+        nfsd_worker_thread_idle();
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+        status = DeviceIoControl(pipe, IOCTL_NFS41_READ_BATCH, NULL, 0,
+            batch->io.upbuf, sizeof(batch->io.upbuf), &outbuf_len, NULL);
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+        nfsd_worker_thread_busy();
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+        if (!status) {
+            DWORD lasterr = GetLastError();
+
+            if (lasterr == ERROR_INVALID_FUNCTION) {
+                DPRINTF(0, ("nfsd_process_upcall_batch: "
+                    "IOCTL_NFS41_READ_BATCH not supported by kernel, "
+                    "using single upcalls\n"));
+                nfsd_batched_upcalls_supported = FALSE;
+                return FALSE;
+            }
+            eprintf("nfsd_process_upcall_batch: "
+                "IOCTL_NFS41_READ_BATCH failed, lasterr=%d\n", (int)lasterr);
+            return TRUE;
+        }
+        batch->upbuf_len = outbuf_len;
+    }
+
+    outbuf_len = batch->upbuf_len;
+    batch->upbuf_len = 0;
+    if (outbuf_len < sizeof(hdr)) {
+        eprintf("nfsd_process_upcall_batch: "
+            "short batch, outbuf_len=%ld\n", (long)outbuf_len);
+        return TRUE;
+    }
+
+    (void)memcpy(&hdr, batch->io.upbuf, sizeof(hdr));
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+    nfsd_worker_thread_backlog(hdr.queued);
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+    up = batch->io.upbuf + sizeof(hdr);
+    up_left = outbuf_len - sizeof(hdr);
+    down = batch->downbuf + sizeof(hdr);
+
+    for (i = 0, rec = 0; i < min(hdr.count, NFS41_UPDOWNCALL_BATCH_MAX);
+        i++) {
+        if (up_left < sizeof(ULONG))
+            break;
+        (void)memcpy(&rec_len, up, sizeof(ULONG));
+        up += sizeof(ULONG);
+        up_left -= sizeof(ULONG);
+        if (rec_len > up_left)
+            break;
+
+        nfsd_process_upcall(nfs41dg, up, rec_len, &batch->upcalls[i],
+            down + sizeof(ULONG), UPCALL_BUF_SIZE, &down_len,
+            &batch->large_downbuf[i]);
+        if (batch->large_downbuf[i]) {
+            batch->large_downbuf_len[i] = down_len;
+        } else {
+            (void)memcpy(down, &down_len, sizeof(ULONG));
+            down += sizeof(ULONG) + down_len;
+            rec++;
+        }
+
+        up += rec_len;
+        up_left -= rec_len;
+    }
+    count = i;
+    if (count != hdr.count) {
+        eprintf("nfsd_process_upcall_batch: "
+            "malformed batch, processed %u of %u upcalls\n",
+            (unsigned int)count, (unsigned int)hdr.count);
+    }
+
+    /*
+     * Write the downcalls which did not fit into the batch first. All
+     * upcalls of the batch have been processed, so it does not matter
+     * that |IOCTL_NFS41_WRITE| ends the caller impersonation
+     */
+    for (i = 0; i < count; i++) {
+        if (batch->large_downbuf[i] == NULL)
+            continue;
+        nfsd_write_downcall(pipe, &batch->upcalls[i],
+            batch->large_downbuf[i], batch->large_downbuf_len[i],
+            batch->large_downbuf[i]);
+    }
+
+    hdr.count = rec;
+    hdr.queued = 0;
+    (void)memcpy(batch->downbuf, &hdr, sizeof(hdr));
+
+    DPRINTF(2, ("making a batch downcall: count=%u len=%ld\n",
+        (unsigned int)rec, (long)(down - batch->downbuf)));
+    if (fetch_next && nfsd_write_read_batch_supported) {
+        status = DeviceIoControl(pipe, IOCTL_NFS41_WRITE_READ_BATCH,
+            batch->downbuf, (DWORD)(down - batch->downbuf),
+            &batch->io, sizeof(batch->io), &outbuf_len, NULL);
+        if (status) {
+            /* keep the next batch, if there is one */
+            if (outbuf_len >=
+                (sizeof(batch->io.downcall_status) + sizeof(hdr))) {
+                (void)memcpy(&hdr, batch->io.upbuf, sizeof(hdr));
+                if (hdr.count > 0) {
+                    batch->upbuf_len = outbuf_len -
+                        sizeof(batch->io.downcall_status);
+                }
+            }
+            goto complete_upcalls;
+        }
+        if (GetLastError() != ERROR_INVALID_FUNCTION) {
+            eprintf("IOCTL_NFS41_WRITE_READ_BATCH failed with %d "
+                "count=%u\n", (int)GetLastError(), (unsigned int)count);
+            goto complete_upcalls;
+        }
+        DPRINTF(0, ("nfsd_process_upcall_batch: "
+            "IOCTL_NFS41_WRITE_READ_BATCH not supported by kernel\n"));
+        nfsd_write_read_batch_supported = FALSE;
+    }
+
+    status = DeviceIoControl(pipe, IOCTL_NFS41_WRITE_BATCH,
+        batch->downbuf, (DWORD)(down - batch->downbuf),
+        batch->io.downcall_status, sizeof(batch->io.downcall_status),
+        &outbuf_len, NULL);
+    if (!status) {
+        eprintf("IOCTL_NFS41_WRITE_BATCH failed with %d count=%u\n",
+            (int)GetLastError(), (unsigned int)count);
+    }
+
+complete_upcalls:
+    for (i = 0, rec = 0; i < count; i++) {
+        upcall = &batch->upcalls[i];
+
+        if (batch->large_downbuf[i]) {
+            /* already completed by |nfsd_write_downcall()| above */
+            batch->large_downbuf[i] = NULL;
+            continue;
+        }
+        if ((!status) || (batch->io.downcall_status[rec] != 0)) {
+            if (status) {
+                eprintf("downcall failed with 0x%lx xid=%lld opcode='%s'\n",
+                    (long)batch->io.downcall_status[rec], upcall->xid,
+                    opcode2string(upcall->opcode));
+            }
+            upcall_cancel(upcall);
+        }
+        if (upcall->status != NFSD_VERSION_MISMATCH)
+            upcall_cleanup(upcall);
+        rec++;
+    }
+    return TRUE;
+}
+#endif /* NFS41_DRIVER_BATCHED_UPCALLS */
+
 static unsigned int nfsd_worker_thread_main(void *args)
 {
-    nfs41_daemon_globals *nfs41dg = (nfs41_daemon_globals *)args;
+    nfsd_worker_thread_args *wargs = (nfsd_worker_thread_args *)args;
+    nfs41_daemon_globals *nfs41dg = wargs->nfs41dg;
     DWORD status = 0;
     HANDLE pipe;
     // buffer used to process upcall, assumed to be fixed size.
@@ -159,6 +805,10 @@ static unsigned int nfsd_worker_thread_main(void *args)
     _declspec(align(128)) unsigned char inbuf[UPCALL_BUF_SIZE];
     DWORD inbuf_len, outbuf_len;
     nfs41_upcall upcall;
+    unsigned char *large_downbuf;
+#ifdef NFS41_DRIVER_BATCHED_UPCALLS
+    nfsd_upcall_batch *batch = NULL;
+#endif /* NFS41_DRIVER_BATCHED_UPCALLS */
 
     /*
      * Set |THREAD_PRIORITY_TIME_CRITICAL| to avoid that the daemon
@@ -181,9 +831,46 @@ static unsigned int nfsd_worker_thread_main(void *args)
         return lasterr;
     }
 
+#ifdef NFS41_DRIVER_BATCHED_UPCALLS
+    if (nfsd_batched_upcalls_supported) {
+        batch = calloc(1, sizeof(nfsd_upcall_batch));
+        if (batch == NULL) {
+            eprintf("nfsd_worker_thread_main: "
+                "out of memory for upcall batch, using single upcalls\n");
+        }
+    }
+#endif /* NFS41_DRIVER_BATCHED_UPCALLS */
+
     while(1) {
+#ifdef NFS41_DRIVER_BATCHED_UPCALLS
+        if (batch) {
+            bool_t fetch_next = TRUE;
+
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+            /* Don't pick up more upcalls if this thread will exit */
+            fetch_next = !nfsd_worker_thread_may_exit(wargs);
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+            if (nfsd_process_upcall_batch(nfs41dg, pipe, batch,
+                fetch_next)) {
+                /* process the next batch we already got first */
+                if (batch->upbuf_len)
+                    continue;
+                goto next_upcall;
+            }
+            /* kernel does not support batches, fall back */
+            free(batch);
+            batch = NULL;
+        }
+#endif /* NFS41_DRIVER_BATCHED_UPCALLS */
+
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+        nfsd_worker_thread_idle();
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
         status = DeviceIoControl(pipe, IOCTL_NFS41_READ, NULL, 0,
             outbuf, UPCALL_BUF_SIZE, (LPDWORD)&outbuf_len, NULL);
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+        nfsd_worker_thread_busy();
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
         if (!status) {
             eprintf("nfsd_worker_thread_main: "
                 "IOCTL_NFS41_READ failed, status=0x%x, lasterr=%d\n",
@@ -191,90 +878,85 @@ static unsigned int nfsd_worker_thread_main(void *args)
             continue;
         }
 
-        status = upcall_parse(outbuf, (uint32_t)outbuf_len, &upcall);
-        if (status) {
-            upcall.status = status;
-            goto write_downcall;
-        }
-
-#ifdef NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP
-        curr_upcall_xid = upcall.xid;
-#endif /* NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP */
-
-        if (!OpenThreadToken(GetCurrentThread(),
-            TOKEN_QUERY/*|TOKEN_IMPERSONATE*/, FALSE,
-            &upcall.currentthread_token)) {
-            upcall.currentthread_token = INVALID_HANDLE_VALUE;
-            DPRINTF(0, ("nfsd_worker_thread_main: "
-                "OpenThreadToken() failed, lasterr=%d.\n",
-                (int)GetLastError()));
-        }
-
-        /*
-         * Map current { user, primary_group } to { uid, gid }
-         * Each thread can handle a different user
-         */
-        status = map_current_user_to_ids(nfs41dg->idmapper,
-            upcall.currentthread_token,
-            &upcall.uid, &upcall.gid);
-        if (status) {
-            upcall.status = status;
-            goto write_downcall;
-        }
-
-        if (upcall.opcode == NFS41_SYSOP_SHUTDOWN) {
-            printf("Shutting down...\n");
-            exit(0);
-        }
-
-        status = upcall_handle(&nfs41_dg, &upcall);
-
-write_downcall:
-        DPRINTF(1, ("writing downcall: xid=%lld opcode='%s' status=%d "
-            "get_last_error=%d\n", upcall.xid, opcode2string(upcall.opcode),
-            upcall.status, upcall.last_error));
-
-        upcall_marshall(&upcall, inbuf, UPCALL_BUF_SIZE, (uint32_t*)&inbuf_len);
-
-        /*
-         * Note: Caller impersonation ends with |IOCTL_NFS41_WRITE| -
-         * nfs41_driver.sys |IOCTL_NFS41_WRITE| calls
-         * |SeStopImpersonatingClient()|
-         */
-        (void)CloseHandle(upcall.currentthread_token);
-        upcall.currentthread_token = INVALID_HANDLE_VALUE;
-
-#ifdef NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP
-        curr_upcall_xid = -1LL;
-#endif /* NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP */
-
-        DPRINTF(2,
-            ("making a downcall: "
-            "xid=%lld inbuf_len=%ld opcode='%s' status=%d\n",
-            upcall.xid,
-            (long)inbuf_len,
-            opcode2string(upcall.opcode),
-            upcall.status));
-        status = DeviceIoControl(pipe, IOCTL_NFS41_WRITE,
-            inbuf, inbuf_len, NULL, 0, (LPDWORD)&outbuf_len, NULL);
-        if (!status) {
-            eprintf("IOCTL_NFS41_WRITE failed with %d xid=%lld opcode='%s'\n",
-                GetLastError(), upcall.xid, opcode2string(upcall.opcode));
-            upcall_cancel(&upcall);
-        }
-        if (upcall.status != NFSD_VERSION_MISMATCH)
-            upcall_cleanup(&upcall);
+        nfsd_process_upcall(nfs41dg, outbuf, (uint32_t)outbuf_len,
+            &upcall, inbuf, UPCALL_BUF_SIZE, (uint32_t*)&inbuf_len,
+            &large_downbuf);
+        nfsd_write_downcall(pipe, &upcall,
+            large_downbuf? large_downbuf : inbuf, (uint32_t)inbuf_len,
+            large_downbuf);
+
+#ifdef NFS41_DRIVER_BATCHED_UPCALLS
+next_upcall:
+#endif /* NFS41_DRIVER_BATCHED_UPCALLS */
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+        if (nfsd_worker_thread_may_exit(wargs)) {
+            (void)InterlockedDecrement(&num_worker_threads_running);
+            DPRINTF(1, ("nfsd_worker_thread_main: idle worker thread "
+                "exiting, %ld worker threads running\n",
+                (long)num_worker_threads_running));
+            break;
+        }
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+        ;
     }
 
+#ifdef NFS41_DRIVER_BATCHED_UPCALLS
+    free(batch);
+#endif /* NFS41_DRIVER_BATCHED_UPCALLS */
     close_nfs41sys_device_pipe(pipe);
 
     return GetLastError();
 }
 
+#ifdef NFS41_DRIVER_NUMA_UPCALL_QUEUES
+/*
+ * Bind the calling worker thread to the next NUMA node (round robin),
+ * nfs41_driver.sys then prefers upcalls queued on that node (see
+ * |nfs41_upcalllist_remove_next()|). Done before the thread's arena
+ * is created, so that the arena memory is node-local too.
+ */
+static void nfsd_worker_thread_bind_node(void)
+{
+    static volatile LONG next_node = 0;
+    ULONG highest_node;
+    USHORT node;
+    GROUP_AFFINITY affinity;
+
+    if ((!GetNumaHighestNodeNumber(&highest_node)) ||
+        (highest_node == 0))
+        return;
+
+    node = (USHORT)(((ULONG)InterlockedIncrement(&next_node) - 1UL) %
+        (highest_node + 1UL));
+    (void)memset(&affinity, 0, sizeof(affinity));
+    if ((!GetNumaNodeProcessorMaskEx(node, &affinity)) ||
+        (affinity.Mask == 0)) {
+        /* node without processors */
+        return;
+    }
+
+    if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL)) {
+        eprintf("nfsd_worker_thread_bind_node: "
+            "SetThreadGroupAffinity(node=%d) failed, lasterr=%d\n",
+            (int)node, (int)GetLastError());
+        return;
+    }
+    DPRINTF(1, ("nfsd_worker_thread_bind_node: bound to NUMA node %d\n",
+        (int)node));
+}
+#endif /* NFS41_DRIVER_NUMA_UPCALL_QUEUES */
+
 static unsigned int WINAPI nfsd_thread_main(void *args)
 {
     unsigned int res = 120 /* fixme: semi-random value */;
 
+#ifdef NFS41_DRIVER_NUMA_UPCALL_QUEUES
+    nfsd_worker_thread_bind_node();
+#endif /* NFS41_DRIVER_NUMA_UPCALL_QUEUES */
+
+    /* Without an arena the allocations fall back to |malloc()| */
+    (void)nfsd_arena_create();
+
     __try {
         res = nfsd_worker_thread_main(args);
     }
@@ -282,6 +964,7 @@ static unsigned int WINAPI nfsd_thread_main(void *args)
         eprintf("#### FATAL: Worker thread crashed with exception ####\n");
     }
 
+    nfsd_arena_destroy();
     return res;
 }
 
@@ -297,6 +980,20 @@ VOID ServiceStop()
 typedef struct _nfsd_args {
     bool_t ldap_enable;
     int debug_level;
+    unsigned int xdrbench_iterations;
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+    const wchar_t *upcalltrace_filename;
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+    const wchar_t *idcachefile_filename;
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+    const wchar_t *fscache_dir;
+    unsigned long fscache_size_mb;
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    const wchar_t *namecachesnapshot_dir;
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
 } nfsd_args;
 
 static bool_t check_for_files()
@@ -322,11 +1019,68 @@ static void PrintUsage(const wchar_t *argv0)
         "\t--uid <non-zero value>\n"
         "\t--gid <non-zero value>\n"
         "\t--numworkerthreads <value-between 16 and %d>\n"
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PREFETCH
+        "\t--readdirprefetch <value-between 0 and %d, 0 disables>\n"
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+        "\t--openprefetch <KB to READ with each OPEN, "
+            "between 0 and %d, 0 disables>\n"
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+        "\t--treewalkprefetch <max. threads prefetching subdirectories "
+            "during tree walks, between 0 and %d, 0 disables>\n"
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+        "\t--maxdelegations <value-between 0 and %d, 0 means no limit>\n"
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+        "\t--maxuserslots <session slots per user, "
+            "between 0 and %d, 0 means no limit>\n"
+        "\t--slotweight <uid>=<weight between 1 and %d>\tshare of "
+            "the session\n"
+            "\t\tslots of <uid> relative to other users (default 1), "
+            "up to %d times\n"
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+        "\t--authsysgids <'token'|'server'|'auto'>\n"
+        "\t--xdrbench <iterations>\tRun XDR/upcall microbenchmarks and exit\n"
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+        "\t--upcalltrace <file>\tRecord all upcalls in <file>\n"
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+        "\t--idcachefile <file>\tKeep idmap/SID cache entries in <file>\n"
+            "\t\tacross restarts\n"
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+        "\t--fscache <dir>\tCache file data of \"fsc\" mounts in <dir>\n"
+        "\t--fscachesize <MB, between 1 and %lu, defaults to %lu>\n"
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+        "\t--namecachesnapshot <dir>\tKeep name cache snapshots of\n"
+            "\t\t\"immutable\" mounts in <dir> across restarts\n"
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
 #ifdef _DEBUG
         "\t--crtdbgmem <'allocmem'|'leakcheck'|'delayfree',\n"
             "\t\t'all', 'none' or 'default'>\n"
 #endif /* _DEBUG */
-        , argv0, MAX_NUM_THREADS);
+        , argv0, MAX_NUM_THREADS
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PREFETCH
+        , READDIR_PREFETCH_MAX_LIMIT
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+        , OPEN_PREFETCH_MAX_KB
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+        , TREEWALK_PREFETCH_MAX_LIMIT
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+        , MAX_DELEGATIONS_LIMIT
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+        , MAX_USER_SLOTS_LIMIT
+        , SLOT_WEIGHT_LIMIT
+        , SLOT_WEIGHTS_MAX
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+        , (unsigned long)FSCACHE_SIZE_MAX_MB
+        , (unsigned long)FSCACHE_SIZE_DEFAULT_MB
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+        );
 }
 
 static
@@ -360,6 +1114,20 @@ bool_t parse_cmdlineargs(int argc, wchar_t *argv[], nfsd_args *out)
     /* set defaults. */
     out->debug_level = 1;
     out->ldap_enable = TRUE;
+    out->xdrbench_iterations = 0;
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+    out->upcalltrace_filename = NULL;
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+    out->idcachefile_filename = NULL;
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+    out->fscache_dir = NULL;
+    out->fscache_size_mb = FSCACHE_SIZE_DEFAULT_MB;
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    out->namecachesnapshot_dir = NULL;
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
 
     /* parse command line */
 #ifdef STANDALONE_NFSD
@@ -454,6 +1222,7 @@ bool_t parse_cmdlineargs(int argc, wchar_t *argv[], nfsd_args *out)
                     return FALSE;
                 }
                 nfs41_dg.num_worker_threads = wcstol(argv[i], NULL, 0);
+                nfs41_dg.num_worker_threads_set = TRUE;
                 if (nfs41_dg.num_worker_threads < 16) {
                     (void)fprintf(stderr,
                         "%S: --numworkerthreads requires at least "
@@ -468,6 +1237,242 @@ bool_t parse_cmdlineargs(int argc, wchar_t *argv[], nfsd_args *out)
                     return FALSE;
                 }
             }
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PREFETCH
+            else if (!wcscmp(argv[i], L"--readdirprefetch")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for readdirprefetch\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                nfs41_dg.readdir_prefetch_max = wcstol(argv[i], NULL, 0);
+                if ((nfs41_dg.readdir_prefetch_max < 0) ||
+                    (nfs41_dg.readdir_prefetch_max >
+                        READDIR_PREFETCH_MAX_LIMIT)) {
+                    (void)fprintf(stderr, "%S: "
+                        "--readdirprefetch must be between 0 and %d\n",
+                        argv[0], READDIR_PREFETCH_MAX_LIMIT);
+                    return FALSE;
+                }
+            }
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+            else if (!wcscmp(argv[i], L"--treewalkprefetch")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for treewalkprefetch\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                nfs41_dg.treewalk_prefetch_max = wcstol(argv[i], NULL, 0);
+                if ((nfs41_dg.treewalk_prefetch_max < 0) ||
+                    (nfs41_dg.treewalk_prefetch_max >
+                        TREEWALK_PREFETCH_MAX_LIMIT)) {
+                    (void)fprintf(stderr, "%S: "
+                        "--treewalkprefetch must be between 0 and %d\n",
+                        argv[0], TREEWALK_PREFETCH_MAX_LIMIT);
+                    return FALSE;
+                }
+            }
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+            else if (!wcscmp(argv[i], L"--openprefetch")) {
+                long kb;
+
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for openprefetch\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                kb = wcstol(argv[i], NULL, 0);
+                if ((kb < 0) || (kb > OPEN_PREFETCH_MAX_KB)) {
+                    (void)fprintf(stderr, "%S: "
+                        "--openprefetch must be between 0 and %d\n",
+                        argv[0], OPEN_PREFETCH_MAX_KB);
+                    return FALSE;
+                }
+                nfs41_dg.open_prefetch_size = (uint32_t)kb * 1024;
+            }
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
+            else if (!wcscmp(argv[i], L"--maxdelegations")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for maxdelegations\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                nfs41_dg.max_delegations = wcstol(argv[i], NULL, 0);
+                if ((nfs41_dg.max_delegations < 0) ||
+                    (nfs41_dg.max_delegations > MAX_DELEGATIONS_LIMIT)) {
+                    (void)fprintf(stderr, "%S: "
+                        "--maxdelegations must be between 0 and %d\n",
+                        argv[0], MAX_DELEGATIONS_LIMIT);
+                    return FALSE;
+                }
+            }
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+            else if (!wcscmp(argv[i], L"--maxuserslots")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for maxuserslots\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                nfs41_dg.max_user_slots = wcstol(argv[i], NULL, 0);
+                if ((nfs41_dg.max_user_slots < 0) ||
+                    (nfs41_dg.max_user_slots > MAX_USER_SLOTS_LIMIT)) {
+                    (void)fprintf(stderr, "%S: "
+                        "--maxuserslots must be between 0 and %d\n",
+                        argv[0], MAX_USER_SLOTS_LIMIT);
+                    return FALSE;
+                }
+            }
+            else if (!wcscmp(argv[i], L"--slotweight")) {
+                wchar_t *end;
+                unsigned long uid, weight;
+
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for slotweight\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                uid = wcstoul(argv[i], &end, 0);
+                if ((end == argv[i]) || (*end != L'=')) {
+                    (void)fprintf(stderr, "%S: "
+                        "--slotweight expects <uid>=<weight>\n", argv[0]);
+                    return FALSE;
+                }
+                weight = wcstoul(end + 1, NULL, 0);
+                if ((weight < 1) || (weight > SLOT_WEIGHT_LIMIT)) {
+                    (void)fprintf(stderr, "%S: "
+                        "--slotweight weight must be between 1 and %d\n",
+                        argv[0], SLOT_WEIGHT_LIMIT);
+                    return FALSE;
+                }
+                if (nfs41_dg.num_slot_weights >= SLOT_WEIGHTS_MAX) {
+                    (void)fprintf(stderr, "%S: "
+                        "--slotweight can be given at most %d times\n",
+                        argv[0], SLOT_WEIGHTS_MAX);
+                    return FALSE;
+                }
+                nfs41_dg.slot_weights[nfs41_dg.num_slot_weights].uid =
+                    (uint32_t)uid;
+                nfs41_dg.slot_weights[nfs41_dg.num_slot_weights].weight =
+                    (uint32_t)weight;
+                nfs41_dg.num_slot_weights++;
+            }
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+            else if (!wcscmp(argv[i], L"--authsysgids")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for authsysgids\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                if (!wcscmp(argv[i], L"token"))
+                    nfs41_dg.authsys_gids_mode = AUTHSYS_GIDS_TOKEN;
+                else if (!wcscmp(argv[i], L"server"))
+                    nfs41_dg.authsys_gids_mode = AUTHSYS_GIDS_SERVER;
+                else if (!wcscmp(argv[i], L"auto"))
+                    nfs41_dg.authsys_gids_mode = AUTHSYS_GIDS_AUTO;
+                else {
+                    (void)fprintf(stderr, "%S: "
+                        "--authsysgids must be 'token', 'server' "
+                        "or 'auto'\n",
+                        argv[0]);
+                    return FALSE;
+                }
+            }
+            else if (!wcscmp(argv[i], L"--xdrbench")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for xdrbench\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                out->xdrbench_iterations = wcstoul(argv[i], NULL, 0);
+                if (out->xdrbench_iterations == 0) {
+                    (void)fprintf(stderr, "%S: "
+                        "--xdrbench requires a non-zero number of "
+                        "iterations\n", argv[0]);
+                    return FALSE;
+                }
+            }
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+            else if (!wcscmp(argv[i], L"--upcalltrace")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing file name for upcalltrace\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                out->upcalltrace_filename = argv[i];
+            }
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+            else if (!wcscmp(argv[i], L"--idcachefile")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing file name for idcachefile\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                out->idcachefile_filename = argv[i];
+            }
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+            else if (!wcscmp(argv[i], L"--fscache")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing directory name for fscache\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                out->fscache_dir = argv[i];
+            }
+            else if (!wcscmp(argv[i], L"--fscachesize")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for fscachesize\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                out->fscache_size_mb = wcstoul(argv[i], NULL, 0);
+                if ((out->fscache_size_mb < 1) ||
+                    (out->fscache_size_mb > FSCACHE_SIZE_MAX_MB)) {
+                    (void)fprintf(stderr, "%S: "
+                        "--fscachesize must be between 1 and %lu\n",
+                        argv[0], (unsigned long)FSCACHE_SIZE_MAX_MB);
+                    return FALSE;
+                }
+            }
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+            else if (!wcscmp(argv[i], L"--namecachesnapshot")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing directory name for namecachesnapshot\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                out->namecachesnapshot_dir = argv[i];
+            }
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
             /*
              * -Debug/-debug might be passed as first option in a
              * Release build to switch nfsd to debug mode
@@ -806,11 +1811,203 @@ void set_nfs_daemon_privileges(void)
         "SeImpersonatePrivilege", true);
     (void)set_token_privilege(proc_token,
         "SeDelegateSessionUserImpersonatePrivilege", true);
+#ifdef NFS41_DRIVER_DAEMON_LARGE_PAGES
+    /* optional, without it we just do not get large pages */
+    (void)set_token_privilege(proc_token,
+        "SeLockMemoryPrivilege", true);
+#endif /* NFS41_DRIVER_DAEMON_LARGE_PAGES */
 
     (void)CloseHandle(proc_token);
 }
 
 
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+/*
+ * Register a pool of I/O buffers with the kernel, see
+ * |NFS41_IO_POOL_REGISTRATION|. The pool is never freed, the kernel
+ * may use it until the daemon exits.
+ */
+#define NFSD_IO_POOL_SLOT_SIZE (64*1024)
+
+static void nfsd_io_pool_register(
+    HANDLE pipe)
+{
+    NFS41_IO_POOL_REGISTRATION reg;
+    ULONG num_slots, num_nodes = 1;
+    DWORD len;
+    void *pool;
+
+    /* each worker thread may have a full batch of upcalls in flight */
+    num_slots = min((ULONG)nfs41_dg.num_worker_threads *
+        NFS41_UPDOWNCALL_BATCH_MAX, NFS41_IO_POOL_MAX_SLOTS);
+
+#ifdef NFS41_DRIVER_NUMA_BUFFER_POOLS
+    num_nodes = nfsd_numa_node_count();
+    if (num_nodes > 1) {
+        /* one equal-sized range per node */
+        num_slots -= num_slots % num_nodes;
+        if (num_slots == 0)
+            num_nodes = 1;
+    }
+    if (num_nodes > 1) {
+        ULONG node, slots_per_node = num_slots / num_nodes;
+        SIZE_T range_size = (SIZE_T)slots_per_node * NFSD_IO_POOL_SLOT_SIZE;
+
+        pool = VirtualAlloc(NULL, (SIZE_T)num_slots * NFSD_IO_POOL_SLOT_SIZE,
+            MEM_RESERVE, PAGE_READWRITE);
+        if (pool == NULL) {
+            eprintf("nfsd_io_pool_register: VirtualAlloc() failed, "
+                "lasterr=%d\n", (int)GetLastError());
+            return;
+        }
+        for (node = 0; node < num_nodes; node++) {
+            if (VirtualAllocExNuma(GetCurrentProcess(),
+                (PUCHAR)pool + (node * range_size), range_size,
+                MEM_COMMIT, PAGE_READWRITE, node) == NULL) {
+                eprintf("nfsd_io_pool_register: "
+                    "VirtualAllocExNuma(node=%lu) failed, lasterr=%d\n",
+                    (unsigned long)node, (int)GetLastError());
+                (void)VirtualFree(pool, 0, MEM_RELEASE);
+                return;
+            }
+        }
+    }
+    else
+#endif /* NFS41_DRIVER_NUMA_BUFFER_POOLS */
+    {
+        pool = NULL;
+#ifdef NFS41_DRIVER_DAEMON_LARGE_PAGES
+        /*
+         * One large page allocation cannot be split between NUMA
+         * nodes, so large pages are only used without the per-node
+         * split
+         */
+        {
+            size_t pool_size = (size_t)num_slots * NFSD_IO_POOL_SLOT_SIZE;
+
+            pool = nfsd_largepage_vmalloc(&pool_size);
+        }
+        if (pool == NULL)
+#endif /* NFS41_DRIVER_DAEMON_LARGE_PAGES */
+            pool = VirtualAlloc(NULL,
+                (SIZE_T)num_slots * NFSD_IO_POOL_SLOT_SIZE,
+                MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+    }
+    if (pool == NULL) {
+        eprintf("nfsd_io_pool_register: VirtualAlloc() failed, "
+            "lasterr=%d\n", (int)GetLastError());
+        return;
+    }
+
+    reg.base = (ULONGLONG)(ULONG_PTR)pool;
+    reg.slot_size = NFSD_IO_POOL_SLOT_SIZE;
+    reg.num_slots = num_slots;
+    reg.num_nodes = num_nodes;
+    reg.reserved = 0;
+    if (!DeviceIoControl(pipe, IOCTL_NFS41_SET_IO_POOL,
+        &reg, sizeof(reg), NULL, 0, &len, NULL)) {
+        /* older kernel module, READ/WRITE buffers stay mapped per I/O */
+        DPRINTF(0, ("nfsd_io_pool_register: IOCTL_NFS41_SET_IO_POOL "
+            "failed, lasterr=%d\n", (int)GetLastError()));
+        (void)VirtualFree(pool, 0, MEM_RELEASE);
+        return;
+    }
+
+    DPRINTF(1, ("nfsd_io_pool_register: registered %lu slots of %lu "
+        "bytes at 0x%p on %lu nodes\n",
+        (unsigned long)num_slots, (unsigned long)NFSD_IO_POOL_SLOT_SIZE,
+        pool, (unsigned long)num_nodes));
+}
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
+
+
+#ifdef NFS41_DRIVER_DAEMON_LAZY_INIT
+/*
+ * Lazy initialization
+ *
+ * |getdomainname()| does DNS queries, which can take several seconds
+ * after boot or when the DNS server is slow, and used to delay
+ * |IOCTL_NFS41_START| and the worker threads, so all I/O on already
+ * mounted drives hung after a service restart until DNS answered.
+ * |nfsd_lazy_init_thread()| now does |getdomainname()| and
+ * |nfs41_idmap_create()| (LDAP connections are opened on first use
+ * anyway) while the main thread starts the driver and the worker
+ * threads; upcalls wait in |nfsd_lazy_init_wait()| before they need
+ * the idmapper or |nfs41_dg.localdomain_name|.
+ */
+static HANDLE lazy_init_thread = NULL;
+static HANDLE lazy_init_done_event = NULL;
+static volatile LONG lazy_init_done = 0;
+static bool_t lazy_init_ldap_enable = FALSE;
+
+static unsigned int WINAPI nfsd_lazy_init_thread(void *args)
+{
+    DWORD status;
+    ULONGLONG start = GetTickCount64();
+
+    (void)args;
+
+    /* acquire and store in global memory current dns domain name.
+     * needed for acls */
+    if (getdomainname()) {
+        eprintf("Could not get domain name\n");
+        exit(1);
+    }
+
+    if (lazy_init_ldap_enable) {
+        EASSERT(nfs41_dg.localdomain_name[0] != '\0');
+
+        status = nfs41_idmap_create(&(nfs41_dg.idmapper),
+            nfs41_dg.localdomain_name);
+        if (status) {
+            eprintf("id mapping initialization failed with %d\n", status);
+            exit(1);
+        }
+    }
+
+    DPRINTF(1, ("nfsd_lazy_init_thread: done after %llu ms\n",
+        (unsigned long long)(GetTickCount64() - start)));
+    (void)InterlockedExchange(&lazy_init_done, 1);
+    (void)SetEvent(lazy_init_done_event);
+    return 0;
+}
+
+static int nfsd_lazy_init_start(
+    IN bool_t ldap_enable)
+{
+    lazy_init_ldap_enable = ldap_enable;
+
+    lazy_init_done_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (lazy_init_done_event == NULL) {
+        eprintf("nfsd_lazy_init_start: CreateEventA() failed, "
+            "lasterr=%d\n", (int)GetLastError());
+        return 1;
+    }
+
+    lazy_init_thread = (HANDLE)_beginthreadex(NULL, 0,
+        nfsd_lazy_init_thread, NULL, 0, NULL);
+    if (lazy_init_thread == NULL) {
+        eprintf("nfsd_lazy_init_start: _beginthreadex() failed, "
+            "lasterr=%d\n", (int)GetLastError());
+        (void)CloseHandle(lazy_init_done_event);
+        lazy_init_done_event = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+static void nfsd_lazy_init_wait(void)
+{
+    if (lazy_init_done)
+        return;
+
+    DPRINTF(1, ("nfsd_lazy_init_wait: waiting for domain name and "
+        "idmapper\n"));
+    (void)WaitForSingleObject(lazy_init_done_event, INFINITE);
+}
+#endif /* NFS41_DRIVER_DAEMON_LAZY_INIT */
+
+
 #ifdef STANDALONE_NFSD
 void __cdecl wmain(int argc, wchar_t *argv[])
 #else
@@ -822,6 +2019,7 @@ VOID ServiceStart(DWORD argc, LPTSTR *argv)
     HANDLE pipe;
     nfs41_process_thread tids[MAX_NUM_THREADS];
     int i;
+    int num_initial_threads;
     nfsd_args cmd_args;
 
     if (!check_for_files())
@@ -831,7 +2029,36 @@ VOID ServiceStart(DWORD argc, LPTSTR *argv)
     set_debug_level(cmd_args.debug_level);
     open_log_files();
     sidcache_init();
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+    /* a missing or broken cache file only costs the warm caches */
+    if (cmd_args.idcachefile_filename &&
+        (idcachefile_open(cmd_args.idcachefile_filename) == NO_ERROR))
+        sidcache_load_idcachefile();
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+    /* "fsc" mounts read from the server if there is no cache */
+    if (cmd_args.fscache_dir)
+        (void)nfs41_fscache_open(cmd_args.fscache_dir,
+            (uint64_t)cmd_args.fscache_size_mb * 1024ULL * 1024ULL);
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    /* "immutable" mounts start with a cold name cache without it */
+    if (cmd_args.namecachesnapshot_dir)
+        (void)nfs41_ncsnap_open(cmd_args.namecachesnapshot_dir);
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+    /* the caches keep their default limits if this fails */
+    (void)nfs41_mempressure_start();
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
     nfsd_crt_debug_init();
+    /* microbenchmarks do not need the driver or the network */
+    if (cmd_args.xdrbench_iterations)
+        exit(nfs_xdr_bench(cmd_args.xdrbench_iterations));
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+    if (cmd_args.upcalltrace_filename &&
+        upcall_trace_open(cmd_args.upcalltrace_filename))
+        exit(1);
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
     (void)winsock_init();
     init_version_string();
 #ifndef NFS41_DRIVER_SID_CACHE
@@ -848,13 +2075,18 @@ VOID ServiceStart(DWORD argc, LPTSTR *argv)
 
     /* Enable Win32 privileges */
     set_nfs_daemon_privileges();
+#ifdef NFS41_DRIVER_DAEMON_LARGE_PAGES
+    nfsd_largepage_pool_init();
+#endif /* NFS41_DRIVER_DAEMON_LARGE_PAGES */
 
+#ifndef NFS41_DRIVER_DAEMON_LAZY_INIT
     /* acquire and store in global memory current dns domain name.
      * needed for acls */
     if (getdomainname()) {
         eprintf("Could not get domain name\n");
         exit(1);
     }
+#endif /* !NFS41_DRIVER_DAEMON_LAZY_INIT */
 
     /*
      * Set high priority class to avoid that the daemon gets stomped
@@ -874,7 +2106,12 @@ VOID ServiceStart(DWORD argc, LPTSTR *argv)
 #endif /* NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN */
 
     nfs41_server_list_init();
+    pnfs_io_pool_init();
 
+#ifdef NFS41_DRIVER_DAEMON_LAZY_INIT
+    if (nfsd_lazy_init_start(cmd_args.ldap_enable))
+        goto out_logs;
+#else
     if (cmd_args.ldap_enable) {
         EASSERT(nfs41_dg.localdomain_name[0] != '\0');
 
@@ -885,9 +2122,11 @@ VOID ServiceStart(DWORD argc, LPTSTR *argv)
             goto out_logs;
         }
     }
+#endif /* NFS41_DRIVER_DAEMON_LAZY_INIT */
 
     NFS41D_VERSION = GetTickCount();
     DPRINTF(1, ("NFS41 Daemon starting: version %d\n", NFS41D_VERSION));
+    nfsd_trace_register();
 
     pipe = create_nfs41sys_device_pipe();
     if (pipe == INVALID_HANDLE_VALUE) {
@@ -911,19 +2150,39 @@ VOID ServiceStart(DWORD argc, LPTSTR *argv)
         goto out_pipe;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+    nfsd_io_pool_register(pipe);
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
+
 #ifndef STANDALONE_NFSD
     stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
     if (stop_event == NULL)
       goto out_pipe;
 #endif
 
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+    {
+        SYSTEM_INFO si;
+
+        GetSystemInfo(&si);
+        max_idle_worker_threads = max(NFSD_MIN_WORKER_THREADS,
+            (LONG)si.dwNumberOfProcessors * 2);
+    }
+    num_initial_threads = (int)min(nfs41_dg.num_worker_threads,
+        NFSD_MIN_WORKER_THREADS);
+    num_worker_threads_running = num_initial_threads;
+    DPRINTF(1, ("Starting %d worker threads (max %d)...\n",
+        num_initial_threads, (int)nfs41_dg.num_worker_threads));
+#else
+    num_initial_threads = (int)nfs41_dg.num_worker_threads;
     DPRINTF(1, ("Starting %d worker threads...\n",
-        (int)nfs41_dg.num_worker_threads));
-    for (i = 0; i < nfs41_dg.num_worker_threads; i++) {
+        num_initial_threads));
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+    for (i = 0; i < num_initial_threads; i++) {
         tids[i].handle = (HANDLE)_beginthreadex(NULL,
             NFSD_THREAD_STACK_SIZE,
             nfsd_thread_main,
-            &nfs41_dg,
+            &static_worker_args,
             0,
             &tids[i].tid);
         if (tids[i].handle == INVALID_HANDLE_VALUE) {
@@ -954,7 +2213,7 @@ VOID ServiceStart(DWORD argc, LPTSTR *argv)
 #else
     //This can be changed to waiting on an array of handles and using waitformultipleobjects
     DPRINTF(1, ("Parent waiting for children threads\n"));
-    for (i = 0; i < nfs41_dg.num_worker_threads; i++)
+    for (i = 0; i < num_initial_threads; i++)
         WaitForSingleObject(tids[i].handle, INFINITE );
 #endif
     DPRINTF(1, ("Parent woke up!!!!\n"));
@@ -963,8 +2222,29 @@ out_pipe:
     close_nfs41sys_device_pipe(pipe);
 
 out_idmap:
+    nfsd_trace_unregister();
+#ifdef NFS41_DRIVER_DAEMON_LAZY_INIT
+    /* do not free the idmapper while it is being created */
+    if (lazy_init_thread) {
+        (void)WaitForSingleObject(lazy_init_thread, INFINITE);
+        (void)CloseHandle(lazy_init_thread);
+    }
+#endif /* NFS41_DRIVER_DAEMON_LAZY_INIT */
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+    nfs41_mempressure_stop();
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
     if (nfs41_dg.idmapper)
         nfs41_idmap_free(nfs41_dg.idmapper);
+    sidcache_free();
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+    idcachefile_close();
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+    nfs41_fscache_close();
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+#ifdef NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT
+    nfs41_ncsnap_close();
+#endif /* NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT */
 out_logs:
 #ifndef STANDALONE_NFSD
     close_log_files();
@@ -30,6 +30,12 @@
 #include "nfs41_build_features.h"
 #include "idmap.h"
 
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+#define SLOT_WEIGHTS_MAX 16 /* max. number of "--slotweight" options */
+#define SLOT_WEIGHT_LIMIT 100
+#define MAX_USER_SLOTS_LIMIT 1024
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+
 /*
  * Global data of the daemon process
  */
@@ -39,10 +45,79 @@ typedef struct __nfs41_daemon_globals {
     int default_uid;
     int default_gid;
     ssize_t num_worker_threads;
+    /* "--numworkerthreads" given, do not adjust to the session slots */
+    bool_t num_worker_threads_set;
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PREFETCH
+    /* max. number of entries prefetched per directory listing */
+    int readdir_prefetch_max;
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+    /* bytes READ in the OPEN compound, 0 disables */
+    uint32_t open_prefetch_size;
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+    /* max. number of tree walk prefetch threads, 0 disables */
+    int treewalk_prefetch_max;
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+    /* max. number of delegations per client, 0 means no limit */
+    int max_delegations;
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+    /* max. session slots per user and session, 0 means no limit */
+    int max_user_slots;
+    /* "--slotweight <uid>=<weight>", all other users have weight 1 */
+    struct {
+        uint32_t uid;
+        uint32_t weight;
+    } slot_weights[SLOT_WEIGHTS_MAX];
+    int num_slot_weights;
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+    /* AUTH_SYS supplementary gids, |AUTHSYS_GIDS_*| */
+    int authsys_gids_mode;
     int crtdbgmem_flags;
     char nfs41_nii_name[256];
 } nfs41_daemon_globals;
 
 #define NFS41D_GLOBALS_CRTDBGMEM_FLAGS_NOT_SET (-1)
 
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PREFETCH
+#define READDIR_PREFETCH_MAX_DEFAULT 256
+#define READDIR_PREFETCH_MAX_LIMIT 4096
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PREFETCH */
+
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+#define OPEN_PREFETCH_MAX_KB 64
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
+
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+#define TREEWALK_PREFETCH_MAX_DEFAULT 2
+#define TREEWALK_PREFETCH_MAX_LIMIT 16
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+
+#define MAX_DELEGATIONS_DEFAULT 4096
+#define MAX_DELEGATIONS_LIMIT 65536
+
+/*
+ * "--authsysgids": |AUTHSYS_GIDS_TOKEN| sends the gids of the first
+ * |RPC_AUTHUNIX_AUP_MAX_NUM_GIDS| groups of the user's token,
+ * |AUTHSYS_GIDS_SERVER| only sends uid and primary gid and relies on
+ * the server to look up the user's groups (e.g. Linux
+ * "rpc.mountd --manage-gids"), |AUTHSYS_GIDS_AUTO| uses
+ * |AUTHSYS_GIDS_SERVER| for tokens with more groups than AUTH_SYS
+ * can carry
+ */
+#define AUTHSYS_GIDS_TOKEN  0
+#define AUTHSYS_GIDS_SERVER 1
+#define AUTHSYS_GIDS_AUTO   2
+
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+/* nfs41_daemon.c */
+void nfsd_worker_threads_fit_slots(
+    IN uint32_t max_slots);
+void nfsd_worker_thread_delay_begin(void);
+void nfsd_worker_thread_delay_end(void);
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+
+/* xdr_bench.c */
+int nfs_xdr_bench(unsigned int iterations);
+
 #endif /* !__NFS41_DAEMON_H_ */
@@ -34,6 +34,7 @@
 #include "nfs41_xdr.h"
 #include "name_cache.h"
 #include "delegation.h"
+#include "nfs41_callback.h"
 #include "daemon_debug.h"
 #include "util.h"
 
@@ -165,7 +166,7 @@ int nfs41_create_session(nfs41_client *clnt, nfs41_session *session, bool_t try_
     set_fore_channel_attrs(clnt->rpc,
         NFS41_MAX_RPC_REQS, &req.csa_fore_chan_attrs);
     set_back_channel_attrs(clnt->rpc,
-        1, &req.csa_back_chan_attrs);
+        NFS41_MAX_CB_REQS, &req.csa_back_chan_attrs);
     
     reply.csr_sessionid = session->session_id;
     reply.csr_fore_chan_attrs = &session->fore_chan_attrs;
@@ -190,6 +191,10 @@ int nfs41_create_session(nfs41_client *clnt, nfs41_session *session, bool_t try_
         "(ca_maxoperations=%d,ca_maxrequests=%d)\n",
         (int)session->fore_chan_attrs.ca_maxoperations,
         (int)session->fore_chan_attrs.ca_maxrequests));
+    DPRINTF(1, ("nfs41_create_session: "
+        "Response from server: session->back_chan_attrs->"
+        "(ca_maxrequests=%d)\n",
+        (int)session->back_chan_attrs.ca_maxrequests));
 
     if (session->fore_chan_attrs.ca_maxoperations < 64) {
         eprintf("WARNING: Server returned ca_maxoperations(=%d) "
@@ -237,9 +242,33 @@ int nfs41_create_session(nfs41_client *clnt, nfs41_session *session, bool_t try_
         "maxrequests", session->fore_chan_attrs.ca_maxrequests));
     DPRINTF(1, ("client supports %d max rpc slots, but server has %d\n",
         session->table.max_slots, session->fore_chan_attrs.ca_maxrequests));
-    /* use the server's ca_maxrequests unless it's bigger than our array */
-    session->table.max_slots = min(session->table.max_slots,
+    /* size the slot table for the server's ca_maxrequests */
+    nfs41_session_set_max_slots(session,
         session->fore_chan_attrs.ca_maxrequests);
+
+    /*
+     * The server may grant smaller requests/responses than rsize/wsize
+     * from the mount options, which limits |max_read_size()| and
+     * |max_write_size()|. Tell the admin, and let connections created
+     * from now on (trunking, reconnects) size their xdrrec buffers
+     * for what the session can actually use
+     */
+    if ((session->fore_chan_attrs.ca_maxresponsesize < clnt->rpc->rsize) ||
+        (session->fore_chan_attrs.ca_maxrequestsize < clnt->rpc->wsize)) {
+        eprintf("nfs41_create_session: server '%s' limits I/O to "
+            "rsize=%u/wsize=%u (requested rsize=%u/wsize=%u)\n",
+            clnt->rpc->server_name,
+            (unsigned int)(session->fore_chan_attrs.ca_maxresponsesize -
+                READ_OVERHEAD),
+            (unsigned int)(session->fore_chan_attrs.ca_maxrequestsize -
+                WRITE_OVERHEAD),
+            (unsigned int)(clnt->rpc->rsize - READ_OVERHEAD),
+            (unsigned int)(clnt->rpc->wsize - WRITE_OVERHEAD));
+        clnt->rpc->rsize = min(clnt->rpc->rsize,
+            session->fore_chan_attrs.ca_maxresponsesize);
+        clnt->rpc->wsize = min(clnt->rpc->wsize,
+            session->fore_chan_attrs.ca_maxrequestsize);
+    }
     status = 0;
 out:
     DPRINTF(1, ("<-- nfs41_create_session() returning %d\n",
@@ -446,29 +475,42 @@ int nfs41_open(
     IN uint32_t create,
     IN uint32_t how_mode,
     IN OPTIONAL nfs41_file_info *createattrs,
+    IN OPTIONAL const bitmap4 *createsetattrs,
     IN bool_t try_recovery,
     OUT stateid4 *stateid,
     OUT open_delegation4 *delegation,
-    OUT OPTIONAL nfs41_file_info *info)
+    OUT OPTIONAL nfs41_file_info *info,
+    IN OUT OPTIONAL nfs41_open_layoutget *layoutget,
+    IN OUT OPTIONAL nfs41_open_read *openread)
 {
     int status;
     nfs41_compound compound;
-    nfs_argop4 argops[8];
-    nfs_resop4 resops[8];
+    nfs_argop4 argops[13];
+    nfs_resop4 resops[13];
     nfs41_sequence_args sequence_args;
     nfs41_sequence_res sequence_res;
-    nfs41_putfh_args putfh_args[2];
-    nfs41_putfh_res putfh_res[2];
+    nfs41_putfh_args putfh_args[3];
+    nfs41_putfh_res putfh_res[3];
+    pnfs_layoutget_args layoutget_args;
+    pnfs_layoutget_res layoutget_res = { 0 };
+    stateid_arg current_stateid;
+    uint32_t i, layoutget_index = 0, setattr_index = 0, read_index = 0;
+    struct list_entry *entry;
     nfs41_op_open_args open_args;
     nfs41_op_open_res open_res;
     nfs41_getfh_res getfh_res;
     bitmap4 attr_request;
     nfs41_getattr_args getattr_args;
     nfs41_getattr_res getattr_res NDSH(= { 0 }), pgetattr_res NDSH(= { 0 });
+    nfs41_getattr_res sgetattr_res NDSH(= { 0 });
+    nfs41_setattr_args setattr_args;
+    nfs41_setattr_res setattr_res = { 0 };
+    nfs41_read_args read_args;
+    nfs41_read_res read_res = { 0 };
     nfs41_savefh_res savefh_res;
     nfs41_restorefh_res restorefh_res;
-    nfs41_file_info tmp_info, dir_info;
-    bool_t current_fh_is_dir;
+    nfs41_file_info tmp_info, dir_info, setattr_info;
+    bool_t current_fh_is_dir, trailing_ops;
     bool_t already_delegated = delegation->type == OPEN_DELEGATE_READ
         || delegation->type == OPEN_DELEGATE_WRITE;
 
@@ -504,6 +546,46 @@ int nfs41_open(
 
     attr_request.arr[0] |= FATTR4_WORD0_FSID;
 
+    /*
+     * Attributes which cannot go into the OPEN's createattrs are set
+     * with a SETATTR in the same compound: Those |createsetattrs|
+     * whose failure must not fail the create, and for EXCLUSIVE4_1
+     * those not in the server's |suppattr_exclcreat|, for which RFC
+     * 5661 section 18.16.3 asks for a SETATTR after the OPEN
+     */
+    bitmap4_clear(&setattr_info.attrmask);
+    if (createattrs && (create == OPEN4_CREATE) && current_fh_is_dir) {
+        setattr_info = *createattrs;
+        if (how_mode != EXCLUSIVE4_1)
+            bitmap4_clear(&setattr_info.attrmask);
+        if (createsetattrs)
+            bitmap_or(&setattr_info.attrmask, createsetattrs);
+        nfs41_superblock_supported_attrs(parent->fh.superblock,
+            &setattr_info.attrmask);
+        /* a new file is empty */
+        bitmap_unset(&setattr_info.attrmask, 0, FATTR4_WORD0_SIZE);
+    }
+
+    if (how_mode == EXCLUSIVE4_1) {
+        /* mask unsupported attributes */
+        nfs41_superblock_supported_attrs_exclcreat(
+            parent->fh.superblock, &createattrs->attrmask);
+    } else if (createattrs) {
+        /* mask unsupported attributes */
+        nfs41_superblock_supported_attrs(
+            parent->fh.superblock, &createattrs->attrmask);
+    }
+    if (createattrs && createsetattrs)
+        bitmap_remove(&createattrs->attrmask, createsetattrs);
+    if (createattrs)
+        bitmap_remove(&setattr_info.attrmask, &createattrs->attrmask);
+
+    /* with a layout, reads go to the data servers */
+    if (layoutget)
+        openread = NULL;
+    trailing_ops = (layoutget != NULL) ||
+        (setattr_info.attrmask.count != 0) || (openread != NULL);
+
     compound_init(&compound, session->client->root->nfsminorvers,
         argops, resops, "open");
 
@@ -516,7 +598,12 @@ int nfs41_open(
         putfh_args[0].file = parent;
         putfh_args[0].in_recovery = 0;
 
-        compound_add_op(&compound, OP_SAVEFH, NULL, &savefh_res);
+        /*
+         * with LAYOUTGET, SETATTR or READ, the file is saved after the
+         * OPEN instead
+         */
+        if (!trailing_ops)
+            compound_add_op(&compound, OP_SAVEFH, NULL, &savefh_res);
     } else {
         /* CURRENT_FH: file being opened */
         compound_add_op(&compound, OP_PUTFH, &putfh_args[0], &putfh_res[0]);
@@ -530,6 +617,16 @@ int nfs41_open(
     open_args.share_access = allow | OPEN4_SHARE_ACCESS_WANT_NO_DELEG;
 #else
     open_args.share_access = allow;
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+    /* ask for delegated timestamps if the server has them (RFC 9754) */
+    if (((allow & OPEN4_SHARE_ACCESS_WANT_DELEG_MASK) !=
+            OPEN4_SHARE_ACCESS_WANT_NO_DELEG) &&
+        (session->client->root->nfsminorvers >= 2) &&
+        parent->fh.superblock &&
+        bitmap_isset(&parent->fh.superblock->supported_attrs, 2,
+            FATTR4_WORD2_TIME_DELEG_MODIFY))
+        open_args.share_access |= OPEN4_SHARE_ACCESS_WANT_DELEG_TIMESTAMPS;
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
 #endif
     open_args.share_deny = deny; 
     open_args.owner = owner;
@@ -540,13 +637,6 @@ int nfs41_open(
         DWORD tid = GetCurrentThreadId();
         time((time_t*)open_args.openhow.how.createverf);
         memcpy(open_args.openhow.how.createverf+4, &tid, sizeof(tid));
-        /* mask unsupported attributes */
-        nfs41_superblock_supported_attrs_exclcreat(
-            parent->fh.superblock, &createattrs->attrmask);
-    } else if (createattrs) {
-        /* mask unsupported attributes */
-        nfs41_superblock_supported_attrs(
-            parent->fh.superblock, &createattrs->attrmask);
     }
     open_args.claim = claim;
     open_res.resok4.stateid = stateid;
@@ -562,9 +652,11 @@ int nfs41_open(
     getattr_res.obj_attributes.attr_vals_len = NFS4_OPAQUE_LIMIT_ATTR;
     getattr_res.info = info;
 
-    if (current_fh_is_dir) {
+    if (current_fh_is_dir && !trailing_ops) {
         compound_add_op(&compound, OP_RESTOREFH, NULL, &restorefh_res);
     } else {
+        if (current_fh_is_dir)
+            compound_add_op(&compound, OP_SAVEFH, NULL, &savefh_res);
         compound_add_op(&compound, OP_PUTFH, &putfh_args[1], &putfh_res[1]);
         putfh_args[1].file = parent;
         putfh_args[1].in_recovery = 0;
@@ -575,11 +667,103 @@ int nfs41_open(
     pgetattr_res.obj_attributes.attr_vals_len = NFS4_OPAQUE_LIMIT_ATTR;
     pgetattr_res.info = &dir_info;
 
+    if (trailing_ops) {
+        /*
+         * SETATTR, READ and LAYOUTGET go last, so their failure does
+         * not hide the results of the OPEN: SAVEFH(file); PUTFH(dir);
+         * GETATTR; RESTOREFH; SETATTR; GETATTR; READ or LAYOUTGET (or
+         * PUTFH(file); ... for the claims which already name the file)
+         */
+        if (current_fh_is_dir) {
+            compound_add_op(&compound, OP_RESTOREFH, NULL, &restorefh_res);
+        } else {
+            compound_add_op(&compound, OP_PUTFH,
+                &putfh_args[2], &putfh_res[2]);
+            putfh_args[2].file = file;
+            putfh_args[2].in_recovery = 0;
+        }
+
+        /* the special "current stateid" refers to the OPEN's stateid */
+        current_stateid.stateid.seqid = 1;
+        (void)memset(current_stateid.stateid.other, 0, NFS4_STATEID_OTHER);
+        current_stateid.type = STATEID_SPECIAL;
+        current_stateid.open = NULL;
+        current_stateid.delegation = NULL;
+    }
+
+    if (setattr_info.attrmask.count) {
+        setattr_index = compound.args.argarray_count;
+        compound_add_op(&compound, OP_SETATTR, &setattr_args, &setattr_res);
+        setattr_args.stateid = &current_stateid;
+        setattr_args.info = &setattr_info;
+
+        /* fetch the file's attributes again, including the new ones */
+        compound_add_op(&compound, OP_GETATTR, &getattr_args, &sgetattr_res);
+        sgetattr_res.obj_attributes.attr_vals_len = NFS4_OPAQUE_LIMIT_ATTR;
+        sgetattr_res.info = info;
+    }
+
+    if (openread) {
+        read_index = compound.args.argarray_count;
+        compound_add_op(&compound, OP_READ, &read_args, &read_res);
+        read_args.stateid = &current_stateid;
+        read_args.offset = 0;
+        read_args.count = openread->count;
+        read_res.resok4.data_len = openread->count;
+        read_res.resok4.data = openread->buffer;
+        openread->status = NFS4ERR_IO;
+    }
+
+    if (layoutget) {
+        layoutget_index = compound.args.argarray_count;
+        compound_add_op(&compound, OP_LAYOUTGET,
+            &layoutget_args, &layoutget_res);
+        layoutget_args.signal_layout_avail = 0;
+        layoutget_args.layout_type = layoutget->type;
+        layoutget_args.iomode = layoutget->iomode;
+        layoutget_args.offset = 0;
+        layoutget_args.minlength = 0;
+        layoutget_args.length = NFS4_UINT64_MAX;
+        layoutget_args.stateid = &current_stateid;
+        layoutget_args.maxcount =
+            session->fore_chan_attrs.ca_maxresponsesize - READ_OVERHEAD;
+
+        list_init(&layoutget->res.layouts);
+        layoutget_res.u.res_ok = &layoutget->res;
+        layoutget->status = NFS4ERR_LAYOUTUNAVAILABLE;
+    }
+
     status = compound_encode_send_decode(session, &compound, try_recovery);
     if (status)
         goto out;
 
-    if (compound_error(status = compound.res.status))
+    status = compound.res.status;
+    if (setattr_index && (compound.res.resarray_count == setattr_index + 1)) {
+        /* the OPEN went through, only the SETATTR failed */
+        eprintf("nfs41_open: SETATTR(attrmask=(%u,{0x%x,0x%x})) "
+            "after OPEN4_CREATE failed with '%s'\n",
+            (unsigned int)setattr_info.attrmask.count,
+            (unsigned int)setattr_info.attrmask.arr[0],
+            (unsigned int)setattr_info.attrmask.arr[1],
+            nfs_error_string(setattr_res.status));
+        setattr_index = 0;
+        status = NFS4_OK;
+    }
+    if (read_index && (compound.res.resarray_count == read_index + 1)) {
+        /* the OPEN went through, only the READ may have failed */
+        openread->status = read_res.status;
+        if (read_res.status == NFS4_OK) {
+            openread->len = read_res.resok4.data_len;
+            openread->eof = read_res.resok4.eof;
+        }
+        status = NFS4_OK;
+    }
+    if (layoutget && (compound.res.resarray_count == layoutget_index + 1)) {
+        /* the OPEN went through, only the LAYOUTGET may have failed */
+        layoutget->status = layoutget_res.status;
+        status = NFS4_OK;
+    }
+    if (compound_error(status))
         goto out;
 
     if (dir_info.type == NF4ATTRDIR) {
@@ -596,9 +780,35 @@ int nfs41_open(
     if (create == OPEN4_CREATE)
         nfs41_superblock_space_changed(file->fh.superblock);
 
+    if ((open_res.resok4.rflags & OPEN4_RESULT_PRESERVE_UNLINKED) &&
+        (!file->fh.superblock->preserve_unlinked))
+        file->fh.superblock->preserve_unlinked = true;
+
+    if (layoutget && (layoutget->status == NFS4_OK)) {
+        /* point each file handle to the meta server's superblock */
+        list_for_each(entry, &layoutget->res.layouts) {
+            pnfs_layout *base = list_container(entry, pnfs_layout, entry);
+            if (base->type == PNFS_LAYOUTTYPE_FILE) {
+                pnfs_file_layout *layout = (pnfs_file_layout*)base;
+                for (i = 0; i < layout->filehandles.count; i++)
+                    layout->filehandles.arr[i].fh.superblock =
+                        file->fh.superblock;
+            }
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+            else if (base->type == PNFS_LAYOUTTYPE_FLEXFILES) {
+                pnfs_file_layout *layout = (pnfs_file_layout*)base;
+                for (i = 0; i < layout->mirrors.count; i++)
+                    layout->mirrors.arr[i].file.fh.superblock =
+                        file->fh.superblock;
+            }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+        }
+    }
+
     /* update the name/attr cache with the results */
     open_update_cache(session, parent, file, try_recovery, delegation,
-        already_delegated, &open_res.resok4.cinfo, &pgetattr_res, &getattr_res);
+        already_delegated, &open_res.resok4.cinfo, &pgetattr_res,
+        setattr_index ? &sgetattr_res : &getattr_res);
 out:
     return status;
 }
@@ -758,6 +968,91 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+/*
+ * SETATTR and CLOSE in one compound, for the attribute changes the
+ * kernel defers until the file is closed. If the SETATTR fails, the
+ * file is closed with a separate CLOSE and the SETATTR error is
+ * returned in |setattr_status|
+ */
+int nfs41_setattr_close(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid_arg *stateid,
+    IN nfs41_file_info *setattr_info,
+    OUT int *setattr_status)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[5];
+    nfs_resop4 resops[5];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs41_setattr_args setattr_args;
+    nfs41_setattr_res setattr_res = { 0 };
+    nfs41_op_close_args close_args;
+    nfs41_op_close_res close_res;
+    nfs41_getattr_args getattr_args;
+    nfs41_getattr_res getattr_res NDSH(= { 0 });
+    bitmap4 attr_request;
+    nfs41_file_info info;
+
+    *setattr_status = NFS4_OK;
+
+    nfs41_superblock_getattr_mask(file->fh.superblock, &attr_request);
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops, "setattr_close");
+
+    compound_add_op(&compound, OP_SEQUENCE, &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 1);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = file;
+    putfh_args.in_recovery = 0;
+
+    compound_add_op(&compound, OP_SETATTR, &setattr_args, &setattr_res);
+    setattr_args.stateid = stateid;
+    setattr_args.info = setattr_info;
+
+    compound_add_op(&compound, OP_CLOSE, &close_args, &close_res);
+    close_args.stateid = stateid;
+
+    compound_add_op(&compound, OP_GETATTR, &getattr_args, &getattr_res);
+    getattr_args.attr_request = &attr_request;
+    getattr_res.obj_attributes.attr_vals_len = NFS4_OPAQUE_LIMIT_ATTR;
+    getattr_res.info = &info;
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    status = compound.res.status;
+    if (status && (compound.res.resarray_count == 3)) {
+        /* only the SETATTR failed, the file is still open */
+        *setattr_status = status;
+        status = nfs41_close(session, file, stateid);
+        goto out;
+    }
+    if (compound_error(status))
+        goto out;
+
+    /* the CLOSE went through, update the file's attributes */
+    bitmap4_cpy(&info.attrmask, &getattr_res.obj_attributes.attrmask);
+    nfs41_attr_cache_update(session_name_cache(session),
+        file->fh.fileid, &info);
+
+    if (bitmap_isset(&setattr_res.attrsset, 0, FATTR4_WORD0_SIZE) ||
+        bitmap_isset(&setattr_res.attrsset, 1, FATTR4_WORD1_SPACE_USED)) {
+        nfs41_superblock_space_changed(file->fh.superblock);
+    }
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+
 int nfs41_write(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -785,7 +1080,8 @@ int nfs41_write(
     bitmap4 attr_request;
     nfs41_file_info info, *pinfo;
 
-    nfs41_superblock_getattr_mask(file->fh.superblock, &attr_request);
+    nfs41_superblock_getattr_profile(file->fh.superblock,
+        NFS41_GETATTR_PROFILE_WRITE, &attr_request);
 
     compound_init(&compound, session->client->root->nfsminorvers,
         argops, resops,
@@ -958,7 +1254,8 @@ int nfs41_commit(
     if (cinfo) pinfo = cinfo;
     else pinfo = &info;
     if (do_getattr) {
-        nfs41_superblock_getattr_mask(file->fh.superblock, &attr_request);
+        nfs41_superblock_getattr_profile(file->fh.superblock,
+            NFS41_GETATTR_PROFILE_WRITE, &attr_request);
 
         compound_add_op(&compound, OP_GETATTR, &getattr_args, &getattr_res);
         getattr_args.attr_request = &attr_request;
@@ -984,6 +1281,244 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+/*
+ * |nfs41_commit_batch()| - COMMIT the ranges of |count| files with
+ * as few compounds as possible
+ *
+ * Same scheme as |nfs41_getattr_batch()|: SEQUENCE, followed by one
+ * PUTFH+COMMIT(+GETATTR if |do_getattr|) group per file.
+ * |verfs[i]| receives the COMMIT verifier, |infos[i]| the attributes
+ * of |files[i]| (if |do_getattr|, |infos| can be |NULL| otherwise)
+ * and |statuses[i]| the NFSv4 status.
+ * The return value is the status of the last compound sent.
+ */
+#define COMMIT_BATCH_MAX_FILES 16
+
+typedef struct __commit_batch_compound {
+    nfs_argop4 argops[1+COMMIT_BATCH_MAX_FILES*3];
+    nfs_resop4 resops[1+COMMIT_BATCH_MAX_FILES*3];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args[COMMIT_BATCH_MAX_FILES];
+    nfs41_putfh_res putfh_res[COMMIT_BATCH_MAX_FILES];
+    nfs41_commit_args commit_args[COMMIT_BATCH_MAX_FILES];
+    nfs41_commit_res commit_res[COMMIT_BATCH_MAX_FILES];
+    bitmap4 attr_request[COMMIT_BATCH_MAX_FILES];
+    nfs41_getattr_args getattr_args[COMMIT_BATCH_MAX_FILES];
+    nfs41_getattr_res getattr_res[COMMIT_BATCH_MAX_FILES];
+} commit_batch_compound;
+
+int nfs41_commit_batch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN const uint64_t *offsets,
+    IN const uint32_t *counts,
+    IN bool_t do_getattr,
+    OUT nfs41_write_verf *const *verfs,
+    OUT nfs41_file_info *const *infos OPTIONAL,
+    OUT int *statuses)
+{
+    int status = NFS4_OK;
+    nfs41_compound compound;
+    commit_batch_compound *cbc;
+    const uint32_t ops_per_file = do_getattr?3:2;
+    uint32_t max_files, chunk, done, i, failed;
+
+    cbc = nfsd_arena_alloc(sizeof(commit_batch_compound));
+    if (cbc == NULL) {
+        status = NFS4ERR_SERVERFAULT;
+        for (i = 0 ; i < count ; i++)
+            statuses[i] = status;
+        goto out;
+    }
+
+    max_files = (session->fore_chan_attrs.ca_maxoperations - 1) /
+        ops_per_file;
+    if (max_files > COMMIT_BATCH_MAX_FILES)
+        max_files = COMMIT_BATCH_MAX_FILES;
+    if (max_files == 0)
+        max_files = 1;
+
+    for (done = 0 ; done < count ; ) {
+        chunk = min(count - done, max_files);
+
+        compound_init(&compound, session->client->root->nfsminorvers,
+            cbc->argops, cbc->resops, "commit_batch");
+
+        compound_add_op(&compound, OP_SEQUENCE,
+            &cbc->sequence_args, &cbc->sequence_res);
+        nfs41_session_sequence(&cbc->sequence_args, session, 1);
+
+        for (i = 0 ; i < chunk ; i++) {
+            compound_add_op(&compound, OP_PUTFH,
+                &cbc->putfh_args[i], &cbc->putfh_res[i]);
+            cbc->putfh_args[i].file = files[done+i];
+            cbc->putfh_args[i].in_recovery = 0;
+
+            compound_add_op(&compound, OP_COMMIT,
+                &cbc->commit_args[i], &cbc->commit_res[i]);
+            cbc->commit_args[i].offset = offsets[done+i];
+            cbc->commit_args[i].count = counts[done+i];
+            cbc->commit_res[i].verf = verfs[done+i];
+
+            if (do_getattr) {
+                nfs41_superblock_getattr_profile(
+                    files[done+i]->fh.superblock,
+                    NFS41_GETATTR_PROFILE_WRITE, &cbc->attr_request[i]);
+                compound_add_op(&compound, OP_GETATTR,
+                    &cbc->getattr_args[i], &cbc->getattr_res[i]);
+                cbc->getattr_args[i].attr_request = &cbc->attr_request[i];
+                (void)memset(&cbc->getattr_res[i], 0,
+                    sizeof(nfs41_getattr_res));
+                cbc->getattr_res[i].obj_attributes.attr_vals_len =
+                    NFS4_OPAQUE_LIMIT_ATTR;
+                cbc->getattr_res[i].info = infos[done+i];
+            }
+        }
+
+        status = compound_encode_send_decode(session, &compound, TRUE);
+        if (status) {
+            for (i = done ; i < count ; i++)
+                statuses[i] = status;
+            goto out_free;
+        }
+
+        status = compound.res.status;
+        if (compound_error(status)) {
+            if (compound.res.resarray_count <= 1) {
+                /* SEQUENCE failed, no file was processed */
+                for (i = done ; i < count ; i++)
+                    statuses[i] = status;
+                goto out_free;
+            }
+            failed = (compound.res.resarray_count - 2) / ops_per_file;
+        }
+        else {
+            failed = chunk;
+        }
+
+        for (i = 0 ; i < failed ; i++) {
+            if (do_getattr) {
+                bitmap4_cpy(&infos[done+i]->attrmask,
+                    &cbc->getattr_res[i].obj_attributes.attrmask);
+                nfs41_attr_cache_update(session_name_cache(session),
+                    files[done+i]->fh.fileid, infos[done+i]);
+            }
+            nfs41_superblock_space_changed(files[done+i]->fh.superblock);
+            statuses[done+i] = NFS4_OK;
+        }
+        if (failed < chunk) {
+            statuses[done+failed] = status;
+            failed++;
+        }
+        done += failed;
+    }
+
+out_free:
+    nfsd_arena_free(cbc);
+out:
+    return status;
+}
+
+/*
+ * |nfs41_commit_coalesced()| - |nfs41_commit()| with
+ * |do_getattr| = |TRUE|, which gathers the COMMITs of concurrent
+ * callers on the same session
+ *
+ * The first caller sends its COMMIT right away. Callers which need a
+ * COMMIT while that compound is in flight queue up, and the next of
+ * them sends all queued COMMITs with one |nfs41_commit_batch()|.
+ * So when e.g. a build closes hundreds of files at once, their
+ * write-backs pay for a few round trips instead of one round trip per
+ * file. Every caller still waits for its own COMMIT, so the data is
+ * on stable storage before the WRITE (and the following CLOSE)
+ * upcall returns.
+ */
+typedef struct __commit_batch_request {
+    struct list_entry entry;
+    nfs41_path_fh *file;
+    uint64_t offset;
+    uint32_t count;
+    nfs41_write_verf *verf;
+    nfs41_file_info *info;
+    int status;
+    bool_t done;
+} commit_batch_request;
+
+int nfs41_commit_coalesced(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN uint64_t offset,
+    IN uint32_t count,
+    OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *cinfo)
+{
+    commit_batch_request req, *reqs[COMMIT_BATCH_MAX_FILES];
+    nfs41_path_fh *files[COMMIT_BATCH_MAX_FILES];
+    uint64_t offsets[COMMIT_BATCH_MAX_FILES];
+    uint32_t counts[COMMIT_BATCH_MAX_FILES];
+    nfs41_write_verf *verfs[COMMIT_BATCH_MAX_FILES];
+    nfs41_file_info *infos[COMMIT_BATCH_MAX_FILES];
+    int statuses[COMMIT_BATCH_MAX_FILES];
+    uint32_t i, n;
+
+    req.file = file;
+    req.offset = offset;
+    req.count = count;
+    req.verf = verf;
+    req.info = cinfo;
+    req.status = NFS4_OK;
+    req.done = FALSE;
+
+    AcquireSRWLockExclusive(&session->commit_batch.lock);
+    list_add_tail(&session->commit_batch.pending, &req.entry);
+    while (!req.done) {
+        if (session->commit_batch.busy) {
+            (void)SleepConditionVariableSRW(&session->commit_batch.cond,
+                &session->commit_batch.lock, INFINITE, 0);
+            continue;
+        }
+
+        /* send the oldest pending COMMITs, ours might not be among them */
+        session->commit_batch.busy = TRUE;
+        for (n = 0 ; (n < COMMIT_BATCH_MAX_FILES) &&
+            !list_empty(&session->commit_batch.pending) ; n++) {
+            reqs[n] = list_container(session->commit_batch.pending.next,
+                commit_batch_request, entry);
+            list_remove(&reqs[n]->entry);
+            files[n] = reqs[n]->file;
+            offsets[n] = reqs[n]->offset;
+            counts[n] = reqs[n]->count;
+            verfs[n] = reqs[n]->verf;
+            infos[n] = reqs[n]->info;
+        }
+        ReleaseSRWLockExclusive(&session->commit_batch.lock);
+
+        if (n == 1) {
+            statuses[0] = nfs41_commit(session, files[0], offsets[0],
+                counts[0], TRUE, verfs[0], infos[0]);
+        } else {
+            DPRINTF(1, ("nfs41_commit_coalesced: sending %u COMMITs\n",
+                (unsigned int)n));
+            (void)nfs41_commit_batch(session, n, files, offsets, counts,
+                TRUE, verfs, infos, statuses);
+        }
+
+        AcquireSRWLockExclusive(&session->commit_batch.lock);
+        for (i = 0 ; i < n ; i++) {
+            reqs[i]->status = statuses[i];
+            reqs[i]->done = TRUE;
+        }
+        session->commit_batch.busy = FALSE;
+        WakeAllConditionVariable(&session->commit_batch.cond);
+    }
+    ReleaseSRWLockExclusive(&session->commit_batch.lock);
+    return req.status;
+}
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+
 int nfs41_lock(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1092,6 +1627,73 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_BATCHED_LOCKU
+/*
+ * Release |count| (at most |NFS41_UNLOCK_BATCH_MAX|) byte-range locks
+ * with one SEQUENCE+PUTFH+LOCKU+LOCKU... compound.
+ * Every LOCKU bumps the seqid of the lock stateid, so only the first
+ * LOCKU uses the seqid from |stateid|, the following ones use seqid
+ * 0, which refers to the current seqid (RFC 8881 8.2.2). |stateid|
+ * gets the lock stateid returned by the last successful LOCKU.
+ * Returns the status of the first LOCKU which failed, the ranges
+ * before it have been released.
+ */
+int nfs41_unlock_batch(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN const nfs41_unlock_range *ranges,
+    IN uint32_t count,
+    IN OUT stateid_arg *stateid)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[2+NFS41_UNLOCK_BATCH_MAX];
+    nfs_resop4 resops[2+NFS41_UNLOCK_BATCH_MAX];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs41_locku_args locku_args[NFS41_UNLOCK_BATCH_MAX];
+    nfs41_locku_res locku_res[NFS41_UNLOCK_BATCH_MAX];
+    stateid_arg current;
+    uint32_t i;
+
+    EASSERT((count > 0) && (count <= NFS41_UNLOCK_BATCH_MAX));
+
+    (void)memcpy(&current, stateid, sizeof(current));
+    current.stateid.seqid = 0;
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops, "unlock_batch");
+
+    compound_add_op(&compound, OP_SEQUENCE, &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = file;
+    putfh_args.in_recovery = 0;
+
+    for (i = 0; i < count; i++) {
+        compound_add_op(&compound, OP_LOCKU, &locku_args[i], &locku_res[i]);
+        /* 18.12.3: the server MUST accept any legal value for locktype */
+        locku_args[i].locktype = READ_LT;
+        locku_args[i].seqid = 0;
+        locku_args[i].offset = ranges[i].offset;
+        locku_args[i].length = ranges[i].length;
+        locku_args[i].lock_stateid = (i == 0)? stateid : &current;
+        locku_res[i].lock_stateid = &stateid->stateid;
+    }
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    compound_error(status = compound.res.status);
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_BATCHED_LOCKU */
+
 int nfs41_readdir(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1204,6 +1806,280 @@ out:
     return status;
 }
 
+/*
+ * |nfs41_getattr_batch()| - fetch the attributes of |count| files
+ * with as few compounds as possible
+ *
+ * Each compound is SEQUENCE, followed by one PUTFH+GETATTR pair per
+ * file, limited by |session->fore_chan_attrs.ca_maxoperations|.
+ * The NFSv4.1 server stops processing a compound at the first
+ * failing operation, so we record the error for that file and resume
+ * with the next file in a new compound.
+ * |statuses[i]| receives the NFSv4 status for |files[i]|, the return
+ * value is the status of the last compound sent.
+ * |getattr_batch_send()| does this for at most
+ * |GETATTR_BATCH_MAX_FILES| files, with one |nfs41_file_info| pointer
+ * per file.
+ */
+#define GETATTR_BATCH_MAX_FILES 32
+
+typedef struct __getattr_batch_compound {
+    nfs_argop4 argops[1+GETATTR_BATCH_MAX_FILES*2];
+    nfs_resop4 resops[1+GETATTR_BATCH_MAX_FILES*2];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args[GETATTR_BATCH_MAX_FILES];
+    nfs41_putfh_res putfh_res[GETATTR_BATCH_MAX_FILES];
+    nfs41_getattr_args getattr_args[GETATTR_BATCH_MAX_FILES];
+    nfs41_getattr_res getattr_res[GETATTR_BATCH_MAX_FILES];
+} getattr_batch_compound;
+
+static int getattr_batch_send(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN bitmap4 *attr_request,
+    OUT nfs41_file_info *const *infos,
+    OUT int *statuses)
+{
+    int status = NFS4_OK;
+    nfs41_compound compound;
+    getattr_batch_compound *gbc;
+    uint32_t max_files, chunk, done, i, failed;
+
+    gbc = nfsd_arena_alloc(sizeof(getattr_batch_compound));
+    if (gbc == NULL) {
+        status = NFS4ERR_SERVERFAULT;
+        for (i = 0 ; i < count ; i++)
+            statuses[i] = status;
+        goto out;
+    }
+
+    max_files = (session->fore_chan_attrs.ca_maxoperations - 1) / 2;
+    if (max_files > GETATTR_BATCH_MAX_FILES)
+        max_files = GETATTR_BATCH_MAX_FILES;
+    if (max_files == 0)
+        max_files = 1;
+
+    for (done = 0 ; done < count ; ) {
+        chunk = min(count - done, max_files);
+
+        compound_init(&compound, session->client->root->nfsminorvers,
+            gbc->argops, gbc->resops, "getattr_batch");
+
+        compound_add_op(&compound, OP_SEQUENCE,
+            &gbc->sequence_args, &gbc->sequence_res);
+        nfs41_session_sequence(&gbc->sequence_args, session, 0);
+
+        for (i = 0 ; i < chunk ; i++) {
+            compound_add_op(&compound, OP_PUTFH,
+                &gbc->putfh_args[i], &gbc->putfh_res[i]);
+            gbc->putfh_args[i].file = files[done+i];
+            gbc->putfh_args[i].in_recovery = 0;
+
+            compound_add_op(&compound, OP_GETATTR,
+                &gbc->getattr_args[i], &gbc->getattr_res[i]);
+            gbc->getattr_args[i].attr_request = attr_request;
+            (void)memset(&gbc->getattr_res[i], 0,
+                sizeof(nfs41_getattr_res));
+            gbc->getattr_res[i].obj_attributes.attr_vals_len =
+                NFS4_OPAQUE_LIMIT_ATTR;
+            gbc->getattr_res[i].info = infos[done+i];
+        }
+
+        status = compound_encode_send_decode(session, &compound, TRUE);
+        if (status) {
+            for (i = done ; i < count ; i++)
+                statuses[i] = status;
+            goto out_free;
+        }
+
+        status = compound.res.status;
+        if (compound_error(status)) {
+            if (compound.res.resarray_count <= 1) {
+                /* SEQUENCE failed, no file was processed */
+                for (i = done ; i < count ; i++)
+                    statuses[i] = status;
+                goto out_free;
+            }
+            failed = (compound.res.resarray_count - 2) / 2;
+        }
+        else {
+            failed = chunk;
+        }
+
+        for (i = 0 ; i < failed ; i++) {
+            /* update the name cache with whatever attributes we got */
+            bitmap4_cpy(&infos[done+i]->attrmask,
+                &gbc->getattr_res[i].obj_attributes.attrmask);
+            nfs41_attr_cache_update(session_name_cache(session),
+                files[done+i]->fh.fileid, infos[done+i]);
+            statuses[done+i] = NFS4_OK;
+        }
+        if (failed < chunk) {
+            statuses[done+failed] = status;
+            failed++;
+        }
+        done += failed;
+    }
+
+out_free:
+    nfsd_arena_free(gbc);
+out:
+    return status;
+}
+
+int nfs41_getattr_batch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN bitmap4 *attr_request,
+    OUT nfs41_file_info *infos,
+    OUT int *statuses)
+{
+    nfs41_file_info *info_ptrs[GETATTR_BATCH_MAX_FILES];
+    int status = NFS4_OK;
+    uint32_t done, chunk, i;
+
+    for (done = 0 ; done < count ; done += chunk) {
+        chunk = min(count - done, GETATTR_BATCH_MAX_FILES);
+        for (i = 0 ; i < chunk ; i++)
+            info_ptrs[i] = &infos[done+i];
+        status = getattr_batch_send(session, chunk, &files[done],
+            attr_request, info_ptrs, &statuses[done]);
+    }
+    return status;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_GETATTR_COALESCING
+/*
+ * |nfs41_getattr_coalesced()| - |nfs41_getattr()| for a file, which
+ * gathers the GETATTRs of concurrent callers on the same session
+ *
+ * Up to |GETATTR_COALESCE_MAX_SENDERS| callers send their GETATTR
+ * right away. Callers which come while that many compounds are in
+ * flight queue up, and the next caller which gets to send takes the
+ * oldest queued GETATTR and all other queued GETATTRs with the same
+ * attribute mask, and sends them with one |getattr_batch_send()|.
+ * The number of files per compound is limited by
+ * |GETATTR_BATCH_MAX_FILES|, |ca_maxoperations| and
+ * |ca_maxrequestsize|.
+ * So a parallel "stat" storm (e.g. "make -j64") uses a few slots and
+ * compounds instead of one compound per file, without making a
+ * single GETATTR wait for anything.
+ */
+#define GETATTR_COALESCE_MAX_SENDERS 4
+/* PUTFH+GETATTR request size, and room for the header and SEQUENCE */
+#define GETATTR_COALESCE_FILE_BYTES (NFS4_FHSIZE + 32)
+#define GETATTR_COALESCE_HEADER_BYTES 256
+
+typedef struct __getattr_batch_request {
+    struct list_entry entry;
+    nfs41_path_fh *file;
+    bitmap4 *attr_request;
+    nfs41_file_info *info;
+    int status;
+    bool_t done;
+} getattr_batch_request;
+
+static bool getattr_mask_equal(
+    IN const bitmap4 *a,
+    IN const bitmap4 *b)
+{
+    uint32_t i;
+
+    for (i = 0 ; i < BITMAP4_MAXCOUNT ; i++) {
+        if (((i < a->count)?a->arr[i]:0) != ((i < b->count)?b->arr[i]:0))
+            return false;
+    }
+    return true;
+}
+
+int nfs41_getattr_coalesced(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN bitmap4 *attr_request,
+    OUT nfs41_file_info *info)
+{
+    getattr_batch_request req, *reqs[GETATTR_BATCH_MAX_FILES];
+    nfs41_path_fh *files[GETATTR_BATCH_MAX_FILES];
+    nfs41_file_info *infos[GETATTR_BATCH_MAX_FILES];
+    int statuses[GETATTR_BATCH_MAX_FILES];
+    struct list_entry *entry, *tmp;
+    uint32_t max_files, i, n;
+
+    max_files = GETATTR_BATCH_MAX_FILES;
+    if (session->fore_chan_attrs.ca_maxrequestsize >
+        GETATTR_COALESCE_HEADER_BYTES) {
+        max_files = min(max_files,
+            (session->fore_chan_attrs.ca_maxrequestsize -
+                GETATTR_COALESCE_HEADER_BYTES) /
+                GETATTR_COALESCE_FILE_BYTES);
+    }
+    if (max_files == 0)
+        max_files = 1;
+
+    req.file = file;
+    req.attr_request = attr_request;
+    req.info = info;
+    req.status = NFS4_OK;
+    req.done = FALSE;
+
+    AcquireSRWLockExclusive(&session->getattr_batch.lock);
+    list_add_tail(&session->getattr_batch.pending, &req.entry);
+    while (!req.done) {
+        if (session->getattr_batch.senders >= GETATTR_COALESCE_MAX_SENDERS) {
+            (void)SleepConditionVariableSRW(&session->getattr_batch.cond,
+                &session->getattr_batch.lock, INFINITE, 0);
+            continue;
+        }
+        session->getattr_batch.senders++;
+
+        /* the oldest pending GETATTR, ours might not be among them */
+        reqs[0] = list_container(session->getattr_batch.pending.next,
+            getattr_batch_request, entry);
+        list_remove(&reqs[0]->entry);
+        n = 1;
+        list_for_each_tmp(entry, tmp, &session->getattr_batch.pending) {
+            getattr_batch_request *r;
+
+            if (n >= max_files)
+                break;
+            r = list_container(entry, getattr_batch_request, entry);
+            if (!getattr_mask_equal(r->attr_request, reqs[0]->attr_request))
+                continue;
+            list_remove(&r->entry);
+            reqs[n++] = r;
+        }
+        ReleaseSRWLockExclusive(&session->getattr_batch.lock);
+
+        if (n == 1) {
+            statuses[0] = nfs41_getattr(session, reqs[0]->file,
+                reqs[0]->attr_request, reqs[0]->info);
+        } else {
+            DPRINTF(1, ("nfs41_getattr_coalesced: sending %u GETATTRs\n",
+                (unsigned int)n));
+            for (i = 0 ; i < n ; i++) {
+                files[i] = reqs[i]->file;
+                infos[i] = reqs[i]->info;
+            }
+            (void)getattr_batch_send(session, n, files,
+                reqs[0]->attr_request, infos, statuses);
+        }
+
+        AcquireSRWLockExclusive(&session->getattr_batch.lock);
+        for (i = 0 ; i < n ; i++) {
+            reqs[i]->status = statuses[i];
+            reqs[i]->done = TRUE;
+        }
+        session->getattr_batch.senders--;
+        WakeAllConditionVariable(&session->getattr_batch.cond);
+    }
+    ReleaseSRWLockExclusive(&session->getattr_batch.lock);
+    return req.status;
+}
+#endif /* NFS41_DRIVER_DAEMON_GETATTR_COALESCING */
+
 int nfs41_superblock_getattr(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1326,18 +2202,24 @@ int nfs41_remove(
     if (info.type == NF4ATTRDIR)
         goto out;
 
-    /* update the attributes of the parent directory */
-    bitmap4_cpy(&info.attrmask, &getattr_res.obj_attributes.attrmask);
-    nfs41_attr_cache_update(session_name_cache(session),
-        parent->fh.fileid, &info);
-
-    /* remove the target file from the cache */
+    /*
+     * Remove the target file from the cache first: The
+     * |change_info4| check of |nfs41_name_cache_remove()| compares
+     * |cinfo.before| with the cached change attribute of the parent
+     * dir, which would always pass after the parent's post-op
+     * attributes were stored
+     */
     AcquireSRWLockShared(&parent->path->lock);
     nfs41_name_cache_remove(session_name_cache(session),
         BIT2BOOL(parent->fh.superblock->case_insensitive),
         parent->path->path, target, fileid, &remove_res.cinfo);
     ReleaseSRWLockShared(&parent->path->lock);
 
+    /* update the attributes of the parent directory */
+    bitmap4_cpy(&info.attrmask, &getattr_res.obj_attributes.attrmask);
+    nfs41_attr_cache_update(session_name_cache(session),
+        parent->fh.fileid, &info);
+
     nfs41_superblock_space_changed(parent->fh.superblock);
 out:
     return status;
@@ -1409,16 +2291,6 @@ int nfs41_rename(
     if (compound_error(status = compound.res.status))
         goto out;
 
-    /* update the attributes of the source directory */
-    bitmap4_cpy(&src_info.attrmask, &src_getattr_res.obj_attributes.attrmask);
-    nfs41_attr_cache_update(session_name_cache(session),
-        src_dir->fh.fileid, &src_info);
-
-    /* update the attributes of the destination directory */
-    bitmap4_cpy(&dst_info.attrmask, &dst_getattr_res.obj_attributes.attrmask);
-    nfs41_attr_cache_update(session_name_cache(session),
-        dst_dir->fh.fileid, &dst_info);
-
     if (src_dir->path == dst_dir->path) {
         /* source and destination are the same, only lock it once */
         AcquireSRWLockShared(&src_dir->path->lock);
@@ -1431,7 +2303,11 @@ int nfs41_rename(
         AcquireSRWLockShared(&src_dir->path->lock);
     }
 
-    /* move/rename the target file's name cache entry */
+    /*
+     * Move/rename the target file's name cache entry in place. This
+     * must happen before the post-op dir attributes are stored, see
+     * |nfs41_remove()|
+     */
     nfs41_name_cache_rename(session_name_cache(session),
         BIT2BOOL(src_dir->fh.superblock->case_insensitive),
         src_dir->path->path, src_name, &rename_res.source_cinfo,
@@ -1443,6 +2319,16 @@ int nfs41_rename(
         ReleaseSRWLockShared(&src_dir->path->lock);
         ReleaseSRWLockShared(&dst_dir->path->lock);
     }
+
+    /* update the attributes of the source directory */
+    bitmap4_cpy(&src_info.attrmask, &src_getattr_res.obj_attributes.attrmask);
+    nfs41_attr_cache_update(session_name_cache(session),
+        src_dir->fh.fileid, &src_info);
+
+    /* update the attributes of the destination directory */
+    bitmap4_cpy(&dst_info.attrmask, &dst_getattr_res.obj_attributes.attrmask);
+    nfs41_attr_cache_update(session_name_cache(session),
+        dst_dir->fh.fileid, &dst_info);
 out:
     return status;
 }
@@ -1682,6 +2568,117 @@ out:
     return status;
 }
 
+/*
+ * |nfs41_readlink_batch()| - read the targets of |count| symlinks
+ * with as few compounds as possible
+ *
+ * Same scheme as |nfs41_getattr_batch()|: SEQUENCE, followed by one
+ * PUTFH+READLINK pair per symlink, resuming with the next symlink
+ * after the first failing operation.
+ * |links[i]| must have room for |max_len| bytes, |statuses[i]|
+ * receives the NFSv4 status for |files[i]|.
+ */
+#define READLINK_BATCH_MAX_FILES 32
+
+typedef struct __readlink_batch_compound {
+    nfs_argop4 argops[1+READLINK_BATCH_MAX_FILES*2];
+    nfs_resop4 resops[1+READLINK_BATCH_MAX_FILES*2];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args[READLINK_BATCH_MAX_FILES];
+    nfs41_putfh_res putfh_res[READLINK_BATCH_MAX_FILES];
+    nfs41_readlink_res readlink_res[READLINK_BATCH_MAX_FILES];
+} readlink_batch_compound;
+
+int nfs41_readlink_batch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN uint32_t max_len,
+    OUT char *const *links,
+    OUT uint32_t *link_lens,
+    OUT int *statuses)
+{
+    int status = NFS4_OK;
+    nfs41_compound compound;
+    readlink_batch_compound *rbc;
+    uint32_t max_files, chunk, done, i, failed;
+
+    rbc = nfsd_arena_alloc(sizeof(readlink_batch_compound));
+    if (rbc == NULL) {
+        status = NFS4ERR_SERVERFAULT;
+        for (i = 0 ; i < count ; i++)
+            statuses[i] = status;
+        goto out;
+    }
+
+    max_files = (session->fore_chan_attrs.ca_maxoperations - 1) / 2;
+    if (max_files > READLINK_BATCH_MAX_FILES)
+        max_files = READLINK_BATCH_MAX_FILES;
+    if (max_files == 0)
+        max_files = 1;
+
+    for (done = 0 ; done < count ; ) {
+        chunk = min(count - done, max_files);
+
+        compound_init(&compound, session->client->root->nfsminorvers,
+            rbc->argops, rbc->resops, "readlink_batch");
+
+        compound_add_op(&compound, OP_SEQUENCE,
+            &rbc->sequence_args, &rbc->sequence_res);
+        nfs41_session_sequence(&rbc->sequence_args, session, 0);
+
+        for (i = 0 ; i < chunk ; i++) {
+            compound_add_op(&compound, OP_PUTFH,
+                &rbc->putfh_args[i], &rbc->putfh_res[i]);
+            rbc->putfh_args[i].file = files[done+i];
+            rbc->putfh_args[i].in_recovery = 0;
+
+            compound_add_op(&compound, OP_READLINK,
+                NULL, &rbc->readlink_res[i]);
+            rbc->readlink_res[i].link_len = max_len - 1;
+            rbc->readlink_res[i].link = links[done+i];
+        }
+
+        status = compound_encode_send_decode(session, &compound, TRUE);
+        if (status) {
+            for (i = done ; i < count ; i++)
+                statuses[i] = status;
+            goto out_free;
+        }
+
+        status = compound.res.status;
+        if (compound_error(status)) {
+            if (compound.res.resarray_count <= 1) {
+                /* SEQUENCE failed, no symlink was processed */
+                for (i = done ; i < count ; i++)
+                    statuses[i] = status;
+                goto out_free;
+            }
+            failed = (compound.res.resarray_count - 2) / 2;
+        }
+        else {
+            failed = chunk;
+        }
+
+        for (i = 0 ; i < failed ; i++) {
+            links[done+i][rbc->readlink_res[i].link_len] = '\0';
+            link_lens[done+i] = rbc->readlink_res[i].link_len;
+            statuses[done+i] = NFS4_OK;
+        }
+        if (failed < chunk) {
+            statuses[done+failed] = status;
+            failed++;
+        }
+        done += failed;
+    }
+
+out_free:
+    nfsd_arena_free(rbc);
+out:
+    return status;
+}
+
 int nfs41_access(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -2050,6 +3047,69 @@ out:
     return status;
 }
 
+enum nfsstat4 nfs41_get_dir_delegation(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN const bitmap4 *notification_types,
+    OUT stateid4 *stateid,
+    OUT bitmap4 *notification,
+    OUT nfs41_file_info *info)
+{
+    enum nfsstat4 status;
+    nfs41_compound compound;
+    nfs_argop4 argops[4];
+    nfs_resop4 resops[4];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs41_get_dir_delegation_args gdd_args;
+    nfs41_get_dir_delegation_res gdd_res = { 0 };
+    nfs41_getattr_args getattr_args;
+    nfs41_getattr_res getattr_res NDSH(= { 0 });
+    bitmap4 attr_request;
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops, "get_dir_delegation");
+
+    compound_add_op(&compound, OP_SEQUENCE, &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = dir;
+    putfh_args.in_recovery = 0;
+
+    compound_add_op(&compound, OP_GET_DIR_DELEGATION, &gdd_args, &gdd_res);
+    (void)memset(&gdd_args, 0, sizeof(gdd_args));
+    gdd_args.signal_deleg_avail = FALSE;
+    bitmap4_cpy(&gdd_args.notification_types, notification_types);
+
+    /* attributes of the directory at the time of the grant */
+    nfs41_superblock_getattr_mask(dir->fh.superblock, &attr_request);
+    compound_add_op(&compound, OP_GETATTR, &getattr_args, &getattr_res);
+    getattr_args.attr_request = &attr_request;
+    getattr_res.obj_attributes.attr_vals_len = NFS4_OPAQUE_LIMIT_ATTR;
+    getattr_res.info = info;
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    if (compound_error(status = compound.res.status))
+        goto out;
+
+    if (gdd_res.gddrnf_status != GDD4_OK) {
+        status = NFS4ERR_DIRDELEG_UNAVAIL;
+        goto out;
+    }
+
+    (void)memcpy(stateid, &gdd_res.stateid, sizeof(stateid4));
+    bitmap4_cpy(notification, &gdd_res.notification);
+    bitmap4_cpy(&info->attrmask, &getattr_res.obj_attributes.attrmask);
+out:
+    return status;
+}
+
 enum nfsstat4 nfs41_test_stateid(
     IN nfs41_session *session,
     IN stateid_arg *stateid_array,
@@ -2090,6 +3150,7 @@ enum nfsstat4 pnfs_rpc_layoutget(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
     IN stateid_arg *stateid,
+    IN enum pnfs_layout_type type,
     IN enum pnfs_iomode iomode,
     IN uint64_t offset,
     IN uint64_t minlength,
@@ -2121,7 +3182,7 @@ enum nfsstat4 pnfs_rpc_layoutget(
 
     compound_add_op(&compound, OP_LAYOUTGET, &layoutget_args, &layoutget_res);
     layoutget_args.signal_layout_avail = 0;
-    layoutget_args.layout_type = PNFS_LAYOUTTYPE_FILE;
+    layoutget_args.layout_type = type;
     layoutget_args.iomode = iomode;
     layoutget_args.offset = offset;
     layoutget_args.minlength = minlength;
@@ -2146,6 +3207,13 @@ enum nfsstat4 pnfs_rpc_layoutget(
             for (i = 0; i < layout->filehandles.count; i++)
                 layout->filehandles.arr[i].fh.superblock = file->fh.superblock;
         }
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        else if (base->type == PNFS_LAYOUTTYPE_FLEXFILES) {
+            pnfs_file_layout *layout = (pnfs_file_layout*)base;
+            for (i = 0; i < layout->mirrors.count; i++)
+                layout->mirrors.arr[i].file.fh.superblock = file->fh.superblock;
+        }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
     }
 out:
     return status;
@@ -2155,6 +3223,7 @@ enum nfsstat4 pnfs_rpc_layoutcommit(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
     IN stateid4 *stateid,
+    IN enum pnfs_layout_type type,
     IN uint64_t offset,
     IN uint64_t length,
     IN OPTIONAL uint64_t *new_last_offset,
@@ -2175,7 +3244,8 @@ enum nfsstat4 pnfs_rpc_layoutcommit(
     nfs41_getattr_res getattr_res NDSH(= { 0 });
     bitmap4 attr_request;
 
-    nfs41_superblock_getattr_mask(file->fh.superblock, &attr_request);
+    nfs41_superblock_getattr_profile(file->fh.superblock,
+        NFS41_GETATTR_PROFILE_WRITE, &attr_request);
 
     compound_init(&compound, session->client->root->nfsminorvers,
         argops, resops, "layoutcommit");
@@ -2188,6 +3258,7 @@ enum nfsstat4 pnfs_rpc_layoutcommit(
     putfh_args.in_recovery = 0;
 
     compound_add_op(&compound, OP_LAYOUTCOMMIT, &lc_args, &lc_res);
+    lc_args.type = type;
     lc_args.offset = offset;
     lc_args.length = length;
     lc_args.stateid = stateid;
@@ -2264,6 +3335,7 @@ out:
 
 enum nfsstat4 pnfs_rpc_getdeviceinfo(
     IN nfs41_session *session,
+    IN enum pnfs_layout_type type,
     IN unsigned char *deviceid,
     OUT pnfs_file_device *device)
 {
@@ -2285,9 +3357,16 @@ enum nfsstat4 pnfs_rpc_getdeviceinfo(
     compound_add_op(&compound, OP_GETDEVICEINFO,
         &getdeviceinfo_args, &getdeviceinfo_res);
     getdeviceinfo_args.deviceid = deviceid;
-    getdeviceinfo_args.layout_type = PNFS_LAYOUTTYPE_FILE;
+    getdeviceinfo_args.layout_type = type;
     getdeviceinfo_args.maxcount = NFS41_MAX_SERVER_CACHE; /* XXX */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+    /* ask for CB_NOTIFY_DEVICEID, see pnfs_file_device_notify() */
+    getdeviceinfo_args.notify_types.count = 1;
+    getdeviceinfo_args.notify_types.arr[0] =
+        (1 << NOTIFY_DEVICEID4_CHANGE) | (1 << NOTIFY_DEVICEID4_DELETE);
+#else
     getdeviceinfo_args.notify_types.count = 0;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
     getdeviceinfo_res.u.res_ok.device = device;
 
     status = compound_encode_send_decode(session, &compound, TRUE);
@@ -2343,3 +3422,183 @@ enum nfsstat4 nfs41_rpc_openattr(
 out:
     return status;
 }
+
+#ifdef NFS41_DRIVER_DAEMON_EA_SET_BATCH
+/* estimated request size of RESTOREFH+OPEN+GETFH+WRITE+CLOSE */
+#define NAMED_ATTR_WRITE_OVERHEAD 512
+
+int nfs41_named_attrs_write(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN OUT nfs41_path_fh *attrdir,
+    IN state_owner4 *owner,
+    IN uint32_t count,
+    IN const nfs41_named_attr_write *writes,
+    OUT uint32_t *written)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[5+NFS41_NAMED_ATTRS_WRITE_MAX*5];
+    nfs_resop4 resops[5+NFS41_NAMED_ATTRS_WRITE_MAX*5];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs41_openattr_args openattr_args;
+    nfs41_openattr_res openattr_res;
+    nfs41_getfh_res getfh_res;
+    nfs41_savefh_res savefh_res;
+    nfs41_restorefh_res restorefh_res;
+    nfs41_file_info createattrs;
+    stateid_arg current_stateid;
+    struct {
+        uint32_t open_index;
+        open_claim4 claim;
+        nfs41_op_open_args open_args;
+        nfs41_op_open_res open_res;
+        stateid4 stateid;
+        open_delegation4 delegation;
+        nfs41_getfh_res getfh_res;
+        nfs41_path_fh file;
+        nfs41_write_args write_args;
+        nfs41_write_res write_res;
+        nfs41_write_verf verf;
+        nfs41_op_close_args close_args;
+        nfs41_op_close_res close_res;
+    } op[NFS41_NAMED_ATTRS_WRITE_MAX];
+    const bool_t create_attrdir = (attrdir->fh.len == 0);
+    const uint32_t max_ops = min(session->fore_chan_attrs.ca_maxoperations,
+        (uint32_t)ARRAYSIZE(argops));
+    uint32_t i, batch, request_size;
+
+    *written = 0;
+
+    /* as many as fit into |ca_maxoperations| and |ca_maxrequestsize| */
+    request_size = 1024;
+    for (batch = 0; batch < min(count, NFS41_NAMED_ATTRS_WRITE_MAX); batch++) {
+        request_size += NAMED_ATTR_WRITE_OVERHEAD +
+            writes[batch].name.len + writes[batch].value_len;
+        if ((batch > 0) &&
+            (((5 + (batch + 1) * 5) > max_ops) ||
+            (request_size > session->fore_chan_attrs.ca_maxrequestsize)))
+            break;
+    }
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops, "named_attrs_write");
+
+    compound_add_op(&compound, OP_SEQUENCE, &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 1);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = create_attrdir ? file : attrdir;
+    putfh_args.in_recovery = FALSE;
+
+    if (create_attrdir) {
+        compound_add_op(&compound, OP_OPENATTR,
+            &openattr_args, &openattr_res);
+        openattr_args.createdir = TRUE;
+
+        compound_add_op(&compound, OP_GETFH, NULL, &getfh_res);
+        getfh_res.fh = &attrdir->fh;
+    }
+
+    /* RESTOREFH returns to the named attribute directory */
+    compound_add_op(&compound, OP_SAVEFH, NULL, &savefh_res);
+
+    createattrs.attrmask.count = 2;
+    createattrs.attrmask.arr[0] = FATTR4_WORD0_SIZE;
+    createattrs.attrmask.arr[1] = FATTR4_WORD1_MODE;
+    createattrs.size = 0;
+    createattrs.mode = 0664;
+
+    /* the special "current stateid" refers to the OPEN's stateid */
+    current_stateid.stateid.seqid = 1;
+    (void)memset(current_stateid.stateid.other, 0, NFS4_STATEID_OTHER);
+    current_stateid.type = STATEID_SPECIAL;
+    current_stateid.open = NULL;
+    current_stateid.delegation = NULL;
+
+    for (i = 0; i < batch; i++) {
+        if (i > 0)
+            compound_add_op(&compound, OP_RESTOREFH, NULL, &restorefh_res);
+
+        op[i].open_index = compound.args.argarray_count;
+        compound_add_op(&compound, OP_OPEN,
+            &op[i].open_args, &op[i].open_res);
+        op[i].claim.claim = CLAIM_NULL;
+        op[i].claim.u.null.filename = &writes[i].name;
+        op[i].open_args.seqid = 0;
+        op[i].open_args.share_access = OPEN4_SHARE_ACCESS_WRITE |
+            OPEN4_SHARE_ACCESS_WANT_NO_DELEG;
+        op[i].open_args.share_deny = OPEN4_SHARE_DENY_BOTH;
+        op[i].open_args.owner = owner;
+        op[i].open_args.openhow.opentype = OPEN4_CREATE;
+        op[i].open_args.openhow.how.mode = UNCHECKED4;
+        op[i].open_args.openhow.how.createattrs = &createattrs;
+        op[i].open_args.claim = &op[i].claim;
+        op[i].open_res.resok4.stateid = &op[i].stateid;
+        op[i].open_res.resok4.delegation = &op[i].delegation;
+        op[i].delegation.type = OPEN_DELEGATE_NONE;
+
+        (void)memset(&op[i].file, 0, sizeof(op[i].file));
+        compound_add_op(&compound, OP_GETFH, NULL, &op[i].getfh_res);
+        op[i].getfh_res.fh = &op[i].file.fh;
+
+        compound_add_op(&compound, OP_WRITE,
+            &op[i].write_args, &op[i].write_res);
+        op[i].write_args.stateid = &current_stateid;
+        op[i].write_args.offset = 0;
+        op[i].write_args.stable = FILE_SYNC4;
+        op[i].write_args.data_len = writes[i].value_len;
+        op[i].write_args.data = writes[i].value;
+        op[i].write_res.resok4.verf = &op[i].verf;
+
+        compound_add_op(&compound, OP_CLOSE,
+            &op[i].close_args, &op[i].close_res);
+        op[i].close_args.stateid = &current_stateid;
+    }
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    if (create_attrdir &&
+        (compound.res.resarray_count >= 4) && (getfh_res.status == NFS4_OK))
+        attrdir->fh.superblock = file->fh.superblock;
+
+    status = compound.res.status;
+    for (i = 0; i < batch; i++) {
+        /* OPEN, GETFH, WRITE and CLOSE decoded */
+        if (compound.res.resarray_count >= (op[i].open_index + 4) &&
+            (op[i].close_res.status == NFS4_OK)) {
+            (*written)++;
+            continue;
+        }
+
+        /* the OPEN went through, but the WRITE or CLOSE did not */
+        if (compound.res.resarray_count >= (op[i].open_index + 2) &&
+            (op[i].open_res.status == NFS4_OK) &&
+            (op[i].getfh_res.status == NFS4_OK)) {
+            stateid_arg stateid;
+
+            eprintf("nfs41_named_attrs_write: "
+                "writing named attribute '%.*s' failed with '%s'\n",
+                (int)writes[i].name.len, writes[i].name.name,
+                nfs_error_string(status));
+            stateid.stateid = op[i].stateid;
+            stateid.type = STATEID_OPEN;
+            stateid.open = NULL;
+            stateid.delegation = NULL;
+            op[i].file.fh.superblock = file->fh.superblock;
+            (void)nfs41_close(session, &op[i].file, &stateid);
+        }
+        break;
+    }
+    if (status == NFS4_OK)
+        nfs41_superblock_space_changed(file->fh.superblock);
+    compound_error(status);
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_EA_SET_BATCH */
@@ -618,14 +618,18 @@ enum {
     OPEN4_SHARE_ACCESS_WANT_CANCEL          = 0x0500,
 
     OPEN4_SHARE_ACCESS_WANT_SIGNAL_DELEG_WHEN_RESRC_AVAIL = 0x10000,
-    OPEN4_SHARE_ACCESS_WANT_PUSH_DELEG_WHEN_UNCONTENDED = 0x20000
+    OPEN4_SHARE_ACCESS_WANT_PUSH_DELEG_WHEN_UNCONTENDED = 0x20000,
+    OPEN4_SHARE_ACCESS_WANT_DELEG_TIMESTAMPS = 0x100000 /* RFC 9754 */
 };
 
 enum open_delegation_type4 {
     OPEN_DELEGATE_NONE      = 0,
     OPEN_DELEGATE_READ      = 1,
     OPEN_DELEGATE_WRITE     = 2,
-    OPEN_DELEGATE_NONE_EXT  = 3
+    OPEN_DELEGATE_NONE_EXT  = 3,
+    /* RFC 9754 delegated timestamps */
+    OPEN_DELEGATE_READ_ATTRS_DELEG  = 4,
+    OPEN_DELEGATE_WRITE_ATTRS_DELEG = 5
 };
 
 enum open_claim_type4 {
@@ -729,6 +733,8 @@ typedef struct __nfs41_read_res_ok {
     bool_t                  eof;
     uint32_t                data_len;
     unsigned char           *data; /* caller-allocated */
+    /* payload already received into |data| by libtirpc */
+    bool_t                  data_placed;
 } nfs41_read_res_ok;
 
 typedef struct __nfs41_read_res {
@@ -791,6 +797,9 @@ typedef struct __nfs42_read_plus_res_ok {
      */
     unsigned char           *data; /* caller-allocated */
     uint32_t                data_len;
+    uint32_t                hole_len; /* bytes of |data| filled from holes */
+    /* first data segment already received into |data| by libtirpc */
+    bool_t                  data_placed;
 } nfs42_read_plus_res_ok;
 
 typedef struct __nfs42_read_plus_res {
@@ -810,6 +819,28 @@ typedef struct __nfs42_allocate_res {
     uint32_t    status;
 } nfs42_allocate_res;
 
+/* netloc4 */
+enum netloc_type4 {
+    NL4_NAME                = 1,
+    NL4_URL                 = 2,
+    NL4_NETADDR             = 3
+};
+
+#define NFS42_MAX_NETLOCS 4
+
+typedef struct __nfs42_netloc {
+    uint32_t        type; /* netloc_type4 */
+    union {
+        char        name[NFS4_OPAQUE_LIMIT+1]; /* NL4_NAME, NL4_URL */
+        netaddr4    addr; /* NL4_NETADDR */
+    } u;
+} nfs42_netloc;
+
+typedef struct __nfs42_netloc_list {
+    uint32_t        count;
+    nfs42_netloc    arr[NFS42_MAX_NETLOCS];
+} nfs42_netloc_list;
+
 /* OP_COPY */
 typedef struct __nfs42_copy_args {
     stateid_arg     *src_stateid;
@@ -819,9 +850,8 @@ typedef struct __nfs42_copy_args {
     uint64_t        count;
     bool_t          consecutive;
     bool_t          synchronous;
-/*
- *  netloc4 ca_source_server<>; not implemented yet
- */
+    /* ca_source_server<>, NULL for intra-server copies */
+    const nfs42_netloc_list *source_servers;
 } nfs42_copy_args;
 
 typedef struct __nfs42_write_response {
@@ -865,6 +895,44 @@ typedef struct __nfs42_deallocate_res {
     uint32_t    status;
 } nfs42_deallocate_res;
 
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+/* OP_COPY_NOTIFY */
+typedef struct __nfs42_copy_notify_args {
+    stateid_arg             *src_stateid;
+    const nfs42_netloc      *destination;
+} nfs42_copy_notify_args;
+
+typedef struct __nfs42_copy_notify_res {
+    uint32_t                status;
+    /* case NFS4_OK: */
+    nfstime4                lease_time;
+    stateid4                *stateid;
+    nfs42_netloc_list       *source_servers;
+} nfs42_copy_notify_res;
+
+/* OP_OFFLOAD_CANCEL */
+typedef struct __nfs42_offload_cancel_args {
+    stateid4        *stateid;
+} nfs42_offload_cancel_args;
+
+typedef struct __nfs42_offload_cancel_res {
+    uint32_t        status;
+} nfs42_offload_cancel_res;
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
+
+/* OP_OFFLOAD_STATUS */
+typedef struct __nfs42_offload_status_args {
+    stateid4        *stateid; /* -> nfs42_write_response.callback_id */
+} nfs42_offload_status_args;
+
+typedef struct __nfs42_offload_status_res {
+    uint32_t    status;
+    /* case NFS4_OK: */
+    uint64_t    count;
+    uint32_t    complete_count; /* zero while the copy is running */
+    uint32_t    complete_status;
+} nfs42_offload_status_res;
+
 /* OP_SEEK */
 typedef struct __nfs42_seek_args {
     stateid_arg     *stateid; /* -> nfs41_op_open_res_ok.stateid */
@@ -883,7 +951,45 @@ typedef struct __nfs42_seek_res {
     nfs42_seek_res_ok   resok4;
 } nfs42_seek_res;
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+/* OP_WRITE_SAME */
+typedef struct __nfs42_app_data_block {
+    uint64_t        offset;
+    uint64_t        block_size;
+    uint64_t        block_count;
+    uint64_t        reloff_blocknum;
+    uint32_t        block_num;
+    uint64_t        reloff_pattern;
+    uint32_t        pattern_len;
+    const unsigned char *pattern;
+} nfs42_app_data_block;
+
+typedef struct __nfs42_write_same_args {
+    stateid_arg             *stateid;
+    uint32_t                stable; /* stable_how4 */
+    nfs42_app_data_block    adb;
+} nfs42_write_same_args;
+
+typedef struct __nfs42_write_same_res {
+    uint32_t                status;
+    /* case NFS4_OK: */
+    nfs42_write_response    response;
+} nfs42_write_same_res;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
+
 /* OP_CLONE */
+/*
+ * Maximum number of CLONE ops in one compound, further limited by the
+ * session's |ca_maxoperations|
+ */
+#define NFS42_MAX_CLONES_PER_COMPOUND 16
+
+typedef struct __nfs42_clone_range {
+    uint64_t        src_offset;
+    uint64_t        dst_offset;
+    uint64_t        count;
+} nfs42_clone_range;
+
 typedef struct __nfs42_clone_args {
     stateid_arg     *src_stateid;
     stateid_arg     *dst_stateid;
@@ -896,6 +1002,57 @@ typedef struct __nfs42_clone_res {
     uint32_t        status;
 } nfs42_clone_res;
 
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+/* OP_LAYOUTERROR */
+typedef struct __nfs42_device_error {
+    unsigned char   *deviceid;
+    uint32_t        status; /* nfsstat4 */
+    uint32_t        opnum;
+} nfs42_device_error;
+
+typedef struct __nfs42_layouterror_args {
+    uint64_t            offset;
+    uint64_t            length;
+    stateid4            *stateid; /* layout stateid */
+    nfs42_device_error  error; /* we report one error at a time */
+} nfs42_layouterror_args;
+
+typedef struct __nfs42_layouterror_res {
+    uint32_t        status;
+} nfs42_layouterror_res;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+/* OP_LAYOUTSTATS */
+#define NFS42_LAYOUTSTATS_MAX_OPS 8 /* per compound */
+
+typedef struct __nfs42_io_info {
+    uint64_t        count;
+    uint64_t        bytes;
+} nfs42_io_info;
+
+typedef struct __nfs42_layoutstats_args {
+    uint64_t                offset;
+    uint64_t                length;
+    stateid4                *stateid; /* layout stateid */
+    nfs42_io_info           read;
+    nfs42_io_info           write;
+    unsigned char           *deviceid;
+    enum pnfs_layout_type   type;
+    /* for the ff_layoutupdate4 of flexfiles layouts */
+    const netaddr4          *ff_addr;
+    const nfs41_fh          *ff_fh;
+    uint64_t                ff_read_busy; /* microseconds */
+    uint64_t                ff_write_busy; /* microseconds */
+    uint64_t                ff_duration; /* microseconds */
+} nfs42_layoutstats_args;
+
+typedef struct __nfs42_layoutstats_res {
+    uint32_t        status;
+} nfs42_layoutstats_res;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
 /* OP_READDIR */
 typedef struct __nfs41_readdir_args {
     nfs41_readdir_cookie    cookie;
@@ -908,6 +1065,7 @@ typedef struct __nfs41_readdir_entry {
     uint64_t                cookie;
     uint32_t                name_len;
     uint32_t                next_entry_offset;
+    nfs41_fh                fh; /* if |FATTR4_WORD0_FILEHANDLE| was requested */
     nfs41_file_info         attr_info;
     char                    name[1];
 } nfs41_readdir_entry;
@@ -1013,6 +1171,44 @@ typedef struct __nfs41_free_stateid_res {
 } nfs41_free_stateid_res;
 
 
+/* OP_GET_DIR_DELEGATION */
+enum notify_type4 {
+    NOTIFY4_CHANGE_CHILD_ATTRS      = 0,
+    NOTIFY4_CHANGE_DIR_ATTRS        = 1,
+    NOTIFY4_REMOVE_ENTRY            = 2,
+    NOTIFY4_ADD_ENTRY               = 3,
+    NOTIFY4_RENAME_ENTRY            = 4,
+    NOTIFY4_CHANGE_COOKIE_VERIFIER  = 5
+};
+
+enum gddrnf4_status {
+    GDD4_OK                 = 0,
+    GDD4_UNAVAIL            = 1
+};
+
+typedef struct __nfs41_get_dir_delegation_args {
+    bool_t                  signal_deleg_avail;
+    bitmap4                 notification_types;
+    nfstime4                child_attr_delay;
+    nfstime4                dir_attr_delay;
+    bitmap4                 child_attributes;
+    bitmap4                 dir_attributes;
+} nfs41_get_dir_delegation_args;
+
+typedef struct __nfs41_get_dir_delegation_res {
+    uint32_t                status;
+    uint32_t                gddrnf_status; /* if |status == NFS4_OK| */
+    /* GDD4_OK */
+    unsigned char           cookieverf[NFS4_VERIFIER_SIZE];
+    stateid4                stateid;
+    bitmap4                 notification;
+    bitmap4                 child_attributes;
+    bitmap4                 dir_attributes;
+    /* GDD4_UNAVAIL */
+    bool_t                  will_signal_deleg_avail;
+} nfs41_get_dir_delegation_res;
+
+
 /* OP_TEST_STATEID */
 typedef struct __nfs41_test_stateid_args {
     uint32_t                count;
@@ -1127,6 +1323,7 @@ typedef struct __pnfs_layoutget_res {
 
 /* LAYOUTCOMMIT */
 typedef struct __pnfs_layoutcommit_args {
+    enum pnfs_layout_type   type;
     uint64_t                offset;
     uint64_t                length;
     stateid4                *stateid;
@@ -1230,6 +1427,31 @@ int nfs41_lookup(
     OUT OPTIONAL nfs41_file_info *info_out,
     OUT nfs41_session **session_out);
 
+/*
+ * LAYOUTGET sent in the same compound as OPEN, using the current
+ * stateid; |status| is the result of the LAYOUTGET, a failed LAYOUTGET
+ * does not fail the OPEN
+ */
+typedef struct __nfs41_open_layoutget {
+    enum pnfs_layout_type   type;
+    enum pnfs_iomode        iomode;
+    enum nfsstat4           status;
+    pnfs_layoutget_res_ok   res;
+} nfs41_open_layoutget;
+
+/*
+ * READ of the first |count| bytes sent in the same compound as OPEN,
+ * using the current stateid; |status| is the result of the READ, a
+ * failed READ does not fail the OPEN
+ */
+typedef struct __nfs41_open_read {
+    uint32_t                count;
+    unsigned char           *buffer; /* caller-allocated, |count| bytes */
+    enum nfsstat4           status;
+    uint32_t                len;
+    bool_t                  eof;
+} nfs41_open_read;
+
 int nfs41_open(
     IN nfs41_session *session,
     IN nfs41_path_fh *parent,
@@ -1241,10 +1463,13 @@ int nfs41_open(
     IN uint32_t create,
     IN uint32_t how_mode,
     IN OPTIONAL nfs41_file_info *createattrs,
+    IN OPTIONAL const bitmap4 *createsetattrs,
     IN bool_t try_recovery,
     OUT stateid4 *stateid,
     OUT open_delegation4 *delegation,
-    OUT OPTIONAL nfs41_file_info *info);
+    OUT OPTIONAL nfs41_file_info *info,
+    IN OUT OPTIONAL nfs41_open_layoutget *layoutget,
+    IN OUT OPTIONAL nfs41_open_read *openread);
 
 int nfs41_create(
     IN nfs41_session *session,
@@ -1260,6 +1485,15 @@ int nfs41_close(
     IN nfs41_path_fh *file,
     IN stateid_arg *stateid);
 
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+int nfs41_setattr_close(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid_arg *stateid,
+    IN nfs41_file_info *setattr_info,
+    OUT int *setattr_status);
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+
 int nfs41_write(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1272,6 +1506,27 @@ int nfs41_write(
     OUT nfs41_write_verf *verf,
     OUT nfs41_file_info *cinfo);
 
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+int nfs41_commit_batch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN const uint64_t *offsets,
+    IN const uint32_t *counts,
+    IN bool_t do_getattr,
+    OUT nfs41_write_verf *const *verfs,
+    OUT nfs41_file_info *const *infos OPTIONAL,
+    OUT int *statuses);
+
+int nfs41_commit_coalesced(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN uint64_t offset,
+    IN uint32_t count,
+    OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *cinfo);
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+
 int nfs41_read(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1290,6 +1545,7 @@ int nfs42_read_plus(
     IN uint32_t count,
     OUT unsigned char *data_out,
     OUT uint32_t *data_len_out,
+    OUT OPTIONAL uint32_t *hole_len_out,
     OUT bool_t *eof_out);
 
 int nfs42_allocate(
@@ -1306,13 +1562,39 @@ int nfs42_copy(
     IN nfs41_path_fh *dst_file,
     IN stateid_arg *src_stateid,
     IN stateid_arg *dst_stateid,
+    IN OPTIONAL const nfs42_netloc_list *source_servers,
     IN uint64_t src_offset,
     IN uint64_t dst_offset,
     IN uint64_t length,
+    IN bool_t synchronous,
     OUT uint64_t *bytes_written,
     OUT nfs41_write_verf *writeverf,
+    OUT OPTIONAL stateid4 *callback_id,
     OUT nfs41_file_info *cinfo);
 
+int nfs42_offload_status(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid4 *stateid,
+    OUT uint64_t *count,
+    OUT bool_t *complete,
+    OUT uint32_t *complete_status);
+
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+int nfs42_copy_notify(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *src_file,
+    IN stateid_arg *src_stateid,
+    IN const nfs42_netloc *destination,
+    OUT stateid4 *copy_stateid,
+    OUT nfs42_netloc_list *source_servers);
+
+int nfs42_offload_cancel(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid4 *stateid);
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
+
 int nfs42_deallocate(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1341,6 +1623,61 @@ int nfs42_clone(
     IN uint64_t length,
     OUT nfs41_file_info *cinfo);
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+/*
+ * write |block_count| blocks of |block_size| bytes from |offset|, each
+ * filled with |pattern|. Like |nfs42_copy()| a non-zero |callback_id|
+ * means the server continues in the background
+ */
+int nfs42_write_same(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid_arg *stateid,
+    IN uint64_t offset,
+    IN uint64_t block_size,
+    IN uint64_t block_count,
+    IN const unsigned char *pattern,
+    IN uint32_t pattern_len,
+    IN enum stable_how4 stable,
+    OUT uint64_t *bytes_written,
+    OUT nfs41_write_verf *verf,
+    OUT OPTIONAL stateid4 *callback_id,
+    OUT nfs41_file_info *cinfo);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
+
+/* send up to |NFS42_MAX_CLONES_PER_COMPOUND| CLONEs in one compound */
+int nfs42_clone_ranges(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *src_file,
+    IN nfs41_path_fh *dst_file,
+    IN stateid_arg *src_stateid,
+    IN stateid_arg *dst_stateid,
+    IN const nfs42_clone_range *ranges,
+    IN uint32_t count,
+    OUT nfs41_file_info *cinfo);
+
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+int nfs42_layouterror(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid4 *layout_stateid,
+    IN uint64_t offset,
+    IN uint64_t length,
+    IN unsigned char *deviceid,
+    IN uint32_t nfsstat,
+    IN uint32_t opnum);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+/* sends one LAYOUTSTATS per entry of |stats| in one compound */
+int nfs42_layoutstats(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN nfs42_layoutstats_args *stats,
+    IN uint32_t count);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
 int nfs41_commit(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1368,6 +1705,22 @@ int nfs41_unlock(
     IN uint64_t length,
     IN OUT stateid_arg *stateid);
 
+#ifdef NFS41_DRIVER_DAEMON_BATCHED_LOCKU
+#define NFS41_UNLOCK_BATCH_MAX 32
+
+typedef struct __nfs41_unlock_range {
+    uint64_t offset;
+    uint64_t length;
+} nfs41_unlock_range;
+
+int nfs41_unlock_batch(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN const nfs41_unlock_range *ranges,
+    IN uint32_t count,
+    IN OUT stateid_arg *stateid);
+#endif /* NFS41_DRIVER_DAEMON_BATCHED_LOCKU */
+
 stateid4* nfs41_lock_stateid_copy(
     IN nfs41_lock_state *lock_state,
     IN OUT stateid4 *dest);
@@ -1387,6 +1740,22 @@ int nfs41_getattr(
     IN bitmap4 *attr_request,
     OUT nfs41_file_info *info);
 
+int nfs41_getattr_batch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN bitmap4 *attr_request,
+    OUT nfs41_file_info *infos,
+    OUT int *statuses);
+
+#ifdef NFS41_DRIVER_DAEMON_GETATTR_COALESCING
+int nfs41_getattr_coalesced(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN bitmap4 *attr_request,
+    OUT nfs41_file_info *info);
+#endif /* NFS41_DRIVER_DAEMON_GETATTR_COALESCING */
+
 int nfs41_superblock_getattr(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1439,6 +1808,14 @@ int nfs41_symlink_follow(
     IN nfs41_path_fh *symlink,
     OUT nfs41_file_info *info);
 
+#ifdef NFS41_DRIVER_DAEMON_SYMLINK_CACHE
+void nfs41_symlink_cache_prefetch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN const uint64_t *changes);
+#endif /* NFS41_DRIVER_DAEMON_SYMLINK_CACHE */
+
 int nfs41_readlink(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1446,6 +1823,15 @@ int nfs41_readlink(
     OUT char *link_out,
     OUT uint32_t *len_out);
 
+int nfs41_readlink_batch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN uint32_t max_len,
+    OUT char *const *links,
+    OUT uint32_t *link_lens,
+    OUT int *statuses);
+
 int nfs41_access(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1491,6 +1877,14 @@ enum nfsstat4 nfs41_free_stateid(
     IN nfs41_session *session,
     IN stateid4 *stateid);
 
+enum nfsstat4 nfs41_get_dir_delegation(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN const bitmap4 *notification_types,
+    OUT stateid4 *stateid,
+    OUT bitmap4 *notification,
+    OUT nfs41_file_info *info);
+
 enum nfsstat4 nfs41_test_stateid(
     IN nfs41_session *session,
     IN stateid_arg *stateid_array,
@@ -1501,6 +1895,7 @@ enum nfsstat4 pnfs_rpc_layoutget(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
     IN stateid_arg *stateid,
+    IN enum pnfs_layout_type type,
     IN enum pnfs_iomode iomode,
     IN uint64_t offset,
     IN uint64_t minlength,
@@ -1511,6 +1906,7 @@ enum nfsstat4 pnfs_rpc_layoutcommit(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
     IN stateid4 *stateid,
+    IN enum pnfs_layout_type type,
     IN uint64_t offset,
     IN uint64_t length,
     IN OPTIONAL uint64_t *new_last_offset,
@@ -1529,6 +1925,7 @@ enum nfsstat4 pnfs_rpc_layoutreturn(
 
 enum nfsstat4 pnfs_rpc_getdeviceinfo(
     IN nfs41_session *session,
+    IN enum pnfs_layout_type type,
     IN unsigned char *deviceid,
     OUT pnfs_file_device *device);
 
@@ -1538,4 +1935,32 @@ enum nfsstat4 nfs41_rpc_openattr(
     IN bool_t createdir,
     OUT nfs41_fh *fh_out);
 
+#ifdef NFS41_DRIVER_DAEMON_EA_SET_BATCH
+/*
+ * |nfs41_named_attrs_write()| - create or truncate the named
+ * attributes |writes[0..count-1]| of |file| and write their values,
+ * with RESTOREFH+OPEN+GETFH+WRITE+CLOSE for each in one compound.
+ * The named attribute directory is created with OPENATTR in the same
+ * compound if |attrdir->fh.len| is zero, and returned in |attrdir|.
+ * |*written| is the number of named attributes done, which is less than
+ * |count| if they do not fit into one compound or after an error
+ */
+#define NFS41_NAMED_ATTRS_WRITE_MAX 16
+
+typedef struct __nfs41_named_attr_write {
+    nfs41_component         name;
+    unsigned char           *value;
+    uint32_t                value_len;
+} nfs41_named_attr_write;
+
+int nfs41_named_attrs_write(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN OUT nfs41_path_fh *attrdir,
+    IN state_owner4 *owner,
+    IN uint32_t count,
+    IN const nfs41_named_attr_write *writes,
+    OUT uint32_t *written);
+#endif /* NFS41_DRIVER_DAEMON_EA_SET_BATCH */
+
 #endif /* !__NFS41_NFS_OPS_H__ */
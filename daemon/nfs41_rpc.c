@@ -21,8 +21,12 @@
  * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
  */
 
+#include <time.h>
+#include <process.h>
 #include "accesstoken.h"
+#include "nfs41_daemon.h"
 #include "nfs41_ops.h"
+#include "nfs41_compound.h"
 #include "daemon_debug.h"
 #include "nfs41_xdr.h"
 #include "nfs41_callback.h"
@@ -43,17 +47,41 @@ static enum clnt_stat send_null(CLIENT *client)
                      (xdrproc_t)xdr_void, NULL, timeout);
 }
 
+static void sockopts_to_clnt(
+    IN const nfs41_sockopts *sockopts,
+    OUT struct clnt_sockopts *clnt_sockopts)
+{
+    if (sockopts->sockbuf == NFS41_MOUNT_SOCKBUF_DEFAULT)
+        clnt_sockopts->sockbuf = CLNT_SOCKBUF_DEFAULT;
+    else
+        clnt_sockopts->sockbuf = sockopts->sockbuf * 1024;
+    clnt_sockopts->keepalive = sockopts->keepalive * 1000;
+    clnt_sockopts->flags = 0;
+    if (sockopts->flags & NFS41_MOUNT_SOCKOPT_NODELAY)
+        clnt_sockopts->flags |= CLNT_SOCKOPT_NODELAY;
+    if (sockopts->flags & NFS41_MOUNT_SOCKOPT_LOOPBACK_FASTPATH)
+        clnt_sockopts->flags |= CLNT_SOCKOPT_LOOPBACK_FASTPATH;
+    if (sockopts->flags & NFS41_MOUNT_SOCKOPT_RSS_AFFINITY) {
+        clnt_sockopts->flags |= CLNT_SOCKOPT_RSS_AFFINITY;
+#ifdef NFS41_DRIVER_NUMA_BUFFER_POOLS
+        clnt_sockopts->flags |= CLNT_SOCKOPT_RSS_NUMA_NODE;
+#endif /* NFS41_DRIVER_NUMA_BUFFER_POOLS */
+    }
+}
+
 static int get_client_for_netaddr(
     IN const netaddr4 *netaddr,
     IN uint32_t wsize,
     IN uint32_t rsize,
     IN nfs41_rpc_clnt *rpc,
+    IN OPTIONAL const nfs41_sockopts *sockopts,
     OUT OPTIONAL char *server_name,
     OUT CLIENT **client_out)
 {
     int status = ERROR_NETWORK_UNREACHABLE;
     struct netconfig *nconf;
     struct netbuf *addr;
+    struct clnt_sockopts clnt_sockopts;
     CLIENT *client;
 
     nconf = getnetconfigent(netaddr->netid);
@@ -69,9 +97,15 @@ static int get_client_for_netaddr(
         DPRINTF(1, ("servername is '%s'\n", server_name));
     }
     DPRINTF(1, ("callback function 0x%p args 0x%p\n", nfs41_handle_callback, rpc));
+    if (sockopts) {
+        sockopts_to_clnt(sockopts, &clnt_sockopts);
+        clnt_set_sockopts(&clnt_sockopts);
+    }
     client = clnt_tli_create(RPC_ANYFD, nconf, addr, NFS41_RPC_PROGRAM,
         NFS41_RPC_VERSION, wsize, rsize, rpc ? (int (*)(void*, void*))proc_cb_compound_res : NULL,
         rpc ? nfs41_handle_callback : NULL, rpc ? rpc : NULL);
+    if (sockopts)
+        clnt_set_sockopts(NULL);
     if (client) {
         *client_out = client;
         status = NO_ERROR;
@@ -84,20 +118,224 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+/*
+ * Fast failover across the addresses of a |multi_addr4|:
+ * - |get_client_for_multi_addr()| connects to all addresses in
+ * parallel, each attempt |RPC_CONNECT_STAGGER_MSECS| after the one
+ * before it ("happy eyeballs"), so the preferred address still wins
+ * if it answers quickly, but an unreachable address no longer costs a
+ * full TCP connect timeout. Attempts which finish after the winner
+ * destroy their connection.
+ * - |rpc_health_thread()| probes each |nfs41_rpc_clnt| with more than
+ * one address every |RPC_HEALTH_INTERVAL_MSECS| with a NULL call with
+ * a |RPC_PROBE_TIMEOUT_SECS| timeout, and keeps |rpc->standby|
+ * connected to another address. After |RPC_HEALTH_MAX_FAILURES|
+ * failed probes it aborts the calls waiting on the dead connection
+ * (which then retransmit) and |rpc_reconnect()| switches to the
+ * standby connection.
+ */
+#define RPC_CONNECT_STAGGER_MSECS   250
+#define RPC_PROBE_TIMEOUT_SECS      5
+#define RPC_HEALTH_INTERVAL_MSECS   10000
+#define RPC_HEALTH_MAX_FAILURES     2
+
+static enum clnt_stat send_null_probe(CLIENT *client)
+{
+    struct timeval timeout = {RPC_PROBE_TIMEOUT_SECS, 0};
+
+    return clnt_call(client, 0,
+                     (xdrproc_t)xdr_void, NULL,
+                     (xdrproc_t)xdr_void, NULL, timeout);
+}
+
+typedef struct __rpc_connect_race {
+    volatile LONG refs;
+    volatile LONG next; /* index of the next address to try */
+    SRWLOCK lock;
+    HANDLE done_event; /* set by the winner, or when all attempts failed */
+    multi_addr4 addrs;
+    uint32_t wsize;
+    uint32_t rsize;
+    nfs41_rpc_clnt *rpc;
+    nfs41_sockopts sockopts;
+    bool_t has_sockopts;
+    uint32_t pending;
+    bool_t decided;
+    CLIENT *client;
+    uint32_t addr_index;
+    char server_name[NI_MAXHOST];
+} rpc_connect_race;
+
+static void rpc_connect_race_release(
+    IN rpc_connect_race *race)
+{
+    if (InterlockedDecrement(&race->refs) != 0)
+        return;
+
+    if (race->rpc)
+        (void)InterlockedDecrement(&race->rpc->connect_races);
+    (void)CloseHandle(race->done_event);
+    free(race);
+}
+
+static unsigned int WINAPI rpc_connect_thread(void *args)
+{
+    rpc_connect_race *race = (rpc_connect_race *)args;
+    CLIENT *client = NULL;
+    char server_name[NI_MAXHOST];
+    uint32_t i;
+    int status;
+
+    i = (uint32_t)InterlockedIncrement(&race->next) - 1;
+
+    /* give the addresses before us a head start */
+    if ((i > 0) && (WaitForSingleObjectEx(race->done_event,
+        i * RPC_CONNECT_STAGGER_MSECS, FALSE) == WAIT_OBJECT_0))
+        goto out;
+
+    server_name[0] = '\0';
+    status = get_client_for_netaddr(&race->addrs.arr[i],
+        race->wsize, race->rsize, race->rpc,
+        race->has_sockopts?&race->sockopts:NULL, server_name, &client);
+    if (status)
+        goto out;
+    if (send_null_probe(client) != RPC_SUCCESS) {
+        DPRINTF(1, ("rpc_connect_thread: address %d ('%s') "
+            "does not answer\n", (int)i, race->addrs.arr[i].uaddr));
+        clnt_destroy(client);
+        client = NULL;
+    }
+
+out:
+    AcquireSRWLockExclusive(&race->lock);
+    race->pending--;
+    if (client && !race->decided) {
+        race->decided = TRUE;
+        race->client = client;
+        race->addr_index = i;
+        (void)memcpy(race->server_name, server_name, NI_MAXHOST);
+        client = NULL;
+        (void)SetEvent(race->done_event);
+    } else if ((race->pending == 0) && !race->decided) {
+        race->decided = TRUE;
+        (void)SetEvent(race->done_event);
+    }
+    ReleaseSRWLockExclusive(&race->lock);
+
+    /* we lost, the winner's connection is used */
+    if (client)
+        clnt_destroy(client);
+
+    rpc_connect_race_release(race);
+    return 0;
+}
+
+static void rpc_wait_connect_races(
+    IN nfs41_rpc_clnt *rpc)
+{
+    /*
+     * The connections of attempts which are still running use |rpc|
+     * as callback argument
+     */
+    while (rpc->connect_races > 0)
+        Sleep(50);
+}
+
+static void rpc_health_register(
+    IN nfs41_rpc_clnt *rpc);
+static void rpc_health_unregister(
+    IN nfs41_rpc_clnt *rpc);
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
+
 static int get_client_for_multi_addr(
     IN const multi_addr4 *addrs,
     IN uint32_t wsize,
     IN uint32_t rsize,
     IN nfs41_rpc_clnt *rpc,
+    IN OPTIONAL const nfs41_sockopts *sockopts,
     OUT OPTIONAL char *server_name,
     OUT CLIENT **client_out,
     OUT uint32_t *addr_index)
 {
     int status = ERROR_NETWORK_UNREACHABLE;
     uint32_t i;
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+    rpc_connect_race *race;
+    HANDLE thread;
+
+    if (addrs->count < 2)
+        goto serial;
+
+    race = calloc(1, sizeof(rpc_connect_race));
+    if (race == NULL)
+        goto serial;
+    race->done_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (race->done_event == NULL) {
+        free(race);
+        goto serial;
+    }
+    InitializeSRWLock(&race->lock);
+    (void)memcpy(&race->addrs, addrs, sizeof(multi_addr4));
+    race->wsize = wsize;
+    race->rsize = rsize;
+    race->rpc = rpc;
+    if (sockopts) {
+        race->sockopts = *sockopts;
+        race->has_sockopts = TRUE;
+    }
+    race->refs = 1;
+    race->pending = addrs->count;
+    if (rpc)
+        (void)InterlockedIncrement(&rpc->connect_races);
+
+    for (i = 0; i < addrs->count; i++) {
+        (void)InterlockedIncrement(&race->refs);
+        thread = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
+            rpc_connect_thread, race, 0, NULL);
+        if (thread == NULL) {
+            eprintf("get_client_for_multi_addr: "
+                "_beginthreadex() failed %d\n", (int)GetLastError());
+            (void)InterlockedDecrement(&race->refs);
+            break;
+        }
+        (void)CloseHandle(thread);
+    }
+
+    if (i < addrs->count) {
+        /* the addresses without a thread count as failed */
+        AcquireSRWLockExclusive(&race->lock);
+        race->pending -= addrs->count - i;
+        if ((race->pending == 0) && !race->decided) {
+            race->decided = TRUE;
+            (void)SetEvent(race->done_event);
+        }
+        ReleaseSRWLockExclusive(&race->lock);
+    }
+
+    (void)WaitForSingleObjectEx(race->done_event, INFINITE, FALSE);
+
+    AcquireSRWLockShared(&race->lock);
+    if (race->client) {
+        *client_out = race->client;
+        *addr_index = race->addr_index;
+        if (server_name)
+            (void)memcpy(server_name, race->server_name, NI_MAXHOST);
+        status = NO_ERROR;
+        DPRINTF(1, ("get_client_for_multi_addr: connected to "
+            "address %d ('%s')\n",
+            (int)race->addr_index, addrs->arr[race->addr_index].uaddr));
+    }
+    ReleaseSRWLockShared(&race->lock);
+
+    rpc_connect_race_release(race);
+    return status;
+
+serial:
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
     for (i = 0; i < addrs->count; i++) {
         status = get_client_for_netaddr(&addrs->arr[i],
-            wsize, rsize, rpc, server_name, client_out);
+            wsize, rsize, rpc, sockopts, server_name, client_out);
         if (status == NO_ERROR) {
             *addr_index = i;
             break;
@@ -107,48 +345,642 @@ static int get_client_for_multi_addr(
 }
 
 static
-int create_rpcsec_auth_client(
+AUTH *create_rpcsec_auth(
     IN uint32_t sec_flavor,
     IN char *server_name,
-    CLIENT	*client
-    )
-{
-    int status = ERROR_NETWORK_UNREACHABLE;
-
-    switch (sec_flavor) {
-    case RPCSEC_AUTHGSS_KRB5:
-        client->cl_auth = authsspi_create_default(client, server_name, 
-            RPCSEC_SSPI_SVC_NONE);
-        break;
-    case RPCSEC_AUTHGSS_KRB5I:
-        client->cl_auth = authsspi_create_default(client, server_name, 
-            RPCSEC_SSPI_SVC_INTEGRITY);
-        break;
-    case RPCSEC_AUTHGSS_KRB5P:
-        client->cl_auth = authsspi_create_default(client, server_name, 
+    CLIENT *client)
+{
+    AUTH *auth;
+
+    switch (sec_flavor) {
+    case RPCSEC_AUTHGSS_KRB5:
+        auth = authsspi_create_default(client, server_name,
+            RPCSEC_SSPI_SVC_NONE);
+        break;
+    case RPCSEC_AUTHGSS_KRB5I:
+        auth = authsspi_create_default(client, server_name,
+            RPCSEC_SSPI_SVC_INTEGRITY);
+        break;
+    case RPCSEC_AUTHGSS_KRB5P:
+        auth = authsspi_create_default(client, server_name,
             RPCSEC_SSPI_SVC_PRIVACY);
         break;
     default:
-        eprintf("create_rpcsec_auth_client: unknown rpcsec flavor %d\n",
+        eprintf("create_rpcsec_auth: unknown rpcsec flavor %d\n",
             sec_flavor);
-        client->cl_auth = NULL;
+        auth = NULL;
     }
 
-    if (client->cl_auth == NULL) {
-        eprintf("create_rpcsec_auth_client: failed to create '%s'\n",
+    if (auth == NULL) {
+        eprintf("create_rpcsec_auth: failed to create '%s'\n",
             secflavorop2name(sec_flavor));
-        goto out;
     } else {
         DPRINTF(1,
-            ("create_rpcsec_auth_client: successfully created '%s'\n",
+            ("create_rpcsec_auth: successfully created '%s'\n",
             secflavorop2name(sec_flavor)));
     }
-    status = 0;
+    return auth;
+}
+
+static
+int create_rpcsec_auth_client(
+    IN uint32_t sec_flavor,
+    IN char *server_name,
+    CLIENT	*client
+    )
+{
+    client->cl_auth = create_rpcsec_auth(sec_flavor, server_name, client);
+    if (client->cl_auth == NULL)
+        return ERROR_NETWORK_UNREACHABLE;
+    return 0;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+/*
+ * Per-user RPCSEC_GSS context pool
+ *
+ * |rpc->rpc->cl_auth| carries the credentials of the user who mounted
+ * the filesystem. For krb5/krb5i/krb5p mounts we additionally keep one
+ * RPCSEC_GSS context per logon session (|TokenStatistics.AuthenticationId|
+ * of the impersonation token of the calling thread), so that on
+ * terminal servers each user talks to the server with their own
+ * Kerberos credentials. |nfs41_send_compound()| picks the context per
+ * compound and passes it to libtirpc with |clnt_set_call_auth()|.
+ * Threads without impersonation token (renew, recovery, delegation
+ * return, ...) use |rpc->rpc->cl_auth| as before.
+ *
+ * Contexts are reference counted: Establishing a new context (after
+ * |RPC_AUTHERROR|, or |GSS_CTX_REFRESH_MARGIN| before the old one
+ * expires) happens without holding |gss_pool_lock|, by one thread of
+ * that user only, and the other threads continue to use the old
+ * context until the new one replaces it. If a user has no usable
+ * Kerberos credentials we fall back to |rpc->rpc->cl_auth| and only
+ * try again after |GSS_CTX_RETRY_INTERVAL|.
+ */
+/* in 100ns units, like |FILETIME| */
+#define GSS_CTX_REFRESH_MARGIN  (5ULL * 60ULL * 10000000ULL)
+#define GSS_CTX_RETRY_INTERVAL  (60ULL * 10000000ULL)
+
+typedef struct __nfs41_gss_ctx {
+    LUID logon_id;
+    uint32_t sec_flavor;
+    AUTH *auth; /* |NULL| if establishing the context failed */
+    volatile LONG refs;
+    volatile LONG refreshing;
+    volatile LONG stale;
+    ULONGLONG expiry; /* local time */
+    ULONGLONG retry_time; /* local time */
+    volatile LONG64 last_used;
+#ifdef NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW
+    /* see "GSS sequence window" */
+    volatile LONG inflight;
+    LONG max_inflight;
+    struct __nfs41_gss_ctx *volatile spill;
+    /* only used in the pool entry, the head of the chain */
+    volatile LONG spilling;
+    volatile LONG64 spill_retry_time; /* local time */
+#endif /* NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW */
+} nfs41_gss_ctx;
+
+static bool_t gss_ctx_flavor(
+    IN uint32_t sec_flavor)
+{
+    return (sec_flavor == RPCSEC_AUTHGSS_KRB5) ||
+        (sec_flavor == RPCSEC_AUTHGSS_KRB5I) ||
+        (sec_flavor == RPCSEC_AUTHGSS_KRB5P);
+}
+
+static ULONGLONG gss_ctx_now(void)
+{
+    FILETIME ft, lft;
+
+    /* |InitializeSecurityContext()| returns the expiry in local time */
+    GetSystemTimeAsFileTime(&ft);
+    (void)FileTimeToLocalFileTime(&ft, &lft);
+    return ((ULONGLONG)lft.dwHighDateTime << 32) | lft.dwLowDateTime;
+}
+
+static bool_t gss_ctx_current_logon(
+    OUT LUID *logon_id)
+{
+    HANDLE tok;
+    TOKEN_STATISTICS tstats;
+    DWORD len;
+    bool_t ok;
+
+    if (!OpenThreadToken(GetCurrentThread(), TOKEN_QUERY, TRUE, &tok))
+        return FALSE;
+    ok = GetTokenInformation(tok, TokenStatistics, &tstats,
+        sizeof(tstats), &len);
+    if (ok)
+        *logon_id = tstats.AuthenticationId;
+    (void)CloseHandle(tok);
+    return ok;
+}
+
+static void gss_ctx_release(
+    IN nfs41_gss_ctx *ctx)
+{
+    if (InterlockedDecrement(&ctx->refs) == 0) {
+#ifdef NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW
+        if (ctx->spill)
+            gss_ctx_release(ctx->spill);
+#endif /* NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW */
+        if (ctx->auth)
+            auth_destroy(ctx->auth);
+        free(ctx);
+    }
+}
+
+/* Must be called with |rpc->lock| held, |client| is |rpc->rpc| */
+static nfs41_gss_ctx *gss_ctx_create(
+    IN nfs41_rpc_clnt *rpc,
+    IN CLIENT *client,
+    IN const LUID *logon_id,
+    IN ULONGLONG now)
+{
+    nfs41_gss_ctx *ctx;
+    TimeStamp expiry;
+
+    ctx = calloc(1, sizeof(nfs41_gss_ctx));
+    if (ctx == NULL)
+        return NULL;
+    ctx->logon_id = *logon_id;
+    ctx->sec_flavor = rpc->sec_flavor;
+    ctx->refs = 1; /* reference of |rpc->gss_pool| */
+    ctx->last_used = (LONG64)now;
+
+    /*
+     * We are impersonating the user, so |AcquireCredentialsHandleA()|
+     * picks up the Kerberos credentials of their logon session
+     */
+    ctx->auth = create_rpcsec_auth(rpc->sec_flavor, rpc->server_name,
+        client);
+    if (ctx->auth &&
+        authsspi_get_expiry(ctx->auth, &expiry)) {
+        ctx->expiry = ((ULONGLONG)expiry.HighPart << 32) |
+            (ULONGLONG)expiry.LowPart;
+    }
+    else {
+        /* Do not try again for every compound */
+        ctx->expiry = now + GSS_CTX_REFRESH_MARGIN + GSS_CTX_RETRY_INTERVAL;
+    }
+    ctx->retry_time = now + GSS_CTX_RETRY_INTERVAL;
+#ifdef NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW
+    ctx->max_inflight = ctx->auth?
+        (LONG)(authsspi_get_window(ctx->auth) / 2) : 0;
+#endif /* NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW */
+
+    DPRINTF(1, ("gss_ctx_create: logon_id=0x%lx.%lx auth=0x%p\n",
+        (long)logon_id->HighPart, (long)logon_id->LowPart,
+        (void *)ctx->auth));
+    return ctx;
+}
+
+/* Insert |ctx| into |rpc->gss_pool|, returns the replaced context */
+static nfs41_gss_ctx *gss_pool_insert(
+    IN nfs41_rpc_clnt *rpc,
+    IN nfs41_gss_ctx *ctx)
+{
+    nfs41_gss_ctx *old;
+    int i, slot = -1;
+
+    for (i = 0; i < NFS41_GSS_CTX_POOL_SIZE; i++) {
+        if (rpc->gss_pool[i] == NULL) {
+            if (slot == -1)
+                slot = i;
+            continue;
+        }
+        if ((rpc->gss_pool[i]->logon_id.LowPart == ctx->logon_id.LowPart) &&
+            (rpc->gss_pool[i]->logon_id.HighPart == ctx->logon_id.HighPart)) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1) {
+        /* Pool full: evict the least recently used context */
+        slot = 0;
+        for (i = 1; i < NFS41_GSS_CTX_POOL_SIZE; i++) {
+            if (rpc->gss_pool[i]->last_used <
+                rpc->gss_pool[slot]->last_used)
+                slot = i;
+        }
+    }
+    old = rpc->gss_pool[slot];
+    rpc->gss_pool[slot] = ctx;
+    return old;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW
+/*
+ * GSS sequence window
+ *
+ * The server drops calls whose RPCSEC_GSS sequence number is more
+ * than its sequence window (|authsspi_get_window()|) behind the
+ * highest one it has seen. Calls of one context can overtake each
+ * other (trunked connections, slots), so we keep at most half a
+ * window of calls in flight per context. When a user has more
+ * concurrent calls, |gss_ctx_pick()| spreads them over up to
+ * |GSS_CTX_MAX_SPILL| additional contexts of that user, chained from
+ * |spill| of the pool entry. The chain is dropped together with the
+ * pool entry when it is re-established.
+ * Establishing a context is a synchronous round trip to the KDC and
+ * the server, so only one thread per chain does it at a time, and
+ * after a failure not again before |GSS_CTX_SPILL_RETRY_INTERVAL|.
+ * Meanwhile the other calls go to the least loaded context of the
+ * chain.
+ */
+#define GSS_CTX_MAX_SPILL 4
+/* in 100ns units, like |FILETIME| */
+#define GSS_CTX_SPILL_RETRY_INTERVAL (10ULL * 10000000ULL)
+
+/* Returns TRUE if the caller got a call slot in |ctx| */
+static bool_t gss_ctx_try_enter(
+    IN nfs41_gss_ctx *ctx)
+{
+    if ((ctx->auth == NULL) || ctx->stale)
+        return FALSE;
+    if (ctx->max_inflight == 0) {
+        /* unknown window, do not limit */
+        (void)InterlockedIncrement(&ctx->inflight);
+        return TRUE;
+    }
+    if (InterlockedIncrement(&ctx->inflight) <= ctx->max_inflight)
+        return TRUE;
+    (void)InterlockedDecrement(&ctx->inflight);
+    return FALSE;
+}
+
+/*
+ * Pick the context of |head|'s chain for the next call, takes a
+ * reference and a call slot, which the caller gives back with
+ * |gss_ctx_exit()|. Falls back to the least loaded context of the
+ * chain (over the limit) if no more contexts can be established right
+ * now
+ */
+static nfs41_gss_ctx *gss_ctx_pick(
+    IN nfs41_rpc_clnt *rpc,
+    IN nfs41_gss_ctx *head)
+{
+    nfs41_gss_ctx *c, *last = NULL, *least = head, *nctx;
+    ULONGLONG now;
+    int n = 0;
+
+    for (c = head; c; c = c->spill) {
+        if (gss_ctx_try_enter(c))
+            goto found;
+        if (c->auth && !c->stale &&
+            ((least->auth == NULL) || least->stale ||
+                (c->inflight < least->inflight)))
+            least = c;
+        last = c;
+        n++;
+    }
+
+    now = gss_ctx_now();
+    if ((n <= GSS_CTX_MAX_SPILL) &&
+        (now >= (ULONGLONG)head->spill_retry_time) &&
+        (InterlockedCompareExchange(&head->spilling, 1, 0) == 0)) {
+        nctx = gss_ctx_create(rpc, rpc->rpc, &head->logon_id, now);
+        if (nctx && nctx->auth &&
+            (InterlockedCompareExchangePointer(
+                (PVOID volatile *)&last->spill, nctx, NULL) == NULL)) {
+            DPRINTF(1, ("gss_ctx_pick: logon_id=0x%lx.%lx: added "
+                "context #%d, max_inflight=%ld\n",
+                (long)head->logon_id.HighPart,
+                (long)head->logon_id.LowPart, n, (long)nctx->max_inflight));
+            (void)InterlockedExchange(&head->spilling, 0);
+            c = nctx;
+            (void)InterlockedIncrement(&c->inflight);
+            goto found;
+        }
+        if ((nctx == NULL) || (nctx->auth == NULL)) {
+            /* do not stall every call of this user on the KDC */
+            (void)InterlockedExchange64(&head->spill_retry_time,
+                (LONG64)(gss_ctx_now() + GSS_CTX_SPILL_RETRY_INTERVAL));
+        }
+        (void)InterlockedExchange(&head->spilling, 0);
+        if (nctx)
+            gss_ctx_release(nctx);
+    }
+
+    c = least;
+    (void)InterlockedIncrement(&c->inflight);
+found:
+    (void)InterlockedIncrement(&c->refs);
+    return c;
+}
+
+static void gss_ctx_exit(
+    IN nfs41_gss_ctx *ctx)
+{
+    (void)InterlockedDecrement(&ctx->inflight);
+}
+#endif /* NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW */
+
+/*
+ * Returns the |AUTH| of the calling user for the next compound, or
+ * |NULL| to use |rpc->rpc->cl_auth|. If |*ctx_out| is not |NULL| the
+ * caller must pass it to |gss_ctx_release()| after the call.
+ * Must be called with |rpc->lock| held shared.
+ */
+static AUTH *gss_ctx_get(
+    IN nfs41_rpc_clnt *rpc,
+    OUT nfs41_gss_ctx **ctx_out)
+{
+    nfs41_gss_ctx *ctx = NULL, *nctx, *old;
+    LUID logon_id;
+    ULONGLONG now;
+    bool_t refresh = FALSE;
+    int i;
+
+    *ctx_out = NULL;
+    if (!gss_ctx_flavor(rpc->sec_flavor))
+        return NULL;
+    if (!gss_ctx_current_logon(&logon_id))
+        return NULL;
+    now = gss_ctx_now();
+
+    AcquireSRWLockShared(&rpc->gss_pool_lock);
+    for (i = 0; i < NFS41_GSS_CTX_POOL_SIZE; i++) {
+        nfs41_gss_ctx *c = rpc->gss_pool[i];
+
+        if (c && (c->logon_id.LowPart == logon_id.LowPart) &&
+            (c->logon_id.HighPart == logon_id.HighPart)) {
+            ctx = c;
+            (void)InterlockedIncrement(&ctx->refs);
+            (void)InterlockedExchange64(&ctx->last_used, (LONG64)now);
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&rpc->gss_pool_lock);
+
+    if (ctx) {
+        if (ctx->stale || (ctx->sec_flavor != rpc->sec_flavor))
+            refresh = TRUE;
+        else if ((now + GSS_CTX_REFRESH_MARGIN) >= ctx->expiry)
+            refresh = (now >= ctx->retry_time);
+        /* Only one thread per user re-establishes the context */
+        if (refresh &&
+            (InterlockedCompareExchange(&ctx->refreshing, 1, 0) != 0))
+            refresh = FALSE;
+        if (!refresh)
+            goto out;
+    }
+
+    nctx = gss_ctx_create(rpc, rpc->rpc, &logon_id, now);
+    if (nctx == NULL)
+        goto out;
+
+    if (ctx && (nctx->auth == NULL) && (ctx->auth != NULL) &&
+        (!ctx->stale) && (now < ctx->expiry)) {
+        /* Keep using the old context while it is valid */
+        ctx->retry_time = now + GSS_CTX_RETRY_INTERVAL;
+        (void)InterlockedExchange(&ctx->refreshing, 0);
+        gss_ctx_release(nctx);
+        goto out;
+    }
+
+    (void)InterlockedIncrement(&nctx->refs); /* reference of the caller */
+    AcquireSRWLockExclusive(&rpc->gss_pool_lock);
+    old = gss_pool_insert(rpc, nctx);
+    ReleaseSRWLockExclusive(&rpc->gss_pool_lock);
+    if (old)
+        gss_ctx_release(old);
+    if (ctx)
+        gss_ctx_release(ctx);
+    ctx = nctx;
 out:
-    return status;
+    if (ctx && (ctx->auth == NULL)) {
+        gss_ctx_release(ctx);
+        ctx = NULL;
+    }
+#ifdef NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW
+    if (ctx) {
+        nctx = gss_ctx_pick(rpc, ctx);
+        gss_ctx_release(ctx);
+        ctx = nctx;
+    }
+#endif /* NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW */
+    *ctx_out = ctx;
+    return ctx?ctx->auth:NULL;
 }
 
+/* The server rejected |ctx|, the next compound of that user replaces it */
+static void gss_ctx_invalidate(
+    IN nfs41_gss_ctx *ctx)
+{
+    (void)InterlockedExchange(&ctx->stale, 1);
+}
+
+/*
+ * Point all contexts to a new connection, must be called with
+ * |rpc->lock| held exclusive (so no context is in use)
+ */
+static void gss_pool_set_clnt(
+    IN nfs41_rpc_clnt *rpc,
+    IN CLIENT *client)
+{
+    nfs41_gss_ctx *c;
+    int i;
+
+    for (i = 0; i < NFS41_GSS_CTX_POOL_SIZE; i++) {
+#ifdef NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW
+        for (c = rpc->gss_pool[i]; c; c = c->spill) {
+#else
+        if ((c = rpc->gss_pool[i]) != NULL) {
+#endif /* NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW */
+            if (c->auth)
+                authsspi_set_clnt(c->auth, client);
+        }
+    }
+}
+
+static void gss_pool_free(
+    IN nfs41_rpc_clnt *rpc)
+{
+    int i;
+
+    for (i = 0; i < NFS41_GSS_CTX_POOL_SIZE; i++) {
+        if (rpc->gss_pool[i]) {
+            gss_ctx_release(rpc->gss_pool[i]);
+            rpc->gss_pool[i] = NULL;
+        }
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
+
 /* Returns a client structure and an associated lock */
+/*
+ * XDR encodes the AUTH_SYS credential for |uid|/|gid| and the groups
+ * of |tok| into |cred|
+ */
+static bool_t authsys_encode_cred(
+    IN HANDLE tok,
+    IN uint32_t uid,
+    IN uint32_t gid,
+    OUT char *cred,
+    OUT u_int *cred_len)
+{
+    struct authunix_parms aup;
+    char machname[MAXHOSTNAMELEN + 1];
+    gid_t aup_gids[RPC_AUTHUNIX_AUP_MAX_NUM_GIDS];
+    int num_aup_gids = 0;
+    bool truncated = false;
+    XDR xdrs;
+    bool_t status;
+
+    /* fixme: This should be a function argument */
+    extern nfs41_daemon_globals nfs41_dg;
+
+    if (gethostname(machname, sizeof(machname)) == -1) {
+        eprintf("authsys_encode_cred: gethostname failed\n");
+        return FALSE;
+    }
+    machname[sizeof(machname) - 1] = '\0';
+
+    if (nfs41_dg.authsys_gids_mode != AUTHSYS_GIDS_SERVER) {
+        if (!fill_auth_unix_aup_gids(tok,
+            aup_gids, &num_aup_gids, &truncated)) {
+            eprintf("authsys_encode_cred: "
+                "fill_auth_unix_aup_gids() failed\n");
+            return FALSE;
+        }
+        if (truncated) {
+            if (nfs41_dg.authsys_gids_mode == AUTHSYS_GIDS_AUTO) {
+                DPRINTF(1, ("authsys_encode_cred: token has more "
+                    "than %d groups, leaving group lookup to the "
+                    "server\n", RPC_AUTHUNIX_AUP_MAX_NUM_GIDS));
+                num_aup_gids = 0;
+            }
+            else {
+                DPRINTF(0, ("authsys_encode_cred: token has more "
+                    "than %d groups, only sending the first %d "
+                    "(see nfsd --authsysgids)\n",
+                    RPC_AUTHUNIX_AUP_MAX_NUM_GIDS,
+                    RPC_AUTHUNIX_AUP_MAX_NUM_GIDS));
+            }
+        }
+    }
+
+    aup.aup_time = (u_long)time(NULL);
+    aup.aup_machname = machname;
+    aup.aup_uid = uid;
+    aup.aup_gid = gid;
+    aup.aup_len = (u_int)num_aup_gids;
+    aup.aup_gids = aup_gids;
+
+    xdrmem_create(&xdrs, cred, MAX_AUTH_BYTES, XDR_ENCODE);
+    status = xdr_authunix_parms(&xdrs, &aup);
+    if (status)
+        *cred_len = XDR_GETPOS(&xdrs);
+    else
+        eprintf("authsys_encode_cred: xdr_authunix_parms() failed\n");
+    XDR_DESTROY(&xdrs);
+    return status;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_AUTHSYS_CRED_CACHE
+/*
+ * AUTH_SYS credential cache
+ *
+ * Keeps the XDR encoded AUTH_SYS credential per token (see
+ * |get_token_cache_key()|) and uid/gid, so creating an AUTH_SYS
+ * handle after a SECINFO or a reconnect is a copy of the cached
+ * credential instead of looking up the token groups, the idmapper
+ * and the host name again.
+ */
+#define AUTHSYS_CRED_CACHE_SIZE 64 /* must be a power of 2 */
+#define AUTHSYS_CRED_CACHE_TTL 60
+
+typedef struct _authsys_cred_entry {
+    token_cache_key key;
+    util_reltimestamp timestamp;
+    uint32_t uid;
+    uint32_t gid;
+    u_int cred_len; /* 0 if unused */
+    char cred[MAX_AUTH_BYTES];
+} authsys_cred_entry;
+
+static struct {
+    SRWLOCK lock;
+    authsys_cred_entry entries[AUTHSYS_CRED_CACHE_SIZE];
+} authsys_cred_cache = { .lock = SRWLOCK_INIT };
+
+static __inline authsys_cred_entry *authsys_cred_slot(
+    IN const token_cache_key *key,
+    IN uint32_t uid)
+{
+    return &authsys_cred_cache.entries[
+        (key->authenticationid.LowPart ^
+            (DWORD)key->authenticationid.HighPart ^ uid) &
+        (AUTHSYS_CRED_CACHE_SIZE - 1)];
+}
+
+static __inline bool_t authsys_cred_match(
+    IN const authsys_cred_entry *e,
+    IN const token_cache_key *key,
+    IN uint32_t uid,
+    IN uint32_t gid)
+{
+    return (e->cred_len != 0) &&
+        (e->uid == uid) && (e->gid == gid) &&
+        (memcmp(&e->key, key, sizeof(token_cache_key)) == 0) &&
+        ((UTIL_GETRELTIME() - e->timestamp) < AUTHSYS_CRED_CACHE_TTL);
+}
+#endif /* NFS41_DRIVER_DAEMON_AUTHSYS_CRED_CACHE */
+
+/*
+ * Creates an AUTH_SYS handle for |uid|/|gid| and the groups of the
+ * calling thread's token
+ */
+AUTH *nfs41_authsys_create(
+    IN uint32_t uid,
+    IN uint32_t gid)
+{
+    HANDLE tok = GetCurrentThreadToken();
+    char cred[MAX_AUTH_BYTES];
+    u_int cred_len = 0;
+    AUTH *auth = NULL;
+#ifdef NFS41_DRIVER_DAEMON_AUTHSYS_CRED_CACHE
+    token_cache_key key;
+    bool have_key;
+    authsys_cred_entry *e;
+
+    have_key = get_token_cache_key(tok, &key);
+    if (have_key) {
+        AcquireSRWLockShared(&authsys_cred_cache.lock);
+        e = authsys_cred_slot(&key, uid);
+        if (authsys_cred_match(e, &key, uid, gid))
+            auth = authunix_create_marshalled(e->cred, e->cred_len);
+        ReleaseSRWLockShared(&authsys_cred_cache.lock);
+        if (auth)
+            goto out;
+    }
+#endif /* NFS41_DRIVER_DAEMON_AUTHSYS_CRED_CACHE */
+
+    if (!authsys_encode_cred(tok, uid, gid, cred, &cred_len))
+        goto out;
+
+#ifdef NFS41_DRIVER_DAEMON_AUTHSYS_CRED_CACHE
+    if (have_key) {
+        AcquireSRWLockExclusive(&authsys_cred_cache.lock);
+        e = authsys_cred_slot(&key, uid);
+        e->key = key;
+        e->timestamp = UTIL_GETRELTIME();
+        e->uid = uid;
+        e->gid = gid;
+        (void)memcpy(e->cred, cred, cred_len);
+        e->cred_len = cred_len;
+        ReleaseSRWLockExclusive(&authsys_cred_cache.lock);
+    }
+#endif /* NFS41_DRIVER_DAEMON_AUTHSYS_CRED_CACHE */
+
+    auth = authunix_create_marshalled(cred, cred_len);
+out:
+    return auth;
+}
+
 int nfs41_rpc_clnt_create(
     IN const multi_addr4 *addrs,
     IN uint32_t wsize,
@@ -156,13 +988,13 @@ int nfs41_rpc_clnt_create(
     IN uint32_t uid,
     IN uint32_t gid,
     IN uint32_t sec_flavor,
+    IN const nfs41_sockopts *sockopts,
     OUT nfs41_rpc_clnt **rpc_out)
 {
     CLIENT *client;
     nfs41_rpc_clnt *rpc;
     uint32_t addr_index;
     int status;
-    char machname[MAXHOSTNAMELEN + 1];
     bool_t needcb = 1;
 
     rpc = calloc(1, sizeof(nfs41_rpc_clnt));
@@ -170,10 +1002,17 @@ int nfs41_rpc_clnt_create(
         status = GetLastError();
         goto out;
     }
-#ifdef NO_CB_4_KRB5P
-    if (sec_flavor == RPCSEC_AUTHGSS_KRB5P)
-        needcb = 0;
-#endif
+    /*
+     * The back channel uses AUTH_NONE/AUTH_SYS (see
+     * |nfs41_create_session()|), so we can have callbacks (and thus
+     * delegations and layout recalls) with all security flavors.
+     * libtirpc's receive thread (|clnt_vc_recv_thread()|, or
+     * |clnt_cb_thread()| without |TIRPC_CLNT_VC_MULTIPLEX|) only
+     * dispatches the callbacks (to |TIRPC_CLNT_VC_CB_WORKERS| worker
+     * threads, so |nfs41_handle_callback()| can run concurrently for
+     * different backchannel slots) and hands RPCSEC_GSS replies to the
+     * thread which sent the call, which unwraps them.
+     */
     rpc->needcb = needcb;
     rpc->cond = CreateEvent(NULL, TRUE, FALSE, NULL);
     if (rpc->cond == NULL) {
@@ -182,8 +1021,15 @@ int nfs41_rpc_clnt_create(
             status);
         goto out_free_rpc_clnt;
     }
+    if (sockopts) {
+        rpc->sockopts = *sockopts;
+    } else {
+        rpc->sockopts.sockbuf = NFS41_MOUNT_SOCKBUF_DEFAULT;
+        rpc->sockopts.keepalive = 0;
+        rpc->sockopts.flags = NFS41_MOUNT_SOCKOPT_NODELAY;
+    }
     status = get_client_for_multi_addr(addrs, wsize, rsize, needcb?rpc:NULL,
-                rpc->server_name, &client, &addr_index);
+                &rpc->sockopts, rpc->server_name, &client, &addr_index);
     if (status) {
         clnt_pcreateerror("connecting failed");
         goto out_free_rpc_cond;
@@ -206,26 +1052,7 @@ int nfs41_rpc_clnt_create(
         }
     }
     else if (sec_flavor == RPCSEC_AUTH_SYS) {
-        gid_t aup_gids[RPC_AUTHUNIX_AUP_MAX_NUM_GIDS];
-        int num_aup_gids = 0;
-
-        if (gethostname(machname, sizeof(machname)) == -1) {
-            eprintf("nfs41_rpc_clnt_create: gethostname failed\n");
-            goto out_err_client;
-        }
-        machname[sizeof(machname) - 1] = '\0';
-
-        if (!fill_auth_unix_aup_gids(GetCurrentThreadToken(),
-            aup_gids, &num_aup_gids)) {
-            eprintf("nfs41_rpc_clnt_create: "
-                "fill_auth_unix_aup_gids() failed\n");
-            status = ERROR_NETWORK_UNREACHABLE;
-            goto out_err_client;
-        }
-
-        client->cl_auth = authsys_create(machname,
-            uid, gid,
-            num_aup_gids, aup_gids);
+        client->cl_auth = nfs41_authsys_create(uid, gid);
         if (client->cl_auth == NULL) {
             eprintf("nfs41_rpc_clnt_create: "
                 "failed to create rpc authsys\n");
@@ -263,6 +1090,16 @@ int nfs41_rpc_clnt_create(
 
     //initialize rpc client lock
     InitializeSRWLock(&rpc->lock);
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+    InitializeSRWLock(&rpc->gss_pool_lock);
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+    InitializeSRWLock(&rpc->rtt_lock);
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+    if (addrs->count > 1)
+        rpc_health_register(rpc);
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
 
     *rpc_out = rpc;
 out:
@@ -270,16 +1107,385 @@ out:
 out_err_client:
     clnt_destroy(client);
 out_free_rpc_cond:
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+    rpc_wait_connect_races(rpc);
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
     CloseHandle(rpc->cond);
 out_free_rpc_clnt:
     free(rpc);
     goto out;
 }
 
+/*
+ * Connection trunking ("nconnect" mount option):
+ * Extra connections to the same server address (with
+ * |NFS41_DRIVER_DAEMON_SESSION_TRUNKING| also to the other addresses
+ * of the same server) are bound to the
+ * session with BIND_CONN_TO_SESSION(CDFC4_FORE), and compounds which
+ * start with |OP_SEQUENCE| are spread round-robin over them and
+ * |rpc->rpc|. Everything else (EXCHANGE_ID, CREATE_SESSION, binding
+ * the backchannel, ...) always goes over |rpc->rpc|, which is also the
+ * only connection with a callback thread.
+ *
+ * The extra connections share the |AUTH| handle of |rpc->rpc|, so this
+ * is limited to the stateless AUTH_NONE/AUTH_SYS flavors.
+ */
+static int rpc_bind_trunk_conn(
+    IN nfs41_rpc_clnt *rpc,
+    IN CLIENT *client,
+    IN const unsigned char *sessionid)
+{
+    struct timeval timeout = {90, 100};
+    nfs41_compound compound;
+    nfs_argop4 argop;
+    nfs_resop4 resop;
+    nfs41_bind_conn_to_session_args bind_args = { 0 };
+    nfs41_bind_conn_to_session_res bind_res = { 0 };
+    enum clnt_stat rpc_status;
+    int status;
+
+    compound_init(&compound, rpc->client->root->nfsminorvers,
+        &argop, &resop, "bind_conn_to_session");
+
+    compound_add_op(&compound, OP_BIND_CONN_TO_SESSION, &bind_args, &bind_res);
+    bind_args.sessionid = (unsigned char *)sessionid;
+    bind_args.dir = CDFC4_FORE;
+
+    /* must go over |client| itself, not through |nfs41_send_compound()| */
+    rpc_status = clnt_call(client, 1,
+        (xdrproc_t)nfs_encode_compound, (char *)&compound.args,
+        (xdrproc_t)nfs_decode_compound, (char *)&compound.res,
+        timeout);
+    if (rpc_status != RPC_SUCCESS) {
+        eprintf("rpc_bind_trunk_conn: clnt_call returned rpc_status='%s'\n",
+            rpc_error_string(rpc_status));
+        status = NFS4ERR_IO;
+        goto out;
+    }
+
+    status = compound.res.status;
+out:
+    return status;
+}
+
+/* Returns |FALSE| if |client| was not added, caller must destroy it */
+static bool_t rpc_add_trunk_conn(
+    IN nfs41_rpc_clnt *rpc,
+    IN CLIENT *client)
+{
+    bool_t added = FALSE;
+
+    AcquireSRWLockExclusive(&rpc->lock);
+    if (rpc->trunk_count < ARRAYSIZE(rpc->trunk)) {
+        rpc->trunk[rpc->trunk_count++] = client;
+        added = TRUE;
+    }
+    ReleaseSRWLockExclusive(&rpc->lock);
+    return added;
+}
+
+static void rpc_remove_trunk_conn(
+    IN nfs41_rpc_clnt *rpc,
+    IN CLIENT *client)
+{
+    bool_t found = FALSE;
+    uint32_t i;
+
+    /*
+     * Waits for all callers of |nfs41_send_compound()| which may
+     * still use |client|
+     */
+    AcquireSRWLockExclusive(&rpc->lock);
+    for (i = 0; i < rpc->trunk_count; i++) {
+        if (rpc->trunk[i] == client) {
+            rpc->trunk[i] = rpc->trunk[--rpc->trunk_count];
+            rpc->trunk[rpc->trunk_count] = NULL;
+            found = TRUE;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&rpc->lock);
+
+    if (found) {
+        DPRINTF(1, ("rpc_remove_trunk_conn: removed connection 0x%p, "
+            "%d left\n", client, (int)rpc->trunk_count));
+        /* |cl_auth| is owned by |rpc->rpc| */
+        clnt_destroy(client);
+    }
+}
+
+#ifdef NFS41_DRIVER_DAEMON_SESSION_TRUNKING
+/*
+ * Session trunking: Check with an EXCHANGE_ID over |client| (which is
+ * connected to another address of the server) that it reaches the
+ * same server (same server_owner major and minor id, same scope) and
+ * the same client ID, so it can be bound to our session
+ */
+static int rpc_trunk_conn_check_owner(
+    IN nfs41_rpc_clnt *rpc,
+    IN CLIENT *client)
+{
+    struct timeval timeout = {90, 100};
+    nfs41_compound compound;
+    nfs_argop4 argop;
+    nfs_resop4 resop;
+    nfs41_exchange_id_args ex_id = { 0 };
+    nfs41_exchange_id_res ex_res = { 0 };
+    nfs41_client *nfs_client = rpc->client;
+    enum clnt_stat rpc_status;
+    int status;
+
+    compound_init(&compound, nfs_client->root->nfsminorvers,
+        &argop, &resop, "exchange_id");
+
+    compound_add_op(&compound, OP_EXCHANGE_ID, &ex_id, &ex_res);
+    ex_id.eia_clientowner = &nfs_client->owner;
+    ex_id.eia_flags = nfs41_exchange_id_flags(nfs_client->is_data);
+    ex_id.eia_state_protect.spa_how = SP4_NONE;
+    ex_id.eia_client_impl_id = NULL;
+
+    ex_res.server_owner.so_major_id_len = NFS4_OPAQUE_LIMIT;
+    ex_res.server_scope_len = NFS4_OPAQUE_LIMIT;
+
+    /* must go over |client| itself, not through |nfs41_send_compound()| */
+    rpc_status = clnt_call(client, 1,
+        (xdrproc_t)nfs_encode_compound, (char *)&compound.args,
+        (xdrproc_t)nfs_decode_compound, (char *)&compound.res,
+        timeout);
+    if (rpc_status != RPC_SUCCESS) {
+        eprintf("rpc_trunk_conn_check_owner: "
+            "clnt_call returned rpc_status='%s'\n",
+            rpc_error_string(rpc_status));
+        status = NFS4ERR_IO;
+        goto out;
+    }
+
+    status = compound.res.status;
+    if (status)
+        goto out;
+
+    AcquireSRWLockShared(&nfs_client->exid_lock);
+    if ((ex_res.clientid != nfs_client->clnt_id) ||
+        (ex_res.server_owner.so_minor_id != nfs_client->server_minor_id) ||
+        (strncmp(ex_res.server_owner.so_major_id,
+            nfs_client->server->owner, NFS4_OPAQUE_LIMIT) != 0) ||
+        (strncmp(ex_res.server_scope,
+            nfs_client->server->scope, NFS4_OPAQUE_LIMIT) != 0))
+        status = NFS4ERR_INVAL;
+    ReleaseSRWLockShared(&nfs_client->exid_lock);
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_SESSION_TRUNKING */
+
+/* Connect to |netaddr|, bind the connection to the session and add it */
+static int rpc_open_trunk_conn(
+    IN nfs41_rpc_clnt *rpc,
+    IN const netaddr4 *netaddr,
+    IN const unsigned char *sessionid,
+    IN bool_t check_owner)
+{
+    CLIENT *client;
+    int status;
+
+    /* no callback args, the backchannel stays on |rpc->rpc| */
+    status = get_client_for_netaddr(netaddr,
+        rpc->wsize, rpc->rsize, NULL, &rpc->sockopts, NULL, &client);
+    if (status) {
+        eprintf("rpc_open_trunk_conn: '%s': "
+            "get_client_for_netaddr() failed with %d\n",
+            netaddr->uaddr, status);
+        goto out;
+    }
+
+    AcquireSRWLockShared(&rpc->lock);
+    client->cl_auth = rpc->rpc->cl_auth;
+    ReleaseSRWLockShared(&rpc->lock);
+
+#ifdef NFS41_DRIVER_DAEMON_SESSION_TRUNKING
+    if (check_owner) {
+        status = rpc_trunk_conn_check_owner(rpc, client);
+        if (status) {
+            DPRINTF(1, ("rpc_open_trunk_conn: '%s' is not trunkable "
+                "with our session ('%s')\n",
+                netaddr->uaddr, nfs_error_string(status)));
+            goto out_err_client;
+        }
+    }
+#else
+    (void)check_owner;
+#endif /* NFS41_DRIVER_DAEMON_SESSION_TRUNKING */
+
+    status = rpc_bind_trunk_conn(rpc, client, sessionid);
+    if (status) {
+        eprintf("rpc_open_trunk_conn: '%s': "
+            "BIND_CONN_TO_SESSION failed with '%s'\n",
+            netaddr->uaddr, nfs_error_string(status));
+        goto out_err_client;
+    }
+
+    if (!rpc_add_trunk_conn(rpc, client)) {
+        status = ERROR_TOO_MANY_LINKS;
+        goto out_err_client;
+    }
+out:
+    return status;
+out_err_client:
+    clnt_destroy(client);
+    goto out;
+}
+
+int nfs41_rpc_clnt_add_trunk_conns(
+    IN nfs41_rpc_clnt *rpc,
+    IN const unsigned char *sessionid,
+    IN uint32_t count)
+{
+    uint32_t i;
+    int status = NO_ERROR;
+#ifdef NFS41_DRIVER_DAEMON_SESSION_TRUNKING
+    uint32_t addrs[NFS41_ADDRS_PER_SERVER];
+    uint32_t num_addrs = 0, a;
+#endif /* NFS41_DRIVER_DAEMON_SESSION_TRUNKING */
+
+    if ((rpc->sec_flavor != RPCSEC_AUTH_NONE) &&
+        (rpc->sec_flavor != RPCSEC_AUTH_SYS)) {
+        eprintf("nfs41_rpc_clnt_add_trunk_conns: "
+            "nconnect not supported for '%s', "
+            "using a single connection\n",
+            secflavorop2name(rpc->sec_flavor));
+        goto out;
+    }
+
+    i = 0;
+#ifdef NFS41_DRIVER_DAEMON_SESSION_TRUNKING
+    /*
+     * Open one connection to each other address of the server which
+     * turns out to be trunkable, and then spread the remaining
+     * connections round-robin across these addresses and the address
+     * of |rpc->rpc|
+     */
+    addrs[num_addrs++] = rpc->addr_index;
+    for (a = 0; a < rpc->addrs.count; a++) {
+        if ((a == rpc->addr_index) ||
+            (rpc->trunk_count >= ARRAYSIZE(rpc->trunk)))
+            continue;
+        if (rpc_open_trunk_conn(rpc, &rpc->addrs.arr[a],
+            sessionid, TRUE) == NO_ERROR) {
+            addrs[num_addrs++] = a;
+            i++;
+        }
+    }
+    if (num_addrs > 1) {
+        DPRINTF(1, ("nfs41_rpc_clnt_add_trunk_conns: "
+            "session trunking over %d addresses\n", (int)num_addrs));
+    }
+#endif /* NFS41_DRIVER_DAEMON_SESSION_TRUNKING */
+
+    for (; i < count; i++) {
+#ifdef NFS41_DRIVER_DAEMON_SESSION_TRUNKING
+        status = rpc_open_trunk_conn(rpc,
+            &rpc->addrs.arr[addrs[(i + 1) % num_addrs]], sessionid, FALSE);
+#else
+        status = rpc_open_trunk_conn(rpc, nfs41_rpc_netaddr(rpc),
+            sessionid, FALSE);
+#endif /* NFS41_DRIVER_DAEMON_SESSION_TRUNKING */
+        if (status) {
+            eprintf("nfs41_rpc_clnt_add_trunk_conns: "
+                "connection %d failed with %d\n",
+                (int)i, status);
+            break;
+        }
+    }
+
+    DPRINTF(1, ("nfs41_rpc_clnt_add_trunk_conns: "
+        "using %d connection(s)\n", (int)(rpc->trunk_count + 1)));
+out:
+    return status;
+}
+
+void nfs41_rpc_clnt_rebind_trunk_conns(
+    IN nfs41_rpc_clnt *rpc,
+    IN const unsigned char *sessionid)
+{
+    CLIENT *trunk[ARRAYSIZE(rpc->trunk)];
+    uint32_t i, count;
+    int status;
+
+    /*
+     * Take all trunked connections out of the rotation first, so
+     * nobody uses them while they are not bound to the new session
+     */
+    AcquireSRWLockExclusive(&rpc->lock);
+    count = rpc->trunk_count;
+    (void)memcpy(trunk, rpc->trunk, count * sizeof(CLIENT *));
+    (void)memset(rpc->trunk, 0, sizeof(rpc->trunk));
+    rpc->trunk_count = 0;
+    ReleaseSRWLockExclusive(&rpc->lock);
+
+    for (i = 0; i < count; i++) {
+        status = rpc_bind_trunk_conn(rpc, trunk[i], sessionid);
+        if (status) {
+            eprintf("nfs41_rpc_clnt_rebind_trunk_conns: "
+                "BIND_CONN_TO_SESSION failed with '%s', "
+                "dropping connection 0x%p\n",
+                nfs_error_string(status), trunk[i]);
+            clnt_destroy(trunk[i]);
+            continue;
+        }
+        if (!rpc_add_trunk_conn(rpc, trunk[i]))
+            clnt_destroy(trunk[i]);
+    }
+}
+
+/*
+ * Pick the connection for the next compound, must be called with
+ * |rpc->lock| held
+ */
+static CLIENT *rpc_select_conn(
+    IN nfs41_rpc_clnt *rpc,
+    IN const nfs41_compound_args *args)
+{
+    CLIENT *client = rpc->rpc;
+    ULONG idx;
+
+    if ((rpc->trunk_count == 0) ||
+        (args->argarray_count == 0) ||
+        (args->argarray[0].op != OP_SEQUENCE))
+        goto out;
+
+    idx = (ULONG)InterlockedIncrement(&rpc->trunk_next) %
+        (rpc->trunk_count + 1);
+    /* |idx == 0| selects |rpc->rpc| */
+    if (idx == 0)
+        goto out;
+
+    /*
+     * Only use it if it still shares the |AUTH| of |rpc->rpc|
+     * (which gets replaced e.g. when a SECINFO changes the flavor)
+     */
+    if (rpc->trunk[idx-1]->cl_auth == client->cl_auth)
+        client = rpc->trunk[idx-1];
+out:
+    return client;
+}
+
 /* Frees resources allocated in clnt_create */
 void nfs41_rpc_clnt_free(
     IN nfs41_rpc_clnt *rpc)
 {
+    uint32_t i;
+
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+    rpc_health_unregister(rpc);
+    rpc_wait_connect_races(rpc);
+    if (rpc->standby)
+        clnt_destroy(rpc->standby);
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
+    for (i = 0; i < rpc->trunk_count; i++)
+        clnt_destroy(rpc->trunk[i]);
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+    gss_pool_free(rpc);
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
     auth_destroy(rpc->rpc->cl_auth);
     clnt_destroy(rpc->rpc);
     CloseHandle(rpc->cond);
@@ -322,10 +1528,30 @@ static int rpc_reconnect(
 
     AcquireSRWLockExclusive(&rpc->lock);
 
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+    /* switch to the standby connection if it still answers */
+    client = rpc->standby;
+    rpc->standby = NULL;
+    if (client) {
+        if (send_null_probe(client) == RPC_SUCCESS) {
+            addr_index = rpc->standby_index;
+            DPRINTF(1, ("rpc_reconnect: switching to standby connection "
+                "to address %d\n", (int)addr_index));
+            goto have_client;
+        }
+        clnt_destroy(client);
+        client = NULL;
+    }
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
     status = get_client_for_multi_addr(&rpc->addrs, rpc->wsize, rpc->rsize, 
-                rpc->needcb?rpc:NULL, NULL, &client, &addr_index);
+                rpc->needcb?rpc:NULL, &rpc->sockopts, NULL, &client,
+                &addr_index);
     if (status)
         goto out_unlock;
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+have_client:
+    status = NO_ERROR;
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
 
     if((rpc->sec_flavor == RPCSEC_AUTH_NONE) ||
         (rpc->sec_flavor == RPCSEC_AUTH_SYS)) {
@@ -347,6 +1573,10 @@ static int rpc_reconnect(
         goto out_err_client;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+    /* The per-user contexts survive the reconnect */
+    gss_pool_set_clnt(rpc, client);
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
     clnt_destroy(rpc->rpc);
     rpc->rpc = client;
     rpc->addr_index = addr_index;
@@ -375,6 +1605,348 @@ out_err_client:
     goto out_unlock;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_RPC_FAILOVER
+static struct {
+    SRWLOCK lock;
+    bool_t started;
+    struct list_entry clients; /* |nfs41_rpc_clnt.health_entry| */
+    HANDLE thread;
+} rpc_health = { .lock = SRWLOCK_INIT };
+
+static bool_t rpc_is_conn_error(
+    IN enum clnt_stat rpc_status)
+{
+    return (rpc_status == RPC_CANTRECV) ||
+        (rpc_status == RPC_CANTSEND) ||
+        (rpc_status == RPC_TIMEDOUT);
+}
+
+/* Make sure |rpc->standby| is connected to another address */
+static void rpc_health_refresh_standby(
+    IN nfs41_rpc_clnt *rpc)
+{
+    CLIENT *client = NULL, *old;
+    uint32_t i, index = 0, current;
+    bool_t standby_ok;
+
+    AcquireSRWLockShared(&rpc->lock);
+    standby_ok = rpc->standby &&
+        (send_null_probe(rpc->standby) == RPC_SUCCESS);
+    current = rpc->addr_index;
+    ReleaseSRWLockShared(&rpc->lock);
+    if (standby_ok)
+        goto out;
+
+    AcquireSRWLockExclusive(&rpc->lock);
+    old = rpc->standby;
+    rpc->standby = NULL;
+    ReleaseSRWLockExclusive(&rpc->lock);
+    if (old) {
+        eprintf("rpc_health_refresh_standby: standby connection to "
+            "address %d does not answer\n", (int)rpc->standby_index);
+        clnt_destroy(old);
+    }
+
+    for (i = 1; i < rpc->addrs.count; i++) {
+        index = (current + i) % rpc->addrs.count;
+        if (get_client_for_netaddr(&rpc->addrs.arr[index],
+            rpc->wsize, rpc->rsize, rpc->needcb?rpc:NULL, &rpc->sockopts,
+            NULL, &client))
+            continue;
+        if (send_null_probe(client) == RPC_SUCCESS)
+            break;
+        clnt_destroy(client);
+        client = NULL;
+    }
+    if (client == NULL)
+        goto out;
+
+    AcquireSRWLockExclusive(&rpc->lock);
+    /* |rpc_reconnect()| might have switched to that address meanwhile */
+    if ((rpc->standby == NULL) && (rpc->addr_index != index)) {
+        rpc->standby = client;
+        rpc->standby_index = index;
+        client = NULL;
+    }
+    ReleaseSRWLockExclusive(&rpc->lock);
+
+    if (client)
+        clnt_destroy(client);
+    else
+        DPRINTF(1, ("rpc_health_refresh_standby: standby connection "
+            "to address %d ('%s')\n",
+            (int)index, rpc->addrs.arr[index].uaddr));
+out:
+    return;
+}
+
+static void rpc_health_check(
+    IN nfs41_rpc_clnt *rpc)
+{
+    enum clnt_stat rpc_status;
+    int one = 1, zero = 0;
+
+    if (!rpc->is_valid_session || rpc_renew_in_progress(rpc, NULL))
+        goto out;
+
+    AcquireSRWLockShared(&rpc->lock);
+    rpc_status = send_null_probe(rpc->rpc);
+    ReleaseSRWLockShared(&rpc->lock);
+
+    if (!rpc_is_conn_error(rpc_status)) {
+        rpc->health_failures = 0;
+        rpc_health_refresh_standby(rpc);
+        goto out;
+    }
+
+    eprintf("rpc_health_check: connection to address %d: "
+        "probe returned '%s'\n",
+        (int)rpc->addr_index, rpc_error_string(rpc_status));
+    if (++rpc->health_failures < RPC_HEALTH_MAX_FAILURES)
+        goto out;
+    rpc->health_failures = 0;
+
+    /*
+     * Fail the calls waiting on the dead connection, they wait in
+     * |nfs41_send_compound()| until we are done and retransmit over
+     * the new connection
+     */
+    rpc_renew_in_progress(rpc, &one);
+    AcquireSRWLockShared(&rpc->lock);
+    clnt_abort_calls(rpc->rpc);
+    ReleaseSRWLockShared(&rpc->lock);
+    if (rpc_reconnect(rpc))
+        eprintf("rpc_health_check: rpc_reconnect: "
+            "Failed to reconnect!\n");
+    rpc_renew_in_progress(rpc, &zero);
+out:
+    return;
+}
+
+static unsigned int WINAPI rpc_health_thread(void *args)
+{
+    struct list_entry *entry;
+
+    (void)args;
+
+    for (;;) {
+        Sleep(RPC_HEALTH_INTERVAL_MSECS);
+
+        /* |rpc_health_unregister()| waits until the round is done */
+        AcquireSRWLockShared(&rpc_health.lock);
+        list_for_each(entry, &rpc_health.clients) {
+            rpc_health_check(list_container(entry,
+                nfs41_rpc_clnt, health_entry));
+        }
+        ReleaseSRWLockShared(&rpc_health.lock);
+    }
+    return 0;
+}
+
+static void rpc_health_register(
+    IN nfs41_rpc_clnt *rpc)
+{
+    AcquireSRWLockExclusive(&rpc_health.lock);
+    if (!rpc_health.started) {
+        list_init(&rpc_health.clients);
+        rpc_health.thread = (HANDLE)_beginthreadex(NULL,
+            NFSD_THREAD_STACK_SIZE, rpc_health_thread, NULL, 0, NULL);
+        if (rpc_health.thread == NULL) {
+            eprintf("rpc_health_register: _beginthreadex() failed %d\n",
+                (int)GetLastError());
+            goto out;
+        }
+        rpc_health.started = TRUE;
+    }
+    list_add_tail(&rpc_health.clients, &rpc->health_entry);
+    rpc->health_registered = TRUE;
+out:
+    ReleaseSRWLockExclusive(&rpc_health.lock);
+}
+
+static void rpc_health_unregister(
+    IN nfs41_rpc_clnt *rpc)
+{
+    if (!rpc->health_registered)
+        return;
+
+    AcquireSRWLockExclusive(&rpc_health.lock);
+    list_remove(&rpc->health_entry);
+    rpc->health_registered = FALSE;
+    ReleaseSRWLockExclusive(&rpc_health.lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_RPC_FAILOVER */
+
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+/*
+ * Adaptive RPC timeouts:
+ * Each connection keeps a smoothed RTT and RTT variance per
+ * |rpc_timer_class|, updated like TCP's retransmission timer (RFC
+ * 6298, with the fixed point scaling of the BSD and Linux sunrpc
+ * implementations) from the replies of compounds which were not
+ * retransmitted (Karn's algorithm). The timeout is
+ * SRTT + 4 * RTTVAR plus an allowance for the READ/WRITE payload,
+ * doubled for each retransmission and clamped to
+ * [|RPC_TIMEOUT_MIN_MSECS|, |RPC_TIMEOUT_MAX_MSECS|].
+ * Until a class has |RPC_TIMEOUT_MIN_SAMPLES| samples, and for
+ * compounds without SEQUENCE or with operations which may take long on
+ * the server, the timeout is |RPC_TIMEOUT_MAX_MSECS|.
+ */
+#define RPC_TIMEOUT_MIN_MSECS       5000
+#define RPC_TIMEOUT_MAX_MSECS       90000
+#define RPC_TIMEOUT_MIN_SAMPLES     8
+#define RPC_TIMEOUT_MSECS_PER_MB    1000
+
+enum rpc_timer_class {
+    RPC_TIMER_NONE = -1,
+    RPC_TIMER_META = 0,
+    RPC_TIMER_READ = 1,
+    RPC_TIMER_WRITE = 2
+};
+
+static int rpc_timer_class(
+    IN const nfs41_compound_args *args,
+    OUT uint32_t *payload_len)
+{
+    int timer = RPC_TIMER_META;
+    uint32_t i;
+
+    *payload_len = 0;
+
+    /* EXCHANGE_ID, CREATE_SESSION, DESTROY_SESSION, ... */
+    if ((args->argarray_count == 0) ||
+        (args->argarray[0].op != OP_SEQUENCE))
+        return RPC_TIMER_NONE;
+
+    for (i = 1; i < args->argarray_count; i++) {
+        switch (args->argarray[i].op) {
+        case OP_READ:
+            timer = RPC_TIMER_READ;
+            *payload_len += ((const nfs41_read_args *)
+                args->argarray[i].arg)->count;
+            break;
+        case OP_READ_PLUS:
+            timer = RPC_TIMER_READ;
+            *payload_len += ((const nfs42_read_plus_args *)
+                args->argarray[i].arg)->count;
+            break;
+        case OP_WRITE:
+            timer = RPC_TIMER_WRITE;
+            *payload_len += ((const nfs41_write_args *)
+                args->argarray[i].arg)->data_len;
+            break;
+        /* these may take long on the server */
+        case OP_COMMIT:
+        case OP_COPY:
+        case OP_CLONE:
+        case OP_ALLOCATE:
+        case OP_DEALLOCATE:
+        case OP_SETATTR:
+        case OP_REMOVE:
+        case OP_RENAME:
+            return RPC_TIMER_NONE;
+        default:
+            break;
+        }
+    }
+    return timer;
+}
+
+static void rpc_rtt_timeout(
+    IN nfs41_rpc_clnt *rpc,
+    IN int timer,
+    IN uint32_t payload_len,
+    IN int retries,
+    OUT struct timeval *timeout)
+{
+    ULONGLONG msecs = RPC_TIMEOUT_MAX_MSECS;
+    const struct __nfs41_rpc_rtt *rtt;
+
+    if (timer == RPC_TIMER_NONE)
+        goto out;
+
+    AcquireSRWLockShared(&rpc->rtt_lock);
+    rtt = &rpc->rtt[timer];
+    if (rtt->samples >= RPC_TIMEOUT_MIN_SAMPLES) {
+        /* |rttvar| is scaled by 4, so this is SRTT + 4 * RTTVAR */
+        msecs = (ULONGLONG)(rtt->srtt >> 3) + rtt->rttvar;
+        msecs += ((ULONGLONG)payload_len * RPC_TIMEOUT_MSECS_PER_MB) /
+            (1024ULL*1024ULL);
+        msecs <<= min(retries, 4);
+        msecs = min(max(msecs, RPC_TIMEOUT_MIN_MSECS),
+            RPC_TIMEOUT_MAX_MSECS);
+    }
+    ReleaseSRWLockShared(&rpc->rtt_lock);
+
+out:
+    timeout->tv_sec = (long)(msecs / 1000ULL);
+    timeout->tv_usec = (long)((msecs % 1000ULL) * 1000ULL);
+}
+
+static void rpc_rtt_update(
+    IN nfs41_rpc_clnt *rpc,
+    IN int timer,
+    IN ULONGLONG rtt_msecs)
+{
+    struct __nfs41_rpc_rtt *rtt;
+    LONG m, delta;
+
+    if (timer == RPC_TIMER_NONE)
+        return;
+
+    m = (LONG)min(max(rtt_msecs, 1ULL), RPC_TIMEOUT_MAX_MSECS);
+
+    AcquireSRWLockExclusive(&rpc->rtt_lock);
+    rtt = &rpc->rtt[timer];
+    if (rtt->samples == 0) {
+        rtt->srtt = m << 3;
+        rtt->rttvar = m << 1; /* RTTVAR = R/2 */
+    } else {
+        /* SRTT = 7/8 SRTT + 1/8 R */
+        delta = m - (LONG)(rtt->srtt >> 3);
+        rtt->srtt = (uint32_t)((LONG)rtt->srtt + delta);
+        /* RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R| */
+        if (delta < 0)
+            delta = -delta;
+        delta -= (LONG)(rtt->rttvar >> 2);
+        rtt->rttvar = (uint32_t)((LONG)rtt->rttvar + delta);
+    }
+    if (rtt->samples < RPC_TIMEOUT_MIN_SAMPLES)
+        rtt->samples++;
+    ReleaseSRWLockExclusive(&rpc->rtt_lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
+
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+/* |nfs_encode_compound()|/|nfs_decode_compound()| with cycle accounting */
+static bool_t nfs_encode_compound_cycles(
+    XDR *xdr,
+    caddr_t *pargs)
+{
+    const ULONG64 start = nfsd_cpu_cycles();
+    const bool_t res = nfs_encode_compound(xdr, pargs);
+
+    nfsd_cpu_stats_add(NFS41_CPU_PHASE_XDR_ENCODE, start);
+    return res;
+}
+
+static bool_t nfs_decode_compound_cycles(
+    XDR *xdr,
+    caddr_t *pres)
+{
+    const ULONG64 start = nfsd_cpu_cycles();
+    const bool_t res = nfs_decode_compound(xdr, pres);
+
+    nfsd_cpu_stats_add(NFS41_CPU_PHASE_XDR_DECODE, start);
+    return res;
+}
+#define NFS_ENCODE_COMPOUND nfs_encode_compound_cycles
+#define NFS_DECODE_COMPOUND nfs_decode_compound_cycles
+#else
+#define NFS_ENCODE_COMPOUND nfs_encode_compound
+#define NFS_DECODE_COMPOUND nfs_decode_compound
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
+
 int nfs41_send_compound(
     IN nfs41_rpc_clnt *rpc,
     IN char *inbuf,
@@ -384,20 +1956,110 @@ int nfs41_send_compound(
     enum clnt_stat rpc_status;
     int status, count = 0, one = 1, zero = 0;
     uint32_t version;
+    CLIENT *client;
+    bool_t trunked;
+#ifdef NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT
+    struct clnt_reply_placement placement;
+#endif /* NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT */
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+    nfs41_gss_ctx *gss_ctx;
+    AUTH *gss_auth;
+    bool_t gss_ctx_failed = FALSE;
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+    bool_t retransmitted = FALSE;
+    uint32_t payload_len;
+    ULONGLONG start;
+    int timer;
+
+    timer = rpc_timer_class((const nfs41_compound_args *)inbuf,
+        &payload_len);
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
 
  try_again:
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+    rpc_rtt_timeout(rpc, timer, payload_len, count, &timeout);
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
     AcquireSRWLockShared(&rpc->lock);
     version = rpc->version;
-    rpc_status = clnt_call(rpc->rpc, 1,
-                           (xdrproc_t)nfs_encode_compound, inbuf,
-                           (xdrproc_t)nfs_decode_compound, outbuf,
+    client = rpc_select_conn(rpc, (const nfs41_compound_args *)inbuf);
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+    /*
+     * Before setting the reply placement, establishing a new context
+     * makes its own calls
+     */
+    gss_auth = gss_ctx_get(rpc, &gss_ctx);
+    if (gss_auth)
+        clnt_set_call_auth(gss_auth);
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
+#ifdef NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT
+    /*
+     * Let libtirpc receive READ/READ_PLUS payloads directly into the
+     * caller's buffer. krb5i/krb5p wrap the results, so the payload
+     * must go through |AUTH_UNWRAP()| there
+     */
+    if ((rpc->sec_flavor != RPCSEC_AUTHGSS_KRB5I) &&
+        (rpc->sec_flavor != RPCSEC_AUTHGSS_KRB5P) &&
+        nfs_reply_placement_init((const nfs41_compound_args *)inbuf,
+            (nfs41_compound_res *)outbuf, &placement)) {
+        clnt_set_reply_placement(&placement);
+    }
+#endif /* NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT */
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+    start = GetTickCount64();
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
+    rpc_status = clnt_call(client, 1,
+                           (xdrproc_t)NFS_ENCODE_COMPOUND, inbuf,
+                           (xdrproc_t)NFS_DECODE_COMPOUND, outbuf,
                            timeout);
+    /* |rpc_reconnect()| replaces |rpc->rpc| under the exclusive lock */
+    trunked = (client != rpc->rpc);
     ReleaseSRWLockShared(&rpc->lock);
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+    /* replies to retransmissions are ambiguous (Karn's algorithm) */
+    if ((rpc_status == RPC_SUCCESS) && !retransmitted)
+        rpc_rtt_update(rpc, timer, GetTickCount64() - start);
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+    if (gss_ctx) {
+        gss_ctx_failed = (rpc_status == RPC_AUTHERROR);
+        if (gss_ctx_failed)
+            gss_ctx_invalidate(gss_ctx);
+#ifdef NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW
+        gss_ctx_exit(gss_ctx);
+#endif /* NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW */
+        gss_ctx_release(gss_ctx);
+    }
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
 
     if (rpc_status != RPC_SUCCESS) {
         eprintf("nfs41_send_compound: "
             "clnt_call returned rpc_status = '%s'\n",
             rpc_error_string(rpc_status));
+        if (trunked) {
+            switch(rpc_status) {
+            case RPC_CANTSEND:
+            case RPC_CANTRECV:
+            case RPC_CANTCONNECT:
+                /*
+                 * The transport of a trunked connection failed: take
+                 * it out of the rotation and retry, the primary
+                 * connection has its own reconnect logic below
+                 */
+                rpc_remove_trunk_conn(rpc, client);
+                goto retransmit;
+            case RPC_TIMEDOUT:
+                /* a slow server, the connection itself is fine */
+                if (++count > 3 || !rpc->is_valid_session) {
+                    status = ERROR_NETWORK_UNREACHABLE;
+                    goto out;
+                }
+                goto retransmit;
+            default:
+                /* e.g. |RPC_AUTHERROR|, handled like the primary */
+                break;
+            }
+        }
         switch(rpc_status) {
         case RPC_CANTRECV:
         case RPC_CANTSEND:
@@ -407,8 +2069,16 @@ int nfs41_send_compound(
                 status = ERROR_NETWORK_UNREACHABLE;
                 break;
             }
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+            /*
+             * Only this user's context was rejected, re-establish it
+             * in |gss_ctx_get()| without stalling the other users
+             */
+            if (gss_ctx_failed)
+                goto retransmit;
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
             if (rpc_should_retry(rpc, version))
-                goto try_again;
+                goto retransmit;
             while (rpc_renew_in_progress(rpc, NULL)) {
                 status = WaitForSingleObjectEx(rpc->cond, INFINITE, FALSE);
                 if (status != WAIT_OBJECT_0) {
@@ -420,7 +2090,7 @@ int nfs41_send_compound(
                     goto out;
                 }
                 rpc_renew_in_progress(rpc, &zero);
-                goto try_again;
+                goto retransmit;
             }
             rpc_renew_in_progress(rpc, &one);
             if ((rpc_status == RPC_AUTHERROR) &&
@@ -442,7 +2112,7 @@ int nfs41_send_compound(
                     eprintf("nfs41_send_compound: rpc_reconnect: "
                         "Failed to reconnect!\n");
             rpc_renew_in_progress(rpc, &zero);
-            goto try_again;
+            goto retransmit;
         default:
             eprintf("nfs41_send_compound: "
                 "UNHANDLED RPC_ERROR: %d\n",
@@ -456,4 +2126,12 @@ int nfs41_send_compound(
     status = 0;
 out:
     return status;
+
+retransmit:
+#ifdef NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT
+    retransmitted = TRUE;
+#endif /* NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT */
+    if (rpc->client && rpc->client->root)
+        (void)InterlockedIncrement64(&rpc->client->root->stats.retransmits);
+    goto try_again;
 }
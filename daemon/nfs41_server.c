@@ -99,6 +99,7 @@ static int server_entry_find(
 
 static int server_create(
     IN const struct server_info *info,
+    IN const nfs41_name_cache_config *nc_config,
     OUT nfs41_server **server_out)
 {
     int status = NO_ERROR;
@@ -116,7 +117,7 @@ static int server_create(
     InitializeSRWLock(&server->addrs.lock);
     nfs41_superblock_list_init(&server->superblocks);
 
-    status = nfs41_name_cache_create(&server->name_cache);
+    status = nfs41_name_cache_create(nc_config, &server->name_cache);
     if (status) {
         eprintf("nfs41_name_cache_create() failed with %d\n", status);
         goto out_free;
@@ -231,6 +232,7 @@ int nfs41_server_find_or_create(
     IN const char *server_owner_major_id,
     IN const char *server_scope,
     IN const netaddr4 *addr,
+    IN const nfs41_name_cache_config *nc_config,
     OUT nfs41_server **server_out)
 {
     struct server_info info;
@@ -249,7 +251,7 @@ int nfs41_server_find_or_create(
     entry = list_search(&g_server_list.head, &info, server_compare);
     if (entry == NULL) {
         /* create a new server */
-        status = server_create(&info, &server);
+        status = server_create(&info, nc_config, &server);
         if (status == NO_ERROR) {
             /* add it to the list */
             list_add_tail(&g_server_list.head, &server->entry);
@@ -27,6 +27,7 @@
 #include "nfs41_build_features.h"
 #include "nfs41_ops.h"
 #include "nfs41_callback.h"
+#include "nfs41_daemon.h"
 #include "util.h"
 #include "daemon_debug.h"
 
@@ -35,48 +36,301 @@
  * SEQUENCE.target_highest_slotid to catch up before updating max_slots again */
 #define MAX_SLOTS_DELAY 2000 /* in milliseconds */
 
+/* log at most one slot starvation warning per mount in this time */
+#define SLOT_STARVATION_WARN_INTERVAL 60000 /* in milliseconds */
+
 
 /* predicate for nfs41_slot_table.cond */
-static int slot_table_avail(
+static bool_t slot_table_avail(
     IN const nfs41_slot_table *table)
 {
-    return table->num_used < table->max_slots;
+    return (uint32_t)table->num_used < table->max_slots;
+}
+
+static __inline ULONGLONG slot_table_get_delay(
+    IN nfs41_slot_table *table)
+{
+    /* 64bit read which is also atomic on 32bit platforms */
+    return (ULONGLONG)InterlockedCompareExchange64(&table->target_delay,
+        0LL, 0LL);
+}
+
+static __inline void slot_table_set_delay(
+    IN nfs41_slot_table *table,
+    IN ULONGLONG delay)
+{
+    (void)InterlockedExchange64(&table->target_delay, (LONG64)delay);
+}
+
+/* wake threads waiting for a slot, if there are any */
+static void slot_table_wake(
+    IN nfs41_slot_table *table,
+    IN bool_t wake_all)
+{
+    /*
+     * Waiters increment |num_waiters| under |table->lock| before
+     * checking the bitmap again, and the interlocked op which freed the
+     * slot is a full barrier, so we cannot miss a waiter here
+     */
+    if (table->num_waiters == 0)
+        return;
+
+    EnterCriticalSection(&table->lock);
+    if (wake_all)
+        WakeAllConditionVariable(&table->cond);
+    else
+        WakeConditionVariable(&table->cond);
+    LeaveCriticalSection(&table->lock);
+}
+
+/* number of slots in the allocated chunks */
+static __inline uint32_t slot_table_capacity(
+    IN const nfs41_slot_table *table)
+{
+    return (uint32_t)table->num_chunks * NFS41_SLOT_CHUNK_SLOTS;
+}
+
+/* the chunk of |slotid|, which must be < |slot_table_capacity()| */
+static __inline nfs41_slot_chunk *slot_table_chunk(
+    IN const nfs41_slot_table *table,
+    IN uint32_t slotid)
+{
+    return table->chunks[slotid / NFS41_SLOT_CHUNK_SLOTS];
+}
+
+/* bitmap word |w| of the whole table */
+static __inline volatile LONG *slot_table_bitmap_word(
+    IN const nfs41_slot_table *table,
+    IN uint32_t w)
+{
+    return &table->chunks[w / NFS41_SLOT_CHUNK_WORDS]->used_bitmap[
+        w % NFS41_SLOT_CHUNK_WORDS];
+}
+
+/*
+ * Add chunks until the table has room for |num_slots| slots, returns
+ * the new capacity (which is smaller if we ran out of memory)
+ */
+static uint32_t slot_table_grow(
+    IN nfs41_slot_table *table,
+    IN uint32_t num_slots)
+{
+    nfs41_slot_chunk *chunk;
+    uint32_t i;
+
+    if (num_slots > NFS41_MAX_NUM_SLOTS)
+        num_slots = NFS41_MAX_NUM_SLOTS;
+    if (slot_table_capacity(table) >= num_slots)
+        goto out;
+
+    EnterCriticalSection(&table->lock);
+    while (slot_table_capacity(table) < num_slots) {
+        chunk = calloc(1, sizeof(nfs41_slot_chunk));
+        if (chunk == NULL) {
+            eprintf("slot_table_grow: out of memory, keeping %u slots\n",
+                slot_table_capacity(table));
+            break;
+        }
+        for (i = 0; i < NFS41_SLOT_CHUNK_SLOTS; i++)
+            chunk->seq_nums[i] = 1;
+
+        /* publish the chunk before the slots become usable */
+        (void)InterlockedExchangePointer(
+            (PVOID volatile *)&table->chunks[table->num_chunks], chunk);
+        (void)InterlockedIncrement(&table->num_chunks);
+    }
+    LeaveCriticalSection(&table->lock);
+
+    DPRINTF(2, ("slot_table_grow: %u slots\n", slot_table_capacity(table)));
+out:
+    return slot_table_capacity(table);
+}
+
+static void slot_table_free(
+    IN nfs41_slot_table *table)
+{
+    LONG i;
+
+    for (i = 0; i < table->num_chunks; i++) {
+        free(table->chunks[i]);
+        table->chunks[i] = NULL;
+    }
+    table->num_chunks = 0;
+}
+
+/*
+ * Try to grab the lowest free slot below |table->max_slots|, returns
+ * |FALSE| if all slots are in use.
+ * With |NFS41_DRIVER_NUMA_BUFFER_POOLS| each NUMA node starts in its
+ * own part of the table (if the table has at least two bitmap words
+ * per node), so that threads on different nodes do not compete for
+ * the same bitmap words and slots
+ */
+static bool_t slot_table_try_get(
+    IN nfs41_slot_table *table,
+    OUT uint32_t *slotid)
+{
+    const uint32_t max_slots = table->max_slots;
+    volatile LONG *word;
+    uint32_t i, w, first = 0, num_words;
+    ULONG mask, freebits;
+    DWORD bit;
+
+    num_words = (max_slots + 31) / 32;
+#ifdef NFS41_DRIVER_NUMA_BUFFER_POOLS
+    {
+        const uint32_t num_nodes = (uint32_t)nfsd_numa_node_count();
+
+        if ((num_nodes > 1) && (num_words >= (2 * num_nodes)))
+            first = ((uint32_t)nfsd_numa_current_node() % num_nodes) *
+                (num_words / num_nodes);
+    }
+#endif /* NFS41_DRIVER_NUMA_BUFFER_POOLS */
+    for (i = 0; i < num_words; i++) {
+        w = (first + i) % num_words;
+        /* only consider slots < |max_slots| */
+        if (((w + 1) * 32) <= max_slots)
+            mask = ~0UL;
+        else
+            mask = (1UL << (max_slots % 32)) - 1UL;
+
+        word = slot_table_bitmap_word(table, w);
+        for (;;) {
+            freebits = ~(ULONG)*word & mask;
+            if (freebits == 0)
+                break;
+
+            (void)BitScanForward(&bit, freebits);
+            if (!InterlockedBitTestAndSet(word, (LONG)bit)) {
+                (void)InterlockedIncrement(&table->num_used);
+                *slotid = (w * 32) + bit;
+                return TRUE;
+            }
+            /* lost the race for this bit, try the next free one */
+        }
+    }
+    return FALSE;
+}
+
+/* per-mount statistics of |session|, |NULL| if it has no root */
+static __inline nfs41_root_stats *session_stats(
+    IN nfs41_session *session)
+{
+    return session->client->root?&session->client->root->stats:NULL;
+}
+
+static void session_stats_set_max_slots(
+    IN nfs41_session *session)
+{
+    nfs41_root_stats *stats = session_stats(session);
+
+    if (stats) {
+        (void)InterlockedExchange(&stats->max_slots,
+            (LONG)session->table.max_slots);
+    }
+#ifdef NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS
+    nfsd_worker_threads_fit_slots(session->table.max_slots);
+#endif /* NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS */
+}
+
+/* highest slotid currently in use, used for |sa_highest_slotid| */
+static uint32_t slot_table_highest_used(
+    IN nfs41_slot_table *table)
+{
+    ULONG bits;
+    DWORD bit;
+    int w;
+
+    for (w = (int)(slot_table_capacity(table) / 32) - 1; w >= 0; w--) {
+        bits = (ULONG)*slot_table_bitmap_word(table, (uint32_t)w);
+        if (bits) {
+            (void)BitScanReverse(&bit, bits);
+            return ((uint32_t)w * 32) + bit;
+        }
+    }
+    return 0;
 }
 
 /* session slot mechanism */
 static void init_slot_table(nfs41_slot_table *table) 
 {
+    nfs41_slot_chunk *chunk;
     uint32_t i;
-    EnterCriticalSection(&table->lock);
-    table->max_slots = NFS41_MAX_NUM_SLOTS;
-    for (i = 0; i < NFS41_MAX_NUM_SLOTS; i++) {
-        table->seq_nums[i] = 1;
-        table->used_slots[i] = 0;
+    LONG c;
+
+    /* keep the chunks, |nfs41_session_set_max_slots()| resizes */
+    for (c = 0; c < table->num_chunks; c++) {
+        chunk = table->chunks[c];
+        for (i = 0; i < NFS41_SLOT_CHUNK_WORDS; i++)
+            (void)InterlockedExchange(&chunk->used_bitmap[i], 0L);
+        for (i = 0; i < NFS41_SLOT_CHUNK_SLOTS; i++)
+            (void)InterlockedExchange(&chunk->seq_nums[i], 1);
+    }
+    (void)InterlockedExchange(&table->num_used, 0);
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+    for (c = 0; c < table->num_chunks; c++) {
+        chunk = table->chunks[c];
+        for (i = 0; i < NFS41_SLOT_CHUNK_SLOTS; i++)
+            (void)InterlockedExchange(&chunk->owners[i], 0);
     }
-    table->highest_used = table->num_used = 0;
-    table->target_delay = 0;
+    for (i = 0; i < NFS41_SLOT_FAIR_USERS; i++)
+        (void)InterlockedExchange(&table->users[i].in_flight, 0);
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+    slot_table_set_delay(table, 0ULL);
+    (void)InterlockedExchange((volatile LONG *)&table->max_slots,
+        (LONG)slot_table_capacity(table));
 
     /* wake any threads waiting on a slot */
-    if (slot_table_avail(table))
-        WakeAllConditionVariable(&table->cond);
-    LeaveCriticalSection(&table->lock);
+    slot_table_wake(table, TRUE);
 }
 
 static void resize_slot_table(
-    IN nfs41_slot_table *table,
-    IN uint32_t target_highest_slotid)
+    IN nfs41_session *session,
+    IN uint32_t target_highest_slotid,
+    IN bool_t recall)
 {
+    nfs41_slot_table *table = &session->table;
+    nfs41_root_stats *stats = session_stats(session);
+    uint32_t old_max_slots, capacity;
+
     if (target_highest_slotid >= NFS41_MAX_NUM_SLOTS)
         target_highest_slotid = NFS41_MAX_NUM_SLOTS - 1;
 
-    if (table->max_slots != target_highest_slotid + 1) {
-        DPRINTF(2, ("updated max_slots %u to %u\n",
-            table->max_slots, target_highest_slotid + 1));
-        table->max_slots = target_highest_slotid + 1;
+    if (table->max_slots == target_highest_slotid + 1)
+        return;
 
-        if (slot_table_avail(table))
-            WakeAllConditionVariable(&table->cond);
+    /* the server wants more slots than we have, add chunks */
+    capacity = slot_table_capacity(table);
+    if (target_highest_slotid + 1 > capacity)
+        capacity = slot_table_grow(table, target_highest_slotid + 1);
+    if (target_highest_slotid + 1 > capacity)
+        target_highest_slotid = capacity - 1;
+    if (table->max_slots == target_highest_slotid + 1)
+        return;
+
+    old_max_slots = (uint32_t)InterlockedExchange(
+        (volatile LONG *)&table->max_slots,
+        (LONG)(target_highest_slotid + 1));
+    if (old_max_slots == target_highest_slotid + 1)
+        return;
+
+    DPRINTF(2, ("updated max_slots %u to %u\n",
+        old_max_slots, target_highest_slotid + 1));
+    NFSD_TRACE_EVENT("SlotTableResize", NFSD_TRACE_KEYWORD_SESSION,
+        TraceLoggingUInt32(old_max_slots, "OldMaxSlots"),
+        TraceLoggingUInt32(target_highest_slotid + 1, "MaxSlots"),
+        TraceLoggingBool(recall, "Recall"));
+    if (stats) {
+        (void)InterlockedExchange(&stats->max_slots,
+            (LONG)(target_highest_slotid + 1));
+        (void)InterlockedIncrement64(&stats->slot_resizes);
+        if (recall)
+            (void)InterlockedIncrement64(&stats->slot_recalls);
     }
+
+    /* more than one slot may have become available */
+    if (target_highest_slotid + 1 > old_max_slots)
+        slot_table_wake(table, TRUE);
 }
 
 void nfs41_session_bump_seq(
@@ -86,52 +340,247 @@ void nfs41_session_bump_seq(
 {
     nfs41_slot_table *table = &session->table;
 
-    AcquireSRWLockShared(&session->client->session_lock);
-    EnterCriticalSection(&table->lock);
+    /* only the current owner of |slotid| updates its sequence number */
+    if (slotid < slot_table_capacity(table))
+        (void)InterlockedIncrement(&slot_table_chunk(table, slotid)->
+            seq_nums[slotid % NFS41_SLOT_CHUNK_SLOTS]);
 
-    if (slotid < NFS41_MAX_NUM_SLOTS)
-        table->seq_nums[slotid]++;
+    /* the SEQUENCE renewed the lease, see |renew_sched_thread()| */
+    (void)InterlockedExchange64(&session->renew.last_sequence,
+        (LONGLONG)GetTickCount64());
 
     /* adjust max_slots in response to changes in target_highest_slotid,
      * but not immediately after a CB_RECALL_SLOT or NFS4ERR_BADSLOT error */
-    if (table->target_delay <= GetTickCount64())
-        resize_slot_table(table, target_highest_slotid);
+    if (slot_table_get_delay(table) <= GetTickCount64())
+        resize_slot_table(session, target_highest_slotid, FALSE);
+}
 
-    LeaveCriticalSection(&table->lock);
-    ReleaseSRWLockShared(&session->client->session_lock);
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+/*
+ * Fair sharing of session slots
+ *
+ * Upcall worker threads call |nfs41_session_thread_user_set()| with
+ * the uid of the user they work for. While threads of other users
+ * wait for a slot, a user only gets another slot if it holds fewer
+ * than its share of |max_slots|, which is proportional to its
+ * "--slotweight" among all users holding or waiting for slots, so one
+ * user's bulk copy cannot starve the interactive requests of others.
+ * "--maxuserslots" caps the slots per user and session in any case.
+ * Compounds sent by the daemon itself (lease renewal, recovery,
+ * readahead threads) have no user and are never held back.
+ * The first |NFS41_SLOT_FAIR_USERS| users of a session get an entry in
+ * |nfs41_slot_table.users|; entries are never removed, later users
+ * share the entry their uid hashes to.
+ */
+static __declspec(thread) bool slot_thread_has_user = false;
+static __declspec(thread) uint32_t slot_thread_uid = 0;
+
+void nfs41_session_thread_user_set(
+    IN uint32_t uid)
+{
+    slot_thread_uid = uid;
+    slot_thread_has_user = true;
+}
+
+void nfs41_session_thread_user_clear(void)
+{
+    slot_thread_has_user = false;
+}
+
+static void slot_users_init(
+    IN nfs41_slot_table *table)
+{
+    uint32_t i;
+
+    for (i = 0; i < NFS41_SLOT_FAIR_USERS; i++) {
+        table->users[i].uid = NFS41_SLOT_USER_NONE;
+        table->users[i].in_flight = 0;
+        table->users[i].waiting = 0;
+    }
+    table->user_waiters = 0;
+}
+
+/* entry of the current thread's user, |NULL| for daemon threads */
+static nfs41_slot_user *slot_user_get(
+    IN nfs41_slot_table *table)
+{
+    const LONG uid = (LONG)slot_thread_uid;
+    uint32_t i, h;
+    LONG prev;
+
+    if (!slot_thread_has_user)
+        return NULL;
+
+    h = ((uint32_t)uid * 0x9E3779B1UL) % NFS41_SLOT_FAIR_USERS;
+    for (i = 0; i < NFS41_SLOT_FAIR_USERS; i++) {
+        nfs41_slot_user *u =
+            &table->users[(h + i) % NFS41_SLOT_FAIR_USERS];
+
+        if (u->uid == uid)
+            return u;
+        if (u->uid == NFS41_SLOT_USER_NONE) {
+            prev = InterlockedCompareExchange(&u->uid, uid,
+                NFS41_SLOT_USER_NONE);
+            if ((prev == NFS41_SLOT_USER_NONE) || (prev == uid))
+                return u;
+        }
+    }
+    /* table full, share the home entry */
+    return &table->users[h];
+}
+
+static uint32_t slot_user_weight(
+    IN LONG uid)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    int i;
+
+    for (i = 0; i < nfs41_dg.num_slot_weights; i++) {
+        if (nfs41_dg.slot_weights[i].uid == (uint32_t)uid)
+            return nfs41_dg.slot_weights[i].weight;
+    }
+    return 1;
 }
 
+/* may |u| take another slot now ? */
+static bool slot_user_may_take(
+    IN nfs41_slot_table *table,
+    IN const nfs41_slot_user *u)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    uint32_t i, weight_sum = 0, share;
+
+    if (u == NULL)
+        return true;
+    if (nfs41_dg.max_user_slots &&
+        (u->in_flight >= (LONG)nfs41_dg.max_user_slots))
+        return false;
+    /* nobody else waits, use as many slots as we like */
+    if ((table->user_waiters - u->waiting) <= 0)
+        return true;
+
+    for (i = 0; i < NFS41_SLOT_FAIR_USERS; i++) {
+        const nfs41_slot_user *o = &table->users[i];
+
+        if ((o == u) || (o->in_flight > 0) || (o->waiting > 0))
+            weight_sum += slot_user_weight(o->uid);
+    }
+    share = (uint32_t)(((uint64_t)table->max_slots *
+        slot_user_weight(u->uid)) / max(weight_sum, 1));
+    return (uint32_t)u->in_flight < max(share, 1);
+}
+
+/* record that |u| holds |slotid| */
+static void slot_user_taken(
+    IN nfs41_slot_table *table,
+    IN nfs41_slot_user *u,
+    IN uint32_t slotid)
+{
+    if (u == NULL)
+        return;
+    (void)InterlockedIncrement(&u->in_flight);
+    (void)InterlockedExchange(&slot_table_chunk(table, slotid)->
+        owners[slotid % NFS41_SLOT_CHUNK_SLOTS],
+        (LONG)(u - table->users) + 1);
+}
+
+/* |slotid| was freed, returns |true| if it was held by a user */
+static bool slot_user_released(
+    IN nfs41_slot_table *table,
+    IN uint32_t slotid)
+{
+    const LONG owner = InterlockedExchange(&slot_table_chunk(table, slotid)->
+        owners[slotid % NFS41_SLOT_CHUNK_SLOTS], 0);
+
+    if (owner == 0)
+        return false;
+    (void)InterlockedDecrement(&table->users[owner - 1].in_flight);
+    return true;
+}
+
+/* like |slot_table_try_get()|, for the share of |u| */
+static bool_t slot_table_try_get_user(
+    IN nfs41_slot_table *table,
+    IN nfs41_slot_user *u,
+    OUT uint32_t *slotid)
+{
+    if (!slot_user_may_take(table, u))
+        return FALSE;
+    if (!slot_table_try_get(table, slotid))
+        return FALSE;
+    slot_user_taken(table, u, *slotid);
+    return TRUE;
+}
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+
 void nfs41_session_free_slot(
     IN nfs41_session *session,
     IN uint32_t slotid)
 {
     nfs41_slot_table *table = &session->table;
 
-    AcquireSRWLockShared(&session->client->session_lock);
-    EnterCriticalSection(&table->lock);
+    if (slotid >= slot_table_capacity(table))
+        return;
 
     /* flag the slot as unused */
-    if (slotid < NFS41_MAX_NUM_SLOTS && table->used_slots[slotid]) {
-        table->used_slots[slotid] = 0;
-        table->num_used--;
-    }
-    /* update highest_used if necessary */
-    if (slotid == table->highest_used) {
-        EASSERT_MSG((table->highest_used < NFS41_MAX_NUM_SLOTS),
-            ("table->highest_used=%lu\n",
-            (unsigned long)table->highest_used));
-        while (table->highest_used && !table->used_slots[table->highest_used])
-            table->highest_used--;
+    if (InterlockedBitTestAndReset(slot_table_bitmap_word(table, slotid / 32),
+        (LONG)(slotid % 32))) {
+        (void)InterlockedDecrement(&table->num_used);
+
+        DPRINTF(3, ("freeing slot#=%d used=%d\n",
+            slotid, (int)table->num_used));
+
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+        (void)slot_user_released(table, slotid);
+        /*
+         * A single waiter might not be allowed to take the slot,
+         * let all of them check their share
+         */
+        if (table->user_waiters > 0) {
+            slot_table_wake(table, TRUE);
+            return;
+        }
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+        /* one slot became available, wake a single waiter */
+        slot_table_wake(table, FALSE);
     }
-    DPRINTF(3, ("freeing slot#=%d used=%d highest=%d\n",
-        slotid, table->num_used, table->highest_used));
-
-    /* wake any threads waiting on a slot */
-    if (slot_table_avail(table))
-        WakeAllConditionVariable(&table->cond);
+}
 
-    LeaveCriticalSection(&table->lock);
-    ReleaseSRWLockShared(&session->client->session_lock);
+/*
+ * Log a warning if a thread had to wait longer than
+ * |NFS41_SLOT_STARVATION_USECS| for a slot, this usually means that
+ * the server shrunk |target_highest_slotid| or the slot table is too
+ * small for the workload
+ */
+static void slot_table_check_starvation(
+    IN nfs41_session *session,
+    IN nfs41_root_stats *stats,
+    IN ULONGLONG usecs)
+{
+    nfs41_slot_table *table = &session->table;
+    ULONGLONG now, last;
+
+    if (usecs < NFS41_SLOT_STARVATION_USECS)
+        return;
+
+    NFSD_TRACE_EVENT("SlotStarvation", NFSD_TRACE_KEYWORD_SESSION,
+        TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+        TraceLoggingUInt64(usecs, "WaitUsecs"),
+        TraceLoggingUInt32(table->max_slots, "MaxSlots"),
+        TraceLoggingInt32(table->num_waiters, "Waiters"));
+
+    now = GetTickCount64();
+    last = (ULONGLONG)InterlockedAdd64(&stats->slot_warn_time, 0);
+    if (((now - last) < SLOT_STARVATION_WARN_INTERVAL) ||
+        (InterlockedCompareExchange64(&stats->slot_warn_time,
+            (LONG64)now, (LONG64)last) != (LONG64)last))
+        return;
+
+    eprintf("slot starvation on '%s': waited %llu ms for a session slot "
+        "(max_slots=%u, %ld waiters, %lld slot waits so far)\n",
+        stats->name, usecs / 1000ULL, (unsigned int)table->max_slots,
+        (long)table->num_waiters,
+        (long long)InterlockedAdd64(&stats->slot_waits, 0));
 }
 
 void nfs41_session_get_slot(
@@ -141,31 +590,74 @@ void nfs41_session_get_slot(
     OUT uint32_t *highest)
 {
     nfs41_slot_table *table = &session->table;
+    nfs41_root_stats *stats = session_stats(session);
+    LONGLONG wait_start;
     uint32_t i;
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+    nfs41_slot_user *user = slot_user_get(table);
+#define SLOT_TABLE_TRY_GET(table, slotid) \
+    slot_table_try_get_user((table), user, (slotid))
+#else
+#define SLOT_TABLE_TRY_GET(table, slotid) \
+    slot_table_try_get((table), (slotid))
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
 
+    /*
+     * |session_lock| is held exclusively by |nfs41_session_renew()|
+     * while the slot table gets reset
+     */
     AcquireSRWLockShared(&session->client->session_lock);
-    EnterCriticalSection(&table->lock);
-
-    /* wait for an available slot */
-    while (!slot_table_avail(table))
-        SleepConditionVariableCS(&table->cond, &table->lock, INFINITE);
 
-    for (i = 0; i < table->max_slots; i++) {
-        if (table->used_slots[i])
-            continue;
+    if (!SLOT_TABLE_TRY_GET(table, &i)) {
+        /* slow path: wait for an available slot */
+        wait_start = nfsd_op_stats_start();
+        EnterCriticalSection(&table->lock);
+        (void)InterlockedIncrement(&table->num_waiters);
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+        if (user) {
+            (void)InterlockedIncrement(&user->waiting);
+            (void)InterlockedIncrement(&table->user_waiters);
+        }
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+        while (!SLOT_TABLE_TRY_GET(table, &i))
+            SleepConditionVariableCS(&table->cond, &table->lock, INFINITE);
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+        if (user) {
+            (void)InterlockedDecrement(&user->waiting);
+            (void)InterlockedDecrement(&table->user_waiters);
+        }
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+        (void)InterlockedDecrement(&table->num_waiters);
+        LeaveCriticalSection(&table->lock);
 
-        table->used_slots[i] = 1;
-        table->num_used++;
-        if (i > table->highest_used)
-            table->highest_used = i;
+        /*
+         * We may have been woken for a slot which was grabbed by
+         * someone else, and another waiter may now be the one which
+         * should get the next free slot
+         */
+        if (slot_table_avail(table)) {
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+            slot_table_wake(table, (table->user_waiters > 0));
+#else
+            slot_table_wake(table, FALSE);
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+        }
 
-        *slot = i;
-        *seqid = table->seq_nums[i];
-        *highest = table->highest_used;
-        break;
+        if (stats) {
+            slot_table_check_starvation(session, stats,
+                nfsd_mount_stats_slot_wait_done(stats, wait_start));
+        }
     }
-    LeaveCriticalSection(&table->lock);
+
+    *slot = i;
+    *seqid = (uint32_t)slot_table_chunk(table, i)->
+        seq_nums[i % NFS41_SLOT_CHUNK_SLOTS];
+    *highest = slot_table_highest_used(table);
+    /* peak value, a racing thread may overwrite a slightly higher one */
+    if (stats && ((LONG)*highest > stats->highest_slot))
+        (void)InterlockedExchange(&stats->highest_slot, (LONG)*highest);
     ReleaseSRWLockShared(&session->client->session_lock);
+#undef SLOT_TABLE_TRY_GET
 
     DPRINTF(2, ("session 0x%p: using slot#=%d with seq#=%d highest=%d\n",
         session, *slot, *seqid, *highest));
@@ -177,16 +669,34 @@ int nfs41_session_recall_slot(
 {
     nfs41_slot_table *table = &session->table;
 
-    AcquireSRWLockShared(&session->client->session_lock);
-    EnterCriticalSection(&table->lock);
-    resize_slot_table(table, target_highest_slotid);
-    table->target_delay = GetTickCount64() + MAX_SLOTS_DELAY;
-    LeaveCriticalSection(&table->lock);
-    ReleaseSRWLockShared(&session->client->session_lock);
+    resize_slot_table(session, target_highest_slotid, TRUE);
+    slot_table_set_delay(table, GetTickCount64() + MAX_SLOTS_DELAY);
 
     return NFS4_OK;
 }
 
+/*
+ * Size the slot table for the |ca_maxrequests| the server granted in
+ * CREATE_SESSION, |target_highest_slotid| adjusts it later on
+ */
+void nfs41_session_set_max_slots(
+    IN nfs41_session *session,
+    IN uint32_t max_requests)
+{
+    nfs41_slot_table *table = &session->table;
+    uint32_t capacity;
+
+    if (max_requests == 0)
+        max_requests = 1;
+    capacity = slot_table_grow(table, max_requests);
+    (void)InterlockedExchange((volatile LONG *)&table->max_slots,
+        (LONG)min(capacity, max_requests));
+
+    DPRINTF(1, ("nfs41_session_set_max_slots: server granted %u slots, "
+        "using %u\n", max_requests, (unsigned int)table->max_slots));
+    slot_table_wake(table, TRUE);
+}
+
 int nfs41_session_bad_slot(
     IN nfs41_session *session,
     IN OUT nfs41_sequence_args *args)
@@ -200,12 +710,10 @@ int nfs41_session_bad_slot(
     }
 
     /* avoid using any slots >= bad_slotid */
-    EnterCriticalSection(&table->lock);
     if (table->max_slots > args->sa_slotid) {
-        resize_slot_table(table, args->sa_slotid);
-        table->target_delay = GetTickCount64() + MAX_SLOTS_DELAY;
+        resize_slot_table(session, args->sa_slotid, FALSE);
+        slot_table_set_delay(table, GetTickCount64() + MAX_SLOTS_DELAY);
     }
-    LeaveCriticalSection(&table->lock);
 
     /* get a new slot */
     nfs41_session_free_slot(session, args->sa_slotid);
@@ -228,58 +736,161 @@ void nfs41_session_sequence(
 }
 
 
-/* session renewal */
+/*
+ * session renewal
+ *
+ * Any successful SEQUENCE renews the lease, so sessions which carry
+ * regular traffic never need an extra renewal.
+ * |nfs41_session_bump_seq()| records the time of the last successful
+ * SEQUENCE in |session->renew.last_sequence|, and one scheduler thread
+ * for all sessions sends a SEQUENCE only for sessions which were idle
+ * for 2/3 of their lease time.
+ * The SEQUENCE itself is sent by a short-lived thread per renewal,
+ * so that a hanging server cannot delay the renewal of the sessions
+ * to other servers.
+ */
+#define RENEW_RETRY_INTERVAL 5000 /* in milliseconds */
+
+static struct {
+    SRWLOCK lock;
+    bool_t started;
+    struct list_entry sessions;
+    HANDLE wake_event;
+    HANDLE thread;
+} renew_sched = { .lock = SRWLOCK_INIT };
+
 static unsigned int WINAPI renew_session_thread(void *args)
 {
     nfs41_session *session = (nfs41_session *)args;
-    int status = NO_ERROR;
-    int event_status;
-
-    DPRINTF(1, ("renew_session_thread(session=0x%p): started thread 0x%p\n",
-        session, session->renew.thread_handle));
-
-    /* sleep for 2/3 of lease_time */
-    const uint32_t sleep_time = (2UL * session->lease_time*1000UL)/3UL;
-
-    EASSERT(sleep_time > 100UL);
-    EASSERT(sleep_time < (60*60*1000UL));
-
-    while(1) {
-        DPRINTF(1, ("renew_session_thread(session=0x%p): "
-            "Going to sleep for %dmsecs\n",
-            session, (int)sleep_time));
-
-        /*
-         * sleep for |sleep_time| milliseconds, or until someone
-         * sends an event
-         */
-        event_status = WaitForSingleObjectEx(session->renew.cancel_event,
-            sleep_time, FALSE);
-        if (event_status == WAIT_TIMEOUT) {
-            DPRINTF(1, ("renew_session_thread(session=0x%p): "
-                "renewing session...\n",
-                session));
-            status = nfs41_send_sequence(session);
-            if (status) {
-                eprintf("renew_session_thread(session=0x%p): "
-                    "nfs41_send_sequence() failed status=%d\n",
-                    session, status);
+    int status;
+
+    DPRINTF(1, ("renew_session_thread(session=0x%p): "
+        "renewing session...\n",
+        session));
+    status = nfs41_send_sequence(session);
+    if (status) {
+        eprintf("renew_session_thread(session=0x%p): "
+            "nfs41_send_sequence() failed status=%d\n",
+            session, status);
+    }
+    return 0;
+}
+
+static unsigned int WINAPI renew_sched_thread(void *args)
+{
+    struct list_entry *entry;
+    nfs41_session *session;
+    ULONGLONG now, due, interval;
+    DWORD wait_time;
+
+    (void)args;
+
+    DPRINTF(1, ("renew_sched_thread: started\n"));
+
+    for (;;) {
+        wait_time = INFINITE;
+        now = GetTickCount64();
+
+        AcquireSRWLockExclusive(&renew_sched.lock);
+        list_for_each(entry, &renew_sched.sessions) {
+            session = list_container(entry, nfs41_session, renew.entry);
+
+            /* reap the renewal thread of the last round */
+            if (valid_handle(session->renew.thread_handle)) {
+                if (WaitForSingleObjectEx(session->renew.thread_handle,
+                    0, FALSE) != WAIT_OBJECT_0) {
+                    wait_time = min(wait_time, RENEW_RETRY_INTERVAL);
+                    continue;
+                }
+                (void)CloseHandle(session->renew.thread_handle);
+                session->renew.thread_handle = INVALID_HANDLE_VALUE;
+            }
+
+            /* renew after 2/3 of lease_time without a SEQUENCE */
+            interval = (2ULL * session->lease_time*1000ULL)/3ULL;
+            due = max((ULONGLONG)session->renew.last_sequence + interval,
+                session->renew.last_attempt + RENEW_RETRY_INTERVAL);
+
+            if (due <= now) {
+                session->renew.last_attempt = now;
+                session->renew.thread_handle = (HANDLE)_beginthreadex(NULL,
+                    NFSD_THREAD_STACK_SIZE, renew_session_thread, session,
+                    0, NULL);
+                if (!valid_handle(session->renew.thread_handle)) {
+                    eprintf("renew_sched_thread: "
+                        "_beginthreadex() failed %d\n", (int)GetLastError());
+                    session->renew.thread_handle = INVALID_HANDLE_VALUE;
+                }
+                wait_time = min(wait_time, RENEW_RETRY_INTERVAL);
+            } else {
+                wait_time = (DWORD)min((ULONGLONG)wait_time, due - now);
             }
         }
-        else if (event_status == WAIT_OBJECT_0) {
-            /* event received, renew thread should exit */
-            break;
+        ReleaseSRWLockExclusive(&renew_sched.lock);
+
+        DPRINTF(2, ("renew_sched_thread: Going to sleep for %dmsecs\n",
+            (int)wait_time));
+        (void)WaitForSingleObjectEx(renew_sched.wake_event, wait_time, FALSE);
+    }
+    return 0;
+}
+
+static int renew_sched_add(
+    IN nfs41_session *session)
+{
+    int status = NO_ERROR;
+
+    AcquireSRWLockExclusive(&renew_sched.lock);
+    if (!renew_sched.started) {
+        list_init(&renew_sched.sessions);
+        renew_sched.wake_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+        if (!valid_handle(renew_sched.wake_event)) {
+            status = GetLastError();
+            eprintf("renew_sched_add: CreateEventA() failed, status=%d\n",
+                status);
+            goto out;
         }
-        else {
-            eprintf("renew_session_thread(session=0x%p): "
-                "unexpected event_status=0x%x\n",
-                session, (int)event_status);
+        renew_sched.thread = (HANDLE)_beginthreadex(NULL,
+            NFSD_THREAD_STACK_SIZE, renew_sched_thread, NULL, 0, NULL);
+        if (!valid_handle(renew_sched.thread)) {
+            status = GetLastError();
+            eprintf("renew_sched_add: _beginthreadex() failed %d\n",
+                status);
+            (void)CloseHandle(renew_sched.wake_event);
+            goto out;
         }
+        renew_sched.started = TRUE;
     }
 
-    DPRINTF(1, ("renew_session_thread(session=0x%p): thread 0x%p exiting\n",
-        session, session->renew.thread_handle));
-    return 0;
+    session->renew.last_sequence = (LONGLONG)GetTickCount64();
+    session->renew.last_attempt = 0;
+    list_add_tail(&renew_sched.sessions, &session->renew.entry);
+    session->renew.registered = TRUE;
+    (void)SetEvent(renew_sched.wake_event);
+out:
+    ReleaseSRWLockExclusive(&renew_sched.lock);
+    return status;
+}
+
+static void renew_sched_remove(
+    IN nfs41_session *session)
+{
+    HANDLE thread_handle;
+
+    AcquireSRWLockExclusive(&renew_sched.lock);
+    list_remove(&session->renew.entry);
+    session->renew.registered = FALSE;
+    thread_handle = session->renew.thread_handle;
+    session->renew.thread_handle = INVALID_HANDLE_VALUE;
+    ReleaseSRWLockExclusive(&renew_sched.lock);
+
+    /* wait for a renewal in progress */
+    if (valid_handle(thread_handle)) {
+        DPRINTF(1, ("renew_sched_remove(session=0x%p): "
+            "waiting for renewal thread to exit\n", session));
+        (void)WaitForSingleObjectEx(thread_handle, INFINITE, FALSE);
+        (void)CloseHandle(thread_handle);
+    }
 }
 
 /* session creation */
@@ -297,12 +908,31 @@ static int session_alloc(
     }
     session->client = client;
     session->renew.thread_handle = INVALID_HANDLE_VALUE;
-    session->renew.cancel_event = INVALID_HANDLE_VALUE;
     session->isValidState = FALSE;
 
     InitializeCriticalSection(&session->table.lock);
     InitializeConditionVariable(&session->table.cond);
+#ifdef NFS41_DRIVER_DAEMON_FAIR_SLOTS
+    slot_users_init(&session->table);
+#endif /* NFS41_DRIVER_DAEMON_FAIR_SLOTS */
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+    InitializeSRWLock(&session->commit_batch.lock);
+    InitializeConditionVariable(&session->commit_batch.cond);
+    list_init(&session->commit_batch.pending);
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+#ifdef NFS41_DRIVER_DAEMON_GETATTR_COALESCING
+    InitializeSRWLock(&session->getattr_batch.lock);
+    InitializeConditionVariable(&session->getattr_batch.cond);
+    list_init(&session->getattr_batch.pending);
+#endif /* NFS41_DRIVER_DAEMON_GETATTR_COALESCING */
 
+    /* start with one chunk, grown to what CREATE_SESSION grants */
+    if (slot_table_grow(&session->table, NFS41_SLOT_CHUNK_SLOTS) == 0) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        DeleteCriticalSection(&session->table.lock);
+        free(session);
+        goto out;
+    }
     init_slot_table(&session->table);
 
     //initialize session lock
@@ -346,6 +976,7 @@ int nfs41_session_create(
     client->session = session;
     session->isValidState = TRUE;
     ReleaseSRWLockExclusive(&session->client->session_lock);
+    session_stats_set_max_slots(session);
     *session_out = session;
 out:
     return status;
@@ -362,45 +993,30 @@ int nfs41_session_renew(
     int status;
 
     AcquireSRWLockExclusive(&session->client->session_lock);
-    session->cb_session.cb_seqnum = 0;
+    nfs41_callback_session_reset(session);
     init_slot_table(&session->table);
 
     status = nfs41_create_session(session->client, session, FALSE);
     ReleaseSRWLockExclusive(&session->client->session_lock);
+    if (status == NFS4_OK)
+        session_stats_set_max_slots(session);
+
+    /* the trunked connections are still bound to the old session */
+    if (status == NFS4_OK)
+        nfs41_rpc_clnt_rebind_trunk_conns(session->client->rpc,
+            session->session_id);
     return status;
 }
 
-static
-void cancel_renew_thread(
-    IN nfs41_session *session)
-{
-    DWORD status;
-
-    DPRINTF(1, ("cancel_renew_thread(session=0x%p): "
-        "signal thread to exit\n", session));
-    (void)SetEvent(session->renew.cancel_event);
-
-    DPRINTF(1, ("cancel_renew_thread(session=0x%p): "
-        "waiting for thread to exit\n", session));
-    status = WaitForSingleObjectEx(session->renew.thread_handle,
-        INFINITE, FALSE);
-    EASSERT(status == WAIT_OBJECT_0);
-
-    DPRINTF(1, ("cancel_renew_thread(session=0x%p): thread done\n",
-        session));
-    (void)CloseHandle(session->renew.cancel_event);
-}
-
 int nfs41_session_set_lease(
     IN nfs41_session *session,
     IN uint32_t lease_time)
 {
     int status = NO_ERROR;
-    uint32_t thread_id;
 
-    if (valid_handle(session->renew.thread_handle)) {
+    if (session->renew.registered) {
         eprintf("nfs41_session_set_lease(): session "
-            "renewal thread already started!\n");
+            "renewal already started!\n");
         goto out;
     }
 
@@ -411,22 +1027,7 @@ int nfs41_session_set_lease(
     }
 
     session->lease_time = lease_time;
-    session->renew.cancel_event = CreateEventA(NULL, TRUE, FALSE,
-        NULL);
-    if (!valid_handle(session->renew.cancel_event)) {
-        status = GetLastError();
-        eprintf("nfs41_session_set_lease: CreateEventA() failed, status=%d\n",
-            status);
-        goto out;
-    }
-    session->renew.thread_handle = (HANDLE)_beginthreadex(NULL,
-        NFSD_THREAD_STACK_SIZE, renew_session_thread, session, 0, &thread_id);
-    if (!valid_handle(session->renew.thread_handle)) {
-        status = GetLastError();
-        eprintf("nfs41_session_set_lease: _beginthreadex() failed %d\n",
-            status);
-        goto out;
-    }
+    status = renew_sched_add(session);
 out:
     return status;
 }
@@ -434,16 +1035,18 @@ out:
 void nfs41_session_free(
     IN nfs41_session *session)
 {
-    AcquireSRWLockExclusive(&session->client->session_lock);
-    if (valid_handle(session->renew.thread_handle)) {
-        DPRINTF(1, ("nfs41_session_free: terminating session renewal thread\n"));
-        cancel_renew_thread(session);
+    if (session->renew.registered) {
+        DPRINTF(1, ("nfs41_session_free: removing session from renewal\n"));
+        renew_sched_remove(session);
     }
 
+    AcquireSRWLockExclusive(&session->client->session_lock);
+
     if (session->isValidState) {
         session->client->rpc->is_valid_session = FALSE;
         nfs41_destroy_session(session);
     }
+    slot_table_free(&session->table);
     DeleteCriticalSection(&session->table.lock);
     ReleaseSRWLockExclusive(&session->client->session_lock);
 
@@ -76,60 +76,62 @@ out:
     return status;
 }
 
-static int get_superblock_attrs(
-    IN nfs41_session *session,
-    IN nfs41_superblock *superblock,
-    IN nfs41_path_fh *file)
+void nfs41_superblock_attr_request(
+    OUT bitmap4 *attr_request)
 {
-    nfs41_root *root = session->client->root;
-    bool_t supports_named_attrs;
-    int status;
-    bitmap4 attr_request;
-    nfs41_file_info info = { 0 };
-
-    attr_request.arr[0] = FATTR4_WORD0_SUPPORTED_ATTRS |
+    attr_request->arr[0] = FATTR4_WORD0_SUPPORTED_ATTRS |
         FATTR4_WORD0_LINK_SUPPORT | FATTR4_WORD0_SYMLINK_SUPPORT |
         FATTR4_WORD0_ACLSUPPORT | FATTR4_WORD0_CANSETTIME |
         FATTR4_WORD0_CASE_INSENSITIVE | FATTR4_WORD0_CASE_PRESERVING |
         FATTR4_WORD0_MAXREAD | FATTR4_WORD0_MAXWRITE;
-    attr_request.arr[1] = FATTR4_WORD1_FS_LAYOUT_TYPE |
+    attr_request->arr[1] = FATTR4_WORD1_FS_LAYOUT_TYPE |
         FATTR4_WORD1_TIME_DELTA;
-    attr_request.arr[2] = FATTR4_WORD2_SUPPATTR_EXCLCREAT;
-    attr_request.count = 3;
+    attr_request->arr[2] = FATTR4_WORD2_SUPPATTR_EXCLCREAT;
+    attr_request->count = 3;
+}
 
-    info.supported_attrs = &superblock->supported_attrs;
-    info.suppattr_exclcreat = &superblock->suppattr_exclcreat;
-    info.time_delta = &superblock->time_delta;
+/*
+ * Fill in |superblock| from the attributes in |info|, requested with
+ * |nfs41_superblock_attr_request()|.
+ * |info->supported_attrs|, |info->suppattr_exclcreat| and
+ * |info->time_delta| may point into |superblock| already
+ */
+static void superblock_apply_attrs(
+    IN nfs41_session *session,
+    IN nfs41_superblock *superblock,
+    IN const nfs41_file_info *info,
+    IN bool_t supports_named_attrs)
+{
+    nfs41_root *root = session->client->root;
+    uint32_t i;
 
-    status = nfs41_superblock_getattr(session, file,
-        &attr_request, &info, &supports_named_attrs);
-    if (status) {
-        eprintf("nfs41_superblock_getattr() failed with '%s'/%d when "
-            "fetching attributes for fsid(%llu,%llu)\n",
-            nfs_error_string(status), status,
-            superblock->fsid.major, superblock->fsid.minor);
-        goto out;
-    }
+    if (info->supported_attrs != &superblock->supported_attrs)
+        bitmap4_cpy(&superblock->supported_attrs, info->supported_attrs);
+    if (info->suppattr_exclcreat != &superblock->suppattr_exclcreat)
+        bitmap4_cpy(&superblock->suppattr_exclcreat,
+            info->suppattr_exclcreat);
+    if (info->time_delta != &superblock->time_delta)
+        superblock->time_delta = *info->time_delta;
 
-    if (info.maxread)
-        superblock->maxread = info.maxread;
+    if (info->maxread)
+        superblock->maxread = info->maxread;
     else
         superblock->maxread = session->fore_chan_attrs.ca_maxresponsesize;
 
-    if (info.maxwrite)
-        superblock->maxwrite = info.maxwrite;
+    if (info->maxwrite)
+        superblock->maxwrite = info->maxwrite;
     else
         superblock->maxwrite = session->fore_chan_attrs.ca_maxrequestsize;
 
-    superblock->layout_types = info.fs_layout_types;
-    superblock->aclsupport = info.aclsupport;
-    superblock->link_support = info.link_support;
-    superblock->symlink_support = info.symlink_support;
+    superblock->layout_types = info->fs_layout_types;
+    superblock->aclsupport = info->aclsupport;
+    superblock->link_support = info->link_support;
+    superblock->symlink_support = info->symlink_support;
     superblock->ea_support = supports_named_attrs;
 
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
     if (root->force_case_preserving == TRISTATE_BOOL_NOT_SET) {
-        superblock->case_preserving = info.case_preserving;
+        superblock->case_preserving = info->case_preserving;
     }
     else {
         superblock->case_preserving = BOOL2BIT(root->force_case_preserving);
@@ -138,7 +140,7 @@ static int get_superblock_attrs(
             (int)superblock->case_preserving));
     }
     if (root->force_case_insensitive == TRISTATE_BOOL_NOT_SET) {
-        superblock->case_insensitive = info.case_insensitive;
+        superblock->case_insensitive = info->case_insensitive;
     }
     else {
         superblock->case_insensitive = BOOL2BIT(root->force_case_insensitive);
@@ -147,8 +149,8 @@ static int get_superblock_attrs(
             (int)superblock->case_insensitive));
     }
 #else
-    superblock->case_preserving = info.case_preserving;
-    superblock->case_insensitive = info.case_insensitive;
+    superblock->case_preserving = info->case_preserving;
+    superblock->case_insensitive = info->case_insensitive;
 #endif /* NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS */
 
     superblock->sparse_file_support = 1; /* always ON for now */
@@ -159,13 +161,13 @@ static int get_superblock_attrs(
         superblock->block_clone_support = 0;
     }
 
-    if (bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_CANSETTIME))
-        superblock->cansettime = info.cansettime;
+    if (bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_CANSETTIME))
+        superblock->cansettime = info->cansettime;
     else /* cansettime is not supported, try setting them anyway */
         superblock->cansettime = 1;
 
     /* if time_delta is not supported, default to 1s */
-    if (!bitmap_isset(&info.attrmask, 1, FATTR4_WORD1_TIME_DELTA))
+    if (!bitmap_isset(&info->attrmask, 1, FATTR4_WORD1_TIME_DELTA))
         superblock->time_delta.seconds = 1;
 
     /* initialize the default getattr mask */
@@ -183,6 +185,14 @@ static int get_superblock_attrs(
 
     nfs41_superblock_supported_attrs(superblock, &superblock->default_getattr);
 
+    /* precompute the GETATTR profile masks */
+    for (i = 0; i < NFS41_GETATTR_PROFILE_COUNT; i++) {
+        nfs41_getattr_profile_mask((enum nfs41_getattr_profile)i,
+            &superblock->profile_getattr[i]);
+        nfs41_superblock_supported_attrs(superblock,
+            &superblock->profile_getattr[i]);
+    }
+
     /*
      * Print infos for admins
      */
@@ -262,6 +272,35 @@ static int get_superblock_attrs(
         (int)superblock->case_insensitive,
         superblock->sparse_file_support,
         superblock->block_clone_support));
+}
+
+static int get_superblock_attrs(
+    IN nfs41_session *session,
+    IN nfs41_superblock *superblock,
+    IN nfs41_path_fh *file)
+{
+    bool_t supports_named_attrs;
+    int status;
+    bitmap4 attr_request;
+    nfs41_file_info info = { 0 };
+
+    nfs41_superblock_attr_request(&attr_request);
+
+    info.supported_attrs = &superblock->supported_attrs;
+    info.suppattr_exclcreat = &superblock->suppattr_exclcreat;
+    info.time_delta = &superblock->time_delta;
+
+    status = nfs41_superblock_getattr(session, file,
+        &attr_request, &info, &supports_named_attrs);
+    if (status) {
+        eprintf("nfs41_superblock_getattr() failed with '%s'/%d when "
+            "fetching attributes for fsid(%llu,%llu)\n",
+            nfs_error_string(status), status,
+            superblock->fsid.major, superblock->fsid.minor);
+        goto out;
+    }
+
+    superblock_apply_attrs(session, superblock, &info, supports_named_attrs);
 out:
     return status;
 }
@@ -338,12 +377,26 @@ void nfs41_superblock_fs_attributes(
 
 /* nfs41_superblock_list */
 #define superblock_entry(pos) list_container(pos, nfs41_superblock, entry)
+#define superblock_hash_entry(pos) \
+    list_container(pos, nfs41_superblock, hash_entry)
+
+static __inline struct list_entry *superblock_bucket(
+    IN nfs41_superblock_list *superblocks,
+    IN const nfs41_fsid *fsid)
+{
+    /* |fsid.minor| is often small, mix both words */
+    uint64_t h = (fsid->major * 0x9E3779B97F4A7C15ULL) ^ fsid->minor;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return &superblocks->hash[h & (SUPERBLOCK_HASH_SIZE-1)];
+}
 
 static int superblock_compare(
     const struct list_entry *entry,
     const void *value)
 {
-    const nfs41_superblock *superblock = superblock_entry(entry);
+    const nfs41_superblock *superblock = superblock_hash_entry(entry);
     return compare_fsid(&superblock->fsid, (const nfs41_fsid*)value);
 }
 
@@ -352,14 +405,19 @@ static nfs41_superblock* find_superblock(
     IN const nfs41_fsid *fsid)
 {
     struct list_entry *entry;
-    entry = list_search(&superblocks->head, fsid, superblock_compare);
-    return entry ? superblock_entry(entry) : NULL;
+    entry = list_search(superblock_bucket(superblocks, fsid), fsid,
+        superblock_compare);
+    return entry ? superblock_hash_entry(entry) : NULL;
 }
 
 void nfs41_superblock_list_init(
     IN nfs41_superblock_list *superblocks)
 {
+    uint32_t i;
+
     list_init(&superblocks->head);
+    for (i = 0; i < SUPERBLOCK_HASH_SIZE; i++)
+        list_init(&superblocks->hash[i]);
     InitializeSRWLock(&superblocks->lock);
 }
 
@@ -375,10 +433,12 @@ void nfs41_superblock_list_free(
 }
 
 
-int nfs41_superblock_for_fh(
+static int superblock_for_fh(
     IN nfs41_session *session,
     IN const nfs41_fsid *fsid,
     IN const nfs41_fh *parent OPTIONAL,
+    IN const nfs41_file_info *fsinfo OPTIONAL,
+    IN bool_t supports_named_attrs,
     OUT nfs41_path_fh *file)
 {
     int status = NFS4_OK;
@@ -416,8 +476,11 @@ int nfs41_superblock_for_fh(
         } else {
             /* create the superblock */
             status = superblock_create(fsid, &superblock);
-            if (status == NO_ERROR) /* add it to the list */
+            if (status == NO_ERROR) { /* add it to the list */
                 list_add_tail(&superblocks->head, &superblock->entry);
+                list_add_tail(superblock_bucket(superblocks, fsid),
+                    &superblock->hash_entry);
+            }
         }
         ReleaseSRWLockExclusive(&superblocks->lock);
     }
@@ -425,8 +488,17 @@ int nfs41_superblock_for_fh(
     if (status == NO_ERROR && superblock->supported_attrs.count == 0) {
         /* exclusive lock on the superblock while fetching attributes */
         AcquireSRWLockExclusive(&superblock->lock);
-        if (superblock->supported_attrs.count == 0)
-            status = get_superblock_attrs(session, superblock, file);
+        if (superblock->supported_attrs.count == 0) {
+            if (fsinfo) {
+                DPRINTF(SBLVL, ("using prefetched attributes for "
+                    "fsid(%llu,%llu)\n", fsid->major, fsid->minor));
+                superblock_apply_attrs(session, superblock, fsinfo,
+                    supports_named_attrs);
+            }
+            else {
+                status = get_superblock_attrs(session, superblock, file);
+            }
+        }
         ReleaseSRWLockExclusive(&superblock->lock);
     }
 
@@ -437,6 +509,42 @@ out:
     return status;
 }
 
+int nfs41_superblock_for_fh(
+    IN nfs41_session *session,
+    IN const nfs41_fsid *fsid,
+    IN const nfs41_fh *parent OPTIONAL,
+    OUT nfs41_path_fh *file)
+{
+    return superblock_for_fh(session, fsid, parent, NULL, FALSE, file);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+int nfs41_superblock_for_fh_prefetched(
+    IN nfs41_session *session,
+    IN const nfs41_fsid *fsid,
+    IN const nfs41_fh *parent OPTIONAL,
+    IN const nfs41_file_info *fsinfo,
+    IN bool_t supports_named_attrs,
+    OUT nfs41_path_fh *file)
+{
+    return superblock_for_fh(session, fsid, parent,
+        fsinfo, supports_named_attrs, file);
+}
+
+bool_t nfs41_superblock_list_empty(
+    IN nfs41_session *session)
+{
+    nfs41_superblock_list *superblocks =
+        &client_server(session->client)->superblocks;
+    bool_t empty;
+
+    AcquireSRWLockShared(&superblocks->lock);
+    empty = list_empty(&superblocks->head);
+    ReleaseSRWLockShared(&superblocks->lock);
+    return empty;
+}
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+
 void nfs41_superblock_space_changed(
     IN nfs41_superblock *superblock)
 {
@@ -149,6 +149,12 @@ typedef struct __open_delegation4 {
     nfsace4 permissions;
     enum open_delegation_type4 type;
     bool_t recalled;
+    /*
+     * |OPEN_DELEGATE_*_ATTRS_DELEG| (RFC 9754) are decoded as
+     * |OPEN_DELEGATE_READ|/|OPEN_DELEGATE_WRITE| with |attrs_deleg|
+     * set, so the client owns the timestamps of the file
+     */
+    bool_t attrs_deleg;
 } open_delegation4;
 
 typedef struct __fattr4 {
@@ -224,6 +230,11 @@ typedef struct __nfs41_file_info {
     bool_t                  archive;
     bool_t                  offline;
     uint32_t                clone_blksize;
+    /*
+     * |FATTR4_WORD0_FILEHANDLE| is only stored if the caller sets |fh|,
+     * otherwise it is decoded and thrown away
+     */
+    nfs41_fh                *fh;
     bool_t                  case_insensitive;
     bool_t                  case_preserving;
     bool_t                  symlink_dir;
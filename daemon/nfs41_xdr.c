@@ -1807,6 +1807,11 @@ static bool_t decode_file_attrs(
             if (!xdr_bool(xdr, &info->case_preserving))
                 return FALSE;
         }
+        if (attrs->attrmask.arr[0] & FATTR4_WORD0_FILEHANDLE) {
+            nfs41_fh ignored_fh;
+            if (!xdr_fh(xdr, info->fh ? info->fh : &ignored_fh))
+                return FALSE;
+        }
         if (attrs->attrmask.arr[0] & FATTR4_WORD0_FILEID) {
             if (!xdr_uint64_t(xdr, &info->fileid))
                 return FALSE;
@@ -1935,6 +1940,340 @@ static bool_t decode_file_attrs(
     return TRUE;
 }
 
+/*
+ * Table-driven fast path for |decode_file_attrs()|
+ *
+ * The attribute mask of a reply is compiled into a list of decode
+ * steps, which is cached per thread. READDIR replies use the same
+ * mask for every entry, so the compiled program is reused. A run of
+ * fixed-size attributes needs only one bounds check, and each step
+ * stores its value at a fixed offset in |nfs41_file_info|.
+ * Masks with attributes that need more than that (ACLs, fs_locations,
+ * bitmaps etc.) are decoded by |decode_file_attrs()|.
+ */
+typedef enum __attr_step_kind {
+    ATTR_STEP_NONE = 0, /* not decoded by |decode_file_attrs()| */
+    ATTR_STEP_UINT32,
+    ATTR_STEP_UINT64,
+    ATTR_STEP_BOOL,
+    ATTR_STEP_FSID,
+    ATTR_STEP_NFSTIME4,
+    /* variable size */
+    ATTR_STEP_FILEHANDLE,
+    ATTR_STEP_OWNER,
+    ATTR_STEP_OWNER_GROUP,
+    /* only |decode_file_attrs()| can decode these */
+    ATTR_STEP_COMPLEX
+} attr_step_kind;
+
+typedef struct __attr_step_desc {
+    unsigned char   kind;
+    unsigned short  offset; /* in |nfs41_file_info| */
+} attr_step_desc;
+
+#define ATTR_STEP(k, field) \
+    { (unsigned char)(k), (unsigned short)FIELD_OFFSET(nfs41_file_info, field) }
+#define ATTR_STEP_C { (unsigned char)ATTR_STEP_COMPLEX, 0 }
+
+/* Indexed by attribute number, must match |decode_file_attrs()| */
+static const attr_step_desc attr_step_table[96] = {
+    [0]  = ATTR_STEP_C, /* supported_attrs */
+    [1]  = ATTR_STEP(ATTR_STEP_UINT32, type),
+    [3]  = ATTR_STEP(ATTR_STEP_UINT64, change),
+    [4]  = ATTR_STEP(ATTR_STEP_UINT64, size),
+    [5]  = ATTR_STEP(ATTR_STEP_BOOL, link_support),
+    [6]  = ATTR_STEP(ATTR_STEP_BOOL, symlink_support),
+    [8]  = ATTR_STEP(ATTR_STEP_FSID, fsid),
+    [10] = ATTR_STEP(ATTR_STEP_UINT32, lease_time),
+    [11] = ATTR_STEP(ATTR_STEP_UINT32, rdattr_error),
+    [12] = ATTR_STEP_C, /* acl */
+    [13] = ATTR_STEP(ATTR_STEP_UINT32, aclsupport),
+    [14] = ATTR_STEP(ATTR_STEP_BOOL, archive),
+    [15] = ATTR_STEP(ATTR_STEP_BOOL, cansettime),
+    [16] = ATTR_STEP(ATTR_STEP_BOOL, case_insensitive),
+    [17] = ATTR_STEP(ATTR_STEP_BOOL, case_preserving),
+    [19] = ATTR_STEP(ATTR_STEP_FILEHANDLE, fh),
+    [20] = ATTR_STEP(ATTR_STEP_UINT64, fileid),
+    [24] = ATTR_STEP_C, /* fs_locations */
+    [25] = ATTR_STEP(ATTR_STEP_BOOL, hidden),
+    [30] = ATTR_STEP(ATTR_STEP_UINT64, maxread),
+    [31] = ATTR_STEP(ATTR_STEP_UINT64, maxwrite),
+    [33] = ATTR_STEP(ATTR_STEP_UINT32, mode),
+    [35] = ATTR_STEP(ATTR_STEP_UINT32, numlinks),
+    [36] = ATTR_STEP(ATTR_STEP_OWNER, owner),
+    [37] = ATTR_STEP(ATTR_STEP_OWNER_GROUP, owner_group),
+    [42] = ATTR_STEP(ATTR_STEP_UINT64, space_avail),
+    [43] = ATTR_STEP(ATTR_STEP_UINT64, space_free),
+    [44] = ATTR_STEP(ATTR_STEP_UINT64, space_total),
+    [45] = ATTR_STEP(ATTR_STEP_UINT64, space_used),
+    [46] = ATTR_STEP(ATTR_STEP_BOOL, system),
+    [47] = ATTR_STEP(ATTR_STEP_NFSTIME4, time_access),
+    [50] = ATTR_STEP(ATTR_STEP_NFSTIME4, time_create),
+    [51] = ATTR_STEP_C, /* time_delta */
+    [53] = ATTR_STEP(ATTR_STEP_NFSTIME4, time_modify),
+    [58] = ATTR_STEP_C, /* dacl */
+    [62] = ATTR_STEP_C, /* fs_layout_type */
+    [68] = ATTR_STEP_C, /* mdsthreshold */
+    [75] = ATTR_STEP_C, /* suppattr_exclcreat */
+    [77] = ATTR_STEP(ATTR_STEP_UINT32, clone_blksize),
+    [83] = ATTR_STEP(ATTR_STEP_BOOL, offline),
+};
+
+/* Wire size of the fixed-size step kinds */
+static const unsigned char attr_step_wire_size[] = {
+    [ATTR_STEP_UINT32]      = 4,
+    [ATTR_STEP_UINT64]      = 8,
+    [ATTR_STEP_BOOL]        = 4,
+    [ATTR_STEP_FSID]        = 16,
+    [ATTR_STEP_NFSTIME4]    = 12,
+};
+
+typedef struct __attr_program_step {
+    unsigned char   kind;
+    unsigned short  offset;
+    /*
+     * For the first step of a run of fixed-size steps: wire size of
+     * the whole run, checked once before the run is decoded
+     */
+    unsigned short  run_len;
+} attr_program_step;
+
+typedef struct __attr_program {
+    uint32_t            mask[3];
+    bool_t              compiled; /* |FALSE| if the mask needs the slow path */
+    uint32_t            count;
+    attr_program_step   steps[96];
+} attr_program;
+
+#define ATTR_PROGRAM_CACHE_SIZE 4
+
+static __declspec(thread) struct {
+    attr_program    programs[ATTR_PROGRAM_CACHE_SIZE];
+    uint32_t        valid;
+    uint32_t        next; /* next entry to replace */
+    uint32_t        last; /* most recently used entry */
+} attr_program_cache;
+
+static void attr_program_compile(
+    IN const uint32_t mask[3],
+    OUT attr_program *prog)
+{
+    attr_program_step *run = NULL;
+    const attr_step_desc *desc;
+    uint32_t i;
+
+    prog->mask[0] = mask[0];
+    prog->mask[1] = mask[1];
+    prog->mask[2] = mask[2];
+    prog->compiled = FALSE;
+    prog->count = 0;
+
+    for (i = 0; i < 96; i++) {
+        if ((mask[i / 32] & (1UL << (i % 32))) == 0)
+            continue;
+        desc = &attr_step_table[i];
+        if (desc->kind == ATTR_STEP_NONE)
+            continue;
+        if (desc->kind == ATTR_STEP_COMPLEX)
+            return;
+
+        prog->steps[prog->count].kind = desc->kind;
+        prog->steps[prog->count].offset = desc->offset;
+        prog->steps[prog->count].run_len = 0;
+        if (desc->kind < ATTR_STEP_FILEHANDLE) {
+            if (run == NULL)
+                run = &prog->steps[prog->count];
+            run->run_len += attr_step_wire_size[desc->kind];
+        } else {
+            run = NULL;
+        }
+        prog->count++;
+    }
+    prog->compiled = TRUE;
+}
+
+static const attr_program *attr_program_get(
+    IN const bitmap4 *attrmask)
+{
+    uint32_t mask[3] = { 0, 0, 0 };
+    attr_program *prog;
+    uint32_t i;
+
+    for (i = 0; i < __min(attrmask->count, 3); i++)
+        mask[i] = attrmask->arr[i];
+
+    prog = &attr_program_cache.programs[attr_program_cache.last];
+    if ((attr_program_cache.valid > 0) &&
+        (prog->mask[0] == mask[0]) && (prog->mask[1] == mask[1]) &&
+        (prog->mask[2] == mask[2]))
+        return prog;
+
+    for (i = 0; i < attr_program_cache.valid; i++) {
+        prog = &attr_program_cache.programs[i];
+        if ((prog->mask[0] == mask[0]) && (prog->mask[1] == mask[1]) &&
+            (prog->mask[2] == mask[2])) {
+            attr_program_cache.last = i;
+            return prog;
+        }
+    }
+
+    i = attr_program_cache.next;
+    attr_program_cache.next = (i + 1) % ATTR_PROGRAM_CACHE_SIZE;
+    if (attr_program_cache.valid < ATTR_PROGRAM_CACHE_SIZE)
+        attr_program_cache.valid++;
+    attr_program_cache.last = i;
+    prog = &attr_program_cache.programs[i];
+    attr_program_compile(mask, prog);
+    return prog;
+}
+
+static __inline uint32_t attr_get_uint32(
+    IN const unsigned char *p)
+{
+    uint32_t v;
+    (void)memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static __inline uint64_t attr_get_uint64(
+    IN const unsigned char *p)
+{
+    return ((uint64_t)attr_get_uint32(p) << 32) | attr_get_uint32(p + 4);
+}
+
+/* Same as |xdr_bytes()| into a buffer of |maxlen| bytes */
+static bool_t attr_get_bytes(
+    IN OUT const unsigned char **pp,
+    IN const unsigned char *end,
+    OUT OPTIONAL unsigned char *buf,
+    IN uint32_t maxlen,
+    OUT uint32_t *len)
+{
+    const unsigned char *p = *pp;
+    uint32_t rndup;
+
+    if ((end - p) < 4)
+        return FALSE;
+    *len = attr_get_uint32(p);
+    p += 4;
+    if (*len > maxlen)
+        return FALSE;
+    rndup = (*len + 3) & ~3U;
+    if ((uint32_t)(end - p) < rndup)
+        return FALSE;
+    if (buf)
+        (void)memcpy(buf, p, *len);
+    *pp = p + rndup;
+    return TRUE;
+}
+
+/*
+ * Decode |attrs| into |info| with a compiled attribute program.
+ * Returns |FALSE| in |*handled| if the mask needs
+ * |decode_file_attrs()|
+ */
+static bool_t decode_file_attrs_fast(
+    IN const fattr4 *attrs,
+    OUT nfs41_file_info *info,
+    OUT bool_t *handled)
+{
+    const attr_program *prog = attr_program_get(&attrs->attrmask);
+    const unsigned char *p = attrs->attr_vals;
+    const unsigned char *end = p + attrs->attr_vals_len;
+    const attr_program_step *step;
+    unsigned char *field;
+    uint32_t i, len;
+
+    *handled = prog->compiled;
+    if (!prog->compiled)
+        return FALSE;
+
+    for (i = 0; i < prog->count; i++) {
+        step = &prog->steps[i];
+        field = (unsigned char *)info + step->offset;
+
+        if (step->run_len && ((uint32_t)(end - p) < step->run_len))
+            return FALSE;
+
+        switch (step->kind) {
+        case ATTR_STEP_UINT32:
+            *(uint32_t *)field = attr_get_uint32(p);
+            p += 4;
+            break;
+        case ATTR_STEP_UINT64:
+            *(uint64_t *)field = attr_get_uint64(p);
+            p += 8;
+            break;
+        case ATTR_STEP_BOOL:
+            *(bool_t *)field = attr_get_uint32(p) ? TRUE : FALSE;
+            p += 4;
+            break;
+        case ATTR_STEP_FSID:
+            ((nfs41_fsid *)field)->major = attr_get_uint64(p);
+            ((nfs41_fsid *)field)->minor = attr_get_uint64(p + 8);
+            p += 16;
+            break;
+        case ATTR_STEP_NFSTIME4:
+            ((nfstime4 *)field)->seconds = (int64_t)attr_get_uint64(p);
+            ((nfstime4 *)field)->nseconds = attr_get_uint32(p + 8);
+            p += 12;
+            break;
+        case ATTR_STEP_FILEHANDLE:
+            if (info->fh) {
+                if (!attr_get_bytes(&p, end, info->fh->fh, NFS4_FHSIZE,
+                    &info->fh->len))
+                    return FALSE;
+            } else {
+                if (!attr_get_bytes(&p, end, NULL, NFS4_FHSIZE, &len))
+                    return FALSE;
+            }
+            break;
+        case ATTR_STEP_OWNER:
+            if (info->owner == NULL)
+                info->owner = info->owner_buf;
+            if (!attr_get_bytes(&p, end, (unsigned char *)info->owner,
+                NFS4_FATTR4_OWNER_LIMIT, &len)) {
+                info->owner = NULL;
+                return FALSE;
+            }
+            EASSERT(len > 0);
+            info->owner[len] = '\0';
+            break;
+        case ATTR_STEP_OWNER_GROUP:
+            if (info->owner_group == NULL)
+                info->owner_group = info->owner_group_buf;
+            if (!attr_get_bytes(&p, end,
+                (unsigned char *)info->owner_group,
+                NFS4_FATTR4_OWNER_LIMIT, &len)) {
+                info->owner_group = NULL;
+                return FALSE;
+            }
+            EASSERT(len > 0);
+            info->owner_group[len] = '\0';
+            break;
+        }
+    }
+    return TRUE;
+}
+
+/* Decode the attribute values of |attrs| */
+static bool_t decode_fattr4_values(
+    IN fattr4 *attrs,
+    OUT nfs41_file_info *info)
+{
+    XDR attr_xdr;
+    bool_t res, handled;
+
+    res = decode_file_attrs_fast(attrs, info, &handled);
+    if (handled)
+        return res;
+
+    xdrmem_create(&attr_xdr, (char *)attrs->attr_vals,
+        attrs->attr_vals_len, XDR_DECODE);
+    return decode_file_attrs(&attr_xdr, attrs, info);
+}
+
+
 static bool_t decode_op_getattr(
     XDR *xdr,
     nfs_resop4 *resop)
@@ -1949,12 +2288,9 @@ static bool_t decode_op_getattr(
 
     if (res->status == NFS4_OK)
     {
-        XDR attr_xdr;
-
         if (!xdr_fattr4(xdr, &res->obj_attributes))
             return FALSE;
-        xdrmem_create(&attr_xdr, (char *)res->obj_attributes.attr_vals, res->obj_attributes.attr_vals_len, XDR_DECODE);
-        return  decode_file_attrs(&attr_xdr, &res->obj_attributes, res->info);
+        return decode_fattr4_values(&res->obj_attributes, res->info);
     }
     return TRUE;
 }
@@ -2193,6 +2529,7 @@ static bool_t decode_open_res_ok(
     if (!xdr_enum(xdr, (enum_t*)&res->delegation->type))
         return FALSE;
 
+    res->delegation->attrs_deleg = FALSE;
     switch (res->delegation->type)
     {
     case OPEN_DELEGATE_NONE:
@@ -2203,6 +2540,14 @@ static bool_t decode_open_res_ok(
         return decode_open_read_delegation4(xdr, res->delegation);
     case OPEN_DELEGATE_WRITE:
         return decode_open_write_delegation4(xdr, res->delegation);
+    case OPEN_DELEGATE_READ_ATTRS_DELEG:
+        res->delegation->type = OPEN_DELEGATE_READ;
+        res->delegation->attrs_deleg = TRUE;
+        return decode_open_read_delegation4(xdr, res->delegation);
+    case OPEN_DELEGATE_WRITE_ATTRS_DELEG:
+        res->delegation->type = OPEN_DELEGATE_WRITE;
+        res->delegation->attrs_deleg = TRUE;
+        return decode_open_write_delegation4(xdr, res->delegation);
     default:
         eprintf("decode_open_res_ok: delegation type %d not "
             "supported.\n", res->delegation->type);
@@ -2301,6 +2646,18 @@ static bool_t decode_read_res_ok(
      * overflow (but will still get an RPC error later).
      */
     count = __min(data_len, count);
+#ifdef NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT
+    if (res->data_placed) {
+        /*
+         * Payload is not in the XDR stream, it was received into
+         * |data| by libtirpc (|nfs_locate_read_payload()| has
+         * already checked |count|)
+         */
+        res->data_placed = FALSE;
+        res->data_len = count;
+        return TRUE;
+    }
+#endif /* NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT */
     if (!xdr_opaque(xdr, (char *)data, count)) {
         DPRINTF(0, ("decode_read_res_ok_ decoding 'bytes' failed\n"));
         return FALSE;
@@ -2403,7 +2760,6 @@ static bool_t decode_readdir_entry(
 
     if (entry_len + name_len <= it->remaining_len)
     {
-        XDR fattr_xdr;
         nfs41_readdir_entry *entry = (nfs41_readdir_entry*)it->buf_pos;
         entry->cookie = cookie;
         entry->name_len = name_len;
@@ -2413,9 +2769,11 @@ static bool_t decode_readdir_entry(
         else
             entry->next_entry_offset = 0;
 
-        xdrmem_create(&fattr_xdr, (char *)attrs.attr_vals, attrs.attr_vals_len, XDR_DECODE);
-        if (!(decode_file_attrs(&fattr_xdr, &attrs, &entry->attr_info)))
+        entry->attr_info.fh = &entry->fh;
+        if (!(decode_fattr4_values(&attrs, &entry->attr_info)))
             entry->attr_info.rdattr_error = NFS4ERR_BADXDR;
+        /* do not leave a pointer into the entry buffer behind */
+        entry->attr_info.fh = NULL;
         bitmap4_cpy(&entry->attr_info.attrmask, &attrs.attrmask);
         StringCchCopyA(entry->name, name_len, (STRSAFE_LPCSTR)name);
 
@@ -2741,6 +3099,17 @@ static bool_t encode_file_attrs(
                 return FALSE;
             attrs->attrmask.arr[2] |= FATTR4_WORD2_MODE_SET_MASKED;
         }
+        /* RFC 9754, only with the stateid of an attribute delegation */
+        if (info->attrmask.arr[2] & FATTR4_WORD2_TIME_DELEG_ACCESS) {
+            if (!xdr_nfstime4(&localxdr, &info->time_access))
+                return FALSE;
+            attrs->attrmask.arr[2] |= FATTR4_WORD2_TIME_DELEG_ACCESS;
+        }
+        if (info->attrmask.arr[2] & FATTR4_WORD2_TIME_DELEG_MODIFY) {
+            if (!xdr_nfstime4(&localxdr, &info->time_modify))
+                return FALSE;
+            attrs->attrmask.arr[2] |= FATTR4_WORD2_TIME_DELEG_MODIFY;
+        }
     }
 
     /* warn if we try to set attributes that aren't handled */
@@ -2834,6 +3203,7 @@ static bool_t decode_op_want_delegation(
     if (!xdr_enum(xdr, (enum_t*)&res->delegation->type))
         return FALSE;
 
+    res->delegation->attrs_deleg = FALSE;
     switch (res->delegation->type)
     {
     case OPEN_DELEGATE_NONE:
@@ -2844,6 +3214,14 @@ static bool_t decode_op_want_delegation(
         return decode_open_read_delegation4(xdr, res->delegation);
     case OPEN_DELEGATE_WRITE:
         return decode_open_write_delegation4(xdr, res->delegation);
+    case OPEN_DELEGATE_READ_ATTRS_DELEG:
+        res->delegation->type = OPEN_DELEGATE_READ;
+        res->delegation->attrs_deleg = TRUE;
+        return decode_open_read_delegation4(xdr, res->delegation);
+    case OPEN_DELEGATE_WRITE_ATTRS_DELEG:
+        res->delegation->type = OPEN_DELEGATE_WRITE;
+        res->delegation->attrs_deleg = TRUE;
+        return decode_open_write_delegation4(xdr, res->delegation);
     default:
         eprintf("decode_open_res_ok: delegation type %d not "
             "supported.\n", res->delegation->type);
@@ -2879,6 +3257,71 @@ static bool_t decode_op_free_stateid(
     return xdr_uint32_t(xdr, &res->status);
 }
 
+/*
+ * OP_GET_DIR_DELEGATION
+ */
+static bool_t encode_op_get_dir_delegation(
+    XDR *xdr,
+    nfs_argop4 *argop)
+{
+    nfs41_get_dir_delegation_args *args =
+        (nfs41_get_dir_delegation_args*)argop->arg;
+
+    if (unexpected_op(argop->op, OP_GET_DIR_DELEGATION))
+        return FALSE;
+
+    if (!xdr_bool(xdr, &args->signal_deleg_avail))
+        return FALSE;
+    if (!xdr_bitmap4(xdr, &args->notification_types))
+        return FALSE;
+    if (!xdr_nfstime4(xdr, &args->child_attr_delay))
+        return FALSE;
+    if (!xdr_nfstime4(xdr, &args->dir_attr_delay))
+        return FALSE;
+    if (!xdr_bitmap4(xdr, &args->child_attributes))
+        return FALSE;
+    return xdr_bitmap4(xdr, &args->dir_attributes);
+}
+
+static bool_t decode_op_get_dir_delegation(
+    XDR *xdr,
+    nfs_resop4 *resop)
+{
+    nfs41_get_dir_delegation_res *res =
+        (nfs41_get_dir_delegation_res*)resop->res;
+
+    if (unexpected_op(resop->op, OP_GET_DIR_DELEGATION))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &res->status))
+        return FALSE;
+
+    if (res->status != NFS4_OK)
+        return TRUE;
+
+    if (!xdr_uint32_t(xdr, &res->gddrnf_status))
+        return FALSE;
+
+    switch (res->gddrnf_status) {
+    case GDD4_OK:
+        if (!xdr_opaque(xdr, (char *)res->cookieverf, NFS4_VERIFIER_SIZE))
+            return FALSE;
+        if (!xdr_stateid4(xdr, &res->stateid))
+            return FALSE;
+        if (!xdr_bitmap4(xdr, &res->notification))
+            return FALSE;
+        if (!xdr_bitmap4(xdr, &res->child_attributes))
+            return FALSE;
+        return xdr_bitmap4(xdr, &res->dir_attributes);
+    case GDD4_UNAVAIL:
+        return xdr_bool(xdr, &res->will_signal_deleg_avail);
+    default:
+        eprintf("decode_op_get_dir_delegation: unexpected "
+            "gddrnf_status %u\n", (unsigned int)res->gddrnf_status);
+        return FALSE;
+    }
+}
+
 
 /*
  * OP_TEST_STATEID
@@ -2941,7 +3384,12 @@ static bool_t encode_op_write(
     if (!xdr_uint32_t(xdr, &args->data_len))
         return FALSE;
 
-    return xdr_opaque(xdr, (char *)data, args->data_len);
+    /*
+     * Let libtirpc send the payload directly from |data| (which is
+     * the mapped user buffer for |NFS41_SYSOP_WRITE|), instead of
+     * copying it into the record buffer first
+     */
+    return xdr_opaque_ref(xdr, (const char *)data, args->data_len);
 }
 
 static bool_t xdr_write_verf(
@@ -3179,21 +3627,22 @@ static bool_t xdr_multi_addr(
     return TRUE;
 }
 
-static bool_t xdr_data_server_list(
-    XDR *xdr,
-    pnfs_data_server_list *servers)
+static bool_t data_server_list_resize(
+    pnfs_data_server_list *servers,
+    uint32_t count)
 {
-    uint32_t i, count;
-
-    if (!xdr_uint32_t(xdr, &count))
-        return FALSE;
+    uint32_t i;
 
     if (count && count != servers->count) {
         pnfs_data_server *tmp;
         /* clear data server clients; they're still cached with nfs41_root,
          * so pnfs_data_server_client() will look them up again */
-        for (i = 0; i < servers->count; i++)
+        for (i = 0; i < servers->count; i++) {
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+            pnfs_data_server_disconnect(&servers->arr[i]);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
             servers->arr[i].client = NULL;
+        }
 
         tmp = realloc(servers->arr, count * sizeof(pnfs_data_server));
         if (tmp == NULL)
@@ -3204,6 +3653,20 @@ static bool_t xdr_data_server_list(
             InitializeSRWLock(&servers->arr[i].lock);
         servers->count = count;
     }
+    return TRUE;
+}
+
+static bool_t xdr_data_server_list(
+    XDR *xdr,
+    pnfs_data_server_list *servers)
+{
+    uint32_t i, count;
+
+    if (!xdr_uint32_t(xdr, &count))
+        return FALSE;
+
+    if (!data_server_list_resize(servers, count))
+        return FALSE;
 
     for (i = 0; i < servers->count; i++) {
         if (!xdr_multi_addr(xdr, &servers->arr[i].addrs))
@@ -3222,6 +3685,65 @@ static bool_t xdr_file_device(
     return xdr_data_server_list(xdr, &device->servers);
 }
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+/* ff_device_addr4 (RFC 8435), decoded into a single data server
+ * with a single stripe */
+static bool_t xdr_ff_device(
+    XDR *xdr,
+    pnfs_file_device *device)
+{
+    pnfs_ff_device_version version;
+    bool_t tightly_coupled;
+    uint32_t i, count;
+
+    /* ffda_netaddrs */
+    if (!data_server_list_resize(&device->servers, 1))
+        return FALSE;
+
+    if (!xdr_multi_addr(xdr, &device->servers.arr[0].addrs))
+        return FALSE;
+
+    if (device->stripes.count != 1) {
+        uint32_t *tmp = realloc(device->stripes.arr, sizeof(uint32_t));
+        if (tmp == NULL)
+            return FALSE;
+        device->stripes.arr = tmp;
+        device->stripes.count = 1;
+    }
+    device->stripes.arr[0] = 0;
+
+    /* ffda_versions; we only talk NFSv4.1+ to the data servers, and
+     * can't do the synthetic uid/gid of loosely coupled ones */
+    ZeroMemory(&device->ff_version, sizeof(device->ff_version));
+
+    if (!xdr_uint32_t(xdr, &count))
+        return FALSE;
+
+    for (i = 0; i < count; i++) {
+        if (!xdr_uint32_t(xdr, &version.version))
+            return FALSE;
+
+        if (!xdr_uint32_t(xdr, &version.minorversion))
+            return FALSE;
+
+        if (!xdr_uint32_t(xdr, &version.rsize))
+            return FALSE;
+
+        if (!xdr_uint32_t(xdr, &version.wsize))
+            return FALSE;
+
+        if (!xdr_bool(xdr, &tightly_coupled))
+            return FALSE;
+
+        if ((device->ff_version.version == 0) &&
+            (version.version == 4) && (version.minorversion >= 1) &&
+            tightly_coupled)
+            device->ff_version = version;
+    }
+    return TRUE;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
 static bool_t decode_getdeviceinfo_ok(
     XDR *xdr,
     pnfs_getdeviceinfo_res_ok *res_ok)
@@ -3231,14 +3753,23 @@ static bool_t decode_getdeviceinfo_ok(
     if (!xdr_enum(xdr, (enum_t *)&res_ok->device->device.type))
         return FALSE;
 
-    if (res_ok->device->device.type != PNFS_LAYOUTTYPE_FILE)
-        return FALSE;
-
     if (!xdr_uint32_t(xdr, &len_ignored))
         return FALSE;
 
-    if (!xdr_file_device(xdr, res_ok->device))
+    switch (res_ok->device->device.type) {
+    case PNFS_LAYOUTTYPE_FILE:
+        if (!xdr_file_device(xdr, res_ok->device))
+            return FALSE;
+        break;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    case PNFS_LAYOUTTYPE_FLEXFILES:
+        if (!xdr_ff_device(xdr, res_ok->device))
+            return FALSE;
+        break;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+    default:
         return FALSE;
+    }
 
     return xdr_bitmap4(xdr, &res_ok->notification);
 }
@@ -3284,7 +3815,7 @@ static bool_t encode_op_layoutcommit(
     pnfs_layoutcommit_args *args = (pnfs_layoutcommit_args*)argop->arg;
     bool_t false_bool = FALSE;
     bool_t true_bool = TRUE;
-    enum_t pnfs_layout = PNFS_LAYOUTTYPE_FILE;
+    enum_t pnfs_layout = args->type;
     uint32_t zero = 0;
 
     if (unexpected_op(argop->op, OP_LAYOUTCOMMIT))
@@ -3462,6 +3993,128 @@ out_error:
     return FALSE;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+/* ff_data_server4 */
+static bool_t decode_ff_data_server(
+    XDR *xdr,
+    pnfs_ff_mirror *mirror)
+{
+    char owner[NFS4_OPAQUE_LIMIT], *powner = owner;
+    nfs41_fh fh_ignored;
+    uint32_t i, count, len;
+
+    if (!xdr_opaque(xdr, (char *)mirror->deviceid, PNFS_DEVICEID_SIZE))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &mirror->efficiency))
+        return FALSE;
+
+    if (!xdr_stateid4(xdr, &mirror->stateid))
+        return FALSE;
+
+    /* ffds_fh_vers, we use the file handle of the first version */
+    if (!xdr_uint32_t(xdr, &count))
+        return FALSE;
+
+    for (i = 0; i < count; i++) {
+        if (!xdr_fh(xdr, i ? &fh_ignored : &mirror->file.fh))
+            return FALSE;
+    }
+
+    /* ffds_user and ffds_group, only used with loose coupling */
+    if (!xdr_bytes(xdr, &powner, &len, NFS4_OPAQUE_LIMIT))
+        return FALSE;
+
+    return xdr_bytes(xdr, &powner, &len, NFS4_OPAQUE_LIMIT);
+}
+
+static bool_t decode_ff_mirrors(
+    XDR *xdr,
+    pnfs_ff_mirror_list *mirrors)
+{
+    pnfs_ff_mirror *mirror, ignored;
+    uint32_t i, j, count, servers;
+
+    if (!xdr_uint32_t(xdr, &count))
+        return FALSE;
+
+    if (count == 0)
+        return TRUE;
+
+    mirrors->arr = calloc(count, sizeof(pnfs_ff_mirror));
+    if (mirrors->arr == NULL)
+        return FALSE;
+
+    for (i = 0; i < count; i++) {
+        mirror = &mirrors->arr[mirrors->count];
+
+        if (!xdr_uint32_t(xdr, &servers))
+            return FALSE;
+
+        for (j = 0; j < servers; j++) {
+            if (!decode_ff_data_server(xdr, j ? &ignored : mirror))
+                return FALSE;
+        }
+
+        /* we don't stripe within a mirror, so only keep the mirrors
+         * with exactly one data server */
+        if (servers == 1) {
+            mirrors->count++;
+        } else {
+            DPRINTF(1, ("decode_ff_mirrors: skipping mirror %u with "
+                "%u data servers\n", i, servers));
+            ZeroMemory(mirror, sizeof(pnfs_ff_mirror));
+        }
+    }
+    return TRUE;
+}
+
+/* ff_layout4 */
+static bool_t decode_ff_layout(
+    XDR *xdr,
+    struct list_entry *list,
+    pnfs_layout *base)
+{
+    pnfs_file_layout *layout;
+    uint64_t stripe_unit_ignored;
+    u_int32_t len_ignored, stats_hint_ignored;
+
+    if (!xdr_uint32_t(xdr, &len_ignored))
+        return FALSE;
+
+    layout = calloc(1, sizeof(pnfs_file_layout));
+    if (layout == NULL)
+        return FALSE;
+
+    layout->layout.offset = base->offset;
+    layout->layout.length = base->length;
+    layout->layout.iomode = base->iomode;
+    layout->layout.type = base->type;
+    list_init(&layout->layout.entry);
+
+    /* ffl_stripe_unit, unused with one data server per mirror */
+    if (!xdr_uint64_t(xdr, &stripe_unit_ignored))
+        goto out_error;
+
+    if (!decode_ff_mirrors(xdr, &layout->mirrors))
+        goto out_error;
+
+    if (!xdr_uint32_t(xdr, &layout->ff_flags))
+        goto out_error;
+
+    if (!xdr_uint32_t(xdr, &stats_hint_ignored))
+        goto out_error;
+
+    list_add_tail(list, &layout->layout.entry);
+    return TRUE;
+
+out_error:
+    free(layout->mirrors.arr);
+    free(layout);
+    return FALSE;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
 static bool_t decode_layout(
     XDR *xdr,
     struct list_entry *list)
@@ -3483,6 +4136,10 @@ static bool_t decode_layout(
     switch (layout.type) {
     case PNFS_LAYOUTTYPE_FILE:
         return decode_file_layout(xdr, list, &layout);
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    case PNFS_LAYOUTTYPE_FLEXFILES:
+        return decode_ff_layout(xdr, list, &layout);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 
     default:
         eprintf("'%s': received non-FILE layout type, %d\n",
@@ -3574,6 +4231,21 @@ static bool_t encode_op_layoutreturn(
         if (!xdr_stateid4(xdr, args->stateid))
             return FALSE;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        if (args->type == PNFS_LAYOUTTYPE_FLEXFILES) {
+            /* ff_layoutreturn4 without io error and io stats reports */
+            u_int32_t body_len = 2 * sizeof(u_int32_t);
+
+            if (!xdr_uint32_t(xdr, &body_len))
+                return FALSE;
+
+            if (!xdr_uint32_t(xdr, &zero)) /* fflr_ioerr_report */
+                return FALSE;
+
+            return xdr_uint32_t(xdr, &zero); /* fflr_iostats_report */
+        }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
         return xdr_uint32_t(xdr, &zero); /* size of lrf_body is 0 */
     } else {
         eprintf("'%s': layout type (%d) is not PNFS_RETURN_FILE!\n",
@@ -3662,7 +4334,7 @@ static const op_table_entry g_op_table[] = {
     { encode_op_create_session, decode_op_create_session }, /* OP_CREATE_SESSION = 43 */
     { encode_op_destroy_session, decode_op_destroy_session }, /* OP_DESTROY_SESSION = 44 */
     { encode_op_free_stateid, decode_op_free_stateid }, /* OP_FREE_STATEID = 45 */
-    { NULL, NULL }, /* OP_GET_DIR_DELEGATION = 46 */
+    { encode_op_get_dir_delegation, decode_op_get_dir_delegation }, /* OP_GET_DIR_DELEGATION = 46 */
     { encode_op_getdeviceinfo, decode_op_getdeviceinfo }, /* OP_GETDEVICEINFO = 47 */
     { NULL, NULL }, /* OP_GETDEVICELIST = 48 */
     { encode_op_layoutcommit, decode_op_layoutcommit }, /* OP_LAYOUTCOMMIT = 49 */
@@ -3679,16 +4351,37 @@ static const op_table_entry g_op_table[] = {
     /* new operations for NFSv4.2 */
     { encode_op_allocate, decode_op_allocate }, /* OP_ALLOCATE = 59, */
     { encode_op_copy, decode_op_copy }, /* OP_COPY = 60, */
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+    { encode_op_copy_notify, decode_op_copy_notify }, /* OP_COPY_NOTIFY = 61, */
+#else
     { NULL, NULL }, /* OP_COPY_NOTIFY = 61, */
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
     { encode_op_deallocate, decode_op_deallocate }, /* OP_DEALLOCATE = 62, */
     { NULL, NULL }, /* OP_IO_ADVISE = 63, */
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+    { encode_op_layouterror, decode_op_layouterror }, /* OP_LAYOUTERROR = 64, */
+#else
     { NULL, NULL }, /* OP_LAYOUTERROR = 64, */
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    { encode_op_layoutstats, decode_op_layoutstats }, /* OP_LAYOUTSTATS = 65, */
+#else
     { NULL, NULL }, /* OP_LAYOUTSTATS = 65, */
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+    { encode_op_offload_cancel, decode_op_offload_cancel }, /* OP_OFFLOAD_CANCEL = 66, */
+#else
     { NULL, NULL }, /* OP_OFFLOAD_CANCEL = 66, */
-    { NULL, NULL }, /* OP_OFFLOAD_STATUS = 67, */
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
+    { encode_op_offload_status, decode_op_offload_status }, /* OP_OFFLOAD_STATUS = 67, */
     { encode_op_read_plus, decode_op_read_plus }, /* OP_READ_PLUS = 68, */
     { encode_op_seek, decode_op_seek }, /* OP_SEEK = 69, */
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+    { encode_op_write_same, decode_op_write_same }, /* OP_WRITE_SAME = 70, */
+#else
     { NULL, NULL }, /* OP_WRITE_SAME = 70, */
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
     { encode_op_clone, decode_op_clone }, /* OP_CLONE = 71, */
 
     /* xattr support (RFC8726) */
@@ -3705,6 +4398,314 @@ static const op_table_entry* op_table_find(uint32_t op)
 }
 
 
+#ifdef NFS41_DRIVER_DAEMON_XDR_TEMPLATES
+/*
+ * Compound templates
+ *
+ * The compounds which dominate the operation mix (GETATTR, READ,
+ * WRITE, LOOKUP+GETFH+GETATTR and CLOSE, each behind SEQUENCE and
+ * PUTFH) only consist of operations with small arguments of a fixed
+ * layout. For those |nfs_encode_compound()| reserves the whole
+ * encoded compound with one |XDR_INLINE()| call and fills it from
+ * per-operation templates, which store the constant words (opcodes,
+ * the CLOSE seqid, zero padding) and patch in only the variable
+ * fields (session id, slot and sequence ids, filehandles, stateids,
+ * offsets, lengths and attribute masks), instead of calling one
+ * |XDR| stream function per field.
+ * The WRITE payload is sent with |xdr_opaque_ref()| as before, so a
+ * WRITE ends the template and the operations after it use the
+ * normal encoders. Compounds with other operations, and compounds
+ * which do not fit into the rest of the record buffer (the RPC call
+ * header in front of them is pre-serialised by libtirpc's
+ * |clnt_vc_create()| already), are encoded field by field.
+ */
+typedef uint32_t (*nfs_op_template_size_proc)(const nfs_argop4*);
+typedef int32_t *(*nfs_op_template_fill_proc)(int32_t*, const nfs_argop4*);
+
+typedef struct __op_template_entry {
+    /* encoded size in bytes including the opcode, 0 if out of range */
+    nfs_op_template_size_proc   size;
+    nfs_op_template_fill_proc   fill;
+} op_template_entry;
+
+static __inline int32_t *template_put_opaque(
+    int32_t *buf,
+    const void *data,
+    uint32_t len)
+{
+    /* clear the padding of the last word first */
+    if (len % BYTES_PER_XDR_UNIT)
+        buf[len / BYTES_PER_XDR_UNIT] = 0;
+    (void)memcpy(buf, data, len);
+    return buf + (RNDUP(len) / BYTES_PER_XDR_UNIT);
+}
+
+static __inline int32_t *template_put_bytes(
+    int32_t *buf,
+    const void *data,
+    uint32_t len)
+{
+    IXDR_PUT_U_INT32(buf, len);
+    return template_put_opaque(buf, data, len);
+}
+
+static __inline int32_t *template_put_uint64(
+    int32_t *buf,
+    uint64_t value)
+{
+    IXDR_PUT_U_INT32(buf, (uint32_t)(value >> 32));
+    IXDR_PUT_U_INT32(buf, (uint32_t)value);
+    return buf;
+}
+
+static __inline int32_t *template_put_stateid(
+    int32_t *buf,
+    const stateid4 *si)
+{
+    IXDR_PUT_U_INT32(buf, si->seqid);
+    return template_put_opaque(buf, si->other, NFS4_STATEID_OTHER);
+}
+
+#define TEMPLATE_STATEID_SIZE (BYTES_PER_XDR_UNIT + NFS4_STATEID_OTHER)
+
+static uint32_t template_size_sequence(const nfs_argop4 *argop)
+{
+    return 5 * BYTES_PER_XDR_UNIT + NFS4_SESSIONID_SIZE;
+}
+
+static int32_t *template_fill_sequence(
+    int32_t *buf,
+    const nfs_argop4 *argop)
+{
+    const nfs41_sequence_args *args = (const nfs41_sequence_args*)argop->arg;
+
+    buf = template_put_opaque(buf, args->sa_sessionid, NFS4_SESSIONID_SIZE);
+    IXDR_PUT_U_INT32(buf, args->sa_sequenceid);
+    IXDR_PUT_U_INT32(buf, args->sa_slotid);
+    IXDR_PUT_U_INT32(buf, args->sa_highest_slotid);
+    IXDR_PUT_BOOL(buf, args->sa_cachethis ? TRUE : FALSE);
+    return buf;
+}
+
+static uint32_t template_size_putfh(const nfs_argop4 *argop)
+{
+    const nfs41_putfh_args *args = (const nfs41_putfh_args*)argop->arg;
+
+    if (args->file->fh.len > NFS4_FHSIZE)
+        return 0;
+    return 2 * BYTES_PER_XDR_UNIT + RNDUP(args->file->fh.len);
+}
+
+static int32_t *template_fill_putfh(
+    int32_t *buf,
+    const nfs_argop4 *argop)
+{
+    const nfs41_putfh_args *args = (const nfs41_putfh_args*)argop->arg;
+
+    return template_put_bytes(buf, args->file->fh.fh, args->file->fh.len);
+}
+
+static uint32_t template_size_getattr(const nfs_argop4 *argop)
+{
+    const nfs41_getattr_args *args = (const nfs41_getattr_args*)argop->arg;
+
+    if (args->attr_request->count > BITMAP4_MAXCOUNT)
+        return 0;
+    return (2 + args->attr_request->count) * BYTES_PER_XDR_UNIT;
+}
+
+static int32_t *template_fill_getattr(
+    int32_t *buf,
+    const nfs_argop4 *argop)
+{
+    const nfs41_getattr_args *args = (const nfs41_getattr_args*)argop->arg;
+    uint32_t i;
+
+    IXDR_PUT_U_INT32(buf, args->attr_request->count);
+    for (i = 0; i < args->attr_request->count; i++)
+        IXDR_PUT_U_INT32(buf, args->attr_request->arr[i]);
+    return buf;
+}
+
+static uint32_t template_size_getfh(const nfs_argop4 *argop)
+{
+    return BYTES_PER_XDR_UNIT;
+}
+
+static int32_t *template_fill_getfh(
+    int32_t *buf,
+    const nfs_argop4 *argop)
+{
+    /* void */
+    return buf;
+}
+
+static uint32_t template_size_lookup(const nfs_argop4 *argop)
+{
+    const nfs41_lookup_args *args = (const nfs41_lookup_args*)argop->arg;
+
+    if (args->name->len > NFS4_OPAQUE_LIMIT)
+        return 0;
+    return 2 * BYTES_PER_XDR_UNIT + RNDUP(args->name->len);
+}
+
+static int32_t *template_fill_lookup(
+    int32_t *buf,
+    const nfs_argop4 *argop)
+{
+    const nfs41_lookup_args *args = (const nfs41_lookup_args*)argop->arg;
+
+    return template_put_bytes(buf, args->name->name, args->name->len);
+}
+
+static uint32_t template_size_read(const nfs_argop4 *argop)
+{
+    return 4 * BYTES_PER_XDR_UNIT + TEMPLATE_STATEID_SIZE;
+}
+
+static int32_t *template_fill_read(
+    int32_t *buf,
+    const nfs_argop4 *argop)
+{
+    const nfs41_read_args *args = (const nfs41_read_args*)argop->arg;
+
+    buf = template_put_stateid(buf, &args->stateid->stateid);
+    buf = template_put_uint64(buf, args->offset);
+    IXDR_PUT_U_INT32(buf, args->count);
+    return buf;
+}
+
+/* without the payload, see "Compound templates" */
+static uint32_t template_size_write(const nfs_argop4 *argop)
+{
+    return 5 * BYTES_PER_XDR_UNIT + TEMPLATE_STATEID_SIZE;
+}
+
+static int32_t *template_fill_write(
+    int32_t *buf,
+    const nfs_argop4 *argop)
+{
+    const nfs41_write_args *args = (const nfs41_write_args*)argop->arg;
+
+    buf = template_put_stateid(buf, &args->stateid->stateid);
+    buf = template_put_uint64(buf, args->offset);
+    IXDR_PUT_U_INT32(buf, args->stable);
+    IXDR_PUT_U_INT32(buf, args->data_len);
+    return buf;
+}
+
+static uint32_t template_size_close(const nfs_argop4 *argop)
+{
+    return 2 * BYTES_PER_XDR_UNIT + TEMPLATE_STATEID_SIZE;
+}
+
+static int32_t *template_fill_close(
+    int32_t *buf,
+    const nfs_argop4 *argop)
+{
+    const nfs41_op_close_args *args = (const nfs41_op_close_args*)argop->arg;
+
+    IXDR_PUT_U_INT32(buf, 0); /* seqid, ignored by the server */
+    return template_put_stateid(buf, &args->stateid->stateid);
+}
+
+static const op_template_entry g_op_template_sequence =
+    { template_size_sequence, template_fill_sequence };
+static const op_template_entry g_op_template_putfh =
+    { template_size_putfh, template_fill_putfh };
+static const op_template_entry g_op_template_getattr =
+    { template_size_getattr, template_fill_getattr };
+static const op_template_entry g_op_template_getfh =
+    { template_size_getfh, template_fill_getfh };
+static const op_template_entry g_op_template_lookup =
+    { template_size_lookup, template_fill_lookup };
+static const op_template_entry g_op_template_read =
+    { template_size_read, template_fill_read };
+static const op_template_entry g_op_template_write =
+    { template_size_write, template_fill_write };
+static const op_template_entry g_op_template_close =
+    { template_size_close, template_fill_close };
+
+static const op_template_entry *op_template_find(uint32_t op)
+{
+    switch (op) {
+    case OP_SEQUENCE:   return &g_op_template_sequence;
+    case OP_PUTFH:      return &g_op_template_putfh;
+    case OP_GETATTR:    return &g_op_template_getattr;
+    case OP_GETFH:      return &g_op_template_getfh;
+    case OP_LOOKUP:     return &g_op_template_lookup;
+    case OP_READ:       return &g_op_template_read;
+    case OP_WRITE:      return &g_op_template_write;
+    case OP_CLOSE:      return &g_op_template_close;
+    default:            return NULL;
+    }
+}
+
+/*
+ * Encode the compound header and the leading operations from the
+ * templates. |*ops_done| is the number of operations encoded, or 0
+ * if the compound must be encoded field by field (nothing has been
+ * written then)
+ */
+static bool_t encode_compound_template(
+    XDR *xdr,
+    const nfs41_compound_args *args,
+    uint32_t *ops_done)
+{
+    const op_template_entry *tmpl;
+    int32_t *buf, *end;
+    uint32_t i, count, len, op_len;
+
+    *ops_done = 0;
+
+    if (args->tag_len > NFS4_OPAQUE_LIMIT)
+        return TRUE;
+
+    /* tag, minorversion and the number of operations */
+    len = 3 * BYTES_PER_XDR_UNIT + RNDUP(args->tag_len);
+    for (count = 0; count < args->argarray_count; ) {
+        tmpl = op_template_find(args->argarray[count].op);
+        if (tmpl == NULL)
+            return TRUE;
+        op_len = tmpl->size(&args->argarray[count]);
+        if (op_len == 0)
+            return TRUE;
+        len += op_len;
+        if (args->argarray[count++].op == OP_WRITE)
+            break;
+    }
+    if (count == 0)
+        return TRUE;
+
+    buf = XDR_INLINE(xdr, len);
+    if (buf == NULL)
+        return TRUE;
+    end = buf + (len / BYTES_PER_XDR_UNIT);
+
+    buf = template_put_bytes(buf, args->tag, args->tag_len);
+    IXDR_PUT_U_INT32(buf, args->minorversion);
+    IXDR_PUT_U_INT32(buf, args->argarray_count);
+    for (i = 0; i < count; i++) {
+        IXDR_PUT_U_INT32(buf, args->argarray[i].op);
+        buf = op_template_find(args->argarray[i].op)->fill(buf,
+            &args->argarray[i]);
+    }
+    EASSERT(buf == end);
+
+    if (args->argarray[count - 1].op == OP_WRITE) {
+        const nfs41_write_args *wargs =
+            (const nfs41_write_args*)args->argarray[count - 1].arg;
+
+        if (!xdr_opaque_ref(xdr, (const char *)wargs->data, wargs->data_len))
+            return FALSE;
+    }
+
+    *ops_done = count;
+    return TRUE;
+}
+#endif /* NFS41_DRIVER_DAEMON_XDR_TEMPLATES */
+
+
 /*
  * COMPOUND
  */
@@ -3715,20 +4716,28 @@ bool_t nfs_encode_compound(
     unsigned char *tag;
 
     nfs41_compound_args *args = (nfs41_compound_args*)pargs;
-    uint32_t i;
+    uint32_t i = 0;
     const op_table_entry *entry;
 
-    tag = args->tag;
-    if (!xdr_bytes(xdr, (char **)&tag, &args->tag_len, NFS4_OPAQUE_LIMIT))
+#ifdef NFS41_DRIVER_DAEMON_XDR_TEMPLATES
+    if (!encode_compound_template(xdr, args, &i))
         return FALSE;
+    if (i == 0)
+#endif /* NFS41_DRIVER_DAEMON_XDR_TEMPLATES */
+    {
+        tag = args->tag;
+        if (!xdr_bytes(xdr, (char **)&tag, &args->tag_len,
+            NFS4_OPAQUE_LIMIT))
+            return FALSE;
 
-    if (!xdr_uint32_t(xdr, &args->minorversion))
-        return FALSE;
+        if (!xdr_uint32_t(xdr, &args->minorversion))
+            return FALSE;
 
-    if (!xdr_uint32_t(xdr, &args->argarray_count))
-        return FALSE;
+        if (!xdr_uint32_t(xdr, &args->argarray_count))
+            return FALSE;
+    }
 
-    for (i = 0; i < args->argarray_count; i++)
+    for (; i < args->argarray_count; i++)
     {
         entry = op_table_find(args->argarray[i].op);
         if (entry == NULL || entry->encode == NULL)
@@ -3797,3 +4806,188 @@ bool_t nfs_decode_compound(
     }
     return TRUE;
 }
+
+#ifdef NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT
+/*
+ * Direct placement of READ/READ_PLUS payloads
+ *
+ * |nfs_locate_read_payload()| is called by the libtirpc receive
+ * thread with the start of the COMPOUND4res, before the rest of the
+ * reply has been read from the socket. For a successful reply whose
+ * last operation is READ (or READ_PLUS starting with a data segment)
+ * it returns where the payload starts, so libtirpc can receive it
+ * straight into the caller's buffer. The result is then marked as
+ * |data_placed|, and the decoder skips the payload.
+ */
+static bool_t placement_decode_uint32(
+    const char *buf,
+    u_int len,
+    u_int *pos,
+    uint32_t *val)
+{
+    if ((len - *pos) < sizeof(*val))
+        return FALSE;
+    (void)memcpy(val, buf + *pos, sizeof(*val));
+    *val = ntohl(*val);
+    *pos += sizeof(*val);
+    return TRUE;
+}
+
+static bool_t placement_skip(
+    u_int len,
+    u_int *pos,
+    u_int skip)
+{
+    if ((len - *pos) < skip)
+        return FALSE;
+    *pos += skip;
+    return TRUE;
+}
+
+static bool_t nfs_locate_read_payload(
+    void *arg,
+    const char *results,
+    u_int len,
+    u_int avail,
+    u_int *offset,
+    u_int *payload_len,
+    char **dest)
+{
+    nfs41_compound_res *res = (nfs41_compound_res *)arg;
+    const nfs_resop4 *last;
+    uint32_t i, val, count;
+    u_int pos = 0;
+
+    if (!placement_decode_uint32(results, len, &pos, &val) ||
+        (val != NFS4_OK))
+        return FALSE;
+    /* tag */
+    if (!placement_decode_uint32(results, len, &pos, &val) ||
+        (val > NFS4_OPAQUE_LIMIT) ||
+        !placement_skip(len, &pos, RNDUP(val)))
+        return FALSE;
+    if (!placement_decode_uint32(results, len, &pos, &count) ||
+        (count == 0) || (count != res->resarray_count))
+        return FALSE;
+
+    /* Only the operations |nfs41_read()|/|nfs42_read_plus()| send */
+    for (i = 0; i < (count - 1); i++) {
+        if (!placement_decode_uint32(results, len, &pos, &val) ||
+            (val != res->resarray[i].op))
+            return FALSE;
+        if (!placement_decode_uint32(results, len, &pos, &val) ||
+            (val != NFS4_OK))
+            return FALSE;
+
+        switch (res->resarray[i].op) {
+        case OP_SEQUENCE:
+            /*
+             * sessionid, sequenceid, slotid, highest_slotid,
+             * target_highest_slotid, status_flags
+             */
+            if (!placement_skip(len, &pos,
+                NFS4_SESSIONID_SIZE + (5 * BYTES_PER_XDR_UNIT)))
+                return FALSE;
+            break;
+        case OP_PUTFH:
+            break;
+        default:
+            return FALSE;
+        }
+    }
+
+    last = &res->resarray[count - 1];
+    if (!placement_decode_uint32(results, len, &pos, &val) ||
+        (val != last->op))
+        return FALSE;
+    if (!placement_decode_uint32(results, len, &pos, &val) ||
+        (val != NFS4_OK))
+        return FALSE;
+    /* eof */
+    if (!placement_decode_uint32(results, len, &pos, &val))
+        return FALSE;
+
+    if (last->op == OP_READ) {
+        nfs41_read_res_ok *ok = &((nfs41_read_res *)last->res)->resok4;
+
+        if (!placement_decode_uint32(results, len, &pos, &count) ||
+            (count > ok->data_len) || (RNDUP(count) > (avail - pos)))
+            return FALSE;
+
+        *dest = (char *)ok->data;
+        ok->data_placed = TRUE;
+    }
+    else if (last->op == OP_READ_PLUS) {
+        nfs42_read_plus_res_ok *ok =
+            &((nfs42_read_plus_res *)last->res)->resok4;
+        uint32_t offset_hi, offset_lo;
+        uint64_t data_offset;
+
+        /* segment count, first segment must be data */
+        if (!placement_decode_uint32(results, len, &pos, &val) ||
+            (val == 0))
+            return FALSE;
+        if (!placement_decode_uint32(results, len, &pos, &val) ||
+            (val != NFS4_CONTENT_DATA))
+            return FALSE;
+        if (!placement_decode_uint32(results, len, &pos, &offset_hi) ||
+            !placement_decode_uint32(results, len, &pos, &offset_lo) ||
+            !placement_decode_uint32(results, len, &pos, &count))
+            return FALSE;
+        data_offset = ((uint64_t)offset_hi << 32) | offset_lo;
+
+        /* Same checks as |decode_read_plus_res_ok()| */
+        if ((data_offset < ok->args_offset) ||
+            ((data_offset - ok->args_offset) > ok->data_len) ||
+            (count > (ok->data_len -
+                (data_offset - ok->args_offset))) ||
+            (RNDUP(count) > (avail - pos)))
+            return FALSE;
+
+        *dest = (char *)ok->data + (data_offset - ok->args_offset);
+        ok->data_placed = TRUE;
+    }
+    else
+        return FALSE;
+
+    *offset = pos;
+    *payload_len = count;
+    return TRUE;
+}
+#endif /* NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT */
+
+/*
+ * Set up |placement| for a compound whose last operation is READ or
+ * READ_PLUS, returns |FALSE| if the compound has no payload to place
+ */
+bool_t nfs_reply_placement_init(
+    const nfs41_compound_args *args,
+    nfs41_compound_res *res,
+    struct clnt_reply_placement *placement)
+{
+#ifdef NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT
+    const nfs_resop4 *last;
+
+    if ((args->argarray_count == 0) ||
+        (res->resarray_count != args->argarray_count))
+        return FALSE;
+
+    last = &res->resarray[res->resarray_count - 1];
+    switch (last->op) {
+    case OP_READ:
+        ((nfs41_read_res *)last->res)->resok4.data_placed = FALSE;
+        break;
+    case OP_READ_PLUS:
+        ((nfs42_read_plus_res *)last->res)->resok4.data_placed = FALSE;
+        break;
+    default:
+        return FALSE;
+    }
+
+    placement->locate = nfs_locate_read_payload;
+    placement->arg = res;
+    return TRUE;
+#else
+    return FALSE;
+#endif /* NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT */
+}
@@ -30,6 +30,12 @@
 bool_t nfs_encode_compound(XDR *xdr, caddr_t *args);
 bool_t nfs_decode_compound(XDR *xdr, caddr_t *res);
 
+struct clnt_reply_placement;
+bool_t nfs_reply_placement_init(
+    const nfs41_compound_args *args,
+    nfs41_compound_res *res,
+    struct clnt_reply_placement *placement);
+
 void nfsacl41_free(nfsacl41 *acl);
 bool_t xdr_stateid4(XDR *xdr, stateid4 *si);
 
@@ -42,9 +48,30 @@ bool_t encode_op_deallocate(XDR *xdr, nfs_argop4 *argop);
 bool_t decode_op_deallocate(XDR *xdr, nfs_resop4 *resop);
 bool_t encode_op_read_plus(XDR *xdr, nfs_argop4 *argop);
 bool_t decode_op_read_plus(XDR *xdr, nfs_resop4 *resop);
+bool_t encode_op_offload_status(XDR *xdr, nfs_argop4 *argop);
+bool_t decode_op_offload_status(XDR *xdr, nfs_resop4 *resop);
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+bool_t encode_op_copy_notify(XDR *xdr, nfs_argop4 *argop);
+bool_t decode_op_copy_notify(XDR *xdr, nfs_resop4 *resop);
+bool_t encode_op_offload_cancel(XDR *xdr, nfs_argop4 *argop);
+bool_t decode_op_offload_cancel(XDR *xdr, nfs_resop4 *resop);
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
 bool_t encode_op_seek(XDR *xdr, nfs_argop4 *argop);
 bool_t decode_op_seek(XDR *xdr, nfs_resop4 *resop);
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+bool_t encode_op_write_same(XDR *xdr, nfs_argop4 *argop);
+bool_t decode_op_write_same(XDR *xdr, nfs_resop4 *resop);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
 bool_t encode_op_clone(XDR *xdr, nfs_argop4 *argop);
 bool_t decode_op_clone(XDR *xdr, nfs_resop4 *resop);
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+bool_t encode_op_layouterror(XDR *xdr, nfs_argop4 *argop);
+bool_t decode_op_layouterror(XDR *xdr, nfs_resop4 *resop);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+bool_t encode_op_layoutstats(XDR *xdr, nfs_argop4 *argop);
+bool_t decode_op_layoutstats(XDR *xdr, nfs_resop4 *resop);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
 
 #endif /* !__NFS41_NFS_XDR_H__ */
@@ -119,11 +119,14 @@ int nfs42_copy(
     IN nfs41_path_fh *dst_file,
     IN stateid_arg *src_stateid,
     IN stateid_arg *dst_stateid,
+    IN OPTIONAL const nfs42_netloc_list *source_servers,
     IN uint64_t src_offset,
     IN uint64_t dst_offset,
     IN uint64_t length,
+    IN bool_t synchronous,
     OUT uint64_t *bytes_written,
     OUT nfs41_write_verf *writeverf,
+    OUT OPTIONAL stateid4 *callback_id,
     OUT nfs41_file_info *cinfo)
 {
     int status;
@@ -167,11 +170,12 @@ int nfs42_copy(
     compound_add_op(&compound, OP_COPY, &copy_args, &copy_res);
     copy_args.src_stateid = src_stateid;
     copy_args.dst_stateid = dst_stateid;
+    copy_args.source_servers = source_servers;
     copy_args.src_offset = src_offset;
     copy_args.dst_offset = dst_offset;
     copy_args.count = length;
     copy_args.consecutive = TRUE;
-    copy_args.synchronous = TRUE;
+    copy_args.synchronous = synchronous;
     copy_res.u.resok4.response.writeverf = writeverf;
 
     if (cinfo) {
@@ -207,7 +211,168 @@ int nfs42_copy(
     nfs41_superblock_space_changed(dst_file->fh.superblock);
 
     *bytes_written = copy_res.u.resok4.response.count;
+    writeverf->committed = copy_res.u.resok4.response.committed;
 
+    /*
+     * The server may still decide to do the copy synchronously, the
+     * copy only runs in the background if we got a callback id
+     */
+    if (callback_id) {
+        if (copy_res.u.resok4.response.callback_id_count == 1) {
+            (void)memcpy(callback_id,
+                &copy_res.u.resok4.response.callback_id[0],
+                sizeof(stateid4));
+        } else {
+            (void)memset(callback_id, 0, sizeof(stateid4));
+        }
+    }
+
+out:
+    return status;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+int nfs42_copy_notify(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *src_file,
+    IN stateid_arg *src_stateid,
+    IN const nfs42_netloc *destination,
+    OUT stateid4 *copy_stateid,
+    OUT nfs42_netloc_list *source_servers)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[3];
+    nfs_resop4 resops[3];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs42_copy_notify_args copy_notify_args;
+    nfs42_copy_notify_res copy_notify_res;
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops,
+        "copy_notify");
+
+    compound_add_op(&compound, OP_SEQUENCE,
+        &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = src_file;
+    putfh_args.in_recovery = 0;
+
+    compound_add_op(&compound, OP_COPY_NOTIFY,
+        &copy_notify_args, &copy_notify_res);
+    copy_notify_args.src_stateid = src_stateid;
+    copy_notify_args.destination = destination;
+    copy_notify_res.stateid = copy_stateid;
+    copy_notify_res.source_servers = source_servers;
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    if (compound_error(status = compound.res.status))
+        goto out;
+
+    DPRINTF(1, ("nfs42_copy_notify: lease_time=%lld, "
+        "source_servers=%u\n",
+        (long long)copy_notify_res.lease_time.seconds,
+        (unsigned int)source_servers->count));
+out:
+    return status;
+}
+
+int nfs42_offload_cancel(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid4 *stateid)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[3];
+    nfs_resop4 resops[3];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs42_offload_cancel_args offload_cancel_args;
+    nfs42_offload_cancel_res offload_cancel_res;
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops,
+        "offload_cancel");
+
+    compound_add_op(&compound, OP_SEQUENCE,
+        &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = file;
+    putfh_args.in_recovery = 0;
+
+    compound_add_op(&compound, OP_OFFLOAD_CANCEL,
+        &offload_cancel_args, &offload_cancel_res);
+    offload_cancel_args.stateid = stateid;
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    if (compound_error(status = compound.res.status))
+        goto out;
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
+
+int nfs42_offload_status(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid4 *stateid,
+    OUT uint64_t *count,
+    OUT bool_t *complete,
+    OUT uint32_t *complete_status)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[3];
+    nfs_resop4 resops[3];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs42_offload_status_args offload_status_args;
+    nfs42_offload_status_res offload_status_res;
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops,
+        "offload_status");
+
+    compound_add_op(&compound, OP_SEQUENCE,
+        &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = file;
+    putfh_args.in_recovery = 0;
+
+    compound_add_op(&compound, OP_OFFLOAD_STATUS,
+        &offload_status_args, &offload_status_res);
+    offload_status_args.stateid = stateid;
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    if (compound_error(status = compound.res.status))
+        goto out;
+
+    *count = offload_status_res.count;
+    *complete = (offload_status_res.complete_count == 1)?TRUE:FALSE;
+    *complete_status = (*complete)?offload_status_res.complete_status:NFS4_OK;
 out:
     return status;
 }
@@ -299,6 +464,7 @@ int nfs42_read_plus(
     IN uint32_t count,
     OUT unsigned char *data_out,
     OUT uint32_t *data_len_out,
+    OUT OPTIONAL uint32_t *hole_len_out,
     OUT bool_t *eof_out)
 {
     int status;
@@ -339,6 +505,8 @@ int nfs42_read_plus(
         goto out;
 
     *data_len_out = read_plus_res.resok4.data_len;
+    if (hole_len_out)
+        *hole_len_out = read_plus_res.resok4.hole_len;
     *eof_out = read_plus_res.resok4.eof;
 
     /* we shouldn't ever see this, but a buggy server could
@@ -402,21 +570,20 @@ out:
     return status;
 }
 
-int nfs42_clone(
+int nfs42_clone_ranges(
     IN nfs41_session *session,
     IN nfs41_path_fh *src_file,
     IN nfs41_path_fh *dst_file,
     IN stateid_arg *src_stateid,
     IN stateid_arg *dst_stateid,
-    IN uint64_t src_offset,
-    IN uint64_t dst_offset,
-    IN uint64_t length,
+    IN const nfs42_clone_range *ranges,
+    IN uint32_t count,
     OUT nfs41_file_info *cinfo)
 {
     int status;
     nfs41_compound compound;
-    nfs_argop4 argops[7];
-    nfs_resop4 resops[7];
+    nfs_argop4 argops[NFS42_MAX_CLONES_PER_COMPOUND+5];
+    nfs_resop4 resops[NFS42_MAX_CLONES_PER_COMPOUND+5];
     nfs41_sequence_args sequence_args;
     nfs41_sequence_res sequence_res;
     nfs41_putfh_args src_putfh_args;
@@ -424,12 +591,15 @@ int nfs42_clone(
     nfs41_savefh_res savefh_res;
     nfs41_putfh_args dst_putfh_args;
     nfs41_putfh_res dst_putfh_res;
-    nfs42_clone_args clone_args;
-    nfs42_clone_res clone_res;
+    nfs42_clone_args clone_args[NFS42_MAX_CLONES_PER_COMPOUND];
+    nfs42_clone_res clone_res[NFS42_MAX_CLONES_PER_COMPOUND];
     nfs41_getattr_args getattr_args;
     nfs41_getattr_res getattr_res = {0};
     bitmap4 attr_request;
     nfs41_file_info info, *pinfo;
+    uint32_t i;
+
+    EASSERT((count > 0) && (count <= NFS42_MAX_CLONES_PER_COMPOUND));
 
     nfs41_superblock_getattr_mask(dst_file->fh.superblock, &attr_request);
 
@@ -451,12 +621,15 @@ int nfs42_clone(
     dst_putfh_args.file = dst_file;
     dst_putfh_args.in_recovery = 0;
 
-    compound_add_op(&compound, OP_CLONE, &clone_args, &clone_res);
-    clone_args.src_stateid = src_stateid;
-    clone_args.dst_stateid = dst_stateid;
-    clone_args.src_offset = src_offset;
-    clone_args.dst_offset = dst_offset;
-    clone_args.count = length;
+    /* CLONE leaves SAVED_FH and CURRENT_FH alone */
+    for (i = 0; i < count; i++) {
+        compound_add_op(&compound, OP_CLONE, &clone_args[i], &clone_res[i]);
+        clone_args[i].src_stateid = src_stateid;
+        clone_args[i].dst_stateid = dst_stateid;
+        clone_args[i].src_offset = ranges[i].src_offset;
+        clone_args[i].dst_offset = ranges[i].dst_offset;
+        clone_args[i].count = ranges[i].count;
+    }
 
     if (cinfo) {
         pinfo = cinfo;
@@ -493,3 +666,226 @@ int nfs42_clone(
 out:
     return status;
 }
+
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+int nfs42_write_same(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid_arg *stateid,
+    IN uint64_t offset,
+    IN uint64_t block_size,
+    IN uint64_t block_count,
+    IN const unsigned char *pattern,
+    IN uint32_t pattern_len,
+    IN enum stable_how4 stable,
+    OUT uint64_t *bytes_written,
+    OUT nfs41_write_verf *verf,
+    OUT OPTIONAL stateid4 *callback_id,
+    OUT nfs41_file_info *cinfo)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[4];
+    nfs_resop4 resops[4];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs42_write_same_args write_same_args;
+    nfs42_write_same_res write_same_res;
+    nfs41_getattr_args getattr_args;
+    nfs41_getattr_res getattr_res = {0};
+    bitmap4 attr_request;
+    nfs41_file_info info, *pinfo;
+
+    nfs41_superblock_getattr_mask(file->fh.superblock, &attr_request);
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops, "write_same");
+
+    compound_add_op(&compound, OP_SEQUENCE,
+        &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = file;
+    putfh_args.in_recovery = 0;
+
+    compound_add_op(&compound, OP_WRITE_SAME,
+        &write_same_args, &write_same_res);
+    write_same_args.stateid = stateid;
+    write_same_args.stable = stable;
+    /* the pattern fills each block, no block numbers are embedded */
+    write_same_args.adb.offset = offset;
+    write_same_args.adb.block_size = block_size;
+    write_same_args.adb.block_count = block_count;
+    write_same_args.adb.reloff_blocknum = 0;
+    write_same_args.adb.block_num = 0;
+    write_same_args.adb.reloff_pattern = 0;
+    write_same_args.adb.pattern_len = pattern_len;
+    write_same_args.adb.pattern = pattern;
+    write_same_res.response.writeverf = verf;
+
+    if (cinfo) {
+        pinfo = cinfo;
+    }
+    else {
+        (void)memset(&info, 0, sizeof(info));
+        pinfo = &info;
+    }
+
+    /* WRITE_SAME allocates space, get the new attributes */
+    compound_add_op(&compound, OP_GETATTR, &getattr_args, &getattr_res);
+    getattr_args.attr_request = &attr_request;
+    getattr_res.obj_attributes.attr_vals_len = NFS4_OPAQUE_LIMIT_ATTR;
+    getattr_res.info = pinfo;
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    if (compound_error(status = compound.res.status))
+        goto out;
+
+    /* update the attribute cache */
+    bitmap4_cpy(&pinfo->attrmask, &getattr_res.obj_attributes.attrmask);
+    nfs41_attr_cache_update(session_name_cache(session),
+        file->fh.fileid, pinfo);
+
+    nfs41_superblock_space_changed(file->fh.superblock);
+
+    *bytes_written = write_same_res.response.count;
+    verf->committed = write_same_res.response.committed;
+
+    if (callback_id) {
+        if (write_same_res.response.callback_id_count == 1) {
+            (void)memcpy(callback_id,
+                &write_same_res.response.callback_id[0],
+                sizeof(stateid4));
+        } else {
+            (void)memset(callback_id, 0, sizeof(stateid4));
+        }
+    }
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
+
+int nfs42_clone(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *src_file,
+    IN nfs41_path_fh *dst_file,
+    IN stateid_arg *src_stateid,
+    IN stateid_arg *dst_stateid,
+    IN uint64_t src_offset,
+    IN uint64_t dst_offset,
+    IN uint64_t length,
+    OUT nfs41_file_info *cinfo)
+{
+    nfs42_clone_range range;
+
+    range.src_offset = src_offset;
+    range.dst_offset = dst_offset;
+    range.count = length;
+    return nfs42_clone_ranges(session, src_file, dst_file,
+        src_stateid, dst_stateid, &range, 1, cinfo);
+}
+
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+int nfs42_layouterror(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid4 *layout_stateid,
+    IN uint64_t offset,
+    IN uint64_t length,
+    IN unsigned char *deviceid,
+    IN uint32_t nfsstat,
+    IN uint32_t opnum)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[3];
+    nfs_resop4 resops[3];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs42_layouterror_args layouterror_args;
+    nfs42_layouterror_res layouterror_res;
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops, "layouterror");
+
+    compound_add_op(&compound, OP_SEQUENCE,
+        &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = file;
+    putfh_args.in_recovery = 0;
+
+    compound_add_op(&compound, OP_LAYOUTERROR,
+        &layouterror_args, &layouterror_res);
+    layouterror_args.offset = offset;
+    layouterror_args.length = length;
+    layouterror_args.stateid = layout_stateid;
+    layouterror_args.error.deviceid = deviceid;
+    layouterror_args.error.status = nfsstat;
+    layouterror_args.error.opnum = opnum;
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    compound_error(status = compound.res.status);
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+int nfs42_layoutstats(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN nfs42_layoutstats_args *stats,
+    IN uint32_t count)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[2+NFS42_LAYOUTSTATS_MAX_OPS];
+    nfs_resop4 resops[2+NFS42_LAYOUTSTATS_MAX_OPS];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs42_layoutstats_res layoutstats_res[NFS42_LAYOUTSTATS_MAX_OPS];
+    uint32_t i;
+
+    if (count > NFS42_LAYOUTSTATS_MAX_OPS)
+        count = NFS42_LAYOUTSTATS_MAX_OPS;
+
+    compound_init(&compound, session->client->root->nfsminorvers,
+        argops, resops, "layoutstats");
+
+    compound_add_op(&compound, OP_SEQUENCE,
+        &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = file;
+    putfh_args.in_recovery = 0;
+
+    for (i = 0; i < count; i++)
+        compound_add_op(&compound, OP_LAYOUTSTATS,
+            &stats[i], &layoutstats_res[i]);
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    compound_error(status = compound.res.status);
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
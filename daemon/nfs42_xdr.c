@@ -77,6 +77,55 @@ bool_t decode_op_allocate(
     return TRUE;
 }
 
+/*
+ * netloc4
+ */
+static bool_t xdr_netloc(
+    XDR *xdr,
+    nfs42_netloc *loc)
+{
+    char *netid, *uaddr, *name;
+    uint32_t len;
+
+    if (!xdr_uint32_t(xdr, &loc->type))
+        return FALSE;
+
+    switch (loc->type) {
+    case NL4_NAME:
+    case NL4_URL:
+        name = loc->u.name;
+        if (xdr->x_op == XDR_ENCODE)
+            len = (uint32_t)strlen(name);
+        if (!xdr_bytes(xdr, &name, &len, NFS4_OPAQUE_LIMIT))
+            return FALSE;
+        if (xdr->x_op == XDR_DECODE)
+            loc->u.name[len] = '\0';
+        return TRUE;
+
+    case NL4_NETADDR:
+        netid = loc->u.addr.netid;
+        if (xdr->x_op == XDR_ENCODE)
+            len = (uint32_t)strlen(netid);
+        if (!xdr_bytes(xdr, &netid, &len, NFS41_NETWORK_ID_LEN))
+            return FALSE;
+        if (xdr->x_op == XDR_DECODE)
+            loc->u.addr.netid[len] = '\0';
+
+        uaddr = loc->u.addr.uaddr;
+        if (xdr->x_op == XDR_ENCODE)
+            len = (uint32_t)strlen(uaddr);
+        if (!xdr_bytes(xdr, &uaddr, &len, NFS41_UNIVERSAL_ADDR_LEN))
+            return FALSE;
+        if (xdr->x_op == XDR_DECODE)
+            loc->u.addr.uaddr[len] = '\0';
+        return TRUE;
+
+    default:
+        eprintf("xdr_netloc: unknown netloc type %u\n", loc->type);
+        return FALSE;
+    }
+}
+
 /*
  * OP_COPY
  */
@@ -110,12 +159,20 @@ bool_t encode_op_copy(
     if (!xdr_bool(xdr, &args->synchronous))
         return FALSE;
 
-    /*
-     * FIXME: We do not support server-to-server copy yet
-    * |source_server_count| means intra-server copy
-    */
-    uint32_t source_server_count = 0;
-    return xdr_uint32_t(xdr, &source_server_count);
+    /* an empty |ca_source_server| means intra-server copy */
+    uint32_t source_server_count =
+        args->source_servers ? args->source_servers->count : 0;
+    uint32_t i;
+
+    if (!xdr_uint32_t(xdr, &source_server_count))
+        return FALSE;
+
+    for (i = 0; i < source_server_count; i++) {
+        if (!xdr_netloc(xdr,
+            (nfs42_netloc *)&args->source_servers->arr[i]))
+            return FALSE;
+    }
+    return TRUE;
 }
 
 static bool_t decode_write_response(
@@ -241,8 +298,10 @@ static bool_t decode_read_plus_res_ok(
     XDR *xdr,
     nfs42_read_plus_res_ok *res)
 {
-    nfs42_read_plus_content *contents = NULL;
+    nfs42_read_plus_content content;
     uint64_t read_data_len = 0ULL;
+    uint64_t hole_data_len = 0ULL;
+    uint32_t i, co;
 
     if (!xdr_bool(xdr, &res->eof)) {
         DPRINTF(0, ("decode eof failed\n"));
@@ -254,6 +313,8 @@ static bool_t decode_read_plus_res_ok(
         return FALSE;
     }
 
+    res->hole_len = 0L;
+
     /*
      * Note that |res->count==0| is a valid value for "READ_PLUS"
      * replies
@@ -263,16 +324,18 @@ static bool_t decode_read_plus_res_ok(
         return TRUE;
     }
 
-    contents = _alloca(res->count * sizeof(nfs42_read_plus_content));
-
-    uint32_t i, co;
-
+    /*
+     * The segments are decoded one at a time straight into the
+     * caller's buffer (which is the mapped user buffer for
+     * |NFS41_SYSOP_READ|), so we do not need a per-segment array
+     * sized by a number chosen by the server
+     */
     for (i = 0 ; i < res->count ; i++) {
         if (!xdr_uint32_t(xdr, &co)) {
             DPRINTF(0, ("i=%d, decode co failed\n", (int)i));
             return FALSE;
         }
-        contents[i].content = co;
+        content.content = co;
 
         switch(co) {
             case NFS4_CONTENT_DATA:
@@ -280,70 +343,93 @@ static bool_t decode_read_plus_res_ok(
                 DPRINTF(2,
                     ("i=%d, 'NFS4_CONTENT_DATA' content\n", (int)i));
 
-                if (!xdr_uint64_t(xdr, &contents[i].u.data.offset)) {
+                if (!xdr_uint64_t(xdr, &content.u.data.offset)) {
                     DPRINTF(0,
                         ("i=%d, decoding 'offset' failed\n", (int)i));
                     return FALSE;
                 }
-                if (!xdr_uint32_t(xdr, &contents[i].u.data.count)) {
+                if (!xdr_uint32_t(xdr, &content.u.data.count)) {
                     DPRINTF(0,
                         ("i=%d, decoding 'count' failed\n", (int)i));
                     return FALSE;
                 }
 
-                contents[i].u.data.data = res->data +
-                    (contents[i].u.data.offset - res->args_offset);
-                contents[i].u.data.data_len = contents[i].u.data.count;
+                if ((content.u.data.offset < res->args_offset) ||
+                    ((content.u.data.offset - res->args_offset) >
+                        res->data_len) ||
+                    (content.u.data.count > (res->data_len -
+                        (content.u.data.offset - res->args_offset)))) {
+                    eprintf("decode_read_plus_res_ok: i=%d, "
+                        "data segment (offset=%llu, count=%u) outside "
+                        "of the requested range\n",
+                        (int)i,
+                        (unsigned long long)content.u.data.offset,
+                        (unsigned int)content.u.data.count);
+                    return FALSE;
+                }
+
+                content.u.data.data = res->data +
+                    (content.u.data.offset - res->args_offset);
+                content.u.data.data_len = content.u.data.count;
 
-                EASSERT(((contents[i].u.data.data - res->data) +
-                    contents[i].u.data.data_len) <= res->data_len);
+#ifdef NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT
+                if (res->data_placed) {
+                    /* Received into |data| by libtirpc */
+                    res->data_placed = FALSE;
+                }
+                else
+#endif /* NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT */
                 if (!xdr_opaque(xdr,
-                    (char *)contents[i].u.data.data,
-                    contents[i].u.data.data_len)) {
+                    (char *)content.u.data.data,
+                    content.u.data.data_len)) {
                     DPRINTF(0,
                         ("i=%d, decoding 'bytes' failed\n", (int)i));
                     return FALSE;
                 }
                 read_data_len = __max((size_t)read_data_len,
-                    ((size_t)(contents[i].u.data.data - res->data) +
-                        (size_t)contents[i].u.data.data_len));
+                    ((size_t)(content.u.data.data - res->data) +
+                        (size_t)content.u.data.data_len));
             }
                 break;
             case NFS4_CONTENT_HOLE:
             {
-                unsigned char *hole_buff;
-                uint64_t hole_length;
+                uint64_t hole_start, hole_end;
 
                 DPRINTF(2,
                     ("i=%d, 'NFS4_CONTENT_HOLE' content\n", (int)i));
-                if (!xdr_uint64_t(xdr, &contents[i].u.hole.offset))
+                if (!xdr_uint64_t(xdr, &content.u.hole.offset))
                     return FALSE;
-                if (!xdr_uint64_t(xdr, &contents[i].u.hole.length))
+                if (!xdr_uint64_t(xdr, &content.u.hole.length))
                     return FALSE;
 
-
-                hole_buff = res->data +
-                    (contents[i].u.hole.offset - res->args_offset);
-                hole_length = contents[i].u.hole.length;
-
                 /*
-                 * NFSv4.2 "READ_PLUS" is required to return the
-                 * whole hole even if |hole.length| is bigger than
-                 * the requested size
+                 * NFSv4.2 "READ_PLUS" is allowed to return the
+                 * whole hole, even if it starts before the requested
+                 * offset or is bigger than the requested size, so
+                 * clip it to the buffer
                  */
-                if (((hole_buff - res->data) + hole_length) >
-                    res->data_len) {
-                    hole_length = (uint64_t)res->data_len -
-                        (hole_buff - res->data);
-                }
-
-                EASSERT(hole_length < UINT_MAX);
-                EASSERT(((hole_buff - res->data) + hole_length) <=
-                    res->data_len);
-                (void)memset(hole_buff, 0, (size_t)hole_length);
-
-                read_data_len = __max(read_data_len,
-                    ((hole_buff - res->data) + hole_length));
+                hole_start = __max(content.u.hole.offset,
+                    res->args_offset) - res->args_offset;
+                if ((NFS4_UINT64_MAX - content.u.hole.offset) <
+                    content.u.hole.length)
+                    hole_end = NFS4_UINT64_MAX - res->args_offset;
+                else if ((content.u.hole.offset +
+                    content.u.hole.length) > res->args_offset)
+                    hole_end = content.u.hole.offset +
+                        content.u.hole.length - res->args_offset;
+                else
+                    hole_end = 0;
+                hole_end = __min(hole_end, (uint64_t)res->data_len);
+
+                if (hole_start >= hole_end)
+                    break;
+
+                /* |memset()| uses the CPU's widest stores for this */
+                (void)memset(res->data + hole_start, 0,
+                    (size_t)(hole_end - hole_start));
+
+                hole_data_len += hole_end - hole_start;
+                read_data_len = __max(read_data_len, hole_end);
             }
                 break;
             default:
@@ -353,8 +439,9 @@ static bool_t decode_read_plus_res_ok(
         }
     }
 
-    EASSERT(read_data_len < UINT_MAX);
+    EASSERT(read_data_len <= res->data_len);
     res->data_len = (uint32_t)read_data_len;
+    res->hole_len = (uint32_t)hole_data_len;
     return TRUE;
 }
 
@@ -376,6 +463,136 @@ bool_t decode_op_read_plus(
     return TRUE;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_INTERSERVER_COPY
+/*
+ * OP_COPY_NOTIFY
+ */
+bool_t encode_op_copy_notify(
+    XDR *xdr,
+    nfs_argop4 *argop)
+{
+    nfs42_copy_notify_args *args = (nfs42_copy_notify_args *)argop->arg;
+
+    if (unexpected_op(argop->op, OP_COPY_NOTIFY))
+        return FALSE;
+
+    if (!xdr_stateid4(xdr, &args->src_stateid->stateid))
+        return FALSE;
+
+    return xdr_netloc(xdr, (nfs42_netloc *)args->destination);
+}
+
+bool_t decode_op_copy_notify(
+    XDR *xdr,
+    nfs_resop4 *resop)
+{
+    nfs42_copy_notify_res *res = (nfs42_copy_notify_res *)resop->res;
+    nfs42_netloc dummy;
+    uint32_t i, count;
+
+    if (unexpected_op(resop->op, OP_COPY_NOTIFY))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &res->status))
+        return FALSE;
+
+    if (res->status != NFS4_OK)
+        return TRUE;
+
+    if (!xdr_int64_t(xdr, &res->lease_time.seconds))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &res->lease_time.nseconds))
+        return FALSE;
+
+    if (!xdr_stateid4(xdr, res->stateid))
+        return FALSE;
+
+    /* cnr_source_server<>, keep the first |NFS42_MAX_NETLOCS| */
+    if (!xdr_uint32_t(xdr, &count))
+        return FALSE;
+    res->source_servers->count = min(count, NFS42_MAX_NETLOCS);
+    for (i = 0; i < count; i++) {
+        if (!xdr_netloc(xdr, (i < NFS42_MAX_NETLOCS) ?
+            &res->source_servers->arr[i] : &dummy))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * OP_OFFLOAD_CANCEL
+ */
+bool_t encode_op_offload_cancel(
+    XDR *xdr,
+    nfs_argop4 *argop)
+{
+    nfs42_offload_cancel_args *args =
+        (nfs42_offload_cancel_args *)argop->arg;
+
+    if (unexpected_op(argop->op, OP_OFFLOAD_CANCEL))
+        return FALSE;
+
+    return xdr_stateid4(xdr, args->stateid);
+}
+
+bool_t decode_op_offload_cancel(
+    XDR *xdr,
+    nfs_resop4 *resop)
+{
+    nfs42_offload_cancel_res *res = (nfs42_offload_cancel_res *)resop->res;
+
+    if (unexpected_op(resop->op, OP_OFFLOAD_CANCEL))
+        return FALSE;
+
+    return xdr_uint32_t(xdr, &res->status);
+}
+#endif /* NFS41_DRIVER_DAEMON_INTERSERVER_COPY */
+
+/*
+ * OP_OFFLOAD_STATUS
+ */
+bool_t encode_op_offload_status(
+    XDR *xdr,
+    nfs_argop4 *argop)
+{
+    nfs42_offload_status_args *args =
+        (nfs42_offload_status_args *)argop->arg;
+
+    if (unexpected_op(argop->op, OP_OFFLOAD_STATUS))
+        return FALSE;
+
+    return xdr_stateid4(xdr, args->stateid);
+}
+
+bool_t decode_op_offload_status(
+    XDR *xdr,
+    nfs_resop4 *resop)
+{
+    nfs42_offload_status_res *res = (nfs42_offload_status_res *)resop->res;
+
+    if (unexpected_op(resop->op, OP_OFFLOAD_STATUS))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &res->status))
+        return FALSE;
+
+    if (res->status != NFS4_OK)
+        return TRUE;
+
+    if (!xdr_uint64_t(xdr, &res->count))
+        return FALSE;
+
+    /* nfsstat4 osr_complete<1> */
+    if (!xdr_uint32_t(xdr, &res->complete_count))
+        return FALSE;
+    if (res->complete_count > 1)
+        return FALSE;
+    if (res->complete_count == 1)
+        return xdr_uint32_t(xdr, &res->complete_status);
+
+    return TRUE;
+}
+
 /*
  * OP_SEEK
  */
@@ -434,6 +651,63 @@ bool_t decode_op_seek(
     return TRUE;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+/*
+ * OP_WRITE_SAME
+ */
+bool_t encode_op_write_same(
+    XDR *xdr,
+    nfs_argop4 *argop)
+{
+    nfs42_write_same_args *args = (nfs42_write_same_args *)argop->arg;
+    nfs42_app_data_block *adb = &args->adb;
+    unsigned char *pattern = (unsigned char *)adb->pattern;
+
+    if (unexpected_op(argop->op, OP_WRITE_SAME))
+        return FALSE;
+
+    if (!xdr_stateid4(xdr, &args->stateid->stateid))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &args->stable))
+        return FALSE;
+
+    if (!xdr_uint64_t(xdr, &adb->offset))
+        return FALSE;
+    if (!xdr_uint64_t(xdr, &adb->block_size))
+        return FALSE;
+    if (!xdr_uint64_t(xdr, &adb->block_count))
+        return FALSE;
+    if (!xdr_uint64_t(xdr, &adb->reloff_blocknum))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &adb->block_num))
+        return FALSE;
+    if (!xdr_uint64_t(xdr, &adb->reloff_pattern))
+        return FALSE;
+
+    return xdr_bytes(xdr, (char **)&pattern, &adb->pattern_len,
+        adb->pattern_len);
+}
+
+bool_t decode_op_write_same(
+    XDR *xdr,
+    nfs_resop4 *resop)
+{
+    nfs42_write_same_res *res = (nfs42_write_same_res *)resop->res;
+
+    if (unexpected_op(resop->op, OP_WRITE_SAME))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &res->status))
+        return FALSE;
+
+    if (res->status == NFS4_OK)
+        return decode_write_response(xdr, &res->response);
+
+    return TRUE;
+}
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
+
 /*
  * OP_CLONE
  */
@@ -475,3 +749,200 @@ bool_t decode_op_clone(
 
     return TRUE;
 }
+
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+/*
+ * OP_LAYOUTERROR
+ */
+bool_t encode_op_layouterror(
+    XDR *xdr,
+    nfs_argop4 *argop)
+{
+    nfs42_layouterror_args *args = (nfs42_layouterror_args *)argop->arg;
+    uint32_t error_count = 1;
+
+    if (unexpected_op(argop->op, OP_LAYOUTERROR))
+        return FALSE;
+
+    if (!xdr_uint64_t(xdr, &args->offset))
+        return FALSE;
+
+    if (!xdr_uint64_t(xdr, &args->length))
+        return FALSE;
+
+    if (!xdr_stateid4(xdr, args->stateid))
+        return FALSE;
+
+    /* lea_errors<> */
+    if (!xdr_uint32_t(xdr, &error_count))
+        return FALSE;
+
+    if (!xdr_opaque(xdr, (char *)args->error.deviceid, PNFS_DEVICEID_SIZE))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &args->error.status))
+        return FALSE;
+
+    return xdr_uint32_t(xdr, &args->error.opnum);
+}
+
+bool_t decode_op_layouterror(
+    XDR *xdr,
+    nfs_resop4 *resop)
+{
+    nfs42_layouterror_res *res = (nfs42_layouterror_res *)resop->res;
+
+    if (unexpected_op(resop->op, OP_LAYOUTERROR))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &res->status))
+        return FALSE;
+
+    return TRUE;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+/*
+ * OP_LAYOUTSTATS
+ */
+static bool_t encode_io_info(
+    XDR *xdr,
+    nfs42_io_info *info)
+{
+    if (!xdr_uint64_t(xdr, &info->count))
+        return FALSE;
+
+    return xdr_uint64_t(xdr, &info->bytes);
+}
+
+static bool_t encode_usec_nfstime4(
+    XDR *xdr,
+    uint64_t usec)
+{
+    int64_t seconds = (int64_t)(usec / 1000000);
+    uint32_t nseconds = (uint32_t)(usec % 1000000) * 1000;
+
+    if (!xdr_int64_t(xdr, &seconds))
+        return FALSE;
+
+    return xdr_uint32_t(xdr, &nseconds);
+}
+
+/* ff_io_latency4, RFC 8435 section 9.2.1; we only count completed
+ * io, so requested and completed are the same */
+static bool_t encode_ff_io_latency(
+    XDR *xdr,
+    nfs42_io_info *info,
+    uint64_t busy)
+{
+    uint64_t not_delivered = 0;
+
+    if (!encode_io_info(xdr, info)) /* ffil_ops/bytes_requested */
+        return FALSE;
+    if (!encode_io_info(xdr, info)) /* ffil_ops/bytes_completed */
+        return FALSE;
+    if (!xdr_uint64_t(xdr, &not_delivered))
+        return FALSE;
+    if (!encode_usec_nfstime4(xdr, busy)) /* ffil_total_busy_time */
+        return FALSE;
+    return encode_usec_nfstime4(xdr, busy); /* ffil_aggregate_completion_time */
+}
+
+#define XDR_STRING_SIZE(len) (4 + (((len) + 3) & ~3))
+
+/* ff_layoutupdate4, RFC 8435 section 9.2.2 */
+static bool_t encode_ff_layoutupdate(
+    XDR *xdr,
+    nfs42_layoutstats_args *args)
+{
+    char *netid = (char *)args->ff_addr->netid;
+    char *uaddr = (char *)args->ff_addr->uaddr;
+    unsigned char *fh = (unsigned char *)args->ff_fh->fh;
+    uint32_t netid_len = (uint32_t)strlen(netid);
+    uint32_t uaddr_len = (uint32_t)strlen(uaddr);
+    uint32_t fh_len = args->ff_fh->len;
+    uint32_t body_len;
+    bool_t local = FALSE;
+
+    body_len = XDR_STRING_SIZE(netid_len) + XDR_STRING_SIZE(uaddr_len) +
+        XDR_STRING_SIZE(fh_len) +
+        2 * (5 * 8 + 2 * 12) + /* ffl_read, ffl_write */
+        12 + /* ffl_duration */
+        4; /* ffl_local */
+
+    /* lou_body<> */
+    if (!xdr_uint32_t(xdr, &body_len))
+        return FALSE;
+
+    if (!xdr_bytes(xdr, &netid, &netid_len, NFS41_NETWORK_ID_LEN))
+        return FALSE;
+    if (!xdr_bytes(xdr, &uaddr, &uaddr_len, NFS41_UNIVERSAL_ADDR_LEN))
+        return FALSE;
+    if (!xdr_bytes(xdr, (char **)&fh, &fh_len, NFS4_FHSIZE))
+        return FALSE;
+    if (!encode_ff_io_latency(xdr, &args->read, args->ff_read_busy))
+        return FALSE;
+    if (!encode_ff_io_latency(xdr, &args->write, args->ff_write_busy))
+        return FALSE;
+    if (!encode_usec_nfstime4(xdr, args->ff_duration))
+        return FALSE;
+    return xdr_bool(xdr, &local);
+}
+
+bool_t encode_op_layoutstats(
+    XDR *xdr,
+    nfs_argop4 *argop)
+{
+    nfs42_layoutstats_args *args = (nfs42_layoutstats_args *)argop->arg;
+    uint32_t type = (uint32_t)args->type;
+    uint32_t body_len = 0;
+
+    if (unexpected_op(argop->op, OP_LAYOUTSTATS))
+        return FALSE;
+
+    if (!xdr_uint64_t(xdr, &args->offset))
+        return FALSE;
+
+    if (!xdr_uint64_t(xdr, &args->length))
+        return FALSE;
+
+    if (!xdr_stateid4(xdr, args->stateid))
+        return FALSE;
+
+    if (!encode_io_info(xdr, &args->read))
+        return FALSE;
+
+    if (!encode_io_info(xdr, &args->write))
+        return FALSE;
+
+    if (!xdr_opaque(xdr, (char *)args->deviceid, PNFS_DEVICEID_SIZE))
+        return FALSE;
+
+    /* lsa_layoutupdate */
+    if (!xdr_uint32_t(xdr, &type))
+        return FALSE;
+
+    if (args->ff_addr && args->ff_fh)
+        return encode_ff_layoutupdate(xdr, args);
+
+    /* the file layout type defines no layoutupdate4 body */
+    return xdr_uint32_t(xdr, &body_len);
+}
+
+bool_t decode_op_layoutstats(
+    XDR *xdr,
+    nfs_resop4 *resop)
+{
+    nfs42_layoutstats_res *res = (nfs42_layoutstats_res *)resop->res;
+
+    if (unexpected_op(resop->op, OP_LAYOUTSTATS))
+        return FALSE;
+
+    if (!xdr_uint32_t(xdr, &res->status))
+        return FALSE;
+
+    return TRUE;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
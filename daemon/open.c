@@ -22,6 +22,7 @@
  */
 
 #include <Windows.h>
+#include <process.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <strsafe.h>
@@ -30,6 +31,7 @@
 #include "nfs41_ops.h"
 #include "nfs41_daemon.h"
 #include "delegation.h"
+#include "dirnotify.h"
 #include "from_kernel.h"
 #include "daemon_debug.h"
 #include "upcall.h"
@@ -37,6 +39,9 @@
 #include "util.h"
 #include "idmap.h"
 #include "accesstoken.h"
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+#include "name_cache.h"
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
 
 static int create_open_state(
     IN const char *path,
@@ -78,9 +83,30 @@ static int create_open_state(
     state->owner.owner_len = (uint32_t)strlen((const char*)state->owner.owner);
 
     InitializeSRWLock(&state->lock);
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+    InitializeSRWLock(&state->readahead.lock);
+    InitializeConditionVariable(&state->readahead.cond);
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    InitializeSRWLock(&state->extent_map.lock);
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+    InitializeSRWLock(&state->readdir_ahead.lock);
+    InitializeConditionVariable(&state->readdir_ahead.cond);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
+#ifdef NFS41_DRIVER_DAEMON_WRITE_GATHERING
+    InitializeSRWLock(&state->write_gather.lock);
+    InitializeConditionVariable(&state->write_gather.cond);
+    list_init(&state->write_gather.pending);
+#ifdef NFS41_DRIVER_PAGING_WRITE_CLUSTERING
+    list_init(&state->write_gather.clustered);
+#endif /* NFS41_DRIVER_PAGING_WRITE_CLUSTERING */
+#endif /* NFS41_DRIVER_DAEMON_WRITE_GATHERING */
     state->ref_count = 1; /* will be released in |cleanup_close()| */
     list_init(&state->locks.list);
     list_init(&state->client_entry);
+    list_init(&state->path_entry);
+    list_init(&state->fileid_entry);
     /*
      * Disable spin count as |state->locks.lock| is typically used to
      * protect list searches, which takes a long time
@@ -100,6 +126,51 @@ out_free:
     goto out;
 }
 
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+/*
+ * Create the open state for a |FILE_OPEN_BY_FILE_ID| open. NFSv4 has
+ * no way to look up a file by its fileid, so this only works for
+ * files in the name cache; the cache provides the path and the
+ * filehandles, and |do_open()| then uses |CLAIM_FH| for the OPEN
+ * instead of walking the path
+ */
+static int create_open_state_by_fileid(
+    IN nfs41_root *root,
+    IN uint64_t fileid,
+    IN uint32_t open_owner_id,
+    OUT nfs41_open_state **state_out,
+    OUT nfs41_file_info *info)
+{
+    nfs41_session *session = nfs41_root_session(root);
+    nfs41_abs_path path;
+    nfs41_fh parent_fh, file_fh;
+    nfs41_open_state *state;
+    int status;
+
+    InitializeSRWLock(&path.lock);
+    status = nfs41_name_cache_fileid_lookup(session_name_cache(session),
+        fileid, &path, &parent_fh, &file_fh, info);
+    if (status) {
+        DPRINTF(1, ("create_open_state_by_fileid(fileid=%llu): "
+            "not in name cache, status=%d\n", fileid, status));
+        status = ERROR_FILE_NOT_FOUND;
+        goto out;
+    }
+
+    status = create_open_state(path.path, open_owner_id, &state);
+    if (status)
+        goto out;
+
+    fh_copy(&state->parent.fh, &parent_fh);
+    fh_copy(&state->file.fh, &file_fh);
+    state->session = session;
+    state->open_by_fh = TRUE;
+    *state_out = state;
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
+
 static void open_state_free(
     IN nfs41_open_state *state)
 {
@@ -118,6 +189,15 @@ static void open_state_free(
         nfs41_delegation_deref(state->delegation.state);
     if (state->ea.list != INVALID_HANDLE_VALUE)
         free(state->ea.list);
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+    nfs41_readahead_shutdown(state);
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    free(state->extent_map.extents);
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+    nfs41_readdir_ahead_free(state);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
 
     DeleteCriticalSection(&state->ea.lock);
     DeleteCriticalSection(&state->locks.lock);
@@ -215,6 +295,14 @@ static void client_state_add(
 
     EnterCriticalSection(&client->state.lock);
     list_add_tail(&client->state.opens, &state->client_entry);
+    AcquireSRWLockShared(&state->path.lock);
+    list_add_tail(client_state_bucket(client->state.open_path_hash,
+        client_state_path_hash(state->path.path, state->path.len)),
+        &state->path_entry);
+    ReleaseSRWLockShared(&state->path.lock);
+    list_add_tail(client_state_bucket(client->state.open_fileid_hash,
+        client_state_fileid_hash(state->file.fh.fileid)),
+        &state->fileid_entry);
     LeaveCriticalSection(&client->state.lock);
 }
 
@@ -225,14 +313,46 @@ static void client_state_remove(
 
     EnterCriticalSection(&client->state.lock);
     list_remove(&state->client_entry);
+    list_remove(&state->path_entry);
+    list_remove(&state->fileid_entry);
+    LeaveCriticalSection(&client->state.lock);
+}
+
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+/*
+ * Returns |TRUE| if |client| has an open of |fileid| with write
+ * access, i.e. the size and times on the server might not include
+ * writes which are still cached in the kernel
+ */
+bool_t nfs41_client_file_open_for_write(
+    IN nfs41_client *client,
+    IN uint64_t fileid)
+{
+    struct list_entry *entry;
+    nfs41_open_state *open;
+    bool_t found = FALSE;
+
+    EnterCriticalSection(&client->state.lock);
+    list_for_each(entry, client_state_bucket(client->state.open_fileid_hash,
+        client_state_fileid_hash(fileid))) {
+        open = list_container(entry, nfs41_open_state, fileid_entry);
+        if ((open->file.fh.fileid == fileid) &&
+            (open->share_access & OPEN4_SHARE_ACCESS_WRITE)) {
+            found = TRUE;
+            break;
+        }
+    }
     LeaveCriticalSection(&client->state.lock);
+    return found;
 }
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
 
 static int do_open(
     IN OUT nfs41_open_state *state,
     IN uint32_t create,
     IN uint32_t createhow,
     IN nfs41_file_info *createattrs,
+    IN OPTIONAL const bitmap4 *createsetattrs,
     IN bool_t try_recovery,
     OUT nfs41_file_info *info)
 {
@@ -240,17 +360,72 @@ static int do_open(
     stateid4 open_stateid;
     open_delegation4 delegation = { 0 };
     nfs41_delegation_state *deleg_state = NULL;
+    nfs41_open_layoutget layoutget, *layoutget_arg = NULL;
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+    extern nfs41_daemon_globals nfs41_dg;
+    nfs41_open_read openread, *openread_arg = NULL;
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
     int status;
 
-    claim.claim = CLAIM_NULL;
-    claim.u.null.filename = &state->file.name;
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    if (state->open_by_fh) {
+        /* CURRENT_FH is the file itself, see |FILE_OPEN_BY_FILE_ID| */
+        claim.claim = CLAIM_FH;
+    }
+    else
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
+    {
+        claim.claim = CLAIM_NULL;
+        claim.u.null.filename = &state->file.name;
+    }
+
+    /*
+     * On pNFS exports, ask for the layout in the OPEN compound instead
+     * of with a separate LAYOUTGET on the first read or write. Not for
+     * creates, which must not be sent again if the server asks us to
+     * retry the compound because of the LAYOUTGET
+     */
+    if ((create == OPEN4_NOCREATE) &&
+        (pnfs_layout_state_open_check(state,
+            &layoutget.type) == PNFS_SUCCESS)) {
+        layoutget.iomode = (state->share_access & OPEN4_SHARE_ACCESS_WRITE) ?
+            PNFS_IOMODE_RW : PNFS_IOMODE_READ;
+        list_init(&layoutget.res.layouts);
+        layoutget_arg = &layoutget;
+    }
+
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+    /*
+     * "--openprefetch": READ the start of an existing regular file in
+     * the OPEN compound, for the file's first READ upcalls
+     */
+    if ((nfs41_dg.open_prefetch_size > 0) && (create == OPEN4_NOCREATE) &&
+        (layoutget_arg == NULL) && (state->type == NF4REG) &&
+        (state->share_access & OPEN4_SHARE_ACCESS_READ)) {
+        openread.count = min(nfs41_dg.open_prefetch_size,
+            max_read_size(state->session, &state->file.fh));
+        openread.buffer = malloc(openread.count);
+        if (openread.buffer)
+            openread_arg = &openread;
+    }
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
 
     status = nfs41_open(state->session, &state->parent, &state->file,
         &state->owner, &claim, state->share_access, state->share_deny,
-        create, createhow, createattrs, TRUE, &open_stateid,
-        &delegation, info);
-    if (status)
+        create, createhow, createattrs, createsetattrs, TRUE, &open_stateid,
+        &delegation, info, layoutget_arg,
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+        openread_arg
+#else
+        NULL
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
+        );
+    if (status) {
+        if (layoutget_arg)
+            pnfs_layout_state_open_layoutget(state, layoutget.iomode,
+                status, &layoutget.res);
         goto out;
+    }
 
     /* allocate delegation state and register it with the client */
     nfs41_delegation_granted(state->session, &state->parent,
@@ -268,7 +443,25 @@ static int do_open(
     state->do_close = 1;
     state->delegation.state = deleg_state;
     ReleaseSRWLockExclusive(&state->lock);
+
+    if (layoutget_arg)
+        pnfs_layout_state_open_layoutget(state, layoutget.iomode,
+            layoutget.status, &layoutget.res);
+
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+    if (openread_arg && (openread.status == NFS4_OK)) {
+        DPRINTF(2, ("do_open('%s'): prefetched len=%lu eof=%d\n",
+            state->path.path, (unsigned long)openread.len,
+            (int)openread.eof));
+        nfs41_readahead_prefetched(state, openread.buffer, openread.len,
+            openread.eof);
+    }
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
 out:
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+    if (openread_arg)
+        free(openread.buffer);
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
     return status;
 }
 
@@ -277,6 +470,7 @@ static int open_or_delegate(
     IN uint32_t create,
     IN uint32_t createhow,
     IN nfs41_file_info *createattrs,
+    IN OPTIONAL const bitmap4 *createsetattrs,
     IN bool_t try_recovery,
     OUT nfs41_file_info *info)
 {
@@ -288,7 +482,7 @@ static int open_or_delegate(
     /* get an open stateid if we have no delegation stateid */
     if (status)
         status = do_open(state, create, createhow,
-            createattrs, try_recovery, info);
+            createattrs, createsetattrs, try_recovery, info);
 
     state->pnfs_last_offset = info->size ? info->size - 1 : 0;
 
@@ -356,6 +550,11 @@ static int parse_open(
     if (status) goto out;
     status = safe_read(&buffer, &length, &args->ea, sizeof(HANDLE));
     if (status) goto out;
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    status = safe_read(&buffer, &length, &args->open_fileid,
+        sizeof(ULONGLONG));
+    if (status) goto out;
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
 
     EASSERT_MSG((length == 0),
         ("parse_open: filename='%s' leftover length=%ld\n",
@@ -506,10 +705,144 @@ static void map_access_2_allowdeny(ULONG access_mask, ULONG access_mode,
 #endif
 }
 
-static int check_execute_access(nfs41_open_state *state)
+#ifdef NFS41_DRIVER_DAEMON_ACCESS_CACHE
+/*
+ * ACCESS result cache
+ *
+ * Caches the ACCESS results of |check_execute_access()| per user
+ * (token AuthenticationId/ModifiedId and uid/gid) and file
+ * (superblock and fileid), so opening the same executable again
+ * does not send an ACCESS compound each time.
+ * An entry is only used if the change attribute from the lookup
+ * still matches (a chmod or ACL change bumps it) and it is younger
+ * than |ACCESSCACHE_TTL| seconds, to pick up changes of the user's
+ * server side group membership eventually.
+ * The cache is direct-mapped, a collision just replaces the entry.
+ */
+#define ACCESSCACHE_SIZE 256 /* must be a power of two */
+#define ACCESSCACHE_TTL 60
+
+typedef struct _accesscache_entry {
+    token_cache_key key;
+    util_reltimestamp timestamp;
+    uid_t uid;
+    gid_t gid;
+    const nfs41_superblock *superblock;
+    uint64_t fileid;
+    uint64_t change;
+    uint32_t requested;
+    uint32_t supported;
+    uint32_t access;
+    bool valid;
+} accesscache_entry;
+
+static struct {
+    SRWLOCK lock;
+    accesscache_entry entries[ACCESSCACHE_SIZE];
+} accesscache = { .lock = SRWLOCK_INIT };
+
+static __inline accesscache_entry *accesscache_slot(
+    IN const token_cache_key *key,
+    IN uint64_t fileid)
+{
+    return &accesscache.entries[
+        ((DWORD)fileid ^ (DWORD)(fileid >> 32) ^
+            key->authenticationid.LowPart) &
+        (ACCESSCACHE_SIZE - 1)];
+}
+
+static __inline bool accesscache_match(
+    IN const accesscache_entry *e,
+    IN const token_cache_key *key,
+    IN const nfs41_upcall *upcall,
+    IN const nfs41_superblock *superblock,
+    IN const nfs41_file_info *info,
+    IN uint32_t requested)
+{
+    return e->valid &&
+        (e->fileid == info->fileid) && (e->change == info->change) &&
+        (e->superblock == superblock) && (e->requested == requested) &&
+        (e->uid == upcall->uid) && (e->gid == upcall->gid) &&
+        (memcmp(&e->key, key, sizeof(token_cache_key)) == 0) &&
+        ((UTIL_GETRELTIME() - e->timestamp) < ACCESSCACHE_TTL);
+}
+#endif /* NFS41_DRIVER_DAEMON_ACCESS_CACHE */
+
+/*
+ * |nfs41_access()| with the results cached by
+ * |NFS41_DRIVER_DAEMON_ACCESS_CACHE|. |info| are the attributes of
+ * |state->file| from the lookup, the cache is bypassed if they
+ * lack fileid or change attribute.
+ */
+static int access_cached(
+    IN const nfs41_upcall *upcall,
+    IN nfs41_open_state *state,
+    IN const nfs41_file_info *info,
+    IN uint32_t requested,
+    OUT uint32_t *supported,
+    OUT uint32_t *access)
+{
+    int status;
+#ifdef NFS41_DRIVER_DAEMON_ACCESS_CACHE
+    const nfs41_superblock *superblock = state->file.fh.superblock;
+    token_cache_key key;
+    accesscache_entry *e;
+    bool use_cache;
+    bool hit = false;
+
+    use_cache = superblock &&
+        bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_FILEID) &&
+        bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_CHANGE) &&
+        get_token_cache_key(GetCurrentThreadToken(), &key);
+    if (use_cache) {
+        AcquireSRWLockShared(&accesscache.lock);
+        e = accesscache_slot(&key, info->fileid);
+        if (accesscache_match(e, &key, upcall, superblock, info,
+            requested)) {
+            *supported = e->supported;
+            *access = e->access;
+            hit = true;
+        }
+        ReleaseSRWLockShared(&accesscache.lock);
+        if (hit) {
+            DPRINTF(2, ("access_cached: cache hit for '%s'\n",
+                state->path.path));
+            return NFS4_OK;
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_ACCESS_CACHE */
+
+    status = nfs41_access(state->session, &state->file,
+        requested, supported, access);
+
+#ifdef NFS41_DRIVER_DAEMON_ACCESS_CACHE
+    if ((status == NFS4_OK) && use_cache) {
+        AcquireSRWLockExclusive(&accesscache.lock);
+        e = accesscache_slot(&key, info->fileid);
+        e->key = key;
+        e->timestamp = UTIL_GETRELTIME();
+        e->uid = upcall->uid;
+        e->gid = upcall->gid;
+        e->superblock = superblock;
+        e->fileid = info->fileid;
+        e->change = info->change;
+        e->requested = requested;
+        e->supported = *supported;
+        e->access = *access;
+        e->valid = true;
+        ReleaseSRWLockExclusive(&accesscache.lock);
+    }
+#endif /* NFS41_DRIVER_DAEMON_ACCESS_CACHE */
+    return status;
+}
+
+static int check_execute_access(
+    IN const nfs41_upcall *upcall,
+    IN nfs41_open_state *state,
+    IN const nfs41_file_info *info)
 {
     uint32_t supported, access;
-    int status = nfs41_access(state->session, &state->file,
+    int status = access_cached(upcall, state, info,
         ACCESS4_EXECUTE | ACCESS4_READ, &supported, &access);
     if (status) {
         eprintf("nfs41_access() failed with '%s' for '%s'\n",
@@ -751,6 +1084,509 @@ out:
 }
 #endif /* NFS41_DRIVER_FEATURE_LOCAL_UIDGID_IN_NFSV3ATTRIBUTES */
 
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+/*
+ * Deferred CLOSE
+ *
+ * Build tools open, stat and close the same files over and over, and
+ * each cycle is a full OPEN/CLOSE pair on the wire. When the last
+ * handle of a plain regular file open (no deny modes, no delegation,
+ * no byte-range locks) is closed, |handle_close()| parks the open
+ * state here for "closetimeo" seconds instead of sending the CLOSE.
+ * A later open of the same file by the same user with the same share
+ * access takes over the open stateid instead of sending a new OPEN.
+ *
+ * Parked opens are closed when they expire, before any other OPEN or
+ * a REMOVE of the same file, when a delegation for the file is
+ * returned, on unmount, and when more than |DEFERRED_CLOSE_MAX| opens
+ * are parked.
+ * Parked opens stay on the client's list of open state, so they are
+ * reclaimed during state recovery like any other open.
+ *
+ * Asynchronous CLOSE (|NFS41_DRIVER_DAEMON_ASYNC_CLOSE|): An open which
+ * cannot be parked is put on |deferred_close.async_list| instead, and
+ * the CLOSE upcall completes without waiting for the server. The
+ * thread sends these CLOSEs first, in the order they were queued.
+ * An open on |async_list| is never reused, it is closed before any
+ * other OPEN or REMOVE of the same file like a parked open, and
+ * |async_close_wait()| makes these callers wait for a CLOSE which is
+ * in flight.
+ */
+#define DEFERRED_CLOSE_MAX 256
+
+static struct {
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+    /* earliest expiration first, see |deferred_close_insert()| */
+    struct list_entry list;
+    uint32_t count;
+    bool thread_running;
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+    CONDITION_VARIABLE done; /* signalled when a CLOSE is done */
+    struct list_entry async_list; /* oldest first */
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+} deferred_close = {
+    .lock = SRWLOCK_INIT,
+    .cond = CONDITION_VARIABLE_INIT,
+    .list = { &deferred_close.list, &deferred_close.list },
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+    .done = CONDITION_VARIABLE_INIT,
+    .async_list = { &deferred_close.async_list, &deferred_close.async_list },
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+};
+
+static int do_nfs41_close(nfs41_open_state *state);
+
+static __inline bool deferred_close_fh_equal(
+    IN const nfs41_fh *fh1,
+    IN const nfs41_fh *fh2)
+{
+    return (fh1->len == fh2->len) && (!memcmp(fh1->fh, fh2->fh, fh1->len));
+}
+
+/* send the CLOSE for a state removed from |deferred_close.list| */
+static void deferred_close_send(
+    IN nfs41_open_state *state)
+{
+    DPRINTF(1, ("deferred_close_send('%s')\n", state->path.path));
+
+    (void)do_nfs41_close(state);
+    client_state_remove(state);
+    /*
+     * release the reference from |deferred_close_park()| or
+     * |async_close_queue()|
+     */
+    nfs41_open_state_deref(state);
+}
+
+/* send the CLOSEs for all states on |list| */
+static void deferred_close_send_list(
+    IN struct list_entry *list)
+{
+    struct list_entry *entry, *tmp;
+
+    list_for_each_tmp(entry, tmp, list) {
+        list_remove(entry);
+        deferred_close_send(list_container(entry,
+            nfs41_open_state, deferred_close.entry));
+    }
+}
+
+/* expects the caller to hold |deferred_close.lock| exclusively */
+static void deferred_close_unlink(
+    IN nfs41_open_state *state)
+{
+    list_remove(&state->deferred_close.entry);
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+    if (state->deferred_close.async)
+        return;
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+    deferred_close.count--;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+/*
+ * Send the CLOSE for the first state on |deferred_close.async_list|.
+ * Expects the caller to hold |deferred_close.lock| exclusively, the
+ * lock is released while the CLOSE is in flight
+ */
+static void async_close_send(
+    IN nfs41_open_state *state)
+{
+    /* stays on the list until the CLOSE is done */
+    state->deferred_close.sending = true;
+    ReleaseSRWLockExclusive(&deferred_close.lock);
+
+    DPRINTF(1, ("async_close_send('%s')\n", state->path.path));
+    (void)do_nfs41_close(state);
+    client_state_remove(state);
+
+    AcquireSRWLockExclusive(&deferred_close.lock);
+    deferred_close_unlink(state);
+    WakeAllConditionVariable(&deferred_close.done);
+    ReleaseSRWLockExclusive(&deferred_close.lock);
+
+    /* release the reference from |async_close_queue()| */
+    nfs41_open_state_deref(state);
+    AcquireSRWLockExclusive(&deferred_close.lock);
+}
+
+/*
+ * Wait until no CLOSE for an open of |fh| (or, if |fh| is |NULL|, of
+ * |root|) is in flight. Expects the caller to hold
+ * |deferred_close.lock| exclusively
+ */
+static void async_close_wait(
+    IN nfs41_root *root,
+    IN nfs41_client *client,
+    IN OPTIONAL const nfs41_fh *fh)
+{
+    struct list_entry *entry;
+
+restart:
+    list_for_each(entry, &deferred_close.async_list) {
+        nfs41_open_state *ps = list_container(entry,
+            nfs41_open_state, deferred_close.entry);
+
+        if (!ps->deferred_close.sending)
+            continue;
+        if (fh?
+            ((ps->session->client != client) ||
+                (!deferred_close_fh_equal(&ps->file.fh, fh))):
+            (ps->session->client->root != root))
+            continue;
+
+        (void)SleepConditionVariableSRW(&deferred_close.done,
+            &deferred_close.lock, INFINITE, 0);
+        goto restart;
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+
+static unsigned int WINAPI deferred_close_thread(void *args)
+{
+    nfs41_open_state *state;
+    ULONGLONG now;
+
+    AcquireSRWLockExclusive(&deferred_close.lock);
+    for (;;) {
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+        if (!list_empty(&deferred_close.async_list)) {
+            async_close_send(list_container(deferred_close.async_list.next,
+                nfs41_open_state, deferred_close.entry));
+            continue;
+        }
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+        if (list_empty(&deferred_close.list)) {
+            (void)SleepConditionVariableSRW(&deferred_close.cond,
+                &deferred_close.lock, INFINITE, 0);
+            continue;
+        }
+
+        state = list_container(deferred_close.list.next,
+            nfs41_open_state, deferred_close.entry);
+        now = GetTickCount64();
+        if (state->deferred_close.expiration > now) {
+            (void)SleepConditionVariableSRW(&deferred_close.cond,
+                &deferred_close.lock,
+                (DWORD)(state->deferred_close.expiration - now), 0);
+            continue;
+        }
+
+        deferred_close_unlink(state);
+        ReleaseSRWLockExclusive(&deferred_close.lock);
+        deferred_close_send(state);
+        AcquireSRWLockExclusive(&deferred_close.lock);
+    }
+    /* NOTREACHED */
+    return 0;
+}
+
+/* expects the caller to hold |deferred_close.lock| exclusively */
+static bool deferred_close_start_thread(void)
+{
+    HANDLE thread;
+
+    if (deferred_close.thread_running)
+        return true;
+
+    thread = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
+        deferred_close_thread, NULL, 0, NULL);
+    if (thread == NULL) {
+        eprintf("deferred_close_start_thread: "
+            "_beginthreadex() failed with %d\n", (int)GetLastError());
+        return false;
+    }
+    (void)CloseHandle(thread);
+    deferred_close.thread_running = true;
+    return true;
+}
+
+/*
+ * Add |state| to |deferred_close.list| in expiration order, the mounts
+ * can have different "closetimeo" values. Expects the caller to hold
+ * |deferred_close.lock| exclusively
+ */
+static void deferred_close_insert(
+    IN nfs41_open_state *state)
+{
+    struct list_entry *entry;
+
+    /* most of the time |state| expires last */
+    list_for_each_reverse(entry, &deferred_close.list) {
+        if (list_container(entry, nfs41_open_state,
+            deferred_close.entry)->deferred_close.expiration <=
+            state->deferred_close.expiration)
+            break;
+    }
+    list_add(&state->deferred_close.entry, entry, entry->next);
+}
+
+/*
+ * Park |state| instead of closing it, returns |false| if the caller
+ * must send the CLOSE itself
+ */
+static bool deferred_close_park(
+    IN nfs41_open_state *state,
+    IN uint32_t uid,
+    IN uint32_t gid)
+{
+    struct list_entry evicted;
+    uint32_t close_timeout = state->session->client->root->close_timeout;
+    bool parked = false;
+
+    if ((close_timeout == 0) ||
+        (state->type != NF4REG) ||
+        (!state->do_close) ||
+        (state->share_deny != OPEN4_SHARE_DENY_NONE))
+        return false;
+
+    AcquireSRWLockShared(&state->lock);
+    if (state->delegation.state) {
+        ReleaseSRWLockShared(&state->lock);
+        return false;
+    }
+    ReleaseSRWLockShared(&state->lock);
+
+    EnterCriticalSection(&state->locks.lock);
+    if (!list_empty(&state->locks.list)) {
+        LeaveCriticalSection(&state->locks.lock);
+        return false;
+    }
+    LeaveCriticalSection(&state->locks.lock);
+
+    list_init(&evicted);
+
+    AcquireSRWLockExclusive(&deferred_close.lock);
+    if (!deferred_close_start_thread())
+        goto out_unlock;
+
+    /* released in |deferred_close_send()| */
+    nfs41_open_state_ref(state);
+    state->deferred_close.expiration =
+        GetTickCount64() + (ULONGLONG)close_timeout * 1000ULL;
+    state->deferred_close.uid = uid;
+    state->deferred_close.gid = gid;
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+    state->deferred_close.async = false;
+    state->deferred_close.sending = false;
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+    deferred_close_insert(state);
+    deferred_close.count++;
+    parked = true;
+
+    /* ... and make room by closing the ones which expire first */
+    while (deferred_close.count > DEFERRED_CLOSE_MAX) {
+        struct list_entry *first = deferred_close.list.next;
+
+        deferred_close_unlink(list_container(first,
+            nfs41_open_state, deferred_close.entry));
+        list_add_tail(&evicted, first);
+    }
+    WakeConditionVariable(&deferred_close.cond);
+out_unlock:
+    ReleaseSRWLockExclusive(&deferred_close.lock);
+
+    deferred_close_send_list(&evicted);
+
+    DPRINTF(1, ("deferred_close_park('%s'): parked=%d\n",
+        state->path.path, (int)parked));
+    return parked;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+/*
+ * Queue the CLOSE of |state| for |deferred_close_thread()|, returns
+ * |false| if the caller must send the CLOSE itself
+ */
+static bool async_close_queue(
+    IN nfs41_open_state *state)
+{
+    bool queued = false;
+
+    if ((state->type != NF4REG) || (!state->do_close))
+        return false;
+
+    /* CLOSE fails with NFS4ERR_LOCKS_HELD, let the caller see that */
+    EnterCriticalSection(&state->locks.lock);
+    if (!list_empty(&state->locks.list)) {
+        LeaveCriticalSection(&state->locks.lock);
+        return false;
+    }
+    LeaveCriticalSection(&state->locks.lock);
+
+    AcquireSRWLockExclusive(&deferred_close.lock);
+    if (!deferred_close_start_thread())
+        goto out_unlock;
+
+    /* released in |async_close_send()| or |deferred_close_send()| */
+    nfs41_open_state_ref(state);
+    state->deferred_close.async = true;
+    state->deferred_close.sending = false;
+    list_add_tail(&deferred_close.async_list, &state->deferred_close.entry);
+    queued = true;
+    WakeConditionVariable(&deferred_close.cond);
+out_unlock:
+    ReleaseSRWLockExclusive(&deferred_close.lock);
+
+    DPRINTF(1, ("async_close_queue('%s'): queued=%d\n",
+        state->path.path, (int)queued));
+    return queued;
+}
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+
+/*
+ * Look for a parked open of |state->file| with the same session,
+ * share access/deny and user. If there is one, |state| takes over its
+ * open stateid, otherwise all parked opens of the file are closed so
+ * they cannot conflict with the OPEN the caller sends
+ */
+static bool deferred_close_reuse(
+    IN OUT nfs41_open_state *state,
+    IN uint32_t uid,
+    IN uint32_t gid)
+{
+    struct list_entry *entry, *tmp;
+    struct list_entry conflicts;
+    nfs41_open_state *parked = NULL;
+
+    if (state->file.fh.len == 0)
+        return false;
+
+    list_init(&conflicts);
+
+    AcquireSRWLockExclusive(&deferred_close.lock);
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+    async_close_wait(NULL, state->session->client, &state->file.fh);
+    list_for_each_tmp(entry, tmp, &deferred_close.async_list) {
+        nfs41_open_state *ps = list_container(entry,
+            nfs41_open_state, deferred_close.entry);
+
+        if ((ps->session->client == state->session->client) &&
+            deferred_close_fh_equal(&ps->file.fh, &state->file.fh)) {
+            deferred_close_unlink(ps);
+            list_add_tail(&conflicts, entry);
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+    list_for_each_tmp(entry, tmp, &deferred_close.list) {
+        nfs41_open_state *ps = list_container(entry,
+            nfs41_open_state, deferred_close.entry);
+
+        if ((ps->session->client != state->session->client) ||
+            (!deferred_close_fh_equal(&ps->file.fh, &state->file.fh)))
+            continue;
+
+        deferred_close_unlink(ps);
+        if ((parked == NULL) &&
+            (ps->session == state->session) &&
+            (ps->share_access == state->share_access) &&
+            (ps->share_deny == state->share_deny) &&
+            (ps->deferred_close.uid == uid) &&
+            (ps->deferred_close.gid == gid))
+            parked = ps;
+        else
+            list_add_tail(&conflicts, entry);
+    }
+    ReleaseSRWLockExclusive(&deferred_close.lock);
+
+    deferred_close_send_list(&conflicts);
+
+    if (parked == NULL)
+        return false;
+
+    DPRINTF(1, ("deferred_close_reuse('%s'): reusing open stateid\n",
+        state->path.path));
+
+    AcquireSRWLockShared(&parked->lock);
+    AcquireSRWLockExclusive(&state->lock);
+    stateid4_cpy(&state->stateid, &parked->stateid);
+    state->do_close = 1;
+    ReleaseSRWLockExclusive(&state->lock);
+    ReleaseSRWLockShared(&parked->lock);
+
+    /* the stateid now belongs to |state|, drop |parked| without CLOSE */
+    client_state_remove(parked);
+    nfs41_open_state_deref(parked);
+    return true;
+}
+
+/* close all parked opens of |fh| */
+void nfs41_deferred_close_flush_file(
+    IN nfs41_client *client,
+    IN const nfs41_fh *fh)
+{
+    struct list_entry *entry, *tmp;
+    struct list_entry flush;
+
+    list_init(&flush);
+
+    AcquireSRWLockExclusive(&deferred_close.lock);
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+    async_close_wait(NULL, client, fh);
+    list_for_each_tmp(entry, tmp, &deferred_close.async_list) {
+        nfs41_open_state *ps = list_container(entry,
+            nfs41_open_state, deferred_close.entry);
+
+        if ((ps->session->client == client) &&
+            deferred_close_fh_equal(&ps->file.fh, fh)) {
+            deferred_close_unlink(ps);
+            list_add_tail(&flush, entry);
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+    list_for_each_tmp(entry, tmp, &deferred_close.list) {
+        nfs41_open_state *ps = list_container(entry,
+            nfs41_open_state, deferred_close.entry);
+
+        if ((ps->session->client == client) &&
+            deferred_close_fh_equal(&ps->file.fh, fh)) {
+            deferred_close_unlink(ps);
+            list_add_tail(&flush, entry);
+        }
+    }
+    ReleaseSRWLockExclusive(&deferred_close.lock);
+
+    deferred_close_send_list(&flush);
+}
+
+/* close all parked opens of |root|, must be called before unmount */
+void nfs41_deferred_close_flush_root(
+    IN nfs41_root *root)
+{
+    struct list_entry *entry, *tmp;
+    struct list_entry flush;
+
+    list_init(&flush);
+
+    AcquireSRWLockExclusive(&deferred_close.lock);
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+    async_close_wait(root, NULL, NULL);
+    list_for_each_tmp(entry, tmp, &deferred_close.async_list) {
+        nfs41_open_state *ps = list_container(entry,
+            nfs41_open_state, deferred_close.entry);
+
+        if (ps->session->client->root == root) {
+            deferred_close_unlink(ps);
+            list_add_tail(&flush, entry);
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
+    list_for_each_tmp(entry, tmp, &deferred_close.list) {
+        nfs41_open_state *ps = list_container(entry,
+            nfs41_open_state, deferred_close.entry);
+
+        if (ps->session->client->root == root) {
+            deferred_close_unlink(ps);
+            list_add_tail(&flush, entry);
+        }
+    }
+    ReleaseSRWLockExclusive(&deferred_close.lock);
+
+    deferred_close_send_list(&flush);
+}
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+
 static int handle_open(void *daemon_context, nfs41_upcall *upcall)
 {
     int status = 0;
@@ -781,9 +1617,11 @@ static int handle_open(void *daemon_context, nfs41_upcall *upcall)
     EASSERT_MSG(!(args->create_opts & FILE_COMPLETE_IF_OPLOCKED),
         ("handle_open: file='%s': "
         "FILE_COMPLETE_IF_OPLOCKED not supported\n", args->path));
+#ifndef NFS41_DRIVER_OPEN_BY_FILEID
     EASSERT_MSG(!(args->create_opts & FILE_OPEN_BY_FILE_ID),
         ("handle_open: file='%s': "
         "FILE_OPEN_BY_FILE_ID not supported\n", args->path));
+#endif /* !NFS41_DRIVER_OPEN_BY_FILEID */
     /*
      * Kernel rejects |FILE_OPEN_REQUIRING_OPLOCK|, we just use
      * this here as safeguard
@@ -798,6 +1636,20 @@ static int handle_open(void *daemon_context, nfs41_upcall *upcall)
         ("handle_open: file='%s': "
         "FILE_RESERVE_OPFILTER not supported\n", args->path));
 
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    if (args->create_opts & FILE_OPEN_BY_FILE_ID) {
+        /* the kernel only sends |FILE_OPEN| for opens by file id */
+        if (args->disposition != FILE_OPEN) {
+            status = ERROR_INVALID_PARAMETER;
+            goto out;
+        }
+        status = create_open_state_by_fileid(upcall->root_ref,
+            args->open_fileid, args->open_owner_id, &state, &info);
+        if (status == ERROR_FILE_NOT_FOUND)
+            goto out;
+    }
+    else
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
     status = create_open_state(args->path, args->open_owner_id, &state);
     if (status) {
         eprintf("handle_open(args->path='%s'): "
@@ -814,6 +1666,13 @@ static int handle_open(void *daemon_context, nfs41_upcall *upcall)
     else
         state->type = NF4REG;
 
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    if (state->open_by_fh) {
+        /* filehandles and |info| are from the name cache */
+        status = NO_ERROR;
+    }
+    else
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
     // always do a lookup
     status = nfs41_lookup(upcall->root_ref, nfs41_root_session(upcall->root_ref),
         is_caseinsensitive_volume, &state->path,
@@ -1043,7 +1902,11 @@ static int handle_open(void *daemon_context, nfs41_upcall *upcall)
          */
     } else {
         nfs41_file_info createattrs;
+        bitmap4 *createsetattrs_arg = NULL;
         uint32_t create = 0, createhowmode = 0, lookup_status = status;
+#ifdef NFS41_DRIVER_SETGID_NEWGRP_SUPPORT
+        bitmap4 createsetattrs = { 0 };
+#endif /* NFS41_DRIVER_SETGID_NEWGRP_SUPPORT */
 
         if (!lookup_status && (args->disposition == FILE_OVERWRITE ||
                 args->disposition == FILE_OVERWRITE_IF ||
@@ -1074,11 +1937,54 @@ static int handle_open(void *daemon_context, nfs41_upcall *upcall)
             goto out_free_state;
 
         if (args->access_mask & FILE_EXECUTE && state->file.fh.len) {
-            status = check_execute_access(state);
+            /* |info| is from the |nfs41_lookup()| above */
+            status = check_execute_access(upcall, state, &info);
             if (status)
                 goto out_free_state;
         }
 
+#ifdef NFS41_DRIVER_SETGID_NEWGRP_SUPPORT
+        /*
+         * Hack: Support |setgid()|/newgrp(1)/sg(1)/winsg(1) by
+         * fetching groupname from auth token for new files and
+         * do a "manual" chgrp on the new file
+         *
+         * The chgrp is a SETATTR in the same compound as the OPEN
+         * (or a separate SETATTR after the CREATE of a directory),
+         * so a failure (e.g. an unknown group name) does not fail
+         * the create.
+         * Note that |RPCSEC_AUTH_NONE| does not have any
+         * user/group information, therefore newgrp will be a
+         * NOP here.
+         */
+        if ((create == OPEN4_CREATE) &&
+            (state->session->client->rpc->sec_flavor !=
+                RPCSEC_AUTH_NONE)) {
+            char *s;
+
+            createattrs.owner_group = createattrs.owner_group_buf;
+            /* fixme: we should store the |owner_group| name in |upcall| */
+            if (get_token_primarygroup_name(upcall->currentthread_token,
+                createattrs.owner_group)) {
+                s = createattrs.owner_group+strlen(createattrs.owner_group);
+                s = stpcpy(s, "@");
+                (void)stpcpy(s, nfs41dg->localdomain_name);
+                DPRINTF(1, ("handle_open(state->file.name.name='%s'): "
+                    "OPEN4_CREATE: owner_group='%s'\n",
+                    state->file.name.name,
+                    createattrs.owner_group));
+                bitmap_set(&createsetattrs, 1, FATTR4_WORD1_OWNER_GROUP);
+                createsetattrs_arg = &createsetattrs;
+            }
+            else {
+                eprintf("handle_open(args->path='%s'): "
+                    "OPEN4_CREATE: "
+                    "get_token_primarygroup_name() failed.\n",
+                    args->path);
+            }
+        }
+#endif /* NFS41_DRIVER_SETGID_NEWGRP_SUPPORT */
+
 supersede_retry:
         // XXX file exists and we have to remove it first
         if (args->disposition == FILE_SUPERSEDE && lookup_status == NO_ERROR) {
@@ -1086,6 +1992,10 @@ supersede_retry:
             if (!(args->create_opts & FILE_DIRECTORY_FILE))
                 nfs41_delegation_return(state->session, &state->file,
                     OPEN_DELEGATE_WRITE, TRUE);
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+            nfs41_deferred_close_flush_file(state->session->client,
+                &state->file.fh);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
 
             DPRINTF(1, ("open for FILE_SUPERSEDE removing '%s' first\n", name->name));
             status = nfs41_remove(state->session, &state->parent,
@@ -1102,8 +2012,27 @@ supersede_retry:
             createattrs.attrmask.arr[0] |= FATTR4_WORD0_SIZE;
             createattrs.size = 0;
             DPRINTF(1, ("creating with mode 0%o\n", args->mode));
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+            if ((create == OPEN4_NOCREATE) && (lookup_status == NO_ERROR) &&
+                (state->type == NF4REG) &&
+                deferred_close_reuse(state, upcall->uid, upcall->gid)) {
+                /* |info| is from the |nfs41_lookup()| above */
+                state->pnfs_last_offset = info.size ? info.size - 1 : 0;
+                client_state_add(state);
+                status = NFS4_OK;
+            }
+            else {
+                /* parked opens must not conflict with this OPEN */
+                if ((lookup_status == NO_ERROR) && (create != OPEN4_NOCREATE))
+                    nfs41_deferred_close_flush_file(state->session->client,
+                        &state->file.fh);
+                status = open_or_delegate(state, create, createhowmode,
+                    &createattrs, createsetattrs_arg, TRUE, &info);
+            }
+#else
             status = open_or_delegate(state, create, createhowmode, &createattrs,
-                TRUE, &info);
+                createsetattrs_arg, TRUE, &info);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
             if (status == NFS4_OK && state->delegation.state)
                     args->deleg_type = state->delegation.state->state.type;
         }
@@ -1117,19 +2046,9 @@ supersede_retry:
             goto out_free_state;
         } else {
 #ifdef NFS41_DRIVER_SETGID_NEWGRP_SUPPORT
-            /*
-             * Hack: Support |setgid()|/newgrp(1)/sg(1)/winsg(1) by
-             * fetching groupname from auth token for new files and
-             * do a "manual" chgrp on the new file
-             *
-             * Note that |RPCSEC_AUTH_NONE| does not have any
-             * user/group information, therefore newgrp will be a
-             * NOP here.
-             */
-            if ((create == OPEN4_CREATE) &&
-                (state->session->client->rpc->sec_flavor !=
-                    RPCSEC_AUTH_NONE)) {
-                char *s;
+            /* CREATE has no current stateid, chgrp the new directory here */
+            if (createsetattrs_arg &&
+                (args->create_opts & FILE_DIRECTORY_FILE)) {
                 int chgrp_status;
                 stateid_arg stateid;
                 nfs41_file_info createchgrpattrs;
@@ -1138,22 +2057,8 @@ supersede_retry:
                 createchgrpattrs.attrmask.arr[0] = 0;
                 createchgrpattrs.attrmask.arr[1] = FATTR4_WORD1_OWNER_GROUP;
                 createchgrpattrs.owner_group = createchgrpattrs.owner_group_buf;
-                /* fixme: we should store the |owner_group| name in |upcall| */
-                if (!get_token_primarygroup_name(upcall->currentthread_token,
-                    createchgrpattrs.owner_group)) {
-                    eprintf("handle_open(args->path='%s'): "
-                        "OPEN4_CREATE: "
-                        "get_token_primarygroup_name() failed.\n",
-                        args->path);
-                    goto create_chgrp_out;
-                }
-                s = createchgrpattrs.owner_group+strlen(createchgrpattrs.owner_group);
-                s = stpcpy(s, "@");
-                (void)stpcpy(s, nfs41dg->localdomain_name);
-                DPRINTF(1, ("handle_open(state->file.name.name='%s'): "
-                    "OPEN4_CREATE: owner_group='%s'\n",
-                    state->file.name.name,
-                    createchgrpattrs.owner_group));
+                (void)strcpy(createchgrpattrs.owner_group,
+                    createattrs.owner_group);
 
                 nfs41_open_stateid_arg(state, &stateid);
                 chgrp_status = nfs41_setattr(state->session,
@@ -1167,8 +2072,6 @@ supersede_retry:
                         createchgrpattrs.owner_group,
                         nfs_error_string(chgrp_status));
                 }
-create_chgrp_out:
-                ;
             }
 #endif /* NFS41_DRIVER_SETGID_NEWGRP_SUPPORT */
 
@@ -1374,6 +2277,21 @@ static int parse_close(
         status = safe_read(&buffer, &length, &args->renamed, sizeof(BOOLEAN));
         if (status) goto out;
     }
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    status = safe_read(&buffer, &length, &args->setattr_flags,
+        sizeof(args->setattr_flags));
+    if (status) goto out;
+    if (args->setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO) {
+        status = safe_read(&buffer, &length, &args->basic_info,
+            sizeof(args->basic_info));
+        if (status) goto out;
+    }
+    if (args->setattr_flags & NFS41_CLOSE_FLAG_SET_EOF) {
+        status = safe_read(&buffer, &length, &args->eof,
+            sizeof(args->eof));
+        if (status) goto out;
+    }
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
 
     EASSERT(length == 0);
 
@@ -1406,22 +2324,112 @@ static int do_nfs41_close(nfs41_open_state *state)
     return status;
 }
 
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+/*
+ * Attributes the kernel deferred until the close, see
+ * |NFS41_DRIVER_SETATTR_AT_CLOSE|; |info->attrmask| is empty if there
+ * is nothing to set
+ */
+static void close_setattr_attrs(
+    IN nfs41_open_state *state,
+    IN const close_upcall_args *args,
+    OUT nfs41_file_info *info)
+{
+    int status;
+
+    (void)memset(info, 0, sizeof(*info));
+
+    if (args->setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO) {
+        status = nfs41_basicinfo_to_setattr(state, &args->basic_info, info);
+        if (status) {
+            eprintf("close_setattr_attrs(path='%s'): "
+                "nfs41_basicinfo_to_setattr() failed with %d\n",
+                state->path.path, status);
+            (void)memset(info, 0, sizeof(*info));
+        }
+    }
+
+    if (args->setattr_flags & NFS41_CLOSE_FLAG_SET_EOF) {
+        /* break read delegations before SETATTR */
+        nfs41_delegation_return(state->session, &state->file,
+            OPEN_DELEGATE_READ, FALSE);
+
+        info->size = (uint64_t)args->eof;
+        bitmap_set(&info->attrmask, 0, FATTR4_WORD0_SIZE);
+
+        /* update the last offset for LAYOUTCOMMIT */
+        AcquireSRWLockExclusive(&state->lock);
+        state->pnfs_last_offset = info->size ? info->size - 1 : 0;
+        ReleaseSRWLockExclusive(&state->lock);
+    }
+}
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+
 static int handle_close(void *deamon_context, nfs41_upcall *upcall)
 {
     int status = NFS4_OK, rm_status = NFS4_OK;
     close_upcall_args *args = &upcall->args.close;
     nfs41_open_state *state = upcall->state_ref;
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    int flush_status = NO_ERROR;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    nfs41_file_info setattr_info;
+    stateid_arg stateid;
+    int setattr_status = NFS4_OK;
+
+    setattr_info.attrmask.count = 0;
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+    /* no prefetch must be in flight when we send the CLOSE */
+    if (state->type == NF4REG)
+        nfs41_readahead_shutdown(state);
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
+
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    /* the last chance to report lost writes to the application */
+    if ((state->type == NF4REG) && (!args->remove)) {
+        flush_status = nfs41_delegation_write_behind_flush_open(state);
+        if (flush_status) {
+            eprintf("handle_close(path='%s'): committing the deferred "
+                "writes failed with '%s'\n",
+                state->path.path, nfs_error_string(flush_status));
+            flush_status = nfs_to_windows_error(flush_status,
+                ERROR_NET_WRITE_FAULT);
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
 
     /* return associated file layouts if necessary */
     if (state->type == NF4REG)
         pnfs_layout_state_close(state->session, state, args->remove);
 
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+    if (state->type == NF4DIR)
+        nfs41_dirnotify_remove(state);
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
+
     if (state->srv_open == args->srv_open)
         nfs41_delegation_remove_srvopen(state->session, &state->file);
 
     if (args->remove) {
         nfs41_component *name = &state->file.name;
 
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+        /* parked opens would keep the file alive on the server */
+        nfs41_deferred_close_flush_file(state->session->client,
+            &state->file.fh);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+
+        if (args->renamed &&
+            state->file.fh.superblock->preserve_unlinked) {
+            /* |handle_nfs41_rename()| did REMOVE the file already */
+            DPRINTF(1, ("renamed file '%s' was removed already\n",
+                name->name));
+            goto out_close;
+        }
+
         if (args->renamed) {
             DPRINTF(1, ("removing a renamed file '%s'\n", name->name));
             create_silly_rename(&state->path, &state->file.fh, name);
@@ -1453,6 +2461,67 @@ retry_delete:
             rm_status = nfs_to_windows_error(rm_status, ERROR_INTERNAL_ERROR);
         }
     }
+
+out_close:
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    /* a removed file does not need its timestamps or size anymore */
+    if (args->setattr_flags && (!args->remove))
+        close_setattr_attrs(state, args, &setattr_info);
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+    if (setattr_info.attrmask.count &&
+        nfs41_delegation_set_times(state, &setattr_info))
+        setattr_info.attrmask.count = 0;
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
+
+    if (setattr_info.attrmask.count) {
+        nfs41_open_stateid_arg(state, &stateid);
+        if (state->do_close) {
+            /*
+             * SETATTR+CLOSE is one round trip, so do not park the
+             * open (which would need a separate SETATTR now)
+             */
+            status = nfs41_setattr_close(state->session, &state->file,
+                &stateid, &setattr_info, &setattr_status);
+            if (status) {
+                DPRINTF(1, ("nfs41_setattr_close() failed with "
+                    "error '%s'.\n", nfs_error_string(status)));
+                status = nfs_to_windows_error(status, ERROR_INTERNAL_ERROR);
+            }
+        }
+        else {
+            setattr_status = nfs41_setattr(state->session, &state->file,
+                &stateid, &setattr_info);
+        }
+        if (setattr_status) {
+            eprintf("handle_close(path='%s'): SETATTR of the "
+                "deferred attributes failed with '%s'\n",
+                state->path.path, nfs_error_string(setattr_status));
+        }
+        goto out;
+    }
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+    if ((!args->remove) && deferred_close_park(state,
+        upcall->uid, upcall->gid)) {
+        /* stays on the client's list of state until really closed */
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+        return flush_status;
+#else
+        return NO_ERROR;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+    }
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+#ifdef NFS41_DRIVER_DAEMON_ASYNC_CLOSE
+    if ((!args->remove) && async_close_queue(state)) {
+        /* |deferred_close_thread()| sends the CLOSE */
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+        return flush_status;
+#else
+        return NO_ERROR;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+    }
+#endif /* NFS41_DRIVER_DAEMON_ASYNC_CLOSE */
 
     if (state->do_close) {
         status = do_nfs41_close(state);
@@ -1461,6 +2530,10 @@ out:
     /* remove from the client's list of state for recovery */
     client_state_remove(state);
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    if (status == NO_ERROR)
+        status = flush_status;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
     if (status || !rm_status)
         return status;
     else
@@ -22,6 +22,7 @@
 #ifndef __PNFS_H__
 #define __PNFS_H__ 1
 
+#include "nfs41_build_features.h"
 #include "nfs41_types.h"
 #include "list.h"
 
@@ -52,6 +53,8 @@ struct __nfs41_session;
 struct __nfs41_open_state;
 struct __nfs41_root;
 struct __stateid_arg;
+/* from nfs41_ops.h */
+struct __pnfs_layoutget_res_ok;
 
 
 /* pnfs error values, in order of increasing severity */
@@ -74,7 +77,8 @@ enum pnfs_status {
 enum pnfs_layout_type {
     PNFS_LAYOUTTYPE_FILE    = 1,
     PNFS_LAYOUTTYPE_OBJECT  = 2,
-    PNFS_LAYOUTTYPE_BLOCK   = 3
+    PNFS_LAYOUTTYPE_BLOCK   = 3,
+    PNFS_LAYOUTTYPE_FLEXFILES = 4
 };
 
 enum pnfs_iomode {
@@ -110,6 +114,14 @@ enum pnfs_return_type {
 
 #define PNFS_DEVICEID_SIZE              16
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+/* ffv4_flags4, RFC 8435 */
+#define FF_FLAGS_NO_LAYOUTCOMMIT        0x00000001
+#define FF_FLAGS_NO_IO_THRU_MDS         0x00000002
+#define FF_FLAGS_NO_READ_IO             0x00000004
+#define FF_FLAGS_WRITE_ONE_MIRROR       0x00000008
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
 
 /* device */
 typedef struct __pnfs_device {
@@ -125,10 +137,41 @@ typedef struct __pnfs_stripe_indices {
     uint32_t                *arr;
 } pnfs_stripe_indices;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+struct pnfs_ds_conn;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+/* completed io since |start|, for LAYOUTSTATS */
+typedef struct __pnfs_io_stats {
+    volatile LONGLONG       read_ops;
+    volatile LONGLONG       read_bytes;
+    volatile LONGLONG       read_busy; /* microseconds */
+    volatile LONGLONG       write_ops;
+    volatile LONGLONG       write_bytes;
+    volatile LONGLONG       write_busy; /* microseconds */
+    volatile LONGLONG       start; /* GetTickCount64() of the first io */
+} pnfs_io_stats;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
 typedef struct __pnfs_data_server {
     struct __nfs41_client   *client;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+    struct pnfs_ds_conn     *conn; /* reference on the pool entry */
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
     multi_addr4             addrs;
     SRWLOCK                 lock;
+    /* number of pnfs io units queued or in flight to this server */
+    volatile LONG           io_queue_depth;
+    volatile LONG           io_queue_depth_max;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    /* moving average of the READ latency in microseconds, zero if
+     * not measured yet, used to pick flexfiles mirrors */
+    volatile LONG           read_latency;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    pnfs_io_stats           stats;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
 } pnfs_data_server;
 
 typedef struct __pnfs_data_server_list {
@@ -136,16 +179,44 @@ typedef struct __pnfs_data_server_list {
     pnfs_data_server        *arr;
 } pnfs_data_server_list;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+/* the ff_device_versions4 entry of a flexfiles device we use; a
+ * |version| of zero means the device has none we can talk to */
+typedef struct __pnfs_ff_device_version {
+    uint32_t                version;
+    uint32_t                minorversion;
+    uint32_t                rsize;
+    uint32_t                wsize;
+} pnfs_ff_device_version;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
+/* flexfiles devices are decoded into a single data server with a
+ * single stripe, so the file layout code can use them as well */
 typedef struct __pnfs_file_device {
     pnfs_device             device;
     pnfs_stripe_indices     stripes;
     pnfs_data_server_list   servers;
     struct pnfs_file_device_list *devices; /* -> nfs41_client.devices */
     struct list_entry       entry; /* position in devices */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    pnfs_ff_device_version  ff_version; /* PNFS_LAYOUTTYPE_FLEXFILES */
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 } pnfs_file_device;
 
 
 /* layout */
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+/* range of DATA_SYNC4 writes waiting for LAYOUTCOMMIT, see pnfs_io.c */
+typedef struct __pnfs_layout_commit {
+    bool_t                  pending;
+    bool_t                  new_last_offset; /* |last_offset| is valid */
+    uint64_t                offset;
+    uint64_t                end; /* |offset| + length */
+    uint64_t                last_offset;
+    ULONGLONG               since; /* GetTickCount64() of first write */
+} pnfs_layout_commit;
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
+
 typedef struct __pnfs_layout_state {
     nfs41_fh                meta_fh;
     stateid4                stateid;
@@ -159,6 +230,18 @@ typedef struct __pnfs_layout_state {
     bool_t                  pending; /* pending LAYOUTGET/LAYOUTRETURN */
     SRWLOCK                 lock;
     CONDITION_VARIABLE      cond;
+    ULONGLONG               last_close; /* GetTickCount64() of last close */
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+    pnfs_layout_commit      commit;
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    /* layout type for LAYOUTGET, chosen from the superblock's
+     * |layout_types| when the layout state is created */
+    enum pnfs_layout_type   type;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    volatile LONGLONG       stats_sent; /* GetTickCount64() of LAYOUTSTATS */
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
 } pnfs_layout_state;
 
 typedef struct __pnfs_layout {
@@ -174,6 +257,28 @@ typedef struct __pnfs_file_layout_handles {
     nfs41_path_fh           *arr;
 } pnfs_file_layout_handles;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+/* ff_mirror4 with its (only) ff_data_server4 */
+typedef struct __pnfs_ff_mirror {
+    unsigned char           deviceid[PNFS_DEVICEID_SIZE];
+    pnfs_file_device        *device;
+    stateid4                stateid;
+    nfs41_path_fh           file; /* first of ffds_fh_vers */
+    uint32_t                efficiency;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    pnfs_io_stats           stats;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+} pnfs_ff_mirror;
+
+typedef struct __pnfs_ff_mirror_list {
+    uint32_t                count;
+    pnfs_ff_mirror          *arr;
+} pnfs_ff_mirror_list;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
+/* also used for PNFS_LAYOUTTYPE_FLEXFILES segments, which have no
+ * |device| or |filehandles| but one entry in |mirrors| for each
+ * mirror */
 typedef struct __pnfs_file_layout {
     pnfs_layout             layout;
     pnfs_file_layout_handles filehandles;
@@ -182,6 +287,13 @@ typedef struct __pnfs_file_layout {
     uint64_t                pattern_offset;
     uint32_t                first_index;
     uint32_t                util;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    pnfs_ff_mirror_list     mirrors;
+    uint32_t                ff_flags; /* FF_FLAGS_* */
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    pnfs_io_stats           stats; /* unused for flexfiles segments */
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
 } pnfs_file_layout;
 
 
@@ -199,6 +311,17 @@ enum pnfs_status pnfs_layout_state_open(
     IN struct __nfs41_open_state *state,
     OUT pnfs_layout_state **layout_out);
 
+/* LAYOUTGET in the OPEN compound, see |nfs41_open_layoutget| */
+enum pnfs_status pnfs_layout_state_open_check(
+    IN struct __nfs41_open_state *state,
+    OUT enum pnfs_layout_type *type_out);
+
+void pnfs_layout_state_open_layoutget(
+    IN struct __nfs41_open_state *state,
+    IN enum pnfs_iomode iomode,
+    IN enum nfsstat4 nfsstat,
+    IN struct __pnfs_layoutget_res_ok *layoutget_res);
+
 /* expects caller to hold an exclusive lock on pnfs_layout_state */
 enum pnfs_status pnfs_layout_state_prepare(
     IN pnfs_layout_state *state,
@@ -238,7 +361,11 @@ void pnfs_layout_io_finished(
 /* pnfs_device.c */
 struct pnfs_file_device_list;
 
+/* returns the device list shared by all clients with the same server
+ * owner and client id, see pnfs_device.c */
 enum pnfs_status pnfs_file_device_list_create(
+    IN const char *server_owner,
+    IN uint64_t clientid,
     OUT struct pnfs_file_device_list **devices_out);
 
 void pnfs_file_device_list_free(
@@ -250,6 +377,7 @@ void pnfs_file_device_list_invalidate(
 enum pnfs_status pnfs_file_device_get(
     IN struct __nfs41_session *session,
     IN struct pnfs_file_device_list *devices,
+    IN enum pnfs_layout_type type,
     IN unsigned char *deviceid,
     OUT pnfs_file_device **device_out);
 
@@ -268,8 +396,20 @@ enum pnfs_status pnfs_data_server_client(
     IN uint32_t default_lease,
     OUT struct __nfs41_client **client_out);
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+/* drops the data server's reference on its pool entry */
+void pnfs_data_server_disconnect(
+    IN pnfs_data_server *server);
+
+/* removes the pool entries of |root| before its clients are freed */
+void pnfs_data_server_pool_purge(
+    IN struct __nfs41_root *root);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
+
 
 /* pnfs_io.c */
+void pnfs_io_pool_init(void);
+
 enum pnfs_status pnfs_read(
     IN struct __nfs41_root *root,
     IN struct __nfs41_open_state *state,
@@ -291,8 +431,40 @@ enum pnfs_status pnfs_write(
     OUT ULONG *len_out,
     OUT nfs41_file_info *cinfo);
 
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+enum pnfs_status pnfs_layout_commit_flush(
+    IN struct __nfs41_session *session,
+    IN nfs41_path_fh *meta_file,
+    IN pnfs_layout_state *layout,
+    OUT OPTIONAL nfs41_file_info *info);
+
+enum pnfs_status pnfs_layout_commit_open_state(
+    IN struct __nfs41_open_state *state);
+
+/* expects caller to hold an exclusive lock on pnfs_layout_state */
+bool_t pnfs_layout_commit_recall(
+    IN struct __nfs41_client *client,
+    IN pnfs_layout_state *layout);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
+
 
 /* helper functions */
+__inline enum pnfs_layout_type layout_state_type(
+    IN const pnfs_layout_state *state)
+{
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    return state->type;
+#else
+    return PNFS_LAYOUTTYPE_FILE;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+}
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+__inline int is_flexfiles(
+    IN const pnfs_file_layout *layout)
+{
+    return layout->layout.type == PNFS_LAYOUTTYPE_FLEXFILES;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 __inline int is_dense(
     IN const pnfs_file_layout *layout)
 {
@@ -51,6 +51,7 @@ const char* pnfs_layout_type_string(enum pnfs_layout_type type)
     case PNFS_LAYOUTTYPE_FILE:  return "PNFS_LAYOUTTYPE_FILE";
     case PNFS_LAYOUTTYPE_OBJECT: return "PNFS_LAYOUTTYPE_OBJECT";
     case PNFS_LAYOUTTYPE_BLOCK: return "PNFS_LAYOUTTYPE_BLOCK";
+    case PNFS_LAYOUTTYPE_FLEXFILES: return "PNFS_LAYOUTTYPE_FLEXFILES";
     default:                    return "Invalid layout type";
     }
 }
@@ -94,6 +95,19 @@ void dprint_layout(
     dprintf_out("  commit_to_mds:    %u\n", should_commit_to_mds(layout));
     dprintf_out("  stripe_unit_size: %u\n", layout_unit_size(layout));
     dprintf_out("  file handles:     %u\n", layout->filehandles.count);
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (is_flexfiles(layout)) {
+        uint32_t i;
+        dprintf_out("  ff_flags:         0x%x\n", layout->ff_flags);
+        dprintf_out("  mirrors:          %u\n", layout->mirrors.count);
+        for (i = 0; i < layout->mirrors.count; i++) {
+            dprintf_out("  mirror[%u]:        efficiency=%u\n", i,
+                layout->mirrors.arr[i].efficiency);
+            dprint_deviceid("    deviceid:       ",
+                layout->mirrors.arr[i].deviceid);
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 }
 
 #define MULTI_ADDR_BUFFER_LEN \
@@ -124,6 +138,14 @@ void dprint_device(
     dprint_deviceid("  deviceid:         ", device->device.deviceid);
     dprintf_out("  type:             '%s'\n", pnfs_layout_type_string(device->device.type));
     dprintf_out("  stripes:          %u\n", device->stripes.count);
-    for (i = 0; i < device->servers.count; i++)
+    for (i = 0; i < device->servers.count; i++) {
         dprint_multi_addr(i, &device->servers.arr[i].addrs);
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+        dprintf_out("    read %lld ops/%lld bytes, write %lld ops/%lld bytes\n",
+            device->servers.arr[i].stats.read_ops,
+            device->servers.arr[i].stats.read_bytes,
+            device->servers.arr[i].stats.write_ops,
+            device->servers.arr[i].stats.write_bytes);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+    }
 }
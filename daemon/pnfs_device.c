@@ -31,17 +31,41 @@
 #define FDLVL 2 /* dprintf level for file device logging */
 
 
-/* pnfs_file_device_list */
+/* pnfs_file_device_list
+ *
+ * The device lists are shared by all metadata server clients with the
+ * same server owner and client id (e.g. the clients of several mounts
+ * from the same server), so GETDEVICEINFO results are reused by later
+ * mounts instead of being fetched again for each of them. Device ids
+ * are only unique within a client id, so clients with a different
+ * client id get their own list.
+ */
 struct pnfs_file_device_list {
     struct list_entry       head;
     CRITICAL_SECTION        lock;
+    struct list_entry       entry; /* position in |device_lists| */
+    char                    server_owner[NFS4_OPAQUE_LIMIT];
+    uint64_t                clientid;
+    LONG                    ref_count; /* protected by |device_lists.lock| */
 };
 
+static struct {
+    SRWLOCK                 lock;
+    struct list_entry       head;
+    bool_t                  initialized;
+} device_lists = { SRWLOCK_INIT };
+
 #define device_entry(pos) list_container(pos, pnfs_file_device, entry)
 
+/* device ids are only unique within a layout type */
+struct device_key {
+    const unsigned char     *deviceid;
+    enum pnfs_layout_type   type;
+};
+
 
 static enum pnfs_status file_device_create(
-    IN const unsigned char *deviceid,
+    IN const struct device_key *key,
     IN struct pnfs_file_device_list *devices,
     OUT pnfs_file_device **device_out)
 {
@@ -54,7 +78,8 @@ static enum pnfs_status file_device_create(
         goto out;
     }
 
-    memcpy(device->device.deviceid, deviceid, PNFS_DEVICEID_SIZE);
+    memcpy(device->device.deviceid, key->deviceid, PNFS_DEVICEID_SIZE);
+    device->device.type = key->type;
     device->devices = devices;
     InitializeCriticalSection(&device->device.lock);
     *device_out = device;
@@ -65,6 +90,11 @@ out:
 static void file_device_free(
     IN pnfs_file_device *device)
 {
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+    uint32_t i;
+    for (i = 0; i < device->servers.count; i++)
+        pnfs_data_server_disconnect(&device->servers.arr[i]);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
     free(device->servers.arr);
     free(device->stripes.arr);
     DeleteCriticalSection(&device->device.lock);
@@ -73,14 +103,23 @@ static void file_device_free(
 
 static int deviceid_compare(
     const struct list_entry *entry,
-    const void *deviceid)
+    const void *value)
 {
     const pnfs_file_device *device = device_entry(entry);
-    return memcmp(device->device.deviceid, deviceid, PNFS_DEVICEID_SIZE);
+    const struct device_key *key = (const struct device_key*)value;
+    if (device->device.type != key->type)
+        return 1;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+    /* a revoked device stays on the list until its last layout is
+     * gone, but new layouts get a new device with fresh device info */
+    if (device->device.status & PNFS_DEVICE_REVOKED)
+        return 1;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
+    return memcmp(device->device.deviceid, key->deviceid, PNFS_DEVICEID_SIZE);
 }
 
 static enum pnfs_status file_device_find_or_create(
-    IN const unsigned char *deviceid,
+    IN const struct device_key *key,
     IN struct pnfs_file_device_list *devices,
     OUT pnfs_file_device **device_out)
 {
@@ -92,11 +131,11 @@ static enum pnfs_status file_device_find_or_create(
     EnterCriticalSection(&devices->lock);
 
     /* search for an existing device */
-    entry = list_search(&devices->head, deviceid, deviceid_compare);
+    entry = list_search(&devices->head, key, deviceid_compare);
     if (entry == NULL) {
         /* create a new device */
         pnfs_file_device *device;
-        status = file_device_create(deviceid, devices, &device);
+        status = file_device_create(key, devices, &device);
         if (status == PNFS_SUCCESS) {
             /* add it to the list */
             list_add_tail(&devices->head, &device->entry);
@@ -122,10 +161,32 @@ static enum pnfs_status file_device_find_or_create(
 
 
 enum pnfs_status pnfs_file_device_list_create(
+    IN const char *server_owner,
+    IN uint64_t clientid,
     OUT struct pnfs_file_device_list **devices_out)
 {
     enum pnfs_status status = PNFS_SUCCESS;
     struct pnfs_file_device_list *devices;
+    struct list_entry *entry;
+
+    AcquireSRWLockExclusive(&device_lists.lock);
+    if (!device_lists.initialized) {
+        list_init(&device_lists.head);
+        device_lists.initialized = TRUE;
+    }
+
+    /* share the devices of an existing client of the same server */
+    list_for_each(entry, &device_lists.head) {
+        devices = list_container(entry, struct pnfs_file_device_list, entry);
+        if ((devices->clientid == clientid) &&
+            (strcmp(devices->server_owner, server_owner) == 0)) {
+            devices->ref_count++;
+            DPRINTF(FDLVL, ("pnfs_file_device_list_create: sharing "
+                "devices of client %llu (%d clients)\n",
+                clientid, (int)devices->ref_count));
+            goto out_found;
+        }
+    }
 
     devices = calloc(1, sizeof(struct pnfs_file_device_list));
     if (devices == NULL) {
@@ -135,9 +196,15 @@ enum pnfs_status pnfs_file_device_list_create(
 
     list_init(&devices->head);
     InitializeCriticalSection(&devices->lock);
+    StringCchCopyA(devices->server_owner, NFS4_OPAQUE_LIMIT, server_owner);
+    devices->clientid = clientid;
+    devices->ref_count = 1;
+    list_add_tail(&device_lists.head, &devices->entry);
 
+out_found:
     *devices_out = devices;
 out:
+    ReleaseSRWLockExclusive(&device_lists.lock);
     return status;
 }
 
@@ -146,6 +213,15 @@ void pnfs_file_device_list_free(
 {
     struct list_entry *entry, *tmp;
 
+    /* free the devices only with the last client using them */
+    AcquireSRWLockExclusive(&device_lists.lock);
+    if (--devices->ref_count > 0) {
+        ReleaseSRWLockExclusive(&device_lists.lock);
+        return;
+    }
+    list_remove(&devices->entry);
+    ReleaseSRWLockExclusive(&device_lists.lock);
+
     EnterCriticalSection(&devices->lock);
 
     list_for_each_tmp(entry, tmp, &devices->head)
@@ -192,16 +268,18 @@ void pnfs_file_device_list_invalidate(
 enum pnfs_status pnfs_file_device_get(
     IN nfs41_session *session,
     IN struct pnfs_file_device_list *devices,
+    IN enum pnfs_layout_type type,
     IN unsigned char *deviceid,
     OUT pnfs_file_device **device_out)
 {
+    const struct device_key key = { deviceid, type };
     pnfs_file_device *device;
     enum pnfs_status status;
     enum nfsstat4 nfsstat;
 
     DPRINTF(FDLVL, ("--> pnfs_file_device_get()\n"));
 
-    status = file_device_find_or_create(deviceid, devices, &device);
+    status = file_device_find_or_create(&key, devices, &device);
     if (status)
         goto out;
 
@@ -213,7 +291,7 @@ enum pnfs_status pnfs_file_device_get(
     else if (device->device.status & PNFS_DEVICE_GRANTED)
         status = PNFS_SUCCESS;
     else {
-        nfsstat = pnfs_rpc_getdeviceinfo(session, deviceid, device);
+        nfsstat = pnfs_rpc_getdeviceinfo(session, type, deviceid, device);
         if (nfsstat == NFS4_OK) {
             device->device.status = PNFS_DEVICE_GRANTED;
             status = PNFS_SUCCESS;
@@ -265,12 +343,238 @@ void pnfs_file_device_put(
     }
 }
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+/* pnfs_ds_conn
+ *
+ * The global pool of data server clients. Every |pnfs_data_server|
+ * of a device holds a reference on the entry for its client, so
+ * devices of other files, of other mounts and the devices fetched
+ * again after CB_NOTIFY_DEVICEID or a bulk recall reuse the client
+ * and its session instead of sending EXCHANGE_ID/CREATE_SESSION
+ * again. Entries are matched by client owner and data server
+ * address, and by client owner and server owner after EXCHANGE_ID,
+ * so the addresses of a trunked data server end up in one entry.
+ * The clients are owned by the |nfs41_root| that created them;
+ * |pnfs_data_server_pool_purge()| detaches its entries before they
+ * are freed, and data servers still holding such an entry reconnect
+ * on their next io.
+ */
+struct pnfs_ds_conn {
+    struct list_entry       entry; /* position in |ds_pool| */
+    client_owner4           owner; /* of the root */
+    char                    server_owner[NFS4_OPAQUE_LIMIT];
+    multi_addr4             addrs;
+    nfs41_root              *root;
+    nfs41_client *volatile  client; /* NULL once detached */
+    LONG                    ref_count; /* protected by |ds_pool.lock| */
+};
+
+static struct {
+    SRWLOCK                 lock;
+    struct list_entry       head;
+    bool_t                  initialized;
+} ds_pool = { SRWLOCK_INIT };
+
+#define conn_entry(pos) list_container(pos, struct pnfs_ds_conn, entry)
+
+static bool_t client_owner_equal(
+    IN const client_owner4 *a,
+    IN const client_owner4 *b)
+{
+    return a->co_ownerid_len == b->co_ownerid_len &&
+        memcmp(a->co_ownerid, b->co_ownerid, a->co_ownerid_len) == 0;
+}
+
+static bool_t multi_addr_intersect(
+    IN const multi_addr4 *a,
+    IN const multi_addr4 *b)
+{
+    uint32_t i, j;
+    for (i = 0; i < a->count; i++)
+        for (j = 0; j < b->count; j++)
+            if (strcmp(a->arr[i].netid, b->arr[j].netid) == 0 &&
+                strcmp(a->arr[i].uaddr, b->arr[j].uaddr) == 0)
+                return TRUE;
+    return FALSE;
+}
+
+/* expects caller to hold |ds_pool.lock| */
+static struct pnfs_ds_conn* ds_pool_find_addrs(
+    IN const client_owner4 *owner,
+    IN const multi_addr4 *addrs)
+{
+    struct list_entry *entry;
+    struct pnfs_ds_conn *conn;
+
+    list_for_each(entry, &ds_pool.head) {
+        conn = conn_entry(entry);
+        if (client_owner_equal(&conn->owner, owner) &&
+            multi_addr_intersect(&conn->addrs, addrs))
+            return conn;
+    }
+    return NULL;
+}
+
+/* expects caller to hold |ds_pool.lock| */
+static struct pnfs_ds_conn* ds_pool_find_owner(
+    IN const client_owner4 *owner,
+    IN const char *server_owner)
+{
+    struct list_entry *entry;
+    struct pnfs_ds_conn *conn;
+
+    list_for_each(entry, &ds_pool.head) {
+        conn = conn_entry(entry);
+        if (client_owner_equal(&conn->owner, owner) &&
+            strcmp(conn->server_owner, server_owner) == 0)
+            return conn;
+    }
+    return NULL;
+}
+
+static void multi_addr_merge(
+    IN OUT multi_addr4 *dst,
+    IN const multi_addr4 *src)
+{
+    uint32_t i, j;
+    for (i = 0; i < src->count && dst->count < NFS41_ADDRS_PER_SERVER; i++) {
+        for (j = 0; j < dst->count; j++)
+            if (strcmp(src->arr[i].netid, dst->arr[j].netid) == 0 &&
+                strcmp(src->arr[i].uaddr, dst->arr[j].uaddr) == 0)
+                break;
+        if (j == dst->count)
+            dst->arr[dst->count++] = src->arr[i];
+    }
+}
+
+/* expects caller to hold |ds_pool.lock| exclusive */
+static void ds_conn_put_locked(
+    IN struct pnfs_ds_conn *conn)
+{
+    /* detached entries are no longer on the list */
+    if (--conn->ref_count == 0 && conn->client == NULL)
+        free(conn);
+}
+
+void pnfs_data_server_disconnect(
+    IN pnfs_data_server *server)
+{
+    if (server->conn == NULL)
+        return;
+
+    AcquireSRWLockExclusive(&ds_pool.lock);
+    ds_conn_put_locked(server->conn);
+    ReleaseSRWLockExclusive(&ds_pool.lock);
+
+    server->conn = NULL;
+    server->client = NULL;
+}
+
+void pnfs_data_server_pool_purge(
+    IN nfs41_root *root)
+{
+    struct list_entry *entry, *tmp;
+    struct pnfs_ds_conn *conn;
+
+    AcquireSRWLockExclusive(&ds_pool.lock);
+    if (ds_pool.initialized) {
+        list_for_each_tmp(entry, tmp, &ds_pool.head) {
+            conn = conn_entry(entry);
+            if (conn->root != root)
+                continue;
+
+            list_remove(&conn->entry);
+            conn->client = NULL;
+            conn->root = NULL;
+            if (conn->ref_count == 0)
+                free(conn);
+        }
+    }
+    ReleaseSRWLockExclusive(&ds_pool.lock);
+}
+
+/* returns a referenced pool entry for |server|, creating the client
+ * with |nfs41_root_mount_addrs()| if no other one can be used */
+static enum pnfs_status ds_pool_get(
+    IN nfs41_root *root,
+    IN const multi_addr4 *addrs,
+    IN uint32_t default_lease,
+    OUT struct pnfs_ds_conn **conn_out)
+{
+    struct pnfs_ds_conn *conn, *existing;
+    nfs41_client *client;
+    enum pnfs_status pnfsstat = PNFS_SUCCESS;
+    int status;
+
+    AcquireSRWLockExclusive(&ds_pool.lock);
+    if (!ds_pool.initialized) {
+        list_init(&ds_pool.head);
+        ds_pool.initialized = TRUE;
+    }
+    conn = ds_pool_find_addrs(&root->client_owner, addrs);
+    if (conn) {
+        conn->ref_count++;
+        DPRINTF(FDLVL, ("ds_pool_get('%s'): reusing client %llu\n",
+            addrs->arr[0].uaddr, conn->client->clnt_id));
+        goto out_unlock;
+    }
+    ReleaseSRWLockExclusive(&ds_pool.lock);
+
+    /* don't hold the pool lock over EXCHANGE_ID/CREATE_SESSION */
+    status = nfs41_root_mount_addrs(root, addrs, 1, default_lease, &client);
+    if (status) {
+        DPRINTF(FDLVL, ("data_client_create('%s') failed with %d\n",
+            addrs->arr[0].uaddr, status));
+        pnfsstat = PNFSERR_NOT_CONNECTED;
+        goto out;
+    }
+
+    conn = calloc(1, sizeof(struct pnfs_ds_conn));
+    if (conn == NULL) {
+        pnfsstat = PNFSERR_RESOURCES;
+        goto out;
+    }
+    conn->owner = root->client_owner;
+    StringCchCopyA(conn->server_owner, NFS4_OPAQUE_LIMIT,
+        client->server->owner);
+    conn->addrs = *addrs;
+    conn->root = root;
+    conn->client = client;
+    conn->ref_count = 1;
+
+    AcquireSRWLockExclusive(&ds_pool.lock);
+    /* another thread or mount may have connected in the meantime, or
+     * this is another address of a data server we already know */
+    existing = ds_pool_find_owner(&root->client_owner, conn->server_owner);
+    if (existing) {
+        multi_addr_merge(&existing->addrs, addrs);
+        existing->ref_count++;
+        free(conn);
+        conn = existing;
+    } else {
+        list_add_tail(&ds_pool.head, &conn->entry);
+        DPRINTF(FDLVL, ("ds_pool_get('%s'): new client %llu\n",
+            addrs->arr[0].uaddr, client->clnt_id));
+    }
+out_unlock:
+    *conn_out = conn;
+    ReleaseSRWLockExclusive(&ds_pool.lock);
+out:
+    return pnfsstat;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
+
 static enum pnfs_status data_client_status(
     IN pnfs_data_server *server,
     OUT nfs41_client **client_out)
 {
     enum pnfs_status status = PNFSERR_NOT_CONNECTED;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+    /* the pool entry is detached when the root of its client goes */
+    if (server->conn && server->conn->client == NULL)
+        return status;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
     if (server->client) {
         DPRINTF(FDLVL, ("pnfs_data_server_client() returning "
             "existing client %llu\n", server->client->clnt_id));
@@ -286,7 +590,9 @@ enum pnfs_status pnfs_data_server_client(
     IN uint32_t default_lease,
     OUT nfs41_client **client_out)
 {
+#ifndef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
     int status;
+#endif /* !NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
     enum pnfs_status pnfsstat;
 
     DPRINTF(FDLVL, ("--> pnfs_data_server_client('%s')\n",
@@ -303,6 +609,19 @@ enum pnfs_status pnfs_data_server_client(
     AcquireSRWLockExclusive(&server->lock);
 
     pnfsstat = data_client_status(server, client_out);
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+    if (pnfsstat) {
+        struct pnfs_ds_conn *conn;
+
+        pnfs_data_server_disconnect(server);
+        pnfsstat = ds_pool_get(root, &server->addrs, default_lease, &conn);
+        if (pnfsstat == PNFS_SUCCESS) {
+            server->conn = conn;
+            server->client = conn->client;
+            *client_out = server->client;
+        }
+    }
+#else
     if (pnfsstat) {
         status = nfs41_root_mount_addrs(root, &server->addrs, 1, default_lease,
             &server->client);
@@ -317,6 +636,7 @@ enum pnfs_status pnfs_data_server_client(
                 "%llu\n", server->client->clnt_id));
         }
     }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
 
     ReleaseSRWLockExclusive(&server->lock);
 out:
@@ -325,27 +645,56 @@ out:
 
 
 /* CB_NOTIFY_DEVICEID */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+/* expects caller to hold |device->devices->lock| */
+static void device_revoke(
+    IN pnfs_file_device *device)
+{
+    EnterCriticalSection(&device->device.lock);
+    if (device->device.layout_count) {
+        device->device.status |= PNFS_DEVICE_REVOKED;
+        LeaveCriticalSection(&device->device.lock);
+    } else {
+        LeaveCriticalSection(&device->device.lock);
+        list_remove(&device->entry);
+        file_device_free(device);
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
+
 enum pnfs_status pnfs_file_device_notify(
     IN struct pnfs_file_device_list *devices,
     IN const struct notify_deviceid4 *change)
 {
+    const struct device_key key = { change->deviceid, change->layouttype };
     struct list_entry *entry;
     enum pnfs_status status = PNFSERR_NO_DEVICE;
 
     DPRINTF(FDLVL, ("--> pnfs_file_device_notify(%u, %0llX:%0llX)\n",
         change->type, change->deviceid));
 
-    if (change->layouttype != PNFS_LAYOUTTYPE_FILE) {
+    if ((change->layouttype != PNFS_LAYOUTTYPE_FILE)
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        && (change->layouttype != PNFS_LAYOUTTYPE_FLEXFILES)
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+        ) {
         status = PNFSERR_NOT_SUPPORTED;
         goto out;
     }
 
     EnterCriticalSection(&devices->lock);
 
-    entry = list_search(&devices->head, change->deviceid, deviceid_compare);
+    entry = list_search(&devices->head, &key, deviceid_compare);
     if (entry) {
         DPRINTF(FDLVL, ("found file device 0x%p\n", device_entry(entry)));
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_DS_POOL
+        /* forget the device info, so the next layout that uses this
+         * device id sends GETDEVICEINFO again; layouts still using the
+         * old device keep it until pnfs_file_device_put(), and their
+         * data server clients stay in the pool */
+        device_revoke(device_entry(entry));
+#endif /* NFS41_DRIVER_DAEMON_PNFS_DS_POOL */
         if (change->type == NOTIFY_DEVICEID4_CHANGE) {
             /* if (change->immediate) ... */
             DPRINTF(FDLVL, ("CHANGE (%u)\n", change->immediate));
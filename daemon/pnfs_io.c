@@ -23,6 +23,7 @@
 #include <process.h>
 
 #include "nfs41_ops.h"
+#include "name_cache.h"
 #include "util.h"
 #include "daemon_debug.h"
 
@@ -31,9 +32,12 @@
 
 #define file_layout_entry(pos) list_container(pos, pnfs_file_layout, layout.entry)
 
+typedef uint32_t (WINAPI *pnfs_io_thread_fn)(void*);
+
 typedef struct __pnfs_io_pattern {
     struct __pnfs_io_thread *threads;
     nfs41_root              *root;
+    nfs41_session           *session; /* of the metadata server */
     nfs41_path_fh           *meta_file;
     const stateid_arg       *stateid;
     pnfs_layout_state       *state;
@@ -42,6 +46,9 @@ typedef struct __pnfs_io_pattern {
     uint64_t                offset_end;
     uint32_t                count;
     uint32_t                default_lease;
+    pnfs_io_thread_fn       thread_fn;
+    uint32_t                pending; /* protected by io_pool.lock */
+    CONDITION_VARIABLE      done;
 } pnfs_io_pattern;
 
 typedef struct __pnfs_io_thread {
@@ -49,9 +56,12 @@ typedef struct __pnfs_io_thread {
     pnfs_io_pattern         *pattern;
     pnfs_file_layout        *layout;
     nfs41_path_fh           *file;
+    pnfs_data_server        *server;
+    struct list_entry       entry; /* position in io_pool.queue */
     uint64_t                offset;
     uint32_t                id;
     enum stable_how4        stable;
+    enum pnfs_status        status;
 } pnfs_io_thread;
 
 typedef struct __pnfs_io_unit {
@@ -62,8 +72,6 @@ typedef struct __pnfs_io_unit {
     uint32_t                serverid;
 } pnfs_io_unit;
 
-typedef uint32_t (WINAPI *pnfs_io_thread_fn)(void*);
-
 
 static enum pnfs_status stripe_next_unit(
     IN const pnfs_file_layout *layout,
@@ -151,6 +159,13 @@ static uint32_t thread_count(
             continue;
 
         position = layout->layout.offset + layout->layout.length;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        if (is_flexfiles(layout)) {
+            /* one mirror for reads, all of them for writes */
+            count += (iomode == PNFS_IOMODE_READ) ? 1 : layout->mirrors.count;
+            continue;
+        }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
         count += layout->device->stripes.count;
     }
     return count;
@@ -173,6 +188,179 @@ static enum pnfs_status thread_init(
         : get_sparse_fh(layout, pattern->meta_file, stripeid, &thread->file);
 }
 
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+static LONGLONG io_elapsed_usec(
+    IN const LARGE_INTEGER *start)
+{
+    LARGE_INTEGER now, frequency;
+    LONGLONG usec;
+
+    (void)QueryPerformanceCounter(&now);
+    (void)QueryPerformanceFrequency(&frequency);
+    usec = ((now.QuadPart - start->QuadPart) * 1000000LL) /
+        frequency.QuadPart;
+    return usec < 1 ? 1 : usec;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+/*
+ * Flexible Files layouts (RFC 8435)
+ *
+ * Each mirror of a flexfiles segment has exactly one data server (see
+ * decode_ff_mirrors()), which stores the file at the same offsets as
+ * the metadata server, so an io thread covers its whole part of the
+ * segment. Reads use one mirror, picked by ff_mirror_select() from
+ * the READ latency measured per data server; an unmeasured data
+ * server counts as fastest, so every mirror gets probed once. If a
+ * mirror fails, ff_layout_read_thread() goes on with the next best
+ * one. Writes use one thread per mirror, so they go to all mirrors in
+ * parallel, and only the bytes written to all of them count. Errors
+ * from data servers are reported to the metadata server with
+ * LAYOUTERROR, when the mount uses NFSv4.2, see thread_ds_error().
+ */
+#define FF_LATENCY_FAILED 10000000 /* microseconds */
+
+static bool_t ff_mirror_usable(
+    IN const pnfs_ff_mirror *mirror)
+{
+    return mirror->device
+        && mirror->device->ff_version.version
+        && mirror->file.fh.len;
+}
+
+static __inline pnfs_data_server* ff_mirror_server(
+    IN const pnfs_ff_mirror *mirror)
+{
+    return &mirror->device->servers.arr[0];
+}
+
+/* pick the usable mirror with the lowest read latency other than
+ * |exclude|; ties go to the higher ffds_efficiency */
+static bool_t ff_mirror_select(
+    IN const pnfs_file_layout *layout,
+    IN uint32_t exclude,
+    OUT uint32_t *index_out)
+{
+    const pnfs_ff_mirror *mirror, *best = NULL;
+    LONG latency, best_latency = 0;
+    uint32_t i;
+
+    for (i = 0; i < layout->mirrors.count; i++) {
+        mirror = &layout->mirrors.arr[i];
+        if (i == exclude || !ff_mirror_usable(mirror))
+            continue;
+
+        latency = ff_mirror_server(mirror)->read_latency;
+        if (best == NULL || latency < best_latency ||
+            (latency == best_latency &&
+                mirror->efficiency > best->efficiency)) {
+            best = mirror;
+            best_latency = latency;
+            *index_out = i;
+        }
+    }
+    return best != NULL;
+}
+
+static void ff_read_latency_update(
+    IN pnfs_data_server *server,
+    IN LONGLONG sample)
+{
+    LONG average;
+
+    if (sample > FF_LATENCY_FAILED)
+        sample = FF_LATENCY_FAILED;
+
+    /* races between io threads only lose a sample */
+    average = server->read_latency;
+    if (average)
+        sample = (average * 7LL + sample) / 8;
+    (void)InterlockedExchange(&server->read_latency, (LONG)sample);
+}
+
+/* make ff_mirror_select() avoid the data server for now */
+static void ff_mirror_failed(
+    IN pnfs_io_thread *thread)
+{
+    pnfs_ff_mirror *mirror = &thread->layout->mirrors.arr[thread->id];
+
+    if (mirror->device)
+        (void)InterlockedExchange(&ff_mirror_server(mirror)->read_latency,
+            FF_LATENCY_FAILED);
+}
+
+static enum pnfs_status ff_thread_init(
+    IN pnfs_io_pattern *pattern,
+    IN pnfs_io_thread *thread,
+    IN pnfs_file_layout *layout,
+    IN uint32_t mirrorid,
+    IN uint64_t offset)
+{
+    thread->pattern = pattern;
+    thread->layout = layout;
+    thread->stable = FILE_SYNC4;
+    thread->offset = offset;
+    thread->id = mirrorid;
+    thread->file = &layout->mirrors.arr[mirrorid].file;
+    return PNFS_SUCCESS;
+}
+
+static enum pnfs_status ff_threads_init(
+    IN pnfs_io_pattern *pattern,
+    IN pnfs_file_layout *layout,
+    IN enum pnfs_iomode iomode,
+    IN uint64_t position,
+    IN OUT uint32_t *t)
+{
+    uint32_t i;
+
+    if (iomode == PNFS_IOMODE_READ) {
+        if (layout->ff_flags & FF_FLAGS_NO_READ_IO)
+            return PNFSERR_NOT_SUPPORTED;
+    }
+
+    if ((iomode == PNFS_IOMODE_READ) ||
+        (layout->ff_flags & FF_FLAGS_WRITE_ONE_MIRROR)) {
+        if (*t >= pattern->count)
+            return PNFSERR_NO_LAYOUT;
+        if (!ff_mirror_select(layout, layout->mirrors.count, &i))
+            return PNFSERR_NO_DEVICE;
+        return ff_thread_init(pattern, &pattern->threads[(*t)++],
+            layout, i, position);
+    }
+
+    /* every mirror must get the data, or none of them */
+    for (i = 0; i < layout->mirrors.count; i++) {
+        if (!ff_mirror_usable(&layout->mirrors.arr[i]))
+            return PNFSERR_NO_DEVICE;
+        if (*t >= pattern->count)
+            return PNFSERR_NO_LAYOUT;
+        (void)ff_thread_init(pattern, &pattern->threads[(*t)++],
+            layout, i, position);
+    }
+    return PNFS_SUCCESS;
+}
+
+static enum pnfs_status ff_next_unit(
+    IN const pnfs_file_layout *layout,
+    IN uint64_t *position,
+    IN uint64_t offset_end,
+    OUT pnfs_io_unit *io)
+{
+    const uint64_t layout_end = layout->layout.offset + layout->layout.length;
+
+    io->offset = *position;
+    io->length = min(offset_end, layout_end);
+    if (io->offset >= io->length) /* nothing to do, return success */
+        return PNFS_SUCCESS;
+
+    io->length -= io->offset;
+    return PNFS_PENDING;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
 static enum pnfs_status pattern_threads_init(
     IN pnfs_io_pattern *pattern,
     IN enum pnfs_iomode iomode,
@@ -191,6 +379,16 @@ static enum pnfs_status pattern_threads_init(
         if (!layout_compatible(&layout->layout, iomode, position))
             continue;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        if (is_flexfiles(layout)) {
+            status = ff_threads_init(pattern, layout, iomode, position, &t);
+            if (status)
+                goto out;
+            position = layout->layout.offset + layout->layout.length;
+            continue;
+        }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
         for (s = 0; s < layout->device->stripes.count; s++) {
             uint64_t off = position;
 
@@ -226,6 +424,7 @@ out:
 static enum pnfs_status pattern_init(
     IN pnfs_io_pattern *pattern,
     IN nfs41_root *root,
+    IN nfs41_session *session,
     IN nfs41_path_fh *meta_file,
     IN const stateid_arg *stateid,
     IN pnfs_layout_state *state,
@@ -247,6 +446,7 @@ static enum pnfs_status pattern_init(
 
     /* information shared between threads */
     pattern->root = root;
+    pattern->session = session;
     pattern->meta_file = meta_file;
     pattern->stateid = stateid;
     pattern->state = state;
@@ -342,6 +542,12 @@ static enum pnfs_status thread_next_unit(
     if (status)
         goto out_unlock;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (is_flexfiles(thread->layout))
+        status = ff_next_unit(thread->layout,
+            &thread->offset, pattern->offset_end, io);
+    else
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
     status = stripe_next_unit(thread->layout, thread->id,
         &thread->offset, pattern->offset_end, io);
     if (status == PNFS_PENDING)
@@ -356,9 +562,22 @@ static enum pnfs_status thread_data_server(
     IN pnfs_io_thread *thread,
     OUT pnfs_data_server **server_out)
 {
-    pnfs_file_device *device = thread->layout->device;
-    const uint32_t serverid = data_server_index(device, thread->id);
+    pnfs_file_device *device;
+    uint32_t serverid;
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (is_flexfiles(thread->layout)) {
+        const pnfs_ff_mirror *mirror =
+            &thread->layout->mirrors.arr[thread->id];
+        if (mirror->device == NULL)
+            return PNFSERR_NO_DEVICE;
+        *server_out = ff_mirror_server(mirror);
+        return PNFS_SUCCESS;
+    }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 
+    device = thread->layout->device;
+    serverid = data_server_index(device, thread->id);
     if (serverid >= device->servers.count)
         return PNFSERR_INVALID_DS_INDEX;
 
@@ -366,75 +585,202 @@ static enum pnfs_status thread_data_server(
     return PNFS_SUCCESS;
 }
 
-static enum pnfs_status pattern_join(
-    IN HANDLE *threads,
-    IN DWORD count)
+/*
+ * pNFS I/O thread pool
+ *
+ * The io units of a pattern are queued to a pool of persistent worker
+ * threads instead of creating (and tearing down) one thread per unit.
+ * The pool starts with |PNFS_IO_POOL_MIN_THREADS| threads and grows on
+ * demand up to |PNFS_IO_POOL_MAX_THREADS| when more units are queued
+ * than there are idle workers, since each unit blocks in its RPCs.
+ * Workers never wait for other io units, so the pool can't deadlock.
+ */
+#define PNFS_IO_POOL_MIN_THREADS 4
+#define PNFS_IO_POOL_MAX_THREADS 64
+
+static struct {
+    SRWLOCK                 lock;
+    CONDITION_VARIABLE      cond; /* signalled when a unit is queued */
+    struct list_entry       queue;
+    uint32_t                num_queued;
+    uint32_t                num_idle;
+    uint32_t                num_threads;
+} io_pool;
+
+static void io_unit_start(
+    IN pnfs_io_thread *thread)
 {
-    DWORD status;
-    /* WaitForMultipleObjects() supports a maximum of 64 objects */
-    while (count) {
-        const DWORD n = min(count, MAXIMUM_WAIT_OBJECTS);
-        status = WaitForMultipleObjects(n, threads, TRUE, INFINITE);
-        if (status != WAIT_OBJECT_0)
-            return PNFSERR_RESOURCES;
+    LONG depth, depth_max;
 
-        count -= n;
-        threads += n;
+    /* track the per-data server queue depth */
+    if (thread_data_server(thread, &thread->server)) {
+        thread->server = NULL;
+        return;
+    }
+
+    depth = InterlockedIncrement(&thread->server->io_queue_depth);
+    depth_max = thread->server->io_queue_depth_max;
+    while (depth > depth_max) {
+        const LONG prev = InterlockedCompareExchange(
+            &thread->server->io_queue_depth_max, depth, depth_max);
+        if (prev == depth_max) {
+            DPRINTF(IOLVL, ("io_unit_start: new max queue depth %ld "
+                "for data server %p\n", (long)depth,
+                (void *)thread->server));
+            break;
+        }
+        depth_max = prev;
     }
-    return PNFS_SUCCESS;
+}
+
+static void io_unit_run(
+    IN pnfs_io_thread *thread)
+{
+    thread->status = (enum pnfs_status)thread->pattern->thread_fn(thread);
+
+    if (thread->server)
+        (void)InterlockedDecrement(&thread->server->io_queue_depth);
+}
+
+static unsigned int WINAPI io_pool_thread(void *args)
+{
+    pnfs_io_thread *thread;
+    pnfs_io_pattern *pattern;
+
+    AcquireSRWLockExclusive(&io_pool.lock);
+    for (;;) {
+        while (list_empty(&io_pool.queue)) {
+            io_pool.num_idle++;
+            (void)SleepConditionVariableSRW(&io_pool.cond,
+                &io_pool.lock, INFINITE, 0);
+            io_pool.num_idle--;
+        }
+
+        thread = list_container(io_pool.queue.next, pnfs_io_thread, entry);
+        list_remove(&thread->entry);
+        io_pool.num_queued--;
+        ReleaseSRWLockExclusive(&io_pool.lock);
+
+        io_unit_run(thread);
+
+        /* |thread| may be freed as soon as |pattern->pending| drops */
+        pattern = thread->pattern;
+        AcquireSRWLockExclusive(&io_pool.lock);
+        if (--pattern->pending == 0)
+            WakeConditionVariable(&pattern->done);
+    }
+    return 0;
+}
+
+/* called with |io_pool.lock| held exclusive */
+static bool_t io_pool_spawn(void)
+{
+    HANDLE thread;
+
+    /*
+     * Only reserve the stack, so idle workers don't hold on to
+     * |NFSD_THREAD_STACK_SIZE| bytes of commit charge each
+     */
+    thread = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
+        io_pool_thread, NULL, STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+    if (thread == NULL) {
+        eprintf("io_pool_spawn: _beginthreadex() failed with %d\n",
+            (int)GetLastError());
+        return FALSE;
+    }
+    (void)CloseHandle(thread);
+    io_pool.num_threads++;
+    return TRUE;
+}
+
+/* called with |io_pool.lock| held exclusive */
+static bool_t io_pool_submit(
+    IN pnfs_io_thread *thread)
+{
+    if ((io_pool.num_queued >= io_pool.num_idle) &&
+        (io_pool.num_threads < PNFS_IO_POOL_MAX_THREADS)) {
+        (void)io_pool_spawn();
+    }
+    if (io_pool.num_threads == 0)
+        return FALSE;
+
+    list_add_tail(&io_pool.queue, &thread->entry);
+    io_pool.num_queued++;
+    WakeConditionVariable(&io_pool.cond);
+    return TRUE;
+}
+
+void pnfs_io_pool_init(void)
+{
+    uint32_t i;
+
+    InitializeSRWLock(&io_pool.lock);
+    InitializeConditionVariable(&io_pool.cond);
+    list_init(&io_pool.queue);
+
+    AcquireSRWLockExclusive(&io_pool.lock);
+    for (i = 0; i < PNFS_IO_POOL_MIN_THREADS; i++) {
+        if (!io_pool_spawn())
+            break;
+    }
+    ReleaseSRWLockExclusive(&io_pool.lock);
+
+    DPRINTF(1, ("pnfs_io_pool_init: started %u pnfs io threads\n",
+        (unsigned int)io_pool.num_threads));
 }
 
 static enum pnfs_status pattern_fork(
     IN pnfs_io_pattern *pattern,
     IN pnfs_io_thread_fn thread_fn)
 {
-    HANDLE *threads;
-    uint32_t i;
+    uint32_t i, queued;
     enum pnfs_status status = PNFS_SUCCESS;
 
     if (pattern->count == 0)
         goto out;
 
+    pattern->thread_fn = thread_fn;
+    for (i = 0; i < pattern->count; i++)
+        io_unit_start(&pattern->threads[i]);
+
     if (pattern->count == 1) {
-        /* no need to fork if there's only 1 thread */
-        status = (enum pnfs_status)thread_fn(pattern->threads);
+        /* no need to queue anything if there's only 1 unit */
+        io_unit_run(&pattern->threads[0]);
+        status = pattern->threads[0].status;
         goto out;
     }
 
-    /* create a thread for each unit that has actual io */
-    threads = calloc(pattern->count, sizeof(HANDLE));
-    if (threads == NULL) {
-        status = PNFSERR_RESOURCES;
-        goto out;
+    /*
+     * Queue all units but the first one to the io pool, the calling
+     * thread handles the first one itself
+     */
+    InitializeConditionVariable(&pattern->done);
+    AcquireSRWLockExclusive(&io_pool.lock);
+    for (queued = 1; queued < pattern->count; queued++) {
+        if (!io_pool_submit(&pattern->threads[queued]))
+            break;
     }
+    pattern->pending = queued - 1;
+    ReleaseSRWLockExclusive(&io_pool.lock);
 
-    for (i = 0; i < pattern->count; i++) {
-        threads[i] = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
-            thread_fn, &pattern->threads[i], 0, NULL);
-        if (threads[i] == NULL) {
-            eprintf("_beginthreadex() failed with %d\n", GetLastError());
-            pattern->count = i; /* join any threads already started */
-            break;
-        }
-    }
-
-    /* wait on all threads to finish */
-    status = pattern_join(threads, pattern->count);
-    if (status) {
-        eprintf("pattern_join() failed with '%s'\n", pnfs_error_string(status));
-        goto out;
+    io_unit_run(&pattern->threads[0]);
+
+    /* run anything the pool couldn't take in this thread */
+    for (i = queued; i < pattern->count; i++)
+        io_unit_run(&pattern->threads[i]);
+
+    /* wait for the pool to finish the queued units */
+    AcquireSRWLockExclusive(&io_pool.lock);
+    while (pattern->pending) {
+        (void)SleepConditionVariableSRW(&pattern->done,
+            &io_pool.lock, INFINITE, 0);
     }
+    ReleaseSRWLockExclusive(&io_pool.lock);
 
-    for (i = 0; i < pattern->count; i++) {
-        /* keep track of the most severe error returned by a thread */
-        DWORD exitcode;
-        if (GetExitCodeThread(threads[i], &exitcode))
-            status = max(status, (enum pnfs_status)exitcode);
-
-        CloseHandle(threads[i]);
+    for (i = 0; i < pattern->count; i++) {
+        /* keep track of the most severe error returned by a unit */
+        status = max(status, pattern->threads[i].status);
     }
-
-    free(threads);
 out:
     return status;
 }
@@ -484,6 +830,273 @@ static enum pnfs_status map_ds_error(
     }
 }
 
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+/* tell the metadata server which data server failed, so it can hand
+ * out layouts for other ones; the io falls back to the metadata
+ * server either way */
+static void thread_layouterror(
+    IN pnfs_io_thread *thread,
+    IN enum nfsstat4 nfsstat,
+    IN uint32_t opnum)
+{
+    pnfs_io_pattern *pattern = thread->pattern;
+    unsigned char *deviceid = thread->layout->deviceid;
+    stateid4 layout_stateid;
+    int status;
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (is_flexfiles(thread->layout))
+        deviceid = thread->layout->mirrors.arr[thread->id].deviceid;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+#ifndef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    if (!is_flexfiles(thread->layout))
+        return;
+#endif /* !NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
+    /* LAYOUTERROR is new in NFSv4.2 */
+    if (pattern->root->nfsminorvers < 2)
+        return;
+
+    AcquireSRWLockShared(&pattern->state->lock);
+    memcpy(&layout_stateid, &pattern->state->stateid, sizeof(stateid4));
+    ReleaseSRWLockShared(&pattern->state->lock);
+
+    status = nfs42_layouterror(pattern->session, pattern->meta_file,
+        &layout_stateid, thread->offset,
+        pattern->offset_end - thread->offset, deviceid,
+        nfsstat, opnum);
+    if (status) {
+        DPRINTF(IOLVL, ("nfs42_layouterror() failed with '%s'\n",
+            nfs_error_string(status)));
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
+static enum pnfs_status thread_ds_error(
+    IN pnfs_io_thread *thread,
+    IN enum nfsstat4 nfsstat,
+    IN uint32_t opnum)
+{
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (is_flexfiles(thread->layout))
+        ff_mirror_failed(thread);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+    thread_layouterror(thread, nfsstat, opnum);
+#else
+    (void)opnum;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+    return map_ds_error(nfsstat, thread->pattern->state, thread->layout);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+/*
+ * LAYOUTSTATS
+ *
+ * The io threads count completed READs and WRITEs with their bytes
+ * and latency in the |pnfs_io_stats| of the layout segment (of the
+ * mirror for flexfiles layouts) and of the data server. With an
+ * NFSv4.2 metadata server, pnfs_read() and pnfs_write() send the
+ * counters of all segments of the layout with one LAYOUTSTATS each
+ * from a separate thread, once per |LAYOUTSTATS_INTERVAL|. The
+ * counters are cumulative since the first io of the segment.
+ */
+#define LAYOUTSTATS_INTERVAL 60000 /* milliseconds */
+
+static void io_stats_add(
+    IN pnfs_io_stats *stats,
+    IN bool_t write,
+    IN uint32_t bytes,
+    IN LONGLONG usec)
+{
+    if (stats->start == 0)
+        (void)InterlockedCompareExchange64(&stats->start,
+            (LONGLONG)GetTickCount64(), 0);
+    if (write) {
+        (void)InterlockedIncrement64(&stats->write_ops);
+        (void)InterlockedExchangeAdd64(&stats->write_bytes, bytes);
+        (void)InterlockedExchangeAdd64(&stats->write_busy, usec);
+    } else {
+        (void)InterlockedIncrement64(&stats->read_ops);
+        (void)InterlockedExchangeAdd64(&stats->read_bytes, bytes);
+        (void)InterlockedExchangeAdd64(&stats->read_busy, usec);
+    }
+}
+
+static void thread_stats_add(
+    IN pnfs_io_thread *thread,
+    IN pnfs_data_server *server,
+    IN bool_t write,
+    IN uint32_t bytes,
+    IN LONGLONG usec)
+{
+    pnfs_io_stats *stats = &thread->layout->stats;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (is_flexfiles(thread->layout))
+        stats = &thread->layout->mirrors.arr[thread->id].stats;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+    io_stats_add(stats, write, bytes, usec);
+    io_stats_add(&server->stats, write, bytes, usec);
+}
+
+struct layout_stats_report {
+    nfs41_session           *session;
+    nfs41_path_fh           file;
+    stateid4                stateid;
+    uint32_t                count;
+    nfs42_layoutstats_args  args[NFS42_LAYOUTSTATS_MAX_OPS];
+    unsigned char           deviceids[NFS42_LAYOUTSTATS_MAX_OPS][PNFS_DEVICEID_SIZE];
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    netaddr4                addrs[NFS42_LAYOUTSTATS_MAX_OPS];
+    nfs41_fh                fhs[NFS42_LAYOUTSTATS_MAX_OPS];
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+};
+
+/* adds one LAYOUTSTATS for |stats|, if it counted any io */
+static void layout_stats_report_add(
+    IN struct layout_stats_report *lsr,
+    IN const pnfs_file_layout *layout,
+    IN const unsigned char *deviceid,
+    IN const pnfs_io_stats *stats)
+{
+    nfs42_layoutstats_args *args;
+
+    if (lsr->count >= NFS42_LAYOUTSTATS_MAX_OPS)
+        return;
+    if (stats->read_ops == 0 && stats->write_ops == 0)
+        return;
+
+    args = &lsr->args[lsr->count];
+    memcpy(lsr->deviceids[lsr->count], deviceid, PNFS_DEVICEID_SIZE);
+    args->offset = layout->layout.offset;
+    args->length = layout->layout.length;
+    args->stateid = &lsr->stateid;
+    args->read.count = stats->read_ops;
+    args->read.bytes = stats->read_bytes;
+    args->write.count = stats->write_ops;
+    args->write.bytes = stats->write_bytes;
+    args->deviceid = lsr->deviceids[lsr->count];
+    args->type = layout->layout.type;
+    args->ff_addr = NULL;
+    args->ff_fh = NULL;
+    args->ff_read_busy = stats->read_busy;
+    args->ff_write_busy = stats->write_busy;
+    args->ff_duration = (GetTickCount64() - stats->start) * 1000;
+    lsr->count++;
+}
+
+static unsigned int WINAPI layout_stats_thread(void *arg)
+{
+    struct layout_stats_report *lsr = (struct layout_stats_report*)arg;
+    int status;
+
+    status = nfs42_layoutstats(lsr->session, &lsr->file,
+        lsr->args, lsr->count);
+    if (status) {
+        DPRINTF(IOLVL, ("nfs42_layoutstats() failed with '%s'\n",
+            nfs_error_string(status)));
+    }
+    free(lsr);
+    return 0;
+}
+
+static void layout_stats_check(
+    IN nfs41_root *root,
+    IN nfs41_open_state *state,
+    IN pnfs_layout_state *layout)
+{
+    const LONGLONG now = (LONGLONG)GetTickCount64();
+    const LONGLONG sent = layout->stats_sent;
+    struct layout_stats_report *lsr;
+    struct list_entry *entry;
+    HANDLE thread;
+
+    /* LAYOUTSTATS is new in NFSv4.2 */
+    if (root->nfsminorvers < 2)
+        return;
+
+    /* the first io starts the interval, and only one of the threads
+     * that see it expire sends the report */
+    if (sent && now - sent < LAYOUTSTATS_INTERVAL)
+        return;
+    if (InterlockedCompareExchange64(&layout->stats_sent, now, sent) != sent)
+        return;
+    if (sent == 0)
+        return;
+
+    lsr = calloc(1, sizeof(struct layout_stats_report));
+    if (lsr == NULL)
+        return;
+    lsr->session = state->session;
+    lsr->file.fh = state->file.fh;
+
+    AcquireSRWLockShared(&layout->lock);
+    memcpy(&lsr->stateid, &layout->stateid, sizeof(stateid4));
+    list_for_each(entry, &layout->layouts) {
+        pnfs_file_layout *file = file_layout_entry(entry);
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        if (is_flexfiles(file)) {
+            uint32_t i, n;
+            for (i = 0; i < file->mirrors.count; i++) {
+                const pnfs_ff_mirror *mirror = &file->mirrors.arr[i];
+                if (mirror->device == NULL)
+                    continue;
+                n = lsr->count;
+                layout_stats_report_add(lsr, file, mirror->deviceid,
+                    &mirror->stats);
+                if (n == lsr->count)
+                    continue;
+                lsr->addrs[n] = ff_mirror_server(mirror)->addrs.arr[0];
+                lsr->fhs[n] = mirror->file.fh;
+                lsr->args[n].ff_addr = &lsr->addrs[n];
+                lsr->args[n].ff_fh = &lsr->fhs[n];
+            }
+            continue;
+        }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+        layout_stats_report_add(lsr, file, file->deviceid, &file->stats);
+    }
+    ReleaseSRWLockShared(&layout->lock);
+
+    if (lsr->count == 0) {
+        free(lsr);
+        return;
+    }
+
+    thread = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
+        layout_stats_thread, lsr, 0, NULL);
+    if (thread == NULL) {
+        eprintf("layout_stats_check: _beginthreadex() failed with %d\n",
+            (int)GetLastError());
+        free(lsr);
+        return;
+    }
+    (void)CloseHandle(thread);
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+
+static void thread_stateid(
+    IN const pnfs_io_thread *thread,
+    OUT stateid_arg *stateid)
+{
+    memcpy(stateid, thread->pattern->stateid, sizeof(stateid_arg));
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (is_flexfiles(thread->layout)) {
+        /* use the ffds_stateid of the mirror, unless it is anonymous */
+        const stateid4 *ds_stateid =
+            &thread->layout->mirrors.arr[thread->id].stateid;
+        static const stateid4 anonymous = { 0 };
+        if (memcmp(ds_stateid, &anonymous, sizeof(stateid4))) {
+            memcpy(&stateid->stateid, ds_stateid, sizeof(stateid4));
+            return;
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+    stateid->stateid.seqid = 0;
+}
+
 static uint32_t WINAPI file_layout_read_thread(void *args)
 {
     pnfs_io_unit io;
@@ -496,6 +1109,11 @@ static uint32_t WINAPI file_layout_read_thread(void *args)
     enum pnfs_status status;
     enum nfsstat4 nfsstat;
     bool_t eof;
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+    LARGE_INTEGER start;
+    LONGLONG usec;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
 
     DPRINTF(IOLVL, ("--> file_layout_read_thread(%u)\n", thread->id));
 
@@ -515,8 +1133,7 @@ static uint32_t WINAPI file_layout_read_thread(void *args)
         goto out;
     }
 
-    memcpy(&stateid, pattern->stateid, sizeof(stateid));
-    stateid.stateid.seqid = 0;
+    thread_stateid(thread, &stateid);
 
     total_read = 0;
     while (thread_next_unit(thread, &io) == PNFS_PENDING) {
@@ -524,14 +1141,29 @@ static uint32_t WINAPI file_layout_read_thread(void *args)
         if (io.length > maxreadsize)
             io.length = maxreadsize;
 
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+        (void)QueryPerformanceCounter(&start);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
         nfsstat = nfs41_read(client->session, thread->file, &stateid,
             io.offset, (uint32_t)io.length, io.buffer, &bytes_read, &eof);
         if (nfsstat) {
             eprintf("nfs41_read() failed with '%s'\n",
                 nfs_error_string(nfsstat));
-            status = map_ds_error(nfsstat, pattern->state, thread->layout);
+            status = thread_ds_error(thread, nfsstat, OP_READ);
             break;
         }
+#if defined(NFS41_DRIVER_DAEMON_PNFS_FLEXFILES) || \
+    defined(NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS)
+        usec = io_elapsed_usec(&start);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES || NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        if (is_flexfiles(thread->layout))
+            ff_read_latency_update(server, usec);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+        thread_stats_add(thread, server, FALSE, bytes_read, usec);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
 
         total_read += bytes_read;
         thread->offset += bytes_read;
@@ -562,6 +1194,9 @@ static uint32_t WINAPI file_layout_write_thread(void *args)
     uint32_t maxwritesize, bytes_written, total_written;
     enum pnfs_status status;
     enum nfsstat4 nfsstat;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    LARGE_INTEGER start;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
 
     DPRINTF(IOLVL, ("--> file_layout_write_thread(%u)\n", thread->id));
 
@@ -581,8 +1216,7 @@ static uint32_t WINAPI file_layout_write_thread(void *args)
         goto out;
     }
 
-    memcpy(&stateid, pattern->stateid, sizeof(stateid));
-    stateid.stateid.seqid = 0;
+    thread_stateid(thread, &stateid);
 
     maxwritesize = max_write_size(client->session, &thread->file->fh);
 
@@ -597,15 +1231,22 @@ retry_write:
         if (io.length > maxwritesize)
             io.length = maxwritesize;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+        (void)QueryPerformanceCounter(&start);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
         nfsstat = nfs41_write(client->session, thread->file, &stateid,
             io.buffer, (uint32_t)io.length, io.offset, UNSTABLE4,
             &bytes_written, &thread->verf, NULL);
         if (nfsstat) {
             eprintf("nfs41_write() failed with '%s'\n",
                 nfs_error_string(nfsstat));
-            status = map_ds_error(nfsstat, pattern->state, thread->layout);
+            status = thread_ds_error(thread, nfsstat, OP_WRITE);
             break;
         }
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+        thread_stats_add(thread, server, TRUE, bytes_written,
+            io_elapsed_usec(&start));
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
         if (!verify_write(&thread->verf, &thread->stable))
             goto retry_write;
 
@@ -638,7 +1279,7 @@ retry_write:
         commit_min, (uint32_t)(commit_max - commit_min), 0, &thread->verf, NULL);
 
     if (nfsstat)
-        status = map_ds_error(nfsstat, pattern->state, thread->layout);
+        status = thread_ds_error(thread, nfsstat, OP_COMMIT);
     else if (!verify_commit(&thread->verf)) {
         /* resend the writes unless the layout was recalled */
         if (status != PNFSERR_LAYOUT_RECALLED)
@@ -650,11 +1291,50 @@ retry_write:
         thread->stable = DATA_SYNC4;
     }
 out:
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    /* the metadata server of a flexfiles layout learns about the new
+     * size and mtime only from LAYOUTCOMMIT, see RFC 8435 section 6 */
+    if (is_flexfiles(thread->layout) && thread->stable == FILE_SYNC4 &&
+        !(thread->layout->ff_flags & FF_FLAGS_NO_LAYOUTCOMMIT))
+        thread->stable = DATA_SYNC4;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
     DPRINTF(IOLVL, ("<-- file_layout_write_thread(%u) returning '%s'\n",
         thread->id, pnfs_error_string(status)));
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+/* read from the selected mirror, and fail over to the other mirrors
+ * of the segment if its data server can not be reached */
+static uint32_t WINAPI ff_layout_read_thread(void *args)
+{
+    pnfs_io_thread *thread = (pnfs_io_thread*)args;
+    const uint64_t offset_start = thread->offset;
+    enum pnfs_status status;
+    uint32_t tries = 0, next;
+
+    for (;;) {
+        status = file_layout_read_thread(thread);
+        if (!is_flexfiles(thread->layout))
+            break;
+        if (status != PNFSERR_IO && status != PNFSERR_NO_DEVICE &&
+            status != PNFSERR_NOT_CONNECTED)
+            break;
+        if (++tries >= thread->layout->mirrors.count)
+            break;
+        if (!ff_mirror_select(thread->layout, thread->id, &next))
+            break;
+
+        DPRINTF(IOLVL, ("ff_layout_read_thread: mirror %u failed with "
+            "'%s', retrying with mirror %u\n", thread->id,
+            pnfs_error_string(status), next));
+        thread->id = next;
+        thread->file = &thread->layout->mirrors.arr[next].file;
+        thread->offset = offset_start;
+    }
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 
 enum pnfs_status pnfs_read(
     IN nfs41_root *root,
@@ -684,7 +1364,8 @@ enum pnfs_status pnfs_read(
 
     if (status == PNFS_SUCCESS) {
         /* interpret the layout and set up threads for io */
-        status = pattern_init(&pattern, root, &state->file, stateid,
+        status = pattern_init(&pattern, root, state->session,
+            &state->file, stateid,
             layout, buffer_out, PNFS_IOMODE_READ, offset, length,
             state->session->lease_time);
         if (status)
@@ -697,6 +1378,11 @@ enum pnfs_status pnfs_read(
     if (status)
         goto out;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (layout_state_type(layout) == PNFS_LAYOUTTYPE_FLEXFILES)
+        status = pattern_fork(&pattern, ff_layout_read_thread);
+    else
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
     status = pattern_fork(&pattern, file_layout_read_thread);
     if (status != PNFS_SUCCESS && status != PNFS_READ_EOF)
         goto out_free_pattern;
@@ -704,6 +1390,9 @@ enum pnfs_status pnfs_read(
     *len_out = (ULONG)pattern_bytes_transferred(&pattern, NULL);
 
 out_free_pattern:
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    layout_stats_check(root, state, layout);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
     pattern_free(&pattern);
 out:
     DPRINTF(IOLVL, ("<-- pnfs_read() returning '%s'\n",
@@ -723,8 +1412,13 @@ static enum pnfs_status mds_commit(
     enum pnfs_status status = PNFS_SUCCESS;
     uint32_t i;
 
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+    nfsstat = nfs41_commit_coalesced(state->session,
+        &state->file, offset, length, &verf, info);
+#else
     nfsstat = nfs41_commit(state->session,
         &state->file, offset, length, 1, &verf, info);
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
     if (nfsstat) {
         eprintf("nfs41_commit() to mds failed with '%s'\n",
             nfs_error_string(nfsstat));
@@ -789,7 +1483,7 @@ static enum pnfs_status layout_commit(
     DPRINTF(1, ("LAYOUTCOMMIT for offset=%lld len=%lld new_last_offset=%u\n",
         offset, length, new_last_offset ? 1 : 0));
     nfsstat = pnfs_rpc_layoutcommit(state->session, &state->file,
-        &layout_stateid, offset, length, new_last_offset, NULL, info);
+        &layout_stateid, layout_state_type(layout), offset, length, new_last_offset, NULL, info);
     if (nfsstat) {
         DPRINTF(IOLVL, ("pnfs_rpc_layoutcommit() failed with '%s'\n",
             nfs_error_string(nfsstat)));
@@ -798,6 +1492,240 @@ static enum pnfs_status layout_commit(
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+/*
+ * Deferred LAYOUTCOMMIT
+ *
+ * DATA_SYNC4 writes to the data servers need a LAYOUTCOMMIT to make
+ * the new size and mtime visible on the metadata server. Instead of
+ * one LAYOUTCOMMIT per write upcall, layout_commit_defer() adds the
+ * written range and the new last offset to |pnfs_layout_state.commit|
+ * and answers the upcall from the attribute cache, whose size it
+ * updates. One LAYOUTCOMMIT for the whole range is then sent by
+ * |pnfs_layout_commit_flush()|: On close, before GETATTR and before
+ * SETATTR of the size, before LAYOUTRETURN, and by the next write once
+ * the range is older than |LAYOUTCOMMIT_DEFER_MAX|.
+ * A CB_LAYOUTRECALL for a layout with a pending LAYOUTCOMMIT is
+ * answered with NFS4ERR_DELAY, and the LAYOUTCOMMIT is sent from a
+ * separate thread, see |pnfs_layout_commit_recall()|.
+ */
+#define LAYOUTCOMMIT_DEFER_MAX 1000 /* milliseconds */
+
+/* expects caller to hold an exclusive lock on |layout| */
+static bool_t layout_commit_take(
+    IN pnfs_layout_state *layout,
+    OUT stateid4 *stateid,
+    OUT pnfs_layout_commit *commit)
+{
+    if (!layout->commit.pending)
+        return FALSE;
+
+    *commit = layout->commit;
+    memcpy(stateid, &layout->stateid, sizeof(stateid4));
+    layout->commit.pending = FALSE;
+    return TRUE;
+}
+
+static enum pnfs_status layout_commit_send(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *meta_file,
+    IN stateid4 *stateid,
+    IN enum pnfs_layout_type type,
+    IN pnfs_layout_commit *commit,
+    OUT nfs41_file_info *info)
+{
+    enum nfsstat4 nfsstat;
+
+    DPRINTF(1, ("LAYOUTCOMMIT for offset=%llu len=%llu "
+        "new_last_offset=%d\n", commit->offset,
+        commit->end - commit->offset, (int)commit->new_last_offset));
+    nfsstat = pnfs_rpc_layoutcommit(session, meta_file, stateid, type,
+        commit->offset, commit->end - commit->offset,
+        commit->new_last_offset ? &commit->last_offset : NULL, NULL, info);
+    if (nfsstat) {
+        eprintf("layout_commit_send: pnfs_rpc_layoutcommit() "
+            "failed with '%s'\n", nfs_error_string(nfsstat));
+        return PNFSERR_IO;
+    }
+    return PNFS_SUCCESS;
+}
+
+enum pnfs_status pnfs_layout_commit_flush(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *meta_file,
+    IN pnfs_layout_state *layout,
+    OUT OPTIONAL nfs41_file_info *info)
+{
+    nfs41_file_info tmp_info;
+    pnfs_layout_commit commit;
+    stateid4 stateid;
+    bool_t pending;
+
+    AcquireSRWLockExclusive(&layout->lock);
+    pending = layout_commit_take(layout, &stateid, &commit);
+    ReleaseSRWLockExclusive(&layout->lock);
+
+    if (!pending)
+        return PNFS_SUCCESS;
+
+    if (info == NULL) {
+        (void)memset(&tmp_info, 0, sizeof(tmp_info));
+        info = &tmp_info;
+    }
+    return layout_commit_send(session, meta_file, &stateid,
+        layout_state_type(layout), &commit, info);
+}
+
+enum pnfs_status pnfs_layout_commit_open_state(
+    IN nfs41_open_state *state)
+{
+    pnfs_layout_state *layout;
+
+    AcquireSRWLockShared(&state->lock);
+    layout = state->layout;
+    ReleaseSRWLockShared(&state->lock);
+
+    /* the open holds a reference on |layout| until its close */
+    if (layout == NULL)
+        return PNFS_SUCCESS;
+    return pnfs_layout_commit_flush(state->session, &state->file,
+        layout, NULL);
+}
+
+struct layout_commit_recall {
+    nfs41_session       *session;
+    nfs41_path_fh       file;
+    stateid4            stateid;
+    enum pnfs_layout_type type;
+    pnfs_layout_commit  commit;
+};
+
+static unsigned int WINAPI layout_commit_recall_thread(void *arg)
+{
+    struct layout_commit_recall *lcr = (struct layout_commit_recall*)arg;
+    nfs41_file_info info = { 0 };
+
+    (void)layout_commit_send(lcr->session, &lcr->file, &lcr->stateid,
+        lcr->type, &lcr->commit, &info);
+    free(lcr);
+    return 0;
+}
+
+/*
+ * Returns |TRUE| if |layout| has a pending LAYOUTCOMMIT, which must be
+ * sent before the recall can be processed. The LAYOUTCOMMIT is sent
+ * from a new thread, because the callback thread must not wait for
+ * fore channel RPCs; the server retries the CB_LAYOUTRECALL after our
+ * NFS4ERR_DELAY
+ */
+bool_t pnfs_layout_commit_recall(
+    IN nfs41_client *client,
+    IN pnfs_layout_state *layout)
+{
+    struct layout_commit_recall *lcr;
+    HANDLE thread;
+
+    if (!layout->commit.pending)
+        return FALSE;
+
+    lcr = calloc(1, sizeof(struct layout_commit_recall));
+    if (lcr == NULL)
+        goto out;
+
+    lcr->session = client->session;
+    fh_copy(&lcr->file.fh, &layout->meta_fh);
+    lcr->type = layout_state_type(layout);
+    (void)layout_commit_take(layout, &lcr->stateid, &lcr->commit);
+
+    thread = (HANDLE)_beginthreadex(NULL, NFSD_THREAD_STACK_SIZE,
+        layout_commit_recall_thread, lcr, 0, NULL);
+    if (thread == NULL) {
+        eprintf("pnfs_layout_commit_recall: "
+            "_beginthreadex() failed with %d\n", (int)GetLastError());
+        /* keep it pending for the next try */
+        layout->commit = lcr->commit;
+        free(lcr);
+        goto out;
+    }
+    (void)CloseHandle(thread);
+out:
+    return TRUE;
+}
+
+static enum pnfs_status layout_commit_defer(
+    IN nfs41_open_state *state,
+    IN pnfs_layout_state *layout,
+    IN uint64_t offset,
+    IN uint64_t length,
+    OUT nfs41_file_info *info)
+{
+    struct nfs41_name_cache *cache = session_name_cache(state->session);
+    const uint64_t end = offset + length;
+    const uint64_t last_offset = end - 1;
+    nfs41_file_info size_info = { 0 };
+    bool_t new_last_offset = FALSE, expired;
+    enum pnfs_status status = PNFS_SUCCESS;
+
+    /*
+     * The write upcall returns the change attribute; if it is not
+     * cached, we have to ask the server anyway
+     */
+    if (nfs41_attr_cache_lookup(cache, state->file.fh.fileid, info) ||
+        !bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_CHANGE)) {
+        status = layout_commit(state, layout, offset, length, info);
+        goto out;
+    }
+
+    AcquireSRWLockExclusive(&state->lock);
+    if (state->pnfs_last_offset < last_offset ||
+        (state->pnfs_last_offset == 0 && last_offset == 0)) {
+        state->pnfs_last_offset = last_offset;
+        new_last_offset = TRUE;
+    }
+    ReleaseSRWLockExclusive(&state->lock);
+
+    AcquireSRWLockExclusive(&layout->lock);
+    if (!layout->commit.pending) {
+        layout->commit.pending = TRUE;
+        layout->commit.new_last_offset = FALSE;
+        layout->commit.offset = offset;
+        layout->commit.end = end;
+        layout->commit.since = GetTickCount64();
+    } else {
+        layout->commit.offset = min(layout->commit.offset, offset);
+        layout->commit.end = max(layout->commit.end, end);
+    }
+    if (new_last_offset && (!layout->commit.new_last_offset ||
+        layout->commit.last_offset < last_offset)) {
+        layout->commit.new_last_offset = TRUE;
+        layout->commit.last_offset = last_offset;
+    }
+    expired = (GetTickCount64() - layout->commit.since) >
+        LAYOUTCOMMIT_DEFER_MAX;
+    ReleaseSRWLockExclusive(&layout->lock);
+
+    if (expired) {
+        status = pnfs_layout_commit_flush(state->session, &state->file,
+            layout, info);
+        goto out;
+    }
+
+    /* the server's size is only updated by the LAYOUTCOMMIT */
+    if (new_last_offset &&
+        (!bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_SIZE) ||
+            (info->size < end))) {
+        size_info.attrmask.count = 1;
+        size_info.attrmask.arr[0] = FATTR4_WORD0_SIZE;
+        size_info.size = end;
+        (void)nfs41_attr_cache_update(cache, state->file.fh.fileid,
+            &size_info);
+        info->size = end;
+    }
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
+
 enum pnfs_status pnfs_write(
     IN nfs41_root *root,
     IN nfs41_open_state *state,
@@ -828,7 +1756,8 @@ enum pnfs_status pnfs_write(
 
     if (status == PNFS_SUCCESS) {
         /* interpret the layout and set up threads for io */
-        status = pattern_init(&pattern, root, &state->file, stateid,
+        status = pattern_init(&pattern, root, state->session,
+            &state->file, stateid,
             layout, buffer, PNFS_IOMODE_RW, offset, length,
             state->session->lease_time);
         if (status)
@@ -855,14 +1784,22 @@ enum pnfs_status pnfs_write(
         status = mds_commit(state, offset, *len_out, &pattern, info);
     } else if (stable == DATA_SYNC4) {
         /* send LAYOUTCOMMIT to sync the metadata */
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+        status = layout_commit_defer(state, layout, offset, *len_out, info);
+#else
         status = layout_commit(state, layout, offset, *len_out, info);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
     } else {
         /* send a GETATTR to update the cached size */
         bitmap4 attr_request;
-        nfs41_superblock_getattr_mask(state->file.fh.superblock, &attr_request);
+        nfs41_superblock_getattr_profile(state->file.fh.superblock,
+            NFS41_GETATTR_PROFILE_WRITE, &attr_request);
         nfs41_getattr(state->session, &state->file, &attr_request, info);
     }
 out_free_pattern:
+#ifdef NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS
+    layout_stats_check(root, state, layout);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS */
     pattern_free(&pattern);
 out:
     DPRINTF(IOLVL, ("<-- pnfs_write() returning '%s'\n",
@@ -35,6 +35,11 @@
 struct pnfs_layout_list {
     struct list_entry       head;
     CRITICAL_SECTION        lock;
+#ifdef NFS41_DRIVER_DAEMON_LAYOUT_RETAIN
+    /* first opens which found/did not find a retained layout */
+    uint64_t                retained_hits;
+    uint64_t                retained_misses;
+#endif /* NFS41_DRIVER_DAEMON_LAYOUT_RETAIN */
 };
 
 #define state_entry(pos) list_container(pos, pnfs_layout_state, entry)
@@ -43,6 +48,7 @@ struct pnfs_layout_list {
 
 static enum pnfs_status layout_state_create(
     IN const nfs41_fh *meta_fh,
+    IN enum pnfs_layout_type type,
     OUT pnfs_layout_state **layout_out)
 {
     pnfs_layout_state *layout;
@@ -59,6 +65,11 @@ static enum pnfs_status layout_state_create(
     list_init(&layout->recalls);
     InitializeSRWLock(&layout->lock);
     InitializeConditionVariable(&layout->cond);
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    layout->type = type;
+#else
+    UNREFERENCED_PARAMETER(type);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 
     *layout_out = layout;
 out:
@@ -68,6 +79,13 @@ out:
 static void file_layout_free(
     IN pnfs_file_layout *layout)
 {
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    uint32_t i;
+    for (i = 0; i < layout->mirrors.count; i++)
+        if (layout->mirrors.arr[i].device)
+            pnfs_file_device_put(layout->mirrors.arr[i].device);
+    free(layout->mirrors.arr);
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
     if (layout->device) pnfs_file_device_put(layout->device);
     free(layout->filehandles.arr);
     free(layout);
@@ -144,6 +162,11 @@ void pnfs_layout_list_free(
 
     EnterCriticalSection(&layouts->lock);
 
+#ifdef NFS41_DRIVER_DAEMON_LAYOUT_RETAIN
+    DPRINTF(1, ("pnfs_layout_list_free: retained layouts %llu hits, "
+        "%llu misses\n", layouts->retained_hits, layouts->retained_misses));
+#endif /* NFS41_DRIVER_DAEMON_LAYOUT_RETAIN */
+
     list_for_each_tmp(entry, tmp, &layouts->head)
         layout_state_free(state_entry(entry));
 
@@ -152,10 +175,40 @@ void pnfs_layout_list_free(
     free(layouts);
 }
 
+#ifdef NFS41_DRIVER_DAEMON_LAYOUT_RETAIN
+/* expects caller to hold |layouts->lock| */
+static void layout_retained_account(
+    IN struct pnfs_layout_list *layouts,
+    IN pnfs_layout_state *state)
+{
+    bool_t hit;
+
+    AcquireSRWLockShared(&state->lock);
+    hit = !list_empty(&state->layouts);
+    ReleaseSRWLockShared(&state->lock);
+
+    if (hit)
+        layouts->retained_hits++;
+    else
+        layouts->retained_misses++;
+
+    if (((layouts->retained_hits + layouts->retained_misses) % 1024) == 0) {
+        DPRINTF(1, ("retained layouts: %llu hits, %llu misses (%u%%)\n",
+            layouts->retained_hits, layouts->retained_misses,
+            (unsigned int)((layouts->retained_hits * 100) /
+                (layouts->retained_hits + layouts->retained_misses))));
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_LAYOUT_RETAIN */
+
+/* takes an open reference on the layout while holding |layouts->lock|,
+ * so that layout_retained_trim() can not free it */
 static enum pnfs_status layout_state_find_or_create(
     IN struct pnfs_layout_list *layouts,
     IN const nfs41_fh *meta_fh,
-    OUT pnfs_layout_state **layout_out)
+    IN enum pnfs_layout_type type,
+    OUT pnfs_layout_state **layout_out,
+    OUT LONG *open_count_out)
 {
     struct list_entry *entry;
     enum pnfs_status status;
@@ -169,10 +222,14 @@ static enum pnfs_status layout_state_find_or_create(
     if (status) {
         /* create a new layout */
         pnfs_layout_state *layout;
-        status = layout_state_create(meta_fh, &layout);
+        status = layout_state_create(meta_fh, type, &layout);
         if (status == PNFS_SUCCESS) {
             /* add it to the list */
             list_add_head(&layouts->head, &layout->entry);
+            *open_count_out = InterlockedIncrement(&layout->open_count);
+#ifdef NFS41_DRIVER_DAEMON_LAYOUT_RETAIN
+            layouts->retained_misses++;
+#endif /* NFS41_DRIVER_DAEMON_LAYOUT_RETAIN */
             *layout_out = layout;
 
             DPRINTF(FLLVL, ("<-- layout_state_find_or_create() "
@@ -183,6 +240,11 @@ static enum pnfs_status layout_state_find_or_create(
         }
     } else {
         *layout_out = state_entry(entry);
+        *open_count_out = InterlockedIncrement(&(*layout_out)->open_count);
+#ifdef NFS41_DRIVER_DAEMON_LAYOUT_RETAIN
+        if (*open_count_out == 1)
+            layout_retained_account(layouts, *layout_out);
+#endif /* NFS41_DRIVER_DAEMON_LAYOUT_RETAIN */
 
         DPRINTF(FLLVL, ("<-- layout_state_find_or_create() "
             "returning existing layout 0x%p\n", *layout_out));
@@ -228,11 +290,20 @@ static uint64_t range_max(
 static bool_t layout_sanity_check(
     IN pnfs_file_layout *layout)
 {
-    /* prevent div/0 */
     if (layout->layout.length == 0 ||
         layout->layout.iomode < PNFS_IOMODE_READ ||
-        layout->layout.iomode > PNFS_IOMODE_RW ||
-        layout_unit_size(layout) == 0)
+        layout->layout.iomode > PNFS_IOMODE_RW)
+        return FALSE;
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    if (is_flexfiles(layout)) {
+        /* need at least one mirror we can use */
+        if (layout->mirrors.count == 0)
+            return FALSE;
+    } else
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+    /* prevent div/0 */
+    if (layout_unit_size(layout) == 0)
         return FALSE;
 
     /* put a cap on layout.length to prevent overflow */
@@ -260,6 +331,12 @@ static bool_t layout_merge_segments(
     if (to == from)
         return FALSE;
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    /* each flexfiles segment has its own mirror stateids */
+    if (is_flexfiles(to) || is_flexfiles(from))
+        return FALSE;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
     /* the ranges must meet or overlap */
     if (to_max < from->layout.offset || from_max < to->layout.offset)
         return FALSE;
@@ -350,9 +427,11 @@ static enum pnfs_status layout_update_range(
     list_for_each_tmp(entry, tmp, layouts) {
         layout = file_layout_entry(entry);
 
-        /* don't know what to do with non-file layouts */
-        if (layout->layout.type != PNFS_LAYOUTTYPE_FILE)
+        /* don't know what to do with other layout types */
+        if (layout->layout.type != layout_state_type(state)) {
+            file_layout_free(layout);
             continue;
+        }
 
         if (!layout_sanity_check(layout)) {
             file_layout_free(layout);
@@ -438,7 +517,8 @@ static enum pnfs_status file_layout_fetch(
     /* drop the lock during the rpc call */
     ReleaseSRWLockExclusive(&state->lock);
     nfsstat = pnfs_rpc_layoutget(session, meta_file, stateid,
-        iomode, offset, minlength, length, &layoutget_res);
+        layout_state_type(state), iomode, offset, minlength, length,
+        &layoutget_res);
     AcquireSRWLockExclusive(&state->lock);
 
     if (nfsstat) {
@@ -563,6 +643,21 @@ static enum pnfs_status device_status(
     list_for_each(entry, &state->layouts) {
         pnfs_file_layout *layout = file_layout_entry(entry);
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        if (is_flexfiles(layout)) {
+            uint32_t i;
+            for (i = 0; i < layout->mirrors.count; i++) {
+                if (layout->mirrors.arr[i].device == NULL) {
+                    /* copy missing deviceid */
+                    memcpy(deviceid, layout->mirrors.arr[i].deviceid,
+                        PNFS_DEVICEID_SIZE);
+                    return PNFS_PENDING;
+                }
+            }
+            continue;
+        }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
         if (layout->device == NULL) {
             /* copy missing deviceid */
             memcpy(deviceid, layout->deviceid, PNFS_DEVICEID_SIZE);
@@ -582,6 +677,22 @@ static void device_assign(
     list_for_each(entry, &state->layouts) {
         pnfs_file_layout *layout = file_layout_entry(entry);
 
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        if (is_flexfiles(layout)) {
+            uint32_t i;
+            for (i = 0; i < layout->mirrors.count; i++) {
+                pnfs_ff_mirror *mirror = &layout->mirrors.arr[i];
+                if (mirror->device == NULL && memcmp(mirror->deviceid,
+                        deviceid, PNFS_DEVICEID_SIZE) == 0) {
+                    /* one reference, one mirror; see below */
+                    mirror->device = device;
+                    return;
+                }
+            }
+            continue;
+        }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+
         /* assign the device to any matching layouts */
         if (layout->device == NULL &&
             memcmp(layout->deviceid, deviceid, PNFS_DEVICEID_SIZE) == 0) {
@@ -604,8 +715,8 @@ static enum pnfs_status device_fetch(
 
     /* drop the layoutstate lock for the rpc call */
     ReleaseSRWLockExclusive(&state->lock);
-    status = pnfs_file_device_get(session,
-        session->client->devices, deviceid, &device);
+    status = pnfs_file_device_get(session, session->client->devices,
+        layout_state_type(state), deviceid, &device);
     AcquireSRWLockExclusive(&state->lock);
 
     if (status == PNFS_SUCCESS)
@@ -635,6 +746,28 @@ static enum pnfs_status fs_supports_layout(
         ? PNFSERR_NOT_SUPPORTED : PNFS_SUCCESS;
 }
 
+/* pick the layout type for LAYOUTGETs on this file system; file
+ * layouts are preferred when the server offers both */
+static enum pnfs_status fs_layout_type(
+    IN const nfs41_superblock *superblock,
+    OUT enum pnfs_layout_type *type_out)
+{
+    enum pnfs_status status;
+
+    status = fs_supports_layout(superblock, PNFS_LAYOUTTYPE_FILE);
+    if (status == PNFS_SUCCESS) {
+        *type_out = PNFS_LAYOUTTYPE_FILE;
+        goto out;
+    }
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    status = fs_supports_layout(superblock, PNFS_LAYOUTTYPE_FLEXFILES);
+    if (status == PNFS_SUCCESS)
+        *type_out = PNFS_LAYOUTTYPE_FLEXFILES;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+out:
+    return status;
+}
+
 static enum pnfs_status open_state_layout_cached(
     IN nfs41_open_state *state,
     OUT pnfs_layout_state **layout_out)
@@ -658,6 +791,7 @@ enum pnfs_status pnfs_layout_state_open(
     struct pnfs_layout_list *layouts = state->session->client->layouts;
     nfs41_session *session = state->session;
     pnfs_layout_state *layout;
+    enum pnfs_layout_type type;
     enum pnfs_status status;
 
     DPRINTF(FLLVL, ("--> pnfs_layout_state_open()\n"));
@@ -665,7 +799,7 @@ enum pnfs_status pnfs_layout_state_open(
     status = client_supports_pnfs(session->client);
     if (status)
         goto out;
-    status = fs_supports_layout(state->file.fh.superblock, PNFS_LAYOUTTYPE_FILE);
+    status = fs_layout_type(state->file.fh.superblock, &type);
     if (status)
         goto out;
 
@@ -680,9 +814,10 @@ enum pnfs_status pnfs_layout_state_open(
 
         status = open_state_layout_cached(state, &layout);
         if (status) {
-            status = layout_state_find_or_create(layouts, &state->file.fh, &layout);
+            LONG open_count;
+            status = layout_state_find_or_create(layouts, &state->file.fh,
+                type, &layout, &open_count);
             if (status == PNFS_SUCCESS) {
-                LONG open_count = InterlockedIncrement(&layout->open_count);
                 state->layout = layout;
 
                 DPRINTF(FLLVL, ("pnfs_layout_state_open() caching layout 0x%p "
@@ -703,6 +838,108 @@ out:
     return status;
 }
 
+/* returns PNFS_SUCCESS if a LAYOUTGET can be sent with the OPEN of
+ * |state|, which must not use a layout stateid yet */
+enum pnfs_status pnfs_layout_state_open_check(
+    IN nfs41_open_state *state,
+    OUT enum pnfs_layout_type *type_out)
+{
+    struct pnfs_layout_list *layouts = state->session->client->layouts;
+    struct list_entry *entry;
+    pnfs_layout_state *layout;
+    enum pnfs_status status;
+
+    status = client_supports_pnfs(state->session->client);
+    if (status)
+        goto out;
+    if ((state->file.fh.len == 0) || (state->file.fh.superblock == NULL)) {
+        status = PNFSERR_NOT_SUPPORTED;
+        goto out;
+    }
+    status = fs_layout_type(state->file.fh.superblock, type_out);
+    if (status)
+        goto out;
+
+    EnterCriticalSection(&layouts->lock);
+    if (layout_entry_find(layouts, &state->file.fh, &entry) == PNFS_SUCCESS) {
+        layout = state_entry(entry);
+        AcquireSRWLockShared(&layout->lock);
+        if (layout->stateid.seqid || layout->pending ||
+            (layout->status & PNFS_LAYOUT_UNAVAILABLE))
+            status = PNFSERR_NO_LAYOUT;
+        ReleaseSRWLockShared(&layout->lock);
+    }
+    LeaveCriticalSection(&layouts->lock);
+out:
+    return status;
+}
+
+/* save the results of the LAYOUTGET sent with the OPEN of |state|;
+ * only frees the layouts for any other |nfsstat|, e.g. if the OPEN
+ * failed after all */
+void pnfs_layout_state_open_layoutget(
+    IN nfs41_open_state *state,
+    IN enum pnfs_iomode iomode,
+    IN enum nfsstat4 nfsstat,
+    IN pnfs_layoutget_res_ok *layoutget_res)
+{
+    struct list_entry *entry, *tmp;
+    pnfs_layout_state *layout;
+    enum pnfs_status status;
+
+    DPRINTF(FLLVL, ("--> pnfs_layout_state_open_layoutget('%s', '%s')\n",
+        pnfs_iomode_string(iomode), nfs_error_string(nfsstat)));
+
+    switch (nfsstat) {
+    case NFS4_OK:
+    case NFS4ERR_BADIOMODE:
+    case NFS4ERR_LAYOUTUNAVAILABLE:
+    case NFS4ERR_UNKNOWN_LAYOUTTYPE:
+    case NFS4ERR_BADLAYOUT:
+        break;
+    default:
+        status = PNFSERR_NO_LAYOUT;
+        goto out_free;
+    }
+
+    status = pnfs_layout_state_open(state, &layout);
+    if (status)
+        goto out_free;
+
+    AcquireSRWLockExclusive(&layout->lock);
+    while (layout->pending)
+        SleepConditionVariableSRW(&layout->cond, &layout->lock, INFINITE, 0);
+
+    switch (nfsstat) {
+    case NFS4_OK:
+        if (layout->stateid.seqid == 0) {
+            /* takes over the layouts in |layoutget_res| */
+            status = layout_update(layout, layoutget_res);
+            list_init(&layoutget_res->layouts);
+        }
+        break;
+    case NFS4ERR_BADIOMODE:
+        if (iomode == PNFS_IOMODE_RW)
+            layout->status |= PNFS_LAYOUT_NOT_RW;
+        break;
+    case NFS4ERR_LAYOUTUNAVAILABLE:
+    case NFS4ERR_UNKNOWN_LAYOUTTYPE:
+    case NFS4ERR_BADLAYOUT:
+        layout->status |= PNFS_LAYOUT_UNAVAILABLE;
+        break;
+    }
+    ReleaseSRWLockExclusive(&layout->lock);
+
+out_free:
+    /* free any layouts which did not make it into the layout state */
+    list_for_each_tmp(entry, tmp, &layoutget_res->layouts)
+        file_layout_free(file_layout_entry(entry));
+    list_init(&layoutget_res->layouts);
+
+    DPRINTF(FLLVL, ("<-- pnfs_layout_state_open_layoutget() returning '%s'\n",
+        pnfs_error_string(status)));
+}
+
 /* expects caller to hold an exclusive lock on pnfs_layout_state */
 enum pnfs_status pnfs_layout_state_prepare(
     IN pnfs_layout_state *state,
@@ -773,6 +1010,11 @@ static enum pnfs_status file_layout_return(
 
     DPRINTF(FLLVL, ("--> file_layout_return()\n"));
 
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+    /* the LAYOUTCOMMIT must come before the LAYOUTRETURN */
+    (void)pnfs_layout_commit_flush(session, file, state, NULL);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
+
     /* under shared lock, determine whether we need to return the layout */
     AcquireSRWLockShared(&state->lock);
     status = layout_return_status(state);
@@ -797,7 +1039,7 @@ static enum pnfs_status file_layout_return(
             
         /* drop the lock during the rpc call */
         ReleaseSRWLockExclusive(&state->lock);
-        nfsstat = pnfs_rpc_layoutreturn(session, file, PNFS_LAYOUTTYPE_FILE, 
+        nfsstat = pnfs_rpc_layoutreturn(session, file, layout_state_type(state),
             PNFS_IOMODE_ANY, 0, NFS4_UINT64_MAX, &stateid, &layoutreturn_res);
         AcquireSRWLockExclusive(&state->lock);
 
@@ -828,6 +1070,92 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_LAYOUT_RETAIN
+/*
+ * retained layouts
+ *
+ * Layouts of closed files stay in |nfs41_client.layouts| (unless the
+ * server asked for return-on-close), so that the next open of the same
+ * file can do I/O without another LAYOUTGET. Ranges fetched later are
+ * merged into the retained segments by layout_update().
+ * We return and free layouts which were not opened again for
+ * |LAYOUT_RETAIN_IDLE_TIMEOUT|, and the least recently closed one
+ * while more than |LAYOUT_RETAIN_MAX| closed files hold layouts.
+ * Recalls of retained layouts are handled like those of open files.
+ */
+#define LAYOUT_RETAIN_IDLE_TIMEOUT  (60 * 1000) /* milliseconds */
+#define LAYOUT_RETAIN_MAX           256
+
+/* expects caller to hold |layouts->lock| */
+static bool_t layout_retained_idle(
+    IN const pnfs_layout_state *state)
+{
+    /* |open_count| is only incremented under |layouts->lock| */
+    return state->open_count <= 0 && state->io_count == 0 &&
+        !state->pending;
+}
+
+static void layout_retained_return(
+    IN nfs41_session *session,
+    IN pnfs_layout_state *state)
+{
+    /* |state| is no longer in the list, so it can't be found by
+     * opens or recalls */
+    if (state->stateid.seqid) {
+        pnfs_layoutreturn_res layoutreturn_res = { 0 };
+        nfs41_path_fh file = { 0 };
+        enum nfsstat4 nfsstat;
+
+        fh_copy(&file.fh, &state->meta_fh);
+        nfsstat = pnfs_rpc_layoutreturn(session, &file, PNFS_LAYOUTTYPE_FILE,
+            PNFS_IOMODE_ANY, 0, NFS4_UINT64_MAX, &state->stateid,
+            &layoutreturn_res);
+        if (nfsstat)
+            DPRINTF(FLLVL, ("layout_retained_return: "
+                "pnfs_rpc_layoutreturn() failed with '%s'\n",
+                nfs_error_string(nfsstat)));
+    }
+    layout_state_free(state);
+}
+
+static void layout_retained_trim(
+    IN nfs41_session *session,
+    IN struct pnfs_layout_list *layouts)
+{
+    struct list_entry expired, *entry, *tmp;
+    pnfs_layout_state *state, *oldest = NULL;
+    const ULONGLONG now = GetTickCount64();
+    uint32_t retained = 0;
+
+    list_init(&expired);
+
+    EnterCriticalSection(&layouts->lock);
+    list_for_each_tmp(entry, tmp, &layouts->head) {
+        state = state_entry(entry);
+        if (!layout_retained_idle(state))
+            continue;
+
+        if ((now - state->last_close) > LAYOUT_RETAIN_IDLE_TIMEOUT) {
+            list_remove(entry);
+            list_add_tail(&expired, entry);
+            continue;
+        }
+
+        retained++;
+        if (oldest == NULL || state->last_close < oldest->last_close)
+            oldest = state;
+    }
+    if (retained > LAYOUT_RETAIN_MAX && oldest) {
+        list_remove(&oldest->entry);
+        list_add_tail(&expired, &oldest->entry);
+    }
+    LeaveCriticalSection(&layouts->lock);
+
+    list_for_each_tmp(entry, tmp, &expired)
+        layout_retained_return(session, state_entry(entry));
+}
+#endif /* NFS41_DRIVER_DAEMON_LAYOUT_RETAIN */
+
 void pnfs_layout_state_close(
     IN nfs41_session *session,
     IN nfs41_open_state *state,
@@ -843,7 +1171,19 @@ void pnfs_layout_state_close(
     ReleaseSRWLockExclusive(&state->lock);
 
     if (layout) {
-        LONG open_count = InterlockedDecrement(&layout->open_count);
+        LONG open_count;
+
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+        /* close-to-open: other clients must see the new size */
+        (void)pnfs_layout_commit_flush(session, &state->file, layout, NULL);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
+
+#ifdef NFS41_DRIVER_DAEMON_LAYOUT_RETAIN
+        /* set before the open reference is dropped, so that
+         * layout_retained_trim() never sees a stale value */
+        layout->last_close = GetTickCount64();
+#endif /* NFS41_DRIVER_DAEMON_LAYOUT_RETAIN */
+        open_count = InterlockedDecrement(&layout->open_count);
 
         AcquireSRWLockShared(&layout->lock);
         /* only return on close if it's the last close */
@@ -862,6 +1202,11 @@ void pnfs_layout_state_close(
         /* free the layout when the file is removed */
         layout_state_find_and_delete(session->client->layouts, &state->file.fh);
     }
+
+#ifdef NFS41_DRIVER_DAEMON_LAYOUT_RETAIN
+    if (layout && session->client->layouts)
+        layout_retained_trim(session, session->client->layouts);
+#endif /* NFS41_DRIVER_DAEMON_LAYOUT_RETAIN */
 }
 
 
@@ -896,6 +1241,10 @@ static pnfs_file_layout* layout_allocate_copy(
     /* XXX: don't use the device from existing layout;
      * we need to get a reference for ourselves */
     layout->device = NULL;
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    layout->mirrors.count = 0;
+    layout->mirrors.arr = NULL;
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 
     /* allocate a copy of the filehandle array */
     layout->filehandles.arr = calloc(layout->filehandles.count,
@@ -905,6 +1254,23 @@ static pnfs_file_layout* layout_allocate_copy(
 
     memcpy(layout->filehandles.arr, existing->filehandles.arr,
         layout->filehandles.count * sizeof(nfs41_path_fh));
+
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+    /* and of the mirrors, without their devices like above */
+    if (existing->mirrors.count) {
+        uint32_t i;
+        layout->mirrors.arr = calloc(existing->mirrors.count,
+            sizeof(pnfs_ff_mirror));
+        if (layout->mirrors.arr == NULL)
+            goto out_free;
+
+        memcpy(layout->mirrors.arr, existing->mirrors.arr,
+            existing->mirrors.count * sizeof(pnfs_ff_mirror));
+        layout->mirrors.count = existing->mirrors.count;
+        for (i = 0; i < layout->mirrors.count; i++)
+            layout->mirrors.arr[i].device = NULL;
+    }
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
 out:
     return layout;
 
@@ -975,6 +1341,7 @@ static void layout_state_deferred_recalls(
 
 static void layout_recall_entry_init(
     OUT struct layout_recall *lrc,
+    IN const pnfs_layout_state *state,
     IN const struct cb_layoutrecall_args *recall)
 {
     list_init(&lrc->layout.entry);
@@ -986,7 +1353,7 @@ static void layout_recall_entry_init(
         lrc->layout.length = NFS4_UINT64_MAX;
     }
     lrc->layout.iomode = recall->iomode;
-    lrc->layout.type = PNFS_LAYOUTTYPE_FILE;
+    lrc->layout.type = layout_state_type(state);
     lrc->changed = recall->changed;
 }
 
@@ -1031,6 +1398,7 @@ static enum pnfs_status layout_recall_merge(
 }
 
 static enum pnfs_status file_layout_recall(
+    IN nfs41_client *client,
     IN pnfs_layout_state *state,
     IN const struct cb_layoutrecall_args *recall)
 {
@@ -1060,6 +1428,14 @@ static enum pnfs_status file_layout_recall(
         state->stateid.seqid = stateid->seqid;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+    /* the server retries after the pending LAYOUTCOMMIT went out */
+    if (pnfs_layout_commit_recall(client, state)) {
+        status = PNFS_PENDING;
+        goto out;
+    }
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
+
     if (state->io_count) {
         /* save an entry for this recall, and process it once io finishes */
         struct layout_recall *lrc = calloc(1, sizeof(struct layout_recall));
@@ -1069,13 +1445,13 @@ static enum pnfs_status file_layout_recall(
             status = PNFS_PENDING;
             goto out;
         }
-        layout_recall_entry_init(lrc, recall);
+        layout_recall_entry_init(lrc, state, recall);
         if (layout_recall_merge(&state->recalls, &lrc->layout) != PNFS_SUCCESS)
             list_add_tail(&state->recalls, &lrc->layout.entry);
     } else {
         /* if there is no pending io, process the recall immediately */
         struct layout_recall lrc = { 0 };
-        layout_recall_entry_init(&lrc, recall);
+        layout_recall_entry_init(&lrc, state, recall);
         layout_recall_range(state, &lrc.layout);
     }
 out:
@@ -1096,7 +1472,7 @@ static enum pnfs_status file_layout_recall_file(
 
     status = layout_entry_find(client->layouts, &recall->recall.args.file.fh, &entry);
     if (status == PNFS_SUCCESS)
-        status = file_layout_recall(state_entry(entry), recall);
+        status = file_layout_recall(client, state_entry(entry), recall);
 
     LeaveCriticalSection(&client->layouts->lock);
 
@@ -1132,7 +1508,7 @@ static enum pnfs_status file_layout_recall_fsid(
          * because they are only written once on creation */
         fh = &state->meta_fh;
         if (fsid_matches(&recall->recall.args.fsid, &fh->superblock->fsid))
-            status = file_layout_recall(state, recall);
+            status = file_layout_recall(client, state, recall);
     }
 
     LeaveCriticalSection(&client->layouts->lock);
@@ -1157,7 +1533,7 @@ static enum pnfs_status file_layout_recall_all(
     EnterCriticalSection(&client->layouts->lock);
 
     list_for_each(entry, &client->layouts->head)
-        status = file_layout_recall(state_entry(entry), recall);
+        status = file_layout_recall(client, state_entry(entry), recall);
 
     LeaveCriticalSection(&client->layouts->lock);
 
@@ -1179,7 +1555,11 @@ enum pnfs_status pnfs_file_layout_recall(
         recall->recall.type, pnfs_iomode_string(recall->iomode),
         recall->changed));
 
-    if (recall->type != PNFS_LAYOUTTYPE_FILE) {
+    if ((recall->type != PNFS_LAYOUTTYPE_FILE)
+#ifdef NFS41_DRIVER_DAEMON_PNFS_FLEXFILES
+        && (recall->type != PNFS_LAYOUTTYPE_FLEXFILES)
+#endif /* NFS41_DRIVER_DAEMON_PNFS_FLEXFILES */
+        ) {
         DPRINTF(FLLVL, ("invalid layout type %u ('%s')!\n",
             recall->type, pnfs_layout_type_string(recall->type)));
         status = PNFSERR_NOT_SUPPORTED;
@@ -0,0 +1,133 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+/*
+ * qos.c - client-side bandwidth and IOPS limits per mount
+ *
+ * The "maxbw" (kilobytes per second) and "maxiops" (READ/WRITE
+ * requests per second) mount options are enforced with one token
+ * bucket each in |nfs41_root|. |nfs41_qos_throttle()| is called by
+ * the MDS and pNFS read and write paths before the data goes over the
+ * wire, reads served from the readahead or "fsc" caches are not
+ * limited.
+ *
+ * A request always takes its tokens, even if the bucket does not have
+ * enough, and the bucket goes into debt. The caller then sleeps until
+ * the debt has been paid back by the refill. This way a single request
+ * larger than the burst size can not starve, and concurrent requests
+ * queue up behind each other in the order they were throttled.
+ * The burst size is |QOS_BURST_MS| worth of tokens, so an idle mount
+ * can not save up enough tokens to saturate the link later.
+ */
+
+#include <Windows.h>
+
+#include "nfs41_build_features.h"
+#include "qos.h"
+#include "daemon_debug.h"
+
+#ifdef NFS41_DRIVER_DAEMON_QOS
+
+#define QOS_BURST_MS    250
+/* never sleep longer than this per request */
+#define QOS_MAX_WAIT_MS 10000
+
+static void qos_bucket_init(
+    nfs41_qos_bucket *bucket,
+    uint64_t rate,
+    uint64_t min_burst)
+{
+    InitializeSRWLock(&bucket->lock);
+    bucket->rate = rate;
+    bucket->burst = (int64_t)max((rate * QOS_BURST_MS) / 1000, min_burst);
+    bucket->tokens = bucket->burst;
+    bucket->last_refill = GetTickCount64();
+}
+
+/* Returns the time in milliseconds the caller has to wait */
+static DWORD qos_bucket_consume(
+    nfs41_qos_bucket *bucket,
+    uint64_t amount)
+{
+    ULONGLONG now, elapsed;
+    int64_t refill;
+    DWORD wait_ms = 0;
+
+    if (bucket->rate == 0)
+        return 0;
+
+    AcquireSRWLockExclusive(&bucket->lock);
+    now = GetTickCount64();
+    elapsed = now - bucket->last_refill;
+    refill = (int64_t)((elapsed * bucket->rate) / 1000);
+    if (refill > 0) {
+        bucket->tokens = min(bucket->tokens + refill, bucket->burst);
+        /* keep the remainder for the next refill */
+        bucket->last_refill += (refill * 1000) / bucket->rate;
+        if (bucket->tokens == bucket->burst)
+            bucket->last_refill = now;
+    }
+
+    bucket->tokens -= (int64_t)amount;
+    if (bucket->tokens < 0) {
+        uint64_t ms = ((uint64_t)(-bucket->tokens) * 1000) /
+            bucket->rate + 1;
+        wait_ms = (DWORD)min(ms, QOS_MAX_WAIT_MS);
+    }
+    ReleaseSRWLockExclusive(&bucket->lock);
+    return wait_ms;
+}
+
+void nfs41_qos_init(
+    nfs41_qos *qos,
+    uint32_t maxbw_kb,
+    uint32_t maxiops)
+{
+    /* allow at least one 1MB READ/WRITE without waiting */
+    qos_bucket_init(&qos->bandwidth, (uint64_t)maxbw_kb * 1024,
+        1024 * 1024);
+    qos_bucket_init(&qos->iops, maxiops, 1);
+
+    if (maxbw_kb || maxiops) {
+        DPRINTF(1, ("nfs41_qos_init: maxbw=%lu KB/s maxiops=%lu\n",
+            (unsigned long)maxbw_kb, (unsigned long)maxiops));
+    }
+}
+
+void nfs41_qos_throttle(
+    nfs41_qos *qos,
+    uint64_t bytes)
+{
+    DWORD bw_wait, iops_wait;
+
+    iops_wait = qos_bucket_consume(&qos->iops, 1);
+    bw_wait = qos_bucket_consume(&qos->bandwidth, bytes);
+
+    /* both buckets refill while we sleep, wait for the slower one */
+    if (max(iops_wait, bw_wait)) {
+        DPRINTF(2, ("nfs41_qos_throttle: bytes=%llu, waiting %lu ms\n",
+            (unsigned long long)bytes,
+            (unsigned long)max(iops_wait, bw_wait)));
+        Sleep(max(iops_wait, bw_wait));
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_QOS */
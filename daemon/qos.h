@@ -0,0 +1,59 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+#ifndef __NFS41_DAEMON_QOS_H__
+#define __NFS41_DAEMON_QOS_H__ 1
+
+#include <Windows.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "nfs41_build_features.h"
+
+#ifdef NFS41_DRIVER_DAEMON_QOS
+/*
+ * Token bucket, see qos.c
+ * A zero-filled bucket (|rate == 0|) does not limit anything
+ */
+typedef struct __nfs41_qos_bucket {
+    SRWLOCK lock;
+    uint64_t rate; /* tokens per second, 0 means no limit */
+    int64_t burst; /* max. number of accumulated tokens */
+    int64_t tokens; /* negative while requests are waiting */
+    ULONGLONG last_refill; /* |GetTickCount64()| */
+} nfs41_qos_bucket;
+
+/* Per-mount limits ("maxbw", "maxiops") */
+typedef struct __nfs41_qos {
+    nfs41_qos_bucket bandwidth; /* bytes per second */
+    nfs41_qos_bucket iops; /* READ/WRITE requests per second */
+} nfs41_qos;
+
+void nfs41_qos_init(
+    nfs41_qos *qos,
+    uint32_t maxbw_kb,
+    uint32_t maxiops);
+void nfs41_qos_throttle(
+    nfs41_qos *qos,
+    uint64_t bytes);
+#endif /* NFS41_DRIVER_DAEMON_QOS */
+
+#endif /* !__NFS41_DAEMON_QOS_H__ */
@@ -22,6 +22,7 @@
  */
 
 #include <Windows.h>
+#include <process.h>
 #include <strsafe.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -29,11 +30,14 @@
 
 #include "nfs41_build_features.h"
 #include "nfs41_driver.h" /* for |FILE_INFO_TIME_NOT_SET| */
+#include "nfs41_daemon.h"
 #include "from_kernel.h"
 #include "nfs41_ops.h"
+#include "name_cache.h"
 #include "daemon_debug.h"
 #include "upcall.h"
 #include "fileinfoutil.h"
+#include "delegation.h"
 #include "util.h"
 
 
@@ -248,6 +252,154 @@ int main(int ac, char *av[])
 }
 #endif /* TEST_FILTER */
 
+/*
+ * Compiled filter patterns
+ *
+ * Most directory queries use one of a few simple patterns ("*.obj"
+ * arrives as "<.obj", "foo*", "*foo*"), which can be matched with a
+ * literal prefix/suffix compare or a substring scan instead of
+ * running |readdir_filter()| for every entry.
+ * |readdir_filter_compile()| recognises these once per upcall, and
+ * |readdir_filter_match()| falls back to |readdir_filter()| for
+ * everything else. Matching is case-sensitive, like
+ * |readdir_filter()|.
+ */
+typedef enum _readdir_filter_type {
+    READDIR_FILTER_ALL,         /* "*" */
+    READDIR_FILTER_PREFIX,      /* "lit*" */
+    READDIR_FILTER_SUFFIX,      /* "*lit", "<lit" with a '.' in "lit" */
+    READDIR_FILTER_CONTAINS,    /* "*lit*" */
+    READDIR_FILTER_GENERIC      /* |readdir_filter()| */
+} readdir_filter_type;
+
+typedef struct _readdir_compiled_filter {
+    readdir_filter_type type;
+    const char *filter;
+    const char *literal;
+    size_t literal_len;
+} readdir_compiled_filter;
+
+static bool readdir_filter_is_literal(
+    IN const char *s,
+    IN size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        switch (s[i]) {
+        case '*':
+        case '?':
+        case FILTER_STAR:
+        case FILTER_QM:
+        case FILTER_DOT:
+            return false;
+        }
+    }
+    return true;
+}
+
+static void readdir_filter_compile(
+    IN const char *filter,
+    OUT readdir_compiled_filter *cf)
+{
+    const size_t filter_len = strlen(filter);
+
+    cf->type = READDIR_FILTER_GENERIC;
+    cf->filter = filter;
+    cf->literal = NULL;
+    cf->literal_len = 0;
+
+    if ((filter_len == 1) && (filter[0] == '*')) {
+        cf->type = READDIR_FILTER_ALL;
+    }
+    else if ((filter_len > 2) &&
+        (filter[0] == '*') && (filter[filter_len-1] == '*') &&
+        readdir_filter_is_literal(filter+1, filter_len-2)) {
+        cf->type = READDIR_FILTER_CONTAINS;
+        cf->literal = filter+1;
+        cf->literal_len = filter_len-2;
+    }
+    else if ((filter_len > 1) && (filter[0] == '*') &&
+        readdir_filter_is_literal(filter+1, filter_len-1)) {
+        cf->type = READDIR_FILTER_SUFFIX;
+        cf->literal = filter+1;
+        cf->literal_len = filter_len-1;
+    }
+    /*
+     * |FILTER_STAR| matches anything up to the last '.', so if the
+     * remaining literal has a '.' the last '.' of a matching name is
+     * always inside the literal
+     */
+    else if ((filter_len > 1) && (filter[0] == FILTER_STAR) &&
+        readdir_filter_is_literal(filter+1, filter_len-1) &&
+        (memchr(filter+1, '.', filter_len-1) != NULL)) {
+        cf->type = READDIR_FILTER_SUFFIX;
+        cf->literal = filter+1;
+        cf->literal_len = filter_len-1;
+    }
+    else if ((filter_len > 1) && (filter[filter_len-1] == '*') &&
+        readdir_filter_is_literal(filter, filter_len-1)) {
+        cf->type = READDIR_FILTER_PREFIX;
+        cf->literal = filter;
+        cf->literal_len = filter_len-1;
+    }
+
+    DPRINTF(2, ("readdir_filter_compile(filter='%s'): type=%d\n",
+        filter, (int)cf->type));
+}
+
+/*
+ * Find |lit| in |s|, using |memchr()| (which the CRT implements with
+ * SIMD instructions) to skip to candidate positions
+ */
+static bool readdir_filter_contains(
+    IN const char *s,
+    IN size_t s_len,
+    IN const char *lit,
+    IN size_t lit_len)
+{
+    const char *p = s;
+    const char *last;
+
+    if (lit_len > s_len)
+        return false;
+    last = s + (s_len - lit_len);
+
+    while (p <= last) {
+        p = memchr(p, lit[0], (size_t)(last - p) + 1);
+        if (p == NULL)
+            return false;
+        if (memcmp(p+1, lit+1, lit_len-1) == 0)
+            return true;
+        p++;
+    }
+    return false;
+}
+
+static bool readdir_filter_match(
+    IN const readdir_compiled_filter *cf,
+    IN const char *name)
+{
+    size_t name_len;
+
+    switch (cf->type) {
+    case READDIR_FILTER_ALL:
+        return name[0] != '\0';
+    case READDIR_FILTER_PREFIX:
+        return strncmp(name, cf->literal, cf->literal_len) == 0;
+    case READDIR_FILTER_SUFFIX:
+        name_len = strlen(name);
+        return (name_len >= cf->literal_len) &&
+            (memcmp(name + (name_len - cf->literal_len),
+                cf->literal, cf->literal_len) == 0);
+    case READDIR_FILTER_CONTAINS:
+        return readdir_filter_contains(name, strlen(name),
+            cf->literal, cf->literal_len);
+    default:
+        return readdir_filter(cf->filter, name);
+    }
+}
+
 
 typedef union _FILE_DIR_INFO_UNION {
     ULONG NextEntryOffset;
@@ -551,6 +703,998 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+/*
+ * Directory listing cache
+ *
+ * Applications enumerate the same directory over and over (e.g. one
+ * FindFirstFile() per file they are going to open), and each
+ * enumeration used to send the same READDIRs again.
+ * The cache keeps the complete, decoded READDIR result of the
+ * |READDIR_CACHE_SLOTS| most recently listed directories, keyed by
+ * superblock and filehandle.
+ * An entry is used as long as the (cached) change attribute of the
+ * directory is the same as when the entry was filled, and, when an
+ * enumeration is continued, the cookie verifier matches. Changes
+ * through this client update the directory's change attribute in the
+ * attribute cache and therefore invalidate the listing.
+ * Changes to the files themselves do not change the directory, so the
+ * attributes of the returned entries are replaced with those from the
+ * attribute cache where these are still valid, and a listing is
+ * never used for longer than "acdirmax" seconds.
+ * Directories which do not fit into |READDIR_CACHE_MAX_SIZE| bytes
+ * are marked |too_large| and are always read from the server.
+ * A directory delegation does not lift the "acdirmax" limit, as we
+ * do not ask for NOTIFY4_CHANGE_CHILD_ATTRS notifications; CB_NOTIFY
+ * only drops the listing earlier through
+ * |nfs41_readdir_cache_invalidate()|.
+ */
+#define READDIR_CACHE_SLOTS 16
+#define READDIR_CACHE_MAX_SIZE (1024*1024UL)
+
+typedef struct __readdir_cache_entry {
+    const nfs41_superblock  *superblock;
+    unsigned char           fh[NFS4_FHSIZE];
+    uint32_t                fh_len;
+    uint64_t                change;
+    unsigned char           verf[NFS4_VERIFIER_SIZE];
+    unsigned char           *entries;
+    uint32_t                entries_len;
+    bool                    too_large;
+    util_reltimestamp       expiration;
+    volatile LONG64         last_used;
+    volatile LONG           prefetched; /* entries prefetched so far */
+} readdir_cache_entry;
+
+static struct {
+    SRWLOCK                 lock;
+    volatile LONG64         clock;
+    readdir_cache_entry     slots[READDIR_CACHE_SLOTS];
+} readdir_cache = { .lock = SRWLOCK_INIT };
+
+static __inline uint32_t readdir_entry_size(
+    IN const nfs41_readdir_entry *entry)
+{
+    return (uint32_t)FIELD_OFFSET(nfs41_readdir_entry, name) +
+        entry->name_len;
+}
+
+/* expects the caller to hold |readdir_cache.lock| */
+static readdir_cache_entry *readdir_cache_find(
+    IN const nfs41_path_fh *dir)
+{
+    readdir_cache_entry *slot;
+    uint32_t i;
+
+    for (i = 0; i < READDIR_CACHE_SLOTS; i++) {
+        slot = &readdir_cache.slots[i];
+        if ((slot->superblock == dir->fh.superblock) &&
+            (slot->fh_len == dir->fh.len) &&
+            (memcmp(slot->fh, dir->fh.fh, dir->fh.len) == 0))
+            return slot;
+    }
+    return NULL;
+}
+
+/*
+ * Copy as many cached entries following |cookie| as fit into
+ * |entries|, returns |false| if the listing must be read from the
+ * server
+ */
+static bool readdir_cache_lookup(
+    IN const nfs41_path_fh *dir,
+    IN uint64_t change,
+    IN OUT nfs41_readdir_cookie *cookie,
+    OUT unsigned char *entries,
+    IN OUT uint32_t *entries_len,
+    OUT bool_t *eof_out)
+{
+    readdir_cache_entry *slot;
+    unsigned char *start, *end, *pos;
+    nfs41_readdir_entry *entry;
+    uint32_t last_offset = 0;
+    bool hit = false;
+
+    AcquireSRWLockShared(&readdir_cache.lock);
+
+    slot = readdir_cache_find(dir);
+    if ((slot == NULL) || slot->too_large || (slot->change != change) ||
+        (UTIL_GETRELTIME() >= slot->expiration))
+        goto out_unlock;
+    if (cookie->cookie &&
+        memcmp(cookie->verf, slot->verf, NFS4_VERIFIER_SIZE))
+        goto out_unlock;
+
+    start = slot->entries;
+    end = slot->entries + slot->entries_len;
+
+    if (cookie->cookie) {
+        /* continue after the entry with this cookie */
+        for (pos = start; pos < end; pos += readdir_entry_size(entry)) {
+            entry = (nfs41_readdir_entry *)pos;
+            if (entry->cookie == cookie->cookie)
+                break;
+        }
+        if (pos >= end)
+            goto out_unlock;
+        start = pos + readdir_entry_size(entry);
+    }
+
+    for (pos = start; pos < end; pos += readdir_entry_size(entry)) {
+        entry = (nfs41_readdir_entry *)pos;
+        if ((uint32_t)(pos - start) + readdir_entry_size(entry) >
+            *entries_len)
+            break;
+        last_offset = (uint32_t)(pos - start);
+    }
+    /* let the server path deal with buffers too small for one entry */
+    if ((pos == start) && (pos < end))
+        goto out_unlock;
+
+    *entries_len = (uint32_t)(pos - start);
+    if (*entries_len) {
+        (void)memcpy(entries, start, *entries_len);
+        ((nfs41_readdir_entry *)(entries + last_offset))->
+            next_entry_offset = 0;
+    }
+    *eof_out = (pos >= end);
+    (void)memcpy(cookie->verf, slot->verf, NFS4_VERIFIER_SIZE);
+    InterlockedExchange64(&slot->last_used,
+        InterlockedIncrement64(&readdir_cache.clock));
+    hit = true;
+
+out_unlock:
+    ReleaseSRWLockShared(&readdir_cache.lock);
+    return hit;
+}
+
+/* takes ownership of |entries| */
+static void readdir_cache_store(
+    IN const nfs41_path_fh *dir,
+    IN uint32_t ttl,
+    IN uint64_t change,
+    IN const unsigned char *verf,
+    IN unsigned char *entries,
+    IN uint32_t entries_len,
+    IN bool too_large)
+{
+    readdir_cache_entry *slot;
+    unsigned char *old_entries;
+    uint32_t i;
+
+    AcquireSRWLockExclusive(&readdir_cache.lock);
+
+    slot = readdir_cache_find(dir);
+    if (slot == NULL) {
+        /* reuse the least recently used slot */
+        slot = &readdir_cache.slots[0];
+        for (i = 1; i < READDIR_CACHE_SLOTS; i++) {
+            if (readdir_cache.slots[i].last_used < slot->last_used)
+                slot = &readdir_cache.slots[i];
+        }
+        slot->superblock = dir->fh.superblock;
+        slot->fh_len = dir->fh.len;
+        (void)memcpy(slot->fh, dir->fh.fh, dir->fh.len);
+    }
+
+    old_entries = slot->entries;
+    slot->change = change;
+    (void)memcpy(slot->verf, verf, NFS4_VERIFIER_SIZE);
+    slot->entries = entries;
+    slot->entries_len = entries_len;
+    slot->too_large = too_large;
+    slot->expiration = UTIL_GETRELTIME() + ttl;
+    slot->last_used = InterlockedIncrement64(&readdir_cache.clock);
+    slot->prefetched = 0;
+
+    ReleaseSRWLockExclusive(&readdir_cache.lock);
+
+    free(old_entries);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+/* drop all cached listings, called while system memory is low */
+void nfs41_readdir_cache_trim(void)
+{
+    unsigned char *old_entries[READDIR_CACHE_SLOTS];
+    readdir_cache_entry *slot;
+    uint32_t i;
+
+    AcquireSRWLockExclusive(&readdir_cache.lock);
+    for (i = 0; i < READDIR_CACHE_SLOTS; i++) {
+        slot = &readdir_cache.slots[i];
+        old_entries[i] = slot->entries;
+        slot->superblock = NULL;
+        slot->fh_len = 0;
+        slot->entries = NULL;
+        slot->entries_len = 0;
+        slot->too_large = false;
+        slot->last_used = 0;
+    }
+    ReleaseSRWLockExclusive(&readdir_cache.lock);
+
+    for (i = 0; i < READDIR_CACHE_SLOTS; i++)
+        free(old_entries[i]);
+}
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+void nfs41_readdir_cache_invalidate(
+    IN const nfs41_fh *fh)
+{
+    readdir_cache_entry *slot;
+    unsigned char *old_entries = NULL;
+    uint32_t i;
+
+    AcquireSRWLockExclusive(&readdir_cache.lock);
+    for (i = 0; i < READDIR_CACHE_SLOTS; i++) {
+        slot = &readdir_cache.slots[i];
+        if ((slot->superblock == fh->superblock) &&
+            (slot->fh_len == fh->len) &&
+            (memcmp(slot->fh, fh->fh, fh->len) == 0)) {
+            /* free the slot for reuse */
+            old_entries = slot->entries;
+            slot->superblock = NULL;
+            slot->fh_len = 0;
+            slot->entries = NULL;
+            slot->entries_len = 0;
+            slot->too_large = false;
+            slot->last_used = 0;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&readdir_cache.lock);
+
+    free(old_entries);
+}
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+
+static bool readdir_cache_is_too_large(
+    IN const nfs41_path_fh *dir,
+    IN uint64_t change)
+{
+    readdir_cache_entry *slot;
+    bool too_large;
+
+    AcquireSRWLockShared(&readdir_cache.lock);
+    slot = readdir_cache_find(dir);
+    too_large = slot && slot->too_large && (slot->change == change) &&
+        (UTIL_GETRELTIME() < slot->expiration);
+    ReleaseSRWLockShared(&readdir_cache.lock);
+    return too_large;
+}
+
+/*
+ * Add the filehandle and attributes of each READDIR entry to the
+ * name cache, so the OPEN/GETATTR upcalls which usually follow a
+ * directory listing do not need a LOOKUP per file
+ */
+static void readdir_prime_name_cache(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN unsigned char *entries,
+    IN uint32_t entries_len)
+{
+    const nfs41_superblock *superblock = dir->fh.superblock;
+    nfs41_readdir_entry *entry;
+    nfs41_abs_path path;
+    nfs41_component name;
+    unsigned char *pos = entries;
+
+    if (entries_len == 0)
+        return;
+
+    for (;;) {
+        entry = (nfs41_readdir_entry *)pos;
+
+        /* skip referrals and entries on a different filesystem */
+        if ((entry->fh.len > 0) &&
+            (entry->attr_info.rdattr_error == NFS4_OK) &&
+            bitmap_isset(&entry->attr_info.attrmask, 0, FATTR4_WORD0_FSID) &&
+            bitmap_isset(&entry->attr_info.attrmask, 0, FATTR4_WORD0_FILEID) &&
+            (entry->attr_info.fsid.major == superblock->fsid.major) &&
+            (entry->attr_info.fsid.minor == superblock->fsid.minor)) {
+            name.name = entry->name;
+            name.len = (unsigned short)entry->name_len - 1;
+
+            if (format_abs_path(dir->path, &name, &path) == NO_ERROR) {
+                last_component(path.path, path.path + path.len, &name);
+                entry->fh.fileid = entry->attr_info.fileid;
+                entry->fh.superblock = dir->fh.superblock;
+                (void)nfs41_name_cache_insert(session_name_cache(session),
+                    BIT2BOOL(superblock->case_insensitive),
+                    path.path, &name, &entry->fh, &entry->attr_info,
+                    NULL, OPEN_DELEGATE_NONE);
+            }
+        }
+
+        if (!entry->next_entry_offset)
+            break;
+        pos += entry->next_entry_offset;
+    }
+}
+
+/*
+ * Read the complete listing of |dir| into a new cache entry, returns
+ * |false| if the listing could not be cached
+ */
+static bool readdir_cache_fill(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN bitmap4 *attr_request,
+    IN uint64_t change)
+{
+    const uint32_t ttl = session->client->root->name_cache_config.acdirmax;
+    nfs41_readdir_cookie cookie = { 0 };
+    nfs41_readdir_entry *entry, *last = NULL;
+    unsigned char *entries, *shrunk;
+    uint32_t entries_len = 0, chunk_len;
+    bool_t eof = FALSE;
+    int status;
+
+    /* "acdirmax=0" disables the cache */
+    if (ttl == 0)
+        return false;
+
+    entries = malloc(READDIR_CACHE_MAX_SIZE);
+    if (entries == NULL)
+        return false;
+
+    while (!eof) {
+        chunk_len = READDIR_CACHE_MAX_SIZE - entries_len;
+        if (chunk_len <
+            (sizeof(nfs41_readdir_entry) + NFS41_MAX_COMPONENT_LEN+1))
+            break;
+
+        status = nfs41_readdir(session, dir, attr_request, &cookie,
+            entries + entries_len, &chunk_len, &eof);
+        if (status) {
+            DPRINTF(1, ("readdir_cache_fill: nfs41_readdir failed "
+                "with '%s'\n", nfs_error_string(status)));
+            free(entries);
+            return false;
+        }
+        if (chunk_len == 0)
+            break;
+
+        readdir_prime_name_cache(session, dir,
+            entries + entries_len, chunk_len);
+
+        /* chain the last entry of the previous reply to this one */
+        if (last)
+            last->next_entry_offset = readdir_entry_size(last);
+
+        entry = (nfs41_readdir_entry *)(entries + entries_len);
+        while (entry->next_entry_offset)
+            entry = (nfs41_readdir_entry *)
+                ((unsigned char *)entry + entry->next_entry_offset);
+        last = entry;
+        cookie.cookie = last->cookie;
+        entries_len += chunk_len;
+    }
+
+    if (!eof) {
+        DPRINTF(1, ("readdir_cache_fill: directory listing larger "
+            "than %lu bytes, not caching it\n",
+            (unsigned long)READDIR_CACHE_MAX_SIZE));
+        free(entries);
+        readdir_cache_store(dir, ttl, change, cookie.verf, NULL, 0, true);
+        return false;
+    }
+
+    shrunk = realloc(entries, max(entries_len, 1));
+    if (shrunk)
+        entries = shrunk;
+    readdir_cache_store(dir, ttl, change, cookie.verf,
+        entries, entries_len, false);
+    return true;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PREFETCH
+/*
+ * Reserve up to |count| entries of the "--readdirprefetch" budget of
+ * the listing of |dir|, returns the number of entries granted
+ */
+static uint32_t readdir_cache_reserve_prefetch(
+    IN const nfs41_path_fh *dir,
+    IN uint32_t count)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    readdir_cache_entry *slot;
+    LONG prev, granted = 0;
+
+    AcquireSRWLockShared(&readdir_cache.lock);
+    slot = readdir_cache_find(dir);
+    if (slot) {
+        do {
+            prev = slot->prefetched;
+            granted = min((LONG)count,
+                (LONG)nfs41_dg.readdir_prefetch_max - prev);
+            if (granted <= 0) {
+                granted = 0;
+                break;
+            }
+        } while (InterlockedCompareExchange(&slot->prefetched,
+            prev + granted, prev) != prev);
+    }
+    ReleaseSRWLockShared(&readdir_cache.lock);
+    return (uint32_t)granted;
+}
+
+typedef struct __readdir_prefetch_job {
+    nfs41_open_state        *state;
+    bitmap4                 attr_request;
+    uint32_t                count;
+    nfs41_path_fh           files[1];
+} readdir_prefetch_job;
+
+static unsigned int WINAPI readdir_prefetch_thread(void *args)
+{
+    readdir_prefetch_job *job = (readdir_prefetch_job *)args;
+    nfs41_path_fh **files = NULL;
+    nfs41_file_info *infos = NULL;
+    int *statuses = NULL;
+    uint32_t i;
+
+    files = malloc(job->count * sizeof(nfs41_path_fh *));
+    infos = calloc(job->count, sizeof(nfs41_file_info));
+    statuses = malloc(job->count * sizeof(int));
+    if ((files == NULL) || (infos == NULL) || (statuses == NULL))
+        goto out;
+
+    for (i = 0; i < job->count; i++)
+        files[i] = &job->files[i];
+
+    /* |nfs41_getattr_batch()| updates the attribute cache */
+    (void)nfs41_getattr_batch(job->state->session, job->count, files,
+        &job->attr_request, infos, statuses);
+
+    DPRINTF(2, ("readdir_prefetch_thread('%s'): prefetched %lu entries\n",
+        job->state->path.path, (unsigned long)job->count));
+out:
+    free(statuses);
+    free(infos);
+    free(files);
+    /* release the reference from |readdir_prefetch_start()| */
+    nfs41_open_state_deref(job->state);
+    free(job);
+    return 0;
+}
+
+/*
+ * Start fetching the attributes of the cached listing entries in
+ * |entries| whose attributes have expired from the attribute cache
+ */
+static void readdir_prefetch_start(
+    IN nfs41_open_state *state,
+    IN const bitmap4 *attr_request,
+    IN unsigned char *entries,
+    IN uint32_t entries_len)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    struct nfs41_name_cache *cache = session_name_cache(state->session);
+    readdir_prefetch_job *job = NULL;
+    nfs41_readdir_entry *entry;
+    nfs41_file_info info;
+    unsigned char *pos = entries;
+    uint32_t count = 0, max_count;
+    HANDLE thread;
+
+    if ((entries_len == 0) || (nfs41_dg.readdir_prefetch_max == 0))
+        return;
+
+    /* count the candidates */
+    for (;;) {
+        entry = (nfs41_readdir_entry *)pos;
+        if (entry->fh.superblock) {
+            ZeroMemory(&info, sizeof(info));
+            if (nfs41_attr_cache_lookup(cache, entry->fh.fileid, &info))
+                count++;
+        }
+        if (!entry->next_entry_offset)
+            break;
+        pos += entry->next_entry_offset;
+    }
+    if (count == 0)
+        return;
+
+    max_count = readdir_cache_reserve_prefetch(&state->file, count);
+    if (max_count == 0)
+        return;
+
+    job = calloc(1, sizeof(readdir_prefetch_job) +
+        max_count * sizeof(nfs41_path_fh));
+    if (job == NULL)
+        return;
+
+    bitmap4_cpy(&job->attr_request, attr_request);
+    job->attr_request.arr[0] &=
+        ~(FATTR4_WORD0_RDATTR_ERROR|FATTR4_WORD0_FILEHANDLE);
+
+    for (pos = entries; job->count < max_count; ) {
+        entry = (nfs41_readdir_entry *)pos;
+        if (entry->fh.superblock) {
+            ZeroMemory(&info, sizeof(info));
+            if (nfs41_attr_cache_lookup(cache, entry->fh.fileid, &info)) {
+                /* no path, this is only used for name cache cleanup */
+                job->files[job->count].path = NULL;
+                fh_copy(&job->files[job->count].fh, &entry->fh);
+                job->count++;
+            }
+        }
+        if (!entry->next_entry_offset)
+            break;
+        pos += entry->next_entry_offset;
+    }
+    if (job->count == 0) {
+        free(job);
+        return;
+    }
+
+    /* the thread holds a reference on |state| until it is done */
+    job->state = state;
+    nfs41_open_state_ref(state);
+    thread = (HANDLE)_beginthreadex(NULL,
+        NFSD_THREAD_STACK_SIZE, readdir_prefetch_thread, job, 0, NULL);
+    if (thread == NULL) {
+        eprintf("readdir_prefetch_start: _beginthreadex() failed with %d\n",
+            (int)GetLastError());
+        nfs41_open_state_deref(state);
+        free(job);
+        return;
+    }
+    (void)CloseHandle(thread);
+}
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PREFETCH */
+
+/*
+ * Replace the attributes of cached listing entries with those from
+ * the attribute cache, which are fresher if they are still valid.
+ * Entries whose attributes have expired from the attribute cache are
+ * fetched again with |nfs41_getattr_batch()|, so a cached listing
+ * never returns attributes older than the attribute cache would.
+ * Returns false if that fails, the caller then reads the directory
+ * from the server.
+ */
+static bool readdir_cache_refresh_attrs(
+    IN nfs41_session *session,
+    IN const bitmap4 *attr_request,
+    IN unsigned char *entries,
+    IN uint32_t entries_len)
+{
+    struct nfs41_name_cache *cache = session_name_cache(session);
+    nfs41_readdir_entry *entry, **expired = NULL;
+    nfs41_path_fh *files = NULL, **file_ptrs = NULL;
+    nfs41_file_info info, *infos = NULL;
+    int *statuses = NULL;
+    bitmap4 mask;
+    unsigned char *pos = entries;
+    uint32_t count = 0, i;
+    bool ok = false;
+
+    if (entries_len == 0)
+        return true;
+
+    for (;;) {
+        entry = (nfs41_readdir_entry *)pos;
+        if (entry->fh.superblock) {
+            ZeroMemory(&info, sizeof(info));
+            if (nfs41_attr_cache_lookup(cache,
+                entry->fh.fileid, &info) == NO_ERROR)
+                nfs41_file_info_cpy(&entry->attr_info, &info, 0);
+            else
+                count++;
+        }
+        if (!entry->next_entry_offset)
+            break;
+        pos += entry->next_entry_offset;
+    }
+    if (count == 0)
+        return true;
+
+    expired = malloc(count * sizeof(nfs41_readdir_entry *));
+    files = calloc(count, sizeof(nfs41_path_fh));
+    file_ptrs = malloc(count * sizeof(nfs41_path_fh *));
+    infos = calloc(count, sizeof(nfs41_file_info));
+    statuses = malloc(count * sizeof(int));
+    if ((expired == NULL) || (files == NULL) || (file_ptrs == NULL) ||
+        (infos == NULL) || (statuses == NULL))
+        goto out;
+
+    for (pos = entries, i = 0; i < count; ) {
+        entry = (nfs41_readdir_entry *)pos;
+        if (entry->fh.superblock) {
+            ZeroMemory(&info, sizeof(info));
+            if (nfs41_attr_cache_lookup(cache, entry->fh.fileid, &info)) {
+                expired[i] = entry;
+                /* no path, this is only used for name cache cleanup */
+                files[i].path = NULL;
+                fh_copy(&files[i].fh, &entry->fh);
+                file_ptrs[i] = &files[i];
+                i++;
+            }
+        }
+        if (!entry->next_entry_offset)
+            break;
+        pos += entry->next_entry_offset;
+    }
+    /* an entry may have come back into the attribute cache meanwhile */
+    count = i;
+
+    bitmap4_cpy(&mask, attr_request);
+    mask.arr[0] &= ~(FATTR4_WORD0_RDATTR_ERROR|FATTR4_WORD0_FILEHANDLE);
+
+    /* |nfs41_getattr_batch()| also updates the attribute cache */
+    if (count && nfs41_getattr_batch(session, count, file_ptrs, &mask,
+        infos, statuses))
+        goto out;
+    for (i = 0; i < count; i++) {
+        if (statuses[i])
+            goto out;
+        nfs41_file_info_cpy(&expired[i]->attr_info, &infos[i], 0);
+    }
+    ok = true;
+out:
+    free(statuses);
+    free(infos);
+    free(file_ptrs);
+    free(files);
+    free(expired);
+    return ok;
+}
+
+/*
+ * Get the next entries of an enumeration from the directory listing
+ * cache, filling the cache first when an enumeration starts
+ */
+static bool readdir_cache_get(
+    IN nfs41_open_state *state,
+    IN bitmap4 *attr_request,
+    OUT unsigned char *entries,
+    IN OUT uint32_t *entries_len,
+    OUT bool_t *eof_out)
+{
+    nfs41_session *session = state->session;
+    nfs41_path_fh *dir = &state->file;
+    nfs41_readdir_cookie *cookie = &state->cookie;
+    const nfs41_readdir_cookie saved_cookie = *cookie;
+    const uint32_t buf_len = *entries_len;
+    nfs41_file_info info;
+
+    ZeroMemory(&info, sizeof(info));
+    if (nfs41_cached_getattr(session, dir, NULL, &info) ||
+        !bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_CHANGE))
+        return false;
+
+    if (readdir_cache_lookup(dir, info.change, cookie,
+        entries, entries_len, eof_out)) {
+        if (readdir_cache_refresh_attrs(session, attr_request,
+            entries, *entries_len)) {
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PREFETCH
+            readdir_prefetch_start(state, attr_request, entries,
+                *entries_len);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PREFETCH */
+            return true;
+        }
+        /* read this batch from the server instead */
+        *cookie = saved_cookie;
+        *entries_len = buf_len;
+        return false;
+    }
+
+    /* only fill the cache at the start of an enumeration */
+    if (cookie->cookie || readdir_cache_is_too_large(dir, info.change))
+        return false;
+
+    if (!readdir_cache_fill(session, dir, attr_request, info.change))
+        return false;
+
+#ifdef NFS41_DRIVER_DAEMON_DIR_DELEGATIONS
+    /* drop the new listing as soon as the directory changes */
+    if (!nfs41_dir_delegation_held(session->client, &dir->fh))
+        nfs41_dir_delegation_hint(session, dir, TRUE);
+#endif /* NFS41_DRIVER_DAEMON_DIR_DELEGATIONS */
+
+    /* just filled from the server, nothing to refresh */
+    return readdir_cache_lookup(dir, info.change, cookie,
+        entries, entries_len, eof_out);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+/*
+ * Tree walk prefetcher
+ *
+ * Tree walkers ("dir /s", robocopy, find, backup and indexing jobs)
+ * enumerate a directory and then descend into its subdirectories one
+ * after the other, so every level pays cold-cache LOOKUP+READDIR
+ * round trips.
+ * Each mount has a detector which looks at the directories whose
+ * enumeration starts: An enumeration of a subdirectory or a sibling
+ * of the previously enumerated directory raises the score of the
+ * mount, any other enumeration lowers it.
+ * While the score is at least |TREEWALK_MIN_SCORE|, the first
+ * |TREEWALK_MAX_SUBDIRS| subdirectories of each returned batch are
+ * read into the directory listing cache (which also primes the
+ * name/attribute cache) by a background thread, in listing order.
+ * The number of these threads is limited by "--treewalkprefetch", and
+ * a thread stops when more than half of the session's slots are in
+ * use.
+ */
+#define TREEWALK_MIN_SCORE 3
+#define TREEWALK_MAX_SCORE 8
+/* keep well below |READDIR_CACHE_SLOTS|, the walker must find them */
+#define TREEWALK_MAX_SUBDIRS (READDIR_CACHE_SLOTS/2)
+
+static volatile LONG treewalk_jobs = 0;
+
+static uint32_t treewalk_hash(
+    IN const char *s,
+    IN size_t len)
+{
+    uint32_t hash = 2166136261U; /* FNV-1a */
+
+    while (len--) {
+        hash ^= (unsigned char)*s++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Feed the start of an enumeration of |path| into the detector of
+ * |root|, returns whether the mount is being walked
+ */
+static bool treewalk_update(
+    IN nfs41_root *root,
+    IN const nfs41_abs_path *path)
+{
+    const char *sep;
+    uint32_t hash, parent_hash;
+    bool active;
+
+    sep = strrchr(path->path, '\\');
+    hash = treewalk_hash(path->path, path->len);
+    parent_hash = treewalk_hash(path->path,
+        sep ? (size_t)(sep - path->path) : 0);
+
+    AcquireSRWLockExclusive(&root->treewalk.lock);
+    if ((parent_hash == root->treewalk.last_hash) ||
+        (parent_hash == root->treewalk.last_parent_hash)) {
+        if (root->treewalk.score < TREEWALK_MAX_SCORE)
+            root->treewalk.score++;
+    }
+    else if (root->treewalk.score > 0) {
+        root->treewalk.score--;
+    }
+    root->treewalk.last_hash = hash;
+    root->treewalk.last_parent_hash = parent_hash;
+    active = root->treewalk.score >= TREEWALK_MIN_SCORE;
+    ReleaseSRWLockExclusive(&root->treewalk.lock);
+
+    if (active)
+        DPRINTF(2, ("treewalk_update('%s'): tree walk detected\n",
+            path->path));
+    return active;
+}
+
+static bool treewalk_active(
+    IN nfs41_root *root)
+{
+    bool active;
+
+    AcquireSRWLockShared(&root->treewalk.lock);
+    active = root->treewalk.score >= TREEWALK_MIN_SCORE;
+    ReleaseSRWLockShared(&root->treewalk.lock);
+    return active;
+}
+
+static bool readdir_cache_is_valid(
+    IN const nfs41_path_fh *dir,
+    IN uint64_t change)
+{
+    readdir_cache_entry *slot;
+    bool valid;
+
+    AcquireSRWLockShared(&readdir_cache.lock);
+    slot = readdir_cache_find(dir);
+    valid = slot && (slot->change == change) &&
+        (UTIL_GETRELTIME() < slot->expiration);
+    ReleaseSRWLockShared(&readdir_cache.lock);
+    return valid;
+}
+
+typedef struct __treewalk_job {
+    nfs41_open_state        *state;
+    bitmap4                 attr_request;
+    uint32_t                count;
+    struct {
+        nfs41_abs_path      path;
+        nfs41_path_fh       file;
+        uint64_t            change;
+    } dirs[TREEWALK_MAX_SUBDIRS];
+} treewalk_job;
+
+static unsigned int WINAPI treewalk_thread(void *args)
+{
+    treewalk_job *job = (treewalk_job *)args;
+    nfs41_session *session = job->state->session;
+    uint32_t i, filled = 0;
+
+    for (i = 0; i < job->count; i++) {
+        /* leave the session's slots to the upcalls */
+        if ((session->table.num_used * 2) > (LONG)session->table.max_slots) {
+            DPRINTF(2, ("treewalk_thread: session busy, stopping\n"));
+            break;
+        }
+        if (readdir_cache_is_valid(&job->dirs[i].file, job->dirs[i].change))
+            continue;
+        if (readdir_cache_fill(session, &job->dirs[i].file,
+            &job->attr_request, job->dirs[i].change))
+            filled++;
+    }
+
+    DPRINTF(2, ("treewalk_thread('%s'): prefetched %lu of %lu "
+        "subdirectories\n",
+        job->state->path.path, (unsigned long)filled,
+        (unsigned long)job->count));
+
+    (void)InterlockedDecrement(&treewalk_jobs);
+    /* release the reference from |treewalk_prefetch_start()| */
+    nfs41_open_state_deref(job->state);
+    free(job);
+    return 0;
+}
+
+/*
+ * Start reading the subdirectories in |entries| into the directory
+ * listing cache
+ */
+static void treewalk_prefetch_start(
+    IN nfs41_open_state *state,
+    IN const bitmap4 *attr_request,
+    IN unsigned char *entries,
+    IN uint32_t entries_len)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    treewalk_job *job = NULL;
+    nfs41_readdir_entry *entry;
+    nfs41_component name;
+    unsigned char *pos = entries;
+    HANDLE thread;
+
+    if ((entries_len == 0) || (nfs41_dg.treewalk_prefetch_max == 0))
+        return;
+
+    if (InterlockedIncrement(&treewalk_jobs) >
+        nfs41_dg.treewalk_prefetch_max) {
+        DPRINTF(2, ("treewalk_prefetch_start: budget exhausted\n"));
+        goto out_budget;
+    }
+
+    job = calloc(1, sizeof(treewalk_job));
+    if (job == NULL)
+        goto out_budget;
+
+    bitmap4_cpy(&job->attr_request, attr_request);
+
+    for (;;) {
+        entry = (nfs41_readdir_entry *)pos;
+        if (entry->fh.superblock &&
+            (entry->attr_info.type == NF4DIR) &&
+            bitmap_isset(&entry->attr_info.attrmask, 0,
+                FATTR4_WORD0_CHANGE) &&
+            strcmp(entry->name, ".") && strcmp(entry->name, "..")) {
+            name.name = entry->name;
+            name.len = (unsigned short)entry->name_len - 1;
+            if (format_abs_path(&state->path, &name,
+                &job->dirs[job->count].path) == NO_ERROR) {
+                nfs41_abs_path *path = &job->dirs[job->count].path;
+                nfs41_path_fh *file = &job->dirs[job->count].file;
+
+                file->path = path;
+                last_component(path->path, path->path + path->len,
+                    &file->name);
+                fh_copy(&file->fh, &entry->fh);
+                job->dirs[job->count].change = entry->attr_info.change;
+                if (++job->count == TREEWALK_MAX_SUBDIRS)
+                    break;
+            }
+        }
+        if (!entry->next_entry_offset)
+            break;
+        pos += entry->next_entry_offset;
+    }
+    if (job->count == 0)
+        goto out_free;
+
+    /* the thread holds a reference on |state| until it is done */
+    job->state = state;
+    nfs41_open_state_ref(state);
+    thread = (HANDLE)_beginthreadex(NULL,
+        NFSD_THREAD_STACK_SIZE, treewalk_thread, job, 0, NULL);
+    if (thread == NULL) {
+        eprintf("treewalk_prefetch_start: _beginthreadex() failed "
+            "with %d\n", (int)GetLastError());
+        nfs41_open_state_deref(state);
+        goto out_free;
+    }
+    (void)CloseHandle(thread);
+    return;
+
+out_free:
+    free(job);
+out_budget:
+    (void)InterlockedDecrement(&treewalk_jobs);
+}
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+
+#ifdef NFS41_DRIVER_DAEMON_SYMLINK_CACHE
+/*
+ * Read the targets of all symlinks in |entries| which match the
+ * filter with batched READLINKs, so |lookup_symlink()| finds them in
+ * the symlink target cache instead of sending one READLINK each
+ */
+static void readdir_prefetch_symlinks(
+    IN nfs41_session *session,
+    IN const readdir_compiled_filter *cfilter,
+    IN unsigned char *entries,
+    IN uint32_t entries_len)
+{
+    nfs41_readdir_entry *entry;
+    nfs41_path_fh *files = NULL, **file_ptrs = NULL;
+    uint64_t *changes = NULL;
+    unsigned char *pos;
+    uint32_t count = 0, i = 0;
+
+    if (entries_len == 0)
+        return;
+
+    for (pos = entries ; ; pos += entry->next_entry_offset) {
+        entry = (nfs41_readdir_entry *)pos;
+        if ((entry->attr_info.type == NF4LNK) && entry->fh.superblock &&
+            bitmap_isset(&entry->attr_info.attrmask, 0,
+                FATTR4_WORD0_CHANGE) &&
+            readdir_filter_match(cfilter, entry->name))
+            count++;
+        if (!entry->next_entry_offset)
+            break;
+    }
+    /* a single symlink gets its READLINK from |lookup_symlink()| */
+    if (count < 2)
+        return;
+
+    files = calloc(count, sizeof(nfs41_path_fh));
+    file_ptrs = malloc(count * sizeof(nfs41_path_fh *));
+    changes = malloc(count * sizeof(uint64_t));
+    if ((files == NULL) || (file_ptrs == NULL) || (changes == NULL))
+        goto out;
+
+    for (pos = entries ; i < count ; pos += entry->next_entry_offset) {
+        entry = (nfs41_readdir_entry *)pos;
+        if ((entry->attr_info.type == NF4LNK) && entry->fh.superblock &&
+            bitmap_isset(&entry->attr_info.attrmask, 0,
+                FATTR4_WORD0_CHANGE) &&
+            readdir_filter_match(cfilter, entry->name)) {
+            /* no path, PUTFH only needs the filehandle */
+            files[i].path = NULL;
+            fh_copy(&files[i].fh, &entry->fh);
+            file_ptrs[i] = &files[i];
+            changes[i] = entry->attr_info.change;
+            i++;
+        }
+        if (!entry->next_entry_offset)
+            break;
+    }
+
+    nfs41_symlink_cache_prefetch(session, i, file_ptrs, changes);
+out:
+    free(changes);
+    free(file_ptrs);
+    free(files);
+}
+#endif /* NFS41_DRIVER_DAEMON_SYMLINK_CACHE */
+
 static int readdir_copy_entry(
     IN readdir_upcall_args *args,
     IN nfs41_readdir_entry *entry,
@@ -563,8 +1707,8 @@ static int readdir_copy_entry(
     PFILE_DIR_INFO_UNION info;
     const nfs41_superblock *superblock = args->state->file.fh.superblock;
 
-    wname_len = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS,
-        entry->name, entry->name_len, wname, NFS4_OPAQUE_LIMIT);
+    wname_len = utf8_to_wide(entry->name, entry->name_len,
+        wname, NFS4_OPAQUE_LIMIT);
     EASSERT(wname_len > 0);
     wname_size = (wname_len - 1) * sizeof(WCHAR);
 
@@ -579,7 +1723,9 @@ static int readdir_copy_entry(
     *dst_pos += info->NextEntryOffset;
     *dst_len -= info->NextEntryOffset;
 
-    if (entry->attr_info.rdattr_error == NFS4ERR_MOVED) {
+    if (args->query_class == FileNamesInformation) {
+        /* no attributes, so neither referrals nor symlinks matter */
+    } else if (entry->attr_info.rdattr_error == NFS4ERR_MOVED) {
         entry->attr_info.type = NF4DIR; /* default to dir */
         /* look up attributes for referral entries, but ignore return value;
          * it's okay if lookup fails, we'll just write garbage attributes */
@@ -752,14 +1898,285 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+/*
+ * READDIR readahead
+ *
+ * Directories which are not served from the directory listing cache
+ * used to be read one READDIR per upcall, with the server's
+ * processing time and the round trip on the critical path of every
+ * batch.
+ * When an enumeration continues with a cookie, the READDIR for the
+ * batch which follows is sent by a worker thread as soon as the
+ * current one is handed to the kernel, and the batch size is doubled
+ * with every prefetch up to |READDIR_AHEAD_MAX_SIZE| (and the
+ * session's maximum reply size).
+ * A prefetched batch can be larger than what fits into one upcall,
+ * the entries not returned yet are kept in |readdir_ahead.cur| for
+ * the next upcall.
+ * Batches which do not start at the cookie of the next upcall
+ * (e.g. after a restart) are discarded.
+ */
+#define READDIR_AHEAD_MAX_SIZE (1024*1024UL)
+
+typedef struct __readdir_ahead_buf {
+    nfs41_open_state        *state;
+    uint32_t                generation;
+    bool                    names_only;
+    bitmap4                 attr_request;
+    nfs41_readdir_cookie    cookie; /* batch follows this cookie */
+    uint64_t                last_cookie; /* cookie of the last entry */
+    int                     status;
+    bool_t                  eof;
+    uint32_t                size;
+    uint32_t                len; /* number of valid bytes */
+    uint32_t                pos; /* offset of the next entry to return */
+    unsigned char           data[1];
+} readdir_ahead_buf;
+
+/* Wait for a prefetch in flight, must be called with the lock held */
+static void readdir_ahead_wait(
+    IN nfs41_open_state *state)
+{
+    while (state->readdir_ahead.busy)
+        (void)SleepConditionVariableSRW(&state->readdir_ahead.cond,
+            &state->readdir_ahead.lock, INFINITE, 0);
+}
+
+static uint64_t readdir_last_cookie(
+    IN unsigned char *entries)
+{
+    nfs41_readdir_entry *entry = (nfs41_readdir_entry *)entries;
+
+    while (entry->next_entry_offset)
+        entry = (nfs41_readdir_entry *)
+            ((unsigned char *)entry + entry->next_entry_offset);
+    return entry->cookie;
+}
+
+static unsigned int WINAPI readdir_ahead_thread(void *args)
+{
+    readdir_ahead_buf *buf = (readdir_ahead_buf *)args;
+    nfs41_open_state *state = buf->state;
+
+    buf->len = buf->size;
+    buf->status = nfs41_readdir(state->session, &state->file,
+        &buf->attr_request, &buf->cookie, buf->data, &buf->len,
+        &buf->eof);
+    if (buf->status == NFS4_OK) {
+        if (buf->len) {
+            buf->last_cookie = readdir_last_cookie(buf->data);
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+            if (!buf->names_only)
+                readdir_prime_name_cache(state->session, &state->file,
+                    buf->data, buf->len);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+        }
+        else if (!buf->eof) {
+            /* nothing to return, let the upcall retry it itself */
+            buf->status = NFS4ERR_TOOSMALL;
+        }
+    }
+
+    DPRINTF(2, ("readdir_ahead_thread('%s'): cookie=%llu len=%lu eof=%d "
+        "status='%s'\n",
+        state->path.path, (unsigned long long)buf->cookie.cookie,
+        (unsigned long)buf->len, (int)buf->eof,
+        nfs_error_string(buf->status)));
+
+    AcquireSRWLockExclusive(&state->readdir_ahead.lock);
+    if ((buf->generation == state->readdir_ahead.generation) &&
+        (buf->status == NFS4_OK)) {
+        free(state->readdir_ahead.next);
+        state->readdir_ahead.next = buf;
+        buf = NULL;
+    }
+    state->readdir_ahead.busy = FALSE;
+    WakeAllConditionVariable(&state->readdir_ahead.cond);
+    ReleaseSRWLockExclusive(&state->readdir_ahead.lock);
+
+    free(buf);
+    /* release the reference from |readdir_ahead_start()| */
+    nfs41_open_state_deref(state);
+    return 0;
+}
+
+/*
+ * Start fetching the batch following |cookie|, must be called with
+ * the lock held
+ */
+static void readdir_ahead_start(
+    IN nfs41_open_state *state,
+    IN const bitmap4 *attr_request,
+    IN bool names_only,
+    IN const nfs41_readdir_cookie *cookie)
+{
+    readdir_ahead_buf *buf;
+    HANDLE thread;
+    uint32_t size;
+
+    if (state->readdir_ahead.busy)
+        return;
+
+    /* scale the batch size up while the enumeration goes on */
+    size = state->readdir_ahead.batch_size;
+    state->readdir_ahead.batch_size = (uint32_t)min(size * 2ULL,
+        min(READDIR_AHEAD_MAX_SIZE,
+            state->session->fore_chan_attrs.ca_maxresponsesize));
+    size = max(size,
+        (uint32_t)(sizeof(nfs41_readdir_entry) + NFS41_MAX_COMPONENT_LEN+1));
+
+    buf = malloc(sizeof(readdir_ahead_buf) + size);
+    if (buf == NULL)
+        return;
+
+    buf->state = state;
+    buf->generation = state->readdir_ahead.generation;
+    buf->names_only = names_only;
+    bitmap4_cpy(&buf->attr_request, attr_request);
+    (void)memcpy(&buf->cookie, cookie, sizeof(nfs41_readdir_cookie));
+    buf->last_cookie = 0;
+    buf->status = NFS4_OK;
+    buf->eof = FALSE;
+    buf->size = size;
+    buf->len = 0;
+    buf->pos = 0;
+
+    /* the thread holds a reference on |state| until it is done */
+    nfs41_open_state_ref(state);
+    state->readdir_ahead.busy = TRUE;
+    thread = (HANDLE)_beginthreadex(NULL,
+        NFSD_THREAD_STACK_SIZE, readdir_ahead_thread, buf, 0, NULL);
+    if (thread == NULL) {
+        eprintf("readdir_ahead_start: _beginthreadex() failed with %d\n",
+            (int)GetLastError());
+        state->readdir_ahead.busy = FALSE;
+        nfs41_open_state_deref(state);
+        free(buf);
+        return;
+    }
+    (void)CloseHandle(thread);
+}
+
+/*
+ * Get the batch which continues the enumeration at |state->cookie|,
+ * either the rest of the current batch or the prefetched one, and
+ * start prefetching the batch after it. The caller owns the returned
+ * buffer and passes it back to |readdir_ahead_put()|.
+ */
+static readdir_ahead_buf *readdir_ahead_get(
+    IN nfs41_open_state *state,
+    IN const bitmap4 *attr_request,
+    IN bool names_only)
+{
+    readdir_ahead_buf *buf;
+
+    AcquireSRWLockExclusive(&state->readdir_ahead.lock);
+    buf = state->readdir_ahead.cur;
+    state->readdir_ahead.cur = NULL;
+    if (buf && (buf->cookie.cookie == state->cookie.cookie) &&
+        (buf->names_only == names_only))
+        goto out;
+    free(buf);
+
+    readdir_ahead_wait(state);
+    buf = state->readdir_ahead.next;
+    state->readdir_ahead.next = NULL;
+    if (buf && ((buf->cookie.cookie != state->cookie.cookie) ||
+        (buf->names_only != names_only))) {
+        free(buf);
+        buf = NULL;
+    }
+    if (buf && !buf->eof) {
+        nfs41_readdir_cookie next;
+
+        next.cookie = buf->last_cookie;
+        (void)memcpy(next.verf, buf->cookie.verf, NFS4_VERIFIER_SIZE);
+        readdir_ahead_start(state, attr_request, names_only, &next);
+    }
+out:
+    ReleaseSRWLockExclusive(&state->readdir_ahead.lock);
+    return buf;
+}
+
+/*
+ * Keep the entries of |buf| following |state->cookie| for the next
+ * upcall, or free it if all entries have been returned
+ */
+static void readdir_ahead_put(
+    IN nfs41_open_state *state,
+    IN readdir_ahead_buf *buf,
+    IN unsigned char *next_entry)
+{
+    AcquireSRWLockExclusive(&state->readdir_ahead.lock);
+    if (next_entry && (buf->generation == state->readdir_ahead.generation)) {
+        buf->pos = (uint32_t)(next_entry - buf->data);
+        buf->cookie.cookie = state->cookie.cookie;
+        free(state->readdir_ahead.cur);
+        state->readdir_ahead.cur = buf;
+        buf = NULL;
+    }
+    ReleaseSRWLockExclusive(&state->readdir_ahead.lock);
+    free(buf);
+}
+
+/* Start prefetching after a batch which was read synchronously */
+static void readdir_ahead_continue(
+    IN nfs41_open_state *state,
+    IN const bitmap4 *attr_request,
+    IN bool names_only,
+    IN uint32_t batch_len)
+{
+    AcquireSRWLockExclusive(&state->readdir_ahead.lock);
+    if (state->readdir_ahead.batch_size < batch_len)
+        state->readdir_ahead.batch_size = batch_len;
+    readdir_ahead_start(state, attr_request, names_only, &state->cookie);
+    ReleaseSRWLockExclusive(&state->readdir_ahead.lock);
+}
+
+/* Discard all batches, a prefetch in flight is dropped when it is done */
+static void readdir_ahead_reset(
+    IN nfs41_open_state *state)
+{
+    AcquireSRWLockExclusive(&state->readdir_ahead.lock);
+    state->readdir_ahead.generation++;
+    state->readdir_ahead.batch_size = 0;
+    free(state->readdir_ahead.cur);
+    state->readdir_ahead.cur = NULL;
+    free(state->readdir_ahead.next);
+    state->readdir_ahead.next = NULL;
+    ReleaseSRWLockExclusive(&state->readdir_ahead.lock);
+}
+
+/* Called when the open state is freed, no prefetch can be in flight */
+void nfs41_readdir_ahead_free(
+    IN nfs41_open_state *state)
+{
+    EASSERT(state->readdir_ahead.busy == FALSE);
+    free(state->readdir_ahead.cur);
+    free(state->readdir_ahead.next);
+}
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
+
 static int handle_readdir(void *deamon_context, nfs41_upcall *upcall)
 {
     int status;
     readdir_upcall_args *args = &upcall->args.readdir;
     nfs41_open_state *state = upcall->state_ref;
     unsigned char *entry_buf = NULL;
+    unsigned char *batch;
     uint32_t entry_buf_len;
-    bitmap4 attr_request;
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+    readdir_ahead_buf *ahead;
+    bool from_server;
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+    bool treewalk;
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+    readdir_compiled_filter cfilter;
+    bitmap4 attr_request, names_request;
+    /* |FileNamesInformation| does not return any attributes */
+    const bool names_only = (args->query_class == FileNamesInformation);
     bool_t eof;
     /* make sure we allocate enough space for one nfs41_readdir_entry */
     const uint32_t max_buf_len = max((uint32_t)args->buf_len,
@@ -771,6 +2188,9 @@ static int handle_readdir(void *deamon_context, nfs41_upcall *upcall)
     args->query_reply_len = 0;
 
     if (args->initial || args->restart) {
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+        readdir_ahead_reset(state);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
         ZeroMemory(&state->cookie, sizeof(nfs41_readdir_cookie));
         if (!state->cookie.cookie) {
             DPRINTF(1, ("initializing the 1st readdir cookie\n"));
@@ -789,22 +2209,44 @@ static int handle_readdir(void *deamon_context, nfs41_upcall *upcall)
         goto out;
     }
 
-    entry_buf = calloc(max_buf_len, sizeof(unsigned char));
+    entry_buf = nfsd_arena_calloc(max_buf_len);
     if (entry_buf == NULL) {
         status = GetLastError();
         goto out_free_cookie;
     }
+    readdir_filter_compile(args->filter, &cfilter);
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+    if ((args->initial || args->restart) &&
+        !readdir_filter_is_literal(args->filter, strlen(args->filter)))
+        treewalk = treewalk_update(upcall->root_ref, &state->path);
+    else
+        treewalk = treewalk_active(upcall->root_ref);
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
 fetch_entries:
     entry_buf_len = max_buf_len;
+    batch = entry_buf;
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+    ahead = NULL;
+    from_server = false;
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
 
     nfs41_superblock_getattr_mask(state->file.fh.superblock, &attr_request);
     attr_request.arr[0] |= FATTR4_WORD0_RDATTR_ERROR;
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+    /* for |readdir_prime_name_cache()| */
+    attr_request.arr[0] |= FATTR4_WORD0_FILEHANDLE;
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+    /*
+     * The directory listing cache is shared by all query classes and
+     * is always filled with |attr_request|, a names-only READDIR
+     * just skips the attributes (and the idmap/name cache work for
+     * them)
+     */
+    nfs41_superblock_getattr_profile(state->file.fh.superblock,
+        NFS41_GETATTR_PROFILE_NAMES, &names_request);
+    names_request.arr[0] |= FATTR4_WORD0_RDATTR_ERROR;
 
-    if (strchr(args->filter, FILTER_STAR) ||
-        strchr(args->filter, FILTER_QM) ||
-        strchr(args->filter, FILTER_DOT) ||
-        strchr(args->filter, '?') ||
-        strchr(args->filter, '*')) {
+    if (!readdir_filter_is_literal(args->filter, strlen(args->filter))) {
         /* use READDIR for wildcards */
 
         uint32_t dots_len = 0;
@@ -823,11 +2265,41 @@ fetch_entries:
                 "will use . or ..\n"));
             entry_buf_len = 0;
             eof = 0;
-        } else {
+        }
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+        else if (readdir_cache_get(state, &attr_request,
+            entry_buf + dots_len, &entry_buf_len, &eof)) {
+            DPRINTF(2, ("using cached directory listing for cookie %llu\n",
+                state->cookie.cookie));
+        }
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+        else if ((dots_len == 0) && state->cookie.cookie && !args->single &&
+            (ahead = readdir_ahead_get(state,
+                names_only?&names_request:&attr_request, names_only))) {
+            DPRINTF(2, ("using prefetched READDIR batch for cookie %llu\n",
+                state->cookie.cookie));
+            batch = ahead->data + ahead->pos;
+            entry_buf_len = ahead->len - ahead->pos;
+            eof = ahead->eof;
+            (void)memcpy(state->cookie.verf, ahead->cookie.verf,
+                NFS4_VERIFIER_SIZE);
+            if (entry_buf_len == 0) {
+                /* empty last batch, only the eof flag was needed */
+                readdir_ahead_put(state, ahead, NULL);
+                ahead = NULL;
+            }
+        }
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
+        else {
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+            from_server = true;
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
             DPRINTF(2, ("calling nfs41_readdir with cookie %llu\n",
                 state->cookie.cookie));
             status = nfs41_readdir(state->session, &state->file,
-                &attr_request, &state->cookie, entry_buf + dots_len,
+                names_only?&names_request:&attr_request,
+                &state->cookie, entry_buf + dots_len,
                 &entry_buf_len, &eof);
             if (status) {
                 DPRINTF(1, ("nfs41_readdir failed with '%s'\n",
@@ -835,6 +2307,11 @@ fetch_entries:
                 status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
                 goto out_free_cookie;
             }
+#ifdef NFS41_DRIVER_DAEMON_READDIR_CACHE
+            if (!names_only)
+                readdir_prime_name_cache(state->session, &state->file,
+                    entry_buf + dots_len, entry_buf_len);
+#endif /* NFS41_DRIVER_DAEMON_READDIR_CACHE */
         }
 
         if (!entry_buf_len && dots_next_offset)
@@ -855,9 +2332,28 @@ fetch_entries:
         StringCbCopyA(entry->name, entry->name_len, args->filter);
         entry->next_entry_offset = 0;
 
-        status = lookup_entry(upcall->root_ref,
-             state->session, &state->file, entry);
+        /*
+         * "." and ".." are not looked up by name, same as in
+         * |readdir_add_dots()|, the root has no ".."
+         */
+        if (!strcmp(args->filter, ".")) {
+            ZeroMemory(&entry->attr_info, sizeof(nfs41_file_info));
+            status = nfs41_cached_getattr(state->session,
+                &state->file, NULL, &entry->attr_info);
+        } else if (!strcmp(args->filter, "..")) {
+            ZeroMemory(&entry->attr_info, sizeof(nfs41_file_info));
+            if (state->file.name.len == 0)
+                status = ERROR_FILE_NOT_FOUND;
+            else
+                status = nfs41_cached_getattr(state->session,
+                    &state->parent, NULL, &entry->attr_info);
+        } else {
+            /* LOOKUP+GETATTR, or answered from the name cache */
+            status = lookup_entry(upcall->root_ref,
+                state->session, &state->file, entry);
+        }
         if (status) {
+            /* already mapped to Windows error codes */
             DPRINTF(1, ("single_lookup failed with %d\n", status));
             goto out_free_cookie;
         }
@@ -870,21 +2366,35 @@ fetch_entries:
     status = args->initial ? ERROR_FILE_NOT_FOUND : ERROR_NO_MORE_FILES;
 
     if (entry_buf_len) {
-        unsigned char *entry_pos = entry_buf;
+        unsigned char *entry_pos = batch;
+        unsigned char *next_entry = NULL; /* first entry not returned */
         unsigned char *dst_pos = args->kbuf;
         uint32_t dst_len = args->buf_len;
         nfs41_readdir_entry *entry;
         PULONG offset, last_offset = NULL;
 
+#ifdef NFS41_DRIVER_DAEMON_SYMLINK_CACHE
+        if (!names_only)
+            readdir_prefetch_symlinks(state->session, &cfilter,
+                batch, entry_buf_len);
+#endif /* NFS41_DRIVER_DAEMON_SYMLINK_CACHE */
+#ifdef NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH
+        /* names-only batches have no file types */
+        if (treewalk && !names_only && !args->single)
+            treewalk_prefetch_start(state, &attr_request,
+                batch, entry_buf_len);
+#endif /* NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH */
+
         for (;;) {
             entry = (nfs41_readdir_entry*)entry_pos;
             offset = (PULONG)dst_pos; /* ULONG NextEntryOffset */
 
             DPRINTF(2, ("filter '%s' looking at '%s' with cookie %lld\n",
                 args->filter, entry->name, (long long)entry->cookie));
-            if (readdir_filter((const char*)args->filter, entry->name)) {
+            if (readdir_filter_match(&cfilter, entry->name)) {
                 if (readdir_copy_entry(args, entry, &dst_pos, &dst_len)) {
                     eof = 0;
+                    next_entry = entry_pos;
                     DPRINTF(2,
                         ("not enough space to copy entry '%s' (cookie %lld)\n",
                         entry->name, (long long)entry->cookie));
@@ -902,11 +2412,22 @@ fetch_entries:
             /* we found our single entry, but the server has more */
             if (args->single && last_offset) {
                 eof = 0;
+                next_entry = entry_pos + entry->next_entry_offset;
                 break;
             }
             entry_pos += entry->next_entry_offset;
         }
         args->query_reply_len = args->buf_len - dst_len;
+#ifdef NFS41_DRIVER_DAEMON_READDIR_PIPELINE
+        if (ahead) {
+            readdir_ahead_put(state, ahead, next_entry);
+            ahead = NULL;
+        } else if (from_server && !next_entry && !eof && !args->single) {
+            readdir_ahead_continue(state,
+                names_only?&names_request:&attr_request, names_only,
+                max_buf_len);
+        }
+#endif /* NFS41_DRIVER_DAEMON_READDIR_PIPELINE */
         if (last_offset) {
             *last_offset = 0;
         } else if (!eof) {
@@ -923,7 +2444,7 @@ fetch_entries:
     }
 
 out_free_entry:
-    free(entry_buf);
+    nfsd_arena_free(entry_buf);
 out:
     const char *debug_status_msg = "<NULL>";
 
@@ -22,7 +22,13 @@
  */
 
 #include <Windows.h>
+#include <process.h>
 #include <stdio.h>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#elif defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
 
 // #define IOSIZE_STAT 1
 
@@ -32,9 +38,13 @@
 
 #include "nfs41_ops.h"
 #include "name_cache.h"
+#include "delegation.h"
 #include "upcall.h"
 #include "daemon_debug.h"
 #include "util.h"
+#include "fscache.h"
+#include "mempressure.h"
+#include "qos.h"
 
 
 /* number of times to retry on write/commit verifier mismatch */
@@ -175,22 +185,373 @@ static int parse_rw(
     int status;
     readwrite_upcall_args *args = &upcall->args.rw;
 
+#ifdef NFS41_DRIVER_INLINE_RW
+    /* |cleanup_rw()| also runs if parsing fails */
+    args->inline_buf = NULL;
+#endif /* NFS41_DRIVER_INLINE_RW */
     status = safe_read(&buffer, &length, &args->len, sizeof(args->len));
     if (status) goto out;
     status = safe_read(&buffer, &length, &args->offset, sizeof(args->offset));
     if (status) goto out;
+    status = safe_read(&buffer, &length, &args->flags, sizeof(args->flags));
+    if (status) goto out;
     status = safe_read(&buffer, &length, &args->buffer, sizeof(args->buffer));
     if (status) goto out;
 
+#ifdef NFS41_DRIVER_INLINE_RW
+    if (args->buffer == NULL) {
+        /* inline READ/WRITE, the data is in the upcall/downcall buffer */
+        if (args->len > NFS41_RW_INLINE_MAX) {
+            eprintf("parse_rw: inline '%s' with len=%lu too large\n",
+                opcode2string(upcall->opcode), (unsigned long)args->len);
+            status = ERROR_INVALID_PARAMETER;
+            goto out;
+        }
+        args->inline_buf = malloc(max(args->len, 1));
+        if (args->inline_buf == NULL) {
+            status = ERROR_NOT_ENOUGH_MEMORY;
+            goto out;
+        }
+        if (upcall->opcode == NFS41_SYSOP_WRITE) {
+            status = safe_read(&buffer, &length, args->inline_buf,
+                args->len);
+            if (status) {
+                free(args->inline_buf);
+                args->inline_buf = NULL;
+                goto out;
+            }
+        }
+        args->buffer = args->inline_buf;
+    }
+#endif /* NFS41_DRIVER_INLINE_RW */
+
     EASSERT(length == 0);
 
-    DPRINTF(1, ("parsing '%s' len=%lu offset=%llu buf=0x%p\n",
-            opcode2string(upcall->opcode), args->len, args->offset, args->buffer));
+    DPRINTF(1, ("parsing '%s' len=%lu offset=%llu flags=0x%lx buf=0x%p\n",
+            opcode2string(upcall->opcode), args->len, args->offset,
+            (unsigned long)args->flags, args->buffer));
 out:
     return status;
 }
 
+/*
+ * Parallel READ/WRITE chunks: Large I/O requests are split into
+ * chunks of |max_read_size()|/|max_write_size()|, and several
+ * of them are kept in flight at once, each on its own session slot.
+ * The calling thread is one of the workers.
+ */
+typedef struct __rw_chunk {
+    stateid_arg stateid; /* per-chunk copy, updated by recovery */
+    unsigned char *buffer;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t bytes_done;
+    int status;
+    bool_t eof; /* READ only */
+    nfs41_open_state *state; /* READ only */
+    nfs41_write_verf verf; /* WRITE only */
+    enum stable_how4 stable; /* WRITE only */
+    nfs41_file_info info; /* WRITE only */
+} rw_chunk;
+
+typedef int (*rw_chunk_fn)(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN OUT rw_chunk *chunk);
+
+typedef struct __rw_pipeline {
+    nfs41_session *session;
+    nfs41_path_fh *file;
+    rw_chunk_fn chunk_fn;
+    rw_chunk *chunks;
+    uint32_t count;
+    volatile LONG next;
+} rw_pipeline;
+
+#define MAX_RW_PIPELINE_DEPTH 16
+
+static int rw_pipeline_init(
+    IN rw_pipeline *pipeline,
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN rw_chunk_fn chunk_fn,
+    IN const stateid_arg *stateid,
+    IN unsigned char *buffer,
+    IN uint64_t offset,
+    IN uint32_t length,
+    IN uint32_t chunksize)
+{
+    uint32_t i;
+
+    pipeline->session = session;
+    pipeline->file = file;
+    pipeline->chunk_fn = chunk_fn;
+    pipeline->count = (length + chunksize - 1) / chunksize;
+    pipeline->next = 0;
+    pipeline->chunks = calloc(pipeline->count, sizeof(rw_chunk));
+    if (pipeline->chunks == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    for (i = 0; i < pipeline->count; i++) {
+        rw_chunk *chunk = &pipeline->chunks[i];
+        const uint32_t reloffset = i * chunksize;
+
+        chunk->stateid = *stateid;
+        chunk->buffer = buffer + reloffset;
+        chunk->offset = offset + reloffset;
+        chunk->len = min(length - reloffset, chunksize);
+        chunk->stable = UNSTABLE4;
+    }
+    return NO_ERROR;
+}
+
+static void rw_pipeline_free(
+    IN rw_pipeline *pipeline)
+{
+    free(pipeline->chunks);
+    pipeline->chunks = NULL;
+}
+
+static unsigned int WINAPI rw_pipeline_thread(void *args)
+{
+    rw_pipeline *pipeline = (rw_pipeline *)args;
+    LONG i;
+
+    /* grab the next chunk until all are done */
+    while ((i = InterlockedIncrement(&pipeline->next) - 1) <
+        (LONG)pipeline->count) {
+        rw_chunk *chunk = &pipeline->chunks[i];
+        chunk->status = pipeline->chunk_fn(pipeline->session,
+            pipeline->file, chunk);
+    }
+    return 0;
+}
+
+/* Run all chunks of |pipeline| with up to |depth| requests in flight */
+static void rw_pipeline_run(
+    IN rw_pipeline *pipeline,
+    IN uint32_t depth)
+{
+    HANDLE threads[MAX_RW_PIPELINE_DEPTH-1];
+    uint32_t i, num_threads = 0;
+
+    /* don't use more requests than the server gave us slots */
+    depth = min(depth, pipeline->count);
+    depth = min(depth, MAX_RW_PIPELINE_DEPTH);
+    depth = min(depth, pipeline->session->table.max_slots);
+
+    for (i = 0; (i + 1) < depth; i++) {
+        threads[num_threads] = (HANDLE)_beginthreadex(NULL,
+            NFSD_THREAD_STACK_SIZE, rw_pipeline_thread, pipeline,
+            0, NULL);
+        if (threads[num_threads] == NULL) {
+            eprintf("rw_pipeline_run: "
+                "_beginthreadex() failed with %d\n", (int)GetLastError());
+            break;
+        }
+        num_threads++;
+    }
+
+    (void)rw_pipeline_thread(pipeline);
+
+    if (num_threads) {
+        (void)WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+        for (i = 0; i < num_threads; i++)
+            (void)CloseHandle(threads[i]);
+    }
+}
+
 /* NFS41_SYSOP_READ */
+/*
+ * Number of READ/READ_PLUS compounds kept in flight for reads larger
+ * than |max_read_size()|. Set to |1| to read the chunks one after
+ * another.
+ */
+#define MAX_READ_PIPELINE_DEPTH 8
+
+#ifdef NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS
+/*
+ * READ vs. READ_PLUS:
+ * READ_PLUS only saves bandwidth for files with holes, and servers
+ * typically have to look for holes in every READ_PLUS, while a plain
+ * READ can be sent from the page cache straight to the socket.
+ * So each open file starts with READ_PLUS, and after
+ * |READ_PLUS_SAMPLE_BYTES| have been read the hole ratio is checked.
+ * If less than |READ_PLUS_MIN_HOLE_PERCENT| of the data came from
+ * holes, the next |READ_PLUS_RETRY_READS| chunks are read with READ,
+ * then READ_PLUS is tried again.
+ */
+#define READ_PLUS_SAMPLE_BYTES      (4LL*1024*1024)
+#define READ_PLUS_MIN_HOLE_PERCENT  5
+#define READ_PLUS_RETRY_READS       256
+
+/* bytes which were not sent over the wire because they were holes */
+static volatile LONG64 read_plus_hole_bytes_saved = 0;
+
+static bool_t read_plus_wanted(
+    IN nfs41_open_state *state)
+{
+    if (state == NULL)
+        return TRUE;
+
+    if (state->read_plus.reads_left <= 0)
+        return TRUE;
+
+    if (InterlockedDecrement(&state->read_plus.reads_left) > 0)
+        return FALSE;
+
+    DPRINTF(2, ("read_plus_wanted('%s'): trying READ_PLUS again\n",
+        state->path.path));
+    return TRUE;
+}
+
+static void read_plus_account(
+    IN nfs41_open_state *state,
+    IN uint32_t data_len,
+    IN uint32_t hole_len)
+{
+    LONG64 bytes, hole_bytes;
+
+    if (hole_len) {
+        LONG64 saved = InterlockedAdd64(&read_plus_hole_bytes_saved,
+            hole_len);
+        DPRINTF(2, ("read_plus_account: %lu bytes from holes, "
+            "%lld bytes saved in total\n",
+            (unsigned long)hole_len, (long long)saved));
+    }
+
+    if (state == NULL)
+        return;
+
+    hole_bytes = InterlockedAdd64(&state->read_plus.hole_bytes, hole_len);
+    bytes = InterlockedAdd64(&state->read_plus.bytes, data_len);
+    if (bytes < READ_PLUS_SAMPLE_BYTES)
+        return;
+
+    /* start a new sample, concurrent chunks may be counted twice */
+    (void)InterlockedExchange64(&state->read_plus.bytes, 0);
+    (void)InterlockedExchange64(&state->read_plus.hole_bytes, 0);
+
+    if ((hole_bytes * 100) < (bytes * READ_PLUS_MIN_HOLE_PERCENT)) {
+        DPRINTF(1, ("read_plus_account('%s'): only %lld of %lld bytes "
+            "were holes, using READ for the next %d chunks\n",
+            state->path.path, (long long)hole_bytes, (long long)bytes,
+            (int)READ_PLUS_RETRY_READS));
+        (void)InterlockedExchange(&state->read_plus.reads_left,
+            READ_PLUS_RETRY_READS);
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS */
+
+static int read_chunk_from_mds(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN OUT rw_chunk *chunk)
+{
+    int status;
+    bool_t use_read_plus = session->client->root->supports_nfs42_read_plus;
+    uint32_t hole_len = 0;
+
+#ifdef NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS
+    if (use_read_plus)
+        use_read_plus = read_plus_wanted(chunk->state);
+#endif /* NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS */
+
+    if (use_read_plus) {
+        status = nfs42_read_plus(session, file, &chunk->stateid,
+            chunk->offset, chunk->len,
+            chunk->buffer, &chunk->bytes_done, &hole_len, &chunk->eof);
+#ifdef NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS
+        if (status == NFS4_OK)
+            read_plus_account(chunk->state, chunk->bytes_done, hole_len);
+#endif /* NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS */
+        /*
+         * Linux returns |NFS4ERR_IO| if not supported, FreeBSD 14.3
+         * returns |NFS4ERR_NOTSUPP| if not supported
+         */
+        if ((status == NFS4ERR_IO) || (status == NFS4ERR_NOTSUPP)) {
+            DPRINTF(0,
+                ("read_chunk_from_mds: "
+                "nfs42_read_plus() failed, error '%s', "
+                "disabling OP_READ_PLUS\n",
+                nfs_error_string(status)));
+            session->client->root->supports_nfs42_read_plus = false;
+#ifdef NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP
+            client_server_set_notsupp(session->client,
+                NFS41_SERVER_NOTSUPP_READ_PLUS);
+#endif /* NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP */
+        }
+    }
+    else {
+        status = nfs41_read(session, file, &chunk->stateid,
+            chunk->offset, chunk->len,
+            chunk->buffer, &chunk->bytes_done, &chunk->eof);
+    }
+    return status;
+}
+
+/*
+ * Read |to_rcv| bytes in parallel chunks of |maxreadsize|. Only the
+ * prefix of chunks which were completely read is counted in
+ * |*len_out|, the caller reads the remainder one chunk at a time
+ */
+static void read_from_mds_parallel(
+    IN nfs41_open_state *state,
+    IN stateid_arg *stateid,
+    IN unsigned char *buffer,
+    IN uint64_t offset,
+    IN uint32_t to_rcv,
+    IN uint32_t maxreadsize,
+    OUT uint32_t *len_out,
+    OUT bool_t *eof_out)
+{
+    nfs41_session *session = state->session;
+    rw_pipeline pipeline;
+    uint32_t i, len = 0;
+
+    *len_out = 0;
+    *eof_out = FALSE;
+
+    /* not fatal, the caller reads the chunks one after another */
+    if (rw_pipeline_init(&pipeline, session, &state->file,
+        read_chunk_from_mds, stateid, buffer, offset, to_rcv, maxreadsize))
+        return;
+
+    for (i = 0; i < pipeline.count; i++)
+        pipeline.chunks[i].state = state;
+
+    DPRINTF(1, ("read_from_mds_parallel: reading %lu in %lu chunks of %lu\n",
+        (unsigned long)to_rcv, (unsigned long)pipeline.count,
+        (unsigned long)maxreadsize));
+
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+    rw_pipeline_run(&pipeline, nfs41_autotune_depth(
+        &session->client->root->autotune, MAX_READ_PIPELINE_DEPTH));
+#else
+    rw_pipeline_run(&pipeline, MAX_READ_PIPELINE_DEPTH);
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
+
+    /* collect the results in file order */
+    for (i = 0; i < pipeline.count; i++) {
+        rw_chunk *chunk = &pipeline.chunks[i];
+
+        if (chunk->status)
+            break;
+
+        len += chunk->bytes_done;
+        if (chunk->eof) {
+            *eof_out = TRUE;
+            break;
+        }
+        /* short read, the caller continues from here */
+        if (chunk->bytes_done < chunk->len)
+            break;
+    }
+
+    *len_out = len;
+    rw_pipeline_free(&pipeline);
+}
+
 static int read_from_mds(
     IN nfs41_upcall *upcall,
     IN stateid_arg *stateid)
@@ -203,37 +564,61 @@ static int read_from_mds(
     unsigned char *p = args->buffer;
     ULONG to_rcv = args->len, reloffset = 0, len = 0;
     const uint32_t maxreadsize = max_read_size(session, &file->fh);
+    rw_chunk chunk;
+
+#ifdef NFS41_DRIVER_DAEMON_FSCACHE
+    if (session->client->root->fsc &&
+        !(args->flags & NFS41_RW_FLAG_DIRECT_IO)) {
+        uint32_t fsc_len;
+        bool fsc_eof;
+
+        if (nfs41_fscache_read(upcall->state_ref, args->offset, to_rcv,
+            p, &fsc_len, &fsc_eof)) {
+            len = fsc_len;
+            args->offset += len;
+            if (fsc_eof && !len)
+                status = ERROR_HANDLE_EOF;
+            goto out;
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_FSCACHE */
+
+#ifdef NFS41_DRIVER_DAEMON_QOS
+    nfs41_qos_throttle(&upcall->root_ref->qos, to_rcv);
+#endif /* NFS41_DRIVER_DAEMON_QOS */
 
     if (to_rcv > maxreadsize) {
         DPRINTF(1, ("handle_nfs41_read: reading %d in chunks of %d\n",
             to_rcv, maxreadsize));
     }
 
-    while(to_rcv > 0) {
-        uint32_t bytes_read = 0, chunk = min(to_rcv, maxreadsize);
-
-        if (session->client->root->supports_nfs42_read_plus) {
-            status = nfs42_read_plus(session, file, stateid,
-                args->offset + reloffset, chunk,
-                p, &bytes_read, &eof);
-            /*
-             * Linux returns |NFS4ERR_IO| if not supported, FreeBSD 14.3
-             * returns |NFS4ERR_NOTSUPP| if not supported
-             */
-            if ((status == NFS4ERR_IO) || (status == NFS4ERR_NOTSUPP)) {
-                DPRINTF(0,
-                    ("read_from_mds: "
-                    "nfs42_read_plus() failed, error '%s', "
-                    "disabling OP_READ_PLUS\n",
-                    nfs_error_string(status)));
-                session->client->root->supports_nfs42_read_plus = false;
-            }
-        }
-        else {
-            status = nfs41_read(session, file, stateid,
-                args->offset + reloffset, chunk,
-                p, &bytes_read, &eof);
+    if ((to_rcv > maxreadsize) && (MAX_READ_PIPELINE_DEPTH > 1)) {
+        read_from_mds_parallel(upcall->state_ref, stateid, p,
+            args->offset, to_rcv, maxreadsize, &len, &eof);
+        p += len;
+        to_rcv -= len;
+        args->offset += len;
+        if (eof) {
+            if (!len)
+                status = ERROR_HANDLE_EOF;
+            goto out;
         }
+    }
+
+    while(to_rcv > 0) {
+        uint32_t bytes_read, chunksize = min(to_rcv, maxreadsize);
+
+        chunk.stateid = *stateid;
+        chunk.buffer = p;
+        chunk.offset = args->offset + reloffset;
+        chunk.len = chunksize;
+        chunk.bytes_done = 0;
+        chunk.eof = FALSE;
+        chunk.state = upcall->state_ref;
+        status = read_chunk_from_mds(session, file, &chunk);
+        bytes_read = chunk.bytes_done;
+        eof = chunk.eof;
+        *stateid = chunk.stateid;
 
         if (status == NFS4ERR_OPENMODE && !len) {
             stateid->type = STATEID_SPECIAL;
@@ -263,6 +648,361 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+/*
+ * Daemon-side readahead:
+ * If an open file is read sequentially, the next window is
+ * prefetched into a buffer owned by the |nfs41_open_state|, so the
+ * next READ upcall can be served without a round trip to the server.
+ *
+ * The memory used by all readahead buffers is limited by
+ * |READAHEAD_POOL_MAX_BYTES| (scaled by |nfs41_mempressure_limit()|),
+ * and a buffer is discarded if it is older
+ * than |READAHEAD_MAX_AGE| or if the file is written through the same
+ * open state.
+ */
+#define READAHEAD_MIN_SEQUENTIAL    2 /* sequential reads before readahead */
+#define READAHEAD_WINDOW_CHUNKS     4 /* window size in |max_read_size()| */
+#define READAHEAD_MAX_WINDOW        (8*1024*1024)
+#define READAHEAD_POOL_MAX_BYTES    (128LL*1024*1024)
+#define READAHEAD_MAX_AGE           1000 /* in milliseconds */
+
+typedef struct __nfs41_readahead_buf {
+    nfs41_open_state *state;
+    uint32_t generation;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t len; /* number of valid bytes */
+    bool_t eof;
+    ULONGLONG timestamp;
+    /* large page pool buffer or behind the header */
+    unsigned char *data;
+} nfs41_readahead_buf;
+
+static volatile LONG64 readahead_pool_bytes = 0;
+
+static nfs41_readahead_buf *readahead_buf_alloc(
+    IN uint32_t size)
+{
+    nfs41_readahead_buf *buf;
+
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+    const LONG64 pool_max = (LONG64)nfs41_mempressure_limit(
+        READAHEAD_POOL_MAX_BYTES, READAHEAD_MAX_WINDOW);
+#else
+    const LONG64 pool_max = READAHEAD_POOL_MAX_BYTES;
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+
+    if (InterlockedAdd64(&readahead_pool_bytes, size) > pool_max) {
+        (void)InterlockedAdd64(&readahead_pool_bytes, -(LONG64)size);
+        DPRINTF(2, ("readahead_buf_alloc: pool exhausted\n"));
+        return NULL;
+    }
+
+#ifdef NFS41_DRIVER_DAEMON_LARGE_PAGES
+    {
+        unsigned char *data = nfsd_largepage_buf_alloc(size);
+
+        if (data) {
+            buf = malloc(sizeof(nfs41_readahead_buf));
+            if (buf == NULL) {
+                (void)nfsd_largepage_buf_free(data);
+                (void)InterlockedAdd64(&readahead_pool_bytes,
+                    -(LONG64)size);
+                return NULL;
+            }
+            buf->data = data;
+            buf->size = size;
+            return buf;
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_LARGE_PAGES */
+
+    buf = malloc(sizeof(nfs41_readahead_buf) + size);
+    if (buf == NULL) {
+        (void)InterlockedAdd64(&readahead_pool_bytes, -(LONG64)size);
+        return NULL;
+    }
+    buf->data = (unsigned char *)(buf + 1);
+    buf->size = size;
+    return buf;
+}
+
+static void readahead_buf_free(
+    IN nfs41_readahead_buf *buf)
+{
+    if (buf == NULL)
+        return;
+    (void)InterlockedAdd64(&readahead_pool_bytes, -(LONG64)buf->size);
+#ifdef NFS41_DRIVER_DAEMON_LARGE_PAGES
+    if (buf->data != (unsigned char *)(buf + 1))
+        (void)nfsd_largepage_buf_free(buf->data);
+#endif /* NFS41_DRIVER_DAEMON_LARGE_PAGES */
+    free(buf);
+}
+
+/* Wait for a prefetch in flight, must be called with |ra.lock| held */
+static void readahead_wait(
+    IN nfs41_open_state *state)
+{
+    while (state->readahead.busy)
+        (void)SleepConditionVariableSRW(&state->readahead.cond,
+            &state->readahead.lock, INFINITE, 0);
+}
+
+static unsigned int WINAPI readahead_thread(void *args)
+{
+    nfs41_readahead_buf *buf = (nfs41_readahead_buf *)args;
+    nfs41_open_state *state = buf->state;
+    const uint32_t maxreadsize = max_read_size(state->session,
+        &state->file.fh);
+    stateid_arg stateid;
+
+    nfs41_open_stateid_arg(state, &stateid);
+
+    read_from_mds_parallel(state, &stateid,
+        buf->data, buf->offset, buf->size, maxreadsize,
+        &buf->len, &buf->eof);
+    buf->timestamp = GetTickCount64();
+
+    DPRINTF(2, ("readahead_thread('%s'): prefetched offset=%llu len=%lu "
+        "eof=%d\n",
+        state->path.path, (unsigned long long)buf->offset,
+        (unsigned long)buf->len, (int)buf->eof));
+
+    AcquireSRWLockExclusive(&state->readahead.lock);
+    if ((buf->generation == state->readahead.generation) &&
+        ((buf->len > 0) || buf->eof)) {
+        readahead_buf_free(state->readahead.buf);
+        state->readahead.buf = buf;
+        buf = NULL;
+    }
+    state->readahead.busy = FALSE;
+    WakeAllConditionVariable(&state->readahead.cond);
+    ReleaseSRWLockExclusive(&state->readahead.lock);
+
+    readahead_buf_free(buf);
+    /* release the reference from |readahead_start()| */
+    nfs41_open_state_deref(state);
+    return 0;
+}
+
+/* Must be called with |ra.lock| held */
+static void readahead_start(
+    IN nfs41_open_state *state,
+    IN uint64_t offset)
+{
+    nfs41_readahead_buf *buf;
+    const uint32_t maxreadsize = max_read_size(state->session,
+        &state->file.fh);
+    HANDLE thread;
+    uint32_t window;
+
+    if (state->readahead.busy)
+        return;
+
+    window = min(maxreadsize * READAHEAD_WINDOW_CHUNKS, READAHEAD_MAX_WINDOW);
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+    window = min(nfs41_autotune_readahead(
+        &state->session->client->root->autotune, window),
+        READAHEAD_MAX_WINDOW);
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
+    buf = readahead_buf_alloc(window);
+    if (buf == NULL)
+        return;
+
+    buf->state = state;
+    buf->generation = state->readahead.generation;
+    buf->offset = offset;
+    buf->len = 0;
+    buf->eof = FALSE;
+
+    /* the thread holds a reference on |state| until it is done */
+    nfs41_open_state_ref(state);
+    state->readahead.busy = TRUE;
+    thread = (HANDLE)_beginthreadex(NULL,
+        NFSD_THREAD_STACK_SIZE, readahead_thread, buf, 0, NULL);
+    if (thread == NULL) {
+        eprintf("readahead_start: _beginthreadex() failed with %d\n",
+            (int)GetLastError());
+        state->readahead.busy = FALSE;
+        nfs41_open_state_deref(state);
+        readahead_buf_free(buf);
+        return;
+    }
+    (void)CloseHandle(thread);
+}
+
+/*
+ * Try to serve a READ upcall from the readahead buffer. Returns
+ * |TRUE| if the request was completely served
+ */
+static bool_t readahead_read(
+    IN nfs41_upcall *upcall)
+{
+    nfs41_open_state *state = upcall->state_ref;
+    readwrite_upcall_args *args = &upcall->args.rw;
+    nfs41_readahead_buf *buf;
+    uint64_t buf_end;
+    uint32_t copy_len;
+    bool_t served = FALSE;
+
+    AcquireSRWLockExclusive(&state->readahead.lock);
+
+    /* a sequential reader waits for a prefetch which is still in flight */
+    if (args->offset == state->readahead.next_offset)
+        readahead_wait(state);
+
+    buf = state->readahead.buf;
+    if (buf == NULL)
+        goto out;
+
+    if ((GetTickCount64() - buf->timestamp) > READAHEAD_MAX_AGE) {
+        state->readahead.buf = NULL;
+        readahead_buf_free(buf);
+        goto out;
+    }
+
+    buf_end = buf->offset + buf->len;
+    if ((args->offset < buf->offset) || (args->offset >= buf_end)) {
+        /* serve reads at or beyond EOF from a complete buffer */
+        if (buf->eof && (args->offset >= buf_end) && (args->len > 0)) {
+            args->out_len = 0;
+            served = TRUE;
+        }
+        goto out;
+    }
+
+    copy_len = (uint32_t)min(args->len, buf_end - args->offset);
+    (void)memcpy(args->buffer, buf->data + (args->offset - buf->offset),
+        copy_len);
+
+    DPRINTF(2, ("readahead_read('%s'): served offset=%llu len=%lu "
+        "from readahead buffer\n",
+        state->path.path, (unsigned long long)args->offset,
+        (unsigned long)copy_len));
+
+    if ((copy_len == args->len) || buf->eof) {
+        args->out_len = copy_len;
+        served = TRUE;
+    }
+    else {
+        /* let |read_from_mds()| read the rest */
+        args->buffer += copy_len;
+        args->offset += copy_len;
+        args->len -= copy_len;
+        args->out_len = copy_len;
+    }
+out:
+    ReleaseSRWLockExclusive(&state->readahead.lock);
+    return served;
+}
+
+/* Track sequential access after a READ and start readahead if needed */
+static void readahead_update(
+    IN nfs41_open_state *state,
+    IN uint64_t offset,
+    IN uint32_t len,
+    IN int status)
+{
+    nfs41_readahead_buf *buf;
+    uint64_t end = offset + len, next;
+
+    if (status || (len == 0))
+        return;
+
+    AcquireSRWLockExclusive(&state->readahead.lock);
+    if (offset == state->readahead.next_offset)
+        state->readahead.seq_count++;
+    else
+        state->readahead.seq_count = 0;
+    state->readahead.next_offset = end;
+
+    if (state->readahead.seq_count < READAHEAD_MIN_SEQUENTIAL)
+        goto out;
+
+    /*
+     * Start the next window once the reader has consumed half of the
+     * current buffer
+     */
+    buf = state->readahead.buf;
+    next = end;
+    if (buf) {
+        if (buf->eof)
+            goto out;
+        if ((buf->offset + buf->len) > end) {
+            if ((end - buf->offset) < (buf->len / 2))
+                goto out;
+            next = buf->offset + buf->len;
+        }
+    }
+    readahead_start(state, next);
+out:
+    ReleaseSRWLockExclusive(&state->readahead.lock);
+}
+
+/* Discard readahead data, e.g. after a WRITE through |state| */
+void nfs41_readahead_invalidate(
+    IN nfs41_open_state *state)
+{
+    AcquireSRWLockExclusive(&state->readahead.lock);
+    state->readahead.generation++;
+    state->readahead.seq_count = 0;
+    readahead_buf_free(state->readahead.buf);
+    state->readahead.buf = NULL;
+    ReleaseSRWLockExclusive(&state->readahead.lock);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_OPEN_PREFETCH
+/*
+ * Keep the data of the READ in the OPEN compound (see |do_open()|)
+ * as readahead buffer of the new |state|, so the first READ upcalls
+ * are served from it like from a prefetched window
+ */
+void nfs41_readahead_prefetched(
+    IN nfs41_open_state *state,
+    IN const unsigned char *data,
+    IN uint32_t len,
+    IN bool_t eof)
+{
+    nfs41_readahead_buf *buf;
+
+    buf = readahead_buf_alloc(len);
+    if (buf == NULL)
+        return;
+
+    buf->state = state;
+    buf->offset = 0;
+    buf->len = len;
+    buf->eof = eof;
+    buf->timestamp = GetTickCount64();
+    (void)memcpy(buf->data, data, len);
+
+    AcquireSRWLockExclusive(&state->readahead.lock);
+    buf->generation = state->readahead.generation;
+    if ((state->readahead.buf == NULL) && !state->readahead.busy) {
+        state->readahead.buf = buf;
+        buf = NULL;
+    }
+    ReleaseSRWLockExclusive(&state->readahead.lock);
+
+    readahead_buf_free(buf);
+}
+#endif /* NFS41_DRIVER_DAEMON_OPEN_PREFETCH */
+
+/* Wait for any prefetch in flight and free the buffer, before CLOSE */
+void nfs41_readahead_shutdown(
+    IN nfs41_open_state *state)
+{
+    AcquireSRWLockExclusive(&state->readahead.lock);
+    state->readahead.generation++;
+    readahead_wait(state);
+    readahead_buf_free(state->readahead.buf);
+    state->readahead.buf = NULL;
+    ReleaseSRWLockExclusive(&state->readahead.lock);
+}
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
+
 static int read_from_pnfs(
     IN nfs41_upcall *upcall,
     IN stateid_arg *stateid)
@@ -277,6 +1017,9 @@ static int read_from_pnfs(
         goto out;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_QOS
+    nfs41_qos_throttle(&upcall->root_ref->qos, args->len);
+#endif /* NFS41_DRIVER_DAEMON_QOS */
     pnfsstat = pnfs_read(upcall->root_ref, upcall->state_ref, stateid, layout, 
         args->offset, args->len, args->buffer, &args->out_len);
     switch (pnfsstat) {
@@ -299,6 +1042,23 @@ static int handle_read(void *daemon_context, nfs41_upcall *upcall)
     stateid_arg stateid;
     ULONG pnfs_bytes_read = 0;
     int status = NO_ERROR;
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+    const uint64_t ra_offset = args->offset;
+    ULONG ra_bytes_read = 0;
+
+    /* direct I/O is read straight into the caller's buffer */
+    if (args->flags & NFS41_RW_FLAG_DIRECT_IO)
+        goto skip_readahead;
+
+    if (readahead_read(upcall)) {
+        status = args->out_len ? NO_ERROR : ERROR_HANDLE_EOF;
+        goto out_readahead;
+    }
+    /* |readahead_read()| may have served the start of the request */
+    ra_bytes_read = args->out_len;
+    args->out_len = 0;
+skip_readahead:
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
 
     nfs41_open_stateid_arg(upcall->state_ref, &stateid);
 
@@ -322,6 +1082,17 @@ static int handle_read(void *daemon_context, nfs41_upcall *upcall)
 
     args->out_len += pnfs_bytes_read;
 out:
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+    if (ra_bytes_read) {
+        args->out_len += ra_bytes_read;
+        if (status == ERROR_HANDLE_EOF)
+            status = NO_ERROR;
+    }
+out_readahead:
+    if (!(args->flags & NFS41_RW_FLAG_DIRECT_IO))
+        readahead_update(upcall->state_ref, ra_offset, args->out_len,
+            status);
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
 
 #ifdef IOSIZE_STAT
     ioread_stats(status, args->out_len);
@@ -332,6 +1103,575 @@ out:
 
 
 /* NFS41_SYSOP_WRITE */
+/*
+ * Number of UNSTABLE4 WRITE compounds kept in flight for writes larger
+ * than |max_write_size()|. A single COMMIT is sent by |write_to_mds()|
+ * at the end. Set to |1| to send the chunks one after another.
+ * Direct I/O (|NFS41_RW_FLAG_DIRECT_IO|) sends the chunks as
+ * DATA_SYNC4/FILE_SYNC4 instead, without a COMMIT.
+ */
+#define MAX_WRITE_PIPELINE_DEPTH 8
+
+static int write_chunk_to_mds(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN OUT rw_chunk *chunk)
+{
+    return nfs41_write(session, file, &chunk->stateid, chunk->buffer,
+        chunk->len, chunk->offset, chunk->stable, &chunk->bytes_done,
+        &chunk->verf, &chunk->info);
+}
+
+/*
+ * Send |to_send| bytes in parallel |stable| chunks of |maxwritesize|.
+ * Only the prefix of chunks which were completely written is counted
+ * in |*len_out|, the caller sends the remainder one chunk at a time
+ */
+static int write_to_mds_pipelined(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid_arg *stateid,
+    IN unsigned char *buffer,
+    IN uint64_t offset,
+    IN uint32_t to_send,
+    IN uint32_t maxwritesize,
+    IN enum stable_how4 stable,
+    OUT uint32_t *len_out,
+    IN OUT nfs41_write_verf *verf,
+    IN OUT enum stable_how4 *committed,
+    OUT nfs41_file_info *info,
+    OUT bool_t *verify_failed)
+{
+    rw_pipeline pipeline;
+    uint32_t i, len = 0;
+    uint64_t highest_change = 0;
+    int status = NFS4_OK;
+
+    *len_out = 0;
+    *verify_failed = FALSE;
+
+    /* not fatal, the caller sends the chunks one after another */
+    if (rw_pipeline_init(&pipeline, session, file, write_chunk_to_mds,
+        stateid, buffer, offset, to_send, maxwritesize))
+        goto out;
+    for (i = 0; i < pipeline.count; i++)
+        pipeline.chunks[i].stable = stable;
+
+    DPRINTF(1, ("write_to_mds_pipelined: writing %lu in %lu chunks of %lu\n",
+        (unsigned long)to_send, (unsigned long)pipeline.count,
+        (unsigned long)maxwritesize));
+
+#ifdef NFS41_DRIVER_DAEMON_AUTOTUNE
+    rw_pipeline_run(&pipeline, nfs41_autotune_depth(
+        &session->client->root->autotune, MAX_WRITE_PIPELINE_DEPTH));
+#else
+    rw_pipeline_run(&pipeline, MAX_WRITE_PIPELINE_DEPTH);
+#endif /* NFS41_DRIVER_DAEMON_AUTOTUNE */
+
+    /* collect the results in file order */
+    for (i = 0; i < pipeline.count; i++) {
+        rw_chunk *chunk = &pipeline.chunks[i];
+
+        if (chunk->status) {
+            if (len == 0)
+                status = chunk->status;
+            break;
+        }
+
+        /* all chunks are checked against the same expected verifier */
+        (void)memcpy(verf->verf, chunk->verf.verf, NFS4_VERIFIER_SIZE);
+        verf->committed = chunk->verf.committed;
+        if (!verify_write(verf, committed)) {
+            *verify_failed = TRUE;
+            break;
+        }
+
+        if ((i == 0) || (chunk->info.change > highest_change)) {
+            highest_change = chunk->info.change;
+            (void)memcpy(info, &chunk->info, sizeof(nfs41_file_info));
+        }
+
+        len += chunk->bytes_done;
+        /* short write, the caller continues from here */
+        if (chunk->bytes_done < chunk->len)
+            break;
+    }
+
+    *len_out = len;
+    rw_pipeline_free(&pipeline);
+out:
+    return status;
+}
+
+#ifdef NFS41_DRIVER_DAEMON_WRITE_GATHERING
+/*
+ * Write gathering for small FILE_SYNC4 WRITEs
+ *
+ * Write-through handles (and apps which, like logging frameworks, send
+ * lots of small writes from several threads) produce one FILE_SYNC4
+ * WRITE per upcall. While such a WRITE for an open is in flight, the
+ * next small WRITEs of the same open queue up, and the next sender
+ * merges the queued WRITEs which continue each other into one
+ * FILE_SYNC4 WRITE. Each upcall only returns when the WRITE which
+ * carried its data has been acknowledged as stable.
+ * There is no artificial delay: A lone writer sends its WRITE right
+ * away, gathering only happens while the server is busy anyway.
+ */
+#define WRITE_GATHER_MAX_LEN        (64*1024) /* per upcall */
+#define WRITE_GATHER_MAX_REQUESTS   32
+
+typedef struct __write_gather_request {
+    struct list_entry entry;
+    stateid_arg *stateid;
+    unsigned char *buffer;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t bytes_written;
+    nfs41_write_verf *verf;
+    nfs41_file_info *info;
+    int status;
+    bool_t done;
+} write_gather_request;
+
+static bool_t write_gather_same_stateid(
+    IN const stateid_arg *s1,
+    IN const stateid_arg *s2)
+{
+    return (s1->type == s2->type) &&
+        (stateid4_cmp(&s1->stateid, &s2->stateid) == 0);
+}
+
+/*
+ * Take the oldest pending request and the pending requests which
+ * continue it from |state->write_gather.pending|, expects the caller
+ * to hold |state->write_gather.lock|
+ */
+static uint32_t write_gather_collect(
+    IN nfs41_open_state *state,
+    IN uint32_t maxwritesize,
+    OUT write_gather_request **reqs)
+{
+    struct list_entry *entry;
+    write_gather_request *req;
+    uint64_t end;
+    uint32_t n = 0, total;
+    bool_t found;
+
+    reqs[n] = list_container(state->write_gather.pending.next,
+        write_gather_request, entry);
+    list_remove(&reqs[n]->entry);
+    end = reqs[n]->offset + reqs[n]->len;
+    total = reqs[n]->len;
+    n++;
+
+    do {
+        found = FALSE;
+        list_for_each(entry, &state->write_gather.pending) {
+            req = list_container(entry, write_gather_request, entry);
+            if ((req->offset == end) &&
+                ((total + req->len) <= maxwritesize) &&
+                write_gather_same_stateid(req->stateid, reqs[0]->stateid)) {
+                list_remove(&req->entry);
+                reqs[n++] = req;
+                end += req->len;
+                total += req->len;
+                found = TRUE;
+                break;
+            }
+        }
+    } while (found && (n < WRITE_GATHER_MAX_REQUESTS));
+    return n;
+}
+
+static void write_gather_send(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN write_gather_request *const *reqs,
+    IN uint32_t count)
+{
+    nfs41_write_verf verf;
+    nfs41_file_info info;
+    unsigned char *buffer, *p;
+    uint32_t i, total = 0, bytes_written = 0, chunk;
+    int status;
+
+    if (count == 1) {
+        reqs[0]->status = nfs41_write(session, file,
+            reqs[0]->stateid, reqs[0]->buffer, reqs[0]->len,
+            reqs[0]->offset, FILE_SYNC4, &reqs[0]->bytes_written,
+            reqs[0]->verf, reqs[0]->info);
+        return;
+    }
+
+    for (i = 0 ; i < count ; i++)
+        total += reqs[i]->len;
+
+    buffer = malloc(total);
+    if (buffer == NULL) {
+        /* no memory to merge, send them one after another */
+        for (i = 0 ; i < count ; i++)
+            write_gather_send(session, file, &reqs[i], 1);
+        return;
+    }
+    for (p = buffer, i = 0 ; i < count ; i++)
+        p = mempcpy(p, reqs[i]->buffer, reqs[i]->len);
+
+    DPRINTF(1, ("write_gather_send: merged %u WRITEs, offset=%llu "
+        "len=%lu\n", (unsigned int)count,
+        (unsigned long long)reqs[0]->offset, (unsigned long)total));
+
+    (void)memset(&verf, 0, sizeof(verf));
+    (void)memset(&info, 0, sizeof(info));
+    status = nfs41_write(session, file, reqs[0]->stateid,
+        buffer, total, reqs[0]->offset, FILE_SYNC4, &bytes_written,
+        &verf, &info);
+    free(buffer);
+
+    /*
+     * A short WRITE only completes a prefix of the requests, the
+     * caller queues the others again
+     */
+    for (i = 0 ; i < count ; i++) {
+        chunk = min(reqs[i]->len, bytes_written);
+        bytes_written -= chunk;
+
+        reqs[i]->bytes_written = chunk;
+        reqs[i]->status = status;
+        (void)memcpy(reqs[i]->verf->verf, verf.verf, NFS4_VERIFIER_SIZE);
+        reqs[i]->verf->committed = verf.committed;
+        (void)memcpy(reqs[i]->info, &info, sizeof(info));
+    }
+}
+
+/* |nfs41_write()| of a small FILE_SYNC4 WRITE with write gathering */
+static int write_gathered(
+    IN nfs41_open_state *state,
+    IN stateid_arg *stateid,
+    IN unsigned char *buffer,
+    IN uint32_t len,
+    IN uint64_t offset,
+    IN uint32_t maxwritesize,
+    OUT uint32_t *bytes_written,
+    IN OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *info)
+{
+    write_gather_request req, *reqs[WRITE_GATHER_MAX_REQUESTS];
+    uint32_t i, n;
+
+    req.stateid = stateid;
+    req.buffer = buffer;
+    req.offset = offset;
+    req.len = len;
+    req.bytes_written = 0;
+    req.verf = verf;
+    req.info = info;
+    req.status = NFS4_OK;
+    req.done = FALSE;
+
+    AcquireSRWLockExclusive(&state->write_gather.lock);
+    list_add_tail(&state->write_gather.pending, &req.entry);
+    while (!req.done) {
+        if (state->write_gather.busy) {
+            (void)SleepConditionVariableSRW(&state->write_gather.cond,
+                &state->write_gather.lock, INFINITE, 0);
+            continue;
+        }
+
+        state->write_gather.busy = TRUE;
+        n = write_gather_collect(state, maxwritesize, reqs);
+        ReleaseSRWLockExclusive(&state->write_gather.lock);
+
+        write_gather_send(state->session, &state->file, reqs, n);
+
+        AcquireSRWLockExclusive(&state->write_gather.lock);
+        for (i = n ; i-- > 0 ; ) {
+            if ((reqs[i]->status == NFS4_OK) &&
+                (reqs[i]->bytes_written == 0))
+                list_add_head(&state->write_gather.pending,
+                    &reqs[i]->entry);
+            else
+                reqs[i]->done = TRUE;
+        }
+        state->write_gather.busy = FALSE;
+        WakeAllConditionVariable(&state->write_gather.cond);
+    }
+    ReleaseSRWLockExclusive(&state->write_gather.lock);
+
+    *bytes_written = req.bytes_written;
+    return req.status;
+}
+
+#ifdef NFS41_DRIVER_PAGING_WRITE_CLUSTERING
+/*
+ * Paging write clustering
+ *
+ * Mm and Cc flush the dirty pages of memory-mapped and cached files
+ * as many small paging WRITE upcalls, often for random offsets (e.g.
+ * a qsort(3) on a mapped file). Paging WRITEs of an open queue up in
+ * |state->write_gather.clustered| while a batch is being sent. The
+ * next sender sorts the queued requests by offset, merges runs of
+ * adjacent requests into UNSTABLE4 WRITEs of up to wsize, and makes
+ * all of them stable with one COMMIT. Each upcall only returns after
+ * that COMMIT, and if the write verifier changed in between, the
+ * requests of the batch are sent again as FILE_SYNC4 WRITEs.
+ * Once a batch had more than one request, the next sender waits
+ * |WRITE_CLUSTER_DELAY_MS| to let the rest of the flush queue up, a
+ * lone writer is never delayed.
+ */
+#define WRITE_CLUSTER_MAX_LEN       (256*1024) /* per upcall */
+#define WRITE_CLUSTER_MAX_REQUESTS  64
+#define WRITE_CLUSTER_DELAY_MS      2
+
+static int write_cluster_cmp(
+    IN const void *a,
+    IN const void *b)
+{
+    const write_gather_request *r1 = *(const write_gather_request **)a;
+    const write_gather_request *r2 = *(const write_gather_request **)b;
+
+    if (r1->offset < r2->offset)
+        return -1;
+    return (r1->offset > r2->offset)? 1 : 0;
+}
+
+/*
+ * Take the oldest request and all pending requests with the same
+ * stateid from |state->write_gather.clustered|, sorted by offset.
+ * Requests which overlap one already taken stay queued, so two writes
+ * of the same page are never reordered. Expects the caller to hold
+ * |state->write_gather.lock|
+ */
+static uint32_t write_cluster_collect(
+    IN nfs41_open_state *state,
+    OUT write_gather_request **reqs)
+{
+    struct list_entry *entry, *tmp;
+    write_gather_request *req;
+    uint32_t i, n = 0;
+
+    list_for_each_tmp(entry, tmp, &state->write_gather.clustered) {
+        req = list_container(entry, write_gather_request, entry);
+        if (n && !write_gather_same_stateid(req->stateid, reqs[0]->stateid))
+            continue;
+        for (i = 0 ; i < n ; i++) {
+            if ((req->offset < (reqs[i]->offset + reqs[i]->len)) &&
+                (reqs[i]->offset < (req->offset + req->len)))
+                break;
+        }
+        if (i < n)
+            continue;
+
+        list_remove(&req->entry);
+        reqs[n++] = req;
+        if (n == WRITE_CLUSTER_MAX_REQUESTS)
+            break;
+    }
+
+    qsort(reqs, n, sizeof(reqs[0]), write_cluster_cmp);
+    return n;
+}
+
+/* Send the requests |reqs[first]| to |reqs[last-1]| as one WRITE */
+static int write_cluster_send_run(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN write_gather_request *const *reqs,
+    IN uint32_t first,
+    IN uint32_t last,
+    OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *info)
+{
+    unsigned char *buffer, *p;
+    uint32_t i, total = 0, bytes_written = 0, chunk;
+    int status;
+
+    for (i = first ; i < last ; i++)
+        total += reqs[i]->len;
+
+    if ((last - first) == 1) {
+        buffer = reqs[first]->buffer;
+    } else {
+        buffer = malloc(total);
+        if (buffer == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        for (p = buffer, i = first ; i < last ; i++)
+            p = mempcpy(p, reqs[i]->buffer, reqs[i]->len);
+    }
+
+    status = nfs41_write(session, file, reqs[first]->stateid, buffer, total,
+        reqs[first]->offset, UNSTABLE4, &bytes_written, verf, info);
+    if (buffer != reqs[first]->buffer)
+        free(buffer);
+
+    /* a short WRITE only completes a prefix of the requests */
+    for (i = first ; i < last ; i++) {
+        chunk = min(reqs[i]->len, bytes_written);
+        bytes_written -= chunk;
+
+        reqs[i]->bytes_written = chunk;
+        reqs[i]->status = status;
+    }
+    return status;
+}
+
+static void write_cluster_send(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN write_gather_request *const *reqs,
+    IN uint32_t count,
+    IN uint32_t maxwritesize)
+{
+    nfs41_write_verf verf, expected;
+    nfs41_file_info info;
+    uint64_t lo = reqs[0]->offset, hi = 0;
+    uint32_t i, j, total, runs = 0;
+    bool_t need_commit = FALSE, verify_failed = FALSE;
+    int status;
+
+    (void)memset(&info, 0, sizeof(info));
+    for (i = 0 ; i < count ; i = j) {
+        total = reqs[i]->len;
+        for (j = i + 1 ; j < count ; j++) {
+            if ((reqs[j]->offset != (reqs[j-1]->offset + reqs[j-1]->len)) ||
+                ((total + reqs[j]->len) > maxwritesize))
+                break;
+            total += reqs[j]->len;
+        }
+
+        (void)memset(&verf, 0, sizeof(verf));
+        status = write_cluster_send_run(session, file, reqs, i, j,
+            &verf, &info);
+        if (status == ERROR_NOT_ENOUGH_MEMORY) {
+            /* no memory to merge, send the run one by one */
+            j = i + 1;
+            status = write_cluster_send_run(session, file, reqs, i, j,
+                &verf, &info);
+        }
+        runs++;
+        if (status)
+            continue;
+
+        hi = max(hi, reqs[i]->offset + total);
+        if (verf.committed != UNSTABLE4)
+            continue;
+        if (!need_commit) {
+            (void)memcpy(&expected, &verf, sizeof(verf));
+            need_commit = TRUE;
+        } else if (memcmp(expected.verf, verf.verf, NFS4_VERIFIER_SIZE))
+            verify_failed = TRUE;
+    }
+
+    DPRINTF(1, ("write_cluster_send: %u paging WRITEs in %u runs, "
+        "offset=%llu\n", (unsigned int)count, (unsigned int)runs,
+        (unsigned long long)lo));
+
+    if (need_commit && !verify_failed) {
+        (void)memcpy(verf.expected, expected.verf, NFS4_VERIFIER_SIZE);
+        /* COMMIT offset 0/count 0 means the whole file */
+        if ((hi - lo) > UINT32_MAX)
+            hi = lo = 0;
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+        status = nfs41_commit_coalesced(session, file, lo,
+            (uint32_t)(hi - lo), &verf, &info);
+#else
+        status = nfs41_commit(session, file, lo, (uint32_t)(hi - lo), 1,
+            &verf, &info);
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
+        if (status) {
+            for (i = 0 ; i < count ; i++) {
+                if (reqs[i]->status == NFS4_OK) {
+                    reqs[i]->status = status;
+                    reqs[i]->bytes_written = 0;
+                }
+            }
+            return;
+        }
+        if (!verify_commit(&verf))
+            verify_failed = TRUE;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        if (verify_failed && (reqs[i]->status == NFS4_OK)) {
+            /* the server lost the UNSTABLE4 data, write it again */
+            reqs[i]->status = nfs41_write(session, file,
+                reqs[i]->stateid, reqs[i]->buffer, reqs[i]->len,
+                reqs[i]->offset, FILE_SYNC4, &reqs[i]->bytes_written,
+                reqs[i]->verf, reqs[i]->info);
+            continue;
+        }
+        reqs[i]->verf->committed = FILE_SYNC4;
+        (void)memcpy(reqs[i]->info, &info, sizeof(info));
+    }
+}
+
+/* |nfs41_write()| of a paging WRITE with write clustering */
+static int write_clustered(
+    IN nfs41_open_state *state,
+    IN stateid_arg *stateid,
+    IN unsigned char *buffer,
+    IN uint32_t len,
+    IN uint64_t offset,
+    IN uint32_t maxwritesize,
+    OUT uint32_t *bytes_written,
+    IN OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *info)
+{
+    write_gather_request req, *reqs[WRITE_CLUSTER_MAX_REQUESTS];
+    uint32_t i, n;
+
+    req.stateid = stateid;
+    req.buffer = buffer;
+    req.offset = offset;
+    req.len = len;
+    req.bytes_written = 0;
+    req.verf = verf;
+    req.info = info;
+    req.status = NFS4_OK;
+    req.done = FALSE;
+
+    AcquireSRWLockExclusive(&state->write_gather.lock);
+    list_add_tail(&state->write_gather.clustered, &req.entry);
+    while (!req.done) {
+        if (state->write_gather.cluster_busy) {
+            (void)SleepConditionVariableSRW(&state->write_gather.cond,
+                &state->write_gather.lock, INFINITE, 0);
+            continue;
+        }
+
+        state->write_gather.cluster_busy = TRUE;
+        if (state->write_gather.cluster_last > 1) {
+            /* a flush is in progress, let its next pages queue up */
+            ReleaseSRWLockExclusive(&state->write_gather.lock);
+            Sleep(WRITE_CLUSTER_DELAY_MS);
+            AcquireSRWLockExclusive(&state->write_gather.lock);
+        }
+        n = write_cluster_collect(state, reqs);
+        state->write_gather.cluster_last = n;
+        ReleaseSRWLockExclusive(&state->write_gather.lock);
+
+        write_cluster_send(state->session, &state->file, reqs, n,
+            maxwritesize);
+
+        AcquireSRWLockExclusive(&state->write_gather.lock);
+        for (i = n ; i-- > 0 ; ) {
+            if ((reqs[i]->status == NFS4_OK) &&
+                (reqs[i]->bytes_written == 0))
+                list_add_head(&state->write_gather.clustered,
+                    &reqs[i]->entry);
+            else
+                reqs[i]->done = TRUE;
+        }
+        state->write_gather.cluster_busy = FALSE;
+        WakeAllConditionVariable(&state->write_gather.cond);
+    }
+    ReleaseSRWLockExclusive(&state->write_gather.lock);
+
+    *bytes_written = req.bytes_written;
+    return req.status;
+}
+#endif /* NFS41_DRIVER_PAGING_WRITE_CLUSTERING */
+#endif /* NFS41_DRIVER_DAEMON_WRITE_GATHERING */
+
 static int write_to_mds(
     IN nfs41_upcall *upcall,
     IN stateid_arg *stateid)
@@ -349,58 +1689,26 @@ static int write_to_mds(
     /* on write verifier mismatch, retry N times before failing */
     uint32_t retries = MAX_WRITE_RETRIES;
     nfs41_file_info info;
+    bool_t verify_failed;
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    nfs41_delegation_state *deleg;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
 
     (void)memset(&info, 0, sizeof(info));
-
-
-#ifdef TEST_OP_ALLOCAE_OP_DEALLOCATE
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
     /*
-     * Test code for OP_ALLOCATE and OP_DEALLOCATE, do not use except for
-     * testing!
+     * with a write delegation, the COMMIT can wait, except for direct
+     * I/O and write-through handles
      */
-    size_t data_i;
-
-    /* Test whether the data block consists is a block of zero bytes */
-    for (data_i = 0 ; data_i < args->len ; data_i++) {
-        if (((char *)args->buffer)[data_i] != '\0')
-            break;
-    }
-
-    if (data_i == args->len) {
-        DPRINTF(0, ("write_to_mds(state->path.path='%s'): "
-            "Using DEALLOCATE+ALLOCATE for zero block\n",
-            state->path.path));
-
-        status = nfs42_deallocate(session, file, stateid,
-            args->offset, args->len,
-            &info);
-        if (status) {
-            DPRINTF(0, ("write_to_mds(state->path.path='%s'): "
-                "DEALLOCATE failed with '%s'\n",
-                state->path.path,
-                nfs_error_string(status)));
-        }
-        else {
-            status = nfs42_allocate(session, file, stateid,
-                args->offset, args->len,
-                &info);
-            if (status) {
-                DPRINTF(0, ("write_to_mds(state->path.path='%s'): "
-                    "ALLOCATE failed with '%s'\n",
-                    state->path.path,
-                    nfs_error_string(status)));
-            }
-        }
-
-        if (!status) {
-            /* Update ctime on success */
-            args->ctime = info.change;
-        }
-
-        len = args->len;
-        goto out;
-    }
-#endif /* TEST_OP_ALLOCAE_OP_DEALLOCATE */
+    if (!(args->flags &
+        (NFS41_RW_FLAG_DIRECT_IO|NFS41_RW_FLAG_WRITE_THROUGH)))
+        deleg = nfs41_delegation_write_behind_get(state);
+    else
+        deleg = NULL;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+#ifdef NFS41_DRIVER_DAEMON_QOS
+    nfs41_qos_throttle(&upcall->root_ref->qos, args->len);
+#endif /* NFS41_DRIVER_DAEMON_QOS */
 
 retry_write:
     p = args->buffer;
@@ -408,6 +1716,18 @@ retry_write:
     reloffset = 0;
     len = 0;
     stable = to_send <= maxwritesize ? FILE_SYNC4 : UNSTABLE4;
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    if (deleg)
+        stable = UNSTABLE4;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+    /*
+     * direct I/O and write-through WRITEs must be on stable storage
+     * when the WRITE returns
+     */
+    if (args->flags & NFS41_RW_FLAG_WRITE_THROUGH)
+        stable = FILE_SYNC4;
+    else if (args->flags & NFS41_RW_FLAG_DIRECT_IO)
+        stable = DATA_SYNC4;
     committed = FILE_SYNC4;
 
     if (to_send > maxwritesize) {
@@ -415,9 +1735,42 @@ retry_write:
             (unsigned long)to_send, (unsigned long)maxwritesize));
     }
 
+    if ((to_send > maxwritesize) && (MAX_WRITE_PIPELINE_DEPTH > 1)) {
+        status = write_to_mds_pipelined(session, file, stateid, p,
+            args->offset, to_send, maxwritesize, stable, &len, &verf,
+            &committed, &info, &verify_failed);
+        if (verify_failed) {
+            if (retries--) goto retry_write;
+            goto out_verify_failed;
+        }
+        if (status)
+            goto out;
+        p += len;
+        to_send -= len;
+        reloffset += len;
+    }
+
     while(to_send > 0) {
         uint32_t bytes_written = 0, chunk = min(to_send, maxwritesize);
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_GATHERING
+#ifdef NFS41_DRIVER_PAGING_WRITE_CLUSTERING
+        if ((stable == FILE_SYNC4) && (len == 0) && (chunk == to_send) &&
+            (chunk <= WRITE_CLUSTER_MAX_LEN) &&
+            (args->flags & NFS41_RW_FLAG_PAGING_IO))
+            status = write_clustered(state, stateid, p, chunk,
+                args->offset + reloffset, maxwritesize, &bytes_written,
+                &verf, &info);
+        else
+#endif /* NFS41_DRIVER_PAGING_WRITE_CLUSTERING */
+        if ((stable == FILE_SYNC4) && (len == 0) && (chunk == to_send) &&
+            (chunk <= WRITE_GATHER_MAX_LEN) &&
+            !(args->flags & NFS41_RW_FLAG_DIRECT_IO))
+            status = write_gathered(state, stateid, p, chunk,
+                args->offset + reloffset, maxwritesize, &bytes_written,
+                &verf, &info);
+        else
+#endif /* NFS41_DRIVER_DAEMON_WRITE_GATHERING */
         status = nfs41_write(session, file, stateid, p, chunk,
             args->offset + reloffset, stable, &bytes_written, &verf, &info);
         if (status && !len)
@@ -435,11 +1788,34 @@ retry_write:
             goto out_verify_failed;
         }
     }
-    if (committed != FILE_SYNC4) {
+    /*
+     * COMMIT unless the data is on stable storage, for direct I/O a
+     * DATA_SYNC4 reply is enough for a DATA_SYNC4 WRITE
+     */
+    if (committed < ((args->flags & NFS41_RW_FLAG_DIRECT_IO)?
+        stable : FILE_SYNC4)) {
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+        if (deleg) {
+            status = nfs41_delegation_write_behind(session->client, deleg,
+                args->buffer, args->offset, len, &verf);
+            if (status == NFS4_OK)
+                goto out_change;
+            if (status == NFS4ERR_IO)
+                goto out_verify_failed;
+            /* the delegation is being returned, or the data could
+             * not be retained, commit now */
+            status = NFS4_OK;
+        }
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
         DPRINTF(1, ("sending COMMIT for offset=%llu and len=%d\n",
             (unsigned long long)args->offset,
             (unsigned long)len));
+#ifdef NFS41_DRIVER_DAEMON_COMMIT_COALESCING
+        status = nfs41_commit_coalesced(session, file, args->offset, len,
+            &verf, &info);
+#else
         status = nfs41_commit(session, file, args->offset, len, 1, &verf, &info);
+#endif /* NFS41_DRIVER_DAEMON_COMMIT_COALESCING */
         if (status)
             goto out;
 
@@ -451,11 +1827,9 @@ retry_write:
         nfs41_file_info dummyinfo;
         bitmap4 attr_request;
 
-        /*
-         * FIXME: Which minimum set of attributes should be updated here (and
-         * for |nfs41_commit()| above ?) ?
-         */
-        nfs41_superblock_getattr_mask(file->fh.superblock, &attr_request);
+        /* only the attributes which the WRITEs can have changed */
+        nfs41_superblock_getattr_profile(file->fh.superblock,
+            NFS41_GETATTR_PROFILE_WRITE, &attr_request);
 
         /* Update attributes in the cache... */
         status = nfs41_getattr(session, file, &attr_request, &dummyinfo);
@@ -463,10 +1837,17 @@ retry_write:
             goto out;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+out_change:
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
     EASSERT(bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_CHANGE));
     args->ctime = info.change;
 
 out:
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    if (deleg)
+        nfs41_delegation_deref(deleg);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
     args->out_len = len;
     return nfs_to_windows_error(status, ERROR_NET_WRITE_FAULT);
 
@@ -476,6 +1857,170 @@ out_verify_failed:
     goto out;
 }
 
+/*
+ * "sparsewrite" mount option:
+ * Page-aligned all-zero ranges of at least |SPARSE_WRITE_MIN_HOLE|
+ * bytes inside a WRITE are sent as DEALLOCATE (which reads back as
+ * zeros) instead of WRITEing the zeros, the rest of the buffer is
+ * written normally. The last page of a WRITE is always written as
+ * data, so a WRITE which extends the file still sets the new size.
+ */
+#define SPARSE_WRITE_PAGE_SIZE  4096
+#define SPARSE_WRITE_MIN_HOLE   (16*SPARSE_WRITE_PAGE_SIZE)
+
+/* |len| must be a multiple of 64 */
+static bool_t block_is_zero(
+    IN const unsigned char *restrict p,
+    IN size_t len)
+{
+    size_t i;
+
+#if defined(_M_X64) || defined(_M_IX86)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc;
+
+    for (i = 0 ; i < len ; i += 64) {
+        acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+                _mm_loadu_si128((const __m128i *)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        /* most data pages are rejected in the first 64 bytes */
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+            return FALSE;
+    }
+#elif defined(_M_ARM64)
+    uint8x16_t acc;
+
+    for (i = 0 ; i < len ; i += 64) {
+        acc = vorrq_u8(
+            vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+            vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+        if (vmaxvq_u8(acc) != 0)
+            return FALSE;
+    }
+#else
+    uint64_t acc, w;
+    size_t j;
+
+    for (i = 0 ; i < len ; i += 64) {
+        acc = 0;
+        for (j = 0 ; j < 64 ; j += sizeof(w)) {
+            (void)memcpy(&w, p + i + j, sizeof(w));
+            acc |= w;
+        }
+        if (acc != 0)
+            return FALSE;
+    }
+#endif
+    return TRUE;
+}
+
+/* write |length| bytes at |reloffset| of the upcall buffer */
+static int sparse_write_data(
+    IN nfs41_upcall *upcall,
+    IN stateid_arg *stateid,
+    IN uint64_t offset,
+    IN unsigned char *buffer,
+    IN uint32_t reloffset,
+    IN uint32_t length,
+    OUT uint32_t *bytes_written)
+{
+    readwrite_upcall_args *args = &upcall->args.rw;
+    int status;
+
+    args->offset = offset + reloffset;
+    args->buffer = buffer + reloffset;
+    args->len = length;
+    args->out_len = 0;
+    status = write_to_mds(upcall, stateid);
+    *bytes_written = args->out_len;
+    return status;
+}
+
+static int write_to_mds_sparse(
+    IN nfs41_upcall *upcall,
+    IN stateid_arg *stateid)
+{
+    nfs41_open_state *state = upcall->state_ref;
+    nfs41_session *session = state->session;
+    readwrite_upcall_args *args = &upcall->args.rw;
+    const uint64_t offset = args->offset;
+    unsigned char *const buffer = args->buffer;
+    const uint32_t length = args->len;
+    uint32_t pos = 0, rel, hole_start, done = 0, written;
+    nfs41_file_info info;
+    int status = NO_ERROR;
+
+    /* first page boundary in the buffer, relative to the file offset */
+    rel = (uint32_t)((SPARSE_WRITE_PAGE_SIZE -
+        (offset % SPARSE_WRITE_PAGE_SIZE)) % SPARSE_WRITE_PAGE_SIZE);
+
+    while ((rel + SPARSE_WRITE_PAGE_SIZE) <= length) {
+        if (!block_is_zero(buffer + rel, SPARSE_WRITE_PAGE_SIZE)) {
+            rel += SPARSE_WRITE_PAGE_SIZE;
+            continue;
+        }
+
+        hole_start = rel;
+        do {
+            rel += SPARSE_WRITE_PAGE_SIZE;
+        } while (((rel + SPARSE_WRITE_PAGE_SIZE) <= length) &&
+            block_is_zero(buffer + rel, SPARSE_WRITE_PAGE_SIZE));
+
+        /* too small, or nothing left to set the file size */
+        if (((rel - hole_start) < SPARSE_WRITE_MIN_HOLE) ||
+            (rel >= length))
+            continue;
+
+        if (hole_start > pos) {
+            status = sparse_write_data(upcall, stateid, offset, buffer,
+                pos, hole_start - pos, &written);
+            done += written;
+            if (status || (written < (hole_start - pos)))
+                goto out;
+        }
+
+        (void)memset(&info, 0, sizeof(info));
+        status = nfs42_deallocate(session, &state->file, stateid,
+            offset + hole_start, rel - hole_start, &info);
+        if (status) {
+            /* not fatal, the zeros are written with the next data */
+            DPRINTF(1, ("write_to_mds_sparse(state->path.path='%s'): "
+                "DEALLOCATE(offset=%llu, length=%lu) failed with '%s'\n",
+                state->path.path,
+                (unsigned long long)(offset + hole_start),
+                (unsigned long)(rel - hole_start),
+                nfs_error_string(status)));
+            status = NO_ERROR;
+            pos = hole_start;
+            continue;
+        }
+
+        DPRINTF(2, ("write_to_mds_sparse(state->path.path='%s'): "
+            "DEALLOCATE(offset=%llu, length=%lu) instead of WRITE\n",
+            state->path.path,
+            (unsigned long long)(offset + hole_start),
+            (unsigned long)(rel - hole_start)));
+        EASSERT(bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_CHANGE));
+        args->ctime = info.change;
+        done += rel - hole_start;
+        pos = rel;
+    }
+
+    /* the rest, and the whole buffer if there was no hole */
+    status = sparse_write_data(upcall, stateid, offset, buffer,
+        pos, length - pos, &written);
+    done += written;
+
+out:
+    args->offset = offset;
+    args->buffer = buffer;
+    args->len = length;
+    args->out_len = done;
+    return status;
+}
+
 static int write_to_pnfs(
     IN nfs41_upcall *upcall,
     IN stateid_arg *stateid)
@@ -492,6 +2037,9 @@ static int write_to_pnfs(
         goto out;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_QOS
+    nfs41_qos_throttle(&upcall->root_ref->qos, args->len);
+#endif /* NFS41_DRIVER_DAEMON_QOS */
     if (pnfs_write(upcall->root_ref, upcall->state_ref, stateid, layout, 
             args->offset, args->len, args->buffer, &args->out_len, &info)) {
         status = ERROR_WRITE_FAULT;
@@ -510,6 +2058,10 @@ static int handle_write(void *daemon_context, nfs41_upcall *upcall)
     uint32_t pnfs_bytes_written = 0;
     int status;
 
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+    nfs41_readahead_invalidate(upcall->state_ref);
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
+
     nfs41_open_stateid_arg(upcall->state_ref, &stateid);
 
 #ifdef PNFS_ENABLE_WRITE
@@ -527,10 +2079,29 @@ static int handle_write(void *daemon_context, nfs41_upcall *upcall)
     }
 #endif
 
-    status = write_to_mds(upcall, &stateid);
+    if (upcall->root_ref->sparse_write &&
+        !(args->flags & NFS41_RW_FLAG_DIRECT_IO) &&
+        upcall->root_ref->supports_nfs42_deallocate &&
+        (args->len > SPARSE_WRITE_MIN_HOLE))
+        status = write_to_mds_sparse(upcall, &stateid);
+    else
+        status = write_to_mds(upcall, &stateid);
 out:
     args->out_len += pnfs_bytes_written;
 
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+    if ((status == NO_ERROR) && args->out_len)
+        nfs41_delegation_modified(upcall->state_ref);
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
+
+#ifdef NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE
+    if ((status == NO_ERROR) && args->out_len) {
+        nfs41_extent_map_update(upcall->state_ref,
+            args->offset - pnfs_bytes_written, args->out_len,
+            TRUE, args->ctime);
+    }
+#endif /* NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE */
+
 #ifdef IOSIZE_STAT
     iowrite_stats(status, args->out_len);
 #endif /* IOSIZE_STAT */
@@ -538,6 +2109,22 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+/* NFS41_SYSOP_FLUSH */
+static int handle_flush(void *daemon_context, nfs41_upcall *upcall)
+{
+    int status;
+
+    status = nfs41_delegation_write_behind_flush_open(upcall->state_ref);
+    if (status) {
+        eprintf("handle_flush: "
+            "nfs41_delegation_write_behind_flush_open() failed with '%s'\n",
+            nfs_error_string(status));
+    }
+    return nfs_to_windows_error(status, ERROR_NET_WRITE_FAULT);
+}
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+
 static int marshall_rw(
     unsigned char *restrict buffer,
     uint32_t *restrict length,
@@ -548,20 +2135,52 @@ static int marshall_rw(
     status = safe_write(&buffer, length, &args->out_len, sizeof(args->out_len));
     if (status) goto out;
     status = safe_write(&buffer, length, &args->ctime, sizeof(args->ctime));
+#ifdef NFS41_DRIVER_INLINE_RW
+    if (status) goto out;
+    if (args->inline_buf && (upcall->opcode == NFS41_SYSOP_READ)) {
+        status = safe_write(&buffer, length, args->inline_buf,
+            args->out_len);
+    }
+#endif /* NFS41_DRIVER_INLINE_RW */
 out:
     return status;
 }
+
+#ifdef NFS41_DRIVER_INLINE_RW
+static void cleanup_rw(
+    nfs41_upcall *upcall)
+{
+    readwrite_upcall_args *args = &upcall->args.rw;
+
+    free(args->inline_buf);
+    args->inline_buf = NULL;
+}
+#endif /* NFS41_DRIVER_INLINE_RW */
 
 
 const nfs41_upcall_op nfs41_op_read = {
     .parse = parse_rw,
     .handle = handle_read,
     .marshall = marshall_rw,
+#ifdef NFS41_DRIVER_INLINE_RW
+    .cleanup = cleanup_rw,
+#endif /* NFS41_DRIVER_INLINE_RW */
     .arg_size = sizeof(readwrite_upcall_args)
 };
 const nfs41_upcall_op nfs41_op_write = {
     .parse = parse_rw,
     .handle = handle_write,
     .marshall = marshall_rw,
+#ifdef NFS41_DRIVER_INLINE_RW
+    .cleanup = cleanup_rw,
+#endif /* NFS41_DRIVER_INLINE_RW */
     .arg_size = sizeof(readwrite_upcall_args)
 };
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+const nfs41_upcall_op nfs41_op_flush = {
+    .parse = NULL,
+    .handle = handle_flush,
+    .marshall = NULL,
+    .arg_size = 0
+};
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
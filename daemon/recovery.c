@@ -153,7 +153,8 @@ static int recover_open_grace(
     claim.u.prev.delegate_type = delegation->type;
 
     return nfs41_open(session, parent, file, owner, &claim, access, deny, 
-        OPEN4_NOCREATE, 0, NULL, FALSE, stateid, delegation, NULL);
+        OPEN4_NOCREATE, 0, NULL, NULL, FALSE, stateid, delegation, NULL,
+        NULL, NULL);
 }
 
 static int recover_open_no_grace(
@@ -175,8 +176,8 @@ static int recover_open_no_grace(
         claim.u.deleg_prev.filename = &file->name;
 
         status = nfs41_open(session, parent, file, owner,
-            &claim, access, deny, OPEN4_NOCREATE, 0, NULL, FALSE,
-            stateid, delegation, NULL);
+            &claim, access, deny, OPEN4_NOCREATE, 0, NULL, NULL, FALSE,
+            stateid, delegation, NULL, NULL, NULL);
         if (status == NFS4_OK || status == NFS4ERR_BADSESSION)
             goto out;
 
@@ -195,8 +196,8 @@ static int recover_open_no_grace(
         access |= OPEN4_SHARE_ACCESS_WANT_WRITE_DELEG;
 
     status = nfs41_open(session, parent, file, owner,
-        &claim, access, deny, OPEN4_NOCREATE, 0, NULL, FALSE,
-        stateid, delegation, NULL);
+        &claim, access, deny, OPEN4_NOCREATE, 0, NULL, NULL, FALSE,
+        stateid, delegation, NULL, NULL, NULL);
 out:
     return status;
 }
@@ -208,6 +209,7 @@ static int recover_open(
 {
     open_delegation4 delegation = { 0 };
     stateid4 stateid = { 0 };
+    nfs41_delegation_state *rehash = NULL;
     int status = NFS4ERR_BADHANDLE;
 
     /* check for an associated delegation */
@@ -269,6 +271,9 @@ static int recover_open(
             } else {
                 open_delegation4_cpy(&deleg->state, &delegation);
                 deleg->revoked = FALSE;
+                /* rehash after releasing |open->lock| */
+                nfs41_delegation_ref(deleg);
+                rehash = deleg;
             }
             ReleaseSRWLockExclusive(&deleg->lock);
         }
@@ -276,6 +281,11 @@ static int recover_open(
         nfs41_delegation_granted(session, &open->parent, &open->file,
             &delegation, FALSE, &open->delegation.state);
     ReleaseSRWLockExclusive(&open->lock);
+
+    if (rehash) {
+        nfs41_delegation_rehash_stateid(session->client, rehash);
+        nfs41_delegation_deref(rehash);
+    }
 out:
     return status;
 }
@@ -385,11 +395,13 @@ static int recover_delegation_want(
             delegation.type != OPEN_DELEGATE_WRITE) {
         eprintf("recover_delegation_want() got delegation type %u, "
             "expected %u\n", delegation.type, deleg->state.type);
+        ReleaseSRWLockExclusive(&deleg->lock);
     } else {
         open_delegation4_cpy(&deleg->state, &delegation);
         deleg->revoked = FALSE;
+        ReleaseSRWLockExclusive(&deleg->lock);
+        nfs41_delegation_rehash_stateid(session->client, deleg);
     }
-    ReleaseSRWLockExclusive(&deleg->lock);
 out:
     return status;
 }
@@ -445,11 +457,13 @@ static int recover_delegation_open(
             delegation.type != OPEN_DELEGATE_WRITE) {
         eprintf("recover_delegation_open() got delegation type %u, "
             "expected %u\n", delegation.type, deleg->state.type);
+        ReleaseSRWLockExclusive(&deleg->lock);
     } else {
         open_delegation4_cpy(&deleg->state, &delegation);
         deleg->revoked = FALSE;
+        ReleaseSRWLockExclusive(&deleg->lock);
+        nfs41_delegation_rehash_stateid(session->client, deleg);
     }
-    ReleaseSRWLockExclusive(&deleg->lock);
 
     /* send CLOSE to free the open stateid */
     stateid.open = NULL;
@@ -487,6 +501,176 @@ static int recover_delegation(
     return status;
 }
 
+/*
+ * Parallel reclaim
+ *
+ * Each reclaim is a synchronous compound, so reclaiming thousands of
+ * opens one after the other takes a long time of the grace period.
+ * |recovery_pipeline_run()| reclaims a snapshot of opens (with their
+ * locks) or delegations with up to |RECOVERY_MAX_THREADS| threads,
+ * but not more than the session has slots.
+ * The workers must not run with |client->state.lock| held, because
+ * |recover_open()| can call |nfs41_delegation_granted()|, which takes
+ * that lock. The snapshot holds a reference on each item instead.
+ */
+#define RECOVERY_MAX_THREADS 16
+
+typedef struct __recovery_pipeline {
+    nfs41_session *session;
+    bool_t delegations; /* |items| are delegations, not opens */
+    void **items;
+    LONG count;
+    volatile LONG next;
+    volatile LONG grace;
+    volatile LONG want_supported;
+    volatile LONG badsession;
+} recovery_pipeline;
+
+static unsigned int WINAPI recovery_pipeline_thread(void *args)
+{
+    recovery_pipeline *pipeline = (recovery_pipeline *)args;
+    bool_t grace, want_supported;
+    LONG i;
+    int status;
+
+    /* grab the next item until all are done */
+    while ((i = InterlockedIncrement(&pipeline->next) - 1) <
+        pipeline->count) {
+        if (pipeline->badsession)
+            break;
+
+        grace = (bool_t)pipeline->grace;
+        if (pipeline->delegations) {
+            want_supported = (bool_t)pipeline->want_supported;
+            status = recover_delegation(pipeline->session,
+                (nfs41_delegation_state *)pipeline->items[i],
+                &grace, &want_supported);
+            if (!want_supported)
+                (void)InterlockedExchange(&pipeline->want_supported, FALSE);
+        } else {
+            nfs41_open_state *open = (nfs41_open_state *)pipeline->items[i];
+
+            status = recover_open(pipeline->session, open, &grace);
+            if (status == NFS4_OK)
+                status = recover_locks(pipeline->session, open, &grace);
+        }
+
+        /* |recover_open()| & co. already sent RECLAIM_COMPLETE */
+        if (!grace)
+            (void)InterlockedExchange(&pipeline->grace, FALSE);
+        if (status == NFS4ERR_BADSESSION)
+            (void)InterlockedExchange(&pipeline->badsession, TRUE);
+    }
+    return 0;
+}
+
+static void recovery_pipeline_run(
+    IN recovery_pipeline *pipeline)
+{
+    HANDLE threads[RECOVERY_MAX_THREADS-1];
+    uint32_t i, depth, num_threads = 0;
+
+    depth = min(RECOVERY_MAX_THREADS, (uint32_t)pipeline->count);
+    depth = min(depth, pipeline->session->table.max_slots);
+
+    for (i = 0; (i + 1) < depth; i++) {
+        threads[num_threads] = (HANDLE)_beginthreadex(NULL,
+            NFSD_THREAD_STACK_SIZE, recovery_pipeline_thread, pipeline,
+            0, NULL);
+        if (threads[num_threads] == NULL) {
+            eprintf("recovery_pipeline_run: "
+                "_beginthreadex() failed with %d\n", (int)GetLastError());
+            break;
+        }
+        num_threads++;
+    }
+
+    (void)recovery_pipeline_thread(pipeline);
+
+    if (num_threads) {
+        (void)WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+        for (i = 0; i < num_threads; i++)
+            (void)CloseHandle(threads[i]);
+    }
+}
+
+/*
+ * Snapshot the client's opens with a reference each, opens with
+ * upcalls in flight (which hold a reference of their own) first, so
+ * that the applications waiting for them can continue early.
+ * Expects |client->state.lock| held.
+ */
+static void **recovery_snapshot_opens(
+    IN struct client_state *state,
+    OUT LONG *count_out)
+{
+    struct list_entry *entry;
+    nfs41_open_state *open;
+    void **items;
+    LONG count = 0, head, tail;
+
+    list_for_each(entry, &state->opens)
+        count++;
+
+    *count_out = count;
+    if (count == 0)
+        return NULL;
+
+    items = malloc(count * sizeof(void *));
+    if (items == NULL)
+        return NULL;
+
+    head = 0;
+    tail = count;
+    list_for_each(entry, &state->opens) {
+        open = list_container(entry, nfs41_open_state, client_entry);
+        nfs41_open_state_ref(open);
+        if (open->ref_count > 2)
+            items[head++] = open;
+        else
+            items[--tail] = open;
+    }
+    return items;
+}
+
+/*
+ * Snapshot the delegations which were not reclaimed together with an
+ * open. Expects |client->state.lock| held.
+ */
+static void **recovery_snapshot_delegations(
+    IN struct client_state *state,
+    OUT LONG *count_out)
+{
+    struct list_entry *entry;
+    nfs41_delegation_state *deleg;
+    void **items;
+    LONG count = 0;
+
+    list_for_each(entry, &state->delegations) {
+        deleg = list_container(entry, nfs41_delegation_state, client_entry);
+        if (deleg->revoked)
+            count++;
+    }
+
+    *count_out = count;
+    if (count == 0)
+        return NULL;
+
+    items = malloc(count * sizeof(void *));
+    if (items == NULL)
+        return NULL;
+
+    count = 0;
+    list_for_each(entry, &state->delegations) {
+        deleg = list_container(entry, nfs41_delegation_state, client_entry);
+        if (deleg->revoked) {
+            nfs41_delegation_ref(deleg);
+            items[count++] = deleg;
+        }
+    }
+    return items;
+}
+
 int nfs41_recover_client_state(
     IN nfs41_session *session,
     IN nfs41_client *client)
@@ -497,10 +681,16 @@ int nfs41_recover_client_state(
     struct list_entry *entry;
     nfs41_open_state *open;
     nfs41_delegation_state *deleg;
+    recovery_pipeline pipeline = { 0 };
     bool_t grace = TRUE;
     bool_t want_supported = TRUE;
+    LONG i;
     int status = NFS4_OK;
 
+    pipeline.session = session;
+    pipeline.grace = TRUE;
+    pipeline.want_supported = TRUE;
+
     EnterCriticalSection(&state->lock);
 
     /* flag all delegations as revoked until successful recovery;
@@ -512,23 +702,58 @@ int nfs41_recover_client_state(
     }
 
     /* recover each of the client's opens and associated delegations */
-    list_for_each(entry, &state->opens) {
-        open = list_container(entry, nfs41_open_state, client_entry);
-        status = recover_open(session, open, &grace);
-        if (status == NFS4_OK)
-            status = recover_locks(session, open, &grace);
-        if (status == NFS4ERR_BADSESSION)
+    pipeline.items = recovery_snapshot_opens(state, &pipeline.count);
+    if (pipeline.items) {
+        LeaveCriticalSection(&state->lock);
+        recovery_pipeline_run(&pipeline);
+        for (i = 0; i < pipeline.count; i++)
+            nfs41_open_state_deref((nfs41_open_state *)pipeline.items[i]);
+        free(pipeline.items);
+        grace = (bool_t)pipeline.grace;
+        EnterCriticalSection(&state->lock);
+        if (pipeline.badsession) {
+            status = NFS4ERR_BADSESSION;
             goto unlock;
+        }
+    } else {
+        /* out of memory, recover one by one with the lock held */
+        list_for_each(entry, &state->opens) {
+            open = list_container(entry, nfs41_open_state, client_entry);
+            status = recover_open(session, open, &grace);
+            if (status == NFS4_OK)
+                status = recover_locks(session, open, &grace);
+            if (status == NFS4ERR_BADSESSION)
+                goto unlock;
+        }
     }
 
     /* recover delegations that weren't associated with any opens */
-    list_for_each(entry, &state->delegations) {
-        deleg = list_container(entry, nfs41_delegation_state, client_entry);
-        if (deleg->revoked) {
-            status = recover_delegation(session,
-                deleg, &grace, &want_supported);
-            if (status == NFS4ERR_BADSESSION)
-                goto unlock;
+    pipeline.delegations = TRUE;
+    pipeline.next = 0;
+    pipeline.grace = grace;
+    pipeline.items = recovery_snapshot_delegations(state, &pipeline.count);
+    if (pipeline.items) {
+        LeaveCriticalSection(&state->lock);
+        recovery_pipeline_run(&pipeline);
+        for (i = 0; i < pipeline.count; i++)
+            nfs41_delegation_deref(
+                (nfs41_delegation_state *)pipeline.items[i]);
+        free(pipeline.items);
+        grace = (bool_t)pipeline.grace;
+        EnterCriticalSection(&state->lock);
+        if (pipeline.badsession) {
+            status = NFS4ERR_BADSESSION;
+            goto unlock;
+        }
+    } else {
+        list_for_each(entry, &state->delegations) {
+            deleg = list_container(entry, nfs41_delegation_state, client_entry);
+            if (deleg->revoked) {
+                status = recover_delegation(session,
+                    deleg, &grace, &want_supported);
+                if (status == NFS4ERR_BADSESSION)
+                    goto unlock;
+            }
         }
     }
 
@@ -69,109 +69,109 @@ out:
     return status;
 }
 
-static int handle_nfs41_setattr_basicinfo(void *daemon_context, setattr_upcall_args *args)
+/*
+ * Translate |basic_info| into the attributes to SETATTR, and break
+ * read delegations if needed. |info->attrmask| is empty if there is
+ * nothing to set
+ */
+int nfs41_basicinfo_to_setattr(
+    IN nfs41_open_state *state,
+    IN const struct _FILE_BASIC_INFORMATION *basic_info,
+    OUT nfs41_file_info *info)
 {
-    PFILE_BASIC_INFORMATION basic_info = (PFILE_BASIC_INFORMATION)args->buf;
-    nfs41_open_state *state = args->state;
     nfs41_superblock *superblock = state->file.fh.superblock;
-    stateid_arg stateid;
-    nfs41_file_info info, old_info;
+    const char *path = state->path.path;
+    nfs41_file_info old_info;
     int status = NO_ERROR;
     int getattr_status;
 
-    (void)memset(&info, 0, sizeof(info));
+    (void)memset(info, 0, sizeof(*info));
     (void)memset(&old_info, 0, sizeof(old_info));
 
-    if (basic_info == NULL) {
-        eprintf("handle_nfs41_setattr_basicinfo: basic_info==NULL\n");
-        status = ERROR_INVALID_PARAMETER;
-        goto out;
-    }
-
     getattr_status = nfs41_cached_getattr(state->session,
         &state->file, NULL, &old_info);
     if (getattr_status) {
-        DPRINTF(0, ("handle_nfs41_setattr_basicinfo(args->path='%s'): "
+        DPRINTF(0, ("nfs41_basicinfo_to_setattr(path='%s'): "
             "nfs41_cached_getattr() failed with error %d.\n",
-            args->path, getattr_status));
+            path, getattr_status));
         status = getattr_status;
         goto out;
     }
 
     if (basic_info->FileAttributes) {
-        info.hidden = basic_info->FileAttributes & FILE_ATTRIBUTE_HIDDEN ? 1 : 0;
-        info.system = basic_info->FileAttributes & FILE_ATTRIBUTE_SYSTEM ? 1 : 0;
-        info.archive = basic_info->FileAttributes & FILE_ATTRIBUTE_ARCHIVE ? 1 : 0;
+        info->hidden = basic_info->FileAttributes & FILE_ATTRIBUTE_HIDDEN ? 1 : 0;
+        info->system = basic_info->FileAttributes & FILE_ATTRIBUTE_SYSTEM ? 1 : 0;
+        info->archive = basic_info->FileAttributes & FILE_ATTRIBUTE_ARCHIVE ? 1 : 0;
 
-        if (info.hidden != old_info.hidden) {
-            info.attrmask.arr[0] |= FATTR4_WORD0_HIDDEN;
-            info.attrmask.count = __max(info.attrmask.count, 1);
+        if (info->hidden != old_info.hidden) {
+            info->attrmask.arr[0] |= FATTR4_WORD0_HIDDEN;
+            info->attrmask.count = __max(info->attrmask.count, 1);
         }
-        if (info.archive != old_info.archive) {
-            info.attrmask.arr[0] |= FATTR4_WORD0_ARCHIVE;
-            info.attrmask.count = __max(info.attrmask.count, 1);
+        if (info->archive != old_info.archive) {
+            info->attrmask.arr[0] |= FATTR4_WORD0_ARCHIVE;
+            info->attrmask.count = __max(info->attrmask.count, 1);
         }
-        if (info.system != old_info.system) {
-            info.attrmask.arr[1] |= FATTR4_WORD1_SYSTEM;
-            info.attrmask.count = __max(info.attrmask.count, 2);
+        if (info->system != old_info.system) {
+            info->attrmask.arr[1] |= FATTR4_WORD1_SYSTEM;
+            info->attrmask.count = __max(info->attrmask.count, 2);
         }
 
         EASSERT_MSG(((basic_info->FileAttributes & FILE_ATTRIBUTE_EA) == 0),
-            ("handle_nfs41_setattr_basicinfo(args->path='%s)': "
+            ("nfs41_basicinfo_to_setattr(path='%s)': "
             "Unsupported flag FILE_ATTRIBUTE_EA ignored.\n",
-            args->path));
+            path));
         EASSERT_MSG(((basic_info->FileAttributes & FILE_ATTRIBUTE_COMPRESSED) == 0),
-            ("handle_nfs41_setattr_basicinfo(args->path='%s)': "
+            ("nfs41_basicinfo_to_setattr(path='%s)': "
             "Unsupported flag FILE_ATTRIBUTE_COMPRESSED ignored.\n",
-            args->path));
+            path));
     }
 
     /* mode */
     if (basic_info->FileAttributes & FILE_ATTRIBUTE_READONLY) {
-        info.mode = 0444;
-        info.attrmask.arr[1] |= FATTR4_WORD1_MODE;
-        info.attrmask.count = __max(info.attrmask.count, 2);
+        info->mode = 0444;
+        info->attrmask.arr[1] |= FATTR4_WORD1_MODE;
+        info->attrmask.count = __max(info->attrmask.count, 2);
     }
     else {
         if (old_info.mode == 0444) {
-            info.mode = 0644;
-            info.attrmask.arr[1] |= FATTR4_WORD1_MODE;
-            info.attrmask.count = __max(info.attrmask.count, 2);
+            info->mode = 0644;
+            info->attrmask.arr[1] |= FATTR4_WORD1_MODE;
+            info->attrmask.count = __max(info->attrmask.count, 2);
         }
     }
 
     if (superblock->cansettime) {
         /* set the time_delta so xdr_settime4() can decide
          * whether or not to use SET_TO_SERVER_TIME4 */
-        info.time_delta = &superblock->time_delta;
+        info->time_delta = &superblock->time_delta;
 
         /* time_create */
         if (basic_info->CreationTime.QuadPart > 0) {
             file_time_to_nfs_time(&basic_info->CreationTime,
-                &info.time_create);
-            info.attrmask.arr[1] |= FATTR4_WORD1_TIME_CREATE;
-            info.attrmask.count = __max(info.attrmask.count, 2);
+                &info->time_create);
+            info->attrmask.arr[1] |= FATTR4_WORD1_TIME_CREATE;
+            info->attrmask.count = __max(info->attrmask.count, 2);
         }
         /* time_access_set */
         if (basic_info->LastAccessTime.QuadPart > 0) {
             file_time_to_nfs_time(&basic_info->LastAccessTime,
-                &info.time_access);
-            info.attrmask.arr[1] |= FATTR4_WORD1_TIME_ACCESS_SET;
-            info.attrmask.count = __max(info.attrmask.count, 2);
+                &info->time_access);
+            info->attrmask.arr[1] |= FATTR4_WORD1_TIME_ACCESS_SET;
+            info->attrmask.count = __max(info->attrmask.count, 2);
         }
         /* time_modify_set */
         if (basic_info->LastWriteTime.QuadPart > 0) {
             file_time_to_nfs_time(&basic_info->LastWriteTime,
-                &info.time_modify);
-            info.attrmask.arr[1] |= FATTR4_WORD1_TIME_MODIFY_SET;
-            info.attrmask.count = __max(info.attrmask.count, 2);
+                &info->time_modify);
+            info->attrmask.arr[1] |= FATTR4_WORD1_TIME_MODIFY_SET;
+            info->attrmask.count = __max(info->attrmask.count, 2);
         }
     }
 
     /* mask out unsupported attributes */
-    nfs41_superblock_supported_attrs(superblock, &info.attrmask);
+    nfs41_superblock_supported_attrs(superblock, &info->attrmask);
 
-    if (info.attrmask.count == 0)
+    if (info->attrmask.count == 0)
         goto out;
 
     /*
@@ -187,16 +187,46 @@ static int handle_nfs41_setattr_basicinfo(void *daemon_context, setattr_upcall_a
      * 3. The NFSv4 RFCs really should have a list of attributes which
      * would trigger a recall for read or write delegations
      */
-    if (bitmap_isset(&info.attrmask, 1, FATTR4_WORD1_MODE) ||
-        bitmap_isset(&info.attrmask, 1, FATTR4_WORD1_TIME_CREATE)) {
-        DPRINTF(0, ("handle_nfs41_setattr_basicinfo(args->path='%s'): "
+    if (bitmap_isset(&info->attrmask, 1, FATTR4_WORD1_MODE) ||
+        bitmap_isset(&info->attrmask, 1, FATTR4_WORD1_TIME_CREATE)) {
+        DPRINTF(0, ("nfs41_basicinfo_to_setattr(path='%s'): "
             "returning read delegation because of mode=%d, time_create=%d\n",
-            args->path,
-            (int)bitmap_isset(&info.attrmask, 1, FATTR4_WORD1_MODE),
-            (int)bitmap_isset(&info.attrmask, 1, FATTR4_WORD1_TIME_CREATE)));
+            path,
+            (int)bitmap_isset(&info->attrmask, 1, FATTR4_WORD1_MODE),
+            (int)bitmap_isset(&info->attrmask, 1, FATTR4_WORD1_TIME_CREATE)));
         nfs41_delegation_return(state->session, &state->file,
             OPEN_DELEGATE_READ, FALSE);
     }
+
+out:
+    return status;
+}
+
+static int handle_nfs41_setattr_basicinfo(void *daemon_context, setattr_upcall_args *args)
+{
+    PFILE_BASIC_INFORMATION basic_info = (PFILE_BASIC_INFORMATION)args->buf;
+    nfs41_open_state *state = args->state;
+    stateid_arg stateid;
+    nfs41_file_info info;
+    int status = NO_ERROR;
+
+    if (basic_info == NULL) {
+        eprintf("handle_nfs41_setattr_basicinfo: basic_info==NULL\n");
+        status = ERROR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    status = nfs41_basicinfo_to_setattr(state, basic_info, &info);
+    if (status || (info.attrmask.count == 0))
+        goto out;
+
+#ifdef NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS
+    /* we own the timestamps until the delegation goes back */
+    if (nfs41_delegation_set_times(state, &info)) {
+        args->ctime = info.change;
+        goto out;
+    }
+#endif /* NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS */
 
     nfs41_open_stateid_arg(state, &stateid);
 
@@ -238,6 +268,10 @@ static void open_state_rename(
     OUT nfs41_open_state *state,
     IN const nfs41_abs_path *path)
 {
+    nfs41_client *client = state->session->client;
+
+    /* |client->state.lock| protects |state->path_entry| */
+    EnterCriticalSection(&client->state.lock);
     AcquireSRWLockExclusive(&state->path.lock);
 
     abs_path_copy(&state->path, path);
@@ -246,14 +280,23 @@ static void open_state_rename(
     last_component(state->path.path, state->file.name.name,
         &state->parent.name);
 
+    /* rehash, unless |state| is not in |client->state.opens| */
+    if (!list_empty(&state->path_entry)) {
+        list_remove(&state->path_entry);
+        list_add_tail(client_state_bucket(client->state.open_path_hash,
+            client_state_path_hash(state->path.path, state->path.len)),
+            &state->path_entry);
+    }
+
     ReleaseSRWLockExclusive(&state->path.lock);
+    LeaveCriticalSection(&client->state.lock);
 }
 
 static int nfs41_abs_path_compare(
     IN const struct list_entry *entry,
     IN const void *value)
 {
-    nfs41_open_state *client = list_container(entry, nfs41_open_state, client_entry);
+    nfs41_open_state *client = list_container(entry, nfs41_open_state, path_entry);
     const nfs41_abs_path *name = (const nfs41_abs_path *)value;
     if (client->path.len == name->len && 
             !strncmp(client->path.path, name->path, client->path.len))
@@ -267,7 +310,9 @@ static int is_dst_name_opened(nfs41_abs_path *dst_path, nfs41_session *dst_sessi
     nfs41_client *client = dst_session->client;
 
     EnterCriticalSection(&client->state.lock);
-    if (list_search(&client->state.opens, dst_path, nfs41_abs_path_compare))
+    if (list_search(client_state_bucket(client->state.open_path_hash,
+            client_state_path_hash(dst_path->path, dst_path->len)),
+            dst_path, nfs41_abs_path_compare))
         status = TRUE;
     else
         status = FALSE;
@@ -351,13 +396,36 @@ static int handle_nfs41_rename(void *daemon_context, setattr_upcall_args *args)
         path_fh_init(&dst_dir, &dst_path);
         fh_copy(&dst_dir.fh, &state->parent.fh);
 
+        /* break any delegations and truncate before silly rename */
+        nfs41_delegation_return(state->session, &state->file,
+            OPEN_DELEGATE_WRITE, TRUE);
+
+        if (state->file.fh.superblock->preserve_unlinked) {
+            /*
+             * The server keeps the file alive for the opens, so
+             * remove it right away. |handle_close()| skips the
+             * REMOVE of the silly name for these superblocks
+             */
+            DPRINTF(1, ("silly rename: removing '%s' "
+                "(OPEN4_RESULT_PRESERVE_UNLINKED)\n", src_name->name));
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_CLOSE
+            /* parked opens would keep the file alive on the server */
+            nfs41_deferred_close_flush_file(state->session->client,
+                &state->file.fh);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_CLOSE */
+            status = nfs41_remove(state->session, &state->parent,
+                src_name, state->file.fh.fileid);
+            if (status) {
+                DPRINTF(1, ("nfs41_remove() failed with error '%s'.\n",
+                    nfs_error_string(status)));
+                status = nfs_to_windows_error(status, ERROR_ACCESS_DENIED);
+            }
+            goto out;
+        }
+
         create_silly_rename(&dst_path, &state->file.fh, &dst_name);
         DPRINTF(1, ("silly rename: '%s' -> '%s'\n",
             src_name->name, dst_name.name));
-
-        /* break any delegations and truncate before silly rename */
-        nfs41_delegation_return(state->session, &state->file,
-            OPEN_DELEGATE_WRITE, TRUE);
 
         status = nfs41_rename(state->session,
             &state->parent, src_name,
@@ -552,6 +620,51 @@ static int handle_nfs41_set_size(void *daemon_context, setattr_upcall_args *args
             FILE_INFORMATION_CLASS2string(args->set_class),
             (long long)size->QuadPart));
 
+#ifdef NFS41_DRIVER_DAEMON_WRITE_SAME
+    /*
+     * Preallocation: ALLOCATE the blocks of the file up to the new
+     * allocation size, so later writes into holes cannot run out of
+     * space. ALLOCATE beyond EOF would grow the file, so the range
+     * is clamped to the file size. This is only a hint, errors are
+     * ignored
+     */
+    if ((args->set_class == FileAllocationInformation) &&
+        (size->QuadPart > 0LL) &&
+        state->session->client->root->supports_nfs42_allocate) {
+        bitmap4 size_bitmap = {
+            .count = 1,
+            .arr[0] = FATTR4_WORD0_SIZE|FATTR4_WORD0_CHANGE,
+        };
+        uint64_t alloc_end;
+
+        status = nfs41_cached_getattr(state->session, &state->file,
+            &size_bitmap, &info);
+        if (status)
+            goto out;
+
+        alloc_end = min(info.size, (uint64_t)size->QuadPart);
+        if (alloc_end > 0ULL) {
+            nfs41_open_stateid_arg(state, &stateid);
+            (void)memset(&info, 0, sizeof(info));
+            status = nfs42_allocate(state->session, &state->file,
+                &stateid, 0ULL, alloc_end, &info);
+            if (status == NFS4_OK) {
+                EASSERT(bitmap_isset(&info.attrmask, 0,
+                    FATTR4_WORD0_CHANGE));
+                args->ctime = info.change;
+                goto out;
+            }
+            DPRINTF(1, ("handle_nfs41_set_size: "
+                "ALLOCATE(length=%llu) failed with '%s'\n",
+                (unsigned long long)alloc_end,
+                nfs_error_string(status)));
+            if (status == NFS4ERR_NOTSUPP)
+                state->session->client->root->supports_nfs42_allocate =
+                    false;
+        }
+    }
+#endif /* NFS41_DRIVER_DAEMON_WRITE_SAME */
+
     /*
      * We cannot set the allocation size, the NFS server handles this
      * automagically
@@ -722,6 +835,13 @@ static int handle_setattr(void *daemon_context, nfs41_upcall *upcall)
         break;
     case FileAllocationInformation:
     case FileEndOfFileInformation:
+#ifdef NFS41_DRIVER_DAEMON_READAHEAD
+        nfs41_readahead_invalidate(args->state);
+#endif /* NFS41_DRIVER_DAEMON_READAHEAD */
+#ifdef NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT
+        /* a later LAYOUTCOMMIT must not extend a truncated file again */
+        (void)pnfs_layout_commit_open_state(args->state);
+#endif /* NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT */
         status = handle_nfs41_set_size(daemon_context, args);
         break;
     case FileLinkInformation:
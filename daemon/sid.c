@@ -22,7 +22,9 @@
  */
 
 #include <Windows.h>
+#include <process.h>
 #include <stdio.h>
+#include <malloc.h> /* for |_aligned_malloc()| */
 #include <stdbool.h>
 #include <time.h>
 #include <strsafe.h>
@@ -36,8 +38,11 @@
 #include "util.h"
 #include "upcall.h"
 #include "nfs41_xdr.h"
+#include "mempressure.h"
 #include "idmap.h"
 #include "sid.h"
+#include "list.h"
+#include "idcachefile.h"
 
 #define ACLLVL 2 /* dprintf level for acl logging */
 
@@ -221,210 +226,522 @@ bool unixgroup_sid2gid(PSID psid, gid_t *pgid)
 
 #ifdef NFS41_DRIVER_SID_CACHE
 /*
- * |SIDCACHE_SIZE| - size of SID cache
+ * SID cache
+ *
+ * Entries are hashed by |win32name|, |aliasname| and SID, so all
+ * lookups only walk one hash chain. The hash tables grow with the
+ * number of entries, up to |SIDCACHE_MAX_ENTRIES| entries, after which
+ * the least recently used entries are evicted.
+ *
+ * Lookups only take the lock shared; instead of moving an entry to the
+ * head of the LRU list they only set |entry->referenced|, and eviction
+ * gives referenced entries a second chance (CLOCK approximation of
+ * LRU), so concurrent lookups never block each other.
+ */
+
+/*
+ * |SIDCACHE_MAX_ENTRIES| - maximum number of entries per SID cache
  * We should at least use the maximum size of ACL entries plus { owner,
  * owner_group, other, nobody, world, ... } entries multiplied by two to
  * make sure two concurrent icacls queries cannot trash the whole cache
  */
-#define SIDCACHE_SIZE 384
+#define SIDCACHE_MAX_ENTRIES 8192
 #define SIDCACHE_TTL 600
+/* initial number of hash buckets, must be a power of two */
+#define SIDCACHE_MIN_BUCKETS 64
+/* grow the hash tables if there are more entries than this per bucket */
+#define SIDCACHE_MAX_LOAD 2
+/* lower bound for |sidcache_max_entries()| */
+#define SIDCACHE_MIN_ENTRIES ((NFS41_ACL_MAX_ACE_ENTRIES+8)*2)
 
 /* Safety/performance checks */
-#if SIDCACHE_SIZE < ((NFS41_ACL_MAX_ACE_ENTRIES+8)*2)
-#error SIDCACHE_SIZE should be at least ((NFS41_ACL_MAX_ACE_ENTRIES+8)*2)
+#if SIDCACHE_MAX_ENTRIES < ((NFS41_ACL_MAX_ACE_ENTRIES+8)*2)
+#error SIDCACHE_MAX_ENTRIES should be at least ((NFS41_ACL_MAX_ACE_ENTRIES+8)*2)
 #endif
 
 typedef struct _sidcache_entry
 {
-#define SIDCACHE_ENTRY_NAME_SIZE (UTF8_UNLEN + 1)
-    char    win32name[SIDCACHE_ENTRY_NAME_SIZE]; /* must fit something like "user@domain" */
-    char    aliasname[SIDCACHE_ENTRY_NAME_SIZE];
-    PSID    sid;
-    DWORD   sid_len;
 #pragma warning( push )
 #pragma warning (disable : 4324)
     DECLARE_SID_BUFFER(sid_buffer);
 #pragma warning( pop )
-    util_reltimestamp  timestamp;
+    struct list_entry   lru; /* |sidcache.lru|, most recently added first */
+    struct list_entry   name_link; /* hashed by |win32name| */
+    struct list_entry   alias_link; /* hashed by |aliasname| */
+    struct list_entry   sid_link; /* hashed by SID */
+    uint32_t            name_hash;
+    uint32_t            alias_hash;
+    uint32_t            sid_hash;
+    volatile LONG       referenced;
+    PSID                sid;
+    DWORD               sid_len;
+    util_reltimestamp   timestamp;
+#define SIDCACHE_ENTRY_NAME_SIZE (UTF8_UNLEN + 1)
+    char    win32name[SIDCACHE_ENTRY_NAME_SIZE]; /* must fit something like "user@domain" */
+    char    aliasname[SIDCACHE_ENTRY_NAME_SIZE];
 } sidcache_entry;
 
 typedef struct _sidcache
 {
-    CRITICAL_SECTION    lock;
-    sidcache_entry      entries[SIDCACHE_SIZE];
-    ssize_t             cacheIndex;
+    SRWLOCK             lock;
+    struct list_entry   lru;
+    /* hash tables with |num_buckets| buckets each */
+    struct list_entry   *byname;
+    struct list_entry   *byalias;
+    struct list_entry   *bysid;
+    uint32_t            num_buckets;
+    uint32_t            count;
 } sidcache;
 
-/* fixme: need function to deallocate this */
 sidcache user_sidcache = { 0 };
 sidcache group_sidcache = { 0 };
 
 
-void sidcache_init(void)
+static uint32_t sidcache_hash_bytes(const void *buf, size_t len)
 {
-    InitializeCriticalSection(&user_sidcache.lock);
-    InitializeCriticalSection(&group_sidcache.lock);
+    const unsigned char *s = (const unsigned char *)buf;
+    uint32_t hash = 2166136261UL; /* FNV-1a */
+
+    while (len--)
+        hash = (hash ^ *s++) * 16777619UL;
+    return hash;
 }
 
-void sidcache_add(sidcache *cache, const char* win32name, PSID value)
+static __inline uint32_t sidcache_hash_name(const char *name)
 {
-    sidcache_addwithalias(cache, win32name, NULL, value);
+    return sidcache_hash_bytes(name, strlen(name));
 }
 
-/* copy SID |value| into cache */
-void sidcache_addwithalias(sidcache *cache, const char *win32name, const char *aliasname, PSID value)
+static __inline uint32_t sidcache_hash_sid(PSID sid)
 {
-    int i;
-    ssize_t freeEntryIndex;
-    util_reltimestamp currentTimestamp;
+    return sidcache_hash_bytes(sid, GetLengthSid(sid));
+}
 
-    EASSERT(win32name[0] != '\0');
+static __inline struct list_entry *sidcache_bucket(
+    struct list_entry *table,
+    const sidcache *cache,
+    uint32_t hash)
+{
+    return &table[hash & (cache->num_buckets - 1)];
+}
 
-    EnterCriticalSection(&cache->lock);
-    currentTimestamp = UTIL_GETRELTIME();
+static __inline bool sidcache_entry_valid(
+    const sidcache_entry *e,
+    util_reltimestamp currentTimestamp)
+{
+    return (currentTimestamp - e->timestamp) < SIDCACHE_TTL;
+}
 
-    /* purge obsolete entries */
-    for (i = 0; i < SIDCACHE_SIZE; i++) {
-        sidcache_entry *e = &cache->entries[i];
+static struct list_entry *sidcache_alloc_table(uint32_t num_buckets)
+{
+    struct list_entry *table;
+    uint32_t i;
+
+    table = malloc(num_buckets * sizeof(struct list_entry));
+    if (table == NULL)
+        return NULL;
+    for (i = 0; i < num_buckets; i++)
+        list_init(&table[i]);
+    return table;
+}
 
-        if ((e->sid != NULL) &&
-            ((currentTimestamp - e->timestamp) >= SIDCACHE_TTL)) {
-            e->sid = NULL;
-            e->win32name[0] = '\0';
-            e->aliasname[0] = '\0';
-            e->sid_len = 0;
-        }
+/* expects the caller to hold the exclusive lock */
+static void sidcache_link(sidcache *cache, sidcache_entry *e)
+{
+    list_add_head(sidcache_bucket(cache->byname, cache, e->name_hash),
+        &e->name_link);
+    if (e->aliasname[0] != '\0') {
+        list_add_head(sidcache_bucket(cache->byalias, cache, e->alias_hash),
+            &e->alias_link);
     }
+    list_add_head(sidcache_bucket(cache->bysid, cache, e->sid_hash),
+        &e->sid_link);
+}
 
-    /* Find the oldest valid cache entry */
-    freeEntryIndex = -1;
-    for (i = 0; i < SIDCACHE_SIZE; i++) {
-        sidcache_entry *e = &cache->entries[i];
-        if (e->sid) {
-            /* Same name ? Then reuse this slot... */
-            if (!strcmp(e->win32name, win32name)) {
-                freeEntryIndex = i;
-                break;
-            }
-            if (aliasname) {
-                if (!strcmp(e->win32name, aliasname)) {
-                    freeEntryIndex = i;
-                    break;
-                }
-                if ((e->aliasname[0] != '\0') &&
-                    (!strcmp(e->aliasname, aliasname))) {
-                    freeEntryIndex = i;
-                    break;
-                }
-            }
-            if ((e->aliasname[0] != '\0') &&
-                (!strcmp(e->aliasname, win32name))) {
-                freeEntryIndex = i;
-                break;
-            }
-        }
-        else {
-            /* (cache->entries[i].sid == NULL) --> empty slot... */
-            freeEntryIndex = i;
-            break;
+/* expects the caller to hold the exclusive lock */
+static void sidcache_remove(sidcache *cache, sidcache_entry *e)
+{
+    list_remove(&e->name_link);
+    list_remove(&e->alias_link);
+    list_remove(&e->sid_link);
+    list_remove(&e->lru);
+    cache->count--;
+    _aligned_free(e);
+}
+
+/*
+ * Double the number of hash buckets. If the allocation fails we keep
+ * the old tables, which only makes the chains longer
+ * Expects the caller to hold the exclusive lock
+ */
+static void sidcache_grow(sidcache *cache)
+{
+    struct list_entry *byname, *byalias, *bysid;
+    struct list_entry *le;
+    uint32_t num_buckets = cache->num_buckets * 2;
+
+    byname = sidcache_alloc_table(num_buckets);
+    byalias = sidcache_alloc_table(num_buckets);
+    bysid = sidcache_alloc_table(num_buckets);
+    if ((byname == NULL) || (byalias == NULL) || (bysid == NULL)) {
+        free(byname);
+        free(byalias);
+        free(bysid);
+        return;
+    }
+
+    free(cache->byname);
+    free(cache->byalias);
+    free(cache->bysid);
+    cache->byname = byname;
+    cache->byalias = byalias;
+    cache->bysid = bysid;
+    cache->num_buckets = num_buckets;
+
+    list_for_each(le, &cache->lru) {
+        sidcache_entry *e = list_container(le, sidcache_entry, lru);
+
+        list_init(&e->alias_link);
+        sidcache_link(cache, e);
+    }
+}
+
+/*
+ * Current limit of entries per SID cache, which is scaled with the
+ * system memory state
+ */
+static __inline uint32_t sidcache_max_entries(void)
+{
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+    return (uint32_t)nfs41_mempressure_limit(SIDCACHE_MAX_ENTRIES,
+        SIDCACHE_MIN_ENTRIES);
+#else
+    return SIDCACHE_MAX_ENTRIES;
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+}
+
+/*
+ * Evict entries until there are at most |max_entries| left, starting
+ * with the oldest. Expired entries are always evicted, entries which
+ * were used since the last pass get a second chance
+ * Expects the caller to hold the exclusive lock
+ */
+static void sidcache_evict(sidcache *cache,
+    util_reltimestamp currentTimestamp, uint32_t max_entries)
+{
+    while (cache->count > max_entries) {
+        sidcache_entry *e = list_container(cache->lru.prev,
+            sidcache_entry, lru);
+
+        if (sidcache_entry_valid(e, currentTimestamp) &&
+            InterlockedExchange(&e->referenced, 0)) {
+            list_remove(&e->lru);
+            list_add_head(&cache->lru, &e->lru);
+            continue;
         }
+        sidcache_remove(cache, e);
     }
+}
 
-    /* If no valid entry was found, overwrite the oldest entry */
-    if (freeEntryIndex == -1) {
-        freeEntryIndex = cache->cacheIndex;
+/* remove all entries which have |name| as |win32name| or |aliasname| */
+static void sidcache_remove_byname(sidcache *cache, const char *name)
+{
+    struct list_entry *le, *tmp;
+    uint32_t hash = sidcache_hash_name(name);
+
+    list_for_each_tmp(le, tmp, sidcache_bucket(cache->byname, cache, hash)) {
+        sidcache_entry *e = list_container(le, sidcache_entry, name_link);
+        if ((e->name_hash == hash) && (!strcmp(e->win32name, name)))
+            sidcache_remove(cache, e);
+    }
+    list_for_each_tmp(le, tmp, sidcache_bucket(cache->byalias, cache, hash)) {
+        sidcache_entry *e = list_container(le, sidcache_entry, alias_link);
+        if ((e->alias_hash == hash) && (!strcmp(e->aliasname, name)))
+            sidcache_remove(cache, e);
+    }
+}
+
+/* find a valid entry by |win32name| or |aliasname| */
+static sidcache_entry *sidcache_find_byname(sidcache *cache,
+    const char *name, util_reltimestamp currentTimestamp)
+{
+    struct list_entry *le;
+    uint32_t hash = sidcache_hash_name(name);
+
+    list_for_each(le, sidcache_bucket(cache->byname, cache, hash)) {
+        sidcache_entry *e = list_container(le, sidcache_entry, name_link);
+        if ((e->name_hash == hash) && (!strcmp(e->win32name, name)) &&
+            sidcache_entry_valid(e, currentTimestamp))
+            return e;
+    }
+    list_for_each(le, sidcache_bucket(cache->byalias, cache, hash)) {
+        sidcache_entry *e = list_container(le, sidcache_entry, alias_link);
+        if ((e->alias_hash == hash) && (!strcmp(e->aliasname, name)) &&
+            sidcache_entry_valid(e, currentTimestamp))
+            return e;
+    }
+    return NULL;
+}
+
+static void sidcache_init_cache(sidcache *cache)
+{
+    InitializeSRWLock(&cache->lock);
+    list_init(&cache->lru);
+    cache->num_buckets = SIDCACHE_MIN_BUCKETS;
+    cache->byname = sidcache_alloc_table(cache->num_buckets);
+    cache->byalias = sidcache_alloc_table(cache->num_buckets);
+    cache->bysid = sidcache_alloc_table(cache->num_buckets);
+    if ((cache->byname == NULL) || (cache->byalias == NULL) ||
+        (cache->bysid == NULL)) {
+        eprintf("sidcache_init: out of memory\n");
+        exit(1);
     }
+    cache->count = 0;
+}
+
+static void sidcache_free_cache(sidcache *cache)
+{
+    struct list_entry *le, *tmp;
+
+    AcquireSRWLockExclusive(&cache->lock);
+    list_for_each_tmp(le, tmp, &cache->lru) {
+        sidcache_remove(cache,
+            list_container(le, sidcache_entry, lru));
+    }
+    free(cache->byname);
+    free(cache->byalias);
+    free(cache->bysid);
+    cache->byname = cache->byalias = cache->bysid = NULL;
+    cache->num_buckets = 0;
+    ReleaseSRWLockExclusive(&cache->lock);
+}
+
+void sidcache_init(void)
+{
+    sidcache_init_cache(&user_sidcache);
+    sidcache_init_cache(&group_sidcache);
+}
+
+/*
+ * Free all SID cache entries on shutdown. Lookups after this always
+ * miss and |sidcache_add*()| become no-ops, so worker threads which
+ * are still running are safe
+ */
+void sidcache_free(void)
+{
+    sidcache_free_cache(&user_sidcache);
+    sidcache_free_cache(&group_sidcache);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+/* Shrink both SID caches to |sidcache_max_entries()| */
+void sidcache_trim(void)
+{
+    sidcache *caches[2] = { &user_sidcache, &group_sidcache };
+    const util_reltimestamp now = UTIL_GETRELTIME();
+    uint32_t i;
+
+    for (i = 0; i < 2; i++) {
+        AcquireSRWLockExclusive(&caches[i]->lock);
+        sidcache_evict(caches[i], now, sidcache_max_entries());
+        ReleaseSRWLockExclusive(&caches[i]->lock);
+    }
+}
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+
+void sidcache_add(sidcache *cache, const char* win32name, PSID value)
+{
+    sidcache_addwithalias(cache, win32name, NULL, value);
+}
 
-    /* Replace the cache entry */
-    sidcache_entry *e = &cache->entries[freeEntryIndex];
-    DWORD sid_len = GetLengthSid(value);
+/*
+ * copy SID |value| into cache, as if it had been added |age| seconds
+ * ago
+ */
+static void sidcache_insert(sidcache *cache, const char *win32name,
+    const char *aliasname, PSID value, util_reltimestamp age)
+{
+    sidcache_entry *e;
+    DWORD sid_len;
+
+    EASSERT(win32name[0] != '\0');
+
+    sid_len = GetLengthSid(value);
     EASSERT_MSG((sid_len <= SECURITY_MAX_SID_SIZE),
         ("sid_len=%ld\n", (long)sid_len));
+
+    /* |sid_buffer| must be 16byte aligned, see |DECLARE_SID_BUFFER| */
+    e = _aligned_malloc(sizeof(sidcache_entry), 16);
+    if (e == NULL)
+        return;
+
     e->sid = (PSID)e->sid_buffer;
     if (!CopySid(sid_len, e->sid, value)) {
-        e->sid = NULL;
-        e->win32name[0] = '\0';
-        e->aliasname[0] = '\0';
-        e->sid_len = 0;
-        goto done;
+        _aligned_free(e);
+        return;
     }
-
     e->sid_len = sid_len;
     (void)strcpy(e->win32name, win32name);
     if (aliasname)
         (void)strcpy(e->aliasname, aliasname);
     else
         e->aliasname[0] = '\0';
-    e->timestamp = currentTimestamp;
+    e->name_hash = sidcache_hash_name(e->win32name);
+    e->alias_hash = sidcache_hash_name(e->aliasname);
+    e->sid_hash = sidcache_hash_sid(e->sid);
+    e->referenced = 0;
+    list_init(&e->alias_link);
+
+    AcquireSRWLockExclusive(&cache->lock);
+    /* cache already freed by |sidcache_free()| ? */
+    if (cache->num_buckets == 0) {
+        ReleaseSRWLockExclusive(&cache->lock);
+        _aligned_free(e);
+        return;
+    }
+    /* wraps around for |age| > uptime, which |sidcache_entry_valid()| handles */
+    e->timestamp = UTIL_GETRELTIME() - age;
 
-    cache->cacheIndex = (cache->cacheIndex + 1) % SIDCACHE_SIZE;
+    /* Replace entries for the same names... */
+    sidcache_remove_byname(cache, win32name);
+    if (aliasname)
+        sidcache_remove_byname(cache, aliasname);
 
-done:
-    LeaveCriticalSection(&cache->lock);
+    /* make room for one more */
+    sidcache_evict(cache, e->timestamp, sidcache_max_entries() - 1);
+
+    if ((cache->count >= (cache->num_buckets * SIDCACHE_MAX_LOAD)) &&
+        (cache->num_buckets < (sidcache_max_entries() / SIDCACHE_MAX_LOAD)))
+        sidcache_grow(cache);
+
+    list_add_head(&cache->lru, &e->lru);
+    sidcache_link(cache, e);
+    cache->count++;
+
+    ReleaseSRWLockExclusive(&cache->lock);
+}
+
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+static __inline enum idcachefile_type sidcache_idcachefile_type(
+    const sidcache *cache)
+{
+    return (cache == &user_sidcache)?
+        IDCACHEFILE_SID_USER : IDCACHEFILE_SID_GROUP;
+}
+
+static void sidcache_idcachefile_store(sidcache *cache,
+    const char *win32name, const char *aliasname, PSID value)
+{
+    idcachefile_entry entry = { 0 };
+
+    if (!idcachefile_is_open())
+        return;
+    /* names which do not fit are only cached in memory */
+    if (FAILED(StringCchCopyA(entry.name, IDCACHEFILE_NAME_LEN,
+            win32name)) ||
+        (aliasname && FAILED(StringCchCopyA(entry.name2,
+            IDCACHEFILE_NAME_LEN, aliasname))))
+        return;
+    entry.type = sidcache_idcachefile_type(cache);
+    entry.sid_len = GetLengthSid(value);
+    if (!CopySid(sizeof(entry.sid), (PSID)entry.sid, value))
+        return;
+    idcachefile_store(&entry, SIDCACHE_TTL);
+}
+
+static void sidcache_idcachefile_load_entry(void *context,
+    const idcachefile_entry *entry, uint32_t remaining)
+{
+    sidcache *cache = (sidcache *)context;
+    DECLARE_SID_BUFFER(sid_buffer);
+
+    if (remaining > SIDCACHE_TTL)
+        remaining = SIDCACHE_TTL;
+    /* |sidcache_insert()| needs an aligned SID */
+    (void)memcpy(sid_buffer, entry->sid, entry->sid_len);
+    sidcache_insert(cache, entry->name,
+        (entry->name2[0] != '\0')?entry->name2:NULL,
+        (PSID)sid_buffer, SIDCACHE_TTL - remaining);
+}
+
+/* fill the SID caches from the idcachefile, see idcachefile.c */
+void sidcache_load_idcachefile(void)
+{
+    (void)idcachefile_load(IDCACHEFILE_SID_USER,
+        sidcache_idcachefile_load_entry, &user_sidcache);
+    (void)idcachefile_load(IDCACHEFILE_SID_GROUP,
+        sidcache_idcachefile_load_entry, &group_sidcache);
+}
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
+
+void sidcache_addwithalias(sidcache *cache, const char *win32name, const char *aliasname, PSID value)
+{
+    sidcache_insert(cache, win32name, aliasname, value, 0);
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+    sidcache_idcachefile_store(cache, win32name, aliasname, value);
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
 }
 
 /* return |malloc()|'ed copy of SID from cache entry */
 PSID *sidcache_getcached_byname(sidcache *cache, const char *win32name)
 {
-    int i;
-    util_reltimestamp currentTimestamp;
     sidcache_entry *e;
     PSID *ret_sid = NULL;
 
-    EnterCriticalSection(&cache->lock);
-    currentTimestamp = UTIL_GETRELTIME();
-
-    for (i = 0; i < SIDCACHE_SIZE; i++) {
-        e = &cache->entries[i];
-
-        if ((e->sid != NULL) &&
-            ((!strcmp(e->win32name, win32name)) ||
-                ((e->aliasname[0] != '\0') && (!strcmp(e->aliasname, win32name)))) &&
-            ((currentTimestamp - e->timestamp) < SIDCACHE_TTL)) {
-            PSID malloced_sid = malloc(e->sid_len);
-            if (!malloced_sid)
-                goto done;
+    AcquireSRWLockShared(&cache->lock);
+    if (cache->num_buckets == 0)
+        goto done;
 
-            if (!CopySid(e->sid_len, malloced_sid, e->sid)) {
-                free(malloced_sid);
-                goto done;
-            }
+    e = sidcache_find_byname(cache, win32name, UTIL_GETRELTIME());
+    if (e) {
+        PSID malloced_sid = malloc(e->sid_len);
+        if (!malloced_sid)
+            goto done;
 
-            ret_sid = malloced_sid;
+        if (!CopySid(e->sid_len, malloced_sid, e->sid)) {
+            free(malloced_sid);
             goto done;
         }
+
+        e->referenced = 1;
+        ret_sid = malloced_sid;
     }
 
 done:
-    LeaveCriticalSection(&cache->lock);
+    ReleaseSRWLockShared(&cache->lock);
     return ret_sid;
 }
 
 bool sidcache_getcached_bysid(sidcache *cache, PSID sid, char *out_win32name)
 {
-    int i;
+    struct list_entry *le;
     util_reltimestamp currentTimestamp;
-    sidcache_entry *e;
+    uint32_t hash;
     bool ret = false;
 
-    EnterCriticalSection(&cache->lock);
+    hash = sidcache_hash_sid(sid);
+
+    AcquireSRWLockShared(&cache->lock);
+    if (cache->num_buckets == 0)
+        goto done;
     currentTimestamp = UTIL_GETRELTIME();
 
-    for (i = 0; i < SIDCACHE_SIZE; i++) {
-        e = &cache->entries[i];
+    list_for_each(le, sidcache_bucket(cache->bysid, cache, hash)) {
+        sidcache_entry *e = list_container(le, sidcache_entry, sid_link);
 
-        if ((e->sid != NULL) &&
-            (EqualSid(sid, e->sid) &&
-            ((currentTimestamp - e->timestamp) < SIDCACHE_TTL))) {
+        if ((e->sid_hash == hash) &&
+            EqualSid(sid, e->sid) &&
+            sidcache_entry_valid(e, currentTimestamp)) {
             (void)strcpy(out_win32name, e->win32name);
 
+            e->referenced = 1;
             ret = true;
-            goto done;
+            break;
         }
     }
 
 done:
-    LeaveCriticalSection(&cache->lock);
+    ReleaseSRWLockShared(&cache->lock);
     return ret;
 }
 #endif /* NFS41_DRIVER_SID_CACHE */
@@ -756,6 +1073,178 @@ out_free_sid:
     goto out;
 }
 
+/*
+ * |map_nfs4servernames_2_sids()| - map the NFSv4 names of a whole ACL
+ * to SIDs
+ *
+ * Every ACE of an ACL used to be mapped with its own
+ * |map_nfs4servername_2_sid()| call, so a file with 50 ACEs meant
+ * 50 serial idmapper/LSA lookups on a cold SID cache.
+ * Here each distinct name is only mapped once (the SIDs of duplicates
+ * are copied), and the names which are not in the SID cache are
+ * passed to up to |SID_BATCH_MAX_THREADS| threads, so that the
+ * lookups run in parallel.
+ */
+#define SID_BATCH_MAX_THREADS 8
+
+typedef struct _sid_batch {
+    nfs41_daemon_globals *nfs41dg;
+    HANDLE tok; /* impersonation token of the caller, or |NULL| */
+    nfs4servername_sid_req **misses;
+    LONG num_misses;
+    volatile LONG next;
+} sid_batch;
+
+static bool sidcache_probe(nfs4servername_sid_req *req)
+{
+#if defined(NFS41_DRIVER_FEATURE_MAP_UNMAPPED_USER_TO_UNIXUSER_SID) && \
+    defined(NFS41_DRIVER_SID_CACHE)
+    if (req->query & OWNER_SECURITY_INFORMATION)
+        req->sid = sidcache_getcached_byname(&user_sidcache, req->nfsname);
+    else if (req->query & GROUP_SECURITY_INFORMATION)
+        req->sid = sidcache_getcached_byname(&group_sidcache, req->nfsname);
+    if (req->sid) {
+        req->sid_len = GetLengthSid(req->sid);
+        req->status = 0;
+        return true;
+    }
+#endif /* NFS41_DRIVER_FEATURE_MAP_UNMAPPED_USER_TO_UNIXUSER_SID &&
+    NFS41_DRIVER_SID_CACHE */
+    return false;
+}
+
+static void sid_batch_run(sid_batch *batch)
+{
+    nfs4servername_sid_req *req;
+    LONG i;
+
+    /* grab the next name until all are done */
+    while ((i = InterlockedIncrement(&batch->next) - 1) <
+        batch->num_misses) {
+        req = batch->misses[i];
+        req->status = map_nfs4servername_2_sid(batch->nfs41dg,
+            req->query, &req->sid_len, &req->sid, req->nfsname);
+    }
+}
+
+static unsigned int WINAPI sid_batch_thread(void *args)
+{
+    sid_batch *batch = (sid_batch *)args;
+
+    /* look up names with the same identity as the upcall thread */
+    if (batch->tok && !SetThreadToken(NULL, batch->tok)) {
+        DPRINTF(0, ("sid_batch_thread: SetThreadToken() failed, "
+            "lasterr=%d\n", (int)GetLastError()));
+        return 0;
+    }
+    sid_batch_run(batch);
+    if (batch->tok)
+        (void)SetThreadToken(NULL, NULL);
+    return 0;
+}
+
+int map_nfs4servernames_2_sids(nfs41_daemon_globals *nfs41dg,
+    int count, nfs4servername_sid_req *reqs)
+{
+    HANDLE threads[SID_BATCH_MAX_THREADS-1];
+    int *dup_of;
+    sid_batch batch;
+    nfs4servername_sid_req *req;
+    int status = ERROR_SUCCESS;
+    int i, j, num_threads = 0;
+
+    DPRINTF(ACLLVL, ("--> map_nfs4servernames_2_sids(count=%d)\n", count));
+
+    if (count == 0)
+        goto out;
+
+    dup_of = _alloca(count * sizeof(int));
+    (void)memset(&batch, 0, sizeof(batch));
+    batch.nfs41dg = nfs41dg;
+    batch.misses = _alloca(count * sizeof(nfs4servername_sid_req *));
+
+    for (i = 0; i < count; i++) {
+        req = &reqs[i];
+        req->sid = NULL;
+        req->sid_len = 0;
+        req->status = ERROR_SUCCESS;
+
+        dup_of[i] = -1;
+        for (j = 0; j < i; j++) {
+            if ((dup_of[j] == -1) && (reqs[j].query == req->query) &&
+                (!strcmp(reqs[j].nfsname, req->nfsname))) {
+                dup_of[i] = j;
+                break;
+            }
+        }
+        if ((dup_of[i] == -1) && !sidcache_probe(req))
+            batch.misses[batch.num_misses++] = req;
+    }
+
+    if (batch.num_misses > 1) {
+        if (!OpenThreadToken(GetCurrentThread(), TOKEN_IMPERSONATE,
+            TRUE, &batch.tok))
+            batch.tok = NULL;
+
+        for (i = 0; ((i + 1) < batch.num_misses) &&
+            ((i + 1) < SID_BATCH_MAX_THREADS); i++) {
+            threads[num_threads] = (HANDLE)_beginthreadex(NULL,
+                NFSD_THREAD_STACK_SIZE, sid_batch_thread, &batch,
+                0, NULL);
+            if (threads[num_threads] == NULL) {
+                eprintf("map_nfs4servernames_2_sids: "
+                    "_beginthreadex() failed with %d\n",
+                    (int)GetLastError());
+                break;
+            }
+            num_threads++;
+        }
+    }
+
+    sid_batch_run(&batch);
+
+    if (num_threads) {
+        (void)WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+        for (i = 0; i < num_threads; i++)
+            (void)CloseHandle(threads[i]);
+    }
+    if (batch.tok)
+        (void)CloseHandle(batch.tok);
+
+    DPRINTF(ACLLVL, ("map_nfs4servernames_2_sids: %d names, "
+        "%d not cached, %d threads\n",
+        count, (int)batch.num_misses, num_threads + 1));
+
+    for (i = 0; i < count; i++) {
+        req = &reqs[i];
+        if (dup_of[i] != -1) {
+            const nfs4servername_sid_req *orig = &reqs[dup_of[i]];
+
+            req->status = orig->status;
+            if (req->status)
+                continue;
+            req->sid_len = orig->sid_len;
+            req->sid = malloc(orig->sid_len);
+            if (req->sid == NULL) {
+                req->status = GetLastError();
+                continue;
+            }
+            (void)CopySid(orig->sid_len, req->sid, orig->sid);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (reqs[i].status) {
+            status = reqs[i].status;
+            break;
+        }
+    }
+out:
+    DPRINTF(ACLLVL, ("<-- map_nfs4servernames_2_sids() returning %d\n",
+        status));
+    return status;
+}
+
 
 /*
  * |lookupaccountnameutf8()| - UTF-8 version of |LookupAccountNameA()|
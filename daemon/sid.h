@@ -71,6 +71,13 @@ bool unixuser_sid2uid(PSID psid, uid_t *puid);
 bool unixgroup_sid2gid(PSID psid, gid_t *pgid);
 #endif /* NFS41_DRIVER_FEATURE_MAP_UNMAPPED_USER_TO_UNIXUSER_SID */
 void sidcache_init(void);
+void sidcache_free(void);
+#ifdef NFS41_DRIVER_DAEMON_MEMORY_PRESSURE
+void sidcache_trim(void);
+#endif /* NFS41_DRIVER_DAEMON_MEMORY_PRESSURE */
+#ifdef NFS41_DRIVER_DAEMON_IDCACHEFILE
+void sidcache_load_idcachefile(void);
+#endif /* NFS41_DRIVER_DAEMON_IDCACHEFILE */
 void sidcache_add(sidcache *cache, const char* win32name, PSID value);
 void sidcache_addwithalias(sidcache *cache, const char *win32name, const char *aliasname, PSID value);
 PSID *sidcache_getcached_byname(sidcache *cache, const char *win32name);
@@ -78,6 +85,18 @@ bool sidcache_getcached_bysid(sidcache *cache, PSID sid, char *out_win32name);
 
 int map_nfs4servername_2_sid(nfs41_daemon_globals *nfs41dg, int query, DWORD *sid_len, PSID *sid, LPCSTR name);
 
+/* one name for |map_nfs4servernames_2_sids()| */
+typedef struct _nfs4servername_sid_req {
+    int query; /* |OWNER_SECURITY_INFORMATION| or |GROUP_SECURITY_INFORMATION| */
+    LPCSTR nfsname;
+    PSID sid; /* out, |malloc()|'ed */
+    DWORD sid_len; /* out */
+    int status; /* out */
+} nfs4servername_sid_req;
+
+int map_nfs4servernames_2_sids(nfs41_daemon_globals *nfs41dg,
+    int count, nfs4servername_sid_req *reqs);
+
 /* UTF-8 version of |LookupAccountNameA()| */
 BOOL lookupaccountnameutf8(
     const char *restrict pSystemNameUTF8,
@@ -26,6 +26,7 @@
 
 #include "nfs41_driver.h"
 #include "nfs41_ops.h"
+#include "name_cache.h"
 #include "upcall.h"
 #include "util.h"
 #include "daemon_debug.h"
@@ -137,6 +138,248 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_DAEMON_SYMLINK_CACHE
+/*
+ * Symlink target cache
+ *
+ * Symlinks are traversed (|nfs41_symlink_follow()|) and queried
+ * (FSCTL_GET_REPARSE_POINT, directory listings) over and over, and
+ * each of these used to send a READLINK.
+ * The cache keeps the target of up to |SYMLINK_CACHE_SIZE| symlinks
+ * per superblock and fileid. Symlink targets cannot be changed, only
+ * the symlink replaced, so an entry is used as long as the (cached)
+ * change attribute of the symlink is the same as when it was filled,
+ * and for at most |SYMLINK_CACHE_TTL| seconds to cover fileid reuse
+ * on the server.
+ */
+#define SYMLINK_CACHE_SIZE 256 /* must be a power of 2 */
+#define SYMLINK_CACHE_TTL 60
+
+typedef struct __symlink_cache_entry {
+    const nfs41_superblock  *superblock;
+    uint64_t                fileid;
+    uint64_t                change;
+    util_reltimestamp       timestamp;
+    bool                    valid;
+    bool                    has_change;
+    uint32_t                link_len;
+    char                    *link;
+} symlink_cache_entry;
+
+static struct {
+    SRWLOCK                 lock;
+    symlink_cache_entry     entries[SYMLINK_CACHE_SIZE];
+} symlink_cache = { .lock = SRWLOCK_INIT };
+
+static __inline symlink_cache_entry *symlink_cache_slot(
+    IN const nfs41_fh *fh)
+{
+    return &symlink_cache.entries[
+        (uint32_t)(fh->fileid ^ (fh->fileid >> 32)) &
+        (SYMLINK_CACHE_SIZE - 1)];
+}
+
+/* get the (cached) change attribute of the symlink, no roundtrip */
+static bool symlink_cache_get_change(
+    IN nfs41_session *session,
+    IN const nfs41_fh *fh,
+    OUT uint64_t *change)
+{
+    nfs41_file_info info;
+
+    (void)memset(&info, 0, sizeof(nfs41_file_info));
+    if ((nfs41_attr_cache_lookup(session_name_cache(session),
+            fh->fileid, &info) == 0) &&
+        bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_CHANGE)) {
+        *change = info.change;
+        return true;
+    }
+    return false;
+}
+
+static __inline bool symlink_cache_entry_matches(
+    IN const symlink_cache_entry *e,
+    IN const nfs41_fh *fh,
+    IN const uint64_t *change)
+{
+    return (e->valid &&
+        (e->superblock == fh->superblock) &&
+        (e->fileid == fh->fileid) &&
+        ((change == NULL) ||
+            (e->has_change && (e->change == *change))) &&
+        ((UTIL_GETRELTIME() - e->timestamp) < SYMLINK_CACHE_TTL));
+}
+
+static bool symlink_cache_contains(
+    IN const nfs41_fh *fh,
+    IN const uint64_t *change)
+{
+    bool hit;
+
+    AcquireSRWLockShared(&symlink_cache.lock);
+    hit = symlink_cache_entry_matches(symlink_cache_slot(fh), fh, change);
+    ReleaseSRWLockShared(&symlink_cache.lock);
+    return hit;
+}
+
+static bool symlink_cache_lookup(
+    IN const nfs41_fh *fh,
+    IN const uint64_t *change,
+    IN uint32_t max_len,
+    OUT char *link_out,
+    OUT uint32_t *len_out)
+{
+    symlink_cache_entry *e;
+    bool hit = false;
+
+    if (fh->fileid == 0)
+        return false;
+
+    AcquireSRWLockShared(&symlink_cache.lock);
+    e = symlink_cache_slot(fh);
+    if (symlink_cache_entry_matches(e, fh, change) &&
+        (e->link_len < max_len)) {
+        (void)memcpy(link_out, e->link, e->link_len);
+        link_out[e->link_len] = '\0';
+        *len_out = e->link_len;
+        hit = true;
+    }
+    ReleaseSRWLockShared(&symlink_cache.lock);
+    return hit;
+}
+
+static void symlink_cache_store(
+    IN const nfs41_fh *fh,
+    IN const uint64_t *change,
+    IN const char *link,
+    IN uint32_t link_len)
+{
+    symlink_cache_entry *e;
+    char *copy, *old;
+
+    if (fh->fileid == 0)
+        return;
+
+    copy = malloc(link_len + 1);
+    if (copy == NULL)
+        return;
+    (void)memcpy(copy, link, link_len);
+    copy[link_len] = '\0';
+
+    AcquireSRWLockExclusive(&symlink_cache.lock);
+    e = symlink_cache_slot(fh);
+    old = e->link;
+    e->superblock = fh->superblock;
+    e->fileid = fh->fileid;
+    e->has_change = (change != NULL);
+    e->change = change ? *change : 0;
+    e->timestamp = UTIL_GETRELTIME();
+    e->link = copy;
+    e->link_len = link_len;
+    e->valid = true;
+    ReleaseSRWLockExclusive(&symlink_cache.lock);
+    free(old);
+}
+
+/*
+ * Read the targets of the symlinks |files[0..count-1]| which are not
+ * in the cache yet with batched READLINKs. |changes[i]| is the change
+ * attribute of |files[i]|, e.g. from the READDIR result
+ */
+void nfs41_symlink_cache_prefetch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN nfs41_path_fh *const *files,
+    IN const uint64_t *changes)
+{
+    nfs41_path_fh **missing = NULL;
+    const uint64_t **missing_changes = NULL;
+    char **links = NULL;
+    char *link_buf = NULL;
+    uint32_t *link_lens = NULL;
+    int *statuses = NULL;
+    uint32_t i, num_missing = 0;
+
+    if (count == 0)
+        return;
+
+    missing = malloc(count * sizeof(nfs41_path_fh *));
+    missing_changes = malloc(count * sizeof(uint64_t *));
+    if ((missing == NULL) || (missing_changes == NULL))
+        goto out;
+
+    for (i = 0; i < count; i++) {
+        if ((files[i]->fh.fileid == 0) ||
+            symlink_cache_contains(&files[i]->fh, &changes[i]))
+            continue;
+        missing[num_missing] = files[i];
+        missing_changes[num_missing] = &changes[i];
+        num_missing++;
+    }
+    if (num_missing == 0)
+        goto out;
+
+    links = malloc(num_missing * sizeof(char *));
+    link_buf = malloc((size_t)num_missing * NFS41_MAX_PATH_LEN);
+    link_lens = malloc(num_missing * sizeof(uint32_t));
+    statuses = malloc(num_missing * sizeof(int));
+    if ((links == NULL) || (link_buf == NULL) ||
+        (link_lens == NULL) || (statuses == NULL))
+        goto out;
+
+    for (i = 0; i < num_missing; i++)
+        links[i] = link_buf + ((size_t)i * NFS41_MAX_PATH_LEN);
+
+    (void)nfs41_readlink_batch(session, num_missing, missing,
+        NFS41_MAX_PATH_LEN, links, link_lens, statuses);
+
+    for (i = 0; i < num_missing; i++) {
+        if (statuses[i] == NFS4_OK)
+            symlink_cache_store(&missing[i]->fh, missing_changes[i],
+                links[i], link_lens[i]);
+    }
+
+    DPRINTF(SYMLLVL2, ("nfs41_symlink_cache_prefetch: "
+        "read %lu of %lu symlinks\n",
+        (unsigned long)num_missing, (unsigned long)count));
+out:
+    free(statuses);
+    free(link_lens);
+    free(link_buf);
+    free(links);
+    free(missing_changes);
+    free(missing);
+}
+#endif /* NFS41_DRIVER_DAEMON_SYMLINK_CACHE */
+
+/* READLINK, answered from the symlink target cache if possible */
+static int symlink_readlink(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN uint32_t max_len,
+    OUT char *link_out,
+    OUT uint32_t *len_out)
+{
+    int status;
+#ifdef NFS41_DRIVER_DAEMON_SYMLINK_CACHE
+    uint64_t change_value;
+    const uint64_t *change = NULL;
+
+    if (symlink_cache_get_change(session, &file->fh, &change_value))
+        change = &change_value;
+    if (symlink_cache_lookup(&file->fh, change,
+        max_len, link_out, len_out))
+        return NFS4_OK;
+#endif /* NFS41_DRIVER_DAEMON_SYMLINK_CACHE */
+
+    status = nfs41_readlink(session, file, max_len, link_out, len_out);
+#ifdef NFS41_DRIVER_DAEMON_SYMLINK_CACHE
+    if (status == NFS4_OK)
+        symlink_cache_store(&file->fh, change, link_out, *len_out);
+#endif /* NFS41_DRIVER_DAEMON_SYMLINK_CACHE */
+    return status;
+}
+
 int nfs41_symlink_target(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -149,7 +392,7 @@ int nfs41_symlink_target(
     int status;
 
     /* read the link */
-    status = nfs41_readlink(session, file, NFS41_MAX_PATH_LEN, link, &link_len);
+    status = symlink_readlink(session, file, NFS41_MAX_PATH_LEN, link, &link_len);
     if (status) {
         eprintf("nfs41_readlink() for '%s' failed with '%s'\n", file->path->path,
             nfs_error_string(status));
@@ -270,7 +513,7 @@ static int handle_symlink_get(void *daemon_context, nfs41_upcall *upcall)
     uint32_t len;
 
     /* read the link */
-    status = nfs41_readlink(state->session, &state->file,
+    status = symlink_readlink(state->session, &state->file,
         NFS41_MAX_PATH_LEN, args->target_get.path, &len);
     if (status) {
         eprintf("handle_symlink_get: "
@@ -308,13 +551,11 @@ static int marshall_symlink_get(
         goto out;
     }
 
-    wc_len = MultiByteToWideChar(CP_UTF8,
-        MB_ERR_INVALID_CHARS,
-        args->target_get.path, args->target_get.len,
+    wc_len = utf8_to_wide(args->target_get.path, args->target_get.len,
         (LPWSTR)buffer, len / sizeof(WCHAR));
     if (wc_len == 0) {
         eprintf("marshall_symlink_get: "
-            "MultiByteToWideChar() failed, lasterr=%d\n",
+            "utf8_to_wide() failed, lasterr=%d\n",
             (int)GetLastError());
         status = ERROR_BUFFER_OVERFLOW;
         goto out;
@@ -0,0 +1,312 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * topstats.c - hot files and directories of each mount
+ *
+ * The daemon counts the upcalls, READ/WRITE bytes and the time spent in
+ * the upcalls per file and per directory, so that "nfsclientdctl top"
+ * can show which files cause the load on a mount.
+ *
+ * - Only one of |NFS41_TOP_STATS_SAMPLE| upcalls of a mount is counted,
+ *   with |NFS41_TOP_STATS_SAMPLE| times the weight, which keeps the
+ *   cost per upcall low (one interlocked increment for the others)
+ * - Each mount has one table for files and one for directories, each
+ *   with |NFS41_TOP_STATS_SLOTS| slots, keyed by fileid. An upcall on
+ *   a file is also counted for its parent directory
+ * - If the table is full, the slot with the fewest |ops| is replaced
+ *   ("space-saving" algorithm): the new file inherits its |ops| as
+ *   |error|, so a file which is really among the hottest is never
+ *   lost, and |ops| - |error| is a lower bound of its real count
+ * - The path of a slot is the most recent path of the fileid, only
+ *   the tail is kept if it is longer than |NFS41_TOP_STATS_PATH_LEN|
+ *
+ * |NFS41_SYSOP_GET_TOP_STATS| merges the tables of all mounts (or one
+ * mount) and returns the hottest files and directories.
+ */
+
+#include <Windows.h>
+#include <stdlib.h>
+
+#include "nfs41_build_features.h"
+#include "nfs41_ops.h"
+#include "topstats.h"
+#include "upcall.h"
+#include "daemon_debug.h"
+#include "util.h"
+
+#ifdef NFS41_DRIVER_DAEMON_TOP_STATS
+
+static void topstats_copy_path(
+    OUT char *dst,
+    IN const char *src,
+    IN size_t len)
+{
+    if (len >= NFS41_TOP_STATS_PATH_LEN) {
+        src += len - (NFS41_TOP_STATS_PATH_LEN - 1);
+        len = NFS41_TOP_STATS_PATH_LEN - 1;
+    }
+    (void)memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+static void topstats_table_add(
+    IN OUT nfs41_topstats_table *table,
+    IN uint64_t fileid,
+    IN const char *path,
+    IN size_t path_len,
+    IN uint64_t weight,
+    IN uint64_t read_bytes,
+    IN uint64_t write_bytes,
+    IN uint64_t usecs)
+{
+    nfs41_topstats_slot *slot = NULL, *min_slot;
+    uint32_t i;
+
+    AcquireSRWLockExclusive(&table->lock);
+    for (i = 0; i < table->used; i++) {
+        if (table->slots[i].fileid == fileid) {
+            slot = &table->slots[i];
+            break;
+        }
+    }
+
+    if (slot) {
+        slot->ops += weight;
+    }
+    else if (table->used < NFS41_TOP_STATS_SLOTS) {
+        slot = &table->slots[table->used++];
+        (void)memset(slot, 0, sizeof(*slot));
+        slot->fileid = fileid;
+        slot->ops = weight;
+    }
+    else {
+        /* replace the slot with the fewest ops */
+        min_slot = &table->slots[0];
+        for (i = 1; i < NFS41_TOP_STATS_SLOTS; i++) {
+            if (table->slots[i].ops < min_slot->ops)
+                min_slot = &table->slots[i];
+        }
+        slot = min_slot;
+        slot->fileid = fileid;
+        slot->error = slot->ops;
+        slot->ops += weight;
+        slot->read_bytes = slot->write_bytes = slot->usecs = 0;
+    }
+
+    slot->read_bytes += read_bytes;
+    slot->write_bytes += write_bytes;
+    slot->usecs += usecs;
+    topstats_copy_path(slot->path, path, path_len);
+    ReleaseSRWLockExclusive(&table->lock);
+}
+
+/*
+ * Count the finished |upcall| which started at |start| (see
+ * |nfsd_op_stats_start()|) for its file and parent directory
+ */
+void nfs41_topstats_upcall_done(
+    IN const nfs41_upcall *upcall,
+    IN LONGLONG start)
+{
+    nfs41_root *root = upcall->root_ref;
+    nfs41_open_state *state = upcall->state_ref;
+    nfs41_topstats *ts;
+    char path[NFS41_MAX_PATH_LEN];
+    size_t path_len, dir_len = 0;
+    uint64_t fileid, dir_fileid = 0;
+    uint64_t read_bytes = 0, write_bytes = 0, usecs;
+    const uint64_t weight = NFS41_TOP_STATS_SAMPLE;
+
+    if ((root == NULL) || (root == INVALID_HANDLE_VALUE) ||
+        (state == NULL) || (state == INVALID_HANDLE_VALUE))
+        return;
+
+    ts = &root->topstats;
+    if ((InterlockedIncrement(&ts->sample) % NFS41_TOP_STATS_SAMPLE) != 0)
+        return;
+
+    usecs = nfsd_op_stats_usecs(start) * weight;
+    if (upcall->status == NO_ERROR) {
+        if (upcall->opcode == NFS41_SYSOP_READ)
+            read_bytes = (uint64_t)upcall->args.rw.out_len * weight;
+        else if (upcall->opcode == NFS41_SYSOP_WRITE)
+            write_bytes = (uint64_t)upcall->args.rw.out_len * weight;
+    }
+
+    AcquireSRWLockShared(&state->path.lock);
+    path_len = state->path.len;
+    (void)memcpy(path, state->path.path, path_len);
+    fileid = state->file.fh.fileid;
+    dir_fileid = state->parent.fh.fileid;
+    if ((state->file.name.name >= state->path.path) &&
+        (state->file.name.name <= (state->path.path + path_len)))
+        dir_len = state->file.name.name - state->path.path;
+    ReleaseSRWLockShared(&state->path.lock);
+
+    if (fileid == 0)
+        return;
+
+    if (state->type == NF4DIR) {
+        topstats_table_add(&ts->dirs, fileid, path, path_len,
+            weight, read_bytes, write_bytes, usecs);
+        return;
+    }
+
+    topstats_table_add(&ts->files, fileid, path, path_len,
+        weight, read_bytes, write_bytes, usecs);
+    if (dir_fileid != 0) {
+        /* strip the '\' before the name, but not of the mount root */
+        if (dir_len > 1)
+            dir_len--;
+        topstats_table_add(&ts->dirs, dir_fileid, path, dir_len,
+            weight, read_bytes, write_bytes, usecs);
+    }
+}
+
+
+/*
+ * Handle |NFS41_SYSOP_GET_TOP_STATS|
+ */
+static int parse_gettopstats(
+    const unsigned char *restrict buffer,
+    uint32_t length,
+    nfs41_upcall *upcall)
+{
+    int status;
+    gettopstats_upcall_args *args = &upcall->args.gettopstats;
+
+    status = safe_read(&buffer, &length, &args->root, sizeof(args->root));
+    if (status) goto out;
+
+    EASSERT(length == 0);
+
+out:
+    return status;
+}
+
+static int handle_gettopstats(void *daemon_context,
+    nfs41_upcall *upcall)
+{
+    return ERROR_SUCCESS;
+}
+
+static int topstats_entry_cmp(
+    const void *a,
+    const void *b)
+{
+    const NFS41_TOP_STATS_ENTRY *ea = a, *eb = b;
+
+    if (ea->ops != eb->ops)
+        return (ea->ops < eb->ops)?1:-1;
+    return 0;
+}
+
+/* Copy the used slots of |table| to |entries|, returns the count */
+static uint32_t topstats_table_copy(
+    IN nfs41_topstats_table *table,
+    IN ULONGLONG root,
+    IN ULONG flags,
+    OUT NFS41_TOP_STATS_ENTRY *entries)
+{
+    NFS41_TOP_STATS_ENTRY *e;
+    const nfs41_topstats_slot *slot;
+    uint32_t i, count;
+
+    AcquireSRWLockShared(&table->lock);
+    count = table->used;
+    for (i = 0; i < count; i++) {
+        slot = &table->slots[i];
+        e = &entries[i];
+        e->root = root;
+        e->fileid = slot->fileid;
+        e->ops = slot->ops;
+        e->error = slot->error;
+        e->read_bytes = slot->read_bytes;
+        e->write_bytes = slot->write_bytes;
+        e->usecs = slot->usecs;
+        e->flags = flags;
+        (void)memcpy(e->path, slot->path, sizeof(e->path));
+    }
+    ReleaseSRWLockShared(&table->lock);
+    return count;
+}
+
+static int marshall_gettopstats(
+    unsigned char *restrict buffer,
+    uint32_t *restrict length,
+    nfs41_upcall *restrict upcall)
+{
+    const gettopstats_upcall_args *args = &upcall->args.gettopstats;
+    nfs41_root *roots[NFS41_MOUNT_STATS_MAX_MOUNTS];
+    NFS41_TOP_STATS_ENTRY *files, *dirs;
+    uint32_t num_roots, i, num_files = 0, num_dirs = 0;
+    ULONG count;
+    ULONGLONG handle;
+    int status;
+
+    files = calloc(NFS41_MOUNT_STATS_MAX_MOUNTS * NFS41_TOP_STATS_SLOTS * 2,
+        sizeof(NFS41_TOP_STATS_ENTRY));
+    if (files == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    dirs = files + (NFS41_MOUNT_STATS_MAX_MOUNTS * NFS41_TOP_STATS_SLOTS);
+
+    num_roots = nfsd_mount_stats_ref_roots(roots,
+        NFS41_MOUNT_STATS_MAX_MOUNTS);
+    for (i = 0; i < num_roots; i++) {
+        handle = (ULONGLONG)(ULONG_PTR)roots[i];
+        if ((args->root == 0) || (args->root == handle)) {
+            num_files += topstats_table_copy(&roots[i]->topstats.files,
+                handle, 0, &files[num_files]);
+            num_dirs += topstats_table_copy(&roots[i]->topstats.dirs,
+                handle, NFS41_TOP_STATS_FLAG_DIR, &dirs[num_dirs]);
+        }
+        nfs41_root_deref(roots[i]);
+    }
+
+    /* half of the entries for files, half for directories */
+    qsort(files, num_files, sizeof(NFS41_TOP_STATS_ENTRY),
+        topstats_entry_cmp);
+    qsort(dirs, num_dirs, sizeof(NFS41_TOP_STATS_ENTRY),
+        topstats_entry_cmp);
+    num_files = min(num_files, NFS41_TOP_STATS_MAX_ENTRIES / 2);
+    num_dirs = min(num_dirs, NFS41_TOP_STATS_MAX_ENTRIES / 2);
+    count = num_files + num_dirs;
+
+    status = safe_write(&buffer, length, &count, sizeof(count));
+    if (status) goto out;
+    status = safe_write(&buffer, length, files,
+        num_files * sizeof(NFS41_TOP_STATS_ENTRY));
+    if (status) goto out;
+    status = safe_write(&buffer, length, dirs,
+        num_dirs * sizeof(NFS41_TOP_STATS_ENTRY));
+out:
+    free(files);
+    return status;
+}
+
+const nfs41_upcall_op nfs41_op_gettopstats = {
+    .parse = parse_gettopstats,
+    .handle = handle_gettopstats,
+    .marshall = marshall_gettopstats,
+    .arg_size = sizeof(gettopstats_upcall_args)
+};
+#endif /* NFS41_DRIVER_DAEMON_TOP_STATS */
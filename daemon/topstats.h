@@ -0,0 +1,71 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+
+
+#ifndef __NFS41_DAEMON_TOPSTATS_H__
+#define __NFS41_DAEMON_TOPSTATS_H__ 1
+
+#include <Windows.h>
+#include <stdint.h>
+#include "nfs41_build_features.h"
+#include "nfs41_driver.h"
+
+#ifdef NFS41_DRIVER_DAEMON_TOP_STATS
+/* Slots per table, the memory used per mount is fixed */
+#define NFS41_TOP_STATS_SLOTS 64
+/* Count one of this many upcalls of a mount */
+#define NFS41_TOP_STATS_SAMPLE 4
+
+typedef struct __nfs41_topstats_slot {
+    uint64_t fileid; /* 0 for a free slot */
+    uint64_t ops;
+    uint64_t error;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t usecs;
+    char path[NFS41_TOP_STATS_PATH_LEN];
+} nfs41_topstats_slot;
+
+typedef struct __nfs41_topstats_table {
+    SRWLOCK lock;
+    uint32_t used;
+    nfs41_topstats_slot slots[NFS41_TOP_STATS_SLOTS];
+} nfs41_topstats_table;
+
+/*
+ * Hot files and directories of one mount, see topstats.c. All zero
+ * is a valid, empty state
+ */
+typedef struct __nfs41_topstats {
+    volatile LONG sample;
+    nfs41_topstats_table files;
+    nfs41_topstats_table dirs;
+} nfs41_topstats;
+
+typedef struct __nfs41_upcall nfs41_upcall;
+
+void nfs41_topstats_upcall_done(
+    IN const nfs41_upcall *upcall,
+    IN LONGLONG start);
+#endif /* NFS41_DRIVER_DAEMON_TOP_STATS */
+
+#endif /* !__NFS41_DAEMON_TOPSTATS_H__ */
@@ -28,6 +28,9 @@
 #include "nfs41_build_features.h"
 #include "upcall.h"
 #include "nfs41_driver.h" /* only for |NFS41_SYSOP_UNMOUNT| */
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+#include "nfs41_upcalltrace.h"
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
 #include "daemon_debug.h"
 #include "util.h"
 
@@ -41,6 +44,7 @@ extern const nfs41_upcall_op nfs41_op_lock;
 extern const nfs41_upcall_op nfs41_op_unlock;
 extern const nfs41_upcall_op nfs41_op_readdir;
 extern const nfs41_upcall_op nfs41_op_getattr;
+extern const nfs41_upcall_op nfs41_op_coherency_batch;
 extern const nfs41_upcall_op nfs41_op_setattr;
 extern const nfs41_upcall_op nfs41_op_getexattr;
 extern const nfs41_upcall_op nfs41_op_setexattr;
@@ -54,6 +58,24 @@ extern const nfs41_upcall_op nfs41_op_setzerodata;
 extern const nfs41_upcall_op nfs41_op_duplicatedata;
 extern const nfs41_upcall_op nfs41_op_offload_datacopy;
 extern const nfs41_upcall_op nfs41_op_setdaemondebuglevel;
+extern const nfs41_upcall_op nfs41_op_getdaemonstats;
+extern const nfs41_upcall_op nfs41_op_getflightrecorder;
+extern const nfs41_upcall_op nfs41_op_getmountstats;
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+extern const nfs41_upcall_op nfs41_op_dirnotify;
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+extern const nfs41_upcall_op nfs41_op_queryopen;
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+extern const nfs41_upcall_op nfs41_op_cachecontrol;
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
+#ifdef NFS41_DRIVER_DAEMON_TOP_STATS
+extern const nfs41_upcall_op nfs41_op_gettopstats;
+#endif /* NFS41_DRIVER_DAEMON_TOP_STATS */
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+extern const nfs41_upcall_op nfs41_op_flush;
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
 
 /* |_nfs41_opcodes| and |g_upcall_op_table| must be in sync! */
 static const nfs41_upcall_op *g_upcall_op_table[] = {
@@ -69,6 +91,7 @@ static const nfs41_upcall_op *g_upcall_op_table[] = {
     &nfs41_op_readdir,
     &nfs41_op_getattr, /* NFS41_SYSOP_FILE_QUERY */
     &nfs41_op_getattr, /* NFS41_SYSOP_FILE_QUERY_TIME_BASED_COHERENCY */
+    &nfs41_op_coherency_batch,
     &nfs41_op_setattr,
     &nfs41_op_getexattr,
     &nfs41_op_setexattr,
@@ -83,10 +106,245 @@ static const nfs41_upcall_op *g_upcall_op_table[] = {
     &nfs41_op_offload_datacopy,
     &nfs41_op_setdaemondebuglevel,
     NULL, /* NFS41_SYSOP_SHUTDOWN */
+    &nfs41_op_getdaemonstats,
+    &nfs41_op_getflightrecorder,
+    &nfs41_op_getmountstats,
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+    &nfs41_op_dirnotify,
+#else
+    NULL, /* NFS41_SYSOP_DIR_NOTIFY */
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+    &nfs41_op_queryopen,
+#else
+    NULL, /* NFS41_SYSOP_QUERY_OPEN */
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+    &nfs41_op_cachecontrol,
+#else
+    NULL, /* NFS41_SYSOP_FSCTL_CACHE_CONTROL */
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
+#ifdef NFS41_DRIVER_DAEMON_TOP_STATS
+    &nfs41_op_gettopstats,
+#else
+    NULL, /* NFS41_SYSOP_GET_TOP_STATS */
+#endif /* NFS41_DRIVER_DAEMON_TOP_STATS */
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    &nfs41_op_flush,
+#else
+    NULL, /* NFS41_SYSOP_FLUSH */
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
     NULL
 };
 static const uint32_t g_upcall_op_table_size = ARRAYSIZE(g_upcall_op_table);
 
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+/*
+ * Upcall trace capture
+ *
+ * Enabled with "nfsd --upcalltrace <file>", writes one request
+ * record per parsed upcall and one reply record per marshalled
+ * downcall, see include/nfs41_upcalltrace.h for the format.
+ * The records are written through the stdio buffer and flushed at
+ * most once per second.
+ */
+static FILE *upcall_trace_file = NULL;
+static CRITICAL_SECTION upcall_trace_lock;
+static LARGE_INTEGER upcall_trace_start;
+static ULONGLONG upcall_trace_last_flush;
+
+int upcall_trace_open(
+    IN const wchar_t *filename)
+{
+    NFS41_UPCALLTRACE_HEADER hdr = { 0 };
+    LARGE_INTEGER freq;
+
+    upcall_trace_file = _wfopen(filename, L"wb");
+    if (upcall_trace_file == NULL) {
+        eprintf("upcall_trace_open: cannot open '%S', errno=%d\n",
+            filename, errno);
+        return ERROR_OPEN_FAILED;
+    }
+    (void)setvbuf(upcall_trace_file, NULL, _IOFBF, 256*1024);
+    InitializeCriticalSection(&upcall_trace_lock);
+
+    (void)QueryPerformanceFrequency(&freq);
+    (void)QueryPerformanceCounter(&upcall_trace_start);
+    upcall_trace_last_flush = GetTickCount64();
+
+    hdr.magic = NFS41_UPCALLTRACE_MAGIC;
+    hdr.version = NFS41_UPCALLTRACE_VERSION;
+    hdr.record_size = sizeof(NFS41_UPCALLTRACE_RECORD);
+    hdr.timestamp_frequency = freq.QuadPart;
+    GetSystemTimeAsFileTime(&hdr.start_time);
+    (void)fwrite(&hdr, sizeof(hdr), 1, upcall_trace_file);
+    (void)fflush(upcall_trace_file);
+
+    DPRINTF(0, ("upcall_trace_open: writing upcall trace to '%S'\n",
+        filename));
+    return NO_ERROR;
+}
+
+/* FNV-1a */
+static ULONGLONG upcall_trace_hash(
+    IN const char *restrict path)
+{
+    ULONGLONG hash = 0xcbf29ce484222325ULL;
+
+    if (path == NULL)
+        return 0;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static ULONGLONG upcall_trace_state_hash(
+    IN nfs41_open_state *state)
+{
+    ULONGLONG hash;
+
+    if ((state == NULL) || (state == INVALID_HANDLE_VALUE))
+        return 0;
+    AcquireSRWLockShared(&state->path.lock);
+    hash = upcall_trace_hash(state->path.path);
+    ReleaseSRWLockShared(&state->path.lock);
+    return hash;
+}
+
+static void upcall_trace_write(
+    IN NFS41_UPCALLTRACE_RECORD *rec)
+{
+    LARGE_INTEGER now;
+    ULONGLONG ticks;
+
+    (void)QueryPerformanceCounter(&now);
+    rec->timestamp = now.QuadPart - upcall_trace_start.QuadPart;
+
+    EnterCriticalSection(&upcall_trace_lock);
+    (void)fwrite(rec, sizeof(*rec), 1, upcall_trace_file);
+    ticks = GetTickCount64();
+    if ((ticks - upcall_trace_last_flush) >= 1000) {
+        (void)fflush(upcall_trace_file);
+        upcall_trace_last_flush = ticks;
+    }
+    LeaveCriticalSection(&upcall_trace_lock);
+}
+
+static void upcall_trace_request(
+    IN const nfs41_upcall *upcall,
+    IN uint32_t upcall_size)
+{
+    NFS41_UPCALLTRACE_RECORD rec = { 0 };
+    const upcall_args *args = &upcall->args;
+
+    rec.xid = upcall->xid;
+    rec.opcode = upcall->opcode;
+    rec.upcall_size = upcall_size;
+    if (upcall->state_ref && (upcall->state_ref != INVALID_HANDLE_VALUE))
+        rec.file_id = (ULONGLONG)(ULONG_PTR)upcall->state_ref;
+
+    switch (upcall->opcode) {
+    case NFS41_SYSOP_OPEN:
+        rec.path_hash = upcall_trace_hash(args->open.path);
+        rec.args[0] = args->open.access_mask;
+        rec.args[1] = args->open.access_mode;
+        rec.args[2] = args->open.disposition;
+        rec.args[3] = args->open.create_opts;
+        rec.length = args->open.file_attrs;
+        break;
+    case NFS41_SYSOP_CLOSE:
+        rec.args[0] = args->close.remove;
+        break;
+    case NFS41_SYSOP_READ:
+    case NFS41_SYSOP_WRITE:
+        rec.offset = args->rw.offset;
+        rec.length = args->rw.len;
+        rec.args[0] = args->rw.flags;
+        break;
+    case NFS41_SYSOP_LOCK:
+        rec.offset = args->lock.offset;
+        rec.length = args->lock.length;
+        rec.args[0] = args->lock.exclusive;
+        rec.args[1] = args->lock.blocking;
+        break;
+    case NFS41_SYSOP_UNLOCK:
+        rec.args[0] = args->unlock.count;
+        if (args->unlock.count) {
+            (void)memcpy(&rec.offset, args->unlock.buf, sizeof(LONGLONG));
+            (void)memcpy(&rec.length, args->unlock.buf + sizeof(LONGLONG),
+                sizeof(LONGLONG));
+        }
+        break;
+    case NFS41_SYSOP_FILE_QUERY:
+    case NFS41_SYSOP_FILE_QUERY_TIME_BASED_COHERENCY:
+        rec.args[0] = args->getattr.query_class;
+        rec.length = args->getattr.buf_len;
+        break;
+    case NFS41_SYSOP_DIR_QUERY:
+        rec.args[0] = args->readdir.query_class;
+        rec.args[1] = args->readdir.initial;
+        rec.args[2] = args->readdir.restart;
+        rec.args[3] = args->readdir.single;
+        rec.length = args->readdir.buf_len;
+        break;
+    case NFS41_SYSOP_FILE_SET:
+        rec.args[0] = args->setattr.set_class;
+        rec.length = args->setattr.buf_len;
+        switch (args->setattr.set_class) {
+        case FileEndOfFileInformation:
+        case FileAllocationInformation:
+            if (args->setattr.buf_len >= sizeof(LARGE_INTEGER))
+                (void)memcpy(&rec.offset, args->setattr.buf,
+                    sizeof(LARGE_INTEGER));
+            break;
+        case FileDispositionInformation:
+            if (args->setattr.buf_len >= sizeof(BOOLEAN))
+                rec.args[1] = *(const BOOLEAN *)args->setattr.buf;
+            break;
+        }
+        break;
+    case NFS41_SYSOP_VOLUME_QUERY:
+        rec.args[0] = args->volume.query;
+        rec.length = args->volume.len;
+        break;
+    case NFS41_SYSOP_ACL_QUERY:
+        rec.args[0] = args->getacl.query;
+        break;
+    case NFS41_SYSOP_ACL_SET:
+        rec.args[0] = args->setacl.query;
+        break;
+    default:
+        break;
+    }
+    if (rec.path_hash == 0)
+        rec.path_hash = upcall_trace_state_hash(upcall->state_ref);
+
+    upcall_trace_write(&rec);
+}
+
+static void upcall_trace_reply(
+    IN const nfs41_upcall *upcall,
+    IN uint32_t downcall_size)
+{
+    NFS41_UPCALLTRACE_RECORD rec = { 0 };
+
+    rec.xid = upcall->xid;
+    rec.opcode = upcall->opcode;
+    rec.flags = NFS41_UPCALLTRACE_FLAG_REPLY;
+    rec.status = upcall->status;
+    rec.length = downcall_size;
+    /* For |NFS41_SYSOP_OPEN| this is the new open state */
+    if (upcall->state_ref && (upcall->state_ref != INVALID_HANDLE_VALUE)) {
+        rec.file_id = (ULONGLONG)(ULONG_PTR)upcall->state_ref;
+        rec.path_hash = upcall_trace_state_hash(upcall->state_ref);
+    }
+
+    upcall_trace_write(&rec);
+}
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
+
 
 int upcall_parse(
     IN const unsigned char *restrict buffer,
@@ -97,6 +355,12 @@ int upcall_parse(
     const nfs41_upcall_op *op;
     DWORD version;
     uint32_t upcall_upcode = 0;
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+    const uint32_t upcall_size = length;
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    const ULONG64 cycles_start = nfsd_cpu_cycles();
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
 
     /*
      * Init generic |upcall| data
@@ -167,10 +431,17 @@ int upcall_parse(
 
     if (op) {
         /*
-         * |NFS41_SYSOP_UNMOUNT| has 0 payload,
+         * |NFS41_SYSOP_UNMOUNT|, |NFS41_SYSOP_GET_DAEMON_STATS|,
+         * |NFS41_SYSOP_GET_FLIGHT_RECORDER|,
+         * |NFS41_SYSOP_GET_MOUNT_STATS| and |NFS41_SYSOP_FLUSH| have
+         * 0 payload,
          * |NFS41_SYSOP_SET_DAEMON_DEBUGLEVEL| has a |ULONG| payload
          */
         if ((upcall_upcode != NFS41_SYSOP_UNMOUNT) &&
+            (upcall_upcode != NFS41_SYSOP_GET_DAEMON_STATS) &&
+            (upcall_upcode != NFS41_SYSOP_GET_FLIGHT_RECORDER) &&
+            (upcall_upcode != NFS41_SYSOP_GET_MOUNT_STATS) &&
+            (upcall_upcode != NFS41_SYSOP_FLUSH) &&
             (upcall_upcode != NFS41_SYSOP_SET_DAEMON_DEBUGLEVEL)) {
             EASSERT_MSG(op->arg_size >= sizeof(void*),
                 ("upcall->opcode=%u, op->arg_size=%ld\n",
@@ -193,7 +464,15 @@ int upcall_parse(
             goto out;
         }
     }
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+    if (upcall_trace_file)
+        upcall_trace_request(upcall, upcall_size);
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
 out:
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    nfsd_cpu_stats_set_opcode(upcall->opcode);
+    nfsd_cpu_stats_add(NFS41_CPU_PHASE_PARSE, cycles_start);
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
     return status;
 }
 
@@ -203,6 +482,9 @@ int upcall_handle(
 {
     int status = NO_ERROR;
     const nfs41_upcall_op *op;
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    const ULONG64 cycles_start = nfsd_cpu_cycles();
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
 
     op = g_upcall_op_table[upcall->opcode];
     if (op == NULL || op->handle == NULL) {
@@ -214,6 +496,9 @@ int upcall_handle(
 
     upcall->status = op->handle(daemon_context, upcall);
 out:
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    nfsd_cpu_stats_add(NFS41_CPU_PHASE_HANDLE, cycles_start);
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
     return status;
 }
 #pragma warning (disable : 4706) /* assignment within conditional expression */
@@ -226,6 +511,9 @@ void upcall_marshall(
     const nfs41_upcall_op *op;
     unsigned char *orig_buf = buffer;
     const uint32_t total = length, orig_len = length;
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    const ULONG64 cycles_start = nfsd_cpu_cycles();
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
 
     /* marshall common elements */
 write_downcall:
@@ -254,6 +542,33 @@ write_downcall:
     }
 out:
     *length_out = total - length;
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+    if (upcall_trace_file)
+        upcall_trace_reply(upcall, *length_out);
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    nfsd_cpu_stats_add(NFS41_CPU_PHASE_MARSHALL, cycles_start);
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
+}
+
+/*
+ * Returns the size of the downcall |upcall_marshall()| will write for
+ * |upcall|, or 0 if the operation has no |downcall_size| hook (its
+ * results always fit into |UPCALL_BUF_SIZE|)
+ */
+uint32_t upcall_downcall_size(
+    IN const nfs41_upcall *upcall)
+{
+    const nfs41_upcall_op *op;
+
+    if (upcall->status)
+        return 0;
+    op = g_upcall_op_table[upcall->opcode];
+    if ((op == NULL) || (op->downcall_size == NULL))
+        return 0;
+    return sizeof(upcall->xid) + sizeof(upcall->opcode) +
+        sizeof(upcall->status) + sizeof(upcall->last_error) +
+        op->downcall_size(upcall);
 }
 
 void upcall_cancel(
@@ -279,4 +594,7 @@ void upcall_cleanup(
         nfs41_root_deref(upcall->root_ref);
         upcall->root_ref = NULL;
     }
+#ifdef NFS41_DRIVER_DAEMON_CPU_STATS
+    nfsd_cpu_stats_set_opcode(0);
+#endif /* NFS41_DRIVER_DAEMON_CPU_STATS */
 }
@@ -40,6 +40,22 @@ typedef struct __mount_upcall_args {
     DWORD       wsize;
     DWORD       use_nfspubfh;
     DWORD       nfsvers;
+    DWORD       nconnect;
+    DWORD       acregmin;
+    DWORD       acregmax;
+    DWORD       acdirmin;
+    DWORD       acdirmax;
+    DWORD       namecachesize; /* in megabytes */
+    DWORD       closetimeo; /* in seconds */
+    DWORD       sparsewrite;
+    DWORD       sockbuf; /* in kilobytes */
+    DWORD       keepalive; /* in seconds */
+    DWORD       sockflags; /* |NFS41_MOUNT_SOCKOPT_*| */
+    DWORD       fsc;
+    DWORD       maxbw; /* in kilobytes per second */
+    DWORD       maxiops;
+    DWORD       autotune;
+    DWORD       immutable;
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
     tristate_bool force_case_preserving;
     tristate_bool force_case_insensitive;
@@ -72,6 +88,9 @@ typedef struct __open_upcall_args {
     HANDLE srv_open;
     DWORD deleg_type;
     PFILE_FULL_EA_INFORMATION ea;
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    ULONGLONG open_fileid; /* for |FILE_OPEN_BY_FILE_ID| */
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
     BOOLEAN created;
     BOOLEAN symlink_embedded;
     nfs41_sysop_open_symlinktarget_type symlinktarget_type;
@@ -82,14 +101,24 @@ typedef struct __close_upcall_args {
     const char *path;
     BOOLEAN remove;
     BOOLEAN renamed;
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    ULONG setattr_flags; /* |NFS41_CLOSE_FLAG_*| */
+    FILE_BASIC_INFORMATION basic_info;
+    LONGLONG eof;
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
 } close_upcall_args;
 
 typedef struct __readwrite_upcall_args {
     unsigned char *buffer;
     ULONGLONG offset;
     ULONG len;
+    ULONG flags; /* |NFS41_RW_FLAG_*| */
     ULONG out_len;
     ULONGLONG ctime;
+#ifdef NFS41_DRIVER_INLINE_RW
+    /* data buffer of an inline READ/WRITE, see |NFS41_RW_INLINE_MAX| */
+    unsigned char *inline_buf;
+#endif /* NFS41_DRIVER_INLINE_RW */
 } readwrite_upcall_args;
 
 typedef struct __lock_upcall_args {
@@ -124,6 +153,13 @@ typedef struct __getattr_upcall_args {
     ULONGLONG ctime;
 } getattr_upcall_args;
 
+typedef struct __coherency_batch_upcall_args {
+    uint32_t count;
+    nfs41_open_state *states[NFS41_COHERENCY_BATCH_MAX];
+    uint32_t status[NFS41_COHERENCY_BATCH_MAX];
+    ULONGLONG changeattr[NFS41_COHERENCY_BATCH_MAX];
+} coherency_batch_upcall_args;
+
 typedef struct __setattr_upcall_args {
     const char *path;
     nfs41_root *root;
@@ -230,6 +266,24 @@ typedef struct __setdaemondebuglevel_upcall_args {
     LONG debuglevel;
 } setdaemondebuglevel_upcall_args;
 
+typedef struct __dirnotify_upcall_args {
+    BOOLEAN watch_tree;
+    ULONG   filter; /* |FILE_NOTIFY_CHANGE_*| */
+} dirnotify_upcall_args;
+
+typedef struct __queryopen_upcall_args {
+    const char *path;
+    FILE_NETWORK_OPEN_INFORMATION network_info;
+} queryopen_upcall_args;
+
+typedef struct __cachecontrol_upcall_args {
+    ULONG   op; /* |NFS41_CACHE_CONTROL_*| */
+} cachecontrol_upcall_args;
+
+typedef struct __gettopstats_upcall_args {
+    ULONGLONG root; /* |nfs41_root| handle, 0 for all mounts */
+} gettopstats_upcall_args;
+
 typedef union __upcall_args {
     mount_upcall_args       mount;
     open_upcall_args        open;
@@ -238,6 +292,7 @@ typedef union __upcall_args {
     lock_upcall_args        lock;
     unlock_upcall_args      unlock;
     getattr_upcall_args     getattr;
+    coherency_batch_upcall_args coherency_batch;
     getexattr_upcall_args   getexattr;
     setattr_upcall_args     setattr;
     setexattr_upcall_args   setexattr;
@@ -250,6 +305,10 @@ typedef union __upcall_args {
     setzerodata_upcall_args setzerodata;
     duplicatedata_upcall_args duplicatedata;
     setdaemondebuglevel_upcall_args setdaemondebuglevel;
+    dirnotify_upcall_args   dirnotify;
+    queryopen_upcall_args   queryopen;
+    cachecontrol_upcall_args cachecontrol;
+    gettopstats_upcall_args gettopstats;
 } upcall_args;
 
 typedef enum _nfs41_opcodes nfs41_opcodes;
@@ -297,6 +356,7 @@ typedef int (*upcall_marshall_proc)(unsigned char* restrict,
     nfs41_upcall* restrict);
 typedef void (*upcall_cancel_proc)(nfs41_upcall*);
 typedef void (*upcall_cleanup_proc)(nfs41_upcall*);
+typedef uint32_t (*upcall_downcall_size_proc)(const nfs41_upcall*);
 
 typedef struct __nfs41_upcall_op {
     upcall_parse_proc       parse;
@@ -304,6 +364,12 @@ typedef struct __nfs41_upcall_op {
     upcall_marshall_proc    marshall;
     upcall_cancel_proc      cancel;
     upcall_cleanup_proc     cleanup;
+    /*
+     * |downcall_size| - optional, size of the results |marshall|
+     * writes, for operations whose results can exceed
+     * |UPCALL_BUF_SIZE|
+     */
+    upcall_downcall_size_proc downcall_size;
     size_t                  arg_size;
 } nfs41_upcall_op;
 
@@ -324,10 +390,18 @@ void upcall_marshall(
     IN uint32_t length,
     OUT uint32_t *length_out);
 
+uint32_t upcall_downcall_size(
+    IN const nfs41_upcall *upcall);
+
 void upcall_cancel(
     IN nfs41_upcall *upcall);
 
 void upcall_cleanup(
     IN nfs41_upcall *upcall);
 
+#ifdef NFS41_DRIVER_DAEMON_UPCALL_TRACE
+int upcall_trace_open(
+    IN const wchar_t *filename);
+#endif /* NFS41_DRIVER_DAEMON_UPCALL_TRACE */
+
 #endif /* !__NFS41_DAEMON_UPCALL_H__ */
@@ -26,6 +26,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <wincrypt.h> /* for Crypt*() functions */
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#elif defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
 
 #include "daemon_debug.h"
 #include "util.h"
@@ -98,6 +103,62 @@ out:
     return status;
 }
 
+/*
+ * |MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, ...)| with an
+ * ASCII fast path: Nearly all file names and symlink targets are
+ * pure ASCII, and then each byte is just zero-extended to a |WCHAR|.
+ * Anything else (or a |dst| which is too small) is left to
+ * |MultiByteToWideChar()|.
+ * Returns the number of |WCHAR|s written, or 0 on error
+ */
+int utf8_to_wide(
+    IN const char *restrict src,
+    IN int src_len,
+    OUT WCHAR *restrict dst,
+    IN int dst_len)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    int i = 0;
+
+    if ((src_len <= 0) || (src_len > dst_len))
+        goto slowpath;
+
+#if defined(_M_X64) || defined(_M_IX86)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v;
+
+    for (; (i + 16) <= src_len ; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v) != 0)
+            goto slowpath;
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i *)(dst + i + 8),
+            _mm_unpackhi_epi8(v, zero));
+    }
+#elif defined(_M_ARM64)
+    uint8x16_t v;
+
+    for (; (i + 16) <= src_len ; i += 16) {
+        v = vld1q_u8(s + i);
+        if (vmaxvq_u8(v) >= 0x80)
+            goto slowpath;
+        vst1q_u16((uint16_t *)(dst + i), vmovl_u8(vget_low_u8(v)));
+        vst1q_u16((uint16_t *)(dst + i + 8), vmovl_high_u8(v));
+    }
+#endif
+
+    for (; i < src_len ; i++) {
+        if (s[i] >= 0x80)
+            goto slowpath;
+        dst[i] = (WCHAR)s[i];
+    }
+    return src_len;
+
+slowpath:
+    return MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS,
+        src, src_len, dst, dst_len);
+}
+
 int safe_write(unsigned char *restrict *restrict pos,
     uint32_t *restrict remaining, const void *src, uint32_t src_len)
 {
@@ -465,11 +526,29 @@ out:
 }
 
 
+static subcmd_popen_context *subcmd_popen_internal(const char *command,
+    bool with_stdin);
+
 /*
  * Like Win32 |popen()| but doesn't randomly fail or genrates EINVAL
  * for unknown reasons
  */
 subcmd_popen_context *subcmd_popen(const char *command)
+{
+    return subcmd_popen_internal(command, false);
+}
+
+/*
+ * Like |subcmd_popen()|, but also connects the stdin of the child
+ * process to a pipe, which can be written with |subcmd_writecmdinput()|
+ */
+subcmd_popen_context *subcmd_popen_rw(const char *command)
+{
+    return subcmd_popen_internal(command, true);
+}
+
+static subcmd_popen_context *subcmd_popen_internal(const char *command,
+    bool with_stdin)
 {
     subcmd_popen_context *pinfo;
     STARTUPINFOW si;
@@ -484,6 +563,7 @@ subcmd_popen_context *subcmd_popen(const char *command)
         return NULL;
 
     pinfo->hReadPipe = pinfo->hWritePipe = INVALID_HANDLE_VALUE;
+    pinfo->hStdinReadPipe = pinfo->hStdinWritePipe = INVALID_HANDLE_VALUE;
 
 #ifdef NOT_WORKING_YET
     /*
@@ -524,9 +604,24 @@ subcmd_popen_context *subcmd_popen(const char *command)
         goto fail;
     }
 
+    if (with_stdin) {
+        if (!CreatePipe(&pinfo->hStdinReadPipe, &pinfo->hStdinWritePipe,
+            &sa, 0)) {
+            DPRINTF(0, ("subcmd_popen: CreatePipe(stdin) error, status=%d\n",
+                (int)GetLastError()));
+            goto fail;
+        }
+
+        if (!SetHandleInformation(pinfo->hStdinWritePipe,
+            HANDLE_FLAG_INHERIT, FALSE)) {
+            DPRINTF(0, ("subcmd_popen: SetHandleInformation(stdin) error\n"));
+            goto fail;
+        }
+    }
+
     (void)memset(&si, 0, sizeof(si));
     si.cb = sizeof(si);
-    si.hStdInput = NULL;
+    si.hStdInput = with_stdin?pinfo->hStdinReadPipe:NULL;
     si.hStdOutput = pinfo->hWritePipe;
     si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
     si.dwFlags |= STARTF_USESTDHANDLES;
@@ -556,6 +651,10 @@ subcmd_popen_context *subcmd_popen(const char *command)
 
     (void)CloseHandle(pinfo->hWritePipe);
     pinfo->hWritePipe = INVALID_HANDLE_VALUE;
+    if (pinfo->hStdinReadPipe != INVALID_HANDLE_VALUE) {
+        (void)CloseHandle(pinfo->hStdinReadPipe);
+        pinfo->hStdinReadPipe = INVALID_HANDLE_VALUE;
+    }
 
     return pinfo;
 fail:
@@ -564,6 +663,10 @@ fail:
             (void)CloseHandle(pinfo->hReadPipe);
         if (pinfo->hWritePipe != INVALID_HANDLE_VALUE)
             (void)CloseHandle(pinfo->hWritePipe);
+        if (pinfo->hStdinReadPipe != INVALID_HANDLE_VALUE)
+            (void)CloseHandle(pinfo->hStdinReadPipe);
+        if (pinfo->hStdinWritePipe != INVALID_HANDLE_VALUE)
+            (void)CloseHandle(pinfo->hStdinWritePipe);
 
         free(pinfo);
     }
@@ -574,6 +677,10 @@ int subcmd_pclose(subcmd_popen_context *pinfo)
 {
     DWORD status;
 
+    /* Close the stdin pipe first, so the child process sees EOF */
+    if (pinfo->hStdinWritePipe != INVALID_HANDLE_VALUE)
+        (void)CloseHandle(pinfo->hStdinWritePipe);
+
     /* Close the read handle to the pipe from the child process */
     (void)CloseHandle(pinfo->hReadPipe);
 
@@ -601,6 +708,21 @@ BOOL subcmd_readcmdoutput(subcmd_popen_context *pinfo, char *buff, size_t buff_s
     return ReadFile(pinfo->hReadPipe, buff, (DWORD)buff_size, num_buff_read_ptr, NULL);
 }
 
+/* Write all of |buff| to the stdin of a |subcmd_popen_rw()| child */
+BOOL subcmd_writecmdinput(subcmd_popen_context *pinfo, const char *buff, size_t buff_size)
+{
+    DWORD num_written;
+
+    while (buff_size > 0) {
+        if (!WriteFile(pinfo->hStdinWritePipe, buff, (DWORD)buff_size,
+            &num_written, NULL))
+            return FALSE;
+        buff += num_written;
+        buff_size -= num_written;
+    }
+    return TRUE;
+}
+
 /*
  * |waitSRWlock()| - Wait for outstanding locks (usually used
  * before disposing (e.g. |free()| the memory of the structure
@@ -853,3 +975,413 @@ int delayxid(LONGLONG xid, LONGLONG moredelaysecs)
 
     return status;
 }
+
+/*
+ * Per-thread arena allocator
+ *
+ * Worker threads reserve |NFSD_ARENA_SIZE| bytes of address space,
+ * which are committed on demand. Upcall-scoped memory, for example
+ * the big compound argument/result structures, is taken from the
+ * arena with a pointer bump. |nfsd_arena_reset()| releases all of it
+ * after each upcall. Memory which must outlive the upcall, such as
+ * open states, must not come from the arena, and arena memory must be
+ * freed by the thread which allocated it.
+ *
+ * Threads without an arena, and allocations which do not fit, fall
+ * back to |malloc()|/|calloc()|. |nfsd_arena_free()| handles both
+ * cases. If the block is the most recent arena allocation, it goes
+ * back to the arena right away.
+ */
+#define NFSD_ARENA_SIZE (4*1024*1024)
+#define NFSD_ARENA_COMMIT_STEP (64*1024)
+#define NFSD_ARENA_ALIGN ((size_t)MEMORY_ALLOCATION_ALIGNMENT)
+#define NFSD_ARENA_ROUNDUP(x, a) (((x) + ((a) - 1)) & ~((a) - 1))
+
+typedef struct __nfsd_arena_block {
+    size_t      prev_top; /* offset of the previous block */
+    uint32_t    generation;
+} nfsd_arena_block;
+
+#define NFSD_ARENA_HDR_SIZE \
+    NFSD_ARENA_ROUNDUP(sizeof(nfsd_arena_block), NFSD_ARENA_ALIGN)
+#define NFSD_ARENA_NO_BLOCK SIZE_MAX
+
+typedef struct __nfsd_arena {
+    char        *base;
+    size_t      committed;
+    size_t      used;
+    size_t      top; /* offset of the most recent block */
+    uint32_t    generation; /* incremented by |nfsd_arena_reset()| */
+} nfsd_arena;
+
+#ifdef NFS41_DRIVER_NUMA_BUFFER_POOLS
+ULONG nfsd_numa_node_count(void)
+{
+    static volatile LONG num_nodes = 0;
+    ULONG highest_node;
+
+    if (num_nodes == 0) {
+        if (!GetNumaHighestNodeNumber(&highest_node))
+            highest_node = 0;
+        (void)InterlockedExchange(&num_nodes, (LONG)highest_node + 1);
+    }
+    return (ULONG)num_nodes;
+}
+
+ULONG nfsd_numa_current_node(void)
+{
+    PROCESSOR_NUMBER procnum;
+    USHORT node;
+
+    GetCurrentProcessorNumberEx(&procnum);
+    if (!GetNumaProcessorNodeEx(&procnum, &node) || (node == MAXUSHORT))
+        return 0;
+    return (ULONG)node;
+}
+#endif /* NFS41_DRIVER_NUMA_BUFFER_POOLS */
+
+#ifdef NFS41_DRIVER_DAEMON_LARGE_PAGES
+/*
+ * Large page buffers
+ *
+ * |nfsd_largepage_vmalloc()| allocates |MEM_LARGE_PAGES| memory,
+ * rounded up to a multiple of |GetLargePageMinimum()|. That needs
+ * |SeLockMemoryPrivilege| and physically contiguous free memory, which
+ * gets rare once the machine has been running for a while, so
+ * |nfsd_largepage_pool_init()| allocates |NFSD_LARGEPAGE_POOL_SIZE|
+ * bytes once at startup and splits them into |NFSD_LARGEPAGE_BUF_SIZE|
+ * buffers for |nfsd_largepage_buf_alloc()|. Callers fall back to
+ * |malloc()| if that returns |NULL|. Large pages are never paged out
+ * and are not returned to the system until the daemon exits.
+ */
+#define NFSD_LARGEPAGE_POOL_SIZE (64*1024*1024)
+#define NFSD_LARGEPAGE_BUF_SIZE (4*1024*1024)
+
+static struct {
+    SLIST_HEADER free_list;
+    char *base;
+    size_t size;
+} largepage_pool;
+
+void *nfsd_largepage_vmalloc(
+    IN OUT size_t *size)
+{
+    const size_t page_size = GetLargePageMinimum();
+    size_t alloc_size;
+    void *ptr;
+
+    if (page_size == 0)
+        return NULL;
+
+    alloc_size = ((*size + page_size - 1) / page_size) * page_size;
+    ptr = VirtualAlloc(NULL, alloc_size,
+        MEM_COMMIT|MEM_RESERVE|MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (ptr == NULL) {
+        /* usually |ERROR_PRIVILEGE_NOT_HELD| */
+        DPRINTF(1, ("nfsd_largepage_vmalloc(size=%llu): "
+            "VirtualAlloc(MEM_LARGE_PAGES) failed, lasterr=%d\n",
+            (unsigned long long)alloc_size, (int)GetLastError()));
+        return NULL;
+    }
+    *size = alloc_size;
+    return ptr;
+}
+
+void nfsd_largepage_pool_init(void)
+{
+    size_t size = NFSD_LARGEPAGE_POOL_SIZE;
+    size_t off;
+    char *base;
+
+    InitializeSListHead(&largepage_pool.free_list);
+
+    base = nfsd_largepage_vmalloc(&size);
+    if (base == NULL) {
+        DPRINTF(0, ("nfsd_largepage_pool_init: "
+            "large pages not available, using normal pages\n"));
+        return;
+    }
+
+    for (off = 0; (off + NFSD_LARGEPAGE_BUF_SIZE) <= size;
+        off += NFSD_LARGEPAGE_BUF_SIZE)
+        InterlockedPushEntrySList(&largepage_pool.free_list,
+            (PSLIST_ENTRY)(base + off));
+
+    largepage_pool.size = size;
+    /* publish the pool last */
+    (void)InterlockedExchangePointer((PVOID volatile *)&largepage_pool.base,
+        base);
+
+    DPRINTF(0, ("nfsd_largepage_pool_init: %llu bytes of large pages, "
+        "%llu buffers\n",
+        (unsigned long long)size,
+        (unsigned long long)(size / NFSD_LARGEPAGE_BUF_SIZE)));
+}
+
+void *nfsd_largepage_buf_alloc(
+    size_t size)
+{
+    if ((largepage_pool.base == NULL) || (size > NFSD_LARGEPAGE_BUF_SIZE))
+        return NULL;
+    return InterlockedPopEntrySList(&largepage_pool.free_list);
+}
+
+/* Returns |false| if |ptr| is not a pool buffer */
+bool nfsd_largepage_buf_free(
+    void *ptr)
+{
+    char *base = largepage_pool.base;
+
+    if ((base == NULL) || ((char *)ptr < base) ||
+        ((char *)ptr >= (base + largepage_pool.size)))
+        return false;
+
+    InterlockedPushEntrySList(&largepage_pool.free_list,
+        (PSLIST_ENTRY)ptr);
+    return true;
+}
+#endif /* NFS41_DRIVER_DAEMON_LARGE_PAGES */
+
+static __declspec(thread) nfsd_arena thread_arena = {
+    .base = NULL,
+    .top = NFSD_ARENA_NO_BLOCK
+};
+
+bool nfsd_arena_create(void)
+{
+    nfsd_arena *arena = &thread_arena;
+
+    arena->base = VirtualAlloc(NULL, NFSD_ARENA_SIZE,
+        MEM_RESERVE, PAGE_READWRITE);
+    if (arena->base == NULL) {
+        eprintf("nfsd_arena_create: VirtualAlloc() failed, lasterr=%d\n",
+            (int)GetLastError());
+        return false;
+    }
+    arena->committed = 0;
+    arena->used = 0;
+    arena->top = NFSD_ARENA_NO_BLOCK;
+    arena->generation = 0;
+    return true;
+}
+
+void nfsd_arena_destroy(void)
+{
+    nfsd_arena *arena = &thread_arena;
+
+    if (arena->base) {
+        (void)VirtualFree(arena->base, 0, MEM_RELEASE);
+        arena->base = NULL;
+    }
+}
+
+void nfsd_arena_reset(void)
+{
+    nfsd_arena *arena = &thread_arena;
+
+    arena->used = 0;
+    arena->top = NFSD_ARENA_NO_BLOCK;
+    arena->generation++;
+}
+
+void *nfsd_arena_alloc(size_t size)
+{
+    nfsd_arena *arena = &thread_arena;
+    nfsd_arena_block *block;
+    size_t need, commit;
+
+    if ((arena->base == NULL) || (size > NFSD_ARENA_SIZE))
+        goto fallback;
+
+    need = NFSD_ARENA_HDR_SIZE + NFSD_ARENA_ROUNDUP(size, NFSD_ARENA_ALIGN);
+    if (need > (NFSD_ARENA_SIZE - arena->used))
+        goto fallback;
+
+    if ((arena->used + need) > arena->committed) {
+        commit = NFSD_ARENA_ROUNDUP(arena->used + need - arena->committed,
+            (size_t)NFSD_ARENA_COMMIT_STEP);
+        commit = min(commit, NFSD_ARENA_SIZE - arena->committed);
+        if (VirtualAlloc(arena->base + arena->committed, commit,
+            MEM_COMMIT, PAGE_READWRITE) == NULL)
+            goto fallback;
+        arena->committed += commit;
+    }
+
+    block = (nfsd_arena_block *)(arena->base + arena->used);
+    block->prev_top = arena->top;
+    block->generation = arena->generation;
+    arena->top = arena->used;
+    arena->used += need;
+    return (char *)block + NFSD_ARENA_HDR_SIZE;
+
+fallback:
+    return malloc(size);
+}
+
+void *nfsd_arena_calloc(size_t size)
+{
+    void *ptr = nfsd_arena_alloc(size);
+
+    if (ptr)
+        (void)memset(ptr, 0, size);
+    return ptr;
+}
+
+void nfsd_arena_free(void *ptr)
+{
+    nfsd_arena *arena = &thread_arena;
+    nfsd_arena_block *block;
+
+    if (ptr == NULL)
+        return;
+
+    if ((arena->base == NULL) ||
+        ((char *)ptr < arena->base) ||
+        ((char *)ptr >= (arena->base + NFSD_ARENA_SIZE))) {
+        free(ptr);
+        return;
+    }
+
+    /* Only the most recent block can go back to the arena early */
+    block = (nfsd_arena_block *)((char *)ptr - NFSD_ARENA_HDR_SIZE);
+    if ((block->generation == arena->generation) &&
+        (arena->top == (size_t)((char *)block - arena->base))) {
+        arena->used = arena->top;
+        arena->top = block->prev_top;
+    }
+}
+
+/*
+ * Single-flight table for identical concurrent requests
+ *
+ * Parallel builds send lots of identical requests (GETATTR of the
+ * same header, LOOKUPs of the same directory) at the same time, and
+ * each of them would become its own compound. The first request for
+ * a key registers itself with |nfsd_inflight_begin()| and sends the
+ * RPC. Duplicates wait until it calls |nfsd_inflight_end()|, and then
+ * pick up the result from the name/attribute cache. If the result is
+ * not there, they send their own RPC.
+ */
+#define NFSD_INFLIGHT_BUCKETS 64
+
+static struct nfsd_inflight_bucket {
+    SRWLOCK             lock;
+    CONDITION_VARIABLE  cond;
+    nfsd_inflight       *head;
+} nfsd_inflight_table[NFSD_INFLIGHT_BUCKETS];
+
+static INIT_ONCE nfsd_inflight_init_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK nfsd_inflight_init(
+    PINIT_ONCE once,
+    PVOID param,
+    PVOID *context)
+{
+    uint32_t i;
+
+    for (i = 0; i < NFSD_INFLIGHT_BUCKETS; i++) {
+        InitializeSRWLock(&nfsd_inflight_table[i].lock);
+        InitializeConditionVariable(&nfsd_inflight_table[i].cond);
+        nfsd_inflight_table[i].head = NULL;
+    }
+    return TRUE;
+}
+
+static struct nfsd_inflight_bucket *nfsd_inflight_bucket(
+    IN nfsd_inflight_op op,
+    IN const void *owner,
+    IN const unsigned char *key,
+    IN size_t key_len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261UL ^ (uint32_t)op;
+    uintptr_t o = (uintptr_t)owner;
+    size_t i;
+
+    for (i = 0; i < sizeof(o); i++) {
+        hash ^= (uint32_t)((o >> (i * 8)) & 0xFF);
+        hash *= 16777619UL;
+    }
+    for (i = 0; i < key_len; i++) {
+        hash ^= key[i];
+        hash *= 16777619UL;
+    }
+    return &nfsd_inflight_table[hash % NFSD_INFLIGHT_BUCKETS];
+}
+
+/* caller must hold the lock of |bucket| */
+static bool nfsd_inflight_exists(
+    IN const struct nfsd_inflight_bucket *bucket,
+    IN nfsd_inflight_op op,
+    IN const void *owner,
+    IN const void *key,
+    IN size_t key_len)
+{
+    const nfsd_inflight *inflight;
+
+    for (inflight = bucket->head; inflight; inflight = inflight->next) {
+        if ((inflight->op == op) && (inflight->owner == owner) &&
+            (inflight->key_len == key_len) &&
+            (memcmp(inflight->key, key, key_len) == 0))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Returns |true| if the caller has waited for a duplicate request and
+ * should check the cache again. Otherwise |inflight| was registered
+ * and must be passed to |nfsd_inflight_end()|.
+ */
+bool nfsd_inflight_begin(
+    IN nfsd_inflight_op op,
+    IN const void *owner,
+    IN const void *key,
+    IN size_t key_len,
+    OUT nfsd_inflight *inflight)
+{
+    struct nfsd_inflight_bucket *bucket;
+    bool waited = false;
+
+    (void)InitOnceExecuteOnce(&nfsd_inflight_init_once,
+        nfsd_inflight_init, NULL, NULL);
+
+    bucket = nfsd_inflight_bucket(op, owner, key, key_len);
+
+    AcquireSRWLockExclusive(&bucket->lock);
+    while (nfsd_inflight_exists(bucket, op, owner, key, key_len)) {
+        (void)SleepConditionVariableSRW(&bucket->cond,
+            &bucket->lock, INFINITE, 0);
+        waited = true;
+    }
+    if (!waited) {
+        inflight->op = op;
+        inflight->owner = owner;
+        inflight->key = key;
+        inflight->key_len = key_len;
+        inflight->next = bucket->head;
+        bucket->head = inflight;
+    }
+    ReleaseSRWLockExclusive(&bucket->lock);
+    return waited;
+}
+
+void nfsd_inflight_end(
+    IN nfsd_inflight *inflight)
+{
+    struct nfsd_inflight_bucket *bucket;
+    nfsd_inflight **pos;
+
+    bucket = nfsd_inflight_bucket(inflight->op, inflight->owner,
+        inflight->key, inflight->key_len);
+
+    AcquireSRWLockExclusive(&bucket->lock);
+    for (pos = &bucket->head; *pos; pos = &(*pos)->next) {
+        if (*pos == inflight) {
+            *pos = inflight->next;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&bucket->lock);
+    WakeAllConditionVariable(&bucket->cond);
+}
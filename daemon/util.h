@@ -99,6 +99,11 @@ int get_safe_read_bufferpos(const unsigned char *restrict *restrict pos,
     uint32_t *restrict remaining, uint32_t src_len, const void **destbuffer);
 int get_name(const unsigned char *restrict *restrict pos,
     uint32_t *restrict remaining, const char *restrict *restrict out_name);
+int utf8_to_wide(
+    IN const char *restrict src,
+    IN int src_len,
+    OUT WCHAR *restrict dst,
+    IN int dst_len);
 int safe_write(unsigned char *restrict *restrict pos,
     uint32_t *restrict remaining, const void *src, uint32_t src_len);
 int get_safe_write_bufferpos(unsigned char *restrict *restrict pos,
@@ -174,7 +179,18 @@ static __inline void bitmap_or(
         if (dst->arr[i])
             count = i+1;
     }
-    dst->count = min(dst->count, count);
+    dst->count = max(dst->count, count);
+}
+/* remove the bits in |src| from |dst| */
+static __inline void bitmap_remove(
+    IN bitmap4 *restrict dst,
+    IN const bitmap4 *restrict src)
+{
+    uint32_t i;
+    for (i = 0; (i < dst->count) && (i < src->count); i++)
+        dst->arr[i] &= ~src->arr[i];
+    while (dst->count && dst->arr[dst->count-1] == 0)
+        dst->count--;
 }
 
 static __inline void bitmap4_cpy(
@@ -421,12 +437,16 @@ __inline int valid_handle(HANDLE handle) {
 typedef struct _subcmd_popen_context {
     HANDLE hReadPipe;
     HANDLE hWritePipe;
+    HANDLE hStdinReadPipe;
+    HANDLE hStdinWritePipe;
     PROCESS_INFORMATION pi;
 } subcmd_popen_context;
 
 subcmd_popen_context *subcmd_popen(const char *command);
+subcmd_popen_context *subcmd_popen_rw(const char *command);
 int subcmd_pclose(subcmd_popen_context *pinfo);
 BOOL subcmd_readcmdoutput(subcmd_popen_context *pinfo, char *buff, size_t buff_size, DWORD *num_buff_read_ptr);
+BOOL subcmd_writecmdinput(subcmd_popen_context *pinfo, const char *buff, size_t buff_size);
 
 bool_t waitSRWlock(PSRWLOCK srwlock);
 bool_t waitcriticalsection(LPCRITICAL_SECTION cs);
@@ -444,4 +464,49 @@ void close_nfs41sys_device_pipe(HANDLE pipe);
 
 int delayxid(LONGLONG xid, LONGLONG moredelaysecs);
 
+#ifdef NFS41_DRIVER_NUMA_BUFFER_POOLS
+/* Number of NUMA nodes, and the node of the calling thread */
+ULONG nfsd_numa_node_count(void);
+ULONG nfsd_numa_current_node(void);
+#endif /* NFS41_DRIVER_NUMA_BUFFER_POOLS */
+
+#ifdef NFS41_DRIVER_DAEMON_LARGE_PAGES
+/* Large page memory, see |NFS41_DRIVER_DAEMON_LARGE_PAGES| */
+void nfsd_largepage_pool_init(void);
+void *nfsd_largepage_vmalloc(IN OUT size_t *size);
+void *nfsd_largepage_buf_alloc(size_t size);
+bool nfsd_largepage_buf_free(void *ptr);
+#endif /* NFS41_DRIVER_DAEMON_LARGE_PAGES */
+
+/* Per-thread arena for upcall-scoped memory */
+bool nfsd_arena_create(void);
+void nfsd_arena_destroy(void);
+void nfsd_arena_reset(void);
+void *nfsd_arena_alloc(size_t size);
+void *nfsd_arena_calloc(size_t size);
+void nfsd_arena_free(void *ptr);
+
+/* Single-flight table for identical concurrent requests */
+typedef enum __nfsd_inflight_op {
+    NFSD_INFLIGHT_LOOKUP,
+    NFSD_INFLIGHT_GETATTR
+} nfsd_inflight_op;
+
+typedef struct __nfsd_inflight {
+    struct __nfsd_inflight  *next;
+    nfsd_inflight_op        op;
+    const void              *owner; /* e.g. the session */
+    const void              *key; /* must stay valid until |nfsd_inflight_end()| */
+    size_t                  key_len;
+} nfsd_inflight;
+
+bool nfsd_inflight_begin(
+    IN nfsd_inflight_op op,
+    IN const void *owner,
+    IN const void *key,
+    IN size_t key_len,
+    OUT nfsd_inflight *inflight);
+void nfsd_inflight_end(
+    IN nfsd_inflight *inflight);
+
 #endif /* !__NFS41_DAEMON_UTIL_H__ */
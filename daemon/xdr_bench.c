@@ -0,0 +1,673 @@
+/* NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * xdr_bench.c - microbenchmarks for the XDR encoder/decoder and
+ * the upcall parser/marshaller
+ *
+ * Started via "nfsd --xdrbench <iterations>", runs each case
+ * |iterations| times in a tight loop and prints ns/op and (DEBUG
+ * builds only) the number of bytes allocated per op.
+ *
+ * The server replies are synthesized with the plain libtirpc XDR
+ * primitives (there is no facility to capture real traffic), and
+ * then decoded with |nfs_decode_compound()|, exactly as
+ * |clnt_call()| would do it.
+ */
+
+#include <Windows.h>
+#include <stdio.h>
+#include <strsafe.h>
+
+#include "nfs41_build_features.h"
+#include "nfs41_compound.h"
+#include "nfs41_ops.h"
+#include "nfs41_xdr.h"
+#include "nfs41_driver.h" /* for |NFS41_SYSOP_*| */
+#include "nfs41_daemon.h"
+#include "upcall.h"
+#include "util.h"
+#include "daemon_debug.h"
+#include "rpc/rpc.h"
+
+bool_t xdr_bitmap4(XDR *xdr, bitmap4 *bitmap);
+
+#define XDR_BENCH_BUF_SIZE (1024*1024)
+#define XDR_BENCH_READ_SIZE (64*1024)
+#define XDR_BENCH_READDIR_ENTRIES 256
+#define XDR_BENCH_FH_LEN 28
+
+typedef bool_t (*xdr_bench_fn)(void *ctx);
+
+typedef struct __xdr_bench_ctx {
+    nfs41_compound compound;
+    nfs_argop4 argops[5];
+    nfs_resop4 resops[5];
+
+    unsigned char sessionid[NFS4_SESSIONID_SIZE];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_path_fh file;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    bitmap4 attr_request;
+
+    /* |OP_GETATTR| */
+    nfs41_getattr_args getattr_args;
+    nfs41_getattr_res getattr_res;
+    nfs41_file_info info;
+
+    /* |OP_OPEN| */
+    state_owner4 owner;
+    nfs41_component name;
+    open_claim4 claim;
+    nfs41_op_open_args open_args;
+    nfs41_op_open_res open_res;
+    stateid4 stateid;
+    open_delegation4 delegation;
+    nfs41_getfh_res getfh_res;
+    nfs41_fh fh;
+
+    /* |OP_READ| */
+    stateid_arg read_stateid;
+    nfs41_read_args read_args;
+    nfs41_read_res read_res;
+    unsigned char *read_data;
+
+    /* |OP_READDIR| */
+    nfs41_readdir_args readdir_args;
+    nfs41_readdir_res readdir_res;
+    unsigned char *entries;
+    uint32_t entries_len;
+
+    /* encoded request and synthesized reply */
+    char *buf;
+    char *reply;
+    u_int reply_len;
+} xdr_bench_ctx;
+
+typedef struct __upcall_bench_ctx {
+    unsigned char buf[512];
+    uint32_t buf_len;
+    unsigned char out[1024];
+    nfs41_upcall upcall;
+} upcall_bench_ctx;
+
+
+static void xdr_bench_run(
+    IN const char *name,
+    IN xdr_bench_fn fn,
+    IN void *ctx,
+    IN unsigned int iterations)
+{
+    LARGE_INTEGER freq, start, end;
+    unsigned int i;
+    double nsecs;
+#ifdef _DEBUG
+    _CrtMemState mem_start, mem_end;
+#endif /* _DEBUG */
+
+    /* warm up and check that the case works at all */
+    if (!fn(ctx)) {
+        (void)fprintf(stdout, "%-28s FAILED\n", name);
+        return;
+    }
+
+    (void)QueryPerformanceFrequency(&freq);
+#ifdef _DEBUG
+    _CrtMemCheckpoint(&mem_start);
+#endif /* _DEBUG */
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < iterations; i++)
+        (void)fn(ctx);
+    (void)QueryPerformanceCounter(&end);
+#ifdef _DEBUG
+    _CrtMemCheckpoint(&mem_end);
+#endif /* _DEBUG */
+
+    nsecs = (double)(end.QuadPart - start.QuadPart) * 1e9 /
+        (double)freq.QuadPart / (double)iterations;
+
+#ifdef _DEBUG
+    (void)fprintf(stdout, "%-28s %12.1f ns/op %10.1f bytes/op\n",
+        name, nsecs,
+        (double)(mem_end.lTotalCount - mem_start.lTotalCount) /
+            (double)iterations);
+#else
+    (void)fprintf(stdout, "%-28s %12.1f ns/op %10s bytes/op\n",
+        name, nsecs, "n/a");
+#endif /* _DEBUG */
+}
+
+
+/*
+ * Reply synthesis
+ */
+static bool_t reply_op_status(
+    XDR *xdr,
+    uint32_t op)
+{
+    uint32_t status = NFS4_OK;
+
+    if (!xdr_uint32_t(xdr, &op))
+        return FALSE;
+    return xdr_uint32_t(xdr, &status);
+}
+
+static bool_t reply_header(
+    XDR *xdr,
+    uint32_t num_ops)
+{
+    uint32_t status = NFS4_OK, tag_len = 0;
+
+    if (!xdr_uint32_t(xdr, &status))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &tag_len))
+        return FALSE;
+    return xdr_uint32_t(xdr, &num_ops);
+}
+
+static bool_t reply_sequence(
+    XDR *xdr,
+    xdr_bench_ctx *ctx)
+{
+    uint32_t sequenceid = 1, slotid = 0;
+    uint32_t highest_slotid = 63, status_flags = 0;
+
+    if (!reply_op_status(xdr, OP_SEQUENCE))
+        return FALSE;
+    if (!xdr_opaque(xdr, (char *)ctx->sessionid, NFS4_SESSIONID_SIZE))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &sequenceid))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &slotid))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &highest_slotid))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &highest_slotid))
+        return FALSE;
+    return xdr_uint32_t(xdr, &status_flags);
+}
+
+/* fattr4 with the attributes |nfs41_open()| and |nfs41_readdir()| ask for */
+static bool_t reply_fattr4(
+    XDR *xdr,
+    uint64_t fileid)
+{
+    fattr4 attrs;
+    XDR attr_xdr;
+    unsigned char *attr_vals = attrs.attr_vals;
+    char *owner = "nfsuser", *group = "nfsgroup";
+    uint32_t owner_len = (uint32_t)strlen(owner);
+    uint32_t group_len = (uint32_t)strlen(group);
+    uint32_t type = NF4REG, mode = 0644, numlinks = 1, nsecs = 0;
+    uint64_t change = 42, size = 1234567, space_used = 1236992;
+    uint64_t fsid = 1, secs = 1735686000;
+
+    attrs.attrmask.count = 2;
+    attrs.attrmask.arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE |
+        FATTR4_WORD0_SIZE | FATTR4_WORD0_FSID | FATTR4_WORD0_FILEID;
+    attrs.attrmask.arr[1] = FATTR4_WORD1_MODE | FATTR4_WORD1_NUMLINKS |
+        FATTR4_WORD1_OWNER | FATTR4_WORD1_OWNER_GROUP |
+        FATTR4_WORD1_SPACE_USED | FATTR4_WORD1_TIME_ACCESS |
+        FATTR4_WORD1_TIME_CREATE | FATTR4_WORD1_TIME_MODIFY;
+
+    xdrmem_create(&attr_xdr, (char *)attrs.attr_vals,
+        NFS4_OPAQUE_LIMIT_ATTR, XDR_ENCODE);
+    if (!xdr_uint32_t(&attr_xdr, &type) ||
+        !xdr_uint64_t(&attr_xdr, &change) ||
+        !xdr_uint64_t(&attr_xdr, &size) ||
+        !xdr_uint64_t(&attr_xdr, &fsid) ||
+        !xdr_uint64_t(&attr_xdr, &fsid) ||
+        !xdr_uint64_t(&attr_xdr, &fileid) ||
+        !xdr_uint32_t(&attr_xdr, &mode) ||
+        !xdr_uint32_t(&attr_xdr, &numlinks) ||
+        !xdr_bytes(&attr_xdr, &owner, &owner_len, NFS4_OPAQUE_LIMIT) ||
+        !xdr_bytes(&attr_xdr, &group, &group_len, NFS4_OPAQUE_LIMIT) ||
+        !xdr_uint64_t(&attr_xdr, &space_used))
+        return FALSE;
+    /* TIME_ACCESS, TIME_CREATE, TIME_MODIFY */
+    if (!xdr_uint64_t(&attr_xdr, &secs) ||
+        !xdr_uint32_t(&attr_xdr, &nsecs) ||
+        !xdr_uint64_t(&attr_xdr, &secs) ||
+        !xdr_uint32_t(&attr_xdr, &nsecs) ||
+        !xdr_uint64_t(&attr_xdr, &secs) ||
+        !xdr_uint32_t(&attr_xdr, &nsecs))
+        return FALSE;
+    attrs.attr_vals_len = XDR_GETPOS(&attr_xdr);
+
+    if (!xdr_bitmap4(xdr, &attrs.attrmask))
+        return FALSE;
+    return xdr_bytes(xdr, (char **)&attr_vals, &attrs.attr_vals_len,
+        NFS4_OPAQUE_LIMIT_ATTR);
+}
+
+static bool_t reply_getattr(
+    XDR *xdr)
+{
+    if (!reply_op_status(xdr, OP_GETATTR))
+        return FALSE;
+    return reply_fattr4(xdr, 0x1000);
+}
+
+static bool_t reply_open(
+    XDR *xdr)
+{
+    stateid4 stateid = { 1 };
+    change_info4 cinfo = { TRUE, 41, 42 };
+    uint32_t rflags = OPEN4_RESULT_LOCKTYPE_POSIX;
+    uint32_t attrset_count = 0, deleg_type = OPEN_DELEGATE_NONE;
+    nfs41_fh fh = { 0 };
+    unsigned char *pfh = fh.fh;
+
+    fh.len = XDR_BENCH_FH_LEN;
+
+    if (!reply_op_status(xdr, OP_OPEN))
+        return FALSE;
+    if (!xdr_stateid4(xdr, &stateid))
+        return FALSE;
+    if (!xdr_bool(xdr, &cinfo.atomic) ||
+        !xdr_uint64_t(xdr, &cinfo.before) ||
+        !xdr_uint64_t(xdr, &cinfo.after))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &rflags))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &attrset_count))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &deleg_type))
+        return FALSE;
+
+    if (!reply_op_status(xdr, OP_GETFH))
+        return FALSE;
+    return xdr_bytes(xdr, (char **)&pfh, &fh.len, NFS4_FHSIZE);
+}
+
+static bool_t reply_read(
+    XDR *xdr,
+    xdr_bench_ctx *ctx)
+{
+    bool_t eof = FALSE;
+    uint32_t count = XDR_BENCH_READ_SIZE;
+
+    if (!reply_op_status(xdr, OP_READ))
+        return FALSE;
+    if (!xdr_bool(xdr, &eof))
+        return FALSE;
+    if (!xdr_uint32_t(xdr, &count))
+        return FALSE;
+    return xdr_opaque(xdr, (char *)ctx->read_data, count);
+}
+
+static bool_t reply_readdir(
+    XDR *xdr)
+{
+    unsigned char cookieverf[NFS4_VERIFIER_SIZE] = { 0 };
+    char name[32], *pname;
+    uint32_t name_len;
+    uint64_t cookie;
+    bool_t value_follows = TRUE, eof = TRUE;
+    uint32_t i;
+
+    if (!reply_op_status(xdr, OP_READDIR))
+        return FALSE;
+    if (!xdr_opaque(xdr, (char *)cookieverf, NFS4_VERIFIER_SIZE))
+        return FALSE;
+    if (!xdr_bool(xdr, &value_follows))
+        return FALSE;
+
+    for (i = 0; i < XDR_BENCH_READDIR_ENTRIES; i++) {
+        cookie = (uint64_t)i + 3;
+        (void)StringCchPrintfA(name, sizeof(name), "file%06u.txt", i);
+        pname = name;
+        name_len = (uint32_t)strlen(name);
+        value_follows = (i + 1) < XDR_BENCH_READDIR_ENTRIES;
+
+        if (!xdr_uint64_t(xdr, &cookie))
+            return FALSE;
+        if (!xdr_bytes(xdr, &pname, &name_len, NFS4_OPAQUE_LIMIT))
+            return FALSE;
+        if (!reply_fattr4(xdr, 0x1000 + (uint64_t)i))
+            return FALSE;
+        if (!xdr_bool(xdr, &value_follows))
+            return FALSE;
+    }
+    return xdr_bool(xdr, &eof);
+}
+
+
+/*
+ * Compound setup
+ */
+static void bench_compound_init(
+    xdr_bench_ctx *ctx,
+    const char *tag)
+{
+    compound_init(&ctx->compound, 1, ctx->argops, ctx->resops, tag);
+
+    compound_add_op(&ctx->compound, OP_SEQUENCE,
+        &ctx->sequence_args, &ctx->sequence_res);
+    ctx->sequence_args.sa_sessionid = ctx->sessionid;
+    ctx->sequence_args.sa_sequenceid = 1;
+    ctx->sequence_args.sa_slotid = 0;
+    ctx->sequence_args.sa_highest_slotid = 63;
+    ctx->sequence_args.sa_cachethis = FALSE;
+
+    compound_add_op(&ctx->compound, OP_PUTFH,
+        &ctx->putfh_args, &ctx->putfh_res);
+    ctx->putfh_args.file = &ctx->file;
+    ctx->putfh_args.in_recovery = 0;
+}
+
+static void bench_getattr_init(
+    xdr_bench_ctx *ctx)
+{
+    bench_compound_init(ctx, "getattr");
+    compound_add_op(&ctx->compound, OP_GETATTR,
+        &ctx->getattr_args, &ctx->getattr_res);
+    ctx->getattr_args.attr_request = &ctx->attr_request;
+    ctx->getattr_res.info = &ctx->info;
+}
+
+static void bench_open_init(
+    xdr_bench_ctx *ctx)
+{
+    bench_compound_init(ctx, "open");
+
+    compound_add_op(&ctx->compound, OP_OPEN,
+        &ctx->open_args, &ctx->open_res);
+    ctx->owner.owner_len = 8;
+    (void)memcpy(ctx->owner.owner, "\1\2\3\4\5\6\7\10", 8);
+    ctx->name.name = "nfsbench_testfile.txt";
+    ctx->name.len = (unsigned short)strlen(ctx->name.name);
+    ctx->claim.claim = CLAIM_NULL;
+    ctx->claim.u.null.filename = &ctx->name;
+    ctx->open_args.seqid = 0;
+    ctx->open_args.share_access = OPEN4_SHARE_ACCESS_READ;
+    ctx->open_args.share_deny = OPEN4_SHARE_DENY_NONE;
+    ctx->open_args.owner = &ctx->owner;
+    ctx->open_args.openhow.opentype = OPEN4_NOCREATE;
+    ctx->open_args.claim = &ctx->claim;
+    ctx->open_res.resok4.stateid = &ctx->stateid;
+    ctx->open_res.resok4.delegation = &ctx->delegation;
+
+    compound_add_op(&ctx->compound, OP_GETFH, NULL, &ctx->getfh_res);
+    ctx->getfh_res.fh = &ctx->fh;
+
+    compound_add_op(&ctx->compound, OP_GETATTR,
+        &ctx->getattr_args, &ctx->getattr_res);
+    ctx->getattr_args.attr_request = &ctx->attr_request;
+    ctx->getattr_res.info = &ctx->info;
+}
+
+static void bench_read_init(
+    xdr_bench_ctx *ctx)
+{
+    bench_compound_init(ctx, "read");
+    compound_add_op(&ctx->compound, OP_READ,
+        &ctx->read_args, &ctx->read_res);
+    ctx->read_stateid.stateid.seqid = 1;
+    ctx->read_args.stateid = &ctx->read_stateid;
+    ctx->read_args.offset = 0;
+    ctx->read_args.count = XDR_BENCH_READ_SIZE;
+}
+
+static void bench_readdir_init(
+    xdr_bench_ctx *ctx)
+{
+    bench_compound_init(ctx, "readdir");
+    compound_add_op(&ctx->compound, OP_READDIR,
+        &ctx->readdir_args, &ctx->readdir_res);
+    ctx->readdir_args.cookie.cookie = 0;
+    ctx->readdir_args.dircount = ctx->entries_len;
+    ctx->readdir_args.maxcount =
+        ctx->entries_len + sizeof(nfs41_readdir_res);
+    ctx->readdir_args.attr_request = &ctx->attr_request;
+}
+
+static bool_t bench_build_reply(
+    xdr_bench_ctx *ctx)
+{
+    XDR xdr;
+    uint32_t i;
+    bool_t ok = TRUE;
+
+    xdrmem_create(&xdr, ctx->reply, XDR_BENCH_BUF_SIZE, XDR_ENCODE);
+    if (!reply_header(&xdr, ctx->compound.args.argarray_count))
+        return FALSE;
+
+    for (i = 0; ok && (i < ctx->compound.args.argarray_count); i++) {
+        switch (ctx->compound.args.argarray[i].op) {
+        case OP_SEQUENCE:   ok = reply_sequence(&xdr, ctx); break;
+        case OP_PUTFH:      ok = reply_op_status(&xdr, OP_PUTFH); break;
+        case OP_GETATTR:    ok = reply_getattr(&xdr); break;
+        /* |reply_open()| includes the GETFH reply */
+        case OP_OPEN:       ok = reply_open(&xdr); break;
+        case OP_GETFH:      break;
+        case OP_READ:       ok = reply_read(&xdr, ctx); break;
+        case OP_READDIR:    ok = reply_readdir(&xdr); break;
+        default:            ok = FALSE; break;
+        }
+    }
+    ctx->reply_len = XDR_GETPOS(&xdr);
+    return ok;
+}
+
+
+/*
+ * Benchmark cases
+ */
+static bool_t bench_encode(
+    void *arg)
+{
+    xdr_bench_ctx *ctx = (xdr_bench_ctx *)arg;
+    XDR xdr;
+
+    xdrmem_create(&xdr, ctx->buf, XDR_BENCH_BUF_SIZE, XDR_ENCODE);
+    return nfs_encode_compound(&xdr, (caddr_t *)&ctx->compound.args);
+}
+
+static bool_t bench_decode(
+    void *arg)
+{
+    xdr_bench_ctx *ctx = (xdr_bench_ctx *)arg;
+    XDR xdr;
+
+    /* reset the fields the decoder updates in place */
+    ctx->compound.res.resarray_count = ctx->compound.args.argarray_count;
+    ctx->getattr_res.obj_attributes.attr_vals_len = NFS4_OPAQUE_LIMIT_ATTR;
+    ctx->info.owner = NULL;
+    ctx->info.owner_group = NULL;
+    ctx->read_res.resok4.data = ctx->read_data;
+    ctx->read_res.resok4.data_len = XDR_BENCH_READ_SIZE;
+    ctx->readdir_res.reply.entries = ctx->entries;
+    ctx->readdir_res.reply.entries_len = ctx->entries_len;
+
+    xdrmem_create(&xdr, ctx->reply, ctx->reply_len, XDR_DECODE);
+    return nfs_decode_compound(&xdr, (caddr_t *)&ctx->compound.res);
+}
+
+static bool_t bench_upcall_parse(
+    void *arg)
+{
+    upcall_bench_ctx *ctx = (upcall_bench_ctx *)arg;
+
+    if (upcall_parse(ctx->buf, ctx->buf_len, &ctx->upcall))
+        return FALSE;
+    upcall_cleanup(&ctx->upcall);
+    return TRUE;
+}
+
+static bool_t bench_upcall_marshall(
+    void *arg)
+{
+    upcall_bench_ctx *ctx = (upcall_bench_ctx *)arg;
+    uint32_t out_len;
+
+    ctx->upcall.status = NO_ERROR;
+    upcall_marshall(&ctx->upcall, ctx->out, sizeof(ctx->out), &out_len);
+    return ctx->upcall.status == NO_ERROR;
+}
+
+static void bench_upcall_header(
+    upcall_bench_ctx *ctx,
+    uint32_t opcode,
+    HANDLE state_ref)
+{
+    unsigned char *p = ctx->buf;
+    uint32_t len = sizeof(ctx->buf);
+    uint64_t xid = 0x1234;
+    HANDLE root_ref = INVALID_HANDLE_VALUE;
+
+    (void)safe_write(&p, &len, &NFS41D_VERSION, sizeof(uint32_t));
+    (void)safe_write(&p, &len, &xid, sizeof(xid));
+    (void)safe_write(&p, &len, &opcode, sizeof(opcode));
+    (void)safe_write(&p, &len, &root_ref, sizeof(root_ref));
+    (void)safe_write(&p, &len, &state_ref, sizeof(state_ref));
+    ctx->buf_len = sizeof(ctx->buf) - len;
+}
+
+static void bench_upcall_append(
+    upcall_bench_ctx *ctx,
+    const void *value,
+    uint32_t value_len)
+{
+    unsigned char *p = ctx->buf + ctx->buf_len;
+    uint32_t len = sizeof(ctx->buf) - ctx->buf_len;
+
+    (void)safe_write(&p, &len, value, value_len);
+    ctx->buf_len = sizeof(ctx->buf) - len;
+}
+
+static void bench_upcalls(
+    IN unsigned int iterations)
+{
+    upcall_bench_ctx *ctx;
+    /*
+     * |parse_getattr()| needs a |state_ref|, use a dummy which holds
+     * a reference of its own so |upcall_cleanup()| never frees it
+     */
+    static nfs41_open_state dummy_state = { .ref_count = 1 };
+    ULONG rw_len = XDR_BENCH_READ_SIZE;
+    ULONGLONG rw_offset = 0;
+    ULONG rw_flags = 0;
+    unsigned char *rw_buffer = NULL;
+    int query_class = FileStandardInformation;
+    int buf_len = sizeof(FILE_STANDARD_INFORMATION);
+
+    ctx = calloc(1, sizeof(upcall_bench_ctx));
+    if (ctx == NULL)
+        return;
+
+    bench_upcall_header(ctx, NFS41_SYSOP_READ, INVALID_HANDLE_VALUE);
+    bench_upcall_append(ctx, &rw_len, sizeof(rw_len));
+    bench_upcall_append(ctx, &rw_offset, sizeof(rw_offset));
+    bench_upcall_append(ctx, &rw_flags, sizeof(rw_flags));
+    bench_upcall_append(ctx, &rw_buffer, sizeof(rw_buffer));
+    xdr_bench_run("upcall READ parse", bench_upcall_parse, ctx, iterations);
+    ctx->upcall.args.rw.out_len = XDR_BENCH_READ_SIZE;
+    xdr_bench_run("upcall READ marshall",
+        bench_upcall_marshall, ctx, iterations);
+
+    bench_upcall_header(ctx, NFS41_SYSOP_FILE_QUERY, &dummy_state);
+    bench_upcall_append(ctx, &query_class, sizeof(query_class));
+    bench_upcall_append(ctx, &buf_len, sizeof(buf_len));
+    xdr_bench_run("upcall FILE_QUERY parse",
+        bench_upcall_parse, ctx, iterations);
+    ctx->upcall.args.getattr.query_class = FileStandardInformation;
+    xdr_bench_run("upcall FILE_QUERY marshall",
+        bench_upcall_marshall, ctx, iterations);
+
+    free(ctx);
+}
+
+static void bench_compound(
+    IN xdr_bench_ctx *ctx,
+    IN const char *name,
+    IN void (*init)(xdr_bench_ctx *),
+    IN unsigned int iterations)
+{
+    char label[64];
+
+    init(ctx);
+    if (!bench_build_reply(ctx)) {
+        (void)fprintf(stdout, "%-28s FAILED to build reply\n", name);
+        return;
+    }
+
+    (void)StringCchPrintfA(label, sizeof(label), "xdr %s encode", name);
+    xdr_bench_run(label, bench_encode, ctx, iterations);
+    (void)StringCchPrintfA(label, sizeof(label),
+        "xdr %s decode (%u bytes)", name, (unsigned int)ctx->reply_len);
+    xdr_bench_run(label, bench_decode, ctx, iterations);
+}
+
+int nfs_xdr_bench(
+    IN unsigned int iterations)
+{
+    xdr_bench_ctx *ctx;
+    int status = ERROR_NOT_ENOUGH_MEMORY;
+
+    ctx = calloc(1, sizeof(xdr_bench_ctx));
+    if (ctx == NULL)
+        goto out;
+    ctx->entries_len = XDR_BENCH_READDIR_ENTRIES *
+        (uint32_t)(sizeof(nfs41_readdir_entry) + NFS4_OPAQUE_LIMIT);
+    ctx->buf = malloc(XDR_BENCH_BUF_SIZE);
+    ctx->reply = malloc(XDR_BENCH_BUF_SIZE);
+    ctx->read_data = calloc(1, XDR_BENCH_READ_SIZE);
+    /*
+     * zeroed once, like |nfs41_readdir()| does before each call, the
+     * entries land at the same offsets in every iteration
+     */
+    ctx->entries = calloc(1, ctx->entries_len);
+    if ((ctx->buf == NULL) || (ctx->reply == NULL) ||
+        (ctx->read_data == NULL) || (ctx->entries == NULL))
+        goto out_free;
+
+    (void)memset(ctx->sessionid, 0x5a, NFS4_SESSIONID_SIZE);
+    ctx->file.fh.len = XDR_BENCH_FH_LEN;
+    (void)memset(ctx->file.fh.fh, 0xa5, XDR_BENCH_FH_LEN);
+    ctx->attr_request.count = 2;
+    ctx->attr_request.arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE |
+        FATTR4_WORD0_SIZE | FATTR4_WORD0_FSID | FATTR4_WORD0_FILEID;
+    ctx->attr_request.arr[1] = FATTR4_WORD1_MODE | FATTR4_WORD1_NUMLINKS |
+        FATTR4_WORD1_OWNER | FATTR4_WORD1_OWNER_GROUP |
+        FATTR4_WORD1_SPACE_USED | FATTR4_WORD1_TIME_ACCESS |
+        FATTR4_WORD1_TIME_CREATE | FATTR4_WORD1_TIME_MODIFY;
+
+    (void)fprintf(stdout, "nfsd xdr benchmark, %u iterations per case\n",
+        iterations);
+
+    bench_compound(ctx, "GETATTR", bench_getattr_init, iterations);
+    bench_compound(ctx, "OPEN", bench_open_init, iterations);
+    bench_compound(ctx, "READ", bench_read_init, iterations);
+    bench_compound(ctx, "READDIR", bench_readdir_init, iterations);
+    bench_upcalls(iterations);
+    status = NO_ERROR;
+
+out_free:
+    free(ctx->entries);
+    free(ctx->read_data);
+    free(ctx->reply);
+    free(ctx->buf);
+    free(ctx);
+out:
+    return status;
+}
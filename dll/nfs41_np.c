@@ -265,6 +265,170 @@ Return Value:
     DbgP((L"<-- CloseSharedMemory\n"));
 }
 
+/*
+ * Lock-free read access to the shared memory
+ *
+ * |NPGetConnection()|/|NPGetConnection3()| and |NPEnumResource()| are
+ * called by Explorer, the MPR router and |net use| very often, and
+ * taking |NFS41NP_MUTEX_NAME| and mapping/unmapping the section for
+ * each call makes them contend with each other and with (slow)
+ * |NPAddConnection3()|/|NPCancelConnection()| calls.
+ * We therefore keep one read-only view of the section per process and
+ * read it using |NFS41NP_SHARED_MEMORY.Generation| as sequence
+ * counter. If a reader keeps racing with writers we fall back to the
+ * mutex.
+ */
+#define SHARED_MEMORY_READ_MAX_RETRIES 16
+
+static PNFS41NP_SHARED_MEMORY volatile ReadOnlySharedMemory = NULL;
+
+static
+PNFS41NP_SHARED_MEMORY GetReadOnlySharedMemory(void)
+{
+    PNFS41NP_SHARED_MEMORY pSharedMemory;
+    HANDLE hMemory;
+
+    pSharedMemory = ReadOnlySharedMemory;
+    if (pSharedMemory)
+        return pSharedMemory;
+
+    hMemory = OpenFileMappingA(FILE_MAP_READ,
+        FALSE,
+        NFS41_USER_SHARED_MEMORY_NAME);
+    if (hMemory == NULL) {
+        DbgP((L"GetReadOnlySharedMemory: "
+            "OpenFileMappingA() failed, lasterr=%d\n",
+            (int)GetLastError()));
+        return NULL;
+    }
+
+    pSharedMemory = MapViewOfFile(hMemory, FILE_MAP_READ, 0, 0, 0);
+    if (pSharedMemory == NULL) {
+        DbgP((L"GetReadOnlySharedMemory: "
+            "MapViewOfFile() failed, lasterr=%d\n",
+            (int)GetLastError()));
+        (void)CloseHandle(hMemory);
+        return NULL;
+    }
+
+    /* The view keeps the section alive */
+    (void)CloseHandle(hMemory);
+
+    if (InterlockedCompareExchangePointer(
+        (PVOID volatile *)&ReadOnlySharedMemory,
+        pSharedMemory, NULL) != NULL) {
+        /* Another thread was faster */
+        (void)UnmapViewOfFile(pSharedMemory);
+        pSharedMemory = ReadOnlySharedMemory;
+    }
+
+    return pSharedMemory;
+}
+
+/*
+ * Writers must hold |NFS41NP_MUTEX_NAME| (i.e. be between
+ * |OpenSharedMemory()| and |CloseSharedMemory()|)
+ */
+static
+void SharedMemoryWriteBegin(
+    PNFS41NP_SHARED_MEMORY pSharedMemory)
+{
+    (void)InterlockedIncrement(&pSharedMemory->Generation);
+}
+
+static
+void SharedMemoryWriteEnd(
+    PNFS41NP_SHARED_MEMORY pSharedMemory)
+{
+    (void)InterlockedIncrement(&pSharedMemory->Generation);
+}
+
+typedef DWORD (*shared_memory_reader)(
+    PNFS41NP_SHARED_MEMORY pSharedMemory,
+    void *context);
+
+/*
+ * |ReadSharedMemory()| - call |reader| on a consistent snapshot of
+ * the shared memory.
+ * |reader| may be called multiple times and must not keep any state
+ * between calls, except in |context|, and the results of all calls but
+ * the last one are discarded. It must not trust any data from the
+ * shared memory, i.e. clamp indexes and lengths before using them.
+ */
+static
+DWORD ReadSharedMemory(
+    shared_memory_reader reader,
+    void *context)
+{
+    PNFS41NP_SHARED_MEMORY pSharedMemory;
+    HANDLE hMutex, hMemory;
+    LONG generation;
+    DWORD Status;
+    int retry;
+
+    pSharedMemory = GetReadOnlySharedMemory();
+    if (pSharedMemory) {
+        for (retry = 0; retry < SHARED_MEMORY_READ_MAX_RETRIES; retry++) {
+            generation = pSharedMemory->Generation;
+            MemoryBarrier();
+            if (generation & 1) {
+                /* Writer in progress */
+                YieldProcessor();
+                continue;
+            }
+
+            Status = reader(pSharedMemory, context);
+
+            MemoryBarrier();
+            if (pSharedMemory->Generation == generation)
+                return Status;
+        }
+
+        DbgP((L"ReadSharedMemory: "
+            "too many retries, falling back to mutex\n"));
+    }
+
+    Status = OpenSharedMemory(&hMutex,
+        &hMemory,
+        (PVOID)&pSharedMemory);
+    if (Status != WN_SUCCESS)
+        return Status;
+
+    Status = reader(pSharedMemory, context);
+
+    CloseSharedMemory(&hMutex, &hMemory, (PVOID)&pSharedMemory);
+    return Status;
+}
+
+static
+ULONG SharedMemoryNextIndex(
+    PNFS41NP_SHARED_MEMORY pSharedMemory)
+{
+    ULONG nextindex = pSharedMemory->NextAvailableIndex;
+
+    return min(nextindex, NFS41NP_MAX_DEVICES);
+}
+
+/*
+ * Compare |name| with a name in a |NFS41NP_NETRESOURCE| without
+ * relying on the entry being NUL-terminated
+ */
+static
+bool netresource_name_equal(
+    LPCWSTR name,
+    const WCHAR *entryname,
+    USHORT entrynamelength,
+    size_t entrynamesize)
+{
+    size_t namelength = (wcslen(name)+1) * sizeof(WCHAR);
+
+    if ((namelength != entrynamelength) ||
+        (namelength > entrynamesize))
+        return false;
+
+    return memcmp(name, entryname, namelength) == 0;
+}
+
 static DWORD StoreConnectionInfo(
     IN LPCWSTR LocalName,
     IN LPCWSTR ConnectionName,
@@ -298,6 +462,8 @@ static DWORD StoreConnectionInfo(
         pSharedMemory->NextAvailableIndex,
         pSharedMemory->NumberOfResourcesInUse));
 
+    SharedMemoryWriteBegin(pSharedMemory);
+
     for (i = 0; i < pSharedMemory->NextAvailableIndex; i++)
     {
         if (!pSharedMemory->NetResources[i].InUse) {
@@ -347,6 +513,7 @@ static DWORD StoreConnectionInfo(
     // TODO: copy mount options -cbodley
 
 out_close:
+    SharedMemoryWriteEnd(pSharedMemory);
     CloseSharedMemory(&hMutex, &hMemory, (PVOID *)&pSharedMemory);
 out:
     DbgP((L"<-- StoreConnectionInfo returns %d\n", (int)status));
@@ -878,11 +1045,13 @@ NPCancelConnection(
                     break;
                 }
 
+                SharedMemoryWriteBegin(pSharedMemory);
                 pNetResource->InUse = FALSE;
                 pSharedMemory->NumberOfResourcesInUse--;
 
                 if (Index+1 == pSharedMemory->NextAvailableIndex)
                     pSharedMemory->NextAvailableIndex--;
+                SharedMemoryWriteEnd(pSharedMemory);
                 break;
             }
         }
@@ -923,11 +1092,13 @@ NPCancelConnection(
                         (int)Status));
                 }
                 else {
+                    SharedMemoryWriteBegin(pSharedMemory);
                     pNetResource->InUse = FALSE;
                     pSharedMemory->NumberOfResourcesInUse--;
 
                     if (Index+1 == pSharedMemory->NextAvailableIndex)
                         pSharedMemory->NextAvailableIndex--;
+                    SharedMemoryWriteEnd(pSharedMemory);
                 }
                 break;
             }
@@ -942,58 +1113,62 @@ out:
     return Status;
 }
 
-static
-DWORD is_unc_path_mounted(
-    __in LPWSTR lpRemoteName)
-{
-    DWORD   Status = 0;
-
-    HANDLE  hMutex, hMemory;
-    PNFS41NP_SHARED_MEMORY  pSharedMemory;
+struct find_netresource_context {
+    /* in */
+    LPCWSTR lpLocalName;
+    LPCWSTR lpRemoteName; /* optional */
 #ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
-    LUID authenticationid = { .LowPart = 0, .HighPart = 0L };
+    LUID authenticationid;
 #endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
-    LPWSTR lpLocalName = NFS41NP_LOCALNAME_UNC_MARKER;
+    /* out */
+    WCHAR *foundRemoteName; /* optional */
+    DWORD foundRemoteNameSize; /* in bytes */
+    USHORT foundRemoteNameLength;
+};
 
-    DbgP((L"--> is_unc_path_mounted(lpRemoteName='%ls')\n", lpRemoteName));
-
-#ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
-    (void)get_token_authenticationid(GetCurrentThreadEffectiveToken(),
-        &authenticationid);
-#endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
-
-    Status = OpenSharedMemory(&hMutex,
-        &hMemory,
-        (PVOID)&pSharedMemory);
-    if (Status != WN_SUCCESS)
-        goto out;
-
-    ULONG Index;
+/*
+ * |find_netresource()| - |shared_memory_reader| which looks up a
+ * connection by local name (and remote name, if |lpRemoteName| is not
+ * |NULL|) and copies its remote name to |foundRemoteName| if it fits
+ */
+static
+DWORD find_netresource(
+    PNFS41NP_SHARED_MEMORY pSharedMemory,
+    void *context)
+{
+    struct find_netresource_context *ctx = context;
+    ULONG Index, NextIndex;
     PNFS41NP_NETRESOURCE pNetResource;
     PNFS41NP_NETRESOURCE foundNetResource = NULL;
 #ifdef NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL
     PNFS41NP_NETRESOURCE foundSystemLuidNetResource = NULL;
 #endif /* NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL */
-    Status = WN_NOT_CONNECTED;
+    USHORT RemoteNameLength;
 
-    for (Index = 0; Index < pSharedMemory->NextAvailableIndex; Index++) {
+    ctx->foundRemoteNameLength = 0;
+
+    NextIndex = SharedMemoryNextIndex(pSharedMemory);
+    for (Index = 0; Index < NextIndex; Index++) {
         pNetResource = &pSharedMemory->NetResources[Index];
 
         if (!pNetResource->InUse)
             continue;
 
-        if ((((wcslen(lpLocalName)+1)*sizeof(WCHAR)) ==
-                pNetResource->LocalNameLength) &&
-                (!wcscmp(lpLocalName, pNetResource->LocalName)) &&
-                (((wcslen(lpRemoteName)+1)*sizeof(WCHAR)) ==
-                pNetResource->RemoteNameLength) &&
-                (!wcscmp(lpRemoteName, pNetResource->RemoteName))) {
+        if (netresource_name_equal(ctx->lpLocalName,
+                pNetResource->LocalName,
+                pNetResource->LocalNameLength,
+                sizeof(pNetResource->LocalName)) &&
+            ((ctx->lpRemoteName == NULL) ||
+                netresource_name_equal(ctx->lpRemoteName,
+                    pNetResource->RemoteName,
+                    pNetResource->RemoteNameLength,
+                    sizeof(pNetResource->RemoteName)))) {
 #ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
-                if (equal_luid(&authenticationid,
-                    &pNetResource->MountAuthId)) {
-                    foundNetResource = pNetResource;
-                    break;
-                }
+            if (equal_luid(&ctx->authenticationid,
+                &pNetResource->MountAuthId)) {
+                foundNetResource = pNetResource;
+                break;
+            }
 #ifdef NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL
             else if (equal_luid(&SystemLuid,
                 &pNetResource->MountAuthId)) {
@@ -1021,12 +1196,49 @@ DWORD is_unc_path_mounted(
     }
 #endif /* NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL */
 
-    if (foundNetResource) {
-        Status = WN_SUCCESS;
+    if (foundNetResource == NULL)
+        return WN_NOT_CONNECTED;
+
+    RemoteNameLength = foundNetResource->RemoteNameLength;
+    if ((RemoteNameLength < sizeof(WCHAR)) ||
+        (RemoteNameLength > sizeof(foundNetResource->RemoteName)))
+        return WN_NOT_CONNECTED;
+
+    ctx->foundRemoteNameLength = RemoteNameLength;
+
+    if (ctx->foundRemoteName) {
+        if (ctx->foundRemoteNameSize < RemoteNameLength)
+            return WN_MORE_DATA;
+
+        (void)memcpy(ctx->foundRemoteName,
+            foundNetResource->RemoteName,
+            RemoteNameLength);
+        ctx->foundRemoteName[(RemoteNameLength/sizeof(WCHAR))-1] = L'\0';
     }
 
-    CloseSharedMemory( &hMutex, &hMemory, (PVOID)&pSharedMemory);
-out:
+    return WN_SUCCESS;
+}
+
+static
+DWORD is_unc_path_mounted(
+    __in LPWSTR lpRemoteName)
+{
+    DWORD   Status = 0;
+    struct find_netresource_context ctx = {
+        .lpLocalName = NFS41NP_LOCALNAME_UNC_MARKER,
+        .lpRemoteName = lpRemoteName,
+        .foundRemoteName = NULL
+    };
+
+    DbgP((L"--> is_unc_path_mounted(lpRemoteName='%ls')\n", lpRemoteName));
+
+#ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
+    (void)get_token_authenticationid(GetCurrentThreadEffectiveToken(),
+        &ctx.authenticationid);
+#endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
+
+    Status = ReadSharedMemory(find_netresource, &ctx);
+
     DbgP((L"<-- is_unc_path_mounted returns %d\n", (int)Status));
 
     return Status;
@@ -1065,11 +1277,12 @@ NPGetConnection3(
     __inout LPDWORD                     lpBufferSize)
 {
     DWORD Status = 0;
-    HANDLE  hMutex, hMemory;
-    PNFS41NP_SHARED_MEMORY  pSharedMemory;
-#ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
-    LUID authenticationid = { .LowPart = 0, .HighPart = 0L };
-#endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
+    struct find_netresource_context ctx = {
+        .lpLocalName = lpLocalName,
+        .lpRemoteName = NULL,
+        .foundRemoteName = lpRemoteName,
+        .foundRemoteNameSize = *lpBufferSize
+    };
 
     DbgP((L"--> NPGetConnection3(lpLocalName='%ls',dwLevel=%d)\n",
         lpLocalName, (int)dwLevel));
@@ -1080,87 +1293,21 @@ NPGetConnection3(
     }
 
     if (lpLocalName == NULL) {
-        lpLocalName = NFS41NP_LOCALNAME_UNC_MARKER;
+        ctx.lpLocalName = NFS41NP_LOCALNAME_UNC_MARKER;
         DbgP((L"lpLocalName==NULL, "
             "changed to " NFS41NP_LOCALNAME_UNC_MARKER L"\n"));
     }
 
 #ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
     (void)get_token_authenticationid(GetCurrentThreadEffectiveToken(),
-        &authenticationid);
-#endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
-
-    Status = OpenSharedMemory(&hMutex,
-        &hMemory,
-        (PVOID)&pSharedMemory);
-    if (Status != WN_SUCCESS)
-        goto out;
-
-    ULONG Index;
-    PNFS41NP_NETRESOURCE pNetResource;
-    PNFS41NP_NETRESOURCE foundNetResource = NULL;
-#ifdef NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL
-    PNFS41NP_NETRESOURCE foundSystemLuidNetResource = NULL;
-#endif /* NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL */
-    Status = WN_NOT_CONNECTED;
-
-    for (Index = 0; Index < pSharedMemory->NextAvailableIndex; Index++) {
-        pNetResource = &pSharedMemory->NetResources[Index];
-
-        if (!pNetResource->InUse)
-            break;
-
-        if ((((wcslen(lpLocalName)+1)*sizeof(WCHAR)) ==
-                pNetResource->LocalNameLength) &&
-                (!wcscmp(lpLocalName, pNetResource->LocalName))) {
-#ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
-            if (equal_luid(&authenticationid,
-                &pNetResource->MountAuthId)) {
-                foundNetResource = pNetResource;
-                break;
-            }
-#ifdef NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL
-            else if (equal_luid(&SystemLuid,
-                &pNetResource->MountAuthId)) {
-                /*
-                 * Found netresource for user "SYSTEM", but
-                 * continue searching |pSharedMemory->NetResources|
-                 * for an exact match...
-                 */
-                foundSystemLuidNetResource = pNetResource;
-            }
-#endif /* NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL */
-#else /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
-            foundNetResource = pNetResource;
+        &ctx.authenticationid);
 #endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
-        }
-    }
-
-#ifdef NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL
-    /*
-     * No exact match found ? Then fall-back to any match we found for
-     * user "SYSTEM"
-     */
-    if (foundNetResource == NULL) {
-        foundNetResource = foundSystemLuidNetResource;
-    }
-#endif /* NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL */
 
-    if (foundNetResource) {
-        if (*lpBufferSize < foundNetResource->RemoteNameLength) {
-            *lpBufferSize = foundNetResource->RemoteNameLength;
-            Status = WN_MORE_DATA;
-        }
-        else {
-            *lpBufferSize = foundNetResource->RemoteNameLength;
-            (void)memcpy(lpRemoteName,
-                foundNetResource->RemoteName,
-                foundNetResource->RemoteNameLength);
-            Status = WN_SUCCESS;
-        }
+    Status = ReadSharedMemory(find_netresource, &ctx);
+    if ((Status == WN_SUCCESS) || (Status == WN_MORE_DATA)) {
+        *lpBufferSize = ctx.foundRemoteNameLength;
     }
 
-    CloseSharedMemory( &hMutex, &hMemory, (PVOID)&pSharedMemory);
 out:
     if (Status == WN_SUCCESS) {
         DbgP((L"<-- NPGetConnection3(lpRemoteName='%.*ls',*lpBufferSize=%d) returns %d\n",
@@ -1220,70 +1367,80 @@ NPOpenEnum(
     return(Status);
 }
 
-DWORD APIENTRY
-NPEnumResource(
-    HANDLE  hEnum,
-    LPDWORD lpcCount,
-    LPVOID  lpBuffer,
-    LPDWORD lpBufferSize)
+struct enum_netresource_context {
+    /* in */
+    ULONG StartIndex;
+    DWORD cCount;
+    LPVOID lpBuffer;
+    DWORD BufferSize;
+#ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
+    LUID authenticationid;
+#endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
+    /* out */
+    ULONG Index;
+    ULONG EntriesCopied;
+    DWORD SpaceNeeded;
+};
+
+/*
+ * |enum_netresource()| - |shared_memory_reader| which fills the
+ * |NPEnumResource()| buffer, starting again from |StartIndex| on
+ * every call
+ */
+static
+DWORD enum_netresource(
+    PNFS41NP_SHARED_MEMORY pSharedMemory,
+    void *context)
 {
-    DWORD           Status = WN_SUCCESS;
-    ULONG           EntriesCopied;
+    struct enum_netresource_context *ctx = context;
+    DWORD           Status;
     LPNETRESOURCEW  pNetResource;
     ULONG           SpaceNeeded = 0;
     ULONG           SpaceAvailable;
     PWCHAR          StringZone;
-    HANDLE  hMutex, hMemory;
-    PNFS41NP_SHARED_MEMORY  pSharedMemory;
     PNFS41NP_NETRESOURCE pNfsNetResource;
-    ULONG           Index = *((PULONG)hEnum);
-#ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
-    LUID            authenticationid =
-        { .LowPart = 0, .HighPart = 0L };
-#endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
-
-    DbgP((L"--> NPEnumResource(hEnum=0x%x, *lpcCount=%lu)\n",
-        HANDLE2INT(hEnum), (unsigned long)*lpcCount));
-
-#ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
-    (void)get_token_authenticationid(GetCurrentThreadEffectiveToken(),
-        &authenticationid);
-#endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
-
-    pNetResource = (LPNETRESOURCEW)lpBuffer;
-    SpaceAvailable = *lpBufferSize;
-    EntriesCopied = 0;
-    StringZone = (PWCHAR) ((PBYTE)lpBuffer + *lpBufferSize);
+    USHORT          LocalNameLength;
+    USHORT          RemoteNameLength;
+    ULONG           Index, NextIndex;
 
-    Status = OpenSharedMemory(&hMutex,
-        &hMemory,
-        (PVOID)&pSharedMemory);
-    if (Status != WN_SUCCESS)
-        goto out;
+    pNetResource = (LPNETRESOURCEW)ctx->lpBuffer;
+    SpaceAvailable = ctx->BufferSize;
+    ctx->EntriesCopied = 0;
+    ctx->SpaceNeeded = 0;
+    StringZone = (PWCHAR) ((PBYTE)ctx->lpBuffer + ctx->BufferSize);
 
     Status = WN_NO_MORE_ENTRIES;
-    for (Index = *(PULONG)hEnum; EntriesCopied < *lpcCount &&
-            Index < pSharedMemory->NextAvailableIndex; Index++)
+    NextIndex = SharedMemoryNextIndex(pSharedMemory);
+    for (Index = ctx->StartIndex; ctx->EntriesCopied < ctx->cCount &&
+            Index < NextIndex; Index++)
     {
         pNfsNetResource = &pSharedMemory->NetResources[Index];
 
         if (pNfsNetResource->InUse
 #ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
 #ifdef NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL
-            && (equal_luid(&authenticationid,
+            && (equal_luid(&ctx->authenticationid,
                 &pNfsNetResource->MountAuthId) ||
                 equal_luid(&SystemLuid,
                 &pNfsNetResource->MountAuthId)
             )
 #else /* NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL */
-            && equal_luid(&authenticationid,
+            && equal_luid(&ctx->authenticationid,
                 &pNfsNetResource->MountAuthId)
 #endif /* NFS41_DRIVER_SYSTEM_LUID_MOUNTS_ARE_GLOBAL */
 #endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
                 ) {
+            LocalNameLength = pNfsNetResource->LocalNameLength;
+            RemoteNameLength = pNfsNetResource->RemoteNameLength;
+            if ((LocalNameLength < sizeof(WCHAR)) ||
+                (LocalNameLength > sizeof(pNfsNetResource->LocalName)) ||
+                (RemoteNameLength < sizeof(WCHAR)) ||
+                (RemoteNameLength > sizeof(pNfsNetResource->RemoteName)))
+                continue;
+
             SpaceNeeded  = sizeof(NETRESOURCE);
-            SpaceNeeded += pNfsNetResource->LocalNameLength;
-            SpaceNeeded += pNfsNetResource->RemoteNameLength;
+            SpaceNeeded += LocalNameLength;
+            SpaceNeeded += RemoteNameLength;
             // comment
             SpaceNeeded += 5 * sizeof(WCHAR);
             // provider name
@@ -1292,7 +1449,7 @@ NPEnumResource(
                 Status = WN_MORE_DATA;
                 DbgP((L"NPEnumResource: "
                     "More Data Needed, SpaceNeeded=%d\n", SpaceNeeded));
-                *lpBufferSize = SpaceNeeded;
+                ctx->SpaceNeeded = SpaceNeeded;
                 break;
             }
             else {
@@ -1307,17 +1464,19 @@ NPEnumResource(
                 SpaceNeeded -= sizeof(NETRESOURCE);
                 StringZone = (PWCHAR)( (PBYTE) StringZone - SpaceNeeded);
                 // copy local name
-                (void)StringCchCopyW(StringZone,
-                    pNfsNetResource->LocalNameLength,
-                    pNfsNetResource->LocalName);
+                (void)memcpy(StringZone,
+                    pNfsNetResource->LocalName,
+                    LocalNameLength);
+                StringZone[(LocalNameLength/sizeof(WCHAR))-1] = L'\0';
                 pNetResource->lpLocalName = StringZone;
-                StringZone += pNfsNetResource->LocalNameLength/sizeof(WCHAR);
+                StringZone += LocalNameLength/sizeof(WCHAR);
                 // copy remote name
-                (void)StringCchCopyW(StringZone,
-                    pNfsNetResource->RemoteNameLength,
-                    pNfsNetResource->RemoteName);
+                (void)memcpy(StringZone,
+                    pNfsNetResource->RemoteName,
+                    RemoteNameLength);
+                StringZone[(RemoteNameLength/sizeof(WCHAR))-1] = L'\0';
                 pNetResource->lpRemoteName = StringZone;
-                StringZone += pNfsNetResource->RemoteNameLength/sizeof(WCHAR);
+                StringZone += RemoteNameLength/sizeof(WCHAR);
                 // copy comment
                 pNetResource->lpComment = StringZone;
                 *StringZone++ = L'A';
@@ -1330,7 +1489,7 @@ NPEnumResource(
                 (void)StringCbCopyW(StringZone,
                     sizeof(NFS41_PROVIDER_NAME_U), NFS41_PROVIDER_NAME_U);
                 StringZone += sizeof(NFS41_PROVIDER_NAME_U)/sizeof(WCHAR);
-                EntriesCopied++;
+                ctx->EntriesCopied++;
                 // set new bottom of string zone
                 StringZone = (PWCHAR)((PBYTE)StringZone - SpaceNeeded);
                 Status = WN_SUCCESS;
@@ -1339,13 +1498,47 @@ NPEnumResource(
         }
     }
 
-    CloseSharedMemory(&hMutex, &hMemory, (PVOID*)&pSharedMemory);
-out:
-    *lpcCount = EntriesCopied;
-    *((PULONG)hEnum) = Index;
+    ctx->Index = Index;
+
+    return Status;
+}
+
+DWORD APIENTRY
+NPEnumResource(
+    HANDLE  hEnum,
+    LPDWORD lpcCount,
+    LPVOID  lpBuffer,
+    LPDWORD lpBufferSize)
+{
+    DWORD           Status = WN_SUCCESS;
+    struct enum_netresource_context ctx = {
+        .StartIndex = *((PULONG)hEnum),
+        .cCount = *lpcCount,
+        .lpBuffer = lpBuffer,
+        .BufferSize = *lpBufferSize,
+        .Index = *((PULONG)hEnum),
+        .EntriesCopied = 0,
+        .SpaceNeeded = 0
+    };
+
+    DbgP((L"--> NPEnumResource(hEnum=0x%x, *lpcCount=%lu)\n",
+        HANDLE2INT(hEnum), (unsigned long)*lpcCount));
+
+#ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
+    (void)get_token_authenticationid(GetCurrentThreadEffectiveToken(),
+        &ctx.authenticationid);
+#endif /* NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE */
+
+    Status = ReadSharedMemory(enum_netresource, &ctx);
+    if (Status == WN_MORE_DATA) {
+        *lpBufferSize = ctx.SpaceNeeded;
+    }
+
+    *lpcCount = ctx.EntriesCopied;
+    *((PULONG)hEnum) = ctx.Index;
 
     DbgP((L"<-- NPEnumResource returns: %d, Index=%lu\n",
-        (int)EntriesCopied, (unsigned long)Index));
+        (int)ctx.EntriesCopied, (unsigned long)ctx.Index));
 
     return Status;
 }
@@ -56,7 +56,14 @@ typedef struct __NFS41NP_NETRESOURCE {
     WCHAR   Options[NFS41_SYS_MAX_PATH_LEN];
 } NFS41NP_NETRESOURCE, *PNFS41NP_NETRESOURCE;
 
+/*
+ * |Generation| is a sequence counter for lock-free readers: writers
+ * (which also hold |NFS41NP_MUTEX_NAME|) increment it to an odd value
+ * before and to an even value after changing the other fields, and
+ * readers retry if it was odd or has changed while they read
+ */
 typedef struct __NFS41NP_SHARED_MEMORY {
+    volatile LONG       Generation;
     ULONG               NextAvailableIndex;
     ULONG               NumberOfResourcesInUse;
     NFS41NP_NETRESOURCE NetResources[NFS41NP_MAX_DEVICES];
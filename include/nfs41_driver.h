@@ -53,6 +53,31 @@
 #define IOCTL_NFS41_DELAYXID    _RDR_CTL_CODE(8, METHOD_BUFFERED)
 #define IOCTL_NFS41_INVALCACHE  _RDR_CTL_CODE(9, METHOD_BUFFERED)
 #define IOCTL_NFS41_SET_DAEMON_DEBUG_LEVEL  _RDR_CTL_CODE(10, METHOD_BUFFERED)
+#define IOCTL_NFS41_GET_UPDOWNCALL_STATS    _RDR_CTL_CODE(11, METHOD_BUFFERED)
+#define IOCTL_NFS41_READ_BATCH  _RDR_CTL_CODE(12, METHOD_BUFFERED)
+#define IOCTL_NFS41_WRITE_BATCH _RDR_CTL_CODE(13, METHOD_BUFFERED)
+#define IOCTL_NFS41_WRITE_READ_BATCH _RDR_CTL_CODE(14, METHOD_BUFFERED)
+#define IOCTL_NFS41_GET_OP_STATS _RDR_CTL_CODE(15, METHOD_BUFFERED)
+#define IOCTL_NFS41_GET_FLIGHT_RECORDER _RDR_CTL_CODE(16, METHOD_BUFFERED)
+#define IOCTL_NFS41_GET_MOUNT_STATS _RDR_CTL_CODE(17, METHOD_BUFFERED)
+#define IOCTL_NFS41_SET_IO_POOL _RDR_CTL_CODE(18, METHOD_BUFFERED)
+#define IOCTL_NFS41_DIR_NOTIFY  _RDR_CTL_CODE(19, METHOD_BUFFERED)
+#define IOCTL_NFS41_GET_TOP_STATS _RDR_CTL_CODE(20, METHOD_BUFFERED)
+
+/*
+ * |FSCTL_NFS41_CACHE_CONTROL| - issued on an open file or directory
+ * handle, input is a |ULONG| with one of the |NFS41_CACHE_CONTROL_*|
+ * ops
+ */
+#define FSCTL_NFS41_CACHE_CONTROL \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x8c0, \
+    METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/* Exempt the name cache entries of the path from eviction */
+#define NFS41_CACHE_CONTROL_PIN     1
+#define NFS41_CACHE_CONTROL_UNPIN   2
+/* Drop the cached names+attributes below the path */
+#define NFS41_CACHE_CONTROL_FLUSH   3
 
 /*
  * NFS41_SYS_MAX_PATH_LEN - Maximum path length
@@ -79,6 +104,7 @@ typedef enum _nfs41_opcodes {
     NFS41_SYSOP_DIR_QUERY,
     NFS41_SYSOP_FILE_QUERY,
     NFS41_SYSOP_FILE_QUERY_TIME_BASED_COHERENCY,
+    NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH,
     NFS41_SYSOP_FILE_SET,
     NFS41_SYSOP_EA_GET,
     NFS41_SYSOP_EA_SET,
@@ -93,9 +119,412 @@ typedef enum _nfs41_opcodes {
     NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY,
     NFS41_SYSOP_SET_DAEMON_DEBUGLEVEL,
     NFS41_SYSOP_SHUTDOWN,
+    NFS41_SYSOP_GET_DAEMON_STATS,
+    NFS41_SYSOP_GET_FLIGHT_RECORDER,
+    NFS41_SYSOP_GET_MOUNT_STATS,
+    NFS41_SYSOP_DIR_NOTIFY,
+    NFS41_SYSOP_QUERY_OPEN,
+    NFS41_SYSOP_FSCTL_CACHE_CONTROL,
+    NFS41_SYSOP_GET_TOP_STATS,
+    NFS41_SYSOP_FLUSH,
     NFS41_SYSOP_INVALID_OPCODE1
 } nfs41_opcodes;
 
+/*
+ * Statistics for the kernel upcall/downcall machinery, returned by
+ * |IOCTL_NFS41_GET_UPDOWNCALL_STATS|
+ */
+typedef struct _NFS41_UPDOWNCALL_STATS {
+    ULONG num_downcall_buckets;
+    /* Number of requests currently waiting for a downcall */
+    LONG downcall_inflight;
+    LONG downcall_max_inflight;
+    /* Longest hash chain seen at insertion time */
+    LONG downcall_max_chain_len;
+    /* Longest hash chain walked to find a downcall xid */
+    LONG downcall_max_scan_len;
+    /* Number of upcalls waiting to be read by the daemon */
+    LONG upcall_queued;
+    LONG upcall_max_queued;
+    /* Number of per-NUMA node upcall queues */
+    ULONG upcall_num_queues;
+    /* Upcalls a daemon thread took from another node's queue */
+    LONG upcall_steals;
+} NFS41_UPDOWNCALL_STATS;
+
+/*
+ * Per-operation latency statistics, returned by
+ * |IOCTL_NFS41_GET_OP_STATS|
+ *
+ * Latencies are counted in log2 buckets of microseconds, bucket |0|
+ * counts latencies below 1us, bucket |i| latencies in
+ * [2^(i-1), 2^i) us, the last bucket everything above.
+ */
+#define NFS41_OP_STATS_NUM_BUCKETS 24
+/* NFSv4.x operations are counted up to (but not including) this number */
+#define NFS41_OP_STATS_NUM_NFS_OPS 80
+
+typedef struct _NFS41_LATENCY_HISTOGRAM {
+    ULONGLONG total_usecs;
+    ULONG buckets[NFS41_OP_STATS_NUM_BUCKETS];
+} NFS41_LATENCY_HISTOGRAM;
+
+/*
+ * Phases of an upcall for the daemon CPU cycle accounting
+ * (|QueryThreadCycleTime()|), see |NFS41_DRIVER_DAEMON_CPU_STATS|.
+ * |NFS41_CPU_PHASE_HANDLE| includes the XDR and RPC phases, which are
+ * counted for each compound sent while handling the upcall.
+ * |NFS41_CPU_PHASE_RPC| is the RPC layer without XDR (record marking,
+ * RPCSEC_GSS, socket I/O), |NFS41_CPU_PHASE_XDR_DECODE| includes
+ * receiving the reply from the socket.
+ * Compounds sent outside of an upcall (lease renewal, recovery) are
+ * counted for opcode 0
+ */
+#define NFS41_CPU_PHASE_PARSE       0
+#define NFS41_CPU_PHASE_IDMAP       1 /* mapping the caller's token */
+#define NFS41_CPU_PHASE_HANDLE      2
+#define NFS41_CPU_PHASE_MARSHALL    3
+#define NFS41_CPU_PHASE_XDR_ENCODE  4
+#define NFS41_CPU_PHASE_XDR_DECODE  5
+#define NFS41_CPU_PHASE_RPC         6
+#define NFS41_OP_STATS_NUM_CPU_PHASES 7
+
+/*
+ * Daemon part, returned by the |NFS41_SYSOP_GET_DAEMON_STATS|
+ * downcall (must fit into the daemon's 16384 byte downcall buffer)
+ */
+typedef struct _NFS41_DAEMON_OP_STATS {
+    /* Time spent by the daemon handling each upcall */
+    NFS41_LATENCY_HISTOGRAM upcall[NFS41_SYSOP_INVALID_OPCODE1];
+    /*
+     * RPC round trip of each compound, counted for its first operation
+     * after SEQUENCE and PUTFH/PUTROOTFH/PUTPUBFH
+     */
+    NFS41_LATENCY_HISTOGRAM rpc[NFS41_OP_STATS_NUM_NFS_OPS];
+    /* CPU cycles of the daemon threads, see |NFS41_CPU_PHASE_*| */
+    ULONGLONG cpu_cycles[NFS41_SYSOP_INVALID_OPCODE1]
+        [NFS41_OP_STATS_NUM_CPU_PHASES];
+} NFS41_DAEMON_OP_STATS;
+
+typedef struct _NFS41_OP_STATS {
+    ULONG num_upcall_ops; /* |NFS41_SYSOP_INVALID_OPCODE1| */
+    ULONG num_nfs_ops; /* |NFS41_OP_STATS_NUM_NFS_OPS| */
+    /* |STATUS_SUCCESS| if |daemon| is valid */
+    LONG daemon_status;
+    /* Time upcalls waited in the kernel until the daemon read them */
+    NFS41_LATENCY_HISTOGRAM upcall_queue[NFS41_SYSOP_INVALID_OPCODE1];
+    /* Time from queuing an upcall until its downcall arrived */
+    NFS41_LATENCY_HISTOGRAM upcall_total[NFS41_SYSOP_INVALID_OPCODE1];
+    /* Upcalls waiting to be read by the daemon, current and maximum */
+    LONG upcall_queued[NFS41_SYSOP_INVALID_OPCODE1];
+    LONG upcall_max_queued[NFS41_SYSOP_INVALID_OPCODE1];
+    NFS41_DAEMON_OP_STATS daemon;
+} NFS41_OP_STATS;
+
+/*
+ * RPC flight recorder, the daemon keeps the last
+ * |NFS41_FLIGHT_RECORDER_NUM_RECORDS| compounds it sent in a ring
+ * buffer, returned by |IOCTL_NFS41_GET_FLIGHT_RECORDER| (via the
+ * |NFS41_SYSOP_GET_FLIGHT_RECORDER| downcall, so
+ * |NFS41_FLIGHT_RECORDER| must fit into the daemon's 16384 byte
+ * downcall buffer)
+ */
+#define NFS41_FLIGHT_RECORDER_NUM_RECORDS 128
+#define NFS41_FLIGHT_RECORDER_MAX_OPS 8
+
+typedef struct _NFS41_FLIGHT_RECORD {
+    /* Counts up from 1 for each compound sent, 0 for unused records */
+    ULONGLONG seq;
+    /* Wall clock time the compound was sent (|FILETIME|) */
+    ULONGLONG send_time;
+    ULONG latency_usecs;
+    ULONG xid;
+    /* |ULONG_MAX| if the compound has no SEQUENCE */
+    ULONG slotid;
+    ULONG sequenceid;
+    LONG rpc_status;
+    ULONG nfs_status;
+    /* READ/WRITE payload bytes */
+    ULONG io_bytes;
+    USHORT retry;
+    /*
+     * Number of ops sent/results received, only the first
+     * |NFS41_FLIGHT_RECORDER_MAX_OPS| ops are kept in |ops|
+     */
+    UCHAR num_ops;
+    UCHAR num_results;
+    UCHAR ops[NFS41_FLIGHT_RECORDER_MAX_OPS];
+} NFS41_FLIGHT_RECORD;
+
+typedef struct _NFS41_FLIGHT_RECORDER {
+    /* Number of valid |records|, oldest first */
+    ULONG count;
+    /* |STATUS_SUCCESS| if the daemon answered */
+    LONG daemon_status;
+    NFS41_FLIGHT_RECORD records[NFS41_FLIGHT_RECORDER_NUM_RECORDS];
+} NFS41_FLIGHT_RECORDER;
+
+/*
+ * Per-mount statistics, returned by |IOCTL_NFS41_GET_MOUNT_STATS|
+ *
+ * The kernel counts the upcalls of each NetRoot, the daemon counts
+ * the compounds of each |nfs41_root| (there is one root per NetRoot
+ * and security flavor/logon session), so that a slow server or
+ * export can be told apart from the others. The daemon part comes
+ * from the |NFS41_SYSOP_GET_MOUNT_STATS| downcall, at most
+ * |NFS41_MOUNT_STATS_MAX_MOUNTS| |NFS41_ROOT_STATS| must fit into the
+ * daemon's 16384 byte downcall buffer.
+ */
+#define NFS41_MOUNT_STATS_MAX_MOUNTS 40
+#define NFS41_MOUNT_STATS_NAME_LEN 128
+/*
+ * Slot waits longer than this are counted as slot starvation, and
+ * the daemon logs a warning (at most once per minute and mount)
+ */
+#define NFS41_SLOT_STARVATION_USECS (1000ULL * 1000ULL)
+
+/*
+ * Socket options ("sockbuf", "keepalive", "nodelay",
+ * "loopbackfastpath" and "rssaffinity" mount options) in the
+ * |NFS41_SYSOP_MOUNT| upcall. "sockbuf" is in kilobytes, 0 uses the
+ * Windows autotuning, |NFS41_MOUNT_SOCKBUF_DEFAULT| the daemon's
+ * default
+ */
+#define NFS41_MOUNT_SOCKBUF_DEFAULT             (~0UL)
+#define NFS41_MOUNT_SOCKOPT_NODELAY             0x0001
+#define NFS41_MOUNT_SOCKOPT_LOOPBACK_FASTPATH   0x0002
+#define NFS41_MOUNT_SOCKOPT_RSS_AFFINITY        0x0004
+
+typedef struct _NFS41_NETROOT_STATS {
+    /* NetRoot name, e.g. "\server@2049\nfs4\export", truncated */
+    WCHAR name[NFS41_MOUNT_STATS_NAME_LEN];
+    ULONGLONG upcalls;
+    /* Upcalls which returned an error */
+    ULONGLONG errors;
+    ULONGLONG read_bytes;
+    ULONGLONG write_bytes;
+    /* Time from queuing an upcall until its downcall arrived */
+    NFS41_LATENCY_HISTOGRAM latency;
+    /* Successful direct I/O READs/WRITEs, see |NFS41_DRIVER_DIRECT_IO| */
+    ULONGLONG direct_io;
+    ULONGLONG direct_io_usecs;
+    ULONGLONG direct_io_min_usecs;
+} NFS41_NETROOT_STATS;
+
+typedef struct _NFS41_ROOT_STATS {
+    /* "server@port:/export", truncated */
+    char name[NFS41_MOUNT_STATS_NAME_LEN];
+    /* |nfs41_root| handle, as returned by |NFS41_SYSOP_MOUNT| */
+    ULONGLONG root;
+    ULONG sec_flavor;
+    ULONG uid;
+    ULONG gid;
+    /* Current |max_slots| of the session's slot table */
+    ULONG max_slots;
+    ULONGLONG compounds;
+    /* READ/WRITE payload bytes */
+    ULONGLONG read_bytes;
+    ULONGLONG write_bytes;
+    /* Compounds sent again after an RPC error or reconnect */
+    ULONGLONG retransmits;
+    /* NFS4ERR_DELAY and NFS4ERR_GRACE replies */
+    ULONGLONG delays;
+    /* Compounds which had to wait for a session slot */
+    ULONGLONG slot_waits;
+    /* Total and longest time spent waiting for a session slot */
+    ULONGLONG slot_wait_usecs;
+    ULONGLONG slot_wait_max_usecs;
+    /* Slot waits longer than |NFS41_SLOT_STARVATION_USECS| */
+    ULONGLONG slot_starvations;
+    /*
+     * Changes of |max_slots| (from SEQUENCE target_highest_slotid,
+     * NFS4ERR_BADSLOT or CB_RECALL_SLOT), and how many of them came
+     * from CB_RECALL_SLOT
+     */
+    ULONGLONG slot_resizes;
+    ULONGLONG slot_recalls;
+    /* Highest slotid used so far */
+    ULONG highest_slot;
+    /*
+     * "autotune" mount option: measured RTT (microseconds) and
+     * bandwidth (kilobytes per second), and the chosen READ/WRITE size,
+     * pipeline depth, number of connections and readahead window
+     * (bytes). All zero without "autotune"
+     */
+    ULONG autotune_rtt_usecs;
+    ULONG autotune_bandwidth;
+    ULONG autotune_io_size;
+    ULONG autotune_depth;
+    ULONG autotune_connections;
+    ULONG autotune_readahead;
+    ULONG reserved;
+    /* RPC round trip of each compound */
+    NFS41_LATENCY_HISTOGRAM rpc;
+} NFS41_ROOT_STATS;
+
+typedef struct _NFS41_MOUNT_STATS {
+    ULONG num_netroots;
+    ULONG num_roots;
+    /* |STATUS_SUCCESS| if |roots| is valid */
+    LONG daemon_status;
+    NFS41_NETROOT_STATS netroots[NFS41_MOUNT_STATS_MAX_MOUNTS];
+    NFS41_ROOT_STATS roots[NFS41_MOUNT_STATS_MAX_MOUNTS];
+} NFS41_MOUNT_STATS;
+
+/*
+ * Hot files and directories, returned by |IOCTL_NFS41_GET_TOP_STATS|
+ *
+ * The input buffer is optional, a |ULONGLONG| |nfs41_root| handle (see
+ * |NFS41_ROOT_STATS.root|) limits the result to one mount, 0 or no
+ * input returns all mounts.
+ * The daemon samples the upcalls of each root (see
+ * |NFS41_DRIVER_DAEMON_TOP_STATS|), so |ops| and the other counters
+ * are estimates; |error| is the maximum overestimate of |ops|.
+ * At most |NFS41_TOP_STATS_MAX_ENTRIES| entries must fit into the
+ * daemon's 16384 byte downcall buffer.
+ */
+#define NFS41_TOP_STATS_MAX_ENTRIES 64
+#define NFS41_TOP_STATS_PATH_LEN 128
+
+#define NFS41_TOP_STATS_FLAG_DIR    0x0001
+
+typedef struct _NFS41_TOP_STATS_ENTRY {
+    /* |nfs41_root| handle */
+    ULONGLONG root;
+    ULONGLONG fileid;
+    ULONGLONG ops;
+    ULONGLONG error;
+    /* READ/WRITE payload bytes */
+    ULONGLONG read_bytes;
+    ULONGLONG write_bytes;
+    /* Total time the daemon spent in the upcalls */
+    ULONGLONG usecs;
+    ULONG flags; /* |NFS41_TOP_STATS_FLAG_*| */
+    ULONG reserved;
+    /* Most recent path, the tail is kept if it is too long */
+    char path[NFS41_TOP_STATS_PATH_LEN];
+} NFS41_TOP_STATS_ENTRY;
+
+typedef struct _NFS41_TOP_STATS {
+    ULONG num_entries;
+    /* |STATUS_SUCCESS| if |entries| is valid */
+    LONG daemon_status;
+    NFS41_TOP_STATS_ENTRY entries[NFS41_TOP_STATS_MAX_ENTRIES];
+} NFS41_TOP_STATS;
+
+/*
+ * Batched upcalls/downcalls
+ *
+ * |IOCTL_NFS41_READ_BATCH| returns one or more upcalls in one buffer,
+ * |IOCTL_NFS41_WRITE_BATCH| passes the downcalls for all of them back
+ * in one buffer. Both buffers start with a
+ * |NFS41_UPDOWNCALL_BATCH_HEADER|, followed by |count| records, each
+ * consisting of a |ULONG| length and the same data as a single
+ * |IOCTL_NFS41_READ|/|IOCTL_NFS41_WRITE| buffer.
+ * The output buffer of |IOCTL_NFS41_WRITE_BATCH| receives one
+ * |NTSTATUS| per downcall record.
+ *
+ * |IOCTL_NFS41_WRITE_READ_BATCH| takes the same input as
+ * |IOCTL_NFS41_WRITE_BATCH| and returns |NFS41_UPDOWNCALL_BATCH_MAX|
+ * |NTSTATUS| values (one per downcall record, the rest zero) followed
+ * by the next upcall batch as returned by |IOCTL_NFS41_READ_BATCH|.
+ * It does not wait for upcalls, the batch has a |count| of zero if
+ * none were queued. This saves one kernel round trip per batch while
+ * the daemon is busy.
+ *
+ * All upcalls of a batch belong to the same logon session, because
+ * the daemon thread is impersonated only once per batch.
+ * Daemons which only use |IOCTL_NFS41_READ|/|IOCTL_NFS41_WRITE| keep
+ * working with the single-request protocol.
+ */
+#define NFS41_UPDOWNCALL_BATCH_MAX 8
+/*
+ * Space which must be left in the |IOCTL_NFS41_READ_BATCH| buffer
+ * before another upcall is added to the batch (same as the daemon's
+ * single-request upcall buffer size)
+ */
+#define NFS41_UPDOWNCALL_BATCH_RECORD_SIZE 16384
+
+typedef struct _NFS41_UPDOWNCALL_BATCH_HEADER {
+    ULONG count;
+    /*
+     * Upcalls still queued in the kernel after an upcall batch was
+     * filled (zero in downcall batches), lets the daemon start more
+     * worker threads if there is a backlog
+     */
+    ULONG queued;
+} NFS41_UPDOWNCALL_BATCH_HEADER;
+
+/*
+ * Inline READ/WRITE data, see |NFS41_DRIVER_INLINE_RW|
+ *
+ * READ/WRITE upcalls of up to |NFS41_RW_INLINE_MAX| bytes pass a
+ * |NULL| buffer address. For WRITE the data follows the upcall
+ * arguments, for READ the daemon appends |out_len| bytes of data to
+ * the downcall. Both must fit into the 16384 byte upcall/downcall
+ * buffers.
+ */
+#define NFS41_RW_INLINE_MAX 8192
+
+/*
+ * |NFS41_SYSOP_READ|/|NFS41_SYSOP_WRITE| upcall flags, see
+ * |NFS41_DRIVER_DIRECT_IO|
+ */
+#define NFS41_RW_FLAG_DIRECT_IO         0x0001
+#define NFS41_RW_FLAG_WRITE_THROUGH     0x0002
+/* paging WRITE, see |NFS41_DRIVER_PAGING_WRITE_CLUSTERING| */
+#define NFS41_RW_FLAG_PAGING_IO         0x0004
+
+/*
+ * |NFS41_SYSOP_CLOSE| flags for the attribute changes sent with the
+ * CLOSE, see |NFS41_DRIVER_SETATTR_AT_CLOSE|
+ */
+#define NFS41_CLOSE_FLAG_SET_BASICINFO  0x0001
+#define NFS41_CLOSE_FLAG_SET_EOF        0x0002
+
+/*
+ * I/O buffer pool, see |NFS41_DRIVER_DAEMON_IO_POOL|
+ *
+ * After |IOCTL_NFS41_START| the daemon passes a
+ * |NFS41_IO_POOL_REGISTRATION| for a buffer in its own address space
+ * with |IOCTL_NFS41_SET_IO_POOL|. The buffer is split into
+ * |num_slots| slots of |slot_size| bytes. For READ/WRITE upcalls
+ * which fit into a slot the kernel passes the address of a free slot
+ * instead of mapping the caller's MDL into the daemon (unless the I/O
+ * is small enough to be passed inline), and copies the data into the
+ * slot (WRITE, while marshalling the upcall) or out of it (READ, while
+ * unmarshalling the downcall). Larger I/Os, or I/Os while all slots
+ * are in use, are still mapped.
+ * Nothing is locked or mapped by the kernel, the daemon must keep the
+ * buffer allocated until it exits. A |num_slots| of zero disables the
+ * pool, |IOCTL_NFS41_START| and |IOCTL_NFS41_STOP| reset it.
+ * With |NFS41_DRIVER_NUMA_BUFFER_POOLS| the slots are split into
+ * |num_nodes| equal ranges, range |n| being in the memory of NUMA node
+ * |n|. The kernel first looks for a free slot in the range of the node
+ * which queued the upcall. A |num_nodes| of zero or one means no split.
+ */
+#define NFS41_IO_POOL_MAX_SLOTS 256
+/* Upper limit for |slot_size|, must be a multiple of |PAGE_SIZE| */
+#define NFS41_IO_POOL_MAX_SLOT_SIZE (256*1024)
+
+typedef struct _NFS41_IO_POOL_REGISTRATION {
+    ULONGLONG base; /* page aligned */
+    ULONG slot_size;
+    ULONG num_slots;
+    ULONG num_nodes;
+    ULONG reserved;
+} NFS41_IO_POOL_REGISTRATION;
+
+/*
+ * |NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH| - the kernel passes up to
+ * |NFS41_COHERENCY_BATCH_MAX| open state handles of one session
+ * (|ULONG| count, followed by the |HANDLE|s), the daemon fetches the
+ * attributes of all of them with as few compounds as possible and
+ * returns one |DWORD| status and one |ULONGLONG| change attribute
+ * per handle
+ */
+#define NFS41_COHERENCY_BATCH_MAX 32
+
 /*
  * Same as |FILE_FS_ATTRIBUTE_INFORMATION| but with inline buffer
  * for 32 characters
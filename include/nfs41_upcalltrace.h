@@ -0,0 +1,102 @@
+/*
+ * NFSv4.1 client for Windows
+ * Copyright (C) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+#ifndef _NFS41_UPCALLTRACE_
+#define _NFS41_UPCALLTRACE_ 1
+
+/*
+ * Upcall trace file format
+ *
+ * Written by "nfsd --upcalltrace <file>", read by
+ * tests/upcallreplay/upcallreplay.exe.
+ * The file starts with one |NFS41_UPCALLTRACE_HEADER|, followed by
+ * |NFS41_UPCALLTRACE_RECORD|s until EOF. All values are in host byte
+ * order.
+ *
+ * Every upcall produces a request record when |upcall_parse()| has
+ * parsed it, and a reply record
+ * (|NFS41_UPCALLTRACE_FLAG_REPLY|) when the downcall has been
+ * marshalled. Both have the same |xid|.
+ * File names are not recorded, only a hash of the path. |file_id|
+ * identifies an open file: It is zero in the request record of
+ * |NFS41_SYSOP_OPEN|, the reply record carries the |file_id| which
+ * the following upcalls for that open use.
+ * The daemon might reuse a |file_id| after |NFS41_SYSOP_CLOSE|.
+ */
+
+#define NFS41_UPCALLTRACE_MAGIC     0x54435055 /* "UPCT" */
+#define NFS41_UPCALLTRACE_VERSION   1
+
+typedef struct _NFS41_UPCALLTRACE_HEADER {
+    ULONG magic;
+    ULONG version;
+    ULONG record_size; /* sizeof(NFS41_UPCALLTRACE_RECORD) */
+    ULONG reserved;
+    LONGLONG timestamp_frequency; /* |QueryPerformanceFrequency()| */
+    FILETIME start_time;
+} NFS41_UPCALLTRACE_HEADER;
+
+#define NFS41_UPCALLTRACE_FLAG_REPLY    0x0001
+
+/*
+ * Opcode specific fields
+ *
+ * |NFS41_SYSOP_OPEN|: |args[]| = { access mask, share access,
+ *      create disposition, create options }, |length| = file
+ *      attributes
+ * |NFS41_SYSOP_CLOSE|: |args[0]| = remove
+ * |NFS41_SYSOP_READ|, |NFS41_SYSOP_WRITE|: |offset|, |length|,
+ *      |args[0]| = |NFS41_RW_FLAG_*|
+ * |NFS41_SYSOP_LOCK|: |offset|, |length|, |args[]| = { exclusive,
+ *      blocking }
+ * |NFS41_SYSOP_UNLOCK|: |offset|, |length| of the first range,
+ *      |args[0]| = number of ranges
+ * |NFS41_SYSOP_FILE_QUERY|: |args[0]| = info class, |length| =
+ *      buffer length
+ * |NFS41_SYSOP_DIR_QUERY|: |args[]| = { info class, initial,
+ *      restart, single }, |length| = buffer length
+ * |NFS41_SYSOP_FILE_SET|: |args[0]| = info class, |length| = buffer
+ *      length, |offset| = new size for |FileEndOfFileInformation|
+ *      and |FileAllocationInformation|, |args[1]| = delete flag for
+ *      |FileDispositionInformation|
+ * |NFS41_SYSOP_VOLUME_QUERY|: |args[0]| = info class, |length| =
+ *      buffer length
+ * |NFS41_SYSOP_ACL_QUERY|, |NFS41_SYSOP_ACL_SET|: |args[0]| =
+ *      |SECURITY_INFORMATION|
+ *
+ * Reply records have the |status| of the upcall and the
+ * downcall size in |length|.
+ */
+typedef struct _NFS41_UPCALLTRACE_RECORD {
+    LONGLONG timestamp; /* ticks since |start_time| */
+    ULONGLONG xid;
+    ULONGLONG file_id;
+    ULONGLONG path_hash; /* FNV-1a, 64bit */
+    ULONGLONG offset;
+    ULONGLONG length;
+    ULONG opcode; /* |nfs41_opcodes| */
+    ULONG flags;
+    ULONG status;
+    ULONG upcall_size;
+    ULONG args[4];
+} NFS41_UPCALLTRACE_RECORD;
+
+#endif /* !_NFS41_UPCALLTRACE_ */
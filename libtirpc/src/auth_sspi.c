@@ -68,6 +68,17 @@ struct rpc_sspi_data {
 
 #define	AUTH_PRIVATE(auth)	((struct rpc_sspi_data *)auth->ah_private)
 
+/*
+ * One |AUTH| is used by concurrent calls, e.g. on the trunked
+ * connections of a session, which do not share a fd lock. So
+ * |authsspi_marshal()| takes the sequence number of a call with an
+ * atomic increment and only uses per-call copies of the credential
+ * and verifier, and passes the sequence number to |authsspi_wrap()|
+ * (which |clnt_call()| runs right after it on the same thread)
+ * in |authsspi_call_seq|.
+ */
+static __declspec(thread) u_int authsspi_call_seq = 0;
+
 static struct timeval AUTH_TIMEOUT = { 25, 0 };
 void print_rpc_gss_sec(struct rpc_sspi_sec *ptr);
 void print_negotiated_attrs(PCtxtHandle ctx);
@@ -75,7 +86,7 @@ void print_negotiated_attrs(PCtxtHandle ctx);
 AUTH *
 authsspi_create(CLIENT *clnt, sspi_name_t name, struct rpc_sspi_sec *sec)
 {
-	AUTH *auth, *save_auth;
+	AUTH *auth;
 	struct rpc_sspi_data *gd;
 
 	log_debug("in authgss_create()");
@@ -120,14 +131,14 @@ authsspi_create(CLIENT *clnt, sspi_name_t name, struct rpc_sspi_sec *sec)
 	auth->ah_ops = &authsspi_ops;
 	auth->ah_private = (caddr_t)gd;
 
-	save_auth = clnt->cl_auth;
-	clnt->cl_auth = auth;
-
+	/*
+	 * |authsspi_refresh()| uses |clnt_set_call_auth()| instead of
+	 * temporarily replacing |clnt->cl_auth|, which other threads
+	 * might be using
+	 */
 	if (!authsspi_refresh(auth, NULL))
 		auth = NULL;
 
-	clnt->cl_auth = save_auth;
-
 	return (auth);
 }
 
@@ -207,6 +218,8 @@ authsspi_marshal(AUTH *auth, XDR *xdrs, u_int *seq)
 	XDR tmpxdrs;
 	char tmp[MAX_AUTH_BYTES];
 	struct rpc_sspi_data *gd;
+	struct rpc_sspi_cred gc;
+	struct opaque_auth cred, verf;
 	sspi_buffer_desc rpcbuf, checksum;
 	uint32_t maj_stat;
 	bool_t xdr_stat;
@@ -214,31 +227,35 @@ authsspi_marshal(AUTH *auth, XDR *xdrs, u_int *seq)
     log_debug("in authgss_marshal()");
 
 	gd = AUTH_PRIVATE(auth);
+	gc = gd->gc;
 
 	if (gd->established) {
-		gd->gc.gc_seq++;
-        *seq = gd->gc.gc_seq;
-    }
+		gc.gc_seq = (u_int)InterlockedIncrement(
+			(volatile LONG *)&gd->gc.gc_seq);
+		if (seq)
+			*seq = gc.gc_seq;
+	}
+	authsspi_call_seq = gc.gc_seq;
 
 	xdrmem_create(&tmpxdrs, tmp, sizeof(tmp), XDR_ENCODE);
 
-	if (!xdr_rpc_sspi_cred(&tmpxdrs, &gd->gc)) {
+	if (!xdr_rpc_sspi_cred(&tmpxdrs, &gc)) {
         log_debug("authsspi_marshal: xdr_rpc_sspi_cred failed");
 		XDR_DESTROY(&tmpxdrs);
 		return (FALSE);
 	}
-	auth->ah_cred.oa_flavor = RPCSEC_GSS;
-	auth->ah_cred.oa_base = tmp;
-	auth->ah_cred.oa_length = XDR_GETPOS(&tmpxdrs);
+	cred.oa_flavor = RPCSEC_GSS;
+	cred.oa_base = tmp;
+	cred.oa_length = XDR_GETPOS(&tmpxdrs);
 
 	XDR_DESTROY(&tmpxdrs);
 
-	if (!xdr_opaque_auth(xdrs, &auth->ah_cred)) {
+	if (!xdr_opaque_auth(xdrs, &cred)) {
         log_debug("authsspi_marshal: failed to xdr GSS CRED");
 		return (FALSE);
     }
-	if (gd->gc.gc_proc == RPCSEC_SSPI_INIT ||
-	    gd->gc.gc_proc == RPCSEC_SSPI_CONTINUE_INIT) {
+	if (gc.gc_proc == RPCSEC_SSPI_INIT ||
+	    gc.gc_proc == RPCSEC_SSPI_CONTINUE_INIT) {
 		return (xdr_opaque_auth(xdrs, &_null_auth));
 	}
 	/* Checksum serialized RPC header, up to and including credential. */
@@ -251,7 +268,7 @@ authsspi_marshal(AUTH *auth, XDR *xdrs, u_int *seq)
 	maj_stat = gss_get_mic(&min_stat, gd->ctx, gd->sec.qop,
 			    &rpcbuf, &checksum);
 #else
-    maj_stat = sspi_get_mic(&gd->ctx, 0, gd->gc.gc_seq, &rpcbuf, &checksum);
+    maj_stat = sspi_get_mic(&gd->ctx, 0, gc.gc_seq, &rpcbuf, &checksum);
 #endif
 	if (maj_stat != SEC_E_OK) {
 		log_debug("authsspi_marshal: sspi_get_mic failed with %x", maj_stat);
@@ -261,10 +278,10 @@ authsspi_marshal(AUTH *auth, XDR *xdrs, u_int *seq)
 		}
 		return (FALSE);
 	}
-	auth->ah_verf.oa_flavor = RPCSEC_GSS;
-	auth->ah_verf.oa_base = checksum.value;
-	auth->ah_verf.oa_length = checksum.length;
-	xdr_stat = xdr_opaque_auth(xdrs, &auth->ah_verf);
+	verf.oa_flavor = RPCSEC_GSS;
+	verf.oa_base = checksum.value;
+	verf.oa_length = checksum.length;
+	xdr_stat = xdr_opaque_auth(xdrs, &verf);
 #if 0
 	gss_release_buffer(&min_stat, &checksum);
 #else
@@ -451,6 +468,7 @@ authsspi_refresh(AUTH *auth, void *tmp)
 				  send_token.length);
 			log_hexdump(0, "", send_token.value, send_token.length, 0);
 
+			clnt_set_call_auth(auth);
 			call_stat = clnt_call(gd->clnt, NULLPROC,
 					      (xdrproc_t)xdr_rpc_sspi_init_args,
 					      &send_token,
@@ -562,6 +580,49 @@ authsspi_service(AUTH *auth, int svc)
 	return (TRUE);
 }
 
+/* Expiry time of the established context, in local time */
+bool_t
+authsspi_get_expiry(AUTH *auth, TimeStamp *expiry)
+{
+	struct rpc_sspi_data *gd = AUTH_PRIVATE(auth);
+
+	if ((gd == NULL) || (!gd->established))
+		return (FALSE);
+	*expiry = gd->expiry;
+	return (TRUE);
+}
+
+/*
+ * Returns the sequence window the server granted for the context of
+ * |auth|, or 0 if it is not established. Callers should keep fewer
+ * calls than this in flight on |auth|, otherwise the server may
+ * silently drop calls whose sequence number fell out of the window
+ * (RFC 2203, section 5.3.3.1)
+ */
+u_int
+authsspi_get_window(AUTH *auth)
+{
+	struct rpc_sspi_data *gd = AUTH_PRIVATE(auth);
+
+	if ((gd == NULL) || (!gd->established))
+		return (0);
+	return (gd->win);
+}
+
+/*
+ * Use |clnt| for context (re-)establishment and destruction, e.g.
+ * after the connection |auth| was created with has been replaced.
+ * The context itself is not bound to a connection.
+ */
+void
+authsspi_set_clnt(AUTH *auth, CLIENT *clnt)
+{
+	struct rpc_sspi_data *gd = AUTH_PRIVATE(auth);
+
+	if (gd != NULL)
+		gd->clnt = clnt;
+}
+
 static void
 authsspi_destroy_context(AUTH *auth)
 {
@@ -575,6 +636,7 @@ authsspi_destroy_context(AUTH *auth)
 	if (SecIsValidHandle(&gd->ctx)) {
 		if (gd->established) {
 			gd->gc.gc_proc = RPCSEC_SSPI_DESTROY;
+			clnt_set_call_auth(auth);
 			clnt_call(gd->clnt, NULLPROC, (xdrproc_t)xdr_void, NULL,
 				  (xdrproc_t)xdr_void, NULL, AUTH_TIMEOUT);
             DeleteSecurityContext(&gd->ctx);
@@ -635,7 +697,7 @@ authsspi_wrap(AUTH *auth, XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr)
 	}
 	return (xdr_rpc_sspi_data(xdrs, xdr_func, xdr_ptr,
 				 &gd->ctx, gd->sec->qop,
-				 gd->sec->svc, gd->gc.gc_seq));
+				 gd->sec->svc, authsspi_call_seq));
 }
 
 bool_t
@@ -793,6 +855,76 @@ out:
     return maj_stat;
 }
 
+uint32_t sspi_wrap_sizes(void *arg_ctx, u_int *trailer_len, u_int *padding_len)
+{
+    PCtxtHandle ctx = arg_ctx;
+    SecPkgContext_Sizes ContextSizes;
+    uint32_t maj_stat;
+
+    maj_stat = QueryContextAttributes(ctx, SECPKG_ATTR_SIZES,
+       &ContextSizes);
+    if (maj_stat != SEC_E_OK)
+        return maj_stat;
+
+    *trailer_len = ContextSizes.cbSecurityTrailer;
+    *padding_len = ContextSizes.cbBlockSize;
+    return SEC_E_OK;
+}
+
+/*
+ * Encrypt in place: |buf| has room for |trailer_len| bytes of
+ * security trailer, followed by |data_len| bytes of plaintext and
+ * room for |padding_len| bytes of padding (see |sspi_wrap_sizes()|).
+ * On success the wrap token (trailer + ciphertext + padding) starts
+ * at |buf| and is |*wrap_len| bytes long - the same layout
+ * |sspi_wrap()| produces, but without allocating and copying.
+ */
+uint32_t sspi_wrap_inplace(void *arg_ctx, u_int seq, u_char *buf,
+                           u_int trailer_len, u_int data_len,
+                           u_int padding_len, u_int *wrap_len)
+{
+    PCtxtHandle ctx = arg_ctx;
+    uint32_t maj_stat;
+    SecBufferDesc BuffDesc;
+    SecBuffer SecBuff[3];
+    ULONG ulQop = 0;
+    u_char *p;
+
+    BuffDesc.ulVersion = 0;
+    BuffDesc.cBuffers = 3;
+    BuffDesc.pBuffers = SecBuff;
+
+    SecBuff[0].cbBuffer = trailer_len;
+    SecBuff[0].BufferType = SECBUFFER_TOKEN;
+    SecBuff[0].pvBuffer = buf;
+
+    SecBuff[1].cbBuffer = data_len;
+    SecBuff[1].BufferType = SECBUFFER_DATA;
+    SecBuff[1].pvBuffer = buf + trailer_len;
+    log_hexdump(0, "plaintext:", SecBuff[1].pvBuffer, data_len, 0);
+
+    SecBuff[2].cbBuffer = padding_len;
+    SecBuff[2].BufferType = SECBUFFER_PADDING;
+    SecBuff[2].pvBuffer = buf + trailer_len + data_len;
+
+    maj_stat = EncryptMessage(ctx, ulQop, &BuffDesc, seq);
+    if (maj_stat != SEC_E_OK)
+        return maj_stat;
+
+    /* The token can be shorter than |trailer_len|, close the gaps */
+    p = buf + SecBuff[0].cbBuffer;
+    if (p != SecBuff[1].pvBuffer)
+        memmove(p, SecBuff[1].pvBuffer, SecBuff[1].cbBuffer);
+    p += SecBuff[1].cbBuffer;
+    if (p != SecBuff[2].pvBuffer)
+        memmove(p, SecBuff[2].pvBuffer, SecBuff[2].cbBuffer);
+    p += SecBuff[2].cbBuffer;
+    *wrap_len = (u_int)(p - buf);
+
+    log_hexdump(0, "cipher:", buf, *wrap_len, 0);
+    return SEC_E_OK;
+}
+
 uint32_t sspi_unwrap(void *arg_ctx, u_int seq, sspi_buffer_desc *bufin,
                      sspi_buffer_desc *bufout, u_int *conf_state,
                      unsigned long *qop_state)
@@ -832,6 +964,48 @@ uint32_t sspi_unwrap(void *arg_ctx, u_int seq, sspi_buffer_desc *bufin,
     return SEC_E_OK;
 }
 
+/*
+ * Decrypt |bufin| in place, |bufout| points to the plaintext inside
+ * |bufin->value| and must not be released
+ */
+uint32_t sspi_unwrap_inplace(void *arg_ctx, u_int seq, sspi_buffer_desc *bufin,
+                             sspi_buffer_desc *bufout, u_int *conf_state,
+                             unsigned long *qop_state)
+{
+    PCtxtHandle ctx = arg_ctx;
+    uint32_t maj_stat;
+    SecBufferDesc BuffDesc;
+    SecBuffer SecBuff[2];
+    ULONG ulQop = 0;
+
+    BuffDesc.ulVersion    = 0;
+    BuffDesc.cBuffers     = 2;
+    BuffDesc.pBuffers     = SecBuff;
+
+    SecBuff[0].cbBuffer   = bufin->length;
+    SecBuff[0].BufferType = SECBUFFER_STREAM;
+    SecBuff[0].pvBuffer   = bufin->value;
+
+    SecBuff[1].cbBuffer   = 0;
+    SecBuff[1].BufferType = SECBUFFER_DATA;
+    SecBuff[1].pvBuffer   = NULL;
+
+    log_hexdump(0, "cipher:", bufin->value, bufin->length, 0);
+
+    maj_stat = DecryptMessage(ctx, &BuffDesc, seq, &ulQop);
+    if (maj_stat != SEC_E_OK) return maj_stat;
+
+    bufout->length = SecBuff[1].cbBuffer;
+    bufout->value = SecBuff[1].pvBuffer;
+
+    log_hexdump(0, "data:", bufout->value, bufout->length, 0);
+
+    *conf_state = 1;
+    *qop_state = 0;
+
+    return SEC_E_OK;
+}
+
 /* useful as i add more mechanisms */
 #define DEBUG
 #ifdef DEBUG
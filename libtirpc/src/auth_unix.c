@@ -202,6 +202,55 @@ authunix_create(
 #endif
 }
 
+/*
+ * Create a unix style authenticator from the XDR encoded
+ * authunix_parms in cred (e.g. a credential cached by the caller),
+ * without encoding the parameters again.
+ */
+AUTH *
+authunix_create_marshalled(const char *cred, u_int len)
+{
+	AUTH *auth;
+	struct audata *au;
+
+	if ((len == 0) || (len > MAX_AUTH_BYTES))
+		return (NULL);
+
+	au = NULL;
+	auth = mem_alloc(sizeof(*auth));
+	if (auth == NULL) {
+		warnx("authunix_create_marshalled: out of memory");
+		goto cleanup_authunix_create_marshalled;
+	}
+	au = mem_alloc(sizeof(*au));
+	if (au == NULL) {
+		warnx("authunix_create_marshalled: out of memory");
+		goto cleanup_authunix_create_marshalled;
+	}
+	auth->ah_ops = authunix_ops();
+	auth->ah_private = (caddr_t)au;
+	auth->ah_verf = au->au_shcred = _null_auth;
+	au->au_shfaults = 0;
+
+	au->au_origcred.oa_length = len;
+	au->au_origcred.oa_flavor = AUTH_UNIX;
+	if ((au->au_origcred.oa_base = mem_alloc(len)) == NULL) {
+		warnx("authunix_create_marshalled: out of memory");
+		goto cleanup_authunix_create_marshalled;
+	}
+	memmove(au->au_origcred.oa_base, cred, (size_t)len);
+
+	auth->ah_cred = au->au_origcred;
+	marshal_new_auth(auth);
+	return (auth);
+ cleanup_authunix_create_marshalled:
+	if (auth)
+		mem_free(auth, sizeof(*auth));
+	if (au)
+		mem_free(au, sizeof(*au));
+	return (NULL);
+}
+
 /*
  * Returns an auth handle with parameters determined by doing lots of
  * syscalls.
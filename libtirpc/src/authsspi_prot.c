@@ -33,6 +33,9 @@
 #include <rpc/auth_sspi.h>
 #include <rpc/rpc.h>
 #include <security.h>
+#include <limits.h>
+
+#include "rpc_com.h"
 
 bool_t
 xdr_rpc_sspi_cred(XDR *xdrs, struct rpc_sspi_cred *p)
@@ -96,6 +99,63 @@ xdr_rpc_sspi_init_res(XDR *xdrs, struct rpc_sspi_init_res *p)
 	return (xdr_stat);
 }
 
+/*
+ * Encrypt rpc_gss_data_t in place in the output buffer.
+ * Returns |FALSE| if the caller has to use the copying path instead,
+ * otherwise |*xdr_stat| is the result.
+ */
+static bool_t
+xdr_rpc_sspi_wrap_priv_inplace(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
+			      PCtxtHandle ctx, u_int seq, bool_t *xdr_stat)
+{
+	static const char xdr_zero[BYTES_PER_XDR_UNIT] = { 0, 0, 0, 0 };
+	u_int trailer_len, padding_len, data_len, wrap_len;
+	u_int start, end;
+	uint32_t maj_stat;
+	u_char *buf;
+
+	if (sspi_wrap_sizes(ctx, &trailer_len, &padding_len) != SEC_E_OK)
+		return (FALSE);
+
+	/* Skip databody length and leave room for the security trailer */
+	start = XDR_GETPOS(xdrs);
+	if (!XDR_SETPOS(xdrs, start + 4 + trailer_len))
+		return (FALSE);
+
+	*xdr_stat = FALSE;
+	/* Marshal rpc_gss_data_t (sequence number + arguments). */
+	if (!xdr_u_int(xdrs, &seq) || !(*xdr_func)(xdrs, xdr_ptr))
+		return (TRUE);
+	end = XDR_GETPOS(xdrs);
+	data_len = end - start - 4 - trailer_len;
+
+	/*
+	 * We need room for the padding, and one more XDR unit so that
+	 * |XDR_SETPOS()| to the end of the token stays inside the buffer
+	 */
+	if (!XDR_SETPOS(xdrs, start + 4))
+		return (!XDR_SETPOS(xdrs, start));
+	buf = (u_char *)XDR_INLINE(xdrs,
+		trailer_len + data_len + padding_len + BYTES_PER_XDR_UNIT);
+	if (buf == NULL)
+		return (!XDR_SETPOS(xdrs, start));
+
+	maj_stat = sspi_wrap_inplace(ctx, 0, buf, trailer_len, data_len,
+		padding_len, &wrap_len);
+	if (maj_stat != SEC_E_OK) {
+		log_debug("xdr_rpc_sspi_wrap_priv_inplace: sspi_wrap_inplace "
+			"failed with %x", maj_stat);
+		return (TRUE);
+	}
+
+	/* Marshal databody_priv length and XDR padding */
+	if (!XDR_SETPOS(xdrs, start) || !xdr_u_int(xdrs, &wrap_len) ||
+		!XDR_SETPOS(xdrs, start + 4 + wrap_len))
+		return (TRUE);
+	*xdr_stat = XDR_PUTBYTES(xdrs, xdr_zero, RNDUP(wrap_len) - wrap_len);
+	return (TRUE);
+}
+
 bool_t
 xdr_rpc_sspi_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 		      PCtxtHandle ctx, sspi_qop_t qop,
@@ -105,9 +165,23 @@ xdr_rpc_sspi_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 	uint32_t maj_stat;
 	int start, end;
         u_int conf_state;
-	bool_t xdr_stat;
+	bool_t xdr_stat, norefs;
 
     log_debug("in xdr_rpc_sspi_wrap_data()");
+
+	/*
+	 * The arguments are checksummed/encrypted in the output buffer,
+	 * so they must not be sent from referenced user buffers
+	 */
+	norefs = __xdrrec_setnorefs(xdrs, TRUE);
+
+	if ((svc == RPCSEC_SSPI_SVC_PRIVACY) &&
+		xdr_rpc_sspi_wrap_priv_inplace(xdrs, xdr_func, xdr_ptr,
+			ctx, seq, &xdr_stat)) {
+		goto out;
+	}
+
+	xdr_stat = FALSE;
 
     /* Skip databody length. */
 	start = XDR_GETPOS(xdrs);
@@ -115,7 +189,7 @@ xdr_rpc_sspi_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 
 	/* Marshal rpc_gss_data_t (sequence number + arguments). */
 	if (!xdr_u_int(xdrs, &seq) || !(*xdr_func)(xdrs, xdr_ptr))
-		return (FALSE);
+		goto out;
 	end = XDR_GETPOS(xdrs);
 
 	/* Set databuf to marshalled rpc_gss_data_t. */
@@ -123,13 +197,11 @@ xdr_rpc_sspi_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 	XDR_SETPOS(xdrs, start + 4);
 	databuf.value = XDR_INLINE(xdrs, databuf.length);
 
-	xdr_stat = FALSE;
-
 	if (svc == RPCSEC_SSPI_SVC_INTEGRITY) {
 		/* Marshal databody_integ length. */
 		XDR_SETPOS(xdrs, start);
 		if (!xdr_u_int(xdrs, (u_int *)&databuf.length))
-			return (FALSE);
+			goto out;
 
 		/* Checksum rpc_gss_data_t. */
 #if 0
@@ -140,7 +212,7 @@ xdr_rpc_sspi_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 #endif
 		if (maj_stat != SEC_E_OK) {
 			log_debug("xdr_rpc_sspi_wrap_data: sspi_get_mic failed with %x", maj_stat);
-			return (FALSE);
+			goto out;
 		}
 		/* Marshal checksum. */
 		XDR_SETPOS(xdrs, end);
@@ -162,7 +234,7 @@ xdr_rpc_sspi_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 #endif
 		if (maj_stat != SEC_E_OK) {
 			log_debug("xdr_rpc_sspi_wrap_data: sspi_wrap failed with %x", maj_stat);
-			return (FALSE);
+			goto out;
 		}
 		/* Marshal databody_priv. */
 		XDR_SETPOS(xdrs, start);
@@ -174,9 +246,44 @@ xdr_rpc_sspi_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
         sspi_release_buffer(&wrapbuf);
 #endif
 	}
+out:
+	(void)__xdrrec_setnorefs(xdrs, norefs);
 	return (xdr_stat);
 }
 
+/*
+ * Decode an opaque<> without copying it if it is contiguous in the
+ * input buffer. Otherwise it is copied into |*mem|, which the caller
+ * must |free()|.
+ */
+static bool_t
+xdr_rpc_sspi_opaque_inplace(XDR *xdrs, sspi_buffer_desc *buf, char **mem)
+{
+	u_int len, rndup;
+
+	*mem = NULL;
+	if (!xdr_u_int(xdrs, &len))
+		return (FALSE);
+	rndup = RNDUP(len);
+	if ((rndup < len) || (len > INT_MAX))
+		return (FALSE);
+	buf->length = (int)len;
+	buf->value = XDR_INLINE(xdrs, rndup);
+	if (buf->value != NULL)
+		return (TRUE);
+
+	*mem = malloc((rndup > 0)?rndup:1);
+	if (*mem == NULL)
+		return (FALSE);
+	if (!XDR_GETBYTES(xdrs, *mem, rndup)) {
+		free(*mem);
+		*mem = NULL;
+		return (FALSE);
+	}
+	buf->value = *mem;
+	return (TRUE);
+}
+
 bool_t
 xdr_rpc_sspi_unwrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 			PCtxtHandle ctx, sspi_qop_t qop,
@@ -184,6 +291,7 @@ xdr_rpc_sspi_unwrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 {
 	XDR tmpxdrs;
 	sspi_buffer_desc databuf, wrapbuf;
+	char *mem = NULL;
 	uint32_t maj_stat;
 	u_int seq_num;
         unsigned long qop_state;
@@ -199,74 +307,42 @@ xdr_rpc_sspi_unwrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 	memset(&wrapbuf, 0, sizeof(wrapbuf));
 
 	if (svc == RPCSEC_SSPI_SVC_INTEGRITY) {
-		/* Decode databody_integ. */
-		if (!xdr_bytes(xdrs, (char **)&databuf.value, (u_int *)&databuf.length,
-                        (u_int)-1)) {
+		/* Decode databody_integ, in place if possible. */
+		if (!xdr_rpc_sspi_opaque_inplace(xdrs, &databuf, &mem)) {
 			log_debug("xdr_rpc_sspi_unwrap_data: xdr decode databody_integ failed");
 			return (FALSE);
 		}
 		/* Decode checksum. */
 		if (!xdr_bytes(xdrs, (char **)&wrapbuf.value, (u_int *)&wrapbuf.length,
                         MAX_NETOBJ_SZ)) {
-#if 0
-			gss_release_buffer(&min_stat, &databuf);
-#else
-            sspi_release_buffer(&databuf);
-#endif
+			free(mem);
 			log_debug("xdr_rpc_sspi_unwrap_data: xdr decode checksum failed");
 			return (FALSE);
 		}
 		/* Verify checksum and QOP. */
-#if 0
-		maj_stat = gss_verify_mic(&min_stat, ctx, &databuf,
-					  &wrapbuf, &qop_state);
-#else
-        maj_stat = sspi_verify_mic(ctx, seq, &databuf, &wrapbuf, &qop_state);
-#endif
-#if 0
-		gss_release_buffer(&min_stat, &wrapbuf);
-#else
-        sspi_release_buffer(&wrapbuf);
-#endif
+		maj_stat = sspi_verify_mic(ctx, seq, &databuf, &wrapbuf, &qop_state);
+		sspi_release_buffer(&wrapbuf);
 
 		if (maj_stat != SEC_E_OK) {
-#if 0
-			gss_release_buffer(&min_stat, &databuf);
-#else
-            sspi_release_buffer(&databuf);
-#endif
+			free(mem);
 			log_debug("xdr_rpc_sspi_unwrap_data: sspi_verify_mic "
                         "failed with %x", maj_stat);
 			return (FALSE);
 		}
 	}
 	else if (svc == RPCSEC_SSPI_SVC_PRIVACY) {
-		/* Decode databody_priv. */
-		if (!xdr_bytes(xdrs, (char **)&wrapbuf.value, (u_int *)&wrapbuf.length,
-                        (u_int)-1)) {
+		/* Decode databody_priv, in place if possible. */
+		if (!xdr_rpc_sspi_opaque_inplace(xdrs, &wrapbuf, &mem)) {
 			log_debug("xdr_rpc_sspi_unwrap_data: xdr decode databody_priv failed");
 			return (FALSE);
 		}
-		/* Decrypt databody. */
-#if 0
-		maj_stat = gss_unwrap(&min_stat, ctx, &wrapbuf, &databuf,
-				      &conf_state, &qop_state);
-#else
-        maj_stat = sspi_unwrap(ctx, seq, &wrapbuf, &databuf, &conf_state, &qop_state);
-#endif
-#if 0
-		gss_release_buffer(&min_stat, &wrapbuf);
-#else
-        sspi_release_buffer(&wrapbuf);
-#endif
+		/* Decrypt databody, |databuf| points into |wrapbuf| */
+		maj_stat = sspi_unwrap_inplace(ctx, seq, &wrapbuf, &databuf,
+			&conf_state, &qop_state);
 		/* Verify encryption and QOP. */
 		if (maj_stat != SEC_E_OK) {
-#if 0
-			gss_release_buffer(&min_stat, &databuf);
-#else
-            sspi_release_buffer(&databuf);
-#endif
-			log_debug("xdr_rpc_sspi_unwrap_data: sspi_unwrap failed with %x", maj_stat);
+			free(mem);
+			log_debug("xdr_rpc_sspi_unwrap_data: sspi_unwrap_inplace failed with %x", maj_stat);
 			return (FALSE);
 		}
 	}
@@ -275,11 +351,7 @@ xdr_rpc_sspi_unwrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 	xdr_stat = (xdr_u_int(&tmpxdrs, &seq_num) &&
                 (*xdr_func)(&tmpxdrs, xdr_ptr));
 	XDR_DESTROY(&tmpxdrs);
-#if 0
-	gss_release_buffer(&min_stat, &databuf);
-#else
-    sspi_release_buffer(&databuf);
-#endif
+	free(mem);
 	/* Verify sequence number. */
 	if (xdr_stat == TRUE && seq_num != seq) {
 		log_debug("wrong sequence number in databody received %d expected %d",
@@ -105,6 +105,50 @@
 
 #define DEBUG_TIRPC_CB_DEADLOCKS 1
 
+/*
+ * TIRPC_CLNT_VC_MULTIPLEX - multiplex concurrent RPC calls over one
+ * connection
+ *
+ * A dedicated receive thread per connection reads complete RPC
+ * records from the socket and hands REPLY records to the calling
+ * thread waiting for the matching xid (and processes CALL records
+ * for the NFSv4.1 backchannel itself).
+ * Calling threads only hold the per-fd lock while sending, so
+ * multiple RPCs can be in flight on the same connection, instead of
+ * having each thread poll the socket with |SwitchToThread()| until
+ * its own xid turns up.
+ */
+#define TIRPC_CLNT_VC_MULTIPLEX 1
+
+/*
+ * TIRPC_CLNT_VC_CB_WORKERS - number of backchannel worker threads
+ * per connection
+ *
+ * With |TIRPC_CLNT_VC_MULTIPLEX| the receive thread queues backchannel
+ * CALL records to a small pool of worker threads, which run
+ * |cl->cb_fn| and send the reply. A slow callback (e.g. a delegation
+ * or layout recall) then no longer blocks the reception of replies
+ * on the same connection, and a recall storm is processed in
+ * parallel (the server can send more than one callback at a time if
+ * it got more than one backchannel slot in CREATE_SESSION).
+ * Zero processes callbacks in the receive thread.
+ */
+#define TIRPC_CLNT_VC_CB_WORKERS 4
+
+/*
+ * TIRPC_CLNT_VC_SEND_COALESCING - gather the RPC records of
+ * concurrent callers into one send
+ *
+ * With |TIRPC_CLNT_VC_MULTIPLEX| a caller which finishes its record
+ * while other callers wait for the per-fd lock leaves the record in
+ * the xdrrec output buffer, and the last caller of the group sends
+ * all of them with one |write_vc()|/|writev_vc()|. A caller without
+ * anybody waiting behind it sends at once, as do records with
+ * |xdr_opaque_ref()| payloads, and the buffer is sent when it has
+ * more than |CT_SEND_COALESCE_MAX_BYTES| bytes of records.
+ */
+#define TIRPC_CLNT_VC_SEND_COALESCING 1
+
 
 #define MCALL_MSG_SIZE 24
 
@@ -143,6 +187,57 @@ static struct clnt_ops *clnt_vc_ops(void);
 static bool_t time_not_ok(struct timeval *);
 static int read_vc(void *, void *, int);
 static int write_vc(void *, void *, int);
+static int writev_vc(void *, WSABUF *, int);
+
+#ifdef TIRPC_CLNT_VC_MULTIPLEX
+static enum clnt_stat clnt_vc_mpx_call(CLIENT *, rpcproc_t, xdrproc_t,
+    void *, xdrproc_t, void *, struct timeval);
+
+/* Must be a power of two */
+#define CT_PENDING_HASH_SIZE 512
+#define CT_PENDING_HASH(xid) ((xid) & (CT_PENDING_HASH_SIZE-1))
+
+/* Poll interval of the receive thread, to check for |cl->shutdown| */
+#define CT_RECV_POLL_TIMEOUT 500
+/* Upper limit for a single RPC record, to catch garbage record marks */
+#define CT_MAX_RECORD_SIZE (64*1024*1024)
+/* xdrrec input buffer size, records are read by the receive thread */
+#define CT_MPX_XDRREC_RECVSZ 4096
+/* Record mark bit for the last fragment of a record (RFC 5531) */
+#define CT_LAST_FRAG ((u_int32_t)(1UL << 31))
+#ifdef TIRPC_CLNT_VC_SEND_COALESCING
+/* Max. bytes of records which wait for the next caller's send */
+#define CT_SEND_COALESCE_MAX_BYTES (32*1024)
+#endif /* TIRPC_CLNT_VC_SEND_COALESCING */
+/*
+ * Bytes read from the first fragment of a reply before looking for a
+ * |clnt_reply_placement| payload, must cover the RPC reply header and
+ * the part of the results in front of the payload
+ */
+#define CT_PLACEMENT_PEEK_LEN 256
+
+/* A call waiting for its reply */
+struct ct_pending_call {
+	struct ct_pending_call *next;
+	u_int32_t	xid;
+	cond_t		cv;
+	bool_t		done;
+	enum clnt_stat	status;
+	char		*reply_buf;	/* complete reply record */
+	u_int		reply_len;
+	/* payload placement requested by the caller, or |NULL| */
+	const struct clnt_reply_placement *placement;
+	/* receive thread is writing into the placement's buffer */
+	bool_t		placing;
+};
+
+/* A backchannel CALL record waiting for a worker thread */
+struct ct_cb_work {
+	struct ct_cb_work *next;
+	char		*buf;	/* complete call record */
+	u_int		len;
+};
+#endif /* TIRPC_CLNT_VC_MULTIPLEX */
 
 struct ct_data {
 	int		ct_fd;		/* connection's fd */
@@ -159,6 +254,25 @@ struct ct_data {
 	XDR		ct_xdrs;	/* XDR stream */
     struct rpc_msg reply_msg;
     bool_t use_stored_reply_msg;
+#ifdef TIRPC_CLNT_VC_MULTIPLEX
+	mutex_t		ct_mpx_lock;	/* protects ct_pending+ct_recv_status */
+	struct ct_pending_call *ct_pending[CT_PENDING_HASH_SIZE];
+	/* != |RPC_SUCCESS| if the receive thread has terminated */
+	enum clnt_stat	ct_recv_status;
+#ifdef TIRPC_CLNT_VC_SEND_COALESCING
+	/* callers waiting for the fd lock in |clnt_vc_mpx_call()| */
+	volatile LONG	ct_send_waiters;
+#endif /* TIRPC_CLNT_VC_SEND_COALESCING */
+#if TIRPC_CLNT_VC_CB_WORKERS > 0
+	mutex_t		ct_cb_lock;	/* protects ct_cb_queue+ct_cb_shutdown */
+	cond_t		ct_cb_cv;
+	struct ct_cb_work *ct_cb_queue;	/* FIFO, |ct_cb_queue_tail| */
+	struct ct_cb_work *ct_cb_queue_tail;
+	bool_t		ct_cb_shutdown;
+	HANDLE		ct_cb_workers[TIRPC_CLNT_VC_CB_WORKERS];
+	int		ct_cb_nworkers;
+#endif /* TIRPC_CLNT_VC_CB_WORKERS > 0 */
+#endif /* TIRPC_CLNT_VC_MULTIPLEX */
 };
 
 /*
@@ -226,6 +340,7 @@ static const char __no_mem_str[] = "out of memory";
 /* callback thread */
 #define CALLBACK_TIMEOUT 5000
 #define	RQCRED_SIZE	400	/* this size is excessive */
+#ifndef TIRPC_CLNT_VC_MULTIPLEX
 static unsigned int WINAPI clnt_cb_thread(void *args) 
 {
     int status = NO_ERROR;
@@ -376,6 +491,533 @@ skip_setlastfrag:
 out:
     return status;
 }
+#else
+/*
+ * Read exactly |len| bytes from the connection.
+ * Returns |FALSE| if the connection failed or |cl->shutdown| was set.
+ */
+static bool_t
+mpx_read_exact(CLIENT *cl, struct ct_data *ct, char *buf, u_int len)
+{
+	struct pollfd fd;
+	int n;
+
+	fd.fd = wintirpc_fd2sockethandle(ct->ct_fd);
+	fd.events = POLLIN;
+
+	while (len > 0) {
+		if (cl->shutdown)
+			return FALSE;
+
+		switch (poll(&fd, 1, CT_RECV_POLL_TIMEOUT)) {
+		case 0:
+			continue;
+		case SOCKET_ERROR:
+			if (WSAGetLastError() == WSAEINTR)
+				continue;
+			return FALSE;
+		}
+
+		n = (int)wintirpc_recv(ct->ct_fd, buf, (size_t)len, 0);
+		if ((n == 0) || (n == SOCKET_ERROR)) {
+			(void)fprintf(stderr, "%04lx: mpx: recv() failed, "
+				"n=%d lasterr=%d\n",
+				(long)GetCurrentThreadId(), n,
+				(int)WSAGetLastError());
+			return FALSE;
+		}
+		buf += n;
+		len -= (u_int)n;
+	}
+	return TRUE;
+}
+
+/* Caller must hold |ct->ct_mpx_lock| */
+static struct ct_pending_call *
+mpx_find_pending(struct ct_data *ct, u_int32_t xid)
+{
+	struct ct_pending_call *pc;
+
+	for (pc = ct->ct_pending[CT_PENDING_HASH(xid)] ; pc != NULL ;
+		pc = pc->next) {
+		if (pc->xid == xid)
+			return pc;
+	}
+	return NULL;
+}
+
+/*
+ * Get the offset of the results in an accepted, successful REPLY
+ * record, using only the first |len| bytes of the record
+ */
+static bool_t
+mpx_reply_results(const char *buf, u_int len, u_int *resultsp)
+{
+	u_int32_t w[5];
+	u_int pos;
+
+	if (len < sizeof(w))
+		return FALSE;
+	(void)memcpy(w, buf, sizeof(w));
+	/* xid, direction, reply_stat, verifier flavor+length */
+	if ((ntohl(w[1]) != REPLY) || (ntohl(w[2]) != MSG_ACCEPTED) ||
+		(ntohl(w[4]) > MAX_AUTH_BYTES))
+		return FALSE;
+	pos = sizeof(w) + RNDUP(ntohl(w[4]));
+	if ((pos + BYTES_PER_XDR_UNIT) > len)
+		return FALSE;
+	(void)memcpy(w, buf + pos, BYTES_PER_XDR_UNIT);
+	if (ntohl(w[0]) != SUCCESS)
+		return FALSE;
+	*resultsp = pos + BYTES_PER_XDR_UNIT;
+	return TRUE;
+}
+
+/*
+ * Read the first fragment of a record into a |malloc()|'ed buffer.
+ *
+ * If the record is the reply to a call with a |clnt_reply_placement|
+ * its payload is received directly into the placement's buffer and
+ * left out of the record buffer, so that each payload byte is only
+ * touched once
+ */
+static bool_t
+mpx_read_first_fragment(CLIENT *cl, struct ct_data *ct, u_int fraglen,
+	char **bufp, u_int *lenp)
+{
+	char peek[CT_PLACEMENT_PEEK_LEN];
+	char pad[BYTES_PER_XDR_UNIT];
+	struct ct_pending_call *pc = NULL;
+	u_int32_t xid;
+	u_int results, offset, payload_len = 0, start = 0, skip = 0;
+	u_int end, peeked, tail = 0;
+	char *dest = NULL;
+	char *buf;
+
+	if (!mpx_read_exact(cl, ct, peek, sizeof(peek)))
+		return FALSE;
+
+	if (mpx_reply_results(peek, sizeof(peek), &results)) {
+		(void)memcpy(&xid, peek, sizeof(xid));
+		mutex_lock(&ct->ct_mpx_lock);
+		pc = mpx_find_pending(ct, ntohl(xid));
+		if ((pc != NULL) && (pc->placement != NULL) &&
+			pc->placement->locate(pc->placement->arg,
+				peek + results, sizeof(peek) - results,
+				fraglen - results,
+				&offset, &payload_len, &dest) &&
+			(offset <= (sizeof(peek) - results)) &&
+			(RNDUP(payload_len) <= (fraglen - results - offset))) {
+			/* keeps the caller waiting until we are done */
+			pc->placing = TRUE;
+		} else
+			pc = NULL;
+		mutex_unlock(&ct->ct_mpx_lock);
+	}
+
+	if (pc != NULL) {
+		start = results + offset;
+		skip = RNDUP(payload_len);
+	}
+
+	buf = malloc(fraglen - skip);
+	if (buf == NULL)
+		goto fail;
+
+	if (pc == NULL) {
+		(void)memcpy(buf, peek, sizeof(peek));
+		if (!mpx_read_exact(cl, ct, buf + sizeof(peek),
+			fraglen - (u_int)sizeof(peek)))
+			goto fail;
+		goto out;
+	}
+
+	/* Part of the payload (or even all of it) may be in |peek| */
+	(void)memcpy(buf, peek, start);
+	end = start + payload_len;
+	peeked = ((sizeof(peek) < end)?(u_int)sizeof(peek):end) - start;
+	(void)memcpy(dest, peek + start, peeked);
+	if (sizeof(peek) > (start + skip)) {
+		tail = (u_int)sizeof(peek) - (start + skip);
+		(void)memcpy(buf + start, peek + start + skip, tail);
+	}
+
+	if (!mpx_read_exact(cl, ct, dest + peeked, payload_len - peeked))
+		goto fail;
+	if (end < sizeof(peek))
+		end = (u_int)sizeof(peek);
+	if ((start + skip) > end) {
+		if (!mpx_read_exact(cl, ct, pad, (start + skip) - end))
+			goto fail;
+	}
+	if (!mpx_read_exact(cl, ct, buf + start + tail,
+		fraglen - skip - start - tail))
+		goto fail;
+
+out:
+	if (pc != NULL) {
+		mutex_lock(&ct->ct_mpx_lock);
+		pc->placing = FALSE;
+		mutex_unlock(&ct->ct_mpx_lock);
+	}
+	*bufp = buf;
+	*lenp = fraglen - skip;
+	return TRUE;
+fail:
+	if (pc != NULL) {
+		mutex_lock(&ct->ct_mpx_lock);
+		pc->placing = FALSE;
+		mutex_unlock(&ct->ct_mpx_lock);
+	}
+	free(buf);
+	return FALSE;
+}
+
+/*
+ * Read a complete RPC record (all fragments) into a |malloc()|'ed
+ * buffer
+ */
+static bool_t
+mpx_read_record(CLIENT *cl, struct ct_data *ct, char **bufp, u_int *lenp)
+{
+	char *buf = NULL, *newbuf;
+	u_int len = 0;
+	u_int32_t header, fraglen;
+	bool_t first = TRUE;
+
+	do {
+		if (!mpx_read_exact(cl, ct, (char *)&header, sizeof(header)))
+			goto fail;
+		header = ntohl(header);
+		fraglen = header & ~CT_LAST_FRAG;
+		if ((len + fraglen) > CT_MAX_RECORD_SIZE) {
+			(void)fprintf(stderr, "%04lx: mpx: record too large "
+				"(%u+%u bytes)\n",
+				(long)GetCurrentThreadId(),
+				(unsigned int)len, (unsigned int)fraglen);
+			goto fail;
+		}
+		if (first && (fraglen > CT_PLACEMENT_PEEK_LEN)) {
+			first = FALSE;
+			if (!mpx_read_first_fragment(cl, ct, fraglen,
+				&buf, &len))
+				goto fail;
+			continue;
+		}
+		first = FALSE;
+		newbuf = realloc(buf, len + fraglen);
+		if ((newbuf == NULL) && ((len + fraglen) > 0))
+			goto fail;
+		buf = newbuf;
+		if (!mpx_read_exact(cl, ct, buf + len, fraglen))
+			goto fail;
+		len += fraglen;
+	} while ((header & CT_LAST_FRAG) == 0);
+
+	*bufp = buf;
+	*lenp = len;
+	return TRUE;
+fail:
+	free(buf);
+	return FALSE;
+}
+
+static void
+mpx_add_pending(struct ct_data *ct, struct ct_pending_call *pc)
+{
+	struct ct_pending_call **bucket = &ct->ct_pending[CT_PENDING_HASH(pc->xid)];
+
+	pc->next = *bucket;
+	*bucket = pc;
+}
+
+/* Caller must hold |ct->ct_mpx_lock| */
+static struct ct_pending_call *
+mpx_remove_pending(struct ct_data *ct, u_int32_t xid)
+{
+	struct ct_pending_call **pcp = &ct->ct_pending[CT_PENDING_HASH(xid)];
+	struct ct_pending_call *pc;
+
+	for (pc = *pcp ; pc != NULL ; pcp = &pc->next, pc = *pcp) {
+		if (pc->xid == xid) {
+			*pcp = pc->next;
+			pc->next = NULL;
+			return pc;
+		}
+	}
+	return NULL;
+}
+
+/* Fail all pending calls after the connection has died */
+static void
+mpx_fail_all_pending(struct ct_data *ct, enum clnt_stat status)
+{
+	struct ct_pending_call *pc;
+	int i;
+
+	mutex_lock(&ct->ct_mpx_lock);
+	ct->ct_recv_status = status;
+	for (i = 0 ; i < CT_PENDING_HASH_SIZE ; i++) {
+		while ((pc = ct->ct_pending[i]) != NULL) {
+			ct->ct_pending[i] = pc->next;
+			pc->next = NULL;
+			pc->status = status;
+			pc->done = TRUE;
+			cond_signal(&pc->cv);
+		}
+	}
+	mutex_unlock(&ct->ct_mpx_lock);
+}
+
+/* Process a backchannel CALL record */
+static void
+mpx_process_cb_call(CLIENT *cl, struct ct_data *ct, char *buf, u_int len)
+{
+	XDR cbxdrs;
+	XDR *xdrs = &(ct->ct_xdrs);
+	struct rpc_msg call_msg;
+	struct rpc_msg reply_msg;
+	char cred_area[2 * MAX_AUTH_BYTES + RQCRED_SIZE];
+	cb_req header;
+	void *res = NULL;
+	int status;
+
+	xdrmem_create(&cbxdrs, buf, len, XDR_DECODE);
+	call_msg.rm_call.cb_cred.oa_base = cred_area;
+	call_msg.rm_call.cb_verf.oa_base = &(cred_area[MAX_AUTH_BYTES]);
+	if ((!xdr_getxiddir(&cbxdrs, &call_msg)) ||
+		(!xdr_getcallbody(&cbxdrs, &call_msg))) {
+		(void)fprintf(stderr,
+			"%04lx: cb: xdr_getcallbody failed\n",
+			(long)GetCurrentThreadId());
+		goto out;
+	}
+
+	header.rq_prog = call_msg.rm_call.cb_prog;
+	header.rq_vers = call_msg.rm_call.cb_vers;
+	header.rq_proc = call_msg.rm_call.cb_proc;
+	header.xdr = &cbxdrs;
+	status = (*cl->cb_fn)(cl->cb_args, &header, &res);
+	if (status) {
+		(void)fprintf(stderr, "%04lx: cb: callback function failed with %d\n",
+			(long)GetCurrentThreadId(), status);
+	}
+
+	reply_msg.rm_xid = call_msg.rm_xid;
+	reply_msg.rm_direction = REPLY;
+	reply_msg.rm_reply.rp_stat = MSG_ACCEPTED;
+	reply_msg.acpted_rply.ar_verf = _null_auth;
+	reply_msg.acpted_rply.ar_stat = status;
+	reply_msg.acpted_rply.ar_results.where = NULL;
+	reply_msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
+
+	acquire_fd_lock(ct->ct_fd);
+	xdrs->x_op = XDR_ENCODE;
+	__xdrrec_setblock(xdrs);
+	xdr_replymsg(xdrs, &reply_msg);
+	if (!status) {
+		(*cl->cb_xdr)(xdrs, res); /* encode the results */
+		xdrs->x_op = XDR_FREE;
+		(*cl->cb_xdr)(xdrs, res); /* free the results */
+	}
+	if (! xdrrec_endofrecord(xdrs, 1)) {
+		(void)fprintf(stderr, "%04lx: cb: failed to send REPLY\n",
+			(long)GetCurrentThreadId());
+	}
+	release_fd_lock(ct->ct_fd, mask);
+out:
+	XDR_DESTROY(&cbxdrs);
+}
+
+#if TIRPC_CLNT_VC_CB_WORKERS > 0
+/*
+ * Backchannel worker thread - runs the callbacks queued by the
+ * receive thread, so that a slow callback does not hold up the
+ * replies for the forechannel calls
+ */
+static unsigned int WINAPI clnt_vc_cb_worker_thread(void *args)
+{
+	CLIENT *cl = (CLIENT *)args;
+	struct ct_data *ct = (struct ct_data *) cl->cl_private;
+	struct ct_cb_work *work;
+
+	while (1) {
+		mutex_lock(&ct->ct_cb_lock);
+		while ((ct->ct_cb_queue == NULL) && (!ct->ct_cb_shutdown))
+			cond_wait(&ct->ct_cb_cv, &ct->ct_cb_lock);
+		if (ct->ct_cb_shutdown) {
+			mutex_unlock(&ct->ct_cb_lock);
+			break;
+		}
+		work = ct->ct_cb_queue;
+		ct->ct_cb_queue = work->next;
+		if (ct->ct_cb_queue == NULL)
+			ct->ct_cb_queue_tail = NULL;
+		mutex_unlock(&ct->ct_cb_lock);
+
+		mpx_process_cb_call(cl, ct, work->buf, work->len);
+		free(work->buf);
+		free(work);
+	}
+	return 0;
+}
+
+static void
+mpx_start_cb_workers(CLIENT *cl, struct ct_data *ct)
+{
+	int i;
+
+	for (i = 0 ; i < TIRPC_CLNT_VC_CB_WORKERS ; i++) {
+		ct->ct_cb_workers[i] = (HANDLE)_beginthreadex(NULL,
+			0, clnt_vc_cb_worker_thread, cl, 0, NULL);
+		if (ct->ct_cb_workers[i] == INVALID_HANDLE_VALUE) {
+			/* the workers we have (if any) are good enough */
+			(void)fprintf(stderr, "%04lx: mpx: _beginthreadex() "
+				"for callback worker failed %d\n",
+				(long)GetCurrentThreadId(),
+				GetLastError());
+			break;
+		}
+		ct->ct_cb_nworkers++;
+	}
+}
+
+/*
+ * Stop the worker threads, must be called after the receive thread
+ * has terminated and without holding |clnt_fd_lock|, because the
+ * workers need the fd lock to send their replies.
+ * Callbacks still in the queue are dropped, the connection goes
+ * away anyway.
+ */
+static void
+mpx_stop_cb_workers(struct ct_data *ct)
+{
+	struct ct_cb_work *work;
+	int i;
+
+	mutex_lock(&ct->ct_cb_lock);
+	ct->ct_cb_shutdown = TRUE;
+	cond_broadcast(&ct->ct_cb_cv);
+	mutex_unlock(&ct->ct_cb_lock);
+
+	for (i = 0 ; i < ct->ct_cb_nworkers ; i++) {
+		(void)WaitForSingleObjectEx(ct->ct_cb_workers[i],
+			INFINITE, FALSE);
+		(void)CloseHandle(ct->ct_cb_workers[i]);
+	}
+	ct->ct_cb_nworkers = 0;
+
+	while ((work = ct->ct_cb_queue) != NULL) {
+		ct->ct_cb_queue = work->next;
+		free(work->buf);
+		free(work);
+	}
+	ct->ct_cb_queue_tail = NULL;
+}
+
+/*
+ * Hand a backchannel CALL record to the worker threads, returns
+ * |FALSE| if the caller has to process it itself
+ */
+static bool_t
+mpx_queue_cb_call(struct ct_data *ct, char *buf, u_int len)
+{
+	struct ct_cb_work *work;
+
+	if (ct->ct_cb_nworkers == 0)
+		return FALSE;
+
+	work = malloc(sizeof(struct ct_cb_work));
+	if (work == NULL)
+		return FALSE;
+	work->next = NULL;
+	work->buf = buf;
+	work->len = len;
+
+	mutex_lock(&ct->ct_cb_lock);
+	if (ct->ct_cb_queue_tail)
+		ct->ct_cb_queue_tail->next = work;
+	else
+		ct->ct_cb_queue = work;
+	ct->ct_cb_queue_tail = work;
+	cond_signal(&ct->ct_cb_cv);
+	mutex_unlock(&ct->ct_cb_lock);
+	return TRUE;
+}
+#endif /* TIRPC_CLNT_VC_CB_WORKERS > 0 */
+
+/*
+ * Receive thread - reads all RPC records from the connection and
+ * demultiplexes them by xid
+ */
+static unsigned int WINAPI clnt_vc_recv_thread(void *args)
+{
+	CLIENT *cl = (CLIENT *)args;
+	struct ct_data *ct = (struct ct_data *) cl->cl_private;
+	struct ct_pending_call *pc;
+	char *buf;
+	u_int len;
+	u_int32_t xid;
+	enum msg_type direction;
+
+	(void)fprintf(stderr/*stdout*/,
+		"%04lx: mpx: Receive thread running\n",
+		(long)GetCurrentThreadId());
+
+	while (1) {
+		TIRPCDbgEnter();
+		if (!mpx_read_record(cl, ct, &buf, &len)) {
+			if (!cl->shutdown) {
+				(void)fprintf(stderr,
+					"%04lx: mpx: connection failed\n",
+					(long)GetCurrentThreadId());
+			}
+			mpx_fail_all_pending(ct, RPC_CANTRECV);
+			goto out;
+		}
+
+		if (len < (2 * BYTES_PER_XDR_UNIT)) {
+			free(buf);
+			continue;
+		}
+		xid = ntohl(((u_int32_t *)buf)[0]);
+		direction = (enum msg_type)ntohl(((u_int32_t *)buf)[1]);
+
+		if (direction == REPLY) {
+			mutex_lock(&ct->ct_mpx_lock);
+			pc = mpx_remove_pending(ct, xid);
+			if (pc) {
+				pc->reply_buf = buf;
+				pc->reply_len = len;
+				pc->status = RPC_SUCCESS;
+				pc->done = TRUE;
+				cond_signal(&pc->cv);
+			}
+			mutex_unlock(&ct->ct_mpx_lock);
+			if (pc == NULL) {
+				/* caller gave up (timeout) */
+				(void)fprintf(stderr,
+					"%04lx: mpx: dropping reply for "
+					"unknown xid=%x\n",
+					(long)GetCurrentThreadId(), (int)xid);
+				free(buf);
+			}
+		} else if ((direction == CALL) && (cl->cb_fn != NULL)) {
+#if TIRPC_CLNT_VC_CB_WORKERS > 0
+			if (mpx_queue_cb_call(ct, buf, len))
+				continue;
+#endif /* TIRPC_CLNT_VC_CB_WORKERS > 0 */
+			mpx_process_cb_call(cl, ct, buf, len);
+			free(buf);
+		} else {
+			free(buf);
+		}
+		TIRPCDbgLeave();
+	}
+out:
+	return 0;
+}
+#endif /* !TIRPC_CLNT_VC_MULTIPLEX */
 /*
  * Create a client handle for a connection.
  * Default options are set, which the user can change using clnt_control()'s.
@@ -506,6 +1148,21 @@ clnt_vc_create(
 	ct->ct_addr.len = raddr->len;
 	ct->ct_addr.maxlen = raddr->maxlen;
     ct->use_stored_reply_msg = FALSE;
+#ifdef TIRPC_CLNT_VC_MULTIPLEX
+	mutex_init(&ct->ct_mpx_lock, 0);
+	memset(ct->ct_pending, 0, sizeof(ct->ct_pending));
+	ct->ct_recv_status = RPC_SUCCESS;
+#ifdef TIRPC_CLNT_VC_SEND_COALESCING
+	ct->ct_send_waiters = 0;
+#endif /* TIRPC_CLNT_VC_SEND_COALESCING */
+#if TIRPC_CLNT_VC_CB_WORKERS > 0
+	mutex_init(&ct->ct_cb_lock, 0);
+	cond_init(&ct->ct_cb_cv, 0, NULL);
+	ct->ct_cb_queue = ct->ct_cb_queue_tail = NULL;
+	ct->ct_cb_shutdown = FALSE;
+	ct->ct_cb_nworkers = 0;
+#endif /* TIRPC_CLNT_VC_CB_WORKERS > 0 */
+#endif /* TIRPC_CLNT_VC_MULTIPLEX */
 
 	/*
 	 * Initialize call message
@@ -539,10 +1196,69 @@ clnt_vc_create(
 	cl->cl_private = ct;
 	cl->cl_auth = authnone_create();
 	sendsz = __rpc_get_t_size(si.si_af, si.si_proto, (int)sendsz);
+#ifdef TIRPC_CLNT_VC_MULTIPLEX
+	/*
+	 * The receive thread reads each record into its own buffer of
+	 * the record's size, the xdrrec input buffer is never used. Do
+	 * not allocate |recvsz| (rsize, which can be many MB) bytes for
+	 * it on every connection.
+	 */
+	recvsz = CT_MPX_XDRREC_RECVSZ;
+#else
 	recvsz = __rpc_get_t_size(si.si_af, si.si_proto, (int)recvsz);
+#endif /* TIRPC_CLNT_VC_MULTIPLEX */
 	xdrrec_create(&(ct->ct_xdrs), sendsz, recvsz,
 	    cl->cl_private, read_vc, write_vc);
+	(void)__xdrrec_setwritev(&(ct->ct_xdrs), writev_vc);
+
+#ifdef TIRPC_CLNT_VC_MULTIPLEX
+    cl->shutdown = FALSE;
+    if (cb_xdr && cb_fn && cb_args) {
+        cl->cb_xdr = cb_xdr;
+        cl->cb_fn = cb_fn;
+        cl->cb_args = cb_args;
+#if TIRPC_CLNT_VC_CB_WORKERS > 0
+        /* before the receive thread, which queues to the workers */
+        mpx_start_cb_workers(cl, ct);
+#endif /* TIRPC_CLNT_VC_CB_WORKERS > 0 */
+    } else {
+        cl->cb_xdr = NULL;
+        cl->cb_fn = NULL;
+        cl->cb_args = NULL;
+    }
+    cl->cb_thread = (HANDLE)_beginthreadex(NULL,
+        0, clnt_vc_recv_thread, cl, 0, NULL);
+    if (cl->cb_thread == INVALID_HANDLE_VALUE) {
+        (void)fprintf(stderr, "%04lx: _beginthreadex() failed %d\n",
+            (long)GetCurrentThreadId(),
+            GetLastError());
+#if TIRPC_CLNT_VC_CB_WORKERS > 0
+        mpx_stop_cb_workers(ct);
+#endif /* TIRPC_CLNT_VC_CB_WORKERS > 0 */
+        goto err;
+    } else
+        fprintf(stdout, "%04lx: started the receive thread %04lx\n",
+            (long)GetCurrentThreadId(), (long)GetThreadId(cl->cb_thread));
+    {
+        const struct clnt_sockopts *sockopts = __clnt_get_sockopts();
+
+        if (sockopts && (sockopts->flags & CLNT_SOCKOPT_RSS_AFFINITY)) {
+            const int bind_node =
+                (sockopts->flags & CLNT_SOCKOPT_RSS_NUMA_NODE)?1:0;
+
+            wintirpc_setrssaffinity(fd, cl->cb_thread, bind_node);
+#if TIRPC_CLNT_VC_CB_WORKERS > 0
+            /* the callbacks use the buffers of the receive thread */
+            if (bind_node) {
+                int i;
 
+                for (i = 0 ; i < ct->ct_cb_nworkers ; i++)
+                    wintirpc_setrssaffinity(fd, ct->ct_cb_workers[i], 1);
+            }
+#endif /* TIRPC_CLNT_VC_CB_WORKERS > 0 */
+        }
+    }
+#else
     if (cb_xdr && cb_fn && cb_args) {
         cl->cb_xdr = cb_xdr;
         cl->cb_fn = cb_fn;
@@ -559,6 +1275,7 @@ clnt_vc_create(
                 (long)GetCurrentThreadId(), (long)GetThreadId(cl->cb_thread));
     } else
         cl->cb_thread = INVALID_HANDLE_VALUE;
+#endif /* TIRPC_CLNT_VC_MULTIPLEX */
 	return (cl);
 
 err:
@@ -574,6 +1291,125 @@ err:
 	return ((CLIENT *)NULL);
 }
 
+extern thread_key_t vc_placement_key;
+extern mutex_t tsd_lock;
+
+void
+clnt_set_reply_placement(const struct clnt_reply_placement *placement)
+{
+	if (vc_placement_key == -1) {
+		mutex_lock(&tsd_lock);
+		if (vc_placement_key == -1)
+			vc_placement_key = TlsAlloc();
+		mutex_unlock(&tsd_lock);
+	}
+	(void)thr_setspecific(vc_placement_key, (void *)placement);
+}
+
+extern thread_key_t vc_auth_key;
+
+void
+clnt_set_call_auth(AUTH *auth)
+{
+	if (vc_auth_key == -1) {
+		mutex_lock(&tsd_lock);
+		if (vc_auth_key == -1)
+			vc_auth_key = TlsAlloc();
+		mutex_unlock(&tsd_lock);
+	}
+	(void)thr_setspecific(vc_auth_key, (void *)auth);
+}
+
+/* Get and clear this thread's |clnt_set_call_auth()| */
+static AUTH *
+vc_take_call_auth(CLIENT *cl)
+{
+	AUTH *auth = NULL;
+
+	if (vc_auth_key != -1) {
+		auth = (AUTH *)thr_getspecific(vc_auth_key);
+		if (auth != NULL)
+			(void)thr_setspecific(vc_auth_key, NULL);
+	}
+	return (auth != NULL)?auth:cl->cl_auth;
+}
+
+extern thread_key_t vc_xid_key;
+
+/* Remember |xid| for |clnt_get_last_xid()| */
+static void
+vc_set_last_xid(u_int32_t xid)
+{
+	if (vc_xid_key == -1) {
+		mutex_lock(&tsd_lock);
+		if (vc_xid_key == -1)
+			vc_xid_key = TlsAlloc();
+		mutex_unlock(&tsd_lock);
+	}
+	(void)thr_setspecific(vc_xid_key, (void *)(uintptr_t)xid);
+}
+
+u_int32_t
+clnt_get_last_xid(void)
+{
+	if (vc_xid_key == -1)
+		return 0;
+	return (u_int32_t)(uintptr_t)thr_getspecific(vc_xid_key);
+}
+
+extern thread_key_t vc_sockopts_key;
+
+void
+clnt_set_sockopts(const struct clnt_sockopts *sockopts)
+{
+	if (vc_sockopts_key == -1) {
+		mutex_lock(&tsd_lock);
+		if (vc_sockopts_key == -1)
+			vc_sockopts_key = TlsAlloc();
+		mutex_unlock(&tsd_lock);
+	}
+	(void)thr_setspecific(vc_sockopts_key, (void *)sockopts);
+}
+
+/* This thread's |clnt_set_sockopts()|, or |NULL| for the defaults */
+const struct clnt_sockopts *
+__clnt_get_sockopts(void)
+{
+	if (vc_sockopts_key == -1)
+		return NULL;
+	return (const struct clnt_sockopts *)thr_getspecific(vc_sockopts_key);
+}
+
+void
+clnt_abort_calls(CLIENT *cl)
+{
+	struct ct_data *ct = (struct ct_data *) cl->cl_private;
+
+	if ((cl->cl_ops != clnt_vc_ops()) || (ct->ct_fd == -1))
+		return;
+	/*
+	 * The receive thread (or the caller waiting in |clnt_vc_call()|)
+	 * sees the connection failing and fails all pending calls
+	 */
+	(void)shutdown(wintirpc_fd2sockethandle(ct->ct_fd), SD_BOTH);
+}
+
+/* Get and clear this thread's |clnt_set_reply_placement()| */
+static const struct clnt_reply_placement *
+vc_take_reply_placement(void)
+{
+	const struct clnt_reply_placement *placement;
+
+	if (vc_placement_key == -1)
+		return NULL;
+	placement = (const struct clnt_reply_placement *)
+		thr_getspecific(vc_placement_key);
+	if (placement != NULL)
+		(void)thr_setspecific(vc_placement_key, NULL);
+	return placement;
+}
+
+#ifndef TIRPC_CLNT_VC_MULTIPLEX
 static enum clnt_stat
 clnt_vc_call(
 	CLIENT *cl,
@@ -591,6 +1427,7 @@ clnt_vc_call(
 	bool_t shipnow;
 	static int refreshes = 2;
     u_int seq = (u_int)-1;
+	AUTH *auth;
     time_t start_send, time_now;
 #ifndef _WINTIRPC
 	sigset_t mask, newmask;
@@ -603,6 +1440,10 @@ clnt_vc_call(
 
 	assert(cl != NULL);
 
+	/* Replies are decoded from the |xdrrec| stream, no placement */
+	(void)vc_take_reply_placement();
+	auth = vc_take_call_auth(cl);
+
 #ifndef _WINTIRPC
 	sigfillset(&newmask);
 	thr_sigsetmask(SIG_SETMASK, &newmask, &mask);
@@ -627,11 +1468,12 @@ call_again:
 	xdrs->x_op = XDR_ENCODE;
 	ct->ct_error.re_status = RPC_SUCCESS;
 	x_id = ntohl(--(*msg_x_id));
+	vc_set_last_xid(x_id);
 
 	if ((! XDR_PUTBYTES(xdrs, ct->ct_u.ct_mcallc, ct->ct_mpos)) ||
 	    (! XDR_PUTINT32(xdrs, (int32_t *)&proc)) ||
-	    (! AUTH_MARSHALL(cl->cl_auth, xdrs, &seq)) ||
-	    (! AUTH_WRAP(cl->cl_auth, xdrs, xdr_args, args_ptr))) {
+	    (! AUTH_MARSHALL(auth, xdrs, &seq)) ||
+	    (! AUTH_WRAP(auth, xdrs, xdr_args, args_ptr))) {
 		if (ct->ct_error.re_status == RPC_SUCCESS)
 			ct->ct_error.re_status = RPC_CANTENCODEARGS;
 		(void)xdrrec_endofrecord(xdrs, TRUE);
@@ -740,12 +1582,12 @@ call_again:
 	 */
 	_seterr_reply(&ct->reply_msg, &(ct->ct_error));
 	if (ct->ct_error.re_status == RPC_SUCCESS) {
-		if (! AUTH_VALIDATE(cl->cl_auth,
+		if (! AUTH_VALIDATE(auth,
 		    &ct->reply_msg.acpted_rply.ar_verf, seq)) {
 			ct->ct_error.re_status = RPC_AUTHERROR;
 			ct->ct_error.re_why = AUTH_INVALIDRESP;
         }
-        else if (! AUTH_UNWRAP(cl->cl_auth, xdrs, xdr_results, results_ptr, seq)) {
+        else if (! AUTH_UNWRAP(auth, xdrs, xdr_results, results_ptr, seq)) {
 			if (ct->ct_error.re_status == RPC_SUCCESS)
 				ct->ct_error.re_status = RPC_CANTDECODERES;
 		}
@@ -763,7 +1605,7 @@ call_again:
 			    &(ct->reply_msg.acpted_rply.ar_verf));
 		}
 		/* maybe our credentials need to be refreshed ... */
-		if (refreshes-- > 0 && AUTH_REFRESH(cl->cl_auth, &ct->reply_msg))
+		if (refreshes-- > 0 && AUTH_REFRESH(auth, &ct->reply_msg))
 			goto call_again;
 	}  /* end of unsuccessful completion */
     ct->reply_msg.rm_direction = -1;
@@ -774,6 +1616,227 @@ out_status:
 	TIRPCDbgLeave();
 	return status;
 }
+#else
+static enum clnt_stat
+clnt_vc_mpx_call(
+	CLIENT *cl,
+	rpcproc_t proc,
+	xdrproc_t xdr_args,
+	void *args_ptr,
+	xdrproc_t xdr_results,
+	void *results_ptr,
+	struct timeval timeout)
+{
+	struct ct_data *ct = (struct ct_data *) cl->cl_private;
+	XDR *xdrs = &(ct->ct_xdrs);
+	XDR rxdrs;
+	u_int32_t *msg_x_id = &ct->ct_u.ct_mcalli;    /* yuk */
+	bool_t shipnow;
+	static int refreshes = 2;
+	u_int seq = (u_int)-1;
+	AUTH *auth;
+	struct ct_pending_call pc;
+	struct rpc_msg reply_msg;
+	struct rpc_err err;
+	ULONGLONG deadline, now;
+	enum clnt_stat status = RPC_SYSTEMERROR;
+
+	TIRPCDbgEnter();
+
+	assert(cl != NULL);
+
+	cond_init(&pc.cv, 0, (void *) 0);
+	pc.placement = vc_take_reply_placement();
+	auth = vc_take_call_auth(cl);
+
+	if (!ct->ct_waitset) {
+		/* If time is not within limits, we ignore it. */
+		if (time_not_ok(&timeout) == FALSE)
+			ct->ct_wait = timeout;
+	}
+
+	shipnow =
+	    (xdr_results == NULL && timeout.tv_sec == 0
+	    && timeout.tv_usec == 0) ? FALSE : TRUE;
+
+call_again:
+	pc.next = NULL;
+	pc.done = FALSE;
+	pc.status = RPC_SYSTEMERROR;
+	pc.reply_buf = NULL;
+	pc.reply_len = 0;
+	pc.placing = FALSE;
+
+#ifdef TIRPC_CLNT_VC_SEND_COALESCING
+	(void)InterlockedIncrement(&ct->ct_send_waiters);
+	acquire_fd_lock(ct->ct_fd);
+	(void)InterlockedDecrement(&ct->ct_send_waiters);
+#else
+	acquire_fd_lock(ct->ct_fd);
+#endif /* TIRPC_CLNT_VC_SEND_COALESCING */
+
+	__xdrrec_setblock(xdrs);
+	xdrs->x_op = XDR_ENCODE;
+	ct->ct_error.re_status = RPC_SUCCESS;
+	pc.xid = ntohl(--(*msg_x_id));
+	vc_set_last_xid(pc.xid);
+
+	if (shipnow) {
+		/*
+		 * Register the call before sending it, the reply may
+		 * arrive before |xdrrec_endofrecord()| returns
+		 */
+		mutex_lock(&ct->ct_mpx_lock);
+		if (ct->ct_recv_status != RPC_SUCCESS) {
+			ct->ct_error.re_status = ct->ct_recv_status;
+			mutex_unlock(&ct->ct_mpx_lock);
+#ifdef TIRPC_CLNT_VC_SEND_COALESCING
+			/* records of earlier callers must not get stuck */
+			(void)__xdrrec_flush(xdrs);
+#endif /* TIRPC_CLNT_VC_SEND_COALESCING */
+			goto out_unlock;
+		}
+		mpx_add_pending(ct, &pc);
+		mutex_unlock(&ct->ct_mpx_lock);
+	}
+
+	if ((! XDR_PUTBYTES(xdrs, ct->ct_u.ct_mcallc, ct->ct_mpos)) ||
+	    (! XDR_PUTINT32(xdrs, (int32_t *)&proc)) ||
+	    (! AUTH_MARSHALL(auth, xdrs, &seq)) ||
+	    (! AUTH_WRAP(auth, xdrs, xdr_args, args_ptr))) {
+		if (ct->ct_error.re_status == RPC_SUCCESS)
+			ct->ct_error.re_status = RPC_CANTENCODEARGS;
+		(void)xdrrec_endofrecord(xdrs, TRUE);
+		goto out_unregister;
+	}
+
+#ifdef TIRPC_CLNT_VC_SEND_COALESCING
+	/*
+	 * If another caller waits for the fd lock our record goes out
+	 * with its send, it takes the lock right after we release it
+	 */
+	if (! xdrrec_endofrecord(xdrs, shipnow &&
+		((ct->ct_send_waiters == 0) ||
+		(__xdrrec_outbuf_len(xdrs) >= CT_SEND_COALESCE_MAX_BYTES)))) {
+		ct->ct_error.re_status = RPC_CANTSEND;
+		goto out_unregister;
+	}
+#else
+	if (! xdrrec_endofrecord(xdrs, shipnow)) {
+		ct->ct_error.re_status = RPC_CANTSEND;
+		goto out_unregister;
+	}
+#endif /* TIRPC_CLNT_VC_SEND_COALESCING */
+	release_fd_lock(ct->ct_fd, mask);
+
+	if (! shipnow) {
+		status = RPC_SUCCESS;
+		goto out_status;
+	}
+
+	/*
+	 * Wait for the receive thread to hand us the reply
+	 */
+	deadline = GetTickCount64() +
+		((ULONGLONG)timeout.tv_sec * 1000ULL) +
+		((ULONGLONG)timeout.tv_usec / 1000ULL);
+	mutex_lock(&ct->ct_mpx_lock);
+	while (!pc.done) {
+		now = GetTickCount64();
+		if (pc.placing) {
+			/*
+			 * The receive thread is writing the payload into
+			 * the caller's buffer, we cannot give up before it
+			 * is done
+			 */
+			(void)cond_wait_timed(&pc.cv, &ct->ct_mpx_lock,
+				CT_RECV_POLL_TIMEOUT);
+			continue;
+		}
+		if (now >= deadline) {
+			(void)mpx_remove_pending(ct, pc.xid);
+			pc.status = RPC_TIMEDOUT;
+			break;
+		}
+		(void)cond_wait_timed(&pc.cv, &ct->ct_mpx_lock,
+			(DWORD)(deadline - now));
+	}
+	mutex_unlock(&ct->ct_mpx_lock);
+
+	if (pc.status != RPC_SUCCESS) {
+		err.re_status = pc.status;
+		goto out_seterr;
+	}
+
+	/*
+	 * process header
+	 */
+	xdrmem_create(&rxdrs, pc.reply_buf, pc.reply_len, XDR_DECODE);
+	reply_msg.acpted_rply.ar_verf = _null_auth;
+	reply_msg.acpted_rply.ar_results.where = NULL;
+	reply_msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
+	if ((!xdr_getxiddir(&rxdrs, &reply_msg)) ||
+		(!xdr_getreplyunion(&rxdrs, &reply_msg))) {
+		err.re_status = RPC_CANTDECODERES;
+		goto out_freereply;
+	}
+
+	_seterr_reply(&reply_msg, &err);
+	if (err.re_status == RPC_SUCCESS) {
+		if (! AUTH_VALIDATE(auth,
+		    &reply_msg.acpted_rply.ar_verf, seq)) {
+			err.re_status = RPC_AUTHERROR;
+			err.re_why = AUTH_INVALIDRESP;
+		}
+		else if (! AUTH_UNWRAP(auth, &rxdrs, xdr_results, results_ptr, seq)) {
+			if (err.re_status == RPC_SUCCESS)
+				err.re_status = RPC_CANTDECODERES;
+		}
+		/* free verifier ... */
+		if (reply_msg.acpted_rply.ar_verf.oa_base != NULL) {
+			rxdrs.x_op = XDR_FREE;
+			(void)xdr_opaque_auth(&rxdrs,
+			    &(reply_msg.acpted_rply.ar_verf));
+		}
+	}  /* end successful completion */
+	else {
+		if (reply_msg.acpted_rply.ar_verf.oa_base != NULL) {
+			rxdrs.x_op = XDR_FREE;
+			(void)xdr_opaque_auth(&rxdrs,
+			    &(reply_msg.acpted_rply.ar_verf));
+		}
+		/* maybe our credentials need to be refreshed ... */
+		if (refreshes-- > 0 && AUTH_REFRESH(auth, &reply_msg)) {
+			XDR_DESTROY(&rxdrs);
+			free(pc.reply_buf);
+			goto call_again;
+		}
+	}  /* end of unsuccessful completion */
+
+out_freereply:
+	XDR_DESTROY(&rxdrs);
+	free(pc.reply_buf);
+out_seterr:
+	acquire_fd_lock(ct->ct_fd);
+	ct->ct_error = err;
+	release_fd_lock(ct->ct_fd, mask);
+	status = err.re_status;
+	goto out_status;
+
+out_unregister:
+	if (shipnow) {
+		mutex_lock(&ct->ct_mpx_lock);
+		(void)mpx_remove_pending(ct, pc.xid);
+		mutex_unlock(&ct->ct_mpx_lock);
+	}
+out_unlock:
+	status = ct->ct_error.re_status;
+	release_fd_lock(ct->ct_fd, mask);
+out_status:
+	TIRPCDbgLeave();
+	return status;
+}
+#endif /* !TIRPC_CLNT_VC_MULTIPLEX */
 
 static void
 clnt_vc_geterr(CLIENT *cl, struct rpc_err *errp)
@@ -998,6 +2061,9 @@ clnt_vc_destroy(CLIENT *cl)
         status = WaitForSingleObjectEx(cl->cb_thread, INFINITE, FALSE);
         assert(status == WAIT_OBJECT_0);
         fprintf(stdout, "%04lx: terminated callback thread\n", (long)GetCurrentThreadId());
+#if defined(TIRPC_CLNT_VC_MULTIPLEX) && (TIRPC_CLNT_VC_CB_WORKERS > 0)
+        mpx_stop_cb_workers(ct);
+#endif /* TIRPC_CLNT_VC_MULTIPLEX && TIRPC_CLNT_VC_CB_WORKERS > 0 */
         mutex_lock(&clnt_fd_lock);
         while (vc_fd_locks[ct_fd])
             cond_wait(&vc_cv[ct_fd], &clnt_fd_lock);
@@ -1100,6 +2166,43 @@ write_vc(
 	return (len);
 }
 
+/*
+ * Gather version of |write_vc()|, used by the record stream to send
+ * |xdr_opaque_ref()| payloads without copying them
+ */
+static int
+writev_vc(
+	void *ctp,
+	WSABUF *bufs,
+	int nbufs)
+{
+	struct ct_data *ct = (struct ct_data *)ctp;
+	DWORD sent;
+	int total = 0;
+
+	while (nbufs > 0) {
+		if (WSASend(wintirpc_fd2sockethandle(ct->ct_fd), bufs,
+			(DWORD)nbufs, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+			ct->ct_error.re_errno = WSAGetLastError();
+			ct->ct_error.re_status = RPC_CANTSEND;
+			return (-1);
+		}
+		total += (int)sent;
+
+		/* skip what was sent, in case of a partial send */
+		while ((nbufs > 0) && (sent >= bufs->len)) {
+			sent -= bufs->len;
+			bufs++;
+			nbufs--;
+		}
+		if (nbufs > 0) {
+			bufs->buf += sent;
+			bufs->len -= sent;
+		}
+	}
+	return (total);
+}
+
 static struct clnt_ops *
 clnt_vc_ops()
 {
@@ -1117,7 +2220,11 @@ clnt_vc_ops()
 #endif
 	mutex_lock(&ops_lock);
 	if (ops.cl_call == NULL) {
+#ifdef TIRPC_CLNT_VC_MULTIPLEX
+		ops.cl_call = clnt_vc_mpx_call;
+#else
 		ops.cl_call = clnt_vc_call;
+#endif /* TIRPC_CLNT_VC_MULTIPLEX */
 		ops.cl_abort = clnt_vc_abort;
 		ops.cl_geterr = clnt_vc_geterr;
 		ops.cl_freeres = clnt_vc_freeres;
@@ -96,6 +96,10 @@ thread_key_t tcp_key = (DWORD)-1;
 thread_key_t udp_key = (DWORD)-1;
 thread_key_t nc_key = (DWORD)-1;
 thread_key_t rce_key = (DWORD)-1;
+thread_key_t vc_placement_key = (DWORD)-1;
+thread_key_t vc_xid_key = (DWORD)-1;
+thread_key_t vc_auth_key = (DWORD)-1;
+thread_key_t vc_sockopts_key = (DWORD)-1;
 
 /* xprtlist (svc_generic.c) */
 mutex_t	xprtlist_lock;
@@ -179,6 +183,14 @@ void tsd_key_delete(void)
 		thr_keydelete(nc_key);
 	if (rce_key != -1)
 		thr_keydelete(rce_key);
+	if (vc_placement_key != -1)
+		thr_keydelete(vc_placement_key);
+	if (vc_xid_key != -1)
+		thr_keydelete(vc_xid_key);
+	if (vc_auth_key != -1)
+		thr_keydelete(vc_auth_key);
+	if (vc_sockopts_key != -1)
+		thr_keydelete(vc_sockopts_key);
 	return;
 }
 
@@ -90,6 +90,10 @@ char *_get_next_token(char *, int);
 bool_t __svc_clean_idle(fd_set *, int, bool_t);
 bool_t __xdrrec_setnonblock(XDR *, int);
 bool_t __xdrrec_setblock(XDR *);
+bool_t __xdrrec_setwritev(XDR *, int (*)(void *, WSABUF *, int));
+bool_t __xdrrec_setnorefs(XDR *, bool_t);
+u_int __xdrrec_outbuf_len(XDR *);
+bool_t __xdrrec_flush(XDR *);
 bool_t __xdrrec_getrec(XDR *, enum xprt_stat *, bool_t);
 void __xprt_unregister_unlocked(SVCXPRT *);
 void __xprt_set_raddr(SVCXPRT *, const struct sockaddr_storage *);
@@ -25,6 +25,7 @@
 #include <rpc/rpc.h>
 #include <stdio.h>
 #include <winsock.h>
+#include <mstcpip.h>
 
 #include "../../nfs41_build_features.h"
 
@@ -371,52 +372,74 @@ int wintirpc_setsockopt(int socket, int level, int option_name,
 		option_value, option_len);
 }
 
-void wintirpc_setnfsclientsockopts(int sock)
+/*
+ * Set the socket buffer |optname| (|SO_RCVBUF| or |SO_SNDBUF|) to
+ * |size| if it is currently smaller
+ */
+static void wintirpc_setsockbuf(int sock, int optname,
+	const char *optstr, int size)
 {
-	DWORD one;
-	int rcvbufvalue;
-	int sndbufvalue;
+	int value;
 	socklen_t bufsize;
 
-	one = 1;
-	/* XXX fvdl - is this useful? */
-	if (wintirpc_setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
-		(const char *)&one, sizeof(one)))
+	value = 0;
+	bufsize = sizeof(value);
+	if (wintirpc_getsockopt(sock, SOL_SOCKET, optname,
+		(char *)&value, &bufsize))
 		wintirpc_warnx("wintirpc_setnfsclientsockopts(sock=%d):"
-			" Error setting TCP_NODELAY\n", sock);
+			" Error getting %s\n", sock, optstr);
 
-	/* gisburn: Is this useful ? */
-	one = 1;
-	if (wintirpc_setsockopt(sock, IPPROTO_TCP, TCP_TIMESTAMPS,
-		(const char *)&one, sizeof(one)))
-		wintirpc_warnx("wintirpc_setnfsclientsockopts(sock=%d):"
-			" Error setting TCP_TIMESTAMPS\n", sock);
+#ifdef _DEBUG
+	(void)printf("wintirpc_setnfsclientsockopts(sock=%d): "
+		"%s=%d\n", sock, optstr, (int)value);
+#endif
 
-#ifdef NFS41_DRIVER_USE_LARGE_SOCKET_RCVSND_BUFFERS
-	/*
-	 * Print default values
-	 */
-	rcvbufvalue = 0;
-	bufsize = sizeof(rcvbufvalue);
-	if (wintirpc_getsockopt(sock, SOL_SOCKET, SO_RCVBUF,
-		(char *)&rcvbufvalue, &bufsize))
-		wintirpc_warnx("wintirpc_setnfsclientsockopts(sock=%d):"
-			" Error getting SO_RCVBUF\n", sock);
+	if (value >= size)
+		return;
 
-	sndbufvalue = 0;
-	bufsize = sizeof(sndbufvalue);
-	if (wintirpc_getsockopt(sock, SOL_SOCKET, SO_SNDBUF,
-		(char *)&sndbufvalue, &bufsize))
-		wintirpc_warnx("wintirpc_setnfsclientsockopts(sock=%d):"
-			" Error getting SO_SNDBUF\n", sock);
+	value = size;
+	if (wintirpc_setsockopt(sock, SOL_SOCKET, optname,
+		(const char *)&value, sizeof(value)))
+		wintirpc_warnx(
+			"wintirpc_setnfsclientsockopts(sock=%d): "
+			"Error setting %s\n", sock, optstr);
+
+	value = 0;
+	bufsize = sizeof(value);
+	if (wintirpc_getsockopt(sock, SOL_SOCKET, optname,
+		(char *)&value, &bufsize))
+		wintirpc_warnx(
+			"wintirpc_setnfsclientsockopts(sock=%d): "
+			"Error getting %s\n", sock, optstr);
+
+	if (value != size) {
+		wintirpc_warnx(
+			"wintirpc_setnfsclientsockopts(sock=%d): "
+			"%s expected size=%d, got size=%d\n",
+			sock, optstr, size, (int)value);
+	}
 
 #ifdef _DEBUG
 	(void)printf("wintirpc_setnfsclientsockopts(sock=%d): "
-		"SO_RCVBUF=%d\n", sock, (int)rcvbufvalue);
-	(void)printf("wintirpc_setnfsclientsockopts(sock=%d): "
-		"SO_SNDBUF=%d\n", sock, (int)sndbufvalue);
+		"set %s to %d\n", sock, optstr, (int)value);
 #endif
+}
 
+/*
+ * Must be called before |connect()|, |SIO_LOOPBACK_FAST_PATH| only
+ * works on unconnected sockets. The options come from
+ * |clnt_set_sockopts()|, the defaults are |TCP_NODELAY| and the
+ * |NFS41_DRIVER_USE_LARGE_SOCKET_RCVSND_BUFFERS| buffer size.
+ */
+void wintirpc_setnfsclientsockopts(int sock)
+{
+	const struct clnt_sockopts *opts = __clnt_get_sockopts();
+	DWORD one;
+	DWORD bytes;
+	int sockbuf;
+	u_int flags;
+
+#ifdef NFS41_DRIVER_USE_LARGE_SOCKET_RCVSND_BUFFERS
 	/*
 	 * Set socket rcv and snd buffer sizes to 8M if the current
 	 * value is smaller
@@ -436,69 +459,113 @@ void wintirpc_setnfsclientsockopts(int sock)
 	 * connections.
 	 */
 #define NFSRV_TCPSOCKBUF (8 * 1024 * 1024)
+	sockbuf = NFSRV_TCPSOCKBUF;
+#else
+	sockbuf = 0;
+#endif /* NFS41_DRIVER_USE_LARGE_SOCKET_RCVSND_BUFFERS */
+	flags = CLNT_SOCKOPT_NODELAY;
+	if (opts) {
+		/* 0 leaves the buffers to the Windows autotuning */
+		if (opts->sockbuf != CLNT_SOCKBUF_DEFAULT)
+			sockbuf = (int)min(opts->sockbuf, INT_MAX);
+		flags = opts->flags;
+	}
 
-	if (rcvbufvalue < NFSRV_TCPSOCKBUF) {
-		rcvbufvalue = NFSRV_TCPSOCKBUF;
-		bufsize = sizeof(rcvbufvalue);
-		if (wintirpc_setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
-			(const char *)&rcvbufvalue, sizeof(bufsize)))
-			wintirpc_warnx(
-				"wintirpc_setnfsclientsockopts(sock=%d): "
-				"Error setting SO_RCVBUF\n", sock);
-
-		rcvbufvalue = 0;
-		bufsize = sizeof(rcvbufvalue);
-		if (wintirpc_getsockopt(sock, SOL_SOCKET, SO_RCVBUF,
-			(char *)&rcvbufvalue, &bufsize))
-			wintirpc_warnx(
-				"wintirpc_setnfsclientsockopts(sock=%d): "
-				"Error getting SO_RCVBUF\n", sock);
-
-		if (rcvbufvalue != NFSRV_TCPSOCKBUF) {
-			wintirpc_warnx(
-				"wintirpc_setnfsclientsockopts(sock=%d): "
-				"SO_RCVBUF expected size=%d, got size=%d\n",
-				sock,
-				(int)NFSRV_TCPSOCKBUF, (int)rcvbufvalue);
-		}
+	one = (flags & CLNT_SOCKOPT_NODELAY)?1:0;
+	if (wintirpc_setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+		(const char *)&one, sizeof(one)))
+		wintirpc_warnx("wintirpc_setnfsclientsockopts(sock=%d):"
+			" Error setting TCP_NODELAY\n", sock);
 
-#ifdef _DEBUG
-		(void)printf("wintirpc_setnfsclientsockopts(sock=%d): "
-			"set SO_RCVBUF to %d\n", sock, (int)rcvbufvalue);
-#endif
+	/* gisburn: Is this useful ? */
+	one = 1;
+	if (wintirpc_setsockopt(sock, IPPROTO_TCP, TCP_TIMESTAMPS,
+		(const char *)&one, sizeof(one)))
+		wintirpc_warnx("wintirpc_setnfsclientsockopts(sock=%d):"
+			" Error setting TCP_TIMESTAMPS\n", sock);
+
+	if (sockbuf > 0) {
+		wintirpc_setsockbuf(sock, SO_RCVBUF, "SO_RCVBUF", sockbuf);
+		wintirpc_setsockbuf(sock, SO_SNDBUF, "SO_SNDBUF", sockbuf);
 	}
 
+	if (opts && (opts->keepalive > 0)) {
+		struct tcp_keepalive ka;
+
+		ka.onoff = 1;
+		ka.keepalivetime = opts->keepalive;
+		ka.keepaliveinterval = max(opts->keepalive / 5, 1000);
+		if (WSAIoctl(wintirpc_fd2sockethandle(sock), SIO_KEEPALIVE_VALS,
+			&ka, sizeof(ka), NULL, 0, &bytes, NULL, NULL))
+			wintirpc_warnx("wintirpc_setnfsclientsockopts(sock=%d):"
+				" Error setting SIO_KEEPALIVE_VALS, "
+				"WSAGetLastError()=%d\n",
+				sock, (int)WSAGetLastError());
+	}
 
-	if (sndbufvalue < NFSRV_TCPSOCKBUF) {
-		sndbufvalue = NFSRV_TCPSOCKBUF;
-		bufsize = sizeof(sndbufvalue);
-		if (wintirpc_setsockopt(sock, SOL_SOCKET, SO_SNDBUF,
-			(const char *)&sndbufvalue, sizeof(bufsize)))
-			wintirpc_warnx(
-				"wintirpc_setnfsclientsockopts(sock=%d): "
-				"Error setting SO_SNDBUF\n", sock);
-
-		sndbufvalue = 0;
-		bufsize = sizeof(sndbufvalue);
-		if (wintirpc_getsockopt(sock, SOL_SOCKET, SO_SNDBUF,
-			(char *)&sndbufvalue, &bufsize))
-			wintirpc_warnx(
-				"wintirpc_setnfsclientsockopts(sock=%d): "
-				"Error getting SO_SNDBUF\n", sock);
-
-		if (sndbufvalue != NFSRV_TCPSOCKBUF) {
-			wintirpc_warnx(
-				"wintirpc_setnfsclientsockopts(sock=%d): "
-				"SO_SNDBUF expected size=%d, got size=%d\n",
-				sock, (int)NFSRV_TCPSOCKBUF, (int)sndbufvalue);
+	if (flags & CLNT_SOCKOPT_LOOPBACK_FASTPATH) {
+		one = 1;
+		if (WSAIoctl(wintirpc_fd2sockethandle(sock),
+			SIO_LOOPBACK_FAST_PATH, &one, sizeof(one),
+			NULL, 0, &bytes, NULL, NULL))
+			wintirpc_warnx("wintirpc_setnfsclientsockopts(sock=%d):"
+				" Error setting SIO_LOOPBACK_FAST_PATH, "
+				"WSAGetLastError()=%d\n",
+				sock, (int)WSAGetLastError());
+	}
+}
+
+/*
+ * Move |thread| (the receive thread of the connection |sock|) to the
+ * processor which RSS uses for the receive queue of the connection,
+ * so the received data is still in that processor's cache
+ */
+/*
+ * Make the RSS processor of |sock| the ideal processor of |thread|,
+ * with |bind_node| also restrict |thread| to the NUMA node of that
+ * processor
+ */
+void wintirpc_setrssaffinity(int sock, HANDLE thread, int bind_node)
+{
+	SOCKET_PROCESSOR_AFFINITY aff;
+	GROUP_AFFINITY node_affinity;
+	DWORD bytes;
+
+	if (WSAIoctl(wintirpc_fd2sockethandle(sock),
+		SIO_QUERY_RSS_PROCESSOR_INFO, NULL, 0,
+		&aff, sizeof(aff), &bytes, NULL, NULL)) {
+		wintirpc_warnx("wintirpc_setrssaffinity(sock=%d): "
+			"SIO_QUERY_RSS_PROCESSOR_INFO failed, "
+			"WSAGetLastError()=%d\n", sock, (int)WSAGetLastError());
+		return;
+	}
+
+	if (!SetThreadIdealProcessorEx(thread, &aff.Processor, NULL)) {
+		wintirpc_warnx("wintirpc_setrssaffinity(sock=%d): "
+			"SetThreadIdealProcessorEx() failed, lasterr=%d\n",
+			sock, (int)GetLastError());
+		return;
+	}
+
+	if (bind_node) {
+		(void)memset(&node_affinity, 0, sizeof(node_affinity));
+		if ((!GetNumaNodeProcessorMaskEx(aff.NumaNodeId,
+			&node_affinity)) ||
+			(node_affinity.Mask == 0) ||
+			(!SetThreadGroupAffinity(thread, &node_affinity, NULL))) {
+			wintirpc_warnx("wintirpc_setrssaffinity(sock=%d): "
+				"cannot bind thread to NUMA node %d, "
+				"lasterr=%d\n",
+				sock, (int)aff.NumaNodeId, (int)GetLastError());
 		}
+	}
 
 #ifdef _DEBUG
-		(void)printf("wintirpc_setnfsclientsockopts(sock=%d): "
-			"set SO_SNDBUF to %d\n", sock, (int)sndbufvalue);
+	(void)printf("wintirpc_setrssaffinity(sock=%d): "
+		"thread on group %d processor %d node %d\n",
+		sock, (int)aff.Processor.Group, (int)aff.Processor.Number,
+		(int)aff.NumaNodeId);
 #endif
-	}
-#endif /* NFS41_DRIVER_USE_LARGE_SOCKET_RCVSND_BUFFERS */
 }
 
 void wintirpc_syslog(int prio, const char *format, ...)
@@ -134,6 +134,22 @@ static const struct  xdr_ops xdrrec_ops = {
 
 #define LAST_FRAG ((u_int32_t)(1 << 31))
 
+/*
+ * Gather send - |xdr_opaque_ref()| payloads are not copied into the
+ * output buffer, but sent from the caller's memory together with the
+ * buffer by the |__xdrrec_setwritev()| routine
+ */
+/* Max number of referenced payloads per output buffer */
+#define XDRREC_MAX_OUT_REFS 4
+/* Smaller payloads are cheaper to copy than to send separately */
+#define XDRREC_MIN_OUT_REF_LEN 4096
+
+struct rec_out_ref {
+	u_int		pos;	/* offset in |out_base| */
+	const char	*addr;
+	u_int		len;
+};
+
 typedef struct rec_strm {
 	char *tcp_handle;
 	/*
@@ -145,6 +161,13 @@ typedef struct rec_strm {
 	char *out_boundry;	/* data cannot up to this address */
 	u_int32_t *frag_header;	/* beginning of curren fragment */
 	bool_t frag_sent;	/* true if buffer sent in middle of record */
+	/* like writeit, but for an array of buffers (optional) */
+	int (*writevit)(void *, WSABUF *, int);
+	struct rec_out_ref out_refs[XDRREC_MAX_OUT_REFS];
+	int out_nrefs;
+	u_int out_refs_len;	/* sum of |out_refs[].len| */
+	/* |xdr_opaque_ref()| must copy, see |__xdrrec_setnorefs()| */
+	bool_t out_norefs;
 	/*
 	 * in-coming bits
 	 */
@@ -170,6 +193,7 @@ typedef struct rec_strm {
 
 static u_int	fix_buf_size(u_int);
 static bool_t	flush_out(RECSTREAM *, bool_t);
+static bool_t	flush_out_refs(RECSTREAM *, u_int32_t, u_int32_t);
 static bool_t	fill_input_buf(RECSTREAM *);
 static bool_t	get_input_bytes(RECSTREAM *, char *, u_int);
 static bool_t	set_input_fragment(RECSTREAM *);
@@ -235,6 +259,10 @@ xdrrec_create(
 	rstrm->out_finger += sizeof(u_int32_t);
 	rstrm->out_boundry += sendsize;
 	rstrm->frag_sent = FALSE;
+	rstrm->writevit = NULL;
+	rstrm->out_nrefs = 0;
+	rstrm->out_refs_len = 0;
+	rstrm->out_norefs = FALSE;
 	rstrm->in_size = recvsize;
 	rstrm->in_boundry = rstrm->in_base;
 	rstrm->in_finger = (rstrm->in_boundry += recvsize);
@@ -370,6 +398,7 @@ xdrrec_getpos(XDR *xdrs)
 
 		case XDR_ENCODE:
 			pos += PtrToLong(rstrm->out_finger) - PtrToLong(rstrm->out_base);
+			pos += rstrm->out_refs_len;
 			break;
 
 		case XDR_DECODE:
@@ -397,6 +426,9 @@ xdrrec_setpos(
 		switch (xdrs->x_op) {
 
 		case XDR_ENCODE:
+			/* cannot move across referenced payloads */
+			if (rstrm->out_nrefs > 0)
+				break;
 			newpos = rstrm->out_finger - delta;
 			if ((newpos > (char *)(void *)(rstrm->frag_header)) &&
 				(newpos < rstrm->out_boundry)) {
@@ -565,7 +597,8 @@ xdrrec_endofrecord(
 	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
 	u_long len;  /* fragment length */
 
-	if (sendnow || rstrm->frag_sent ||
+	/* referenced payloads must be sent before the caller returns */
+	if (sendnow || rstrm->frag_sent || (rstrm->out_nrefs > 0) ||
 		(PtrToUlong(rstrm->out_finger) + sizeof(u_int32_t) >=
 		PtrToUlong(rstrm->out_boundry))) {
 		rstrm->frag_sent = FALSE;
@@ -687,9 +720,176 @@ __xdrrec_setblock(XDR *xdrs)
 	rstrm->nonblock = FALSE;
 	return TRUE;
 }
+
+/*
+ * Enable gather send for |xdr_opaque_ref()|, |writevit| must send
+ * all buffers or fail, like |writeit|
+ */
+bool_t
+__xdrrec_setwritev(
+	XDR *xdrs,
+	int (*writevit)(void *, WSABUF *, int))
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+
+	rstrm->writevit = writevit;
+	return TRUE;
+}
+
+/*
+ * Make |xdr_opaque_ref()| copy into the output buffer, for callers
+ * which need the encoded data to be contiguous in the output buffer
+ * (e.g. RPCSEC_GSS integrity/privacy, which checksums or encrypts the
+ * arguments in place). Returns the previous setting.
+ */
+bool_t
+__xdrrec_setnorefs(
+	XDR *xdrs,
+	bool_t norefs)
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+	bool_t old;
+
+	if (xdrs->x_ops != &xdrrec_ops)
+		return FALSE;
+	old = rstrm->out_norefs;
+	rstrm->out_norefs = norefs;
+	return old;
+}
+
+/*
+ * Number of bytes of complete records which |xdrrec_endofrecord()|
+ * with |sendnow| = |FALSE| left in the output buffer
+ */
+u_int
+__xdrrec_outbuf_len(XDR *xdrs)
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+
+	if (xdrs->x_ops != &xdrrec_ops)
+		return 0;
+	return (u_int)(PtrToUlong(rstrm->frag_header) -
+		PtrToUlong(rstrm->out_base));
+}
+
+/*
+ * Send the complete records left in the output buffer, must not be
+ * called while a record is being encoded
+ */
+bool_t
+__xdrrec_flush(XDR *xdrs)
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+	u_int32_t len;
+	bool_t ok = TRUE;
+
+	if (xdrs->x_ops != &xdrrec_ops)
+		return FALSE;
+	len = (u_int32_t)(PtrToUlong(rstrm->frag_header) -
+		PtrToUlong(rstrm->out_base));
+	if (len > 0) {
+		if ((*(rstrm->writeit))(rstrm->tcp_handle, rstrm->out_base,
+			(int)len) != (int)len)
+			ok = FALSE;
+		rstrm->frag_header = (u_int32_t *)(void *)rstrm->out_base;
+		rstrm->out_finger = (char *)rstrm->out_base + sizeof(u_int32_t);
+	}
+	return ok;
+}
+
+/*
+ * Same as |xdr_opaque()|, but when encoding to a record stream with
+ * gather send enabled the bytes are sent directly from |cp| when the
+ * record (or the full output buffer) is flushed, instead of being
+ * copied into the output buffer first.
+ * |cp| must not be modified or freed until |xdrrec_endofrecord()|
+ * has returned.
+ */
+bool_t
+xdr_opaque_ref(
+	XDR *xdrs,
+	const char *cp,
+	u_int cnt)
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+	static const char xdr_zero[BYTES_PER_XDR_UNIT] = { 0, 0, 0, 0 };
+	struct rec_out_ref *ref;
+	u_int rndup;
+
+	if ((xdrs->x_op != XDR_ENCODE) || (xdrs->x_ops != &xdrrec_ops) ||
+		(rstrm->writevit == NULL) || rstrm->out_norefs ||
+		(rstrm->out_nrefs >= XDRREC_MAX_OUT_REFS) ||
+		(cnt < XDRREC_MIN_OUT_REF_LEN))
+		return xdr_opaque(xdrs, (char *)cp, cnt);
+
+	ref = &rstrm->out_refs[rstrm->out_nrefs++];
+	ref->pos = (u_int)(rstrm->out_finger - rstrm->out_base);
+	ref->addr = cp;
+	ref->len = cnt;
+	rstrm->out_refs_len += cnt;
+
+	rndup = cnt % BYTES_PER_XDR_UNIT;
+	if (rndup > 0)
+		return xdrrec_putbytes(xdrs, xdr_zero,
+			BYTES_PER_XDR_UNIT - rndup);
+	return (TRUE);
+}
 /*
  * Internal useful routines
  */
+
+/*
+ * |flush_out()| for an output buffer with |xdr_opaque_ref()|
+ * payloads, sends the buffer and the payloads with one
+ * |writevit()| call
+ */
+static bool_t
+flush_out_refs(
+	RECSTREAM *rstrm,
+	u_int32_t len,
+	u_int32_t eormask)
+{
+	WSABUF bufs[(2 * XDRREC_MAX_OUT_REFS) + 1];
+	u_int pos = 0, end;
+	int i, nbufs = 0;
+	int total = (int)(rstrm->out_finger - rstrm->out_base) +
+		(int)rstrm->out_refs_len;
+	bool_t res;
+
+	*(rstrm->frag_header) = htonl((len + rstrm->out_refs_len) | eormask);
+
+	end = (u_int)(rstrm->out_finger - rstrm->out_base);
+	for (i = 0 ; i < rstrm->out_nrefs ; i++) {
+		struct rec_out_ref *ref = &rstrm->out_refs[i];
+
+		if (ref->pos > pos) {
+			bufs[nbufs].buf = rstrm->out_base + pos;
+			bufs[nbufs].len = ref->pos - pos;
+			nbufs++;
+			pos = ref->pos;
+		}
+		bufs[nbufs].buf = (char *)ref->addr;
+		bufs[nbufs].len = ref->len;
+		nbufs++;
+	}
+	if (end > pos) {
+		bufs[nbufs].buf = rstrm->out_base + pos;
+		bufs[nbufs].len = end - pos;
+		nbufs++;
+	}
+
+	res = ((*(rstrm->writevit))(rstrm->tcp_handle, bufs, nbufs) == total);
+
+	/* never keep references to the caller's memory */
+	rstrm->out_nrefs = 0;
+	rstrm->out_refs_len = 0;
+	if (!res)
+		return (FALSE);
+	rstrm->frag_header = (u_int32_t *)(void *)rstrm->out_base;
+	rstrm->out_finger = (char *)rstrm->out_base + sizeof(u_int32_t);
+	return (TRUE);
+}
+
 static bool_t
 flush_out(
 	RECSTREAM *rstrm,
@@ -699,6 +899,9 @@ flush_out(
 	u_int32_t len = (u_int32_t)(PtrToUlong(rstrm->out_finger) - 
 		PtrToUlong(rstrm->frag_header) - sizeof(u_int32_t));
 
+	if (rstrm->out_nrefs > 0)
+		return flush_out_refs(rstrm, len, eormask);
+
 	*(rstrm->frag_header) = htonl(len | eormask);
 	len = (u_int32_t)(PtrToUlong(rstrm->out_finger) - 
 	    PtrToUlong(rstrm->out_base));
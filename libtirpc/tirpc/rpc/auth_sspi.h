@@ -101,6 +101,9 @@ bool_t xdr_rpc_sspi_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 AUTH *authsspi_create(CLIENT *, sspi_name_t, struct rpc_sspi_sec *);
 AUTH *authsspi_create_default(CLIENT *, char *, int);
 bool_t authsspi_service(AUTH *auth, int svc);
+bool_t authsspi_get_expiry(AUTH *auth, TimeStamp *expiry);
+u_int authsspi_get_window(AUTH *auth);
+void authsspi_set_clnt(AUTH *auth, CLIENT *clnt);
 uint32_t sspi_get_mic(void *ctx, u_int qop, u_int seq,
                       sspi_buffer_desc *bufin, sspi_buffer_desc *bufout);
 uint32_t sspi_verify_mic(void *ctx, u_int seq, sspi_buffer_desc *bufin,
@@ -110,6 +113,13 @@ uint32_t sspi_wrap(void *ctx, u_int seq, sspi_buffer_desc *bufin,
 uint32_t sspi_unwrap(void *ctx, u_int seq, sspi_buffer_desc *bufin,
                      sspi_buffer_desc *bufout, u_int *conf_state,
                      unsigned long *qop_state);
+uint32_t sspi_wrap_sizes(void *ctx, u_int *trailer_len, u_int *padding_len);
+uint32_t sspi_wrap_inplace(void *ctx, u_int seq, u_char *buf,
+                           u_int trailer_len, u_int data_len,
+                           u_int padding_len, u_int *wrap_len);
+uint32_t sspi_unwrap_inplace(void *ctx, u_int seq, sspi_buffer_desc *bufin,
+                             sspi_buffer_desc *bufout, u_int *conf_state,
+                             unsigned long *qop_state);
 void sspi_release_buffer(sspi_buffer_desc *buf);
 uint32_t sspi_import_name(sspi_buffer_desc *name_in, sspi_name_t *name_out);
 
@@ -421,6 +421,76 @@ extern CLIENT *clnt_vc_create(const int, const struct netbuf *,
 			      const rpcprog_t, const rpcvers_t,
 			      u_int, u_int, int (*cb_xdr)(void *, void *),
                   int (*cb)(void *, void *, void **), void *args);
+
+/*
+ * Direct placement of a bulk payload in the reply of the next
+ * |clnt_call()| made by this thread over a |clnt_vc_create()| handle.
+ *
+ * |locate()| is called by the connection's receive thread with the
+ * first |len| bytes of the (unwrapped) results of the reply, before
+ * the rest of the record has been read from the socket. |avail| is
+ * the number of result bytes in the first record fragment.
+ * If it returns |TRUE| the |payload_len| bytes at |offset| (relative
+ * to |results|, plus XDR padding, all within |avail|) are received
+ * directly into |dest|, and are not passed to the results decoder,
+ * which must skip them instead.
+ * |locate()| must not block, it runs with the connection's pending
+ * call list locked.
+ *
+ * The placement must remain valid until |clnt_call()| returns, it is
+ * only used for the next call and then cleared.
+ */
+struct clnt_reply_placement {
+	bool_t	(*locate)(void *arg, const char *results, u_int len,
+		    u_int avail, u_int *offset, u_int *payload_len,
+		    char **dest);
+	void	*arg;
+};
+extern void clnt_set_reply_placement(const struct clnt_reply_placement *);
+
+/*
+ * Use |auth| instead of |cl_auth| for the next |clnt_call()| made by
+ * this thread over a |clnt_vc_create()| handle, so that several
+ * callers can share one |CLIENT| with different credentials. Like
+ * the reply placement it is only used for the next call and then
+ * cleared.
+ */
+extern void clnt_set_call_auth(AUTH *);
+
+/*
+ * Returns the xid of the last |clnt_call()| made by this thread over a
+ * |clnt_vc_create()| handle, or 0 if there was none
+ */
+extern u_int32_t clnt_get_last_xid(void);
+
+/*
+ * Shut down the connection of a |clnt_vc_create()| handle, so that
+ * all calls waiting for a reply fail with |RPC_CANTRECV| right away
+ * instead of after their timeout. The handle must still be destroyed
+ * with |clnt_destroy()|.
+ */
+extern void clnt_abort_calls(CLIENT *);
+
+/*
+ * Socket options for the TCP connections created by the following
+ * |clnt_tli_create()| calls of this thread. Unlike the reply placement
+ * this stays set until it is changed, |NULL| restores the defaults
+ * (|TCP_NODELAY| and the |NFS41_DRIVER_USE_LARGE_SOCKET_RCVSND_BUFFERS|
+ * buffer size). The struct must remain valid while it is set.
+ */
+#define CLNT_SOCKOPT_NODELAY		0x0001
+#define CLNT_SOCKOPT_LOOPBACK_FASTPATH	0x0002 /* |SIO_LOOPBACK_FAST_PATH| */
+#define CLNT_SOCKOPT_RSS_AFFINITY	0x0004 /* receive thread on RSS CPU */
+#define CLNT_SOCKOPT_RSS_NUMA_NODE	0x0008 /* receive and callback */
+						/* threads on RSS node */
+#define CLNT_SOCKBUF_DEFAULT		(~0U)
+struct clnt_sockopts {
+	u_int	sockbuf;	/* |SO_RCVBUF|/|SO_SNDBUF|, 0 = autotuning */
+	u_int	keepalive;	/* keepalive idle time in msecs, 0 = off */
+	u_int	flags;		/* |CLNT_SOCKOPT_*| */
+};
+extern void clnt_set_sockopts(const struct clnt_sockopts *);
+
 /*
  * Added for compatibility to old rpc 4.0. Obsoleted by clnt_vc_create().
  */
@@ -318,6 +318,7 @@ extern bool_t	xdr_enum(XDR *, enum_t *);
 extern bool_t	xdr_array(XDR *, char **, u_int *, u_int, u_int, xdrproc_t);
 extern bool_t	xdr_bytes(XDR *, char **, u_int *, u_int);
 extern bool_t	xdr_opaque(XDR *, char *, u_int);
+extern bool_t	xdr_opaque_ref(XDR *, const char *, u_int);
 extern bool_t	xdr_string(XDR *, char **, u_int);
 extern bool_t	xdr_union(XDR *, enum_t *, char *, const struct xdr_discrim *, xdrproc_t);
 extern bool_t	xdr_char(XDR *, char *);
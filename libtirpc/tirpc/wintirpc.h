@@ -166,6 +166,9 @@ int wintirpc_getsockopt(int socket, int level, int option_name,
 int wintirpc_setsockopt(int socket, int level, int option_name,
     const void *option_value, socklen_t option_len);
 void wintirpc_setnfsclientsockopts(int sock);
+void wintirpc_setrssaffinity(int sock, HANDLE thread, int bind_node);
+struct clnt_sockopts;
+const struct clnt_sockopts *__clnt_get_sockopts(void);
 void wintirpc_syslog(int prio, const char *format, ...);
 void wintirpc_warnx(const char *format, ...);
 void *wintirpc_mem_alloc(size_t s);
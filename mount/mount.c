@@ -145,11 +145,15 @@ void PrintMountUsage(LPWSTR pProcess)
         "\tro\tmount as read-only\n"
         "\trw\tmount as read-write (default)\n"
         "\tport=#\tTCP port to use (defaults to 2049)\n"
+        "\tproto=tcp\ttransport protocol, only 'tcp' is supported\n"
+            "\t\t('rdma' is rejected, there is no RPC-over-RDMA transport)\n"
         "\tvers=#\tNFS protocol version, either 4.1 or 4.2\n"
             "\t\tIf this option is not specified, the client negotiates a\n"
             "\t\tsuitable version with the server, trying version 4.2 and then 4.1\n"
         "\trsize=#\tread buffer size in bytes\n"
         "\twsize=#\twrite buffer size in bytes\n"
+        "\tnconnect=#\tnumber of TCP connections to the server (1-16,\n"
+            "\t\tdefaults to 1), bound to the same NFSv4.1 session\n"
         "\tsec=none:sys:krb5:krb5i:krb5p\tspecify (gss) security flavor "
             "(defaults to 'sys')\n"
         "\twritethru\tturns off rdbss caching for writes\n"
@@ -158,6 +162,69 @@ void PrintMountUsage(LPWSTR pProcess)
         "\tnocache\tturns off rdbss caching\n"
         "\ttimebasedcoherency\tturns on time-based coherency\n"
         "\tnotimebasedcoherency\tturns off time-based coherency (default, due to bugs)\n"
+        "\tvolcachettl=#\tseconds to cache volume size information\n"
+            "\t\t(0-3600, 0 disables the cache, defaults to 5)\n"
+        "\taclcachettl=#\tseconds to cache security descriptors per file\n"
+            "\t\t(0-3600, defaults to 5)\n"
+        "\tacregmin=#\tminimum seconds to cache file attributes (defaults to 30)\n"
+        "\tacregmax=#\tmaximum seconds to cache file attributes (defaults to 60)\n"
+        "\tacdirmin=#\tminimum seconds to cache directory attributes\n"
+            "\t\tand name lookups (defaults to 30)\n"
+        "\tacdirmax=#\tmaximum seconds to cache directory attributes\n"
+            "\t\t(defaults to 60)\n"
+        "\tactimeo=#\tsets acregmin, acregmax, acdirmin and acdirmax to the\n"
+            "\t\tsame value (0-3600, 0 disables the name/attribute cache)\n"
+        "\tnamecachesize=#\tsize of the name/attribute cache in megabytes\n"
+            "\t\t(1-1024, defaults to 32), shared by all mounts of a server\n"
+        "\tclosetimeo=#\tseconds to keep a file open on the server after\n"
+            "\t\tthe last close, for reuse by the next open\n"
+            "\t\t(0-60, 0 disables deferred close, defaults to 1)\n"
+        "\tprofile=build:media:db:home\tset the cache and I/O options\n"
+            "\t\tabove for a workload, explicit options override the profile\n"
+            "\t\t('build': long attribute cache and deferred close timeouts,\n"
+            "\t\t'media': largest rsize/wsize,\n"
+            "\t\t'db': nocache, writethru, actimeo=0, closetimeo=0,\n"
+            "\t\t'home': the defaults)\n"
+        "\tsparsewrite\tpunch holes (NFSv4.2 DEALLOCATE) for page-aligned\n"
+            "\t\tall-zero ranges inside large writes instead of sending\n"
+            "\t\tthe zeros over the wire\n"
+        "\tnosparsewrite\twrite all-zero ranges as data (default)\n"
+        "\tfsc\tcache file data on the local disk, requires\n"
+            "\t\t\"nfsd --fscache <dir>\"\n"
+        "\tnofsc\tdo not cache file data on the local disk (default)\n"
+        "\tautotune\tmeasure the round trip time and bandwidth to the\n"
+            "\t\tserver, and choose the READ/WRITE pipeline depth,\n"
+            "\t\treadahead window and number of connections from them\n"
+        "\tnoautotune\tuse the fixed defaults (default)\n"
+        "\tnocto\tdo not drop cached file data on open unless the\n"
+            "\t\tfile changed, and disable timebasedcoherency\n"
+        "\tcto\tclose-to-open consistency (default)\n"
+        "\timmutable\tfor exports which only change when they are\n"
+            "\t\trepublished: implies nocto, cached attributes, names\n"
+            "\t\tand ACLs are valid until \"nfsclientdctl flush\"\n"
+        "\tnoimmutable\tnormal cache timeouts (default)\n"
+        "\tsockbuf=#\tsocket send and receive buffer size in kilobytes\n"
+            "\t\t(0-65536, 0 uses the Windows autotuning, e.g. for\n"
+            "\t\thigh-latency WAN links, defaults to 8192)\n"
+        "\tnodelay\tdisable the Nagle algorithm (TCP_NODELAY, default)\n"
+        "\tnonodelay\tenable the Nagle algorithm\n"
+        "\tkeepalive=#\tseconds of idle time before TCP keepalive probes\n"
+            "\t\tare sent (0-7200, 0 disables keepalive, the default)\n"
+        "\treadahead=#\tCache Manager read-ahead granularity in kilobytes,\n"
+            "\t\trounded down to a power of two, should be a multiple\n"
+            "\t\tof rsize (0-65536, 0 uses the default of 65536)\n"
+        "\twritebehind=#\tkilobytes of dirty cached data per file before\n"
+            "\t\twriters are throttled, rounded up to a multiple of wsize\n"
+            "\t\t(0-1048576, 0 means no per-file limit, the default)\n"
+        "\tmaxbw=#\tlimit the READ/WRITE bandwidth of this mount to #\n"
+            "\t\tkilobytes per second (0-16777216, 0 means no limit,\n"
+            "\t\tthe default)\n"
+        "\tmaxiops=#\tlimit this mount to # READ/WRITE requests per\n"
+            "\t\tsecond (0-1048576, 0 means no limit, the default)\n"
+        "\tloopbackfastpath\tuse the TCP loopback fast path\n"
+            "\t\t(SIO_LOOPBACK_FAST_PATH) for servers on the same machine\n"
+        "\trssaffinity\trun the receive thread of each connection on the\n"
+            "\t\tCPU which RSS assigned to the connection\n"
         "\twsize=#\twrite buffer size in bytes\n"
         "\tcreatemode=\tspecify default POSIX permission mode\n"
             "\t\tfor new directories and files created on the NFS share.\n"
@@ -261,4 +261,681 @@
  */
 #define NFS41_DRIVER_HACK_HANDLE_NFS_DELAY_GRACE_WIP 1
 
+/*
+ * |NFS41_DRIVER_DAEMON_READAHEAD| - detect sequential reads per open
+ * file in the daemon and prefetch the next window into a bounded
+ * buffer pool, so the next READ upcall can be served without a
+ * round trip to the server.
+ * Prefetched data is discarded on WRITE or truncate through the
+ * same open file, and after one second.
+ */
+#define NFS41_DRIVER_DAEMON_READAHEAD 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS| - start a small number
+ * of nfsd worker threads and add more on demand, up to
+ * "--numworkerthreads", instead of starting all of them at startup.
+ */
+#define NFS41_DRIVER_DAEMON_DYNAMIC_WORKER_THREADS 1
+
+/*
+ * |NFS41_DRIVER_BATCHED_UPCALLS| - nfsd fetches several queued upcalls
+ * of the same logon session with one |IOCTL_NFS41_READ_BATCH| and
+ * returns their downcalls with one |IOCTL_NFS41_WRITE_BATCH|.
+ * nfsd falls back to |IOCTL_NFS41_READ|/|IOCTL_NFS41_WRITE| if the
+ * kernel does not support batches.
+ */
+#define NFS41_DRIVER_BATCHED_UPCALLS 1
+
+/*
+ * |NFS41_DRIVER_FCB_ATTRCACHE| - answer |FileBasicInformation|,
+ * |FileStandardInformation| and (with |NFS41_DRIVER_WSL_SUPPORT|)
+ * |FileStatInformation|/|FileStatLxInformation| queries from
+ * |nfs41_fcb->BasicInfo|/|nfs41_fcb->StandardInfo|/
+ * |nfs41_fcb->StatLxInfo| without an upcall, as long as the data
+ * is younger than |NFS41_DRIVER_FCB_ATTRCACHE_TIMEOUT_MS| or the
+ * handle holds a delegation.
+ * SETATTR, WRITE, delegation recalls and time-based coherency
+ * changes invalidate the cache.
+ */
+#define NFS41_DRIVER_FCB_ATTRCACHE 1
+#define NFS41_DRIVER_FCB_ATTRCACHE_TIMEOUT_MS (3000)
+
+/*
+ * |NFS41_DRIVER_FASTIO_QUERYINFO| - add |FastIoQueryBasicInfo| and
+ * |FastIoQueryStandardInfo| callbacks to the RDBSS fast I/O dispatch
+ * table, which answer from the FCB attribute cache without building
+ * an IRP. Requires |NFS41_DRIVER_FCB_ATTRCACHE|.
+ */
+#define NFS41_DRIVER_FASTIO_QUERYINFO 1
+
+/*
+ * |NFS41_DRIVER_FCB_ACLCACHE| - keep the security descriptor returned
+ * by the last |NFS41_SYSOP_ACL_QUERY| upcall per FCB (instead of per
+ * FOBX for 1ms) for "aclcachettl=#" seconds, shared by all handles of
+ * the file. SetSecurity, SETATTR, EA changes, delegation recalls and
+ * coherency changes invalidate the cache.
+ */
+#define NFS41_DRIVER_FCB_ACLCACHE 1
+
+/*
+ * |NFS41_DRIVER_VOLUME_INFO_CACHE| - cache |FileFsSizeInformation|
+ * and |FileFsFullSizeInformation| per mount for "volcachettl=#"
+ * seconds, and answer |FileFsAttributeInformation| from the data
+ * returned by the MOUNT upcall.
+ */
+#define NFS41_DRIVER_VOLUME_INFO_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_READDIR_CACHE| - keep the decoded READDIR
+ * results of recently listed directories in nfsd, validated by the
+ * directory's change attribute, and add the filehandle and attributes
+ * of every READDIR entry to the name/attribute cache.
+ */
+#define NFS41_DRIVER_DAEMON_READDIR_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_READDIR_PREFETCH| - when a directory listing
+ * is served from the |NFS41_DRIVER_DAEMON_READDIR_CACHE| and the
+ * attribute cache no longer has fresh attributes for its entries,
+ * fetch them in the background with batched PUTFH/GETATTR compounds,
+ * for up to "--readdirprefetch" entries per directory listing.
+ * Requires |NFS41_DRIVER_DAEMON_READDIR_CACHE|.
+ */
+#define NFS41_DRIVER_DAEMON_READDIR_PREFETCH 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE| - cache the uid/gid and the
+ * AUTH_SYS supplementary gids nfsd maps from a thread's access token,
+ * keyed by the token's AuthenticationId and ModifiedId, instead of
+ * looking up the token user/groups and calling the idmapper for every
+ * upcall.
+ */
+#define NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_DEFERRED_CLOSE| - keep the NFS OPEN of a
+ * regular file for "closetimeo" seconds after the last handle was
+ * closed, and reuse it for a compatible re-open instead of sending a
+ * CLOSE and a new OPEN.
+ */
+#define NFS41_DRIVER_DAEMON_DEFERRED_CLOSE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_WRITE_BEHIND| - while a write delegation is
+ * held, send WRITEs as UNSTABLE4 and postpone the COMMIT until the
+ * delegation is returned or the data has been uncommitted for a few
+ * seconds, instead of one FILE_SYNC4 WRITE per flush.
+ */
+#define NFS41_DRIVER_DAEMON_WRITE_BEHIND 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE| - keep the data/hole map
+ * found by |FSCTL_QUERY_ALLOCATED_RANGES| with the open state, and
+ * answer follow-up queries from it while the change attribute in the
+ * attribute cache still matches. Our own WRITEs and DEALLOCATEs
+ * update the map instead of discarding it.
+ */
+#define NFS41_DRIVER_DAEMON_EXTENT_MAP_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS| - choose between READ and
+ * READ_PLUS per open file from the share of holes seen in earlier
+ * READ_PLUS replies, instead of using READ_PLUS for every read once
+ * the server supports it.
+ */
+#define NFS41_DRIVER_DAEMON_ADAPTIVE_READ_PLUS 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT| - let the libtirpc
+ * receive thread |recv()| the payload of READ (and the first data
+ * segment of READ_PLUS) replies straight into the caller's buffer
+ * (the mapped user buffer for |NFS41_SYSOP_READ|), instead of into
+ * the RPC record buffer from where the decoder copies it again.
+ * Not used for krb5i/krb5p, which wrap the results.
+ */
+#define NFS41_DRIVER_DAEMON_READ_DIRECT_PLACEMENT 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_GSS_CTX_POOL| - krb5/krb5i/krb5p mounts keep
+ * one RPCSEC_GSS context per logon session of the calling user
+ * (instead of one context per |nfs41_rpc_clnt|), chosen per compound
+ * and re-established shortly before the ticket expires
+ */
+#define NFS41_DRIVER_DAEMON_GSS_CTX_POOL 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE| - keep negative name cache
+ * entries valid for as long as the change attribute of their parent
+ * directory is unchanged, instead of only for the fixed name entry
+ * timeout (see "negative lookup caching" in daemon/name_cache.c)
+ */
+#define NFS41_DRIVER_DAEMON_NEGATIVE_NAME_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_DIR_DELEGATIONS| - request directory delegations
+ * (GET_DIR_DELEGATION) for directories which are listed or looked up
+ * often, and keep their name cache entries and READDIR listing without
+ * timeout until a CB_NOTIFY or CB_RECALL arrives
+ */
+#define NFS41_DRIVER_DAEMON_DIR_DELEGATIONS 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_LAYOUT_RETAIN| - keep the layouts of closed
+ * files (which the server did not mark as return-on-close) for reuse
+ * by the next open, until they are recalled, idle for
+ * |LAYOUT_RETAIN_IDLE_TIMEOUT| or pushed out by
+ * |LAYOUT_RETAIN_MAX| (see "retained layouts" in daemon/pnfs_layout.c)
+ */
+#define NFS41_DRIVER_DAEMON_LAYOUT_RETAIN 1
+
+/*
+ * |NFS41_DRIVER_ETW_TRACELOGGING| - emit ETW TraceLogging events from
+ * the kernel ("NFS41-Client-Driver", upcall enqueue/dequeue/downcall)
+ * and the daemon ("NFS41-Client-Daemon", RPC send/receive, cache
+ * lookups, delegation grants/recalls), for use with WPR/WPA
+ */
+#define NFS41_DRIVER_ETW_TRACELOGGING 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_UPCALL_TRACE| - support "nfsd --upcalltrace",
+ * which records opcode, timestamps, sizes and path hashes of all
+ * upcalls for offline analysis and for
+ * tests/upcallreplay/upcallreplay.exe
+ */
+#define NFS41_DRIVER_DAEMON_UPCALL_TRACE 1
+
+/*
+ * |NFS41_DRIVER_INLINE_RW| - pass the data of READ/WRITE requests up
+ * to |NFS41_RW_INLINE_MAX| bytes in the upcall/downcall buffers
+ * instead of mapping the request's MDL into the daemon's address
+ * space
+ */
+#define NFS41_DRIVER_INLINE_RW 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_IO_POOL| - the daemon registers a pool of I/O
+ * buffers with the kernel (|IOCTL_NFS41_SET_IO_POOL|), and READ/WRITE
+ * requests up to the pool's slot size are copied through it instead
+ * of mapping each request's MDL into the daemon's address space
+ * (which costs a |MmMapLockedPagesSpecifyCache()|, a
+ * |MmUnmapLockedPages()| and a TLB flush per I/O)
+ */
+#define NFS41_DRIVER_DAEMON_IO_POOL 1
+
+/*
+ * |NFS41_DRIVER_NUMA_UPCALL_QUEUES| - the kernel keeps one upcall
+ * queue and upcall entry lookasidelist per NUMA node, and the daemon
+ * binds its worker threads to the NUMA nodes round robin, so that
+ * upcalls are usually handed to a daemon thread on the node which
+ * queued them
+ */
+#define NFS41_DRIVER_NUMA_UPCALL_QUEUES 1
+
+/*
+ * |NFS41_DRIVER_DIRQUERY_BUFFER| - fetch directory entries in
+ * |NFS41_DIRQUERY_BUFFER_SIZE| batches into a per-FOBX kernel buffer,
+ * and serve small or |ReturnSingleEntry| directory queries from that
+ * buffer instead of making one upcall per query
+ */
+#define NFS41_DRIVER_DIRQUERY_BUFFER 1
+
+/*
+ * |NFS41_DRIVER_NEGATIVE_OPEN_CACHE| - remember for
+ * |NFS41_NEGCACHE_TTL_MSECS| which paths an OPEN without create
+ * disposition did not find, and fail further opens of these paths
+ * with |STATUS_OBJECT_NAME_NOT_FOUND| without an upcall (e.g. for
+ * PATH searches and build tools probing for files)
+ */
+#define NFS41_DRIVER_NEGATIVE_OPEN_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_AUTHSYS_CRED_CACHE| - cache the XDR encoded
+ * AUTH_SYS credential per token and uid/gid, so new AUTH_SYS handles
+ * (e.g. after SECINFO or a reconnect) are created by copying the
+ * cached credential. Requires |NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE|.
+ */
+#define NFS41_DRIVER_DAEMON_AUTHSYS_CRED_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_ACL_CACHE| - cache the self-relative security
+ * descriptors built by |handle_getacl()| per file, validated by the
+ * file's change attribute, instead of fetching the ACL and mapping
+ * owner, group and all ACEs through the idmapper for each query
+ */
+#define NFS41_DRIVER_DAEMON_ACL_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_EA_CACHE| - cache the list of EA names and
+ * small EA values per file, validated by the file's change attribute,
+ * instead of reading the named attribute directory for each EA query
+ */
+#define NFS41_DRIVER_DAEMON_EA_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_RPC_FAILOVER| - for servers with several
+ * addresses, connect to all addresses in parallel (staggered, the
+ * first address which answers wins), keep an established standby
+ * connection to another address, and probe the connections with a
+ * short NULL call, so that a dead connection is detected and replaced
+ * by the standby connection without waiting for the RPC timeout
+ */
+#define NFS41_DRIVER_DAEMON_RPC_FAILOVER 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_SESSION_TRUNKING| - bind a connection to each
+ * other address of the server which EXCHANGE_ID reports as the same
+ * server_owner (major and minor id) to the session, and spread the
+ * "nconnect" connections round-robin across all these addresses
+ */
+#define NFS41_DRIVER_DAEMON_SESSION_TRUNKING 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT| - estimate the RTT of
+ * each connection per class of compound (metadata, READ, WRITE), and
+ * derive the |clnt_call()| timeout from it instead of always waiting
+ * 90 seconds, so a dead connection is detected within a few seconds.
+ * Compounds which may take long on the server (COMMIT, COPY, ...)
+ * keep the fixed timeout.
+ */
+#define NFS41_DRIVER_DAEMON_RPC_ADAPTIVE_TIMEOUT 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_LAZY_INIT| - look up the DNS domain name and
+ * create the idmapper in a background thread while nfsd opens the
+ * upcall pipe and starts its worker threads, instead of doing the
+ * DNS queries before the driver is told that the daemon is running
+ */
+#define NFS41_DRIVER_DAEMON_LAZY_INIT 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_IDCACHEFILE| - "nfsd --idcachefile <file>"
+ * keeps copies of the idmap user/group and SID cache entries in a
+ * memory-mapped file, and loads the unexpired entries at startup
+ */
+#define NFS41_DRIVER_DAEMON_IDCACHEFILE 1
+
+/*
+ * |NFS41_DRIVER_DIRECT_IO| - non-paging READs/WRITEs on handles
+ * opened with |FILE_NO_INTERMEDIATE_BUFFERING| (or on "nocache"
+ * mounts) which are aligned to |NFS41_DIRECT_IO_ALIGNMENT| are sent
+ * as direct I/O: The caller's MDL is always mapped into the daemon
+ * (no I/O pool copy), the daemon skips readahead and sends the
+ * (parallel) WRITE chunks as |DATA_SYNC4| (|FILE_SYNC4| for
+ * write-through handles) without a COMMIT. The latency floor of a
+ * direct I/O is one upcall plus one READ/WRITE round trip to the
+ * server, plus the server's stable storage write for WRITEs;
+ * "nfsclientdctl mountstats" reports the number and the
+ * average/minimum latency of direct I/Os per NetRoot
+ */
+#define NFS41_DRIVER_DIRECT_IO 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_SYMLINK_CACHE| - cache symlink targets per
+ * file, validated by the file's change attribute, and read the
+ * targets of the symlinks in a directory listing with batched
+ * PUTFH+READLINK compounds instead of one READLINK per symlink
+ */
+#define NFS41_DRIVER_DAEMON_SYMLINK_CACHE 1
+
+/*
+ * |NFS41_DRIVER_FCB_UTF8NAME_CACHE| - keep the UTF-8 form of the
+ * FCB's prefixed name on the FCB, so that the upcalls for an open
+ * file (CLOSE, SETATTR, EA get/set, ...) copy the name into the
+ * upcall buffer instead of converting it from UTF-16 again
+ */
+#define NFS41_DRIVER_FCB_UTF8NAME_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_COMMIT_COALESCING| - COMMITs for different
+ * files which are needed at the same time (e.g. when many files are
+ * flushed and closed at once) are sent together in multi-file
+ * PUTFH+COMMIT compounds, see |nfs41_commit_batch()|
+ */
+#define NFS41_DRIVER_DAEMON_COMMIT_COALESCING 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_WRITE_GATHERING| - small FILE_SYNC4 WRITEs of
+ * the same open which queue up while one is in flight, and which
+ * continue each other, are merged into one FILE_SYNC4 WRITE, see
+ * |write_gathered()|
+ */
+#define NFS41_DRIVER_DAEMON_WRITE_GATHERING 1
+
+/*
+ * |NFS41_DRIVER_PAGING_WRITE_CLUSTERING| - paging WRITEs of the same
+ * open (Mm/Cc flushes of memory-mapped and cached files) which queue
+ * up are sorted, merged into UNSTABLE4 WRITEs and made stable with
+ * one COMMIT per batch, see |write_clustered()|. Requires
+ * |NFS41_DRIVER_DAEMON_WRITE_GATHERING|
+ */
+#define NFS41_DRIVER_PAGING_WRITE_CLUSTERING 1
+
+/*
+ * |NFS41_DRIVER_SETATTR_AT_CLOSE| - timestamp and end-of-file
+ * changes (e.g. the ones RDBSS sets at cleanup, or an archiver
+ * restoring the mtime of each file) are kept on the FOBX and sent
+ * as one SETATTR in the same compound as the CLOSE
+ */
+#define NFS41_DRIVER_SETATTR_AT_CLOSE 1
+
+/*
+ * |NFS41_DRIVER_SRVOPEN_COLLAPSING| - let RDBSS collapse opens of
+ * the same user with the same access and share modes onto an
+ * existing SRV_OPEN, so they share its NFSv4.1 open state instead
+ * of sending another |NFS41_SYSOP_OPEN| upcall. Only attribute-only
+ * opens of regular files are collapsed, see
+ * |nfs41_ShouldTryToCollapseThisOpen()|
+ */
+#define NFS41_DRIVER_SRVOPEN_COLLAPSING 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_ACCESS_CACHE| - cache the ACCESS results of
+ * the execute access check in |handle_open()| per user and file,
+ * validated by the change attribute, so running the same binaries
+ * or scripts over and over does not send ACCESS for every open.
+ * Requires |NFS41_DRIVER_DAEMON_TOKEN_ID_CACHE|.
+ */
+#define NFS41_DRIVER_DAEMON_ACCESS_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_OPEN_PREFETCH| - with "nfsd --openprefetch
+ * <KB>", OPENs of existing regular files for reading also READ the
+ * first KB of the file in the same compound, and keep the data as
+ * readahead buffer, so small files (headers, scripts, config files)
+ * are opened and read in one round trip. Off by default.
+ * Requires |NFS41_DRIVER_DAEMON_READAHEAD|.
+ */
+#define NFS41_DRIVER_DAEMON_OPEN_PREFETCH 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_ASYNC_LOGGING| - |DPRINTF()|, |eprintf()|
+ * and |logprintf()| format into a per-thread buffer and queue the
+ * line for a writer thread, instead of writing (and flushing)
+ * through stdio on the calling thread; lines are dropped (and
+ * counted) if the queue is full
+ */
+#define NFS41_DRIVER_DAEMON_ASYNC_LOGGING 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_READDIR_PIPELINE| - while a directory is
+ * enumerated from the server (not from the
+ * |NFS41_DRIVER_DAEMON_READDIR_CACHE|), send the READDIR for the next
+ * batch in the background as soon as the current batch is returned,
+ * and grow the batch size with every READDIR of the enumeration
+ */
+#define NFS41_DRIVER_DAEMON_READDIR_PIPELINE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH| - detect depth-first tree
+ * walks on a mount and read the subdirectories of the listings being
+ * returned into the |NFS41_DRIVER_DAEMON_READDIR_CACHE| in the
+ * background, for up to "--treewalkprefetch" concurrent threads.
+ * Requires |NFS41_DRIVER_DAEMON_READDIR_CACHE|.
+ */
+#define NFS41_DRIVER_DAEMON_TREEWALK_PREFETCH 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_FSCACHE| - persistent local cache of file
+ * data for mounts with the "fsc" option, stored in the directory
+ * given by "nfsd --fscache <dir>" and validated with the change
+ * attribute, see daemon/fscache.c
+ */
+#define NFS41_DRIVER_DAEMON_FSCACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_MEMORY_PRESSURE| - watch the system memory
+ * state with |CreateMemoryResourceNotification()|, shrink the SID,
+ * idmap, READDIR and readahead caches and return cold delegations
+ * while memory is low, and let the caches grow past their defaults
+ * while memory is plentiful, see daemon/mempressure.c
+ */
+#define NFS41_DRIVER_DAEMON_MEMORY_PRESSURE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_FAIR_SLOTS| - share the session slots of a
+ * mount fairly between the users whose upcalls use them, weighted with
+ * "nfsd --slotweight", and optionally cap the slots per user with
+ * "nfsd --maxuserslots", see daemon/nfs41_session.c
+ */
+#define NFS41_DRIVER_DAEMON_FAIR_SLOTS 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_QOS| - limit the READ/WRITE bandwidth and
+ * request rate of a mount with the "maxbw" and "maxiops" mount
+ * options, enforced with token buckets in the daemon, see
+ * daemon/qos.c
+ */
+#define NFS41_DRIVER_DAEMON_QOS 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS| - ask NFSv4.2 servers for
+ * delegated timestamps (RFC 9754), and keep timestamp-only SETATTRs
+ * and the time_modify updates of WRITEs local while a write
+ * delegation with delegated timestamps is held, see
+ * daemon/delegation.c
+ */
+#define NFS41_DRIVER_DAEMON_DELEG_TIMESTAMPS 1
+
+/*
+ * |NFS41_DRIVER_DIR_CHANGE_NOTIFY| - support
+ * |IRP_MN_NOTIFY_CHANGE_DIRECTORY|; changes are taken from CB_NOTIFY
+ * for directories with a directory delegation, and from a change
+ * attribute poller for all others, see daemon/dirnotify.c
+ */
+#define NFS41_DRIVER_DIR_CHANGE_NOTIFY 1
+
+/*
+ * |NFS41_DRIVER_FASTIO_QUERYOPEN| - add a |FastIoQueryOpen| callback
+ * which answers |NtQueryFullAttributesFile()| (used by
+ * |GetFileAttributesEx()|, |stat()| etc.) with one
+ * |NFS41_SYSOP_QUERY_OPEN| upcall, which is served from the daemon's
+ * name/attribute cache or does a LOOKUP+GETATTR, without creating
+ * NFS open state
+ */
+#define NFS41_DRIVER_FASTIO_QUERYOPEN 1
+
+/*
+ * |NFS41_DRIVER_OPEN_BY_FILEID| - support |FILE_OPEN_BY_FILE_ID| opens
+ * of files which are in the daemon's name cache, with one
+ * PUTFH+OPEN(CLAIM_FH) compound instead of a path walk, see
+ * |nfs41_name_cache_fileid_lookup()|
+ */
+#define NFS41_DRIVER_OPEN_BY_FILEID 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_XDR_TEMPLATES| - encode the hot compound
+ * shapes (SEQUENCE+PUTFH+GETATTR, READ, WRITE, LOOKUP, CLOSE) from
+ * per-operation templates into one |XDR_INLINE()| buffer instead of
+ * field by field, see "Compound templates" in daemon/nfs41_xdr.c
+ */
+#define NFS41_DRIVER_DAEMON_XDR_TEMPLATES 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT| - collect the ranges of
+ * DATA_SYNC4 pNFS writes and send one LAYOUTCOMMIT on close, GETATTR,
+ * SETATTR of the size, LAYOUTRETURN or layout recall, or when the
+ * range gets older than one second, instead of one per write upcall
+ */
+#define NFS41_DRIVER_DAEMON_DEFERRED_LAYOUTCOMMIT 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_PNFS_FLEXFILES| - support pNFS Flexible Files
+ * layouts (RFC 8435) with tightly coupled NFSv4.1/4.2 data servers:
+ * Reads go to the mirror with the lowest observed latency, writes go
+ * to all mirrors in parallel, and data server errors are reported to
+ * the metadata server with LAYOUTERROR
+ */
+#define NFS41_DRIVER_DAEMON_PNFS_FLEXFILES 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_PNFS_DS_POOL| - share pNFS data server clients
+ * between all devices and mounts with the same client owner through
+ * a global pool, and register for CB_NOTIFY_DEVICEID so changed or
+ * deleted devices are fetched again instead of failing
+ */
+#define NFS41_DRIVER_DAEMON_PNFS_DS_POOL 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS| - count the bytes, ops and
+ * busy time of pNFS io per layout segment and data server, report
+ * them to NFSv4.2 metadata servers with LAYOUTSTATS once a minute,
+ * and report data server errors with LAYOUTERROR for all layout types
+ */
+#define NFS41_DRIVER_DAEMON_PNFS_LAYOUTSTATS 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_INTERSERVER_COPY| - offloaded copies between
+ * files on different NFSv4.2 servers use COPY_NOTIFY to the source
+ * server and COPY with |ca_source_server| to the destination server,
+ * so the data does not pass through this machine
+ */
+#define NFS41_DRIVER_DAEMON_INTERSERVER_COPY 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_WRITE_SAME| - zero ranges which must stay
+ * allocated with NFSv4.2 WRITE_SAME, and fall back to WRITEs from a
+ * shared zero buffer if the server does not support WRITE_SAME.
+ * |FileAllocationInformation| reserves the file's blocks up to the
+ * new allocation size with ALLOCATE
+ */
+#define NFS41_DRIVER_DAEMON_WRITE_SAME 1
+
+/*
+ * |NFS41_DRIVER_NUMA_BUFFER_POOLS| - extends
+ * |NFS41_DRIVER_NUMA_UPCALL_QUEUES|: the daemon commits each NUMA
+ * node's part of the I/O pool (|NFS41_DRIVER_DAEMON_IO_POOL|) on that
+ * node and the kernel takes pool slots from the upcall's node first,
+ * session slot searches start in a per-node part of the slot table,
+ * and the RPC receive and backchannel threads of a connection are
+ * bound to the NUMA node of the NIC's RSS queue
+ */
+#define NFS41_DRIVER_NUMA_BUFFER_POOLS 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_LARGE_PAGES| - if the daemon has
+ * |SeLockMemoryPrivilege| the I/O pool and the readahead buffers use
+ * |MEM_LARGE_PAGES| memory to reduce TLB misses for READ/WRITE data
+ * copies, otherwise normal pages are used
+ */
+#define NFS41_DRIVER_DAEMON_LARGE_PAGES 1
+
+/*
+ * |NFS41_DRIVER_DELEGATED_LOCK_BUFFERING| - while the daemon holds a
+ * write delegation RDBSS grants and releases byte-range locks in the
+ * FCB's FsRtl file lock without an upcall, the locks are sent to the
+ * daemon when the delegation is recalled
+ */
+#define NFS41_DRIVER_DELEGATED_LOCK_BUFFERING 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_ASYNC_CLOSE| - extends
+ * |NFS41_DRIVER_DAEMON_DEFERRED_CLOSE|: a CLOSE upcall for a regular
+ * file which is not removed and has no byte-range locks completes
+ * at once, and the NFS CLOSE is sent from the deferred close thread.
+ * A later OPEN or REMOVE of the same file waits for it
+ */
+#define NFS41_DRIVER_DAEMON_ASYNC_CLOSE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_REFERRAL_CACHE| - cache the fs_locations of a
+ * referral per mount for |REFERRAL_CACHE_TIMEOUT| seconds, and mount
+ * the location which answers a TCP connect first instead of the first
+ * location in the list
+ */
+#define NFS41_DRIVER_DAEMON_REFERRAL_CACHE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_GETATTR_COALESCING| - GETATTRs of
+ * |nfs41_cached_getattr()| for different files which queue up behind
+ * the GETATTRs in flight on a session are sent together in one
+ * multi-file PUTFH+GETATTR compound, see |nfs41_getattr_coalesced()|
+ */
+#define NFS41_DRIVER_DAEMON_GETATTR_COALESCING 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS| - downcalls which do not fit
+ * into a worker's |UPCALL_BUF_SIZE| buffer (large ACLs or EA lists)
+ * are marshalled into a |UPCALL_LARGE_BUF_SIZE| buffer from a shared
+ * pool instead of failing
+ */
+#define NFS41_DRIVER_DAEMON_LARGE_DOWNCALLS 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_BATCHED_LOCKU| - release the ranges of a
+ * multi-range unlock (e.g. all locks of a file on close) with up to
+ * |NFS41_UNLOCK_BATCH_MAX| LOCKU ops per compound, see
+ * |nfs41_unlock_batch()|
+ */
+#define NFS41_DRIVER_DAEMON_BATCHED_LOCKU 1
+
+/*
+ * |NFS41_DRIVER_CACHE_CONTROL| - support |FSCTL_NFS41_CACHE_CONTROL|,
+ * which "nfsclientdctl pin/unpin/flush" use to exempt a subtree of
+ * the daemon's name cache from eviction or to drop it
+ */
+#define NFS41_DRIVER_CACHE_CONTROL 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING| - bound the name cache
+ * by the size of the name and attribute entries in use instead of a
+ * fixed number of names, so trees with many hard links (which share
+ * one attribute entry per fileid) can cache more names
+ */
+#define NFS41_DRIVER_DAEMON_NAME_CACHE_USAGE_SIZING 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW| - keep at most half of the
+ * server's RPCSEC_GSS sequence window of calls in flight per context,
+ * and spread the calls of a user over additional contexts when there
+ * are more, see "GSS sequence window" in daemon/nfs41_rpc.c.
+ * Requires |NFS41_DRIVER_DAEMON_GSS_CTX_POOL|
+ */
+#ifdef NFS41_DRIVER_DAEMON_GSS_CTX_POOL
+#define NFS41_DRIVER_DAEMON_GSS_SEQ_WINDOW 1
+#endif /* NFS41_DRIVER_DAEMON_GSS_CTX_POOL */
+
+/*
+ * |NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP| - fetch the superblock
+ * attributes of a new server with the lookup of the mount path, and
+ * remember unsupported NFSv4.2 operations per server for later mounts
+ */
+#define NFS41_DRIVER_DAEMON_MOUNT_BOOTSTRAP 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_EA_SET_BATCH| - write all EAs of one
+ * |FILE_FULL_EA_INFORMATION| chain with as few compounds as possible,
+ * and cache the named attribute directory of open files
+ */
+#define NFS41_DRIVER_DAEMON_EA_SET_BATCH 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_AUTOTUNE| - "autotune" mount option, measure
+ * RTT and bandwidth to the server and choose the READ/WRITE pipeline
+ * depth, readahead window and number of connections from them, see
+ * daemon/autotune.c
+ */
+#define NFS41_DRIVER_DAEMON_AUTOTUNE 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT| - "nfsd --namecachesnapshot
+ * <dir>", keep the name cache of "immutable" mounts in memory-mapped
+ * snapshot files across restarts, see daemon/ncsnap.c
+ */
+#define NFS41_DRIVER_DAEMON_NAME_CACHE_SNAPSHOT 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_TOP_STATS| - sample the upcalls of each mount
+ * and keep the hottest files and directories, for "nfsclientdctl top",
+ * see daemon/topstats.c
+ */
+#define NFS41_DRIVER_DAEMON_TOP_STATS 1
+
+/*
+ * |NFS41_DRIVER_DAEMON_CPU_STATS| - count the CPU cycles the daemon
+ * spends in each upcall, per opcode and phase (parsing, idmapping,
+ * handling, marshalling, XDR and RPC), for "nfsclientdctl stats"
+ */
+#define NFS41_DRIVER_DAEMON_CPU_STATS 1
+
 #endif /* !_NFS41_DRIVER_BUILDFEATURES_ */
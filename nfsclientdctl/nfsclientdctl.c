@@ -33,6 +33,7 @@
 #include <windows.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <devioctl.h>
@@ -71,7 +72,11 @@ void usage(const char *progname)
 {
     (void)fprintf(stderr,
         "Usage: %s "
-        "[stopdaemon|setdaemondebuglevel <debuglevel>]",
+        "[stopdaemon|setdaemondebuglevel <debuglevel>|"
+        "getupdowncallstats|stats|flightrecorder|mountstats|"
+        "top [--mount <server:/export>]|"
+        "prefetch <path> [-r] [-d]|pin <path>|unpin <path>|"
+        "flush <path>]",
         progname);
 }
 
@@ -148,6 +153,890 @@ int cmd_setdaemondebuglevel(const char *progname, const char *levelstr)
     return EXIT_SUCCESS;
 }
 
+static
+int cmd_getupdowncallstats(const char *progname)
+{
+    HANDLE pipe;
+    DWORD status;
+    BOOL dstatus;
+    DWORD outbuf_len;
+    NFS41_UPDOWNCALL_STATS stats;
+
+    pipe = create_nfs41sys_device_pipe();
+    if (pipe == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: getupdowncallstats: "
+            "Unable to open nfs41_driver pipe, lasterr=%d\n",
+            progname,
+            (int)status);
+        return EXIT_FAILURE;
+    }
+
+    dstatus = DeviceIoControl(pipe,
+        IOCTL_NFS41_GET_UPDOWNCALL_STATS,
+        NULL, 0,
+        &stats, sizeof(stats),
+        &outbuf_len, NULL);
+    if ((dstatus == FALSE) || (outbuf_len != sizeof(stats))) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: getupdowncallstats: "
+            "IOCTL_NFS41_GET_UPDOWNCALL_STATS failed with lasterr=%d\n",
+            progname,
+            (int)status);
+        close_nfs41sys_device_pipe(pipe);
+        return EXIT_FAILURE;
+    }
+
+    (void)printf("num_downcall_buckets=%lu\n",
+        (unsigned long)stats.num_downcall_buckets);
+    (void)printf("downcall_inflight=%ld\n",
+        (long)stats.downcall_inflight);
+    (void)printf("downcall_max_inflight=%ld\n",
+        (long)stats.downcall_max_inflight);
+    (void)printf("downcall_max_chain_len=%ld\n",
+        (long)stats.downcall_max_chain_len);
+    (void)printf("downcall_max_scan_len=%ld\n",
+        (long)stats.downcall_max_scan_len);
+    (void)printf("upcall_queued=%ld\n",
+        (long)stats.upcall_queued);
+    (void)printf("upcall_max_queued=%ld\n",
+        (long)stats.upcall_max_queued);
+    (void)printf("upcall_num_queues=%lu\n",
+        (unsigned long)stats.upcall_num_queues);
+    (void)printf("upcall_steals=%ld\n",
+        (long)stats.upcall_steals);
+
+    close_nfs41sys_device_pipe(pipe);
+    return EXIT_SUCCESS;
+}
+
+/* |_nfs41_opcodes| names, without the "NFS41_SYSOP_" prefix */
+static const char *upcall_op_names[NFS41_SYSOP_INVALID_OPCODE1] = {
+    "INVALID_OPCODE0", "MOUNT", "UNMOUNT", "OPEN", "CLOSE", "READ",
+    "WRITE", "LOCK", "UNLOCK", "DIR_QUERY", "FILE_QUERY",
+    "FILE_QUERY_TIME_BASED_COHERENCY", "FILE_QUERY_COHERENCY_BATCH",
+    "FILE_SET", "EA_GET", "EA_SET", "SYMLINK_GET", "SYMLINK_SET",
+    "VOLUME_QUERY", "ACL_QUERY", "ACL_SET",
+    "FSCTL_QUERYALLOCATEDRANGES", "FSCTL_SET_ZERO_DATA",
+    "FSCTL_DUPLICATE_DATA", "FSCTL_OFFLOAD_DATACOPY",
+    "SET_DAEMON_DEBUGLEVEL", "SHUTDOWN", "GET_DAEMON_STATS",
+    "GET_FLIGHT_RECORDER", "GET_MOUNT_STATS", "DIR_NOTIFY",
+    "QUERY_OPEN", "FSCTL_CACHE_CONTROL", "GET_TOP_STATS", "FLUSH"
+};
+
+/* NFSv4.x operation names, indexed by operation number */
+static const char *nfs_op_names[NFS41_OP_STATS_NUM_NFS_OPS] = {
+    NULL, NULL, NULL, "ACCESS", "CLOSE", "COMMIT", "CREATE",
+    "DELEGPURGE", "DELEGRETURN", "GETATTR", "GETFH", "LINK", "LOCK",
+    "LOCKT", "LOCKU", "LOOKUP", "LOOKUPP", "NVERIFY", "OPEN",
+    "OPENATTR", "OPEN_CONFIRM", "OPEN_DOWNGRADE", "PUTFH", "PUTPUBFH",
+    "PUTROOTFH", "READ", "READDIR", "READLINK", "REMOVE", "RENAME",
+    "RENEW", "RESTOREFH", "SAVEFH", "SECINFO", "SETATTR",
+    "SETCLIENTID", "SETCLIENTID_CONFIRM", "VERIFY", "WRITE",
+    "RELEASE_LOCKOWNER", "BACKCHANNEL_CTL", "BIND_CONN_TO_SESSION",
+    "EXCHANGE_ID", "CREATE_SESSION", "DESTROY_SESSION",
+    "FREE_STATEID", "GET_DIR_DELEGATION", "GETDEVICEINFO",
+    "GETDEVICELIST", "LAYOUTCOMMIT", "LAYOUTGET", "LAYOUTRETURN",
+    "SECINFO_NO_NAME", "SEQUENCE", "SET_SSV", "TEST_STATEID",
+    "WANT_DELEGATION", "DESTROY_CLIENTID", "RECLAIM_COMPLETE",
+    "ALLOCATE", "COPY", "COPY_NOTIFY", "DEALLOCATE", "IO_ADVISE",
+    "LAYOUTERROR", "LAYOUTSTATS", "OFFLOAD_CANCEL", "OFFLOAD_STATUS",
+    "READ_PLUS", "SEEK", "WRITE_SAME", "CLONE", "GETXATTR",
+    "SETXATTR", "LISTXATTRS", "REMOVEXATTR"
+};
+
+/*
+ * Upper bound (in microseconds) of the bucket which contains the
+ * |percent| percentile of |hist|
+ */
+static
+unsigned long long histogram_percentile(
+    const NFS41_LATENCY_HISTOGRAM *hist,
+    unsigned long long count,
+    unsigned int percent)
+{
+    unsigned long long sum = 0ULL;
+    unsigned long long threshold = (count * percent + 99ULL) / 100ULL;
+    int i;
+
+    for (i = 0 ; i < NFS41_OP_STATS_NUM_BUCKETS ; i++) {
+        sum += hist->buckets[i];
+        if (sum >= threshold)
+            break;
+    }
+    if (i >= (NFS41_OP_STATS_NUM_BUCKETS-1))
+        i = NFS41_OP_STATS_NUM_BUCKETS-1;
+    return 1ULL << i;
+}
+
+static
+void print_histogram(
+    const char *kind,
+    const char *name,
+    unsigned int num,
+    const NFS41_LATENCY_HISTOGRAM *hist)
+{
+    unsigned long long count = 0ULL;
+    int i;
+
+    for (i = 0 ; i < NFS41_OP_STATS_NUM_BUCKETS ; i++)
+        count += hist->buckets[i];
+    if (count == 0ULL)
+        return;
+
+    if (name)
+        (void)printf("%s\t%s", kind, name);
+    else
+        (void)printf("%s\t%u", kind, num);
+    (void)printf("\tcount=%llu\tavg_usecs=%llu"
+        "\tp50_usecs<%llu\tp90_usecs<%llu\tp99_usecs<%llu\n",
+        count,
+        hist->total_usecs / count,
+        histogram_percentile(hist, count, 50),
+        histogram_percentile(hist, count, 90),
+        histogram_percentile(hist, count, 99));
+}
+
+/*
+ * Print the CPU cycles of upcall |opcode| per |NFS41_CPU_PHASE_*|, and
+ * the average cycles per upcall
+ */
+static
+void print_cpu_cycles(const NFS41_DAEMON_OP_STATS *daemon, unsigned int i)
+{
+    static const char *phase_names[NFS41_OP_STATS_NUM_CPU_PHASES] = {
+        "parse", "idmap", "handle", "marshall",
+        "xdr_encode", "xdr_decode", "rpc"
+    };
+    const ULONGLONG *cycles = daemon->cpu_cycles[i];
+    ULONGLONG upcalls = 0, total;
+    unsigned int b, phase;
+
+    total = cycles[NFS41_CPU_PHASE_PARSE] + cycles[NFS41_CPU_PHASE_IDMAP] +
+        cycles[NFS41_CPU_PHASE_HANDLE] + cycles[NFS41_CPU_PHASE_MARSHALL];
+    if ((total == 0) && (cycles[NFS41_CPU_PHASE_RPC] == 0))
+        return;
+    for (b = 0 ; b < NFS41_OP_STATS_NUM_BUCKETS ; b++)
+        upcalls += daemon->upcall[i].buckets[b];
+
+    if (upcall_op_names[i])
+        (void)printf("cpu\t%s", upcall_op_names[i]);
+    else
+        (void)printf("cpu\t%u", i);
+    for (phase = 0 ; phase < NFS41_OP_STATS_NUM_CPU_PHASES ; phase++)
+        (void)printf("\t%s=%llu", phase_names[phase], cycles[phase]);
+    (void)printf("\tavg_cycles=%llu\n", upcalls?(total / upcalls):0ULL);
+}
+
+static
+int cmd_stats(const char *progname)
+{
+    HANDLE pipe;
+    DWORD status;
+    BOOL dstatus;
+    DWORD outbuf_len;
+    NFS41_OP_STATS *stats;
+    unsigned int i;
+
+    stats = calloc(1, sizeof(NFS41_OP_STATS));
+    if (stats == NULL) {
+        (void)fprintf(stderr, "%s: stats: Out of memory\n", progname);
+        return EXIT_FAILURE;
+    }
+
+    pipe = create_nfs41sys_device_pipe();
+    if (pipe == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: stats: "
+            "Unable to open nfs41_driver pipe, lasterr=%d\n",
+            progname,
+            (int)status);
+        free(stats);
+        return EXIT_FAILURE;
+    }
+
+    dstatus = DeviceIoControl(pipe,
+        IOCTL_NFS41_GET_OP_STATS,
+        NULL, 0,
+        stats, sizeof(NFS41_OP_STATS),
+        &outbuf_len, NULL);
+    if ((dstatus == FALSE) || (outbuf_len != sizeof(NFS41_OP_STATS))) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: stats: "
+            "IOCTL_NFS41_GET_OP_STATS failed with lasterr=%d\n",
+            progname,
+            (int)status);
+        close_nfs41sys_device_pipe(pipe);
+        free(stats);
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * kernel_queue - upcall waiting for the daemon
+     * kernel_total - upcall queued until downcall arrived
+     * kernel_depth - upcalls currently/at most waiting for the daemon
+     * daemon       - daemon handling the upcall
+     * rpc          - RPC round trip to the server
+     * cpu          - daemon CPU cycles per upcall phase ("handle"
+     *                includes "xdr_*" and "rpc"), opcode 0 counts
+     *                compounds sent outside of upcalls
+     */
+    for (i = 0 ; i < NFS41_SYSOP_INVALID_OPCODE1 ; i++)
+        print_histogram("kernel_queue", upcall_op_names[i], i,
+            &stats->upcall_queue[i]);
+    for (i = 0 ; i < NFS41_SYSOP_INVALID_OPCODE1 ; i++)
+        print_histogram("kernel_total", upcall_op_names[i], i,
+            &stats->upcall_total[i]);
+    for (i = 0 ; i < NFS41_SYSOP_INVALID_OPCODE1 ; i++) {
+        if (stats->upcall_max_queued[i] == 0)
+            continue;
+        if (upcall_op_names[i])
+            (void)printf("kernel_depth\t%s", upcall_op_names[i]);
+        else
+            (void)printf("kernel_depth\t%u", i);
+        (void)printf("\tqueued=%ld\tmax_queued=%ld\n",
+            (long)stats->upcall_queued[i],
+            (long)stats->upcall_max_queued[i]);
+    }
+
+    if (stats->daemon_status == 0) {
+        for (i = 0 ; i < NFS41_SYSOP_INVALID_OPCODE1 ; i++)
+            print_histogram("daemon", upcall_op_names[i], i,
+                &stats->daemon.upcall[i]);
+        for (i = 0 ; i < NFS41_OP_STATS_NUM_NFS_OPS ; i++)
+            print_histogram("rpc", nfs_op_names[i], i,
+                &stats->daemon.rpc[i]);
+        for (i = 0 ; i < NFS41_SYSOP_INVALID_OPCODE1 ; i++)
+            print_cpu_cycles(&stats->daemon, i);
+    }
+    else {
+        (void)fprintf(stderr,
+            "%s: stats: No daemon statistics, status=0x%lx\n",
+            progname,
+            (long)stats->daemon_status);
+    }
+
+    close_nfs41sys_device_pipe(pipe);
+    free(stats);
+    return EXIT_SUCCESS;
+}
+
+static
+int cmd_flightrecorder(const char *progname)
+{
+    HANDLE pipe;
+    DWORD status;
+    BOOL dstatus;
+    DWORD outbuf_len;
+    NFS41_FLIGHT_RECORDER *fr;
+    const NFS41_FLIGHT_RECORD *rec;
+    FILETIME ft;
+    SYSTEMTIME st;
+    unsigned int i, j;
+
+    fr = calloc(1, sizeof(NFS41_FLIGHT_RECORDER));
+    if (fr == NULL) {
+        (void)fprintf(stderr, "%s: flightrecorder: Out of memory\n",
+            progname);
+        return EXIT_FAILURE;
+    }
+
+    pipe = create_nfs41sys_device_pipe();
+    if (pipe == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: flightrecorder: "
+            "Unable to open nfs41_driver pipe, lasterr=%d\n",
+            progname,
+            (int)status);
+        free(fr);
+        return EXIT_FAILURE;
+    }
+
+    dstatus = DeviceIoControl(pipe,
+        IOCTL_NFS41_GET_FLIGHT_RECORDER,
+        NULL, 0,
+        fr, sizeof(NFS41_FLIGHT_RECORDER),
+        &outbuf_len, NULL);
+    if ((dstatus == FALSE) ||
+        (outbuf_len != sizeof(NFS41_FLIGHT_RECORDER))) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: flightrecorder: "
+            "IOCTL_NFS41_GET_FLIGHT_RECORDER failed with lasterr=%d\n",
+            progname,
+            (int)status);
+        close_nfs41sys_device_pipe(pipe);
+        free(fr);
+        return EXIT_FAILURE;
+    }
+    close_nfs41sys_device_pipe(pipe);
+
+    if (fr->daemon_status != 0) {
+        (void)fprintf(stderr,
+            "%s: flightrecorder: No records from daemon, status=0x%lx\n",
+            progname,
+            (long)fr->daemon_status);
+        free(fr);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0 ; i < min(fr->count, NFS41_FLIGHT_RECORDER_NUM_RECORDS) ;
+        i++) {
+        rec = &fr->records[i];
+        ft.dwLowDateTime = (DWORD)rec->send_time;
+        ft.dwHighDateTime = (DWORD)(rec->send_time >> 32);
+        (void)FileTimeToSystemTime(&ft, &st);
+
+        (void)printf("%llu\t%04d-%02d-%02dT%02d:%02d:%02d.%03dZ"
+            "\tlatency_usecs=%lu\txid=0x%08lx\tslotid=%ld\tsequenceid=%lu"
+            "\tretry=%u\tio_bytes=%lu\trpc_status=%ld\tnfs_status=%lu\tops=",
+            rec->seq,
+            (int)st.wYear, (int)st.wMonth, (int)st.wDay,
+            (int)st.wHour, (int)st.wMinute, (int)st.wSecond,
+            (int)st.wMilliseconds,
+            (unsigned long)rec->latency_usecs,
+            (unsigned long)rec->xid,
+            (long)rec->slotid,
+            (unsigned long)rec->sequenceid,
+            (unsigned int)rec->retry,
+            (unsigned long)rec->io_bytes,
+            (long)rec->rpc_status,
+            (unsigned long)rec->nfs_status);
+        for (j = 0 ;
+            j < min(rec->num_ops, NFS41_FLIGHT_RECORDER_MAX_OPS) ; j++) {
+            if ((rec->ops[j] < NFS41_OP_STATS_NUM_NFS_OPS) &&
+                nfs_op_names[rec->ops[j]])
+                (void)printf("%s%s", (j > 0)?",":"",
+                    nfs_op_names[rec->ops[j]]);
+            else
+                (void)printf("%s%u", (j > 0)?",":"",
+                    (unsigned int)rec->ops[j]);
+        }
+        if (rec->num_ops > NFS41_FLIGHT_RECORDER_MAX_OPS)
+            (void)printf(",...");
+        (void)printf("\t(%u/%u results)\n",
+            (unsigned int)rec->num_results,
+            (unsigned int)rec->num_ops);
+    }
+
+    free(fr);
+    return EXIT_SUCCESS;
+}
+
+/* Print the average and percentiles of |hist|, if it has samples */
+static
+void print_mount_latency(
+    const NFS41_LATENCY_HISTOGRAM *hist)
+{
+    unsigned long long count = 0ULL;
+    int i;
+
+    for (i = 0 ; i < NFS41_OP_STATS_NUM_BUCKETS ; i++)
+        count += hist->buckets[i];
+    if (count == 0ULL)
+        return;
+
+    (void)printf("\tavg_usecs=%llu"
+        "\tp50_usecs<%llu\tp90_usecs<%llu\tp99_usecs<%llu",
+        hist->total_usecs / count,
+        histogram_percentile(hist, count, 50),
+        histogram_percentile(hist, count, 90),
+        histogram_percentile(hist, count, 99));
+}
+
+static
+int cmd_mountstats(const char *progname)
+{
+    static const char *secflavor_names[] = {
+        "undefined", "none", "sys", "krb5", "krb5i", "krb5p"
+    };
+    HANDLE pipe;
+    DWORD status;
+    BOOL dstatus;
+    DWORD outbuf_len;
+    NFS41_MOUNT_STATS *ms;
+    const NFS41_NETROOT_STATS *ns;
+    const NFS41_ROOT_STATS *rs;
+    unsigned int i;
+
+    ms = calloc(1, sizeof(NFS41_MOUNT_STATS));
+    if (ms == NULL) {
+        (void)fprintf(stderr, "%s: mountstats: Out of memory\n",
+            progname);
+        return EXIT_FAILURE;
+    }
+
+    pipe = create_nfs41sys_device_pipe();
+    if (pipe == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: mountstats: "
+            "Unable to open nfs41_driver pipe, lasterr=%d\n",
+            progname,
+            (int)status);
+        free(ms);
+        return EXIT_FAILURE;
+    }
+
+    dstatus = DeviceIoControl(pipe,
+        IOCTL_NFS41_GET_MOUNT_STATS,
+        NULL, 0,
+        ms, sizeof(NFS41_MOUNT_STATS),
+        &outbuf_len, NULL);
+    if ((dstatus == FALSE) || (outbuf_len != sizeof(NFS41_MOUNT_STATS))) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: mountstats: "
+            "IOCTL_NFS41_GET_MOUNT_STATS failed with lasterr=%d\n",
+            progname,
+            (int)status);
+        close_nfs41sys_device_pipe(pipe);
+        free(ms);
+        return EXIT_FAILURE;
+    }
+    close_nfs41sys_device_pipe(pipe);
+
+    /*
+     * netroot - upcalls of each NetRoot, as seen by the kernel
+     * root    - compounds of each mount (NetRoot+security flavor+user)
+     *           in the daemon
+     */
+    for (i = 0 ; i < min(ms->num_netroots, NFS41_MOUNT_STATS_MAX_MOUNTS) ;
+        i++) {
+        ns = &ms->netroots[i];
+        (void)printf("netroot\t%.*ls\tupcalls=%llu\terrors=%llu"
+            "\tread_bytes=%llu\twrite_bytes=%llu",
+            (int)NFS41_MOUNT_STATS_NAME_LEN, ns->name,
+            ns->upcalls,
+            ns->errors,
+            ns->read_bytes,
+            ns->write_bytes);
+        print_mount_latency(&ns->latency);
+        if (ns->direct_io) {
+            (void)printf("\tdirect_io=%llu\tdirect_io_avg_usecs=%llu"
+                "\tdirect_io_min_usecs=%llu",
+                ns->direct_io,
+                ns->direct_io_usecs / ns->direct_io,
+                ns->direct_io_min_usecs);
+        }
+        (void)printf("\n");
+    }
+
+    if (ms->daemon_status != 0) {
+        (void)fprintf(stderr,
+            "%s: mountstats: No daemon statistics, status=0x%lx\n",
+            progname,
+            (long)ms->daemon_status);
+        free(ms);
+        return EXIT_SUCCESS;
+    }
+
+    for (i = 0 ; i < min(ms->num_roots, NFS41_MOUNT_STATS_MAX_MOUNTS) ;
+        i++) {
+        rs = &ms->roots[i];
+        (void)printf("root\t%.*s\tsec=%s\tuid=%lu\tgid=%lu"
+            "\tcompounds=%llu\tread_bytes=%llu\twrite_bytes=%llu"
+            "\tretransmits=%llu\tdelays=%llu"
+            "\tmax_slots=%lu\thighest_slot=%lu\tslot_resizes=%llu"
+            "\tslot_recalls=%llu\tslot_waits=%llu\tslot_wait_usecs=%llu"
+            "\tslot_wait_max_usecs=%llu\tslot_starvations=%llu",
+            (int)NFS41_MOUNT_STATS_NAME_LEN, rs->name,
+            (rs->sec_flavor < ARRAYSIZE(secflavor_names))?
+                secflavor_names[rs->sec_flavor]:"unknown",
+            (unsigned long)rs->uid,
+            (unsigned long)rs->gid,
+            rs->compounds,
+            rs->read_bytes,
+            rs->write_bytes,
+            rs->retransmits,
+            rs->delays,
+            (unsigned long)rs->max_slots,
+            (unsigned long)rs->highest_slot,
+            rs->slot_resizes,
+            rs->slot_recalls,
+            rs->slot_waits,
+            rs->slot_wait_usecs,
+            rs->slot_wait_max_usecs,
+            rs->slot_starvations);
+        if (rs->autotune_depth) {
+            (void)printf("\tautotune_rtt_usecs=%lu"
+                "\tautotune_bandwidth_kb=%lu\tautotune_io_size=%lu"
+                "\tautotune_depth=%lu\tautotune_connections=%lu"
+                "\tautotune_readahead=%lu",
+                (unsigned long)rs->autotune_rtt_usecs,
+                (unsigned long)rs->autotune_bandwidth,
+                (unsigned long)rs->autotune_io_size,
+                (unsigned long)rs->autotune_depth,
+                (unsigned long)rs->autotune_connections,
+                (unsigned long)rs->autotune_readahead);
+        }
+        print_mount_latency(&rs->rpc);
+        (void)printf("\n");
+    }
+
+    free(ms);
+    return EXIT_SUCCESS;
+}
+
+static
+const char *top_root_name(const NFS41_MOUNT_STATS *ms, ULONGLONG root)
+{
+    unsigned int i;
+
+    for (i = 0 ; i < min(ms->num_roots, NFS41_MOUNT_STATS_MAX_MOUNTS) ;
+        i++) {
+        if (ms->roots[i].root == root)
+            return ms->roots[i].name;
+    }
+    return "<unmounted>";
+}
+
+static
+int top_print(const char *progname, HANDLE pipe,
+    const NFS41_MOUNT_STATS *ms, const ULONGLONG *root)
+{
+    DWORD status;
+    BOOL dstatus;
+    DWORD outbuf_len;
+    NFS41_TOP_STATS *ts;
+    const NFS41_TOP_STATS_ENTRY *e;
+    unsigned int i;
+
+    ts = calloc(1, sizeof(NFS41_TOP_STATS));
+    if (ts == NULL) {
+        (void)fprintf(stderr, "%s: top: Out of memory\n", progname);
+        return EXIT_FAILURE;
+    }
+
+    dstatus = DeviceIoControl(pipe,
+        IOCTL_NFS41_GET_TOP_STATS,
+        (LPVOID)root, root?sizeof(ULONGLONG):0,
+        ts, sizeof(NFS41_TOP_STATS),
+        &outbuf_len, NULL);
+    if ((dstatus == FALSE) || (outbuf_len != sizeof(NFS41_TOP_STATS))) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: top: "
+            "IOCTL_NFS41_GET_TOP_STATS failed with lasterr=%d\n",
+            progname,
+            (int)status);
+        free(ts);
+        return EXIT_FAILURE;
+    }
+    if (ts->daemon_status != 0) {
+        (void)fprintf(stderr,
+            "%s: top: No daemon statistics, status=0x%lx\n",
+            progname,
+            (long)ts->daemon_status);
+        free(ts);
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * file/dir - estimated counts, |ops| is at most |error| too high,
+     * sorted by |ops|
+     */
+    for (i = 0 ; i < min(ts->num_entries, NFS41_TOP_STATS_MAX_ENTRIES) ;
+        i++) {
+        e = &ts->entries[i];
+        (void)printf("%s\t%.*s\t%.*s\tfileid=%llu\tops=%llu\terror=%llu"
+            "\tread_bytes=%llu\twrite_bytes=%llu\tavg_usecs=%llu\n",
+            (e->flags & NFS41_TOP_STATS_FLAG_DIR)?"dir":"file",
+            (int)NFS41_MOUNT_STATS_NAME_LEN, top_root_name(ms, e->root),
+            (int)NFS41_TOP_STATS_PATH_LEN, e->path,
+            e->fileid,
+            e->ops,
+            e->error,
+            e->read_bytes,
+            e->write_bytes,
+            e->ops?(e->usecs / e->ops):0ULL);
+    }
+
+    free(ts);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Print the hottest files and directories of all mounts, or of the
+ * mounts whose "server@port:/export" name contains |mount|
+ */
+static
+int cmd_top(const char *progname, int ac, char *av[])
+{
+    const char *mount = NULL;
+    HANDLE pipe;
+    DWORD status;
+    BOOL dstatus;
+    DWORD outbuf_len;
+    NFS41_MOUNT_STATS *ms;
+    unsigned int i, found = 0;
+    int res = EXIT_SUCCESS;
+
+    if (ac == 4 && !strcmp(av[2], "--mount")) {
+        mount = av[3];
+    }
+    else if (ac != 2) {
+        usage(progname);
+        return EXIT_USAGE;
+    }
+
+    ms = calloc(1, sizeof(NFS41_MOUNT_STATS));
+    if (ms == NULL) {
+        (void)fprintf(stderr, "%s: top: Out of memory\n", progname);
+        return EXIT_FAILURE;
+    }
+
+    pipe = create_nfs41sys_device_pipe();
+    if (pipe == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: top: "
+            "Unable to open nfs41_driver pipe, lasterr=%d\n",
+            progname,
+            (int)status);
+        free(ms);
+        return EXIT_FAILURE;
+    }
+
+    /* for the mount names and the |nfs41_root| handles */
+    dstatus = DeviceIoControl(pipe,
+        IOCTL_NFS41_GET_MOUNT_STATS,
+        NULL, 0,
+        ms, sizeof(NFS41_MOUNT_STATS),
+        &outbuf_len, NULL);
+    if ((dstatus == FALSE) || (outbuf_len != sizeof(NFS41_MOUNT_STATS)) ||
+        (ms->daemon_status != 0)) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: top: "
+            "IOCTL_NFS41_GET_MOUNT_STATS failed with lasterr=%d\n",
+            progname,
+            (int)status);
+        res = EXIT_FAILURE;
+        goto out;
+    }
+
+    if (mount == NULL) {
+        res = top_print(progname, pipe, ms, NULL);
+        goto out;
+    }
+
+    for (i = 0 ; i < min(ms->num_roots, NFS41_MOUNT_STATS_MAX_MOUNTS) ;
+        i++) {
+        if (strstr(ms->roots[i].name, mount) == NULL)
+            continue;
+        found++;
+        if (top_print(progname, pipe, ms, &ms->roots[i].root))
+            res = EXIT_FAILURE;
+    }
+    if (found == 0) {
+        (void)fprintf(stderr, "%s: top: No mount matches '%s'\n",
+            progname, mount);
+        res = EXIT_FAILURE;
+    }
+
+out:
+    close_nfs41sys_device_pipe(pipe);
+    free(ms);
+    return res;
+}
+
+typedef struct _prefetch_counts {
+    unsigned long long dirs;
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long errors;
+} prefetch_counts;
+
+static
+void prefetch_file_data(const char *path, prefetch_counts *pc)
+{
+    static char buf[256*1024];
+    HANDLE h;
+    DWORD n;
+
+    h = CreateFileA(path, GENERIC_READ,
+        FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        pc->errors++;
+        return;
+    }
+    while (ReadFile(h, buf, sizeof(buf), &n, NULL) && (n > 0))
+        pc->bytes += n;
+    (void)CloseHandle(h);
+}
+
+/*
+ * Walk the directory |path| (of length |pathlen|) into the client's
+ * caches: Enumerating a directory fetches the names and attributes of
+ * all entries with batched READDIRs, which fills the daemon's name
+ * and attribute caches without a LOOKUP+GETATTR per file
+ */
+static
+void prefetch_dir(char *path, size_t pathlen,
+    bool recursive, bool readdata, prefetch_counts *pc)
+{
+    WIN32_FIND_DATAA fd;
+    HANDLE fh;
+    size_t namelen;
+
+    if ((pathlen + 3) >= NFS41_SYS_MAX_PATH_LEN) {
+        pc->errors++;
+        return;
+    }
+    (void)strcpy(&path[pathlen], "\\*");
+
+    fh = FindFirstFileExA(path, FindExInfoBasic, &fd,
+        FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (fh == INVALID_HANDLE_VALUE) {
+        pc->errors++;
+        path[pathlen] = '\0';
+        return;
+    }
+    pc->dirs++;
+
+    do {
+        if (!strcmp(fd.cFileName, ".") || !strcmp(fd.cFileName, ".."))
+            continue;
+
+        namelen = strlen(fd.cFileName);
+        if ((pathlen + 1 + namelen) >= NFS41_SYS_MAX_PATH_LEN) {
+            pc->errors++;
+            continue;
+        }
+        path[pathlen] = '\\';
+        (void)memcpy(&path[pathlen+1], fd.cFileName, namelen+1);
+
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            /* Do not follow symlinks/junctions out of the tree */
+            if (recursive &&
+                !(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                prefetch_dir(path, pathlen+1+namelen,
+                    recursive, readdata, pc);
+        }
+        else {
+            pc->files++;
+            if (readdata)
+                prefetch_file_data(path, pc);
+        }
+    } while (FindNextFileA(fh, &fd));
+
+    (void)FindClose(fh);
+    path[pathlen] = '\0';
+}
+
+static
+int cmd_prefetch(const char *progname, int ac, char *av[])
+{
+    prefetch_counts pc = { 0 };
+    bool recursive = false;
+    bool readdata = false;
+    char *path;
+    size_t pathlen;
+    DWORD attrs;
+    int i;
+
+    if (ac < 3) {
+        (void)fprintf(stderr, "%s: prefetch: No path given\n", progname);
+        return EXIT_USAGE;
+    }
+    for (i = 3 ; i < ac ; i++) {
+        if (!strcmp(av[i], "-r"))
+            recursive = true;
+        else if (!strcmp(av[i], "-d"))
+            readdata = true;
+        else {
+            (void)fprintf(stderr, "%s: prefetch: Unknown option '%s'\n",
+                progname, av[i]);
+            return EXIT_USAGE;
+        }
+    }
+
+    pathlen = strlen(av[2]);
+    if (pathlen >= NFS41_SYS_MAX_PATH_LEN) {
+        (void)fprintf(stderr, "%s: prefetch: Path too long\n", progname);
+        return EXIT_FAILURE;
+    }
+    path = malloc(NFS41_SYS_MAX_PATH_LEN);
+    if (path == NULL) {
+        (void)fprintf(stderr, "%s: prefetch: Out of memory\n", progname);
+        return EXIT_FAILURE;
+    }
+    (void)memcpy(path, av[2], pathlen+1);
+    /* strip trailing path separators, |prefetch_dir()| adds its own */
+    while ((pathlen > 1) &&
+        ((path[pathlen-1] == '\\') || (path[pathlen-1] == '/')))
+        path[--pathlen] = '\0';
+
+    attrs = GetFileAttributesA(path);
+    if (attrs == INVALID_FILE_ATTRIBUTES) {
+        (void)fprintf(stderr, "%s: prefetch: Cannot access '%s', "
+            "lasterr=%d\n", progname, path, (int)GetLastError());
+        free(path);
+        return EXIT_FAILURE;
+    }
+    if (attrs & FILE_ATTRIBUTE_DIRECTORY) {
+        prefetch_dir(path, pathlen, recursive, readdata, &pc);
+    }
+    else {
+        pc.files++;
+        if (readdata)
+            prefetch_file_data(path, &pc);
+    }
+    free(path);
+
+    (void)printf("dirs=%llu\tfiles=%llu\tbytes=%llu\terrors=%llu\n",
+        pc.dirs, pc.files, pc.bytes, pc.errors);
+    return pc.errors?EXIT_FAILURE:EXIT_SUCCESS;
+}
+
+static
+int cmd_cachecontrol(const char *progname, const char *cmd,
+    const char *path, ULONG op)
+{
+    HANDLE h;
+    DWORD status;
+    DWORD dstatus;
+    DWORD outbuf_len;
+
+    if (path == NULL) {
+        (void)fprintf(stderr, "%s: %s: No path given\n", progname, cmd);
+        return EXIT_USAGE;
+    }
+
+    /* |FILE_FLAG_BACKUP_SEMANTICS| so directories can be opened, too */
+    h = CreateFileA(path, FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        (void)fprintf(stderr,
+            "%s: %s: Unable to open '%s', lasterr=%d\n",
+            progname, cmd, path, (int)status);
+        return EXIT_FAILURE;
+    }
+
+    dstatus = DeviceIoControl(h, FSCTL_NFS41_CACHE_CONTROL,
+        &op, sizeof(op), NULL, 0, &outbuf_len, NULL);
+    status = GetLastError();
+    (void)CloseHandle(h);
+
+    if (!dstatus) {
+        (void)fprintf(stderr,
+            "%s: %s: FSCTL_NFS41_CACHE_CONTROL failed for '%s', "
+            "lasterr=%d\n",
+            progname, cmd, path, (int)status);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 int main(int ac, char *av[])
 {
     if (ac < 2) {
@@ -161,6 +1050,36 @@ int main(int ac, char *av[])
     else if (!strcmp(av[1], "setdaemondebuglevel")) {
         return cmd_setdaemondebuglevel(av[0], av[2]);
     }
+    else if (!strcmp(av[1], "getupdowncallstats")) {
+        return cmd_getupdowncallstats(av[0]);
+    }
+    else if (!strcmp(av[1], "stats")) {
+        return cmd_stats(av[0]);
+    }
+    else if (!strcmp(av[1], "flightrecorder")) {
+        return cmd_flightrecorder(av[0]);
+    }
+    else if (!strcmp(av[1], "mountstats")) {
+        return cmd_mountstats(av[0]);
+    }
+    else if (!strcmp(av[1], "top")) {
+        return cmd_top(av[0], ac, av);
+    }
+    else if (!strcmp(av[1], "prefetch")) {
+        return cmd_prefetch(av[0], ac, av);
+    }
+    else if (!strcmp(av[1], "pin")) {
+        return cmd_cachecontrol(av[0], av[1], av[2],
+            NFS41_CACHE_CONTROL_PIN);
+    }
+    else if (!strcmp(av[1], "unpin")) {
+        return cmd_cachecontrol(av[0], av[1], av[2],
+            NFS41_CACHE_CONTROL_UNPIN);
+    }
+    else if (!strcmp(av[1], "flush")) {
+        return cmd_cachecontrol(av[0], av[1], av[2],
+            NFS41_CACHE_CONTROL_FLUSH);
+    }
     else {
         (void)fprintf(stderr, "%s: Unknown cmd '%s'\n",
             av[0], av[1]);
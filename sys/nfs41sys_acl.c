@@ -162,8 +162,7 @@ NTSTATUS unmarshal_nfs41_getacl(
 
     RtlCopyMemory(&buf_len, *buf, sizeof(DWORD));
     *buf += sizeof(DWORD);
-    cur->u.Acl.buf = RxAllocatePoolWithTag(NonPagedPoolNx,
-        buf_len, NFS41_MM_POOLTAG_ACL);
+    cur->u.Acl.buf = nfs41_buffer_allocate(buf_len, NFS41_MM_POOLTAG_ACL);
     if (cur->u.Acl.buf == NULL) {
         cur->status = status = STATUS_INSUFFICIENT_RESOURCES;
         goto out;
@@ -219,6 +218,103 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+/*
+ * FCB security descriptor cache
+ *
+ * Antivirus and backup agents query the security descriptor on every
+ * open of every file, so |nfs41_QuerySecurityInformation()| keeps the
+ * last result per FCB (shared by all handles of the file) for
+ * "aclcachettl" seconds, on "immutable" mounts until the next
+ * "nfsclientdctl flush".
+ * |nfs41_fcb->aclcache| is protected by |nfs41_fcb->aclcache_lock|,
+ * readers take a reference and copy the data after dropping the
+ * lock. SetSecurity, SETATTR/EA changes, coherency change detection
+ * and delegation recalls call |nfs41_fcb_aclcache_invalidate()|,
+ * which increments |nfs41_fcb->aclcache_gen| so that a query upcall
+ * which raced with it does not store its (possibly stale) result.
+ */
+static void nfs41_aclcache_entry_release(
+    nfs41_aclcache_entry *e)
+{
+    if (InterlockedDecrement(&e->refcount) == 0)
+        RxFreePool(e);
+}
+
+/* Returns a referenced entry for |query|, or |NULL| */
+static nfs41_aclcache_entry *nfs41_fcb_aclcache_get(
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext,
+    PNFS41_FCB nfs41_fcb,
+    SECURITY_INFORMATION query,
+    ULONG ttl_msecs)
+{
+    nfs41_aclcache_entry *e;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&nfs41_fcb->aclcache_lock, &irql);
+    e = nfs41_fcb->aclcache;
+    if (e && (e->query == query) &&
+        (((nfs41_get_interrupttime_msecs() - e->time) < ttl_msecs) ||
+            nfs41_immutable_cache_valid(pVNetRootContext, e->time)))
+        (void)InterlockedIncrement(&e->refcount);
+    else
+        e = NULL;
+    KeReleaseSpinLock(&nfs41_fcb->aclcache_lock, irql);
+    return e;
+}
+
+/* Stores |sec_desc| unless the cache was invalidated since |gen| */
+static void nfs41_fcb_aclcache_set(
+    PNFS41_FCB nfs41_fcb,
+    SECURITY_INFORMATION query,
+    const void *sec_desc,
+    ULONG sec_desc_len,
+    LONG gen)
+{
+    nfs41_aclcache_entry *e, *old;
+    KIRQL irql;
+
+    e = RxAllocatePoolWithTag(NonPagedPoolNx,
+        FIELD_OFFSET(nfs41_aclcache_entry, sec_desc) + sec_desc_len,
+        NFS41_MM_POOLTAG_ACL);
+    if (e == NULL)
+        return;
+    e->refcount = 1;
+    e->query = query;
+    e->time = nfs41_get_interrupttime_msecs();
+    e->sec_desc_len = sec_desc_len;
+    RtlCopyMemory(e->sec_desc, sec_desc, sec_desc_len);
+
+    KeAcquireSpinLock(&nfs41_fcb->aclcache_lock, &irql);
+    if (nfs41_fcb->aclcache_gen == gen) {
+        old = nfs41_fcb->aclcache;
+        nfs41_fcb->aclcache = e;
+    } else {
+        old = e;
+    }
+    KeReleaseSpinLock(&nfs41_fcb->aclcache_lock, irql);
+
+    if (old)
+        nfs41_aclcache_entry_release(old);
+}
+
+void nfs41_fcb_aclcache_invalidate(
+    PNFS41_FCB nfs41_fcb)
+{
+    nfs41_aclcache_entry *old;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&nfs41_fcb->aclcache_lock, &irql);
+    nfs41_fcb->aclcache_gen++;
+    old = nfs41_fcb->aclcache;
+    nfs41_fcb->aclcache = NULL;
+    KeReleaseSpinLock(&nfs41_fcb->aclcache_lock, irql);
+
+    if (old)
+        nfs41_aclcache_entry_release(old);
+}
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+
 NTSTATUS nfs41_QuerySecurityInformation(
     IN OUT PRX_CONTEXT RxContext)
 {
@@ -234,6 +330,11 @@ NTSTATUS nfs41_QuerySecurityInformation(
         RxContext->CurrentIrpSp->Parameters.QuerySecurity.SecurityInformation;
     ULONG querysecuritylength =
         RxContext->CurrentIrpSp->Parameters.QuerySecurity.Length;
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+    nfs41_aclcache_entry *cached;
+    LONG aclcache_gen;
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
 #ifdef ENABLE_TIMINGS
     LARGE_INTEGER t1, t2;
     t1 = KeQueryPerformanceCounter(NULL);
@@ -249,6 +350,43 @@ NTSTATUS nfs41_QuerySecurityInformation(
     status = check_nfs41_getacl_args(RxContext);
     if (status) goto out;
 
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    cached = nfs41_fcb_aclcache_get(pVNetRootContext, nfs41_fcb, info_class,
+        max(pVNetRootContext->aclcachettl * 1000UL,
+            NFS41_ACLCACHE_MIN_MSECS));
+    if (cached) {
+        if (querysecuritylength < cached->sec_desc_len) {
+            status = STATUS_BUFFER_OVERFLOW;
+            RxContext->InformationToReturn = cached->sec_desc_len;
+
+            DbgP("nfs41_QuerySecurityInformation: "
+                "STATUS_BUFFER_OVERFLOW for cached entry, "
+                "got %lu, need %lu\n",
+                (unsigned long)querysecuritylength,
+                (unsigned long)cached->sec_desc_len);
+            nfs41_aclcache_entry_release(cached);
+            goto out;
+        }
+
+        PSECURITY_DESCRIPTOR sec_desc = (PSECURITY_DESCRIPTOR)
+            RxContext->CurrentIrp->UserBuffer;
+        RtlCopyMemory(sec_desc, cached->sec_desc, cached->sec_desc_len);
+        RxContext->IoStatusBlock.Information =
+            RxContext->InformationToReturn = cached->sec_desc_len;
+        RxContext->IoStatusBlock.Status = status = STATUS_SUCCESS;
+#ifdef ENABLE_TIMINGS
+        InterlockedIncrement(&getacl.sops);
+        InterlockedAdd64(&getacl.size, cached->sec_desc_len);
+#endif
+        nfs41_aclcache_entry_release(cached);
+
+#ifdef DEBUG_ACL_QUERY
+        DbgP("nfs41_QuerySecurityInformation: using cached ACL info\n");
+#endif
+        goto out;
+    }
+    aclcache_gen = InterlockedCompareExchange(&nfs41_fcb->aclcache_gen, 0, 0);
+#else
     if (nfs41_fobx->acl && nfs41_fobx->acl_len) {
         LARGE_INTEGER current_time;
         KeQuerySystemTime(&current_time);
@@ -285,18 +423,20 @@ NTSTATUS nfs41_QuerySecurityInformation(
             goto out;
         } else {
             if (nfs41_fobx->acl) {
-                RxFreePool(nfs41_fobx->acl);
+                nfs41_buffer_free(nfs41_fobx->acl, nfs41_fobx->acl_len);
                 nfs41_fobx->acl = NULL;
                 nfs41_fobx->acl_len = 0;
             }
             DbgP("nfs41_QuerySecurityInformation: cached ACL info invalidated\n");
         }
     }
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
 
     status = nfs41_UpcallCreate(NFS41_SYSOP_ACL_QUERY, &nfs41_fobx->sec_ctx,
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.Acl.query = info_class;
     /* we can't provide RxContext->CurrentIrp->UserBuffer to the upcall thread
@@ -321,16 +461,34 @@ NTSTATUS nfs41_QuerySecurityInformation(
         RxContext->InformationToReturn = entry->u.Acl.buf_len;
 
         if (entry->u.Acl.buf) {
-            RxFreePool(entry->u.Acl.buf);
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+            /* We got the whole security descriptor, keep it for the retry */
+            nfs41_fcb_aclcache_set(nfs41_fcb, info_class,
+                entry->u.Acl.buf, entry->u.Acl.buf_len, aclcache_gen);
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+            nfs41_buffer_free(entry->u.Acl.buf, entry->u.Acl.buf_len);
             entry->u.Acl.buf = NULL;
         }
     } else if (entry->status == STATUS_SUCCESS) {
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+        nfs41_fcb_aclcache_set(nfs41_fcb, info_class,
+            entry->u.Acl.buf, entry->u.Acl.buf_len, aclcache_gen);
+
+        PSECURITY_DESCRIPTOR sec_desc = (PSECURITY_DESCRIPTOR)
+            RxContext->CurrentIrp->UserBuffer;
+        RtlCopyMemory(sec_desc, entry->u.Acl.buf, entry->u.Acl.buf_len);
+        RxContext->IoStatusBlock.Information =
+            RxContext->InformationToReturn = entry->u.Acl.buf_len;
+        RxContext->IoStatusBlock.Status = status = STATUS_SUCCESS;
+        nfs41_buffer_free(entry->u.Acl.buf, entry->u.Acl.buf_len);
+        entry->u.Acl.buf = NULL;
+#else
         /*
          * Free previous ACL data. This can happen if two concurrent
          * requests are executed for the same file
          */
         if (nfs41_fobx->acl) {
-            RxFreePool(nfs41_fobx->acl);
+            nfs41_buffer_free(nfs41_fobx->acl, nfs41_fobx->acl_len);
             nfs41_fobx->acl = NULL;
             nfs41_fobx->acl_len = 0;
         }
@@ -346,16 +504,17 @@ NTSTATUS nfs41_QuerySecurityInformation(
         RxContext->IoStatusBlock.Information =
             RxContext->InformationToReturn = nfs41_fobx->acl_len;
         RxContext->IoStatusBlock.Status = status = STATUS_SUCCESS;
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
 
 #ifdef ENABLE_TIMINGS
         InterlockedIncrement(&getacl.sops);
-        InterlockedAdd64(&getacl.size, entry->u.Acl.buf_len);
+        InterlockedAdd64(&getacl.size, RxContext->InformationToReturn);
 #endif
     } else {
         status = map_query_acl_error(entry->status);
 
         if (entry->u.Acl.buf) {
-            RxFreePool(entry->u.Acl.buf);
+            nfs41_buffer_free(entry->u.Acl.buf, entry->u.Acl.buf_len);
             entry->u.Acl.buf = NULL;
         }
     }
@@ -459,6 +618,7 @@ NTSTATUS nfs41_SetSecurityInformation(
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.Acl.query = info_class;
     entry->u.Acl.buf = sec_desc;
@@ -470,12 +630,16 @@ NTSTATUS nfs41_SetSecurityInformation(
 
     /* Invalidate cached ACL info */
     if (nfs41_fobx->acl) {
-        RxFreePool(nfs41_fobx->acl);
+        nfs41_buffer_free(nfs41_fobx->acl, nfs41_fobx->acl_len);
         nfs41_fobx->acl = NULL;
         nfs41_fobx->acl_len = 0;
     }
 
     status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    /* Even a failed or timed-out SetSecurity may have changed the ACL */
+    nfs41_fcb_aclcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
     if (status) {
         /* Timeout - |nfs41_downcall()| will free |entry|+contents */
         entry = NULL;
@@ -484,11 +648,16 @@ NTSTATUS nfs41_SetSecurityInformation(
 
     status = map_query_acl_error(entry->status);
     if (!status) {
-        if (!nfs41_fobx->deleg_type && entry->ChangeTime &&
+        if (!nfs41_fobx_deleg_type(SrvOpen, nfs41_fobx) &&
+                entry->ChangeTime &&
                 (SrvOpen->DesiredAccess &
                 (FILE_READ_DATA | FILE_WRITE_DATA | FILE_APPEND_DATA)))
             nfs41_update_fcb_list(RxContext->pFcb, entry->ChangeTime);
         nfs41_fcb->changeattr = entry->ChangeTime;
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+        /* ctime (and maybe mode) changed */
+        nfs41_fcb_attrcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
     }
 out:
     if (entry) {
@@ -47,6 +47,7 @@
 #if (NTDDI_VERSION >= NTDDI_WIN10_VB)
 #define USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM 1
 #define USE_LOOKASIDELISTS_FOR_FCBLISTENTRY_MEM 1
+#define USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS 1
 // #define LOOKASIDELISTS_STATS 1
 #endif /* (NTDDI_VERSION >= NTDDI_WIN10_VB) */
 
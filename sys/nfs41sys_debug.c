@@ -184,12 +184,24 @@ void print_fs_ioctl(int op)
         case IOCTL_NFS41_INVALCACHE:
             DbgP("IOCTL_NFS41_INVALCACHE\n");
             break;
+        case IOCTL_NFS41_DIR_NOTIFY:
+            DbgP("IOCTL_NFS41_DIR_NOTIFY\n");
+            break;
         case IOCTL_NFS41_READ:
             DbgP("IOCTL_NFS41_UPCALL\n");
             break;
         case IOCTL_NFS41_WRITE:
             DbgP("IOCTL_NFS41_DOWNCALL\n");
             break;
+        case IOCTL_NFS41_READ_BATCH:
+            DbgP("IOCTL_NFS41_READ_BATCH\n");
+            break;
+        case IOCTL_NFS41_WRITE_BATCH:
+            DbgP("IOCTL_NFS41_WRITE_BATCH\n");
+            break;
+        case IOCTL_NFS41_WRITE_READ_BATCH:
+            DbgP("IOCTL_NFS41_WRITE_READ_BATCH\n");
+            break;
         case IOCTL_NFS41_ADDCONN:
             DbgP("IOCTL_NFS41_ADDCONN\n");
             break;
@@ -205,6 +217,12 @@ void print_fs_ioctl(int op)
         case IOCTL_NFS41_STOP:
             DbgP("IOCTL_NFS41_STOP\n");
             break;
+        case IOCTL_NFS41_GET_UPDOWNCALL_STATS:
+            DbgP("IOCTL_NFS41_GET_UPDOWNCALL_STATS\n");
+            break;
+        case IOCTL_NFS41_GET_OP_STATS:
+            DbgP("IOCTL_NFS41_GET_OP_STATS\n");
+            break;
         default:
             DbgP("UNKNOWN FS IOCTL %d\n", op);
     };
@@ -683,6 +701,8 @@ const char *opcode2string(int opcode)
     case NFS41_SYSOP_UNLOCK: return "NFS41_SYSOP_UNLOCK";
     case NFS41_SYSOP_DIR_QUERY: return "NFS41_SYSOP_DIR_QUERY";
     case NFS41_SYSOP_FILE_QUERY: return "NFS41_SYSOP_FILE_QUERY";
+    case NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH:
+        return "NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH";
     case NFS41_SYSOP_FILE_SET: return "NFS41_SYSOP_FILE_SET";
     case NFS41_SYSOP_EA_SET: return "NFS41_SYSOP_EA_SET";
     case NFS41_SYSOP_EA_GET: return "NFS41_SYSOP_EA_GET";
@@ -696,6 +716,15 @@ const char *opcode2string(int opcode)
     case NFS41_SYSOP_FSCTL_DUPLICATE_DATA: return "NFS41_SYSOP_FSCTL_DUPLICATE_DATA";
     case NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY:
         return "NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY";
+    case NFS41_SYSOP_GET_DAEMON_STATS: return "NFS41_SYSOP_GET_DAEMON_STATS";
+    case NFS41_SYSOP_GET_FLIGHT_RECORDER:
+        return "NFS41_SYSOP_GET_FLIGHT_RECORDER";
+    case NFS41_SYSOP_GET_MOUNT_STATS: return "NFS41_SYSOP_GET_MOUNT_STATS";
+    case NFS41_SYSOP_DIR_NOTIFY: return "NFS41_SYSOP_DIR_NOTIFY";
+    case NFS41_SYSOP_QUERY_OPEN: return "NFS41_SYSOP_QUERY_OPEN";
+    case NFS41_SYSOP_FSCTL_CACHE_CONTROL: return "NFS41_SYSOP_FSCTL_CACHE_CONTROL";
+    case NFS41_SYSOP_GET_TOP_STATS: return "NFS41_SYSOP_GET_TOP_STATS";
+    case NFS41_SYSOP_FLUSH: return "NFS41_SYSOP_FLUSH";
     default: return "UNKNOWN";
     }
 }
@@ -1523,7 +1552,8 @@ const char *reparsetag2string(ULONG tag)
 }
 
 
-#ifdef USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM
+#if defined(USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM) || \
+    defined(USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS)
 void print_lookasidelist_stat(const char *label, PNPAGED_LOOKASIDE_LIST ll)
 {
     DbgP("#### lookasidelist stat '%s': "
@@ -1535,7 +1565,8 @@ void print_lookasidelist_stat(const char *label, PNPAGED_LOOKASIDE_LIST ll)
         (long)ll->L.Depth,
         (long)ll->L.MaximumDepth);
 }
-#endif /* USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM */
+#endif /* USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM ||
+    USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
 
 void print_debug_header(
     PRX_CONTEXT RxContext)
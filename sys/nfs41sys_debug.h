@@ -56,9 +56,11 @@ void print_wait_status(int on, const char *str, NTSTATUS status,
 void print_acl_args(SECURITY_INFORMATION info);
 const char *fsctl2string(ULONG fsctl);
 const char *reparsetag2string(ULONG tag);
-#ifdef USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM
+#if defined(USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM) || \
+    defined(USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS)
 void print_lookasidelist_stat(const char *label, PNPAGED_LOOKASIDE_LIST ll);
-#endif /* USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM */
+#endif /* USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM ||
+    USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
 void print_debug_header(PRX_CONTEXT RxContext);
 
 #define PTR2PTRDIFF_T(p) (((char *)(p))-((char *)0))
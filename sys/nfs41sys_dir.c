@@ -212,61 +212,338 @@ NTSTATUS check_nfs41_dirquery_args(
     return STATUS_SUCCESS;
 }
 
-NTSTATUS nfs41_QueryDirectory(
-    IN OUT PRX_CONTEXT RxContext)
+/*
+ * Make a |NFS41_SYSOP_DIR_QUERY| upcall which fills the buffer
+ * described by |*mdl|. |*kbuf| is the nonpaged kernel buffer behind
+ * |*mdl|, or |NULL| if |*mdl| describes locked caller pages.
+ * On timeout the entry takes over |*mdl| and |*kbuf| (they are freed
+ * by |nfs41_downcall()|), and both are set to |NULL|.
+ * |*reply_len| returns the number of bytes filled, or the size needed
+ * for |STATUS_BUFFER_TOO_SMALL|.
+ */
+static NTSTATUS nfs41_dirquery_upcall(
+    IN PRX_CONTEXT RxContext,
+    IN OUT PMDL *mdl,
+    IN OUT PVOID *kbuf,
+    IN ULONG buf_len,
+    IN BOOLEAN initial_query,
+    IN BOOLEAN restart_scan,
+    IN BOOLEAN return_single,
+    OUT ULONG *reply_len)
 {
-    NTSTATUS status = STATUS_INVALID_PARAMETER;
+    NTSTATUS status;
     nfs41_updowncall_entry *entry = NULL;
-    FILE_INFORMATION_CLASS InfoClass = RxContext->Info.FileInformationClass;
-    PUNICODE_STRING Filter = &RxContext->pFobx->UnicodeQueryTemplate;
     __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
     __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
         NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
     __notnull PNFS41_NETROOT_EXTENSION pNetRootContext =
         NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
     __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+
+    *reply_len = 0;
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_DIR_QUERY, &nfs41_fobx->sec_ctx,
+        pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
+        pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
+    if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+
+    entry->u.QueryFile.InfoClass = RxContext->Info.FileInformationClass;
+    entry->u.QueryFile.buf_len = buf_len;
+    entry->u.QueryFile.mdl = *mdl;
+    entry->u.QueryFile.kbuf = *kbuf;
+    entry->u.QueryFile.filter = &RxContext->pFobx->UnicodeQueryTemplate;
+    entry->u.QueryFile.initial_query = initial_query;
+    entry->u.QueryFile.restart_scan = restart_scan;
+    entry->u.QueryFile.return_single = return_single;
+
+    status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        *mdl = NULL;
+        *kbuf = NULL;
+        entry = NULL;
+        goto out;
+    }
+
+    if (entry->status == STATUS_BUFFER_TOO_SMALL) {
+        DbgP("nfs41_dirquery_upcall: buffer too small provided %lu need %lu\n",
+            buf_len, entry->u.QueryFile.buf_len);
+        *reply_len = entry->u.QueryFile.buf_len;
+        status = STATUS_BUFFER_TOO_SMALL;
+    } else if (entry->status == STATUS_SUCCESS) {
 #ifdef ENABLE_TIMINGS
-    LARGE_INTEGER t1, t2;
-    t1 = KeQueryPerformanceCounter(NULL);
+        InterlockedIncrement(&readdir.sops);
+        InterlockedAdd64(&readdir.size, entry->u.QueryFile.buf_len);
 #endif
+        *reply_len = entry->u.QueryFile.buf_len;
+        status = STATUS_SUCCESS;
+    } else if ((entry->status == STATUS_ACCESS_VIOLATION) ||
+        (entry->status == STATUS_INSUFFICIENT_RESOURCES)) {
+        DbgP("nfs41_dirquery_upcall: internal error: entry->status=0x%lx\n",
+            (long)entry->status);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    } else {
+        /* map windows ERRORs to NTSTATUS */
+        status = map_querydir_errors(entry->status);
+    }
 
-#ifdef DEBUG_DIR_QUERY
-    DbgEn();
-    print_querydir_args(RxContext);
-#endif
-    FsRtlEnterFileSystem();
+out:
+    if (entry) {
+        /* the caller still owns |mdl| and |kbuf| */
+        entry->u.QueryFile.mdl = NULL;
+        entry->u.QueryFile.kbuf = NULL;
+        nfs41_UpcallDestroy(entry);
+    }
+    return status;
+}
 
-    status = check_nfs41_dirquery_args(RxContext);
-    if (status) goto out;
+#ifdef NFS41_DRIVER_DIRQUERY_BUFFER
+/*
+ * Directory enumeration buffer
+ *
+ * Instead of one |NFS41_SYSOP_DIR_QUERY| upcall per
+ * |IRP_MN_QUERY_DIRECTORY| (sized to the caller's buffer, or just one
+ * entry for |ReturnSingleEntry|) each FOBX fetches up to
+ * |NFS41_DIRQUERY_BUFFER_SIZE| bytes of entries per upcall, and
+ * serves the following queries from that buffer.
+ * The daemon already applied the FOBX's |UnicodeQueryTemplate| filter
+ * (which cannot change after the initial query), so the buffered
+ * entries can be returned as-is. The buffer is dropped on
+ * |InitialQuery|, |RestartScan| or if the caller switches to another
+ * information class.
+ * The |dirbuf_*| fields in |NFS41_FOBX| are protected by the FCB
+ * resource, which RDBSS holds exclusively while calling
+ * |MRxQueryDirectory|.
+ */
+
+/* Size of the entry at |info| without the padding to the next entry */
+static ULONG nfs41_dirbuf_entry_size(
+    IN FILE_INFORMATION_CLASS InfoClass,
+    IN const void *info)
+{
+#define DIRBUF_ENTRY_SIZE(type) \
+    (FIELD_OFFSET(type, FileName) + ((const type *)info)->FileNameLength)
 
     switch (InfoClass) {
-    /* classes handled in readdir_copy_entry() and readdir_size_for_entry() */
     case FileNamesInformation:
+        return DIRBUF_ENTRY_SIZE(FILE_NAMES_INFORMATION);
     case FileDirectoryInformation:
+        return DIRBUF_ENTRY_SIZE(FILE_DIRECTORY_INFORMATION);
     case FileFullDirectoryInformation:
+        return DIRBUF_ENTRY_SIZE(FILE_FULL_DIR_INFORMATION);
     case FileIdFullDirectoryInformation:
+        return DIRBUF_ENTRY_SIZE(FILE_ID_FULL_DIR_INFORMATION);
     case FileBothDirectoryInformation:
+        return DIRBUF_ENTRY_SIZE(FILE_BOTH_DIR_INFORMATION);
     case FileIdBothDirectoryInformation:
+        return DIRBUF_ENTRY_SIZE(FILE_ID_BOTH_DIR_INFORMATION);
     case FileIdExtdDirectoryInformation:
+        return DIRBUF_ENTRY_SIZE(FILE_ID_EXTD_DIR_INFORMATION);
     case FileIdExtdBothDirectoryInformation:
-        break;
+        return DIRBUF_ENTRY_SIZE(FILE_ID_EXTD_BOTH_DIR_INFORMATION);
     default:
-        print_error("nfs41_QueryDirectory: "
-            "unhandled dir query class %d\n",
-            (int)InfoClass);
-        status = STATUS_NOT_SUPPORTED;
+        return 0;
+    }
+#undef DIRBUF_ENTRY_SIZE
+}
+
+void nfs41_dirbuf_free(
+    IN OUT PNFS41_FOBX nfs41_fobx)
+{
+    if (nfs41_fobx->dirbuf) {
+        nfs41_buffer_free(nfs41_fobx->dirbuf, NFS41_DIRQUERY_BUFFER_SIZE);
+        nfs41_fobx->dirbuf = NULL;
+    }
+    nfs41_fobx->dirbuf_len = 0;
+    nfs41_fobx->dirbuf_pos = 0;
+}
+
+/* Refill the FOBX's enumeration buffer with one upcall */
+static NTSTATUS nfs41_dirbuf_fill(
+    IN PRX_CONTEXT RxContext,
+    IN BOOLEAN initial_query,
+    IN BOOLEAN restart_scan)
+{
+    NTSTATUS status;
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+    PMDL mdl = NULL;
+    PVOID kbuf;
+    ULONG reply_len;
+
+    nfs41_fobx->dirbuf_len = 0;
+    nfs41_fobx->dirbuf_pos = 0;
+    nfs41_fobx->dirbuf_class = RxContext->Info.FileInformationClass;
+
+    if (nfs41_fobx->dirbuf == NULL) {
+        nfs41_fobx->dirbuf = nfs41_buffer_allocate(
+            NFS41_DIRQUERY_BUFFER_SIZE, NFS41_MM_POOLTAG_DIR);
+        if (nfs41_fobx->dirbuf == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto out;
+        }
+    }
+    kbuf = nfs41_fobx->dirbuf;
+
+    mdl = IoAllocateMdl(kbuf, NFS41_DIRQUERY_BUFFER_SIZE,
+        FALSE, FALSE, NULL);
+    if (mdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+#pragma warning( push )
+/*
+ * C28145: "The opaque MDL structure should not be modified by a
+ * driver.", |MDL_MAPPING_CAN_FAIL| is the exception
+ */
+#pragma warning (disable : 28145)
+    mdl->MdlFlags |= MDL_MAPPING_CAN_FAIL;
+#pragma warning( pop )
+
+    status = nfs41_dirquery_upcall(RxContext, &mdl, &kbuf,
+        NFS41_DIRQUERY_BUFFER_SIZE, initial_query, restart_scan, FALSE,
+        &reply_len);
+    if (kbuf == NULL) {
+        /* timeout, the upcall entry owns the buffer now */
+        nfs41_fobx->dirbuf = NULL;
+        goto out;
+    }
+    if (status)
+        goto out;
+
+    nfs41_fobx->dirbuf_len = min(reply_len, NFS41_DIRQUERY_BUFFER_SIZE);
+out:
+    if (mdl)
+        IoFreeMdl(mdl);
+    return status;
+}
+
+/*
+ * Copy entries from the FOBX's enumeration buffer to the caller's
+ * buffer, returns |STATUS_NO_MORE_ENTRIES| if the enumeration buffer
+ * is empty
+ */
+static NTSTATUS nfs41_dirbuf_copy(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+    FILE_INFORMATION_CLASS InfoClass = RxContext->Info.FileInformationClass;
+    PUCHAR dst = (PUCHAR)RxContext->Info.Buffer;
+    ULONG dst_len = (ULONG)RxContext->Info.LengthRemaining;
+    ULONG dst_pos = 0, used = 0, pos, entry_len, entry_size = 0;
+    PULONG last_next = NULL;
+    const FILE_NAMES_INFORMATION *info;
+
+    pos = nfs41_fobx->dirbuf_pos;
+    if (pos >= nfs41_fobx->dirbuf_len)
+        return STATUS_NO_MORE_ENTRIES;
+
+    __try {
+        while (pos < nfs41_fobx->dirbuf_len) {
+            /* |NextEntryOffset| is the first field of all classes */
+            info = (const FILE_NAMES_INFORMATION *)
+                (nfs41_fobx->dirbuf + pos);
+            entry_len = info->NextEntryOffset ?
+                info->NextEntryOffset : (nfs41_fobx->dirbuf_len - pos);
+            entry_size = nfs41_dirbuf_entry_size(InfoClass, info);
+            if ((entry_size == 0) || (entry_size > entry_len)) {
+                print_error("nfs41_dirbuf_copy: "
+                    "invalid entry at offset %lu\n", (unsigned long)pos);
+                nfs41_fobx->dirbuf_len = 0;
+                status = STATUS_INVALID_NETWORK_RESPONSE;
+                break;
+            }
+            if ((dst_pos > dst_len) || (entry_size > (dst_len - dst_pos)))
+                break;
+
+            RtlCopyMemory(dst + dst_pos, info, entry_size);
+            last_next = (PULONG)(dst + dst_pos);
+            *last_next = ALIGN_UP_BY(entry_size, 8);
+            used = dst_pos + entry_size;
+            dst_pos += *last_next;
+            pos += entry_len;
+
+            if (RxContext->QueryDirectory.ReturnSingleEntry)
+                break;
+        }
+        if (last_next)
+            *last_next = 0;
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        print_error("nfs41_dirbuf_copy: "
+            "exception 0x%lx copying to the caller's buffer\n",
+            (long)status);
+        return STATUS_INVALID_USER_BUFFER;
+    }
+    if (status)
+        return status;
+
+    nfs41_fobx->dirbuf_pos = pos;
+    if (last_next == NULL) {
+        /* not even the first entry fits */
+        RxContext->InformationToReturn = entry_size;
+        return STATUS_BUFFER_OVERFLOW;
+    }
+    RxContext->Info.LengthRemaining -= used;
+    return STATUS_SUCCESS;
+}
+
+/* |nfs41_QueryDirectory()| for classes served from the FOBX buffer */
+static NTSTATUS nfs41_dirbuf_query(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    NTSTATUS status;
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+    BOOLEAN initial_query = RxContext->QueryDirectory.InitialQuery;
+    BOOLEAN restart_scan = RxContext->QueryDirectory.RestartScan;
+
+    if ((!initial_query) && (!restart_scan) &&
+        (nfs41_fobx->dirbuf_class == RxContext->Info.FileInformationClass)) {
+        status = nfs41_dirbuf_copy(RxContext);
+        if (status != STATUS_NO_MORE_ENTRIES)
+            goto out;
+    } else if (nfs41_fobx->dirbuf_pos < nfs41_fobx->dirbuf_len) {
+        DbgP("nfs41_dirbuf_query: dropping %lu buffered bytes "
+            "(initial=%d restart=%d class %d->%d)\n",
+            (unsigned long)(nfs41_fobx->dirbuf_len - nfs41_fobx->dirbuf_pos),
+            (int)initial_query, (int)restart_scan,
+            (int)nfs41_fobx->dirbuf_class,
+            (int)RxContext->Info.FileInformationClass);
+    }
+
+    status = nfs41_dirbuf_fill(RxContext, initial_query, restart_scan);
+    if (status) {
+        /* the enumeration is done (or failed), release the buffer */
+        nfs41_dirbuf_free(nfs41_fobx);
         goto out;
     }
-    status = nfs41_UpcallCreate(NFS41_SYSOP_DIR_QUERY, &nfs41_fobx->sec_ctx,
-        pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
-        pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
-    if (status) goto out;
 
-    entry->u.QueryFile.InfoClass = InfoClass;
-    entry->u.QueryFile.buf_len = RxContext->Info.LengthRemaining;
-    entry->u.QueryFile.mdl = IoAllocateMdl(RxContext->Info.Buffer,
+    status = nfs41_dirbuf_copy(RxContext);
+    if (status == STATUS_NO_MORE_ENTRIES) {
+        /* the daemon returned success without entries */
+        status = STATUS_NO_MORE_FILES;
+    }
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_DIRQUERY_BUFFER */
+
+#ifndef NFS41_DRIVER_DIRQUERY_BUFFER
+/* Make the upcall fill the caller's buffer directly */
+static NTSTATUS nfs41_dirquery_callerbuf(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    NTSTATUS status;
+    PMDL mdl = NULL;
+    PVOID kbuf = NULL;
+    ULONG reply_len;
+
+    mdl = IoAllocateMdl(RxContext->Info.Buffer,
         RxContext->Info.LengthRemaining, FALSE, FALSE, NULL);
-    if (entry->u.QueryFile.mdl == NULL) {
+    if (mdl == NULL) {
         status = STATUS_INTERNAL_ERROR;
         goto out;
     }
@@ -276,62 +553,84 @@ NTSTATUS nfs41_QueryDirectory(
  * driver.", |MDL_MAPPING_CAN_FAIL| is the exception
  */
 #pragma warning (disable : 28145)
-    entry->u.QueryFile.mdl->MdlFlags |= MDL_MAPPING_CAN_FAIL;
+    mdl->MdlFlags |= MDL_MAPPING_CAN_FAIL;
 #pragma warning( pop )
 
-    status = nfs41_ProbeAndLockKernelPages(entry->u.QueryFile.mdl,
-        IoModifyAccess);
+    status = nfs41_ProbeAndLockKernelPages(mdl, IoModifyAccess);
     if (status) {
-        DbgP("nfs41_QueryDirectory: "
+        DbgP("nfs41_dirquery_callerbuf: "
             "nfs41_ProbeAndLockKernelPages() failed, status=0x%lx\n",
             (long)status);
+        IoFreeMdl(mdl);
+        mdl = NULL;
         goto out;
     }
 
-    entry->u.QueryFile.filter = Filter;
-    entry->u.QueryFile.initial_query = RxContext->QueryDirectory.InitialQuery;
-    entry->u.QueryFile.restart_scan = RxContext->QueryDirectory.RestartScan;
-    entry->u.QueryFile.return_single = RxContext->QueryDirectory.ReturnSingleEntry;
-
-    status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+    status = nfs41_dirquery_upcall(RxContext, &mdl, &kbuf,
+        RxContext->Info.LengthRemaining,
+        RxContext->QueryDirectory.InitialQuery,
+        RxContext->QueryDirectory.RestartScan,
+        RxContext->QueryDirectory.ReturnSingleEntry,
+        &reply_len);
+    if (status == STATUS_BUFFER_TOO_SMALL)
+        RxContext->InformationToReturn = reply_len;
+    else if (status == STATUS_SUCCESS)
+        RxContext->Info.LengthRemaining -= reply_len;
 
-    if (status) {
-        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
-        entry = NULL;
-        goto out;
+out:
+    if (mdl) {
+        (void)nfs41_UnlockKernelPages(mdl);
+        IoFreeMdl(mdl);
     }
+    return status;
+}
+#endif /* !NFS41_DRIVER_DIRQUERY_BUFFER */
 
-    if (entry->status == STATUS_BUFFER_TOO_SMALL) {
-        DbgP("nfs41_QueryDirectory: buffer too small provided %d need %lu\n",
-            RxContext->Info.LengthRemaining, entry->u.QueryFile.buf_len);
-        RxContext->InformationToReturn = entry->u.QueryFile.buf_len;
-        status = STATUS_BUFFER_TOO_SMALL;
-    } else if (entry->status == STATUS_SUCCESS) {
+NTSTATUS nfs41_QueryDirectory(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    NTSTATUS status = STATUS_INVALID_PARAMETER;
+    FILE_INFORMATION_CLASS InfoClass = RxContext->Info.FileInformationClass;
 #ifdef ENABLE_TIMINGS
-        InterlockedIncrement(&readdir.sops);
-        InterlockedAdd64(&readdir.size, entry->u.QueryFile.buf_len);
+    LARGE_INTEGER t1, t2;
+    t1 = KeQueryPerformanceCounter(NULL);
 #endif
-        RxContext->Info.LengthRemaining -= entry->u.QueryFile.buf_len;
-        status = STATUS_SUCCESS;
-    } else if ((entry->status == STATUS_ACCESS_VIOLATION) ||
-        (entry->status == STATUS_INSUFFICIENT_RESOURCES)) {
-        DbgP("nfs41_QueryDirectory: internal error: entry->status=0x%lx\n",
-            (long)entry->status);
-        status = STATUS_INSUFFICIENT_RESOURCES;
-    } else {
-        /* map windows ERRORs to NTSTATUS */
-        status = map_querydir_errors(entry->status);
+
+#ifdef DEBUG_DIR_QUERY
+    DbgEn();
+    print_querydir_args(RxContext);
+#endif
+    FsRtlEnterFileSystem();
+
+    status = check_nfs41_dirquery_args(RxContext);
+    if (status) goto out;
+
+    switch (InfoClass) {
+    /* classes handled in readdir_copy_entry() and readdir_size_for_entry() */
+    case FileNamesInformation:
+    case FileDirectoryInformation:
+    case FileFullDirectoryInformation:
+    case FileIdFullDirectoryInformation:
+    case FileBothDirectoryInformation:
+    case FileIdBothDirectoryInformation:
+    case FileIdExtdDirectoryInformation:
+    case FileIdExtdBothDirectoryInformation:
+        break;
+    default:
+        print_error("nfs41_QueryDirectory: "
+            "unhandled dir query class %d\n",
+            (int)InfoClass);
+        status = STATUS_NOT_SUPPORTED;
+        goto out;
     }
 
+#ifdef NFS41_DRIVER_DIRQUERY_BUFFER
+    status = nfs41_dirbuf_query(RxContext);
+#else
+    status = nfs41_dirquery_callerbuf(RxContext);
+#endif /* NFS41_DRIVER_DIRQUERY_BUFFER */
+
 out:
-    if (entry) {
-        if (entry->u.QueryFile.mdl) {
-            (void)nfs41_UnlockKernelPages(entry->u.QueryFile.mdl);
-            IoFreeMdl(entry->u.QueryFile.mdl);
-            entry->u.QueryFile.mdl = NULL;
-        }
-        nfs41_UpcallDestroy(entry);
-    }
 #ifdef ENABLE_TIMINGS
     t2 = KeQueryPerformanceCounter(NULL);
     InterlockedIncrement(&readdir.tops);
@@ -347,3 +646,252 @@ out:
 #endif
     return status;
 }
+
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+/*
+ * Directory change notification
+ *
+ * |nfs41_NotifyChangeDirectory()| makes a |NFS41_SYSOP_DIR_NOTIFY|
+ * upcall, which arms a watch in the daemon (see daemon/dirnotify.c),
+ * and then keeps the |RxContext| on |dirnotifylist| until the daemon
+ * reports a change of the directory with |IOCTL_NFS41_DIR_NOTIFY|.
+ * We do not know which entries have changed, so the IRP is always
+ * completed with |STATUS_NOTIFY_ENUM_DIR|, and the application has
+ * to re-read the directory.
+ * Whoever removes an entry from |dirnotifylist| completes its
+ * |RxContext|. RDBSS calls the cancel routine for the pending
+ * requests of a handle when it is cleaned up.
+ */
+typedef struct _nfs41_dirnotify_entry {
+    LIST_ENTRY      next;
+    PRX_CONTEXT     RxContext;
+    PMRX_SRV_OPEN   srv_open;
+} nfs41_dirnotify_entry;
+
+static struct {
+    LIST_ENTRY  head;
+    KSPIN_LOCK  lock;
+} dirnotifylist;
+
+void nfs41_dirnotify_init(void)
+{
+    InitializeListHead(&dirnotifylist.head);
+    KeInitializeSpinLock(&dirnotifylist.lock);
+}
+
+NTSTATUS marshal_nfs41_dirnotify(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG header_len = 0;
+    unsigned char *tmp = buf;
+
+    status = marshal_nfs41_header(entry, tmp, buf_len, len);
+    if (status)
+        goto out;
+    tmp += *len;
+
+    header_len = *len + sizeof(BOOLEAN) + sizeof(ULONG);
+    if (header_len > buf_len) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+    RtlCopyMemory(tmp, &entry->u.DirNotify.watch_tree, sizeof(BOOLEAN));
+    tmp += sizeof(BOOLEAN);
+    RtlCopyMemory(tmp, &entry->u.DirNotify.filter, sizeof(ULONG));
+    tmp += sizeof(ULONG);
+
+    *len = (ULONG)(tmp - buf);
+    if (*len != header_len) {
+        DbgP("marshal_nfs41_dirnotify: *len(=%ld) != header_len(=%ld)\n",
+            (long)*len, (long)header_len);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+#ifdef DEBUG_MARSHAL_DETAIL
+    DbgP("marshal_nfs41_dirnotify: name='%wZ' watch_tree=%d filter=0x%lx\n",
+        entry->filename, (int)entry->u.DirNotify.watch_tree,
+        (long)entry->u.DirNotify.filter);
+#endif
+out:
+    return status;
+}
+
+/* Remove |RxContext| from |dirnotifylist|, returns the entry if found */
+static nfs41_dirnotify_entry *nfs41_dirnotify_remove(
+    IN PRX_CONTEXT RxContext)
+{
+    PLIST_ENTRY pEntry;
+    nfs41_dirnotify_entry *cur, *found = NULL;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&dirnotifylist.lock, &irql);
+    for (pEntry = dirnotifylist.head.Flink;
+        pEntry != &dirnotifylist.head;
+        pEntry = pEntry->Flink) {
+        cur = CONTAINING_RECORD(pEntry, nfs41_dirnotify_entry, next);
+        if (cur->RxContext == RxContext) {
+            RemoveEntryList(&cur->next);
+            found = cur;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&dirnotifylist.lock, irql);
+    return found;
+}
+
+static void nfs41_dirnotify_complete(
+    IN nfs41_dirnotify_entry *entry,
+    IN NTSTATUS status)
+{
+    PRX_CONTEXT RxContext = entry->RxContext;
+
+    RxFreePool(entry);
+    RxContext->StoredStatus = status;
+    RxContext->InformationToReturn = 0;
+    RxLowIoCompletion(RxContext);
+}
+
+static NTSTATUS nfs41_dirnotify_cancel(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    nfs41_dirnotify_entry *entry;
+
+    entry = nfs41_dirnotify_remove(RxContext);
+    if (entry) {
+        DbgP("nfs41_dirnotify_cancel: RxContext=0x%p cancelled\n",
+            RxContext);
+        nfs41_dirnotify_complete(entry, STATUS_CANCELLED);
+    }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS nfs41_NotifyChangeDirectory(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    NTSTATUS status;
+    nfs41_updowncall_entry *entry = NULL;
+    nfs41_dirnotify_entry *pending = NULL;
+    KIRQL irql;
+    __notnull PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
+    __notnull PNFS41_NETROOT_EXTENSION pNetRootContext =
+        NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+
+    FsRtlEnterFileSystem();
+
+    pending = RxAllocatePoolWithTag(NonPagedPoolNx,
+        sizeof(nfs41_dirnotify_entry), NFS41_MM_POOLTAG_DIR);
+    if (pending == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+    pending->RxContext = RxContext;
+    pending->srv_open = SrvOpen;
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_DIR_NOTIFY,
+        &nfs41_fobx->sec_ctx,
+        pVNetRootContext->session,
+        nfs41_fobx->nfs41_open_state,
+        pNetRootContext->nfs41d_version,
+        SrvOpen->pAlreadyPrefixedName,
+        &entry);
+    if (status)
+        goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+
+    entry->u.DirNotify.watch_tree =
+        LowIoContext->ParamsFor.NotifyChangeDirectory.WatchTree;
+    entry->u.DirNotify.filter =
+        LowIoContext->ParamsFor.NotifyChangeDirectory.CompletionFilter;
+
+    status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        goto out;
+    }
+    if (entry->status) {
+        status = map_querydir_errors(entry->status);
+        goto out;
+    }
+
+    /*
+     * The daemon's watch is armed, a change from now on completes
+     * |RxContext| through |nfs41_dirnotify_downcall()|. The cancel
+     * routine is set with |dirnotifylist.lock| held, so a downcall
+     * can not complete |RxContext| before that
+     */
+    KeAcquireSpinLock(&dirnotifylist.lock, &irql);
+    status = RxSetMinirdrCancelRoutine(RxContext, nfs41_dirnotify_cancel);
+    if (status != STATUS_CANCELLED)
+        InsertTailList(&dirnotifylist.head, &pending->next);
+    KeReleaseSpinLock(&dirnotifylist.lock, irql);
+    if (status == STATUS_CANCELLED)
+        goto out;
+
+    pending = NULL;
+    status = STATUS_PENDING;
+
+out:
+    if (pending) {
+        RxFreePool(pending);
+    }
+    if (entry) {
+        nfs41_UpcallDestroy(entry);
+    }
+    FsRtlExitFileSystem();
+    return status;
+}
+
+/*
+ * |IOCTL_NFS41_DIR_NOTIFY| - the daemon has seen a change of the
+ * directory opened by |srv_open|. |srv_open| is only compared, the
+ * directory might have been closed already
+ */
+NTSTATUS nfs41_dirnotify_downcall(
+    IN PRX_CONTEXT RxContext)
+{
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    PMRX_SRV_OPEN srv_open;
+    LIST_ENTRY done;
+    PLIST_ENTRY pEntry, pNext;
+    nfs41_dirnotify_entry *cur;
+    KIRQL irql;
+
+    if (LowIoContext->ParamsFor.IoCtl.InputBufferLength < sizeof(HANDLE))
+        return STATUS_INVALID_PARAMETER;
+    RtlCopyMemory(&srv_open, LowIoContext->ParamsFor.IoCtl.pInputBuffer,
+        sizeof(HANDLE));
+
+    InitializeListHead(&done);
+    KeAcquireSpinLock(&dirnotifylist.lock, &irql);
+    for (pEntry = dirnotifylist.head.Flink;
+        pEntry != &dirnotifylist.head;
+        pEntry = pNext) {
+        pNext = pEntry->Flink;
+        cur = CONTAINING_RECORD(pEntry, nfs41_dirnotify_entry, next);
+        if (cur->srv_open == srv_open) {
+            RemoveEntryList(&cur->next);
+            InsertTailList(&done, &cur->next);
+        }
+    }
+    KeReleaseSpinLock(&dirnotifylist.lock, irql);
+
+    while (!IsListEmpty(&done)) {
+        pEntry = RemoveHeadList(&done);
+        cur = CONTAINING_RECORD(pEntry, nfs41_dirnotify_entry, next);
+        (void)RxSetMinirdrCancelRoutine(cur->RxContext, NULL);
+        nfs41_dirnotify_complete(cur, STATUS_NOTIFY_ENUM_DIR);
+    }
+    return STATUS_SUCCESS;
+}
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
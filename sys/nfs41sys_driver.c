@@ -58,6 +58,9 @@
 #include <winerror.h>
 
 #include <Ntstrsafe.h>
+#if defined(_M_X64)
+#include <emmintrin.h>
+#endif /* _M_X64 */
 
 #include "nfs41sys_buildconfig.h"
 
@@ -89,7 +92,8 @@ DECLARE_CONST_ANSI_STRING(NfsSymlinkTargetName, EA_NFSSYMLINKTARGETNAME);
 DECLARE_CONST_ANSI_STRING(NfsActOnLink, EA_NFSACTONLINK);
 
 #ifdef USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM
-NPAGED_LOOKASIDE_LIST updowncall_entry_upcall_lookasidelist;
+NPAGED_LOOKASIDE_LIST
+    updowncall_entry_upcall_lookasidelist[NFS41_UPCALL_MAX_NODES];
 #ifndef USE_STACK_FOR_DOWNCALL_UPDOWNCALLENTRY_MEM
 NPAGED_LOOKASIDE_LIST updowncall_entry_downcall_lookasidelist;
 #endif /* !USE_STACK_FOR_DOWNCALL_UPDOWNCALLENTRY_MEM */
@@ -97,6 +101,18 @@ NPAGED_LOOKASIDE_LIST updowncall_entry_downcall_lookasidelist;
 #ifdef USE_LOOKASIDELISTS_FOR_FCBLISTENTRY_MEM
 NPAGED_LOOKASIDE_LIST fcblistentry_lookasidelist;
 #endif /* USE_LOOKASIDELISTS_FOR_FCBLISTENTRY_MEM */
+#ifdef USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS
+NPAGED_LOOKASIDE_LIST buffer_lookasidelist[NFS41_BUFFER_NUM_CLASSES];
+
+static const SIZE_T buffer_class_size[NFS41_BUFFER_NUM_CLASSES] = {
+    512, 4096, NFS41_DIRQUERY_BUFFER_SIZE
+};
+#ifdef LOOKASIDELISTS_STATS
+static const char *buffer_class_label[NFS41_BUFFER_NUM_CLASSES] = {
+    "buffer_512", "buffer_4096", "buffer_dirquery"
+};
+#endif /* LOOKASIDELISTS_STATS */
+#endif /* USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
 
 #ifdef ENABLE_TIMINGS
 nfs41_timings lookup;
@@ -127,8 +143,12 @@ PRDBSS_DEVICE_OBJECT nfs41_dev;
 
 
 KEVENT upcallEvent;
+#if defined(NFS41_DRIVER_FASTIO_QUERYINFO) || \
+    defined(NFS41_DRIVER_FASTIO_QUERYOPEN)
+static FAST_IO_DISPATCH nfs41_FastIoDispatch;
+#endif /* NFS41_DRIVER_FASTIO_QUERYINFO || NFS41_DRIVER_FASTIO_QUERYOPEN */
 nfs41_updowncall_list upcalllist;
-nfs41_updowncall_list downcalllist;
+nfs41_downcall_hashtable downcalllist;
 nfs41_fcb_list openlist;
 
 nfs41_offloadcontext_list offloadcontextlist;
@@ -174,6 +194,216 @@ void nfs41_free_nfs41_fcb_list_entry(nfs41_fcb_list_entry *entry)
 #endif /* USE_LOOKASIDELISTS_FOR_FCBLISTENTRY_MEM */
 }
 
+/*
+ * Transient nonpaged buffers (ACL query results, symlink targets
+ * from |NFS41_SYSOP_OPEN|, |nfs41_fobx->dirbuf|) are served from
+ * per-size-class lookasidelists instead of hitting the pool for
+ * every upcall.
+ * The caller must pass the same |size| to |nfs41_buffer_free()| as
+ * to |nfs41_buffer_allocate()|, this is used to find the size class.
+ * |tag| is only used for sizes larger than the largest class, which
+ * come from the pool.
+ */
+#ifdef USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS
+static int nfs41_buffer_class(SIZE_T size)
+{
+    int i;
+
+    for (i = 0; i < NFS41_BUFFER_NUM_CLASSES; i++) {
+        if (size <= buffer_class_size[i])
+            return i;
+    }
+    return -1;
+}
+#endif /* USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
+
+void nfs41_buffer_lookasidelists_init(void)
+{
+#ifdef USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS
+    int i;
+
+    for (i = 0; i < NFS41_BUFFER_NUM_CLASSES; i++) {
+        ExInitializeNPagedLookasideList(
+            &buffer_lookasidelist[i], NULL, NULL,
+            POOL_NX_ALLOCATION, buffer_class_size[i],
+            NFS41_MM_POOLTAG_BUF, 0);
+    }
+#endif /* USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
+}
+
+void nfs41_buffer_lookasidelists_delete(void)
+{
+#ifdef USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS
+    int i;
+
+    for (i = 0; i < NFS41_BUFFER_NUM_CLASSES; i++) {
+#ifdef LOOKASIDELISTS_STATS
+        print_lookasidelist_stat(buffer_class_label[i],
+            &buffer_lookasidelist[i]);
+#endif /* LOOKASIDELISTS_STATS */
+        ExDeleteNPagedLookasideList(&buffer_lookasidelist[i]);
+    }
+#endif /* USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
+}
+
+PVOID nfs41_buffer_allocate(SIZE_T size, ULONG tag)
+{
+#ifdef USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS
+    int c = nfs41_buffer_class(size);
+
+    if (c >= 0) {
+#ifdef LOOKASIDELISTS_STATS
+        volatile static long cnt = 0;
+        if ((cnt++ % 100) == 0) {
+            print_lookasidelist_stat(buffer_class_label[c],
+                &buffer_lookasidelist[c]);
+        }
+#endif /* LOOKASIDELISTS_STATS */
+        return ExAllocateFromNPagedLookasideList(&buffer_lookasidelist[c]);
+    }
+#endif /* USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
+    return RxAllocatePoolWithTag(NonPagedPoolNx, size, tag);
+}
+
+void nfs41_buffer_free(PVOID buf, SIZE_T size)
+{
+#ifdef USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS
+    int c = nfs41_buffer_class(size);
+
+    if (c >= 0) {
+        ExFreeToNPagedLookasideList(&buffer_lookasidelist[c], buf);
+        return;
+    }
+#else
+    (void)size;
+#endif /* USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
+    RxFreePool(buf);
+}
+
+static
+nfs41_fcb_list_bucket *nfs41_openlist_bucket(
+    IN PMRX_FCB fcb)
+{
+    /*
+     * FCBs are pool allocations, so the low bits of the pointer are
+     * always zero, use the upper bits of a multiplicative hash
+     */
+    ULONGLONG h = ((ULONGLONG)(ULONG_PTR)fcb >> 4) *
+        0x9E3779B97F4A7C15ULL;
+
+    return &openlist.buckets[
+        (ULONG)(h >> 32) & (NFS41_OPENLIST_NUM_BUCKETS-1)];
+}
+
+/* Caller must hold the lock of |bucket| */
+static
+nfs41_fcb_list_entry *nfs41_openlist_find(
+    IN nfs41_fcb_list_bucket *bucket,
+    IN PMRX_FCB fcb)
+{
+    PLIST_ENTRY pEntry;
+    nfs41_fcb_list_entry *cur;
+
+    for (pEntry = bucket->head.Flink ;
+        pEntry != &bucket->head ;
+        pEntry = pEntry->Flink) {
+        cur = (nfs41_fcb_list_entry *)CONTAINING_RECORD(pEntry,
+                nfs41_fcb_list_entry, hash_next);
+        if (cur->fcb == fcb)
+            return cur;
+    }
+    return NULL;
+}
+
+void nfs41_openlist_init(void)
+{
+    ULONG i;
+
+    ExInitializeFastMutex(&openlist.lock);
+    InitializeListHead(&openlist.head);
+    for (i = 0 ; i < NFS41_OPENLIST_NUM_BUCKETS ; i++) {
+        ExInitializeFastMutex(&openlist.buckets[i].lock);
+        InitializeListHead(&openlist.buckets[i].head);
+    }
+}
+
+/* Caller must hold |openlist.lock| */
+static
+void nfs41_openlist_add_locked(
+    IN nfs41_fcb_list_entry *entry)
+{
+    nfs41_fcb_list_bucket *bucket = nfs41_openlist_bucket(entry->fcb);
+
+    InsertTailList(&openlist.head, &entry->next);
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+    InsertTailList(&bucket->head, &entry->hash_next);
+    ExReleaseFastMutexUnsafe(&bucket->lock);
+}
+
+void nfs41_openlist_add(
+    IN nfs41_fcb_list_entry *entry)
+{
+    ExAcquireFastMutexUnsafe(&openlist.lock);
+    nfs41_openlist_add_locked(entry);
+    ExReleaseFastMutexUnsafe(&openlist.lock);
+}
+
+/*
+ * ASCII fast path for the UTF-16 -> UTF-8 conversion of upcall
+ * strings: Nearly all paths are pure ASCII, and then the UTF-8 form
+ * is just the low byte of each |WCHAR|.
+ * x64 always has SSE2 and kernel code may use the XMM registers
+ * without saving them (AVX would require
+ * |KeSaveExtendedProcessorState()|, which costs more than it saves
+ * for strings of this length), all other platforms use the scalar
+ * loop
+ */
+BOOLEAN nfs41_unicode_is_ascii(
+    IN const WCHAR *str,
+    IN ULONG nchars)
+{
+    ULONG i = 0;
+
+#if defined(_M_X64)
+    const __m128i highbits = _mm_set1_epi16((short)0xFF80);
+    __m128i acc = _mm_setzero_si128();
+
+    for (; (i + 8) <= nchars; i += 8) {
+        acc = _mm_or_si128(acc,
+            _mm_loadu_si128((const __m128i *)(str + i)));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(acc, highbits),
+        _mm_setzero_si128())) != 0xFFFF)
+        return FALSE;
+#endif /* _M_X64 */
+
+    for (; i < nchars; i++) {
+        if (str[i] >= 0x80)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void nfs41_unicode_narrow_ascii(
+    OUT PCHAR out,
+    IN const WCHAR *str,
+    IN ULONG nchars)
+{
+    ULONG i = 0;
+
+#if defined(_M_X64)
+    for (; (i + 16) <= nchars; i += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(str + i + 8));
+        /* All values are < 0x80, so the saturation never kicks in */
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+#endif /* _M_X64 */
+
+    for (; i < nchars; i++)
+        out[i] = (CHAR)str[i];
+}
+
 NTSTATUS marshall_unicode_as_utf8(
     IN OUT unsigned char **pos,
     IN PCUNICODE_STRING str)
@@ -190,6 +420,13 @@ NTSTATUS marshall_unicode_as_utf8(
         goto out_copy;
     }
 
+    if (nfs41_unicode_is_ascii(str->Buffer, str->Length/sizeof(WCHAR))) {
+        status = STATUS_SUCCESS;
+        ActualCount = str->Length/sizeof(WCHAR);
+        nfs41_unicode_narrow_ascii(out_str, str->Buffer, ActualCount);
+        goto out_copy;
+    }
+
     /*
      * Convert the string directly into the upcall buffer
      * (We assume that the caller has used |length_as_utf8()|
@@ -223,6 +460,41 @@ out:
     return status;
 }
 
+/*
+ * |length_as_utf8()|/|marshall_unicode_as_utf8()| for
+ * |entry->filename|, which use the FCB's UTF-8 name if
+ * |nfs41_UpcallSetFcbFilename()| has set one
+ */
+ULONG length_filename_as_utf8(
+    IN nfs41_updowncall_entry *entry)
+{
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    if (entry->filename_utf8)
+        return sizeof(USHORT) + entry->filename_utf8->length + 1;
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
+    return length_as_utf8(entry->filename);
+}
+
+NTSTATUS marshall_filename_as_utf8(
+    IN OUT unsigned char **pos,
+    IN nfs41_updowncall_entry *entry)
+{
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    const nfs41_utf8name *name = entry->filename_utf8;
+
+    if (name) {
+        USHORT out_str_len = (USHORT)(name->length+1);
+        RtlCopyMemory(*pos, &out_str_len, sizeof(out_str_len));
+        *pos += sizeof(out_str_len);
+        /* Includes the '\0' */
+        RtlCopyMemory(*pos, name->name, out_str_len);
+        *pos += out_str_len;
+        return STATUS_SUCCESS;
+    }
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
+    return marshall_unicode_as_utf8(pos, entry->filename);
+}
+
 NTSTATUS marshal_nfs41_header(
     nfs41_updowncall_entry *entry,
     unsigned char *buf,
@@ -300,6 +572,28 @@ NTSTATUS nfs41_invalidate_cache(
         srv_open, srv_open->pAlreadyPrefixedName);
 #endif
     __try {
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+        /* Delegation recall, cached attributes are no longer safe */
+        nfs41_fcb_attrcache_invalidate(NFS41GetFcbExtension(srv_open->pFcb));
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+        nfs41_fcb_aclcache_invalidate(NFS41GetFcbExtension(srv_open->pFcb));
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+        /*
+         * The delegation is gone for all FOBXs on this SRV_OPEN, and
+         * opens collapsed onto it later must not inherit it
+         */
+        NFS41GetSrvOpenExtension(srv_open)->deleg_type = 0;
+        NFS41GetSrvOpenExtension(srv_open)->deleg_recalled = TRUE;
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+        /*
+         * Send locally granted locks to the daemon, from a worker
+         * thread because we must not wait for the FCB here
+         */
+        nfs41_lock_buffering_recall(nfs41_dev, srv_open);
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
         RxIndicateChangeOfBufferingStateForSrvOpen(
             srv_open->pFcb->pNetRoot->pSrvCall, srv_open,
             srv_open->Key, ULongToPtr(flag));
@@ -384,6 +678,324 @@ out:
     return status;
 }
 
+NTSTATUS marshal_nfs41_get_daemon_stats(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    return marshal_nfs41_header(entry, buf, buf_len, len);
+}
+
+void unmarshal_nfs41_get_daemon_stats(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf)
+{
+    RtlCopyMemory(cur->u.GetDaemonStats.stats, *buf,
+        sizeof(NFS41_DAEMON_OP_STATS));
+    *buf += sizeof(NFS41_DAEMON_OP_STATS);
+}
+
+static
+NTSTATUS nfs41_get_daemon_stats(
+    DWORD version,
+    NFS41_DAEMON_OP_STATS *stats)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    nfs41_updowncall_entry *entry = NULL;
+
+    DbgEn();
+    status = nfs41_UpcallCreate(NFS41_SYSOP_GET_DAEMON_STATS, NULL,
+        INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, version, NULL, &entry);
+    if (status) goto out;
+
+    /*
+     * |stats| is the |IOCTL_NFS41_GET_OP_STATS| output buffer, it is
+     * only written by |nfs41_downcall()| while we still wait for
+     * the reply
+     */
+    entry->u.GetDaemonStats.stats = stats;
+
+    status = nfs41_UpcallWaitForReply(entry, UPCALL_TIMEOUT_DEFAULT);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        goto out;
+    }
+
+    if (entry->status)
+        status = STATUS_UNSUCCESSFUL;
+
+    nfs41_UpcallDestroy(entry);
+out:
+    DbgEx();
+    return status;
+}
+
+NTSTATUS marshal_nfs41_get_flight_recorder(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    return marshal_nfs41_header(entry, buf, buf_len, len);
+}
+
+void unmarshal_nfs41_get_flight_recorder(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf)
+{
+    NFS41_FLIGHT_RECORDER *recorder = cur->u.GetFlightRecorder.recorder;
+    ULONG count;
+
+    RtlCopyMemory(&count, *buf, sizeof(count));
+    *buf += sizeof(count);
+    count = min(count, NFS41_FLIGHT_RECORDER_NUM_RECORDS);
+    RtlCopyMemory(recorder->records, *buf,
+        count * sizeof(NFS41_FLIGHT_RECORD));
+    *buf += count * sizeof(NFS41_FLIGHT_RECORD);
+    recorder->count = count;
+}
+
+/*
+ * Handle |IOCTL_NFS41_GET_FLIGHT_RECORDER|, the records come from
+ * the daemon
+ */
+static
+NTSTATUS nfs41_get_flight_recorder(
+    IN OUT PRX_CONTEXT RxContext,
+    IN DWORD version)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    ULONG outbuf_len = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
+    NFS41_FLIGHT_RECORDER *recorder =
+        (NFS41_FLIGHT_RECORDER *)LowIoContext->ParamsFor.IoCtl.pOutputBuffer;
+    nfs41_updowncall_entry *entry = NULL;
+
+    DbgEn();
+    if (outbuf_len < sizeof(NFS41_FLIGHT_RECORDER)) {
+        status = STATUS_BUFFER_TOO_SMALL;
+        goto out;
+    }
+
+    RtlZeroMemory(recorder, sizeof(NFS41_FLIGHT_RECORDER));
+    recorder->daemon_status = STATUS_DEVICE_NOT_READY;
+    RxContext->InformationToReturn = sizeof(NFS41_FLIGHT_RECORDER);
+
+    if (nfs41_start_state != NFS41_START_DRIVER_STARTED)
+        goto out;
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_GET_FLIGHT_RECORDER, NULL,
+        INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, version, NULL, &entry);
+    if (status) goto out;
+
+    /* see |nfs41_get_daemon_stats()| */
+    entry->u.GetFlightRecorder.recorder = recorder;
+
+    status = nfs41_UpcallWaitForReply(entry, UPCALL_TIMEOUT_DEFAULT);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        recorder->daemon_status = status;
+        status = STATUS_SUCCESS;
+        goto out;
+    }
+
+    recorder->daemon_status = entry->status?STATUS_UNSUCCESSFUL:STATUS_SUCCESS;
+
+    nfs41_UpcallDestroy(entry);
+out:
+    DbgEx();
+    return status;
+}
+
+NTSTATUS marshal_nfs41_get_mount_stats(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    return marshal_nfs41_header(entry, buf, buf_len, len);
+}
+
+void unmarshal_nfs41_get_mount_stats(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf)
+{
+    NFS41_MOUNT_STATS *stats = cur->u.GetMountStats.stats;
+    ULONG count;
+
+    RtlCopyMemory(&count, *buf, sizeof(count));
+    *buf += sizeof(count);
+    count = min(count, NFS41_MOUNT_STATS_MAX_MOUNTS);
+    RtlCopyMemory(stats->roots, *buf, count * sizeof(NFS41_ROOT_STATS));
+    *buf += count * sizeof(NFS41_ROOT_STATS);
+    stats->num_roots = count;
+}
+
+/*
+ * Handle |IOCTL_NFS41_GET_MOUNT_STATS|, the per-NetRoot part comes
+ * from the kernel, the per-|nfs41_root| part from the daemon
+ */
+static
+NTSTATUS nfs41_get_mount_stats(
+    IN OUT PRX_CONTEXT RxContext,
+    IN DWORD version)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    ULONG outbuf_len = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
+    NFS41_MOUNT_STATS *stats =
+        (NFS41_MOUNT_STATS *)LowIoContext->ParamsFor.IoCtl.pOutputBuffer;
+    nfs41_updowncall_entry *entry = NULL;
+
+    DbgEn();
+    if (outbuf_len < sizeof(NFS41_MOUNT_STATS)) {
+        status = STATUS_BUFFER_TOO_SMALL;
+        goto out;
+    }
+
+    RtlZeroMemory(stats, sizeof(NFS41_MOUNT_STATS));
+    stats->daemon_status = STATUS_DEVICE_NOT_READY;
+    RxContext->InformationToReturn = sizeof(NFS41_MOUNT_STATS);
+
+    nfs41_get_netroot_stats(stats);
+
+    if (nfs41_start_state != NFS41_START_DRIVER_STARTED)
+        goto out;
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_GET_MOUNT_STATS, NULL,
+        INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, version, NULL, &entry);
+    if (status) goto out;
+
+    /* see |nfs41_get_daemon_stats()| */
+    entry->u.GetMountStats.stats = stats;
+
+    status = nfs41_UpcallWaitForReply(entry, UPCALL_TIMEOUT_DEFAULT);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        stats->daemon_status = status;
+        status = STATUS_SUCCESS;
+        goto out;
+    }
+
+    stats->daemon_status = entry->status?STATUS_UNSUCCESSFUL:STATUS_SUCCESS;
+
+    nfs41_UpcallDestroy(entry);
+out:
+    DbgEx();
+    return status;
+}
+
+NTSTATUS marshal_nfs41_get_top_stats(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG header_len = 0;
+    unsigned char *tmp = buf;
+
+    status = marshal_nfs41_header(entry, tmp, buf_len, len);
+    if (status)
+        goto out;
+    tmp += *len;
+
+    header_len = *len + sizeof(ULONGLONG);
+    if (header_len > buf_len) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+    RtlCopyMemory(tmp, &entry->u.GetTopStats.root,
+        sizeof(entry->u.GetTopStats.root));
+    tmp += sizeof(entry->u.GetTopStats.root);
+
+    *len = (ULONG)(tmp - buf);
+out:
+    return status;
+}
+
+void unmarshal_nfs41_get_top_stats(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf)
+{
+    NFS41_TOP_STATS *stats = cur->u.GetTopStats.stats;
+    ULONG count;
+
+    RtlCopyMemory(&count, *buf, sizeof(count));
+    *buf += sizeof(count);
+    count = min(count, NFS41_TOP_STATS_MAX_ENTRIES);
+    RtlCopyMemory(stats->entries, *buf,
+        count * sizeof(NFS41_TOP_STATS_ENTRY));
+    *buf += count * sizeof(NFS41_TOP_STATS_ENTRY);
+    stats->num_entries = count;
+}
+
+/* Handle |IOCTL_NFS41_GET_TOP_STATS| */
+static
+NTSTATUS nfs41_get_top_stats(
+    IN OUT PRX_CONTEXT RxContext,
+    IN DWORD version)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    ULONG inbuf_len = LowIoContext->ParamsFor.IoCtl.InputBufferLength;
+    ULONG outbuf_len = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
+    NFS41_TOP_STATS *stats =
+        (NFS41_TOP_STATS *)LowIoContext->ParamsFor.IoCtl.pOutputBuffer;
+    nfs41_updowncall_entry *entry = NULL;
+    ULONGLONG root = 0;
+
+    DbgEn();
+    if (outbuf_len < sizeof(NFS41_TOP_STATS)) {
+        status = STATUS_BUFFER_TOO_SMALL;
+        goto out;
+    }
+    if (inbuf_len == sizeof(ULONGLONG)) {
+        RtlCopyMemory(&root, LowIoContext->ParamsFor.IoCtl.pInputBuffer,
+            sizeof(root));
+    }
+    else if (inbuf_len != 0) {
+        status = STATUS_INVALID_PARAMETER;
+        goto out;
+    }
+
+    RtlZeroMemory(stats, sizeof(NFS41_TOP_STATS));
+    stats->daemon_status = STATUS_DEVICE_NOT_READY;
+    RxContext->InformationToReturn = sizeof(NFS41_TOP_STATS);
+
+    if (nfs41_start_state != NFS41_START_DRIVER_STARTED)
+        goto out;
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_GET_TOP_STATS, NULL,
+        INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, version, NULL, &entry);
+    if (status) goto out;
+
+    /* see |nfs41_get_daemon_stats()| */
+    entry->u.GetTopStats.stats = stats;
+    entry->u.GetTopStats.root = root;
+
+    status = nfs41_UpcallWaitForReply(entry, UPCALL_TIMEOUT_DEFAULT);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        stats->daemon_status = status;
+        status = STATUS_SUCCESS;
+        goto out;
+    }
+
+    stats->daemon_status = entry->status?STATUS_UNSUCCESSFUL:STATUS_SUCCESS;
+
+    nfs41_UpcallDestroy(entry);
+out:
+    DbgEx();
+    return status;
+}
+
 NTSTATUS nfs41_shutdown_daemon(
     DWORD version)
 {
@@ -556,12 +1168,26 @@ NTSTATUS nfs41_DevFcbXXXControlFile(
         case IOCTL_NFS41_INVALCACHE:
             status = nfs41_invalidate_cache(RxContext);
             break;
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+        case IOCTL_NFS41_DIR_NOTIFY:
+            status = nfs41_dirnotify_downcall(RxContext);
+            break;
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
         case IOCTL_NFS41_READ:
             status = nfs41_upcall(RxContext);
             break;
         case IOCTL_NFS41_WRITE:
             status = nfs41_downcall(RxContext);
             break;
+        case IOCTL_NFS41_READ_BATCH:
+            status = nfs41_upcall_batch(RxContext);
+            break;
+        case IOCTL_NFS41_WRITE_BATCH:
+            status = nfs41_downcall_batch(RxContext);
+            break;
+        case IOCTL_NFS41_WRITE_READ_BATCH:
+            status = nfs41_downcall_upcall_batch(RxContext);
+            break;
         case IOCTL_NFS41_DELAYXID:
             status = nfs41_delayxid(RxContext);
             break;
@@ -603,6 +1229,10 @@ NTSTATUS nfs41_DevFcbXXXControlFile(
             break;
         case IOCTL_NFS41_START:
             print_driver_state(nfs41_start_state);
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+            /* a (re-)started daemon must register its pool again */
+            nfs41_io_pool_reset();
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
             if (in_len >= sizeof(DWORD)) {
                 RtlCopyMemory(&nfs41d_version, inbuf, sizeof(DWORD));
                 DbgP("NFS41 Daemon sent start request with version %d\n",
@@ -639,6 +1269,9 @@ NTSTATUS nfs41_DevFcbXXXControlFile(
         case IOCTL_NFS41_STOP:
             if (nfs41_start_state == NFS41_START_DRIVER_STARTED)
                 nfs41_shutdown_daemon(DevExt->nfs41d_version);
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+            nfs41_io_pool_reset();
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
             if (RxContext->RxDeviceObject->NumberOfActiveFcbs > 0) {
                 DbgP("device has open handles %d\n",
                     RxContext->RxDeviceObject->NumberOfActiveFcbs);
@@ -656,6 +1289,37 @@ NTSTATUS nfs41_DevFcbXXXControlFile(
             if (status == STATUS_PENDING && RxContext->PostRequest == TRUE )
                 status = STATUS_MORE_PROCESSING_REQUIRED;
             break;
+        case IOCTL_NFS41_GET_UPDOWNCALL_STATS:
+            status = nfs41_get_updowncall_stats(RxContext);
+            break;
+        case IOCTL_NFS41_GET_OP_STATS:
+            status = nfs41_get_op_stats(RxContext);
+            if (status)
+                break;
+            if (nfs41_start_state == NFS41_START_DRIVER_STARTED) {
+                NFS41_OP_STATS *stats =
+                    (NFS41_OP_STATS *)io_ctx->ParamsFor.IoCtl.pOutputBuffer;
+                stats->daemon_status = nfs41_get_daemon_stats(
+                    DevExt->nfs41d_version, &stats->daemon);
+            }
+            break;
+        case IOCTL_NFS41_GET_FLIGHT_RECORDER:
+            status = nfs41_get_flight_recorder(RxContext,
+                DevExt->nfs41d_version);
+            break;
+        case IOCTL_NFS41_GET_MOUNT_STATS:
+            status = nfs41_get_mount_stats(RxContext,
+                DevExt->nfs41d_version);
+            break;
+        case IOCTL_NFS41_GET_TOP_STATS:
+            status = nfs41_get_top_stats(RxContext,
+                DevExt->nfs41d_version);
+            break;
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+        case IOCTL_NFS41_SET_IO_POOL:
+            status = nfs41_io_pool_set(RxContext);
+            break;
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
         case IOCTL_NFS41_SET_DAEMON_DEBUG_LEVEL:
             if (in_len == sizeof(LONG)) {
                 LONG debuglevel = 0;
@@ -793,32 +1457,29 @@ out:
 VOID nfs41_remove_fcb_entry(
     PMRX_FCB fcb)
 {
-    PLIST_ENTRY pEntry;
+    nfs41_fcb_list_bucket *bucket = nfs41_openlist_bucket(fcb);
     nfs41_fcb_list_entry *cur;
-    ExAcquireFastMutexUnsafe(&openlist.lock);
 
-    pEntry = openlist.head.Flink;
-    while (!IsListEmpty(&openlist.head)) {
-        cur = (nfs41_fcb_list_entry *)CONTAINING_RECORD(pEntry,
-                nfs41_fcb_list_entry, next);
-        if (cur->fcb == fcb) {
+    ExAcquireFastMutexUnsafe(&openlist.lock);
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+    cur = nfs41_openlist_find(bucket, fcb);
+    if (cur) {
 #ifdef DEBUG_CLOSE
-            DbgP("nfs41_remove_fcb_entry: Found match for fcb=0x%p\n", fcb);
+        DbgP("nfs41_remove_fcb_entry: Found match for fcb=0x%p\n", fcb);
 #endif
-            RemoveEntryList(pEntry);
-            nfs41_free_nfs41_fcb_list_entry(cur);
-            break;
-        }
-        if (pEntry->Flink == &openlist.head) {
+        RemoveEntryList(&cur->hash_next);
+        RemoveEntryList(&cur->next);
+    }
 #ifdef DEBUG_CLOSE
-            DbgP("nfs41_remove_fcb_entry: reached EOL looking "
-                "for fcb 0x%p\n", fcb);
-#endif
-            break;
-        }
-        pEntry = pEntry->Flink;
+    else {
+        DbgP("nfs41_remove_fcb_entry: reached EOL looking "
+            "for fcb 0x%p\n", fcb);
     }
+#endif
+    ExReleaseFastMutexUnsafe(&bucket->lock);
     ExReleaseFastMutexUnsafe(&openlist.lock);
+    if (cur)
+        nfs41_free_nfs41_fcb_list_entry(cur);
 }
 
 static
@@ -828,13 +1489,20 @@ VOID nfs41_invalidate_fobx_entry(
     PLIST_ENTRY pEntry;
     nfs41_fcb_list_entry *cur;
     __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(pFobx);
+    nfs41_fcb_list_bucket *bucket =
+        nfs41_openlist_bucket(pFobx->pSrvOpen->pFcb);
 
+    /*
+     * |openlist.lock| keeps |fcbopen_main()| from using
+     * |nfs41_fobx| while we clear it
+     */
     ExAcquireFastMutexUnsafe(&openlist.lock);
-
-    pEntry = openlist.head.Flink;
-    while (!IsListEmpty(&openlist.head)) {
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+    for (pEntry = bucket->head.Flink ;
+        pEntry != &bucket->head ;
+        pEntry = pEntry->Flink) {
         cur = (nfs41_fcb_list_entry *)CONTAINING_RECORD(pEntry,
-                nfs41_fcb_list_entry, next);
+                nfs41_fcb_list_entry, hash_next);
         if (cur->nfs41_fobx == nfs41_fobx) {
 #ifdef DEBUG_CLOSE
             DbgP("nfs41_invalidate_fobx_entry: Found match for nfs41_fobx=0x%p\n",
@@ -843,31 +1511,83 @@ VOID nfs41_invalidate_fobx_entry(
             cur->nfs41_fobx = NULL;
             break;
         }
-        if (pEntry->Flink == &openlist.head) {
-#ifdef DEBUG_CLOSE
-            DbgP("nfs41_invalidate_fobx_entry: reached EOL looking "
-                "for nfs41_fobx=0x%p\n", nfs41_fobx);
-#endif
-            break;
-        }
-        pEntry = pEntry->Flink;
     }
+    ExReleaseFastMutexUnsafe(&bucket->lock);
     ExReleaseFastMutexUnsafe(&openlist.lock);
 }
 
+/*
+ * |FlushFileBuffers()|: RDBSS has written the cached data already,
+ * ask the daemon to COMMIT what it still holds back under a write
+ * delegation, see |NFS41_DRIVER_DAEMON_WRITE_BEHIND|
+ */
 NTSTATUS nfs41_Flush(
     IN OUT PRX_CONTEXT RxContext)
 {
+    NTSTATUS status = STATUS_SUCCESS;
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    nfs41_updowncall_entry *entry = NULL;
+    __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
+    __notnull PNFS41_NETROOT_EXTENSION pNetRootContext =
+        NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+
     DbgP("nfs41_Flush: FileName='%wZ'\n",
         GET_ALREADY_PREFIXED_NAME_FROM_CONTEXT(RxContext));
 
-    return STATUS_SUCCESS;
+#ifdef NFS41_DRIVER_DAEMON_WRITE_BEHIND
+    if (nfs41_fcb->StandardInfo.Directory ||
+        !(SrvOpen->DesiredAccess & (FILE_WRITE_DATA|FILE_APPEND_DATA)))
+        goto out_nolock;
+
+    FsRtlEnterFileSystem();
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_FLUSH, &nfs41_fobx->sec_ctx,
+        pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
+        pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
+    if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+
+    status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        goto out;
+    }
+
+    if (entry->status)
+        status = map_readwrite_errors(entry->status);
+out:
+    if (entry) {
+        nfs41_UpcallDestroy(entry);
+    }
+    FsRtlExitFileSystem();
+out_nolock:
+#endif /* NFS41_DRIVER_DAEMON_WRITE_BEHIND */
+    return status;
 }
 
 NTSTATUS nfs41_DeallocateForFcb(
     IN OUT PMRX_FCB pFcb)
 {
     nfs41_remove_fcb_entry(pFcb);
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    nfs41_fcb_aclcache_invalidate(NFS41GetFcbExtension(pFcb));
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    {
+        PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(pFcb);
+
+        if (nfs41_fcb->utf8name) {
+            RxFreePool(nfs41_fcb->utf8name);
+            nfs41_fcb->utf8name = NULL;
+        }
+    }
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
     return STATUS_SUCCESS;
 }
 
@@ -878,11 +1598,16 @@ NTSTATUS nfs41_DeallocateForFobx(
 
     nfs41_invalidate_fobx_entry(pFobx);
     nfs41_remove_offloadcontext_for_fobx(pFobx);
+#ifdef NFS41_DRIVER_DIRQUERY_BUFFER
+    nfs41_dirbuf_free(nfs41_fobx);
+#endif /* NFS41_DRIVER_DIRQUERY_BUFFER */
 
+#ifndef NFS41_DRIVER_FCB_ACLCACHE
     if (nfs41_fobx->acl) {
-        RxFreePool(nfs41_fobx->acl);
+        nfs41_buffer_free(nfs41_fobx->acl, nfs41_fobx->acl_len);
         nfs41_fobx->acl = NULL;
     }
+#endif /* !NFS41_DRIVER_FCB_ACLCACHE */
 
     if (nfs41_fobx->sec_ctx.ClientToken) {
         SeDeleteClientSecurity(&nfs41_fobx->sec_ctx);
@@ -898,11 +1623,14 @@ VOID nfs41_update_fcb_list(
 {
     PLIST_ENTRY pEntry;
     nfs41_fcb_list_entry *cur;
-    ExAcquireFastMutexUnsafe(&openlist.lock);
-    pEntry = openlist.head.Flink;
-    while (!IsListEmpty(&openlist.head)) {
+    nfs41_fcb_list_bucket *bucket = nfs41_openlist_bucket(fcb);
+
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+    for (pEntry = bucket->head.Flink ;
+        pEntry != &bucket->head ;
+        pEntry = pEntry->Flink) {
         cur = (nfs41_fcb_list_entry *)CONTAINING_RECORD(pEntry,
-                nfs41_fcb_list_entry, next);
+                nfs41_fcb_list_entry, hash_next);
         if (cur->fcb == fcb &&
                 cur->ChangeTime != ChangeTime) {
 #if defined(DEBUG_FILE_SET) || defined(DEBUG_ACL_SET) || \
@@ -914,18 +1642,8 @@ VOID nfs41_update_fcb_list(
             cur->ChangeTime = ChangeTime;
             break;
         }
-        /* place an upcall for this srv_open */
-        if (pEntry->Flink == &openlist.head) {
-#if defined(DEBUG_FILE_SET) || defined(DEBUG_ACL_SET) || \
-    defined(DEBUG_WRITE) || defined(DEBUG_EA_SET)
-            DbgP("nfs41_update_fcb_list: reached EOL loooking for "
-                "fcb=0x%p\n", fcb);
-#endif
-            break;
-        }
-        pEntry = pEntry->Flink;
     }
-    ExReleaseFastMutexUnsafe(&openlist.lock);
+    ExReleaseFastMutexUnsafe(&bucket->lock);
 }
 
 NTSTATUS nfs41_IsValidDirectory (
@@ -958,6 +1676,15 @@ NTSTATUS nfs41_ComputeNewBufferingState(
             pSrvOpen->BufferingFlags &=
                 ~(FCB_STATE_WRITECACHING_ENABLED |
                   FCB_STATE_WRITEBUFFERING_ENABLED);
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+        /*
+         * While a push is pending |nfs41_lock_buffering_push()| turns
+         * lock buffering off itself, after it has sent the locks to
+         * the daemon
+         */
+        if (!NFS41GetFcbExtension(pSrvOpen->pFcb)->lock_push_pending)
+            pSrvOpen->BufferingFlags &= ~FCB_STATE_LOCK_BUFFERING_ENABLED;
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
         pSrvOpen->BufferingFlags |= FCB_STATE_DISABLE_LOCAL_BUFFERING;
         break;
     case ENABLE_READ_CACHING:
@@ -971,7 +1698,12 @@ NTSTATUS nfs41_ComputeNewBufferingState(
     case ENABLE_READWRITE_CACHING:
         pSrvOpen->BufferingFlags =
             (FCB_STATE_READBUFFERING_ENABLED | FCB_STATE_READCACHING_ENABLED |
-            FCB_STATE_WRITECACHING_ENABLED | FCB_STATE_WRITEBUFFERING_ENABLED);
+            FCB_STATE_WRITECACHING_ENABLED | FCB_STATE_WRITEBUFFERING_ENABLED
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+            /* Locally held locks are only pushed on recall */
+            | (pSrvOpen->BufferingFlags & FCB_STATE_LOCK_BUFFERING_ENABLED)
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
+            );
     }
 #ifdef DEBUG_TIME_BASED_COHERENCY
     DbgP("nfs41_ComputeNewBufferingState: '%wZ' pSrvOpen 0x%p Old %08x New %08x\n",
@@ -989,9 +1721,8 @@ void enable_caching(
     HANDLE session)
 {
     ULONG flag = 0;
-    PLIST_ENTRY pEntry;
+    nfs41_fcb_list_bucket *bucket;
     nfs41_fcb_list_entry *cur;
-    BOOLEAN found = FALSE;
 
     if (SrvOpen->DesiredAccess & FILE_READ_DATA)
         flag = ENABLE_READ_CACHING;
@@ -1013,47 +1744,52 @@ void enable_caching(
 
     RxChangeBufferingState((PSRV_OPEN)SrvOpen, ULongToPtr(flag), 1);
 
-    ExAcquireFastMutexUnsafe(&openlist.lock);
-    pEntry = openlist.head.Flink;
-    while (!IsListEmpty(&openlist.head)) {
-        cur = (nfs41_fcb_list_entry *)CONTAINING_RECORD(pEntry,
-                nfs41_fcb_list_entry, next);
-        if (cur->fcb == SrvOpen->pFcb) {
+    bucket = nfs41_openlist_bucket(SrvOpen->pFcb);
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+    cur = nfs41_openlist_find(bucket, SrvOpen->pFcb);
+    if (cur) {
 #ifdef DEBUG_TIME_BASED_COHERENCY
-            DbgP("enable_caching: Looked&Found match for fcb=0x%p '%wZ'\n",
-                SrvOpen->pFcb, SrvOpen->pAlreadyPrefixedName);
+        DbgP("enable_caching: Looked&Found match for fcb=0x%p '%wZ'\n",
+            SrvOpen->pFcb, SrvOpen->pAlreadyPrefixedName);
 #endif
-            cur->skip = FALSE;
-            found = TRUE;
-            break;
-        }
-        if (pEntry->Flink == &openlist.head) {
+        cur->skip = FALSE;
+    }
 #ifdef DEBUG_TIME_BASED_COHERENCY
-            DbgP("enable_caching: reached EOL looking for fcb=0x%p '%wZ'\n",
-                SrvOpen->pFcb, SrvOpen->pAlreadyPrefixedName);
-#endif
-            break;
-        }
-        pEntry = pEntry->Flink;
+    else {
+        DbgP("enable_caching: reached EOL looking for fcb=0x%p '%wZ'\n",
+            SrvOpen->pFcb, SrvOpen->pAlreadyPrefixedName);
     }
-    if (!found && nfs41_fobx->deleg_type) {
+#endif
+    ExReleaseFastMutexUnsafe(&bucket->lock);
+
+    if (!cur && nfs41_fobx->deleg_type) {
         nfs41_fcb_list_entry *oentry;
 #ifdef DEBUG_TIME_BASED_COHERENCY
         DbgP("enable_caching: delegation recalled: srv_open=0x%p\n", SrvOpen);
 #endif
         oentry = nfs41_allocate_nfs41_fcb_list_entry();
         if (oentry == NULL)
-            goto out_release_fcblistlock;
+            return;
         oentry->fcb = SrvOpen->pFcb;
         oentry->session = session;
         oentry->nfs41_fobx = nfs41_fobx;
         oentry->ChangeTime = ChangeTime;
         oentry->skip = FALSE;
-        InsertTailList(&openlist.head, &oentry->next);
+
+        ExAcquireFastMutexUnsafe(&openlist.lock);
+        /* Somebody else might have added the FCB in the meantime */
+        ExAcquireFastMutexUnsafe(&bucket->lock);
+        cur = nfs41_openlist_find(bucket, SrvOpen->pFcb);
+        if (cur)
+            cur->skip = FALSE;
+        ExReleaseFastMutexUnsafe(&bucket->lock);
+        if (cur == NULL)
+            nfs41_openlist_add_locked(oentry);
+        ExReleaseFastMutexUnsafe(&openlist.lock);
+        if (cur)
+            nfs41_free_nfs41_fcb_list_entry(oentry);
         nfs41_fobx->deleg_type = 0;
     }
-out_release_fcblistlock:
-    ExReleaseFastMutexUnsafe(&openlist.lock);
 }
 
 NTSTATUS nfs41_CompleteBufferingStateChangeRequest(
@@ -1185,12 +1921,18 @@ NTSTATUS nfs41_init_ops(void)
     nfs41_ops.MRxFlags = (RDBSS_MANAGE_NET_ROOT_EXTENSION |
                             RDBSS_MANAGE_V_NET_ROOT_EXTENSION |
                             RDBSS_MANAGE_FCB_EXTENSION |
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+                            RDBSS_MANAGE_SRV_OPEN_EXTENSION |
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
                             RDBSS_MANAGE_FOBX_EXTENSION);
 
     nfs41_ops.MRxSrvCallSize  = 0; // srvcall extension is not handled in rdbss
     nfs41_ops.MRxNetRootSize  = sizeof(NFS41_NETROOT_EXTENSION);
     nfs41_ops.MRxVNetRootSize = sizeof(NFS41_V_NET_ROOT_EXTENSION);
     nfs41_ops.MRxFcbSize      = sizeof(NFS41_FCB);
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+    nfs41_ops.MRxSrvOpenSize  = sizeof(NFS41_SRV_OPEN);
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
     nfs41_ops.MRxFobxSize     = sizeof(NFS41_FOBX);
 
     // Mini redirector cancel routine
@@ -1307,6 +2049,10 @@ NTSTATUS nfs41_init_ops(void)
         (PMRX_CALLDOWN)nfs41_FsCtl;
     nfs41_ops.MRxLowIOSubmit[LOWIO_OP_IOCTL]           =
         (PMRX_CALLDOWN)nfs41_IoCtl;
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+    nfs41_ops.MRxLowIOSubmit[LOWIO_OP_NOTIFY_CHANGE_DIRECTORY] =
+        (PMRX_CALLDOWN)nfs41_NotifyChangeDirectory;
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
 
     //
     // Miscellanous
@@ -1328,26 +2074,179 @@ NTSTATUS nfs41_init_ops(void)
     return(STATUS_SUCCESS);
 }
 
+/*
+ * Time-based coherency
+ *
+ * |fcbopen_main()| periodically checks the change attribute of all
+ * open files with |timebasedcoherency| enabled and invalidates the
+ * caches of files which were modified by another client.
+ * The files are checked in batches of up to |NFS41_COHERENCY_BATCH_MAX|
+ * open states per session and logon session (the upcall is sent with
+ * the token of the first one), which the daemon turns into one compound
+ * (or a few if the server's |ca_maxoperations| is small) instead of
+ * one upcall and one compound per file.
+ * The polling interval adapts between |NFS41_COHERENCY_INTERVAL_MIN|
+ * and |NFS41_COHERENCY_INTERVAL_MAX| seconds: it is halved when a
+ * change was found and doubled when nothing changed.
+ */
+#define NFS41_COHERENCY_INTERVAL_MIN 5
+#define NFS41_COHERENCY_INTERVAL_MAX 60
+#define NFS41_COHERENCY_INTERVAL_INITIAL 30
+
+typedef struct _nfs41_coherency_batch {
+    ULONG count;
+    /* logon session of |entries[0]|'s token */
+    LUID authentication_id;
+    nfs41_fcb_list_entry *entries[NFS41_COHERENCY_BATCH_MAX];
+    HANDLE open_states[NFS41_COHERENCY_BATCH_MAX];
+    ULONGLONG changeattrs[NFS41_COHERENCY_BATCH_MAX];
+    DWORD statuses[NFS41_COHERENCY_BATCH_MAX];
+} nfs41_coherency_batch;
+
+/* Only used by the |fcbopen_main()| thread */
+static nfs41_coherency_batch coherency_batch;
+
+static void fcbopen_invalidate(
+    nfs41_fcb_list_entry *cur,
+    ULONGLONG new_changeattr)
+{
+    ULONG flag = DISABLE_CACHING;
+    PMRX_SRV_OPEN srv_open;
+    PLIST_ENTRY psrvEntry;
+    nfs41_fcb_list_bucket *bucket = nfs41_openlist_bucket(cur->fcb);
+
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+#ifdef DEBUG_TIME_BASED_COHERENCY
+    DbgP("fcbopen_main: old ctime=%llu new_ctime=%llu\n",
+        cur->ChangeTime, new_changeattr);
+#endif
+    cur->ChangeTime = new_changeattr;
+    cur->skip = TRUE;
+    ExReleaseFastMutexUnsafe(&bucket->lock);
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+    nfs41_fcb_attrcache_invalidate(NFS41GetFcbExtension(cur->fcb));
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    nfs41_fcb_aclcache_invalidate(NFS41GetFcbExtension(cur->fcb));
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+    psrvEntry = &cur->fcb->SrvOpenList;
+    psrvEntry = psrvEntry->Flink;
+    while (!IsListEmpty(&cur->fcb->SrvOpenList)) {
+        srv_open = (PMRX_SRV_OPEN)CONTAINING_RECORD(psrvEntry,
+                MRX_SRV_OPEN, SrvOpenQLinks);
+        if (srv_open->DesiredAccess &
+                (FILE_READ_DATA | FILE_WRITE_DATA | FILE_APPEND_DATA)) {
+#ifdef DEBUG_TIME_BASED_COHERENCY
+            DbgP("fcbopen_main: ************ Invalidate the cache '%wZ'"
+                 "************\n", srv_open->pAlreadyPrefixedName);
+#endif
+            RxIndicateChangeOfBufferingStateForSrvOpen(
+                cur->fcb->pNetRoot->pSrvCall, srv_open,
+                srv_open->Key, ULongToPtr(flag));
+        }
+        if (psrvEntry->Flink == &cur->fcb->SrvOpenList) {
+#ifdef DEBUG_TIME_BASED_COHERENCY
+            DbgP("fcbopen_main: reached end of srvopen for fcb 0x%p\n",
+                cur->fcb);
+#endif
+            break;
+        }
+        psrvEntry = psrvEntry->Flink;
+    };
+}
+
+/*
+ * Send one |NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH| upcall for all
+ * entries in |batch| and return the number of changed files.
+ * Must be called with |openlist.lock| held, which keeps the daemon's
+ * open states alive because |nfs41_remove_fcb_entry()| runs before
+ * the |NFS41_SYSOP_CLOSE| upcall.
+ */
+static ULONG fcbopen_send_batch(
+    nfs41_coherency_batch *batch)
+{
+    NTSTATUS status;
+    nfs41_updowncall_entry *entry = NULL;
+    nfs41_fcb_list_entry *first = batch->entries[0];
+    nfs41_fcb_list_entry *cur;
+    nfs41_fcb_list_bucket *bucket;
+    PNFS41_NETROOT_EXTENSION pNetRootContext;
+    ULONG i, changed = 0;
+    BOOLEAN fcb_changed;
+
+    if (batch->count == 0)
+        goto out;
+
+    pNetRootContext = NFS41GetNetRootExtension(first->fcb->pNetRoot);
+    status = nfs41_UpcallCreate(NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH,
+        &first->nfs41_fobx->sec_ctx, first->session,
+        first->nfs41_fobx->nfs41_open_state,
+        pNetRootContext->nfs41d_version, NULL, &entry);
+    if (status) goto out;
+
+    entry->u.CoherencyBatch.count = batch->count;
+    entry->u.CoherencyBatch.open_states = batch->open_states;
+    entry->u.CoherencyBatch.changeattrs = batch->changeattrs;
+    entry->u.CoherencyBatch.statuses = batch->statuses;
+
+    status = nfs41_UpcallWaitForReply(entry, UPCALL_TIMEOUT_DEFAULT);
+    if (status) {
+        /* Timed-out upcalls are freed by the downcall */
+        entry = NULL;
+        goto out;
+    }
+    if (entry->status)
+        goto out;
+
+    for (i = 0 ; i < batch->count ; i++) {
+        cur = batch->entries[i];
+        if (batch->statuses[i]) {
+#ifdef DEBUG_TIME_BASED_COHERENCY
+            DbgP("fcbopen_main: fcb=0x%p status=%ld\n",
+                cur->fcb, (long)batch->statuses[i]);
+#endif
+            continue;
+        }
+        bucket = nfs41_openlist_bucket(cur->fcb);
+        ExAcquireFastMutexUnsafe(&bucket->lock);
+        fcb_changed = (cur->ChangeTime != batch->changeattrs[i]);
+        ExReleaseFastMutexUnsafe(&bucket->lock);
+        if (fcb_changed) {
+            fcbopen_invalidate(cur, batch->changeattrs[i]);
+            changed++;
+        }
+        NFS41GetFcbExtension(cur->fcb)->changeattr = batch->changeattrs[i];
+    }
+out:
+    if (entry)
+        nfs41_UpcallDestroy(entry);
+    batch->count = 0;
+    return changed;
+}
+
 KSTART_ROUTINE fcbopen_main;
 
 VOID fcbopen_main(PVOID ctx)
 {
     NTSTATUS status;
     LARGE_INTEGER timeout;
+    LONGLONG interval = NFS41_COHERENCY_INTERVAL_INITIAL;
+    nfs41_coherency_batch *batch = &coherency_batch;
 
 //    DbgEn();
-    timeout.QuadPart = RELATIVE(SECONDS(30));
     while(1) {
         PLIST_ENTRY pEntry;
         nfs41_fcb_list_entry *cur;
+        LUID authentication_id;
+        ULONG changed = 0;
+
+        timeout.QuadPart = RELATIVE(SECONDS(interval));
         status = KeDelayExecutionThread(KernelMode, TRUE, &timeout);
         ExAcquireFastMutexUnsafe(&openlist.lock);
-        pEntry = openlist.head.Flink;
-        while (!IsListEmpty(&openlist.head)) {
-            PNFS41_NETROOT_EXTENSION pNetRootContext;
-            nfs41_updowncall_entry *entry = NULL;
-            FILE_BASIC_INFORMATION binfo;
-            PNFS41_FCB nfs41_fcb;
+        batch->count = 0;
+        for (pEntry = openlist.head.Flink ;
+            pEntry != &openlist.head ;
+            pEntry = pEntry->Flink) {
             cur = (nfs41_fcb_list_entry *)CONTAINING_RECORD(pEntry,
                     nfs41_fcb_list_entry, next);
 
@@ -1356,89 +2255,66 @@ VOID fcbopen_main(PVOID ctx)
                 "change_time=%llu skipping=%d\n", cur->fcb,
                 cur->ChangeTime, cur->skip);
 #endif
-            if (cur->skip) goto out;
+            /*
+             * Read without the bucket lock, a stale value only
+             * shifts the check by one interval
+             */
+            if (cur->skip)
+                continue;
 
             /*
              * This can only happen if |nfs41_DeallocateForFobx()|
              * was called
              */
             if ((!cur->nfs41_fobx) || (!cur->nfs41_fobx->sec_ctx.ClientToken))
-                goto out;
+                continue;
 
             if (!cur->nfs41_fobx->timebasedcoherency) {
 #ifdef DEBUG_TIME_BASED_COHERENCY
                 DbgP("fcbopen_main: timebasedcoherency disabled for "
                     "fcb=0x%p, nfs41_fobx=0x%p\n", cur->fcb, cur->nfs41_fobx);
 #endif
-                goto out;
+                continue;
             }
 
-            pNetRootContext =
-                NFS41GetNetRootExtension(cur->fcb->pNetRoot);
-            /* place an upcall for this srv_open */
-            status = nfs41_UpcallCreate(
-                NFS41_SYSOP_FILE_QUERY_TIME_BASED_COHERENCY,
-                &cur->nfs41_fobx->sec_ctx, cur->session,
-                cur->nfs41_fobx->nfs41_open_state,
-                pNetRootContext->nfs41d_version, NULL, &entry);
-            if (status) goto out;
-
-            entry->u.QueryFile.InfoClass = FileBasicInformation;
-            entry->u.QueryFile.buf = &binfo;
-            entry->u.QueryFile.buf_len = sizeof(binfo);
-
-            status = nfs41_UpcallWaitForReply(entry, UPCALL_TIMEOUT_DEFAULT);
-            if (status) goto out;
-
-            if (cur->ChangeTime != entry->ChangeTime) {
-                ULONG flag = DISABLE_CACHING;
-                PMRX_SRV_OPEN srv_open;
-                PLIST_ENTRY psrvEntry;
-#ifdef DEBUG_TIME_BASED_COHERENCY
-                DbgP("fcbopen_main: old ctime=%llu new_ctime=%llu\n",
-                    cur->ChangeTime, entry->ChangeTime);
-#endif
-                cur->ChangeTime = entry->ChangeTime;
-                cur->skip = TRUE;
-                psrvEntry = &cur->fcb->SrvOpenList;
-                psrvEntry = psrvEntry->Flink;
-                while (!IsListEmpty(&cur->fcb->SrvOpenList)) {
-                    srv_open = (PMRX_SRV_OPEN)CONTAINING_RECORD(psrvEntry,
-                            MRX_SRV_OPEN, SrvOpenQLinks);
-                    if (srv_open->DesiredAccess &
-                            (FILE_READ_DATA | FILE_WRITE_DATA | FILE_APPEND_DATA)) {
-#ifdef DEBUG_TIME_BASED_COHERENCY
-                        DbgP("fcbopen_main: ************ Invalidate the cache '%wZ'"
-                             "************\n", srv_open->pAlreadyPrefixedName);
-#endif
-                        RxIndicateChangeOfBufferingStateForSrvOpen(
-                            cur->fcb->pNetRoot->pSrvCall, srv_open,
-                            srv_open->Key, ULongToPtr(flag));
-                    }
-                    if (psrvEntry->Flink == &cur->fcb->SrvOpenList) {
-#ifdef DEBUG_TIME_BASED_COHERENCY
-                        DbgP("fcbopen_main: reached end of srvopen for fcb 0x%p\n",
-                            cur->fcb);
-#endif
-                        break;
-                    }
-                    psrvEntry = psrvEntry->Flink;
-                };
-            }
-            nfs41_fcb = NFS41GetFcbExtension(cur->fcb);
-            nfs41_fcb->changeattr = entry->ChangeTime;
-out:
-            nfs41_UpcallDestroy(entry);
-            entry = NULL;
-            if (pEntry->Flink == &openlist.head) {
-#ifdef DEBUG_TIME_BASED_COHERENCY
-                DbgP("fcbopen_main: reached end of the fcb list\n");
-#endif
-                break;
+            if (!NT_SUCCESS(SeQueryAuthenticationIdToken(
+                cur->nfs41_fobx->sec_ctx.ClientToken, &authentication_id)))
+                continue;
+
+            /*
+             * One batch can only contain open states of one session,
+             * and of one logon session, as the daemon checks all of
+             * them with the credentials of the first one
+             */
+            if ((batch->count == NFS41_COHERENCY_BATCH_MAX) ||
+                ((batch->count > 0) &&
+                    ((batch->entries[0]->session != cur->session) ||
+                    (!RtlEqualLuid(&batch->authentication_id,
+                        &authentication_id))))) {
+                changed += fcbopen_send_batch(batch);
             }
-            pEntry = pEntry->Flink;
+
+            if (batch->count == 0)
+                batch->authentication_id = authentication_id;
+
+            batch->entries[batch->count] = cur;
+            batch->open_states[batch->count] =
+                cur->nfs41_fobx->nfs41_open_state;
+            batch->count++;
         }
+        changed += fcbopen_send_batch(batch);
         ExReleaseFastMutexUnsafe(&openlist.lock);
+
+        if (changed) {
+            interval = max(interval / 2, NFS41_COHERENCY_INTERVAL_MIN);
+        }
+        else {
+            interval = min(interval * 2, NFS41_COHERENCY_INTERVAL_MAX);
+        }
+#ifdef DEBUG_TIME_BASED_COHERENCY
+        DbgP("fcbopen_main: changed=%ld, next check in %lld seconds\n",
+            (long)changed, (long long)interval);
+#endif
     }
 //    DbgEx();
 }
@@ -1503,13 +2379,17 @@ NTSTATUS DriverEntry(
     }
 
     KeInitializeEvent(&upcallEvent, SynchronizationEvent, FALSE );
-    ExInitializeFastMutex(&upcalllist.lock);
-    ExInitializeFastMutex(&downcalllist.lock);
-    ExInitializeFastMutex(&openlist.lock);
+    nfs41_upcalllist_init();
+    nfs41_openlist_init();
     ExInitializeFastMutex(&offloadcontextlist.lock);
-    InitializeListHead(&upcalllist.head);
-    InitializeListHead(&downcalllist.head);
-    InitializeListHead(&openlist.head);
+    nfs41_downcalllist_init();
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+    nfs41_dirnotify_init();
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
+    nfs41_op_stats_init();
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+    (void)TraceLoggingRegister(nfs41_trace_provider);
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
     InitializeListHead(&offloadcontextlist.head);
 #ifdef USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM
     /*
@@ -1517,10 +2397,17 @@ NTSTATUS DriverEntry(
      * otherwise we could use |MmQuerySystemSize()| to scale the
      * lookasidelists
      */
-    ExInitializeNPagedLookasideList(
-        &updowncall_entry_upcall_lookasidelist, NULL, NULL,
-        POOL_NX_ALLOCATION, sizeof(nfs41_updowncall_entry),
-        NFS41_MM_POOLTAG_UP, 0);
+    /*
+     * One lookasidelist per upcall queue, so that entries are recycled
+     * on the NUMA node which allocated them (nonpaged pool allocations
+     * are served from the current node)
+     */
+    for (i = 0; i < upcalllist.num_queues; i++) {
+        ExInitializeNPagedLookasideList(
+            &updowncall_entry_upcall_lookasidelist[i], NULL, NULL,
+            POOL_NX_ALLOCATION, sizeof(nfs41_updowncall_entry),
+            NFS41_MM_POOLTAG_UP, 0);
+    }
 #ifndef USE_STACK_FOR_DOWNCALL_UPDOWNCALLENTRY_MEM
     ExInitializeNPagedLookasideList(
         &updowncall_entry_downcall_lookasidelist, NULL, NULL,
@@ -1539,6 +2426,7 @@ NTSTATUS DriverEntry(
         POOL_NX_ALLOCATION, sizeof(nfs41_fcb_list_entry),
         NFS41_MM_POOLTAG_OPEN, 0);
 #endif /* USE_LOOKASIDELISTS_FOR_FCBLISTENTRY_MEM */
+    nfs41_buffer_lookasidelists_init();
     InitializeObjectAttributes(&oattrs, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
     status = PsCreateSystemThread(&dev_exts->openlistHandle, mask,
         &oattrs, NULL, NULL, &fcbopen_main, NULL);
@@ -1550,11 +2438,40 @@ NTSTATUS DriverEntry(
     for (i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++)
         drv->MajorFunction[i] = (PDRIVER_DISPATCH)nfs41_FsdDispatch;
 
+#if defined(NFS41_DRIVER_FASTIO_QUERYINFO) || \
+    defined(NFS41_DRIVER_FASTIO_QUERYOPEN)
+    /*
+     * Keep the RDBSS fast I/O callbacks (|FastIoRead|/|FastIoWrite|
+     * serve cached I/O from the cache manager), and add our own
+     * attribute queries
+     */
+    if (drv->FastIoDispatch) {
+        RtlCopyMemory(&nfs41_FastIoDispatch, drv->FastIoDispatch,
+            min(sizeof(FAST_IO_DISPATCH),
+                drv->FastIoDispatch->SizeOfFastIoDispatch));
+        nfs41_FastIoDispatch.SizeOfFastIoDispatch = sizeof(FAST_IO_DISPATCH);
+#ifdef NFS41_DRIVER_FASTIO_QUERYINFO
+        nfs41_FastIoDispatch.FastIoQueryBasicInfo =
+            nfs41_FastIoQueryBasicInfo;
+        nfs41_FastIoDispatch.FastIoQueryStandardInfo =
+            nfs41_FastIoQueryStandardInfo;
+#endif /* NFS41_DRIVER_FASTIO_QUERYINFO */
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+        nfs41_FastIoDispatch.FastIoQueryOpen = nfs41_FastIoQueryOpen;
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+        drv->FastIoDispatch = &nfs41_FastIoDispatch;
+    }
+#endif /* NFS41_DRIVER_FASTIO_QUERYINFO || NFS41_DRIVER_FASTIO_QUERYOPEN */
+
     RtlTimeFieldsToTime(&jan_1_1970, &unix_time_diff);
 
 out_unregister:
-    if (status != STATUS_SUCCESS)
+    if (status != STATUS_SUCCESS) {
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+        TraceLoggingUnregister(nfs41_trace_provider);
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
         RxUnregisterMinirdr(nfs41_dev);
+    }
 out:
     DbgEx();
     return status;
@@ -1591,6 +2508,11 @@ unload:
             "could not delete pipe symbolic link\n");
     }
     RxUnload(drv);
+    nfs41_buffer_lookasidelists_delete();
+
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+    TraceLoggingUnregister(nfs41_trace_provider);
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
 
     DbgP("nfs41_driver_unload: driver unloaded 0x%p\n", drv);
     DbgR();
@@ -34,6 +34,14 @@
 
 #include "nfs_ea.h"
 
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+#include <TraceLoggingProvider.h>
+
+/* ETW TraceLogging provider "NFS41-Client-Driver" */
+TRACELOGGING_DECLARE_PROVIDER(nfs41_trace_provider);
+#define NFS41_TRACE_KEYWORD_UPCALL 0x1ULL
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
+
 #if (NTDDI_VERSION >= NTDDI_WIN10_VB)
 #define EXALLOCATEPOOLWITHTAG_DEPRECATED 1
 #endif /* (NTDDI_VERSION >= NTDDI_WIN10_VB) */
@@ -106,6 +114,8 @@ typedef struct __nfs41_timings {
 #define NFS41_MM_POOLTAG_OPEN   ('open')
 #define NFS41_MM_POOLTAG_UP     ('upca')
 #define NFS41_MM_POOLTAG_DOWN   ('down')
+#define NFS41_MM_POOLTAG_DIR    ('dirb')
+#define NFS41_MM_POOLTAG_BUF    ('bufs')
 
 
 DECLARE_EXTERN_DECLARE_CONST_UNICODE_STRING(AUTH_NONE_NAME);
@@ -121,8 +131,12 @@ DECLARE_EXTERN_CONST_ANSI_STRING(NfsV3Attributes);
 DECLARE_EXTERN_CONST_ANSI_STRING(NfsSymlinkTargetName);
 DECLARE_EXTERN_CONST_ANSI_STRING(NfsActOnLink);
 
+/* Max. number of NUMA nodes with their own upcall queue */
+#define NFS41_UPCALL_MAX_NODES (64)
+
 #ifdef USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM
-extern NPAGED_LOOKASIDE_LIST updowncall_entry_upcall_lookasidelist;
+extern NPAGED_LOOKASIDE_LIST
+    updowncall_entry_upcall_lookasidelist[NFS41_UPCALL_MAX_NODES];
 #ifndef USE_STACK_FOR_DOWNCALL_UPDOWNCALLENTRY_MEM
 extern NPAGED_LOOKASIDE_LIST updowncall_entry_downcall_lookasidelist;
 #endif /* !USE_STACK_FOR_DOWNCALL_UPDOWNCALLENTRY_MEM */
@@ -130,6 +144,15 @@ extern NPAGED_LOOKASIDE_LIST updowncall_entry_downcall_lookasidelist;
 #ifdef USE_LOOKASIDELISTS_FOR_FCBLISTENTRY_MEM
 extern NPAGED_LOOKASIDE_LIST fcblistentry_lookasidelist;
 #endif /* USE_LOOKASIDELISTS_FOR_FCBLISTENTRY_MEM */
+#ifdef USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS
+/*
+ * Size classes for |nfs41_buffer_allocate()|, the largest one is
+ * |NFS41_DIRQUERY_BUFFER_SIZE| for |nfs41_fobx->dirbuf|
+ */
+#define NFS41_BUFFER_NUM_CLASSES (3)
+extern NPAGED_LOOKASIDE_LIST
+    buffer_lookasidelist[NFS41_BUFFER_NUM_CLASSES];
+#endif /* USE_LOOKASIDELISTS_FOR_TRANSIENT_BUFFERS */
 
 #ifdef ENABLE_TIMINGS
 extern nfs41_timings lookup;
@@ -162,6 +185,22 @@ typedef enum _nfs41_updowncall_state {
     NFS41_NOT_WAITING
 } nfs41_updowncall_state;
 
+/*
+ * Upcall priority classes, each |nfs41_upcall_queue| has one FIFO per
+ * class, see |nfs41_upcalllist_remove_next()|
+ */
+typedef enum _nfs41_upcall_prio {
+    /* OPEN, CLOSE, directory queries, attributes, locks etc. */
+    NFS41_UPCALL_PRIO_METADATA = 0,
+    /* synchronous, non-paging READ/WRITE */
+    NFS41_UPCALL_PRIO_SYNC_IO,
+    /* paging and asynchronous READ/WRITE */
+    NFS41_UPCALL_PRIO_BULK_IO,
+    /* cache coherency checks */
+    NFS41_UPCALL_PRIO_BACKGROUND,
+    NFS41_UPCALL_PRIO_NUM
+} nfs41_upcall_prio;
+
 typedef struct _updowncall_entry {
     DWORD version;
     LONGLONG xid;
@@ -175,6 +214,15 @@ typedef struct _updowncall_entry {
 #undef errno
     DWORD errno;
     BOOLEAN async_op;
+    /*
+     * Set by the caller for READ/WRITE, derived from |opcode| for
+     * everything else
+     */
+    nfs41_upcall_prio prio;
+    /* |upcalllist.queues| index the entry was queued on */
+    ULONG queue;
+    /* lookasidelist the entry was allocated from */
+    ULONG alloc_queue;
     SECURITY_CLIENT_CONTEXT sec_ctx;
     PSECURITY_CLIENT_CONTEXT psec_ctx;
     /*
@@ -186,11 +234,43 @@ typedef struct _updowncall_entry {
     HANDLE open_state;
     HANDLE session;
     PUNICODE_STRING filename;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    /*
+     * UTF-8 form of |filename| from the FCB, or |NULL|, see
+     * |nfs41_UpcallSetFcbFilename()|
+     */
+    const struct _nfs41_utf8name *filename_utf8;
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
     ULONGLONG ChangeTime;
+    /*
+     * |KeQueryPerformanceCounter()| when the upcall was created, queued
+     * and read by the daemon, for |IOCTL_NFS41_GET_OP_STATS|
+     */
+    LONGLONG create_ticks;
+    LONGLONG queue_ticks;
+    LONGLONG read_ticks;
+    /*
+     * Per-NetRoot statistics the upcall is counted for, set by the
+     * caller, can be |NULL|
+     */
+    NFS41_NETROOT_STATS *netroot_stats;
     union {
         struct {
             LONG debuglevel;
         } SetDaemonDebugLevel;
+        struct {
+            NFS41_DAEMON_OP_STATS *stats;
+        } GetDaemonStats;
+        struct {
+            NFS41_FLIGHT_RECORDER *recorder;
+        } GetFlightRecorder;
+        struct {
+            NFS41_MOUNT_STATS *stats;
+        } GetMountStats;
+        struct {
+            NFS41_TOP_STATS *stats;
+            ULONGLONG root;
+        } GetTopStats;
         struct {
             PUNICODE_STRING srv_name; /* hostname, or hostname@port */
             PUNICODE_STRING root;
@@ -201,6 +281,22 @@ typedef struct _updowncall_entry {
             DWORD lease_time;
             DWORD use_nfspubfh;
             DWORD nfsvers;
+            DWORD nconnect;
+            DWORD acregmin;
+            DWORD acregmax;
+            DWORD acdirmin;
+            DWORD acdirmax;
+            DWORD namecachesize;
+            DWORD closetimeo;
+            DWORD sparsewrite;
+            DWORD sockbuf;
+            DWORD keepalive;
+            DWORD sockflags;
+            DWORD fsc;
+            DWORD maxbw;
+            DWORD maxiops;
+            DWORD autotune;
+            DWORD immutable;
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
             tristate_bool force_case_preserving;
             tristate_bool force_case_insensitive;
@@ -212,6 +308,17 @@ typedef struct _updowncall_entry {
             PVOID buf;
             ULONG buf_len;
             PRX_CONTEXT rxcontext;
+            ULONG flags; /* |NFS41_RW_FLAG_*| */
+#ifdef NFS41_DRIVER_INLINE_RW
+            /* data is passed in the upcall/downcall buffer */
+            BOOLEAN inline_data;
+#endif /* NFS41_DRIVER_INLINE_RW */
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+            /* |buf| is slot |pool_slot| of the daemon's I/O pool */
+            BOOLEAN pool_buf;
+            ULONG pool_slot;
+            LONG pool_generation;
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
         } ReadWrite;
         struct {
             LONGLONG offset;
@@ -249,11 +356,20 @@ typedef struct _updowncall_entry {
             nfs41_sysop_open_symlinktarget_type symlinktarget_type;
             PMDL EaMdl;
             PVOID EaBuffer;
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+            ULONGLONG open_fileid;
+            UNICODE_STRING fileid_dirname;
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
         } Open;
         struct {
             HANDLE srv_open;
             BOOLEAN remove;
             BOOLEAN renamed;
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+            ULONG setattr_flags;
+            FILE_BASIC_INFORMATION basic_info;
+            LARGE_INTEGER eof;
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
         } Close;
         struct {
             PUNICODE_STRING filter;
@@ -263,9 +379,20 @@ typedef struct _updowncall_entry {
             BOOLEAN initial_query;
             PMDL mdl;
             PVOID mdl_buf;
+            /*
+             * Kernel buffer behind |mdl| for |NFS41_DRIVER_DIRQUERY_BUFFER|,
+             * |NULL| if |mdl| describes locked caller pages
+             */
+            PVOID kbuf;
             PVOID buf;
             ULONG buf_len;
         } QueryFile;
+        struct {
+            ULONG count;
+            HANDLE *open_states;
+            ULONGLONG *changeattrs;
+            DWORD *statuses;
+        } CoherencyBatch;
         struct {
             FILE_INFORMATION_CLASS InfoClass;
             PVOID buf;
@@ -310,6 +437,16 @@ typedef struct _updowncall_entry {
         struct {
             FILE_ZERO_DATA_INFORMATION setzerodata;
         } SetZeroData;
+        struct {
+            BOOLEAN watch_tree;
+            ULONG filter;
+        } DirNotify;
+        struct {
+            FILE_NETWORK_OPEN_INFORMATION info;
+        } QueryOpen;
+        struct {
+            ULONG op; /* |NFS41_CACHE_CONTROL_*| */
+        } CacheControl;
         struct {
             void        *src_state;
             LONGLONG    srcfileoffset;
@@ -320,20 +457,117 @@ typedef struct _updowncall_entry {
 
 } nfs41_updowncall_entry;
 
-typedef struct _updowncall_list {
+/*
+ * Upcall queues
+ *
+ * With |NFS41_DRIVER_NUMA_UPCALL_QUEUES| |upcalllist| has one
+ * |nfs41_upcall_queue| per NUMA node (up to |NFS41_UPCALL_MAX_NODES|,
+ * nodes beyond share queues). Upcalls are queued on the node of the
+ * processor which issued them, daemon threads take upcalls from the
+ * queue of their own node first and steal from the other queues if
+ * that is empty. See |nfs41_upcalllist_add()| and
+ * |nfs41_upcalllist_remove_next()|.
+ */
+typedef struct DECLSPEC_CACHEALIGN _nfs41_upcall_queue {
     FAST_MUTEX lock;
-    LIST_ENTRY head;
+    LIST_ENTRY head[NFS41_UPCALL_PRIO_NUM];
+    /* dequeues left for each class in this round, protected by |lock| */
+    LONG credits[NFS41_UPCALL_PRIO_NUM];
+    /* number of queued entries, read without |lock| to skip empty queues */
+    volatile LONG count;
+    /* number of daemon threads of this node waiting for |event| */
+    volatile LONG waiters;
+    KEVENT event;
+} nfs41_upcall_queue;
+
+typedef struct _updowncall_list {
+    nfs41_upcall_queue queues[NFS41_UPCALL_MAX_NODES];
+    ULONG num_queues;
+    /* upcalls taken from the queue of another node */
+    volatile LONG steals;
+    /*
+     * statistics, see |nfs41_upcalllist_add()| and
+     * |nfs41_upcalllist_removed()|
+     */
+    volatile LONG depth;
+    volatile LONG max_depth;
+    volatile LONG depth_by_op[NFS41_SYSOP_INVALID_OPCODE1];
+    volatile LONG max_depth_by_op[NFS41_SYSOP_INVALID_OPCODE1];
 } nfs41_updowncall_list;
 extern nfs41_updowncall_list upcalllist;
-extern nfs41_updowncall_list downcalllist;
+
+/*
+ * |downcalllist| - hash table of all |nfs41_updowncall_entry| which
+ * have been passed to the daemon and wait for a downcall.
+ *
+ * The xids are allocated sequentially (see |nfs41_UpcallCreate()|),
+ * so we can just use the lower bits of the xid as hash value, which
+ * distributes the entries evenly across all buckets.
+ * Each bucket has its own lock, so the completion of a request only
+ * contends with requests in the same bucket.
+ * |NFS41_DOWNCALLLIST_NUM_BUCKETS| must be a power of two!
+ */
+#define NFS41_DOWNCALLLIST_NUM_BUCKETS (256)
+
+typedef struct _nfs41_downcall_bucket {
+    FAST_MUTEX lock;
+    LIST_ENTRY head;
+    LONG count;
+} nfs41_downcall_bucket;
+
+typedef struct _nfs41_downcall_hashtable {
+    nfs41_downcall_bucket buckets[NFS41_DOWNCALLLIST_NUM_BUCKETS];
+    /* statistics */
+    volatile LONG inflight;
+    volatile LONG max_inflight;
+    volatile LONG max_chain_len;
+    volatile LONG max_scan_len;
+} nfs41_downcall_hashtable;
+extern nfs41_downcall_hashtable downcalllist;
+
+#define NFS41_DOWNCALLLIST_BUCKET(xid) \
+    (&downcalllist.buckets[((ULONGLONG)(xid)) & \
+        (NFS41_DOWNCALLLIST_NUM_BUCKETS-1)])
 
 
 #define SERVER_NAME_BUFFER_SIZE         1024
 #define MOUNT_CONFIG_RW_SIZE_MIN        8192
 #define MOUNT_CONFIG_RW_SIZE_DEFAULT    (4*1024*1024)
 #define MOUNT_CONFIG_RW_SIZE_MAX        (16*1024*1024)
+#define MOUNT_CONFIG_NCONNECT_DEFAULT   1
+#define MOUNT_CONFIG_NCONNECT_MAX       16
 #define MAX_SEC_FLAVOR_LEN              12
 #define UPCALL_TIMEOUT_DEFAULT          50  /* in seconds */
+#define MOUNT_CONFIG_VOLCACHETTL_DEFAULT 5  /* in seconds */
+#define MOUNT_CONFIG_VOLCACHETTL_MAX    3600
+#define MOUNT_CONFIG_ACLCACHETTL_DEFAULT 5  /* in seconds */
+#define MOUNT_CONFIG_ACLCACHETTL_MAX    3600
+/* daemon name/attribute cache timeouts, in seconds */
+#define MOUNT_CONFIG_ACREGMIN_DEFAULT   30
+#define MOUNT_CONFIG_ACREGMAX_DEFAULT   60
+#define MOUNT_CONFIG_ACDIRMIN_DEFAULT   30
+#define MOUNT_CONFIG_ACDIRMAX_DEFAULT   60
+#define MOUNT_CONFIG_ACTIMEO_MAX        3600
+/* daemon name/attribute cache size, in megabytes */
+#define MOUNT_CONFIG_NAMECACHESIZE_DEFAULT 32
+#define MOUNT_CONFIG_NAMECACHESIZE_MAX  1024
+/* daemon deferred CLOSE timeout, in seconds */
+#define MOUNT_CONFIG_CLOSETIMEO_DEFAULT 1
+#define MOUNT_CONFIG_CLOSETIMEO_MAX     60
+/* socket buffer size in kilobytes, 0 = Windows autotuning */
+#define MOUNT_CONFIG_SOCKBUF_MAX        (64*1024)
+/* TCP keepalive idle time in seconds, 0 = disabled */
+#define MOUNT_CONFIG_KEEPALIVE_MAX      7200
+/* Cache Manager read-ahead granularity in kilobytes, 0 = default */
+#define MOUNT_CONFIG_READAHEAD_MAX      (64*1024)
+/* per-file dirty data before writers are throttled, in kilobytes */
+#define MOUNT_CONFIG_WRITEBEHIND_MAX    (1024*1024)
+/* bandwidth limit in kilobytes per second, 0 = no limit */
+#define MOUNT_CONFIG_MAXBW_MAX          (16*1024*1024)
+/* READ/WRITE requests per second, 0 = no limit */
+#define MOUNT_CONFIG_MAXIOPS_MAX        (1024*1024)
+/* offset/length alignment for direct I/O, see |NFS41_DRIVER_DIRECT_IO| */
+#define NFS41_DIRECT_IO_ALIGNMENT       512
 
 typedef struct _NFS41_MOUNT_CREATEMODE {
     BOOLEAN use_nfsv3attrsea_mode;
@@ -343,12 +577,21 @@ typedef struct _NFS41_MOUNT_CREATEMODE {
 typedef struct _NFS41_MOUNT_CONFIG {
     BOOLEAN use_nfspubfh;
     DWORD nfsvers;
+    DWORD nconnect;
     DWORD ReadSize;
     DWORD WriteSize;
     BOOLEAN ReadOnly;
     BOOLEAN write_thru;
     BOOLEAN nocache;
     BOOLEAN timebasedcoherency;
+    BOOLEAN sparsewrite;
+    BOOLEAN fsc;
+    BOOLEAN autotune;
+    BOOLEAN nocto;
+    BOOLEAN immutable;
+    BOOLEAN nodelay;
+    BOOLEAN loopbackfastpath;
+    BOOLEAN rssaffinity;
     WCHAR srv_buffer[SERVER_NAME_BUFFER_SIZE];
     UNICODE_STRING SrvName; /* hostname, or hostname@port */
     WCHAR mntpt_buffer[NFS41_SYS_MAX_PATH_LEN];
@@ -356,6 +599,20 @@ typedef struct _NFS41_MOUNT_CONFIG {
     WCHAR sec_flavor_buffer[MAX_SEC_FLAVOR_LEN];
     UNICODE_STRING SecFlavor;
     DWORD timeout;
+    DWORD volcachettl;
+    DWORD aclcachettl;
+    DWORD acregmin;
+    DWORD acregmax;
+    DWORD acdirmin;
+    DWORD acdirmax;
+    DWORD namecachesize;
+    DWORD closetimeo;
+    DWORD sockbuf;
+    DWORD keepalive;
+    DWORD readahead; /* in kilobytes, 0 = default */
+    DWORD writebehind; /* in kilobytes, 0 = no per-file limit */
+    DWORD maxbw; /* in kilobytes per second, 0 = no limit */
+    DWORD maxiops; /* 0 = no limit */
     NFS41_MOUNT_CREATEMODE dir_createmode;
     NFS41_MOUNT_CREATEMODE file_createmode;
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
@@ -430,17 +687,92 @@ typedef struct _nfs41_mount_list {
             }
 
 
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+/*
+ * Per-|NetRoot| cache of paths for which an OPEN upcall returned
+ * |STATUS_OBJECT_NAME_NOT_FOUND|, see |nfs41_negcache_lookup()|
+ */
+#define NFS41_NEGCACHE_NUM_ENTRIES  32
+#define NFS41_NEGCACHE_MAX_NAME_LEN 128 /* in |WCHAR|s */
+#define NFS41_NEGCACHE_TTL_MSECS    1000
+
+typedef struct _nfs41_negcache_entry {
+    BOOLEAN valid;
+    ULONG time; /* msecs, see |nfs41_get_interrupttime_msecs()| */
+    ULONG hash;
+    ULONG parent_hash;
+    USHORT name_len; /* in bytes */
+    WCHAR name[NFS41_NEGCACHE_MAX_NAME_LEN];
+} nfs41_negcache_entry;
+
+typedef struct _nfs41_negcache {
+    FAST_MUTEX lock;
+    /* incremented each time entries are invalidated */
+    LONG gen;
+    nfs41_negcache_entry entries[NFS41_NEGCACHE_NUM_ENTRIES];
+} nfs41_negcache;
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
+
 typedef struct _NFS41_NETROOT_EXTENSION {
     NODE_TYPE_CODE          NodeTypeCode;
     NODE_BYTE_SIZE          NodeByteSize;
     DWORD                   nfs41d_version;
     BOOLEAN                 mounts_init;
     nfs41_mount_list        mounts;
+    /* see |nfs41_netroot_stats_add()| */
+    BOOLEAN                 stats_listed;
+    LIST_ENTRY              stats_next;
+    NFS41_NETROOT_STATS     stats;
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+    /* see |nfs41_netroot_find_session()| */
+    EX_RUNDOWN_REF          lookup_rundown;
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+    /*
+     * Shared by all |VNetRoot|s (logon sessions), so changes through
+     * any of them invalidate it
+     */
+    nfs41_negcache          negcache;
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
 } NFS41_NETROOT_EXTENSION, *PNFS41_NETROOT_EXTENSION;
 #define NFS41GetNetRootExtension(pNetRoot)      \
         (((pNetRoot) == NULL) ? NULL :          \
         (PNFS41_NETROOT_EXTENSION)((pNetRoot)->Context))
 
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+/*
+ * Per-mount cache for |FileFsSizeInformation|,
+ * |FileFsFullSizeInformation| and |FileFsAttributeInformation|, see
+ * |nfs41_QueryVolumeInformation()|
+ */
+#define NFS41_VOLCACHE_SIZE         0
+#define NFS41_VOLCACHE_FULLSIZE     1
+#define NFS41_VOLCACHE_ATTRIBUTE    2
+#define NFS41_VOLCACHE_NUM_ENTRIES  3
+
+typedef struct _nfs41_volcache_entry {
+    BOOLEAN valid;
+    /* An upcall to refresh this entry is in progress */
+    BOOLEAN refreshing;
+    ULONG time; /* msecs, see |nfs41_get_interrupttime_msecs()| */
+    ULONG len;
+    /* filesystem the data belongs to, see |NFS41_FCB.fsid_major| */
+    ULONGLONG fsid_major, fsid_minor;
+    union {
+        FILE_FS_SIZE_INFORMATION size;
+        FILE_FS_FULL_SIZE_INFORMATION fullsize;
+        NFS41_FILE_FS_ATTRIBUTE_INFORMATION attribute;
+    } u;
+} nfs41_volcache_entry;
+
+typedef struct _nfs41_volcache {
+    FAST_MUTEX lock;
+    /* incremented by |nfs41_volcache_invalidate()| */
+    LONG gen;
+    nfs41_volcache_entry entries[NFS41_VOLCACHE_NUM_ENTRIES];
+} nfs41_volcache;
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
+
 typedef struct _NFS41_V_NET_ROOT_EXTENSION {
     NODE_TYPE_CODE          NodeTypeCode;
     NODE_BYTE_SIZE          NodeByteSize;
@@ -448,6 +780,13 @@ typedef struct _NFS41_V_NET_ROOT_EXTENSION {
     NFS41_FILE_FS_ATTRIBUTE_INFORMATION FsAttrs;
     DWORD                   sec_flavor;
     DWORD                   timeout;
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    DWORD                   volcachettl; /* in seconds, 0 == disabled */
+    nfs41_volcache          volcache;
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    DWORD                   aclcachettl; /* in seconds */
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
     NFS41_MOUNT_CREATEMODE  dir_createmode;
     NFS41_MOUNT_CREATEMODE  file_createmode;
     WCHAR                   mntpt_buffer[NFS41_SYS_MAX_PATH_LEN];
@@ -457,6 +796,17 @@ typedef struct _NFS41_V_NET_ROOT_EXTENSION {
     BOOLEAN                 write_thru;
     BOOLEAN                 nocache;
     BOOLEAN                 timebasedcoherency;
+    /* "nocto" and "immutable", see |nfs41_Create()| */
+    BOOLEAN                 nocto;
+    BOOLEAN                 immutable;
+    /*
+     * With "immutable" cached FCB attributes and ACLs are valid if
+     * they are younger than the time since the mount or the last
+     * "nfsclientdctl flush", see |nfs41_immutable_cache_valid()|
+     */
+    volatile LONG           cache_flush_time;
+    /* "writebehind", see |nfs41_set_writebehind()|, 0 == no limit */
+    ULONG                   writebehind_pages;
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
     tristate_bool           force_case_preserving;
     tristate_bool           force_case_insensitive;
@@ -466,6 +816,35 @@ typedef struct _NFS41_V_NET_ROOT_EXTENSION {
         (((pVNetRoot) == NULL) ? NULL :           \
         (PNFS41_V_NET_ROOT_EXTENSION)((pVNetRoot)->Context))
 
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+/*
+ * Even with "aclcachettl=0" a security descriptor is kept for the
+ * retry of a |STATUS_BUFFER_OVERFLOW| query
+ */
+#define NFS41_ACLCACHE_MIN_MSECS 10
+
+typedef struct _nfs41_aclcache_entry {
+    volatile LONG refcount;
+    SECURITY_INFORMATION query;
+    ULONG time; /* msecs, see |nfs41_get_interrupttime_msecs()| */
+    ULONG sec_desc_len;
+    UCHAR sec_desc[1];
+} nfs41_aclcache_entry;
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+/*
+ * UTF-8 form of a |UNICODE_STRING|, valid as long as the
+ * |UNICODE_STRING| still has |src_buffer| and |src_length|
+ */
+typedef struct _nfs41_utf8name {
+    PCWCH src_buffer;
+    USHORT src_length;
+    USHORT length; /* without the '\0' */
+    CHAR name[1];
+} nfs41_utf8name;
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
+
 typedef struct _NFS41_FCB {
     NODE_TYPE_CODE          NodeTypeCode;
     NODE_BYTE_SIZE          NodeByteSize;
@@ -481,27 +860,130 @@ typedef struct _NFS41_FCB {
     DWORD                   owner_group_local_gid; /* owner group mapped into local gid */
 #endif /* NFS41_DRIVER_FEATURE_LOCAL_UIDGID_IN_NFSV3ATTRIBUTES */
     ULONGLONG               changeattr;
+    /* |CcSetDirtyPageThreshold()| was called for this file */
+    BOOLEAN                 writebehind_set;
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+    /*
+     * Attribute cache state for |BasicInfo|/|StandardInfo|, see
+     * |nfs41_fcb_attrcache_lookup()|
+     */
+    volatile LONG           attrcache_gen;
+    volatile LONG           attrcache_valid;
+    ULONG                   attrcache_basic_time; /* msecs */
+    ULONG                   attrcache_std_time; /* msecs */
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+    ULONG                   attrcache_statlx_time; /* msecs */
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+    /* last |FileStatLxInformation| reply */
+    FILE_STAT_LX_INFORMATION StatLxInfo;
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    /*
+     * Security descriptor cache, see |nfs41_fcb_aclcache_get()|.
+     * The FCB extension is zeroed by RDBSS, which is an initialised
+     * |KSPIN_LOCK|
+     */
+    KSPIN_LOCK              aclcache_lock;
+    volatile LONG           aclcache_gen;
+    nfs41_aclcache_entry    *aclcache;
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    /*
+     * UTF-8 form of the FCB's prefixed name, set once by
+     * |nfs41_UpcallSetFcbFilename()| and freed with the FCB
+     */
+    struct _nfs41_utf8name * volatile utf8name;
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+    /* see |nfs41_lock_buffering_recall()| */
+    volatile LONG           lock_push_pending;
+    RX_WORK_QUEUE_ITEM      lock_push_workitem;
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
 } NFS41_FCB, *PNFS41_FCB;
 #define NFS41GetFcbExtension(pFcb)      \
         (((pFcb) == NULL) ? NULL : (PNFS41_FCB)((pFcb)->Context))
 
+/*
+ * Size of the FOBX directory enumeration buffer
+ * (|NFS41_DRIVER_DIRQUERY_BUFFER|). Must be a multiple of |PAGE_SIZE|,
+ * so that the pool allocation is page aligned and mapping it into the
+ * daemon does not expose other pool memory.
+ */
+#define NFS41_DIRQUERY_BUFFER_SIZE (64*1024)
+
 typedef struct _NFS41_FOBX {
     NODE_TYPE_CODE          NodeTypeCode;
     NODE_BYTE_SIZE          NodeByteSize;
 
     HANDLE nfs41_open_state;
     SECURITY_CLIENT_CONTEXT sec_ctx;
+#ifndef NFS41_DRIVER_FCB_ACLCACHE
     PVOID acl;
     DWORD acl_len;
     LARGE_INTEGER time;
+#endif /* !NFS41_DRIVER_FCB_ACLCACHE */
     DWORD deleg_type;
     BOOLEAN write_thru;
     BOOLEAN nocache;
     BOOLEAN timebasedcoherency;
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    /*
+     * Attribute changes sent with |NFS41_SYSOP_CLOSE|, see
+     * |nfs41_fobx_defer_setattr()|; |setattr_flags| are
+     * |NFS41_CLOSE_FLAG_*|
+     */
+    ULONG setattr_flags;
+    FILE_BASIC_INFORMATION setattr_basic;
+    LARGE_INTEGER setattr_eof;
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+#ifdef NFS41_DRIVER_DIRQUERY_BUFFER
+    /* directory enumeration buffer, see |nfs41_dirbuf_query()| */
+    PUCHAR dirbuf;
+    /* bytes filled by the last |NFS41_SYSOP_DIR_QUERY| upcall */
+    ULONG dirbuf_len;
+    /* offset of the next entry to return */
+    ULONG dirbuf_pos;
+    FILE_INFORMATION_CLASS dirbuf_class;
+#endif /* NFS41_DRIVER_DIRQUERY_BUFFER */
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+    /*
+     * A lock granted locally under a write delegation could not be
+     * sent to the server on recall, see |nfs41_lock_buffering_push()|
+     */
+    BOOLEAN locks_lost;
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
 } NFS41_FOBX, *PNFS41_FOBX;
 #define NFS41GetFobxExtension(pFobx)  \
         (((pFobx) == NULL) ? NULL : (PNFS41_FOBX)((pFobx)->Context))
 
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+/*
+ * SRV_OPEN extension, filled by |nfs41_Create()| for opens which
+ * other opens may be collapsed onto; |nfs41_CollapseOpen()| copies
+ * it into the new FOBX. |collapsible| is |FALSE| for all other
+ * SRV_OPENs
+ */
+typedef struct _NFS41_SRV_OPEN {
+    BOOLEAN collapsible;
+    LUID logon_id;
+    HANDLE nfs41_open_state;
+    DWORD deleg_type;
+    BOOLEAN write_thru;
+    BOOLEAN nocache;
+    BOOLEAN timebasedcoherency;
+    /*
+     * Set by |nfs41_invalidate_cache()|, see
+     * |nfs41_fobx_deleg_type()|. Used for all SRV_OPENs, not only
+     * collapsible ones
+     */
+    BOOLEAN deleg_recalled;
+} NFS41_SRV_OPEN, *PNFS41_SRV_OPEN;
+#define NFS41GetSrvOpenExtension(pSrvOpen)  \
+        (((pSrvOpen) == NULL) ? NULL : (PNFS41_SRV_OPEN)((pSrvOpen)->Context))
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
+
 typedef struct _NFS41_SERVER_ENTRY {
     PMRX_SRV_CALL                 pRdbssSrvCall;
     WCHAR                         NameBuffer[SERVER_NAME_BUFFER_SIZE];
@@ -524,6 +1006,7 @@ typedef struct _NFS41_DEVICE_EXTENSION {
 
 typedef struct _nfs41_fcb_list_entry {
     LIST_ENTRY next;
+    LIST_ENTRY hash_next;
     PMRX_FCB fcb;
     HANDLE session;
     PNFS41_FOBX nfs41_fobx;
@@ -531,9 +1014,29 @@ typedef struct _nfs41_fcb_list_entry {
     BOOLEAN skip;
 } nfs41_fcb_list_entry;
 
+/*
+ * |openlist| - FCBs checked by the time-based coherency thread
+ * |fcbopen_main()|
+ * |openlist.lock| protects |openlist.head|, which is only used to
+ * iterate over all entries, and is held when entries are added or
+ * removed or their |nfs41_fobx| is cleared.
+ * Each entry is also in the bucket of its FCB (via |hash_next|), so
+ * lookups by FCB only take the bucket lock, which protects
+ * |ChangeTime| and |skip|.
+ * Lock order is |openlist.lock| before the bucket lock.
+ * |NFS41_OPENLIST_NUM_BUCKETS| must be a power of two!
+ */
+#define NFS41_OPENLIST_NUM_BUCKETS (1024)
+
+typedef struct _nfs41_fcb_list_bucket {
+    FAST_MUTEX  lock;
+    LIST_ENTRY  head;
+} nfs41_fcb_list_bucket;
+
 typedef struct _nfs41_fcb_list {
     FAST_MUTEX  lock;
     LIST_ENTRY  head;
+    nfs41_fcb_list_bucket buckets[NFS41_OPENLIST_NUM_BUCKETS];
 } nfs41_fcb_list;
 extern nfs41_fcb_list openlist;
 
@@ -590,6 +1093,8 @@ NTSTATUS map_mount_errors(
 NTSTATUS map_sec_flavor(
     IN PUNICODE_STRING sec_flavor_name,
     OUT PDWORD sec_flavor);
+NTSTATUS nfs41_GetLUID(
+    PLUID id);
 NTSTATUS map_open_errors(
     DWORD status,
     USHORT len);
@@ -634,6 +1139,10 @@ NTSTATUS nfs41_QuerySecurityInformation(
     IN OUT PRX_CONTEXT RxContext);
 NTSTATUS nfs41_SetSecurityInformation(
     IN OUT PRX_CONTEXT RxContext);
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+void nfs41_fcb_aclcache_invalidate(
+    PNFS41_FCB nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
 
 /* nfs41sys_dir.c */
 NTSTATUS marshal_nfs41_dirquery(
@@ -646,17 +1155,47 @@ NTSTATUS unmarshal_nfs41_dirquery(
     const unsigned char *restrict *restrict buf);
 void print_debug_filedirquery_header(
     PRX_CONTEXT RxContext);
+#ifdef NFS41_DRIVER_DIRQUERY_BUFFER
+void nfs41_dirbuf_free(
+    IN OUT PNFS41_FOBX nfs41_fobx);
+#endif /* NFS41_DRIVER_DIRQUERY_BUFFER */
 NTSTATUS check_nfs41_dirquery_args(
     IN PRX_CONTEXT RxContext);
 NTSTATUS nfs41_QueryDirectory(
     IN OUT PRX_CONTEXT RxContext);
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+void nfs41_dirnotify_init(void);
+NTSTATUS marshal_nfs41_dirnotify(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+NTSTATUS nfs41_NotifyChangeDirectory(
+    IN OUT PRX_CONTEXT RxContext);
+NTSTATUS nfs41_dirnotify_downcall(
+    IN PRX_CONTEXT RxContext);
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
 
 /* nfs41sys_driver.c */
 nfs41_fcb_list_entry *nfs41_allocate_nfs41_fcb_list_entry(void);
 void nfs41_free_nfs41_fcb_list_entry(nfs41_fcb_list_entry *entry);
+void nfs41_buffer_lookasidelists_init(void);
+void nfs41_buffer_lookasidelists_delete(void);
+PVOID nfs41_buffer_allocate(SIZE_T size, ULONG tag);
+void nfs41_buffer_free(PVOID buf, SIZE_T size);
+void nfs41_openlist_init(void);
+void nfs41_openlist_add(nfs41_fcb_list_entry *entry);
 NTSTATUS marshall_unicode_as_utf8(
     IN OUT unsigned char **pos,
     IN PCUNICODE_STRING str);
+BOOLEAN nfs41_unicode_is_ascii(
+    IN const WCHAR *str,
+    IN ULONG nchars);
+ULONG length_filename_as_utf8(
+    IN nfs41_updowncall_entry *entry);
+NTSTATUS marshall_filename_as_utf8(
+    IN OUT unsigned char **pos,
+    IN nfs41_updowncall_entry *entry);
 NTSTATUS marshal_nfs41_shutdown(
     nfs41_updowncall_entry *entry,
     unsigned char *buf,
@@ -667,6 +1206,38 @@ NTSTATUS marshal_nfs41_set_daemon_debuglevel(
     unsigned char *buf,
     ULONG buf_len,
     ULONG *len);
+NTSTATUS marshal_nfs41_get_daemon_stats(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+void unmarshal_nfs41_get_daemon_stats(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf);
+NTSTATUS marshal_nfs41_get_flight_recorder(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+void unmarshal_nfs41_get_flight_recorder(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf);
+NTSTATUS marshal_nfs41_get_mount_stats(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+void unmarshal_nfs41_get_mount_stats(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf);
+NTSTATUS marshal_nfs41_get_top_stats(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+void unmarshal_nfs41_get_top_stats(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf);
 void enable_caching(
     PMRX_SRV_OPEN SrvOpen,
     PNFS41_FOBX nfs41_fobx,
@@ -724,6 +1295,13 @@ NTSTATUS unmarshal_nfs41_duplicatedata(
     const unsigned char *restrict *restrict buf);
 void nfs41_remove_offloadcontext_for_fobx(
     IN PMRX_FOBX pFobx);
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+NTSTATUS marshal_nfs41_cachecontrol(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
 
 /* nfs41sys_ioctl.c */
 NTSTATUS nfs41_IoCtl(
@@ -749,6 +1327,11 @@ NTSTATUS nfs41_Lock(
     IN OUT PRX_CONTEXT RxContext);
 NTSTATUS nfs41_Unlock(
     IN OUT PRX_CONTEXT RxContext);
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+void nfs41_lock_buffering_recall(
+    IN PRDBSS_DEVICE_OBJECT DeviceObject,
+    IN OUT PMRX_SRV_OPEN SrvOpen);
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
 
 /* nfs41sys_mount.c */
 void copy_nfs41_mount_config(NFS41_MOUNT_CONFIG *dest,
@@ -827,6 +1410,29 @@ NTSTATUS marshal_nfs41_close(
 NTSTATUS unmarshal_nfs41_open(
     nfs41_updowncall_entry *cur,
     const unsigned char *restrict *restrict buf);
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+NTSTATUS marshal_nfs41_queryopen(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+void unmarshal_nfs41_queryopen(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf);
+BOOLEAN nfs41_FastIoQueryOpen(
+    IN OUT PIRP Irp,
+    OUT PFILE_NETWORK_OPEN_INFORMATION NetworkInformation,
+    IN PDEVICE_OBJECT DeviceObject);
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+void nfs41_negcache_init(
+    PNFS41_NETROOT_EXTENSION pNetRootContext);
+void nfs41_negcache_invalidate(
+    PNFS41_NETROOT_EXTENSION pNetRootContext);
+void nfs41_negcache_invalidate_parent(
+    PNFS41_NETROOT_EXTENSION pNetRootContext,
+    PUNICODE_STRING name);
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
 NTSTATUS nfs41_Create(
     IN OUT PRX_CONTEXT RxContext);
 NTSTATUS nfs41_CollapseOpen(
@@ -845,10 +1451,24 @@ NTSTATUS marshal_nfs41_rw(
 NTSTATUS unmarshal_nfs41_rw(
     nfs41_updowncall_entry *cur,
     const unsigned char *restrict *restrict buf);
+NTSTATUS marshal_nfs41_flush(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+void nfs41_io_pool_reset(void);
+NTSTATUS nfs41_io_pool_set(
+    IN OUT PRX_CONTEXT RxContext);
+void nfs41_io_pool_release(
+    IN OUT nfs41_updowncall_entry *entry);
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
 NTSTATUS nfs41_Read(
     IN OUT PRX_CONTEXT RxContext);
 NTSTATUS nfs41_Write(
     IN OUT PRX_CONTEXT RxContext);
+void nfs41_rw_async_complete(
+    IN OUT nfs41_updowncall_entry *entry);
 ULONG nfs41_ExtendForCache(
     IN OUT PRX_CONTEXT RxContext,
     IN PLARGE_INTEGER pNewFileSize,
@@ -899,16 +1519,58 @@ NTSTATUS nfs41_UpcallCreate(
     IN DWORD version,
     IN PUNICODE_STRING filename,
     OUT nfs41_updowncall_entry **entry_out);
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+void nfs41_UpcallSetFcbFilename(
+    IN OUT nfs41_updowncall_entry *entry,
+    IN OUT PNFS41_FCB nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
 void nfs41_UpcallDestroy(nfs41_updowncall_entry *entry);
 NTSTATUS nfs41_UpcallWaitForReply(
     IN nfs41_updowncall_entry *entry,
     IN LONGLONG secs);
 NTSTATUS nfs41_upcall(
     IN PRX_CONTEXT RxContext);
+NTSTATUS nfs41_upcall_batch(
+    IN PRX_CONTEXT RxContext);
 NTSTATUS nfs41_downcall(
     IN PRX_CONTEXT RxContext);
+NTSTATUS nfs41_downcall_batch(
+    IN PRX_CONTEXT RxContext);
+NTSTATUS nfs41_downcall_upcall_batch(
+    IN PRX_CONTEXT RxContext);
 NTSTATUS nfs41_delayxid(
     IN PRX_CONTEXT RxContext);
+void nfs41_downcalllist_init(void);
+void nfs41_downcalllist_add(
+    IN nfs41_updowncall_entry *entry);
+void nfs41_downcalllist_remove(
+    IN nfs41_updowncall_entry *entry);
+nfs41_updowncall_entry *nfs41_downcalllist_remove_first(void);
+NTSTATUS nfs41_get_updowncall_stats(
+    IN OUT PRX_CONTEXT RxContext);
+void nfs41_op_stats_init(void);
+void nfs41_upcalllist_init(void);
+nfs41_updowncall_entry *nfs41_upcalllist_remove_next(void);
+void nfs41_upcalllist_removed(
+    IN const nfs41_updowncall_entry *entry);
+NTSTATUS nfs41_get_op_stats(
+    IN OUT PRX_CONTEXT RxContext);
+void nfs41_netroot_stats_add(
+    IN OUT PNFS41_NETROOT_EXTENSION pNetRootContext,
+    IN PUNICODE_STRING name);
+void nfs41_netroot_stats_remove(
+    IN OUT PNFS41_NETROOT_EXTENSION pNetRootContext);
+void nfs41_get_netroot_stats(
+    OUT NFS41_MOUNT_STATS *stats);
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+PNFS41_NETROOT_EXTENSION nfs41_netroot_find_session(
+    IN PCUNICODE_STRING path,
+    IN PLUID luid,
+    OUT HANDLE *session,
+    OUT PUNICODE_STRING relpath);
+void nfs41_netroot_release(
+    IN OUT PNFS41_NETROOT_EXTENSION pNetRootContext);
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
 
 /* nfs41sys_fileinfo.c */
 NTSTATUS marshal_nfs41_filequery(
@@ -928,6 +1590,36 @@ void unmarshal_nfs41_setattr(
 void unmarshal_nfs41_getattr(
     nfs41_updowncall_entry *cur,
     const unsigned char *restrict *restrict buf);
+NTSTATUS marshal_nfs41_coherency_batch(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len);
+void unmarshal_nfs41_coherency_batch(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf);
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+void nfs41_fcb_attrcache_update(
+    PNFS41_FCB nfs41_fcb,
+    FILE_INFORMATION_CLASS InfoClass,
+    LONG gen);
+void nfs41_fcb_attrcache_invalidate(
+    PNFS41_FCB nfs41_fcb);
+#ifdef NFS41_DRIVER_FASTIO_QUERYINFO
+BOOLEAN nfs41_FastIoQueryBasicInfo(
+    IN PFILE_OBJECT FileObject,
+    IN BOOLEAN Wait,
+    OUT PFILE_BASIC_INFORMATION Buffer,
+    OUT PIO_STATUS_BLOCK IoStatus,
+    IN PDEVICE_OBJECT DeviceObject);
+BOOLEAN nfs41_FastIoQueryStandardInfo(
+    IN PFILE_OBJECT FileObject,
+    IN BOOLEAN Wait,
+    OUT PFILE_STANDARD_INFORMATION Buffer,
+    OUT PIO_STATUS_BLOCK IoStatus,
+    IN PDEVICE_OBJECT DeviceObject);
+#endif /* NFS41_DRIVER_FASTIO_QUERYINFO */
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
 NTSTATUS nfs41_QueryFileInformation(
     IN OUT PRX_CONTEXT RxContext);
 NTSTATUS nfs41_SetFileInformation(
@@ -944,6 +1636,12 @@ NTSTATUS marshal_nfs41_volume(
 void unmarshal_nfs41_volume(
     nfs41_updowncall_entry *cur,
     const unsigned char *restrict *restrict buf);
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+void nfs41_volcache_init(
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext);
+void nfs41_volcache_invalidate(
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext);
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
 NTSTATUS nfs41_QueryVolumeInformation(
     IN OUT PRX_CONTEXT RxContext);
 
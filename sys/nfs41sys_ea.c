@@ -83,14 +83,14 @@ NTSTATUS marshal_nfs41_easet(
         goto out;
     tmp += *len;
 
-    header_len = *len + length_as_utf8(entry->filename) +
+    header_len = *len + length_filename_as_utf8(entry) +
         sizeof(ULONG) + entry->u.SetEa.buf_len  + sizeof(DWORD);
     if (header_len > buf_len) {
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto out;
     }
 
-    status = marshall_unicode_as_utf8(&tmp, entry->filename);
+    status = marshall_filename_as_utf8(&tmp, entry);
     if (status) goto out;
     RtlCopyMemory(tmp, &entry->u.SetEa.mode, sizeof(DWORD));
     tmp += sizeof(DWORD);
@@ -132,7 +132,7 @@ NTSTATUS marshal_nfs41_eaget(
         goto out;
     tmp += *len;
 
-    header_len = *len + length_as_utf8(entry->filename) +
+    header_len = *len + length_filename_as_utf8(entry) +
         3 * sizeof(ULONG) + entry->u.QueryEa.EaListLength + 2 * sizeof(BOOLEAN);
 
     if (header_len > buf_len) {
@@ -140,7 +140,7 @@ NTSTATUS marshal_nfs41_eaget(
         goto out;
     }
 
-    status = marshall_unicode_as_utf8(&tmp, entry->filename);
+    status = marshall_filename_as_utf8(&tmp, entry);
     if (status) goto out;
     RtlCopyMemory(tmp, &entry->u.QueryEa.EaIndex, sizeof(ULONG));
     tmp += sizeof(ULONG);
@@ -231,6 +231,13 @@ static void file_time_to_nfs_time(
     nfs_time->tv_nsec = (UINT32)((diff.QuadPart % 10000000LL) * 100LL);
 }
 
+/*
+ * Build the Cygwin "NfsV3Attributes" EA from the FCB, without an
+ * upcall. |nfs41_Create()| refreshes all fields used here from the
+ * OPEN reply whenever the change attribute differs, and
+ * |nfs41_QueryFileInformation()|/|nfs41_SetEaInformation()| keep
+ * them current while the file is open.
+ */
 static void create_nfs3_attrs(
     nfs3_attrs *attrs,
     PNFS41_FCB nfs41_fcb)
@@ -374,6 +381,10 @@ NTSTATUS nfs41_SetEaInformation(
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    nfs41_UpcallSetFcbFilename(entry, nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
 
     if (AnsiStrEq(&NfsV3Attributes, eainfo->EaName, eainfo->EaNameLength)) {
         attrs = (nfs3_attrs *)(eainfo->EaName + eainfo->EaNameLength + 1);
@@ -411,12 +422,20 @@ NTSTATUS nfs41_SetEaInformation(
 #endif
     status = map_setea_error(entry->status);
     if (!status) {
-        if (!nfs41_fobx->deleg_type && entry->ChangeTime &&
+        if (!nfs41_fobx_deleg_type(SrvOpen, nfs41_fobx) &&
+                entry->ChangeTime &&
                 (SrvOpen->DesiredAccess &
                 (FILE_READ_DATA | FILE_WRITE_DATA | FILE_APPEND_DATA)))
             nfs41_update_fcb_list(RxContext->pFcb, entry->ChangeTime);
         nfs41_fcb->changeattr = entry->ChangeTime;
         nfs41_fcb->mode = entry->u.SetEa.mode;
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+        nfs41_fcb_attrcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+        /* NfsV3Attributes mode changes also change the ACL */
+        nfs41_fcb_aclcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
     }
 out:
     if (entry) {
@@ -504,6 +523,7 @@ NTSTATUS QueryCygwinSymlink(
         VNetRootContext->session, Fobx->nfs41_open_state,
         NetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &NetRootContext->stats;
 
     entry->u.Symlink.target = &TargetName;
 
@@ -660,6 +680,10 @@ NTSTATUS nfs41_QueryEaInformation(
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    nfs41_UpcallSetFcbFilename(entry, NFS41GetFcbExtension(RxContext->pFcb));
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
 
     entry->u.QueryEa.buf_len = buflen;
     entry->u.QueryEa.buf = RxContext->Info.Buffer;
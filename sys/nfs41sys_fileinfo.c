@@ -124,13 +124,13 @@ NTSTATUS marshal_nfs41_fileset(
         goto out;
     tmp += *len;
 
-    header_len = *len + length_as_utf8(entry->filename) +
+    header_len = *len + length_filename_as_utf8(entry) +
         2 * sizeof(ULONG) + entry->u.SetFile.buf_len;
     if (header_len > buf_len) {
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto out;
     }
-    status = marshall_unicode_as_utf8(&tmp, entry->filename);
+    status = marshall_filename_as_utf8(&tmp, entry);
     if (status) goto out;
     RtlCopyMemory(tmp, &entry->u.SetFile.InfoClass, sizeof(ULONG));
     tmp += sizeof(ULONG);
@@ -181,6 +181,69 @@ void unmarshal_nfs41_getattr(
 #endif
 }
 
+NTSTATUS marshal_nfs41_coherency_batch(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG header_len = 0;
+    unsigned char *tmp = buf;
+    ULONG count = entry->u.CoherencyBatch.count;
+
+    status = marshal_nfs41_header(entry, tmp, buf_len, len);
+    if (status)
+        goto out;
+    tmp += *len;
+
+    header_len = *len + sizeof(ULONG) + count * sizeof(HANDLE);
+    if (header_len > buf_len) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+    RtlCopyMemory(tmp, &count, sizeof(ULONG));
+    tmp += sizeof(ULONG);
+    RtlCopyMemory(tmp, entry->u.CoherencyBatch.open_states,
+        count * sizeof(HANDLE));
+    tmp += count * sizeof(HANDLE);
+
+    *len = (ULONG)(tmp - buf);
+    if (*len != header_len) {
+        DbgP("marshal_nfs41_coherency_batch: "
+            "*len(=%ld) != header_len(=%ld)\n",
+            (long)*len, (long)header_len);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+#ifdef DEBUG_MARSHAL_DETAIL
+    DbgP("marshal_nfs41_coherency_batch: count=%ld\n", (long)count);
+#endif
+out:
+    return status;
+}
+
+void unmarshal_nfs41_coherency_batch(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf)
+{
+    ULONG i;
+
+    for (i = 0 ; i < cur->u.CoherencyBatch.count ; i++) {
+        RtlCopyMemory(&cur->u.CoherencyBatch.statuses[i], *buf,
+            sizeof(DWORD));
+        *buf += sizeof(DWORD);
+        RtlCopyMemory(&cur->u.CoherencyBatch.changeattrs[i], *buf,
+            sizeof(ULONGLONG));
+        *buf += sizeof(ULONGLONG);
+    }
+#ifdef DEBUG_MARSHAL_DETAIL
+    DbgP("unmarshal_nfs41_coherency_batch: count=%ld\n",
+        (long)cur->u.CoherencyBatch.count);
+#endif
+}
+
 NTSTATUS map_queryfile_error(
     DWORD error)
 {
@@ -198,6 +261,454 @@ NTSTATUS map_queryfile_error(
     }
 }
 
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+/* |FILE_STAT_INFORMATION| is a prefix of |FILE_STAT_LX_INFORMATION| */
+#define NFS41_STATINFO_LEN(InfoClass) \
+    (((InfoClass) == FileStatInformation)? \
+        sizeof(FILE_STAT_INFORMATION) : sizeof(FILE_STAT_LX_INFORMATION))
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+/*
+ * FCB attribute cache
+ *
+ * |nfs41_fcb->BasicInfo| and |nfs41_fcb->StandardInfo| are filled in
+ * by |nfs41_Create()| and by |nfs41_QueryFileInformation()|, and
+ * |nfs41_fcb->attrcache_valid| records which of them are usable to
+ * answer a query without an upcall. |nfs41_fcb->StatLxInfo| is
+ * filled in by |FileStatInformation|/|FileStatLxInformation|
+ * queries, which always fetch |FileStatLxInformation|.
+ * Cached data is used if it is younger than
+ * |NFS41_DRIVER_FCB_ATTRCACHE_TIMEOUT_MS|, or for any age if the
+ * handle holds a delegation (the server must recall the delegation
+ * before another client can change the file), or on "immutable"
+ * mounts until the next "nfsclientdctl flush".
+ *
+ * |nfs41_fcb->attrcache_gen| is incremented by each invalidation, so
+ * that a query upcall which raced with a WRITE or SETATTR cannot
+ * mark its (possibly stale) result as valid.
+ */
+#define NFS41_FCB_ATTRCACHE_BASIC   (0x1)
+#define NFS41_FCB_ATTRCACHE_STD     (0x2)
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+/*
+ * |nfs41_fcb->StatLxInfo|, answers both |FileStatLxInformation| and
+ * |FileStatInformation| (which is a prefix of it)
+ */
+#define NFS41_FCB_ATTRCACHE_STATLX  (0x4)
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+
+/* Size of the |InfoClass| data the cache can answer, 0 otherwise */
+static ULONG nfs41_fcb_attrcache_infolen(
+    IN FILE_INFORMATION_CLASS InfoClass)
+{
+    switch (InfoClass) {
+    case FileBasicInformation:
+        return sizeof(FILE_BASIC_INFORMATION);
+    case FileStandardInformation:
+        return sizeof(FILE_STANDARD_INFORMATION);
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+    case FileStatInformation:
+    case FileStatLxInformation:
+        return NFS41_STATINFO_LEN(InfoClass);
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+    default:
+        return 0;
+    }
+}
+
+void nfs41_fcb_attrcache_update(
+    PNFS41_FCB nfs41_fcb,
+    FILE_INFORMATION_CLASS InfoClass,
+    LONG gen)
+{
+    LONG flag;
+
+    if (InfoClass == FileBasicInformation) {
+        nfs41_fcb->attrcache_basic_time = nfs41_get_interrupttime_msecs();
+        flag = NFS41_FCB_ATTRCACHE_BASIC;
+    } else if (InfoClass == FileStandardInformation) {
+        nfs41_fcb->attrcache_std_time = nfs41_get_interrupttime_msecs();
+        flag = NFS41_FCB_ATTRCACHE_STD;
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+    } else if (InfoClass == FileStatLxInformation) {
+        nfs41_fcb->attrcache_statlx_time = nfs41_get_interrupttime_msecs();
+        flag = NFS41_FCB_ATTRCACHE_STATLX;
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+    } else {
+        return;
+    }
+
+    (void)InterlockedOr(&nfs41_fcb->attrcache_valid, flag);
+    /* Lost a race against |nfs41_fcb_attrcache_invalidate()| ? */
+    if (InterlockedCompareExchange(&nfs41_fcb->attrcache_gen, 0, 0) != gen)
+        (void)InterlockedAnd(&nfs41_fcb->attrcache_valid, ~flag);
+}
+
+void nfs41_fcb_attrcache_invalidate(
+    PNFS41_FCB nfs41_fcb)
+{
+    (void)InterlockedIncrement(&nfs41_fcb->attrcache_gen);
+    (void)InterlockedExchange(&nfs41_fcb->attrcache_valid, 0);
+}
+
+/*
+ * Copy cached |InfoClass| data to |buf|, returns |FALSE| if the cache
+ * cannot answer the query
+ */
+static BOOLEAN nfs41_fcb_attrcache_copy(
+    IN PMRX_SRV_OPEN SrvOpen,
+    IN PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext,
+    IN PNFS41_FCB nfs41_fcb,
+    IN PNFS41_FOBX nfs41_fobx,
+    IN FILE_INFORMATION_CLASS InfoClass,
+    OUT PVOID buf,
+    IN ULONG buf_len)
+{
+    ULONG cache_time;
+    ULONG len;
+    LONG flag;
+
+    len = nfs41_fcb_attrcache_infolen(InfoClass);
+    if (InfoClass == FileBasicInformation) {
+        flag = NFS41_FCB_ATTRCACHE_BASIC;
+        cache_time = nfs41_fcb->attrcache_basic_time;
+    } else if (InfoClass == FileStandardInformation) {
+        flag = NFS41_FCB_ATTRCACHE_STD;
+        cache_time = nfs41_fcb->attrcache_std_time;
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+    } else if (len != 0) {
+        flag = NFS41_FCB_ATTRCACHE_STATLX;
+        cache_time = nfs41_fcb->attrcache_statlx_time;
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+    } else {
+        return FALSE;
+    }
+
+    if (nfs41_fobx->nocache)
+        return FALSE;
+    /* Let the upcall path report |STATUS_BUFFER_TOO_SMALL| */
+    if (buf_len < len)
+        return FALSE;
+    if (!(nfs41_fcb->attrcache_valid & flag))
+        return FALSE;
+    if ((!nfs41_fobx_deleg_type(SrvOpen, nfs41_fobx)) &&
+        ((nfs41_get_interrupttime_msecs() - cache_time) >=
+            NFS41_DRIVER_FCB_ATTRCACHE_TIMEOUT_MS) &&
+        !nfs41_immutable_cache_valid(pVNetRootContext, cache_time))
+        return FALSE;
+
+    if (InfoClass == FileBasicInformation) {
+        RtlCopyMemory(buf, &nfs41_fcb->BasicInfo, len);
+#ifdef DEBUG_FILE_QUERY
+        print_basic_info(1, &nfs41_fcb->BasicInfo);
+#endif
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+    } else if (flag == NFS41_FCB_ATTRCACHE_STATLX) {
+        RtlCopyMemory(buf, &nfs41_fcb->StatLxInfo, len);
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+    } else {
+        PFILE_STANDARD_INFORMATION std_info =
+            (PFILE_STANDARD_INFORMATION)buf;
+
+        RtlCopyMemory(std_info, &nfs41_fcb->StandardInfo, len);
+        /* Same as the upcall path below */
+        std_info->DeletePending = nfs41_fcb->DeletePending;
+#ifdef DEBUG_FILE_QUERY
+        print_std_info(1, &nfs41_fcb->StandardInfo);
+#endif
+    }
+    return TRUE;
+}
+
+static BOOLEAN nfs41_fcb_attrcache_lookup(
+    IN OUT PRX_CONTEXT RxContext,
+    PNFS41_FCB nfs41_fcb,
+    PNFS41_FOBX nfs41_fobx)
+{
+    FILE_INFORMATION_CLASS InfoClass = RxContext->Info.FileInformationClass;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(RxContext->pRelevantSrvOpen->pVNetRoot);
+
+    if (RxContext->Info.LengthRemaining < 0)
+        return FALSE;
+    if (!nfs41_fcb_attrcache_copy(RxContext->pRelevantSrvOpen,
+        pVNetRootContext, nfs41_fcb, nfs41_fobx,
+        InfoClass, RxContext->Info.Buffer,
+        (ULONG)RxContext->Info.LengthRemaining))
+        return FALSE;
+
+    RxContext->Info.LengthRemaining -= nfs41_fcb_attrcache_infolen(InfoClass);
+    return TRUE;
+}
+
+#ifdef NFS41_DRIVER_FASTIO_QUERYINFO
+/*
+ * Fast I/O |FileBasicInformation|/|FileStandardInformation| queries
+ *
+ * RDBSS does not provide |FastIoQueryBasicInfo|/
+ * |FastIoQueryStandardInfo|, so every |GetFileAttributesEx()|-style
+ * query on an open handle built an IRP and went through
+ * |nfs41_FsdDispatch()| just to be answered from the FCB attribute
+ * cache. These callbacks answer from the cache directly, and return
+ * |FALSE| (so that the I/O manager falls back to an IRP) for
+ * everything the cache cannot answer.
+ */
+static BOOLEAN nfs41_FastIoQueryInfo(
+    IN PFILE_OBJECT FileObject,
+    IN FILE_INFORMATION_CLASS InfoClass,
+    OUT PVOID Buffer,
+    IN ULONG BufferLength,
+    OUT PIO_STATUS_BLOCK IoStatus)
+{
+    PMRX_FCB fcb = (PMRX_FCB)FileObject->FsContext;
+    PMRX_FOBX fobx = (PMRX_FOBX)FileObject->FsContext2;
+    PNFS41_FCB nfs41_fcb;
+    PNFS41_FOBX nfs41_fobx;
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext;
+    LONG gen;
+
+    if ((fcb == NULL) || (fobx == NULL) ||
+        FlagOn(FileObject->Flags, FO_CLEANUP_COMPLETE))
+        return FALSE;
+    /* skip net root, IPC and other non-file opens */
+    if (((NodeType(fcb) != RDBSS_NTC_STORAGE_TYPE_FILE) &&
+        (NodeType(fcb) != RDBSS_NTC_STORAGE_TYPE_DIRECTORY)) ||
+        (NodeType(fobx) != RDBSS_NTC_FOBX))
+        return FALSE;
+
+    nfs41_fcb = NFS41GetFcbExtension(fcb);
+    nfs41_fobx = NFS41GetFobxExtension(fobx);
+    if ((nfs41_fcb == NULL) || (nfs41_fobx == NULL) ||
+        (fobx->pSrvOpen == NULL))
+        return FALSE;
+    pVNetRootContext = NFS41GetVNetRootExtension(fobx->pSrvOpen->pVNetRoot);
+    if (pVNetRootContext == NULL)
+        return FALSE;
+
+    /* no FCB lock here, retry with an IRP if the cache was invalidated */
+    gen = InterlockedCompareExchange(&nfs41_fcb->attrcache_gen, 0, 0);
+    if (!nfs41_fcb_attrcache_copy(fobx->pSrvOpen,
+        pVNetRootContext, nfs41_fcb, nfs41_fobx,
+        InfoClass, Buffer, BufferLength))
+        return FALSE;
+    if (InterlockedCompareExchange(&nfs41_fcb->attrcache_gen, 0, 0) != gen)
+        return FALSE;
+
+    IoStatus->Status = STATUS_SUCCESS;
+    IoStatus->Information = BufferLength;
+    return TRUE;
+}
+
+BOOLEAN nfs41_FastIoQueryBasicInfo(
+    IN PFILE_OBJECT FileObject,
+    IN BOOLEAN Wait,
+    OUT PFILE_BASIC_INFORMATION Buffer,
+    OUT PIO_STATUS_BLOCK IoStatus,
+    IN PDEVICE_OBJECT DeviceObject)
+{
+    UNREFERENCED_PARAMETER(Wait);
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    return nfs41_FastIoQueryInfo(FileObject, FileBasicInformation,
+        Buffer, sizeof(FILE_BASIC_INFORMATION), IoStatus);
+}
+
+BOOLEAN nfs41_FastIoQueryStandardInfo(
+    IN PFILE_OBJECT FileObject,
+    IN BOOLEAN Wait,
+    OUT PFILE_STANDARD_INFORMATION Buffer,
+    OUT PIO_STATUS_BLOCK IoStatus,
+    IN PDEVICE_OBJECT DeviceObject)
+{
+    UNREFERENCED_PARAMETER(Wait);
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    return nfs41_FastIoQueryInfo(FileObject, FileStandardInformation,
+        Buffer, sizeof(FILE_STANDARD_INFORMATION), IoStatus);
+}
+#endif /* NFS41_DRIVER_FASTIO_QUERYINFO */
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+/*
+ * Deferred SETATTRs
+ *
+ * Timestamp-only |FileBasicInformation| changes (e.g. an archiver
+ * restoring the mtime of each file it extracts) and the
+ * |FileEndOfFileInformation| RDBSS sets at cleanup are kept on the
+ * FOBX and sent with |NFS41_SYSOP_CLOSE|, where the daemon puts them
+ * into one SETATTR in the same compound as the CLOSE.
+ * This is only done for regular files opened for writing, and only
+ * for absolute timestamps (not -1/-2, which stop/resume automatic
+ * updates). Since the SETATTR comes after all writes of the handle,
+ * the writes cannot change the mtime which was set.
+ *
+ * Returns |TRUE| if the change has been deferred.
+ */
+static
+BOOLEAN nfs41_fobx_defer_setattr(
+    IN PRX_CONTEXT RxContext,
+    IN FILE_INFORMATION_CLASS InfoClass,
+    IN BOOLEAN at_cleanup)
+{
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+
+    if (nfs41_fcb->StandardInfo.Directory ||
+        nfs41_fcb->DeletePending ||
+        !(RxContext->pRelevantSrvOpen->DesiredAccess & FILE_WRITE_DATA))
+        return FALSE;
+
+    switch (InfoClass) {
+    case FileBasicInformation:
+    {
+        const FILE_BASIC_INFORMATION *binfo =
+            (const FILE_BASIC_INFORMATION *)RxContext->Info.Buffer;
+        PFILE_BASIC_INFORMATION pending = &nfs41_fobx->setattr_basic;
+
+        if ((RxContext->Info.Length < sizeof(FILE_BASIC_INFORMATION)) ||
+            binfo->FileAttributes ||
+            (binfo->CreationTime.QuadPart < 0) ||
+            (binfo->LastAccessTime.QuadPart < 0) ||
+            (binfo->LastWriteTime.QuadPart < 0) ||
+            (binfo->ChangeTime.QuadPart < 0))
+            return FALSE;
+
+        if (!(nfs41_fobx->setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO))
+            RtlZeroMemory(pending, sizeof(FILE_BASIC_INFORMATION));
+
+        /* a zero timestamp means "do not change" */
+        if (binfo->CreationTime.QuadPart) {
+            pending->CreationTime = binfo->CreationTime;
+            nfs41_fcb->BasicInfo.CreationTime = binfo->CreationTime;
+        }
+        if (binfo->LastAccessTime.QuadPart) {
+            pending->LastAccessTime = binfo->LastAccessTime;
+            nfs41_fcb->BasicInfo.LastAccessTime = binfo->LastAccessTime;
+        }
+        if (binfo->LastWriteTime.QuadPart) {
+            pending->LastWriteTime = binfo->LastWriteTime;
+            nfs41_fcb->BasicInfo.LastWriteTime = binfo->LastWriteTime;
+        }
+        if (binfo->ChangeTime.QuadPart) {
+            pending->ChangeTime = binfo->ChangeTime;
+            nfs41_fcb->BasicInfo.ChangeTime = binfo->ChangeTime;
+        }
+        nfs41_fobx->setattr_flags |= NFS41_CLOSE_FLAG_SET_BASICINFO;
+        return TRUE;
+    }
+    case FileEndOfFileInformation:
+    {
+        const FILE_END_OF_FILE_INFORMATION *einfo =
+            (const FILE_END_OF_FILE_INFORMATION *)RxContext->Info.Buffer;
+
+        /* a truncate by the application must happen right away */
+        if (!at_cleanup ||
+            (RxContext->Info.Length < sizeof(FILE_END_OF_FILE_INFORMATION)))
+            return FALSE;
+
+        nfs41_fobx->setattr_eof = einfo->EndOfFile;
+        nfs41_fcb->StandardInfo.EndOfFile = einfo->EndOfFile;
+        nfs41_fobx->setattr_flags |= NFS41_CLOSE_FLAG_SET_EOF;
+        return TRUE;
+    }
+    default:
+        return FALSE;
+    }
+}
+
+/*
+ * Fill the zero timestamps of |binfo| with the deferred ones and
+ * forget them, for a |FileBasicInformation| which is sent right away
+ */
+static
+void nfs41_fobx_merge_deferred_basicinfo(
+    IN OUT PNFS41_FOBX nfs41_fobx,
+    IN OUT PFILE_BASIC_INFORMATION binfo)
+{
+    const FILE_BASIC_INFORMATION *pending = &nfs41_fobx->setattr_basic;
+
+    if (!(nfs41_fobx->setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO))
+        return;
+
+    if (binfo->CreationTime.QuadPart == 0)
+        binfo->CreationTime = pending->CreationTime;
+    if (binfo->LastAccessTime.QuadPart == 0)
+        binfo->LastAccessTime = pending->LastAccessTime;
+    if (binfo->LastWriteTime.QuadPart == 0)
+        binfo->LastWriteTime = pending->LastWriteTime;
+    if (binfo->ChangeTime.QuadPart == 0)
+        binfo->ChangeTime = pending->ChangeTime;
+    nfs41_fobx->setattr_flags &= ~NFS41_CLOSE_FLAG_SET_BASICINFO;
+}
+
+/*
+ * Put the deferred timestamps into the reply of a query, the server
+ * does not have them yet. |FILE_NETWORK_OPEN_INFORMATION| starts with
+ * the same four timestamps as |FILE_BASIC_INFORMATION|
+ */
+static
+void nfs41_fobx_overlay_deferred_basicinfo(
+    IN PNFS41_FOBX nfs41_fobx,
+    IN OUT PFILE_BASIC_INFORMATION binfo)
+{
+    const FILE_BASIC_INFORMATION *pending = &nfs41_fobx->setattr_basic;
+
+    if (!(nfs41_fobx->setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO))
+        return;
+
+    if (pending->CreationTime.QuadPart)
+        binfo->CreationTime = pending->CreationTime;
+    if (pending->LastAccessTime.QuadPart)
+        binfo->LastAccessTime = pending->LastAccessTime;
+    if (pending->LastWriteTime.QuadPart)
+        binfo->LastWriteTime = pending->LastWriteTime;
+    if (pending->ChangeTime.QuadPart)
+        binfo->ChangeTime = pending->ChangeTime;
+}
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+/*
+ * Fill in the per-handle parts of a |FILE_STAT_INFORMATION| or
+ * |FILE_STAT_LX_INFORMATION| (which starts with the same fields),
+ * the FCB attribute cache and the daemon only know the file
+ */
+static
+void nfs41_statinfo_fixup(
+    IN PRX_CONTEXT RxContext,
+    IN PNFS41_FOBX nfs41_fobx,
+    IN OUT PFILE_STAT_INFORMATION stat_info)
+{
+    ACCESS_MASK access = RxContext->pRelevantSrvOpen->DesiredAccess;
+
+    if (access & MAXIMUM_ALLOWED) {
+        access &= ~MAXIMUM_ALLOWED;
+        access |= FILE_GENERIC_READ|FILE_GENERIC_WRITE|FILE_GENERIC_EXECUTE;
+    }
+    stat_info->EffectiveAccess = access;
+
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    if (nfs41_fobx->setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO) {
+        FILE_BASIC_INFORMATION binfo;
+
+        binfo.CreationTime = stat_info->CreationTime;
+        binfo.LastAccessTime = stat_info->LastAccessTime;
+        binfo.LastWriteTime = stat_info->LastWriteTime;
+        binfo.ChangeTime = stat_info->ChangeTime;
+        nfs41_fobx_overlay_deferred_basicinfo(nfs41_fobx, &binfo);
+        stat_info->CreationTime = binfo.CreationTime;
+        stat_info->LastAccessTime = binfo.LastAccessTime;
+        stat_info->LastWriteTime = binfo.LastWriteTime;
+        stat_info->ChangeTime = binfo.ChangeTime;
+    }
+#else
+    UNREFERENCED_PARAMETER(nfs41_fobx);
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+}
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
+
 NTSTATUS nfs41_QueryFileInformation(
     IN OUT PRX_CONTEXT RxContext)
 {
@@ -211,6 +722,17 @@ NTSTATUS nfs41_QueryFileInformation(
         NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
     __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
     __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+    LONG attrcache_gen = 0;
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+    /*
+     * |FileStatInformation| and |FileStatLxInformation| queries both
+     * fetch |FileStatLxInformation| into |statlx|
+     */
+    FILE_STAT_LX_INFORMATION statlx;
+    BOOLEAN stat_query = FALSE;
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
 #ifdef ENABLE_TIMINGS
     LARGE_INTEGER t1, t2;
     t1 = KeQueryPerformanceCounter(NULL);
@@ -389,15 +911,61 @@ NTSTATUS nfs41_QueryFileInformation(
     }
     case FileBasicInformation:
     case FileStandardInformation:
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+        if (nfs41_fcb_attrcache_lookup(RxContext, nfs41_fcb, nfs41_fobx)) {
+            status = STATUS_SUCCESS;
+            goto out;
+        }
+        attrcache_gen =
+            InterlockedCompareExchange(&nfs41_fcb->attrcache_gen, 0, 0);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+        break;
     case FileInternalInformation:
-    case FileAttributeTagInformation:
-    case FileNetworkOpenInformation:
-    case FileRemoteProtocolInformation:
-    case FileIdInformation:
+        /* The fileid never changes, the OPEN reply had it */
+        if (nfs41_fcb->fileid != 0ULL) {
+            PFILE_INTERNAL_INFORMATION info =
+                (PFILE_INTERNAL_INFORMATION)RxContext->Info.Buffer;
+
+            if (RxContext->Info.LengthRemaining <
+                sizeof(FILE_INTERNAL_INFORMATION)) {
+                RxContext->InformationToReturn =
+                    sizeof(FILE_INTERNAL_INFORMATION);
+                status = STATUS_BUFFER_TOO_SMALL;
+                goto out;
+            }
+            info->IndexNumber.QuadPart = (LONGLONG)nfs41_fcb->fileid;
+            RxContext->Info.LengthRemaining -=
+                sizeof(FILE_INTERNAL_INFORMATION);
+            status = STATUS_SUCCESS;
+            goto out;
+        }
+        break;
 #ifdef NFS41_DRIVER_WSL_SUPPORT
     case FileStatInformation:
     case FileStatLxInformation:
+        if (RxContext->Info.LengthRemaining <
+            (LONG)NFS41_STATINFO_LEN(InfoClass)) {
+            RxContext->InformationToReturn = NFS41_STATINFO_LEN(InfoClass);
+            status = STATUS_BUFFER_TOO_SMALL;
+            goto out;
+        }
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+        if (nfs41_fcb_attrcache_lookup(RxContext, nfs41_fcb, nfs41_fobx)) {
+            nfs41_statinfo_fixup(RxContext, nfs41_fobx,
+                (PFILE_STAT_INFORMATION)RxContext->Info.Buffer);
+            status = STATUS_SUCCESS;
+            goto out;
+        }
+        attrcache_gen =
+            InterlockedCompareExchange(&nfs41_fcb->attrcache_gen, 0, 0);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+        stat_query = TRUE;
+        break;
 #endif /* NFS41_DRIVER_WSL_SUPPORT */
+    case FileAttributeTagInformation:
+    case FileNetworkOpenInformation:
+    case FileRemoteProtocolInformation:
+    case FileIdInformation:
         break;
     default:
         print_error("nfs41_QueryFileInformation: "
@@ -415,10 +983,18 @@ NTSTATUS nfs41_QueryFileInformation(
             (long)status);
         goto out;
     }
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.QueryFile.InfoClass = InfoClass;
     entry->u.QueryFile.buf = RxContext->Info.Buffer;
     entry->u.QueryFile.buf_len = RxContext->Info.LengthRemaining;
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+    if (stat_query) {
+        entry->u.QueryFile.InfoClass = FileStatLxInformation;
+        entry->u.QueryFile.buf = &statlx;
+        entry->u.QueryFile.buf_len = sizeof(statlx);
+    }
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
 
     status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
     if (status) {
@@ -441,13 +1017,38 @@ NTSTATUS nfs41_QueryFileInformation(
         InterlockedIncrement(&getattr.sops);
         InterlockedAdd64(&getattr.size, entry->u.QueryFile.buf_len);
 #endif
+#ifdef NFS41_DRIVER_WSL_SUPPORT
+        if (stat_query) {
+            RtlCopyMemory(&nfs41_fcb->StatLxInfo, &statlx, sizeof(statlx));
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+            nfs41_fcb_attrcache_update(nfs41_fcb, FileStatLxInformation,
+                attrcache_gen);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+            entry->u.QueryFile.buf_len = NFS41_STATINFO_LEN(InfoClass);
+            RtlCopyMemory(RxContext->Info.Buffer, &statlx,
+                entry->u.QueryFile.buf_len);
+            nfs41_statinfo_fixup(RxContext, nfs41_fobx,
+                (PFILE_STAT_INFORMATION)RxContext->Info.Buffer);
+        }
+#endif /* NFS41_DRIVER_WSL_SUPPORT */
         RxContext->Info.LengthRemaining -= entry->u.QueryFile.buf_len;
         status = STATUS_SUCCESS;
 
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+        if ((InfoClass == FileBasicInformation) ||
+            (InfoClass == FileNetworkOpenInformation)) {
+            nfs41_fobx_overlay_deferred_basicinfo(nfs41_fobx,
+                (PFILE_BASIC_INFORMATION)RxContext->Info.Buffer);
+        }
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+
         switch (InfoClass) {
         case FileBasicInformation:
             RtlCopyMemory(&nfs41_fcb->BasicInfo, RxContext->Info.Buffer,
                 sizeof(nfs41_fcb->BasicInfo));
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+            nfs41_fcb_attrcache_update(nfs41_fcb, InfoClass, attrcache_gen);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
 #ifdef DEBUG_FILE_QUERY
             print_basic_info(1, &nfs41_fcb->BasicInfo);
 #endif
@@ -487,6 +1088,9 @@ NTSTATUS nfs41_QueryFileInformation(
             RtlCopyMemory(&nfs41_fcb->StandardInfo, RxContext->Info.Buffer,
                 sizeof(nfs41_fcb->StandardInfo));
             nfs41_fcb->StandardInfo.DeletePending = DeletePending;
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+            nfs41_fcb_attrcache_update(nfs41_fcb, InfoClass, attrcache_gen);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
 #ifdef DEBUG_FILE_QUERY
             print_std_info(1, &nfs41_fcb->StandardInfo);
 #endif
@@ -668,6 +1272,10 @@ NTSTATUS nfs41_SetFileInformation(
 #ifdef FORCE_POSIX_SEMANTICS_DELETE
     FILE_RENAME_INFORMATION rinfo;
 #endif /* FORCE_POSIX_SEMANTICS_DELETE */
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    FILE_BASIC_INFORMATION merged_binfo;
+    BOOLEAN use_merged_binfo = FALSE;
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
     __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
     __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
         NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
@@ -763,8 +1371,28 @@ NTSTATUS nfs41_SetFileInformation(
                 (PFILE_END_OF_FILE_INFORMATION)RxContext->Info.Buffer;
 
             nfs41_fcb->StandardInfo.EndOfFile.QuadPart = info->EndOfFile.QuadPart;
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+            /* this replaces a deferred size */
+            nfs41_fobx->setattr_flags &= ~NFS41_CLOSE_FLAG_SET_EOF;
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
             break;
         }
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    case FileBasicInformation:
+        if (nfs41_fobx_defer_setattr(RxContext, InfoClass, FALSE)) {
+            status = STATUS_SUCCESS;
+            goto out;
+        }
+        if ((nfs41_fobx->setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO) &&
+            (RxContext->Info.Length >= sizeof(FILE_BASIC_INFORMATION))) {
+            /* send the deferred timestamps with this one */
+            RtlCopyMemory(&merged_binfo, RxContext->Info.Buffer,
+                sizeof(FILE_BASIC_INFORMATION));
+            nfs41_fobx_merge_deferred_basicinfo(nfs41_fobx, &merged_binfo);
+            use_merged_binfo = TRUE;
+        }
+        break;
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
     case FileRenameInformation:
         {
             /* noop if filename and destination are the same */
@@ -784,6 +1412,10 @@ NTSTATUS nfs41_SetFileInformation(
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    nfs41_UpcallSetFcbFilename(entry, nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
 
     entry->u.SetFile.InfoClass = InfoClass;
 
@@ -797,6 +1429,13 @@ NTSTATUS nfs41_SetFileInformation(
     }
     else
 #endif /* FORCE_POSIX_SEMANTICS_DELETE */
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    if (use_merged_binfo) {
+        entry->u.SetFile.buf = &merged_binfo;
+        entry->u.SetFile.buf_len = sizeof(merged_binfo);
+    }
+    else
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
     {
         entry->u.SetFile.buf = RxContext->Info.Buffer;
         entry->u.SetFile.buf_len = RxContext->Info.Length;
@@ -807,6 +1446,52 @@ NTSTATUS nfs41_SetFileInformation(
 #endif
 
     status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+    /* Even a failed or timed-out SETATTR may have changed the file */
+    nfs41_fcb_attrcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    nfs41_fcb_aclcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    /* Truncate, allocate, rename over an existing file, ... */
+    nfs41_volcache_invalidate(pVNetRootContext);
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+    /*
+     * Renames and hardlinks add a new name. A renamed dir changes all
+     * paths below it, for files only the parent dir of the new name
+     * is affected (temp file + rename in build systems)
+     */
+    if ((InfoClass == FileRenameInformation) ||
+        (InfoClass == FileLinkInformation)) {
+        /* |entry| might be gone after a timeout */
+        const FILE_RENAME_INFORMATION *nameinfo =
+            (const FILE_RENAME_INFORMATION *)RxContext->Info.Buffer;
+        UNICODE_STRING dst;
+
+        if ((InfoClass == FileRenameInformation) &&
+            nfs41_fcb->StandardInfo.Directory) {
+            nfs41_negcache_invalidate(pNetRootContext);
+        }
+        else if ((RxContext->Info.FileInformationClass != InfoClass) ||
+            (nameinfo->FileNameLength == 0)) {
+            /* silly rename within the same dir */
+            nfs41_negcache_invalidate_parent(pNetRootContext,
+                SrvOpen->pAlreadyPrefixedName);
+        }
+        else {
+            /*
+             * |FILE_LINK_INFORMATION| has the same layout for
+             * |FileName| and |FileNameLength|
+             */
+            dst.Length = dst.MaximumLength =
+                (USHORT)nameinfo->FileNameLength;
+            dst.Buffer = (PWCH)nameinfo->FileName;
+            nfs41_negcache_invalidate_parent(pNetRootContext, &dst);
+        }
+    }
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
     if (status) {
         /* Timeout - |nfs41_downcall()| will free |entry|+contents */
         entry = NULL;
@@ -815,7 +1500,8 @@ NTSTATUS nfs41_SetFileInformation(
 
     status = map_setfile_error(entry->status);
     if (!status) {
-        if (!nfs41_fobx->deleg_type && entry->ChangeTime &&
+        if (!nfs41_fobx_deleg_type(SrvOpen, nfs41_fobx) &&
+                entry->ChangeTime &&
                 (SrvOpen->DesiredAccess &
                 (FILE_READ_DATA | FILE_WRITE_DATA | FILE_APPEND_DATA)))
             nfs41_update_fcb_list(RxContext->pFcb, entry->ChangeTime);
@@ -846,7 +1532,19 @@ NTSTATUS nfs41_SetFileInformationAtCleanup(
 {
     NTSTATUS status;
     DbgEn();
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    /* sent with the CLOSE, see |nfs41_fobx_defer_setattr()| */
+    if ((check_nfs41_setattr_args(RxContext) == STATUS_SUCCESS) &&
+        nfs41_fobx_defer_setattr(RxContext,
+            RxContext->Info.FileInformationClass, TRUE)) {
+        status = STATUS_SUCCESS;
+        goto out;
+    }
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
     status = nfs41_SetFileInformation(RxContext);
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+out:
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
     DbgEx();
     return status;
 }
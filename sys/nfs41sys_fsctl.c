@@ -162,6 +162,7 @@ NTSTATUS nfs41_QueryAllocatedRanges(
 
     if (status)
         goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.QueryAllocatedRanges.inrange = *in_range_buffer;
     entry->u.QueryAllocatedRanges.BufferSize = out_range_buffer_len;
@@ -501,10 +502,14 @@ NTSTATUS nfs41_SetZeroData(
 
     if (status)
         goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.SetZeroData.setzerodata = *setzerodatabuffer;
 
     status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    nfs41_volcache_invalidate(pVNetRootContext);
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
     if (status) {
         /* Timeout - |nfs41_downcall()| will free |entry|+contents */
         entry = NULL;
@@ -805,6 +810,7 @@ NTSTATUS nfs41_DuplicateData(
 
     if (status)
         goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.DuplicateData.src_state = nfs41_src_fobx->nfs41_open_state;
     entry->u.DuplicateData.srcfileoffset = dd.srcfileoffset;
@@ -816,6 +822,9 @@ NTSTATUS nfs41_DuplicateData(
         EXTRA_TIMEOUT_PER_BYTE(entry->u.DuplicateData.bytecount);
 
     status = nfs41_UpcallWaitForReply(entry, io_delay);
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    nfs41_volcache_invalidate(pVNetRootContext);
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
     if (status) {
         /* Timeout - |nfs41_downcall()| will free |entry|+contents */
         entry = NULL;
@@ -1312,6 +1321,7 @@ NTSTATUS nfs41_OffloadWrite(
 
     if (status)
         goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.DuplicateData.src_state = nfs41_src_fobx->nfs41_open_state;
     entry->u.DuplicateData.srcfileoffset = dd.srcfileoffset;
@@ -1323,6 +1333,9 @@ NTSTATUS nfs41_OffloadWrite(
         EXTRA_TIMEOUT_PER_BYTE(entry->u.DuplicateData.bytecount);
 
     status = nfs41_UpcallWaitForReply(entry, io_delay);
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    nfs41_volcache_invalidate(pVNetRootContext);
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
     if (status) {
         /* Timeout - |nfs41_downcall()| will free |entry|+contents */
         entry = NULL;
@@ -1361,6 +1374,144 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+static
+NTSTATUS nfs41_CacheControl(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    NTSTATUS status = STATUS_INVALID_DEVICE_REQUEST;
+    nfs41_updowncall_entry *entry = NULL;
+    __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
+    __notnull PNFS41_NETROOT_EXTENSION pNetRootContext =
+        NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
+    __notnull XXCTL_LOWIO_COMPONENT *FsCtl =
+        &RxContext->LowIoContext.ParamsFor.FsCtl;
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+    ULONG op;
+
+    DbgEn();
+
+    RxContext->IoStatusBlock.Information = 0;
+
+    if (FsCtl->pInputBuffer == NULL) {
+        status = STATUS_INVALID_USER_BUFFER;
+        goto out;
+    }
+
+    if (FsCtl->InputBufferLength < sizeof(ULONG)) {
+        DbgP("nfs41_CacheControl: buffer to small\n");
+        status = STATUS_BUFFER_TOO_SMALL;
+        goto out;
+    }
+
+    op = *(const ULONG *)FsCtl->pInputBuffer;
+    if ((op != NFS41_CACHE_CONTROL_PIN) &&
+        (op != NFS41_CACHE_CONTROL_UNPIN) &&
+        (op != NFS41_CACHE_CONTROL_FLUSH)) {
+        DbgP("nfs41_CacheControl: invalid op=%lu\n", (unsigned long)op);
+        status = STATUS_INVALID_PARAMETER;
+        goto out;
+    }
+
+    DbgP("nfs41_CacheControl: op=%lu name='%wZ'\n",
+        (unsigned long)op, SrvOpen->pAlreadyPrefixedName);
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_FSCTL_CACHE_CONTROL,
+        &nfs41_fobx->sec_ctx,
+        pVNetRootContext->session,
+        nfs41_fobx->nfs41_open_state,
+        pNetRootContext->nfs41d_version,
+        SrvOpen->pAlreadyPrefixedName,
+        &entry);
+
+    if (status)
+        goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+
+    entry->u.CacheControl.op = op;
+
+    status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        goto out;
+    }
+
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    if (op == NFS41_CACHE_CONTROL_FLUSH)
+        nfs41_volcache_invalidate(pVNetRootContext);
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
+    if (op == NFS41_CACHE_CONTROL_FLUSH) {
+        __notnull PNFS41_FCB nfs41_fcb =
+            NFS41GetFcbExtension(RxContext->pFcb);
+
+        /* ends the "immutable" lifetime of all cached FCB data */
+        (void)InterlockedExchange(&pVNetRootContext->cache_flush_time,
+            (LONG)nfs41_get_interrupttime_msecs());
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+        nfs41_fcb_attrcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+        nfs41_fcb_aclcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
+    }
+
+    if (!entry->status) {
+        DbgP("nfs41_CacheControl: SUCCESS\n");
+        RxContext->CurrentIrp->IoStatus.Status = STATUS_SUCCESS;
+    }
+    else {
+        DbgP("nfs41_CacheControl: "
+            "FAILURE, entry->status=0x%lx\n", entry->status);
+        status = map_setfile_error(entry->status);
+        RxContext->CurrentIrp->IoStatus.Status = status;
+    }
+
+out:
+    if (entry) {
+        nfs41_UpcallDestroy(entry);
+    }
+
+    DbgEx();
+    return status;
+}
+
+NTSTATUS marshal_nfs41_cachecontrol(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG header_len = 0;
+    unsigned char *tmp = buf;
+
+    status = marshal_nfs41_header(entry, tmp, buf_len, len);
+    if (status)
+        goto out;
+    tmp += *len;
+
+    header_len = *len + sizeof(entry->u.CacheControl.op);
+    if (header_len > buf_len) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+    RtlCopyMemory(tmp, &entry->u.CacheControl.op,
+        sizeof(entry->u.CacheControl.op));
+    tmp += sizeof(entry->u.CacheControl.op);
+
+    *len = (ULONG)(tmp - buf);
+
+    DbgP("marshal_nfs41_cachecontrol: name='%wZ' op=%lu\n",
+         entry->filename, (unsigned long)entry->u.CacheControl.op);
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
+
 NTSTATUS nfs41_FsCtl(
     IN OUT PRX_CONTEXT RxContext)
 {
@@ -1399,6 +1550,11 @@ NTSTATUS nfs41_FsCtl(
     case FSCTL_OFFLOAD_WRITE:
         status = nfs41_OffloadWrite(RxContext);
         break;
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+    case FSCTL_NFS41_CACHE_CONTROL:
+        status = nfs41_CacheControl(RxContext);
+        break;
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
     case FSCTL_SET_PURGE_FAILURE_MODE:
         /*
          * We explicitly return here |STATUS_INVALID_DEVICE_REQUEST|, because
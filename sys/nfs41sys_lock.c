@@ -302,6 +302,7 @@ NTSTATUS nfs41_Lock(
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.Lock.offset = LowIoContext->ParamsFor.Locks.ByteOffset;
     entry->u.Lock.length = LowIoContext->ParamsFor.Locks.Length;
@@ -416,6 +417,7 @@ NTSTATUS nfs41_Unlock(
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     if (LowIoContext->Operation == LOWIO_OP_UNLOCK_MULTIPLE) {
         entry->u.Unlock.count = unlock_list_count(
@@ -459,3 +461,149 @@ out:
 #endif
     return status;
 }
+
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+/*
+ * Delegated lock buffering
+ *
+ * While the daemon holds a write delegation |nfs41_Create()| sets
+ * |FCB_STATE_LOCK_BUFFERING_ENABLED|, and RDBSS grants and releases
+ * byte-range locks in the FCB's FsRtl file lock without calling
+ * |nfs41_Lock()|/|nfs41_Unlock()|. No other client can lock the file
+ * while the delegation is held, so only local conflicts matter.
+ *
+ * On recall |nfs41_invalidate_cache()| calls
+ * |nfs41_lock_buffering_recall()|, which posts
+ * |nfs41_lock_buffering_push()| to a worker thread: The
+ * |IOCTL_NFS41_INVALCACHE| downcall must not wait for the FCB, its
+ * owner might be waiting for the daemon (e.g. |nfs41_Create()| or a
+ * rename which caused the delegation return).
+ * The worker turns lock buffering off with the FCB held exclusively,
+ * and sends the locks held in the FCB as |NFS41_SYSOP_LOCK| upcalls.
+ * The delegation is already being returned, so the daemon converts
+ * the open (|nfs41_delegation_to_open()|) and sends each lock to the
+ * server as a LOCK. Until then |lock_push_pending| keeps
+ * |nfs41_ComputeNewBufferingState()| from turning lock buffering off,
+ * so locks taken in the meantime are granted locally and pushed too.
+ * A lock which the server does not grant is still held locally,
+ * |NFS41_FOBX.locks_lost| makes further reads and writes through
+ * that file object fail.
+ */
+static NTSTATUS push_buffered_lock(
+    IN PFILE_LOCK_INFO lkinfo)
+{
+    NTSTATUS status;
+    nfs41_updowncall_entry *entry = NULL;
+    __notnull PMRX_FOBX Fobx = (PMRX_FOBX)lkinfo->FileObject->FsContext2;
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(Fobx);
+    __notnull PMRX_SRV_OPEN SrvOpen = Fobx->pSrvOpen;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
+    __notnull PNFS41_NETROOT_EXTENSION pNetRootContext =
+        NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_LOCK, &nfs41_fobx->sec_ctx,
+        pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
+        pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
+    if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+
+    entry->u.Lock.offset = lkinfo->StartingByte.QuadPart;
+    entry->u.Lock.length = lkinfo->Length.QuadPart;
+    entry->u.Lock.exclusive = lkinfo->ExclusiveLock;
+    /* The range is already granted locally, never wait */
+    entry->u.Lock.blocking = FALSE;
+
+    status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        goto out;
+    }
+
+    status = map_lock_errors(entry->status);
+
+out:
+    if (entry) {
+        nfs41_UpcallDestroy(entry);
+    }
+    return status;
+}
+
+static VOID nfs41_lock_buffering_push(
+    IN PVOID Context)
+{
+    __notnull PMRX_SRV_OPEN SrvOpen = (PMRX_SRV_OPEN)Context;
+    __notnull PMRX_FCB Fcb = SrvOpen->pFcb;
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(Fcb);
+    PFILE_LOCK filelock = &((PFCB)Fcb)->Specific.Fcb.FileLock;
+    PFILE_LOCK_INFO lkinfo;
+    NTSTATUS status;
+
+    /*
+     * Hold the FCB exclusively so RDBSS cannot grant another lock
+     * locally between turning lock buffering off and the end of the
+     * enumeration
+     */
+    (void)RxAcquireExclusiveFcbResourceInMRx(Fcb);
+    ClearFlag(SrvOpen->BufferingFlags, FCB_STATE_LOCK_BUFFERING_ENABLED);
+    ClearFlag(Fcb->FcbState, FCB_STATE_LOCK_BUFFERING_ENABLED);
+    InterlockedExchange(&nfs41_fcb->lock_push_pending, 0);
+
+    for (lkinfo = FsRtlGetNextFileLock(filelock, TRUE);
+        lkinfo != NULL;
+        lkinfo = FsRtlGetNextFileLock(filelock, FALSE)) {
+#ifdef DEBUG_LOCK
+        DbgP("nfs41_lock_buffering_push: '%wZ' offset=0x%llx "
+            "length=0x%llx exclusive=%d\n",
+            SrvOpen->pAlreadyPrefixedName,
+            (long long)lkinfo->StartingByte.QuadPart,
+            (long long)lkinfo->Length.QuadPart,
+            (int)lkinfo->ExclusiveLock);
+#endif
+        status = push_buffered_lock(lkinfo);
+        if (status) {
+            print_error("nfs41_lock_buffering_push: '%wZ': "
+                "lock offset=0x%llx length=0x%llx failed, "
+                "status=0x%lx\n",
+                SrvOpen->pAlreadyPrefixedName,
+                (long long)lkinfo->StartingByte.QuadPart,
+                (long long)lkinfo->Length.QuadPart,
+                (long)status);
+            NFS41GetFobxExtension(
+                (PMRX_FOBX)lkinfo->FileObject->FsContext2)->locks_lost =
+                TRUE;
+        }
+    }
+
+    RxReleaseFcbResourceInMRx(Fcb);
+    RxDereferenceSrvOpen(SrvOpen, LHS_LockNotHeld);
+}
+
+void nfs41_lock_buffering_recall(
+    IN PRDBSS_DEVICE_OBJECT DeviceObject,
+    IN OUT PMRX_SRV_OPEN SrvOpen)
+{
+    __notnull PMRX_FCB Fcb = SrvOpen->pFcb;
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(Fcb);
+    NTSTATUS status;
+
+    if (!FlagOn(Fcb->FcbState, FCB_STATE_LOCK_BUFFERING_ENABLED))
+        return;
+    /* Another recall has already posted the push */
+    if (InterlockedCompareExchange(&nfs41_fcb->lock_push_pending, 1, 0))
+        return;
+
+    RxReferenceSrvOpen(SrvOpen);
+    status = RxPostToWorkerThread(DeviceObject, DelayedWorkQueue,
+        &nfs41_fcb->lock_push_workitem, nfs41_lock_buffering_push, SrvOpen);
+    if (status != STATUS_SUCCESS) {
+        print_error("nfs41_lock_buffering_recall: '%wZ': "
+            "RxPostToWorkerThread() failed, status=0x%lx, "
+            "locally held locks are not sent to the server\n",
+            SrvOpen->pAlreadyPrefixedName, (long)status);
+        InterlockedExchange(&nfs41_fcb->lock_push_pending, 0);
+        RxDereferenceSrvOpen(SrvOpen, LHS_LockNotHeld);
+    }
+}
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
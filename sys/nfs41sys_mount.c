@@ -109,7 +109,7 @@ NTSTATUS marshal_nfs41_mount(
     tmp += *len;
 
     header_len = *len + length_as_utf8(entry->u.Mount.srv_name) +
-        length_as_utf8(entry->u.Mount.root) + 5 * sizeof(DWORD)
+        length_as_utf8(entry->u.Mount.root) + 21 * sizeof(DWORD)
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
         + 2 * sizeof(tristate_bool)
 #endif /* NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS */
@@ -132,6 +132,38 @@ NTSTATUS marshal_nfs41_mount(
     tmp += sizeof(DWORD);
     RtlCopyMemory(tmp, &entry->u.Mount.nfsvers, sizeof(DWORD));
     tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.nconnect, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.acregmin, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.acregmax, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.acdirmin, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.acdirmax, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.namecachesize, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.closetimeo, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.sparsewrite, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.sockbuf, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.keepalive, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.sockflags, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.fsc, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.maxbw, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.maxiops, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.autotune, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.immutable, sizeof(DWORD));
+    tmp += sizeof(DWORD);
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
     RtlCopyMemory(tmp, &entry->u.Mount.force_case_preserving,
         sizeof(tristate_bool));
@@ -152,15 +184,35 @@ NTSTATUS marshal_nfs41_mount(
 #ifdef DEBUG_MARSHAL_DETAIL
     DbgP("marshal_nfs41_mount: server name='%wZ' mount point='%wZ' "
         "sec_flavor='%s' rsize=%d wsize=%d use_nfspubfh=%d "
+        "nfsvers=%d nconnect=%d "
+        "acregmin=%d acregmax=%d acdirmin=%d acdirmax=%d namecachesize=%d "
+        "closetimeo=%d sparsewrite=%d sockbuf=%d keepalive=%d "
+        "sockflags=0x%x fsc=%d maxbw=%d maxiops=%d autotune=%d immutable=%d"
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
-        "nfsvers=%d force_case_preserving=%d force_case_insensitive=%d\n"
+        " force_case_preserving=%d force_case_insensitive=%d"
 #endif /* NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS */
-        ,
+        "\n",
         entry->u.Mount.srv_name, entry->u.Mount.root,
         secflavorop2name(entry->u.Mount.sec_flavor),
         (int)entry->u.Mount.rsize, (int)entry->u.Mount.wsize,
         (int)entry->u.Mount.use_nfspubfh,
-        (int)entry->u.Mount.nfsvers
+        (int)entry->u.Mount.nfsvers,
+        (int)entry->u.Mount.nconnect,
+        (int)entry->u.Mount.acregmin,
+        (int)entry->u.Mount.acregmax,
+        (int)entry->u.Mount.acdirmin,
+        (int)entry->u.Mount.acdirmax,
+        (int)entry->u.Mount.namecachesize,
+        (int)entry->u.Mount.closetimeo,
+        (int)entry->u.Mount.sparsewrite,
+        (int)entry->u.Mount.sockbuf,
+        (int)entry->u.Mount.keepalive,
+        (int)entry->u.Mount.sockflags,
+        (int)entry->u.Mount.fsc,
+        (int)entry->u.Mount.maxbw,
+        (int)entry->u.Mount.maxiops,
+        (int)entry->u.Mount.autotune,
+        (int)entry->u.Mount.immutable
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
         ,
         (int)entry->u.Mount.force_case_preserving,
@@ -293,6 +345,25 @@ NTSTATUS nfs41_mount(
     entry->u.Mount.wsize = config->WriteSize;
     entry->u.Mount.use_nfspubfh = config->use_nfspubfh;
     entry->u.Mount.nfsvers = config->nfsvers;
+    entry->u.Mount.nconnect = config->nconnect;
+    entry->u.Mount.acregmin = config->acregmin;
+    entry->u.Mount.acregmax = config->acregmax;
+    entry->u.Mount.acdirmin = config->acdirmin;
+    entry->u.Mount.acdirmax = config->acdirmax;
+    entry->u.Mount.namecachesize = config->namecachesize;
+    entry->u.Mount.closetimeo = config->closetimeo;
+    entry->u.Mount.sparsewrite = config->sparsewrite;
+    entry->u.Mount.sockbuf = config->sockbuf;
+    entry->u.Mount.keepalive = config->keepalive;
+    entry->u.Mount.sockflags =
+        (config->nodelay?NFS41_MOUNT_SOCKOPT_NODELAY:0) |
+        (config->loopbackfastpath?NFS41_MOUNT_SOCKOPT_LOOPBACK_FASTPATH:0) |
+        (config->rssaffinity?NFS41_MOUNT_SOCKOPT_RSS_AFFINITY:0);
+    entry->u.Mount.fsc = config->fsc;
+    entry->u.Mount.maxbw = config->maxbw;
+    entry->u.Mount.maxiops = config->maxiops;
+    entry->u.Mount.autotune = config->autotune;
+    entry->u.Mount.immutable = config->immutable;
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
     entry->u.Mount.force_case_preserving = config->force_case_preserving;
     entry->u.Mount.force_case_insensitive = config->force_case_insensitive;
@@ -334,9 +405,18 @@ void nfs41_MountConfig_InitDefaults(
     Config->WriteSize = MOUNT_CONFIG_RW_SIZE_DEFAULT;
     Config->use_nfspubfh = FALSE;
     Config->nfsvers = NFS_VERSION_AUTONEGOTIATION;
+    Config->nconnect = MOUNT_CONFIG_NCONNECT_DEFAULT;
     Config->ReadOnly = FALSE;
     Config->write_thru = FALSE;
     Config->nocache = FALSE;
+    Config->sparsewrite = FALSE;
+    Config->fsc = FALSE;
+    Config->autotune = FALSE;
+    Config->nocto = FALSE;
+    Config->immutable = FALSE;
+    Config->nodelay = TRUE;
+    Config->loopbackfastpath = FALSE;
+    Config->rssaffinity = FALSE;
     Config->timebasedcoherency = FALSE; /* disabled by default because of bugs */
     Config->SrvName.Length = 0;
     Config->SrvName.MaximumLength = SERVER_NAME_BUFFER_SIZE;
@@ -349,6 +429,20 @@ void nfs41_MountConfig_InitDefaults(
     Config->SecFlavor.Buffer = Config->sec_flavor_buffer;
     RtlCopyUnicodeString(&Config->SecFlavor, &AUTH_SYS_NAME);
     Config->timeout = UPCALL_TIMEOUT_DEFAULT;
+    Config->volcachettl = MOUNT_CONFIG_VOLCACHETTL_DEFAULT;
+    Config->aclcachettl = MOUNT_CONFIG_ACLCACHETTL_DEFAULT;
+    Config->acregmin = MOUNT_CONFIG_ACREGMIN_DEFAULT;
+    Config->acregmax = MOUNT_CONFIG_ACREGMAX_DEFAULT;
+    Config->acdirmin = MOUNT_CONFIG_ACDIRMIN_DEFAULT;
+    Config->acdirmax = MOUNT_CONFIG_ACDIRMAX_DEFAULT;
+    Config->namecachesize = MOUNT_CONFIG_NAMECACHESIZE_DEFAULT;
+    Config->closetimeo = MOUNT_CONFIG_CLOSETIMEO_DEFAULT;
+    Config->sockbuf = NFS41_MOUNT_SOCKBUF_DEFAULT;
+    Config->keepalive = 0;
+    Config->readahead = 0;
+    Config->writebehind = 0;
+    Config->maxbw = 0;
+    Config->maxiops = 0;
     Config->dir_createmode.use_nfsv3attrsea_mode = TRUE;
     Config->dir_createmode.mode =
         NFS41_DRIVER_DEFAULT_DIR_CREATE_MODE;
@@ -361,6 +455,141 @@ void nfs41_MountConfig_InitDefaults(
 #endif /* NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS */
 }
 
+/*
+ * Mount option profiles
+ *
+ * "profile=<name>" sets several cache and I/O options at once for a
+ * typical workload. It is applied before all other options, so
+ * explicit options always override the profile's settings.
+ */
+typedef struct _NFS41_MOUNT_PROFILE {
+    LPCWSTR name;
+    DWORD ReadSize;
+    DWORD WriteSize;
+    BOOLEAN write_thru;
+    BOOLEAN nocache;
+    DWORD volcachettl;
+    DWORD aclcachettl;
+    DWORD acregmin;
+    DWORD acregmax;
+    DWORD acdirmin;
+    DWORD acdirmax;
+    DWORD closetimeo;
+} NFS41_MOUNT_PROFILE;
+
+static const NFS41_MOUNT_PROFILE nfs41_mount_profiles[] = {
+    /*
+     * "build": Source trees and compilers, which open, stat and close
+     * the same files over and over again: Long attribute/name cache
+     * timeouts and a long deferred close
+     */
+    {
+        .name = L"build",
+        .ReadSize = MOUNT_CONFIG_RW_SIZE_DEFAULT,
+        .WriteSize = MOUNT_CONFIG_RW_SIZE_DEFAULT,
+        .write_thru = FALSE,
+        .nocache = FALSE,
+        .volcachettl = 30,
+        .aclcachettl = 60,
+        .acregmin = 60,
+        .acregmax = 600,
+        .acdirmin = 60,
+        .acdirmax = 600,
+        .closetimeo = 10
+    },
+    /*
+     * "media": Large files read/written sequentially: Largest
+     * rsize/wsize, so RDBSS readahead and write-behind move big
+     * chunks
+     */
+    {
+        .name = L"media",
+        .ReadSize = MOUNT_CONFIG_RW_SIZE_MAX,
+        .WriteSize = MOUNT_CONFIG_RW_SIZE_MAX,
+        .write_thru = FALSE,
+        .nocache = FALSE,
+        .volcachettl = MOUNT_CONFIG_VOLCACHETTL_DEFAULT,
+        .aclcachettl = MOUNT_CONFIG_ACLCACHETTL_DEFAULT,
+        .acregmin = MOUNT_CONFIG_ACREGMIN_DEFAULT,
+        .acregmax = MOUNT_CONFIG_ACREGMAX_DEFAULT,
+        .acdirmin = MOUNT_CONFIG_ACDIRMIN_DEFAULT,
+        .acdirmax = MOUNT_CONFIG_ACDIRMAX_DEFAULT,
+        .closetimeo = MOUNT_CONFIG_CLOSETIMEO_DEFAULT
+    },
+    /*
+     * "db": Databases which do their own caching and locking: No
+     * RDBSS caching (and therefore no readahead), write-through, no
+     * attribute caching and no deferred close, so that locks and
+     * data are always seen by the server at once
+     */
+    {
+        .name = L"db",
+        .ReadSize = 1024*1024,
+        .WriteSize = 1024*1024,
+        .write_thru = TRUE,
+        .nocache = TRUE,
+        .volcachettl = MOUNT_CONFIG_VOLCACHETTL_DEFAULT,
+        .aclcachettl = 0,
+        .acregmin = 0,
+        .acregmax = 0,
+        .acdirmin = 0,
+        .acdirmax = 0,
+        .closetimeo = 0
+    },
+    /* "home": Home directories, same as the defaults */
+    {
+        .name = L"home",
+        .ReadSize = MOUNT_CONFIG_RW_SIZE_DEFAULT,
+        .WriteSize = MOUNT_CONFIG_RW_SIZE_DEFAULT,
+        .write_thru = FALSE,
+        .nocache = FALSE,
+        .volcachettl = MOUNT_CONFIG_VOLCACHETTL_DEFAULT,
+        .aclcachettl = MOUNT_CONFIG_ACLCACHETTL_DEFAULT,
+        .acregmin = MOUNT_CONFIG_ACREGMIN_DEFAULT,
+        .acregmax = MOUNT_CONFIG_ACREGMAX_DEFAULT,
+        .acdirmin = MOUNT_CONFIG_ACDIRMIN_DEFAULT,
+        .acdirmax = MOUNT_CONFIG_ACDIRMAX_DEFAULT,
+        .closetimeo = MOUNT_CONFIG_CLOSETIMEO_DEFAULT
+    }
+};
+
+static
+NTSTATUS nfs41_MountConfig_ApplyProfile(
+    IN PUNICODE_STRING usValue,
+    IN OUT PNFS41_MOUNT_CONFIG Config)
+{
+    const NFS41_MOUNT_PROFILE *p;
+    size_t i;
+
+    for (i = 0 ; i < ARRAYSIZE(nfs41_mount_profiles) ; i++) {
+        p = &nfs41_mount_profiles[i];
+
+        if ((usValue->Length == (wcslen(p->name)*sizeof(WCHAR))) &&
+            (wcsncmp(p->name, usValue->Buffer,
+                usValue->Length/sizeof(WCHAR)) == 0)) {
+            Config->ReadSize = p->ReadSize;
+            Config->WriteSize = p->WriteSize;
+            Config->write_thru = p->write_thru;
+            Config->nocache = p->nocache;
+            Config->volcachettl = p->volcachettl;
+            Config->aclcachettl = p->aclcachettl;
+            Config->acregmin = p->acregmin;
+            Config->acregmax = p->acregmax;
+            Config->acdirmin = p->acdirmin;
+            Config->acdirmax = p->acdirmax;
+            Config->closetimeo = p->closetimeo;
+
+            DbgP("nfs41_MountConfig_ApplyProfile: "
+                "applied profile '%ls'\n", p->name);
+            return STATUS_SUCCESS;
+        }
+    }
+
+    print_error("nfs41_MountConfig_ApplyProfile: "
+        "Unknown profile '%wZ'\n", usValue);
+    return STATUS_INVALID_PARAMETER;
+}
+
 static
 NTSTATUS nfs41_MountConfig_ParseBoolean(
     IN PFILE_FULL_EA_INFORMATION Option,
@@ -464,6 +693,32 @@ NTSTATUS nfs41_MountConfig_ParseOptions(
         goto out;
     }
 
+    /*
+     * Apply "profile=" first, so that the other options override the
+     * profile's settings regardless of their order
+     */
+    Option = EaBuffer;
+    for (;;) {
+        Name = (LPWSTR)Option->EaName;
+        NameLen = Option->EaNameLength/sizeof(WCHAR);
+
+        if (wcsncmp(L"profile", Name, NameLen) == 0) {
+            usValue.Length = usValue.MaximumLength = Option->EaValueLength;
+            usValue.Buffer = (PWCH)(Option->EaName +
+                Option->EaNameLength + sizeof(WCHAR));
+
+            status = nfs41_MountConfig_ApplyProfile(&usValue, Config);
+            if (status)
+                goto out;
+        }
+
+        if (Option->NextEntryOffset == 0)
+            break;
+
+        Option = (PFILE_FULL_EA_INFORMATION)
+            ((PBYTE)Option + Option->NextEntryOffset);
+    }
+
     Option = EaBuffer;
     while (status == STATUS_SUCCESS) {
         DbgP("Option=0x%p\n", (void *)Option);
@@ -512,11 +767,148 @@ NTSTATUS nfs41_MountConfig_ParseOptions(
             status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
                 TRUE, &Config->timebasedcoherency);
         }
+        else if (wcsncmp(L"sparsewrite", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &Config->sparsewrite);
+        }
+        else if (wcsncmp(L"nosparsewrite", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                TRUE, &Config->sparsewrite);
+        }
+        else if (wcsncmp(L"fsc", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &Config->fsc);
+        }
+        else if (wcsncmp(L"nofsc", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                TRUE, &Config->fsc);
+        }
+        else if (wcsncmp(L"autotune", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &Config->autotune);
+        }
+        else if (wcsncmp(L"noautotune", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                TRUE, &Config->autotune);
+        }
+        else if (wcsncmp(L"nocto", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &Config->nocto);
+        }
+        else if (wcsncmp(L"cto", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                TRUE, &Config->nocto);
+        }
+        else if (wcsncmp(L"immutable", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &Config->immutable);
+        }
+        else if (wcsncmp(L"noimmutable", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                TRUE, &Config->immutable);
+        }
+        else if (wcsncmp(L"nodelay", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &Config->nodelay);
+        }
+        else if (wcsncmp(L"nonodelay", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                TRUE, &Config->nodelay);
+        }
+        else if (wcsncmp(L"loopbackfastpath", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &Config->loopbackfastpath);
+        }
+        else if (wcsncmp(L"rssaffinity", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &Config->rssaffinity);
+        }
         else if (wcsncmp(L"timeout", Name, NameLen) == 0) {
             status = nfs41_MountConfig_ParseDword(Option, &usValue,
                 &Config->timeout, 15,
                 3600);
         }
+        else if (wcsncmp(L"volcachettl", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->volcachettl, 0,
+                MOUNT_CONFIG_VOLCACHETTL_MAX);
+        }
+        else if (wcsncmp(L"aclcachettl", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->aclcachettl, 0,
+                MOUNT_CONFIG_ACLCACHETTL_MAX);
+        }
+        else if (wcsncmp(L"acregmin", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->acregmin, 0,
+                MOUNT_CONFIG_ACTIMEO_MAX);
+        }
+        else if (wcsncmp(L"acregmax", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->acregmax, 0,
+                MOUNT_CONFIG_ACTIMEO_MAX);
+        }
+        else if (wcsncmp(L"acdirmin", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->acdirmin, 0,
+                MOUNT_CONFIG_ACTIMEO_MAX);
+        }
+        else if (wcsncmp(L"acdirmax", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->acdirmax, 0,
+                MOUNT_CONFIG_ACTIMEO_MAX);
+        }
+        else if (wcsncmp(L"actimeo", Name, NameLen) == 0) {
+            /* sets all four timeouts to the same value */
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->acregmin, 0,
+                MOUNT_CONFIG_ACTIMEO_MAX);
+            if (status == STATUS_SUCCESS) {
+                Config->acregmax = Config->acregmin;
+                Config->acdirmin = Config->acregmin;
+                Config->acdirmax = Config->acregmin;
+            }
+        }
+        else if (wcsncmp(L"namecachesize", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->namecachesize, 1,
+                MOUNT_CONFIG_NAMECACHESIZE_MAX);
+        }
+        else if (wcsncmp(L"closetimeo", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->closetimeo, 0,
+                MOUNT_CONFIG_CLOSETIMEO_MAX);
+        }
+        else if (wcsncmp(L"sockbuf", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->sockbuf, 0,
+                MOUNT_CONFIG_SOCKBUF_MAX);
+        }
+        else if (wcsncmp(L"keepalive", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->keepalive, 0,
+                MOUNT_CONFIG_KEEPALIVE_MAX);
+        }
+        else if (wcsncmp(L"readahead", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->readahead, 0,
+                MOUNT_CONFIG_READAHEAD_MAX);
+        }
+        else if (wcsncmp(L"writebehind", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->writebehind, 0,
+                MOUNT_CONFIG_WRITEBEHIND_MAX);
+        }
+        else if (wcsncmp(L"maxbw", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->maxbw, 0,
+                MOUNT_CONFIG_MAXBW_MAX);
+        }
+        else if (wcsncmp(L"maxiops", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->maxiops, 0,
+                MOUNT_CONFIG_MAXIOPS_MAX);
+        }
         else if (wcsncmp(L"rsize", Name, NameLen) == 0) {
             status = nfs41_MountConfig_ParseDword(Option, &usValue,
                 &Config->ReadSize, MOUNT_CONFIG_RW_SIZE_MIN,
@@ -527,6 +919,11 @@ NTSTATUS nfs41_MountConfig_ParseOptions(
                 &Config->WriteSize, MOUNT_CONFIG_RW_SIZE_MIN,
                 MOUNT_CONFIG_RW_SIZE_MAX);
         }
+        else if (wcsncmp(L"nconnect", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->nconnect, 1,
+                MOUNT_CONFIG_NCONNECT_MAX);
+        }
         else if (wcsncmp(L"vers", Name, NameLen) == 0) {
             if (wcsncmp(L"4.2", usValue.Buffer, usValue.Length) == 0)
                 Config->nfsvers = 42;
@@ -537,6 +934,28 @@ NTSTATUS nfs41_MountConfig_ParseOptions(
                 print_error("Invalid vers= string\n");
             }
         }
+        else if (wcsncmp(L"proto", Name, NameLen) == 0) {
+            /*
+             * Only TCP, libtirpc (|clnt_vc_create()|) has no
+             * RPC-over-RDMA (RFC 8166) transport. Accept "tcp" for
+             * mount scripts written for other clients, and reject
+             * "rdma" with a message which says why
+             */
+            if ((usValue.Length == (3*sizeof(WCHAR))) &&
+                (wcsncmp(L"tcp", usValue.Buffer, 3) == 0)) {
+                /* default */
+            }
+            else if ((usValue.Length == (4*sizeof(WCHAR))) &&
+                (wcsncmp(L"rdma", usValue.Buffer, 4) == 0)) {
+                status = STATUS_NOT_SUPPORTED;
+                print_error("proto=rdma: RPC-over-RDMA transport "
+                    "not supported, use proto=tcp\n");
+            }
+            else {
+                status = STATUS_INVALID_PARAMETER;
+                print_error("Invalid proto= string\n");
+            }
+        }
         else if (wcsncmp(L"public", Name, NameLen) == 0) {
             /*
              + We ignore this value here, and instead rely on the
@@ -564,6 +983,9 @@ NTSTATUS nfs41_MountConfig_ParseOptions(
             else
                 RtlCopyUnicodeString(&Config->SecFlavor, &usValue);
         }
+        else if (wcsncmp(L"profile", Name, NameLen) == 0) {
+            /* Already applied above */
+        }
         else if ((wcsncmp(L"createmode", Name, NameLen) == 0) ||
             (wcsncmp(L"dircreatemode", Name, NameLen) == 0) ||
             (wcsncmp(L"filecreatemode", Name, NameLen) == 0)) {
@@ -739,7 +1161,6 @@ NTSTATUS map_sec_flavor(
     return STATUS_SUCCESS;
 }
 
-static
 NTSTATUS nfs41_GetLUID(
     PLUID id)
 {
@@ -845,6 +1266,50 @@ NTSTATUS netroot_has_nfs_tag(
     return status;
 }
 
+/*
+ * Cache Manager read-ahead granularity for "readahead=<KB>". RDBSS
+ * reads ahead in multiples of this, so with a power-of-two rsize each
+ * read-ahead maps to whole NFS READs. "readahead=0" keeps our default
+ * of 64MB, which is a multiple of every power-of-two rsize.
+ */
+static ULONG nfs41_readahead_granularity(
+    IN const NFS41_MOUNT_CONFIG *Config)
+{
+    ULONG granularity;
+
+    if (Config->readahead == 0)
+        return 64*1024*1024;
+
+    /* must be a power of two and at least |PAGE_SIZE| */
+    granularity = PAGE_SIZE;
+    while ((granularity * 2ULL) <= (Config->readahead * 1024ULL))
+        granularity *= 2;
+
+    if (granularity % Config->ReadSize)
+        DbgP("nfs41_readahead_granularity: readahead granularity %lu "
+            "is not a multiple of rsize=%lu\n",
+            (unsigned long)granularity, (unsigned long)Config->ReadSize);
+    return granularity;
+}
+
+/*
+ * Per-file dirty page threshold for "writebehind=<KB>", rounded up
+ * to whole wsize WRITEs, see |nfs41_set_writebehind()|
+ */
+static ULONG nfs41_writebehind_pages(
+    IN const NFS41_MOUNT_CONFIG *Config)
+{
+    ULONGLONG bytes;
+
+    if (Config->writebehind == 0)
+        return 0;
+
+    bytes = Config->writebehind * 1024ULL;
+    bytes = ((bytes + Config->WriteSize - 1) / Config->WriteSize) *
+        Config->WriteSize;
+    return (ULONG)((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
 NTSTATUS nfs41_CreateVNetRoot(
     IN OUT PMRX_CREATENETROOT_CONTEXT pCreateNetRootContext)
 {
@@ -922,6 +1387,9 @@ NTSTATUS nfs41_CreateVNetRoot(
     }
 
     pVNetRootContext->session = INVALID_HANDLE_VALUE;
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    nfs41_volcache_init(pVNetRootContext);
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
 
     /*
      * In order to cooperate with other network providers, we
@@ -968,7 +1436,15 @@ NTSTATUS nfs41_CreateVNetRoot(
         pVNetRootContext->read_only = Config->ReadOnly;
         pVNetRootContext->write_thru = Config->write_thru;
         pVNetRootContext->nocache = Config->nocache;
-        pVNetRootContext->timebasedcoherency = Config->timebasedcoherency;
+        /* "immutable" implies "nocto", neither needs polling */
+        pVNetRootContext->immutable = Config->immutable;
+        pVNetRootContext->nocto = Config->nocto || Config->immutable;
+        pVNetRootContext->timebasedcoherency = Config->timebasedcoherency &&
+            !pVNetRootContext->nocto;
+        pVNetRootContext->cache_flush_time =
+            (LONG)nfs41_get_interrupttime_msecs();
+        pVNetRootContext->writebehind_pages =
+            nfs41_writebehind_pages(Config);
     } else {
         /*
          * Codepath for \\server@NFS@port\path or
@@ -1091,7 +1567,15 @@ NTSTATUS nfs41_CreateVNetRoot(
         pVNetRootContext->read_only = Config->ReadOnly;
         pVNetRootContext->write_thru = Config->write_thru;
         pVNetRootContext->nocache = Config->nocache;
-        pVNetRootContext->timebasedcoherency = Config->timebasedcoherency;
+        /* "immutable" implies "nocto", neither needs polling */
+        pVNetRootContext->immutable = Config->immutable;
+        pVNetRootContext->nocto = Config->nocto || Config->immutable;
+        pVNetRootContext->timebasedcoherency = Config->timebasedcoherency &&
+            !pVNetRootContext->nocto;
+        pVNetRootContext->cache_flush_time =
+            (LONG)nfs41_get_interrupttime_msecs();
+        pVNetRootContext->writebehind_pages =
+            nfs41_writebehind_pages(Config);
     }
 
     Config->use_nfspubfh = pubfh_tag;
@@ -1101,11 +1585,22 @@ NTSTATUS nfs41_CreateVNetRoot(
         "SrvName='%wZ', "
         "usenfspubfh=%d, "
         "nfsvers=%d, "
+        "nconnect=%d, "
         "ro=%d, "
         "writethru=%d, "
         "nocache=%d "
         "timebasedcoherency=%d "
         "timeout=%d "
+        "volcachettl=%d "
+        "aclcachettl=%d "
+        "acregmin=%d acregmax=%d acdirmin=%d acdirmax=%d "
+        "namecachesize=%d "
+        "closetimeo=%d "
+        "sparsewrite=%d fsc=%d autotune=%d nocto=%d immutable=%d "
+        "sockbuf=%d keepalive=%d nodelay=%d loopbackfastpath=%d "
+        "rssaffinity=%d "
+        "readahead=%d writebehind=%d "
+        "maxbw=%d maxiops=%d "
         "dir_cmode=(usenfsv3attrs=%d mode=0%o) "
         "file_cmode=(usenfsv3attrs=%d mode=0%o) "
 #ifdef NFS41_DRIVER_HACK_FORCE_FILENAME_CASE_MOUNTOPTIONS
@@ -1117,11 +1612,34 @@ NTSTATUS nfs41_CreateVNetRoot(
         &Config->SrvName,
         Config->use_nfspubfh?1:0,
         (int)Config->nfsvers,
+        (int)Config->nconnect,
         Config->ReadOnly?1:0,
         Config->write_thru?1:0,
         Config->nocache?1:0,
         Config->timebasedcoherency?1:0,
         Config->timeout,
+        (int)Config->volcachettl,
+        (int)Config->aclcachettl,
+        (int)Config->acregmin,
+        (int)Config->acregmax,
+        (int)Config->acdirmin,
+        (int)Config->acdirmax,
+        (int)Config->namecachesize,
+        (int)Config->closetimeo,
+        Config->sparsewrite?1:0,
+        Config->fsc?1:0,
+        Config->autotune?1:0,
+        Config->nocto?1:0,
+        Config->immutable?1:0,
+        (int)Config->sockbuf,
+        (int)Config->keepalive,
+        Config->nodelay?1:0,
+        Config->loopbackfastpath?1:0,
+        Config->rssaffinity?1:0,
+        (int)Config->readahead,
+        (int)Config->writebehind,
+        (int)Config->maxbw,
+        (int)Config->maxiops,
         Config->dir_createmode.use_nfsv3attrsea_mode?1:0,
         Config->dir_createmode.mode,
         Config->file_createmode.use_nfsv3attrsea_mode?1:0,
@@ -1138,6 +1656,12 @@ NTSTATUS nfs41_CreateVNetRoot(
     pVNetRootContext->MntPt.MaximumLength = Config->MntPt.MaximumLength;
     RtlCopyUnicodeString(&pVNetRootContext->MntPt, &Config->MntPt);
     pVNetRootContext->timeout = Config->timeout;
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    pVNetRootContext->volcachettl = Config->volcachettl;
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+    pVNetRootContext->aclcachettl = Config->aclcachettl;
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
     pVNetRootContext->dir_createmode.use_nfsv3attrsea_mode =
         Config->dir_createmode.use_nfsv3attrsea_mode;
     pVNetRootContext->dir_createmode.mode =
@@ -1301,6 +1825,7 @@ NTSTATUS nfs41_CreateVNetRoot(
         }
     }
     pNetRootContext->nfs41d_version = nfs41d_version;
+    nfs41_netroot_stats_add(pNetRootContext, pNetRoot->pNetRootName);
 
     DbgP("default pNetRoot->DiskParameters=("
         "ClusterSize=%lu, "
@@ -1321,10 +1846,11 @@ NTSTATUS nfs41_CreateVNetRoot(
      * |(0x08000)| (=32768), but |log2(32768)==15|, and |15| is an
      * odd number, violating that rule.
      *
-     * We now use 2**16==64k here, per |CcSetReadAheadGranularity()|
-     * spec
+     * RDBSS passes this to |CcSetReadAheadGranularity()| when it
+     * sets up caching for a file, see |nfs41_readahead_granularity()|
      */
-    pNetRoot->DiskParameters.ReadAheadGranularity = 64*1024*1024;
+    pNetRoot->DiskParameters.ReadAheadGranularity =
+        nfs41_readahead_granularity(Config);
 
 #ifdef DEBUG_MOUNT
     DbgP("Saving new session 0x%p\n", pVNetRootContext->session);
@@ -1423,6 +1949,10 @@ NTSTATUS nfs41_FinalizeNetRoot(
         goto out;
     }
 
+    /* the NetRoot extension goes away, even if we bail out below */
+    if (pNetRootContext)
+        nfs41_netroot_stats_remove(pNetRootContext);
+
     if (pNetRootContext == NULL || !pNetRootContext->mounts_init) {
         print_error("nfs41_FinalizeNetRoot: No valid session established\n");
         goto out;
@@ -1486,10 +2016,9 @@ NTSTATUS nfs41_FinalizeNetRoot(
 
     // check if there is anything waiting in the upcall or downcall queue
     do {
-        nfs41_GetFirstEntry(upcalllist.lock, upcalllist, tmp);
+        tmp = nfs41_upcalllist_remove_next();
         if (tmp != NULL) {
             DbgP("Removing entry from upcall list\n");
-            nfs41_RemoveEntry(upcalllist.lock, tmp);
             tmp->status = STATUS_INSUFFICIENT_RESOURCES;
             (void)KeSetEvent(&tmp->cond, IO_NFS41FS_INCREMENT, FALSE);
         } else
@@ -1497,10 +2026,9 @@ NTSTATUS nfs41_FinalizeNetRoot(
     } while (1);
 
     do {
-        nfs41_GetFirstEntry(downcalllist.lock, downcalllist, tmp);
+        tmp = nfs41_downcalllist_remove_first();
         if (tmp != NULL) {
             DbgP("Removing entry from downcall list\n");
-            nfs41_RemoveEntry(downcalllist.lock, tmp);
             tmp->status = STATUS_INSUFFICIENT_RESOURCES;
             (void)KeSetEvent(&tmp->cond, IO_NFS41FS_INCREMENT, FALSE);
         } else
@@ -119,17 +119,20 @@ NTSTATUS marshal_nfs41_open(
         goto out;
     tmp += *len;
 
-    header_len = *len + length_as_utf8(entry->filename) +
+    header_len = *len + length_filename_as_utf8(entry) +
         1 * sizeof(tristate_bool) +
         7 * sizeof(ULONG) +
         1 * sizeof(BOOLEAN) +
         2 * sizeof(HANDLE) +
         length_as_utf8(&entry->u.Open.symlink);
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    header_len += sizeof(ULONGLONG);
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
     if (header_len > buf_len) {
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto out;
     }
-    status = marshall_unicode_as_utf8(&tmp, entry->filename);
+    status = marshall_filename_as_utf8(&tmp, entry);
     if (status) goto out;
     RtlCopyMemory(tmp, &entry->u.Open.is_caseinsensitive_volume,
         sizeof(entry->u.Open.is_caseinsensitive_volume));
@@ -178,6 +181,10 @@ NTSTATUS marshal_nfs41_open(
     }
     RtlCopyMemory(tmp, &entry->u.Open.EaBuffer, sizeof(HANDLE));
     tmp += sizeof(HANDLE);
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    RtlCopyMemory(tmp, &entry->u.Open.open_fileid, sizeof(ULONGLONG));
+    tmp += sizeof(ULONGLONG);
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
 
     *len = (ULONG)(tmp - buf);
     if (*len != header_len) {
@@ -217,8 +224,15 @@ NTSTATUS marshal_nfs41_close(
 
     header_len = *len + sizeof(BOOLEAN) + sizeof(HANDLE);
     if (entry->u.Close.remove)
-        header_len += length_as_utf8(entry->filename) +
+        header_len += length_filename_as_utf8(entry) +
             sizeof(BOOLEAN);
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    header_len += sizeof(ULONG);
+    if (entry->u.Close.setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO)
+        header_len += sizeof(FILE_BASIC_INFORMATION);
+    if (entry->u.Close.setattr_flags & NFS41_CLOSE_FLAG_SET_EOF)
+        header_len += sizeof(LONGLONG);
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
 
     if (header_len > buf_len) {
         status = STATUS_INSUFFICIENT_RESOURCES;
@@ -229,11 +243,24 @@ NTSTATUS marshal_nfs41_close(
     RtlCopyMemory(tmp, &entry->u.Close.srv_open, sizeof(HANDLE));
     tmp += sizeof(HANDLE);
     if (entry->u.Close.remove) {
-        status = marshall_unicode_as_utf8(&tmp, entry->filename);
+        status = marshall_filename_as_utf8(&tmp, entry);
         if (status) goto out;
         RtlCopyMemory(tmp, &entry->u.Close.renamed, sizeof(BOOLEAN));
         tmp += sizeof(BOOLEAN);
     }
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    RtlCopyMemory(tmp, &entry->u.Close.setattr_flags, sizeof(ULONG));
+    tmp += sizeof(ULONG);
+    if (entry->u.Close.setattr_flags & NFS41_CLOSE_FLAG_SET_BASICINFO) {
+        RtlCopyMemory(tmp, &entry->u.Close.basic_info,
+            sizeof(FILE_BASIC_INFORMATION));
+        tmp += sizeof(FILE_BASIC_INFORMATION);
+    }
+    if (entry->u.Close.setattr_flags & NFS41_CLOSE_FLAG_SET_EOF) {
+        RtlCopyMemory(tmp, &entry->u.Close.eof.QuadPart, sizeof(LONGLONG));
+        tmp += sizeof(LONGLONG);
+    }
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
 
     *len = (ULONG)(tmp - buf);
     if (*len != header_len) {
@@ -300,7 +327,7 @@ NTSTATUS unmarshal_nfs41_open(
         *buf += sizeof(USHORT);
         cur->u.Open.symlink.MaximumLength =
             cur->u.Open.symlink.Length+sizeof(wchar_t);
-        cur->u.Open.symlink.Buffer = RxAllocatePoolWithTag(NonPagedPoolNx,
+        cur->u.Open.symlink.Buffer = nfs41_buffer_allocate(
             cur->u.Open.symlink.MaximumLength, NFS41_MM_POOLTAG);
         if (cur->u.Open.symlink.Buffer == NULL) {
             cur->status = STATUS_INSUFFICIENT_RESOURCES;
@@ -336,6 +363,145 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+NTSTATUS marshal_nfs41_queryopen(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG header_len = 0;
+    unsigned char *tmp = buf;
+
+    status = marshal_nfs41_header(entry, tmp, buf_len, len);
+    if (status)
+        goto out;
+    tmp += *len;
+
+    header_len = *len + length_filename_as_utf8(entry);
+    if (header_len > buf_len) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+    status = marshall_filename_as_utf8(&tmp, entry);
+    if (status) goto out;
+
+    *len = (ULONG)(tmp - buf);
+    if (*len != header_len) {
+        DbgP("marshal_nfs41_queryopen: *len(=%ld) != header_len(=%ld)\n",
+            (long)*len, (long)header_len);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+#ifdef DEBUG_MARSHAL_DETAIL
+    DbgP("marshal_nfs41_queryopen: name='%wZ'\n", entry->filename);
+#endif
+out:
+    return status;
+}
+
+void unmarshal_nfs41_queryopen(
+    nfs41_updowncall_entry *cur,
+    const unsigned char *restrict *restrict buf)
+{
+    RtlCopyMemory(&cur->u.QueryOpen.info, *buf,
+        sizeof(FILE_NETWORK_OPEN_INFORMATION));
+    *buf += sizeof(FILE_NETWORK_OPEN_INFORMATION);
+#ifdef DEBUG_MARSHAL_DETAIL
+    DbgP("unmarshal_nfs41_queryopen: attrs=0x%lx eof=%lld\n",
+        (long)cur->u.QueryOpen.info.FileAttributes,
+        (long long)cur->u.QueryOpen.info.EndOfFile.QuadPart);
+#endif
+}
+
+/*
+ * |FastIoQueryOpen| - |NtQueryFullAttributesFile()| without a full open
+ *
+ * The I/O manager asks us before it builds an |IRP_MJ_CREATE| for
+ * |FileNetworkOpenInformation| by name, which is what
+ * |GetFileAttributesEx()|, |stat()| and Explorer do most of the time.
+ * Without this callback each query costs an OPEN, a GETATTR and a
+ * CLOSE. RDBSS has not resolved the name to a |V_NET_ROOT| at this
+ * point, so |nfs41_netroot_find_session()| maps it to the session of
+ * the caller's mount, and a single |NFS41_SYSOP_QUERY_OPEN| upcall
+ * asks the daemon for the attributes.
+ * Relative opens, opens by file id, names the daemon cannot answer
+ * exactly (symlinks, files open for writing) and all errors return
+ * |FALSE|, so the I/O manager falls back to a full open, which then
+ * handles them as usual.
+ */
+BOOLEAN nfs41_FastIoQueryOpen(
+    IN OUT PIRP Irp,
+    OUT PFILE_NETWORK_OPEN_INFORMATION NetworkInformation,
+    IN PDEVICE_OBJECT DeviceObject)
+{
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    PFILE_OBJECT FileObject = IrpSp->FileObject;
+    PNFS41_NETROOT_EXTENSION pNetRootContext = NULL;
+    nfs41_updowncall_entry *entry = NULL;
+    UNICODE_STRING relpath;
+    HANDLE session;
+    LUID luid;
+    BOOLEAN done = FALSE;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    if ((FileObject == NULL) ||
+        (FileObject->RelatedFileObject != NULL) ||
+        (FileObject->FileName.Length == 0) ||
+        (IrpSp->Parameters.Create.Options & FILE_OPEN_BY_FILE_ID))
+        return FALSE;
+
+    FsRtlEnterFileSystem();
+
+    status = nfs41_GetLUID(&luid);
+    if (status)
+        goto out;
+
+    pNetRootContext = nfs41_netroot_find_session(&FileObject->FileName,
+        &luid, &session, &relpath);
+    if (pNetRootContext == NULL)
+        goto out;
+
+    status = nfs41_UpcallCreate(NFS41_SYSOP_QUERY_OPEN, NULL, session,
+        INVALID_HANDLE_VALUE, pNetRootContext->nfs41d_version,
+        &relpath, &entry);
+    if (status)
+        goto out;
+
+    status = nfs41_UpcallWaitForReply(entry, UPCALL_TIMEOUT_DEFAULT);
+    if (status) {
+        /* Timeout - |nfs41_downcall()| will free |entry|+contents */
+        entry = NULL;
+        goto out;
+    }
+    if (entry->status) {
+#ifdef DEBUG_OPEN
+        DbgP("nfs41_FastIoQueryOpen: '%wZ' status=%d, "
+            "falling back to a full open\n",
+            &relpath, (int)entry->status);
+#endif
+        goto out;
+    }
+
+    RtlCopyMemory(NetworkInformation, &entry->u.QueryOpen.info,
+        sizeof(FILE_NETWORK_OPEN_INFORMATION));
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof(FILE_NETWORK_OPEN_INFORMATION);
+    done = TRUE;
+out:
+    if (entry)
+        nfs41_UpcallDestroy(entry);
+    if (pNetRootContext)
+        nfs41_netroot_release(pNetRootContext);
+    FsRtlExitFileSystem();
+    return done;
+}
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+
 static BOOLEAN isDataAccess(
     ACCESS_MASK mask)
 {
@@ -371,6 +537,47 @@ static BOOLEAN isAttributeOnlyDesiredAccess(PNT_CREATE_PARAMETERS params)
     return FALSE;
 }
 
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+/*
+ * Opens which can share one SRV_OPEN (and the NFSv4.1 open state
+ * behind it): Only opens of existing files, and no write or delete
+ * access, because the handle specific state for these (deferred
+ * SETATTRs, delete-on-close) is kept per FOBX and only the last
+ * FOBX would get to |nfs41_CloseSrvOpen()|.
+ * No directories either, the open state holds the READDIR cookie of
+ * the enumeration, and no read access, because byte-range locks
+ * need read or write access and all handles of one open state would
+ * share one lock owner, so their locks would not conflict.
+ * The caller must also check that the FCB is not a directory.
+ */
+static BOOLEAN isCollapsibleOpen(PNT_CREATE_PARAMETERS params)
+{
+    if ((params->Disposition != FILE_OPEN) &&
+        (params->Disposition != FILE_OPEN_IF))
+        return FALSE;
+    if (params->CreateOptions & (FILE_DELETE_ON_CLOSE|FILE_DIRECTORY_FILE))
+        return FALSE;
+    if (params->DesiredAccess &
+        (FILE_READ_DATA|FILE_WRITE_DATA|FILE_APPEND_DATA|DELETE))
+        return FALSE;
+    return TRUE;
+}
+
+static
+NTSTATUS nfs41_get_caller_logon_id(
+    OUT PLUID logon_id)
+{
+    NTSTATUS status;
+    SECURITY_SUBJECT_CONTEXT ctx;
+
+    SeCaptureSubjectContext(&ctx);
+    status = SeQueryAuthenticationIdToken(
+        SeQuerySubjectContextToken(&ctx), logon_id);
+    SeReleaseSubjectContext(&ctx);
+    return status;
+}
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
+
 static BOOLEAN areOpenParamsValid(NT_CREATE_PARAMETERS *params)
 {
     /* from ms-fsa page 52 */
@@ -524,6 +731,19 @@ NTSTATUS check_nfs41_create_args(
         goto out;
     }
 
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    /*
+     * Opens by file id can only open existing files, and the name must
+     * end with the 8 byte file id (see |nfs41_Create()|)
+     */
+    if ((params->CreateOptions & FILE_OPEN_BY_FILE_ID) &&
+        ((params->Disposition != FILE_OPEN) ||
+            (SrvOpen->pAlreadyPrefixedName->Length < sizeof(ULONGLONG)))) {
+        status = STATUS_INVALID_PARAMETER;
+        goto out;
+    }
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
+
     if (pVNetRootContext->read_only &&
             (params->DesiredAccess & (FILE_WRITE_DATA | FILE_APPEND_DATA))) {
         status = STATUS_MEDIA_WRITE_PROTECTED;
@@ -603,6 +823,188 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+/*
+ * Negative open cache
+ *
+ * Applications searching $PATH, build tools and script interpreters
+ * probe many files which do not exist, and each probe costs an OPEN
+ * upcall followed by a LOOKUP roundtrip to the server.
+ * We remember the paths for which an open without create disposition
+ * returned |STATUS_OBJECT_NAME_NOT_FOUND| for |NFS41_NEGCACHE_TTL_MSECS|
+ * and fail further opens of these paths without an upcall.
+ *
+ * The cache lives in the |NetRoot|, so creates, file renames and
+ * hardlinks through any |VNetRoot| (logon session) of this client
+ * invalidate all entries in the parent dir of the new name, dir
+ * renames invalidate the whole cache (a renamed dir changes all paths
+ * below it). Hashes are always case-insensitive, so this also works
+ * if the |VNetRoot|s differ in what they know about the volume's case
+ * sensitivity. Changes by other clients
+ * are only covered by the TTL, the kernel does not have the parent
+ * dir's change attribute without an upcall.
+ */
+void nfs41_negcache_init(
+    PNFS41_NETROOT_EXTENSION pNetRootContext)
+{
+    ExInitializeFastMutex(&pNetRootContext->negcache.lock);
+    pNetRootContext->negcache.gen = 0;
+    RtlZeroMemory(pNetRootContext->negcache.entries,
+        sizeof(pNetRootContext->negcache.entries));
+}
+
+void nfs41_negcache_invalidate(
+    PNFS41_NETROOT_EXTENSION pNetRootContext)
+{
+    nfs41_negcache *nc = &pNetRootContext->negcache;
+    int i;
+
+    ExAcquireFastMutex(&nc->lock);
+    nc->gen++;
+    for (i = 0 ; i < NFS41_NEGCACHE_NUM_ENTRIES ; i++)
+        nc->entries[i].valid = FALSE;
+    ExReleaseFastMutex(&nc->lock);
+}
+
+static BOOLEAN nfs41_negcache_is_caseinsensitive(
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext)
+{
+    ULONG fsattrs = pVNetRootContext->FsAttrs.FileSystemAttributes;
+
+    /*
+     * Compare case-sensitive as long as we do not know the volume's
+     * attributes, this can only cause cache misses
+     */
+    return (fsattrs && !(fsattrs & FILE_CASE_SENSITIVE_SEARCH))?
+        TRUE:FALSE;
+}
+
+static BOOLEAN nfs41_negcache_hash(
+    PUNICODE_STRING name,
+    ULONG *hash_out,
+    ULONG *parent_hash_out)
+{
+    UNICODE_STRING parent;
+    USHORT i = name->Length / sizeof(WCHAR);
+
+    while ((i > 0) && (name->Buffer[i-1] != L'\\'))
+        i--;
+    parent.Buffer = name->Buffer;
+    parent.Length = parent.MaximumLength =
+        (USHORT)((i > 0)?((i-1) * sizeof(WCHAR)):0);
+
+    if (!NT_SUCCESS(RtlHashUnicodeString(name, TRUE,
+        HASH_STRING_ALGORITHM_DEFAULT, hash_out)))
+        return FALSE;
+    if (!NT_SUCCESS(RtlHashUnicodeString(&parent, TRUE,
+        HASH_STRING_ALGORITHM_DEFAULT, parent_hash_out)))
+        return FALSE;
+    return TRUE;
+}
+
+/*
+ * Returns |TRUE| if |name| is known not to exist. Otherwise
+ * |*gen_out| is set to the cache generation which must be passed to
+ * |nfs41_negcache_add()| after the upcall.
+ */
+static BOOLEAN nfs41_negcache_lookup(
+    PNFS41_NETROOT_EXTENSION pNetRootContext,
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext,
+    PUNICODE_STRING name,
+    OUT LONG *gen_out)
+{
+    nfs41_negcache *nc = &pNetRootContext->negcache;
+    nfs41_negcache_entry *e;
+    BOOLEAN ci = nfs41_negcache_is_caseinsensitive(pVNetRootContext);
+    UNICODE_STRING ename;
+    ULONG hash, parent_hash;
+    BOOLEAN hit = FALSE;
+
+    ExAcquireFastMutex(&nc->lock);
+    *gen_out = nc->gen;
+    ExReleaseFastMutex(&nc->lock);
+
+    if ((name->Length == 0) ||
+        (name->Length > (NFS41_NEGCACHE_MAX_NAME_LEN * sizeof(WCHAR))))
+        return FALSE;
+    if (!nfs41_negcache_hash(name, &hash, &parent_hash))
+        return FALSE;
+
+    e = &nc->entries[hash % NFS41_NEGCACHE_NUM_ENTRIES];
+    ExAcquireFastMutex(&nc->lock);
+    if (e->valid && (e->hash == hash) && (e->name_len == name->Length)) {
+        ename.Buffer = e->name;
+        ename.Length = ename.MaximumLength = e->name_len;
+        if ((nfs41_get_interrupttime_msecs() - e->time) >=
+            NFS41_NEGCACHE_TTL_MSECS)
+            e->valid = FALSE;
+        else if (RtlEqualUnicodeString(&ename, name, ci))
+            hit = TRUE;
+    }
+    ExReleaseFastMutex(&nc->lock);
+
+#ifdef DEBUG_OPEN
+    DbgP("nfs41_negcache_lookup: name='%wZ' hit=%d\n", name, (int)hit);
+#endif
+    return hit;
+}
+
+static void nfs41_negcache_add(
+    PNFS41_NETROOT_EXTENSION pNetRootContext,
+    PUNICODE_STRING name,
+    LONG gen)
+{
+    nfs41_negcache *nc = &pNetRootContext->negcache;
+    nfs41_negcache_entry *e;
+    ULONG hash, parent_hash;
+
+    if ((name->Length == 0) ||
+        (name->Length > (NFS41_NEGCACHE_MAX_NAME_LEN * sizeof(WCHAR))))
+        return;
+    if (!nfs41_negcache_hash(name, &hash, &parent_hash))
+        return;
+
+    e = &nc->entries[hash % NFS41_NEGCACHE_NUM_ENTRIES];
+    ExAcquireFastMutex(&nc->lock);
+    /*
+     * Do not add the entry if something was created or renamed
+     * while the upcall was in progress
+     */
+    if (nc->gen == gen) {
+        RtlCopyMemory(e->name, name->Buffer, name->Length);
+        e->name_len = name->Length;
+        e->hash = hash;
+        e->parent_hash = parent_hash;
+        e->time = nfs41_get_interrupttime_msecs();
+        e->valid = TRUE;
+    }
+    ExReleaseFastMutex(&nc->lock);
+}
+
+/* Invalidate all entries in the parent dir of |name| */
+void nfs41_negcache_invalidate_parent(
+    PNFS41_NETROOT_EXTENSION pNetRootContext,
+    PUNICODE_STRING name)
+{
+    nfs41_negcache *nc = &pNetRootContext->negcache;
+    ULONG hash, parent_hash;
+    int i;
+
+    if (!nfs41_negcache_hash(name, &hash, &parent_hash)) {
+        nfs41_negcache_invalidate(pNetRootContext);
+        return;
+    }
+
+    ExAcquireFastMutex(&nc->lock);
+    nc->gen++;
+    for (i = 0 ; i < NFS41_NEGCACHE_NUM_ENTRIES ; i++) {
+        if (nc->entries[i].parent_hash == parent_hash)
+            nc->entries[i].valid = FALSE;
+    }
+    ExReleaseFastMutex(&nc->lock);
+}
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
+
 NTSTATUS nfs41_Create(
     IN OUT PRX_CONTEXT RxContext)
 {
@@ -621,6 +1023,11 @@ NTSTATUS nfs41_Create(
     PNFS41_FOBX nfs41_fobx = NULL;
     BOOLEAN oldDeletePending = nfs41_fcb->StandardInfo.DeletePending;
     bool fcb_locked_exclusive = false;
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+    BOOLEAN negcache_lookup = (params->Disposition == FILE_OPEN) ||
+        (params->Disposition == FILE_OVERWRITE);
+    LONG negcache_gen = 0;
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
 #ifdef ENABLE_TIMINGS
     LARGE_INTEGER t1, t2;
     t1 = KeQueryPerformanceCounter(NULL);
@@ -639,11 +1046,53 @@ NTSTATUS nfs41_Create(
     status = check_nfs41_create_args(RxContext);
     if (status) goto out;
 
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+    if (negcache_lookup &&
+        nfs41_negcache_lookup(pNetRootContext, pVNetRootContext,
+            SrvOpen->pAlreadyPrefixedName, &negcache_gen)) {
+        status = STATUS_OBJECT_NAME_NOT_FOUND;
+        goto out;
+    }
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
+
     status = nfs41_UpcallCreate(NFS41_SYSOP_OPEN, NULL,
         pVNetRootContext->session, INVALID_HANDLE_VALUE,
         pNetRootContext->nfs41d_version,
         SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    nfs41_UpcallSetFcbFilename(entry, nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
+
+#ifdef NFS41_DRIVER_OPEN_BY_FILEID
+    entry->u.Open.open_fileid = 0ULL;
+    if (params->CreateOptions & FILE_OPEN_BY_FILE_ID) {
+        PUNICODE_STRING name = SrvOpen->pAlreadyPrefixedName;
+        PUNICODE_STRING dirname = &entry->u.Open.fileid_dirname;
+
+        /*
+         * RDBSS appends the binary 8 byte file id of the
+         * |FILE_OPEN_BY_FILE_ID| name to the name of the related
+         * directory, so send the directory name and the file id
+         * separately. The daemon resolves the file id in its name
+         * cache
+         */
+        RtlCopyMemory(&entry->u.Open.open_fileid,
+            (PUCHAR)name->Buffer + name->Length - sizeof(ULONGLONG),
+            sizeof(ULONGLONG));
+        dirname->Buffer = name->Buffer;
+        dirname->Length = name->Length - sizeof(ULONGLONG);
+        if ((dirname->Length > sizeof(WCHAR)) &&
+            (dirname->Buffer[(dirname->Length / sizeof(WCHAR)) - 1] == L'\\'))
+            dirname->Length -= sizeof(WCHAR);
+        dirname->MaximumLength = dirname->Length;
+        entry->filename = dirname;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+        entry->filename_utf8 = NULL;
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
+    }
+#endif /* NFS41_DRIVER_OPEN_BY_FILEID */
 
     entry->u.Open.is_caseinsensitive_volume = TRISTATE_BOOL_NOT_SET;
     ULONG fsattrs = pVNetRootContext->FsAttrs.FileSystemAttributes;
@@ -841,7 +1290,8 @@ retry_on_link:
         buf += entry->u.Open.symlink.Length;
         *(PWCHAR)buf = UNICODE_NULL;
 
-        RxFreePool(entry->u.Open.symlink.Buffer);
+        nfs41_buffer_free(entry->u.Open.symlink.Buffer,
+            entry->u.Open.symlink.MaximumLength);
         entry->u.Open.symlink.Buffer = NULL;
 
         status = RxPrepareToReparseSymbolicLink(RxContext,
@@ -874,6 +1324,11 @@ retry_on_link:
     status = map_open_errors(entry->status,
                 SrvOpen->pAlreadyPrefixedName->Length);
     if (status) {
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+        if (negcache_lookup && (status == STATUS_OBJECT_NAME_NOT_FOUND))
+            nfs41_negcache_add(pNetRootContext,
+                SrvOpen->pAlreadyPrefixedName, negcache_gen);
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
 #ifdef DEBUG_OPEN
         print_open_error(1, status);
 #endif
@@ -927,7 +1382,24 @@ retry_on_link:
         nfs41_fcb->owner_local_uid = entry->u.Open.owner_local_uid;
         nfs41_fcb->owner_group_local_gid = entry->u.Open.owner_group_local_gid;
 #endif /* NFS41_DRIVER_FEATURE_LOCAL_UIDGID_IN_NFSV3ATTRIBUTES */
+#ifdef NFS41_DRIVER_FCB_ACLCACHE
+        /* The file was changed, maybe by another client */
+        if (nfs41_fcb->changeattr != entry->ChangeTime)
+            nfs41_fcb_aclcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ACLCACHE */
         nfs41_fcb->changeattr = entry->ChangeTime;
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+        {
+            LONG gen;
+
+            /* The OPEN reply carries fresh attributes, seed the cache */
+            nfs41_fcb_attrcache_invalidate(nfs41_fcb);
+            gen = InterlockedCompareExchange(&nfs41_fcb->attrcache_gen, 0, 0);
+            nfs41_fcb_attrcache_update(nfs41_fcb, FileBasicInformation, gen);
+            nfs41_fcb_attrcache_update(nfs41_fcb, FileStandardInformation,
+                gen);
+        }
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
         if (((params->CreateOptions & FILE_DELETE_ON_CLOSE) &&
                 !pVNetRootContext->read_only) || oldDeletePending)
             nfs41_fcb->StandardInfo.DeletePending = TRUE;
@@ -1035,8 +1507,13 @@ retry_on_link:
      * If the file was opened before, RDBSS might have cached (unflushed) data
      * and by opening it again, we will not have the correct representation of
      * the file size and data content. fileio tests 208, 219, 221.
+     * "nocto" (and "immutable") mounts only do this if the change
+     * attribute from the OPEN differs, an unchanged file keeps its
+     * cached data.
      */
-    if (Fcb->OpenCount > 0 && (isDataAccess(params->DesiredAccess) ||
+    if (Fcb->OpenCount > 0 &&
+            ((isDataAccess(params->DesiredAccess) &&
+                !pVNetRootContext->nocto) ||
             nfs41_fcb->changeattr != entry->ChangeTime) &&
                 !nfs41_fcb->StandardInfo.Directory) {
         ULONG flag = DISABLE_CACHING;
@@ -1106,7 +1583,21 @@ retry_on_link:
 #endif
             SrvOpen->BufferingFlags = FCB_STATE_DISABLE_LOCAL_BUFFERING;
             nfs41_fobx->nocache = TRUE;
-        } else if (!entry->u.Open.deleg_type && !Fcb->OpenCount) {
+        }
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+        else if (entry->u.Open.deleg_type == 2) {
+            /*
+             * No other client can lock the file while we hold a write
+             * delegation, let RDBSS handle byte-range locks locally.
+             * See |nfs41_lock_buffering_push()|
+             */
+#ifdef DEBUG_OPEN
+            DbgP("nfs41_Create: enabling lock buffering\n");
+#endif
+            SrvOpen->BufferingFlags |= FCB_STATE_LOCK_BUFFERING_ENABLED;
+        }
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
+        else if (!entry->u.Open.deleg_type && !Fcb->OpenCount) {
             nfs41_fcb_list_entry *oentry;
 #ifdef DEBUG_OPEN
             DbgP("nfs41_Create: received no delegations: srv_open=0x%p "
@@ -1122,7 +1613,7 @@ retry_on_link:
             oentry->session = pVNetRootContext->session;
             oentry->ChangeTime = entry->ChangeTime;
             oentry->skip = FALSE;
-            nfs41_AddEntry(openlist.lock, openlist, oentry);
+            nfs41_openlist_add(oentry);
         }
     }
 
@@ -1130,8 +1621,40 @@ retry_on_link:
             !pVNetRootContext->read_only)
         nfs41_fcb->StandardInfo.DeletePending = TRUE;
 
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+    /*
+     * Remember what |nfs41_CollapseOpen()| needs to give later opens
+     * of the same user with the same access and share modes a FOBX
+     * on this SRV_OPEN
+     */
+    if (isCollapsibleOpen(params) &&
+        !nfs41_fcb->StandardInfo.Directory &&
+        !nfs41_fcb->StandardInfo.DeletePending) {
+        PNFS41_SRV_OPEN nfs41_srvopen = NFS41GetSrvOpenExtension(SrvOpen);
+
+        if (nfs41_get_caller_logon_id(&nfs41_srvopen->logon_id) ==
+            STATUS_SUCCESS) {
+            nfs41_srvopen->nfs41_open_state = nfs41_fobx->nfs41_open_state;
+            nfs41_srvopen->deleg_type = nfs41_fobx->deleg_type;
+            nfs41_srvopen->write_thru = nfs41_fobx->write_thru;
+            nfs41_srvopen->nocache = nfs41_fobx->nocache;
+            nfs41_srvopen->timebasedcoherency =
+                nfs41_fobx->timebasedcoherency;
+            nfs41_srvopen->collapsible = TRUE;
+            Fcb->FcbState |= FCB_STATE_COLLAPSING_ENABLED;
+        }
+    }
+    if (!NFS41GetSrvOpenExtension(SrvOpen)->collapsible)
+        SrvOpen->Flags |= SRVOPEN_FLAG_COLLAPSING_DISABLED;
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
+
     RxContext->Create.ReturnedCreateInformation =
         map_disposition_to_create_retval(params->Disposition, entry->errno);
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+    if (RxContext->Create.ReturnedCreateInformation == FILE_CREATED)
+        nfs41_negcache_invalidate_parent(pNetRootContext,
+            SrvOpen->pAlreadyPrefixedName);
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
 
     RxContext->pFobx->OffsetOfNextEaToReturn = 1;
     RxContext->CurrentIrp->IoStatus.Information =
@@ -1179,8 +1702,53 @@ NTSTATUS nfs41_CollapseOpen(
     IN OUT PRX_CONTEXT RxContext)
 {
     NTSTATUS status = STATUS_MORE_PROCESSING_REQUIRED;
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+    __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
+    __notnull PNFS41_SRV_OPEN nfs41_srvopen =
+        NFS41GetSrvOpenExtension(SrvOpen);
+    PNFS41_FOBX nfs41_fobx;
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
     DbgEn();
     FsRtlEnterFileSystem();
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+    if (!nfs41_srvopen->collapsible)
+        goto out;
+
+    /*
+     * The new FOBX shares the open state of the SRV_OPEN, only
+     * |nfs41_CloseSrvOpen()| of the last FOBX sends
+     * |NFS41_SYSOP_CLOSE|
+     */
+    RxContext->pFobx = RxCreateNetFobx(RxContext, SrvOpen);
+    if (RxContext->pFobx == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+#ifdef DEBUG_OPEN
+    DbgP("nfs41_CollapseOpen: created FOBX 0x%p on srv_open=0x%p\n",
+        RxContext->pFobx, SrvOpen);
+#endif
+    nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+    status = nfs41_get_sec_ctx(SecurityImpersonation, &nfs41_fobx->sec_ctx);
+    if (status) {
+        /* Let |nfs41_DeallocateForFobx()| skip the token */
+        nfs41_fobx->sec_ctx.ClientToken = NULL;
+        RxDereferenceNetFobx(RxContext->pFobx, LHS_LockNotHeld);
+        RxContext->pFobx = NULL;
+        goto out;
+    }
+    nfs41_fobx->nfs41_open_state = nfs41_srvopen->nfs41_open_state;
+    nfs41_fobx->deleg_type = nfs41_srvopen->deleg_type;
+    nfs41_fobx->write_thru = nfs41_srvopen->write_thru;
+    nfs41_fobx->nocache = nfs41_srvopen->nocache;
+    nfs41_fobx->timebasedcoherency = nfs41_srvopen->timebasedcoherency;
+
+    RxContext->pFobx->OffsetOfNextEaToReturn = 1;
+    RxContext->Create.ReturnedCreateInformation = FILE_OPENED;
+    RxContext->CurrentIrp->IoStatus.Information = FILE_OPENED;
+    status = STATUS_SUCCESS;
+out:
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
     FsRtlExitFileSystem();
     DbgEx();
     return status;
@@ -1189,9 +1757,35 @@ NTSTATUS nfs41_CollapseOpen(
 NTSTATUS nfs41_ShouldTryToCollapseThisOpen(
     IN OUT PRX_CONTEXT RxContext)
 {
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+    PNFS41_SRV_OPEN nfs41_srvopen;
+    PNFS41_FCB nfs41_fcb;
+    LUID logon_id;
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
+
     if (RxContext->pRelevantSrvOpen == NULL)
         return STATUS_SUCCESS;
-    else return STATUS_MORE_PROCESSING_REQUIRED;
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+    /*
+     * RDBSS already checked that |DesiredAccess| and |ShareAccess|
+     * of |RxContext->pRelevantSrvOpen| match, but the NFS open has
+     * the credentials of the user who opened it first
+     */
+    nfs41_srvopen = NFS41GetSrvOpenExtension(RxContext->pRelevantSrvOpen);
+    nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+    if (!nfs41_srvopen->collapsible ||
+        nfs41_fcb->StandardInfo.Directory ||
+        nfs41_fcb->StandardInfo.DeletePending ||
+        !isCollapsibleOpen(&RxContext->Create.NtCreateParameters))
+        return STATUS_MORE_PROCESSING_REQUIRED;
+    if (nfs41_get_caller_logon_id(&logon_id) != STATUS_SUCCESS)
+        return STATUS_MORE_PROCESSING_REQUIRED;
+    if (!RtlEqualLuid(&logon_id, &nfs41_srvopen->logon_id))
+        return STATUS_MORE_PROCESSING_REQUIRED;
+    return STATUS_SUCCESS;
+#else
+    return STATUS_MORE_PROCESSING_REQUIRED;
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
 }
 
 NTSTATUS map_close_errors(
@@ -1238,7 +1832,8 @@ NTSTATUS nfs41_CloseSrvOpen(
 #endif
     FsRtlEnterFileSystem();
 
-    if (!nfs41_fobx->deleg_type && !nfs41_fcb->StandardInfo.Directory &&
+    if (!nfs41_fobx_deleg_type(SrvOpen, nfs41_fobx) &&
+            !nfs41_fcb->StandardInfo.Directory &&
             !RxContext->pFcb->OpenCount) {
         nfs41_remove_fcb_entry(RxContext->pFcb);
     }
@@ -1247,6 +1842,10 @@ NTSTATUS nfs41_CloseSrvOpen(
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    nfs41_UpcallSetFcbFilename(entry, nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
 
     entry->u.Close.srv_open = SrvOpen;
     if (nfs41_fcb->StandardInfo.DeletePending)
@@ -1261,6 +1860,13 @@ NTSTATUS nfs41_CloseSrvOpen(
         entry->u.Close.remove = nfs41_fcb->StandardInfo.DeletePending;
     if (!RxContext->pFcb->OpenCount)
         entry->u.Close.renamed = nfs41_fcb->Renamed;
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    /* the daemon drops them if the file gets removed */
+    entry->u.Close.setattr_flags = nfs41_fobx->setattr_flags;
+    entry->u.Close.basic_info = nfs41_fobx->setattr_basic;
+    entry->u.Close.eof = nfs41_fobx->setattr_eof;
+    nfs41_fobx->setattr_flags = 0;
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
 
     status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
     if (status) {
@@ -1271,6 +1877,20 @@ NTSTATUS nfs41_CloseSrvOpen(
 
     /* map windows ERRORs to NTSTATUS */
     status = map_close_errors(entry->status);
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    if (entry->u.Close.remove)
+        nfs41_volcache_invalidate(pVNetRootContext);
+#ifdef NFS41_DRIVER_SETATTR_AT_CLOSE
+    else if (entry->u.Close.setattr_flags & NFS41_CLOSE_FLAG_SET_EOF)
+        nfs41_volcache_invalidate(pVNetRootContext);
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE */
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
+#if defined(NFS41_DRIVER_SETATTR_AT_CLOSE) && \
+    defined(NFS41_DRIVER_FCB_ATTRCACHE)
+    /* other opens of the FCB must see the new attributes */
+    if (entry->u.Close.setattr_flags)
+        nfs41_fcb_attrcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_SETATTR_AT_CLOSE && NFS41_DRIVER_FCB_ATTRCACHE */
 out:
     if (entry) {
         nfs41_UpcallDestroy(entry);
@@ -83,6 +83,287 @@ static void print_readwrite_args(
         LowIoContext->ParamsFor.ReadWrite.Buffer);
 }
 
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+/*
+ * I/O buffer pool registered by the daemon with
+ * |IOCTL_NFS41_SET_IO_POOL|, see |NFS41_IO_POOL_REGISTRATION|
+ *
+ * |base| is an address in the daemon's address space, and is only
+ * accessed (with |ProbeForRead()|/|ProbeForWrite()|) from daemon
+ * threads while they marshal upcalls or unmarshal downcalls.
+ * |num_slots| is zero while no pool is registered. Changing the pool
+ * bumps |generation|, so that slots of an old pool are not returned
+ * to the new one.
+ */
+static struct {
+    volatile LONG num_slots;
+    volatile LONG generation;
+    PEPROCESS process;
+    PUCHAR base;
+    ULONG slot_size;
+    ULONG num_nodes;
+    volatile LONG used_bitmap[NFS41_IO_POOL_MAX_SLOTS / 32];
+} nfs41_io_pool;
+
+void nfs41_io_pool_reset(void)
+{
+    ULONG i;
+
+    (void)InterlockedExchange(&nfs41_io_pool.num_slots, 0);
+    (void)InterlockedIncrement(&nfs41_io_pool.generation);
+    for (i = 0; i < ARRAYSIZE(nfs41_io_pool.used_bitmap); i++)
+        (void)InterlockedExchange(&nfs41_io_pool.used_bitmap[i], 0);
+}
+
+NTSTATUS nfs41_io_pool_set(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PLOWIO_CONTEXT io_ctx = &RxContext->LowIoContext;
+    NFS41_IO_POOL_REGISTRATION reg;
+
+    if (io_ctx->ParamsFor.IoCtl.InputBufferLength < sizeof(reg)) {
+        status = STATUS_BUFFER_TOO_SMALL;
+        goto out;
+    }
+    RtlCopyMemory(&reg, io_ctx->ParamsFor.IoCtl.pInputBuffer, sizeof(reg));
+
+    nfs41_io_pool_reset();
+    if (reg.num_slots == 0)
+        goto out;
+
+    if ((reg.num_slots > NFS41_IO_POOL_MAX_SLOTS) ||
+        (reg.slot_size == 0) ||
+        (reg.slot_size > NFS41_IO_POOL_MAX_SLOT_SIZE) ||
+        (reg.slot_size % PAGE_SIZE) ||
+        (reg.base % PAGE_SIZE)) {
+        print_error("nfs41_io_pool_set: invalid pool "
+            "base=0x%llx slot_size=%lu num_slots=%lu\n",
+            reg.base, (unsigned long)reg.slot_size,
+            (unsigned long)reg.num_slots);
+        status = STATUS_INVALID_PARAMETER;
+        goto out;
+    }
+
+    __try {
+        ProbeForWrite((PVOID)(ULONG_PTR)reg.base,
+            (SIZE_T)reg.slot_size * reg.num_slots, PAGE_SIZE);
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        print_error("nfs41_io_pool_set: ProbeForWrite() failed, "
+            "status=0x%lx\n", (long)status);
+        goto out;
+    }
+
+    nfs41_io_pool.process = PsGetCurrentProcess();
+    nfs41_io_pool.base = (PUCHAR)(ULONG_PTR)reg.base;
+    nfs41_io_pool.slot_size = reg.slot_size;
+    nfs41_io_pool.num_nodes =
+        ((reg.num_nodes > 1) && (reg.num_nodes <= reg.num_slots))?
+            reg.num_nodes:1;
+    /* publish the pool last */
+    (void)InterlockedExchange(&nfs41_io_pool.num_slots,
+        (LONG)reg.num_slots);
+
+    DbgP("nfs41_io_pool_set: using %lu slots of %lu bytes at 0x%p, "
+        "%lu nodes\n",
+        (unsigned long)reg.num_slots, (unsigned long)reg.slot_size,
+        nfs41_io_pool.base, (unsigned long)nfs41_io_pool.num_nodes);
+out:
+    return status;
+}
+
+/*
+ * Use a pool slot as |entry->u.ReadWrite.buf| if the I/O fits into
+ * one and one is free, returns |STATUS_NO_MORE_ENTRIES| if the MDL
+ * must be mapped instead
+ */
+static NTSTATUS nfs41_io_pool_map_rw(
+    IN OUT nfs41_updowncall_entry *entry)
+{
+    NTSTATUS status = STATUS_NO_MORE_ENTRIES;
+    ULONG num_slots, slot, first = 0, i;
+    LONG generation;
+    PVOID sysbuf;
+    PUCHAR buf;
+
+    generation = nfs41_io_pool.generation;
+    num_slots = (ULONG)InterlockedCompareExchange(
+        &nfs41_io_pool.num_slots, 0, 0);
+    if ((num_slots == 0) ||
+        (entry->u.ReadWrite.buf_len > nfs41_io_pool.slot_size) ||
+        (entry->u.ReadWrite.buf_len >
+            MmGetMdlByteCount(entry->u.ReadWrite.MdlAddress)) ||
+        (PsGetCurrentProcess() != nfs41_io_pool.process))
+        goto out;
+
+#ifdef NFS41_DRIVER_NUMA_BUFFER_POOLS
+    /* start in the part of the pool on the upcall's node */
+    if (nfs41_io_pool.num_nodes > 1)
+        first = (entry->alloc_queue % nfs41_io_pool.num_nodes) *
+            (num_slots / nfs41_io_pool.num_nodes);
+#endif /* NFS41_DRIVER_NUMA_BUFFER_POOLS */
+
+    for (i = 0; i < num_slots; i++) {
+        slot = (first + i) % num_slots;
+        if (!InterlockedBitTestAndSet(
+            &nfs41_io_pool.used_bitmap[slot / 32], (LONG)(slot % 32)))
+            break;
+    }
+    if (i == num_slots)
+        goto out;
+
+    entry->u.ReadWrite.pool_buf = TRUE;
+    entry->u.ReadWrite.pool_slot = slot;
+    entry->u.ReadWrite.pool_generation = generation;
+    buf = nfs41_io_pool.base + ((SIZE_T)slot * nfs41_io_pool.slot_size);
+    entry->u.ReadWrite.buf = buf;
+    status = STATUS_SUCCESS;
+
+    if (entry->opcode != NFS41_SYSOP_WRITE)
+        goto out;
+
+    sysbuf = MmGetSystemAddressForMdlSafe(entry->u.ReadWrite.MdlAddress,
+        NormalPagePriority|MdlMappingNoExecute);
+    if (sysbuf == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out_release;
+    }
+    __try {
+        ProbeForWrite(buf, entry->u.ReadWrite.buf_len, 1);
+        RtlCopyMemory(buf, sysbuf, entry->u.ReadWrite.buf_len);
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        print_error("nfs41_io_pool_map_rw: copy to pool slot %lu "
+            "failed, status=0x%lx\n", (unsigned long)slot, (long)status);
+        goto out_release;
+    }
+out:
+    return status;
+
+out_release:
+    nfs41_io_pool_release(entry);
+    goto out;
+}
+
+/* For READ, copy |len| bytes from the pool slot to the caller's MDL */
+static NTSTATUS nfs41_io_pool_copy_read(
+    IN nfs41_updowncall_entry *entry,
+    IN ULONG len)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PVOID sysbuf;
+
+    if (len == 0)
+        goto out;
+    if ((len > nfs41_io_pool.slot_size) ||
+        (len > MmGetMdlByteCount(entry->u.ReadWrite.MdlAddress)) ||
+        (PsGetCurrentProcess() != nfs41_io_pool.process)) {
+        print_error("nfs41_io_pool_copy_read: invalid downcall, "
+            "len=%lu\n", (unsigned long)len);
+        status = STATUS_INTERNAL_ERROR;
+        goto out;
+    }
+
+    sysbuf = MmGetSystemAddressForMdlSafe(entry->u.ReadWrite.MdlAddress,
+        NormalPagePriority|MdlMappingNoExecute);
+    if (sysbuf == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+    __try {
+        ProbeForRead(entry->u.ReadWrite.buf, len, 1);
+        RtlCopyMemory(sysbuf, entry->u.ReadWrite.buf, len);
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        print_error("nfs41_io_pool_copy_read: copy from pool slot %lu "
+            "failed, status=0x%lx\n",
+            (unsigned long)entry->u.ReadWrite.pool_slot, (long)status);
+    }
+out:
+    return status;
+}
+
+void nfs41_io_pool_release(
+    IN OUT nfs41_updowncall_entry *entry)
+{
+    ULONG slot = entry->u.ReadWrite.pool_slot;
+
+    if (entry->u.ReadWrite.pool_generation == nfs41_io_pool.generation) {
+        (void)InterlockedBitTestAndReset(
+            &nfs41_io_pool.used_bitmap[slot / 32], (LONG)(slot % 32));
+    }
+    entry->u.ReadWrite.pool_buf = FALSE;
+    entry->u.ReadWrite.buf = NULL;
+}
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
+
+#ifdef NFS41_DRIVER_INLINE_RW
+/*
+ * Marshal a READ/WRITE of up to |NFS41_RW_INLINE_MAX| bytes without a
+ * buffer mapping: The buffer address is |NULL|, and WRITE data
+ * follows in the upcall buffer. |*tmp| is advanced past the data.
+ */
+static NTSTATUS marshal_nfs41_rw_inline(
+    IN OUT nfs41_updowncall_entry *entry,
+    IN OUT unsigned char **tmp)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    const HANDLE nobuf = NULL;
+    PVOID sysbuf;
+
+    RtlCopyMemory(*tmp, &nobuf, sizeof(HANDLE));
+    *tmp += sizeof(HANDLE);
+
+    if (entry->opcode == NFS41_SYSOP_WRITE) {
+        sysbuf = MmGetSystemAddressForMdlSafe(
+            entry->u.ReadWrite.MdlAddress,
+            NormalPagePriority|MdlMappingNoExecute);
+        if (sysbuf == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto out;
+        }
+        RtlCopyMemory(*tmp, sysbuf, entry->u.ReadWrite.buf_len);
+        *tmp += entry->u.ReadWrite.buf_len;
+    }
+    entry->u.ReadWrite.inline_data = TRUE;
+out:
+    return status;
+}
+
+/* Copy the data of an inline READ downcall to the caller's MDL */
+static NTSTATUS unmarshal_nfs41_rw_inline(
+    IN nfs41_updowncall_entry *cur,
+    IN ULONG req_len,
+    IN OUT const unsigned char *restrict *restrict buf)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG len = cur->u.ReadWrite.buf_len;
+    PVOID sysbuf;
+
+    if (len == 0)
+        goto out;
+    if (len > req_len) {
+        print_error("unmarshal_nfs41_rw_inline: daemon returned "
+            "%lu bytes for a %lu byte READ\n",
+            (unsigned long)len, (unsigned long)req_len);
+        status = STATUS_INTERNAL_ERROR;
+        goto out;
+    }
+
+    sysbuf = MmGetSystemAddressForMdlSafe(cur->u.ReadWrite.MdlAddress,
+        NormalPagePriority|MdlMappingNoExecute);
+    if (sysbuf == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+    RtlCopyMemory(sysbuf, *buf, len);
+    *buf += len;
+out:
+    return status;
+}
+#endif /* NFS41_DRIVER_INLINE_RW */
+
 NTSTATUS marshal_nfs41_rw(
     nfs41_updowncall_entry *entry,
     unsigned char *buf,
@@ -99,7 +380,8 @@ NTSTATUS marshal_nfs41_rw(
     tmp += *len;
 
     header_len = *len + sizeof(entry->u.ReadWrite.buf_len) +
-        sizeof(entry->u.ReadWrite.offset) + sizeof(HANDLE);
+        sizeof(entry->u.ReadWrite.offset) +
+        sizeof(entry->u.ReadWrite.flags) + sizeof(HANDLE);
     if (header_len > buf_len) {
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto out;
@@ -111,6 +393,35 @@ NTSTATUS marshal_nfs41_rw(
     RtlCopyMemory(tmp, &entry->u.ReadWrite.offset,
         sizeof(entry->u.ReadWrite.offset));
     tmp += sizeof(entry->u.ReadWrite.offset);
+    RtlCopyMemory(tmp, &entry->u.ReadWrite.flags,
+        sizeof(entry->u.ReadWrite.flags));
+    tmp += sizeof(entry->u.ReadWrite.flags);
+
+#ifdef NFS41_DRIVER_INLINE_RW
+    if ((entry->u.ReadWrite.buf_len <= NFS41_RW_INLINE_MAX) &&
+        (entry->u.ReadWrite.buf_len <=
+            MmGetMdlByteCount(entry->u.ReadWrite.MdlAddress)) &&
+        ((entry->opcode == NFS41_SYSOP_READ) ||
+            ((header_len + entry->u.ReadWrite.buf_len) <= buf_len))) {
+        status = marshal_nfs41_rw_inline(entry, &tmp);
+        if (status)
+            goto out;
+        if (entry->opcode == NFS41_SYSOP_WRITE)
+            header_len += entry->u.ReadWrite.buf_len;
+        goto marshal_done;
+    }
+#endif /* NFS41_DRIVER_INLINE_RW */
+
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+    /* direct I/O is never copied through a pool slot */
+    if (!(entry->u.ReadWrite.flags & NFS41_RW_FLAG_DIRECT_IO)) {
+        status = nfs41_io_pool_map_rw(entry);
+        if (status == STATUS_SUCCESS)
+            goto marshal_buf;
+        if (status != STATUS_NO_MORE_ENTRIES)
+            goto out;
+    }
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
 
 #pragma warning( push )
 /*
@@ -142,9 +453,15 @@ NTSTATUS marshal_nfs41_rw(
         goto out;
     }
 
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+marshal_buf:
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
     RtlCopyMemory(tmp, &entry->u.ReadWrite.buf, sizeof(HANDLE));
     tmp += sizeof(HANDLE);
 
+#ifdef NFS41_DRIVER_INLINE_RW
+marshal_done:
+#endif /* NFS41_DRIVER_INLINE_RW */
     *len = (ULONG)(tmp - buf);
     if (*len != header_len) {
         DbgP("marshal_nfs41_rw: *len(=%ld) != header_len(=%ld)\n",
@@ -168,6 +485,9 @@ NTSTATUS unmarshal_nfs41_rw(
     const unsigned char *restrict *restrict buf)
 {
     NTSTATUS status = STATUS_SUCCESS;
+#ifdef NFS41_DRIVER_INLINE_RW
+    const ULONG req_len = cur->u.ReadWrite.buf_len;
+#endif /* NFS41_DRIVER_INLINE_RW */
 
     RtlCopyMemory(&cur->u.ReadWrite.buf_len, *buf,
         sizeof(cur->u.ReadWrite.buf_len));
@@ -178,6 +498,21 @@ NTSTATUS unmarshal_nfs41_rw(
     DbgP("unmarshal_nfs41_rw: returned len %lu ChangeTime %llu\n",
         cur->u.ReadWrite.buf_len, cur->ChangeTime);
 #endif
+#ifdef NFS41_DRIVER_INLINE_RW
+    if (cur->u.ReadWrite.inline_data) {
+        if (cur->opcode == NFS41_SYSOP_READ)
+            status = unmarshal_nfs41_rw_inline(cur, req_len, buf);
+        return status;
+    }
+#endif /* NFS41_DRIVER_INLINE_RW */
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+    if (cur->u.ReadWrite.pool_buf) {
+        if (cur->opcode == NFS41_SYSOP_READ)
+            status = nfs41_io_pool_copy_read(cur, cur->u.ReadWrite.buf_len);
+        nfs41_io_pool_release(cur);
+        return status;
+    }
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
 #if 1
     /*
      * 08/27/2010: it looks like we really don't need to call
@@ -193,6 +528,15 @@ NTSTATUS unmarshal_nfs41_rw(
     return status;
 }
 
+NTSTATUS marshal_nfs41_flush(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len)
+{
+    return marshal_nfs41_header(entry, buf, buf_len, len);
+}
+
 NTSTATUS map_readwrite_errors(
     DWORD status)
 {
@@ -225,6 +569,98 @@ static NTSTATUS check_nfs41_read_args(
     return STATUS_SUCCESS;
 }
 
+/*
+ * Complete a READ/WRITE from |nfs41_downcall()| instead of waiting
+ * for the downcall in |nfs41_Read()|/|nfs41_Write()|, for overlapped
+ * I/O and for I/O which RDBSS handles asynchronously (e.g. paging
+ * writes from the mapped/modified page writers). This does not park
+ * a thread per outstanding I/O, so the queue depth is only limited
+ * by the daemon.
+ */
+static BOOLEAN nfs41_rw_is_async(
+    IN PRX_CONTEXT RxContext)
+{
+    return ((FlagOn(RxContext->CurrentIrpSp->FileObject->Flags,
+            FO_SYNCHRONOUS_IO) == FALSE) ||
+        BooleanFlagOn(RxContext->Flags, RX_CONTEXT_FLAG_ASYNC_OPERATION));
+}
+
+#ifdef NFS41_DRIVER_DIRECT_IO
+/*
+ * Return the |NFS41_RW_FLAG_*| for a READ/WRITE, see
+ * |NFS41_DRIVER_DIRECT_IO|. Paging I/O and unaligned I/O is never
+ * direct I/O, but write-through is flagged for all I/O so that the
+ * daemon sends the data stable.
+ */
+static ULONG nfs41_rw_flags(
+    IN PRX_CONTEXT RxContext)
+{
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(RxContext->pRelevantSrvOpen->pVNetRoot);
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+    ULONG flags = 0;
+
+    if (nfs41_fobx->write_thru || pVNetRootContext->write_thru ||
+        FlagOn(RxContext->CurrentIrpSp->Flags, SL_WRITE_THROUGH) ||
+        FlagOn(RxContext->CurrentIrpSp->FileObject->Flags,
+            FO_WRITE_THROUGH))
+        flags |= NFS41_RW_FLAG_WRITE_THROUGH;
+
+    if (BooleanFlagOn(LowIoContext->ParamsFor.ReadWrite.Flags,
+            LOWIO_READWRITEFLAG_PAGING_IO) ||
+        (!nfs41_fobx->nocache && !pVNetRootContext->nocache) ||
+        (LowIoContext->ParamsFor.ReadWrite.ByteOffset %
+            NFS41_DIRECT_IO_ALIGNMENT) ||
+        (LowIoContext->ParamsFor.ReadWrite.ByteCount %
+            NFS41_DIRECT_IO_ALIGNMENT))
+        goto out;
+
+    flags |= NFS41_RW_FLAG_DIRECT_IO;
+out:
+    return flags;
+}
+#endif /* NFS41_DRIVER_DIRECT_IO */
+
+/* Finish a READ after its downcall arrived */
+static NTSTATUS nfs41_read_done(
+    IN OUT PRX_CONTEXT RxContext,
+    IN nfs41_updowncall_entry *entry)
+{
+    NTSTATUS status;
+    PLOWIO_CONTEXT LowIoContext  = &RxContext->LowIoContext;
+    __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+
+    if (entry->status == NO_ERROR) {
+#ifdef ENABLE_TIMINGS
+        InterlockedIncrement(&read.sops);
+        InterlockedAdd64(&read.size, entry->u.ReadWrite.len);
+#endif
+        status = RxContext->CurrentIrp->IoStatus.Status = STATUS_SUCCESS;
+        RxContext->IoStatusBlock.Information = entry->u.ReadWrite.buf_len;
+
+        if ((!BooleanFlagOn(LowIoContext->ParamsFor.ReadWrite.Flags,
+                LOWIO_READWRITEFLAG_PAGING_IO) &&
+                (SrvOpen->DesiredAccess & FILE_READ_DATA) &&
+                !pVNetRootContext->nocache && !nfs41_fobx->nocache &&
+                !(SrvOpen->BufferingFlags &
+                (FCB_STATE_READBUFFERING_ENABLED |
+                 FCB_STATE_READCACHING_ENABLED)))) {
+            enable_caching(SrvOpen, nfs41_fobx, nfs41_fcb->changeattr,
+                pVNetRootContext->session);
+        }
+    } else {
+        status = map_readwrite_errors(entry->status);
+        RxContext->CurrentIrp->IoStatus.Status = status;
+        RxContext->IoStatusBlock.Information = 0;
+    }
+    return status;
+}
+
 NTSTATUS nfs41_Read(
     IN OUT PRX_CONTEXT RxContext)
 {
@@ -237,7 +673,6 @@ NTSTATUS nfs41_Read(
         NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
     __notnull PNFS41_NETROOT_EXTENSION pNetRootContext =
         NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
-    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
     __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
     LONGLONG io_delay;
 #ifdef ENABLE_TIMINGS
@@ -254,19 +689,31 @@ NTSTATUS nfs41_Read(
     status = check_nfs41_read_args(RxContext);
     if (status) goto out;
 
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+    if (nfs41_fobx->locks_lost) {
+        status = STATUS_FILE_LOCK_CONFLICT;
+        goto out;
+    }
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
+
     status = nfs41_UpcallCreate(NFS41_SYSOP_READ, &nfs41_fobx->sec_ctx,
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.ReadWrite.MdlAddress = LowIoContext->ParamsFor.ReadWrite.Buffer;
     entry->u.ReadWrite.buf_len = LowIoContext->ParamsFor.ReadWrite.ByteCount;
     entry->u.ReadWrite.offset = LowIoContext->ParamsFor.ReadWrite.ByteOffset;
-    if (FlagOn(RxContext->CurrentIrpSp->FileObject->Flags,
-            FO_SYNCHRONOUS_IO) == FALSE) {
+#ifdef NFS41_DRIVER_DIRECT_IO
+    entry->u.ReadWrite.flags = nfs41_rw_flags(RxContext);
+#endif /* NFS41_DRIVER_DIRECT_IO */
+    if (nfs41_rw_is_async(RxContext)) {
         entry->u.ReadWrite.rxcontext = RxContext;
         async = entry->async_op = TRUE;
     }
+    /* synchronous paging reads are page faults somebody waits for */
+    entry->prio = async?NFS41_UPCALL_PRIO_BULK_IO:NFS41_UPCALL_PRIO_SYNC_IO;
 
     /* Add extra timeout depending on buffer size */
     io_delay = pVNetRootContext->timeout +
@@ -287,29 +734,7 @@ NTSTATUS nfs41_Read(
         goto out;
     }
 
-    if (entry->status == NO_ERROR) {
-#ifdef ENABLE_TIMINGS
-        InterlockedIncrement(&read.sops);
-        InterlockedAdd64(&read.size, entry->u.ReadWrite.len);
-#endif
-        status = RxContext->CurrentIrp->IoStatus.Status = STATUS_SUCCESS;
-        RxContext->IoStatusBlock.Information = entry->u.ReadWrite.buf_len;
-
-        if ((!BooleanFlagOn(LowIoContext->ParamsFor.ReadWrite.Flags,
-                LOWIO_READWRITEFLAG_PAGING_IO) &&
-                (SrvOpen->DesiredAccess & FILE_READ_DATA) &&
-                !pVNetRootContext->nocache && !nfs41_fobx->nocache &&
-                !(SrvOpen->BufferingFlags &
-                (FCB_STATE_READBUFFERING_ENABLED |
-                 FCB_STATE_READCACHING_ENABLED)))) {
-            enable_caching(SrvOpen, nfs41_fobx, nfs41_fcb->changeattr,
-                pVNetRootContext->session);
-        }
-    } else {
-        status = map_readwrite_errors(entry->status);
-        RxContext->CurrentIrp->IoStatus.Status = status;
-        RxContext->IoStatusBlock.Information = 0;
-    }
+    status = nfs41_read_done(RxContext, entry);
 out:
     if (entry) {
         nfs41_UpcallDestroy(entry);
@@ -351,6 +776,83 @@ out:
     return status;
 }
 
+/* Finish a WRITE after its downcall arrived */
+static NTSTATUS nfs41_write_done(
+    IN OUT PRX_CONTEXT RxContext,
+    IN nfs41_updowncall_entry *entry)
+{
+    NTSTATUS status;
+    PLOWIO_CONTEXT LowIoContext  = &RxContext->LowIoContext;
+    __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+
+    if (entry->status == NO_ERROR) {
+        //update cached file attributes
+#ifdef ENABLE_TIMINGS
+        InterlockedIncrement(&write.sops);
+        InterlockedAdd64(&write.size, entry->u.ReadWrite.len);
+#endif
+        status = RxContext->CurrentIrp->IoStatus.Status = STATUS_SUCCESS;
+        RxContext->IoStatusBlock.Information = entry->u.ReadWrite.buf_len;
+        nfs41_fcb->changeattr = entry->ChangeTime;
+
+        //re-enable write buffering
+        if (!BooleanFlagOn(LowIoContext->ParamsFor.ReadWrite.Flags,
+                LOWIO_READWRITEFLAG_PAGING_IO) &&
+                (SrvOpen->DesiredAccess & (FILE_WRITE_DATA | FILE_APPEND_DATA)) &&
+                !pVNetRootContext->write_thru &&
+                !pVNetRootContext->nocache &&
+                !nfs41_fobx->write_thru && !nfs41_fobx->nocache &&
+                !(SrvOpen->BufferingFlags &
+                (FCB_STATE_WRITEBUFFERING_ENABLED |
+                 FCB_STATE_WRITECACHING_ENABLED))) {
+            enable_caching(SrvOpen, nfs41_fobx, nfs41_fcb->changeattr,
+                pVNetRootContext->session);
+        } else if (!nfs41_fobx_deleg_type(SrvOpen, nfs41_fobx))
+            nfs41_update_fcb_list(RxContext->pFcb, entry->ChangeTime);
+
+    } else {
+        status = map_readwrite_errors(entry->status);
+        RxContext->CurrentIrp->IoStatus.Status = status;
+        RxContext->IoStatusBlock.Information = 0;
+    }
+    return status;
+}
+
+/*
+ * Apply "writebehind=<KB>": Limit the dirty data of a file in the
+ * Cache Manager, so writers are throttled and write-behind starts
+ * once that many pages are dirty. The threshold needs the file's
+ * shared cache map, which RDBSS only creates on the first cached
+ * write, so it is set on the first (paging) write we see for it.
+ */
+static void nfs41_set_writebehind(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    PFILE_OBJECT FileObject = RxContext->CurrentIrpSp->FileObject;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(RxContext->pRelevantSrvOpen->pVNetRoot);
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+
+    if ((pVNetRootContext->writebehind_pages == 0) ||
+        nfs41_fcb->writebehind_set ||
+        (FileObject == NULL) ||
+        (FileObject->SectionObjectPointer == NULL) ||
+        (FileObject->SectionObjectPointer->SharedCacheMap == NULL))
+        return;
+
+    CcSetDirtyPageThreshold(FileObject, pVNetRootContext->writebehind_pages);
+    nfs41_fcb->writebehind_set = TRUE;
+#ifdef DEBUG_WRITE
+    DbgP("nfs41_set_writebehind: '%wZ' dirty page threshold=%lu\n",
+        RxContext->pRelevantSrvOpen->pAlreadyPrefixedName,
+        (unsigned long)pVNetRootContext->writebehind_pages);
+#endif
+}
+
 NTSTATUS nfs41_Write(
     IN OUT PRX_CONTEXT RxContext)
 {
@@ -380,25 +882,54 @@ NTSTATUS nfs41_Write(
     status = check_nfs41_write_args(RxContext);
     if (status) goto out;
 
+#ifdef NFS41_DRIVER_DELEGATED_LOCK_BUFFERING
+    if (nfs41_fobx->locks_lost) {
+        status = STATUS_FILE_LOCK_CONFLICT;
+        goto out;
+    }
+#endif /* NFS41_DRIVER_DELEGATED_LOCK_BUFFERING */
+
+    nfs41_set_writebehind(RxContext);
+
     status = nfs41_UpcallCreate(NFS41_SYSOP_WRITE, &nfs41_fobx->sec_ctx,
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.ReadWrite.MdlAddress = LowIoContext->ParamsFor.ReadWrite.Buffer;
     entry->u.ReadWrite.buf_len = LowIoContext->ParamsFor.ReadWrite.ByteCount;
     entry->u.ReadWrite.offset = LowIoContext->ParamsFor.ReadWrite.ByteOffset;
-
-    if (FlagOn(RxContext->CurrentIrpSp->FileObject->Flags,
-            FO_SYNCHRONOUS_IO) == FALSE) {
+#ifdef NFS41_DRIVER_DIRECT_IO
+    entry->u.ReadWrite.flags = nfs41_rw_flags(RxContext);
+#endif /* NFS41_DRIVER_DIRECT_IO */
+#ifdef NFS41_DRIVER_PAGING_WRITE_CLUSTERING
+    if (BooleanFlagOn(LowIoContext->ParamsFor.ReadWrite.Flags,
+            LOWIO_READWRITEFLAG_PAGING_IO))
+        entry->u.ReadWrite.flags |= NFS41_RW_FLAG_PAGING_IO;
+#endif /* NFS41_DRIVER_PAGING_WRITE_CLUSTERING */
+
+    if (nfs41_rw_is_async(RxContext)) {
         entry->u.ReadWrite.rxcontext = RxContext;
         async = entry->async_op = TRUE;
     }
+    /* cache flushes and write-behind must not delay interactive I/O */
+    entry->prio = (async ||
+        BooleanFlagOn(LowIoContext->ParamsFor.ReadWrite.Flags,
+            LOWIO_READWRITEFLAG_PAGING_IO))?
+        NFS41_UPCALL_PRIO_BULK_IO:NFS41_UPCALL_PRIO_SYNC_IO;
 
     /* Add extra timeout depending on buffer size */
     io_delay = pVNetRootContext->timeout +
         EXTRA_TIMEOUT_PER_BYTE(entry->u.ReadWrite.buf_len);
     status = nfs41_UpcallWaitForReply(entry, io_delay);
+#ifdef NFS41_DRIVER_FCB_ATTRCACHE
+    /*
+     * The WRITE changes mtime/size, also for async, failed or
+     * timed-out writes
+     */
+    nfs41_fcb_attrcache_invalidate(nfs41_fcb);
+#endif /* NFS41_DRIVER_FCB_ATTRCACHE */
     if (status) {
         /* Timeout - |nfs41_downcall()| will free |entry|+contents */
         entry = NULL;
@@ -414,36 +945,7 @@ NTSTATUS nfs41_Write(
         goto out;
     }
 
-    if (entry->status == NO_ERROR) {
-        //update cached file attributes
-#ifdef ENABLE_TIMINGS
-        InterlockedIncrement(&write.sops);
-        InterlockedAdd64(&write.size, entry->u.ReadWrite.len);
-#endif
-        status = RxContext->CurrentIrp->IoStatus.Status = STATUS_SUCCESS;
-        RxContext->IoStatusBlock.Information = entry->u.ReadWrite.buf_len;
-        nfs41_fcb->changeattr = entry->ChangeTime;
-
-        //re-enable write buffering
-        if (!BooleanFlagOn(LowIoContext->ParamsFor.ReadWrite.Flags,
-                LOWIO_READWRITEFLAG_PAGING_IO) &&
-                (SrvOpen->DesiredAccess & (FILE_WRITE_DATA | FILE_APPEND_DATA)) &&
-                !pVNetRootContext->write_thru &&
-                !pVNetRootContext->nocache &&
-                !nfs41_fobx->write_thru && !nfs41_fobx->nocache &&
-                !(SrvOpen->BufferingFlags &
-                (FCB_STATE_WRITEBUFFERING_ENABLED |
-                 FCB_STATE_WRITECACHING_ENABLED))) {
-            enable_caching(SrvOpen, nfs41_fobx, nfs41_fcb->changeattr,
-                pVNetRootContext->session);
-        } else if (!nfs41_fobx->deleg_type)
-            nfs41_update_fcb_list(RxContext->pFcb, entry->ChangeTime);
-
-    } else {
-        status = map_readwrite_errors(entry->status);
-        RxContext->CurrentIrp->IoStatus.Status = status;
-        RxContext->IoStatusBlock.Information = 0;
-    }
+    status = nfs41_write_done(RxContext, entry);
 out:
     if (entry) {
         nfs41_UpcallDestroy(entry);
@@ -464,6 +966,22 @@ out:
     return status;
 }
 
+/*
+ * Called by |nfs41_downcall()| for asynchronous READs/WRITEs (see
+ * |nfs41_rw_is_async()|), after the downcall has been unmarshalled
+ */
+void nfs41_rw_async_complete(
+    IN OUT nfs41_updowncall_entry *entry)
+{
+    PRX_CONTEXT RxContext = entry->u.ReadWrite.rxcontext;
+
+    if (entry->opcode == NFS41_SYSOP_READ)
+        RxContext->StoredStatus = nfs41_read_done(RxContext, entry);
+    else
+        RxContext->StoredStatus = nfs41_write_done(RxContext, entry);
+    RxLowIoCompletion(RxContext);
+}
+
 ULONG nfs41_ExtendForCache(
     IN OUT PRX_CONTEXT RxContext,
     IN PLARGE_INTEGER pNewFileSize,
@@ -87,7 +87,7 @@ NTSTATUS marshal_nfs41_symlink(
         goto out;
     tmp += *len;
 
-    header_len = *len + length_as_utf8(entry->filename);
+    header_len = *len + length_filename_as_utf8(entry);
     if (entry->opcode == NFS41_SYSOP_SYMLINK_SET)
         header_len += length_as_utf8(entry->u.Symlink.target);
     if (header_len > buf_len) {
@@ -95,7 +95,7 @@ NTSTATUS marshal_nfs41_symlink(
         goto out;
     }
 
-    status = marshall_unicode_as_utf8(&tmp, entry->filename);
+    status = marshall_filename_as_utf8(&tmp, entry);
     if (status) goto out;
     if (entry->opcode == NFS41_SYSOP_SYMLINK_SET) {
         status = marshall_unicode_as_utf8(&tmp, entry->u.Symlink.target);
@@ -419,6 +419,10 @@ NTSTATUS nfs41_SetSymlinkReparsePoint(
         VNetRootContext->session, Fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    nfs41_UpcallSetFcbFilename(entry, NFS41GetFcbExtension(RxContext->pFcb));
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
 
     entry->u.Symlink.target = &TargetName;
 
@@ -605,6 +609,10 @@ NTSTATUS nfs41_GetSymlinkReparsePoint(
         VNetRootContext->session, Fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+    nfs41_UpcallSetFcbFilename(entry, NFS41GetFcbExtension(RxContext->pFcb));
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
 
     entry->u.Symlink.target = &TargetName;
 
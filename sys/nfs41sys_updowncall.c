@@ -69,23 +69,48 @@
 #include "nfs41sys_driver.h"
 #include "nfs41sys_util.h"
 
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+/* {ba6b8b68-22a6-49ec-9e65-6ea73ed83cda} */
+TRACELOGGING_DEFINE_PROVIDER(nfs41_trace_provider,
+    "NFS41-Client-Driver",
+    (0xba6b8b68, 0x22a6, 0x49ec,
+        0x9e, 0x65, 0x6e, 0xa7, 0x3e, 0xd8, 0x3c, 0xda));
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
 
+
+/* Index of the |upcalllist.queues| entry for the current processor */
+static ULONG nfs41_upcall_current_queue(void)
+{
+#ifdef NFS41_DRIVER_NUMA_UPCALL_QUEUES
+    return (ULONG)KeGetCurrentNodeNumber() % upcalllist.num_queues;
+#else
+    return 0;
+#endif /* NFS41_DRIVER_NUMA_UPCALL_QUEUES */
+}
+
+/*
+ * Allocate an upcall entry from the lookasidelist of NUMA node
+ * |queue|, the caller must store |queue| in |e->alloc_queue| after
+ * initialising the entry
+ */
 static
-nfs41_updowncall_entry *nfs41_upcall_allocate_updowncall_entry(void)
+nfs41_updowncall_entry *nfs41_upcall_allocate_updowncall_entry(
+    IN ULONG queue)
 {
     nfs41_updowncall_entry *e;
 #ifdef USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM
     e = ExAllocateFromNPagedLookasideList(
-        &updowncall_entry_upcall_lookasidelist);
+        &updowncall_entry_upcall_lookasidelist[queue]);
 
 #ifdef LOOKASIDELISTS_STATS
     volatile static long cnt = 0;
     if ((cnt++ % 100) == 0) {
         print_lookasidelist_stat("updowncall_entry_upcall",
-            &updowncall_entry_upcall_lookasidelist);
+            &updowncall_entry_upcall_lookasidelist[queue]);
     }
 #endif /* LOOKASIDELISTS_STATS */
 #else
+    (void)queue;
     e = RxAllocatePoolWithTag(NonPagedPoolNx,
         sizeof(nfs41_updowncall_entry),
         NFS41_MM_POOLTAG_UP);
@@ -98,7 +123,8 @@ static
 void nfs41_upcall_free_updowncall_entry(nfs41_updowncall_entry *entry)
 {
 #ifdef USE_LOOKASIDELISTS_FOR_UPDOWNCALLENTRY_MEM
-    ExFreeToNPagedLookasideList(&updowncall_entry_upcall_lookasidelist,
+    ExFreeToNPagedLookasideList(
+        &updowncall_entry_upcall_lookasidelist[entry->alloc_queue],
         entry);
 #else
     RxFreePool(entry);
@@ -141,6 +167,757 @@ void nfs41_downcall_free_updowncall_entry(nfs41_updowncall_entry *entry)
 }
 #endif /* !USE_STACK_FOR_DOWNCALL_UPDOWNCALLENTRY_MEM */
 
+static
+void update_max_stat(volatile LONG *stat, LONG val)
+{
+    LONG oldval;
+
+    for (oldval = *stat ; val > oldval ; oldval = *stat) {
+        if (InterlockedCompareExchange(stat, val, oldval) == oldval)
+            break;
+    }
+}
+
+/*
+ * Upcall priority classes
+ *
+ * Each |nfs41_upcall_queue| has one FIFO per |nfs41_upcall_prio|. The
+ * daemon gets upcalls in weighted round robin order: Each round, a
+ * class may be dequeued |nfs41_upcall_prio_weights[class]| times,
+ * higher classes first. A new round starts when all non-empty classes
+ * have used their credits. This keeps interactive OPENs and directory
+ * queries from waiting behind hundreds of queued paging writes, and
+ * still lets every class make progress.
+ */
+static const LONG nfs41_upcall_prio_weights[NFS41_UPCALL_PRIO_NUM] = {
+    8, /* NFS41_UPCALL_PRIO_METADATA */
+    4, /* NFS41_UPCALL_PRIO_SYNC_IO */
+    2, /* NFS41_UPCALL_PRIO_BULK_IO */
+    1  /* NFS41_UPCALL_PRIO_BACKGROUND */
+};
+
+void nfs41_upcalllist_init(void)
+{
+    nfs41_upcall_queue *queue;
+    ULONG i, prio;
+
+#ifdef NFS41_DRIVER_NUMA_UPCALL_QUEUES
+    upcalllist.num_queues = min(KeQueryHighestNodeNumber() + 1UL,
+        (ULONG)NFS41_UPCALL_MAX_NODES);
+#else
+    upcalllist.num_queues = 1;
+#endif /* NFS41_DRIVER_NUMA_UPCALL_QUEUES */
+    DbgP("nfs41_upcalllist_init: %lu upcall queues\n",
+        (unsigned long)upcalllist.num_queues);
+
+    for (i = 0; i < upcalllist.num_queues; i++) {
+        queue = &upcalllist.queues[i];
+        ExInitializeFastMutex(&queue->lock);
+        for (prio = 0; prio < NFS41_UPCALL_PRIO_NUM; prio++) {
+            InitializeListHead(&queue->head[prio]);
+            queue->credits[prio] = nfs41_upcall_prio_weights[prio];
+        }
+        queue->count = 0;
+        queue->waiters = 0;
+        KeInitializeEvent(&queue->event, SynchronizationEvent, FALSE);
+    }
+}
+
+static nfs41_upcall_prio nfs41_upcall_get_prio(
+    IN const nfs41_updowncall_entry *entry)
+{
+    switch (entry->opcode) {
+    case NFS41_SYSOP_READ:
+    case NFS41_SYSOP_WRITE:
+        return entry->prio;
+    case NFS41_SYSOP_FILE_QUERY_TIME_BASED_COHERENCY:
+    case NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH:
+        return NFS41_UPCALL_PRIO_BACKGROUND;
+    default:
+        return NFS41_UPCALL_PRIO_METADATA;
+    }
+}
+
+/*
+ * Return the entry of |queue| which should be dequeued next, without
+ * removing it. Must be called with |queue->lock| held, may start a
+ * new round.
+ */
+static nfs41_updowncall_entry *nfs41_upcall_queue_peek(
+    IN OUT nfs41_upcall_queue *queue)
+{
+    ULONG prio, round;
+
+    for (round = 0; round < 2; round++) {
+        for (prio = 0; prio < NFS41_UPCALL_PRIO_NUM; prio++) {
+            if ((queue->credits[prio] > 0) &&
+                !IsListEmpty(&queue->head[prio])) {
+                return (nfs41_updowncall_entry *)CONTAINING_RECORD(
+                    queue->head[prio].Flink,
+                    nfs41_updowncall_entry, next);
+            }
+        }
+        /* all non-empty classes used their credits, start a new round */
+        for (prio = 0; prio < NFS41_UPCALL_PRIO_NUM; prio++)
+            queue->credits[prio] = nfs41_upcall_prio_weights[prio];
+    }
+    return NULL;
+}
+
+/* Remove |entry| as returned by |nfs41_upcall_queue_peek()| */
+static void nfs41_upcall_queue_take(
+    IN OUT nfs41_upcall_queue *queue,
+    IN nfs41_updowncall_entry *entry)
+{
+    queue->credits[entry->prio]--;
+    RemoveEntryList(&entry->next);
+    (void)InterlockedDecrement(&queue->count);
+    nfs41_upcalllist_removed(entry);
+}
+
+/*
+ * Remove the next upcall in priority order from the queue of the
+ * current NUMA node, or steal one from the other queues if that is
+ * empty. If |match| is not |NULL| an entry is only removed if
+ * |match(entry, context)| returns |TRUE|.
+ * Returns |NULL| if no (matching) entry was found.
+ */
+static nfs41_updowncall_entry *nfs41_upcalllist_remove_matching(
+    IN BOOLEAN (*match)(IN const nfs41_updowncall_entry *, IN void *),
+    IN void *context)
+{
+    nfs41_upcall_queue *queue;
+    nfs41_updowncall_entry *entry = NULL;
+    ULONG first, i;
+
+    first = nfs41_upcall_current_queue();
+    for (i = 0; i < upcalllist.num_queues; i++) {
+        queue = &upcalllist.queues[(first + i) % upcalllist.num_queues];
+        /* skip empty queues without touching their lock */
+        if (InterlockedAdd(&queue->count, 0) == 0)
+            continue;
+
+        ExAcquireFastMutexUnsafe(&queue->lock);
+        entry = nfs41_upcall_queue_peek(queue);
+        if (entry && ((match == NULL) || match(entry, context)))
+            nfs41_upcall_queue_take(queue, entry);
+        else
+            entry = NULL;
+        ExReleaseFastMutexUnsafe(&queue->lock);
+
+        if (entry) {
+            if (i > 0)
+                (void)InterlockedIncrement(&upcalllist.steals);
+            break;
+        }
+    }
+    return entry;
+}
+
+/*
+ * Remove the next upcall in priority order, returns |NULL| if all
+ * upcall queues are empty
+ */
+nfs41_updowncall_entry *nfs41_upcalllist_remove_next(void)
+{
+    return nfs41_upcalllist_remove_matching(NULL, NULL);
+}
+
+/*
+ * Add |entry| to the upcall queue of the current NUMA node, see
+ * |nfs41_upcalllist_removed()| for the other side of the queue depth
+ * accounting
+ */
+static void nfs41_upcalllist_add(
+    IN nfs41_updowncall_entry *entry)
+{
+    ULONG op = (ULONG)entry->opcode;
+    nfs41_upcall_queue *queue;
+    LONG depth;
+
+    /* count first, so the depth never drops below zero */
+    depth = InterlockedIncrement(&upcalllist.depth);
+    update_max_stat(&upcalllist.max_depth, depth);
+    if (op < NFS41_SYSOP_INVALID_OPCODE1) {
+        update_max_stat(&upcalllist.max_depth_by_op[op],
+            InterlockedIncrement(&upcalllist.depth_by_op[op]));
+    }
+
+    entry->prio = nfs41_upcall_get_prio(entry);
+    entry->queue = nfs41_upcall_current_queue();
+    entry->queue_ticks = KeQueryPerformanceCounter(NULL).QuadPart;
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+    TraceLoggingWrite(nfs41_trace_provider, "UpcallEnqueue",
+        TraceLoggingKeyword(NFS41_TRACE_KEYWORD_UPCALL),
+        TraceLoggingInt64(entry->xid, "Xid"),
+        TraceLoggingUInt32(entry->opcode, "Opcode"),
+        TraceLoggingBool(entry->async_op, "Async"),
+        TraceLoggingUInt32(entry->prio, "Priority"),
+        TraceLoggingUInt32(entry->queue, "Queue"),
+        TraceLoggingInt32(depth, "QueueDepth"));
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
+    queue = &upcalllist.queues[entry->queue];
+    ExAcquireFastMutexUnsafe(&queue->lock);
+    InsertTailList(&queue->head[entry->prio], &entry->next);
+    (void)InterlockedIncrement(&queue->count);
+    ExReleaseFastMutexUnsafe(&queue->lock);
+
+    /*
+     * Wake a daemon thread of the same node if one is waiting,
+     * otherwise any daemon thread, which then steals the entry
+     */
+    if (InterlockedAdd(&queue->waiters, 0) > 0)
+        (void)KeSetEvent(&queue->event, IO_NFS41FS_INCREMENT, FALSE);
+    else
+        (void)KeSetEvent(&upcallEvent, IO_NFS41FS_INCREMENT, FALSE);
+}
+
+/* Called whenever |entry| was taken off an upcall queue */
+void nfs41_upcalllist_removed(
+    IN const nfs41_updowncall_entry *entry)
+{
+    ULONG op = (ULONG)entry->opcode;
+
+    (void)InterlockedDecrement(&upcalllist.depth);
+    if (op < NFS41_SYSOP_INVALID_OPCODE1)
+        (void)InterlockedDecrement(&upcalllist.depth_by_op[op]);
+}
+
+void nfs41_downcalllist_init(void)
+{
+    ULONG i;
+
+    for (i = 0 ; i < NFS41_DOWNCALLLIST_NUM_BUCKETS ; i++) {
+        ExInitializeFastMutex(&downcalllist.buckets[i].lock);
+        InitializeListHead(&downcalllist.buckets[i].head);
+        downcalllist.buckets[i].count = 0;
+    }
+    downcalllist.inflight = 0;
+    downcalllist.max_inflight = 0;
+    downcalllist.max_chain_len = 0;
+    downcalllist.max_scan_len = 0;
+}
+
+void nfs41_downcalllist_add(
+    IN nfs41_updowncall_entry *entry)
+{
+    nfs41_downcall_bucket *bucket = NFS41_DOWNCALLLIST_BUCKET(entry->xid);
+    LONG chain_len;
+
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+    InsertTailList(&bucket->head, &entry->next);
+    chain_len = ++bucket->count;
+    ExReleaseFastMutexUnsafe(&bucket->lock);
+
+    update_max_stat(&downcalllist.max_chain_len, chain_len);
+    update_max_stat(&downcalllist.max_inflight,
+        InterlockedIncrement(&downcalllist.inflight));
+}
+
+void nfs41_downcalllist_remove(
+    IN nfs41_updowncall_entry *entry)
+{
+    nfs41_downcall_bucket *bucket = NFS41_DOWNCALLLIST_BUCKET(entry->xid);
+
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+    RemoveEntryList(&entry->next);
+    bucket->count--;
+    ExReleaseFastMutexUnsafe(&bucket->lock);
+
+    (void)InterlockedDecrement(&downcalllist.inflight);
+}
+
+/*
+ * |nfs41_downcalllist_remove_first()| - remove and return any entry
+ * from |downcalllist|, or |NULL| if |downcalllist| is empty
+ */
+nfs41_updowncall_entry *nfs41_downcalllist_remove_first(void)
+{
+    nfs41_downcall_bucket *bucket;
+    PLIST_ENTRY pEntry;
+    ULONG i;
+
+    for (i = 0 ; i < NFS41_DOWNCALLLIST_NUM_BUCKETS ; i++) {
+        bucket = &downcalllist.buckets[i];
+
+        ExAcquireFastMutexUnsafe(&bucket->lock);
+        if (IsListEmpty(&bucket->head)) {
+            ExReleaseFastMutexUnsafe(&bucket->lock);
+            continue;
+        }
+        pEntry = RemoveHeadList(&bucket->head);
+        bucket->count--;
+        ExReleaseFastMutexUnsafe(&bucket->lock);
+
+        (void)InterlockedDecrement(&downcalllist.inflight);
+        return (nfs41_updowncall_entry *)CONTAINING_RECORD(pEntry,
+            nfs41_updowncall_entry, next);
+    }
+
+    return NULL;
+}
+
+static
+nfs41_updowncall_entry *nfs41_downcalllist_find(
+    IN LONGLONG findxid)
+{
+    nfs41_downcall_bucket *bucket = NFS41_DOWNCALLLIST_BUCKET(findxid);
+    nfs41_updowncall_entry *cur;
+    PLIST_ENTRY pEntry;
+    LONG scan_len = 0;
+
+    ExAcquireFastMutexUnsafe(&bucket->lock);
+    for (pEntry = bucket->head.Flink ;
+        pEntry != &bucket->head ;
+        pEntry = pEntry->Flink) {
+        scan_len++;
+        cur = (nfs41_updowncall_entry *)CONTAINING_RECORD(pEntry,
+                nfs41_updowncall_entry, next);
+        if (cur->xid == findxid) {
+            ExReleaseFastMutexUnsafe(&bucket->lock);
+            update_max_stat(&downcalllist.max_scan_len, scan_len);
+            return cur;
+        }
+    }
+    ExReleaseFastMutexUnsafe(&bucket->lock);
+    update_max_stat(&downcalllist.max_scan_len, scan_len);
+
+    return NULL;
+}
+
+NTSTATUS nfs41_get_updowncall_stats(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    ULONG outbuf_len = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
+    NFS41_UPDOWNCALL_STATS stats;
+
+    if (outbuf_len < sizeof(stats))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    stats.num_downcall_buckets = NFS41_DOWNCALLLIST_NUM_BUCKETS;
+    stats.downcall_inflight = InterlockedAdd(&downcalllist.inflight, 0);
+    stats.downcall_max_inflight =
+        InterlockedAdd(&downcalllist.max_inflight, 0);
+    stats.downcall_max_chain_len =
+        InterlockedAdd(&downcalllist.max_chain_len, 0);
+    stats.downcall_max_scan_len =
+        InterlockedAdd(&downcalllist.max_scan_len, 0);
+    stats.upcall_queued = InterlockedAdd(&upcalllist.depth, 0);
+    stats.upcall_max_queued = InterlockedAdd(&upcalllist.max_depth, 0);
+    stats.upcall_num_queues = upcalllist.num_queues;
+    stats.upcall_steals = InterlockedAdd(&upcalllist.steals, 0);
+
+    RtlCopyMemory(LowIoContext->ParamsFor.IoCtl.pOutputBuffer,
+        &stats, sizeof(stats));
+    RxContext->InformationToReturn = sizeof(stats);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Per-operation latency statistics for |IOCTL_NFS41_GET_OP_STATS|
+ *
+ * The histograms are kept in |NFS41_OP_STATS_CPU_SLOTS| cache aligned
+ * slots, indexed by the number of the current processor, so that
+ * processors do not fight over the same cache lines. Updates still
+ * use interlocked operations, because a thread can be moved to another
+ * processor and processors beyond |NFS41_OP_STATS_CPU_SLOTS| share
+ * slots.
+ */
+#define NFS41_OP_STATS_CPU_SLOTS 16
+
+typedef struct DECLSPEC_CACHEALIGN _nfs41_cpu_op_stats {
+    NFS41_LATENCY_HISTOGRAM upcall_queue[NFS41_SYSOP_INVALID_OPCODE1];
+    NFS41_LATENCY_HISTOGRAM upcall_total[NFS41_SYSOP_INVALID_OPCODE1];
+} nfs41_cpu_op_stats;
+
+static nfs41_cpu_op_stats cpu_op_stats[NFS41_OP_STATS_CPU_SLOTS];
+static LONGLONG op_stats_ticks_per_sec = 1;
+
+/* NetRoots for |IOCTL_NFS41_GET_MOUNT_STATS| */
+static struct {
+    FAST_MUTEX lock;
+    LIST_ENTRY head;
+} netrootstatslist;
+
+void nfs41_op_stats_init(void)
+{
+    LARGE_INTEGER freq;
+
+    (void)KeQueryPerformanceCounter(&freq);
+    if (freq.QuadPart > 0)
+        op_stats_ticks_per_sec = freq.QuadPart;
+    RtlZeroMemory(cpu_op_stats, sizeof(cpu_op_stats));
+    ExInitializeFastMutex(&netrootstatslist.lock);
+    InitializeListHead(&netrootstatslist.head);
+}
+
+static
+ULONG latency_bucket(ULONGLONG usecs)
+{
+    ULONG bucket = 0;
+
+    while (usecs && (bucket < (NFS41_OP_STATS_NUM_BUCKETS-1))) {
+        bucket++;
+        usecs >>= 1;
+    }
+    return bucket;
+}
+
+static
+void latency_histogram_add(
+    IN OUT NFS41_LATENCY_HISTOGRAM *hist,
+    IN LONGLONG ticks)
+{
+    ULONGLONG usecs;
+
+    if (ticks < 0)
+        ticks = 0;
+    usecs = ((ULONGLONG)ticks * 1000000ULL) /
+        (ULONGLONG)op_stats_ticks_per_sec;
+
+    (void)InterlockedAdd64((volatile LONG64 *)&hist->total_usecs,
+        (LONG64)usecs);
+    (void)InterlockedIncrement(
+        (volatile LONG *)&hist->buckets[latency_bucket(usecs)]);
+}
+
+static
+void latency_histogram_sum(
+    IN OUT NFS41_LATENCY_HISTOGRAM *sum,
+    IN NFS41_LATENCY_HISTOGRAM *hist)
+{
+    ULONG i;
+
+    sum->total_usecs +=
+        (ULONGLONG)InterlockedAdd64((volatile LONG64 *)&hist->total_usecs, 0);
+    for (i = 0 ; i < NFS41_OP_STATS_NUM_BUCKETS ; i++)
+        sum->buckets[i] += hist->buckets[i];
+}
+
+/* Called by |nfs41_downcall()| when the downcall for |entry| arrived */
+static
+void nfs41_op_stats_record(
+    IN const nfs41_updowncall_entry *entry)
+{
+    nfs41_cpu_op_stats *slot;
+    LARGE_INTEGER now;
+    ULONG op = (ULONG)entry->opcode;
+
+    if ((op >= NFS41_SYSOP_INVALID_OPCODE1) || (entry->queue_ticks == 0))
+        return;
+
+    now = KeQueryPerformanceCounter(NULL);
+    slot = &cpu_op_stats[
+        KeGetCurrentProcessorNumberEx(NULL) % NFS41_OP_STATS_CPU_SLOTS];
+
+    if (entry->read_ticks) {
+        latency_histogram_add(&slot->upcall_queue[op],
+            entry->read_ticks - entry->queue_ticks);
+    }
+    latency_histogram_add(&slot->upcall_total[op],
+        now.QuadPart - entry->queue_ticks);
+}
+
+/*
+ * Fill the kernel part of |IOCTL_NFS41_GET_OP_STATS|, the caller
+ * adds the daemon part
+ */
+NTSTATUS nfs41_get_op_stats(
+    IN OUT PRX_CONTEXT RxContext)
+{
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    ULONG outbuf_len = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
+    NFS41_OP_STATS *stats =
+        (NFS41_OP_STATS *)LowIoContext->ParamsFor.IoCtl.pOutputBuffer;
+    ULONG cpu, op;
+
+    if (outbuf_len < sizeof(NFS41_OP_STATS))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    RtlZeroMemory(stats, sizeof(NFS41_OP_STATS));
+    stats->num_upcall_ops = NFS41_SYSOP_INVALID_OPCODE1;
+    stats->num_nfs_ops = NFS41_OP_STATS_NUM_NFS_OPS;
+    stats->daemon_status = STATUS_DEVICE_NOT_READY;
+
+    for (op = 0 ; op < NFS41_SYSOP_INVALID_OPCODE1 ; op++) {
+        stats->upcall_queued[op] =
+            InterlockedAdd(&upcalllist.depth_by_op[op], 0);
+        stats->upcall_max_queued[op] =
+            InterlockedAdd(&upcalllist.max_depth_by_op[op], 0);
+    }
+
+    for (cpu = 0 ; cpu < NFS41_OP_STATS_CPU_SLOTS ; cpu++) {
+        for (op = 0 ; op < NFS41_SYSOP_INVALID_OPCODE1 ; op++) {
+            latency_histogram_sum(&stats->upcall_queue[op],
+                &cpu_op_stats[cpu].upcall_queue[op]);
+            latency_histogram_sum(&stats->upcall_total[op],
+                &cpu_op_stats[cpu].upcall_total[op]);
+        }
+    }
+
+    RxContext->InformationToReturn = sizeof(NFS41_OP_STATS);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Per-NetRoot statistics for |IOCTL_NFS41_GET_MOUNT_STATS|
+ *
+ * |nfs41_CreateVNetRoot()| adds each NetRoot to |netrootstatslist|
+ * after its first successful mount, |nfs41_FinalizeNetRoot()| removes
+ * it. Callers set |entry->netroot_stats| for upcalls which belong to
+ * a NetRoot, |handle_downcall()| counts them with interlocked
+ * operations while the caller still waits for the downcall, so the
+ * NetRoot cannot go away.
+ */
+static
+void nfs41_netroot_stats_record(
+    IN const nfs41_updowncall_entry *entry)
+{
+    NFS41_NETROOT_STATS *stats = entry->netroot_stats;
+    LARGE_INTEGER now;
+
+    if ((stats == NULL) || (entry->queue_ticks == 0))
+        return;
+
+    now = KeQueryPerformanceCounter(NULL);
+    (void)InterlockedIncrement64((volatile LONG64 *)&stats->upcalls);
+    if (entry->status) {
+        (void)InterlockedIncrement64((volatile LONG64 *)&stats->errors);
+    }
+    else if (entry->opcode == NFS41_SYSOP_READ) {
+        (void)InterlockedAdd64((volatile LONG64 *)&stats->read_bytes,
+            (LONG64)entry->u.ReadWrite.buf_len);
+    }
+    else if (entry->opcode == NFS41_SYSOP_WRITE) {
+        (void)InterlockedAdd64((volatile LONG64 *)&stats->write_bytes,
+            (LONG64)entry->u.ReadWrite.buf_len);
+    }
+    latency_histogram_add(&stats->latency,
+        now.QuadPart - entry->queue_ticks);
+
+#ifdef NFS41_DRIVER_DIRECT_IO
+    if ((entry->status == 0) &&
+        ((entry->opcode == NFS41_SYSOP_READ) ||
+            (entry->opcode == NFS41_SYSOP_WRITE)) &&
+        (entry->u.ReadWrite.flags & NFS41_RW_FLAG_DIRECT_IO)) {
+        ULONGLONG usecs, min_usecs;
+
+        usecs = ((ULONGLONG)max(now.QuadPart - entry->queue_ticks, 0) *
+            1000000ULL) / (ULONGLONG)op_stats_ticks_per_sec;
+        (void)InterlockedIncrement64((volatile LONG64 *)&stats->direct_io);
+        (void)InterlockedAdd64((volatile LONG64 *)&stats->direct_io_usecs,
+            (LONG64)usecs);
+        /* |0| means no sample yet */
+        do {
+            min_usecs = stats->direct_io_min_usecs;
+            if ((min_usecs != 0ULL) && (min_usecs <= usecs))
+                break;
+        } while (InterlockedCompareExchange64(
+            (volatile LONG64 *)&stats->direct_io_min_usecs,
+            (LONG64)usecs, (LONG64)min_usecs) != (LONG64)min_usecs);
+    }
+#endif /* NFS41_DRIVER_DIRECT_IO */
+}
+
+void nfs41_netroot_stats_add(
+    IN OUT PNFS41_NETROOT_EXTENSION pNetRootContext,
+    IN PUNICODE_STRING name)
+{
+    USHORT len;
+
+    ExAcquireFastMutexUnsafe(&netrootstatslist.lock);
+    if (!pNetRootContext->stats_listed) {
+        RtlZeroMemory(&pNetRootContext->stats,
+            sizeof(pNetRootContext->stats));
+        len = (USHORT)min(name->Length / sizeof(WCHAR),
+            NFS41_MOUNT_STATS_NAME_LEN - 1);
+        RtlCopyMemory(pNetRootContext->stats.name, name->Buffer,
+            len * sizeof(WCHAR));
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+        ExInitializeRundownProtection(&pNetRootContext->lookup_rundown);
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+#ifdef NFS41_DRIVER_NEGATIVE_OPEN_CACHE
+        nfs41_negcache_init(pNetRootContext);
+#endif /* NFS41_DRIVER_NEGATIVE_OPEN_CACHE */
+        InsertTailList(&netrootstatslist.head,
+            &pNetRootContext->stats_next);
+        pNetRootContext->stats_listed = TRUE;
+    }
+    ExReleaseFastMutexUnsafe(&netrootstatslist.lock);
+}
+
+void nfs41_netroot_stats_remove(
+    IN OUT PNFS41_NETROOT_EXTENSION pNetRootContext)
+{
+    BOOLEAN was_listed;
+
+    ExAcquireFastMutexUnsafe(&netrootstatslist.lock);
+    was_listed = pNetRootContext->stats_listed;
+    if (was_listed) {
+        RemoveEntryList(&pNetRootContext->stats_next);
+        pNetRootContext->stats_listed = FALSE;
+    }
+    ExReleaseFastMutexUnsafe(&netrootstatslist.lock);
+
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+    /* wait for |nfs41_netroot_find_session()| users */
+    if (was_listed)
+        ExWaitForRundownProtectionRelease(
+            &pNetRootContext->lookup_rundown);
+#else
+    (void)was_listed;
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+}
+
+/*
+ * Fill the kernel part of |IOCTL_NFS41_GET_MOUNT_STATS|, the caller
+ * adds the daemon part
+ */
+void nfs41_get_netroot_stats(
+    OUT NFS41_MOUNT_STATS *stats)
+{
+    PNFS41_NETROOT_EXTENSION pNetRootContext;
+    NFS41_NETROOT_STATS *ns;
+    PLIST_ENTRY pEntry;
+
+    ExAcquireFastMutexUnsafe(&netrootstatslist.lock);
+    for (pEntry = netrootstatslist.head.Flink;
+        (pEntry != &netrootstatslist.head) &&
+        (stats->num_netroots < NFS41_MOUNT_STATS_MAX_MOUNTS);
+        pEntry = pEntry->Flink) {
+        pNetRootContext = CONTAINING_RECORD(pEntry,
+            NFS41_NETROOT_EXTENSION, stats_next);
+        ns = &stats->netroots[stats->num_netroots++];
+
+        RtlCopyMemory(ns->name, pNetRootContext->stats.name,
+            sizeof(ns->name));
+        ns->upcalls = (ULONGLONG)InterlockedAdd64(
+            (volatile LONG64 *)&pNetRootContext->stats.upcalls, 0);
+        ns->errors = (ULONGLONG)InterlockedAdd64(
+            (volatile LONG64 *)&pNetRootContext->stats.errors, 0);
+        ns->read_bytes = (ULONGLONG)InterlockedAdd64(
+            (volatile LONG64 *)&pNetRootContext->stats.read_bytes, 0);
+        ns->write_bytes = (ULONGLONG)InterlockedAdd64(
+            (volatile LONG64 *)&pNetRootContext->stats.write_bytes, 0);
+        latency_histogram_sum(&ns->latency,
+            &pNetRootContext->stats.latency);
+    }
+    ExReleaseFastMutexUnsafe(&netrootstatslist.lock);
+}
+
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+/*
+ * Find the NetRoot of |path| and the daemon session of the mount of
+ * the user with logon id |luid|, for callers which have a file name
+ * but no RDBSS context (see |nfs41_FastIoQueryOpen()|).
+ * |path| is a |FILE_OBJECT.FileName| like
+ * "\;Z:<luid>\server@2049\export\dir\file" or
+ * "\server@2049\export\dir\file".
+ * On success |relpath| points to the part of |path| after the NetRoot
+ * name, and the caller must call |nfs41_netroot_release()| when it is
+ * done with |session|; |nfs41_netroot_stats_remove()| waits for that
+ * before |nfs41_FinalizeNetRoot()| unmounts the sessions.
+ */
+PNFS41_NETROOT_EXTENSION nfs41_netroot_find_session(
+    IN PCUNICODE_STRING path,
+    IN PLUID luid,
+    OUT HANDLE *session,
+    OUT PUNICODE_STRING relpath)
+{
+    PNFS41_NETROOT_EXTENSION pNetRootContext, found = NULL;
+    nfs41_mount_entry *mount;
+    PLIST_ENTRY pEntry, pMountEntry;
+    UNICODE_STRING name, rootname;
+    DWORD sec_flavor;
+    USHORT i;
+
+    *session = INVALID_HANDLE_VALUE;
+
+    name = *path;
+    /* skip the "\;Z:<luid>" prefix of drive letter mappings */
+    if ((name.Length >= (2 * sizeof(WCHAR))) &&
+        (name.Buffer[0] == L'\\') && (name.Buffer[1] == L';')) {
+        for (i = 2 ; i < (name.Length / sizeof(WCHAR)) ; i++) {
+            if (name.Buffer[i] == L'\\')
+                break;
+        }
+        name.Buffer += i;
+        name.Length -= i * sizeof(WCHAR);
+        name.MaximumLength = name.Length;
+    }
+
+    ExAcquireFastMutexUnsafe(&netrootstatslist.lock);
+    for (pEntry = netrootstatslist.head.Flink;
+        pEntry != &netrootstatslist.head;
+        pEntry = pEntry->Flink) {
+        pNetRootContext = CONTAINING_RECORD(pEntry,
+            NFS41_NETROOT_EXTENSION, stats_next);
+
+        /* |stats.name| is truncated for very long NetRoot names */
+        RtlInitUnicodeString(&rootname, pNetRootContext->stats.name);
+        if ((rootname.Length == 0) ||
+            (rootname.Length >=
+                ((NFS41_MOUNT_STATS_NAME_LEN - 1) * sizeof(WCHAR))))
+            continue;
+        /* we need a name below the NetRoot, not the NetRoot itself */
+        if ((name.Length <= (rootname.Length + sizeof(WCHAR))) ||
+            (name.Buffer[rootname.Length / sizeof(WCHAR)] != L'\\') ||
+            !RtlPrefixUnicodeString(&rootname, &name, TRUE))
+            continue;
+
+        if (!pNetRootContext->mounts_init)
+            break;
+
+        ExAcquireFastMutexUnsafe(&pNetRootContext->mounts.lock);
+        for (pMountEntry = pNetRootContext->mounts.head.Flink;
+            pMountEntry != &pNetRootContext->mounts.head;
+            pMountEntry = pMountEntry->Flink) {
+            mount = CONTAINING_RECORD(pMountEntry, nfs41_mount_entry, next);
+            if (!RtlEqualLuid(luid, &mount->login_id))
+                continue;
+            if (map_sec_flavor(&mount->Config.SecFlavor, &sec_flavor))
+                break;
+            switch (sec_flavor) {
+            case RPCSEC_AUTH_NONE:
+                *session = mount->authnone_session; break;
+            case RPCSEC_AUTH_SYS:
+                *session = mount->authsys_session; break;
+            case RPCSEC_AUTHGSS_KRB5:
+                *session = mount->gss_session; break;
+            case RPCSEC_AUTHGSS_KRB5I:
+                *session = mount->gssi_session; break;
+            case RPCSEC_AUTHGSS_KRB5P:
+                *session = mount->gssp_session; break;
+            }
+            break;
+        }
+        ExReleaseFastMutexUnsafe(&pNetRootContext->mounts.lock);
+
+        if ((*session != NULL) && (*session != INVALID_HANDLE_VALUE) &&
+            ExAcquireRundownProtection(&pNetRootContext->lookup_rundown)) {
+            relpath->Buffer = name.Buffer +
+                (rootname.Length / sizeof(WCHAR));
+            relpath->Length = name.Length - rootname.Length;
+            relpath->MaximumLength = relpath->Length;
+            found = pNetRootContext;
+        }
+        break;
+    }
+    ExReleaseFastMutexUnsafe(&netrootstatslist.lock);
+
+    if (found == NULL)
+        *session = INVALID_HANDLE_VALUE;
+    return found;
+}
+
+void nfs41_netroot_release(
+    IN OUT PNFS41_NETROOT_EXTENSION pNetRootContext)
+{
+    ExReleaseRundownProtection(&pNetRootContext->lookup_rundown);
+}
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+
 static void unmarshal_nfs41_header(
     nfs41_updowncall_entry *tmp,
     const unsigned char *restrict *restrict buf)
@@ -193,15 +970,22 @@ void unmarshal_nfs41_attrget(
     *buf += buf_len;
 }
 
-NTSTATUS handle_upcall(
-    IN PRX_CONTEXT RxContext,
+/*
+ * Marshal |entry| into |pbOut|. If |impersonate| is set the calling
+ * daemon thread impersonates the client of |entry| until the next
+ * downcall (all entries of a batch share the first entry's client)
+ */
+static NTSTATUS handle_upcall(
     IN nfs41_updowncall_entry *entry,
+    IN BOOLEAN impersonate,
+    OUT unsigned char *pbOut,
+    IN ULONG cbOut,
     OUT ULONG *len)
 {
     NTSTATUS status = STATUS_SUCCESS;
-    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
-    ULONG cbOut = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
-    unsigned char *pbOut = LowIoContext->ParamsFor.IoCtl.pOutputBuffer;
+
+    if (!impersonate)
+        goto marshal;
 
 #ifdef NFS41_DRIVER_STABILITY_HACKS
     /*
@@ -259,10 +1043,23 @@ NTSTATUS handle_upcall(
         goto out;
     }
 
+marshal:
     switch(entry->opcode) {
     case NFS41_SYSOP_SET_DAEMON_DEBUGLEVEL:
         status = marshal_nfs41_set_daemon_debuglevel(entry, pbOut, cbOut, len);
         break;
+    case NFS41_SYSOP_GET_DAEMON_STATS:
+        status = marshal_nfs41_get_daemon_stats(entry, pbOut, cbOut, len);
+        break;
+    case NFS41_SYSOP_GET_FLIGHT_RECORDER:
+        status = marshal_nfs41_get_flight_recorder(entry, pbOut, cbOut, len);
+        break;
+    case NFS41_SYSOP_GET_MOUNT_STATS:
+        status = marshal_nfs41_get_mount_stats(entry, pbOut, cbOut, len);
+        break;
+    case NFS41_SYSOP_GET_TOP_STATS:
+        status = marshal_nfs41_get_top_stats(entry, pbOut, cbOut, len);
+        break;
     case NFS41_SYSOP_SHUTDOWN:
         status = marshal_nfs41_shutdown(entry, pbOut, cbOut, len);
         (void)KeSetEvent(&entry->cond, IO_NFS41FS_INCREMENT, FALSE);
@@ -282,6 +1079,9 @@ NTSTATUS handle_upcall(
     case NFS41_SYSOP_WRITE:
         status = marshal_nfs41_rw(entry, pbOut, cbOut, len);
         break;
+    case NFS41_SYSOP_FLUSH:
+        status = marshal_nfs41_flush(entry, pbOut, cbOut, len);
+        break;
     case NFS41_SYSOP_LOCK:
         status = marshal_nfs41_lock(entry, pbOut, cbOut, len);
         break;
@@ -298,6 +1098,9 @@ NTSTATUS handle_upcall(
     case NFS41_SYSOP_FILE_QUERY_TIME_BASED_COHERENCY:
         status = marshal_nfs41_filequery(entry, pbOut, cbOut, len);
         break;
+    case NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH:
+        status = marshal_nfs41_coherency_batch(entry, pbOut, cbOut, len);
+        break;
     case NFS41_SYSOP_FILE_SET:
         status = marshal_nfs41_fileset(entry, pbOut, cbOut, len);
         break;
@@ -333,6 +1136,21 @@ NTSTATUS handle_upcall(
         status = marshal_nfs41_duplicatedata(entry,
             pbOut, cbOut, len);
         break;
+#ifdef NFS41_DRIVER_DIR_CHANGE_NOTIFY
+    case NFS41_SYSOP_DIR_NOTIFY:
+        status = marshal_nfs41_dirnotify(entry, pbOut, cbOut, len);
+        break;
+#endif /* NFS41_DRIVER_DIR_CHANGE_NOTIFY */
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+    case NFS41_SYSOP_QUERY_OPEN:
+        status = marshal_nfs41_queryopen(entry, pbOut, cbOut, len);
+        break;
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
+#ifdef NFS41_DRIVER_CACHE_CONTROL
+    case NFS41_SYSOP_FSCTL_CACHE_CONTROL:
+        status = marshal_nfs41_cachecontrol(entry, pbOut, cbOut, len);
+        break;
+#endif /* NFS41_DRIVER_CACHE_CONTROL */
     default:
         status = STATUS_INVALID_PARAMETER;
         print_error("handle_upcall: Unknown nfs41 ops %d\n",
@@ -360,15 +1178,19 @@ NTSTATUS nfs41_UpcallCreate(
     nfs41_updowncall_entry *entry;
     SECURITY_SUBJECT_CONTEXT sec_ctx;
     SECURITY_QUALITY_OF_SERVICE sec_qos;
+    ULONG alloc_queue;
 
-    entry = nfs41_upcall_allocate_updowncall_entry();
+    alloc_queue = nfs41_upcall_current_queue();
+    entry = nfs41_upcall_allocate_updowncall_entry(alloc_queue);
     if (entry == NULL) {
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto out;
     }
 
     RtlZeroMemory(entry, sizeof(nfs41_updowncall_entry));
+    entry->alloc_queue = alloc_queue;
     entry->xid = InterlockedIncrement64(&xid);
+    entry->create_ticks = KeQueryPerformanceCounter(NULL).QuadPart;
     entry->opcode = opcode;
     entry->state = NFS41_WAITING_FOR_UPCALL;
     entry->session = session;
@@ -433,6 +1255,7 @@ NTSTATUS nfs41_UpcallCreate(
             case NFS41_SYSOP_DIR_QUERY:
                 entry->u.QueryFile.mdl_buf = NULL;
                 entry->u.QueryFile.mdl = NULL;
+                entry->u.QueryFile.kbuf = NULL;
                 break;
             case NFS41_SYSOP_OPEN:
                 entry->u.Open.EaBuffer = NULL;
@@ -450,6 +1273,63 @@ out:
     return status;
 }
 
+#ifdef NFS41_DRIVER_FCB_UTF8NAME_CACHE
+/*
+ * Let the upcall use the UTF-8 form of the FCB's name for
+ * |entry->filename|, which is converted on first use.
+ * The name is published only once (and freed in
+ * |nfs41_DeallocateForFcb()|), so upcalls can use it without locking
+ * or reference counting. If |entry->filename| is not the string the
+ * FCB's name was converted from (e.g. after a rename) the upcall
+ * converts |entry->filename| itself
+ */
+void nfs41_UpcallSetFcbFilename(
+    IN OUT nfs41_updowncall_entry *entry,
+    IN OUT PNFS41_FCB nfs41_fcb)
+{
+    PCUNICODE_STRING src = entry->filename;
+    nfs41_utf8name *name, *old;
+    ULONG len, ActualCount = 0;
+
+    name = nfs41_fcb->utf8name;
+    if (name == NULL) {
+        if ((src == &SLASH) || (src == &EMPTY_STRING))
+            return;
+
+        /* |length_as_utf8()| includes the length field and the '\0' */
+        len = length_as_utf8(src) - sizeof(USHORT) - 1;
+        if (len >= 0xFFFF)
+            return;
+
+        name = RxAllocatePoolWithTag(NonPagedPoolNx,
+            FIELD_OFFSET(nfs41_utf8name, name) + len + 1,
+            NFS41_MM_POOLTAG);
+        if (name == NULL)
+            return;
+        if (RtlUnicodeToUTF8N(name->name, len, &ActualCount,
+            src->Buffer, src->Length) || (ActualCount != len)) {
+            RxFreePool(name);
+            return;
+        }
+        name->name[len] = '\0';
+        name->src_buffer = src->Buffer;
+        name->src_length = src->Length;
+        name->length = (USHORT)len;
+
+        old = InterlockedCompareExchangePointer(
+            (PVOID volatile *)&nfs41_fcb->utf8name, name, NULL);
+        if (old) {
+            RxFreePool(name);
+            name = old;
+        }
+    }
+
+    if ((name->src_buffer == src->Buffer) &&
+        (name->src_length == src->Length))
+        entry->filename_utf8 = name;
+}
+#endif /* NFS41_DRIVER_FCB_UTF8NAME_CACHE */
+
 void nfs41_UpcallDestroy(nfs41_updowncall_entry *entry)
 {
     if (!entry)
@@ -484,8 +1364,7 @@ NTSTATUS nfs41_UpcallWaitForReply(
      */
     entry->timeout_secs = (LONG)secs;
 
-    nfs41_AddEntry(upcalllist.lock, upcalllist, entry);
-    (void)KeSetEvent(&upcallEvent, IO_NFS41FS_INCREMENT, FALSE);
+    nfs41_upcalllist_add(entry);
 
     if (entry->async_op)
         goto out;
@@ -548,7 +1427,7 @@ retry_wait:
         ExReleaseFastMutexUnsafe(&entry->lock);
         goto out;
     }
-    nfs41_RemoveEntry(downcalllist.lock, entry);
+    nfs41_downcalllist_remove(entry);
 
 out:
     FsRtlExitFileSystem();
@@ -559,56 +1438,121 @@ out:
     return status;
 }
 
-NTSTATUS nfs41_upcall(
-    IN PRX_CONTEXT RxContext)
-{
-    NTSTATUS status = STATUS_SUCCESS;
-    ULONG len = 0;
-    PLIST_ENTRY pEntry = NULL;
+/*
+ * Number of daemon threads waiting in |IOCTL_NFS41_READ| or
+ * |IOCTL_NFS41_READ_BATCH| for an upcall
+ */
+static volatile LONG upcall_readers_waiting = 0;
 
-    FsRtlEnterFileSystem();
+/*
+ * Get the next entry from the upcall queues, if |wait| is
+ * not set |STATUS_NO_MORE_ENTRIES| is returned instead of waiting for
+ * one
+ */
+static NTSTATUS nfs41_upcall_get_entry(
+    IN BOOLEAN wait,
+    OUT nfs41_updowncall_entry **entry_out)
+{
+    NTSTATUS status;
+    nfs41_upcall_queue *queue;
+    PVOID wait_objects[2];
 
-process_upcall:
-    nfs41_RemoveFirst(upcalllist.lock, upcalllist, pEntry);
-    if (pEntry) {
-        nfs41_updowncall_entry *entry;
+    for (;;) {
+        *entry_out = nfs41_upcalllist_remove_next();
+        if (*entry_out)
+            return STATUS_SUCCESS;
+        if (!wait)
+            return STATUS_NO_MORE_ENTRIES;
 
-        entry = (nfs41_updowncall_entry *)CONTAINING_RECORD(pEntry,
-                    nfs41_updowncall_entry, next);
-        ExAcquireFastMutexUnsafe(&entry->lock);
-        nfs41_AddEntry(downcalllist.lock, downcalllist, entry);
-        status = handle_upcall(RxContext, entry, &len);
-        if (status == STATUS_SUCCESS &&
-                entry->state == NFS41_WAITING_FOR_UPCALL)
-            entry->state = NFS41_WAITING_FOR_DOWNCALL;
-        ExReleaseFastMutexUnsafe(&entry->lock);
-        if (status) {
-            entry->status = status;
-            (void)KeSetEvent(&entry->cond, IO_NFS41FS_INCREMENT, FALSE);
-            RxContext->InformationToReturn = 0;
-        } else
-            RxContext->InformationToReturn = len;
-    }
-    else {
-        status = KeWaitForSingleObject(&upcallEvent, Executive, UserMode, TRUE,
-            (PLARGE_INTEGER) NULL);
+        /*
+         * Wait for an upcall queued on our own node, or for any
+         * upcall queued while no thread of its node was waiting
+         */
+        queue = &upcalllist.queues[nfs41_upcall_current_queue()];
+        wait_objects[0] = &queue->event;
+        wait_objects[1] = &upcallEvent;
+        (void)InterlockedIncrement(&upcall_readers_waiting);
+        (void)InterlockedIncrement(&queue->waiters);
+        status = KeWaitForMultipleObjects(2, wait_objects, WaitAny,
+            Executive, UserMode, TRUE, (PLARGE_INTEGER)NULL, NULL);
+        (void)InterlockedDecrement(&queue->waiters);
+        (void)InterlockedDecrement(&upcall_readers_waiting);
         print_wait_status(0, "[upcall]", status, NULL, NULL, 0);
         switch (status) {
-            case STATUS_SUCCESS:
-                goto process_upcall;
+            case STATUS_WAIT_0:
+            case STATUS_WAIT_1:
+                break;
             case STATUS_USER_APC:
             case STATUS_ALERTED:
                 DbgP("nfs41_upcall: KeWaitForSingleObject() "
                     "returned status(=0x%lx)\n",
                     (long)status);
-                goto out;
+                return status;
             default:
                 DbgP("nfs41_upcall: KeWaitForSingleObject() "
                     "returned UNEXPECTED status(=0x%lx)\n",
                     (long)status);
-                goto out;
+                return status;
         }
     }
+}
+
+/*
+ * Pass |entry| to the daemon: marshal it into |pbOut| and move it to
+ * the downcall list
+ */
+static NTSTATUS nfs41_upcall_entry(
+    IN nfs41_updowncall_entry *entry,
+    IN BOOLEAN impersonate,
+    OUT unsigned char *pbOut,
+    IN ULONG cbOut,
+    OUT ULONG *len)
+{
+    NTSTATUS status;
+
+    ExAcquireFastMutexUnsafe(&entry->lock);
+    entry->read_ticks = KeQueryPerformanceCounter(NULL).QuadPart;
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+    TraceLoggingWrite(nfs41_trace_provider, "UpcallDequeue",
+        TraceLoggingKeyword(NFS41_TRACE_KEYWORD_UPCALL),
+        TraceLoggingInt64(entry->xid, "Xid"),
+        TraceLoggingUInt32(entry->opcode, "Opcode"),
+        TraceLoggingInt32(upcalllist.depth, "QueueDepth"));
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
+    nfs41_downcalllist_add(entry);
+    status = handle_upcall(entry, impersonate, pbOut, cbOut, len);
+    if (status == STATUS_SUCCESS &&
+            entry->state == NFS41_WAITING_FOR_UPCALL)
+        entry->state = NFS41_WAITING_FOR_DOWNCALL;
+    ExReleaseFastMutexUnsafe(&entry->lock);
+    if (status) {
+        entry->status = status;
+        (void)KeSetEvent(&entry->cond, IO_NFS41FS_INCREMENT, FALSE);
+    }
+    return status;
+}
+
+NTSTATUS nfs41_upcall(
+    IN PRX_CONTEXT RxContext)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    ULONG cbOut = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
+    unsigned char *pbOut = LowIoContext->ParamsFor.IoCtl.pOutputBuffer;
+    ULONG len = 0;
+    nfs41_updowncall_entry *entry;
+
+    FsRtlEnterFileSystem();
+
+    status = nfs41_upcall_get_entry(TRUE, &entry);
+    if (status)
+        goto out;
+
+    status = nfs41_upcall_entry(entry, TRUE, pbOut, cbOut, &len);
+    if (status)
+        RxContext->InformationToReturn = 0;
+    else
+        RxContext->InformationToReturn = len;
 
 out:
     FsRtlExitFileSystem();
@@ -616,20 +1560,166 @@ out:
     return status;
 }
 
-NTSTATUS nfs41_downcall(
-    IN PRX_CONTEXT RxContext)
+static BOOLEAN nfs41_upcall_get_auth_id(
+    IN const nfs41_updowncall_entry *entry,
+    OUT PLUID auth_id)
+{
+    if ((entry->psec_ctx == NULL) || (entry->psec_ctx->ClientToken == NULL))
+        return FALSE;
+    return NT_SUCCESS(SeQueryAuthenticationIdToken(
+        entry->psec_ctx->ClientToken, auth_id));
+}
+
+typedef struct _nfs41_upcall_batch_match {
+    const LUID *auth_id;
+    SECURITY_IMPERSONATION_LEVEL level;
+} nfs41_upcall_batch_match;
+
+static BOOLEAN nfs41_upcall_is_batchable(
+    IN const nfs41_updowncall_entry *entry,
+    IN void *context)
+{
+    const nfs41_upcall_batch_match *m =
+        (const nfs41_upcall_batch_match *)context;
+    LUID entry_auth_id;
+
+    if ((entry->opcode == NFS41_SYSOP_SHUTDOWN) ||
+        (entry->opcode == NFS41_SYSOP_SET_DAEMON_DEBUGLEVEL) ||
+        (entry->opcode == NFS41_SYSOP_GET_DAEMON_STATS) ||
+        (entry->opcode == NFS41_SYSOP_GET_FLIGHT_RECORDER) ||
+        (entry->opcode == NFS41_SYSOP_GET_MOUNT_STATS) ||
+        (entry->opcode == NFS41_SYSOP_GET_TOP_STATS) ||
+        (!nfs41_upcall_get_auth_id(entry, &entry_auth_id)) ||
+        (!RtlEqualLuid(&entry_auth_id, m->auth_id)) ||
+        (entry->psec_ctx->SecurityQos.ImpersonationLevel != m->level))
+        return FALSE;
+    return TRUE;
+}
+
+/*
+ * Remove the next entry from the upcall queues if it can be added to
+ * a batch whose first entry belongs to the logon session |auth_id| and
+ * uses |level| impersonation
+ */
+static nfs41_updowncall_entry *nfs41_upcall_remove_batchable(
+    IN const LUID *auth_id,
+    IN SECURITY_IMPERSONATION_LEVEL level)
+{
+    nfs41_upcall_batch_match m = { .auth_id = auth_id, .level = level };
+
+    return nfs41_upcalllist_remove_matching(nfs41_upcall_is_batchable, &m);
+}
+
+/*
+ * Marshal a batch of upcalls into |pbOut|, see
+ * |IOCTL_NFS41_READ_BATCH|
+ */
+static NTSTATUS upcall_batch_fill(
+    OUT unsigned char *pbOut,
+    IN ULONG cbOut,
+    IN BOOLEAN wait,
+    OUT ULONG *len_out)
 {
     NTSTATUS status = STATUS_SUCCESS;
+    NFS41_UPDOWNCALL_BATCH_HEADER hdr = { .count = 0 };
+    ULONG offset = sizeof(hdr), len;
+    SECURITY_IMPERSONATION_LEVEL level;
+    nfs41_updowncall_entry *entry;
+    BOOLEAN batchable;
+    LUID auth_id;
+
+    *len_out = 0;
+
+    if (cbOut < (sizeof(hdr) + sizeof(ULONG))) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    status = nfs41_upcall_get_entry(wait, &entry);
+    if (status)
+        goto out;
+
+    /* The first entry decides whose client the batch belongs to */
+    batchable = (entry->opcode != NFS41_SYSOP_SHUTDOWN) &&
+        (entry->opcode != NFS41_SYSOP_SET_DAEMON_DEBUGLEVEL) &&
+        (entry->opcode != NFS41_SYSOP_GET_DAEMON_STATS) &&
+        (entry->opcode != NFS41_SYSOP_GET_FLIGHT_RECORDER) &&
+        (entry->opcode != NFS41_SYSOP_GET_MOUNT_STATS) &&
+        (entry->opcode != NFS41_SYSOP_GET_TOP_STATS) &&
+        nfs41_upcall_get_auth_id(entry, &auth_id);
+    level = batchable ?
+        entry->psec_ctx->SecurityQos.ImpersonationLevel : SecurityAnonymous;
+
+    status = nfs41_upcall_entry(entry, TRUE,
+        pbOut + offset + sizeof(ULONG),
+        cbOut - offset - sizeof(ULONG), &len);
+    if (status)
+        goto out;
+    RtlCopyMemory(pbOut + offset, &len, sizeof(ULONG));
+    offset += sizeof(ULONG) + len;
+    hdr.count++;
+
+    /*
+     * Add more upcalls while there is a backlog, i.e. no other daemon
+     * thread is waiting to pick them up
+     */
+    while (batchable &&
+        (hdr.count < NFS41_UPDOWNCALL_BATCH_MAX) &&
+        ((cbOut - offset) >=
+            (sizeof(ULONG) + NFS41_UPDOWNCALL_BATCH_RECORD_SIZE)) &&
+        (upcall_readers_waiting == 0)) {
+        entry = nfs41_upcall_remove_batchable(&auth_id, level);
+        if (entry == NULL)
+            break;
+
+        /* A failed entry is completed with its error and skipped */
+        if (nfs41_upcall_entry(entry, FALSE,
+            pbOut + offset + sizeof(ULONG),
+            cbOut - offset - sizeof(ULONG), &len))
+            continue;
+        RtlCopyMemory(pbOut + offset, &len, sizeof(ULONG));
+        offset += sizeof(ULONG) + len;
+        hdr.count++;
+    }
+
+    hdr.queued = (ULONG)max(InterlockedAdd(&upcalllist.depth, 0), 0);
+    RtlCopyMemory(pbOut, &hdr, sizeof(hdr));
+    *len_out = offset;
+
+out:
+    return status;
+}
+
+NTSTATUS nfs41_upcall_batch(
+    IN PRX_CONTEXT RxContext)
+{
+    NTSTATUS status;
     PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
-    ULONG inbuf_len = LowIoContext->ParamsFor.IoCtl.InputBufferLength;
-    const unsigned char *inbuf;
-    const unsigned char *inbuf_orig;
-    PLIST_ENTRY pEntry;
+    ULONG len = 0;
+
+    FsRtlEnterFileSystem();
+
+    status = upcall_batch_fill(LowIoContext->ParamsFor.IoCtl.pOutputBuffer,
+        LowIoContext->ParamsFor.IoCtl.OutputBufferLength, TRUE, &len);
+    RxContext->InformationToReturn = status ? 0 : len;
+
+    FsRtlExitFileSystem();
+
+    return status;
+}
+
+/*
+ * Process one downcall. The first downcall of a batch (or a single
+ * downcall) ends the impersonation started by |handle_upcall()|
+ */
+static NTSTATUS handle_downcall(
+    IN const unsigned char *inbuf_orig,
+    IN ULONG inbuf_len,
+    IN BOOLEAN stop_impersonating)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    const unsigned char *inbuf = inbuf_orig;
     nfs41_updowncall_entry *header_tmp;
     nfs41_updowncall_entry *cur = NULL;
-    bool found = false;
-
-    inbuf = inbuf_orig = LowIoContext->ParamsFor.IoCtl.pInputBuffer;
 
     FsRtlEnterFileSystem();
 
@@ -651,23 +1741,10 @@ NTSTATUS nfs41_downcall(
 
     unmarshal_nfs41_header(header_tmp, &inbuf);
 
-    ExAcquireFastMutexUnsafe(&downcalllist.lock);
-    pEntry = &downcalllist.head;
-    pEntry = pEntry->Flink;
-    while (pEntry != NULL) {
-        cur = (nfs41_updowncall_entry *)CONTAINING_RECORD(pEntry,
-                nfs41_updowncall_entry, next);
-        if (cur->xid == header_tmp->xid) {
-            found = true;
-            break;
-        }
-        if (pEntry->Flink == &downcalllist.head)
-            break;
-        pEntry = pEntry->Flink;
-    }
-    ExReleaseFastMutexUnsafe(&downcalllist.lock);
-    SeStopImpersonatingClient();
-    if (!found) {
+    cur = nfs41_downcalllist_find(header_tmp->xid);
+    if (stop_impersonating)
+        SeStopImpersonatingClient();
+    if (cur == NULL) {
         print_error("nfs41_downcall: Did not find xid=%lld entry\n",
             header_tmp->xid);
         status = STATUS_NOT_FOUND;
@@ -682,6 +1759,12 @@ NTSTATUS nfs41_downcall(
         switch(cur->opcode) {
         case NFS41_SYSOP_WRITE:
         case NFS41_SYSOP_READ:
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+            if (cur->u.ReadWrite.pool_buf) {
+                nfs41_io_pool_release(cur);
+                break;
+            }
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
             if (cur->u.ReadWrite.buf) {
                 (void)nfs41_UnmapLockedKernelPagesInNfsDaemonAddressSpace(
                     cur->u.ReadWrite.buf,
@@ -694,11 +1777,19 @@ NTSTATUS nfs41_downcall(
                 (void)nfs41_UnmapLockedKernelPagesInNfsDaemonAddressSpace(
                     cur->u.QueryFile.mdl_buf,
                     cur->u.QueryFile.mdl);
-                (void)nfs41_UnlockKernelPages(cur->u.QueryFile.mdl);
+                /* |kbuf| is nonpaged pool, nothing was locked */
+                if (cur->u.QueryFile.kbuf == NULL)
+                    (void)nfs41_UnlockKernelPages(cur->u.QueryFile.mdl);
                 IoFreeMdl(cur->u.QueryFile.mdl);
                 cur->u.QueryFile.mdl_buf = NULL;
                 cur->u.QueryFile.mdl = NULL;
             }
+            if (cur->u.QueryFile.kbuf) {
+                /* |kbuf| is always a |nfs41_fobx->dirbuf| */
+                nfs41_buffer_free(cur->u.QueryFile.kbuf,
+                    NFS41_DIRQUERY_BUFFER_SIZE);
+                cur->u.QueryFile.kbuf = NULL;
+            }
             break;
         case NFS41_SYSOP_OPEN:
             if (cur->u.Open.EaMdl) {
@@ -725,7 +1816,7 @@ NTSTATUS nfs41_downcall(
             break;
         }
         ExReleaseFastMutexUnsafe(&cur->lock);
-        nfs41_RemoveEntry(downcalllist.lock, cur);
+        nfs41_downcalllist_remove(cur);
         nfs41_UpcallDestroy(cur);
         status = STATUS_UNSUCCESSFUL;
         goto out_free;
@@ -734,6 +1825,23 @@ NTSTATUS nfs41_downcall(
     cur->status = header_tmp->status;
     cur->errno = header_tmp->errno;
     status = STATUS_SUCCESS;
+    nfs41_op_stats_record(cur);
+#ifdef NFS41_DRIVER_ETW_TRACELOGGING
+    TraceLoggingWrite(nfs41_trace_provider, "Downcall",
+        TraceLoggingKeyword(NFS41_TRACE_KEYWORD_UPCALL),
+        TraceLoggingInt64(cur->xid, "Xid"),
+        TraceLoggingUInt32(cur->opcode, "Opcode"),
+        TraceLoggingUInt32(cur->status, "Status"));
+#endif /* NFS41_DRIVER_ETW_TRACELOGGING */
+
+#ifdef NFS41_DRIVER_DAEMON_IO_POOL
+    /* failed READ/WRITE downcalls are not unmarshalled */
+    if (header_tmp->status &&
+        ((cur->opcode == NFS41_SYSOP_READ) ||
+            (cur->opcode == NFS41_SYSOP_WRITE)) &&
+        cur->u.ReadWrite.pool_buf)
+        nfs41_io_pool_release(cur);
+#endif /* NFS41_DRIVER_DAEMON_IO_POOL */
 
     if (!header_tmp->status) {
         switch (header_tmp->opcode) {
@@ -754,6 +1862,9 @@ NTSTATUS nfs41_downcall(
         case NFS41_SYSOP_FILE_QUERY_TIME_BASED_COHERENCY:
             unmarshal_nfs41_getattr(cur, &inbuf);
             break;
+        case NFS41_SYSOP_FILE_QUERY_COHERENCY_BATCH:
+            unmarshal_nfs41_coherency_batch(cur, &inbuf);
+            break;
         case NFS41_SYSOP_EA_GET:
             unmarshal_nfs41_eaget(cur, &inbuf);
             break;
@@ -788,8 +1899,28 @@ NTSTATUS nfs41_downcall(
         case NFS41_SYSOP_FSCTL_OFFLOAD_DATACOPY:
             unmarshal_nfs41_duplicatedata(cur, &inbuf);
             break;
+        case NFS41_SYSOP_GET_DAEMON_STATS:
+            unmarshal_nfs41_get_daemon_stats(cur, &inbuf);
+            break;
+        case NFS41_SYSOP_GET_FLIGHT_RECORDER:
+            unmarshal_nfs41_get_flight_recorder(cur, &inbuf);
+            break;
+        case NFS41_SYSOP_GET_MOUNT_STATS:
+            unmarshal_nfs41_get_mount_stats(cur, &inbuf);
+            break;
+        case NFS41_SYSOP_GET_TOP_STATS:
+            unmarshal_nfs41_get_top_stats(cur, &inbuf);
+            break;
+#ifdef NFS41_DRIVER_FASTIO_QUERYOPEN
+        case NFS41_SYSOP_QUERY_OPEN:
+            unmarshal_nfs41_queryopen(cur, &inbuf);
+            break;
+#endif /* NFS41_DRIVER_FASTIO_QUERYOPEN */
         case NFS41_SYSOP_SET_DAEMON_DEBUGLEVEL:
         case NFS41_SYSOP_SHUTDOWN:
+        case NFS41_SYSOP_DIR_NOTIFY:
+        case NFS41_SYSOP_FSCTL_CACHE_CONTROL:
+        case NFS41_SYSOP_FLUSH:
             /* no unmarshal function */
             break;
         }
@@ -814,23 +1945,14 @@ NTSTATUS nfs41_downcall(
             status = STATUS_BUFFER_OVERFLOW;
         }
     }
+    nfs41_netroot_stats_record(cur);
     ExReleaseFastMutexUnsafe(&cur->lock);
     if (cur->async_op) {
         switch (cur->opcode) {
             case NFS41_SYSOP_WRITE:
             case NFS41_SYSOP_READ:
-                if (cur->status == STATUS_SUCCESS) {
-                    cur->u.ReadWrite.rxcontext->StoredStatus =
-                        STATUS_SUCCESS;
-                    cur->u.ReadWrite.rxcontext->InformationToReturn =
-                        cur->u.ReadWrite.buf_len;
-                } else {
-                    cur->u.ReadWrite.rxcontext->StoredStatus =
-                        map_readwrite_errors(cur->status);
-                    cur->u.ReadWrite.rxcontext->InformationToReturn = 0;
-                }
-                nfs41_RemoveEntry(downcalllist.lock, cur);
-                RxLowIoCompletion(cur->u.ReadWrite.rxcontext);
+                nfs41_downcalllist_remove(cur);
+                nfs41_rw_async_complete(cur);
                 nfs41_UpcallDestroy(cur);
                 break;
             default:
@@ -856,6 +1978,157 @@ out:
     return status;
 }
 
+NTSTATUS nfs41_downcall(
+    IN PRX_CONTEXT RxContext)
+{
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+
+    return handle_downcall(LowIoContext->ParamsFor.IoCtl.pInputBuffer,
+        LowIoContext->ParamsFor.IoCtl.InputBufferLength, TRUE);
+}
+
+/*
+ * Process a batch of downcalls, see |IOCTL_NFS41_WRITE_BATCH|.
+ * The status of each downcall is returned in |statuses|
+ */
+static NTSTATUS downcall_batch_process(
+    IN const unsigned char *inbuf,
+    IN ULONG inbuf_len,
+    OUT NTSTATUS statuses[NFS41_UPDOWNCALL_BATCH_MAX],
+    OUT ULONG *count_out)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    NFS41_UPDOWNCALL_BATCH_HEADER hdr;
+    ULONG i, offset, len;
+
+    *count_out = 0;
+
+    if (inbuf_len < sizeof(hdr)) {
+        SeStopImpersonatingClient();
+        status = STATUS_INVALID_PARAMETER;
+        goto out;
+    }
+    RtlCopyMemory(&hdr, inbuf, sizeof(hdr));
+    if ((hdr.count == 0) || (hdr.count > NFS41_UPDOWNCALL_BATCH_MAX)) {
+        print_error("downcall_batch_process: invalid batch, count=%lu\n",
+            (unsigned long)hdr.count);
+        SeStopImpersonatingClient();
+        status = STATUS_INVALID_PARAMETER;
+        goto out;
+    }
+
+    offset = sizeof(hdr);
+    for (i = 0; i < hdr.count; i++) {
+        len = 0;
+        if ((inbuf_len - offset) >= sizeof(ULONG)) {
+            RtlCopyMemory(&len, inbuf + offset, sizeof(ULONG));
+            offset += sizeof(ULONG);
+        }
+
+        if ((len == 0) || (len > (inbuf_len - offset))) {
+            print_error("downcall_batch_process: "
+                "record %lu truncated (inbuf_len=%lu)\n",
+                (unsigned long)i, (unsigned long)inbuf_len);
+            if (i == 0)
+                SeStopImpersonatingClient();
+            statuses[i] = STATUS_INVALID_PARAMETER;
+            /* all following records are unusable too */
+            offset = inbuf_len;
+        }
+        else {
+            statuses[i] = handle_downcall(inbuf + offset, len,
+                (BOOLEAN)(i == 0));
+            offset += len;
+        }
+    }
+    *count_out = hdr.count;
+
+out:
+    return status;
+}
+
+NTSTATUS nfs41_downcall_batch(
+    IN PRX_CONTEXT RxContext)
+{
+    NTSTATUS status;
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    ULONG cbOut = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
+    unsigned char *pbOut = LowIoContext->ParamsFor.IoCtl.pOutputBuffer;
+    NTSTATUS statuses[NFS41_UPDOWNCALL_BATCH_MAX];
+    ULONG count;
+
+    if (cbOut < sizeof(statuses)) {
+        SeStopImpersonatingClient();
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    /*
+     * Note: |pbOut| and the input buffer are the same
+     * (|METHOD_BUFFERED|), so the statuses can only be copied out
+     * after all downcalls have been processed
+     */
+    status = downcall_batch_process(
+        LowIoContext->ParamsFor.IoCtl.pInputBuffer,
+        LowIoContext->ParamsFor.IoCtl.InputBufferLength,
+        statuses, &count);
+    if (status)
+        goto out;
+
+    RtlCopyMemory(pbOut, statuses, count * sizeof(NTSTATUS));
+    RxContext->InformationToReturn = count * sizeof(NTSTATUS);
+
+out:
+    return status;
+}
+
+NTSTATUS nfs41_downcall_upcall_batch(
+    IN PRX_CONTEXT RxContext)
+{
+    NTSTATUS status;
+    PLOWIO_CONTEXT LowIoContext = &RxContext->LowIoContext;
+    ULONG cbOut = LowIoContext->ParamsFor.IoCtl.OutputBufferLength;
+    unsigned char *pbOut = LowIoContext->ParamsFor.IoCtl.pOutputBuffer;
+    NTSTATUS statuses[NFS41_UPDOWNCALL_BATCH_MAX];
+    NFS41_UPDOWNCALL_BATCH_HEADER hdr = { .count = 0 };
+    ULONG count, len = 0;
+
+    if (cbOut < (sizeof(statuses) + sizeof(hdr))) {
+        SeStopImpersonatingClient();
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    FsRtlEnterFileSystem();
+
+    status = downcall_batch_process(
+        LowIoContext->ParamsFor.IoCtl.pInputBuffer,
+        LowIoContext->ParamsFor.IoCtl.InputBufferLength,
+        statuses, &count);
+    if (status)
+        goto out;
+    RtlZeroMemory(&statuses[count],
+        (NFS41_UPDOWNCALL_BATCH_MAX - count) * sizeof(NTSTATUS));
+
+    /*
+     * Pick up the next batch if upcalls are already queued. Don't wait
+     * for new ones, the daemon must see the downcall statuses first.
+     * Any error here just means "no upcalls", the downcall statuses
+     * must be returned in any case
+     */
+    if (upcall_batch_fill(pbOut + sizeof(statuses),
+        cbOut - sizeof(statuses), FALSE, &len)) {
+        RtlCopyMemory(pbOut + sizeof(statuses), &hdr, sizeof(hdr));
+        len = sizeof(hdr);
+    }
+
+    RtlCopyMemory(pbOut, statuses, sizeof(statuses));
+    RxContext->InformationToReturn = sizeof(statuses) + len;
+
+out:
+    FsRtlExitFileSystem();
+
+    return status;
+}
+
 NTSTATUS nfs41_delayxid(
     IN PRX_CONTEXT RxContext)
 {
@@ -864,9 +2137,7 @@ NTSTATUS nfs41_delayxid(
     ULONG inbuf_len = LowIoContext->ParamsFor.IoCtl.InputBufferLength;
     const unsigned char *inbuf;
     const unsigned char *inbuf_orig;
-    PLIST_ENTRY pEntry;
     nfs41_updowncall_entry *cur = NULL;
-    bool found = false;
 
     FsRtlEnterFileSystem();
 
@@ -900,23 +2171,8 @@ NTSTATUS nfs41_delayxid(
         status = STATUS_BUFFER_OVERFLOW;
     }
 
-    ExAcquireFastMutexUnsafe(&downcalllist.lock);
-    pEntry = &downcalllist.head;
-    pEntry = pEntry->Flink;
-    while (pEntry != NULL) {
-        cur = (nfs41_updowncall_entry *)CONTAINING_RECORD(pEntry,
-                nfs41_updowncall_entry, next);
-        if (cur->xid == delayxid) {
-            found = true;
-            break;
-        }
-        if (pEntry->Flink == &downcalllist.head)
-            break;
-        pEntry = pEntry->Flink;
-    }
-    ExReleaseFastMutexUnsafe(&downcalllist.lock);
-
-    if (!found) {
+    cur = nfs41_downcalllist_find(delayxid);
+    if (cur == NULL) {
         print_error("nfs41_delayxid: Did not find xid=%lld entry\n", delayxid);
         status = STATUS_NOT_FOUND;
         goto out;
@@ -39,11 +39,61 @@ static INLINE ULONG length_as_utf8(
     PCUNICODE_STRING str)
 {
     ULONG ActualCount = 0;
-    RtlUnicodeToUTF8N(NULL, 0xffff, &ActualCount, str->Buffer, str->Length);
+    if (nfs41_unicode_is_ascii(str->Buffer, str->Length/sizeof(WCHAR)))
+        ActualCount = str->Length/sizeof(WCHAR);
+    else
+        RtlUnicodeToUTF8N(NULL, 0xffff, &ActualCount,
+            str->Buffer, str->Length);
     /* Length of length field + string length + '\0'*/
     return sizeof(USHORT) + ActualCount + 1;
 }
 
+/*
+ * Monotonic time in milliseconds for cache timeouts.
+ * |KeQueryInterruptTime()| is in 100ns units, the truncation to
+ * |ULONG| wraps after 49 days, which is harmless as long as callers
+ * only compare differences.
+ */
+static INLINE ULONG nfs41_get_interrupttime_msecs(void)
+{
+    return (ULONG)(KeQueryInterruptTime() / 10000ULL);
+}
+
+/*
+ * "immutable" mounts: Data cached at |cache_time| is valid if it was
+ * cached after the mount or the last "nfsclientdctl flush". Comparing
+ * both ages keeps this correct across the |ULONG| wrap, at worst an
+ * entry is dropped once every 49 days.
+ */
+static INLINE BOOLEAN nfs41_immutable_cache_valid(
+    IN PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext,
+    IN ULONG cache_time)
+{
+    const ULONG now = nfs41_get_interrupttime_msecs();
+
+    return pVNetRootContext->immutable &&
+        ((now - cache_time) <
+            (now - (ULONG)pVNetRootContext->cache_flush_time));
+}
+
+/*
+ * Delegation type of an open. The copy in the FOBX is not updated
+ * on recall for FOBXs collapsed onto the same SRV_OPEN, so check the
+ * SRV_OPEN first
+ */
+static INLINE DWORD nfs41_fobx_deleg_type(
+    IN PMRX_SRV_OPEN SrvOpen,
+    IN PNFS41_FOBX nfs41_fobx)
+{
+#ifdef NFS41_DRIVER_SRVOPEN_COLLAPSING
+    if (NFS41GetSrvOpenExtension(SrvOpen)->deleg_recalled)
+        return 0;
+#else
+    (void)SrvOpen;
+#endif /* NFS41_DRIVER_SRVOPEN_COLLAPSING */
+    return nfs41_fobx->deleg_type;
+}
+
 /* Prototypes */
 BOOLEAN isFilenameTooLong(
     PUNICODE_STRING name,
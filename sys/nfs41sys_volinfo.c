@@ -145,6 +145,138 @@ NTSTATUS map_volume_errors(
     }
 }
 
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+/*
+ * Volume information cache
+ *
+ * Copy engines like robocopy and Explorer query the free space for
+ * each file they copy, so we cache |FileFsSizeInformation|,
+ * |FileFsFullSizeInformation| and |FileFsAttributeInformation| per
+ * mount for |pVNetRootContext->volcachettl| seconds.
+ * The daemon answers from the superblock of the file, and files below
+ * the mount can be on other filesystems (nested exports, referrals),
+ * so each entry remembers the fsid it was filled for and only answers
+ * queries for files on the same fsid.
+ * If an entry has expired only one thread does the refresh upcall,
+ * all other threads get the old data until the refresh is done.
+ *
+ * The cache is invalidated in the same places where the daemon calls
+ * |nfs41_superblock_space_changed()| and the kernel sees the
+ * operation, except for WRITE - we do not want to throw away the
+ * cache for each WRITE of a copy, and the TTL limits how stale the
+ * data can get.
+ */
+void nfs41_volcache_init(
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext)
+{
+    ExInitializeFastMutex(&pVNetRootContext->volcache.lock);
+    pVNetRootContext->volcache.gen = 0;
+    RtlZeroMemory(pVNetRootContext->volcache.entries,
+        sizeof(pVNetRootContext->volcache.entries));
+}
+
+void nfs41_volcache_invalidate(
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext)
+{
+    nfs41_volcache *vc = &pVNetRootContext->volcache;
+    int i;
+
+    ExAcquireFastMutex(&vc->lock);
+    vc->gen++;
+    for (i = 0 ; i < NFS41_VOLCACHE_NUM_ENTRIES ; i++)
+        vc->entries[i].valid = FALSE;
+    ExReleaseFastMutex(&vc->lock);
+}
+
+static int nfs41_volcache_index(
+    FS_INFORMATION_CLASS InfoClass)
+{
+    switch (InfoClass) {
+    case FileFsSizeInformation:     return NFS41_VOLCACHE_SIZE;
+    case FileFsFullSizeInformation: return NFS41_VOLCACHE_FULLSIZE;
+    case FileFsAttributeInformation: return NFS41_VOLCACHE_ATTRIBUTE;
+    default:                        return -1;
+    }
+}
+
+/*
+ * Returns |TRUE| if |RxContext| was answered from the cache.
+ * Otherwise |*refresh_out| is set if the caller was chosen to
+ * refresh the entry, and must call |nfs41_volcache_store()| after
+ * the upcall.
+ */
+static BOOLEAN nfs41_volcache_lookup(
+    IN OUT PRX_CONTEXT RxContext,
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext,
+    PNFS41_FCB nfs41_fcb,
+    OUT BOOLEAN *refresh_out,
+    OUT LONG *gen_out)
+{
+    nfs41_volcache *vc = &pVNetRootContext->volcache;
+    nfs41_volcache_entry *e;
+    int i = nfs41_volcache_index(RxContext->Info.FsInformationClass);
+    BOOLEAN hit = FALSE;
+
+    *refresh_out = FALSE;
+    if ((i < 0) || (pVNetRootContext->volcachettl == 0))
+        return FALSE;
+
+    e = &vc->entries[i];
+    ExAcquireFastMutex(&vc->lock);
+    if (e->valid &&
+        (e->fsid_major == nfs41_fcb->fsid_major) &&
+        (e->fsid_minor == nfs41_fcb->fsid_minor) &&
+        (e->len <= (ULONG)RxContext->Info.LengthRemaining)) {
+        ULONG age = nfs41_get_interrupttime_msecs() - e->time;
+
+        if ((age < (pVNetRootContext->volcachettl * 1000UL)) ||
+            e->refreshing) {
+            RtlCopyMemory(RxContext->Info.Buffer, &e->u, e->len);
+            RxContext->Info.LengthRemaining -= e->len;
+            hit = TRUE;
+        }
+    }
+    if ((!hit) && (!e->refreshing)) {
+        e->refreshing = TRUE;
+        *refresh_out = TRUE;
+        *gen_out = vc->gen;
+    }
+    ExReleaseFastMutex(&vc->lock);
+
+#ifdef DEBUG_VOLUME_QUERY
+    DbgP("nfs41_volcache_lookup: class=%d hit=%d refresh=%d\n",
+        (int)RxContext->Info.FsInformationClass,
+        (int)hit, (int)*refresh_out);
+#endif
+    return hit;
+}
+
+static void nfs41_volcache_store(
+    PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext,
+    PNFS41_FCB nfs41_fcb,
+    FS_INFORMATION_CLASS InfoClass,
+    LONG gen,
+    const void *buf,
+    ULONG len)
+{
+    nfs41_volcache *vc = &pVNetRootContext->volcache;
+    nfs41_volcache_entry *e = &vc->entries[nfs41_volcache_index(InfoClass)];
+
+    ExAcquireFastMutex(&vc->lock);
+    e->refreshing = FALSE;
+    /* |buf == NULL| means the refresh failed */
+    if (buf && (vc->gen == gen) && (len <= sizeof(e->u))) {
+        RtlCopyMemory(&e->u, buf, len);
+        e->len = len;
+        e->fsid_major = nfs41_fcb->fsid_major;
+        e->fsid_minor = nfs41_fcb->fsid_minor;
+        e->time = nfs41_get_interrupttime_msecs();
+        e->valid = TRUE;
+    }
+    ExReleaseFastMutex(&vc->lock);
+}
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
+
 NTSTATUS nfs41_QueryVolumeInformation(
     IN OUT PRX_CONTEXT RxContext)
 {
@@ -158,6 +290,11 @@ NTSTATUS nfs41_QueryVolumeInformation(
     __notnull PNFS41_NETROOT_EXTENSION pNetRootContext =
         NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
     __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+    BOOLEAN volcache_refresh = FALSE;
+    LONG volcache_gen = 0;
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
 
 #ifdef ENABLE_TIMINGS
     LARGE_INTEGER t1, t2;
@@ -193,12 +330,28 @@ NTSTATUS nfs41_QueryVolumeInformation(
         goto out;
     }
 
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
     case FileFsAttributeInformation:
     case FileFsSizeInformation:
     case FileFsFullSizeInformation:
+        if (nfs41_volcache_lookup(RxContext, pVNetRootContext, nfs41_fcb,
+            &volcache_refresh, &volcache_gen)) {
+            status = STATUS_SUCCESS;
+            goto out;
+        }
+        break;
+
     case FileFsSectorSizeInformation:
     case FileFsVolumeInformation:
         break;
+#else
+    case FileFsAttributeInformation:
+    case FileFsSizeInformation:
+    case FileFsFullSizeInformation:
+    case FileFsSectorSizeInformation:
+    case FileFsVolumeInformation:
+        break;
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
 
     default:
         print_error("nfs41_QueryVolumeInformation: unhandled class %d\n", InfoClass);
@@ -209,6 +362,7 @@ NTSTATUS nfs41_QueryVolumeInformation(
         pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
         pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
     if (status) goto out;
+    entry->netroot_stats = &pNetRootContext->stats;
 
     entry->u.Volume.query = InfoClass;
     entry->u.Volume.buf = RxContext->Info.Buffer;
@@ -235,10 +389,25 @@ NTSTATUS nfs41_QueryVolumeInformation(
 #endif
         RxContext->Info.LengthRemaining -= entry->u.Volume.buf_len;
         status = STATUS_SUCCESS;
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+        if (volcache_refresh) {
+            nfs41_volcache_store(pVNetRootContext, nfs41_fcb, InfoClass,
+                volcache_gen, RxContext->Info.Buffer,
+                entry->u.Volume.buf_len);
+            volcache_refresh = FALSE;
+        }
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
     } else {
         status = map_volume_errors(entry->status);
     }
 out:
+#ifdef NFS41_DRIVER_VOLUME_INFO_CACHE
+    /* Refresh failed, let the next caller try again */
+    if (volcache_refresh) {
+        nfs41_volcache_store(pVNetRootContext, nfs41_fcb, InfoClass,
+            volcache_gen, NULL, 0);
+    }
+#endif /* NFS41_DRIVER_VOLUME_INFO_CACHE */
     if (entry) {
         nfs41_UpcallDestroy(entry);
     }
@@ -23,6 +23,7 @@
 #include <tchar.h>
 #include <stdio.h>
 #include <errno.h>
+#include <process.h>
 
 
 static void PrintErrorMessage(
@@ -246,6 +247,457 @@ out:
 #define BLOCK_SIZE 512
 #define PAGE_SIZE 4096
 
+/*
+ * Load generator: |threads| threads, each keeping |depth| overlapped
+ * ReadFile()/WriteFile() calls in flight on its own handle and
+ * collecting the completions from its own I/O completion port
+ */
+#define LAT_SUB_BUCKETS 8
+#define LAT_BUCKETS (64 * LAT_SUB_BUCKETS)
+#define LOAD_MAX_DEPTH 256
+
+// log-linear histogram of latencies in microseconds, ~12% resolution
+struct latency_hist {
+    ULONGLONG count;
+    ULONGLONG total;
+    ULONGLONG min;
+    ULONGLONG max;
+    ULONGLONG buckets[LAT_BUCKETS];
+};
+
+struct load_config {
+    LPCTSTR filename;
+    ULONGLONG filesize;
+    DWORD threads;
+    DWORD depth;
+    DWORD block_size;
+    DWORD duration_ms;
+    DWORD read_percent;
+    BOOL buffered;
+    BOOL sequential;
+};
+
+struct load_op {
+    OVERLAPPED overlapped;
+    LPVOID buffer;
+    LONGLONG started;
+    BOOL write;
+};
+
+struct load_thread {
+    const struct load_config *cfg;
+    HANDLE thread;
+    HANDLE file;
+    HANDLE iocp;
+    ULONGLONG rstate;
+    DWORD status;
+    ULONGLONG bytes_read;
+    ULONGLONG bytes_written;
+    struct latency_hist read_lat;
+    struct latency_hist write_lat;
+};
+
+static LONGLONG ticks_per_sec;
+static volatile LONGLONG load_seq_offset = 0;
+
+static LONGLONG now_ticks(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static DWORD lat_bucket(ULONGLONG usecs)
+{
+    DWORD log2 = 0;
+    ULONGLONG v;
+
+    if (usecs < LAT_SUB_BUCKETS)
+        return (DWORD)usecs;
+    for (v = usecs; v >= (2 * LAT_SUB_BUCKETS); v >>= 1)
+        log2++;
+    // |v| is in [LAT_SUB_BUCKETS, 2*LAT_SUB_BUCKETS)
+    return (log2 + 1) * LAT_SUB_BUCKETS + (DWORD)(v - LAT_SUB_BUCKETS);
+}
+
+// smallest latency which falls into bucket |b|
+static ULONGLONG lat_bucket_value(DWORD b)
+{
+    if (b < LAT_SUB_BUCKETS)
+        return b;
+    return (ULONGLONG)(LAT_SUB_BUCKETS + (b % LAT_SUB_BUCKETS)) <<
+        ((b / LAT_SUB_BUCKETS) - 1);
+}
+
+static void lat_add(struct latency_hist *hist, ULONGLONG usecs)
+{
+    DWORD b = lat_bucket(usecs);
+
+    if (b >= LAT_BUCKETS)
+        b = LAT_BUCKETS - 1;
+    hist->buckets[b]++;
+    if (hist->count == 0 || usecs < hist->min)
+        hist->min = usecs;
+    if (usecs > hist->max)
+        hist->max = usecs;
+    hist->count++;
+    hist->total += usecs;
+}
+
+static void lat_merge(struct latency_hist *sum, const struct latency_hist *hist)
+{
+    DWORD b;
+
+    if (hist->count == 0)
+        return;
+    if (sum->count == 0 || hist->min < sum->min)
+        sum->min = hist->min;
+    if (hist->max > sum->max)
+        sum->max = hist->max;
+    sum->count += hist->count;
+    sum->total += hist->total;
+    for (b = 0; b < LAT_BUCKETS; b++)
+        sum->buckets[b] += hist->buckets[b];
+}
+
+static ULONGLONG lat_percentile(const struct latency_hist *hist, double percent)
+{
+    ULONGLONG threshold = (ULONGLONG)((double)hist->count * percent / 100.0);
+    ULONGLONG sum = 0;
+    DWORD b;
+
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        sum += hist->buckets[b];
+        if (sum > threshold)
+            return lat_bucket_value(b);
+    }
+    return hist->max;
+}
+
+static void load_print(
+    LPCTSTR kind,
+    const struct latency_hist *hist,
+    ULONGLONG bytes,
+    double seconds)
+{
+    if (hist->count == 0)
+        return;
+    _tprintf(TEXT("%s: ops=%llu iops=%.1f MB/s=%.2f ")
+        TEXT("lat_usecs: avg=%llu min=%llu p50=%llu p90=%llu p99=%llu ")
+        TEXT("p99.9=%llu max=%llu\n"),
+        kind, hist->count, (double)hist->count / seconds,
+        ((double)bytes / (1024.0 * 1024.0)) / seconds,
+        hist->total / hist->count, hist->min,
+        lat_percentile(hist, 50.0), lat_percentile(hist, 90.0),
+        lat_percentile(hist, 99.0), lat_percentile(hist, 99.9),
+        hist->max);
+}
+
+// xorshift64, seeded per thread so runs are repeatable
+static ULONGLONG load_rand(struct load_thread *lt)
+{
+    ULONGLONG x = lt->rstate;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    lt->rstate = x;
+    return x;
+}
+
+static DWORD load_issue(
+    struct load_thread *lt,
+    struct load_op *op)
+{
+    const struct load_config *cfg = lt->cfg;
+    const ULONGLONG blocks = cfg->filesize / cfg->block_size;
+    ULARGE_INTEGER offset;
+    BOOL ok;
+
+    if (cfg->sequential)
+        offset.QuadPart = (ULONGLONG)InterlockedExchangeAdd64(
+            &load_seq_offset, cfg->block_size) % (blocks * cfg->block_size);
+    else
+        offset.QuadPart = (load_rand(lt) % blocks) * cfg->block_size;
+
+    op->write = (load_rand(lt) % 100) >= cfg->read_percent;
+    ZeroMemory(&op->overlapped, sizeof(op->overlapped));
+    op->overlapped.Offset = offset.LowPart;
+    op->overlapped.OffsetHigh = offset.HighPart;
+    op->started = now_ticks();
+
+    // completions are queued to |lt->iocp| even if the call succeeds
+    if (op->write)
+        ok = WriteFile(lt->file, op->buffer, cfg->block_size, NULL, &op->overlapped);
+    else
+        ok = ReadFile(lt->file, op->buffer, cfg->block_size, NULL, &op->overlapped);
+    if (!ok && GetLastError() != ERROR_IO_PENDING)
+        return GetLastError();
+    return NO_ERROR;
+}
+
+static unsigned int WINAPI load_thread_main(void *arg)
+{
+    struct load_thread *lt = (struct load_thread*)arg;
+    const struct load_config *cfg = lt->cfg;
+    struct load_op ops[LOAD_MAX_DEPTH];
+    LONGLONG deadline;
+    OVERLAPPED *overlapped;
+    ULONG_PTR key;
+    DWORD i, inflight = 0, transferred;
+    struct load_op *op;
+    BOOL ok;
+
+    ZeroMemory(ops, sizeof(ops));
+    for (i = 0; i < cfg->depth; i++) {
+        // page aligned for FILE_FLAG_NO_BUFFERING
+        ops[i].buffer = VirtualAlloc(NULL, cfg->block_size,
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (ops[i].buffer == NULL) {
+            lt->status = GetLastError();
+            goto out;
+        }
+        FillMemory(ops[i].buffer, cfg->block_size, (BYTE)(0x41 + i));
+    }
+
+    deadline = now_ticks() + (ticks_per_sec * cfg->duration_ms) / 1000;
+
+    for (i = 0; i < cfg->depth; i++) {
+        lt->status = load_issue(lt, &ops[i]);
+        if (lt->status) {
+            _ftprintf(stderr, TEXT("%s failed with %d: "),
+                ops[i].write ? TEXT("WriteFile()") : TEXT("ReadFile()"),
+                lt->status);
+            break;
+        }
+        inflight++;
+    }
+
+    while (inflight) {
+        ok = GetQueuedCompletionStatus(lt->iocp, &transferred, &key,
+            &overlapped, INFINITE);
+        if (overlapped == NULL) {
+            lt->status = GetLastError();
+            _ftprintf(stderr, TEXT("GetQueuedCompletionStatus() failed with %d: "),
+                lt->status);
+            break;
+        }
+        inflight--;
+        op = CONTAINING_RECORD(overlapped, struct load_op, overlapped);
+        if (!ok) {
+            if (lt->status == NO_ERROR) {
+                lt->status = GetLastError();
+                _ftprintf(stderr, TEXT("%s completed with %d: "),
+                    op->write ? TEXT("WriteFile()") : TEXT("ReadFile()"),
+                    lt->status);
+            }
+            continue;
+        }
+
+        if (op->write) {
+            lat_add(&lt->write_lat, (ULONGLONG)((now_ticks() - op->started) *
+                1000000 / ticks_per_sec));
+            lt->bytes_written += transferred;
+        } else {
+            lat_add(&lt->read_lat, (ULONGLONG)((now_ticks() - op->started) *
+                1000000 / ticks_per_sec));
+            lt->bytes_read += transferred;
+        }
+
+        if (lt->status == NO_ERROR && now_ticks() < deadline) {
+            lt->status = load_issue(lt, op);
+            if (lt->status == NO_ERROR)
+                inflight++;
+        }
+    }
+out:
+    for (i = 0; i < cfg->depth; i++)
+        if (ops[i].buffer)
+            VirtualFree(ops[i].buffer, 0, MEM_RELEASE);
+    return 0;
+}
+
+static DWORD load_run(
+    const struct load_config *cfg)
+{
+    struct load_thread *threads;
+    struct latency_hist *read_lat, *write_lat;
+    ULONGLONG bytes_read = 0, bytes_written = 0;
+    LARGE_INTEGER freq;
+    LONGLONG start;
+    double seconds;
+    HANDLE file;
+    DWORD i, status = NO_ERROR;
+
+    QueryPerformanceFrequency(&freq);
+    ticks_per_sec = freq.QuadPart;
+
+    threads = calloc(cfg->threads, sizeof(struct load_thread));
+    read_lat = calloc(1, sizeof(struct latency_hist));
+    write_lat = calloc(1, sizeof(struct latency_hist));
+    if (threads == NULL || read_lat == NULL || write_lat == NULL) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto out;
+    }
+
+    // create the file with its final size, extending writes are synchronous
+    file = CreateFile(cfg->filename, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        _ftprintf(stderr, TEXT("CreateFile('%s') failed with %d: "),
+            cfg->filename, status);
+        goto out;
+    }
+    status = resize_file(file, (SIZE_T)cfg->filesize);
+    CloseHandle(file);
+    if (status)
+        goto out;
+
+    for (i = 0; i < cfg->threads; i++) {
+        threads[i].cfg = cfg;
+        threads[i].rstate = 0x9E3779B97F4A7C15ULL * (i + 1);
+        threads[i].file = CreateFile(cfg->filename,
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED |
+            (cfg->buffered ? 0 : FILE_FLAG_NO_BUFFERING) |
+            (cfg->sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS),
+            NULL);
+        if (threads[i].file == INVALID_HANDLE_VALUE) {
+            status = GetLastError();
+            _ftprintf(stderr, TEXT("CreateFile('%s') failed with %d: "),
+                cfg->filename, status);
+            goto out_threads;
+        }
+        threads[i].iocp = CreateIoCompletionPort(threads[i].file, NULL, 0, 1);
+        if (threads[i].iocp == NULL) {
+            status = GetLastError();
+            _ftprintf(stderr, TEXT("CreateIoCompletionPort() failed with %d: "),
+                status);
+            goto out_threads;
+        }
+    }
+
+    _tprintf(TEXT("file='%s' filesize=%llu threads=%u depth=%u bs=%u ")
+        TEXT("read_percent=%u %s %s duration_ms=%u\n"),
+        cfg->filename, cfg->filesize, cfg->threads, cfg->depth,
+        cfg->block_size, cfg->read_percent,
+        cfg->sequential ? TEXT("sequential") : TEXT("random"),
+        cfg->buffered ? TEXT("buffered") : TEXT("unbuffered"),
+        cfg->duration_ms);
+
+    start = now_ticks();
+    for (i = 0; i < cfg->threads; i++) {
+        threads[i].thread = (HANDLE)_beginthreadex(NULL, 0,
+            load_thread_main, &threads[i], 0, NULL);
+        if (threads[i].thread == NULL) {
+            status = GetLastError();
+            _ftprintf(stderr, TEXT("_beginthreadex() failed with %d: "), status);
+            break;
+        }
+    }
+    for (i = 0; i < cfg->threads; i++) {
+        if (threads[i].thread == NULL)
+            continue;
+        WaitForSingleObject(threads[i].thread, INFINITE);
+        CloseHandle(threads[i].thread);
+    }
+    seconds = (double)(now_ticks() - start) / (double)ticks_per_sec;
+
+    for (i = 0; i < cfg->threads; i++) {
+        if (threads[i].status && status == NO_ERROR)
+            status = threads[i].status;
+        lat_merge(read_lat, &threads[i].read_lat);
+        lat_merge(write_lat, &threads[i].write_lat);
+        bytes_read += threads[i].bytes_read;
+        bytes_written += threads[i].bytes_written;
+    }
+
+    load_print(TEXT("read"), read_lat, bytes_read, seconds);
+    load_print(TEXT("write"), write_lat, bytes_written, seconds);
+    _tprintf(TEXT("total: iops=%.1f MB/s=%.2f seconds=%.2f\n"),
+        (double)(read_lat->count + write_lat->count) / seconds,
+        ((double)(bytes_read + bytes_written) / (1024.0 * 1024.0)) / seconds,
+        seconds);
+
+out_threads:
+    for (i = 0; i < cfg->threads; i++) {
+        if (threads[i].iocp)
+            CloseHandle(threads[i].iocp);
+        if (threads[i].file && threads[i].file != INVALID_HANDLE_VALUE)
+            CloseHandle(threads[i].file);
+    }
+out:
+    free(write_lat);
+    free(read_lat);
+    free(threads);
+    return status;
+}
+
+static void load_usage(LPCTSTR argv0)
+{
+    _tprintf(TEXT("Usage: %s <filename> <bytes> <threads>\n")
+        TEXT("       %s -load [-t <threads>] [-q <depth>] [-b <blocksize>] ")
+        TEXT("[-s <filesize>] [-d <seconds>] [-r <read percent>] ")
+        TEXT("[-buffered] [-seq] <filename>\n"), argv0, argv0);
+}
+
+static DWORD load_main(DWORD argc, LPTSTR argv[])
+{
+    struct load_config cfg = {
+        .filesize = 1024 * 1024 * 1024,
+        .threads = 4,
+        .depth = 16,
+        .block_size = 4096,
+        .duration_ms = 10000,
+        .read_percent = 100,
+        .buffered = FALSE,
+        .sequential = FALSE
+    };
+    DWORD i;
+
+    for (i = 2; i < argc; i++) {
+        if (_tcscmp(argv[i], TEXT("-buffered")) == 0)
+            cfg.buffered = TRUE;
+        else if (_tcscmp(argv[i], TEXT("-seq")) == 0)
+            cfg.sequential = TRUE;
+        else if (argv[i][0] == TEXT('-') && i + 1 < argc) {
+            switch (argv[i][1]) {
+            case TEXT('t'): cfg.threads = _ttoi(argv[++i]); break;
+            case TEXT('q'): cfg.depth = _ttoi(argv[++i]); break;
+            case TEXT('b'): cfg.block_size = (DWORD)parse_buffer_size(argv[++i]); break;
+            case TEXT('s'): cfg.filesize = parse_buffer_size(argv[++i]); break;
+            case TEXT('d'): cfg.duration_ms = _ttoi(argv[++i]) * 1000; break;
+            case TEXT('r'): cfg.read_percent = _ttoi(argv[++i]); break;
+            default: load_usage(argv[0]); return ERROR_INVALID_PARAMETER;
+            }
+        } else
+            break;
+    }
+    if (i + 1 != argc) {
+        load_usage(argv[0]);
+        return ERROR_INVALID_PARAMETER;
+    }
+    cfg.filename = argv[i];
+
+    if (cfg.threads == 0 || cfg.threads > MAXIMUM_WAIT_OBJECTS ||
+        cfg.depth == 0 || cfg.depth > LOAD_MAX_DEPTH ||
+        cfg.read_percent > 100 || cfg.duration_ms == 0) {
+        load_usage(argv[0]);
+        return ERROR_INVALID_PARAMETER;
+    }
+    // FILE_FLAG_NO_BUFFERING needs sector aligned offsets and sizes
+    if (cfg.block_size == 0 || (cfg.block_size % BLOCK_SIZE) ||
+        cfg.filesize < cfg.block_size) {
+        _tprintf(TEXT("blocksize must be a multiple of %u and <= filesize\n"),
+            BLOCK_SIZE);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    return load_run(&cfg);
+}
+
 DWORD __cdecl _tmain(DWORD argc, LPTSTR argv[])
 {
     DWORD status = NO_ERROR;
@@ -255,8 +707,12 @@ DWORD __cdecl _tmain(DWORD argc, LPTSTR argv[])
     PBYTE buffer;
 
     // parse the command line
+    if (argc >= 2 && _tcscmp(argv[1], TEXT("-load")) == 0) {
+        status = load_main(argc, argv);
+        goto out;
+    }
     if (argc < 4) {
-        _tprintf(TEXT("Usage: %s <filename> <bytes> <threads>\n"), argv[0]);
+        load_usage(argv[0]);
         goto out;
     }
     filename = argv[1];
@@ -35,20 +35,497 @@
  * # on machine 2:
  * $ time bash -c 'set -o errexit ; (for ((i=0 ; i < 400 ; i++)) ; do ./lockincfile1 contestedfile1.txt "bbb"; done) ; echo $?'
  * When both machines are finished the last line should match eregex ".+800"
+ *
+ * Lock contention benchmark:
+ * $ ./lockincfile1 -bench [-p <procs>] [-n <iterations>] [-m <shared%>] \
+ *       [-f] [-g <granularity>] [-r <ranges>] [-w <hold_usecs>] [-h] \
+ *       <filename>
+ * starts |procs| processes which each take |iterations| byte-range
+ * locks on <filename>:
+ * -m   percentage of shared locks, the others are exclusive (default 0)
+ * -f   non-blocking mode: |LOCKFILE_FAIL_IMMEDIATELY|, retried until
+ *      the lock is granted (default is blocking)
+ * -g   size of each locked range in bytes (default 4096)
+ * -r   number of ranges, each lock picks a random one; 1 (the default)
+ *      means all processes contend for the same range
+ * -w   time to hold each lock, in microseconds (default 0)
+ * -h   measure the handoff latency: the holder of an exclusive lock
+ *      writes the release time into its range before unlocking, the
+ *      next holder on the same machine computes the time from the
+ *      release to its own acquisition. Needs a granularity of at
+ *      least 24 bytes
+ * It prints the lock acquisitions/s, the time to acquire a lock and
+ * the handoff latency as percentiles (upper bounds of log2
+ * microsecond buckets).
+ * For contention between several clients, start the same command on
+ * each machine at the same time, each prints its own results. Note
+ * that the handoff latency is only measured between processes on the
+ * same machine (|QueryPerformanceCounter()| is per machine)
  */
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
 
 #define EXIT_USAGE (2) /* Traditional UNIX exit code for usage */
 
+#define BENCH_MAX_PROCS 256
+#define BENCH_NUM_BUCKETS 24
+
+typedef struct _bench_params {
+    const char *filename;
+    int procs;
+    long iterations;
+    int shared_percent;
+    bool nonblocking;
+    ULONG granularity;
+    ULONG ranges;
+    ULONG hold_usecs;
+    bool handoff;
+} bench_params;
+
+typedef struct _bench_result {
+    unsigned long long acquisitions;
+    /* |LOCKFILE_FAIL_IMMEDIATELY| attempts which were not granted */
+    unsigned long long failed_attempts;
+    unsigned long long handoffs;
+    /* bucket |i| counts [2^(i-1), 2^i) microseconds */
+    unsigned long wait[BENCH_NUM_BUCKETS];
+    unsigned long handoff[BENCH_NUM_BUCKETS];
+} bench_result;
+
+/* Written at the start of a range by the holder of an exclusive lock */
+typedef struct _bench_release_record {
+    unsigned long long machine;
+    DWORD pid;
+    DWORD pad;
+    LONGLONG release_time; /* |QueryPerformanceCounter()| */
+} bench_release_record;
+
+static LONGLONG qpc_freq;
+
+static
+LONGLONG qpc_now(void)
+{
+    LARGE_INTEGER now;
+
+    (void)QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static
+unsigned long long qpc_usecs(LONGLONG ticks)
+{
+    return (ticks > 0)?
+        (((unsigned long long)ticks * 1000000ULL) /
+            (unsigned long long)qpc_freq):0ULL;
+}
+
+static
+void histogram_add(unsigned long *hist, unsigned long long usecs)
+{
+    int bucket = 0;
+
+    for (unsigned long long u = usecs ;
+        u && (bucket < (BENCH_NUM_BUCKETS-1)) ; u >>= 1)
+        bucket++;
+    hist[bucket]++;
+}
+
+static
+unsigned long long histogram_percentile(const unsigned long *hist,
+    unsigned long long count, int percent)
+{
+    unsigned long long sum = 0ULL;
+    unsigned long long threshold = (count * percent + 99) / 100;
+    int i;
+
+    for (i = 0 ; i < BENCH_NUM_BUCKETS ; i++) {
+        sum += hist[i];
+        if (sum >= threshold)
+            break;
+    }
+    if (i >= BENCH_NUM_BUCKETS)
+        i = BENCH_NUM_BUCKETS-1;
+    return 1ULL << i;
+}
+
+/* FNV-1a hash of the computer name, identifies the machine */
+static
+unsigned long long machine_id(void)
+{
+    char name[MAX_COMPUTERNAME_LENGTH+1];
+    DWORD len = sizeof(name);
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    if (!GetComputerNameA(name, &len))
+        return 0ULL;
+    for (DWORD i = 0 ; i < len ; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static
+int bench_usage(const char *progname)
+{
+    (void)fprintf(stderr,
+        "Usage:\n%s -bench [-p <procs>] [-n <iterations>] "
+        "[-m <shared%%>] [-f] [-g <granularity>] [-r <ranges>] "
+        "[-w <hold_usecs>] [-h] <filename>\n",
+        progname);
+    return EXIT_USAGE;
+}
+
+/*
+ * Parse the options of "-bench" and "-benchchild", |*argi| is the
+ * index of the first option, returns |false| on a usage error
+ */
+static
+bool bench_parse_args(int argc, char *av[], int argi, bench_params *bp)
+{
+    bp->procs = 4;
+    bp->iterations = 1000;
+    bp->shared_percent = 0;
+    bp->nonblocking = false;
+    bp->granularity = 4096;
+    bp->ranges = 1;
+    bp->hold_usecs = 0;
+    bp->handoff = false;
+
+    for ( ; argi < argc ; argi++) {
+        const char *opt = av[argi];
+
+        if (!strcmp(opt, "-f")) {
+            bp->nonblocking = true;
+        }
+        else if (!strcmp(opt, "-h")) {
+            bp->handoff = true;
+        }
+        else if ((opt[0] == '-') && (opt[1] != '\0') &&
+            (opt[2] == '\0') && ((argi+1) < argc)) {
+            long val = strtol(av[++argi], NULL, 10);
+
+            switch (opt[1]) {
+                case 'p': bp->procs = (int)val; break;
+                case 'n': bp->iterations = val; break;
+                case 'm': bp->shared_percent = (int)val; break;
+                case 'g': bp->granularity = (ULONG)val; break;
+                case 'r': bp->ranges = (ULONG)val; break;
+                case 'w': bp->hold_usecs = (ULONG)val; break;
+                default: return false;
+            }
+        }
+        else {
+            break;
+        }
+    }
+    if ((argi+1) != argc)
+        return false;
+    bp->filename = av[argi];
+
+    if ((bp->procs < 1) || (bp->procs > BENCH_MAX_PROCS) ||
+        (bp->iterations < 1) ||
+        (bp->shared_percent < 0) || (bp->shared_percent > 100) ||
+        (bp->granularity < 1) || (bp->ranges < 1))
+        return false;
+    if (bp->handoff && (bp->granularity < sizeof(bench_release_record)))
+        return false;
+    return true;
+}
+
+/* One benchmark process, writes its |bench_result| to |out| */
+static
+int bench_child(const char *progname, const bench_params *bp,
+    HANDLE start_event, HANDLE out)
+{
+    bench_result res;
+    bench_release_record rec;
+    const unsigned long long machine = machine_id();
+    const DWORD pid = GetCurrentProcessId();
+    unsigned long long seed = ((unsigned long long)pid << 32) ^ qpc_now();
+    OVERLAPPED ov;
+    DWORD flags, num;
+    ULONGLONG offset;
+    LONGLONG start, now;
+    bool shared;
+    HANDLE h;
+
+    (void)memset(&res, 0, sizeof(res));
+
+    h = CreateFileA(bp->filename,
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_WRITE_THROUGH,
+        NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        (void)fprintf(stderr, "%s: Cannot open file '%s', lasterr=%ld\n",
+            progname,
+            bp->filename,
+            (long)GetLastError());
+        return EXIT_FAILURE;
+    }
+
+    (void)WaitForSingleObject(start_event, INFINITE);
+
+    for (long i = 0 ; i < bp->iterations ; i++) {
+        /* xorshift64 */
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        offset = (ULONGLONG)(seed % bp->ranges) * bp->granularity;
+        shared = (int)((seed >> 32) % 100) < bp->shared_percent;
+        flags = shared?0:LOCKFILE_EXCLUSIVE_LOCK;
+        if (bp->nonblocking)
+            flags |= LOCKFILE_FAIL_IMMEDIATELY;
+
+        (void)memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+
+        start = qpc_now();
+        while (!LockFileEx(h, flags, 0, bp->granularity, 0, &ov)) {
+            if (bp->nonblocking &&
+                (GetLastError() == ERROR_LOCK_VIOLATION)) {
+                res.failed_attempts++;
+                continue;
+            }
+            (void)fprintf(stderr,
+                "%s: Locking failed, lasterr=%ld\n",
+                progname, (long)GetLastError());
+            (void)CloseHandle(h);
+            return EXIT_FAILURE;
+        }
+        now = qpc_now();
+        res.acquisitions++;
+        histogram_add(res.wait, qpc_usecs(now - start));
+
+        if (bp->handoff) {
+            (void)memset(&ov, 0, sizeof(ov));
+            ov.Offset = (DWORD)offset;
+            ov.OffsetHigh = (DWORD)(offset >> 32);
+            if (ReadFile(h, &rec, sizeof(rec), &num, &ov) &&
+                (num == sizeof(rec)) &&
+                (rec.machine == machine) && (rec.pid != pid) &&
+                (rec.release_time != 0)) {
+                res.handoffs++;
+                histogram_add(res.handoff,
+                    qpc_usecs(now - rec.release_time));
+            }
+        }
+
+        if (bp->hold_usecs) {
+            while (qpc_usecs(qpc_now() - now) < bp->hold_usecs)
+                YieldProcessor();
+        }
+
+        if (bp->handoff && !shared) {
+            rec.machine = machine;
+            rec.pid = pid;
+            rec.pad = 0;
+            rec.release_time = qpc_now();
+            (void)memset(&ov, 0, sizeof(ov));
+            ov.Offset = (DWORD)offset;
+            ov.OffsetHigh = (DWORD)(offset >> 32);
+            (void)WriteFile(h, &rec, sizeof(rec), &num, &ov);
+        }
+
+        (void)memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        (void)UnlockFileEx(h, 0, bp->granularity, 0, &ov);
+    }
+
+    (void)CloseHandle(h);
+
+    if (!WriteFile(out, &res, sizeof(res), &num, NULL) ||
+        (num != sizeof(res)))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+static
+void print_latency(const char *kind, const unsigned long *hist,
+    unsigned long long count)
+{
+    if (count == 0ULL)
+        return;
+    (void)printf("%s\tcount=%llu\tp50_usecs<%llu\tp90_usecs<%llu"
+        "\tp99_usecs<%llu\n",
+        kind, count,
+        histogram_percentile(hist, count, 50),
+        histogram_percentile(hist, count, 90),
+        histogram_percentile(hist, count, 99));
+}
+
+/*
+ * Start |bp->procs| children with "-benchchild", release them at the
+ * same time with an (inherited) event, and sum up their results, which
+ * they write to their stdout pipe
+ */
+static
+int bench_main(const char *progname, const bench_params *bp)
+{
+    SECURITY_ATTRIBUTES sa = {
+        .nLength = sizeof(SECURITY_ATTRIBUTES),
+        .lpSecurityDescriptor = NULL,
+        .bInheritHandle = TRUE
+    };
+    static PROCESS_INFORMATION pi[BENCH_MAX_PROCS];
+    static HANDLE pipes[BENCH_MAX_PROCS];
+    char exe[MAX_PATH];
+    char cmdline[MAX_PATH*2+512];
+    STARTUPINFOA si;
+    HANDLE start_event, wr;
+    bench_result sum, res;
+    LONGLONG start, end;
+    DWORD num, exitcode;
+    double secs;
+    int i, started = 0, failed = 0;
+
+    (void)memset(&sum, 0, sizeof(sum));
+
+    if (GetModuleFileNameA(NULL, exe, sizeof(exe)) == 0) {
+        (void)fprintf(stderr, "%s: GetModuleFileNameA() failed, lasterr=%ld\n",
+            progname, (long)GetLastError());
+        return EXIT_FAILURE;
+    }
+
+    start_event = CreateEventA(&sa, TRUE, FALSE, NULL);
+    if (start_event == NULL) {
+        (void)fprintf(stderr, "%s: CreateEventA() failed, lasterr=%ld\n",
+            progname, (long)GetLastError());
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0 ; i < bp->procs ; i++) {
+        if (!CreatePipe(&pipes[i], &wr, &sa, 0)) {
+            (void)fprintf(stderr, "%s: CreatePipe() failed, lasterr=%ld\n",
+                progname, (long)GetLastError());
+            break;
+        }
+        (void)SetHandleInformation(pipes[i], HANDLE_FLAG_INHERIT, 0);
+
+        (void)snprintf(cmdline, sizeof(cmdline),
+            "\"%s\" -benchchild %llu -n %ld -m %d -g %lu -r %lu -w %lu%s%s "
+            "\"%s\"",
+            exe,
+            (unsigned long long)(ULONG_PTR)start_event,
+            bp->iterations, bp->shared_percent,
+            (unsigned long)bp->granularity, (unsigned long)bp->ranges,
+            (unsigned long)bp->hold_usecs,
+            bp->nonblocking?" -f":"", bp->handoff?" -h":"",
+            bp->filename);
+
+        (void)memset(&si, 0, sizeof(si));
+        si.cb = sizeof(si);
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+        si.hStdOutput = wr;
+        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+        if (!CreateProcessA(exe, cmdline, NULL, NULL, TRUE, 0, NULL, NULL,
+            &si, &pi[i])) {
+            (void)fprintf(stderr, "%s: CreateProcessA() failed, lasterr=%ld\n",
+                progname, (long)GetLastError());
+            (void)CloseHandle(wr);
+            (void)CloseHandle(pipes[i]);
+            break;
+        }
+        (void)CloseHandle(wr);
+        started++;
+    }
+
+    start = qpc_now();
+    (void)SetEvent(start_event);
+
+    /* All children are done when the last one has exited */
+    for (i = 0 ; i < started ; i++)
+        (void)WaitForSingleObject(pi[i].hProcess, INFINITE);
+    end = qpc_now();
+
+    for (i = 0 ; i < started ; i++) {
+        if (GetExitCodeProcess(pi[i].hProcess, &exitcode) &&
+            (exitcode == EXIT_SUCCESS) &&
+            ReadFile(pipes[i], &res, sizeof(res), &num, NULL) &&
+            (num == sizeof(res))) {
+            sum.acquisitions += res.acquisitions;
+            sum.failed_attempts += res.failed_attempts;
+            sum.handoffs += res.handoffs;
+            for (int b = 0 ; b < BENCH_NUM_BUCKETS ; b++) {
+                sum.wait[b] += res.wait[b];
+                sum.handoff[b] += res.handoff[b];
+            }
+        }
+        else {
+            failed++;
+        }
+        (void)CloseHandle(pipes[i]);
+        (void)CloseHandle(pi[i].hThread);
+        (void)CloseHandle(pi[i].hProcess);
+    }
+    (void)CloseHandle(start_event);
+
+    secs = (double)(end - start) / (double)qpc_freq;
+    if (secs <= 0.0)
+        secs = 1e-6;
+
+    (void)printf("lockbench\tprocs=%d\titerations=%ld\tshared_percent=%d"
+        "\tmode=%s\tgranularity=%lu\tranges=%lu\thold_usecs=%lu\n",
+        started, bp->iterations, bp->shared_percent,
+        bp->nonblocking?"nonblocking":"blocking",
+        (unsigned long)bp->granularity, (unsigned long)bp->ranges,
+        (unsigned long)bp->hold_usecs);
+    (void)printf("result\tacquisitions=%llu\tseconds=%.3f"
+        "\tacquisitions_per_sec=%.1f\tfailed_attempts=%llu"
+        "\tfailed_procs=%d\n",
+        sum.acquisitions, secs, (double)sum.acquisitions / secs,
+        sum.failed_attempts, failed);
+    print_latency("wait", sum.wait, sum.acquisitions);
+    print_latency("handoff", sum.handoff, sum.handoffs);
+
+    return ((failed == 0) && (started == bp->procs))?
+        EXIT_SUCCESS:EXIT_FAILURE;
+}
+
 int main(int argc, char *av[])
 {
+    if ((argc >= 2) &&
+        (!strcmp(av[1], "-bench") || !strcmp(av[1], "-benchchild"))) {
+        bench_params bp;
+        LARGE_INTEGER freq;
+        const bool child = !strcmp(av[1], "-benchchild");
+        HANDLE start_event = NULL;
+        int argi = 2;
+
+        (void)QueryPerformanceFrequency(&freq);
+        qpc_freq = (freq.QuadPart > 0)?freq.QuadPart:1;
+
+        if (child) {
+            if (argc < 3)
+                return EXIT_USAGE;
+            start_event = (HANDLE)(ULONG_PTR)strtoull(av[2], NULL, 10);
+            argi = 3;
+        }
+        if (!bench_parse_args(argc, av, argi, &bp))
+            return bench_usage(av[0]);
+
+        if (child)
+            return bench_child(av[0], &bp, start_event,
+                GetStdHandle(STD_OUTPUT_HANDLE));
+        return bench_main(av[0], &bp);
+    }
+
     if (argc != 3) {
         (void)fprintf(stderr, "Usage:\n%s <filename> <tag>\n", av[0]);
+        (void)bench_usage(av[0]);
         return EXIT_USAGE;
     }
 
@@ -0,0 +1,957 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * nfsbench.c - repeatable throughput and metadata benchmarks for the
+ * NFS client, with CSV or JSON output
+ *
+ * Usage:
+ * $ nfsbench.exe [-o csv|json] [-s <filesize_mb>] [-n <iterations>]
+ *       [-e <entries>[,<entries>...]] [-t <test>[,<test>...]] <testdir>
+ *
+ * Tests (default: all):
+ * - seqwrite, seqread, randwrite, randread: 4KB/64KB/1MB blocks,
+ *   each through a buffered and an unbuffered
+ *   (|FILE_FLAG_NO_BUFFERING|) handle
+ * - openclose: |CreateFileA()|+|GetFileInformationByHandle()|+
+ *   |CloseHandle()| storm
+ * - stat: |GetFileAttributesExA()| storm
+ * - readdir: enumerate directories with 10000 and 100000 entries
+ * - createdelete: create+delete churn
+ * - lockpingpong: two processes take turns incrementing a counter in
+ *   a file under |LockFileEx()|
+ * - copyfile: |CopyFileExA()| (uses copy offload if available)
+ * - clonefile: |FSCTL_DUPLICATE_EXTENTS_TO_FILE|
+ *
+ * Each result has a "status" field, which is "ok" or the Win32 error
+ * code, so unsupported tests (e.g. clonefile) show up as such instead
+ * of being silently omitted.
+ *
+ * Example:
+ * $ nfsbench.exe -o csv 'L:\tmp\bench1' >results.csv
+ */
+
+#define WIN32_LEAN_AND_MEAN 1
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define EXIT_USAGE (2) /* Traditional UNIX exit code for usage */
+
+#ifdef DUPLICATE_EXTENTS_DATA_EX_SOURCE_ATOMIC
+/* See tests/winclonefile/winclonefile.c */
+#define WIN32_HEADERS_HAVE_DUPLICATE_EXTENTS_DATA 1
+#endif /* WIN32_HEADERS_HAVE_DUPLICATE_EXTENTS_DATA */
+
+#ifndef WIN32_HEADERS_HAVE_DUPLICATE_EXTENTS_DATA
+typedef struct _DUPLICATE_EXTENTS_DATA {
+    HANDLE FileHandle;
+    LARGE_INTEGER SourceFileOffset;
+    LARGE_INTEGER TargetFileOffset;
+    LARGE_INTEGER ByteCount;
+} DUPLICATE_EXTENTS_DATA, *PDUPLICATE_EXTENTS_DATA;
+#endif /* WIN32_HEADERS_HAVE_DUPLICATE_EXTENTS_DATA */
+
+#define LOCKPINGPONG_CHILD_ARG "--lockpingpong-child"
+
+typedef enum _output_format {
+    OUTPUT_CSV,
+    OUTPUT_JSON
+} output_format;
+
+typedef struct _bench_config {
+    const char *testdir;
+    output_format format;
+    ULONGLONG filesize;
+    ULONG iterations;
+    ULONG dir_entries[8];
+    ULONG num_dir_entries;
+    const char *tests;
+} bench_config;
+
+/* Per-operation latency samples of one benchmark run */
+typedef struct _bench_samples {
+    ULONGLONG *usecs;
+    ULONG count;
+    ULONG max_count;
+} bench_samples;
+
+typedef struct _bench_result {
+    const char *test;
+    const char *variant;
+    ULONG block_size;
+    ULONGLONG ops;
+    ULONGLONG bytes;
+    double seconds;
+    DWORD status;
+    /* filled in by |print_result()| */
+    ULONGLONG lat_avg;
+    ULONGLONG lat_p50;
+    ULONGLONG lat_p99;
+    ULONGLONG lat_max;
+} bench_result;
+
+static LONGLONG ticks_per_sec;
+static bool first_result = true;
+
+static
+LONGLONG now_ticks(void)
+{
+    LARGE_INTEGER now;
+
+    (void)QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static
+ULONGLONG ticks_to_usecs(LONGLONG ticks)
+{
+    return (ticks > 0)?
+        (((ULONGLONG)ticks * 1000000ULL) / (ULONGLONG)ticks_per_sec):0ULL;
+}
+
+static
+bool samples_init(bench_samples *s, ULONG max_count)
+{
+    s->count = 0;
+    s->max_count = max_count;
+    s->usecs = malloc(sizeof(ULONGLONG) * max_count);
+    return s->usecs != NULL;
+}
+
+static
+void samples_free(bench_samples *s)
+{
+    free(s->usecs);
+    s->usecs = NULL;
+}
+
+static
+void samples_add(bench_samples *s, LONGLONG start)
+{
+    if (s->count < s->max_count)
+        s->usecs[s->count++] = ticks_to_usecs(now_ticks() - start);
+}
+
+static
+int cmp_ulonglong(const void *a, const void *b)
+{
+    ULONGLONG x = *(const ULONGLONG *)a, y = *(const ULONGLONG *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* xorshift64, fixed seed so random I/O runs are repeatable */
+static
+ULONGLONG rand_next(ULONGLONG *state)
+{
+    ULONGLONG x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static
+void print_result(const bench_config *cfg, bench_result *r,
+    bench_samples *s)
+{
+    ULONGLONG sum = 0ULL;
+    double ops_per_sec, mb_per_sec;
+    ULONG i;
+
+    if (s && (s->count > 0)) {
+        qsort(s->usecs, s->count, sizeof(ULONGLONG), cmp_ulonglong);
+        for (i = 0 ; i < s->count ; i++)
+            sum += s->usecs[i];
+        r->lat_avg = sum / s->count;
+        r->lat_p50 = s->usecs[(s->count * 50) / 100];
+        r->lat_p99 = s->usecs[((ULONGLONG)s->count * 99) / 100];
+        r->lat_max = s->usecs[s->count - 1];
+    }
+
+    ops_per_sec = (r->seconds > 0.0)?((double)r->ops / r->seconds):0.0;
+    mb_per_sec = (r->seconds > 0.0)?
+        (((double)r->bytes / (1024.0*1024.0)) / r->seconds):0.0;
+
+    if (cfg->format == OUTPUT_CSV) {
+        if (first_result) {
+            (void)printf("test,variant,block_size,ops,bytes,seconds,"
+                "ops_per_sec,mb_per_sec,lat_avg_usecs,lat_p50_usecs,"
+                "lat_p99_usecs,lat_max_usecs,status\n");
+        }
+        (void)printf("%s,%s,%lu,%llu,%llu,%.6f,%.2f,%.2f,"
+            "%llu,%llu,%llu,%llu,",
+            r->test, r->variant, (unsigned long)r->block_size,
+            r->ops, r->bytes, r->seconds, ops_per_sec, mb_per_sec,
+            r->lat_avg, r->lat_p50, r->lat_p99, r->lat_max);
+        if (r->status == ERROR_SUCCESS)
+            (void)printf("ok\n");
+        else
+            (void)printf("%lu\n", (unsigned long)r->status);
+    }
+    else {
+        (void)printf("%s\n  {\"test\": \"%s\", \"variant\": \"%s\", "
+            "\"block_size\": %lu, \"ops\": %llu, \"bytes\": %llu, "
+            "\"seconds\": %.6f, \"ops_per_sec\": %.2f, "
+            "\"mb_per_sec\": %.2f, \"lat_avg_usecs\": %llu, "
+            "\"lat_p50_usecs\": %llu, \"lat_p99_usecs\": %llu, "
+            "\"lat_max_usecs\": %llu, ",
+            first_result?"[":",",
+            r->test, r->variant, (unsigned long)r->block_size,
+            r->ops, r->bytes, r->seconds, ops_per_sec, mb_per_sec,
+            r->lat_avg, r->lat_p50, r->lat_p99, r->lat_max);
+        if (r->status == ERROR_SUCCESS)
+            (void)printf("\"status\": \"ok\"}");
+        else
+            (void)printf("\"status\": %lu}", (unsigned long)r->status);
+    }
+    (void)fflush(stdout);
+    first_result = false;
+}
+
+static
+bool test_enabled(const bench_config *cfg, const char *name)
+{
+    const char *s = cfg->tests;
+    size_t len = strlen(name);
+
+    if (s == NULL)
+        return true;
+
+    while (*s) {
+        if ((strncmp(s, name, len) == 0) &&
+            ((s[len] == ',') || (s[len] == '\0')))
+            return true;
+        s = strchr(s, ',');
+        if (s == NULL)
+            break;
+        s++;
+    }
+    return false;
+}
+
+static
+void make_path(char *buf, size_t buf_len, const bench_config *cfg,
+    const char *name)
+{
+    (void)_snprintf_s(buf, buf_len, _TRUNCATE, "%s\\%s",
+        cfg->testdir, name);
+}
+
+/*
+ * Read/write benchmarks
+ */
+static
+void bench_rw(const bench_config *cfg, const char *test,
+    bool write, bool random, bool unbuffered, ULONG block_size)
+{
+    char path[MAX_PATH];
+    bench_result r = {
+        .test = test,
+        .variant = unbuffered?"unbuffered":"buffered",
+        .block_size = block_size
+    };
+    bench_samples s;
+    ULONGLONG nblocks = cfg->filesize / block_size;
+    ULONGLONG i, rstate = 0x2545f4914f6cdd1dULL;
+    LARGE_INTEGER off;
+    LONGLONG start, op_start;
+    HANDLE h;
+    DWORD done;
+    void *buf;
+
+    make_path(path, sizeof(path), cfg, "nfsbench_rw.dat");
+
+    if (!samples_init(&s, (ULONG)nblocks)) {
+        r.status = ERROR_NOT_ENOUGH_MEMORY;
+        print_result(cfg, &r, NULL);
+        return;
+    }
+    /* page aligned, as required for |FILE_FLAG_NO_BUFFERING| */
+    buf = VirtualAlloc(NULL, block_size, MEM_COMMIT|MEM_RESERVE,
+        PAGE_READWRITE);
+    if (buf == NULL) {
+        r.status = GetLastError();
+        goto out;
+    }
+    (void)memset(buf, 0xA5, block_size);
+
+    h = CreateFileA(path,
+        write?(GENERIC_READ|GENERIC_WRITE):GENERIC_READ,
+        FILE_SHARE_READ|FILE_SHARE_WRITE,
+        NULL,
+        write?OPEN_ALWAYS:OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL |
+            (unbuffered?FILE_FLAG_NO_BUFFERING:0) |
+            (random?FILE_FLAG_RANDOM_ACCESS:FILE_FLAG_SEQUENTIAL_SCAN),
+        NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        r.status = GetLastError();
+        goto out_free;
+    }
+
+    start = now_ticks();
+    for (i = 0 ; i < nblocks ; i++) {
+        off.QuadPart = (LONGLONG)((random?
+            (rand_next(&rstate) % nblocks):i) * block_size);
+        if (!SetFilePointerEx(h, off, NULL, FILE_BEGIN)) {
+            r.status = GetLastError();
+            break;
+        }
+        op_start = now_ticks();
+        if (write) {
+            if (!WriteFile(h, buf, block_size, &done, NULL)) {
+                r.status = GetLastError();
+                break;
+            }
+        }
+        else {
+            if (!ReadFile(h, buf, block_size, &done, NULL)) {
+                r.status = GetLastError();
+                break;
+            }
+        }
+        samples_add(&s, op_start);
+        r.ops++;
+        r.bytes += done;
+    }
+    /* written data must be on the server before we stop the clock */
+    if (write && (r.status == ERROR_SUCCESS) && !FlushFileBuffers(h))
+        r.status = GetLastError();
+    r.seconds = (double)(now_ticks() - start) / (double)ticks_per_sec;
+
+    (void)CloseHandle(h);
+out_free:
+    (void)VirtualFree(buf, 0, MEM_RELEASE);
+out:
+    print_result(cfg, &r, &s);
+    samples_free(&s);
+}
+
+static
+void bench_rw_all(const bench_config *cfg)
+{
+    static const ULONG block_sizes[] = { 4096, 65536, 1048576 };
+    static const struct {
+        const char *name;
+        bool write;
+        bool random;
+    } rw_tests[] = {
+        /* seqwrite first, it creates the file the others use */
+        { "seqwrite", true, false },
+        { "seqread", false, false },
+        { "randwrite", true, true },
+        { "randread", false, true }
+    };
+    char path[MAX_PATH];
+    int t, b, unbuffered;
+
+    for (t = 0 ; t < (int)ARRAYSIZE(rw_tests) ; t++) {
+        if (!test_enabled(cfg, rw_tests[t].name))
+            continue;
+        for (b = 0 ; b < (int)ARRAYSIZE(block_sizes) ; b++) {
+            for (unbuffered = 0 ; unbuffered <= 1 ; unbuffered++) {
+                bench_rw(cfg, rw_tests[t].name, rw_tests[t].write,
+                    rw_tests[t].random, unbuffered?true:false,
+                    block_sizes[b]);
+            }
+        }
+    }
+
+    make_path(path, sizeof(path), cfg, "nfsbench_rw.dat");
+    (void)DeleteFileA(path);
+}
+
+/*
+ * Metadata benchmarks
+ */
+#define META_NUM_FILES 64
+
+static
+DWORD meta_create_files(const bench_config *cfg, const char *prefix,
+    ULONG count)
+{
+    char path[MAX_PATH], name[64];
+    HANDLE h;
+    ULONG i;
+
+    for (i = 0 ; i < count ; i++) {
+        (void)_snprintf_s(name, sizeof(name), _TRUNCATE, "%s%lu",
+            prefix, (unsigned long)i);
+        make_path(path, sizeof(path), cfg, name);
+        h = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h == INVALID_HANDLE_VALUE)
+            return GetLastError();
+        (void)CloseHandle(h);
+    }
+    return ERROR_SUCCESS;
+}
+
+static
+void meta_delete_files(const bench_config *cfg, const char *prefix,
+    ULONG count)
+{
+    char path[MAX_PATH], name[64];
+    ULONG i;
+
+    for (i = 0 ; i < count ; i++) {
+        (void)_snprintf_s(name, sizeof(name), _TRUNCATE, "%s%lu",
+            prefix, (unsigned long)i);
+        make_path(path, sizeof(path), cfg, name);
+        (void)DeleteFileA(path);
+    }
+}
+
+static
+void bench_openclose_stat(const bench_config *cfg, bool stat)
+{
+    char path[MAX_PATH], name[64];
+    bench_result r = {
+        .test = stat?"stat":"openclose",
+        .variant = stat?"getfileattributesex":"createfile"
+    };
+    BY_HANDLE_FILE_INFORMATION bhfi;
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    bench_samples s;
+    LONGLONG start, op_start;
+    HANDLE h;
+    ULONG i;
+
+    if (!samples_init(&s, cfg->iterations)) {
+        r.status = ERROR_NOT_ENOUGH_MEMORY;
+        print_result(cfg, &r, NULL);
+        return;
+    }
+
+    r.status = meta_create_files(cfg, "nfsbench_meta", META_NUM_FILES);
+    if (r.status != ERROR_SUCCESS)
+        goto out;
+
+    start = now_ticks();
+    for (i = 0 ; i < cfg->iterations ; i++) {
+        (void)_snprintf_s(name, sizeof(name), _TRUNCATE, "nfsbench_meta%lu",
+            (unsigned long)(i % META_NUM_FILES));
+        make_path(path, sizeof(path), cfg, name);
+
+        op_start = now_ticks();
+        if (stat) {
+            if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fad)) {
+                r.status = GetLastError();
+                break;
+            }
+        }
+        else {
+            h = CreateFileA(path, GENERIC_READ,
+                FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL,
+                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (h == INVALID_HANDLE_VALUE) {
+                r.status = GetLastError();
+                break;
+            }
+            (void)GetFileInformationByHandle(h, &bhfi);
+            (void)CloseHandle(h);
+        }
+        samples_add(&s, op_start);
+        r.ops++;
+    }
+    r.seconds = (double)(now_ticks() - start) / (double)ticks_per_sec;
+
+out:
+    meta_delete_files(cfg, "nfsbench_meta", META_NUM_FILES);
+    print_result(cfg, &r, &s);
+    samples_free(&s);
+}
+
+static
+void bench_createdelete(const bench_config *cfg)
+{
+    char path[MAX_PATH];
+    bench_result r = {
+        .test = "createdelete",
+        .variant = "createfile+deletefile"
+    };
+    bench_samples s;
+    LONGLONG start, op_start;
+    HANDLE h;
+    ULONG i;
+
+    if (!samples_init(&s, cfg->iterations)) {
+        r.status = ERROR_NOT_ENOUGH_MEMORY;
+        print_result(cfg, &r, NULL);
+        return;
+    }
+
+    make_path(path, sizeof(path), cfg, "nfsbench_churn");
+    start = now_ticks();
+    for (i = 0 ; i < cfg->iterations ; i++) {
+        op_start = now_ticks();
+        h = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h == INVALID_HANDLE_VALUE) {
+            r.status = GetLastError();
+            break;
+        }
+        (void)CloseHandle(h);
+        if (!DeleteFileA(path)) {
+            r.status = GetLastError();
+            break;
+        }
+        samples_add(&s, op_start);
+        r.ops++;
+    }
+    r.seconds = (double)(now_ticks() - start) / (double)ticks_per_sec;
+
+    print_result(cfg, &r, &s);
+    samples_free(&s);
+}
+
+static
+void bench_readdir(const bench_config *cfg, ULONG entries)
+{
+    char dirpath[MAX_PATH], pattern[MAX_PATH], path[MAX_PATH+64];
+    char variant[64];
+    bench_result r = { .test = "readdir" };
+    WIN32_FIND_DATAA fd;
+    LONGLONG start;
+    HANDLE h, fh;
+    ULONG i;
+
+    (void)_snprintf_s(variant, sizeof(variant), _TRUNCATE, "%lu_entries",
+        (unsigned long)entries);
+    r.variant = variant;
+
+    (void)_snprintf_s(dirpath, sizeof(dirpath), _TRUNCATE,
+        "%s\\nfsbench_dir%lu", cfg->testdir, (unsigned long)entries);
+    if (!CreateDirectoryA(dirpath, NULL) &&
+        (GetLastError() != ERROR_ALREADY_EXISTS)) {
+        r.status = GetLastError();
+        print_result(cfg, &r, NULL);
+        return;
+    }
+
+    (void)fprintf(stderr, "# readdir: creating %lu entries...\n",
+        (unsigned long)entries);
+    for (i = 0 ; i < entries ; i++) {
+        (void)_snprintf_s(path, sizeof(path), _TRUNCATE, "%s\\f%lu",
+            dirpath, (unsigned long)i);
+        fh = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (fh == INVALID_HANDLE_VALUE) {
+            r.status = GetLastError();
+            goto out;
+        }
+        (void)CloseHandle(fh);
+    }
+
+    (void)_snprintf_s(pattern, sizeof(pattern), _TRUNCATE, "%s\\*",
+        dirpath);
+    start = now_ticks();
+    h = FindFirstFileExA(pattern, FindExInfoBasic, &fd,
+        FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (h == INVALID_HANDLE_VALUE) {
+        r.status = GetLastError();
+        goto out;
+    }
+    do {
+        r.ops++;
+    } while (FindNextFileA(h, &fd));
+    if (GetLastError() != ERROR_NO_MORE_FILES)
+        r.status = GetLastError();
+    (void)FindClose(h);
+    r.seconds = (double)(now_ticks() - start) / (double)ticks_per_sec;
+
+out:
+    for (i = 0 ; i < entries ; i++) {
+        (void)_snprintf_s(path, sizeof(path), _TRUNCATE, "%s\\f%lu",
+            dirpath, (unsigned long)i);
+        (void)DeleteFileA(path);
+    }
+    (void)RemoveDirectoryA(dirpath);
+    print_result(cfg, &r, NULL);
+}
+
+/*
+ * Lock ping-pong, the parent increments the counter when it is even,
+ * the child (the same executable started with
+ * |LOCKPINGPONG_CHILD_ARG|) when it is odd
+ */
+static
+DWORD lockpingpong_loop(HANDLE h, ULONG role, ULONG iterations,
+    bench_samples *s)
+{
+    OVERLAPPED ov = { 0 };
+    ULONGLONG counter;
+    LARGE_INTEGER zero = { .QuadPart = 0LL };
+    LONGLONG op_start = now_ticks();
+    DWORD done;
+
+    for (;;) {
+        if (!LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK, 0,
+            sizeof(counter), 0, &ov))
+            return GetLastError();
+
+        counter = 0ULL;
+        (void)SetFilePointerEx(h, zero, NULL, FILE_BEGIN);
+        if (!ReadFile(h, &counter, sizeof(counter), &done, NULL)) {
+            (void)UnlockFileEx(h, 0, sizeof(counter), 0, &ov);
+            return GetLastError();
+        }
+        if (counter >= (ULONGLONG)iterations * 2ULL) {
+            (void)UnlockFileEx(h, 0, sizeof(counter), 0, &ov);
+            return ERROR_SUCCESS;
+        }
+        if ((counter % 2ULL) == role) {
+            counter++;
+            (void)SetFilePointerEx(h, zero, NULL, FILE_BEGIN);
+            if (!WriteFile(h, &counter, sizeof(counter), &done, NULL)) {
+                (void)UnlockFileEx(h, 0, sizeof(counter), 0, &ov);
+                return GetLastError();
+            }
+            if (s) {
+                samples_add(s, op_start);
+                op_start = now_ticks();
+            }
+        }
+        (void)UnlockFileEx(h, 0, sizeof(counter), 0, &ov);
+    }
+}
+
+static
+HANDLE lockpingpong_open(const char *path, DWORD disposition)
+{
+    /* write through, each update must reach the server before unlocking */
+    return CreateFileA(path, GENERIC_READ|GENERIC_WRITE,
+        FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, disposition,
+        FILE_ATTRIBUTE_NORMAL|FILE_FLAG_WRITE_THROUGH, NULL);
+}
+
+static
+int lockpingpong_child(const char *path, const char *iterations)
+{
+    DWORD status;
+    HANDLE h;
+
+    h = lockpingpong_open(path, OPEN_EXISTING);
+    if (h == INVALID_HANDLE_VALUE)
+        return EXIT_FAILURE;
+    status = lockpingpong_loop(h, 1, strtoul(iterations, NULL, 0), NULL);
+    (void)CloseHandle(h);
+    return (status == ERROR_SUCCESS)?EXIT_SUCCESS:EXIT_FAILURE;
+}
+
+static
+void bench_lockpingpong(const bench_config *cfg)
+{
+    char path[MAX_PATH], exe[MAX_PATH], cmdline[MAX_PATH*2+64];
+    bench_result r = {
+        .test = "lockpingpong",
+        .variant = "2_processes"
+    };
+    STARTUPINFOA si = { .cb = sizeof(si) };
+    PROCESS_INFORMATION pi;
+    ULONGLONG counter = 0ULL;
+    bench_samples s;
+    LONGLONG start;
+    DWORD done, child_exit;
+    HANDLE h;
+
+    if (!samples_init(&s, cfg->iterations)) {
+        r.status = ERROR_NOT_ENOUGH_MEMORY;
+        print_result(cfg, &r, NULL);
+        return;
+    }
+
+    make_path(path, sizeof(path), cfg, "nfsbench_lock.dat");
+    h = lockpingpong_open(path, CREATE_ALWAYS);
+    if (h == INVALID_HANDLE_VALUE) {
+        r.status = GetLastError();
+        goto out;
+    }
+    (void)WriteFile(h, &counter, sizeof(counter), &done, NULL);
+
+    (void)GetModuleFileNameA(NULL, exe, sizeof(exe));
+    (void)_snprintf_s(cmdline, sizeof(cmdline), _TRUNCATE,
+        "\"%s\" " LOCKPINGPONG_CHILD_ARG " \"%s\" %lu",
+        exe, path, (unsigned long)cfg->iterations);
+    if (!CreateProcessA(exe, cmdline, NULL, NULL, FALSE, 0, NULL, NULL,
+        &si, &pi)) {
+        r.status = GetLastError();
+        (void)CloseHandle(h);
+        goto out_delete;
+    }
+
+    start = now_ticks();
+    r.status = lockpingpong_loop(h, 0, cfg->iterations, &s);
+    (void)WaitForSingleObject(pi.hProcess, INFINITE);
+    r.seconds = (double)(now_ticks() - start) / (double)ticks_per_sec;
+    if ((r.status == ERROR_SUCCESS) &&
+        GetExitCodeProcess(pi.hProcess, &child_exit) &&
+        (child_exit != EXIT_SUCCESS))
+        r.status = ERROR_LOCK_VIOLATION;
+    r.ops = s.count;
+    (void)CloseHandle(pi.hThread);
+    (void)CloseHandle(pi.hProcess);
+    (void)CloseHandle(h);
+
+out_delete:
+    (void)DeleteFileA(path);
+out:
+    print_result(cfg, &r, &s);
+    samples_free(&s);
+}
+
+/*
+ * Copy benchmarks
+ */
+static
+DWORD copy_create_source(const bench_config *cfg, const char *path)
+{
+    const ULONG block_size = 1048576;
+    ULONGLONG written = 0ULL;
+    DWORD status = ERROR_SUCCESS, done;
+    HANDLE h;
+    void *buf;
+
+    buf = malloc(block_size);
+    if (buf == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    (void)memset(buf, 0x5A, block_size);
+
+    h = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        goto out;
+    }
+    while (written < cfg->filesize) {
+        if (!WriteFile(h, buf, block_size, &done, NULL)) {
+            status = GetLastError();
+            break;
+        }
+        written += done;
+    }
+    (void)CloseHandle(h);
+out:
+    free(buf);
+    return status;
+}
+
+static
+DWORD clone_file(const char *src, const char *dst, ULONGLONG size)
+{
+    DUPLICATE_EXTENTS_DATA ded = { 0 };
+    FILE_END_OF_FILE_INFO eofi = { .EndOfFile.QuadPart = (LONGLONG)size };
+    DWORD status = ERROR_SUCCESS, done;
+    HANDLE hs, hd;
+
+    hs = CreateFileA(src, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hs == INVALID_HANDLE_VALUE)
+        return GetLastError();
+    hd = CreateFileA(dst, GENERIC_READ|GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hd == INVALID_HANDLE_VALUE) {
+        status = GetLastError();
+        goto out_src;
+    }
+
+    if (!SetFileInformationByHandle(hd, FileEndOfFileInfo,
+        &eofi, sizeof(eofi))) {
+        status = GetLastError();
+        goto out_dst;
+    }
+
+    ded.FileHandle = hs;
+    ded.SourceFileOffset.QuadPart = 0LL;
+    ded.TargetFileOffset.QuadPart = 0LL;
+    ded.ByteCount.QuadPart = (LONGLONG)size;
+    if (!DeviceIoControl(hd, FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+        &ded, sizeof(ded), NULL, 0, &done, NULL))
+        status = GetLastError();
+
+out_dst:
+    (void)CloseHandle(hd);
+out_src:
+    (void)CloseHandle(hs);
+    return status;
+}
+
+static
+void bench_copy(const bench_config *cfg, bool clone)
+{
+    char src[MAX_PATH], dst[MAX_PATH];
+    bench_result r = {
+        .test = clone?"clonefile":"copyfile",
+        .variant = clone?"fsctl_duplicate_extents":"copyfileex"
+    };
+    LONGLONG start;
+
+    make_path(src, sizeof(src), cfg, "nfsbench_copysrc.dat");
+    make_path(dst, sizeof(dst), cfg, "nfsbench_copydst.dat");
+
+    r.status = copy_create_source(cfg, src);
+    if (r.status != ERROR_SUCCESS)
+        goto out;
+
+    start = now_ticks();
+    if (clone) {
+        r.status = clone_file(src, dst, cfg->filesize);
+    }
+    else {
+        if (!CopyFileExA(src, dst, NULL, NULL, NULL, 0))
+            r.status = GetLastError();
+    }
+    r.seconds = (double)(now_ticks() - start) / (double)ticks_per_sec;
+    if (r.status == ERROR_SUCCESS) {
+        r.ops = 1;
+        r.bytes = cfg->filesize;
+    }
+
+out:
+    (void)DeleteFileA(dst);
+    (void)DeleteFileA(src);
+    print_result(cfg, &r, NULL);
+}
+
+static
+void usage(const char *progname)
+{
+    (void)fprintf(stderr,
+        "Usage: %s [-o csv|json] [-s <filesize_mb>] [-n <iterations>] "
+        "[-e <entries>[,<entries>...]] [-t <test>[,<test>...]] "
+        "<testdir>\n"
+        "\ttests: seqwrite,seqread,randwrite,randread,openclose,stat,"
+        "readdir,createdelete,lockpingpong,copyfile,clonefile\n",
+        progname);
+}
+
+int main(int ac, char *av[])
+{
+    bench_config cfg = {
+        .format = OUTPUT_CSV,
+        .filesize = 256ULL*1024ULL*1024ULL,
+        .iterations = 10000,
+        .dir_entries = { 10000, 100000 },
+        .num_dir_entries = 2
+    };
+    LARGE_INTEGER freq;
+    char *s, *end;
+    ULONG i;
+    int ai;
+
+    if ((ac == 4) && (strcmp(av[1], LOCKPINGPONG_CHILD_ARG) == 0)) {
+        (void)QueryPerformanceFrequency(&freq);
+        ticks_per_sec = freq.QuadPart;
+        return lockpingpong_child(av[2], av[3]);
+    }
+
+    for (ai = 1 ; ai < ac ; ai++) {
+        if ((av[ai][0] != '-') || ((ai + 1) >= ac))
+            break;
+        switch (av[ai][1]) {
+            case 'o':
+                if (strcmp(av[ai+1], "csv") == 0)
+                    cfg.format = OUTPUT_CSV;
+                else if (strcmp(av[ai+1], "json") == 0)
+                    cfg.format = OUTPUT_JSON;
+                else {
+                    usage(av[0]);
+                    return EXIT_USAGE;
+                }
+                break;
+            case 's':
+                cfg.filesize = strtoull(av[ai+1], NULL, 0) *
+                    1024ULL * 1024ULL;
+                break;
+            case 'n':
+                cfg.iterations = strtoul(av[ai+1], NULL, 0);
+                break;
+            case 'e':
+                cfg.num_dir_entries = 0;
+                for (s = av[ai+1] ;
+                    *s && (cfg.num_dir_entries < ARRAYSIZE(cfg.dir_entries)) ;
+                    s = end) {
+                    cfg.dir_entries[cfg.num_dir_entries++] =
+                        strtoul(s, &end, 0);
+                    if (*end == ',')
+                        end++;
+                    else if (*end != '\0')
+                        break;
+                }
+                break;
+            case 't':
+                cfg.tests = av[ai+1];
+                break;
+            default:
+                usage(av[0]);
+                return EXIT_USAGE;
+        }
+        ai++;
+    }
+
+    if ((ai + 1) != ac) {
+        usage(av[0]);
+        return EXIT_USAGE;
+    }
+    cfg.testdir = av[ai];
+
+    if ((cfg.filesize < 1048576ULL) || (cfg.iterations == 0)) {
+        usage(av[0]);
+        return EXIT_USAGE;
+    }
+
+    (void)QueryPerformanceFrequency(&freq);
+    ticks_per_sec = freq.QuadPart;
+
+    bench_rw_all(&cfg);
+    if (test_enabled(&cfg, "openclose"))
+        bench_openclose_stat(&cfg, false);
+    if (test_enabled(&cfg, "stat"))
+        bench_openclose_stat(&cfg, true);
+    if (test_enabled(&cfg, "readdir")) {
+        for (i = 0 ; i < cfg.num_dir_entries ; i++)
+            bench_readdir(&cfg, cfg.dir_entries[i]);
+    }
+    if (test_enabled(&cfg, "createdelete"))
+        bench_createdelete(&cfg);
+    if (test_enabled(&cfg, "lockpingpong"))
+        bench_lockpingpong(&cfg);
+    if (test_enabled(&cfg, "copyfile"))
+        bench_copy(&cfg, false);
+    if (test_enabled(&cfg, "clonefile"))
+        bench_copy(&cfg, true);
+
+    if (cfg.format == OUTPUT_JSON)
+        (void)printf("%s\n", first_result?"[]":"\n]");
+
+    return EXIT_SUCCESS;
+}
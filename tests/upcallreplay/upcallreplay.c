@@ -0,0 +1,843 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * upcallreplay.c - replay an upcall trace recorded with
+ * "nfsd --upcalltrace <file>" against a directory on a NFS mount
+ *
+ * Usage:
+ * $ upcallreplay.exe [-t <threads>] [-r <speed>] [-n <maxrecords>]
+ *       <tracefile> <targetdir>
+ *
+ * The trace only has path hashes, so every file of the trace becomes
+ * "<targetdir>\<hash>". Files which existed when the trace was
+ * recorded (i.e. their first open did not create them) are created
+ * before the replay starts, large enough for all READs in the trace.
+ *
+ * Each upcall is mapped back to the Win32 call which produced it:
+ * OPEN -> |CreateFileA()|, CLOSE -> |CloseHandle()|, READ/WRITE ->
+ * |ReadFile()|/|WriteFile()|, LOCK/UNLOCK -> |LockFileEx()|/
+ * |UnlockFileEx()|, FILE_QUERY/DIR_QUERY/FILE_SET ->
+ * |GetFileInformationByHandleEx()|/|SetFileInformationByHandle()|,
+ * VOLUME_QUERY -> |GetVolumeInformationByHandleW()|/
+ * |GetDiskFreeSpaceExA()|, ACL_QUERY -> |GetSecurityInfo()|.
+ * Other upcalls (EAs, symlinks, ACL_SET, FSCTLs, rename/link and
+ * upcalls created by the kernel cache coherency code) are counted as
+ * "skipped".
+ *
+ * All operations on one file run in trace order on the same thread,
+ * the files are distributed over <threads> threads (default 8).
+ * "-r 0" (default) replays as fast as possible, "-r 1" keeps the
+ * original inter-arrival times, "-r 2" runs at twice the speed etc.
+ *
+ * At the end a table compares the replay latency of each upcall type
+ * with the latency in the trace.
+ *
+ * Example:
+ * $ upcallreplay.exe -t 16 -r 1 nightlybuild.upct 'L:\tmp\replay1'
+ */
+
+#define WIN32_LEAN_AND_MEAN 1
+
+#include <windows.h>
+#include <winioctl.h>
+#include <aclapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "from_kernel.h"
+#include "nfs41_driver.h"
+#include "nfs41_upcalltrace.h"
+
+#define EXIT_USAGE (2) /* Traditional UNIX exit code for usage */
+
+#define MAX_THREADS 256
+#define MAX_IO_SIZE (16*1024*1024)
+#define NO_INDEX ((ULONG)~0UL)
+
+static const char *upcall_op_names[NFS41_SYSOP_INVALID_OPCODE1] = {
+    "INVALID_OPCODE0", "MOUNT", "UNMOUNT", "OPEN", "CLOSE", "READ",
+    "WRITE", "LOCK", "UNLOCK", "DIR_QUERY", "FILE_QUERY",
+    "FILE_QUERY_TIME_BASED_COHERENCY", "FILE_QUERY_COHERENCY_BATCH",
+    "FILE_SET", "EA_GET", "EA_SET", "SYMLINK_GET", "SYMLINK_SET",
+    "VOLUME_QUERY", "ACL_QUERY", "ACL_SET",
+    "FSCTL_QUERYALLOCATEDRANGES", "FSCTL_SET_ZERO_DATA",
+    "FSCTL_DUPLICATE_DATA", "FSCTL_OFFLOAD_DATACOPY",
+    "SET_DAEMON_DEBUGLEVEL", "SHUTDOWN", "GET_DAEMON_STATS",
+    "GET_FLIGHT_RECORDER", "GET_MOUNT_STATS", "DIR_NOTIFY",
+    "QUERY_OPEN", "FSCTL_CACHE_CONTROL", "GET_TOP_STATS", "FLUSH"
+};
+
+/* One file of the trace, identified by its path hash */
+typedef struct _replay_file {
+    ULONGLONG path_hash;
+    ULONGLONG read_extent; /* end of the last byte read */
+    ULONG first_open;
+    bool is_dir;
+    bool precreate;
+} replay_file;
+
+/* One OPEN of the trace, and the handle of the replay */
+typedef struct _replay_open {
+    ULONG file_index;
+    HANDLE handle;
+} replay_open;
+
+/* One request record scheduled for replay */
+typedef struct _replay_op {
+    const NFS41_UPCALLTRACE_RECORD *rec;
+    ULONG open_index;
+    LONGLONG orig_latency; /* ticks of the trace, -1 if unknown */
+} replay_op;
+
+typedef struct _replay_opstats {
+    ULONGLONG count;
+    ULONGLONG errors;
+    ULONGLONG skipped;
+    LONGLONG replay_ticks;
+    LONGLONG orig_ticks;
+    ULONGLONG orig_count;
+} replay_opstats;
+
+typedef struct _replay_thread {
+    HANDLE thread;
+    ULONG *ops; /* indexes into |ops[]| */
+    ULONG num_ops;
+    ULONG max_ops;
+    void *buf;
+    ULONG buf_size;
+    replay_opstats stats[NFS41_SYSOP_INVALID_OPCODE1];
+} replay_thread;
+
+/* u64 -> u32 hash map, entries are never removed */
+typedef struct _u64map {
+    ULONGLONG *keys;
+    ULONG *values;
+    bool *used;
+    size_t size; /* power of two */
+} u64map;
+
+static struct {
+    const char *targetdir;
+    double speed;
+    ULONG num_threads;
+
+    NFS41_UPCALLTRACE_HEADER hdr;
+    NFS41_UPCALLTRACE_RECORD *recs;
+    size_t num_recs;
+
+    replay_file *files;
+    ULONG num_files;
+    replay_open *opens;
+    ULONG num_opens;
+    replay_op *ops;
+    ULONG num_ops;
+    ULONG max_io_size; /* largest READ/WRITE/DIR_QUERY buffer */
+
+    replay_thread threads[MAX_THREADS];
+    LONGLONG ticks_per_sec;
+    LONGLONG replay_start;
+} g;
+
+static
+bool u64map_init(u64map *m, size_t count)
+{
+    m->size = 64;
+    while (m->size < (count * 2))
+        m->size *= 2;
+    m->keys = calloc(m->size, sizeof(ULONGLONG));
+    m->values = calloc(m->size, sizeof(ULONG));
+    m->used = calloc(m->size, sizeof(bool));
+    return m->keys && m->values && m->used;
+}
+
+static
+size_t u64map_slot(const u64map *m, ULONGLONG key)
+{
+    size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 17) & (m->size - 1);
+
+    while (m->used[i] && (m->keys[i] != key))
+        i = (i + 1) & (m->size - 1);
+    return i;
+}
+
+static
+void u64map_put(u64map *m, ULONGLONG key, ULONG value)
+{
+    size_t i = u64map_slot(m, key);
+
+    m->used[i] = true;
+    m->keys[i] = key;
+    m->values[i] = value;
+}
+
+static
+ULONG u64map_get(const u64map *m, ULONGLONG key)
+{
+    size_t i = u64map_slot(m, key);
+
+    return m->used[i] ? m->values[i] : NO_INDEX;
+}
+
+static
+void u64map_free(u64map *m)
+{
+    free(m->keys);
+    free(m->values);
+    free(m->used);
+}
+
+static
+bool read_trace(const char *filename)
+{
+    FILE *fp;
+    long long size;
+    bool res = false;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        (void)fprintf(stderr, "Cannot open trace file '%s'\n", filename);
+        return false;
+    }
+    if (fread(&g.hdr, sizeof(g.hdr), 1, fp) != 1) {
+        (void)fprintf(stderr, "Cannot read trace header\n");
+        goto out;
+    }
+    if ((g.hdr.magic != NFS41_UPCALLTRACE_MAGIC) ||
+        (g.hdr.version != NFS41_UPCALLTRACE_VERSION) ||
+        (g.hdr.record_size != sizeof(NFS41_UPCALLTRACE_RECORD)) ||
+        (g.hdr.timestamp_frequency <= 0)) {
+        (void)fprintf(stderr, "'%s' is not a version %d upcall trace\n",
+            filename, NFS41_UPCALLTRACE_VERSION);
+        goto out;
+    }
+
+    (void)_fseeki64(fp, 0, SEEK_END);
+    size = _ftelli64(fp) - (long long)sizeof(g.hdr);
+    (void)_fseeki64(fp, sizeof(g.hdr), SEEK_SET);
+
+    /* a partial last record (daemon killed while writing) is ignored */
+    if (g.num_recs == 0 ||
+        g.num_recs > (size_t)size / sizeof(NFS41_UPCALLTRACE_RECORD))
+        g.num_recs = (size_t)size / sizeof(NFS41_UPCALLTRACE_RECORD);
+    g.recs = malloc(g.num_recs * sizeof(NFS41_UPCALLTRACE_RECORD) + 1);
+    if (g.recs == NULL) {
+        (void)fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+    g.num_recs = fread(g.recs, sizeof(NFS41_UPCALLTRACE_RECORD),
+        g.num_recs, fp);
+    res = true;
+out:
+    (void)fclose(fp);
+    return res;
+}
+
+static
+ULONG file_lookup(u64map *files_by_hash, ULONGLONG path_hash,
+    ULONG create_opts, ULONG open_index)
+{
+    ULONG fi = u64map_get(files_by_hash, path_hash);
+    replay_file *f;
+
+    if (fi != NO_INDEX)
+        return fi;
+
+    fi = g.num_files++;
+    f = &g.files[fi];
+    f->path_hash = path_hash;
+    f->is_dir = (create_opts & FILE_DIRECTORY_FILE) != 0;
+    f->first_open = open_index;
+    f->read_extent = 0;
+    f->precreate = true;
+    u64map_put(files_by_hash, path_hash, fi);
+    return fi;
+}
+
+/*
+ * Walk the trace once: bind each upcall to its OPEN via the
+ * |file_id| of the OPEN reply, find the files which have to exist
+ * before the replay and assign the requests to threads
+ */
+static
+bool prepare_trace(void)
+{
+    u64map files_by_hash, opens_by_xid, opens_by_fileid, ops_by_xid;
+    const NFS41_UPCALLTRACE_RECORD *rec;
+    replay_thread *t;
+    ULONG oi, fi, ti;
+    size_t i;
+    bool res = false;
+
+    g.files = calloc(g.num_recs + 1, sizeof(replay_file));
+    g.opens = calloc(g.num_recs + 1, sizeof(replay_open));
+    g.ops = calloc(g.num_recs + 1, sizeof(replay_op));
+    if ((g.files == NULL) || (g.opens == NULL) || (g.ops == NULL) ||
+        !u64map_init(&files_by_hash, g.num_recs) ||
+        !u64map_init(&opens_by_xid, g.num_recs) ||
+        !u64map_init(&opens_by_fileid, g.num_recs) ||
+        !u64map_init(&ops_by_xid, g.num_recs)) {
+        (void)fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    for (i = 0; i < g.num_recs; i++) {
+        rec = &g.recs[i];
+        if (rec->opcode >= NFS41_SYSOP_INVALID_OPCODE1)
+            continue;
+
+        if (rec->flags & NFS41_UPCALLTRACE_FLAG_REPLY) {
+            ULONG opi = u64map_get(&ops_by_xid, rec->xid);
+            if ((opi != NO_INDEX) && (g.ops[opi].orig_latency < 0))
+                g.ops[opi].orig_latency =
+                    rec->timestamp - g.ops[opi].rec->timestamp;
+
+            if (rec->opcode != NFS41_SYSOP_OPEN)
+                continue;
+            oi = u64map_get(&opens_by_xid, rec->xid);
+            if (oi == NO_INDEX)
+                continue;
+            if (rec->status == 0) {
+                u64map_put(&opens_by_fileid, rec->file_id, oi);
+            }
+            else if (g.files[g.opens[oi].file_index].first_open == oi) {
+                /* the file did not exist, or could not be opened */
+                g.files[g.opens[oi].file_index].precreate = false;
+            }
+            continue;
+        }
+
+        g.ops[g.num_ops].rec = rec;
+        g.ops[g.num_ops].open_index = NO_INDEX;
+        g.ops[g.num_ops].orig_latency = -1;
+
+        if (rec->opcode == NFS41_SYSOP_OPEN) {
+            oi = g.num_opens++;
+            fi = file_lookup(&files_by_hash, rec->path_hash,
+                rec->args[3], oi);
+            /* the first open created the file */
+            if ((g.files[fi].first_open == oi) &&
+                ((rec->args[2] == FILE_CREATE) ||
+                (rec->args[2] == FILE_SUPERSEDE) ||
+                (rec->args[2] == FILE_OVERWRITE_IF)))
+                g.files[fi].precreate = false;
+            g.opens[oi].file_index = fi;
+            g.opens[oi].handle = INVALID_HANDLE_VALUE;
+            u64map_put(&opens_by_xid, rec->xid, oi);
+            g.ops[g.num_ops].open_index = oi;
+        }
+        else if (rec->file_id) {
+            oi = u64map_get(&opens_by_fileid, rec->file_id);
+            g.ops[g.num_ops].open_index = oi;
+            if ((oi != NO_INDEX) && (rec->opcode == NFS41_SYSOP_READ)) {
+                fi = g.opens[oi].file_index;
+                if (g.files[fi].read_extent < (rec->offset + rec->length))
+                    g.files[fi].read_extent = rec->offset + rec->length;
+            }
+            if (rec->opcode == NFS41_SYSOP_CLOSE)
+                u64map_put(&opens_by_fileid, rec->file_id, NO_INDEX);
+        }
+        if (((rec->opcode == NFS41_SYSOP_READ) ||
+            (rec->opcode == NFS41_SYSOP_WRITE) ||
+            (rec->opcode == NFS41_SYSOP_DIR_QUERY)) &&
+            (rec->length > g.max_io_size))
+            g.max_io_size = (ULONG)min(rec->length, MAX_IO_SIZE);
+        u64map_put(&ops_by_xid, rec->xid, g.num_ops);
+        g.num_ops++;
+    }
+
+    /* All operations of one file go to the same thread */
+    for (ti = 0; ti < g.num_threads; ti++) {
+        t = &g.threads[ti];
+        t->max_ops = g.num_ops / g.num_threads + 16;
+        t->ops = malloc(t->max_ops * sizeof(ULONG));
+        t->buf_size = max(g.max_io_size, 64 * 1024);
+        t->buf = calloc(1, t->buf_size);
+        if ((t->ops == NULL) || (t->buf == NULL)) {
+            (void)fprintf(stderr, "Out of memory\n");
+            goto out;
+        }
+    }
+    for (i = 0; i < g.num_ops; i++) {
+        oi = g.ops[i].open_index;
+        ti = (oi == NO_INDEX) ? 0 : (g.opens[oi].file_index % g.num_threads);
+        t = &g.threads[ti];
+        if (t->num_ops == t->max_ops) {
+            ULONG *nops = realloc(t->ops, t->max_ops * 2 * sizeof(ULONG));
+            if (nops == NULL) {
+                (void)fprintf(stderr, "Out of memory\n");
+                goto out;
+            }
+            t->ops = nops;
+            t->max_ops *= 2;
+        }
+        t->ops[t->num_ops++] = (ULONG)i;
+    }
+    res = true;
+out:
+    u64map_free(&files_by_hash);
+    u64map_free(&opens_by_xid);
+    u64map_free(&opens_by_fileid);
+    u64map_free(&ops_by_xid);
+    return res;
+}
+
+static
+void make_path(char *buf, size_t buf_len, ULONGLONG path_hash)
+{
+    (void)snprintf(buf, buf_len, "%s\\%016llx",
+        g.targetdir, (unsigned long long)path_hash);
+}
+
+static
+bool precreate_files(void)
+{
+    char path[MAX_PATH];
+    ULONG i, num_created = 0;
+    HANDLE h;
+    FILE_END_OF_FILE_INFO eof;
+
+    if (!CreateDirectoryA(g.targetdir, NULL) &&
+        (GetLastError() != ERROR_ALREADY_EXISTS)) {
+        (void)fprintf(stderr, "Cannot create '%s', lasterr=%d\n",
+            g.targetdir, (int)GetLastError());
+        return false;
+    }
+
+    for (i = 0; i < g.num_files; i++) {
+        if (!g.files[i].precreate)
+            continue;
+        make_path(path, sizeof(path), g.files[i].path_hash);
+
+        if (g.files[i].is_dir) {
+            if (!CreateDirectoryA(path, NULL) &&
+                (GetLastError() != ERROR_ALREADY_EXISTS))
+                goto fail;
+            num_created++;
+            continue;
+        }
+
+        h = CreateFileA(path, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h == INVALID_HANDLE_VALUE)
+            goto fail;
+        eof.EndOfFile.QuadPart = (LONGLONG)g.files[i].read_extent;
+        if (!SetFileInformationByHandle(h, FileEndOfFileInfo,
+            &eof, sizeof(eof))) {
+            (void)CloseHandle(h);
+            goto fail;
+        }
+        (void)CloseHandle(h);
+        num_created++;
+    }
+
+    (void)printf("# %lu files, %lu created before replay\n",
+        (unsigned long)g.num_files, (unsigned long)num_created);
+    return true;
+
+fail:
+    (void)fprintf(stderr, "Cannot create '%s', lasterr=%d\n",
+        path, (int)GetLastError());
+    return false;
+}
+
+static
+LONGLONG now_ticks(void)
+{
+    LARGE_INTEGER li;
+
+    (void)QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+/* Wait until the trace time of |rec| (scaled by |g.speed|) is reached */
+static
+void wait_for_record(const NFS41_UPCALLTRACE_RECORD *rec)
+{
+    LONGLONG due, now;
+
+    due = (LONGLONG)((double)rec->timestamp * g.ticks_per_sec /
+        g.hdr.timestamp_frequency / g.speed);
+    for (;;) {
+        now = now_ticks() - g.replay_start;
+        if (now >= due)
+            break;
+        Sleep((DWORD)((due - now) * 1000 / g.ticks_per_sec));
+    }
+}
+
+static
+DWORD open_disposition(ULONG disposition)
+{
+    switch (disposition) {
+    case FILE_SUPERSEDE:    return CREATE_ALWAYS;
+    case FILE_CREATE:       return CREATE_NEW;
+    case FILE_OPEN_IF:      return OPEN_ALWAYS;
+    case FILE_OVERWRITE:    return TRUNCATE_EXISTING;
+    case FILE_OVERWRITE_IF: return CREATE_ALWAYS;
+    case FILE_OPEN:
+    default:                return OPEN_EXISTING;
+    }
+}
+
+static
+bool replay_open_file(const NFS41_UPCALLTRACE_RECORD *rec,
+    replay_open *o)
+{
+    char path[MAX_PATH];
+    ULONG create_opts = rec->args[3];
+    DWORD flags = (DWORD)rec->length;
+
+    make_path(path, sizeof(path), g.files[o->file_index].path_hash);
+
+    if (create_opts & FILE_DIRECTORY_FILE) {
+        if ((rec->args[2] == FILE_CREATE) || (rec->args[2] == FILE_OPEN_IF))
+            (void)CreateDirectoryA(path, NULL);
+        flags |= FILE_FLAG_BACKUP_SEMANTICS;
+    }
+    if (create_opts & FILE_WRITE_THROUGH)
+        flags |= FILE_FLAG_WRITE_THROUGH;
+    if (create_opts & FILE_SEQUENTIAL_ONLY)
+        flags |= FILE_FLAG_SEQUENTIAL_SCAN;
+    if (create_opts & FILE_RANDOM_ACCESS)
+        flags |= FILE_FLAG_RANDOM_ACCESS;
+    if (create_opts & FILE_DELETE_ON_CLOSE)
+        flags |= FILE_FLAG_DELETE_ON_CLOSE;
+    if (create_opts & FILE_OPEN_REPARSE_POINT)
+        flags |= FILE_FLAG_OPEN_REPARSE_POINT;
+
+    o->handle = CreateFileA(path, rec->args[0], rec->args[1], NULL,
+        (create_opts & FILE_DIRECTORY_FILE) ?
+            OPEN_EXISTING : open_disposition(rec->args[2]),
+        flags, NULL);
+    return o->handle != INVALID_HANDLE_VALUE;
+}
+
+static
+FILE_INFO_BY_HANDLE_CLASS dir_query_class(ULONG query_class, bool restart)
+{
+    switch (query_class) {
+    case FileBothDirectoryInformation:
+    case FileIdBothDirectoryInformation:
+        return restart ?
+            FileIdBothDirectoryRestartInfo : FileIdBothDirectoryInfo;
+    case FileIdExtdDirectoryInformation:
+    case FileIdExtdBothDirectoryInformation:
+        return restart ?
+            FileIdExtdDirectoryRestartInfo : FileIdExtdDirectoryInfo;
+    default:
+        return restart ?
+            FileFullDirectoryRestartInfo : FileFullDirectoryInfo;
+    }
+}
+
+static
+bool replay_file_query(HANDLE h, replay_thread *t, ULONG query_class)
+{
+    BY_HANDLE_FILE_INFORMATION bhfi;
+
+    switch (query_class) {
+    case FileBasicInformation:
+        return GetFileInformationByHandleEx(h, FileBasicInfo,
+            t->buf, sizeof(FILE_BASIC_INFO));
+    case FileStandardInformation:
+        return GetFileInformationByHandleEx(h, FileStandardInfo,
+            t->buf, sizeof(FILE_STANDARD_INFO));
+    case FileAttributeTagInformation:
+        return GetFileInformationByHandleEx(h, FileAttributeTagInfo,
+            t->buf, sizeof(FILE_ATTRIBUTE_TAG_INFO));
+    case FileIdInformation:
+        return GetFileInformationByHandleEx(h, FileIdInfo,
+            t->buf, sizeof(FILE_ID_INFO));
+    case FileRemoteProtocolInformation:
+        return GetFileInformationByHandleEx(h, FileRemoteProtocolInfo,
+            t->buf, sizeof(FILE_REMOTE_PROTOCOL_INFO));
+    default:
+        /* FileInternalInformation, FileNetworkOpenInformation etc. */
+        return GetFileInformationByHandle(h, &bhfi);
+    }
+}
+
+/*
+ * Replay one request
+ * Returns 1 on success, 0 on error, -1 if it cannot be replayed
+ */
+static
+int replay_one(replay_thread *t, replay_op *op)
+{
+    const NFS41_UPCALLTRACE_RECORD *rec = op->rec;
+    replay_open *o = (op->open_index == NO_INDEX) ?
+        NULL : &g.opens[op->open_index];
+    HANDLE h = o ? o->handle : INVALID_HANDLE_VALUE;
+    OVERLAPPED ov = { 0 };
+    DWORD len, nbytes;
+    ULARGE_INTEGER free_bytes;
+
+    if ((o == NULL) ||
+        ((rec->opcode != NFS41_SYSOP_OPEN) && (h == INVALID_HANDLE_VALUE)))
+        return -1;
+
+    ov.Offset = (DWORD)rec->offset;
+    ov.OffsetHigh = (DWORD)(rec->offset >> 32);
+    len = (DWORD)min(rec->length, (ULONGLONG)t->buf_size);
+
+    switch (rec->opcode) {
+    case NFS41_SYSOP_OPEN:
+        return replay_open_file(rec, o);
+    case NFS41_SYSOP_CLOSE:
+        (void)CloseHandle(h);
+        o->handle = INVALID_HANDLE_VALUE;
+        return 1;
+    case NFS41_SYSOP_READ:
+        return ReadFile(h, t->buf, len, &nbytes, &ov);
+    case NFS41_SYSOP_WRITE:
+        return WriteFile(h, t->buf, len, &nbytes, &ov);
+    case NFS41_SYSOP_LOCK:
+        return LockFileEx(h,
+            (rec->args[0] ? LOCKFILE_EXCLUSIVE_LOCK : 0) |
+            (rec->args[1] ? 0 : LOCKFILE_FAIL_IMMEDIATELY),
+            0, (DWORD)rec->length, (DWORD)(rec->length >> 32), &ov);
+    case NFS41_SYSOP_UNLOCK:
+        return UnlockFileEx(h, 0,
+            (DWORD)rec->length, (DWORD)(rec->length >> 32), &ov);
+    case NFS41_SYSOP_FILE_QUERY:
+        return replay_file_query(h, t, rec->args[0]);
+    case NFS41_SYSOP_DIR_QUERY:
+        if (!GetFileInformationByHandleEx(h,
+            dir_query_class(rec->args[0], rec->args[1] || rec->args[2]),
+            t->buf, len))
+            /* end of the listing is not an error */
+            return GetLastError() == ERROR_NO_MORE_FILES;
+        return 1;
+    case NFS41_SYSOP_FILE_SET:
+        switch (rec->args[0]) {
+        case FileEndOfFileInformation: {
+            FILE_END_OF_FILE_INFO eof;
+            eof.EndOfFile.QuadPart = (LONGLONG)rec->offset;
+            return SetFileInformationByHandle(h, FileEndOfFileInfo,
+                &eof, sizeof(eof));
+        }
+        case FileAllocationInformation: {
+            FILE_ALLOCATION_INFO alloc;
+            alloc.AllocationSize.QuadPart = (LONGLONG)rec->offset;
+            return SetFileInformationByHandle(h, FileAllocationInfo,
+                &alloc, sizeof(alloc));
+        }
+        case FileDispositionInformation: {
+            FILE_DISPOSITION_INFO disp;
+            disp.DeleteFile = rec->args[1] ? TRUE : FALSE;
+            return SetFileInformationByHandle(h, FileDispositionInfo,
+                &disp, sizeof(disp));
+        }
+        case FileBasicInformation: {
+            /* all zero means "do not change" */
+            FILE_BASIC_INFO basic = { 0 };
+            return SetFileInformationByHandle(h, FileBasicInfo,
+                &basic, sizeof(basic));
+        }
+        default:
+            return -1;
+        }
+    case NFS41_SYSOP_VOLUME_QUERY:
+        if ((rec->args[0] == FileFsSizeInformation) ||
+            (rec->args[0] == FileFsFullSizeInformation))
+            return GetDiskFreeSpaceExA(g.targetdir,
+                &free_bytes, NULL, NULL);
+        return GetVolumeInformationByHandleW(h, NULL, 0, NULL, NULL,
+            NULL, NULL, 0);
+    case NFS41_SYSOP_ACL_QUERY: {
+        PSECURITY_DESCRIPTOR sd = NULL;
+        if (GetSecurityInfo(h, SE_FILE_OBJECT, rec->args[0],
+            NULL, NULL, NULL, NULL, &sd) != ERROR_SUCCESS)
+            return 0;
+        (void)LocalFree(sd);
+        return 1;
+    }
+    default:
+        return -1;
+    }
+}
+
+static
+DWORD WINAPI replay_thread_main(LPVOID arg)
+{
+    replay_thread *t = (replay_thread *)arg;
+    replay_opstats *s;
+    replay_op *op;
+    LONGLONG start;
+    ULONG i;
+    int res;
+
+    for (i = 0; i < t->num_ops; i++) {
+        op = &g.ops[t->ops[i]];
+        s = &t->stats[op->rec->opcode];
+
+        if (g.speed > 0)
+            wait_for_record(op->rec);
+
+        start = now_ticks();
+        res = replay_one(t, op);
+        if (res < 0) {
+            s->skipped++;
+            continue;
+        }
+        s->replay_ticks += now_ticks() - start;
+        s->count++;
+        if (res == 0)
+            s->errors++;
+        if (op->orig_latency >= 0) {
+            s->orig_ticks += op->orig_latency;
+            s->orig_count++;
+        }
+    }
+    return 0;
+}
+
+static
+void print_results(LONGLONG elapsed)
+{
+    replay_opstats total[NFS41_SYSOP_INVALID_OPCODE1] = { 0 };
+    replay_opstats *s;
+    ULONG i, op;
+
+    for (i = 0; i < g.num_threads; i++) {
+        for (op = 0; op < NFS41_SYSOP_INVALID_OPCODE1; op++) {
+            s = &g.threads[i].stats[op];
+            total[op].count += s->count;
+            total[op].errors += s->errors;
+            total[op].skipped += s->skipped;
+            total[op].replay_ticks += s->replay_ticks;
+            total[op].orig_ticks += s->orig_ticks;
+            total[op].orig_count += s->orig_count;
+        }
+    }
+
+    (void)printf("# replayed %lu requests with %lu threads in %.3f s\n",
+        (unsigned long)g.num_ops, (unsigned long)g.num_threads,
+        (double)elapsed / g.ticks_per_sec);
+    (void)printf("%-32s %10s %8s %8s %12s %12s\n",
+        "upcall", "count", "errors", "skipped",
+        "trace_us", "replay_us");
+    for (op = 0; op < NFS41_SYSOP_INVALID_OPCODE1; op++) {
+        s = &total[op];
+        if ((s->count == 0) && (s->skipped == 0))
+            continue;
+        (void)printf("%-32s %10llu %8llu %8llu %12.1f %12.1f\n",
+            upcall_op_names[op],
+            s->count, s->errors, s->skipped,
+            s->orig_count ?
+                (double)s->orig_ticks * 1e6 /
+                g.hdr.timestamp_frequency / s->orig_count : 0.0,
+            s->count ?
+                (double)s->replay_ticks * 1e6 /
+                g.ticks_per_sec / s->count : 0.0);
+    }
+}
+
+static
+void usage(const char *progname)
+{
+    (void)fprintf(stderr,
+        "Usage: %s [-t <threads>] [-r <speed>] [-n <maxrecords>] "
+        "<tracefile> <targetdir>\n"
+        "\t-t <threads>\tnumber of replay threads (default 8)\n"
+        "\t-r <speed>\t0 replays as fast as possible (default), 1 with "
+        "the original timing, 2 twice as fast...\n"
+        "\t-n <maxrecords>\tonly use the first <maxrecords> records\n",
+        progname);
+}
+
+int main(int ac, char *av[])
+{
+    LARGE_INTEGER freq;
+    LONGLONG elapsed;
+    ULONG i;
+    int c;
+
+    g.num_threads = 8;
+    g.speed = 0.0;
+
+    for (c = 1; c < ac; c++) {
+        if (av[c][0] != '-')
+            break;
+        if (((c + 1) < ac) && !strcmp(av[c], "-t")) {
+            g.num_threads = strtoul(av[++c], NULL, 0);
+        }
+        else if (((c + 1) < ac) && !strcmp(av[c], "-r")) {
+            g.speed = strtod(av[++c], NULL);
+        }
+        else if (((c + 1) < ac) && !strcmp(av[c], "-n")) {
+            g.num_recs = strtoul(av[++c], NULL, 0);
+        }
+        else {
+            usage(av[0]);
+            return EXIT_USAGE;
+        }
+    }
+    if (((ac - c) != 2) ||
+        (g.num_threads < 1) || (g.num_threads > MAX_THREADS) ||
+        (g.speed < 0.0)) {
+        usage(av[0]);
+        return EXIT_USAGE;
+    }
+    g.targetdir = av[c+1];
+
+    (void)QueryPerformanceFrequency(&freq);
+    g.ticks_per_sec = freq.QuadPart;
+
+    if (!read_trace(av[c]))
+        return EXIT_FAILURE;
+    (void)printf("# %lu trace records\n", (unsigned long)g.num_recs);
+    if (!prepare_trace())
+        return EXIT_FAILURE;
+    if (!precreate_files())
+        return EXIT_FAILURE;
+
+    g.replay_start = now_ticks();
+    for (i = 0; i < g.num_threads; i++) {
+        g.threads[i].thread = CreateThread(NULL, 0,
+            replay_thread_main, &g.threads[i], 0, NULL);
+        if (g.threads[i].thread == NULL) {
+            (void)fprintf(stderr, "CreateThread() failed, lasterr=%d\n",
+                (int)GetLastError());
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < g.num_threads; i++) {
+        (void)WaitForSingleObject(g.threads[i].thread, INFINITE);
+        (void)CloseHandle(g.threads[i].thread);
+    }
+    elapsed = now_ticks() - g.replay_start;
+
+    /* Close what the trace left open */
+    for (i = 0; i < g.num_opens; i++) {
+        if (g.opens[i].handle != INVALID_HANDLE_VALUE)
+            (void)CloseHandle(g.opens[i].handle);
+    }
+
+    print_results(elapsed);
+    return EXIT_SUCCESS;
+}
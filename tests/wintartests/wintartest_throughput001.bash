@@ -0,0 +1,264 @@
+#!/bin/bash
+
+#
+# MIT License
+# Copyright (c) 2025 Roland Mainz <roland.mainz@nrubsig.org>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# wintartest_throughput001.bash - throughput benchmark
+# which extracts and creates tar archives with
+# /cygdrive/c/Windows/system32/tar and Cygwin's GNU /usr/bin/tar,
+# on a NFS filesystem and on the local disk for comparison
+#
+# Usage:
+# $ cd /cygdrive/n/benchdir # directory on the NFS filesystem
+# $ bash wintartest_throughput001.bash [number of small files]
+#
+# Data sets (generated on the local disk):
+# - smallfiles: many files of 1-4KB in 100 directories
+# - deeptree: a tree 64 directories deep with a few files per level
+# - sparse: large sparse files with a few data blocks
+# - symlinks: many symlinks to a few files (GNU tar only, Windows
+#   tar needs SeCreateSymbolicLinkPrivilege for them)
+#
+# Output is one tab-separated "result" line per data set, filesystem,
+# tar implementation and operation ("extract" into the filesystem,
+# "create" an archive (on the local disk) from the extracted files),
+# with files/s, MB/s and, on NFS, the upcalls and RPCs per file from
+# $ nfsclientdctl stats #.
+#
+# Written by Roland Mainz <roland.mainz@nrubsig.org>
+#
+
+function nfsclientdctl_path
+{
+	if [[ "${NFSCLIENTDCTL-}" != '' ]] ; then
+		printf '%s\n' "$NFSCLIENTDCTL"
+	else
+		printf '/lib/msnfs41client/%s/nfsclientdctl.exe\n' \
+			"$(uname -m | sed 's/x86_64/x64/')"
+	fi
+	return 0
+}
+
+#
+# Print the total number of upcalls (without the statistics upcalls
+# themselves) and RPCs so far, or "0 0" if there are no statistics
+#
+function get_upcalls_rpcs
+{
+	typeset ctl="$(nfsclientdctl_path)"
+
+	if [[ ! -x "$ctl" ]] ; then
+		printf '0 0\n'
+		return 0
+	fi
+
+	"$ctl" stats 2>/dev/null | awk -F $'\t' '
+		$1 == "daemon" && $2 !~ /^GET_/ { split($3, a, "=") ; u += a[2] }
+		$1 == "rpc" { split($3, a, "=") ; r += a[2] }
+		END { printf("%d %d\n", u, r) }'
+	return 0
+}
+
+function make_dataset
+{
+	set -o errexit
+	set -o nounset
+
+	typeset name="$1"
+	typeset dir="$2"
+	typeset -i num_small_files=$3
+	typeset -i i j
+	typeset path
+
+	rm -Rf "$dir"
+	mkdir -p "$dir"
+
+	case "$name" in
+		'smallfiles')
+			for (( i=0 ; i < 100 ; i++ )) ; do
+				mkdir "$dir/d$i"
+			done
+			for (( i=0 ; i < num_small_files ; i++ )) ; do
+				head -c $(( 1024 + (i % 4) * 1024 )) /dev/urandom >"$dir/d$((i % 100))/f$i"
+			done
+			;;
+		'deeptree')
+			path="$dir"
+			for (( i=0 ; i < 64 ; i++ )) ; do
+				path+="/l$i"
+				mkdir "$path"
+				for (( j=0 ; j < 4 ; j++ )) ; do
+					seq $(( (i+1)*(j+1) )) >"$path/f$j"
+				done
+			done
+			;;
+		'sparse')
+			for (( i=0 ; i < 4 ; i++ )) ; do
+				# 1GB each, with 64KB of data every 128MB
+				truncate -s 1G "$dir/sparse$i"
+				for (( j=0 ; j < 8 ; j++ )) ; do
+					dd if=/dev/urandom of="$dir/sparse$i" bs=64K count=1 \
+						seek=$(( j * 2048 )) conv=notrunc status=none
+				done
+			done
+			;;
+		'symlinks')
+			for (( i=0 ; i < 10 ; i++ )) ; do
+				seq $(( i * 100 )) >"$dir/target$i"
+			done
+			for (( i=0 ; i < 1000 ; i++ )) ; do
+				ln -s "target$((i % 10))" "$dir/link$i"
+			done
+			;;
+	esac
+	return 0
+}
+
+#
+# Run command "$@" in the current directory and print one result line
+# for |files| files and |bytes| bytes
+#
+function measure
+{
+	typeset label="$1"
+	typeset -i files=$2
+	typeset -i bytes=$3
+	shift 3
+	typeset start end
+	typeset -i res upcalls_start rpcs_start upcalls_end rpcs_end
+
+	read upcalls_start rpcs_start < <(get_upcalls_rpcs)
+	start="$EPOCHREALTIME"
+	"$@" >/dev/null 2>&1
+	res=$?
+	end="$EPOCHREALTIME"
+	read upcalls_end rpcs_end < <(get_upcalls_rpcs)
+
+	awk -v label="$label" -v res="$res" -v files="$files" -v bytes="$bytes" \
+		-v start="$start" -v end="$end" \
+		-v upcalls=$(( upcalls_end - upcalls_start )) \
+		-v rpcs=$(( rpcs_end - rpcs_start )) '
+		BEGIN {
+			secs = end - start
+			if (secs <= 0)
+				secs = 0.000001
+			printf("result\t%s\tstatus=%d\tfiles=%d\tbytes=%d" \
+				"\tseconds=%.3f\tfiles_per_sec=%.1f\tmb_per_sec=%.2f" \
+				"\tupcalls_per_file=%.2f\trpcs_per_file=%.2f\n",
+				label, res, files, bytes, secs, files / secs,
+				bytes / secs / (1024 * 1024),
+				upcalls / files, rpcs / files)
+		}'
+	return $res
+}
+
+function test_wintar_throughput
+{
+	set -o nounset
+
+	typeset -i num_small_files=$1
+	typeset nfsdir="$PWD"
+	typeset localdir="/tmp/wintartest_throughput.$$"
+	typeset dataset fs fsdir tarname
+	typeset -i files bytes
+	typeset -a tars
+	typeset -i errc=0
+
+	mkdir -p "$localdir"
+
+	for dataset in 'smallfiles' 'deeptree' 'sparse' 'symlinks' ; do
+		printf '#### Generating data set %q\n' "$dataset"
+		make_dataset "$dataset" "$localdir/src/$dataset" "$num_small_files" || return 1
+		(cd "$localdir/src" && /usr/bin/tar --sparse -cf "$localdir/$dataset.tar" "$dataset") || return 1
+
+		# the directories are counted as files too
+		files=$(find "$localdir/src/$dataset" | wc -l)
+		bytes=$(du -s -b --apparent-size "$localdir/src/$dataset" | awk '{ print $1 }')
+
+		tars=( 'gnutar' )
+		[[ "$dataset" != 'symlinks' ]] && tars+=( 'wintar' )
+
+		for fs in 'nfs' 'local' ; do
+			if [[ "$fs" == 'nfs' ]] ; then
+				fsdir="$nfsdir/wintartest_throughput_tmp"
+			else
+				fsdir="$localdir/dst"
+			fi
+
+			for tarname in "${tars[@]}" ; do
+				rm -Rf "$fsdir"
+				mkdir -p "$fsdir"
+				cd "$fsdir"
+
+				if [[ "$tarname" == 'gnutar' ]] ; then
+					measure "$dataset"$'\t'"$fs"$'\t'"$tarname"$'\t''extract' \
+						$files $bytes \
+						/usr/bin/tar -xf "$localdir/$dataset.tar" || (( errc++ ))
+					measure "$dataset"$'\t'"$fs"$'\t'"$tarname"$'\t''create' \
+						$files $bytes \
+						/usr/bin/tar --sparse -cf "$localdir/out.tar" "$dataset" || (( errc++ ))
+				else
+					measure "$dataset"$'\t'"$fs"$'\t'"$tarname"$'\t''extract' \
+						$files $bytes \
+						/cygdrive/c/Windows/system32/tar -xf "$(cygpath -w "$localdir/$dataset.tar")" || (( errc++ ))
+					measure "$dataset"$'\t'"$fs"$'\t'"$tarname"$'\t''create' \
+						$files $bytes \
+						/cygdrive/c/Windows/system32/tar -cf "$(cygpath -w "$localdir/out.tar")" "$dataset" || (( errc++ ))
+				fi
+
+				cd "$nfsdir"
+				rm -Rf "$fsdir" "$localdir/out.tar"
+			done
+		done
+	done
+
+	rm -Rf "$localdir"
+
+	if (( errc > 0 )) ; then
+		printf '##### FAILED (%d errors)\n' $errc
+		return 1
+	fi
+	printf '##### SUCCESS\n'
+	return 0
+}
+
+
+#
+# main
+#
+
+export PATH='/bin:/usr/bin'
+
+if [[ ! -x '/cygdrive/c/Windows/system32/tar' ]] ; then
+	printf $"%s: %s not found.\n" \
+		"$0" '/cygdrive/c/Windows/system32/tar' 1>&2
+	exit 1
+fi
+
+# Set umask=0000 to avoid permission trouble on SMB filesystems
+umask 0000
+
+test_wintar_throughput "${1:-10000}"
+exit $?
+# EOF.